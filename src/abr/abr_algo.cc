@@ -1,8 +1,66 @@
 #include "abr_algo.hh"
+#include "ws_client.hh"
 #include <cmath>
+#include <limits>
 
 using namespace std;
 
+thread_local ABRAlgo::ReadyCallback ABRAlgo::ready_callback_;
+
+void ABRAlgo::notify_ready() const
+{
+  if (ready_callback_) {
+    ready_callback_(client_.connection_id());
+  }
+}
+
+optional<ThroughputPrior::Sample> ABRAlgo::throughput_prior() const
+{
+  if (not use_throughput_prior_) {
+    return nullopt;
+  }
+
+  return ThroughputPrior::lookup(client_.address());
+}
+
+const vector<size_t> & ABRAlgo::update_candidate_vformats(const uint64_t ts)
+{
+  const auto & channel = client_.channel();
+  const auto & screen_vformats = channel->vformats_for_screen(
+    client_.screen_width(), client_.screen_height());
+
+  if (not prune_dominated_) {
+    candidate_vformats_ = screen_vformats;
+    return candidate_vformats_;
+  }
+
+  /* the table is in ascending order of size, so a format is dominated
+   * unless its SSIM is above those of all the smaller formats */
+  vector<bool> eligible(channel->vformats().size());
+  for (const size_t format_idx : screen_vformats) {
+    eligible[format_idx] = true;
+  }
+
+  vector<bool> kept(eligible.size());
+  double max_ssim_db = numeric_limits<double>::lowest();
+
+  for (const auto & info : channel->vformat_table(ts)) {
+    if (eligible.at(info.format_idx) and info.ssim_db > max_ssim_db) {
+      kept[info.format_idx] = true;
+      max_ssim_db = info.ssim_db;
+    }
+  }
+
+  candidate_vformats_.clear();
+  for (const size_t format_idx : screen_vformats) {
+    if (kept[format_idx]) {
+      candidate_vformats_.emplace_back(format_idx);
+    }
+  }
+
+  return candidate_vformats_;
+}
+
 double ssim_db(const double ssim)
 {
   if (ssim != 1) {
@@ -2,8 +2,12 @@
 #define ABR_ALGO_HH
 
 #include <iostream>
+#include <optional>
+#include <functional>
+#include <vector>
 #include "media_formats.hh"
 #include "yaml.hh"
+#include "throughput_prior.hh"
 
 class WebSocketClient;
 
@@ -30,7 +34,27 @@ public:
   virtual ~ABRAlgo() {}
 
   virtual void video_chunk_acked(Chunk &&) {}
-  virtual VideoFormat select_video_format() = 0;
+
+  /* return the index of the selected format in the vformats() of the
+   * channel of the client */
+  virtual size_t select_video_format() = 0;
+
+  /* called on all the clients due for a decision before any of them calls
+   * select_video_format(), so that work can be batched across clients */
+  virtual void prepare_video_format() {}
+
+  /* for decisions made in other processes: while a decision is pending,
+   * this returns its deadline (timestamp_ms), and the server waits until
+   * notify_ready() is called or the deadline has passed */
+  virtual std::optional<uint64_t> video_format_pending() { return std::nullopt; }
+
+  /* throughput (bytes/s) at which the algorithm expects the chunk it has
+   * last selected to be delivered, for the server to pace the chunk at;
+   * nullopt without an estimate */
+  virtual std::optional<double> target_rate() const { return std::nullopt; }
+
+  using ReadyCallback = std::function<void(const uint64_t connection_id)>;
+  static void set_ready_callback(ReadyCallback func) { ready_callback_ = func; }
 
   /* accessors */
   std::string abr_name() const { return abr_name_; }
@@ -43,6 +67,31 @@ protected:
   /* it is safe to hold a reference to the parent as the parent lives longer */
   const WebSocketClient & client_;
   std::string abr_name_;
+
+  /* tell the server that the pending decision is ready */
+  void notify_ready() const;
+
+  /* seed the throughput estimate of a session that has no acked chunk yet
+   * from ThroughputPrior (abr_config["throughput_prior"]) */
+  bool use_throughput_prior_ {false};
+
+  /* the prior of the subnet of the client, if use_throughput_prior_ */
+  std::optional<ThroughputPrior::Sample> throughput_prior() const;
+
+  /* drop the formats that another format beats in both size and SSIM at
+   * the next timestamp (abr_config["prune_dominated"]) */
+  bool prune_dominated_ {false};
+
+  /* the formats that the algorithm considers for the video chunk at ts, as
+   * indices in the vformats() of the channel (ascending): those for the
+   * screen of the client (see Channel::vformats_for_screen()), pruned if
+   * prune_dominated_; an algorithm indexes its tables by position in here
+   * and maps the position it selects back through candidate_vformats_ */
+  const std::vector<size_t> & update_candidate_vformats(const uint64_t ts);
+  std::vector<size_t> candidate_vformats_ {};
+
+private:
+  static thread_local ReadyCallback ready_callback_;
 };
 
 #endif /* ABR_ALGO_HH */
@@ -0,0 +1,310 @@
+#include "abr_worker_pool.hh"
+
+#include <iostream>
+#include <stdexcept>
+#include <atomic>
+
+#include "pid.hh"
+#include "serialization.hh"
+#include "ipc_socket.hh"
+
+using namespace std;
+using namespace PollerShortNames;
+using json = nlohmann::json;
+
+thread_local Poller * ABRWorkerPool::poller_ = nullptr;
+thread_local map<string, unique_ptr<ABRWorkerPool>> ABRWorkerPool::pools_;
+
+ABRWorkerPool & ABRWorkerPool::get(const string & name,
+                                   const vector<string> & prog_args,
+                                   const size_t num_workers)
+{
+  /* tells apart the sockets of the pools on different threads */
+  static atomic<unsigned int> num_pools {0};
+
+  auto & pool = pools_[name];
+  if (not pool) {
+    string ipc_dir = "abr_workers";
+    fs::create_directory(ipc_dir);
+    fs::path ipc_file = fs::path(ipc_dir) /
+      (name + "_" + to_string(pid()) + "_" + to_string(num_pools++));
+
+    pool = make_unique<ABRWorkerPool>(ipc_file, prog_args, num_workers, true);
+  }
+
+  return *pool;
+}
+
+ABRWorkerPool::ABRWorkerPool(const fs::path & ipc_file,
+                             const vector<string> & prog_args,
+                             const size_t num_workers, const bool shared)
+  : ipc_file_(ipc_file), shared_(shared)
+{
+  if (prog_args.empty() or num_workers == 0) {
+    throw runtime_error("ABRWorkerPool requires a program and workers");
+  }
+
+  if (not poller_) {
+    throw runtime_error("ABRWorkerPool requires a poller on this thread");
+  }
+
+  /* setup the IPC socket shared by all the workers */
+  IPCSocket sock;
+  sock.set_reuseaddr();
+  sock.bind(ipc_file_);
+  sock.listen();
+
+  vector<string> worker_args {prog_args};
+  worker_args.emplace_back(fs::current_path() / ipc_file_);
+
+  for (size_t i = 0; i < num_workers; i++) {
+    auto worker = make_unique<Worker>();
+
+    worker->proc = make_unique<ChildProcess>(worker_args.front(),
+                                             worker_args.front(), worker_args);
+
+    workers_.emplace_back(move(worker));
+  }
+
+  /* workers are interchangeable, so it does not matter who connects first */
+  for (auto & worker : workers_) {
+    worker->connection = make_shared<FileDescriptor>(sock.accept());
+    worker->connection->set_blocking(false);
+
+    /* the action holds the connection and checks that the pool is alive;
+     * once the pool is gone, the worker exits and the action is cancelled */
+    Worker * w = worker.get();
+    poller_->add_action(Poller::Action(*worker->connection, Direction::In,
+      [this, w, connection = worker->connection,
+       pool_alive = pool_alive_]()->Result {
+        if (not *pool_alive) {
+          return ResultType::Cancel;
+        }
+
+        receive(*w);
+        return w->alive ? ResultType::Continue : ResultType::Cancel;
+      },
+      [] { return true; },
+      [w, pool_alive = pool_alive_]() {
+        if (*pool_alive) {
+          w->alive = false;
+        }
+      }
+    ));
+
+    poller_->add_action(Poller::Action(*worker->connection, Direction::Out,
+      [w, connection = worker->connection,
+       pool_alive = pool_alive_]()->Result {
+        if (not *pool_alive) {
+          return ResultType::Cancel;
+        }
+
+        flush(*w);
+        return w->alive ? ResultType::Continue : ResultType::Cancel;
+      },
+      [w, pool_alive = pool_alive_] {
+        return *pool_alive and w->alive and
+               (not w->outgoing.empty() or not w->send_buffer.empty());
+      }
+    ));
+  }
+}
+
+ABRWorkerPool::~ABRWorkerPool()
+{
+  *pool_alive_ = false;
+
+  if (not fs::remove(ipc_file_)) {
+    cerr << "Warning: file " << ipc_file_ << " cannot be removed" << endl;
+  }
+}
+
+ABRWorkerPool::Worker & ABRWorkerPool::worker(const uint64_t client_id)
+{
+  auto it = client_workers_.find(client_id);
+  if (it != client_workers_.end() and workers_[it->second]->alive) {
+    return *workers_[it->second];
+  }
+
+  /* assign the alive worker with the fewest clients */
+  optional<size_t> idx;
+  for (size_t i = 0; i < workers_.size(); i++) {
+    if (workers_[i]->alive and
+        (not idx or workers_[i]->num_clients < workers_[*idx]->num_clients)) {
+      idx = i;
+    }
+  }
+
+  if (not idx) {
+    throw runtime_error("ABRWorkerPool: no worker is alive");
+  }
+
+  if (it != client_workers_.end()) {
+    workers_[it->second]->num_clients--;
+    it->second = *idx;
+  } else {
+    client_workers_.emplace(client_id, *idx);
+  }
+
+  workers_[*idx]->num_clients++;
+  return *workers_[*idx];
+}
+
+void ABRWorkerPool::request(const uint64_t client_id, json && msg,
+                            ResponseCallback && callback)
+{
+  Worker & w = worker(client_id);
+  const uint64_t request_id = next_request_id_++;
+
+  msg["request_id"] = request_id;
+  msg["client_id"] = client_id;
+
+  send_msg(w, msg);
+  w.pending.push_back({request_id, client_id, move(callback)});
+}
+
+void ABRWorkerPool::close_client(const uint64_t client_id)
+{
+  auto it = client_workers_.find(client_id);
+  if (it == client_workers_.end()) {
+    return;
+  }
+
+  Worker & w = *workers_[it->second];
+  w.num_clients--;
+  client_workers_.erase(it);
+
+  /* the responses still have to be read, but nobody is waiting for them */
+  for (auto & pending : w.pending) {
+    if (pending.client_id == client_id) {
+      pending.callback = nullptr;
+    }
+  }
+
+  if (shared_ and w.alive) {
+    json msg;
+    msg["client_id"] = client_id;
+    msg["close"] = true;
+
+    send_msg(w, msg);
+  }
+}
+
+void ABRWorkerPool::receive(Worker & w)
+{
+  IOBuffer buffer;
+  w.recv_buffer.append(w.connection->read(buffer));
+
+  if (w.connection->eof()) {
+    cerr << "ABRWorkerPool: worker " << w.proc->pid() << " exited" << endl;
+    w.alive = false;
+    w.pending.clear();
+    w.outgoing.clear();
+    w.send_buffer.clear();
+    return;
+  }
+
+  while (w.recv_buffer.size() >= sizeof(uint16_t)) {
+    const size_t msg_len = get_uint16(w.recv_buffer.data());
+    if (w.recv_buffer.size() < sizeof(uint16_t) + msg_len) {
+      break;
+    }
+
+    json response = json::parse(w.recv_buffer.substr(sizeof(uint16_t), msg_len));
+    w.recv_buffer.erase(0, sizeof(uint16_t) + msg_len);
+
+    if (response.count("batch")) {
+      for (auto & r : response.at("batch")) {
+        respond(w, move(r));
+      }
+    } else {
+      respond(w, move(response));
+    }
+  }
+}
+
+void ABRWorkerPool::respond(Worker & w, json && response)
+{
+  if (w.pending.empty()) {
+    cerr << "ABRWorkerPool: ignored a response to no request" << endl;
+    return;
+  }
+
+  PendingRequest pending = move(w.pending.front());
+  w.pending.pop_front();
+
+  if (response.count("request_id") and
+      response.at("request_id").get<uint64_t>() != pending.request_id) {
+    cerr << "ABRWorkerPool: ignored a response to another request" << endl;
+    return;
+  }
+
+  if (pending.callback) {
+    pending.callback(move(response));
+  }
+}
+
+static const string BATCH_BEGIN = "{\"batch\":[";
+static const string BATCH_END = "]}";
+
+void ABRWorkerPool::send_msg(Worker & w, const json & msg)
+{
+  string msg_str = msg.dump();
+  if (BATCH_BEGIN.size() + msg_str.size() + BATCH_END.size() > UINT16_MAX) {
+    throw runtime_error("ABRWorkerPool: message too long");
+  }
+
+  w.outgoing.emplace_back(move(msg_str));
+}
+
+void ABRWorkerPool::pack(Worker & w)
+{
+  string batch;
+  size_t batch_size = 0;
+
+  const auto queue_batch = [&w, &batch, &batch_size]() {
+    /* a lone message is sent as is */
+    const string msg_str = batch_size > 1 ? BATCH_BEGIN + batch + BATCH_END
+                                          : batch;
+
+    w.send_buffer.append(put_field(static_cast<uint16_t>(msg_str.size())));
+    w.send_buffer.append(msg_str);
+
+    batch.clear();
+    batch_size = 0;
+  };
+
+  for (const auto & msg_str : w.outgoing) {
+    if (batch_size > 0 and BATCH_BEGIN.size() + batch.size() + 1
+        + msg_str.size() + BATCH_END.size() > UINT16_MAX) {
+      queue_batch();
+    }
+
+    if (batch_size > 0) {
+      batch += ',';
+    }
+    batch += msg_str;
+    batch_size++;
+  }
+
+  if (batch_size > 0) {
+    queue_batch();
+  }
+
+  w.outgoing.clear();
+}
+
+void ABRWorkerPool::flush(Worker & w)
+{
+  pack(w);
+
+  if (w.send_buffer.empty()) {
+    return;
+  }
+
+  /* the connection is writable, so the write does not block but might be
+   * partial; the rest is written when the connection is writable again */
+  const string_view pending(w.send_buffer);
+  const auto it = w.connection->write(pending, false);
+  w.send_buffer.erase(0, it - pending.begin());
+}
@@ -0,0 +1,129 @@
+#ifndef ABR_WORKER_POOL_HH
+#define ABR_WORKER_POOL_HH
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <functional>
+
+#include "child_process.hh"
+#include "file_descriptor.hh"
+#include "poller.hh"
+#include "filesystem.hh"
+#include "json.hpp"
+
+/* Worker processes (e.g., Python ABR models) that answer the requests of
+ * clients asynchronously: requests are written to a worker, and responses
+ * are read when the worker's connection becomes readable in the event loop,
+ * so a slow worker does not stall the other clients.
+ *
+ * Workers are started with the given program arguments followed by the path
+ * of a Unix socket that all of them connect to. Messages in both directions
+ * are JSON prefixed by a 16-bit length. Requests carry "request_id" and
+ * "client_id"; a worker answers the requests in order, and may echo
+ * "request_id" to have it checked. A shared pool pins each client to one
+ * worker, which can keep per-client state, and sends
+ * {"client_id": id, "close": true} (without a response) when the client is
+ * gone. A private pool serves a single client with a single worker.
+ *
+ * The connections to the workers are non-blocking: messages are queued on
+ * the worker and written when its connection becomes writable, so a worker
+ * that does not read its socket cannot stall the event loop either. The
+ * messages queued in an iteration of the event loop (e.g., the observations
+ * of all the clients that acked a chunk) are sent to a worker as a single
+ * {"batch": [msg, ...]}, split only to fit the length prefix; a worker
+ * answers the requests of a batch in order, either one by one or as a
+ * single {"batch": [response, ...]}. */
+class ABRWorkerPool
+{
+public:
+  using ResponseCallback = std::function<void(nlohmann::json &&)>;
+
+  /* the shared pool named name on this thread, started on first use */
+  static ABRWorkerPool & get(const std::string & name,
+                             const std::vector<std::string> & prog_args,
+                             const size_t num_workers);
+
+  /* start a pool whose workers connect to the socket bound at ipc_file */
+  ABRWorkerPool(const fs::path & ipc_file,
+                const std::vector<std::string> & prog_args,
+                const size_t num_workers, const bool shared = false);
+  ~ABRWorkerPool();
+
+  /* the event loop that reads the responses on this thread */
+  static void set_poller(Poller * poller) { poller_ = poller; }
+
+  /* send msg on behalf of client_id; callback gets the response */
+  void request(const uint64_t client_id, nlohmann::json && msg,
+               ResponseCallback && callback);
+
+  /* drop the pending responses of client_id and release its worker */
+  void close_client(const uint64_t client_id);
+
+  /* forbid copying or moving */
+  ABRWorkerPool(const ABRWorkerPool & other) = delete;
+  const ABRWorkerPool & operator=(const ABRWorkerPool & other) = delete;
+  ABRWorkerPool(ABRWorkerPool && other) = delete;
+  ABRWorkerPool & operator=(ABRWorkerPool && other) = delete;
+
+private:
+  struct PendingRequest {
+    uint64_t request_id;
+    uint64_t client_id;
+    ResponseCallback callback;  /* empty if the client is gone */
+  };
+
+  struct Worker {
+    std::unique_ptr<ChildProcess> proc {nullptr};
+
+    /* shared with the poller action, which might outlive the pool */
+    std::shared_ptr<FileDescriptor> connection {nullptr};
+
+    bool alive {true};
+    size_t num_clients {0};
+    std::string recv_buffer {};
+    std::vector<std::string> outgoing {};  /* queued in this iteration */
+    std::string send_buffer {};  /* length-prefixed messages not yet written */
+    std::deque<PendingRequest> pending {};
+  };
+
+  fs::path ipc_file_ {};
+  bool shared_;
+  std::vector<std::unique_ptr<Worker>> workers_ {};
+
+  /* worker index of each client and the next request ID */
+  std::map<uint64_t, size_t> client_workers_ {};
+  uint64_t next_request_id_ {0};
+
+  /* cleared when the pool is destroyed, so that its actions cancel */
+  std::shared_ptr<bool> pool_alive_ {std::make_shared<bool>(true)};
+
+  /* the worker of client_id, which is assigned if not yet */
+  Worker & worker(const uint64_t client_id);
+
+  /* read what is available on the worker and run the callbacks of the
+   * complete responses */
+  void receive(Worker & w);
+
+  /* run the callback of the next pending request of the worker */
+  void respond(Worker & w, nlohmann::json && response);
+
+  /* queue msg to be sent to the worker in the next batch */
+  static void send_msg(Worker & w, const nlohmann::json & msg);
+
+  /* queue the outgoing messages of the worker as batches to be written */
+  static void pack(Worker & w);
+
+  /* write as much of the queued messages as the worker's connection takes */
+  static void flush(Worker & w);
+
+  static thread_local Poller * poller_;
+
+  /* shared pools; key: name */
+  static thread_local std::map<std::string, std::unique_ptr<ABRWorkerPool>> pools_;
+};
+
+#endif /* ABR_WORKER_POOL_HH */
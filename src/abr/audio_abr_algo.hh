@@ -0,0 +1,35 @@
+#ifndef AUDIO_ABR_ALGO_HH
+#define AUDIO_ABR_ALGO_HH
+
+#include <iostream>
+#include <string>
+#include "media_formats.hh"
+#include "yaml.hh"
+
+class WebSocketClient;
+
+/* ABR algorithm of the audio, the counterpart of ABRAlgo; it can see the
+ * video state of the client (e.g., curr_vformat() and video_playback_buf())
+ * so as to budget the bandwidth of audio and video jointly */
+class AudioABRAlgo
+{
+public:
+  virtual ~AudioABRAlgo() {}
+
+  /* return the index of the selected format in aformats() of the channel */
+  virtual size_t select_audio_format() = 0;
+
+  /* accessors */
+  std::string abr_name() const { return abr_name_; }
+
+protected:
+  AudioABRAlgo(const WebSocketClient & client, const std::string & abr_name)
+    : client_(client), abr_name_(abr_name)
+  { std::cerr << "audio_abr_name = " << abr_name << std::endl; }
+
+  /* it is safe to hold a reference to the parent as the parent lives longer */
+  const WebSocketClient & client_;
+  std::string abr_name_;
+};
+
+#endif /* AUDIO_ABR_ALGO_HH */
@@ -0,0 +1,63 @@
+#include "audio_linear_bba.hh"
+#include "ws_client.hh"
+
+#include <algorithm>
+
+using namespace std;
+
+AudioLinearBBA::AudioLinearBBA(const WebSocketClient & client,
+                               const string & abr_name,
+                               const YAML::Node & abr_config)
+  : AudioABRAlgo(client, abr_name)
+{
+  if (abr_config["lower_reservoir"]) {
+    lower_reservoir_ = abr_config["lower_reservoir"].as<double>();
+  }
+
+  if (abr_config["upper_reservoir"]) {
+    upper_reservoir_ = abr_config["upper_reservoir"].as<double>();
+  }
+}
+
+size_t AudioLinearBBA::select_audio_format()
+{
+  double max_buffer_s = WebSocketClient::MAX_BUFFER_S;
+  double buf = min(max(client_.audio_playback_buf(), 0.0), max_buffer_s);
+
+  const auto & channel = client_.channel();
+
+  uint64_t next_ats = client_.next_ats().value();
+
+  /* formats of the next audio ts in ascending order of size, skipping the
+   * empty chunks */
+  const auto & table = channel->aformat_table(next_ats);
+  const auto first = find_if(table.begin(), table.end(),
+    [](const Channel::AudioFormatInfo & info) { return info.size > 0; });
+  if (first == table.end()) {
+    throw runtime_error("AudioLinearBBA: all audio chunks are empty");
+  }
+
+  const auto & smallest = *first;
+  const auto & largest = table.back();
+
+  /* lower and uppper reservoirs */
+  if (buf >= upper_reservoir_ * max_buffer_s) {
+    return largest.format_idx;
+  } else if (buf <= lower_reservoir_ * max_buffer_s) {
+    return smallest.format_idx;
+  }
+
+  /* pick the largest chunk with size <= max_serve_size */
+  double slope = (largest.size - smallest.size) /
+                 ((upper_reservoir_ - lower_reservoir_) * max_buffer_s);
+  double max_serve_size = smallest.size +
+                          slope * (buf - lower_reservoir_ * max_buffer_s);
+
+  size_t ret_idx = smallest.format_idx;
+  for (auto it = first; it != table.end() and it->size <= max_serve_size;
+       it++) {
+    ret_idx = it->format_idx;
+  }
+
+  return ret_idx;
+}
@@ -0,0 +1,24 @@
+#ifndef AUDIO_LINEAR_BBA_HH
+#define AUDIO_LINEAR_BBA_HH
+
+#include "audio_abr_algo.hh"
+
+/* BBA on the audio playback buffer: the largest audio chunk whose size is
+ * at most linear in the buffer between the reservoirs */
+class AudioLinearBBA : public AudioABRAlgo
+{
+public:
+  AudioLinearBBA(const WebSocketClient & client,
+                 const std::string & abr_name, const YAML::Node & abr_config);
+
+  size_t select_audio_format() override;
+
+private:
+  static constexpr double LOWER_RESERVOIR = 0.1;
+  static constexpr double UPPER_RESERVOIR = 0.9;
+
+  double lower_reservoir_ {LOWER_RESERVOIR};
+  double upper_reservoir_ {UPPER_RESERVOIR};
+};
+
+#endif /* AUDIO_LINEAR_BBA_HH */
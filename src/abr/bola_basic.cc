@@ -6,6 +6,11 @@
 
 using namespace std;
 
+const BolaBasic::Parameters BolaBasic::PARAMS_V1 =
+  BolaBasic::calculate_params(BOLA_BASIC_v1);
+const BolaBasic::Parameters BolaBasic::PARAMS_V2 =
+  BolaBasic::calculate_params(BOLA_BASIC_v2);
+
 BolaBasic::BolaBasic(const WebSocketClient & client, const string & abr_name)
   : ABRAlgo(client, abr_name)
 {
@@ -20,11 +25,11 @@ BolaBasic::BolaBasic(const WebSocketClient & client, const string & abr_name)
 
 /* Size/buf units don't affect gp (if consistent). Utility units do. */
 BolaBasic::Parameters
-BolaBasic::calculate_params(BolaBasic::Version version) const
+BolaBasic::calculate_params(BolaBasic::Version version)
 {
-  /* vf is not meaningful, since these are averages over past encodings across
-   * channels */
-  const VideoFormat fake = VideoFormat("11x11-11");
+  /* format_idx is not meaningful, since these are averages over past
+   * encodings across channels */
+  const size_t fake = 0;
   const Encoded smallest = { fake,
     size_ladder_bytes.front(), utility(ssim_index_ladder.front(), version) };
   const Encoded second_smallest = { fake,
@@ -99,25 +104,22 @@ BolaBasic::choose_max_scaled_utility(const vector<Encoded> & encoded_formats) co
   return *chosen;
 }
 
-VideoFormat BolaBasic::select_video_format()
+size_t BolaBasic::select_video_format()
 {
   const auto & channel = client_.channel();
   double chunk_duration_s = channel->vduration() * 1.0 / channel->timescale();
   double client_buf_s = max(client_.video_playback_buf(), 0.0);
   double client_buf_chunks = client_buf_s / chunk_duration_s;
 
-  /* 1. Get info for each encoded format */
-  vector<Encoded> encoded_formats;
+  /* 1. Get info for each encoded format (precomputed by the channel) */
+  auto & encoded_formats = encoded_formats_;
+  encoded_formats.clear();
   uint64_t next_vts = client_.next_vts().value();
-  const auto & data_map = channel->vdata(next_vts);
-  const auto & ssim_map = channel->vssim(next_vts);
-  const auto & vformats = channel->vformats();
 
-  transform(vformats.begin(), vformats.end(), back_inserter(encoded_formats),
-    [this, data_map, ssim_map](const VideoFormat & vf) {
-      return Encoded { vf, get<1>(data_map.at(vf)), utility(ssim_map.at(vf), version) };
-    }
-  );
+  for (const auto & info : channel->vformat_table(next_vts)) {
+    encoded_formats.push_back({ info.format_idx, info.size,
+      version == BOLA_BASIC_v1 ? info.ssim_db : info.ssim });
+  }
 
   /* 2. Using parameters, calculate objective for each format.
   * BOLA_BASIC_v1: Choose format with max objective.
@@ -130,8 +132,8 @@ VideoFormat BolaBasic::select_video_format()
     objective(max_obj_format, client_buf_chunks, chunk_duration_s);
 
   if (version == BOLA_BASIC_v1 or max_obj_value >= 0) {
-    return max_obj_format.vf;
+    return max_obj_format.format_idx;
   } else {
-    return choose_max_scaled_utility(encoded_formats).vf;
+    return choose_max_scaled_utility(encoded_formats).format_idx;
   }
 }
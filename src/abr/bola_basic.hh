@@ -25,7 +25,7 @@ public:
   BolaBasic(const WebSocketClient & client,
             const std::string & abr_name);
 
-  VideoFormat select_video_format() override;
+  size_t select_video_format() override;
 
 private:
   /* Version of BOLA-BASIC */
@@ -46,7 +46,7 @@ private:
 
   /* Represents an encoded format */
   struct Encoded {
-    VideoFormat vf;
+    size_t format_idx;  // in vformats()
     size_t size;    // bytes (as in vdata map)
     double utility;
   };
@@ -75,14 +75,17 @@ private:
   static_assert(MIN_BUF_S < MAX_BUF_S);
 
   /* Calculate parameters appropriate for BOLA version. */
-  Parameters calculate_params(Version version) const;
+  static Parameters calculate_params(Version version);
 
-  /* Calculate both versions of parameters statically,
+  /* Calculate both versions of parameters once for all the clients,
    * then choose dynamically based on config. */
-  const Parameters PARAMS_V1 = calculate_params(BOLA_BASIC_v1);
-  const Parameters PARAMS_V2 = calculate_params(BOLA_BASIC_v2);
+  static const Parameters PARAMS_V1;
+  static const Parameters PARAMS_V2;
   Parameters params = PARAMS_V1;
 
+  /* reused across decisions */
+  std::vector<Encoded> encoded_formats_ {};
+
   /* A format's utility to the client.
    * Takes version as arg, to allow use before configured version is known. */
   static double utility(double raw_ssim, Version version);
@@ -0,0 +1,60 @@
+#include "decision_cache.hh"
+
+#include <cstring>
+#include <functional>
+
+using namespace std;
+
+bool DecisionCache::Key::operator==(const Key & other) const
+{
+  return ts == other.ts and formats == other.formats
+         and horizon == other.horizon
+         and buffer == other.buffer and throughput == other.throughput
+         and last_ssim_db == other.last_ssim_db;
+}
+
+size_t DecisionCache::KeyHash::operator()(const Key & key) const
+{
+  uint64_t ssim_bits;
+  memcpy(&ssim_bits, &key.last_ssim_db, sizeof(ssim_bits));
+
+  /* the timestamp is the same for all the keys of a table */
+  size_t h = hash<uint64_t>()(ssim_bits);
+  for (const uint64_t x : {key.formats, static_cast<uint64_t>(key.horizon),
+                           static_cast<uint64_t>(key.buffer),
+                           static_cast<uint64_t>(key.throughput)}) {
+    h ^= hash<uint64_t>()(x) + 0x9e3779b97f4a7c15 + (h << 6) + (h >> 2);
+  }
+
+  return h;
+}
+
+DecisionCache & DecisionCache::get(const string & channel, const string & algo)
+{
+  static thread_local map<pair<string, string>, DecisionCache> caches;
+  return caches[{channel, algo}];
+}
+
+optional<size_t> DecisionCache::lookup(const Key & key) const
+{
+  const auto table = decisions_.find(key.ts);
+  if (table == decisions_.end()) {
+    return nullopt;
+  }
+
+  const auto it = table->second.find(key);
+  if (it == table->second.end()) {
+    return nullopt;
+  }
+
+  return it->second;
+}
+
+void DecisionCache::insert(const Key & key, const size_t format)
+{
+  decisions_[key.ts][key] = format;
+
+  while (decisions_.size() > MAX_TIMESTAMPS) {
+    decisions_.erase(decisions_.begin());
+  }
+}
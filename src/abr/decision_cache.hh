@@ -0,0 +1,53 @@
+#ifndef DECISION_CACHE_HH
+#define DECISION_CACHE_HH
+
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+/* Decisions of an ABR algorithm shared by the clients of a thread that watch
+ * the same channel: for a given timestamp of the next chunk, a decision that
+ * is a function of a few discretized inputs is solved once and reused by the
+ * other clients with the same inputs. Each thread holds its own caches (as
+ * the tables of MPC), so they take no lock. */
+class DecisionCache
+{
+public:
+  struct Key
+  {
+    uint64_t ts;          /* timestamp of the next chunk */
+    uint64_t formats;     /* bitmap of the candidate formats */
+    size_t horizon;       /* number of chunks ahead that are ready */
+    size_t buffer;        /* discretized playback buffer */
+    int64_t throughput;   /* bucket of the predicted throughput */
+    double last_ssim_db;  /* of the last chunk sent, or 0 for the first */
+
+    bool operator==(const Key & other) const;
+  };
+
+  /* the cache of algo (the name and config of an algorithm) on channel */
+  static DecisionCache & get(const std::string & channel,
+                             const std::string & algo);
+
+  /* the format selected for key, if any */
+  std::optional<size_t> lookup(const Key & key) const;
+
+  /* remember the format selected for key; the timestamps behind the
+   * MAX_TIMESTAMPS most recent ones are evicted */
+  void insert(const Key & key, const size_t format);
+
+private:
+  static constexpr size_t MAX_TIMESTAMPS = 64;
+
+  struct KeyHash
+  {
+    size_t operator()(const Key & key) const;
+  };
+
+  /* timestamp -> key -> format */
+  std::map<uint64_t, std::unordered_map<Key, size_t, KeyHash>> decisions_ {};
+};
+
+#endif /* DECISION_CACHE_HH */
@@ -0,0 +1,229 @@
+#include "distribution.hh"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+using namespace std;
+
+/* eight floats, loaded and stored unaligned as in MLP; the arrays of n bins
+ * are copied to and from vectors on the stack, so that the last partial
+ * vector is padded */
+typedef float Vec __attribute__((vector_size(32), aligned(alignof(float))));
+typedef int32_t IVec __attribute__((vector_size(32)));
+static constexpr size_t VEC_WIDTH = 8;
+static constexpr size_t MAX_VECS = Distribution::MAX_BINS / VEC_WIDTH;
+
+static_assert(Distribution::MAX_BINS % VEC_WIDTH == 0);
+
+static inline float horizontal_sum(const Vec & x)
+{
+  float sum = 0;
+  for (size_t i = 0; i < VEC_WIDTH; i++) {
+    sum += x[i];
+  }
+  return sum;
+}
+
+/* exp() of each lane in place, to about 1e-6 relative: the argument is reduced to
+ * x - t * ln(2), with t an integer and |x| <= ln(2) / 2, and exp(x) is
+ * approximated by a polynomial (as in Cephes) and scaled by 2^t through the
+ * exponent bits */
+static inline void exp_in_place(Vec & x)
+{
+  const Vec min_x = Vec {} - 87.3f;
+  const Vec max_x = Vec {} + 88.3f;
+  x = x < min_x ? min_x : x;
+  x = x > max_x ? max_x : x;
+
+  /* t = floor(x / ln(2) + 0.5), as the conversion truncates towards 0 */
+  const Vec fx = x * 1.44269504088896341f + 0.5f;
+  Vec t = __builtin_convertvector(__builtin_convertvector(fx, IVec), Vec);
+  t = t > fx ? t - 1.0f : t;
+
+  /* ln(2) in two parts, so that the reduction is exact */
+  x -= t * 0.693359375f;
+  x -= t * -2.12194440e-4f;
+
+  Vec y = x * 1.9875691500e-4f + 1.3981999507e-3f;
+  y = y * x + 8.3334519073e-3f;
+  y = y * x + 4.1665795894e-2f;
+  y = y * x + 1.6666665459e-1f;
+  y = y * x + 5.0000001201e-1f;
+  y = y * x * x + x + 1.0f;
+
+  const IVec exponent = (__builtin_convertvector(t, IVec) + 127) << 23;
+  Vec scale;
+  memcpy(&scale, &exponent, sizeof(scale));
+  x = y * scale;
+}
+
+/* build a copy of each kernel for each x86-64 level, as in MLP */
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+#define DISTRIBUTION_TARGET_CLONES \
+  __attribute__((target_clones("arch=x86-64-v4", "arch=x86-64-v3", \
+                               "default")))
+#else
+#define DISTRIBUTION_TARGET_CLONES
+#endif
+
+DISTRIBUTION_TARGET_CLONES
+static void softmax_kernel(const float * logits, const size_t n, float * probs)
+{
+  const size_t num_vecs = (n + VEC_WIDTH - 1) / VEC_WIDTH;
+
+  Vec x[MAX_VECS];
+  float * xf = reinterpret_cast<float *>(x);
+  memcpy(xf, logits, n * sizeof(float));
+  for (size_t k = n; k < num_vecs * VEC_WIDTH; k++) {
+    xf[k] = numeric_limits<float>::lowest();
+  }
+
+  Vec max_vec = x[0];
+  for (size_t v = 1; v < num_vecs; v++) {
+    max_vec = x[v] > max_vec ? x[v] : max_vec;
+  }
+
+  float max_logit = max_vec[0];
+  for (size_t i = 1; i < VEC_WIDTH; i++) {
+    max_logit = max(max_logit, max_vec[i]);
+  }
+
+  /* the padding is 0 after exp() */
+  Vec sum_vec {};
+  for (size_t v = 0; v < num_vecs; v++) {
+    x[v] -= max_logit;
+    exp_in_place(x[v]);
+    sum_vec += x[v];
+  }
+
+  const float scale = 1 / horizontal_sum(sum_vec);
+  for (size_t v = 0; v < num_vecs; v++) {
+    x[v] *= scale;
+  }
+
+  memcpy(probs, xf, n * sizeof(float));
+}
+
+DISTRIBUTION_TARGET_CLONES
+static float truncate_kernel(const float * probs, const size_t n,
+                             const float eps, float * out)
+{
+  const size_t num_vecs = (n + VEC_WIDTH - 1) / VEC_WIDTH;
+
+  Vec x[MAX_VECS];
+  float * xf = reinterpret_cast<float *>(x);
+  memcpy(xf, probs, n * sizeof(float));
+  for (size_t k = n; k < num_vecs * VEC_WIDTH; k++) {
+    xf[k] = 0;
+  }
+
+  const Vec eps_vec = Vec {} + eps;
+  const Vec zero {};
+  Vec sum_vec {};
+
+  for (size_t v = 0; v < num_vecs; v++) {
+    x[v] = x[v] < eps_vec ? zero : x[v];
+    sum_vec += x[v];
+  }
+
+  memcpy(out, xf, n * sizeof(float));
+  return horizontal_sum(sum_vec);
+}
+
+DISTRIBUTION_TARGET_CLONES
+static void blur_kernel(const float * matrix, const size_t num_bins,
+                        const size_t stride, float * probs)
+{
+  const size_t num_vecs = stride / VEC_WIDTH;
+
+  Vec acc[MAX_VECS] {};
+
+  for (size_t m = 0; m < num_bins; m++) {
+    const float p = probs[m];
+    if (p == 0) {
+      continue;
+    }
+
+    const Vec * row = reinterpret_cast<const Vec *>(matrix + m * stride);
+    for (size_t v = 0; v < num_vecs; v++) {
+      acc[v] += p * row[v];
+    }
+  }
+
+  /* the padding of the rows is 0 */
+  Vec sum_vec {};
+  for (size_t v = 0; v < num_vecs; v++) {
+    sum_vec += acc[v];
+  }
+
+  const float scale = 1 / horizontal_sum(sum_vec);
+  for (size_t v = 0; v < num_vecs; v++) {
+    acc[v] *= scale;
+  }
+
+  memcpy(probs, acc, num_bins * sizeof(float));
+}
+
+void Distribution::softmax(const float * logits, const size_t n,
+                           float * probs)
+{
+  if (n == 0 or n > MAX_BINS) {
+    throw runtime_error("Distribution: invalid number of bins "
+                        + to_string(n));
+  }
+
+  softmax_kernel(logits, n, probs);
+}
+
+double Distribution::truncate(const float * probs, const size_t n,
+                              const float eps, float * out)
+{
+  if (n > MAX_BINS) {
+    throw runtime_error("Distribution: invalid number of bins "
+                        + to_string(n));
+  }
+
+  return truncate_kernel(probs, n, eps, out);
+}
+
+GaussianBlur::GaussianBlur(const size_t num_bins, const double mean,
+                           const double std, const size_t kernel_size)
+  : num_bins_(num_bins),
+    stride_((num_bins + VEC_WIDTH - 1) / VEC_WIDTH * VEC_WIDTH)
+{
+  if (num_bins == 0 or num_bins > Distribution::MAX_BINS) {
+    throw runtime_error("GaussianBlur: invalid number of bins "
+                        + to_string(num_bins));
+  }
+
+  if (kernel_size % 2 == 0 or std <= 0) {
+    throw runtime_error("GaussianBlur: the kernel size must be odd and the "
+                        "std positive");
+  }
+
+  matrix_.resize(num_bins_ * stride_);
+
+  const double coefficient = 1.0 / (std * sqrt(2.0 * M_PI));
+  const int right = kernel_size >> 1;
+  const int n = num_bins_;
+
+  /* output bin k sums up the samples at x of input bin (k + x) mod n */
+  for (int x = -right; x <= right; x++) {
+    const double value = coefficient * exp(-(x - mean) * (x - mean)
+                                           / (2.0 * std * std));
+
+    for (int k = 0; k < n; k++) {
+      const int m = ((k + x) % n + n) % n;
+      matrix_[m * stride_ + k] += value;
+    }
+  }
+}
+
+void GaussianBlur::apply(float * probs) const
+{
+  blur_kernel(matrix_.data(), num_bins_, stride_, probs);
+}
@@ -0,0 +1,48 @@
+#ifndef DISTRIBUTION_HH
+#define DISTRIBUTION_HH
+
+#include <cstddef>
+#include <vector>
+
+/* Kernels for the discrete distributions of PufferTTP, e.g., of the sending
+ * time of a chunk over its bins: float arrays of at most MAX_BINS values,
+ * unaligned, processed eight at a time in vector registers and without
+ * allocating, as they run for every format and step of every decision. */
+class Distribution
+{
+public:
+  static constexpr size_t MAX_BINS = 64;
+
+  /* probs[k] = exp(logits[k]) / sum of exp(logits) over the n bins */
+  static void softmax(const float * logits, const size_t n, float * probs);
+
+  /* out[k] = probs[k], or 0 where probs[k] < eps, over the n bins; return
+   * the sum of out */
+  static double truncate(const float * probs, const size_t n,
+                         const float eps, float * out);
+};
+
+/* A circular Gaussian blur of distributions over num_bins bins, i.e., the
+ * convolution with kernel_size samples of N(mean, std^2) at
+ * -kernel_size / 2, ..., kernel_size / 2, wrapping around the bins */
+class GaussianBlur
+{
+public:
+  GaussianBlur(const size_t num_bins, const double mean, const double std,
+               const size_t kernel_size);
+
+  /* blur probs (num_bins values) in place and normalize them to sum to 1 */
+  void apply(float * probs) const;
+
+  size_t num_bins() const { return num_bins_; }
+
+private:
+  size_t num_bins_;
+  size_t stride_;  /* num_bins_ padded to a whole number of vectors */
+
+  /* the kernel folded into a circulant matrix [input bin][stride], so that
+   * each input bin is multiplied by a contiguous row into all the outputs */
+  std::vector<float> matrix_ {};
+};
+
+#endif /* DISTRIBUTION_HH */
@@ -0,0 +1,226 @@
+#include "inference_channel.hh"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <ctime>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include "file_descriptor.hh"
+#include "exception.hh"
+#include "mmap.hh"
+#include "timestamp.hh"
+
+using namespace std;
+
+fs::path InferenceChannel::dir_;
+uint64_t InferenceChannel::timeout_us_ = 0;
+thread_local unique_ptr<InferenceChannel> InferenceChannel::channel_;
+thread_local uint64_t InferenceChannel::generation_ = 0;
+thread_local uint64_t InferenceChannel::create_after_us_ = 0;
+
+void InferenceChannel::enable(const fs::path & dir, const uint64_t timeout_us)
+{
+  dir_ = dir;
+  timeout_us_ = timeout_us;
+}
+
+InferenceChannel * InferenceChannel::get()
+{
+  if (dir_.empty()) {
+    return nullptr;
+  }
+
+  const uint64_t now = timestamp_us();
+
+  if (channel_ and now < channel_->retry_after_us_) {
+    return nullptr;
+  }
+
+  /* the slot given up on is left to the daemon, which drops its file */
+  if (channel_ and channel_->stale_) {
+    channel_.reset();
+  }
+
+  if (not channel_) {
+    if (now < create_after_us_) {
+      return nullptr;
+    }
+
+    try {
+      channel_ = make_unique<InferenceChannel>(dir_, generation_++);
+    } catch (const exception & e) {
+      /* reported once until a channel is created */
+      if (create_after_us_ == 0) {
+        cerr << "InferenceChannel: evaluating models locally (" << e.what()
+             << ")" << endl;
+      }
+      create_after_us_ = now + RETRY_INTERVAL_US;
+      return nullptr;
+    }
+
+    create_after_us_ = 0;
+  }
+
+  return channel_.get();
+}
+
+/* map a file of size bytes at path, creating it (empty) if needed */
+static shared_ptr<void> map_file(const fs::path & path, const size_t size)
+{
+  FileDescriptor fd(CheckSystemCall("open (" + path.string() + ")",
+                    open(path.c_str(), O_RDWR | O_CREAT, 0644)));
+
+  if (fd.filesize() < size) {
+    CheckSystemCall("ftruncate", ftruncate(fd.fd_num(), size));
+  }
+
+  /* the mapping remains valid after fd is closed */
+  return mmap_shared(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     fd.fd_num(), 0);
+}
+
+shared_ptr<InferenceChannel::Doorbell>
+InferenceChannel::map_doorbell(const fs::path & dir)
+{
+  const auto mapping = map_file(dir / "doorbell", sizeof(Doorbell));
+  return {mapping, static_cast<Doorbell *>(mapping.get())};
+}
+
+shared_ptr<InferenceChannel::Slot>
+InferenceChannel::map_slot(const fs::path & path)
+{
+  const auto mapping = map_file(path, sizeof(Slot));
+  return {mapping, static_cast<Slot *>(mapping.get())};
+}
+
+void InferenceChannel::futex_wake(atomic<uint32_t> & word)
+{
+  syscall(SYS_futex, &word, FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+}
+
+void InferenceChannel::futex_wait(atomic<uint32_t> & word,
+                                  const uint32_t value,
+                                  const uint64_t timeout_us)
+{
+  timespec timeout {};
+  timeout.tv_sec = timeout_us / 1000000;
+  timeout.tv_nsec = (timeout_us % 1000000) * 1000;
+
+  /* EAGAIN (no longer value), EINTR and ETIMEDOUT all mean "check again" */
+  if (syscall(SYS_futex, &word, FUTEX_WAIT, value,
+              timeout_us ? &timeout : nullptr, nullptr, 0) < 0
+      and errno != EAGAIN and errno != EINTR and errno != ETIMEDOUT) {
+    throw unix_error("futex");
+  }
+}
+
+InferenceChannel::InferenceChannel(const fs::path & dir,
+                                   const uint64_t generation)
+  : path_(dir / ("channel." + to_string(getpid()) + "."
+                 + to_string(syscall(SYS_gettid)) + "."
+                 + to_string(generation)))
+{
+  doorbell_ = map_doorbell(dir);
+
+  /* the daemon only sees the file once it has been set up */
+  const fs::path tmp_path = path_.string() + ".tmp";
+  slot_ = map_slot(tmp_path);
+  slot_->state = IDLE;
+  slot_->pid = getpid();
+  fs::rename(tmp_path, path_);
+
+  doorbell_->channels++;
+  doorbell_->seq++;
+  futex_wake(doorbell_->seq);
+}
+
+InferenceChannel::~InferenceChannel()
+{
+  error_code ec;
+  fs::remove(path_, ec);
+}
+
+InferenceChannel::State InferenceChannel::wait(const State state,
+                                               const uint64_t deadline_us)
+{
+  for (;;) {
+    const State current = static_cast<State>(slot_->state.load());
+    const uint64_t now = timestamp_us();
+    if (current != state or now >= deadline_us) {
+      return current;
+    }
+
+    futex_wait(slot_->state, state, deadline_us - now);
+  }
+}
+
+bool InferenceChannel::forward(const string & model_path,
+                               const string & meta_path,
+                               const float * inputs, const size_t num_rows,
+                               const size_t input_dim, float * outputs,
+                               const size_t output_dim)
+{
+  if (stale_ or model_path.size() >= MAX_PATH or meta_path.size() >= MAX_PATH
+      or num_rows * max(input_dim, output_dim) > MAX_FLOATS) {
+    return false;
+  }
+
+  Slot & slot = *slot_;
+  strcpy(slot.model_path, model_path.c_str());
+  strcpy(slot.meta_path, meta_path.c_str());
+  slot.num_rows = num_rows;
+  slot.input_dim = input_dim;
+  slot.output_dim = output_dim;
+  memcpy(slot.data, inputs, num_rows * input_dim * sizeof(float));
+
+  slot.state = REQUEST;
+  doorbell_->seq++;
+  futex_wake(doorbell_->seq);
+
+  /* the whole request, claimed or not, is bounded by the timeout, as the
+   * thread of an event loop is blocked meanwhile */
+  const uint64_t deadline_us = timestamp_us() + timeout_us_;
+  State state = wait(REQUEST, deadline_us);
+
+  if (state == REQUEST) {
+    /* withdraw the request, unless the daemon has just claimed it */
+    uint32_t expected = REQUEST;
+    if (slot.state.compare_exchange_strong(expected, IDLE)) {
+      give_up(REQUEST);
+      return false;
+    }
+    state = static_cast<State>(expected);
+  }
+
+  if (state == CLAIMED) {
+    state = wait(CLAIMED, deadline_us);
+    if (state == CLAIMED) {
+      give_up(CLAIMED);
+      return false;
+    }
+  }
+
+  if (state == RESPONSE) {
+    memcpy(outputs, slot.data, num_rows * output_dim * sizeof(float));
+  }
+
+  slot.state = IDLE;
+  return state == RESPONSE;
+}
+
+void InferenceChannel::give_up(const State state)
+{
+  retry_after_us_ = timestamp_us() + RETRY_INTERVAL_US;
+
+  /* the daemon is gone, or busy for longer than the timeout */
+  if (state == CLAIMED) {
+    cerr << "InferenceChannel: inference_daemon did not respond in time; "
+         << "evaluating models locally for a while" << endl;
+    stale_ = true;
+  }
+}
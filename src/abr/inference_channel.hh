@@ -0,0 +1,126 @@
+#ifndef INFERENCE_CHANNEL_HH
+#define INFERENCE_CHANNEL_HH
+
+#include <cstdint>
+#include <string>
+#include <memory>
+#include <atomic>
+
+#include "filesystem.hh"
+
+/* Forward passes of MLPs requested by the threads of the ws_media_servers
+ * on a host from inference_daemon, which loads each model once for all of
+ * them and evaluates the requests of all the processes that are pending at
+ * once in a single batch per model.
+ *
+ * In the directory shared with the daemon, each thread maps a file of its
+ * own, channel.<pid>.<tid>.<n>, with a single request/response slot (a
+ * thread waits for its forward pass, so it has at most one request in
+ * flight), and all of them map the doorbell file, whose sequence number is
+ * incremented on every request. The daemon waits on the doorbell and the
+ * thread on the state of its slot, both with futexes.
+ *
+ * A forward pass blocks its thread for up to the timeout. A request that
+ * is not answered by then is given up on, and the caller evaluates it
+ * locally and does so for the next RETRY_INTERVAL_US too; if the daemon had
+ * claimed it (and might have died, or might still write the response), the
+ * thread then moves on to a fresh slot file, which a restarted daemon
+ * picks up. */
+class InferenceChannel
+{
+public:
+  /* the states of a slot; the thread moves a slot from IDLE to REQUEST and
+   * from RESPONSE or FAILED back to IDLE, the daemon from REQUEST to CLAIMED
+   * and then to RESPONSE or FAILED */
+  enum State : uint32_t { IDLE, REQUEST, CLAIMED, RESPONSE, FAILED };
+
+  static constexpr size_t MAX_PATH = 256;
+  static constexpr size_t MAX_FLOATS = 1 << 20;  /* 4 MB of inputs */
+  static constexpr uint64_t RETRY_INTERVAL_US = 1000000;
+
+  struct Slot {
+    std::atomic<uint32_t> state;
+    uint32_t pid;  /* of the thread's process, to clean up after */
+
+    /* the model and the JSON of its input normalization (see MLP), if any */
+    char model_path[MAX_PATH];
+    char meta_path[MAX_PATH];
+
+    uint64_t num_rows;
+    uint64_t input_dim;
+    uint64_t output_dim;
+
+    /* the inputs of the request, overwritten by the outputs (logits) */
+    float data[MAX_FLOATS];
+  };
+
+  struct Doorbell {
+    std::atomic<uint32_t> seq;       /* incremented on every request */
+    std::atomic<uint32_t> channels;  /* incremented on every new channel */
+  };
+
+  static_assert(std::atomic<uint32_t>::is_always_lock_free,
+                "InferenceChannel requires lock-free atomics in shared memory");
+
+  /* send the requests of the threads of this process to the daemon serving
+   * dir, waiting up to timeout_us for each */
+  static void enable(const fs::path & dir, const uint64_t timeout_us);
+
+  /* the channel of this thread, created on first use; nullptr if not
+   * enabled, or backing off after an unanswered request or a failure to
+   * create the channel */
+  static InferenceChannel * get();
+
+  /* evaluate num_rows rows of input_dim inputs into output_dim outputs each
+   * with the model at model_path (meta_path: its normalization, or empty),
+   * waiting up to the timeout; false if the daemon did not answer in time,
+   * or failed to */
+  bool forward(const std::string & model_path, const std::string & meta_path,
+               const float * inputs, const size_t num_rows,
+               const size_t input_dim, float * outputs,
+               const size_t output_dim);
+
+  /* map the doorbell of dir, creating it if needed */
+  static std::shared_ptr<Doorbell> map_doorbell(const fs::path & dir);
+
+  /* map the slot of a channel file */
+  static std::shared_ptr<Slot> map_slot(const fs::path & path);
+
+  /* wake up the waiters of word, or wait until it is no longer value (or
+   * timeout_us has passed if not 0); might return spuriously */
+  static void futex_wake(std::atomic<uint32_t> & word);
+  static void futex_wait(std::atomic<uint32_t> & word, const uint32_t value,
+                         const uint64_t timeout_us);
+
+  /* the channel at dir/channel.<pid>.<tid>.<generation> */
+  InferenceChannel(const fs::path & dir, const uint64_t generation);
+  ~InferenceChannel();
+
+  /* forbid copying */
+  InferenceChannel(const InferenceChannel & other) = delete;
+  const InferenceChannel & operator=(const InferenceChannel & other) = delete;
+
+private:
+  fs::path path_ {};
+  std::shared_ptr<Doorbell> doorbell_ {};
+  std::shared_ptr<Slot> slot_ {};
+  uint64_t retry_after_us_ {0};  /* not to wait on a daemon that is down */
+
+  /* a request was given up on after the daemon claimed it, so the daemon
+   * might still write to the slot: replaced after the back-off */
+  bool stale_ {false};
+
+  /* give up on the request in the slot (in state) and back off */
+  void give_up(const State state);
+
+  /* wait until the slot is no longer in state or deadline_us has passed */
+  State wait(const State state, const uint64_t deadline_us);
+
+  static fs::path dir_;
+  static uint64_t timeout_us_;
+  static thread_local std::unique_ptr<InferenceChannel> channel_;
+  static thread_local uint64_t generation_;  /* of the next channel_ */
+  static thread_local uint64_t create_after_us_;  /* after failing to */
+};
+
+#endif /* INFERENCE_CHANNEL_HH */
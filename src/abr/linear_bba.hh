@@ -9,7 +9,7 @@ public:
   LinearBBA(const WebSocketClient & client,
             const std::string & abr_name, const YAML::Node & abr_config);
 
-  VideoFormat select_video_format() override;
+  size_t select_video_format() override;
 
 private:
   static constexpr double LOWER_RESERVOIR = 0.2;
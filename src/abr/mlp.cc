@@ -0,0 +1,237 @@
+#include "mlp.hh"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include "json.hpp"
+
+using namespace std;
+using json = nlohmann::json;
+
+/* eight floats, as a whole AVX register or two SSE registers; loaded and
+ * stored unaligned, as std::vector only aligns to alignof(float) */
+typedef float Vec __attribute__((vector_size(32), aligned(alignof(float))));
+static constexpr size_t VEC_WIDTH = 8;
+
+/* outputs[r] = weights^T * inputs[r] + biases for each of num_rows rows
+ * (and ReLU if relu), with inputs[r] at r * input_stride, weights in
+ * [num_inputs][stride] and outputs[r] at r * stride; the NumVecs vectors of
+ * outputs of a row are accumulated in registers, so NumVecs must be at
+ * most the number of vector registers, or 0 to accumulate any number of
+ * vectors in outputs */
+template <size_t NumVecs>
+__attribute__((always_inline))
+static inline void dense_rows(const float * __restrict inputs,
+                              const size_t num_rows,
+                              const size_t input_stride,
+                              const size_t num_inputs, const size_t stride,
+                              const float * __restrict weights,
+                              const float * __restrict biases,
+                              const bool relu, float * __restrict outputs)
+{
+  constexpr size_t max_vecs = NumVecs ? NumVecs : 1;
+  const size_t num_vecs = NumVecs ? NumVecs : stride / VEC_WIDTH;
+  const Vec * b = reinterpret_cast<const Vec *>(biases);
+  const Vec zero {};
+
+  for (size_t r = 0; r < num_rows; r++) {
+    const float * x = inputs + r * input_stride;
+    Vec * y = reinterpret_cast<Vec *>(outputs + r * stride);
+
+    Vec registers[max_vecs];
+    Vec * acc = NumVecs ? registers : y;
+
+    #pragma GCC unroll 8
+    for (size_t v = 0; v < num_vecs; v++) {
+      acc[v] = b[v];
+    }
+
+    for (size_t i = 0; i < num_inputs; i++) {
+      const float xi = x[i];
+      if (xi == 0) {
+        continue;
+      }
+
+      const Vec * w = reinterpret_cast<const Vec *>(weights + i * stride);
+      #pragma GCC unroll 8
+      for (size_t v = 0; v < num_vecs; v++) {
+        acc[v] += xi * w[v];
+      }
+    }
+
+    #pragma GCC unroll 8
+    for (size_t v = 0; v < num_vecs; v++) {
+      y[v] = relu ? (acc[v] > zero ? acc[v] : zero) : acc[v];
+    }
+  }
+}
+
+/* build a copy of dense() for each x86-64 level (AVX-512, AVX2 and FMA, or
+ * only SSE2), picked by the features of the CPU at load time */
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+#define MLP_TARGET_CLONES \
+  __attribute__((target_clones("arch=x86-64-v4", "arch=x86-64-v3", \
+                               "default")))
+#else
+#define MLP_TARGET_CLONES
+#endif
+
+/* dense_rows() with the accumulators in registers for the layer sizes of
+ * the TTP models (64 and 21 outputs) */
+MLP_TARGET_CLONES
+static void dense(const float * inputs, const size_t num_rows,
+                  const size_t input_stride, const size_t num_inputs,
+                  const size_t stride, const float * weights,
+                  const float * biases, const bool relu, float * outputs)
+{
+  switch (stride / VEC_WIDTH) {
+  case 1:
+    dense_rows<1>(inputs, num_rows, input_stride, num_inputs, stride,
+                  weights, biases, relu, outputs);
+    break;
+  case 2:
+    dense_rows<2>(inputs, num_rows, input_stride, num_inputs, stride,
+                  weights, biases, relu, outputs);
+    break;
+  case 3:
+    dense_rows<3>(inputs, num_rows, input_stride, num_inputs, stride,
+                  weights, biases, relu, outputs);
+    break;
+  case 4:
+    dense_rows<4>(inputs, num_rows, input_stride, num_inputs, stride,
+                  weights, biases, relu, outputs);
+    break;
+  case 8:
+    dense_rows<8>(inputs, num_rows, input_stride, num_inputs, stride,
+                  weights, biases, relu, outputs);
+    break;
+  default:
+    dense_rows<0>(inputs, num_rows, input_stride, num_inputs, stride,
+                  weights, biases, relu, outputs);
+  }
+}
+
+template <typename T>
+static T read_value(ifstream & ifs, const string & path)
+{
+  T value;
+  if (not ifs.read(reinterpret_cast<char *>(&value), sizeof(value))) {
+    throw runtime_error("MLP: " + path + " is truncated");
+  }
+  return value;
+}
+
+MLP::MLP(const string & path)
+{
+  ifstream ifs(path, ios::binary);
+  if (not ifs) {
+    throw runtime_error("MLP: cannot open " + path);
+  }
+
+  char magic[4];
+  if (not ifs.read(magic, sizeof(magic)) or memcmp(magic, "MLP1", 4) != 0) {
+    throw runtime_error("MLP: " + path + " is not an MLP1 file");
+  }
+
+  const uint32_t num_layers = read_value<uint32_t>(ifs, path);
+  if (num_layers == 0) {
+    throw runtime_error("MLP: " + path + " has no layers");
+  }
+
+  for (uint32_t l = 0; l < num_layers; l++) {
+    Layer layer;
+    layer.num_outputs = read_value<uint32_t>(ifs, path);
+    layer.num_inputs = read_value<uint32_t>(ifs, path);
+
+    if (l > 0 and layer.num_inputs != layers_.back().num_outputs) {
+      throw runtime_error("MLP: mismatched layer sizes in " + path);
+    }
+
+    layer.stride = (layer.num_outputs + VEC_WIDTH - 1) / VEC_WIDTH * VEC_WIDTH;
+
+    /* the padding of each row of weights and of the biases stays 0 */
+    layer.weights.resize(layer.num_inputs * layer.stride);
+    for (size_t o = 0; o < layer.num_outputs; o++) {
+      for (size_t i = 0; i < layer.num_inputs; i++) {
+        layer.weights[i * layer.stride + o] = read_value<float>(ifs, path);
+      }
+    }
+
+    layer.biases.resize(layer.stride);
+    for (size_t o = 0; o < layer.num_outputs; o++) {
+      layer.biases[o] = read_value<float>(ifs, path);
+    }
+
+    layers_.emplace_back(move(layer));
+  }
+}
+
+MLP::MLP(const string & path, const string & meta_path)
+  : MLP(path)
+{
+  ifstream ifs(meta_path);
+  if (not ifs) {
+    throw runtime_error("MLP: cannot open " + meta_path);
+  }
+
+  const json j = json::parse(ifs);
+  fold_normalization(j.at("obs_mean").get<vector<double>>(),
+                     j.at("obs_std").get<vector<double>>());
+}
+
+void MLP::fold_normalization(const vector<double> & mean,
+                             const vector<double> & std)
+{
+  Layer & layer = layers_.front();
+  if (mean.size() != layer.num_inputs or std.size() != layer.num_inputs) {
+    throw runtime_error("MLP: normalization does not match the inputs");
+  }
+
+  /* w * (x - mean) / std + b = (w / std) * x + (b - (w / std) * mean) */
+  for (size_t i = 0; i < layer.num_inputs; i++) {
+    float * w = layer.weights.data() + i * layer.stride;
+
+    for (size_t o = 0; o < layer.num_outputs; o++) {
+      double wi = w[o];
+      if (std[i] != 0) {
+        wi /= std[i];
+      }
+
+      w[o] = wi;
+      layer.biases[o] -= wi * mean[i];
+    }
+  }
+}
+
+void MLP::forward(const float * inputs, const size_t num_rows,
+                  float * outputs) const
+{
+  /* activations of each layer, with rows padded to the stride of the
+   * layer; reused across calls on a thread */
+  static thread_local vector<float> buffers[2];
+
+  const float * x = inputs;
+  size_t input_stride = input_dim();
+
+  for (size_t l = 0; l < layers_.size(); l++) {
+    const Layer & layer = layers_[l];
+    auto & buffer = buffers[l % 2];
+    buffer.resize(num_rows * layer.stride);
+
+    dense(x, num_rows, input_stride, layer.num_inputs, layer.stride,
+          layer.weights.data(), layer.biases.data(),
+          l + 1 < layers_.size(), buffer.data());
+
+    x = buffer.data();
+    input_stride = layer.stride;
+  }
+
+  /* strip the padding of the last layer */
+  for (size_t r = 0; r < num_rows; r++) {
+    copy(x + r * input_stride, x + r * input_stride + output_dim(),
+         outputs + r * output_dim());
+  }
+}
@@ -0,0 +1,54 @@
+#ifndef MLP_HH
+#define MLP_HH
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/* A multilayer perceptron of fully connected layers with ReLU in between,
+ * evaluated in single precision, e.g., a TTP model exported by
+ * scripts/export_ttp_mlp.py. Its file is little-endian:
+ *   "MLP1", uint32 number of layers, then for each layer
+ *   uint32 outputs, uint32 inputs, float32 weights[outputs][inputs],
+ *   float32 biases[outputs]
+ * i.e., the weights of each torch.nn.Linear in order. */
+class MLP
+{
+public:
+  explicit MLP(const std::string & path);
+
+  /* load the model at path and fold in the normalization in the JSON file
+   * meta_path ("obs_mean" and "obs_std", see scripts/export_ttp_mlp.py) */
+  MLP(const std::string & path, const std::string & meta_path);
+
+  size_t input_dim() const { return layers_.front().num_inputs; }
+  size_t output_dim() const { return layers_.back().num_outputs; }
+
+  /* fold the normalization of the inputs, (x - mean) / std, into the first
+   * layer so that it takes the raw inputs; an input whose std is 0 is only
+   * shifted by its mean, as when training */
+  void fold_normalization(const std::vector<double> & mean,
+                          const std::vector<double> & std);
+
+  /* evaluate num_rows rows of input_dim() inputs into output_dim() outputs
+   * each (the logits of the last layer) */
+  void forward(const float * inputs, const size_t num_rows,
+               float * outputs) const;
+
+private:
+  struct Layer
+  {
+    size_t num_inputs {0};
+    size_t num_outputs {0};
+    size_t stride {0};  /* num_outputs padded to a whole number of vectors */
+
+    /* transposed to [inputs][stride], so that each input is multiplied by a
+     * contiguous row of weights into all the outputs */
+    std::vector<float> weights {};
+    std::vector<float> biases {};
+  };
+
+  std::vector<Layer> layers_ {};
+};
+
+#endif /* MLP_HH */
@@ -1,8 +1,22 @@
 #include "mpc.hh"
 #include "ws_client.hh"
+#include "decision_cache.hh"
+#include "metrics.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
 
 using namespace std;
 
+thread_local double MPC::v_[2][MPC::MAX_NUM_FORMATS][MPC::MAX_DIS_BUF_LENGTH + 1];
+thread_local double MPC::unit_sending_time_[MPC::MAX_LOOKAHEAD_HORIZON + 1
+                                            + MPC::MAX_NUM_PAST_CHUNKS];
+thread_local double MPC::curr_ssims_[MPC::MAX_LOOKAHEAD_HORIZON + 1]
+                                    [MPC::MAX_NUM_FORMATS];
+thread_local double MPC::curr_sending_time_[MPC::MAX_LOOKAHEAD_HORIZON + 1]
+                                           [MPC::MAX_NUM_FORMATS];
+
 MPC::MPC(const WebSocketClient & client,
          const string & abr_name, const YAML::Node & abr_config)
   : ABRAlgo(client, abr_name)
@@ -26,12 +40,31 @@ MPC::MPC(const WebSocketClient & client,
     ssim_diff_coeff_ = abr_config["ssim_diff_coeff"].as<double>();
   }
 
+  if (abr_config["throughput_prior"]) {
+    use_throughput_prior_ = abr_config["throughput_prior"].as<bool>();
+  }
+
   if (abr_name_ == "robust_mpc") {
     is_robust_ = true;
   }
 
+  if (abr_config["prune_dominated"]) {
+    prune_dominated_ = abr_config["prune_dominated"].as<bool>();
+  }
+
+  if (abr_config["decision_cache"]) {
+    use_decision_cache_ = abr_config["decision_cache"].as<bool>();
+  }
+
+  /* clients share decisions only with the same parameters */
+  cache_id_ = abr_name_ + " " + to_string(max_lookahead_horizon_)
+              + " " + to_string(dis_buf_length_)
+              + " " + to_string(rebuffer_length_coeff_)
+              + " " + to_string(ssim_diff_coeff_);
+
   unit_buf_length_ = WebSocketClient::MAX_BUFFER_S / dis_buf_length_;
 
+  real_buffer_.resize(dis_buf_length_ + 1);
   for (size_t i = 0; i <= dis_buf_length_; i++) {
     real_buffer_[i] = i * unit_buf_length_;
   }
@@ -51,30 +84,67 @@ void MPC::video_chunk_acked(Chunk && c)
   }
 }
 
-VideoFormat MPC::select_video_format()
+size_t MPC::select_video_format()
 {
   reinit();
-  size_t ret_format = update_value(0, curr_buffer_, 0);
-  return client_.channel()->vformats()[ret_format];
+
+  const size_t format = use_decision_cache_ ? cached_decision() : solve_dp();
+  return candidate_vformats_.at(format);
 }
 
-void MPC::reinit()
+size_t MPC::cached_decision()
 {
-  curr_round_++;
+  DecisionCache & cache = DecisionCache::get(client_.channel()->name(),
+                                             cache_id_);
 
+  /* clients with different candidate formats do not share decisions */
+  uint64_t formats = 0;
+  for (const size_t format_idx : candidate_vformats_) {
+    formats |= uint64_t(1) << format_idx;
+  }
+
+  const DecisionCache::Key key {client_.next_vts().value(), formats,
+                                lookahead_horizon_, curr_buffer_,
+                                throughput_bucket_, curr_ssims_[0][0]};
+
+  if (const auto format = cache.lookup(key)) {
+    Metrics::record("abr_decision_cache_hit", 1);
+    return *format;
+  }
+
+  Metrics::record("abr_decision_cache_hit", 0);
+
+  const size_t format = solve_dp();
+  cache.insert(key, format);
+  return format;
+}
+
+optional<double> MPC::target_rate() const
+{
+  if (last_tp_pred_ > 0) {
+    return last_tp_pred_;
+  }
+
+  return nullopt;
+}
+
+void MPC::reinit()
+{
   const auto & channel = client_.channel();
   const auto & vformats = channel->vformats();
   const unsigned int vduration = channel->vduration();
   const uint64_t next_ts = client_.next_vts().value();
 
   chunk_length_ = (double) vduration / channel->timescale();
-  num_formats_ = vformats.size();
 
   /* initialization failed if there is no ready chunk ahead */
-  if (channel->vready_frontier().value() < next_ts || num_formats_ == 0) {
+  if (channel->vready_frontier().value() < next_ts || vformats.empty()) {
     throw runtime_error("no ready chunk ahead");
   }
 
+  const auto & formats = update_candidate_vformats(next_ts);
+  num_formats_ = formats.size();
+
   lookahead_horizon_ = min(
     max_lookahead_horizon_,
     (channel->vready_frontier().value() - next_ts) / vduration + 1);
@@ -88,16 +158,18 @@ void MPC::reinit()
     curr_ssims_[0][0] = ssim_db(past_chunks_.back().ssim);
   } else {
     is_init_ = true;
+    curr_ssims_[0][0] = 0;
   }
 
   for (size_t i = 1; i <= lookahead_horizon_; i++) {
     for (size_t j = 0; j < num_formats_; j++) {
       try {
         curr_ssims_[i][j] = ssim_db(
-            channel->vssim(vformats[j], next_ts + vduration * (i - 1)));
+            channel->vssim(formats[j], next_ts + vduration * (i - 1)));
       } catch (const exception & e) {
         cerr << "Error occurs when getting the ssim of "
-             << next_ts + vduration * (i - 1) << " " << vformats[j] << endl;
+             << next_ts + vduration * (i - 1) << " "
+             << vformats[formats[j]] << endl;
         curr_ssims_[i][j] = MIN_SSIM;
       }
     }
@@ -117,6 +189,9 @@ void MPC::reinit()
     max_err = 0;
   }
 
+  /* without acked chunks, the throughput of the subnet of the client */
+  const auto prior = num_past_chunks == 0 ? throughput_prior() : nullopt;
+
   for (size_t i = 1; i <= lookahead_horizon_; i++) {
     double tmp = 0;
     for (size_t j = 0; j < num_past_chunks; j++) {
@@ -131,75 +206,135 @@ void MPC::reinit()
       }
 
       unit_sending_time_[i + num_past_chunks] = unit_st * (1 + max_err);
+    } else if (prior) {
+      unit_sending_time_[i + num_past_chunks] =
+        (double) prior->trans_time / prior->size / 1000;
     } else {
       /* set the sending time to be a default hight value */
       unit_sending_time_[i + num_past_chunks] = HIGH_SENDING_TIME;
     }
 
-    const auto & data_map = channel->vdata(next_ts + vduration * (i - 1));
+    /* with the decision cache, the whole horizon takes the bucket of the
+     * prediction for the next chunk */
+    if (use_decision_cache_) {
+      if (i == 1) {
+        const double unit_st = max(unit_sending_time_[1 + num_past_chunks],
+                                   numeric_limits<double>::min());
+        throughput_bucket_ = llround(log(unit_st)
+                                     / log1p(THROUGHPUT_BUCKET_WIDTH));
+      }
+
+      unit_sending_time_[i + num_past_chunks] =
+        exp(throughput_bucket_ * log1p(THROUGHPUT_BUCKET_WIDTH));
+    }
 
     for (size_t j = 0; j < num_formats_; j++) {
       try {
-        curr_sending_time_[i][j] = get<1>(data_map.at(vformats[j]))
-                                   * unit_sending_time_[i + num_past_chunks];
+        curr_sending_time_[i][j] =
+            channel->vsize(formats[j], next_ts + vduration * (i - 1))
+            * unit_sending_time_[i + num_past_chunks];
       } catch (const exception & e) {
         cerr << "Error occurs when getting the video size of "
-             << next_ts + vduration * (i - 1) << " " << vformats[j] << endl;
+             << next_ts + vduration * (i - 1) << " "
+             << vformats[formats[j]] << endl;
         curr_sending_time_[i][j] = HIGH_SENDING_TIME;
       }
     }
   }
 }
 
-size_t MPC::update_value(size_t i, size_t curr_buffer, size_t curr_format)
+size_t MPC::solve_dp()
+{
+  /* the kernels for the numbers of formats of our channels, with the
+   * default discretization of the buffer */
+  if (dis_buf_length_ == MAX_DIS_BUF_LENGTH) {
+    constexpr size_t num_buffers = MAX_DIS_BUF_LENGTH + 1;
+
+    switch (num_formats_) {
+    case 10:
+      return solve_dp_kernel<10, num_buffers>();
+    default:
+      break;
+    }
+  }
+
+  return solve_dp_kernel<0, 0>();
+}
+
+template <size_t NumFormats, size_t NumBuffers>
+size_t MPC::solve_dp_kernel()
 {
-  flag_[i][curr_buffer][curr_format] = curr_round_;
+  /* the dimensions given as 0 are only known at runtime */
+  const size_t num_formats = NumFormats ? NumFormats : num_formats_;
+  const size_t num_buffers = NumBuffers ? NumBuffers : dis_buf_length_ + 1;
+  const size_t horizon = lookahead_horizon_;
+
+  /* the value of the last step is the ssim of its chunk */
+  for (size_t f = 0; f < num_formats; f++) {
+    for (size_t b = 0; b < num_buffers; b++) {
+      v_[horizon % 2][f][b] = curr_ssims_[horizon][f];
+    }
+  }
+
+  /* steps in between: compute the values of all buffer lengths at once, so
+   * the innermost loops run over contiguous buffer lengths */
+  double future[MAX_DIS_BUF_LENGTH + 1];
+
+  for (size_t i = horizon - 1; i >= 1; i--) {
+    const auto & next_v = v_[(i + 1) % 2];
+    auto & curr_v = v_[i % 2];
+
+    for (size_t f = 0; f < num_formats; f++) {
+      fill(curr_v[f], curr_v[f] + num_buffers,
+           numeric_limits<double>::lowest());
+    }
+
+    for (size_t nf = 0; nf < num_formats; nf++) {
+      for (size_t b = 0; b < num_buffers; b++) {
+        future[b] = future_value(i, b, nf, next_v[nf]);
+      }
+
+      for (size_t f = 0; f < num_formats; f++) {
+        const double ssim_value = curr_ssims_[i][f] - ssim_diff_coeff_
+                                  * fabs(curr_ssims_[i][f] - curr_ssims_[i + 1][nf]);
 
-  if (i == lookahead_horizon_) {
-    v_[i][curr_buffer][curr_format] = curr_ssims_[i][curr_format];
-    return 0;
+        for (size_t b = 0; b < num_buffers; b++) {
+          curr_v[f][b] = max(curr_v[f][b], ssim_value + future[b]);
+        }
+      }
+    }
   }
 
-  size_t best_next_format = num_formats_;
+  /* the first step only has the current state */
+  size_t best_next_format = num_formats;
   double max_qvalue = 0;
-  for (size_t next_format = 0; next_format < num_formats_; next_format++) {
-    double qvalue = get_qvalue(i, curr_buffer, curr_format, next_format);
-    if (best_next_format == num_formats_ or qvalue > max_qvalue) {
+
+  for (size_t nf = 0; nf < num_formats; nf++) {
+    double qvalue = curr_ssims_[0][0]
+                    + future_value(0, curr_buffer_, nf, v_[1][nf]);
+    if (not is_init_) {
+      qvalue -= ssim_diff_coeff_ * fabs(curr_ssims_[0][0] - curr_ssims_[1][nf]);
+    }
+
+    if (best_next_format == num_formats or qvalue > max_qvalue) {
       max_qvalue = qvalue;
-      best_next_format = next_format;
+      best_next_format = nf;
     }
   }
-  v_[i][curr_buffer][curr_format] = max_qvalue;
 
   return best_next_format;
 }
 
-double MPC::get_qvalue(size_t i, size_t curr_buffer, size_t curr_format,
-                       size_t next_format)
+double MPC::future_value(size_t i, size_t curr_buffer, size_t next_format,
+                         const double * next_value)
 {
   double real_rebuffer = curr_sending_time_[i + 1][next_format]
                          - real_buffer_[curr_buffer];
   size_t next_buffer = discretize_buffer(max(0.0, -real_rebuffer) + chunk_length_);
   next_buffer = min(next_buffer, dis_buf_length_);
 
-  if (is_init_ and i == 0) {
-    return curr_ssims_[i][curr_format]
-           - rebuffer_length_coeff_ * max(0.0, real_rebuffer)
-           + get_value(i + 1, next_buffer, next_format);
-  }
-  return curr_ssims_[i][curr_format]
-         - ssim_diff_coeff_ * fabs(curr_ssims_[i][curr_format]
-                                   - curr_ssims_[i + 1][next_format])
-         - rebuffer_length_coeff_ * max(0.0, real_rebuffer)
-         + get_value(i + 1, next_buffer, next_format);
-}
-
-double MPC::get_value(size_t i, size_t curr_buffer, size_t curr_format)
-{
-  if (flag_[i][curr_buffer][curr_format] != curr_round_) {
-    update_value(i, curr_buffer, curr_format);
-  }
-  return v_[i][curr_buffer][curr_format];
+  return next_value[next_buffer]
+         - rebuffer_length_coeff_ * max(0.0, real_rebuffer);
 }
 
 size_t MPC::discretize_buffer(double buf)
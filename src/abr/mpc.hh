@@ -4,6 +4,7 @@
 #include "abr_algo.hh"
 
 #include <deque>
+#include <vector>
 
 class MPC : public ABRAlgo
 {
@@ -12,7 +13,8 @@ public:
       const std::string & abr_name, const YAML::Node & abr_config);
 
   void video_chunk_acked(Chunk && c) override;
-  VideoFormat select_video_format() override;
+  size_t select_video_format() override;
+  std::optional<double> target_rate() const override;
 
 private:
   static constexpr size_t MAX_NUM_PAST_CHUNKS = 5;
@@ -23,6 +25,10 @@ private:
   static constexpr size_t MAX_NUM_FORMATS = 20;
   static constexpr double HIGH_SENDING_TIME = 10000;
 
+  /* relative width of the buckets of the predicted throughput that share
+   * the decisions of the decision cache */
+  static constexpr double THROUGHPUT_BUCKET_WIDTH = 0.05;
+
   /* past chunks and max number of them */
   struct ChunkInfo {
     double ssim;          /* chunk ssim */
@@ -47,42 +53,63 @@ private:
   bool is_robust_ {false};
   double last_tp_pred_ {-1};
 
+  /* whether to share decisions with the clients of the thread that are in
+   * the same state; the predicted throughput is then quantized and held
+   * over the horizon, so that the decision is a function of the state */
+  bool use_decision_cache_ {false};
+
+  /* name of the algorithm and its parameters in the decision cache */
+  std::string cache_id_ {};
+
+  /* bucket of the predicted throughput of the next chunk */
+  int64_t throughput_bucket_ {};
+
   /* whether the current chunk is the first chunk */
   bool is_init_ {};
 
   /* for the current buffer length */
   size_t curr_buffer_ {};
 
-  /* for storing the value function */
-  uint64_t flag_[MAX_LOOKAHEAD_HORIZON + 1][MAX_DIS_BUF_LENGTH + 1][MAX_NUM_FORMATS] {};
-  double v_[MAX_LOOKAHEAD_HORIZON + 1][MAX_DIS_BUF_LENGTH + 1][MAX_NUM_FORMATS] {};
+  /* map the discretized buffer length to the estimation */
+  std::vector<double> real_buffer_ {};
 
-  /* record the current round of DP */
-  uint64_t curr_round_ {};
+  /* the tables below are shared by the instances on a thread rather than
+   * held by each client: they are all filled by reinit() and used by
+   * solve_dp(), which run to completion within select_video_format() */
 
-  /* map the discretized buffer length to the estimation */
-  double real_buffer_[MAX_DIS_BUF_LENGTH + 1] {};
+  /* for storing the value function of steps i and i + 1 of the DP, indexed
+   * by [i % 2][format][buffer] */
+  static thread_local double v_[2][MAX_NUM_FORMATS][MAX_DIS_BUF_LENGTH + 1];
 
   /* unit sending time estimation */
-  double unit_sending_time_[MAX_LOOKAHEAD_HORIZON + 1 + MAX_NUM_PAST_CHUNKS] {};
+  static thread_local double unit_sending_time_[MAX_LOOKAHEAD_HORIZON + 1
+                                                + MAX_NUM_PAST_CHUNKS];
 
   /* the ssim of the chunk given the timestamp and format */
-  double curr_ssims_[MAX_LOOKAHEAD_HORIZON + 1][MAX_NUM_FORMATS] {};
+  static thread_local double curr_ssims_[MAX_LOOKAHEAD_HORIZON + 1][MAX_NUM_FORMATS];
 
   /* the estimation of sending time given the timestamp and format */
-  double curr_sending_time_[MAX_LOOKAHEAD_HORIZON + 1][MAX_NUM_FORMATS] {};
+  static thread_local double curr_sending_time_[MAX_LOOKAHEAD_HORIZON + 1]
+                                               [MAX_NUM_FORMATS];
 
   void reinit();
 
-  /* calculate the value of corresponding state and return the best strategy */
-  size_t update_value(size_t i, size_t curr_buffer, size_t curr_format);
+  /* the format of the next chunk from the decision cache, or solve_dp() */
+  size_t cached_decision();
+
+  /* solve the DP bottom-up and return the best format of the next chunk */
+  size_t solve_dp();
 
-  /* return the qvalue of the given cur state and next action */
-  double get_qvalue(size_t i, size_t curr_buffer, size_t curr_format,
-                    size_t next_format);
+  /* solve_dp() with the numbers of formats and buffer lengths fixed at
+   * compile time so that its loops are unrolled and vectorized; a dimension
+   * of 0 is taken from the members at runtime instead */
+  template <size_t NumFormats, size_t NumBuffers>
+  size_t solve_dp_kernel();
 
-  /* return the value of the given state */
-  double get_value(size_t i, size_t curr_buffer, size_t curr_format);
+  /* value of sending next_format at step i + 1 with curr_buffer, excluding
+   * the ssim terms that only depend on the formats */
+  double future_value(size_t i, size_t curr_buffer, size_t next_format,
+                      const double * next_value);
 
   /* discretize the buffer length */
   size_t discretize_buffer(double buf);
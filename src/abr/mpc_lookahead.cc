@@ -0,0 +1,192 @@
+#include "mpc_lookahead.hh"
+#include "timestamp.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+using namespace std;
+
+thread_local double MPCLookahead::ssims_[MPCLookahead::MAX_HORIZON + 1]
+                                        [MPCLookahead::MAX_NUM_FORMATS];
+thread_local double MPCLookahead::sending_times_[MPCLookahead::MAX_HORIZON + 1]
+                                                [MPCLookahead::MAX_NUM_FORMATS];
+thread_local double MPCLookahead::max_ssim_suffix_[
+  MPCLookahead::MAX_HORIZON + 2];
+
+MPCLookahead::MPCLookahead(const double rebuffer_length_coeff,
+                           const double ssim_diff_coeff, const bool prune,
+                           const double max_buffer_s,
+                           const double unit_buf_length,
+                           const size_t max_search_nodes,
+                           const uint64_t max_search_us)
+  : rebuffer_length_coeff_(rebuffer_length_coeff),
+    ssim_diff_coeff_(ssim_diff_coeff), prune_(prune),
+    max_buffer_s_(max_buffer_s), unit_buf_length_(unit_buf_length),
+    max_search_nodes_(max_search_nodes), max_search_us_(max_search_us)
+{}
+
+void MPCLookahead::reset(const size_t horizon, const size_t num_formats,
+                         const double chunk_length, const bool is_init)
+{
+  horizon_ = horizon;
+  num_formats_ = num_formats;
+  chunk_length_ = chunk_length;
+  is_init_ = is_init;
+
+  num_nodes_ = 0;
+  out_of_budget_ = false;
+  if (max_search_us_ > 0) {
+    deadline_us_ = timestamp_us() + max_search_us_;
+  }
+}
+
+size_t MPCLookahead::search(const double curr_buffer,
+                            const size_t first_format)
+{
+  max_ssim_suffix_[horizon_ + 1] = 0;
+  for (size_t i = horizon_; i >= 1; i--) {
+    max_ssim_suffix_[i] = max_ssim_suffix_[i + 1]
+      + *max_element(ssims_[i], ssims_[i] + num_formats_);
+  }
+
+  size_t order[MAX_NUM_FORMATS];
+  search_order(min(first_format, num_formats_ - 1), order);
+
+  size_t best_next_format = num_formats_;
+  double max_qvalue = 0;
+  for (size_t k = 0; k < num_formats_; k++) {
+    const size_t next_format = order[k];
+
+    double next_buffer;
+    const double reward = get_reward(0, curr_buffer, 0, next_format,
+                                     next_buffer);
+    const double lower = best_next_format == num_formats_ ?
+                         -numeric_limits<double>::infinity() : max_qvalue;
+
+    if (prune_ and reward + ssims_[1][next_format]
+                   + max_ssim_suffix_[2] <= lower) {
+      continue;
+    }
+
+    double qvalue = reward + get_value(1, next_buffer, next_format,
+                                       lower - reward);
+    if (best_next_format == num_formats_ or qvalue > max_qvalue) {
+      max_qvalue = qvalue;
+      best_next_format = next_format;
+    }
+  }
+
+  value_ = max_qvalue;
+  return best_next_format;
+}
+
+double MPCLookahead::get_reward(size_t i, double curr_buffer,
+                                size_t curr_format, size_t next_format,
+                                double & next_buffer) const
+{
+  double real_rebuffer = sending_times_[i + 1][next_format] - curr_buffer;
+  next_buffer = min(max_buffer_s_, max(0.0, -real_rebuffer) + chunk_length_);
+  if (unit_buf_length_ > 0) {
+    next_buffer = discretize_buffer(next_buffer);
+  }
+
+  if (is_init_ and i == 0) {
+    return ssims_[i][curr_format]
+           - rebuffer_length_coeff_ * max(0.0, real_rebuffer);
+  }
+  return ssims_[i][curr_format]
+         - ssim_diff_coeff_ * fabs(ssims_[i][curr_format]
+                                   - ssims_[i + 1][next_format])
+         - rebuffer_length_coeff_ * max(0.0, real_rebuffer);
+}
+
+double MPCLookahead::get_value(size_t i, double curr_buffer,
+                               size_t curr_format, double lower)
+{
+  if (i == horizon_) {
+    return ssims_[i][curr_format];
+  }
+
+  if (out_of_budget()) {
+    return get_stay_value(i, curr_buffer, curr_format);
+  }
+  num_nodes_++;
+
+  size_t order[MAX_NUM_FORMATS];
+  search_order(curr_format, order);
+
+  double max_qvalue = -numeric_limits<double>::infinity();
+  for (size_t k = 0; k < num_formats_; k++) {
+    const size_t next_format = order[k];
+
+    double next_buffer;
+    const double reward = get_reward(i, curr_buffer, curr_format, next_format,
+                                     next_buffer);
+    const double bound = max(max_qvalue, lower);
+
+    /* even the best of the chunks left cannot beat bound */
+    if (prune_ and reward + ssims_[i + 1][next_format]
+                   + max_ssim_suffix_[i + 2] <= bound) {
+      continue;
+    }
+
+    max_qvalue = max(max_qvalue,
+                     reward + get_value(i + 1, next_buffer, next_format,
+                                        bound - reward));
+  }
+
+  /* -infinity if every branch was cut: returning lower instead would let
+   * the rounding of (lower - reward) + reward pass off the state as better
+   * than the one that set lower */
+  return max_qvalue;
+}
+
+double MPCLookahead::get_stay_value(size_t i, double curr_buffer,
+                                    size_t curr_format) const
+{
+  double value = 0;
+  for (; i < horizon_; i++) {
+    double next_buffer;
+    value += get_reward(i, curr_buffer, curr_format, curr_format,
+                        next_buffer);
+    curr_buffer = next_buffer;
+  }
+  return value + ssims_[horizon_][curr_format];
+}
+
+bool MPCLookahead::out_of_budget()
+{
+  if (out_of_budget_) {
+    return true;
+  }
+
+  /* read the clock only every so often */
+  if ((max_search_nodes_ > 0 and num_nodes_ >= max_search_nodes_) or
+      (max_search_us_ > 0 and num_nodes_ % 64 == 63 and
+       timestamp_us() >= deadline_us_)) {
+    out_of_budget_ = true;
+  }
+  return out_of_budget_;
+}
+
+void MPCLookahead::search_order(size_t first, size_t * order) const
+{
+  /* first, then first + 1, first - 1, first + 2, ... */
+  size_t k = 0;
+  order[k++] = first;
+  for (size_t d = 1; k < num_formats_; d++) {
+    if (first + d < num_formats_) {
+      order[k++] = first + d;
+    }
+    if (d <= first) {
+      order[k++] = first - d;
+    }
+  }
+}
+
+double MPCLookahead::discretize_buffer(const double buf) const
+{
+  size_t dis_buf = (buf + unit_buf_length_ * 0.5) / unit_buf_length_;
+  return dis_buf * unit_buf_length_;
+}
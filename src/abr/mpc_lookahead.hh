@@ -0,0 +1,113 @@
+#ifndef MPC_LOOKAHEAD_HH
+#define MPC_LOOKAHEAD_HH
+
+#include <cstddef>
+#include <cstdint>
+
+/* The search of MPCSearch: given the SSIM and the estimated sending time of
+ * each format of the chunks over the horizon, the format of the next chunk
+ * whose path maximizes the SSIM less the penalties for switching and for
+ * rebuffering.
+ *
+ * The search is branch-and-bound if prune: a branch is cut once even the
+ * highest SSIM at every chunk left, with no switches or rebuffering, cannot
+ * beat the best value found, which only holds with nonnegative
+ * coefficients. It starts from the previous decision (and at each chunk,
+ * from staying on the format), so that a good value is found early. */
+class MPCLookahead
+{
+public:
+  static constexpr size_t MAX_HORIZON = 10;
+  static constexpr size_t MAX_NUM_FORMATS = 20;
+
+  /* unit_buf_length: the length the buffer is discretized to, if not 0;
+   * max_search_nodes and max_search_us: expand at most that many states
+   * and spend at most that long per decision (0: no limit); beyond either,
+   * the states left are valued as staying on their format to the end of
+   * the horizon, and the best decision so far is taken */
+  MPCLookahead(const double rebuffer_length_coeff,
+               const double ssim_diff_coeff, const bool prune,
+               const double max_buffer_s, const double unit_buf_length,
+               const size_t max_search_nodes, const uint64_t max_search_us);
+
+  /* start a decision over horizon chunks of num_formats formats each; is_init
+   * if no chunk has been played yet, so that the first has no switch */
+  void reset(const size_t horizon, const size_t num_formats,
+             const double chunk_length, const bool is_init);
+
+  /* the SSIM (dB) of format of chunk i, 1 to horizon; (0, 0) is the SSIM
+   * of the last chunk sent */
+  double & ssim(const size_t i, const size_t format)
+  { return ssims_[i][format]; }
+
+  /* the estimated sending time (s) of format of chunk i, 1 to horizon */
+  double & sending_time(const size_t i, const size_t format)
+  { return sending_times_[i][format]; }
+
+  /* the format for chunk 1 with curr_buffer (s), searched from
+   * first_format on; call after filling the tables */
+  size_t search(const double curr_buffer, const size_t first_format);
+
+  /* the value of the decision of the last search */
+  double value() const { return value_; }
+
+  /* the states expanded by the last search */
+  size_t num_nodes() const { return num_nodes_; }
+
+  /* discretize the buffer length */
+  double discretize_buffer(const double buf) const;
+
+private:
+  double rebuffer_length_coeff_;
+  double ssim_diff_coeff_;
+  bool prune_;
+  double max_buffer_s_;
+  double unit_buf_length_;
+  size_t max_search_nodes_;
+  uint64_t max_search_us_;
+
+  size_t horizon_ {0};
+  size_t num_formats_ {0};
+  double chunk_length_ {0};
+  bool is_init_ {false};
+
+  double value_ {0};
+  size_t num_nodes_ {0};
+  uint64_t deadline_us_ {0};
+  bool out_of_budget_ {false};
+
+  /* as in MPC, the tables below are shared by the instances on a thread
+   * since they are filled and used within a decision */
+
+  /* the ssim of the chunk given the timestamp and format */
+  static thread_local double ssims_[MAX_HORIZON + 1][MAX_NUM_FORMATS];
+
+  /* the estimation of sending time given the timestamp and format */
+  static thread_local double sending_times_[MAX_HORIZON + 1][MAX_NUM_FORMATS];
+
+  /* the sum of the highest SSIM of the chunks from the timestamp on */
+  static thread_local double max_ssim_suffix_[MAX_HORIZON + 2];
+
+  /* return the reward of the given cur state and next action, i.e., its
+   * qvalue without the value of the next state, which it sets next_buffer
+   * to the buffer of */
+  double get_reward(size_t i, double curr_buffer, size_t curr_format,
+                    size_t next_format, double & next_buffer) const;
+
+  /* return the value of the given state, or if it cannot exceed lower, the
+   * value of a path from it that does not either (or -infinity) */
+  double get_value(size_t i, double curr_buffer, size_t curr_format,
+                   double lower);
+
+  /* return the value of staying on curr_format from the given state */
+  double get_stay_value(size_t i, double curr_buffer,
+                        size_t curr_format) const;
+
+  /* whether the budget of the decision is spent */
+  bool out_of_budget();
+
+  /* fill order with the formats to search, from first outwards */
+  void search_order(size_t first, size_t * order) const;
+};
+
+#endif /* MPC_LOOKAHEAD_HH */
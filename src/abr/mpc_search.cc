@@ -1,8 +1,12 @@
 #include "mpc_search.hh"
 #include "ws_client.hh"
+#include "diag_log.hh"
 
 using namespace std;
 
+thread_local double MPCSearch::unit_sending_time_[
+  MPCSearch::MAX_LOOKAHEAD_HORIZON + 1 + MPCSearch::MAX_NUM_PAST_CHUNKS];
+
 MPCSearch::MPCSearch(const WebSocketClient & client,
                      const string & abr_name, const YAML::Node & abr_config)
   : ABRAlgo(client, abr_name)
@@ -27,12 +31,30 @@ MPCSearch::MPCSearch(const WebSocketClient & client,
     ssim_diff_coeff_ = abr_config["ssim_diff_coeff"].as<double>();
   }
 
+  if (abr_config["throughput_prior"]) {
+    use_throughput_prior_ = abr_config["throughput_prior"].as<bool>();
+  }
+
+  if (abr_config["max_search_nodes"]) {
+    max_search_nodes_ = abr_config["max_search_nodes"].as<size_t>();
+  }
+
+  if (abr_config["max_search_us"]) {
+    max_search_us_ = abr_config["max_search_us"].as<uint64_t>();
+  }
+
   if (is_discrete_buf_) {
     unit_buf_length_ = WebSocketClient::MAX_BUFFER_S / dis_buf_length_;
+    real_buffer_.resize(dis_buf_length_ + 1);
     for (size_t i = 0; i <= dis_buf_length_; i++) {
       real_buffer_[i] = i * unit_buf_length_;
     }
   }
+
+  lookahead_.emplace(rebuffer_length_coeff_, ssim_diff_coeff_,
+                     rebuffer_length_coeff_ >= 0 and ssim_diff_coeff_ >= 0,
+                     WebSocketClient::MAX_BUFFER_S, unit_buf_length_,
+                     max_search_nodes_, max_search_us_);
 }
 
 void MPCSearch::video_chunk_acked(Chunk && c)
@@ -43,20 +65,21 @@ void MPCSearch::video_chunk_acked(Chunk && c)
   }
 }
 
-VideoFormat MPCSearch::select_video_format()
+size_t MPCSearch::select_video_format()
 {
   reinit();
 
-  size_t best_next_format = num_formats_;
-  double max_qvalue = 0;
-  for (size_t next_format = 0; next_format < num_formats_; next_format++) {
-    double qvalue = get_qvalue(0, curr_buffer_, 0, next_format);
-    if (best_next_format == num_formats_ or qvalue > max_qvalue) {
-      max_qvalue = qvalue;
-      best_next_format = next_format;
-    }
+  last_format_ = lookahead_->search(curr_buffer_, last_format_);
+  return last_format_;
+}
+
+optional<double> MPCSearch::target_rate() const
+{
+  if (tp_pred_ > 0) {
+    return tp_pred_;
   }
-  return client_.channel()->vformats()[best_next_format];
+
+  return nullopt;
 }
 
 void MPCSearch::reinit()
@@ -81,31 +104,29 @@ void MPCSearch::reinit()
   curr_buffer_ = min(WebSocketClient::MAX_BUFFER_S,
                      client_.video_playback_buf());
   if (is_discrete_buf_) {
-    curr_buffer_ = discretize_buffer(curr_buffer_);
+    curr_buffer_ = lookahead_->discretize_buffer(curr_buffer_);
   }
 
-  /* init curr_ssims */
-  if (past_chunks_.size() > 0) {
-    is_init_ = false;
-    curr_ssims_[0][0] = ssim_db(past_chunks_.back().ssim);
-  } else {
-    is_init_ = true;
-  }
+  is_init_ = past_chunks_.empty();
+  lookahead_->reset(lookahead_horizon_, num_formats_, chunk_length_, is_init_);
+
+  /* init the ssims */
+  lookahead_->ssim(0, 0) = is_init_ ? 0 : ssim_db(past_chunks_.back().ssim);
 
   for (size_t i = 1; i <= lookahead_horizon_; i++) {
     for (size_t j = 0; j < num_formats_; j++) {
       try {
-        curr_ssims_[i][j] = ssim_db(
-            channel->vssim(vformats[j], next_ts + vduration * (i - 1)));
+        lookahead_->ssim(i, j) = ssim_db(
+            channel->vssim(j, next_ts + vduration * (i - 1)));
       } catch (const exception & e) {
-        cerr << "Error occurs when getting the ssim of "
-             << next_ts + vduration * (i - 1) << " " << vformats[j] << endl;
-        curr_ssims_[i][j] = MIN_SSIM;
+        DIAG(Error) << "Error occurs when getting the ssim of "
+                    << next_ts + vduration * (i - 1) << " " << vformats[j];
+        lookahead_->ssim(i, j) = MIN_SSIM;
       }
     }
   }
 
-  /* init curr_sending_time */
+  /* init the sending times */
   size_t num_past_chunks = past_chunks_.size();
 
   auto it = past_chunks_.begin();
@@ -113,6 +134,9 @@ void MPCSearch::reinit()
     unit_sending_time_[i] = (double) it->trans_time / it->size / 1000;
   }
 
+  /* without acked chunks, the throughput of the subnet of the client */
+  const auto prior = num_past_chunks == 0 ? throughput_prior() : nullopt;
+
   for (size_t i = 1; i <= lookahead_horizon_; i++) {
     double tmp = 0;
     for (size_t j = 0; j < num_past_chunks; j++) {
@@ -121,67 +145,28 @@ void MPCSearch::reinit()
 
     if (num_past_chunks != 0) {
       unit_sending_time_[i + num_past_chunks] = tmp / num_past_chunks;
+
+      if (i == 1) {
+        tp_pred_ = num_past_chunks / tmp;
+      }
+    } else if (prior) {
+      unit_sending_time_[i + num_past_chunks] =
+        (double) prior->trans_time / prior->size / 1000;
     } else {
       /* set the sending time to be a default hight value */
       unit_sending_time_[i + num_past_chunks] = HIGH_SENDING_TIME;
     }
 
-    const auto & data_map = channel->vdata(next_ts + vduration * (i - 1));
-
     for (size_t j = 0; j < num_formats_; j++) {
       try {
-        curr_sending_time_[i][j] = get<1>(data_map.at(vformats[j]))
-                                   * unit_sending_time_[i + num_past_chunks];
+        lookahead_->sending_time(i, j) =
+            channel->vsize(j, next_ts + vduration * (i - 1))
+            * unit_sending_time_[i + num_past_chunks];
       } catch (const exception & e) {
-        cerr << "Error occurs when getting the video size of "
-             << next_ts + vduration * (i - 1) << " " << vformats[j] << endl;
-        curr_sending_time_[i][j] = HIGH_SENDING_TIME;
+        DIAG(Error) << "Error occurs when getting the video size of "
+                    << next_ts + vduration * (i - 1) << " " << vformats[j];
+        lookahead_->sending_time(i, j) = HIGH_SENDING_TIME;
       }
     }
   }
 }
-
-double MPCSearch::get_qvalue(size_t i, double curr_buffer, size_t curr_format,
-                             size_t next_format)
-{
-  double real_rebuffer = curr_sending_time_[i + 1][next_format] - curr_buffer;
-  double next_buffer = min(WebSocketClient::MAX_BUFFER_S,
-                           max(0.0, -real_rebuffer) + chunk_length_);
-  if (is_discrete_buf_) {
-    next_buffer = discretize_buffer(next_buffer);
-  }
-
-  if (is_init_ and i == 0) {
-    return curr_ssims_[i][curr_format]
-           - rebuffer_length_coeff_ * max(0.0, real_rebuffer)
-           + get_value(i + 1, next_buffer, next_format);
-  }
-  return curr_ssims_[i][curr_format]
-         - ssim_diff_coeff_ * fabs(curr_ssims_[i][curr_format]
-                                   - curr_ssims_[i + 1][next_format])
-         - rebuffer_length_coeff_ * max(0.0, real_rebuffer)
-         + get_value(i + 1, next_buffer, next_format);
-}
-
-double MPCSearch::get_value(size_t i, double curr_buffer, size_t curr_format)
-{
-  if (i == lookahead_horizon_) {
-    return curr_ssims_[i][curr_format];
-  }
-
-  double max_qvalue = 0;
-  for (size_t next_format = 0; next_format < num_formats_; next_format++) {
-    double qvalue = get_qvalue(i, curr_buffer, curr_format, next_format);
-    if (next_format == 0) {
-      max_qvalue = qvalue;
-    }
-    max_qvalue = max(max_qvalue, qvalue);
-  }
-  return max_qvalue;
-}
-
-double MPCSearch::discretize_buffer(double buf)
-{
-  size_t dis_buf = (buf + unit_buf_length_ * 0.5) / unit_buf_length_;
-  return dis_buf * unit_buf_length_;
-}
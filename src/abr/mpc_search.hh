@@ -2,8 +2,11 @@
 #define MPCSearch_HH
 
 #include "abr_algo.hh"
+#include "mpc_lookahead.hh"
 
 #include <deque>
+#include <optional>
+#include <vector>
 
 class MPCSearch : public ABRAlgo
 {
@@ -12,15 +15,15 @@ public:
             const std::string & abr_name, const YAML::Node & abr_config);
 
   void video_chunk_acked(Chunk && c) override;
-  VideoFormat select_video_format() override;
+  size_t select_video_format() override;
+  std::optional<double> target_rate() const override;
 
 private:
   static constexpr size_t MAX_NUM_PAST_CHUNKS = 5;
-  static constexpr size_t MAX_LOOKAHEAD_HORIZON = 10;
+  static constexpr size_t MAX_LOOKAHEAD_HORIZON = MPCLookahead::MAX_HORIZON;
   static constexpr size_t MAX_DIS_BUF_LENGTH = 100;
   static constexpr double REBUFFER_LENGTH_COEFF = 20;
   static constexpr double SSIM_DIFF_COEFF = 1;
-  static constexpr size_t MAX_NUM_FORMATS = 20;
   static constexpr double HIGH_SENDING_TIME = 10000;
 
   /* past chunks and max number of them */
@@ -38,6 +41,16 @@ private:
   double rebuffer_length_coeff_ {REBUFFER_LENGTH_COEFF};
   double ssim_diff_coeff_ {SSIM_DIFF_COEFF};
 
+  /* throughput predicted for the next chunk (bytes/s); -1 if none */
+  double tp_pred_ {-1};
+
+  /* see MPCLookahead; pruning is on with nonnegative coefficients, and the
+   * search starts from the previous decision */
+  size_t last_format_ {0};
+  size_t max_search_nodes_ {0};
+  uint64_t max_search_us_ {0};
+  std::optional<MPCLookahead> lookahead_ {};
+
   /* whether the current chunk is the first chunk */
   bool is_init_ {};
 
@@ -45,28 +58,13 @@ private:
   double curr_buffer_ {};
 
   /* map the discretized buffer length to the estimation */
-  double real_buffer_[MAX_DIS_BUF_LENGTH + 1] {};
+  std::vector<double> real_buffer_ {};
 
   /* unit sending time estimation */
-  double unit_sending_time_[MAX_LOOKAHEAD_HORIZON + 1 + MAX_NUM_PAST_CHUNKS] {};
-
-  /* the ssim of the chunk given the timestamp and format */
-  double curr_ssims_[MAX_LOOKAHEAD_HORIZON + 1][MAX_NUM_FORMATS] {};
-
-  /* the estimation of sending time given the timestamp and format */
-  double curr_sending_time_[MAX_LOOKAHEAD_HORIZON + 1][MAX_NUM_FORMATS] {};
+  static thread_local double unit_sending_time_[MAX_LOOKAHEAD_HORIZON + 1
+                                                + MAX_NUM_PAST_CHUNKS];
 
   void reinit();
-
-  /* return the qvalue of the given cur state and next action */
-  double get_qvalue(size_t i, double curr_buffer, size_t curr_format,
-                    size_t next_format);
-
-  /* return the value of the given state */
-  double get_value(size_t i, double curr_buffer, size_t curr_format);
-
-  /* discretize the buffer length */
-  double discretize_buffer(double buf);
 };
 
 #endif /* MPCSearch_HH */
@@ -1,29 +1,61 @@
 #include "pensieve.hh"
 #include "ws_client.hh"
 #include "pid.hh"
-#include "system_runner.hh"
-#include "serialization.hh"
-#include "ipc_socket.hh"
+#include "timestamp.hh"
+#include "inference_channel.hh"
 #include "json.hpp"
 
 using namespace std;
 using json = nlohmann::json;
 
+map<string, shared_ptr<const MLP>> Pensieve::actors_registry_;
+mutex Pensieve::actors_registry_mutex_;
+
+/* normalization of the state, as in Pensieve */
+static constexpr double M_IN_K = 1000.0;
+static constexpr double BUFFER_NORM_FACTOR = 10.0;  /* seconds */
+
+shared_ptr<const MLP> Pensieve::load_actor(const string & path)
+{
+  lock_guard<mutex> lock(actors_registry_mutex_);
+
+  auto & actor_ptr = actors_registry_[path];
+  if (not actor_ptr) {
+    actor_ptr = make_shared<const MLP>(path);
+  }
+
+  return actor_ptr;
+}
+
 Pensieve::Pensieve(const WebSocketClient & client,
                    const string & abr_name, const YAML::Node & abr_config)
   : ABRAlgo(client, abr_name)
 {
-  string ipc_dir = "pensieve_ipc";
-  fs::create_directory(ipc_dir);
-  ipc_file_ = fs::path(ipc_dir) /
-              (to_string(pid()) + "_" + to_string(client.connection_id()));
+  if (abr_config["actor_path"]) {
+    /* evaluate the actor in this process */
+    actor_path_ = fs::absolute(abr_config["actor_path"].as<string>());
+    actor_ = load_actor(actor_path_);
+
+    const size_t num_formats = client.channel()->vformats().size();
+    if (actor_->output_dim() != num_formats) {
+      throw runtime_error("Pensieve actor selects among " +
+                          to_string(actor_->output_dim()) + " formats, but "
+                          "the channel has " + to_string(num_formats));
+    }
+
+    /* a row must hold the sizes of the next chunk */
+    s_len_ = actor_->input_dim() / S_INFO;
+    if (s_len_ * S_INFO != actor_->input_dim() or s_len_ < num_formats) {
+      throw runtime_error("Pensieve actor takes " +
+                          to_string(actor_->input_dim()) + " inputs, which "
+                          "is not " + to_string(S_INFO) + " rows of at least "
+                          + to_string(num_formats));
+    }
 
-  IPCSocket sock;
-  sock.set_reuseaddr();
-  sock.bind(ipc_file_);
-  sock.listen();
+    state_.resize(S_INFO * s_len_);
+    return;
+  }
 
-  fs::path ipc_path = fs::current_path() / ipc_file_;
   string pensieve_path;
   string nn_path;
 
@@ -35,22 +67,39 @@ Pensieve::Pensieve(const WebSocketClient & client,
     throw runtime_error("Pensieve config missing");
   }
 
-  /* start child process */
-  vector<string> prog_args { pensieve_path, nn_path, ipc_path };
+  if (abr_config["timeout_ms"]) {
+    timeout_ms_ = abr_config["timeout_ms"].as<uint64_t>();
+  }
 
-  pensieve_proc_ = make_unique<ChildProcess>(pensieve_path,
-    [&pensieve_path, &prog_args]() {
-      return ezexec(pensieve_path, prog_args);
-    }
-  );
+  fallback_ = make_unique<LinearBBA>(client, "linear_bba", YAML::Node());
 
-  connection_ =  make_unique<FileDescriptor>(sock.accept());
+  if (abr_config["num_workers"]) {
+    /* share a pool of long-lived processes with other clients */
+    pool_ = &ABRWorkerPool::get(abr_name, {pensieve_path, nn_path},
+                                abr_config["num_workers"].as<size_t>());
+  } else {
+    /* start child process */
+    string ipc_dir = "pensieve_ipc";
+    fs::create_directory(ipc_dir);
+    fs::path ipc_file = fs::path(ipc_dir) /
+      (to_string(pid()) + "_" + to_string(client.connection_id()));
+
+    private_pool_ = make_unique<ABRWorkerPool>(
+      ipc_file, vector<string> {pensieve_path, nn_path}, 1);
+    pool_ = private_pool_.get();
+  }
 }
 
 Pensieve::~Pensieve()
 {
-  if (not fs::remove(ipc_file_)) {
-    cerr << "Warning: file " << ipc_file_ << " cannot be removed" << endl;
+  if (not pool_) {
+    return;
+  }
+
+  try {
+    pool_->close_client(client_.connection_id());
+  } catch (const exception & e) {
+    cerr << "Warning: " << e.what() << endl;
   }
 }
 
@@ -66,17 +115,35 @@ void Pensieve::video_chunk_acked(Chunk && c)
   assert(vformats_cnt == 10); // pensieve requires exactly 10 bitrates
 
   uint64_t next_vts = client_.next_vts().value();
-  const auto & data_map = channel->vdata(next_vts);
   vector<double> next_chunk_sizes;
 
   for (size_t i = 0; i < vformats_cnt; i++) {
-    const auto & vf = vformats[i];
-    double chunk_size = get<1>(data_map.at(vf)); // bytes
+    double chunk_size = channel->vsize(i, next_vts); // bytes
     next_chunk_sizes.push_back(chunk_size);
   }
 
   sort(next_chunk_sizes.begin(), next_chunk_sizes.end());
 
+  if (actor_) {
+    update_state(size, trans_time, next_chunk_sizes);
+
+    /* the most probable action, i.e., the largest logit */
+    static thread_local vector<float> logits;
+    logits.resize(actor_->output_dim());
+
+    InferenceChannel * channel = InferenceChannel::get();
+    if (not channel or
+        not channel->forward(actor_path_, "", state_.data(), 1,
+                             actor_->input_dim(), logits.data(),
+                             logits.size())) {
+      actor_->forward(state_.data(), 1, logits.data());
+    }
+
+    next_br_index_ = max_element(logits.begin(), logits.end())
+                     - logits.begin();
+    return;
+  }
+
   // TODO: increase trans_time to account for time to send audio chunks?
   json j;
   j["delay"] = trans_time; // ms
@@ -84,33 +151,87 @@ void Pensieve::video_chunk_acked(Chunk && c)
   j["rebuf_time"] = client_.cum_rebuffer(); // seconds
   j["last_chunk_size"] = (double)size; // bytes
   j["next_chunk_sizes"] = next_chunk_sizes; // bytes
-  uint16_t json_len = j.dump().length();
 
-  connection_->write(put_field(json_len) + j.dump());
+  /* the response updates the next format when it arrives */
+  const uint64_t request_num = ++num_requests_;
+  pool_->request(client_.connection_id(), move(j),
+    [this, request_num](json && response) {
+      if (request_num != num_requests_ or not pending_deadline_) {
+        return;  /* timed out or superseded */
+      }
+
+      next_br_index_ = response.at("bit_rate");
+      pending_deadline_.reset();
+      notify_ready();
+    }
+  );
 
-  auto read_data = connection_->read_exactly(2); // read 2 byte length
-  auto rcvd_json_len = get_uint16(read_data.data());
-  auto read_json = connection_->read_exactly(rcvd_json_len);
-  next_br_index_ = json::parse(read_json).at("bit_rate");
+  pending_deadline_ = timestamp_ms() + timeout_ms_;
+  use_fallback_ = false;
 }
 
-VideoFormat Pensieve::select_video_format()
+void Pensieve::update_state(const unsigned int size, const uint64_t trans_time,
+                            const vector<double> & next_chunk_sizes)
 {
+  for (size_t row = 0; row < S_INFO; row++) {
+    float * values = state_.data() + row * s_len_;
+    rotate(values, values + 1, values + s_len_);
+  }
+
+  auto latest = [this](const size_t row) -> float & {
+    return state_[row * s_len_ + s_len_ - 1];
+  };
+
+  const size_t num_formats = next_chunk_sizes.size();
+
+  /* the quality of the last chunk (its rank among the sizes, which is the
+   * last selection), the buffer, the throughput (KB/ms) and delay of the
+   * last chunk, the sizes of the next chunk (MB) and the fraction of the
+   * chunks left, which is always 1 in a live stream */
+  latest(0) = static_cast<double>(next_br_index_)
+              / max<size_t>(num_formats - 1, 1);
+  latest(1) = client_.video_playback_buf() / BUFFER_NORM_FACTOR;
+  latest(2) = static_cast<double>(size) / max<uint64_t>(trans_time, 1)
+              / M_IN_K;
+  latest(3) = trans_time / M_IN_K / BUFFER_NORM_FACTOR;
+
+  float * sizes = state_.data() + 4 * s_len_;
+  for (size_t i = 0; i < s_len_; i++) {
+    sizes[i] = i < num_formats ? next_chunk_sizes[i] / M_IN_K / M_IN_K : 0;
+  }
+
+  latest(5) = 1;
+}
+
+optional<uint64_t> Pensieve::video_format_pending()
+{
+  if (pending_deadline_ and timestamp_ms() >= *pending_deadline_) {
+    cerr << "Warning: pensieve timed out; falling back to linear_bba" << endl;
+    pending_deadline_.reset();
+    use_fallback_ = true;
+  }
+
+  return pending_deadline_;
+}
+
+size_t Pensieve::select_video_format()
+{
+  if (use_fallback_) {
+    use_fallback_ = false;
+    return fallback_->select_video_format();
+  }
+
   const auto & channel = client_.channel();
-  const auto & vformats = channel->vformats();
-  size_t vformats_cnt = vformats.size();
+  size_t vformats_cnt = channel->vformats().size();
 
   uint64_t next_vts = client_.next_vts().value();
-  const auto & data_map = channel->vdata(next_vts);
   vector<pair<double, size_t>> next_chunk_sizes; // store (chunk size, vf index)
 
   for (size_t i = 0; i < vformats_cnt; i++) {
-    const auto & vf = vformats[i];
-    double chunk_size = get<1>(data_map.at(vf));
+    double chunk_size = channel->vsize(i, next_vts);
     next_chunk_sizes.push_back(make_pair(chunk_size, i));
   }
 
   sort(next_chunk_sizes.begin(), next_chunk_sizes.end()); // sort by 1st element
-  size_t next_format = get<1>(next_chunk_sizes[next_br_index_]);
-  return client_.channel()->vformats()[next_format];
+  return get<1>(next_chunk_sizes[next_br_index_]);
 }
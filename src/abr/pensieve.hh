@@ -1,9 +1,14 @@
 #ifndef PENSIEVE_HH
 #define PENSIEVE_HH
 
+#include <map>
+#include <memory>
+#include <mutex>
+
 #include "abr_algo.hh"
-#include "child_process.hh"
-#include "filesystem.hh"
+#include "linear_bba.hh"
+#include "abr_worker_pool.hh"
+#include "mlp.hh"
 
 class Pensieve : public ABRAlgo
 {
@@ -13,13 +18,51 @@ public:
   ~Pensieve();
 
   void video_chunk_acked(Chunk && c) override;
-  VideoFormat select_video_format() override;
+  size_t select_video_format() override;
+  std::optional<uint64_t> video_format_pending() override;
+
+  /* forbid copying */
+  Pensieve(const Pensieve & other) = delete;
+  const Pensieve & operator=(const Pensieve & other) = delete;
 
 private:
+  static constexpr uint64_t DEFAULT_TIMEOUT_MS = 1000;
+
+  /* the state of the actor has S_INFO rows of the last values, as in
+   * Pensieve's a3c.py (see update_state()) */
+  static constexpr size_t S_INFO = 6;
+
   size_t next_br_index_ {};
-  fs::path ipc_file_ {};
-  std::unique_ptr<FileDescriptor> connection_ {nullptr};
-  std::unique_ptr<ChildProcess> pensieve_proc_ {nullptr};
+
+  /* the actor network evaluated in this process (abr_config "actor_path",
+   * exported by scripts/export_pensieve_mlp.py) rather than in a Python
+   * process; shared by the clients (and threads) using the same file */
+  std::shared_ptr<const MLP> actor_ {nullptr};
+  std::string actor_path_ {};  /* by which inference_daemon knows it */
+  size_t s_len_ {0};  /* values per row, which the actor determines */
+  std::vector<float> state_ {};  /* [S_INFO][s_len_] */
+
+  static std::map<std::string, std::shared_ptr<const MLP>> actors_registry_;
+  static std::mutex actors_registry_mutex_;
+  static std::shared_ptr<const MLP> load_actor(const std::string & path);
+
+  /* shift the state by the chunk acked, whose size is in bytes and
+   * trans_time in ms, given the sorted sizes of the next chunk (bytes) */
+  void update_state(const unsigned int size, const uint64_t trans_time,
+                    const std::vector<double> & next_chunk_sizes);
+
+  /* a pensieve process of this client, or workers shared by the clients
+   * if num_workers is set */
+  std::unique_ptr<ABRWorkerPool> private_pool_ {nullptr};
+  ABRWorkerPool * pool_ {nullptr};
+
+  /* the request sent on the last ack and the deadline of its response,
+   * after which the next format is selected by fallback_ */
+  uint64_t num_requests_ {0};
+  std::optional<uint64_t> pending_deadline_ {};
+  bool use_fallback_ {false};
+  uint64_t timeout_ms_ {DEFAULT_TIMEOUT_MS};
+  std::unique_ptr<LinearBBA> fallback_ {nullptr};
 };
 
 #endif /* PENSIEVE_HH */
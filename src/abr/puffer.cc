@@ -2,6 +2,8 @@
 
 #include <fstream>
 #include <memory>
+#include <algorithm>
+#include <limits>
 
 #include "ws_client.hh"
 #include "json.hpp"
@@ -9,6 +11,18 @@
 using namespace std;
 using json = nlohmann::json;
 
+thread_local double Puffer::v_[2][Puffer::MAX_NUM_FORMATS]
+                              [Puffer::MAX_DIS_BUF_LENGTH + 1];
+thread_local double Puffer::curr_ssims_[Puffer::MAX_LOOKAHEAD_HORIZON + 1]
+                                       [Puffer::MAX_NUM_FORMATS];
+thread_local int Puffer::curr_sizes_[Puffer::MAX_LOOKAHEAD_HORIZON + 1]
+                                    [Puffer::MAX_NUM_FORMATS];
+thread_local float Puffer::sending_time_prob_[Puffer::MAX_LOOKAHEAD_HORIZON + 1]
+                                             [Puffer::MAX_NUM_FORMATS]
+                                             [Puffer::MAX_DIS_SENDING_TIME + 1];
+thread_local bool Puffer::is_ban_[Puffer::MAX_LOOKAHEAD_HORIZON + 1]
+                                 [Puffer::MAX_NUM_FORMATS];
+
 Puffer::Puffer(const WebSocketClient & client,
                const string & abr_name, const YAML::Node & abr_config)
   : ABRAlgo(client, abr_name)
@@ -27,6 +41,14 @@ Puffer::Puffer(const WebSocketClient & client,
     ssim_diff_coeff_ = abr_config["ssim_diff_coeff"].as<double>();
   }
 
+  if (abr_config["throughput_prior"]) {
+    use_throughput_prior_ = abr_config["throughput_prior"].as<bool>();
+  }
+
+  if (abr_config["prune_dominated"]) {
+    prune_dominated_ = abr_config["prune_dominated"].as<bool>();
+  }
+
   dis_buf_length_ = min(dis_buf_length_,
                         discretize_buffer(WebSocketClient::MAX_BUFFER_S));
 }
@@ -39,30 +61,30 @@ void Puffer::video_chunk_acked(Chunk && c)
   }
 }
 
-VideoFormat Puffer::select_video_format()
+size_t Puffer::select_video_format()
 {
   reinit();
-  size_t ret_format = update_value(0, curr_buffer_, 0);
-  return client_.channel()->vformats()[ret_format];
+  reinit_sending_time();
+  return candidate_vformats_.at(solve_dp());
 }
 
 void Puffer::reinit()
 {
-  curr_round_++;
-
   const auto & channel = client_.channel();
   const auto & vformats = channel->vformats();
   const unsigned int vduration = channel->vduration();
   const uint64_t next_ts = client_.next_vts().value();
 
   dis_chunk_length_ = discretize_buffer((double) vduration / channel->timescale());
-  num_formats_ = vformats.size();
 
   /* initialization failed if there is no ready chunk ahead */
-  if (channel->vready_frontier().value() < next_ts || num_formats_ == 0) {
+  if (channel->vready_frontier().value() < next_ts || vformats.empty()) {
     throw runtime_error("no ready chunk ahead");
   }
 
+  const auto & formats = update_candidate_vformats(next_ts);
+  num_formats_ = formats.size();
+
   lookahead_horizon_ = min(
     max_lookahead_horizon_,
     (channel->vready_frontier().value() - next_ts) / vduration + 1);
@@ -76,34 +98,68 @@ void Puffer::reinit()
     curr_ssims_[0][0] = ssim_db(past_chunks_.back().ssim);
   } else {
     is_init_ = true;
+    curr_ssims_[0][0] = 0;
   }
 
-  for (size_t i = 1; i <= lookahead_horizon_; i++) {
-    const auto & data_map = channel->vdata(next_ts + vduration * (i - 1));
+  /* forget the cached chunks behind, or all of them on a channel change */
+  if (cached_channel_ != channel.get()) {
+    cached_channel_ = channel.get();
+    cached_chunks_.clear();
+  }
+
+  cached_chunks_.erase(
+    remove_if(cached_chunks_.begin(), cached_chunks_.end(),
+              [next_ts](const ChunkInputs & c) { return c.ts < next_ts; }),
+    cached_chunks_.end());
 
+  for (size_t i = 1; i <= lookahead_horizon_; i++) {
+    const auto & chunk = chunk_inputs(*channel, next_ts + vduration * (i - 1));
     for (size_t j = 0; j < num_formats_; j++) {
+      curr_ssims_[i][j] = chunk.ssims[formats[j]];
+      curr_sizes_[i][j] = chunk.sizes[formats[j]];
+    }
+  }
+}
 
-      try {
-        curr_ssims_[i][j] = ssim_db(
-            channel->vssim(vformats[j], next_ts + vduration * (i - 1)));
-      } catch (const exception & e) {
-        cerr << "Error occurs when getting the ssim of "
-             << next_ts + vduration * (i - 1) << " " << vformats[j] << endl;
-        curr_ssims_[i][j] = MIN_SSIM;
-      }
+const Puffer::ChunkInputs & Puffer::chunk_inputs(const Channel & channel,
+                                                 const uint64_t ts)
+{
+  auto it = find_if(cached_chunks_.begin(), cached_chunks_.end(),
+                    [ts](const ChunkInputs & c) { return c.ts == ts; });
+  const auto & vformats = channel.vformats();
+
+  if (it == cached_chunks_.end()) {
+    cached_chunks_.push_back({ts, false, vector<double>(vformats.size()),
+                              vector<int>(vformats.size())});
+    it = prev(cached_chunks_.end());
+  } else if (it->complete) {
+    return *it;
+  }
 
-      try {
-        curr_sizes_[i][j] = get<1>(data_map.at(vformats[j]));
-      } catch (const exception & e) {
-        cerr << "Error occurs when getting the sizes of "
-             << next_ts + vduration * (i - 1) << " " << vformats[j] << endl;
-        curr_sizes_[i][j] = -1;
-      }
+  /* look up the chunk again until all of its formats are found */
+  it->complete = true;
+
+  for (size_t j = 0; j < vformats.size(); j++) {
+    try {
+      it->ssims[j] = ssim_db(channel.vssim(j, ts));
+    } catch (const exception & e) {
+      cerr << "Error occurs when getting the ssim of "
+           << ts << " " << vformats[j] << endl;
+      it->ssims[j] = MIN_SSIM;
+      it->complete = false;
+    }
+
+    try {
+      it->sizes[j] = channel.vsize(j, ts);
+    } catch (const exception & e) {
+      cerr << "Error occurs when getting the sizes of "
+           << ts << " " << vformats[j] << endl;
+      it->sizes[j] = -1;
+      it->complete = false;
     }
   }
 
-  /* init sending time */
-  reinit_sending_time();
+  return *it;
 }
 
 void Puffer::deal_all_ban(size_t i)
@@ -131,74 +187,152 @@ void Puffer::deal_all_ban(size_t i)
   sending_time_prob_[i][min_id][dis_sending_time_] = 1;
 }
 
-size_t Puffer::update_value(size_t i, size_t curr_buffer, size_t curr_format)
+size_t Puffer::solve_dp()
 {
-  flag_[i][curr_buffer][curr_format] = curr_round_;
+  /* the kernels for the numbers of formats of our channels, with the
+   * default discretization of the buffer and sending time */
+  constexpr size_t kernel_dis_buf_length = min(
+    MAX_DIS_BUF_LENGTH,
+    size_t((WebSocketClient::MAX_BUFFER_S + UNIT_BUF_LENGTH * 0.5)
+           / UNIT_BUF_LENGTH));
+
+  if (dis_buf_length_ == kernel_dis_buf_length and
+      dis_sending_time_ == MAX_DIS_SENDING_TIME) {
+    constexpr size_t num_buffers = kernel_dis_buf_length + 1;
+    constexpr size_t num_sending_times = MAX_DIS_SENDING_TIME + 1;
+
+    switch (num_formats_) {
+    case 10:
+      return solve_dp_kernel<10, num_buffers, num_sending_times>();
+    default:
+      break;
+    }
+  }
 
-  if (i == lookahead_horizon_) {
-    v_[i][curr_buffer][curr_format] = curr_ssims_[i][curr_format];
-    return 0;
+  return solve_dp_kernel<0, 0, 0>();
+}
+
+template <size_t NumFormats, size_t NumBuffers, size_t NumSendingTimes>
+size_t Puffer::solve_dp_kernel()
+{
+  /* the dimensions given as 0 are only known at runtime */
+  const size_t num_formats = NumFormats ? NumFormats : num_formats_;
+  const size_t num_buffers = NumBuffers ? NumBuffers : dis_buf_length_ + 1;
+  const size_t horizon = lookahead_horizon_;
+
+  /* the value of the last step is the ssim of its chunk */
+  for (size_t f = 0; f < num_formats; f++) {
+    for (size_t b = 0; b < num_buffers; b++) {
+      v_[horizon % 2][f][b] = curr_ssims_[horizon][f];
+    }
   }
 
-  size_t best_next_format = num_formats_;
+  /* steps in between: compute the values of all buffer lengths at once, so
+   * the innermost loops run over contiguous buffer lengths */
+  double future[MAX_DIS_BUF_LENGTH + 1];
+
+  for (size_t i = horizon - 1; i >= 1; i--) {
+    const auto & next_v = v_[(i + 1) % 2];
+    auto & curr_v = v_[i % 2];
+    bool any_format = false;
+
+    for (size_t f = 0; f < num_formats; f++) {
+      fill(curr_v[f], curr_v[f] + num_buffers,
+           numeric_limits<double>::lowest());
+    }
+
+    for (size_t nf = 0; nf < num_formats; nf++) {
+      if (is_ban_[i + 1][nf]) {
+        continue;
+      }
+
+      any_format = true;
+      future_values<NumBuffers, NumSendingTimes>(i, nf, next_v[nf], future);
+
+      for (size_t f = 0; f < num_formats; f++) {
+        const double ssim_value = curr_ssims_[i][f] - ssim_diff_coeff_
+                                  * fabs(curr_ssims_[i][f] - curr_ssims_[i + 1][nf]);
+
+        for (size_t b = 0; b < num_buffers; b++) {
+          curr_v[f][b] = max(curr_v[f][b], ssim_value + future[b]);
+        }
+      }
+    }
+
+    /* no format can be sent at the next step */
+    if (not any_format) {
+      for (size_t f = 0; f < num_formats; f++) {
+        fill(curr_v[f], curr_v[f] + num_buffers, 0.0);
+      }
+    }
+  }
+
+  /* the first step only has the current state */
+  size_t best_next_format = num_formats;
   double max_qvalue = 0;
-  for (size_t next_format = 0; next_format < num_formats_; next_format++) {
-    if (is_ban_[i + 1][next_format] == true) {
+
+  for (size_t nf = 0; nf < num_formats; nf++) {
+    if (is_ban_[1][nf]) {
       continue;
     }
 
-    double qvalue = get_qvalue(i, curr_buffer, curr_format, next_format);
-    if (best_next_format == num_formats_ or qvalue > max_qvalue) {
+    future_values<NumBuffers, NumSendingTimes>(0, nf, v_[1][nf], future);
+
+    double qvalue = curr_ssims_[0][0] + future[curr_buffer_];
+    if (not is_init_) {
+      qvalue -= ssim_diff_coeff_ * fabs(curr_ssims_[0][0] - curr_ssims_[1][nf]);
+    }
+
+    if (best_next_format == num_formats or qvalue > max_qvalue) {
       max_qvalue = qvalue;
-      best_next_format = next_format;
+      best_next_format = nf;
     }
   }
-  v_[i][curr_buffer][curr_format] = max_qvalue;
 
   return best_next_format;
 }
 
-double Puffer::get_qvalue(size_t i, size_t curr_buffer, size_t curr_format,
-                          size_t next_format)
+template <size_t NumBuffers, size_t NumSendingTimes>
+void Puffer::future_values(size_t i, size_t next_format,
+                           const double * next_value, double * future)
 {
-  assert(is_ban_[i + 1][next_format] == false);
+  const size_t num_buffers = NumBuffers ? NumBuffers : dis_buf_length_ + 1;
+  const size_t num_sending_times =
+    NumSendingTimes ? NumSendingTimes : dis_sending_time_ + 1;
 
-  double ans = curr_ssims_[i][curr_format];
+  fill(future, future + num_buffers, 0.0);
 
-  if (not (is_init_ and i == 0)) {
-     ans -= ssim_diff_coeff_
-            * fabs(curr_ssims_[i][curr_format] - curr_ssims_[i + 1][next_format]);
-  }
+  const size_t max_buffer = num_buffers - 1;
+  const double rebuffer_coeff = rebuffer_length_coeff_ * unit_buf_length_;
 
-  for (size_t st = 0; st <= dis_sending_time_; st++) {
-    if (sending_time_prob_[i + 1][next_format][st] < st_prob_eps_) {
+  for (size_t st = 0; st < num_sending_times; st++) {
+    const double prob = sending_time_prob_[i + 1][next_format][st];
+    if (prob < st_prob_eps_) {
       continue;
     }
 
-    int rebuffer = st - curr_buffer;
-    size_t next_buffer = min(max(-rebuffer, 0) + dis_chunk_length_,
-                             dis_buf_length_);
-    rebuffer = max(rebuffer, 0);
-    double real_rebuffer = rebuffer * unit_buf_length_;
-
-    if (curr_buffer - st == 0) {
-      real_rebuffer = rebuffer * unit_buf_length_ * 0.25;
+    /* split the buffer lengths b into the ranges where the next buffer
+     * length is linear in b, so that each loop is vectorized: rebuffer
+     * (b < st), the next buffer length short of the max, and at the max */
+    const size_t rebuffer_end = min(st, num_buffers);
+    const size_t max_start = max(rebuffer_end,
+        min(max_buffer + st - min(dis_chunk_length_, max_buffer + st),
+            num_buffers));
+    const double rebuffer_value = next_value[min(dis_chunk_length_,
+                                                 max_buffer)];
+
+    for (size_t b = 0; b < rebuffer_end; b++) {
+      future[b] += prob * (rebuffer_value - rebuffer_coeff * (st - b));
     }
 
-    ans += sending_time_prob_[i+1][next_format][st]
-           * (get_value(i + 1, next_buffer, next_format)
-              - rebuffer_length_coeff_ * real_rebuffer);
-  }
-
-  return ans;
-}
+    for (size_t b = rebuffer_end; b < max_start; b++) {
+      future[b] += prob * next_value[b - st + dis_chunk_length_];
+    }
 
-double Puffer::get_value(size_t i, size_t curr_buffer, size_t curr_format)
-{
-  if (flag_[i][curr_buffer][curr_format] != curr_round_) {
-    update_value(i, curr_buffer, curr_format);
+    for (size_t b = max_start; b < num_buffers; b++) {
+      future[b] += prob * next_value[max_buffer];
+    }
   }
-  return v_[i][curr_buffer][curr_format];
 }
 
 size_t Puffer::discretize_buffer(double buf)
@@ -6,6 +6,8 @@
 #include <vector>
 #include "filesystem.hh"
 
+class Channel;
+
 class Puffer : public ABRAlgo
 {
 public:
@@ -13,7 +15,11 @@ public:
          const std::string & abr_name, const YAML::Node & abr_config);
 
   void video_chunk_acked(Chunk && c) override;
-  VideoFormat select_video_format() override;
+  size_t select_video_format() override;
+
+  /* forbid copying */
+  Puffer(const Puffer & other) = delete;
+  Puffer & operator=(const Puffer & other) = delete;
 
 protected:
   static constexpr size_t MAX_NUM_PAST_CHUNKS = 8;
@@ -48,36 +54,63 @@ protected:
   /* for the current buffer length */
   size_t curr_buffer_ {};
 
-  /* for storing the value function */
-  uint64_t flag_[MAX_LOOKAHEAD_HORIZON + 1][MAX_DIS_BUF_LENGTH + 1][MAX_NUM_FORMATS] {};
-  double v_[MAX_LOOKAHEAD_HORIZON + 1][MAX_DIS_BUF_LENGTH + 1][MAX_NUM_FORMATS] {};
+  /* the tables below are shared by the instances on a thread rather than
+   * held by each client: they are all filled by reinit() and
+   * reinit_sending_time() and used by solve_dp(), which run to completion
+   * within select_video_format() */
 
-  /* record the current round of DP */
-  uint64_t curr_round_ {};
+  /* for storing the value function of steps i and i + 1 of the DP, indexed
+   * by [i % 2][format][buffer] */
+  static thread_local double v_[2][MAX_NUM_FORMATS][MAX_DIS_BUF_LENGTH + 1];
 
   /* the ssim and size of the chunk given the timestamp and format */
-  double curr_ssims_[MAX_LOOKAHEAD_HORIZON + 1][MAX_NUM_FORMATS] {};
-  int curr_sizes_[MAX_LOOKAHEAD_HORIZON + 1][MAX_NUM_FORMATS] {};
+  static thread_local double curr_ssims_[MAX_LOOKAHEAD_HORIZON + 1][MAX_NUM_FORMATS];
+  static thread_local int curr_sizes_[MAX_LOOKAHEAD_HORIZON + 1][MAX_NUM_FORMATS];
 
-  /* the estimation of sending time given the timestamp and format */
-  double sending_time_prob_[MAX_LOOKAHEAD_HORIZON + 1][MAX_NUM_FORMATS]
-                           [MAX_DIS_SENDING_TIME + 1] {};
+  /* the estimation of sending time given the timestamp and format; a float
+   * is precise enough for a probability */
+  static thread_local float sending_time_prob_[MAX_LOOKAHEAD_HORIZON + 1]
+                                              [MAX_NUM_FORMATS]
+                                              [MAX_DIS_SENDING_TIME + 1];
 
   /* denote whether a chunk is abandoned */
-  bool is_ban_[MAX_LOOKAHEAD_HORIZON + 1][MAX_NUM_FORMATS] {};
-
+  static thread_local bool is_ban_[MAX_LOOKAHEAD_HORIZON + 1][MAX_NUM_FORMATS];
+
+  /* the ssims (in dB) and sizes of all the formats of a chunk ahead, indexed
+   * like vformats() rather than by candidate */
+  struct ChunkInputs {
+    uint64_t ts;
+    bool complete;  /* whether all of them have been found */
+    std::vector<double> ssims;
+    std::vector<int> sizes;
+  };
+
+  /* the chunks ahead looked up by the last decisions, of cached_channel_,
+   * which consecutive decisions mostly share */
+  const Channel * cached_channel_ {nullptr};
+  std::deque<ChunkInputs> cached_chunks_ {};
+
+  /* the inputs of the chunk at ts, which are looked up unless cached */
+  const ChunkInputs & chunk_inputs(const Channel & channel, const uint64_t ts);
+
+  /* init the chunks ahead; reinit_sending_time() must be called after */
   void reinit();
   virtual void reinit_sending_time() {};
 
-  /* calculate the value of corresponding state and return the best strategy */
-  size_t update_value(size_t i, size_t curr_buffer, size_t curr_format);
+  /* solve the DP bottom-up and return the best format of the next chunk */
+  size_t solve_dp();
 
-  /* return the qvalue of the given cur state and next action */
-  double get_qvalue(size_t i, size_t curr_buffer, size_t curr_format,
-                    size_t next_format);
+  /* solve_dp() with the numbers of formats, buffer lengths and sending times
+   * fixed at compile time so that its loops are unrolled and vectorized; a
+   * dimension of 0 is taken from the members at runtime instead */
+  template <size_t NumFormats, size_t NumBuffers, size_t NumSendingTimes>
+  size_t solve_dp_kernel();
 
-  /* return the value of the given state */
-  double get_value(size_t i, size_t curr_buffer, size_t curr_format);
+  /* expected value of sending next_format at step i + 1 for all buffer
+   * lengths, excluding the ssim terms that only depend on the formats */
+  template <size_t NumBuffers, size_t NumSendingTimes>
+  void future_values(size_t i, size_t next_format, const double * next_value,
+                     double * future);
 
   /* discretize the buffer length */
   size_t discretize_buffer(double buf);
@@ -14,8 +14,10 @@ PufferRaw::PufferRaw(const WebSocketClient & client,
 
 void PufferRaw::reinit_sending_time()
 {
-  static double unit_st[MAX_LOOKAHEAD_HORIZON + 1 + MAX_NUM_PAST_CHUNKS];
-  static double st_prob[MAX_DIS_SENDING_TIME + 1];
+  /* scratch space, per thread as the event loops decide concurrently */
+  static thread_local double
+    unit_st[MAX_LOOKAHEAD_HORIZON + 1 + MAX_NUM_PAST_CHUNKS];
+  static thread_local double st_prob[MAX_DIS_SENDING_TIME + 1];
 
   size_t num_past_chunks = past_chunks_.size();
   auto it = past_chunks_.begin();
@@ -24,6 +26,9 @@ void PufferRaw::reinit_sending_time()
     unit_st[i] = (double) it->trans_time / it->size / 1000;
   }
 
+  /* without acked chunks, the throughput of the subnet of the client */
+  const auto prior = num_past_chunks == 0 ? throughput_prior() : nullopt;
+
   for (size_t i = 1; i <= lookahead_horizon_; i++) {
     double tmp = 0;
     for (size_t j = 0; j < num_past_chunks; j++) {
@@ -32,6 +37,9 @@ void PufferRaw::reinit_sending_time()
 
     if (num_past_chunks != 0) {
       unit_st[i + num_past_chunks] = tmp / num_past_chunks;
+    } else if (prior) {
+      unit_st[i + num_past_chunks] =
+        (double) prior->trans_time / prior->size / 1000;
     } else {
       /* set the sending time to be a default hight value */
       unit_st[i + num_past_chunks] = HIGH_SENDING_TIME;
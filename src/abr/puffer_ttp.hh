@@ -2,51 +2,89 @@
 #define PUFFER_TTP_HH
 
 #include "puffer.hh"
-#include "torch/script.h"
+#include "mlp.hh"
+#include "distribution.hh"
+#include "ttp_batch.hh"
+#include "ttp_features.hh"
 #include <cmath>
 #include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
 
 class PufferTTP : public Puffer
 {
 public:
   PufferTTP(const WebSocketClient & client,
             const std::string & abr_name, const YAML::Node & abr_config);
+
+  /* queue the TTP inputs of this client to be batched with other clients */
+  void prepare_video_format() override;
+
 private:
   static constexpr double BAN_PROB_ = 0.5;
   static constexpr size_t TTP_INPUT_DIM = 62;
   static constexpr size_t TTP_CURR_DIFF_POS = 5;
-  static constexpr size_t PKT_BYTES = 1500;
-  static constexpr size_t MILLION = 1000000;
-  static constexpr size_t THOUSAND = 1000;
 
   double ban_prob_ {BAN_PROB_};
 
-  torch::jit::script::Module ttp_modules_[MAX_LOOKAHEAD_HORIZON];
+  /* models of a model_dir, loaded once and shared by all the clients; the
+   * normalization of the inputs with the stats of the training data is
+   * folded into each model, which thus takes the raw inputs */
+  struct TTPModels {
+    std::vector<MLP> models {};
+
+    /* the files of each model, by which inference_daemon knows it */
+    std::vector<std::string> model_paths {};
+    std::vector<std::string> meta_paths {};
+  };
+
+  /* loaded models; key: model_dir */
+  static std::map<std::string, std::shared_ptr<const TTPModels>> models_registry_;
+  static std::mutex models_registry_mutex_;
+
+  /* return the models of model_dir, which are loaded if not yet */
+  static std::shared_ptr<const TTPModels> load_models(const fs::path & model_dir);
 
-  /* stats of training data used for normalization */
-  std::vector<double> obs_mean_[MAX_LOOKAHEAD_HORIZON];
-  std::vector<double> obs_std_[MAX_LOOKAHEAD_HORIZON];
+  std::shared_ptr<const TTPModels> models_ {};
+
+  /* batches of TTP inputs, one per lookahead step, shared by the
+   * clients on a thread; key: model_dir and input dimension */
+  static thread_local std::map<std::pair<std::string, size_t>,
+                               std::vector<TTPBatch>> ttp_batches_;
+  std::string model_dir_ {};
+
+  /* rows of this client queued in each batch of ttp_batches() */
+  struct BatchRows {
+    uint64_t generation;  /* generation of the batch */
+    size_t first_row;     /* row of the first format */
+  };
+  std::vector<BatchRows> batch_rows_ {};
 
   size_t ttp_input_dim_ {TTP_INPUT_DIM};
   bool is_mle_ {false};
   bool no_tcp_info_ {false};
 
-  /* params for Gaussian Blur **/
-  double mean_val_ {0.0};
-  double std_val_ {0.0};
-  int kernel_size_ {0};
-  std::vector<double> gaussian_kernel_vals_ {};
-
-  /* preprocess the data */
-  void normalize_in_place(size_t i, std::vector<double> & input);
+  /* blur of the sending time distributions, if blur_params are given */
+  std::optional<GaussianBlur> blur_ {};
 
   void reinit_sending_time() override;
 
-  /* calculate the values for gaussian kernel (blur case) */
-  void calculate_gaussian_values();
+  /* batches of the models of this client */
+  std::vector<TTPBatch> & ttp_batches();
+
+  /* queue the TTP inputs of all the lookahead steps in ttp_batches() */
+  void queue_ttp_inputs();
+
+  /* whether the rows queued by queue_ttp_inputs() are still in the batches */
+  bool ttp_inputs_queued();
 
-  /* blur probability */
-  void blur_probability(int horizontal_index, int format_index);
+  /* extract the sending time distribution of step i from the TTP outputs
+   * of all formats, which start at output */
+  void set_sending_time_prob(size_t i, const float * output,
+                             size_t output_dim);
 };
 
 #endif /* PUFFER_TTP_HH */
@@ -1,9 +1,7 @@
 #include "python_ipc.hh"
 #include "ws_client.hh"
 #include "pid.hh"
-#include "system_runner.hh"
-#include "serialization.hh"
-#include "ipc_socket.hh"
+#include "timestamp.hh"
 #include "json.hpp"
 #include <tuple>
 #include <vector>
@@ -21,17 +19,6 @@ PythonIPC::PythonIPC(const WebSocketClient & client,
                    const string & abr_name, const YAML::Node & abr_config)
   : ABRAlgo(client, abr_name)
 {
-  /* setup IPC connection */
-  string ipc_dir = "python_ipc";
-  fs::create_directory(ipc_dir);
-  ipc_file_ = fs::path(ipc_dir) /
-              (abr_name + "_"+ to_string(pid()) + "_" + to_string(client.connection_id()));
-
-  IPCSocket sock;
-  sock.set_reuseaddr();
-  sock.bind(ipc_file_);
-  sock.listen();
-
   /* initialize past chunk information */
   past_chunk_info_["delay"] = 0.;
   past_chunk_info_["ssim"] = 0.;
@@ -43,7 +30,6 @@ PythonIPC::PythonIPC(const WebSocketClient & client,
   past_chunk_info_["delivery_rate"] = 0.;
 
   /* parse args for env process */
-  fs::path ipc_path = fs::current_path() / ipc_file_;
   string test_path;
   string model_path;
 
@@ -55,22 +41,36 @@ PythonIPC::PythonIPC(const WebSocketClient & client,
     throw runtime_error("PythonIPC config missing");
   }
 
-  /* start abr env process */
-  vector<string> prog_args {test_path, abr_name, model_path, ipc_path};
+  if (abr_config["timeout_ms"]) {
+    timeout_ms_ = abr_config["timeout_ms"].as<uint64_t>();
+  }
 
-  python_proc_ = make_unique<ChildProcess>(test_path,
-    [&test_path, &prog_args]() {
-      return ezexec(test_path, prog_args);
-    }
-  );
+  fallback_ = make_unique<LinearBBA>(client, "linear_bba", YAML::Node());
 
-  connection_ =  make_unique<FileDescriptor>(sock.accept());
+  vector<string> prog_args {test_path, abr_name, model_path};
+
+  if (abr_config["num_workers"]) {
+    /* share a pool of long-lived processes with other clients */
+    pool_ = &ABRWorkerPool::get(abr_name, prog_args,
+                                abr_config["num_workers"].as<size_t>());
+  } else {
+    /* start abr env process */
+    string ipc_dir = "python_ipc";
+    fs::create_directory(ipc_dir);
+    fs::path ipc_file = fs::path(ipc_dir) /
+      (abr_name + "_"+ to_string(pid()) + "_" + to_string(client.connection_id()));
+
+    private_pool_ = make_unique<ABRWorkerPool>(ipc_file, prog_args, 1);
+    pool_ = private_pool_.get();
+  }
 }
 
 PythonIPC::~PythonIPC()
 {
-  if (not fs::remove(ipc_file_)) {
-    cerr << "Warning: file " << ipc_file_ << " cannot be removed" << endl;
+  try {
+    pool_->close_client(client_.connection_id());
+  } catch (const exception & e) {
+    cerr << "Warning: " << e.what() << endl;
   }
 }
 
@@ -88,16 +88,37 @@ void PythonIPC::video_chunk_acked(Chunk && c)
   past_chunk_info_["delivery_rate"] = c.delivery_rate * 1e-6; /* b/s -> Mb/s */
 }
 
-VideoFormat PythonIPC::select_video_format()
+vector<size_t> PythonIPC::sorted_vformats() const
+{
+  const auto & vformats = client_.channel()->vformats();
+
+  vector<size_t> ret(vformats.size());
+  for (size_t i = 0; i < ret.size(); i++) {
+    ret[i] = i;
+  }
+
+  // sort by increasing quality
+  sort(ret.begin(), ret.end(), [&vformats](const size_t l, const size_t r) {
+    return compare_vformats(vformats[l], vformats[r]);
+  });
+  return ret;
+}
+
+void PythonIPC::prepare_video_format()
 {
   const auto & channel = client_.channel();
   const unsigned int vduration = channel->vduration();
   const uint64_t next_ts = client_.next_vts().value();
-  auto vformats = channel->vformats();
+
+  /* the request for this chunk has been sent */
+  if (decision_ and decision_->vts == next_ts) {
+    return;
+  }
+
+  const auto vformats = sorted_vformats();
   size_t num_formats = vformats.size();
 
   assert(num_formats == ACTION_SPACE_N); // all the controllers expect the same action space
-  sort(vformats.begin(), vformats.end(), &compare_vformats); // sort by increasing quality
 
   /* get future chunk sizes and ssims */
   vector<vector<double>> chunk_sizes(
@@ -110,22 +131,22 @@ VideoFormat PythonIPC::select_video_format()
     (channel->vready_frontier().value() - next_ts) / vduration + 1);
 
   for (size_t i = 0; i < lookahead_horizon; i++) {
-    const auto & data_map = channel->vdata(next_ts + vduration * i);
-
     for (size_t j = 0; j < num_formats; j++) {
 
       try {
         chunk_ssims[i][j] = channel->vssim(vformats[j], next_ts + vduration * i);
       } catch (const exception & e) {
         cerr << "Error occured when getting the ssim of "
-             << next_ts + vduration * i << " " << vformats[j] << endl;
+             << next_ts + vduration * i << " "
+             << channel->vformat_string(vformats[j]) << endl;
       }
 
       try {
-        chunk_sizes[i][j] = get<1>(data_map.at(vformats[j])) * 1e-6; /* b -> Mb */
+        chunk_sizes[i][j] = channel->vsize(vformats[j], next_ts + vduration * i) * 1e-6; /* b -> Mb */
       } catch (const exception & e) {
         cerr << "Error occured when getting the size of "
-             << next_ts + vduration * i << " " << vformats[j] << endl;
+             << next_ts + vduration * i << " "
+             << channel->vformat_string(vformats[j]) << endl;
       }
     }
   }
@@ -138,15 +159,54 @@ VideoFormat PythonIPC::select_video_format()
   j["sizes"] = chunk_sizes; // Mb
   j["ssims"] = chunk_ssims; // unitless
   j["channel_name"] = channel->name(); // eg. fox, abc
-  uint16_t json_len = j.dump().length();
 
-  connection_->write(put_field(json_len) + j.dump());
+  /* the action is received in the event loop */
+  pool_->request(client_.connection_id(), move(j),
+    [this, next_ts](json && response) {
+      if (not decision_ or decision_->vts != next_ts or decision_->done) {
+        return;  /* timed out or superseded */
+      }
+
+      decision_->action = response.at("action").get<size_t>();
+      decision_->done = true;
+      notify_ready();
+    }
+  );
+
+  decision_ = Decision {next_ts, timestamp_ms() + timeout_ms_, nullopt, false};
+}
+
+optional<uint64_t> PythonIPC::video_format_pending()
+{
+  if (not decision_ or decision_->done) {
+    return nullopt;
+  }
+
+  if (timestamp_ms() >= decision_->deadline) {
+    cerr << "Warning: " << abr_name_ << " timed out; "
+         << "falling back to linear_bba" << endl;
+    decision_->done = true;
+    return nullopt;
+  }
 
-  /* read action received from ipc */
-  auto read_data = connection_->read_exactly(2); // read 2 byte length
-  auto rcvd_json_len = get_uint16(read_data.data());
-  auto read_json = connection_->read_exactly(rcvd_json_len);
-  size_t action = json::parse(read_json).at("action");
+  return decision_->deadline;
+}
+
+size_t PythonIPC::select_video_format()
+{
+  const uint64_t next_ts = client_.next_vts().value();
+  optional<size_t> action;
+
+  if (decision_ and decision_->vts == next_ts) {
+    action = decision_->action;
+  }
+
+  decision_.reset();
+
+  const auto vformats = sorted_vformats();
+  if (not action or *action >= vformats.size()) {
+    return fallback_->select_video_format();
+  }
 
-  return vformats[action];
+  return vformats[*action];
 }
@@ -2,9 +2,10 @@
 #define PYTHON_IPC_HH
 
 #include "abr_algo.hh"
-#include "child_process.hh"
-#include "filesystem.hh"
+#include "linear_bba.hh"
+#include "abr_worker_pool.hh"
 #include <map>
+#include <vector>
 
 static const double DEFAULT_SSIM = 0.85; // unitless, about 8 SSIM dB
 static const double DEFAULT_CHUNK_SIZE = 3.0; // Mb
@@ -19,13 +20,41 @@ public:
   ~PythonIPC();
 
   void video_chunk_acked(Chunk && c) override;
-  VideoFormat select_video_format() override;
+
+  /* send the request for the next chunk, whose response is awaited */
+  void prepare_video_format() override;
+  std::optional<uint64_t> video_format_pending() override;
+  size_t select_video_format() override;
+
+  /* forbid copying */
+  PythonIPC(const PythonIPC & other) = delete;
+  const PythonIPC & operator=(const PythonIPC & other) = delete;
 
 private:
+  static constexpr uint64_t DEFAULT_TIMEOUT_MS = 1000;
+
   std::map<std::string, double> past_chunk_info_ {};
-  fs::path ipc_file_ {};
-  std::unique_ptr<FileDescriptor> connection_ {nullptr};
-  std::unique_ptr<ChildProcess> python_proc_ {nullptr};
+
+  /* a python process of this client, or workers shared by the clients
+   * if num_workers is set */
+  std::unique_ptr<ABRWorkerPool> private_pool_ {nullptr};
+  ABRWorkerPool * pool_ {nullptr};
+
+  /* the decision requested for the chunk at vts; the format is selected by
+   * fallback_ if the action does not arrive by the deadline */
+  struct Decision {
+    uint64_t vts;
+    uint64_t deadline;
+    std::optional<size_t> action;
+    bool done;
+  };
+  std::optional<Decision> decision_ {};
+  uint64_t timeout_ms_ {DEFAULT_TIMEOUT_MS};
+  std::unique_ptr<LinearBBA> fallback_ {nullptr};
+
+  /* indices of the formats in vformats() sorted by increasing quality,
+   * which actions index into */
+  std::vector<size_t> sorted_vformats() const;
 };
 
 #endif /* PYTHON_IPC_HH */
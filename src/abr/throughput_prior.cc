@@ -0,0 +1,127 @@
+#include "throughput_prior.hh"
+
+#include <netinet/in.h>
+#include <algorithm>
+
+using namespace std;
+
+array<atomic<uint64_t>, ThroughputPrior::NUM_SLOTS> ThroughputPrior::slots_;
+
+static constexpr unsigned int FIELD_BITS = 20;
+static constexpr uint64_t FIELD_MAX = (uint64_t(1) << FIELD_BITS) - 1;
+static constexpr unsigned int TAG_SHIFT = 2 * FIELD_BITS;
+
+/* the slot is picked by the low bits of the hash and tagged with its high
+ * bits; a tag is never 0, so that an empty slot matches no subnet */
+static uint64_t tag_of(const uint64_t hash)
+{
+  return hash >> TAG_SHIFT | 1;
+}
+
+static uint64_t pack(const uint64_t tag, const double size_kib,
+                     const double trans_time)
+{
+  const uint64_t size = min<uint64_t>(FIELD_MAX, size_kib + 0.5);
+  const uint64_t time = min<uint64_t>(FIELD_MAX, trans_time + 0.5);
+  return tag << TAG_SHIFT | size << FIELD_BITS | time;
+}
+
+optional<uint64_t> ThroughputPrior::subnet_hash(const Address & address)
+{
+  const sockaddr & sa = address.to_sockaddr();
+
+  /* the first bytes of the address, tagged with the length of the prefix */
+  uint64_t key = 0;
+  const uint8_t * bytes = nullptr;
+  size_t prefix_len = 0;
+
+  if (sa.sa_family == AF_INET) {
+    const auto & sin = reinterpret_cast<const sockaddr_in &>(sa);
+    bytes = reinterpret_cast<const uint8_t *>(&sin.sin_addr);
+    prefix_len = 3;
+  } else if (sa.sa_family == AF_INET6) {
+    const auto & sin6 = reinterpret_cast<const sockaddr_in6 &>(sa);
+    bytes = sin6.sin6_addr.s6_addr;
+    prefix_len = 6;
+
+    if (IN6_IS_ADDR_V4MAPPED(&sin6.sin6_addr)) {
+      bytes += 12;
+      prefix_len = 3;
+    }
+  } else {
+    return nullopt;
+  }
+
+  bool unspecified = true;
+  for (size_t i = 0; i < prefix_len; i++) {
+    key = key << 8 | bytes[i];
+    unspecified = unspecified and bytes[i] == 0;
+  }
+
+  if (unspecified) {
+    return nullopt;
+  }
+
+  key |= uint64_t(prefix_len) << 56;
+
+  /* splitmix64 finalizer */
+  key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9;
+  key = (key ^ (key >> 27)) * 0x94d049bb133111eb;
+  return key ^ (key >> 31);
+}
+
+optional<ThroughputPrior::Sample>
+ThroughputPrior::lookup(const Address & address)
+{
+  const auto hash = subnet_hash(address);
+  if (not hash) {
+    return nullopt;
+  }
+
+  const uint64_t tag = tag_of(*hash);
+  const uint64_t slot = slots_[*hash % NUM_SLOTS].load(memory_order_relaxed);
+
+  if (slot >> TAG_SHIFT != tag) {
+    return nullopt;
+  }
+
+  const uint64_t size_kib = slot >> FIELD_BITS & FIELD_MAX;
+  const uint64_t trans_time = slot & FIELD_MAX;
+  if (size_kib == 0) {
+    return nullopt;
+  }
+
+  return Sample {static_cast<unsigned int>(size_kib * 1024), trans_time};
+}
+
+void ThroughputPrior::update(const Address & address, const Sample & sample)
+{
+  const auto hash = subnet_hash(address);
+  if (not hash or sample.size == 0) {
+    return;
+  }
+
+  const uint64_t tag = tag_of(*hash);
+  auto & slot = slots_[*hash % NUM_SLOTS];
+
+  const double size_kib = sample.size / 1024.0;
+  const double trans_time = sample.trans_time;
+
+  uint64_t old_slot = slot.load(memory_order_relaxed);
+  uint64_t new_slot;
+
+  if (old_slot >> TAG_SHIFT == tag) {
+    const double old_size_kib = old_slot >> FIELD_BITS & FIELD_MAX;
+    const double old_trans_time = old_slot & FIELD_MAX;
+
+    new_slot = pack(tag, old_size_kib + ALPHA * (size_kib - old_size_kib),
+                    old_trans_time + ALPHA * (trans_time - old_trans_time));
+  } else {
+    /* a new subnet, or one that evicts another */
+    new_slot = pack(tag, size_kib, trans_time);
+  }
+
+  /* a single attempt: if another thread has just updated the slot, its
+   * update stands */
+  slot.compare_exchange_strong(old_slot, new_slot, memory_order_relaxed);
+}
@@ -0,0 +1,50 @@
+#ifndef THROUGHPUT_PRIOR_HH
+#define THROUGHPUT_PRIOR_HH
+
+#include <atomic>
+#include <cstdint>
+#include <optional>
+#include <array>
+
+#include "address.hh"
+
+/* Throughput of the recent video chunks acked by the clients of each subnet
+ * (IPv4 /24 or IPv6 /48), shared by all the threads of the process, so that
+ * a new session can seed its throughput estimate before its first chunk is
+ * acked. Each subnet is an EWMA of chunk size and transmission time packed
+ * with a tag of the subnet into one atomic word of a direct-mapped table,
+ * so reads and updates take no lock; subnets that collide on a slot
+ * evict each other, and a racing update may be lost, which only delays the
+ * prior. */
+class ThroughputPrior
+{
+public:
+  struct Sample
+  {
+    unsigned int size;    /* bytes */
+    uint64_t trans_time;  /* ms */
+  };
+
+  /* the prior of the subnet of address, unless none of its chunks has been
+   * acked (or it has been evicted) */
+  static std::optional<Sample> lookup(const Address & address);
+
+  /* fold a video chunk acked by a client at address into the prior */
+  static void update(const Address & address, const Sample & sample);
+
+private:
+  static constexpr size_t NUM_SLOTS = 1 << 14;
+
+  /* weight of a new chunk in the EWMA */
+  static constexpr double ALPHA = 0.125;
+
+  /* slot: tag (24 bits) | size in KiB (20 bits) | trans_time in ms (20);
+   * 0 if empty */
+  static std::array<std::atomic<uint64_t>, NUM_SLOTS> slots_;
+
+  /* hash of the subnet of address; nullopt if address has no subnet
+   * (e.g., unspecified) */
+  static std::optional<uint64_t> subnet_hash(const Address & address);
+};
+
+#endif /* THROUGHPUT_PRIOR_HH */
@@ -0,0 +1,83 @@
+#include "ttp_batch.hh"
+
+#include <stdexcept>
+
+#include "distribution.hh"
+#include "inference_channel.hh"
+#include "metrics.hh"
+#include "timestamp.hh"
+
+using namespace std;
+
+TTPBatch::TTPBatch(const MLP & model, const string & model_path,
+                   const string & meta_path)
+  : model_(model), model_path_(model_path), meta_path_(meta_path),
+    input_dim_(model.input_dim()),
+    output_dim_(model.output_dim())
+{}
+
+size_t TTPBatch::add(const float * inputs, const size_t num_rows)
+{
+  if (done_) {
+    inputs_.clear();
+    num_rows_ = 0;
+    done_ = false;
+    generation_++;
+  }
+
+  if (num_rows_ == 0) {
+    first_add_us_ = timestamp_us();
+  }
+
+  inputs_.insert(inputs_.end(), inputs, inputs + num_rows * input_dim_);
+
+  size_t first_row = num_rows_;
+  num_rows_ += num_rows;
+  return first_row;
+}
+
+void TTPBatch::run()
+{
+  if (done_) {
+    return;
+  }
+
+  done_ = true;
+
+  if (num_rows_ == 0) {
+    return;
+  }
+
+  /* how long the first rows waited for the rest of the batch */
+  const uint64_t start_us = timestamp_us();
+  Metrics::record("ttp_queue_us", start_us - first_add_us_);
+  Metrics::record("ttp_batch_rows", num_rows_);
+
+  logits_.resize(num_rows_ * output_dim_);
+
+  InferenceChannel * channel =
+    model_path_.empty() ? nullptr : InferenceChannel::get();
+  if (not channel or
+      not channel->forward(model_path_, meta_path_, inputs_.data(), num_rows_,
+                           input_dim_, logits_.data(), output_dim_)) {
+    model_.forward(inputs_.data(), num_rows_, logits_.data());
+  }
+
+  /* softmax of each row */
+  output_.resize(num_rows_ * output_dim_);
+  for (size_t r = 0; r < num_rows_; r++) {
+    Distribution::softmax(logits_.data() + r * output_dim_, output_dim_,
+                          output_.data() + r * output_dim_);
+  }
+
+  Metrics::record("ttp_inference_us", timestamp_us() - start_us);
+}
+
+const float * TTPBatch::output(const size_t row) const
+{
+  if (not done_ or row >= num_rows_) {
+    throw runtime_error("TTPBatch: no output for the row");
+  }
+
+  return output_.data() + row * output_dim_;
+}
@@ -0,0 +1,52 @@
+#ifndef TTP_BATCH_HH
+#define TTP_BATCH_HH
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "mlp.hh"
+
+/* rows of TTP inputs from several clients, fed to one model in a single
+ * forward pass; rows are added until the batch is run, and adding rows to
+ * a batch that has been run starts a new generation of the batch */
+class TTPBatch
+{
+public:
+  /* the model must outlive the batch; if model_path is given, the forward
+   * pass is requested from inference_daemon (see InferenceChannel) when
+   * enabled, with model as the fallback */
+  explicit TTPBatch(const MLP & model, const std::string & model_path = "",
+                    const std::string & meta_path = "");
+
+  /* append num_rows rows of input_dim inputs; return the index of the first */
+  size_t add(const float * inputs, const size_t num_rows);
+
+  /* run the forward pass over all the rows, unless it has been run */
+  void run();
+
+  /* softmax output of a row, with output_dim() values; requires run() */
+  const float * output(const size_t row) const;
+  size_t output_dim() const { return output_dim_; }
+
+  uint64_t generation() const { return generation_; }
+
+private:
+  const MLP & model_;
+  std::string model_path_;
+  std::string meta_path_;
+  size_t input_dim_;
+  size_t output_dim_;
+
+  std::vector<float> inputs_ {};
+  size_t num_rows_ {0};
+  uint64_t first_add_us_ {0};  /* when the first row was added */
+
+  bool done_ {false};
+  uint64_t generation_ {0};
+
+  std::vector<float> logits_ {};
+  std::vector<float> output_ {};
+};
+
+#endif /* TTP_BATCH_HH */
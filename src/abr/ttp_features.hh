@@ -0,0 +1,44 @@
+#ifndef TTP_FEATURES_HH
+#define TTP_FEATURES_HH
+
+#include <cstddef>
+#include <vector>
+
+/* The inputs of the TTP models, in the order and the units that they are
+ * trained with: for each past chunk, oldest first, the TCP info when it was
+ * sent (unless the model takes no TCP info) followed by its size and
+ * transmission time; then the current TCP info (likewise); last, the size of
+ * the chunk to send. PufferTTP serves the models and ttp_extractor makes
+ * their training data with these, so that the two cannot drift apart. */
+class TTPFeatures
+{
+public:
+  static constexpr size_t PKT_BYTES = 1500;
+  static constexpr size_t MILLION = 1000000;
+  static constexpr size_t THOUSAND = 1000;
+
+  /* info has the fields of TCPInfo, e.g., an ABRAlgo::Chunk */
+  template<class Info>
+  static void append_tcp_info(std::vector<double> & input, const Info & info)
+  {
+    input.insert(input.end(), {
+      (double) info.delivery_rate / PKT_BYTES,
+      (double) info.cwnd,
+      (double) info.in_flight,
+      (double) info.min_rtt / MILLION,
+      (double) info.rtt / MILLION,
+    });
+  }
+
+  /* a past chunk of size (bytes) transmitted in trans_time (ms) */
+  static void append_chunk(std::vector<double> & input, const double size,
+                           const double trans_time)
+  {
+    input.insert(input.end(), {size / PKT_BYTES, trans_time / THOUSAND});
+  }
+
+  /* the input of the size (bytes) of the chunk to send */
+  static double next_chunk_size(const double size) { return size / PKT_BYTES; }
+};
+
+#endif /* TTP_FEATURES_HH */
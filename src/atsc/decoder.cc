@@ -10,14 +10,28 @@
 #include <cstring>
 #include <array>
 #include <queue>
+#include <map>
 #include <optional>
 #include <cmath>
+#include <climits>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <tuple>
 
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #ifdef HAVE_STRING_VIEW
 #include <string_view>
 #elif HAVE_EXPERIMENTAL_STRING_VIEW
@@ -38,6 +52,12 @@ extern "C" {
 #include "socket.hh"
 #include "timestamp.hh"
 #include "poller.hh"
+#include "io_buffer.hh"
+#include "tokenize.hh"
+#include "spsc_ring.hh"
+#include "mmap.hh"
+#include "profiler.hh"
+#include "vaapi_mpeg2.hh"
 
 using namespace std;
 using namespace PollerShortNames;
@@ -50,20 +70,28 @@ static const unsigned int audio_block_duration = 144000;
 static const unsigned int audio_samples_per_block = 256;
 static const unsigned int opus_sample_overlap = 10 * 960 + 960 - 312; /* 960 = 48 kHz * 20 ms, 312 = Opus's 6.5 ms lookahead */
 
-/* if tmp_dir is not empty, output to tmp_dir first and move output chunks
- * to video_output_dir or audio_output_dir */
-static string tmp_dir;
-
 void print_usage( const string & program_name )
 {
   cerr <<
   "Usage: " << program_name << " video_pid audio_pid format "
   "frames_per_chunk audio_blocks_per_chunk audio_sample_overlap "
-  "video_output_dir audio_output_dir [--tmp TMP] [--tcp IP:PORT]\n\n"
+  "video_output_dir audio_output_dir [--tmp TMP] "
+  "[--tcp IP:PORT [--resume] | --udp [GROUP:]PORT] [--vaapi DEVICE]\n"
+  "       " << program_name << " --program PROGRAM [--program PROGRAM ...] "
+  "[--tmp TMP] [--tcp IP:PORT [--resume] | --udp [GROUP:]PORT] [--vaapi DEVICE]\n\n"
   "format = \"1080i30\" | \"720p60\"\n"
   "--tmp TMP : output to TMP directory first and then move output chunks "
   "to video_output_dir or audio_output_dir\n"
-  "--tcp IP:PORT : establish a TCP connection and read input from IP:PORT"
+  "--tcp IP:PORT : establish a TCP connection and read input from IP:PORT\n"
+  "--resume : subscribe to the input from udp_to_tcp at IP:PORT so that it\n"
+  "resumes where it left off if the connection is lost\n"
+  "--udp [GROUP:]PORT : receive the input as TS over UDP on PORT, joining "
+  "GROUP if it is a multicast group (e.g., 239.0.0.1:5000), without udp_to_tcp\n"
+  "--program PROGRAM : decode a program of the multiplex, given as the "
+  "arguments above separated by commas (\"video_pid,audio_pid,...,"
+  "audio_output_dir\"), optionally followed by \",TMP\" for a TMP of its own\n"
+  "--vaapi DEVICE : decode the video on the GPU of the DRM render node DEVICE "
+  "(e.g., /dev/dri/renderD128), and in software where it cannot"
   << endl;
 }
 
@@ -78,18 +106,72 @@ int64_t timestamp_difference( const uint64_t ts_64, const uint64_t ts_33 )
   return static_cast<int64_t>(ts_64) - static_cast<int64_t>(ts_33);
 }
 
+/* reserve the blocks of a chunk file of size bytes before writing it, so
+ * that a full disk fails the chunk up front and the file is laid out in one
+ * extent; the size shown stays that of what is written. File systems
+ * without fallocate (EOPNOTSUPP) allocate as the chunk is written. */
+void reserve_chunk( FileDescriptor & fd, const size_t size )
+{
+  if ( fallocate( fd.fd_num(), FALLOC_FL_KEEP_SIZE, 0, size ) < 0
+       and errno != EOPNOTSUPP ) {
+    throw unix_error( "fallocate" );
+  }
+}
+
+static const size_t huge_page_size = 2 * 1024 * 1024;
+
+/* Map at least size bytes (rounded up to huge pages), backed by huge pages
+ * if any are reserved and otherwise asking for transparent ones, so that a
+ * few TLB entries cover many fields. */
+shared_ptr<void> map_huge_pages( const size_t size )
+{
+  const size_t rounded_size = (size + huge_page_size - 1) / huge_page_size * huge_page_size;
+
+  try {
+    return mmap_shared( nullptr, rounded_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+  } catch ( const exception & ) {
+    /* no huge pages reserved */
+  }
+
+  shared_ptr<void> memory = mmap_shared( nullptr, rounded_size, PROT_READ | PROT_WRITE,
+                                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+  madvise( memory.get(), rounded_size, MADV_HUGEPAGE ); /* only a hint */
+  return memory;
+}
+
+/* the planes of a decoded frame, as libmpeg2 (three planes) or VA-API (NV12,
+ * whose Cb plane interleaves Cb and Cr, and Cr is null) output them */
+struct FramePlanes
+{
+  const uint8_t * Y, * Cb, * Cr;
+  unsigned int luma_pitch, chroma_pitch;
+};
+
 struct Raster
 {
   unsigned int width, height;
-  unique_ptr<uint8_t[]> Y, Cb, Cr;
+  shared_ptr<void> memory; /* of the planes, which follow each other */
+  uint8_t * Y = nullptr, * Cb = nullptr, * Cr = nullptr;
+
+  /* the bytes of the planes of a raster, rounded up to a cache line */
+  static size_t size( const unsigned int width, const unsigned int height )
+  {
+    return (height * width + 2 * (height/2) * (width/2) + 63) / 64 * 64;
+  }
 
+  /* the planes go in memory if given (of size() bytes), or a new allocation */
   Raster( const unsigned int s_width,
-          const unsigned int s_height )
+          const unsigned int s_height,
+          shared_ptr<void> s_memory = {} )
     : width( s_width ),
       height( s_height ),
-      Y(  make_unique<uint8_t[]>(  height    *  width ) ),
-      Cb( make_unique<uint8_t[]>( (height/2) * (width/2) ) ),
-      Cr( make_unique<uint8_t[]>( (height/2) * (width/2) ) )
+      memory( s_memory ? move( s_memory )
+                       : shared_ptr<void>( new uint8_t[ size( width, height ) ],
+                                           default_delete<uint8_t[]>() ) ),
+      Y( static_cast<uint8_t *>( memory.get() ) ),
+      Cb( Y + height * width ),
+      Cr( Cb + (height/2) * (width/2) )
   {
     if ( (height % 2 != 0)
          or (width % 2 != 0) ) {
@@ -99,36 +181,56 @@ struct Raster
     clear();
   }
 
+  /* forbid copying Raster objects or assigning them */
+  Raster( const Raster & other ) = delete;
+  const Raster & operator=( const Raster & other ) = delete;
+
   void clear()
   {
-    memset( Y.get(),  16,   height    *  width );
-    memset( Cb.get(), 128, (height/2) * (width/2) );
-    memset( Cr.get(), 128, (height/2) * (width/2) );
+    memset( Y,  16,   height    *  width );
+    memset( Cb, 128, (height/2) * (width/2) );
+    memset( Cr, 128, (height/2) * (width/2) );
   }
 
-  void read_from_frame( const bool top_field,
-                        const unsigned int physical_luma_width,
-                        const mpeg2_fbuf_t * display_raster )
+  void read_from_frame( const bool top_field, const FramePlanes & frame )
   {
-    if ( physical_luma_width < width ) {
-      throw runtime_error( "invalid physical_luma_width" );
+    if ( frame.luma_pitch < width
+         or frame.chroma_pitch < (frame.Cr ? width/2 : width) ) {
+      throw runtime_error( "invalid pitch" );
     }
 
     /* copy Y */
     for ( unsigned int source_row = (top_field ? 0 : 1), dest_row = 0;
           dest_row < height;
           source_row += 2, dest_row += 1 ) {
-      memcpy( Y.get() + dest_row * width,
-              display_raster->buf[ 0 ] + source_row * physical_luma_width,
+      memcpy( Y + dest_row * width,
+              frame.Y + source_row * frame.luma_pitch,
               width );
     }
 
+    if ( not frame.Cr ) {
+      /* split the interleaved Cb and Cr */
+      for ( unsigned int source_row = (top_field ? 0 : 1), dest_row = 0;
+            dest_row < height/2;
+            source_row += 2, dest_row += 1 ) {
+        const uint8_t * source = frame.Cb + source_row * frame.chroma_pitch;
+        uint8_t * Cb_row = Cb + dest_row * width/2;
+        uint8_t * Cr_row = Cr + dest_row * width/2;
+        for ( unsigned int i = 0; i < width/2; i++ ) {
+          Cb_row[ i ] = source[ 2 * i ];
+          Cr_row[ i ] = source[ 2 * i + 1 ];
+        }
+      }
+
+      return;
+    }
+
     /* copy Cb */
     for ( unsigned int source_row = (top_field ? 0 : 1), dest_row = 0;
           dest_row < height/2;
           source_row += 2, dest_row += 1 ) {
-      memcpy( Cb.get() + dest_row * width/2,
-              display_raster->buf[ 1 ] + source_row * physical_luma_width/2,
+      memcpy( Cb + dest_row * width/2,
+              frame.Cb + source_row * frame.chroma_pitch,
               width/2 );
     }
 
@@ -136,8 +238,8 @@ struct Raster
     for ( unsigned int source_row = (top_field ? 0 : 1), dest_row = 0;
           dest_row < height/2;
           source_row += 2, dest_row += 1 ) {
-      memcpy( Cr.get() + dest_row * width/2,
-              display_raster->buf[ 2 ] + source_row * physical_luma_width/2,
+      memcpy( Cr + dest_row * width/2,
+              frame.Cr + source_row * frame.chroma_pitch,
               width/2 );
     }
   }
@@ -188,30 +290,76 @@ public:
 
 typedef unique_ptr<Raster, RasterDeleter> RasterHandle;
 
+/* Pools the rasters of the fields by size class (width and height), so
+ * that a change of resolution starts a class rather than failing. At most
+ * MAX_UNUSED_PER_CLASS unused rasters are kept in a class, and the rest are
+ * freed. Shared by the video decoder and the output, which run on different
+ * threads. */
 class RasterPool
 {
 private:
-  queue<RasterHandle> unused_buffers_ {};
+  static const size_t MAX_UNUSED_PER_CLASS = 256;
+
+  struct SizeClass
+  {
+    queue<RasterHandle> unused_buffers {};
+    size_t in_use { 0 };
+  };
+
+  map<pair<unsigned int, unsigned int>, SizeClass> classes_ {};
+  size_t in_use_ { 0 };     /* of all the classes */
+  size_t high_water_ { 0 }; /* the most in use since take_high_water() */
+  mutex mutex_ {};
 
 public:
+  /* allocate count rasters of the size in one mapping of huge pages, which
+   * is touched (cleared) by the calling thread and so placed on its NUMA
+   * node; the mapping is unmapped once all of the rasters are freed */
+  void preallocate( const unsigned int luma_width,
+                    const unsigned int field_luma_height,
+                    size_t count )
+  {
+    lock_guard<mutex> lock( mutex_ );
+    auto & size_class = classes_[ { luma_width, field_luma_height } ];
+
+    count = min( count, MAX_UNUSED_PER_CLASS - size_class.unused_buffers.size() );
+    if ( count == 0 ) {
+      return;
+    }
+
+    const size_t raster_size = Raster::size( luma_width, field_luma_height );
+    const shared_ptr<void> slab = map_huge_pages( count * raster_size );
+
+    for ( size_t i = 0; i < count; i++ ) {
+      /* aliases slab, to keep it mapped */
+      shared_ptr<void> memory { slab, static_cast<uint8_t *>( slab.get() ) + i * raster_size };
+      size_class.unused_buffers.emplace( new Raster( luma_width, field_luma_height, move( memory ) ) );
+    }
+  }
+
+  /* a buffer that is about to be overwritten need not be cleared */
   RasterHandle make_buffer( const unsigned int luma_width,
-                            const unsigned int field_luma_height )
+                            const unsigned int field_luma_height,
+                            const bool clear = true )
   {
+    lock_guard<mutex> lock( mutex_ );
+    auto & size_class = classes_[ { luma_width, field_luma_height } ];
     RasterHandle ret;
 
-    if ( unused_buffers_.empty() ) {
+    if ( size_class.unused_buffers.empty() ) {
       ret.reset( new Raster( luma_width, field_luma_height ) );
     } else {
-      if ( (unused_buffers_.front()->width != luma_width)
-           or (unused_buffers_.front()->height != field_luma_height) ) {
-        throw runtime_error( "buffer size has changed" );
+      ret = move( size_class.unused_buffers.front() );
+      size_class.unused_buffers.pop();
+      if ( clear ) {
+        ret->clear();
       }
-
-      ret = move( unused_buffers_.front() );
-      unused_buffers_.pop();
-      ret->clear();
     }
 
+    size_class.in_use++;
+    in_use_++;
+    high_water_ = max( high_water_, in_use_ );
+
     ret.get_deleter().set_buffer_pool( this );
     return ret;
   }
@@ -222,7 +370,25 @@ public:
       throw runtime_error( "attempt to free null buffer" );
     }
 
-    unused_buffers_.emplace( buffer );
+    lock_guard<mutex> lock( mutex_ );
+    auto & size_class = classes_.at( { buffer->width, buffer->height } );
+    size_class.in_use--;
+    in_use_--;
+
+    if ( size_class.unused_buffers.size() < MAX_UNUSED_PER_CLASS ) {
+      size_class.unused_buffers.emplace( buffer );
+    } else {
+      delete buffer;
+    }
+  }
+
+  /* the most rasters in use at once since the last call */
+  size_t take_high_water()
+  {
+    lock_guard<mutex> lock( mutex_ );
+    const size_t ret = high_water_;
+    high_water_ = in_use_;
+    return ret;
   }
 };
 
@@ -244,39 +410,39 @@ void RasterDeleter::set_buffer_pool( RasterPool * pool )
   buffer_pool_ = pool;
 }
 
-RasterPool & global_buffer_pool()
-{
-  static RasterPool pool;
-  return pool;
-}
-
+/* The contents of a field never change once decoded, so they are shared
+ * rather than copied: the Y4M_Writer keeps the fields of a chunk until the
+ * chunk is written, and a filler field can appear any number of times. */
 struct VideoField
 {
   uint64_t presentation_time_stamp;
   bool top_field;
-  RasterHandle contents;
+  shared_ptr<const Raster> contents;
 
-  VideoField( const uint64_t presentation_time_stamp,
+  VideoField( RasterPool & pool,
+              const uint64_t presentation_time_stamp,
               const bool top_field,
               const unsigned int luma_width,
               const unsigned int frame_luma_height,
-              const unsigned int physical_luma_width,
-              const mpeg2_fbuf_t * display_raster )
-    : VideoField( presentation_time_stamp,
-                  top_field,
-                  luma_width,
-                  frame_luma_height )
+              const FramePlanes & frame )
+    : presentation_time_stamp( presentation_time_stamp ),
+      top_field( top_field ),
+      contents()
   {
-    contents->read_from_frame( top_field, physical_luma_width, display_raster );
+    /* every row is overwritten */
+    RasterHandle raster = pool.make_buffer( luma_width, frame_luma_height / 2, false );
+    raster->read_from_frame( top_field, frame );
+    contents = move( raster );
   }
 
-  VideoField( const uint64_t presentation_time_stamp,
+  VideoField( RasterPool & pool,
+              const uint64_t presentation_time_stamp,
               const bool top_field,
               const unsigned int luma_width,
               const unsigned int frame_luma_height )
     : presentation_time_stamp( presentation_time_stamp ),
       top_field( top_field ),
-      contents( global_buffer_pool().make_buffer( luma_width, frame_luma_height / 2 ) )
+      contents( pool.make_buffer( luma_width, frame_luma_height / 2 ) )
   {}
 };
 
@@ -301,6 +467,8 @@ struct TSPacketHeader : TSPacketRequirements
   bool payload_unit_start_indicator;
   uint16_t pid;
   uint8_t adaptation_field_control;
+  uint8_t continuity_counter;
+  bool discontinuity_indicator; /* the continuity counter may jump */
   uint8_t payload_start;
 
   TSPacketHeader( const string_view & packet )
@@ -309,6 +477,10 @@ struct TSPacketHeader : TSPacketRequirements
       payload_unit_start_indicator( packet[ 1 ] & 0x40 ),
       pid( ((uint8_t( packet[ 1 ] ) & 0x1f) << 8) | uint8_t( packet[ 2 ] ) ),
       adaptation_field_control( (uint8_t( packet[ 3 ] ) & 0x30) >> 4 ),
+      continuity_counter( uint8_t( packet[ 3 ] ) & 0x0f ),
+      discontinuity_indicator( (adaptation_field_control & 2)
+                               and packet[ 4 ] != 0
+                               and (packet[ 5 ] & 0x80) ),
       payload_start( 4 )
   {
     /* find start of payload */
@@ -331,6 +503,9 @@ struct TSPacketHeader : TSPacketRequirements
       throw InvalidMPEG( "invalid TS packet" );
     }
   }
+
+  /* the continuity counter counts the packets with a payload */
+  bool has_payload() const { return adaptation_field_control & 1; }
 };
 
 struct TimestampedPESPacket
@@ -388,6 +563,48 @@ struct TimestampedPESPacket
   }
 };
 
+/* Reusable buffers for the PES packets of a stream. The demuxer fills a
+ * buffer and the decoder gives it back when done with the packet; as they
+ * run on different threads, the pool is guarded by a mutex. A buffer comes
+ * back with its capacity, so a pool warmed up on a stream stops allocating
+ * even for video PES packets of hundreds of KB. */
+class PESBufferPool
+{
+private:
+  static const size_t MAX_FREE_BUFFERS = 64;
+
+  vector<string> unused_buffers_ {};
+  mutex mutex_ {};
+
+public:
+  /* an empty buffer with a capacity of at least expected_size */
+  string make_buffer( const size_t expected_size )
+  {
+    string ret;
+
+    {
+      lock_guard<mutex> lock( mutex_ );
+      if ( not unused_buffers_.empty() ) {
+        ret = move( unused_buffers_.back() );
+        unused_buffers_.pop_back();
+      }
+    }
+
+    ret.reserve( expected_size );
+    return ret;
+  }
+
+  void free_buffer( string && buffer )
+  {
+    buffer.clear();
+
+    lock_guard<mutex> lock( mutex_ );
+    if ( unused_buffers_.size() < MAX_FREE_BUFFERS ) {
+      unused_buffers_.emplace_back( move( buffer ) );
+    }
+  }
+};
+
 struct PESPacketHeader
 {
   uint8_t stream_id;
@@ -532,9 +749,79 @@ struct VideoParameters
 struct AudioBlock
 {
   uint64_t presentation_time_stamp;
-  int16_t left[ audio_samples_per_block ], right[ audio_samples_per_block ];
+  int16_t samples[ 2 * audio_samples_per_block ]; /* interleaved: left, right, left, ... */
 };
 
+/* convert the left and right channels of a block from a52dec (each
+ * audio_samples_per_block samples) to interleaved 16-bit samples, rounded
+ * to nearest (ties to even); return false if a sample is out of range */
+static bool interleave_samples( const sample_t * left, const sample_t * right, int16_t * out )
+{
+  unsigned int i = 0;
+  bool in_range = true;
+
+#if defined(__SSE2__) && !defined(LIBA52_DOUBLE)
+  const __m128 max = _mm_set1_ps( 32767.4 );
+  const __m128 min = _mm_set1_ps( -32767.4 );
+  __m128 out_of_range = _mm_setzero_ps();
+
+  for ( ; i + 8 <= audio_samples_per_block; i += 8 ) {
+    const __m128 l0 = _mm_loadu_ps( left + i ), l1 = _mm_loadu_ps( left + i + 4 );
+    const __m128 r0 = _mm_loadu_ps( right + i ), r1 = _mm_loadu_ps( right + i + 4 );
+
+    out_of_range = _mm_or_ps( out_of_range,
+                              _mm_or_ps( _mm_or_ps( _mm_cmpgt_ps( l0, max ), _mm_cmplt_ps( l0, min ) ),
+                                         _mm_or_ps( _mm_cmpgt_ps( r0, max ), _mm_cmplt_ps( r0, min ) ) ) );
+    out_of_range = _mm_or_ps( out_of_range,
+                              _mm_or_ps( _mm_or_ps( _mm_cmpgt_ps( l1, max ), _mm_cmplt_ps( l1, min ) ),
+                                         _mm_or_ps( _mm_cmpgt_ps( r1, max ), _mm_cmplt_ps( r1, min ) ) ) );
+
+    /* in range, so packing does not saturate */
+    const __m128i l = _mm_packs_epi32( _mm_cvtps_epi32( l0 ), _mm_cvtps_epi32( l1 ) );
+    const __m128i r = _mm_packs_epi32( _mm_cvtps_epi32( r0 ), _mm_cvtps_epi32( r1 ) );
+
+    _mm_storeu_si128( reinterpret_cast<__m128i *>( out + 2 * i ), _mm_unpacklo_epi16( l, r ) );
+    _mm_storeu_si128( reinterpret_cast<__m128i *>( out + 2 * i + 8 ), _mm_unpackhi_epi16( l, r ) );
+  }
+
+  in_range = _mm_movemask_ps( out_of_range ) == 0;
+#elif defined(__ARM_NEON) && defined(__aarch64__) && !defined(LIBA52_DOUBLE)
+  const float32x4_t max = vdupq_n_f32( 32767.4 );
+  const float32x4_t min = vdupq_n_f32( -32767.4 );
+  uint32x4_t out_of_range = vdupq_n_u32( 0 );
+
+  for ( ; i + 8 <= audio_samples_per_block; i += 8 ) {
+    const float32x4_t l0 = vld1q_f32( left + i ), l1 = vld1q_f32( left + i + 4 );
+    const float32x4_t r0 = vld1q_f32( right + i ), r1 = vld1q_f32( right + i + 4 );
+
+    out_of_range = vorrq_u32( out_of_range, vorrq_u32( vcgtq_f32( l0, max ), vcltq_f32( l0, min ) ) );
+    out_of_range = vorrq_u32( out_of_range, vorrq_u32( vcgtq_f32( l1, max ), vcltq_f32( l1, min ) ) );
+    out_of_range = vorrq_u32( out_of_range, vorrq_u32( vcgtq_f32( r0, max ), vcltq_f32( r0, min ) ) );
+    out_of_range = vorrq_u32( out_of_range, vorrq_u32( vcgtq_f32( r1, max ), vcltq_f32( r1, min ) ) );
+
+    int16x8x2_t interleaved;
+    interleaved.val[ 0 ] = vcombine_s16( vqmovn_s32( vcvtnq_s32_f32( l0 ) ), vqmovn_s32( vcvtnq_s32_f32( l1 ) ) );
+    interleaved.val[ 1 ] = vcombine_s16( vqmovn_s32( vcvtnq_s32_f32( r0 ) ), vqmovn_s32( vcvtnq_s32_f32( r1 ) ) );
+    vst2q_s16( out + 2 * i, interleaved );
+  }
+
+  in_range = vmaxvq_u32( out_of_range ) == 0;
+#endif
+
+  /* scalar fallback */
+  for ( ; i < audio_samples_per_block; i++ ) {
+    if ( left[ i ] > 32767.4 or left[ i ] < -32767.4
+         or right[ i ] > 32767.4 or right[ i ] < -32767.4 ) {
+      in_range = false;
+    }
+
+    out[ 2 * i ] = static_cast<int16_t>( lrint( left[ i ] ) );
+    out[ 2 * i + 1 ] = static_cast<int16_t>( lrint( right[ i ] ) );
+  }
+
+  return in_range;
+}
+
 class A52AudioDecoder
 {
 private:
@@ -548,15 +835,6 @@ private:
 
   unique_ptr<a52_state_t, A52Deleter> decoder_;
 
-  sample_t check_sample( const sample_t & sample )
-  {
-    if ( sample > 32767.4 or sample < -32767.4 ) {
-      throw InvalidMPEG( "sample out of range" );
-    }
-
-    return sample;
-  }
-
 public:
   A52AudioDecoder()
     : decoder_( notnull( "a52_init", a52_init( MM_ACCEL_DJBFFT ) ) )
@@ -605,16 +883,10 @@ public:
         chunk.presentation_time_stamp = 300 * PES_packet.presentation_time_stamp + block_id * audio_block_duration;
         //        cerr << "Making audio block with pts_27M = " << chunk.presentation_time_stamp << "\n";
 
-        sample_t * next_sample = a52_samples( decoder_.get() );
-
-        for ( unsigned int i = 0; i < audio_samples_per_block; i++ ) {
-          chunk.left[ i ] = static_cast<int16_t>( lround( check_sample( *next_sample ) ) );
-          next_sample++;
-        }
-
-        for ( unsigned int i = 0; i < audio_samples_per_block; i++ ) {
-          chunk.right[ i ] = static_cast<int16_t>( lround( check_sample( *next_sample ) ) );
-          next_sample++;
+        /* the left channel, then the right */
+        const sample_t * samples = a52_samples( decoder_.get() );
+        if ( not interleave_samples( samples, samples + audio_samples_per_block, chunk.samples ) ) {
+          throw InvalidMPEG( "sample out of range" );
         }
 
         decoded_samples.push( chunk );
@@ -627,7 +899,146 @@ public:
   }
 };
 
-class MPEG2VideoDecoder
+/* How much of the video to decode when decoding falls behind: each level
+ * skips more pictures, whose slots the VideoOutput fills by repeating the
+ * fields before them, so that the output catches up without a resync */
+enum class Degradation { NONE, SKIP_B_PICTURES, INTRA_ONLY };
+
+/* A decoder of MPEG-2 video into the fields of its pictures, in display
+ * order. The backends decode in software (MPEG2VideoDecoder) or on a GPU
+ * (VAAPIVideoDecoder); both output their pictures with output_picture(). */
+class VideoDecoderBackend
+{
+protected:
+  RasterPool * raster_pool_; /* of the fields decoded */
+
+  unsigned int display_width_;
+  unsigned int display_height_;
+  unsigned int frame_interval_;
+  bool progressive_sequence_;
+
+  /* the reference pictures to decode before pictures that refer to them
+   * can be decoded again, after a P picture was skipped: an I picture, then
+   * an I or P picture (for the B pictures between the two) */
+  unsigned int anchors_to_rebuild_ {};
+
+  /* the coding type (PIC_FLAG_CODING_TYPE_I, _P or _B) of the first picture in
+   * [begin, end), or 0 if none is found before a sequence header */
+  static unsigned int peek_picture_coding_type( const uint8_t * begin, const uint8_t * end )
+  {
+    for ( const uint8_t * p = begin; end - p >= 6; p++ ) {
+      if ( p[ 0 ] != 0 or p[ 1 ] != 0 or p[ 2 ] != 1 ) {
+        continue;
+      }
+
+      if ( p[ 3 ] == 0x00 ) { /* picture_start_code */
+        return (p[ 5 ] >> 3) & 0x7;
+      } else if ( p[ 3 ] == 0xB3 ) { /* sequence_header_code: always decode */
+        return 0;
+      }
+    }
+
+    return 0;
+  }
+
+  bool skip_picture( const unsigned int picture_coding_type, const Degradation degradation )
+  {
+    switch ( picture_coding_type ) {
+    case PIC_FLAG_CODING_TYPE_I:
+      anchors_to_rebuild_ = min( anchors_to_rebuild_, 1u );
+      return false;
+    case PIC_FLAG_CODING_TYPE_P:
+      if ( anchors_to_rebuild_ == 2 or degradation == Degradation::INTRA_ONLY ) {
+        anchors_to_rebuild_ = 2;
+        return true;
+      }
+      anchors_to_rebuild_ = 0;
+      return false;
+    case PIC_FLAG_CODING_TYPE_B:
+      return anchors_to_rebuild_ > 0 or degradation != Degradation::NONE;
+    default:
+      return false;
+    }
+  }
+
+  /* output the fields of a picture, whose presentation time stamp is at
+   * 90 kHz, and which has nb_fields fields (three or more if a field or the
+   * frame is repeated) */
+  void output_picture( const FramePlanes & frame,
+                       const uint64_t presentation_time_stamp,
+                       const unsigned int nb_fields,
+                       const bool top_field_first,
+                       queue<VideoField> & output )
+  {
+    if ( progressive_sequence_ ) {
+      if ( nb_fields % 2 != 0 ) {
+        throw runtime_error( "progressive sequence, but picture has odd number of fields" );
+      }
+    }
+
+    bool next_field_is_top = top_field_first | progressive_sequence_;
+    uint64_t presentation_time_stamp_27M = 300 * presentation_time_stamp;
+
+    /* output each field */
+    for ( unsigned int field = 0; field < nb_fields; field++ ) {
+      output.emplace( *raster_pool_,
+                      presentation_time_stamp_27M,
+                      next_field_is_top,
+                      display_width_,
+                      display_height_,
+                      frame );
+
+      next_field_is_top = !next_field_is_top;
+      presentation_time_stamp_27M += frame_interval_ / 2; /* treat all as interlaced */
+    }
+  }
+
+public:
+  VideoDecoderBackend( const VideoParameters & params, RasterPool & raster_pool )
+    : raster_pool_( &raster_pool ),
+      display_width_( params.width ),
+      display_height_( params.height ),
+      frame_interval_( params.frame_interval ),
+      progressive_sequence_( params.progressive )
+  {
+    if ( (display_width_ % 4 != 0)
+         or (display_height_ % 4 != 0) ) {
+      throw runtime_error( "width or height is not multiple of 4" );
+    }
+  }
+
+  virtual ~VideoDecoderBackend() {}
+
+  /* forbid copying VideoDecoderBackend objects or assigning them */
+  VideoDecoderBackend( const VideoDecoderBackend & other ) = delete;
+  const VideoDecoderBackend & operator=( const VideoDecoderBackend & other ) = delete;
+
+  /* decode the picture of a PES packet (mutable because mpeg2_buffer args
+   * are not const), and output the fields that are due for display */
+  virtual void decode_frame( TimestampedPESPacket & PES_packet,
+                             queue<VideoField> & output ) = 0;
+
+  /* start over after a non-fatal error */
+  virtual void reset() = 0;
+
+  /* decode_frame() unless degradation calls for skipping the picture, in
+   * which case no fields are output for it; return whether it was decoded */
+  bool decode( TimestampedPESPacket & PES_packet,
+               const Degradation degradation,
+               queue<VideoField> & output )
+  {
+    if ( skip_picture( peek_picture_coding_type( PES_packet.payload_start(),
+                                                 PES_packet.payload_end() ),
+                       degradation ) ) {
+      return false;
+    }
+
+    decode_frame( PES_packet, output );
+    return true;
+  }
+};
+
+class MPEG2VideoDecoder : public VideoDecoderBackend
 {
 private:
   struct MPEG2Deleter
@@ -640,11 +1051,6 @@ private:
 
   unique_ptr<mpeg2dec_t, MPEG2Deleter> decoder_;
 
-  unsigned int display_width_;
-  unsigned int display_height_;
-  unsigned int frame_interval_;
-  bool progressive_sequence_;
-
   static unsigned int macroblock_dimension( const unsigned int num )
   {
     return ( num + 15 ) / 16;
@@ -712,53 +1118,40 @@ private:
     }
   }
 
-  void output_picture( const mpeg2_picture_t * pic,
-                       const mpeg2_fbuf_t * display_raster,
-                       queue<VideoField> & output )
+  void output_libmpeg2_picture( const mpeg2_picture_t * pic,
+                                const mpeg2_fbuf_t * display_raster,
+                                queue<VideoField> & output )
   {
     if ( not (pic->flags & PIC_FLAG_TAGS) ) {
       throw UnsupportedMPEG( "picture without timestamp" );
     }
 
-    if ( progressive_sequence_ ) {
-      if ( pic->nb_fields % 2 != 0 ) {
-        throw runtime_error( "progressive sequence, but picture has odd number of fields" );
-      }
-    }
-
-    bool next_field_is_top = (pic->flags & PIC_FLAG_TOP_FIELD_FIRST) | progressive_sequence_;
-    uint64_t presentation_time_stamp_27M = 300 * ( (uint64_t( pic->tag ) << 32) | (pic->tag2) );
-
-    /* output each field */
-    for ( unsigned int field = 0; field < pic->nb_fields; field++ ) {
-      output.emplace( presentation_time_stamp_27M,
-                      next_field_is_top,
-                      display_width_,
-                      display_height_,
-                      physical_luma_width(),
-                      display_raster );
+    const FramePlanes frame { display_raster->buf[ 0 ],
+                              display_raster->buf[ 1 ],
+                              display_raster->buf[ 2 ],
+                              physical_luma_width(),
+                              physical_luma_width() / 2 };
 
-      next_field_is_top = !next_field_is_top;
-      presentation_time_stamp_27M += frame_interval_ / 2; /* treat all as interlaced */
-    }
+    output_picture( frame,
+                    (uint64_t( pic->tag ) << 32) | (pic->tag2),
+                    pic->nb_fields,
+                    pic->flags & PIC_FLAG_TOP_FIELD_FIRST,
+                    output );
   }
 
 public:
-  MPEG2VideoDecoder( const VideoParameters & params )
-    : decoder_( notnull( "mpeg2_init", mpeg2_init() ) ),
-      display_width_( params.width ),
-      display_height_( params.height ),
-      frame_interval_( params.frame_interval ),
-      progressive_sequence_( params.progressive )
+  MPEG2VideoDecoder( const VideoParameters & params, RasterPool & raster_pool )
+    : VideoDecoderBackend( params, raster_pool ),
+      decoder_( notnull( "mpeg2_init", mpeg2_init() ) )
+  {}
+
+  void reset() override
   {
-    if ( (display_width_ % 4 != 0)
-         or (display_height_ % 4 != 0) ) {
-      throw runtime_error( "width or height is not multiple of 4" );
-    }
+    decoder_.reset( notnull( "mpeg2_init", mpeg2_init() ) );
   }
 
-  void decode_frame( TimestampedPESPacket & PES_packet, /* mutable because mpeg2_buffer args are not const */
-                     queue<VideoField> & output )
+  void decode_frame( TimestampedPESPacket & PES_packet,
+                     queue<VideoField> & output ) override
   {
     mpeg2_tag_picture( decoder_.get(),
                        PES_packet.presentation_time_stamp >> 32,
@@ -799,7 +1192,7 @@ public:
           if ( pic ) {
             /* picture ready for display */
             const mpeg2_fbuf_t * display_raster = notnull( "display_fbuf", decoder_info->display_fbuf );
-            output_picture( pic, display_raster, output );
+            output_libmpeg2_picture( pic, display_raster, output );
           }
         }
         break;
@@ -819,36 +1212,159 @@ public:
   }
 };
 
+/* Decodes on a GPU with VA-API (see VAAPIMPEG2Decoder), and in software
+ * from the first picture the GPU cannot decode on: a stream it does not
+ * support, or a failure of the GPU */
+class VAAPIVideoDecoder : public VideoDecoderBackend
+{
+private:
+  unique_ptr<VAAPIMPEG2Decoder> hardware_;
+  optional<MPEG2VideoDecoder> software_ {};
+  VideoParameters params_;
+
+public:
+  VAAPIVideoDecoder( const VideoParameters & params, RasterPool & raster_pool,
+                     const string & device )
+    : VideoDecoderBackend( params, raster_pool ),
+      hardware_( make_unique<VAAPIMPEG2Decoder>( device, params.width, params.height ) ),
+      params_( params )
+  {}
+
+  void reset() override
+  {
+    if ( software_ ) {
+      software_->reset();
+    } else {
+      hardware_->reset();
+    }
+  }
+
+  void decode_frame( TimestampedPESPacket & PES_packet,
+                     queue<VideoField> & output ) override
+  {
+    if ( not software_ ) {
+      try {
+        hardware_->decode( PES_packet.payload_start(), PES_packet.payload_end(),
+                           PES_packet.presentation_time_stamp,
+                           [&]( const VAAPIMPEG2Decoder::Picture & picture ) {
+                             output_picture( { picture.Y, picture.CbCr, nullptr,
+                                               picture.Y_pitch, picture.CbCr_pitch },
+                                             picture.presentation_time_stamp,
+                                             picture.nb_fields,
+                                             picture.top_field_first,
+                                             output );
+                           } );
+        return;
+      } catch ( const VAAPIMPEG2Decoder::Invalid & e ) {
+        throw InvalidMPEG( e.what() );
+      } catch ( const VAAPIMPEG2Decoder::Unsupported & e ) {
+        cerr << "VA-API: " << e.what() << "; decoding in software from now on" << endl;
+      }
+
+      /* libmpeg2 picks up at the next sequence header */
+      hardware_.reset();
+      software_.emplace( params_, *raster_pool_ );
+    }
+
+    software_->decode_frame( PES_packet, output );
+  }
+};
+
+/* decode on the GPU at vaapi_device if given and able, or else in software */
+unique_ptr<VideoDecoderBackend> make_video_decoder( const VideoParameters & params,
+                                                    RasterPool & raster_pool,
+                                                    const string & vaapi_device )
+{
+  if ( not vaapi_device.empty() ) {
+    try {
+      return make_unique<VAAPIVideoDecoder>( params, raster_pool, vaapi_device );
+    } catch ( const VAAPIMPEG2Decoder::Unsupported & e ) {
+      cerr << "VA-API: " << e.what() << "; decoding in software" << endl;
+    }
+  }
+
+  return make_unique<MPEG2VideoDecoder>( params, raster_pool );
+}
+
 class TSParser
 {
 private:
   unsigned int pid_; /* program ID of interest */
   bool is_video_; /* true = video, false = audio */
 
+  PESBufferPool & buffer_pool_;
   string PES_packet_ {};
+  size_t last_PES_packet_size_ { 0 }; /* to size the next buffer */
+
+  optional<uint8_t> last_continuity_counter_ {};
+  uint64_t continuity_gaps_ { 0 };
+
+  enum class Continuity { NEXT, DUPLICATE, GAP };
+
+  /* whether packets were lost (e.g., datagrams of a UDP input) before this
+   * one, or it repeats the last one, which a multiplexer may send twice */
+  Continuity check_continuity( const TSPacketHeader & header )
+  {
+    if ( not header.has_payload() ) {
+      return Continuity::NEXT;
+    }
+
+    const optional<uint8_t> last = exchange( last_continuity_counter_, header.continuity_counter );
+    if ( not last or header.discontinuity_indicator ) {
+      return Continuity::NEXT;
+    }
+
+    if ( header.continuity_counter == *last ) {
+      return Continuity::DUPLICATE;
+    }
+
+    return header.continuity_counter == ((*last + 1) & 0x0f) ? Continuity::NEXT : Continuity::GAP;
+  }
 
   void append_payload( const string_view & packet, const TSPacketHeader & header )
   {
+    if ( PES_packet_.empty() ) {
+      /* a little room to spare, as PES packets vary in size */
+      PES_packet_ = buffer_pool_.make_buffer( last_PES_packet_size_ + last_PES_packet_size_ / 4 );
+    }
+
     const string_view payload = packet.substr( header.payload_start );
     PES_packet_.append( payload.begin(), payload.end() );
   }
 
 public:
-  TSParser( const unsigned int pid, const bool is_video )
+  TSParser( const unsigned int pid, const bool is_video, PESBufferPool & buffer_pool )
     : pid_( pid ),
-      is_video_( is_video )
+      is_video_( is_video ),
+      buffer_pool_( buffer_pool )
   {
     if ( pid >= (1 << 13) ) {
       throw runtime_error( "program ID must be less than " + to_string( 1 << 13 ) );
     }
   }
 
-  void parse( const string_view & packet, queue<TimestampedPESPacket> & PES_packets )
-  {
-    TSPacketHeader header { packet };
+  unsigned int pid() const { return pid_; }
 
-    if ( header.pid != pid_ ) {
+  /* packet must be of the PID of this parser (its header already parsed) */
+  void parse( const string_view & packet, const TSPacketHeader & header,
+              queue<TimestampedPESPacket> & PES_packets )
+  {
+    switch ( check_continuity( header ) ) {
+    case Continuity::NEXT:
+      break;
+    case Continuity::DUPLICATE:
       return;
+    case Continuity::GAP:
+      /* the PES packet is missing a piece: drop it, and start over at the
+       * next one (possibly with this TS packet) */
+      continuity_gaps_++;
+      cerr << "Warning: TS packets lost on PID " << pid_ << " (" << continuity_gaps_
+           << " gaps so far)" << ( PES_packet_.empty() ? "" : ", dropping PES packet" ) << "\n";
+      if ( not PES_packet_.empty() ) {
+        buffer_pool_.free_buffer( move( PES_packet_ ) );
+        PES_packet_.clear();
+      }
+      break;
     }
 
     if ( header.payload_unit_start_indicator ) {
@@ -859,6 +1375,7 @@ public:
         /* make sure PES_packet_ is cleared even if header parsers subsequently throw an exception */
         string PES_packet = move( PES_packet_ );
         PES_packet_.clear();
+        last_PES_packet_size_ = PES_packet.size();
 
         /* now, attempt to parse the accumulated payload as a PES packet */
         PESPacketHeader pes_header { PES_packet, is_video_ };
@@ -886,23 +1403,70 @@ private:
   uint64_t wallclock_time_for_outer_timestamp_zero_;
   uint64_t pending_chunk_outer_timestamp_ {};
   unsigned int pending_chunk_index_ {};
-  vector<Raster> pending_chunk_;
+  /* the fields of each frame, written out in place when the chunk is done */
+  struct PendingFrame
+  {
+    shared_ptr<const Raster> top_field {};
+    shared_ptr<const Raster> bottom_field {};
+  };
+
+  vector<PendingFrame> pending_chunk_;
   unsigned int filler_field_count_ {};
 
+  unsigned int width_;
+  unsigned int height_;
+
   unsigned int frame_interval_;
 
   string directory_;
+  string tmp_directory_; /* if not empty, chunks are written there and moved */
   string y4m_header_;
 
+  RasterPool & raster_pool_; /* of the fields, reported in the .info */
+
   uint64_t outer_timestamp_ {};
 
   optional<int64_t> last_offset_ {};
 
-  Raster & pending_frame()
+  PendingFrame & pending_frame()
   {
     return pending_chunk_.at( pending_chunk_index_ );
   }
 
+  /* the rows of a plane of a frame, alternating between the fields */
+  static void add_interleaved_rows( vector<string_view> & buffers,
+                                    const uint8_t * top_plane,
+                                    const uint8_t * bottom_plane,
+                                    const unsigned int width,
+                                    const unsigned int field_height )
+  {
+    for ( unsigned int row = 0; row < field_height; row++ ) {
+      buffers.emplace_back( reinterpret_cast<const char *>( top_plane + row * width ), width );
+      buffers.emplace_back( reinterpret_cast<const char *>( bottom_plane + row * width ), width );
+    }
+  }
+
+  /* writev the buffers, at most IOV_MAX of them at a time */
+  static void write_all( FileDescriptor & fd, vector<string_view> & buffers )
+  {
+    auto next = buffers.begin();
+
+    while ( next != buffers.end() ) {
+      const auto batch_end = next + min<ptrdiff_t>( IOV_MAX, buffers.end() - next );
+      size_t bytes_written = fd.writev( vector<string_view>( next, batch_end ) );
+
+      /* skip the buffers written */
+      while ( next != buffers.end() and bytes_written >= next->size() ) {
+        bytes_written -= next->size();
+        next++;
+      }
+
+      if ( bytes_written > 0 ) {
+        next->remove_prefix( bytes_written );
+      }
+    }
+  }
+
   void write_frame_to_disk( const uint64_t first_field_presentation_time_stamp )
   {
     if ( pending_chunk_index_ == 0 ) {
@@ -915,8 +1479,8 @@ private:
       const string filename = to_string( pending_chunk_outer_timestamp_ ) + ".y4m";
       const string info_filename = to_string( pending_chunk_outer_timestamp_ ) + ".y4m.info";
 
-      /* output to tmp_dir first if tmp_dir is not empty */
-      string output_dir = tmp_dir.empty() ? directory_ : tmp_dir;
+      /* output to tmp_directory_ first if it is not empty */
+      string output_dir = tmp_directory_.empty() ? directory_ : tmp_directory_;
 
       cerr << "Writing " << output_dir + "/" + filename << " ... ";
       cerr << "(due in " << wallclock_ms_until_next_chunk_is_due() << " ms) ";
@@ -929,24 +1493,34 @@ private:
                                                                   O_WRONLY | O_CREAT | O_EXCL,
                                                                   S_IRUSR | S_IWUSR ) ) };
 
-      output_.write( y4m_header_ );
+      static const string_view frame_header { "FRAME\n" };
+      reserve_chunk( output_, y4m_header_.size()
+                              + pending_chunk_.size() * (frame_header.size() + width_ * height_ * 3 / 2) );
+
+      /* gather the rows of the frames straight from the fields */
+      vector<string_view> buffers { y4m_header_ };
+      buffers.reserve( 1 + pending_chunk_.size() * (1 + 2 * height_) );
 
       for ( const auto & pending_frame : pending_chunk_ ) {
-        output_.write( "FRAME\n" );
+        const Raster & top = *pending_frame.top_field;
+        const Raster & bottom = *pending_frame.bottom_field;
 
-        /* Y */
-        output_.write( string_view { reinterpret_cast<char *>( pending_frame.Y.get() ), pending_frame.width * pending_frame.height } );
+        buffers.emplace_back( frame_header );
+        add_interleaved_rows( buffers, top.Y, bottom.Y, width_, height_ / 2 );
+        add_interleaved_rows( buffers, top.Cb, bottom.Cb, width_ / 2, height_ / 4 );
+        add_interleaved_rows( buffers, top.Cr, bottom.Cr, width_ / 2, height_ / 4 );
+      }
 
-        /* Cb */
-        output_.write( string_view { reinterpret_cast<char *>( pending_frame.Cb.get() ), (pending_frame.width/2) * (pending_frame.height/2) } );
+      write_all( output_, buffers );
 
-        /* Cr */
-        output_.write( string_view { reinterpret_cast<char *>( pending_frame.Cr.get() ), (pending_frame.width/2) * (pending_frame.height/2) } );
+      /* give the fields back to the pool */
+      for ( auto & pending_frame : pending_chunk_ ) {
+        pending_frame = {};
       }
 
       output_.close(); /* make sure output is flushed before renaming */
 
-      /* move output file if tmp_dir is not empty */
+      /* move output file if tmp_directory_ is not empty */
       if ( output_dir != directory_ ) {
         fs::rename( fs::path( output_dir ) / filename,
                     fs::path( directory_ ) / filename );
@@ -963,7 +1537,8 @@ private:
       string info_string = /* wallclock timestamp */ to_string( timestamp_ms() ) + " "
         + /* video timestamp */ to_string( pending_chunk_outer_timestamp_ ) + " "
         + /* due in (ms) */ to_string( wallclock_ms_until_next_chunk_is_due() ) + " "
-        + /* filler fields */ to_string( filler_field_count_ );
+        + /* filler fields */ to_string( filler_field_count_ ) + " "
+        + /* rasters in use */ to_string( raster_pool_.take_high_water() );
 
       info_.write( info_string + "\n");
 
@@ -992,18 +1567,24 @@ private:
 public:
   Y4M_Writer( const uint64_t initial_wallclock_timestamp,
               const string directory,
+              const string tmp_directory,
               const unsigned int frames_per_chunk,
-              const VideoParameters & params )
+              const VideoParameters & params,
+              RasterPool & raster_pool )
     : wallclock_time_for_outer_timestamp_zero_( initial_wallclock_timestamp ),
-      pending_chunk_(),
+      pending_chunk_( frames_per_chunk ),
+      width_( params.width ),
+      height_( params.height ),
       frame_interval_( params.frame_interval ),
       directory_( directory ),
+      tmp_directory_( tmp_directory ),
       y4m_header_( "YUV4MPEG2 W" + to_string( params.width )
                    + " H" + to_string( params.height ) + " " + params.y4m_description
-                   + " A1:1 C420mpeg2\n" )
+                   + " A1:1 C420mpeg2\n" ),
+      raster_pool_( raster_pool )
   {
-    for ( unsigned int i = 0; i < frames_per_chunk; i++ ) {
-      pending_chunk_.emplace_back( params.width, params.height );
+    if ( height_ % 4 != 0 ) {
+      throw runtime_error( "height is not multiple of 4" );
     }
   }
 
@@ -1014,43 +1595,36 @@ public:
     return next_chunk_is_due_wallclock_ms - timestamp_ms();
   }
 
+  /* how far the frames written lag behind wallclock time; unlike
+   * wallclock_ms_until_next_chunk_is_due(), which falls by a chunk's
+   * duration as each chunk fills, it holds steady while output keeps up */
+  int wallclock_ms_behind() const
+  {
+    const uint64_t written_into_chunk = outer_timestamp_ / 300 - pending_chunk_outer_timestamp_;
+    return -wallclock_ms_until_next_chunk_is_due() - int( written_into_chunk / 90 );
+  }
+
   void set_next_field_is_filler() { filler_field_count_++; }
 
   bool next_field_is_top() const { return next_field_is_top_; }
 
+  size_t frames_per_chunk() const { return pending_chunk_.size(); }
+
   void write_raw( const VideoField & field )
   {
     if ( field.top_field != next_field_is_top_ ) {
       throw runtime_error( "field cadence mismatch" );
     }
 
-    /* copy field to proper lines of pending frame */
-
-    /* copy Y */
-    for ( unsigned int source_row = 0, dest_row = (next_field_is_top_ ? 0 : 1);
-          source_row < field.contents->height;
-          source_row += 1, dest_row += 2 ) {
-      memcpy( pending_frame().Y.get() + dest_row * pending_frame().width,
-              field.contents->Y.get() + source_row * pending_frame().width,
-              pending_frame().width );
-    }
-
-    /* copy Cb */
-    for ( unsigned int source_row = 0, dest_row = (next_field_is_top_ ? 0 : 1);
-          source_row < field.contents->height/2;
-          source_row += 1, dest_row += 2 ) {
-      memcpy( pending_frame().Cb.get() + dest_row * pending_frame().width/2,
-              field.contents->Cb.get() + source_row * pending_frame().width/2,
-              pending_frame().width/2 );
+    if ( field.contents->width != width_ or field.contents->height != height_ / 2 ) {
+      throw runtime_error( "field size mismatch" );
     }
 
-    /* copy Cr */
-    for ( unsigned int source_row = 0, dest_row = (next_field_is_top_ ? 0 : 1);
-          source_row < field.contents->height/2;
-          source_row += 1, dest_row += 2 ) {
-      memcpy( pending_frame().Cr.get() + dest_row * pending_frame().width/2,
-              field.contents->Cr.get() + source_row * pending_frame().width/2,
-              pending_frame().width/2 );
+    /* hold on to the field until the chunk is written */
+    if ( next_field_is_top_ ) {
+      pending_frame().top_field = field.contents;
+    } else {
+      pending_frame().bottom_field = field.contents;
     }
 
     next_field_is_top_ = !next_field_is_top_;
@@ -1073,11 +1647,18 @@ public:
 class VideoOutput
 {
 private:
+  /* gaps up to this long (e.g., of the pictures skipped by a Degradation)
+   * repeat the last fields; longer ones are filled with blank fields */
+  static const unsigned int MAX_REPEATED_FRAMES = 60;
+
   unsigned int frame_interval_;
   uint64_t expected_inner_timestamp_;
 
   VideoField missing_field_;
 
+  /* the contents of the last bottom and top field written */
+  array<shared_ptr<const Raster>, 2> last_fields_ {};
+
   void write_single_field( const VideoField & field, Y4M_Writer & writer )
   {
     writer.write_raw( field );
@@ -1085,10 +1666,11 @@ private:
   }
 
 public:
-  VideoOutput( const VideoParameters & params, const uint64_t initial_inner_timestamp )
+  VideoOutput( const VideoParameters & params, const uint64_t initial_inner_timestamp,
+               RasterPool & raster_pool )
     : frame_interval_( params.frame_interval ),
       expected_inner_timestamp_( initial_inner_timestamp ),
-      missing_field_( 0, false, params.width, params.height )
+      missing_field_( raster_pool, 0, false, params.width, params.height )
   {
     cerr << "VideoOutput: constructed with initial timestamp = " << initial_inner_timestamp << "\n";
   }
@@ -1116,19 +1698,26 @@ public:
     }
 
     /* field's moment is in the future -> insert filler fields */
+    const bool repeat = -diff <= int64_t( frame_interval_ ) * MAX_REPEATED_FRAMES;
     while ( timestamp_difference( expected_inner_timestamp_,
                                   field.presentation_time_stamp )
             < -9 * int64_t( frame_interval_ ) / 8 ) {
       cerr << "Generating replacement fields to fill in gap (diff now "
            << timestamp_difference( expected_inner_timestamp_,
                                     field.presentation_time_stamp ) / double( frame_interval_ ) << " frames)\n";
-      write_filler_field( writer );
-      write_filler_field( writer );
+      if ( repeat ) {
+        repeat_last_field( writer );
+        repeat_last_field( writer );
+      } else {
+        write_filler_field( writer );
+        write_filler_field( writer );
+      }
     }
 
     /* write the originally requested field */
     if ( field.top_field == writer.next_field_is_top() ) {
       write_single_field( field, writer );
+      last_fields_[ field.top_field ] = field.contents;
     } else {
       cerr << "ignoring field with mismatched cadence\n";
     }
@@ -1141,20 +1730,48 @@ public:
     writer.set_next_field_is_filler();
     write_single_field( missing_field_, writer );
   }
+
+  /* repeat the last field of the same parity, or write a blank one */
+  void repeat_last_field( Y4M_Writer & writer )
+  {
+    const shared_ptr<const Raster> & last = last_fields_[ writer.next_field_is_top() ];
+    if ( not last ) {
+      write_filler_field( writer );
+      return;
+    }
+
+    VideoField repeated_field = missing_field_;
+    repeated_field.presentation_time_stamp = expected_inner_timestamp_;
+    repeated_field.top_field = writer.next_field_is_top();
+    repeated_field.contents = last;
+    writer.set_next_field_is_filler();
+    write_single_field( repeated_field, writer );
+  }
 };
 
+/* Writes the audio in chunks of .wav files, each starting with the last
+ * samples of the chunk before it (the overlap). A chunk is assembled in
+ * place in a buffer allocated once -- header, overlap, then the samples of
+ * each block as it comes -- and written out with a single write. */
 class WavWriter
 {
 private:
+  static const size_t block_bytes = sizeof( AudioBlock::samples );
+
   uint64_t wallclock_time_for_outer_timestamp_zero_;
   uint64_t pending_chunk_outer_timestamp_ {};
   unsigned int pending_chunk_index_ {};
-  vector<AudioBlock> pending_chunk_;
-  string overlap_samples_;
+  unsigned int blocks_per_chunk_;
+  size_t overlap_bytes_;
 
   string directory_;
+  string tmp_directory_; /* if not empty, chunks are written there and moved */
   string wav_header_;
 
+  string chunk_ {}; /* the header, the overlap, and the blocks of the chunk */
+
+  size_t samples_start() const { return wav_header_.size() + overlap_bytes_; }
+
   uint64_t outer_timestamp_ {};
 
   optional<int64_t> last_offset_ {};
@@ -1162,20 +1779,22 @@ private:
 public:
   WavWriter( const uint64_t initial_wallclock_timestamp,
              const string directory,
+             const string tmp_directory,
              const unsigned int audio_blocks_per_chunk,
              const unsigned int audio_sample_overlap )
     : wallclock_time_for_outer_timestamp_zero_( initial_wallclock_timestamp ),
-      pending_chunk_(),
-      overlap_samples_( audio_sample_overlap * 2 * 2, 0 ),
+      blocks_per_chunk_( audio_blocks_per_chunk ),
+      overlap_bytes_( audio_sample_overlap * 2 * 2 ),
       directory_( directory ),
+      tmp_directory_( tmp_directory ),
       wav_header_()
   {
-    for ( unsigned int i = 0; i < audio_blocks_per_chunk; i++ ) {
-      pending_chunk_.emplace_back();
+    if ( overlap_bytes_ > audio_blocks_per_chunk * block_bytes ) {
+      throw runtime_error( "not enough samples in a chunk for the overlap" );
     }
 
     wav_header_ += "RIFF";
-    const uint32_t ChunkSize = htole32( overlap_samples_.size() + audio_blocks_per_chunk * audio_samples_per_block * 2 * 2 + 36 );
+    const uint32_t ChunkSize = htole32( overlap_bytes_ + audio_blocks_per_chunk * block_bytes + 36 );
     wav_header_ += string( reinterpret_cast<const char *>( &ChunkSize ), sizeof( ChunkSize ) );
     wav_header_ += "WAVE";
 
@@ -1202,8 +1821,12 @@ public:
 
     wav_header_ += "data";
 
-    const uint32_t SubChunk2Size = htole32( overlap_samples_.size() + audio_blocks_per_chunk * audio_samples_per_block * 2 * 2 );
+    const uint32_t SubChunk2Size = htole32( overlap_bytes_ + audio_blocks_per_chunk * block_bytes );
     wav_header_ += string( reinterpret_cast<const char *>( &SubChunk2Size ), sizeof( SubChunk2Size ) );
+
+    /* the first chunk's overlap is silence */
+    chunk_ = wav_header_;
+    chunk_.resize( samples_start() + audio_blocks_per_chunk * block_bytes, 0 );
   }
 
   int wallclock_ms_until_next_chunk_is_due() const
@@ -1215,7 +1838,8 @@ public:
 
   void write_raw( const AudioBlock & audio_block )
   {
-    pending_chunk_.at( pending_chunk_index_ ) = audio_block;
+    memcpy( chunk_.data() + samples_start() + pending_chunk_index_ * block_bytes,
+            audio_block.samples, block_bytes );
 
     if ( pending_chunk_index_ == 0 ) {
       pending_chunk_outer_timestamp_ = outer_timestamp_ / 300;
@@ -1223,11 +1847,11 @@ public:
       cerr << wallclock_ms_until_next_chunk_is_due() << " ms until this chunk is due.\n";
     }
 
-    if ( pending_chunk_index_ == pending_chunk_.size() - 1 ) {
+    if ( pending_chunk_index_ == blocks_per_chunk_ - 1 ) {
       const string filename = to_string( pending_chunk_outer_timestamp_ ) + ".wav";
 
-      /* output to tmp_dir first if tmp_dir is not empty */
-      string output_dir = tmp_dir.empty() ? directory_ : tmp_dir;
+      /* output to tmp_directory_ first if it is not empty */
+      string output_dir = tmp_directory_.empty() ? directory_ : tmp_directory_;
 
       cerr << "Writing " << output_dir + "/" + filename << " ... ";
       cerr << "(due in " << wallclock_ms_until_next_chunk_is_due() << " ms) ";
@@ -1240,41 +1864,18 @@ public:
                                                                   O_WRONLY | O_CREAT | O_EXCL,
                                                                   S_IRUSR | S_IWUSR ) ) };
 
-      output_.write( wav_header_ );
-
-      /* write the overlap (last 648 samples of last chunk) first */
-      output_.write( overlap_samples_ );
-
-      /* now write the new samples */
-      string serialized_samples;
-
-      for ( const auto & pending_block : pending_chunk_ ) {
-        for ( unsigned int sample_id = 0; sample_id < audio_samples_per_block; sample_id++ ) {
-          serialized_samples += string_view( reinterpret_cast<const char *>( pending_block.left + sample_id ),
-                                             sizeof( int16_t ) );
-          serialized_samples += string_view( reinterpret_cast<const char *>( pending_block.right + sample_id ),
-                                             sizeof( int16_t ) );
-        }
-      }
-
-
-      output_.write( serialized_samples );
+      /* the header, the overlap (last samples of last chunk), and the new samples */
+      reserve_chunk( output_, chunk_.size() );
+      output_.write( chunk_ );
 
       /* now record the last samples for next time's overlap */
-      if ( serialized_samples.size() < overlap_samples_.size() ) {
-        throw runtime_error( "not enough overlap samples" );
-      }
-
-      overlap_samples_ = serialized_samples.substr( serialized_samples.size() - overlap_samples_.size() );
-
-      /* Bug check */
-      if ( overlap_samples_.size() != opus_sample_overlap * 2 * 2 ) {
-        throw runtime_error( "BUG: overlap_samples is wrong size" );
-      }
+      memmove( chunk_.data() + wav_header_.size(),
+               chunk_.data() + chunk_.size() - overlap_bytes_,
+               overlap_bytes_ );
 
       output_.close(); /* make sure output is flushed before renaming */
 
-      /* move output file if tmp_dir is not empty */
+      /* move output file if tmp_directory_ is not empty */
       if ( output_dir != directory_ ) {
         fs::rename( fs::path( output_dir ) / filename,
                     fs::path( directory_ ) / filename );
@@ -1291,7 +1892,7 @@ public:
     /* advance virtual clock */
     last_offset_ = audio_block.presentation_time_stamp - outer_timestamp_;
     outer_timestamp_ += audio_block_duration;
-    pending_chunk_index_ = (pending_chunk_index_ + 1) % pending_chunk_.size();
+    pending_chunk_index_ = (pending_chunk_index_ + 1) % blocks_per_chunk_;
   }
 
   /* get last outer-inner timestamp offset (for verifying a/v sync) */
@@ -1365,28 +1966,63 @@ public:
   }
 };
 
+/* Decodes a program of the multiplex. The stages of the decoder run on their
+ * own threads, connected by bounded SPSC rings: the demuxer (a TSDemuxer,
+ * on the thread that calls demux_packet() and push_demuxed()) feeds the video
+ * and audio decoders, which feed the outputs. A stage waits for STAGE_WAIT
+ * whenever it has nothing to do or its next ring is full, which pushes back
+ * on the input when the outputs fall behind. */
 class AudioVideoDecoder
 {
+  static constexpr auto STAGE_WAIT = chrono::microseconds( 500 );
+  static const uint64_t SYNC_CHECK_INTERVAL_MS = 500; /* when there is no output */
+
+  /* the degradation ladder: how far video may fall behind wallclock time
+   * (beyond the least lag since the outputs were initialized) before the
+   * decoder skips B pictures, then all but I pictures; a level is left once
+   * the lag is DEGRADATION_HYSTERESIS_MS below it, and resync() remains the
+   * last resort (see enforce_wallclock_lag_limit()) */
+  static const int SKIP_B_PICTURES_LAG_MS = 500;
+  static const int INTRA_ONLY_LAG_MS = 1000;
+  static const int DEGRADATION_HYSTERESIS_MS = 250;
+
+  RasterPool raster_pool {}; /* outlives the fields of this program */
+
+  PESBufferPool video_PES_buffers {};
+  PESBufferPool audio_PES_buffers {};
   TSParser video_parser;
   TSParser audio_parser;
-  queue<TimestampedPESPacket> video_PES_packets {}; /* output of TSParser */
-  queue<TimestampedPESPacket> audio_PES_packets {}; /* output of TSParser */
+  queue<TimestampedPESPacket> parsed_video_PES_packets {}; /* output of TSParser */
+  queue<TimestampedPESPacket> parsed_audio_PES_packets {}; /* output of TSParser */
+  SPSCRing<TimestampedPESPacket> video_PES_packets { 256 };
+  SPSCRing<TimestampedPESPacket> audio_PES_packets { 256 };
 
   VideoParameters params;
 
-  MPEG2VideoDecoder video_decoder { params };
-  queue<VideoField> decoded_fields {}; /* output of MPEG2VideoDecoder */
+  unique_ptr<VideoDecoderBackend> video_decoder;
+  atomic<Degradation> degradation { Degradation::NONE }; /* set by the output */
+  queue<VideoField> video_decoder_output {}; /* output of video_decoder */
+  SPSCRing<VideoField> decoded_fields { 32 }; /* about 1.5 MB each at 1080i */
   Y4M_Writer y4m_writer;
 
   A52AudioDecoder audio_decoder {};
-  queue<AudioBlock> decoded_samples {}; /* output of A52AudioDecoder */
+  queue<AudioBlock> audio_decoder_output {}; /* output of A52AudioDecoder */
+  SPSCRing<AudioBlock> decoded_samples { 1024 };
   WavWriter wav_writer;
 
+  /* the threads of the decoders and the output */
+  vector<thread> stages {};
+  atomic<bool> stopping { false };
+
+  /* the first error of a stage, rethrown by check_stages() */
+  mutex stage_error_mutex {};
+  exception_ptr stage_error {};
+
   bool outputs_initialized = false;
   optional<VideoOutput> video_output {};
   optional<AudioOutput> audio_output {};
-
-  string input_buffer {};
+  uint64_t last_sync_check_ms { timestamp_ms() };
+  optional<int> least_video_lag_ms {}; /* since the outputs were initialized */
 
   void resync()
   {
@@ -1424,6 +2060,18 @@ class AudioVideoDecoder
     y4m_writer.reset_sync_tracking();
     wav_writer.reset_sync_tracking();
     outputs_initialized = false;
+    least_video_lag_ms.reset();
+    set_degradation( Degradation::NONE );
+  }
+
+  void set_degradation( const Degradation level )
+  {
+    static const char * const names[] = { "none", "skipping B pictures", "decoding I pictures only" };
+
+    if ( degradation.exchange( level ) != level ) {
+      cerr << "Video decoding degradation: " << names[ static_cast<int>( level ) ]
+           << " (video lags by " << y4m_writer.wallclock_ms_behind() << " ms)\n";
+    }
   }
 
 public:
@@ -1435,72 +2083,167 @@ public:
                      const unsigned int audio_sample_overlap,
                      const string & video_directory,
                      const string & audio_directory,
-                     const uint64_t initial_wallclock_timestamp )
-    : video_parser( video_pid, true ),
-      audio_parser( audio_pid, false ),
+                     const string & tmp_directory,
+                     const uint64_t initial_wallclock_timestamp,
+                     const string & vaapi_device )
+    : video_parser( video_pid, true, video_PES_buffers ),
+      audio_parser( audio_pid, false, audio_PES_buffers ),
       params( params ),
-      y4m_writer( initial_wallclock_timestamp, video_directory, frames_per_chunk, params ),
-      wav_writer( initial_wallclock_timestamp, audio_directory, audio_blocks_per_chunk, audio_sample_overlap )
+      video_decoder( make_video_decoder( params, raster_pool, vaapi_device ) ),
+      y4m_writer( initial_wallclock_timestamp, video_directory, tmp_directory, frames_per_chunk, params, raster_pool ),
+      wav_writer( initial_wallclock_timestamp, audio_directory, tmp_directory, audio_blocks_per_chunk, audio_sample_overlap )
   {}
 
-  void parse_input( const string & new_chunk )
+  ~AudioVideoDecoder()
   {
-    /* parse transport stream packets into video and audio PES packets */
-    input_buffer.append( new_chunk );
+    stopping = true;
+    for ( auto & stage : stages ) {
+      stage.join();
+    }
+  }
 
-    if ( input_buffer.size() < ts_packet_length ) {
-      return;
+  /* forbid copying and moving, as the stages refer to the decoder */
+  AudioVideoDecoder( const AudioVideoDecoder & other ) = delete;
+  AudioVideoDecoder & operator=( const AudioVideoDecoder & other ) = delete;
+
+  /* start decoding what is demuxed, and writing it out */
+  void start_stages()
+  {
+    stages.emplace_back( [this] {
+        /* on the thread that writes the fields: enough for a full ring and
+         * the chunk being written */
+        raster_pool.preallocate( params.width, params.height / 2,
+                                 decoded_fields.capacity() + 2 * y4m_writer.frames_per_chunk() + 4 );
+        run_stage( [this] { return decode_video(); } );
+      } );
+    stages.emplace_back( [this] { run_stage( [this] { return decode_audio(); } ); } );
+    stages.emplace_back( [this] { run_stage( [this] { return output(); } ); } );
+  }
+
+  /* rethrow the error that has stopped a stage, if any */
+  void check_stages()
+  {
+    lock_guard<mutex> lock( stage_error_mutex );
+    if ( stage_error ) {
+      rethrow_exception( stage_error );
+    }
+  }
+
+private:
+  /* call step until stopping, waiting whenever it returns false (idle) */
+  void run_stage( const function<bool()> & step )
+  {
+    try {
+      while ( not stopping ) {
+        if ( not step() ) {
+          this_thread::sleep_for( STAGE_WAIT );
+        }
+      }
+    } catch ( ... ) {
+      lock_guard<mutex> lock( stage_error_mutex );
+      if ( not stage_error ) {
+        stage_error = current_exception();
+      }
+      stopping = true;
     }
+  }
 
-    const unsigned int packets_in_chunk = input_buffer.size() / ts_packet_length;
-    const string chunk = input_buffer.substr( 0, packets_in_chunk * ts_packet_length );
-    input_buffer.erase( 0, packets_in_chunk * ts_packet_length );
-    const string_view chunk_view { chunk };
+  /* move the items of a stage's queue into the ring of the next stage */
+  template<class T>
+  void push_all( queue<T> & items, SPSCRing<T> & ring )
+  {
+    while ( not items.empty() ) {
+      if ( ring.push( move( items.front() ) ) ) {
+        items.pop();
+      } else if ( stopping ) {
+        return;
+      } else {
+        this_thread::sleep_for( STAGE_WAIT );
+      }
+    }
+  }
 
-    for ( unsigned packet_no = 0; packet_no < packets_in_chunk; packet_no++ ) {
-      try {
-        video_parser.parse( chunk_view.substr( packet_no * ts_packet_length,
-                                               ts_packet_length ),
-                            video_PES_packets );
-        audio_parser.parse( chunk_view.substr( packet_no * ts_packet_length,
-                                               ts_packet_length ),
-                            audio_PES_packets );
-      } catch ( const non_fatal_exception & e ) {
-        print_exception( "transport stream input", e );
+public:
+  /* parse a TS packet (whose header is parsed) if it is of this program */
+  void demux_packet( const string_view & packet, const TSPacketHeader & header )
+  {
+    try {
+      if ( header.pid == video_parser.pid() ) {
+        video_parser.parse( packet, header, parsed_video_PES_packets );
+      } else if ( header.pid == audio_parser.pid() ) {
+        audio_parser.parse( packet, header, parsed_audio_PES_packets );
       }
+    } catch ( const non_fatal_exception & e ) {
+      print_exception( "transport stream input", e );
     }
   }
 
-  void decode_video()
+  /* pass the PES packets demuxed so far on to the decoders */
+  void push_demuxed()
+  {
+    push_all( parsed_video_PES_packets, video_PES_packets );
+    push_all( parsed_audio_PES_packets, audio_PES_packets );
+  }
+
+private:
+  /* return false if there was nothing to decode */
+  bool decode_video()
   {
+    if ( video_PES_packets.empty() ) {
+      return false;
+    }
+
     while ( not video_PES_packets.empty() ) {
+      TimestampedPESPacket PES_packet { move( video_PES_packets.front() ) };
+      video_PES_packets.pop();
+
       try {
-        TimestampedPESPacket PES_packet { move( video_PES_packets.front() ) };
-        video_PES_packets.pop();
-        video_decoder.decode_frame( PES_packet, decoded_fields );
+        video_decoder->decode( PES_packet, degradation, video_decoder_output );
       } catch ( const non_fatal_exception & e ) {
         print_exception( "video decode", e );
-        video_decoder = MPEG2VideoDecoder( params );
+        video_decoder->reset();
       }
+
+      video_PES_buffers.free_buffer( move( PES_packet.PES_packet ) );
+
+      push_all( video_decoder_output, decoded_fields );
     }
+
+    return true;
   }
 
-  void decode_audio()
+  bool decode_audio()
   {
+    if ( audio_PES_packets.empty() ) {
+      return false;
+    }
+
     while ( not audio_PES_packets.empty() ) {
+      TimestampedPESPacket PES_packet { move( audio_PES_packets.front() ) };
+      audio_PES_packets.pop();
+
       try {
-        TimestampedPESPacket PES_packet { move( audio_PES_packets.front() ) };
-        audio_PES_packets.pop();
-        audio_decoder.decode_frames( PES_packet, decoded_samples );
+        audio_decoder.decode_frames( PES_packet, audio_decoder_output );
       } catch ( const non_fatal_exception & e ) {
         print_exception( "audio decode", e );
         audio_decoder = A52AudioDecoder();
       }
+
+      audio_PES_buffers.free_buffer( move( PES_packet.PES_packet ) );
+
+      push_all( audio_decoder_output, decoded_samples );
     }
+
+    return true;
   }
 
-  void output_video()
+  /* return false if there was nothing to output */
+  bool output_video()
   {
+    if ( decoded_fields.empty() ) {
+      return false;
+    }
+
     while ( not decoded_fields.empty() ) {
       /* initialize audio and video outputs with earliest video field as first timestamp */
       if ( not outputs_initialized ) {
@@ -1508,9 +2251,9 @@ public:
           decoded_fields.pop();
           continue;
         }
-        video_output.emplace( params, decoded_fields.front().presentation_time_stamp );
+        video_output.emplace( params, decoded_fields.front().presentation_time_stamp, raster_pool );
         audio_output.emplace( decoded_fields.front().presentation_time_stamp );
-        decoded_samples = {}; /* don't confuse newly resynced audio output with old audio samples
+        decoded_samples.clear(); /* don't confuse newly resynced audio output with old audio samples
                                  (which may be old enough, relative to the new video frame, to
                                  cause a HugeTimestampDifference exception) */
         outputs_initialized = true;
@@ -1525,10 +2268,16 @@ public:
       }
       decoded_fields.pop();
     }
+
+    return true;
   }
 
-  void output_audio()
+  bool output_audio()
   {
+    if ( decoded_samples.empty() or not outputs_initialized ) {
+      return false;
+    }
+
     while ( not decoded_samples.empty() ) {
       /* only initialize timestamps on valid video */
       if ( not outputs_initialized ) {
@@ -1544,6 +2293,26 @@ public:
       }
       decoded_samples.pop();
     }
+
+    return true;
+  }
+
+  /* return false if there was nothing to output */
+  bool output()
+  {
+    const bool video_written = output_video();
+    const bool audio_written = output_audio();
+    const bool written = video_written or audio_written;
+
+    /* as often as there is output, or every SYNC_CHECK_INTERVAL_MS */
+    if ( written or timestamp_ms() - last_sync_check_ms >= SYNC_CHECK_INTERVAL_MS ) {
+      check_av_sync();
+      adjust_degradation();
+      enforce_wallclock_lag_limit();
+      last_sync_check_ms = timestamp_ms();
+    }
+
+    return written;
   }
 
   void check_av_sync() const
@@ -1563,6 +2332,34 @@ public:
     }
   }
 
+  /* skip more or fewer pictures as video falls behind or catches up */
+  void adjust_degradation()
+  {
+    if ( not outputs_initialized ) {
+      return;
+    }
+
+    const int lag = y4m_writer.wallclock_ms_behind();
+    if ( not least_video_lag_ms or lag < *least_video_lag_ms ) {
+      least_video_lag_ms = lag;
+    }
+
+    const int excess_lag = lag - *least_video_lag_ms;
+    const Degradation current = degradation;
+
+    Degradation level = Degradation::NONE;
+    if ( excess_lag >= SKIP_B_PICTURES_LAG_MS
+         - (current >= Degradation::SKIP_B_PICTURES ? DEGRADATION_HYSTERESIS_MS : 0) ) {
+      level = Degradation::SKIP_B_PICTURES;
+    }
+    if ( excess_lag >= INTRA_ONLY_LAG_MS
+         - (current == Degradation::INTRA_ONLY ? DEGRADATION_HYSTERESIS_MS : 0) ) {
+      level = Degradation::INTRA_ONLY;
+    }
+
+    set_degradation( level );
+  }
+
   /* don't let audio or video get more than N seconds behind wallclock time */
   void enforce_wallclock_lag_limit()
   {
@@ -1578,6 +2375,342 @@ public:
   }
 };
 
+/* Demultiplexes a transport stream into the programs of one or more
+ * AudioVideoDecoders, parsing the header of each TS packet once, in place in
+ * the buffer that the input was read into. */
+class TSDemuxer
+{
+private:
+  vector<AudioVideoDecoder *> decoders_;
+  string input_buffer_ {}; /* a TS packet split across reads */
+
+  void demux_packet( const string_view & packet )
+  {
+    try {
+      const TSPacketHeader header { packet };
+      for ( auto decoder : decoders_ ) {
+        decoder->demux_packet( packet, header );
+      }
+    } catch ( const non_fatal_exception & e ) {
+      print_exception( "transport stream input", e );
+    }
+  }
+
+public:
+  TSDemuxer( const vector<AudioVideoDecoder *> & decoders )
+    : decoders_( decoders )
+  {}
+
+  /* parse transport stream packets into the PES packets of the programs */
+  void parse_input( string_view new_chunk )
+  {
+    /* complete the packet left over from the last read */
+    if ( not input_buffer_.empty() ) {
+      const size_t missing = min( ts_packet_length - input_buffer_.size(), new_chunk.size() );
+      input_buffer_.append( new_chunk.substr( 0, missing ) );
+      new_chunk.remove_prefix( missing );
+
+      if ( input_buffer_.size() < ts_packet_length ) {
+        return;
+      }
+
+      demux_packet( input_buffer_ );
+      input_buffer_.clear();
+    }
+
+    while ( new_chunk.size() >= ts_packet_length ) {
+      demux_packet( new_chunk.substr( 0, ts_packet_length ) );
+      new_chunk.remove_prefix( ts_packet_length );
+    }
+
+    input_buffer_.assign( new_chunk.begin(), new_chunk.end() );
+
+    push_demuxed();
+  }
+
+  /* drop the packet left over from the last read, e.g., if the input skips
+   * the rest of it */
+  void discard_partial_packet() { input_buffer_.clear(); }
+
+  /* parse the TS packets of a datagram, which carries whole ones; call
+   * push_demuxed() after a batch of datagrams */
+  void parse_datagram( string_view datagram )
+  {
+    while ( datagram.size() >= ts_packet_length ) {
+      demux_packet( datagram.substr( 0, ts_packet_length ) );
+      datagram.remove_prefix( ts_packet_length );
+    }
+  }
+
+  void push_demuxed()
+  {
+    for ( auto decoder : decoders_ ) {
+      decoder->push_demuxed();
+    }
+  }
+};
+
+/* The input from udp_to_tcp with --resume: the stream is subscribed to with
+ * its offset, and the connection is re-established when lost, resuming the
+ * stream from the byte after the last one read. */
+class ResumableInput
+{
+private:
+  /* give up if udp_to_tcp cannot be reconnected to in this long */
+  static constexpr uint64_t reconnect_timeout_ms = 30 * 1000;
+
+  Address address_;
+  TCPSocket socket_ {};
+  uint64_t epoch_ { 0 };
+  uint64_t offset_ { 0 }; /* of the next byte to read */
+
+  /* send request over a new connection, and return the connection with
+   * the epoch and offset it is at */
+  tuple<TCPSocket, uint64_t, uint64_t> request( const string & request_line )
+  {
+    TCPSocket socket;
+    socket.connect( address_ );
+    socket.write( request_line + "\n" );
+
+    string reply;
+    while ( reply.empty() or reply.back() != '\n' ) {
+      reply += socket.read_exactly( 1 );
+    }
+
+    const vector<string> tokens = split( reply.substr( 0, reply.size() - 1 ), " " );
+    if ( tokens.size() != 3 or tokens[ 0 ] != "offset" ) {
+      throw runtime_error( "unexpected reply from " + address_.str() + ": " + reply );
+    }
+
+    return { move( socket ), stoull( tokens[ 1 ] ), stoull( tokens[ 2 ] ) };
+  }
+
+  /* resume over a new connection on the fd of the old one, which the poller
+   * keeps polling; return whether bytes were skipped */
+  bool reconnect()
+  {
+    const uint64_t start_ms = timestamp_ms();
+
+    for ( ;; ) {
+      try {
+        auto [ socket, epoch, offset ] = request( "resume " + to_string( epoch_ ) + " "
+                                                  + to_string( offset_ ) );
+        socket_.replace_with( socket );
+        cerr << "Reconnected to " << address_.str() << endl;
+
+        const bool skipped = epoch != epoch_ or offset != offset_;
+        if ( skipped ) {
+          cerr << "Warning: input resumed at " << offset << " rather than " << offset_ << endl;
+        }
+
+        epoch_ = epoch;
+        offset_ = offset;
+        return skipped;
+      } catch ( const exception & e ) {
+        if ( timestamp_ms() - start_ms >= reconnect_timeout_ms ) {
+          throw;
+        }
+
+        print_exception( "reconnecting input", e );
+        this_thread::sleep_for( chrono::seconds( 1 ) );
+      }
+    }
+  }
+
+public:
+  ResumableInput( const Address & address )
+    : address_( address )
+  {
+    auto [ socket, epoch, offset ] = request( "subscribe" );
+    socket_ = move( socket );
+    epoch_ = epoch;
+    offset_ = offset;
+  }
+
+  FileDescriptor & fd() { return socket_; }
+
+  /* read into buffer, reconnecting if the connection has been lost; set
+   * skipped if the input has skipped bytes since the last read */
+  string_view read( IOBuffer & buffer, bool & skipped )
+  {
+    string_view data;
+    try {
+      data = socket_.read( buffer );
+    } catch ( const exception & e ) {
+      print_exception( "input", e );
+    }
+
+    if ( data.empty() ) {
+      cerr << "Lost connection to " << address_.str() << endl;
+      skipped = reconnect();
+      return {};
+    }
+
+    skipped = false;
+    offset_ += data.size();
+    return data;
+  }
+};
+
+/* The input as TS over UDP (e.g., multicast from the tuner), received in
+ * batches with recvmmsg and demuxed in place, with the kernel's receive
+ * buffer as the ring that absorbs stalls; lost datagrams show up as gaps
+ * in the continuity counters. */
+class UDPInput
+{
+private:
+  static const unsigned int RECV_BATCH_SIZE = 64;
+  static const size_t MAX_DATAGRAM_SIZE = 9000; /* a jumbo frame: 47 TS packets */
+
+  /* room for a few seconds of a ~20 Mbps transport stream in the kernel */
+  static const int RECEIVE_BUFFER = 16 * 1024 * 1024;
+
+  /* report the datagrams received and dropped this often */
+  static const uint64_t STATS_INTERVAL_MS = 60 * 1000;
+
+  static constexpr size_t CONTROL_SIZE = CMSG_SPACE( sizeof( uint32_t ) );
+
+  UDPSocket socket_ {};
+
+  vector<char> data_ = vector<char>( RECV_BATCH_SIZE * MAX_DATAGRAM_SIZE );
+  vector<iovec> iov_ = vector<iovec>( RECV_BATCH_SIZE );
+  vector<mmsghdr> msgs_ = vector<mmsghdr>( RECV_BATCH_SIZE );
+  vector<char> control_ = vector<char>( RECV_BATCH_SIZE * CONTROL_SIZE );
+
+  uint64_t datagrams_ { 0 };
+  uint64_t bytes_ { 0 };
+  uint64_t truncated_ { 0 };
+  uint32_t kernel_drops_ { 0 };
+  uint64_t last_report_ms_ { timestamp_ms() };
+
+  /* the number of datagrams the kernel has dropped so far, if reported
+   * with the i-th datagram */
+  optional<uint32_t> kernel_drops( const unsigned int i )
+  {
+    msghdr & hdr = msgs_[ i ].msg_hdr;
+    for ( cmsghdr * cmsg = CMSG_FIRSTHDR( &hdr ); cmsg != nullptr;
+          cmsg = CMSG_NXTHDR( &hdr, cmsg ) ) {
+      if ( cmsg->cmsg_level == SOL_SOCKET and cmsg->cmsg_type == SO_RXQ_OVFL ) {
+        uint32_t drops;
+        memcpy( &drops, CMSG_DATA( cmsg ), sizeof( drops ) );
+        return drops;
+      }
+    }
+
+    return nullopt;
+  }
+
+public:
+  /* receive on PORT, or on GROUP:PORT, joining the group if multicast */
+  UDPInput( const string & address )
+  {
+    const auto idx = address.rfind( ':' );
+    const string ip = idx == string::npos ? "0" : address.substr( 0, idx );
+    const uint16_t port = narrow_cast<uint16_t>( stoi( address.substr( idx + 1 ) ) );
+
+    /* bound to the group, the socket receives only the datagrams sent to it */
+    const Address local { ip, port };
+    socket_.set_reuseaddr();
+    socket_.bind( local );
+
+    const sockaddr_in & local_in = reinterpret_cast<const sockaddr_in &>( local.to_sockaddr() );
+    if ( IN_MULTICAST( ntohl( local_in.sin_addr.s_addr ) ) ) {
+      socket_.join_multicast_group( local );
+    }
+
+    socket_.set_blocking( false );
+    socket_.set_drop_counts();
+
+    /* the kernel reports twice the size, for its bookkeeping */
+    const int receive_buffer = socket_.set_receive_buffer( RECEIVE_BUFFER );
+    if ( receive_buffer / 2 < RECEIVE_BUFFER ) {
+      cerr << "Warning: UDP receive buffer is limited to " << receive_buffer / 2
+           << " bytes; raise net.core.rmem_max" << endl;
+    }
+
+    for ( unsigned int i = 0; i < RECV_BATCH_SIZE; i++ ) {
+      iov_[ i ] = { &data_[ i * MAX_DATAGRAM_SIZE ], MAX_DATAGRAM_SIZE };
+    }
+
+    cerr << "Receiving on UDP " << local.str() << endl;
+  }
+
+  FileDescriptor & fd() { return socket_; }
+
+  /* demux the datagrams waiting, a batch at a time */
+  void receive( TSDemuxer & demuxer )
+  {
+    unsigned int num_datagrams;
+    do {
+      for ( unsigned int i = 0; i < RECV_BATCH_SIZE; i++ ) {
+        msgs_[ i ] = {};
+        msgs_[ i ].msg_hdr.msg_iov = &iov_[ i ];
+        msgs_[ i ].msg_hdr.msg_iovlen = 1;
+        msgs_[ i ].msg_hdr.msg_control = &control_[ i * CONTROL_SIZE ];
+        msgs_[ i ].msg_hdr.msg_controllen = CONTROL_SIZE;
+      }
+
+      num_datagrams = socket_.recvmmsg( msgs_ );
+
+      for ( unsigned int i = 0; i < num_datagrams; i++ ) {
+        if ( const auto drops = kernel_drops( i ) ) {
+          kernel_drops_ = *drops;
+        }
+
+        if ( msgs_[ i ].msg_hdr.msg_flags & MSG_TRUNC ) {
+          truncated_++;
+          continue;
+        }
+
+        datagrams_++;
+        bytes_ += msgs_[ i ].msg_len;
+        demuxer.parse_datagram( { &data_[ i * MAX_DATAGRAM_SIZE ], msgs_[ i ].msg_len } );
+      }
+    } while ( num_datagrams == RECV_BATCH_SIZE );
+
+    demuxer.push_demuxed();
+
+    if ( timestamp_ms() - last_report_ms_ >= STATS_INTERVAL_MS ) {
+      cerr << "UDP input: received " << datagrams_ << " datagrams (" << bytes_
+           << " bytes); dropped " << kernel_drops_ << " in the kernel and "
+           << truncated_ << " of more than " << MAX_DATAGRAM_SIZE << " bytes" << endl;
+      last_report_ms_ = timestamp_ms();
+    }
+  }
+};
+
+/* make the decoder of a program given by the positional arguments (and an
+ * optional tmp directory of its own) */
+unique_ptr<AudioVideoDecoder> make_decoder( const vector<string> & args,
+                                            const string & tmp_directory,
+                                            const string & vaapi_device )
+{
+  if ( args.size() != 8 and args.size() != 9 ) {
+    throw runtime_error( "a program has 8 arguments (or 9 with TMP)" );
+  }
+
+  /* NB: "1080i30" is the preferred notation in Poynton's books and "Video Demystified" */
+  const unsigned int video_pid = stoi( args[ 0 ], nullptr, 0 );
+  const unsigned int audio_pid = stoi( args[ 1 ], nullptr, 0 );
+  const VideoParameters params { args[ 2 ] };
+  const unsigned int frames_per_chunk = stoi( args[ 3 ] );
+  const unsigned int audio_blocks_per_chunk = stoi( args[ 4 ] );
+  const unsigned int audio_sample_overlap = stoi( args[ 5 ] );
+  const string & video_directory = args[ 6 ];
+  const string & audio_directory = args[ 7 ];
+
+  if ( audio_sample_overlap != opus_sample_overlap ) {
+    throw runtime_error( "audio_sample_overlap must be " + to_string( opus_sample_overlap ) );
+  }
+
+  return make_unique<AudioVideoDecoder>( video_pid, audio_pid, params,
+                                         frames_per_chunk, audio_blocks_per_chunk,
+                                         audio_sample_overlap,
+                                         video_directory, audio_directory,
+                                         args.size() == 9 ? args[ 8 ] : tmp_directory,
+                                         timestamp_ms(), vaapi_device );
+}
+
 int main( int argc, char *argv[] )
 {
   try {
@@ -1586,15 +2719,24 @@ int main( int argc, char *argv[] )
     }
 
     string tcp_addr;
+    string udp_addr;
+    bool resume = false;
+    string tmp_dir;
+    string vaapi_device;
+    vector<vector<string>> programs;
 
     const option cmd_line_opts[] = {
-      { "tmp",    required_argument, nullptr, 't' },
-      { "tcp",    required_argument, nullptr, 'c' },
-      { nullptr,  0,                 nullptr,  0  }
+      { "tmp",     required_argument, nullptr, 't' },
+      { "tcp",     required_argument, nullptr, 'c' },
+      { "udp",     required_argument, nullptr, 'u' },
+      { "resume",  no_argument,       nullptr, 'r' },
+      { "program", required_argument, nullptr, 'p' },
+      { "vaapi",   required_argument, nullptr, 'v' },
+      { nullptr,   0,                 nullptr,  0  }
     };
 
     while ( true ) {
-      const int opt = getopt_long( argc, argv, "t:c:", cmd_line_opts, nullptr );
+      const int opt = getopt_long( argc, argv, "t:c:u:rp:v:", cmd_line_opts, nullptr );
       if ( opt == -1 ) {
         break;
       }
@@ -1606,33 +2748,61 @@ int main( int argc, char *argv[] )
       case 'c':
         tcp_addr = optarg;
         break;
+      case 'u':
+        udp_addr = optarg;
+        break;
+      case 'r':
+        resume = true;
+        break;
+      case 'p':
+        programs.emplace_back( split( optarg, "," ) );
+        break;
+      case 'v':
+        vaapi_device = optarg;
+        break;
       default:
         print_usage( argv[0] );
         return EXIT_FAILURE;
       }
     }
 
-    if ( optind != argc - 8 ) {
+    /* a single program is given by the positional arguments */
+    if ( programs.empty() ) {
+      if ( optind != argc - 8 ) {
+        print_usage( argv[0] );
+        return EXIT_FAILURE;
+      }
+
+      programs.emplace_back( argv + optind, argv + argc );
+    } else if ( optind != argc ) {
       print_usage( argv[0] );
       return EXIT_FAILURE;
     }
 
-    /* NB: "1080i30" is the preferred notation in Poynton's books and "Video Demystified" */
-    const unsigned int video_pid = stoi( argv[ optind++ ], nullptr, 0 );
-    const unsigned int audio_pid = stoi( argv[ optind++ ], nullptr, 0 );
-    const VideoParameters params { argv[ optind++ ] };
-    const unsigned int frames_per_chunk = stoi( argv[ optind++ ] );
-    const unsigned int audio_blocks_per_chunk = stoi( argv[ optind++ ] );
-    const unsigned int audio_sample_overlap = stoi( argv[ optind++ ] );
-    const string video_directory = argv[ optind++ ];
-    const string audio_directory = argv[ optind++ ];
+    /* profile the CPU on SIGUSR2 if PROFILER_DIR is set */
+    Profiler::install_from_env();
+
+    vector<unique_ptr<AudioVideoDecoder>> decoders;
+    vector<AudioVideoDecoder *> decoder_ptrs;
+    for ( const auto & program : programs ) {
+      decoders.emplace_back( make_decoder( program, tmp_dir, vaapi_device ) );
+      decoder_ptrs.emplace_back( decoders.back().get() );
+    }
+
+    if ( resume and tcp_addr.empty() ) {
+      throw runtime_error( "--resume requires --tcp" );
+    }
 
-    if ( audio_sample_overlap != opus_sample_overlap ) {
-      throw runtime_error( "audio_sample_overlap must be " + to_string( opus_sample_overlap ) );
+    if ( not udp_addr.empty() and not tcp_addr.empty() ) {
+      throw runtime_error( "--udp and --tcp are mutually exclusive" );
     }
 
     shared_ptr<FileDescriptor> input;
-    if ( tcp_addr.empty() ) {
+    unique_ptr<ResumableInput> resumable_input;
+    unique_ptr<UDPInput> udp_input;
+    if ( not udp_addr.empty() ) {
+      udp_input = make_unique<UDPInput>( udp_addr );
+    } else if ( tcp_addr.empty() ) {
       /* read from stdin if a remote address is not provided */
       input = make_shared<FileDescriptor>( STDIN_FILENO );
     } else {
@@ -1640,37 +2810,60 @@ int main( int argc, char *argv[] )
       string ip = tcp_addr.substr( 0, idx );
       uint16_t port = narrow_cast<uint16_t>( stoi( tcp_addr.substr( idx + 1 ) ) );
 
-      input = make_shared<TCPSocket>();
-      auto sock = dynamic_pointer_cast<TCPSocket>( input );
-      sock->connect( { ip, port } );
+      if ( resume ) {
+        resumable_input = make_unique<ResumableInput>( Address { ip, port } );
+      } else {
+        input = make_shared<TCPSocket>();
+        auto sock = dynamic_pointer_cast<TCPSocket>( input );
+        sock->connect( { ip, port } );
+      }
       cerr << "Connected to " << tcp_addr << endl;
     }
 
-    AudioVideoDecoder decoder { video_pid, audio_pid, params,
-                                frames_per_chunk, audio_blocks_per_chunk,
-                                audio_sample_overlap,
-                                video_directory, audio_directory,
-                                timestamp_ms() };
+    TSDemuxer demuxer { decoder_ptrs };
 
     Poller poller;
-    poller.add_action( { *input, Direction::In,
-                         [&decoder, &input] {
-                           decoder.parse_input( input->read() );
-                           decoder.decode_video();
-                           decoder.decode_audio();
-                           return ResultType::Continue;
-                         } } );
+    if ( udp_input ) {
+      poller.add_action( { udp_input->fd(), Direction::In,
+                           [&demuxer, &udp_input] {
+                             udp_input->receive( demuxer );
+                             return ResultType::Continue;
+                           } } );
+    } else if ( resumable_input ) {
+      poller.add_action( { resumable_input->fd(), Direction::In,
+                           [&demuxer, &resumable_input] {
+                             IOBuffer buffer;
+                             bool skipped;
+                             const string_view data = resumable_input->read( buffer, skipped );
+                             if ( skipped ) {
+                               demuxer.discard_partial_packet();
+                             }
+                             demuxer.parse_input( data );
+                             return ResultType::Continue;
+                           } } );
+    } else {
+      poller.add_action( { *input, Direction::In,
+                           [&demuxer, &input] {
+                             IOBuffer buffer;
+                             demuxer.parse_input( input->read( buffer ) );
+                             return ResultType::Continue;
+                           } } );
+    }
+
+    /* demux on this thread, and decode and output each program on others */
+    for ( auto & decoder : decoders ) {
+      decoder->start_stages();
+    }
 
     while ( true ) {
-      const auto ret = poller.poll( 500 );
+      for ( auto & decoder : decoders ) {
+        decoder->check_stages();
+      }
+
+      const auto ret = poller.poll( 100 );
       if ( ret.result == Poller::Result::Type::Exit ) {
         return EXIT_SUCCESS;
       }
-
-      decoder.output_video();
-      decoder.output_audio();
-      decoder.check_av_sync();
-      decoder.enforce_wallclock_lag_limit();
     }
   } catch ( const exception & e ) {
     print_exception( argv[ 0 ], e );
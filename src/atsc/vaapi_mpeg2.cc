@@ -0,0 +1,629 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+#include "vaapi_mpeg2.hh"
+
+#ifdef HAVE_VAAPI
+
+#include <fcntl.h>
+#include <va/va_drm.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "exception.hh"
+
+using namespace std;
+
+namespace {
+
+/* the raster index of each coefficient in zigzag order (ISO 13818-2 7.3) */
+const array<uint8_t, 64> zigzag {
+  0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+  12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+  35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+  58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+/* the default intra quantiser matrix, in raster order (6.3.11) */
+const array<uint8_t, 64> default_intra_matrix {
+  8, 16, 19, 22, 26, 27, 29, 34,
+  16, 16, 22, 24, 27, 29, 34, 37,
+  19, 22, 26, 27, 29, 34, 34, 38,
+  22, 22, 26, 27, 29, 34, 37, 40,
+  22, 26, 27, 29, 32, 35, 40, 48,
+  26, 27, 29, 32, 35, 40, 48, 58,
+  26, 27, 29, 34, 38, 46, 56, 69,
+  27, 29, 35, 38, 46, 56, 69, 83
+};
+
+/* macroblock_address_increment (table B.1): length and code of 1 to 33 */
+const array<pair<unsigned int, uint32_t>, 33> address_increments { {
+  { 1, 0b1 }, { 3, 0b011 }, { 3, 0b010 }, { 4, 0b0011 }, { 4, 0b0010 },
+  { 5, 0b00011 }, { 5, 0b00010 }, { 7, 0b0000111 }, { 7, 0b0000110 },
+  { 8, 0b00001011 }, { 8, 0b00001010 }, { 8, 0b00001001 },
+  { 8, 0b00001000 }, { 8, 0b00000111 }, { 8, 0b00000110 },
+  { 10, 0b0000010111 }, { 10, 0b0000010110 }, { 10, 0b0000010101 },
+  { 10, 0b0000010100 }, { 10, 0b0000010011 }, { 10, 0b0000010010 },
+  { 11, 0b00000100011 }, { 11, 0b00000100010 }, { 11, 0b00000100001 },
+  { 11, 0b00000100000 }, { 11, 0b00000011111 }, { 11, 0b00000011110 },
+  { 11, 0b00000011101 }, { 11, 0b00000011100 }, { 11, 0b00000011011 },
+  { 11, 0b00000011010 }, { 11, 0b00000011001 }, { 11, 0b00000011000 }
+} };
+
+const uint32_t address_escape = 0b00000001000; /* 11 bits, adds 33 */
+
+class BitReader
+{
+private:
+  const uint8_t * data_;
+  size_t size_bits_;
+  size_t position_ {};
+
+public:
+  BitReader( const uint8_t * data, const size_t size )
+    : data_( data ), size_bits_( 8 * size )
+  {}
+
+  uint32_t peek( const unsigned int num_bits ) const
+  {
+    if ( position_ + num_bits > size_bits_ ) {
+      throw VAAPIMPEG2Decoder::Invalid( "truncated MPEG-2 header" );
+    }
+
+    uint32_t value = 0;
+    for ( size_t bit = position_; bit < position_ + num_bits; bit++ ) {
+      value = (value << 1) | ((data_[ bit / 8 ] >> (7 - bit % 8)) & 1);
+    }
+
+    return value;
+  }
+
+  uint32_t read( const unsigned int num_bits )
+  {
+    const uint32_t value = peek( num_bits );
+    position_ += num_bits;
+    return value;
+  }
+
+  size_t position() const { return position_; }
+};
+
+/* the offset of the next start code (00 00 01) from offset, or size */
+size_t next_start_code( const uint8_t * data, const size_t size, size_t offset )
+{
+  for ( ; offset + 3 <= size; offset++ ) {
+    if ( data[ offset ] == 0 and data[ offset + 1 ] == 0 and data[ offset + 2 ] == 1 ) {
+      return offset;
+    }
+  }
+
+  return size;
+}
+
+void read_matrix( BitReader & bits, array<uint8_t, 64> & matrix )
+{
+  for ( auto & coefficient : matrix ) {
+    coefficient = bits.read( 8 );
+  }
+}
+
+}
+
+void VAAPIMPEG2Decoder::check( const char * call, const VAStatus status )
+{
+  if ( status != VA_STATUS_SUCCESS ) {
+    throw Unsupported( string( call ) + ": " + vaErrorStr( status ) );
+  }
+}
+
+VAAPIMPEG2Decoder::VAAPIMPEG2Decoder( const string & device,
+                                      const unsigned int width,
+                                      const unsigned int height )
+  : width_( width ),
+    height_( height ),
+    drm_fd_( CheckSystemCall( "open (" + device + ")",
+                              open( device.c_str(), O_RDWR | O_CLOEXEC ) ) )
+{
+  display_ = vaGetDisplayDRM( drm_fd_.fd_num() );
+  if ( not display_ ) {
+    throw Unsupported( "vaGetDisplayDRM failed on " + device );
+  }
+
+  try {
+    int major_version, minor_version;
+    check( "vaInitialize", vaInitialize( display_, &major_version, &minor_version ) );
+
+    /* the GPU must decode MPEG-2 main profile, into 4:2:0 surfaces */
+    vector<VAEntrypoint> entrypoints( vaMaxNumEntrypoints( display_ ) );
+    int num_entrypoints = 0;
+    check( "vaQueryConfigEntrypoints",
+           vaQueryConfigEntrypoints( display_, VAProfileMPEG2Main,
+                                     entrypoints.data(), &num_entrypoints ) );
+    if ( find( entrypoints.begin(), entrypoints.begin() + num_entrypoints,
+               VAEntrypointVLD ) == entrypoints.begin() + num_entrypoints ) {
+      throw Unsupported( "no MPEG-2 decoding on " + device );
+    }
+
+    VAConfigAttrib attribute {};
+    attribute.type = VAConfigAttribRTFormat;
+    check( "vaGetConfigAttributes",
+           vaGetConfigAttributes( display_, VAProfileMPEG2Main, VAEntrypointVLD,
+                                  &attribute, 1 ) );
+    if ( not (attribute.value & VA_RT_FORMAT_YUV420) ) {
+      throw Unsupported( "no 4:2:0 surfaces on " + device );
+    }
+    attribute.value = VA_RT_FORMAT_YUV420;
+
+    check( "vaCreateConfig",
+           vaCreateConfig( display_, VAProfileMPEG2Main, VAEntrypointVLD,
+                           &attribute, 1, &config_ ) );
+
+    /* the surfaces hold whole macroblocks */
+    const unsigned int coded_width = (width_ + 15) / 16 * 16;
+    const unsigned int coded_height = (height_ + 15) / 16 * 16;
+
+    check( "vaCreateSurfaces",
+           vaCreateSurfaces( display_, VA_RT_FORMAT_YUV420, coded_width, coded_height,
+                             surfaces_.data(), NUM_SURFACES, nullptr, 0 ) );
+    surfaces_created_ = true;
+
+    check( "vaCreateContext",
+           vaCreateContext( display_, config_, coded_width, coded_height,
+                            VA_PROGRESSIVE, surfaces_.data(), NUM_SURFACES,
+                            &context_ ) );
+  } catch ( ... ) {
+    release();
+    throw;
+  }
+}
+
+VAAPIMPEG2Decoder::~VAAPIMPEG2Decoder()
+{
+  release();
+}
+
+void VAAPIMPEG2Decoder::release()
+{
+  if ( context_ != VA_INVALID_ID ) {
+    vaDestroyContext( display_, context_ );
+    context_ = VA_INVALID_ID;
+  }
+
+  if ( surfaces_created_ ) {
+    vaDestroySurfaces( display_, surfaces_.data(), NUM_SURFACES );
+    surfaces_created_ = false;
+  }
+
+  if ( config_ != VA_INVALID_ID ) {
+    vaDestroyConfig( display_, config_ );
+    config_ = VA_INVALID_ID;
+  }
+
+  if ( display_ ) {
+    vaTerminate( display_ );
+    display_ = nullptr;
+  }
+}
+
+void VAAPIMPEG2Decoder::reset()
+{
+  sequence_.reset();
+  past_.reset();
+  future_.reset();
+}
+
+VASurfaceID VAAPIMPEG2Decoder::free_surface() const
+{
+  for ( const VASurfaceID surface : surfaces_ ) {
+    if ( (not past_ or past_->surface != surface)
+         and (not future_ or future_->surface != surface) ) {
+      return surface;
+    }
+  }
+
+  throw runtime_error( "VAAPIMPEG2Decoder: no free surface" );
+}
+
+void VAAPIMPEG2Decoder::parse_sequence_header( const uint8_t * data, const size_t size )
+{
+  BitReader bits { data, size };
+  SequenceState sequence;
+
+  sequence.horizontal_size = bits.read( 12 );
+  sequence.vertical_size = bits.read( 12 );
+  bits.read( 4 );  /* aspect_ratio_information */
+  bits.read( 4 );  /* frame_rate_code */
+  bits.read( 18 ); /* bit_rate_value */
+  bits.read( 1 );  /* marker_bit */
+  bits.read( 10 ); /* vbv_buffer_size_value */
+  bits.read( 1 );  /* constrained_parameters_flag */
+
+  if ( bits.read( 1 ) ) {
+    read_matrix( bits, sequence.intra_matrix );
+  } else {
+    for ( unsigned int i = 0; i < 64; i++ ) {
+      sequence.intra_matrix[ i ] = default_intra_matrix[ zigzag[ i ] ];
+    }
+  }
+
+  if ( bits.read( 1 ) ) {
+    read_matrix( bits, sequence.non_intra_matrix );
+  } else {
+    sequence.non_intra_matrix.fill( 16 );
+  }
+
+  if ( sequence.horizontal_size != width_ or sequence.vertical_size != height_ ) {
+    throw Invalid( "picture size mismatch" );
+  }
+
+  /* the sequence extension that follows tells progressive_sequence */
+  sequence_ = sequence;
+}
+
+void VAAPIMPEG2Decoder::parse_extension( const uint8_t * data, const size_t size,
+                                         PictureHeader * picture )
+{
+  BitReader bits { data, size };
+  const unsigned int extension_id = bits.read( 4 );
+
+  if ( extension_id == 1 ) { /* sequence extension */
+    if ( not sequence_ ) {
+      return;
+    }
+
+    bits.read( 8 ); /* profile_and_level_indication */
+    sequence_->progressive_sequence = bits.read( 1 );
+    if ( bits.read( 2 ) != 1 ) {
+      throw Unsupported( "chroma format other than 4:2:0" );
+    }
+    if ( bits.read( 2 ) != 0 or bits.read( 2 ) != 0 ) {
+      throw Invalid( "picture size mismatch" );
+    }
+  } else if ( extension_id == 3 ) { /* quant matrix extension */
+    if ( not sequence_ ) {
+      return;
+    }
+
+    if ( bits.read( 1 ) ) {
+      read_matrix( bits, sequence_->intra_matrix );
+    }
+    if ( bits.read( 1 ) ) {
+      read_matrix( bits, sequence_->non_intra_matrix );
+    }
+    /* the chroma matrices are only for 4:2:2 and 4:4:4 */
+  } else if ( extension_id == 8 ) { /* picture coding extension */
+    if ( not picture ) {
+      throw Invalid( "picture coding extension without a picture" );
+    }
+
+    picture->extension_seen = true;
+    for ( auto & f_code : picture->f_code ) {
+      f_code = bits.read( 4 );
+    }
+    picture->intra_dc_precision = bits.read( 2 );
+    picture->picture_structure = bits.read( 2 );
+    picture->top_field_first = bits.read( 1 );
+    picture->frame_pred_frame_dct = bits.read( 1 );
+    picture->concealment_motion_vectors = bits.read( 1 );
+    picture->q_scale_type = bits.read( 1 );
+    picture->intra_vlc_format = bits.read( 1 );
+    picture->alternate_scan = bits.read( 1 );
+    picture->repeat_first_field = bits.read( 1 );
+    bits.read( 1 ); /* chroma_420_type */
+    picture->progressive_frame = bits.read( 1 );
+  }
+}
+
+/* data is of the slice, from its start code */
+VAAPIMPEG2Decoder::Slice VAAPIMPEG2Decoder::parse_slice( const uint8_t * data,
+                                                         const size_t size,
+                                                         const size_t offset )
+{
+  BitReader bits { data + 4, size - 4 };
+  Slice slice {};
+
+  slice.offset = offset;
+  slice.size = size;
+
+  /* ATSC pictures are well under 2800 lines, so without the
+   * slice_vertical_position_extension */
+  slice.vertical_position = data[ 3 ] - 1;
+  slice.quantiser_scale_code = bits.read( 5 );
+
+  if ( bits.read( 1 ) ) {
+    slice.intra_slice_flag = true;
+    bits.read( 8 ); /* intra_slice and reserved_bits */
+    while ( bits.read( 1 ) ) { /* extra_bit_slice */
+      bits.read( 8 );
+    }
+  }
+
+  slice.macroblock_offset = 32 + bits.position();
+
+  /* the address increment of the first macroblock tells its column */
+  unsigned int increment = 0;
+  while ( bits.peek( 11 ) == address_escape ) {
+    bits.read( 11 );
+    increment += 33;
+  }
+
+  bool found = false;
+  for ( unsigned int i = 0; i < address_increments.size() and not found; i++ ) {
+    const auto & [ length, code ] = address_increments[ i ];
+    if ( bits.peek( length ) == code ) {
+      bits.read( length );
+      increment += i + 1;
+      found = true;
+    }
+  }
+
+  if ( not found ) {
+    throw Invalid( "invalid macroblock_address_increment" );
+  }
+
+  slice.horizontal_position = increment - 1;
+
+  return slice;
+}
+
+void VAAPIMPEG2Decoder::decode( const uint8_t * begin, const uint8_t * end,
+                                const uint64_t pts,
+                                const PictureCallback & callback )
+{
+  const size_t size = end - begin;
+
+  optional<PictureHeader> picture;
+  vector<Slice> slices;
+
+  /* split the payload at the start codes */
+  size_t unit = next_start_code( begin, size, 0 );
+  while ( unit + 4 <= size ) {
+    const size_t next = next_start_code( begin, size, unit + 4 );
+    const uint8_t start_code = begin[ unit + 3 ];
+    const uint8_t * data = begin + unit + 4;
+    const size_t data_size = next - unit - 4;
+
+    if ( start_code == 0xB3 ) {
+      parse_sequence_header( data, data_size );
+    } else if ( start_code == 0xB5 ) {
+      parse_extension( data, data_size, picture ? &*picture : nullptr );
+    } else if ( start_code == 0x00 ) {
+      if ( picture ) {
+        throw Invalid( "PES packet with multiple pictures" );
+      }
+
+      BitReader bits { data, data_size };
+      bits.read( 10 ); /* temporal_reference */
+      picture.emplace();
+      picture->picture_coding_type = bits.read( 3 );
+    } else if ( start_code >= 0x01 and start_code <= 0xAF ) {
+      if ( not picture ) {
+        throw Invalid( "slice outside a picture" );
+      }
+
+      slices.emplace_back( parse_slice( begin + unit, next - unit, unit ) );
+    }
+
+    unit = next;
+  }
+
+  /* after a reset, wait for a sequence header */
+  if ( not picture or not sequence_ ) {
+    return;
+  }
+
+  if ( not picture->extension_seen ) {
+    throw Unsupported( "MPEG-1 video" );
+  }
+
+  if ( picture->picture_structure != 3 ) {
+    throw Unsupported( "field pictures" );
+  }
+
+  if ( slices.empty() ) {
+    throw Invalid( "picture without slices" );
+  }
+
+  unsigned int nb_fields = 2;
+  if ( picture->repeat_first_field ) {
+    nb_fields = sequence_->progressive_sequence
+                ? (picture->top_field_first ? 6 : 4) : 3;
+  }
+
+  const DecodedPicture decoded { free_surface(), pts, nb_fields,
+                                 picture->top_field_first };
+
+  switch ( picture->picture_coding_type ) {
+  case 1: /* I */
+    render( *picture, begin, slices, decoded.surface,
+            VA_INVALID_SURFACE, VA_INVALID_SURFACE );
+    break;
+
+  case 2: /* P */
+    if ( not future_ ) {
+      return; /* no anchor since the reset */
+    }
+    render( *picture, begin, slices, decoded.surface,
+            future_->surface, VA_INVALID_SURFACE );
+    break;
+
+  case 3: /* B */
+    if ( not past_ or not future_ ) {
+      return; /* of an open GOP whose anchor is gone */
+    }
+    render( *picture, begin, slices, decoded.surface,
+            past_->surface, future_->surface );
+
+    /* a B picture is displayed as soon as it is decoded */
+    display( decoded, callback );
+    return;
+
+  default:
+    throw Invalid( "invalid picture_coding_type" );
+  }
+
+  /* and an anchor once the next one is decoded */
+  if ( future_ ) {
+    display( *future_, callback );
+  }
+
+  past_ = future_;
+  future_ = decoded;
+}
+
+void VAAPIMPEG2Decoder::render( const PictureHeader & picture,
+                                const uint8_t * begin,
+                                const vector<Slice> & slices,
+                                const VASurfaceID target,
+                                const VASurfaceID forward,
+                                const VASurfaceID backward )
+{
+  VAPictureParameterBufferMPEG2 picture_parameters {};
+  picture_parameters.horizontal_size = width_;
+  picture_parameters.vertical_size = height_;
+  picture_parameters.forward_reference_picture = forward;
+  picture_parameters.backward_reference_picture = backward;
+  picture_parameters.picture_coding_type = picture.picture_coding_type;
+  picture_parameters.f_code = (picture.f_code[ 0 ] << 12) | (picture.f_code[ 1 ] << 8)
+                              | (picture.f_code[ 2 ] << 4) | picture.f_code[ 3 ];
+
+  auto & extension = picture_parameters.picture_coding_extension.bits;
+  extension.intra_dc_precision = picture.intra_dc_precision;
+  extension.picture_structure = picture.picture_structure;
+  extension.top_field_first = picture.top_field_first;
+  extension.frame_pred_frame_dct = picture.frame_pred_frame_dct;
+  extension.concealment_motion_vectors = picture.concealment_motion_vectors;
+  extension.q_scale_type = picture.q_scale_type;
+  extension.intra_vlc_format = picture.intra_vlc_format;
+  extension.alternate_scan = picture.alternate_scan;
+  extension.repeat_first_field = picture.repeat_first_field;
+  extension.progressive_frame = picture.progressive_frame;
+  extension.is_first_field = 1;
+
+  /* the matrices in effect, always loaded; chroma uses those of luma */
+  VAIQMatrixBufferMPEG2 matrices {};
+  matrices.load_intra_quantiser_matrix = 1;
+  matrices.load_non_intra_quantiser_matrix = 1;
+  matrices.load_chroma_intra_quantiser_matrix = 1;
+  matrices.load_chroma_non_intra_quantiser_matrix = 1;
+  memcpy( matrices.intra_quantiser_matrix, sequence_->intra_matrix.data(), 64 );
+  memcpy( matrices.non_intra_quantiser_matrix, sequence_->non_intra_matrix.data(), 64 );
+  memcpy( matrices.chroma_intra_quantiser_matrix, sequence_->intra_matrix.data(), 64 );
+  memcpy( matrices.chroma_non_intra_quantiser_matrix, sequence_->non_intra_matrix.data(), 64 );
+
+  vector<VABufferID> buffers;
+  auto create_buffer = [&]( const VABufferType type, const size_t buffer_size, const void * buffer ) {
+    VABufferID id;
+    check( "vaCreateBuffer",
+           vaCreateBuffer( display_, context_, type, buffer_size, 1,
+                           const_cast<void *>( buffer ), &id ) );
+    buffers.emplace_back( id );
+  };
+
+  try {
+    create_buffer( VAPictureParameterBufferType, sizeof( picture_parameters ), &picture_parameters );
+    create_buffer( VAIQMatrixBufferType, sizeof( matrices ), &matrices );
+
+    /* a parameter buffer and a data buffer per slice */
+    for ( const Slice & slice : slices ) {
+      VASliceParameterBufferMPEG2 slice_parameters {};
+      slice_parameters.slice_data_size = slice.size;
+      slice_parameters.slice_data_offset = 0;
+      slice_parameters.slice_data_flag = VA_SLICE_DATA_FLAG_ALL;
+      slice_parameters.macroblock_offset = slice.macroblock_offset;
+      slice_parameters.slice_horizontal_position = slice.horizontal_position;
+      slice_parameters.slice_vertical_position = slice.vertical_position;
+      slice_parameters.quantiser_scale_code = slice.quantiser_scale_code;
+      slice_parameters.intra_slice_flag = slice.intra_slice_flag;
+
+      create_buffer( VASliceParameterBufferType, sizeof( slice_parameters ), &slice_parameters );
+      create_buffer( VASliceDataBufferType, slice.size, begin + slice.offset );
+    }
+
+    check( "vaBeginPicture", vaBeginPicture( display_, context_, target ) );
+    check( "vaRenderPicture", vaRenderPicture( display_, context_, buffers.data(), buffers.size() ) );
+    check( "vaEndPicture", vaEndPicture( display_, context_ ) );
+  } catch ( ... ) {
+    for ( const VABufferID id : buffers ) {
+      vaDestroyBuffer( display_, id );
+    }
+    throw;
+  }
+
+  for ( const VABufferID id : buffers ) {
+    vaDestroyBuffer( display_, id );
+  }
+}
+
+void VAAPIMPEG2Decoder::display( const DecodedPicture & picture,
+                                 const PictureCallback & callback )
+{
+  check( "vaSyncSurface", vaSyncSurface( display_, picture.surface ) );
+
+  /* map the surface itself if the driver can, or else a copy of it */
+  VAImage image;
+  if ( vaDeriveImage( display_, picture.surface, &image ) != VA_STATUS_SUCCESS ) {
+    VAImageFormat format {};
+    format.fourcc = VA_FOURCC_NV12;
+    format.byte_order = VA_LSB_FIRST;
+    format.bits_per_pixel = 12;
+
+    check( "vaCreateImage", vaCreateImage( display_, &format, width_, height_, &image ) );
+
+    const VAStatus status = vaGetImage( display_, picture.surface, 0, 0,
+                                        width_, height_, image.image_id );
+    if ( status != VA_STATUS_SUCCESS ) {
+      vaDestroyImage( display_, image.image_id );
+      check( "vaGetImage", status );
+    }
+  }
+
+  try {
+    if ( image.format.fourcc != VA_FOURCC_NV12 ) {
+      throw Unsupported( "surfaces are not NV12" );
+    }
+
+    void * data;
+    check( "vaMapBuffer", vaMapBuffer( display_, image.buf, &data ) );
+
+    const uint8_t * const base = static_cast<const uint8_t *>( data );
+    try {
+      callback( { base + image.offsets[ 0 ], base + image.offsets[ 1 ],
+                  image.pitches[ 0 ], image.pitches[ 1 ],
+                  picture.pts, picture.nb_fields, picture.top_field_first } );
+    } catch ( ... ) {
+      vaUnmapBuffer( display_, image.buf );
+      throw;
+    }
+
+    vaUnmapBuffer( display_, image.buf );
+  } catch ( ... ) {
+    vaDestroyImage( display_, image.image_id );
+    throw;
+  }
+
+  vaDestroyImage( display_, image.image_id );
+}
+
+#else
+
+using namespace std;
+
+VAAPIMPEG2Decoder::VAAPIMPEG2Decoder( const string &,
+                                      const unsigned int,
+                                      const unsigned int )
+{
+  throw Unsupported( "built without VA-API" );
+}
+
+VAAPIMPEG2Decoder::~VAAPIMPEG2Decoder() {}
+
+void VAAPIMPEG2Decoder::decode( const uint8_t *, const uint8_t *, const uint64_t,
+                                const PictureCallback & )
+{
+  throw Unsupported( "built without VA-API" );
+}
+
+void VAAPIMPEG2Decoder::reset() {}
+
+#endif /* HAVE_VAAPI */
@@ -0,0 +1,154 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+#ifndef VAAPI_MPEG2_HH
+#define VAAPI_MPEG2_HH
+
+#include "config.h"
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifdef HAVE_VAAPI
+#include <va/va.h>
+#endif
+
+#include "file_descriptor.hh"
+
+/* Decodes MPEG-2 video (main profile, 4:2:0, frame pictures) on a GPU with
+ * VA-API: the headers are parsed here, the slices are decoded into surfaces
+ * by the GPU, and the pictures are mapped back (as NV12) in display order.
+ * Without VA-API at build time, the constructor throws Unsupported. */
+class VAAPIMPEG2Decoder
+{
+public:
+  /* the stream needs what the GPU or this decoder does not support, or the
+   * GPU has failed: the stream has to be decoded in software instead */
+  class Unsupported : public std::runtime_error
+  {
+  public:
+    using std::runtime_error::runtime_error;
+  };
+
+  /* the stream is corrupt: reset() and go on */
+  class Invalid : public std::runtime_error
+  {
+  public:
+    using std::runtime_error::runtime_error;
+  };
+
+  /* a decoded picture, valid during the callback */
+  struct Picture
+  {
+    const uint8_t * Y;
+    const uint8_t * CbCr; /* interleaved */
+    unsigned int Y_pitch;
+    unsigned int CbCr_pitch;
+    uint64_t presentation_time_stamp; /* 90 kHz */
+    unsigned int nb_fields;
+    bool top_field_first;
+  };
+
+  using PictureCallback = std::function<void( const Picture & )>;
+
+  /* decode pictures of width x height (in luma samples) on the DRM render
+   * node at device, e.g., /dev/dri/renderD128 */
+  VAAPIMPEG2Decoder( const std::string & device,
+                     const unsigned int width,
+                     const unsigned int height );
+  ~VAAPIMPEG2Decoder();
+
+  VAAPIMPEG2Decoder( const VAAPIMPEG2Decoder & other ) = delete;
+  VAAPIMPEG2Decoder & operator=( const VAAPIMPEG2Decoder & other ) = delete;
+
+  /* decode the picture in [begin, end), a PES payload, whose presentation
+   * time stamp is pts; the pictures that are due for display are passed to
+   * callback */
+  void decode( const uint8_t * begin, const uint8_t * end, const uint64_t pts,
+               const PictureCallback & callback );
+
+  /* forget the pictures decoded so far, to start over at the next
+   * sequence header */
+  void reset();
+
+#ifdef HAVE_VAAPI
+private:
+  static constexpr unsigned int NUM_SURFACES = 4; /* two anchors and a B */
+
+  using Matrix = std::array<uint8_t, 64>; /* in zigzag order */
+
+  struct SequenceState
+  {
+    unsigned int horizontal_size {}, vertical_size {};
+    bool progressive_sequence {};
+    Matrix intra_matrix {}, non_intra_matrix {};
+  };
+
+  struct PictureHeader
+  {
+    bool extension_seen {}; /* i.e., MPEG-2 rather than MPEG-1 */
+    unsigned int picture_coding_type {};
+    std::array<unsigned int, 4> f_code {};
+    unsigned int intra_dc_precision {};
+    unsigned int picture_structure {};
+    bool top_field_first {}, frame_pred_frame_dct {},
+      concealment_motion_vectors {}, q_scale_type {}, intra_vlc_format {},
+      alternate_scan {}, repeat_first_field {}, progressive_frame {};
+  };
+
+  struct Slice
+  {
+    size_t offset, size;
+    unsigned int macroblock_offset; /* in bits, from the start code */
+    unsigned int horizontal_position, vertical_position;
+    unsigned int quantiser_scale_code;
+    bool intra_slice_flag;
+  };
+
+  /* a decoded picture in a surface, before it is displayed */
+  struct DecodedPicture
+  {
+    VASurfaceID surface;
+    uint64_t pts;
+    unsigned int nb_fields;
+    bool top_field_first;
+  };
+
+  unsigned int width_, height_;
+
+  FileDescriptor drm_fd_;
+  VADisplay display_ {};
+  VAConfigID config_ { VA_INVALID_ID };
+  VAContextID context_ { VA_INVALID_ID };
+  std::array<VASurfaceID, NUM_SURFACES> surfaces_ {};
+  bool surfaces_created_ {};
+
+  std::optional<SequenceState> sequence_ {};
+
+  /* the older and newer anchor (I or P) pictures; the newer is displayed
+   * once the next anchor is decoded */
+  std::optional<DecodedPicture> past_ {}, future_ {};
+
+  static void check( const char * call, const VAStatus status );
+
+  void release();
+
+  VASurfaceID free_surface() const;
+  void parse_sequence_header( const uint8_t * data, const size_t size );
+  void parse_extension( const uint8_t * data, const size_t size,
+                        PictureHeader * picture );
+  static Slice parse_slice( const uint8_t * data, const size_t size,
+                            const size_t offset );
+  void render( const PictureHeader & picture, const uint8_t * begin,
+               const std::vector<Slice> & slices, const VASurfaceID target,
+               const VASurfaceID forward, const VASurfaceID backward );
+  void display( const DecodedPicture & picture,
+                const PictureCallback & callback );
+#endif
+};
+
+#endif /* VAAPI_MPEG2_HH */
@@ -1,14 +1,24 @@
 #include <getopt.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
 #include <sys/stat.h>
 #include <iostream>
 #include <string>
 #include <regex>
-#include <chrono>
+#include <optional>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <ctime>
 #include <system_error>
 
 #include "filesystem.hh"
 #include "exception.hh"
+#include "file_descriptor.hh"
 
 using namespace std;
 
@@ -20,64 +30,213 @@ void print_usage(const string & program_name)
   "Options:\n"
   "-r                         recursively\n"
   "-p, --pattern <pattern>    remove files whose names matching <pattern>\n"
-  "-t, --time <time>          remove files that have not been accessed for <time> seconds"
+  "-t, --time <time>          remove files that have not been accessed for <time> seconds\n"
+  "-j, --jobs <n>             with -r, walk the tree with <n> threads\n"
+  "-n, --dry-run              only report the files and bytes that would be removed"
   << endl;
 }
 
-void remove_file(const string & path,
-                 const string & pattern, const int stale_time_sec)
+/* the filters of the files to remove, and what has been (or would be)
+ * removed so far */
+struct Cleaner
 {
-  error_code ec;
-  if (not fs::is_regular_file(path, ec) or ec) {
-    /* only interested in regular files */
-    return;
-  }
+  optional<regex> pattern {};  /* compiled once rather than for each file */
+  int stale_time_sec {-1};
+  time_t now {time(nullptr)};
+  bool dry_run {false};
 
-  if (pattern.size()) {
-    string filename = fs::path(path).filename().string();
-    if (not regex_match(filename, regex(pattern))) {
-      /* filename does not match pattern */
+  atomic<uint64_t> num_files {0};
+  atomic<uint64_t> num_bytes {0};
+};
+
+/* call callback with the name and type of each entry in dir_fd but . and ..;
+ * getdents64(2) reads many entries per syscall, and no entry is stat'ed
+ * unless its type is unknown */
+template <typename Callback>
+void for_each_entry(const FileDescriptor & dir_fd, Callback && callback)
+{
+  alignas(dirent64) char buf[64 * 1024];
+
+  for (;;) {
+    const ssize_t len = getdents64(dir_fd.fd_num(), buf, sizeof(buf));
+    if (len < 0) {
+      throw unix_error("getdents64");
+    } else if (len == 0) {
       return;
     }
-  }
 
-  if (stale_time_sec != -1) {
-    struct stat file_stat;
-    if (stat(path.c_str(), &file_stat)) {
-      cerr << "Warning: failed to run stat on " << path << endl;
-      return;
+    for (ssize_t pos = 0; pos < len;) {
+      const auto * entry = reinterpret_cast<const dirent64 *>(buf + pos);
+      pos += entry->d_reclen;
+
+      const string_view name(entry->d_name);
+      if (name == "." or name == "..") {
+        continue;
+      }
+
+      callback(entry->d_name, entry->d_type);
     }
+  }
+}
+
+/* statx(2) only the fields asked for; follow the symlink at name unless
+ * nofollow, as fs::is_regular_file() and stat() do */
+optional<struct statx> stat_entry(const FileDescriptor & dir_fd,
+                                  const char * name, const unsigned int mask,
+                                  const bool nofollow)
+{
+  struct statx stx;
+  if (statx(dir_fd.fd_num(), name, nofollow ? AT_SYMLINK_NOFOLLOW : 0,
+            mask, &stx) < 0) {
+    cerr << "Warning: failed to run statx on " << name << endl;
+    return nullopt;
+  }
+
+  return stx;
+}
 
-    timespec file_time = file_stat.st_atim;
-    auto last_chrono = chrono::seconds(file_time.tv_sec);
-    auto last = chrono::system_clock::time_point(last_chrono);
+void remove_file(Cleaner & cleaner, const FileDescriptor & dir_fd,
+                 const fs::path & dir, const char * name,
+                 const unsigned char type)
+{
+  /* only interested in regular files */
+  if (type != DT_REG and type != DT_LNK and type != DT_UNKNOWN) {
+    return;
+  }
+
+  if (cleaner.pattern and not regex_match(name, *cleaner.pattern)) {
+    /* filename does not match pattern */
+    return;
+  }
+
+  unsigned int mask = 0;
+  if (type != DT_REG) {
+    mask |= STATX_TYPE;
+  }
+  if (cleaner.stale_time_sec != -1) {
+    mask |= STATX_ATIME;
+  }
+  if (cleaner.dry_run) {
+    mask |= STATX_SIZE;
+  }
 
-    auto now = chrono::system_clock::now();
-    auto elapsed_sec = chrono::duration_cast<chrono::seconds>(now - last);
+  optional<struct statx> stx;
+  if (mask) {
+    stx = stat_entry(dir_fd, name, mask, type == DT_REG);
+    if (not stx) {
+      return;
+    }
 
-    if (elapsed_sec.count() < stale_time_sec) {
-      /* file is not stale yet */
+    if (type != DT_REG and not S_ISREG(stx->stx_mode)) {
       return;
     }
   }
 
+  if (cleaner.stale_time_sec != -1 and
+      cleaner.now - stx->stx_atime.tv_sec < cleaner.stale_time_sec) {
+    /* file is not stale yet */
+    return;
+  }
+
+  if (cleaner.dry_run) {
+    cleaner.num_files++;
+    cleaner.num_bytes += stx->stx_size;
+    return;
+  }
+
   /* remove the file if it passes all filters */
-  if (not fs::remove(path, ec) or ec) {
-    cerr << "Warning: file " << path << " cannot be removed" << endl;
+  if (unlinkat(dir_fd.fd_num(), name, 0) < 0) {
+    cerr << "Warning: file " << dir / name << " cannot be removed" << endl;
+    return;
   }
+
+  cleaner.num_files++;
 }
 
-void clean_files(const string & working_dir, const bool recursive,
-                 const string & pattern, const int stale_time_sec)
+/* remove the files in dir, and return its subdirectories if recursive */
+vector<fs::path> clean_dir(Cleaner & cleaner, const fs::path & dir,
+                           const bool recursive)
 {
-  if (recursive) {
-    for (const auto & entry : fs::recursive_directory_iterator(working_dir)) {
-      remove_file(entry.path().string(), pattern, stale_time_sec);
+  vector<fs::path> subdirs;
+
+  FileDescriptor dir_fd(CheckSystemCall("open (" + dir.string() + ")",
+      open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)));
+
+  for_each_entry(dir_fd,
+    [&](const char * name, unsigned char type) {
+      if (type == DT_UNKNOWN) {
+        const auto stx = stat_entry(dir_fd, name, STATX_TYPE, true);
+        if (not stx) {
+          return;
+        }
+
+        type = S_ISDIR(stx->stx_mode) ? DT_DIR : DT_UNKNOWN;
+      }
+
+      /* as fs::recursive_directory_iterator, do not follow symlinks */
+      if (type == DT_DIR) {
+        if (recursive) {
+          subdirs.emplace_back(dir / name);
+        }
+        return;
+      }
+
+      remove_file(cleaner, dir_fd, dir, name, type);
     }
-  } else {
-    for (const auto & entry : fs::directory_iterator(working_dir)) {
-      remove_file(entry.path().string(), pattern, stale_time_sec);
+  );
+
+  return subdirs;
+}
+
+/* clean the tree at working_dir with num_jobs threads, each taking the next
+ * directory to clean from a shared queue */
+void clean_tree(Cleaner & cleaner, const fs::path & working_dir,
+                const unsigned int num_jobs)
+{
+  mutex mtx;
+  condition_variable cv;
+  deque<fs::path> dirs { working_dir };
+  unsigned int num_busy = 0;
+
+  auto work = [&]() {
+    unique_lock<mutex> lock(mtx);
+
+    for (;;) {
+      cv.wait(lock, [&] { return not dirs.empty() or num_busy == 0; });
+      if (dirs.empty()) {
+        return;  /* no directory is left or being cleaned */
+      }
+
+      const fs::path dir = move(dirs.front());
+      dirs.pop_front();
+      num_busy++;
+      lock.unlock();
+
+      vector<fs::path> subdirs;
+      try {
+        subdirs = clean_dir(cleaner, dir, true);
+      } catch (const exception & e) {
+        cerr << "Warning: " << e.what() << endl;
+      }
+
+      lock.lock();
+      num_busy--;
+      for (auto & subdir : subdirs) {
+        dirs.emplace_back(move(subdir));
+      }
+      cv.notify_all();
     }
+  };
+
+  vector<thread> threads;
+  for (unsigned int i = 1; i < num_jobs; i++) {
+    threads.emplace_back(work);
+  }
+
+  work();
+
+  for (auto & t : threads) {
+    t.join();
   }
 }
 
@@ -89,15 +248,19 @@ int main(int argc, char * argv[])
 
   string working_dir, pattern, stale_time;
   bool recursive = false;
+  unsigned int num_jobs = 1;
+  Cleaner cleaner;
 
   const option cmd_line_opts[] = {
     {"pattern", required_argument, nullptr, 'p'},
     {"time",    required_argument, nullptr, 't'},
+    {"jobs",    required_argument, nullptr, 'j'},
+    {"dry-run", no_argument,       nullptr, 'n'},
     { nullptr,  0,                 nullptr,  0 },
   };
 
   while (true) {
-    const int opt = getopt_long(argc, argv, "p:t:r", cmd_line_opts, nullptr);
+    const int opt = getopt_long(argc, argv, "p:t:rj:n", cmd_line_opts, nullptr);
     if (opt == -1) {
       break;
     }
@@ -112,6 +275,12 @@ int main(int argc, char * argv[])
     case 'r':
       recursive = true;
       break;
+    case 'j':
+      num_jobs = stoul(optarg);
+      break;
+    case 'n':
+      cleaner.dry_run = true;
+      break;
     default:
       print_usage(argv[0]);
       return EXIT_FAILURE;
@@ -131,22 +300,39 @@ int main(int argc, char * argv[])
     return EXIT_FAILURE;
   }
 
-  int stale_time_sec = -1;
   if (stale_time.size()) {
-    stale_time_sec = stoi(stale_time);
-    if (stale_time_sec <= 0) {
+    cleaner.stale_time_sec = stoi(stale_time);
+    if (cleaner.stale_time_sec <= 0) {
       cerr << "--time should be greater than 0" << endl;
       return EXIT_FAILURE;
     }
   }
 
-  if (not (pattern.size() or stale_time_sec > 0)) {
+  if (not (pattern.size() or cleaner.stale_time_sec > 0)) {
     /* do nothing if no filter is specified */
     cerr << "error: neither --pattern nor --time is specified" << endl;
     return EXIT_FAILURE;
   }
 
-  clean_files(working_dir, recursive, pattern, stale_time_sec);
+  if (pattern.size()) {
+    cleaner.pattern = regex(pattern);
+  }
+
+  if (num_jobs == 0) {
+    cerr << "--jobs should be greater than 0" << endl;
+    return EXIT_FAILURE;
+  }
+
+  if (recursive) {
+    clean_tree(cleaner, working_dir, num_jobs);
+  } else {
+    clean_dir(cleaner, working_dir, false);
+  }
+
+  if (cleaner.dry_run) {
+    cout << cleaner.num_files << " files, " << cleaner.num_bytes
+         << " bytes would be removed" << endl;
+  }
 
   return EXIT_SUCCESS;
 }
@@ -1,25 +1,158 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/inotify.h>
 #include <iostream>
 #include <string>
 #include <vector>
 #include <tuple>
+#include <map>
+#include <memory>
 
 #include "filesystem.hh"
+#include "exception.hh"
+#include "file_descriptor.hh"
+#include "poller.hh"
+#include "inotify.hh"
 
 using namespace std;
 
 void print_usage(const string & program_name)
 {
   cerr <<
-  "Usage: " << program_name << " <input_file> "
-  "--clean <clean_dir> <clean_ext> [<clean_dir> <clean_ext> ...]\n"
+  "Usage: " << program_name << " <input_file> | --watch\n"
+  "       --clean <clean_dir> <clean_ext> [<clean_dir> <clean_ext> ...]\n"
   "       --depend <dep_dir> <dep_ext> [<dep_dir> <dep_ext>]\n"
   "<input_file>   input file from notifier\n"
+  "--watch        rather than checking a single input file, keep running\n"
+  "               and check every file moved into the <dep_dir>s\n"
   "--clean <clean_dir> <clean_ext>  directories and file extensions to clean\n"
   "--depend <dep_dir> <dep_ext>     directories containing dependent files\n"
   "                                 and extensions"
   << endl;
 }
 
+/* With --watch, a single depcleaner watches all the dependent directories
+ * rather than a notifier spawning a depcleaner per dependent file: it keeps
+ * which of the dependent files of each input have appeared, and once all of
+ * them have, removes the input's files to clean along with those of the
+ * other inputs completed by the same batch of inotify events. */
+class DepCleaner
+{
+public:
+  DepCleaner(Inotify & inotify,
+             const vector<tuple<string, string>> & clean_files,
+             const vector<tuple<string, string>> & depend_files)
+    : clean_dirs_(), depend_files_(depend_files)
+  {
+    for (const auto & [clean_dir, clean_ext] : clean_files) {
+      clean_dirs_.emplace_back(
+        make_unique<FileDescriptor>(CheckSystemCall("open (" + clean_dir + ")",
+          open(clean_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC))),
+        clean_ext);
+    }
+
+    /* watch before listing so that no file is missed in between */
+    for (size_t i = 0; i < depend_files_.size(); i++) {
+      const auto & [dep_dir, dep_ext] = depend_files_[i];
+
+      inotify.add_watch(dep_dir, IN_MOVED_TO,
+        [this, i](const inotify_event & event, const string & path) {
+          if (not (event.mask & IN_MOVED_TO) or (event.mask & IN_ISDIR)) {
+            return;
+          }
+
+          add_depend_file(i, fs::path(path) / event.name);
+        }
+      );
+    }
+
+    inotify.add_batch_callback([this]() { clean(); });
+
+    for (size_t i = 0; i < depend_files_.size(); i++) {
+      const auto & dep_dir = get<0>(depend_files_[i]);
+      for (const auto & entry : fs::directory_iterator(dep_dir)) {
+        add_depend_file(i, entry.path());
+      }
+    }
+
+    clean();
+  }
+
+private:
+  vector<pair<unique_ptr<FileDescriptor>, string>> clean_dirs_;
+  vector<tuple<string, string>> depend_files_;
+
+  /* the inputs that some, but not all, dependent files have appeared for:
+   * whether each has appeared and how many have */
+  struct Dependencies
+  {
+    vector<bool> appeared;
+    size_t num_appeared;
+  };
+  map<string, Dependencies> pending_ {};  /* key: stem */
+
+  /* the inputs all of whose dependent files have appeared */
+  vector<string> to_clean_ {};
+
+  void add_depend_file(const size_t dep_idx, const fs::path & file)
+  {
+    if (file.extension() != get<1>(depend_files_[dep_idx])) {
+      return;
+    }
+
+    const string stem = file.stem();
+    auto it = pending_.find(stem);
+    if (it == pending_.end()) {
+      it = pending_.emplace(stem, Dependencies {
+             vector<bool>(depend_files_.size(), false), 0 }).first;
+    }
+
+    auto & deps = it->second;
+    if (not deps.appeared[dep_idx]) {
+      deps.appeared[dep_idx] = true;
+      deps.num_appeared++;
+    }
+
+    if (deps.num_appeared == depend_files_.size()) {
+      to_clean_.emplace_back(stem);
+      pending_.erase(it);
+    }
+  }
+
+  void clean()
+  {
+    for (const auto & stem : to_clean_) {
+      for (const auto & [clean_dir, clean_ext] : clean_dirs_) {
+        const string filename = stem + clean_ext;
+
+        /* the file might have been removed already */
+        if (unlinkat(clean_dir->fd_num(), filename.c_str(), 0) < 0 and
+            errno != ENOENT) {
+          cerr << "Warning: "
+               << unix_error("unlinkat (" + filename + ")").what() << endl;
+        }
+      }
+    }
+
+    to_clean_.clear();
+  }
+};
+
+int watch(const vector<tuple<string, string>> & clean_files,
+          const vector<tuple<string, string>> & depend_files)
+{
+  Poller poller;
+  Inotify inotify(poller);
+  DepCleaner cleaner(inotify, clean_files, depend_files);
+
+  for (;;) {
+    auto ret = poller.poll(-1);
+    if (ret.result != Poller::Result::Type::Success) {
+      return ret.exit_status;
+    }
+  }
+}
+
 int main(int argc, char * argv[])
 {
   if (argc < 1) {
@@ -67,6 +200,10 @@ int main(int argc, char * argv[])
     depend_files.emplace_back(argv[i], argv[i + 1]);
   }
 
+  if (input_file == "--watch") {
+    return watch(clean_files, depend_files);
+  }
+
   /* check if all dependent files exist */
   string input_filestem = fs::path(input_file).stem();
   for (const auto & depend_file : depend_files) {
@@ -1,28 +1,261 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/inotify.h>
 #include <iostream>
 #include <string>
 #include <vector>
+#include <map>
+#include <optional>
+#include <memory>
+#include <set>
 
 #include "filesystem.hh"
+#include "exception.hh"
+#include "file_descriptor.hh"
+#include "chunk_pack.hh"
+#include "poller.hh"
+#include "inotify.hh"
 
 using namespace std;
 
 void print_usage(const string & program_name)
 {
   cerr <<
-  "Usage: " << program_name << " <input_file> <clean_ext> <time_window>\n\n"
+  "Usage: " << program_name << " <input_file> <clean_ext> <time_window>\n"
+  "       " << program_name << " --watch "
+  "[--archive <archive_dir> <segment_span> <archive_window>]\n"
+  "       <dir> <clean_ext> <time_window> "
+  "[<dir> <clean_ext> <time_window> ...]\n\n"
   "<input_file>   input file from notifier\n"
   "<clean_ext>    extension of the files to clean\n"
   "<time_window>  clean files with timestamped names that are less than\n"
-  "               input_file - time_window"
+  "               input_file - time_window\n"
+  "--watch        rather than being run for each input file, keep running\n"
+  "               and clean each <dir> as files are moved into it\n"
+  "--archive      append each file to <archive_dir>/<dir name>/<ts><clean_ext>.pack\n"
+  "               before removing it, where <ts> is the timestamp of the file\n"
+  "               rounded down to a multiple of <segment_span>; the packs\n"
+  "               that end more than <archive_window> before the newest file\n"
+  "               are removed"
   << endl;
 }
 
+/* the segments of a DVR archive that a WindowCleaner appends the files that
+ * it cleans to, for the media servers to serve (see DVRArchive) */
+struct Archive
+{
+  fs::path dir;
+  int64_t segment_span;
+  int64_t window;
+};
+
+/* With --watch, a single windowcleaner cleans the directories as files are
+ * moved into them rather than a notifier spawning a windowcleaner per file:
+ * it keeps the files of each directory in timestamp order, so that
+ * those out of the window of the newest are removed without listing the
+ * directory again. */
+class WindowCleaner
+{
+public:
+  WindowCleaner(Inotify & inotify, const string & dir,
+                const string & clean_ext, const int64_t time_window,
+                const optional<Archive> & archive)
+    : dir_fd_(CheckSystemCall("open (" + dir + ")",
+        open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC))),
+      clean_ext_(clean_ext), time_window_(time_window), archive_(archive)
+  {
+    if (archive_) {
+      /* archive_dir/<dir name>/ */
+      fs::path dir_path = dir;
+      if (dir_path.filename().empty()) {
+        dir_path = dir_path.parent_path();
+      }
+
+      archive_->dir /= dir_path.filename();
+      fs::create_directories(archive_->dir);
+
+      for (const auto & entry : fs::directory_iterator(archive_->dir)) {
+        const string filename = entry.path().filename();
+        if (filename.size() > pack_suffix().size() and
+            filename.compare(filename.size() - pack_suffix().size(),
+                             string::npos, pack_suffix()) == 0) {
+          segments_.emplace(stoll(filename));
+        }
+      }
+    }
+
+    /* watch before listing so that no file is missed in between */
+    inotify.add_watch(dir, IN_MOVED_TO,
+      [this](const inotify_event & event, const string &) {
+        if (not (event.mask & IN_MOVED_TO) or (event.mask & IN_ISDIR)) {
+          return;
+        }
+
+        add_file(event.name);
+      }
+    );
+
+    inotify.add_batch_callback([this]() { clean(); });
+
+    for (const auto & entry : fs::directory_iterator(dir)) {
+      add_file(entry.path().filename());
+    }
+
+    clean();
+  }
+
+private:
+  FileDescriptor dir_fd_;
+  string clean_ext_;
+  int64_t time_window_;
+
+  optional<Archive> archive_;
+
+  map<int64_t, string> files_ {};  /* key: timestamp */
+  optional<int64_t> newest_ {};
+
+  /* timestamps of the segments in the archive */
+  set<int64_t> segments_ {};
+
+  string pack_suffix() const { return clean_ext_ + ".pack"; }
+
+  /* append the file at timestamp to its segment in the archive */
+  void archive_file(const string & filename, const int64_t timestamp)
+  {
+    const int64_t segment_ts = timestamp / archive_->segment_span
+                               * archive_->segment_span;
+    const fs::path pack_path = archive_->dir
+                               / (to_string(segment_ts) + pack_suffix());
+
+    try {
+      FileDescriptor fd(CheckSystemCall("openat (" + filename + ")",
+          openat(dir_fd_.fd_num(), filename.c_str(), O_RDONLY | O_CLOEXEC)));
+      const string data = fd.read_exactly(fd.filesize());
+
+      ChunkPack::append(pack_path, ChunkPack::DEFAULT_CAPACITY, timestamp,
+                        data);
+    } catch (const exception & e) {
+      /* the file is removed regardless, lest ready/ grow without bound */
+      print_exception("windowcleaner archive", e);
+      return;
+    }
+
+    if (not segments_.emplace(segment_ts).second) {
+      return;
+    }
+
+    /* a new segment has begun: remove those out of the archive window */
+    while (not segments_.empty() and
+           segment_ts - (*segments_.begin() + archive_->segment_span)
+           > archive_->window) {
+      const fs::path old_path = archive_->dir
+          / (to_string(*segments_.begin()) + pack_suffix());
+
+      error_code ec;
+      fs::remove(old_path, ec);
+      if (ec) {
+        cerr << "Warning: failed to remove " << old_path << ": "
+             << ec.message() << endl;
+      }
+
+      segments_.erase(segments_.begin());
+    }
+  }
+
+  void add_file(const fs::path & filename)
+  {
+    if (filename.extension() != clean_ext_) {
+      return;
+    }
+
+    const int64_t timestamp = stoll(filename.stem());
+    files_.emplace(timestamp, filename);
+
+    if (not newest_ or timestamp > *newest_) {
+      newest_ = timestamp;
+    }
+  }
+
+  void clean()
+  {
+    while (not files_.empty() and
+           *newest_ - files_.begin()->first > time_window_) {
+      const string & filename = files_.begin()->second;
+
+      if (archive_) {
+        archive_file(filename, files_.begin()->first);
+      }
+
+      /* the file might have been removed already */
+      if (unlinkat(dir_fd_.fd_num(), filename.c_str(), 0) < 0 and
+          errno != ENOENT) {
+        cerr << "Warning: "
+             << unix_error("unlinkat (" + filename + ")").what() << endl;
+      }
+
+      files_.erase(files_.begin());
+    }
+  }
+};
+
+int watch(int argc, char * argv[])
+{
+  int first_dir = 2;
+  optional<Archive> archive;
+
+  if (argc > 2 and string(argv[2]) == "--archive") {
+    if (argc < 6) {
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+
+    archive = Archive {argv[3], stoll(argv[4]), stoll(argv[5])};
+    if (archive->segment_span <= 0 or archive->window <= 0) {
+      cerr << "Segment span and archive window must be positive" << endl;
+      return EXIT_FAILURE;
+    }
+
+    first_dir = 6;
+  }
+
+  if (argc < first_dir + 3 or (argc - first_dir) % 3 != 0) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  Poller poller;
+  Inotify inotify(poller);
+
+  vector<unique_ptr<WindowCleaner>> cleaners;
+  for (int i = first_dir; i < argc; i += 3) {
+    const int64_t time_window = stoll(argv[i + 2]);
+    if (time_window <= 0) {
+      cerr << "Time window cannot be negative or less than 0" << endl;
+      return EXIT_FAILURE;
+    }
+
+    cleaners.emplace_back(make_unique<WindowCleaner>(
+      inotify, argv[i], argv[i + 1], time_window, archive));
+  }
+
+  for (;;) {
+    auto ret = poller.poll(-1);
+    if (ret.result != Poller::Result::Type::Success) {
+      return ret.exit_status;
+    }
+  }
+}
+
 int main(int argc, char * argv[])
 {
   if (argc < 1) {
     abort();
   }
 
+  if (argc > 1 and string(argv[1]) == "--watch") {
+    return watch(argc, argv);
+  }
+
   if (argc != 4) {
     print_usage(argv[0]);
     return EXIT_FAILURE;
@@ -6,28 +6,44 @@
 
 using namespace std;
 
-FileMsg::FileMsg(const uint16_t _dst_path_len, const string & _dst_path)
-  : dst_path_len(_dst_path_len), dst_path(_dst_path)
+FileMsg::FileMsg(const uint16_t _dst_path_len, const string & _dst_path,
+                 const uint64_t _file_size)
+  : dst_path_len(_dst_path_len), dst_path(_dst_path), file_size(_file_size)
 {}
 
 FileMsg::FileMsg(const string & str)
 {
+  const auto msg_size = parsed_size(str);
+  if (not msg_size or str.size() < *msg_size) {
+    throw runtime_error("FileMsg is too small to contain its fields");
+  }
+
   const char * data = str.data();
 
-  if (str.size() < sizeof(dst_path_len)) {
-    throw runtime_error("FileMsg is too small to contain dst_path_len");
+  dst_path_len = get_uint16(data);
+  data += sizeof(dst_path_len);
+
+  dst_path = string(data, dst_path_len);
+  data += dst_path_len;
+
+  file_size = get_uint64(data);
+}
+
+optional<size_t> FileMsg::parsed_size(const string_view data)
+{
+  if (data.size() < sizeof(dst_path_len)) {
+    return nullopt;
   }
 
-  dst_path_len = get_uint16(data);
-  dst_path = str.substr(sizeof(dst_path_len), dst_path_len);
+  return sizeof(dst_path_len) + get_uint16(data.data()) + sizeof(file_size);
 }
 
 string FileMsg::to_string() const
 {
-  return put_field(dst_path_len) + dst_path;
+  return put_field(dst_path_len) + dst_path + put_field(file_size);
 }
 
 unsigned int FileMsg::size() const
 {
-  return sizeof(dst_path_len) + dst_path.size();
+  return sizeof(dst_path_len) + dst_path.size() + sizeof(file_size);
 }
@@ -2,18 +2,28 @@
 #define FILE_MESSAGE_HH
 
 #include <string>
+#include <string_view>
+#include <optional>
 
+/* the header of a file sent over a file_sender connection, which is followed
+ * by file_size bytes of the file and then by the header of the next file */
 class FileMsg
 {
 public:
   uint16_t dst_path_len {};
   std::string dst_path {};
+  uint64_t file_size {};
 
-  FileMsg(const uint16_t dst_path_len, const std::string & dst_path);
+  FileMsg(const uint16_t dst_path_len, const std::string & dst_path,
+          const uint64_t file_size);
 
   /* parse a file message from network */
   FileMsg(const std::string & str);
 
+  /* the size of the file message at the front of data, or nullopt if data
+   * is too short to tell */
+  static std::optional<size_t> parsed_size(const std::string_view data);
+
   /* make network representation of file message */
   std::string to_string() const;
 
@@ -1,15 +1,23 @@
 #include <fcntl.h>
+#include <csignal>
 
 #include <iostream>
 #include <stdexcept>
 #include <map>
+#include <optional>
+#include <memory>
+#include <deque>
+#include <vector>
 
 #include "strict_conversions.hh"
 #include "socket.hh"
 #include "file_descriptor.hh"
 #include "exception.hh"
 #include "poller.hh"
+#include "io_uring.hh"
 #include "filesystem.hh"
+#include "child_process.hh"
+#include "pipe.hh"
 #include "file_message.hh"
 
 using namespace std;
@@ -18,23 +26,185 @@ using namespace PollerShortNames;
 static uint16_t global_file_id = 0;  /* intended to wrap around */
 static fs::path tmp_dir_path = fs::temp_directory_path();
 
+/* stop reading from a client while this much of its data is yet to be
+ * written to disk */
+static constexpr size_t MAX_QUEUED_BYTES = 16 * 1024 * 1024;  /* 16 MiB */
+
 void print_usage(const string & program_name)
 {
   cerr <<
-  "Usage: " << program_name << " PORT [TMP-DIR]\n\n"
+  "Usage: " << program_name << " PORT [TMP-DIR] [--relay HOST PORT]\n\n"
   "TMP-DIR: directory to save temp file; "
-  "must be unique for each file_receiver process"
+  "must be unique for each file_receiver process\n"
+  "--relay: forward each file received to the file_receiver at HOST:PORT,\n"
+  "         to the same path there, e.g., to replicate to media servers in\n"
+  "         a chain rather than all from the pipeline host"
   << endl;
 }
 
+/* Forwards the files received to the next file_receiver through a
+ * "file_sender --stdin" child, so that the files are relayed with a queue
+ * and connection of their own rather than stalling the receiver. */
+class Relay
+{
+public:
+  Relay(Poller & poller, const string & file_sender, const string & host,
+        const string & port)
+    : Relay(poller, make_pipe(), file_sender, host, port)
+  {}
+
+  /* queue the file at path to be sent to the same path */
+  void relay(const fs::path & path)
+  {
+    if (not stopped_) {
+      lines_.emplace_back(path.string() + "\t" + path.string() + "\n");
+    }
+  }
+
+  /* forbid copying and moving, as the action refers to this */
+  Relay(const Relay & other) = delete;
+  Relay & operator=(const Relay & other) = delete;
+
+private:
+  FileDescriptor pipe_;  /* the write end of the child's stdin */
+  ChildProcess sender_;
+  deque<string> lines_ {};
+  bool stopped_ {false};
+
+  Relay(Poller & poller, pair<FileDescriptor, FileDescriptor> && pipe,
+        const string & file_sender, const string & host,
+        const string & port)
+    : pipe_(move(pipe.second)),
+      sender_(spawn(pipe.first, pipe_, file_sender, host, port))
+  {
+    /* each line is much shorter than the pipe capacity, so a line written
+     * when the pipe is writable does not block */
+    poller.add_action(Poller::Action(pipe_, Direction::Out,
+      [this]() {
+        try {
+          pipe_.write(lines_.front());
+          lines_.pop_front();
+          return ResultType::Continue;
+        } catch (const exception & e) {
+          cerr << "Warning: stopped relaying: " << e.what() << endl;
+          stopped_ = true;
+          lines_.clear();
+          return ResultType::Cancel;
+        }
+      },
+      [this]() { return not lines_.empty(); }
+    ));
+  }
+
+  static ChildProcess spawn(const FileDescriptor & read_end,
+                            const FileDescriptor & write_end,
+                            const string & file_sender, const string & host,
+                            const string & port)
+  {
+    SpawnOptions options;
+    options.dup2s = { {read_end.fd_num(), STDIN_FILENO} };
+    options.closes = { read_end.fd_num(), write_end.fd_num() };
+
+    return ChildProcess(file_sender, file_sender,
+                        {file_sender, "--stdin", host, port}, options);
+  }
+};
+
+static unique_ptr<Relay> relay = nullptr;
+
+/* A connection from a file_sender, over which any number of files arrive
+ * back to back, each as a FileMsg followed by its contents. The contents are
+ * written to a temp file as they arrive rather than buffered in memory, and
+ * the temp file is moved to dst_path once complete. The temp file is
+ * unnamed (O_TMPFILE) until then where supported, so that a file cut short
+ * leaves nothing behind even if the receiver dies. */
 class Client
 {
 public:
-  Client(TCPSocket && _socket) : socket(move(_socket)), buffer() {}
+  Client(TCPSocket && _socket) : socket(move(_socket)) {}
+
+  /* whether to stop reading until more of the data received is on disk */
+  bool backlogged() const { return *queued_bytes_ >= MAX_QUEUED_BYTES; }
 
-  void write_to_file() const
+  /* consume data received on socket; file writes and fsyncs go to ring */
+  void receive(IOUring & ring, string_view data)
+  {
+    while (not data.empty()) {
+      if (not file_) {
+        /* take no more of data than the rest of the FileMsg */
+        const auto msg_size = FileMsg::parsed_size(header_);
+        const size_t wanted = msg_size ? *msg_size - header_.size()
+                              : sizeof(FileMsg::dst_path_len) - header_.size();
+        const size_t taken = min(wanted, data.size());
+
+        header_.append(data.substr(0, taken));
+        data.remove_prefix(taken);
+
+        if (msg_size and header_.size() == *msg_size) {
+          open_file(ring, FileMsg(header_));
+          header_.clear();
+        }
+      } else {
+        const size_t taken = min<uint64_t>(file_->remaining, data.size());
+
+        *queued_bytes_ += taken;
+        ring.write(file_->fd, string(data.substr(0, taken)),
+          [queued_bytes = queued_bytes_, taken]() {
+            *queued_bytes -= taken;
+          }
+        );
+        file_->remaining -= taken;
+        data.remove_prefix(taken);
+
+        if (file_->remaining == 0) {
+          close_file(ring);
+        }
+      }
+    }
+  }
+
+  /* the connection has closed; discard the file cut short, if any */
+  void discard(IOUring & ring)
+  {
+    if (not file_) {
+      return;
+    }
+
+    cerr << "Warning: connection closed before receiving "
+         << file_->dst_path << endl;
+
+    /* remove the named temp file after the writes queued to it; an unnamed
+     * one is gone once closed */
+    if (not file_->unnamed) {
+      ring.fsync(file_->fd, [tmp_path = file_->tmp_path]() {
+        error_code ec;
+        fs::remove(tmp_path, ec);
+      });
+    }
+
+    file_.reset();
+  }
+
+  TCPSocket socket;
+
+private:
+  struct File
+  {
+    shared_ptr<FileDescriptor> fd;
+    bool unnamed;  /* opened with O_TMPFILE; linked at tmp_path once done */
+    fs::path tmp_path;
+    fs::path dst_path;
+    uint64_t remaining;  /* bytes yet to receive */
+  };
+
+  string header_ {};  /* a FileMsg received partially */
+  optional<File> file_ {};  /* the file being received */
+
+  /* shared with the write callbacks, which might outlive the client */
+  shared_ptr<size_t> queued_bytes_ { make_shared<size_t>(0) };
+
+  void open_file(IOUring & ring, const FileMsg & metadata)
   {
-    FileMsg metadata(buffer);
     fs::path dst_path = metadata.dst_path;
     fs::path tmp_path = tmp_dir_path / (dst_path.filename().string() + "."
                                         + to_string(global_file_id++));
@@ -47,23 +217,62 @@ public:
       fs::create_directories(tmp_path.parent_path());
     }
 
-    FileDescriptor fd(CheckSystemCall("open (" + tmp_path.string() + ")",
-        open(tmp_path.string().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)));
+    /* fall back to a named temp file if the file system lacks O_TMPFILE */
+    int fd_num = open(tmp_path.parent_path().c_str(),
+                      O_WRONLY | O_TMPFILE | O_CLOEXEC, 0644);
+    const bool unnamed = fd_num >= 0;
+    if (not unnamed) {
+      fd_num = CheckSystemCall("open (" + tmp_path.string() + ")",
+          open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+               0644));
+    }
+
+    auto fd = make_shared<FileDescriptor>(fd_num);
+
+    /* reserve the blocks of the whole file up front so that it is laid out
+     * contiguously; only a hint, so failure is ignored */
+    if (metadata.file_size > 0) {
+      fallocate(fd->fd_num(), 0, 0, metadata.file_size);
+    }
+
+    file_ = File { move(fd), unnamed, tmp_path, dst_path,
+                   metadata.file_size };
 
     /* avoid writing empty data */
-    if (buffer.size() > metadata.size()) {
-      fd.write(buffer.substr(metadata.size()));
+    if (file_->remaining == 0) {
+      close_file(ring);
     }
+  }
 
-    fd.close();
+  /* the file is written and flushed by ring, and then moved to dst_path */
+  void close_file(IOUring & ring)
+  {
+    /* the file is complete on disk before it appears at dst_path */
+    ring.fsync(file_->fd,
+      [fd = file_->fd, unnamed = file_->unnamed, tmp_path = file_->tmp_path,
+       dst_path = file_->dst_path]() {
+        /* name the file before renaming it, so that it appears at dst_path
+         * atomically and with IN_MOVED_TO as any other file */
+        if (unnamed) {
+          const string fd_path = "/proc/self/fd/" + to_string(fd->fd_num());
+          CheckSystemCall("linkat (" + tmp_path.string() + ")",
+              linkat(AT_FDCWD, fd_path.c_str(), AT_FDCWD, tmp_path.c_str(),
+                     AT_SYMLINK_FOLLOW));
+        }
 
-    fs::rename(tmp_path, dst_path);
+        fs::rename(tmp_path, dst_path);
 
-    cerr << "Received " << tmp_path << " and moved to " << dst_path << endl;
-  }
+        cerr << "Received " << tmp_path << " and moved to " << dst_path
+             << endl;
 
-  TCPSocket socket;
-  string buffer;
+        if (relay) {
+          relay->relay(dst_path);
+        }
+      }
+    );
+
+    file_.reset();
+  }
 };
 
 int main(int argc, char * argv[])
@@ -72,6 +281,13 @@ int main(int argc, char * argv[])
     abort();
   }
 
+  /* the relay's address follows --relay at the end of the arguments */
+  vector<string> relay_args;
+  if (argc >= 4 and string(argv[argc - 3]) == "--relay") {
+    relay_args = { argv[argc - 2], argv[argc - 1] };
+    argc -= 3;
+  }
+
   if (argc != 2 and argc != 3) {
     print_usage(argv[0]);
     return EXIT_FAILURE;
@@ -82,6 +298,23 @@ int main(int argc, char * argv[])
     tmp_dir_path = argv[2];
   }
 
+  /* a relay that has gone is reported by the failing write instead */
+  if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+    throw runtime_error("signal: failed to ignore SIGPIPE");
+  }
+
+  uint64_t global_client_id = 0;
+  map<uint64_t, Client> clients;
+
+  Poller poller;
+
+  /* file_sender is expected next to file_receiver (or on PATH) */
+  if (not relay_args.empty()) {
+    relay = make_unique<Relay>(poller,
+      fs::path(argv[0]).parent_path() / "file_sender",
+      relay_args[0], relay_args[1]);
+  }
+
   TCPSocket listening_socket;
   listening_socket.set_reuseaddr();
   listening_socket.set_reuseport();
@@ -90,12 +323,13 @@ int main(int argc, char * argv[])
   listening_socket.listen(128);
   cerr << "Listening on " << listening_socket.local_address().str() << endl;
 
-  uint64_t global_client_id = 0;
-  map<uint64_t, Client> clients;
+  /* file writes and fsyncs of all the clients are batched */
+  IOUring ring;
+  ring.add_to_poller(poller);
 
-  Poller poller;
   poller.add_action(Poller::Action(listening_socket, Direction::In,
-    [&poller, &listening_socket, &global_client_id, &clients]()->ResultType {
+    [&poller, &ring, &listening_socket, &global_client_id,
+     &clients]()->ResultType {
       TCPSocket client_sock = listening_socket.accept();
 
       /* create a new Client */
@@ -108,18 +342,27 @@ int main(int argc, char * argv[])
       Client & client = clients.at(client_id);
 
       poller.add_action(Poller::Action(client.socket, Direction::In,
-        [client_id, &client, &clients]()->ResultType {
-          const string & data = client.socket.read();
-          client.buffer.append(data);
+        [client_id, &client, &clients, &ring]()->ResultType {
+          IOBuffer buffer;
+          string_view data;
+
+          /* a connection reset by its sender ends like any other */
+          try {
+            data = client.socket.read(buffer);
+          } catch (const exception & e) {
+            cerr << "Warning: " << e.what() << endl;
+          }
 
           if (data.empty()) {  // EOF
-            client.write_to_file();
+            client.discard(ring);
             clients.erase(client_id);
             return ResultType::CancelAll;
           }
 
+          client.receive(ring, data);
           return ResultType::Continue;
-        }
+        },
+        [&client]() { return not client.backlogged(); }
       ));
 
       return ResultType::Continue;
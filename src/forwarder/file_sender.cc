@@ -1,64 +1,327 @@
 #include <fcntl.h>
+#include <csignal>
+#include <sys/sendfile.h>
 
 #include <iostream>
+#include <optional>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <chrono>
 
 #include "strict_conversions.hh"
 #include "socket.hh"
+#include "connection_pool.hh"
 #include "file_descriptor.hh"
 #include "exception.hh"
 #include "filesystem.hh"
+#include "poller.hh"
+#include "inotify.hh"
 #include "file_message.hh"
 
 using namespace std;
 
+/* wait this long before reconnecting to a receiver that has gone */
+static constexpr auto reconnect_delay = chrono::seconds(1);
+
 void print_usage(const string & program_name)
 {
   cerr <<
-  "Usage: " << program_name << " SRC-PATH HOST PORT DST-DIR\n\n"
-  "Transfer the file at SRC-PATH to DST-DIR on HOST:PORT"
+  "Usage: " << program_name << " SRC-PATH HOST PORT DST-DIR\n"
+  "       " << program_name << " --watch HOST PORT SRC-DIR DST-DIR "
+  "[SRC-DIR DST-DIR ...]\n"
+  "       " << program_name << " --stdin HOST PORT\n\n"
+  "Transfer the file at SRC-PATH to DST-DIR on HOST:PORT\n\n"
+  "A segment <ts>.pack is transferred once it has been rolled, i.e., when\n"
+  "the segment after it appears at SRC-PATH\n\n"
+  "--watch  rather than being run for each file, keep running and transfer\n"
+  "         the files moved into each SRC-DIR to its DST-DIR, all over a\n"
+  "         single connection\n"
+  "--stdin  keep running and transfer the files listed on stdin, one\n"
+  "         \"SRC-PATH<tab>DST-PATH\" per line; used by file_receiver\n"
+  "         to relay the files it receives"
   << endl;
 }
 
-int main(int argc, char * argv[])
+/* the segment that precedes the new segment at pack_path, if any */
+optional<fs::path> rolled_segment(const fs::path & pack_path)
 {
-  if (argc < 1) {
-    abort();
+  const uint64_t ts = stoull(pack_path.stem());
+
+  optional<fs::path> rolled;
+  optional<uint64_t> rolled_ts;
+
+  for (const auto & entry : fs::directory_iterator(pack_path.parent_path())) {
+    const auto & file = entry.path();
+    if (file.extension() != ".pack") {
+      continue;
+    }
+
+    const uint64_t file_ts = stoull(file.stem());
+    if (file_ts < ts and (not rolled_ts or file_ts > *rolled_ts)) {
+      rolled = file;
+      rolled_ts = file_ts;
+    }
   }
 
-  if (argc != 5) {
+  return rolled;
+}
+
+/* the file to transfer for a file that has appeared at src_path, if any */
+optional<fs::path> file_to_send(const fs::path & src_path)
+{
+  /* a new segment is still being appended to, but the one before is not */
+  if (src_path.extension() == ".pack") {
+    return rolled_segment(src_path);
+  }
+
+  return src_path;
+}
+
+/* Sends files to a file_receiver over a single connection that is kept
+ * open, each file as a FileMsg followed by its contents. The files are sent
+ * back to back without waiting on the receiver, and with sendfile(2) so
+ * that they are not copied through user space. The connection is handed
+ * back to a ConnectionPool between files, which checks that the receiver
+ * has not closed it (e.g., on a restart) before the next file is sent over
+ * it. If reconnect, a file cut short by a lost connection is sent again
+ * over a new one. */
+class FileSender
+{
+public:
+  FileSender(const Address & address, const bool reconnect)
+    : address_(address), reconnect_(reconnect) {}
+
+  /* queue a file to send with the next send_queued() */
+  void enqueue(const fs::path & src_path, const fs::path & dst_path)
+  {
+    queue_.emplace_back(src_path, dst_path);
+  }
+
+  void send_queued()
+  {
+    while (not queue_.empty()) {
+      const auto & [src_path, dst_path] = queue_.front();
+
+      try {
+        send(src_path, dst_path);
+      } catch (const exception & e) {
+        /* e.g., the file has been cleaned before it could be sent */
+        cerr << "Warning: " << e.what() << endl;
+      }
+
+      queue_.pop_front();
+    }
+  }
+
+  void send(const fs::path & src_path, const fs::path & dst_path)
+  {
+    FileDescriptor fd(CheckSystemCall("open (" + src_path.string() + ")",
+                      open(src_path.c_str(), O_RDONLY | O_CLOEXEC)));
+
+    /* wait for a late append to the segment to complete */
+    if (src_path.extension() == ".pack") {
+      fd.acquire_shared_flock();
+    }
+
+    const uint64_t file_size = fd.filesize();
+    const string metadata = FileMsg(
+      narrow_cast<uint16_t>(dst_path.string().size()), dst_path,
+      file_size).to_string();
+
+    bool truncated = false;
+
+    for (;;) {
+      try {
+        TCPSocket socket = connect();
+        socket.write(metadata);
+
+        off_t offset = 0;
+        while (static_cast<uint64_t>(offset) < file_size) {
+          if (CheckSystemCall("sendfile", sendfile(socket.fd_num(),
+                fd.fd_num(), &offset, file_size - offset)) == 0) {
+            truncated = true;
+            break;
+          }
+        }
+
+        /* the receiver expects file_size bytes: a file cut short leaves
+         * the connection out of step, so it is not reused */
+        if (not truncated) {
+          pool_.put(address_, move(socket));
+        }
+
+        break;
+      } catch (const exception & e) {
+        if (not reconnect_) {
+          throw;
+        }
+
+        cerr << "Error sending " << src_path << ": " << e.what() << endl;
+        this_thread::sleep_for(reconnect_delay);
+      }
+    }
+
+    /* the receiver expects file_size bytes, which are no longer there */
+    if (truncated) {
+      throw runtime_error(src_path.string() + " was truncated while sent");
+    }
+
+    cerr << "Delivered file " << src_path << endl;
+  }
+
+private:
+  Address address_;
+  bool reconnect_;
+  ConnectionPool<TCPSocket> pool_ {};
+
+  deque<pair<fs::path, fs::path>> queue_ {};
+
+  /* the connection to the receiver, reused if it is still open */
+  TCPSocket connect()
+  {
+    const uint64_t num_connected = pool_.num_connected();
+    TCPSocket socket = pool_.get(address_);
+
+    if (pool_.num_connected() != num_connected) {
+      cerr << "Connected to " << socket.peer_address().str() << endl;
+    }
+
+    return socket;
+  }
+};
+
+int watch(int argc, char * argv[])
+{
+  if (argc < 6 or argc % 2 != 0) {
     print_usage(argv[0]);
     return EXIT_FAILURE;
   }
 
-  string src_path = argv[1];
-  string dst_ip = argv[2];
-  uint16_t dst_port = narrow_cast<uint16_t>(stoi(argv[3]));
-  string dst_dir = argv[4];
+  FileSender sender({argv[2], narrow_cast<uint16_t>(stoi(argv[3]))}, true);
+
+  Poller poller;
+  Inotify inotify(poller);
+
+  /* the files moved in by a batch of events are sent after the batch */
+  auto enqueue = [&sender](const fs::path & path, const fs::path & dst_dir) {
+    const auto src_path = file_to_send(path);
+    if (src_path) {
+      sender.enqueue(*src_path, dst_dir / src_path->filename());
+    }
+  };
+
+  for (int i = 4; i < argc; i += 2) {
+    const fs::path src_dir = argv[i];
+    const fs::path dst_dir = argv[i + 1];
 
-  TCPSocket socket;
-  socket.connect({dst_ip, dst_port});
-  cerr << "Connected to " << socket.peer_address().str() << endl;
+    /* watch before listing so that no file is missed in between */
+    inotify.add_watch(src_dir, IN_MOVED_TO,
+      [&enqueue, src_dir, dst_dir](const inotify_event & event,
+                                   const string &) {
+        if (not (event.mask & IN_MOVED_TO) or (event.mask & IN_ISDIR)) {
+          return;
+        }
 
-  /* send dst_path first */
-  string dst_path = fs::path(dst_dir) / fs::path(src_path).filename();
-  FileMsg metadata(dst_path.size(), dst_path);
-  socket.write(metadata.to_string());
+        enqueue(src_dir / event.name, dst_dir);
+      }
+    );
+
+    for (const auto & entry : fs::directory_iterator(src_dir)) {
+      if (fs::is_regular_file(entry.status())) {
+        enqueue(entry.path(), dst_dir);
+      }
+    }
+  }
+
+  inotify.add_batch_callback([&sender]() { sender.send_queued(); });
+  sender.send_queued();
 
-  FileDescriptor fd(CheckSystemCall("open (" + src_path + ")",
-                    open(src_path.c_str(), O_RDONLY)));
-  /* send the file at src_path */
   for (;;) {
-    const string data = fd.read();
+    auto ret = poller.poll(-1);
+    if (ret.result != Poller::Result::Type::Success) {
+      return ret.exit_status;
+    }
+  }
+}
+
+int relay(int argc, char * argv[])
+{
+  if (argc != 4) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  FileSender sender({argv[2], narrow_cast<uint16_t>(stoi(argv[3]))}, true);
+
+  FileDescriptor input(STDIN_FILENO);
+  string buffer;
+
+  for (;;) {
+    const string data = input.read();
     if (data.empty()) {  // EOF
-      break;
+      return EXIT_SUCCESS;
     }
 
-    socket.write(data);
+    buffer.append(data);
+
+    /* send the files of all the complete lines read */
+    size_t line_start = 0;
+    for (size_t line_end = buffer.find('\n');
+         line_end != string::npos;
+         line_end = buffer.find('\n', line_start)) {
+      const string line = buffer.substr(line_start, line_end - line_start);
+      line_start = line_end + 1;
+
+      const size_t tab = line.find('\t');
+      if (tab == string::npos) {
+        cerr << "Warning: invalid line: " << line << endl;
+        continue;
+      }
+
+      sender.enqueue(line.substr(0, tab), line.substr(tab + 1));
+    }
+
+    buffer.erase(0, line_start);
+    sender.send_queued();
+  }
+}
+
+int main(int argc, char * argv[])
+{
+  if (argc < 1) {
+    abort();
+  }
+
+  /* a lost connection is reported by the failing write instead */
+  if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+    throw runtime_error("signal: failed to ignore SIGPIPE");
   }
 
-  fd.close();
+  if (argc > 1 and string(argv[1]) == "--watch") {
+    return watch(argc, argv);
+  } else if (argc > 1 and string(argv[1]) == "--stdin") {
+    return relay(argc, argv);
+  }
+
+  if (argc != 5) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  const fs::path path = argv[1];
+  string dst_ip = argv[2];
+  uint16_t dst_port = narrow_cast<uint16_t>(stoi(argv[3]));
+  string dst_dir = argv[4];
+
+  const auto src_path = file_to_send(path);
+  if (not src_path) {
+    return EXIT_SUCCESS;
+  }
 
-  cerr << "Delivered file " << src_path << endl;
+  FileSender sender({dst_ip, dst_port}, false);
+  sender.send(*src_path, fs::path(dst_dir) / src_path->filename());
 
   return EXIT_SUCCESS;
 }
@@ -1,142 +1,503 @@
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <cstdint>
+#include <cstring>
+#include <csignal>
 #include <deque>
+#include <vector>
+#include <map>
+#include <memory>
+#include <optional>
+#include <functional>
 
 #include "strict_conversions.hh"
 #include "socket.hh"
 #include "poller.hh"
+#include "timestamp.hh"
+#include "tokenize.hh"
 
 using namespace std;
 using namespace PollerShortNames;
 
 static const int MAX_BUFFER_BYTES = 128 * 1000 * 1000;  /* 128 MB */
 
+/* receive up to this many datagrams with each recvmmsg */
+static const unsigned int RECV_BATCH_SIZE = 64;
+static const size_t MAX_DATAGRAM_SIZE = 65536;
+
+/* room for a few seconds of a ~20 Mbps transport stream in the kernel,
+ * unless net.core.rmem_max is lower and udp_to_tcp is not privileged */
+static const int UDP_RECEIVE_BUFFER = 16 * 1024 * 1024;
+
+/* report the datagrams received, forwarded and dropped this often */
+static const uint64_t STATS_INTERVAL_MS = 60 * 1000;
+
+/* how long a new TCP client has to send a request before it is sent the
+ * stream as is, from when it connected */
+static const uint64_t REQUEST_WAIT_MS = 100;
+
 void print_usage(const string & program_name)
 {
   cerr <<
-  "Usage: " << program_name << " UDP-PORT TCP-PORT\n\n"
-  "Listen on the TCP port and accept the first connection only. Then start\n"
-  "forwarding datagrams from the UDP port to the connected TCP socket"
+  "Usage: " << program_name << " [--buffer BYTES] [--receive-buffer BYTES] "
+  "UDP-PORT TCP-PORT [UDP-PORT TCP-PORT ...]\n\n"
+  "Forward the datagrams from each UDP port to every client connected to\n"
+  "its TCP port, keeping the last BYTES (default: " << MAX_BUFFER_BYTES
+  << ") of each\nstream so that a client that reconnects resumes where it "
+  "left off.\n\n"
+  "A client that sends nothing gets the stream from when udp_to_tcp accepted\n"
+  "its connection, i.e., not the datagrams kept from before. A client may\n"
+  "instead send, right after connecting, one of\n"
+  "  \"subscribe\\n\"                 the stream from when it was accepted\n"
+  "  \"resume <epoch> <offset>\\n\"   the stream from offset\n"
+  "and is then sent \"offset <epoch> <offset>\\n\" ahead of the stream, with\n"
+  "the offset in the stream of its first byte; if resuming, the offset is\n"
+  "later than asked for if the bytes in between are no longer kept, and\n"
+  "the stream is sent from now on if the epoch is not that of this process.\n\n"
+  "--receive-buffer sets the size of the kernel's receive buffer of each\n"
+  "UDP socket (default: up to " << UDP_RECEIVE_BUFFER << "), with a warning "
+  "if it is limited\nto less by net.core.rmem_max"
   << endl;
 }
 
-void accept_one_client(TCPSocket & listening_socket, const uint16_t udp_port)
+/* The last bytes of a stream of datagrams, in a ring allocated once; each
+ * byte is known by its offset in the stream. When the ring is full, the
+ * oldest datagrams are evicted whole. */
+class DatagramRing
 {
-  Poller poller;
+public:
+  /* called with the offsets [start, end) of each datagram evicted */
+  using evict_callback_t = function<void(const uint64_t, const uint64_t)>;
+
+  DatagramRing(const size_t capacity)
+    : capacity_(capacity), ring_(new char[capacity])
+  {}
+
+  uint64_t begin() const { return begin_; }
+  uint64_t end() const { return end_; }
+
+  /* append a datagram, evicting the oldest ones to make room for it;
+   * return false if the datagram cannot fit at all */
+  bool push(const string_view datagram, const evict_callback_t & evict)
+  {
+    if (datagram.size() > capacity_) {
+      return false;
+    }
 
-  /* create a UDP socket */
-  UDPSocket udp_socket;
-  udp_socket.bind(Address("0", udp_port));
-  udp_socket.set_blocking(false);
+    while (capacity_ - (end_ - begin_) < datagram.size()) {
+      starts_.pop_front();
+      const uint64_t next = starts_.empty() ? end_ : starts_.front();
+      evict(begin_, next);
+      begin_ = next;
+    }
 
-  /* wait for the first connection blockingly */
-  TCPSocket client = listening_socket.accept();
-  client.set_blocking(false);
+    /* the free space might wrap around the end of the ring */
+    const size_t tail = end_ % capacity_;
+    const size_t first = min(datagram.size(), capacity_ - tail);
+    memcpy(ring_.get() + tail, datagram.data(), first);
+    memcpy(ring_.get(), datagram.data() + first, datagram.size() - first);
 
-  cerr << "Start forwarding datagrams from UDP "
-       << udp_socket.local_address().str() << " to TCP "
-       << client.peer_address().str() << endl;
+    starts_.emplace_back(end_);
+    end_ += datagram.size();
+    return true;
+  }
 
-  /* start forwarding */
-  deque<string> buffer;
-  uint64_t buffer_size = 0;
-  size_t buffer_offset = 0;
+  /* the bytes from offset (between begin() and end()) to end() */
+  vector<string_view> from(const uint64_t offset) const
+  {
+    const size_t start = offset % capacity_;
+    const size_t size = end_ - offset;
+    const size_t first = min(size, capacity_ - start);
 
-  /* read datagrams from UDP socket into the buffer */
-  poller.add_action(Poller::Action(udp_socket, Direction::In,
-    [&udp_socket, &buffer, &buffer_size, &buffer_offset]() {
-      string data = udp_socket.read();
+    return { { ring_.get() + start, first }, { ring_.get(), size - first } };
+  }
 
-      if (data.empty()) {
-        cerr << "Received empty data from UDP socket" << endl;
-        return ResultType::Exit;
+  /* a copy of the bytes [start, end) */
+  string copy(const uint64_t start, const uint64_t end) const
+  {
+    string ret;
+    for (const auto & view : from(start)) {
+      ret.append(view.substr(0, end - start - ret.size()));
+    }
+    return ret;
+  }
+
+  /* forbid copying */
+  DatagramRing(const DatagramRing & other) = delete;
+  DatagramRing & operator=(const DatagramRing & other) = delete;
+
+private:
+  size_t capacity_;
+  unique_ptr<char[]> ring_;  /* not initialized, so not paged in up front */
+
+  uint64_t begin_ {0};  /* offset of the oldest byte kept */
+  uint64_t end_ {0};  /* offset of the byte after the newest */
+  deque<uint64_t> starts_ {};  /* offsets of the datagrams kept */
+};
+
+/* the buffers of a recvmmsg of up to RECV_BATCH_SIZE datagrams, each with
+ * room for an SO_RXQ_OVFL control message */
+class RecvBatch
+{
+public:
+  RecvBatch()
+  {
+    for (unsigned int i = 0; i < RECV_BATCH_SIZE; i++) {
+      iov_[i] = { &data_[i * MAX_DATAGRAM_SIZE], MAX_DATAGRAM_SIZE };
+    }
+  }
+
+  /* receive the datagrams waiting on socket, up to RECV_BATCH_SIZE */
+  unsigned int receive(UDPSocket & socket)
+  {
+    for (unsigned int i = 0; i < RECV_BATCH_SIZE; i++) {
+      msgs_[i] = {};
+      msgs_[i].msg_hdr.msg_iov = &iov_[i];
+      msgs_[i].msg_hdr.msg_iovlen = 1;
+      msgs_[i].msg_hdr.msg_control = &control_[i * CONTROL_SIZE];
+      msgs_[i].msg_hdr.msg_controllen = CONTROL_SIZE;
+    }
+
+    return socket.recvmmsg(msgs_);
+  }
+
+  string_view datagram(const unsigned int i) const
+  {
+    return { &data_[i * MAX_DATAGRAM_SIZE], msgs_[i].msg_len };
+  }
+
+  /* the number of datagrams the kernel has dropped so far, if reported
+   * with the i-th datagram */
+  optional<uint32_t> kernel_drops(const unsigned int i)
+  {
+    msghdr & hdr = msgs_[i].msg_hdr;
+    for (cmsghdr * cmsg = CMSG_FIRSTHDR(&hdr); cmsg != nullptr;
+         cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+      if (cmsg->cmsg_level == SOL_SOCKET and cmsg->cmsg_type == SO_RXQ_OVFL) {
+        uint32_t drops;
+        memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+        return drops;
       }
+    }
 
-      buffer_size += data.size();
+    return nullopt;
+  }
 
-      buffer.emplace_back(move(data));
+private:
+  static constexpr size_t CONTROL_SIZE = CMSG_SPACE(sizeof(uint32_t));
 
-      /* keep dropping old data until the buffer_size is within limit */
-      while (buffer_size >= MAX_BUFFER_BYTES) {
-        const string & old_data = buffer.front();
+  vector<char> data_ = vector<char>(RECV_BATCH_SIZE * MAX_DATAGRAM_SIZE);
+  vector<iovec> iov_ = vector<iovec>(RECV_BATCH_SIZE);
+  vector<mmsghdr> msgs_ = vector<mmsghdr>(RECV_BATCH_SIZE);
+  vector<char> control_ = vector<char>(RECV_BATCH_SIZE * CONTROL_SIZE);
+};
 
-        /* update buffer_size with buffer_offset taken into account */
-        auto size_to_drop = old_data.size() - buffer_offset;
-        buffer_size -= size_to_drop;
+/* what has happened to the datagrams of a stream since udp_to_tcp started */
+struct Stats
+{
+  uint64_t received_datagrams {0};
+  uint64_t received_bytes {0};
+  uint64_t forwarded_bytes {0};
+  uint32_t kernel_drops {0};  /* for lack of room in the receive buffer */
+  uint64_t client_drops {0};  /* evicted before sent to a client */
+  uint64_t last_report_ms {timestamp_ms()};
+
+  void report(const uint16_t udp_port)
+  {
+    cerr << "UDP port " << udp_port << ": received " << received_datagrams
+         << " datagrams (" << received_bytes << " bytes), forwarded "
+         << forwarded_bytes << " bytes; dropped " << kernel_drops
+         << " datagrams in the kernel and " << client_drops
+         << " datagrams evicted before sent to a client" << endl;
+
+    last_report_ms = timestamp_ms();
+  }
+};
+
+/* A stream of datagrams from a UDP port, forwarded to all the clients that
+ * connect to a TCP port. Each client is sent the stream from an offset of
+ * its own, so a slow client holds back no other; a client that falls
+ * behind by more than the ring loses the datagrams evicted in the
+ * meantime, but never part of one, so that what it is sent stays aligned
+ * to datagrams (e.g., to the TS packets in them). */
+class Stream
+{
+public:
+  Stream(Poller & poller, RecvBatch & batch, const uint64_t epoch,
+         const uint16_t udp_port, const uint16_t tcp_port,
+         const size_t buffer_bytes, const optional<int> & receive_buffer)
+    : poller_(poller), batch_(batch), epoch_(epoch), udp_port_(udp_port),
+      ring_(buffer_bytes)
+  {
+    udp_socket_.bind(Address("0", udp_port));
+    udp_socket_.set_blocking(false);
+    udp_socket_.set_drop_counts();
+    const int requested = receive_buffer.value_or(UDP_RECEIVE_BUFFER);
+    const int actual = udp_socket_.set_receive_buffer(requested);
+
+    /* the kernel reports twice the size, for its bookkeeping; the default
+     * size is only attempted, so it is not worth a warning */
+    if (receive_buffer and actual / 2 < requested) {
+      cerr << "Warning: UDP receive buffer is limited to " << actual / 2
+           << " bytes; raise net.core.rmem_max" << endl;
+    }
 
-        /* drop the first item */
-        buffer_offset = 0;
-        buffer.pop_front();
+    listening_socket_.set_reuseaddr();
+    listening_socket_.bind(Address("0", tcp_port));
+    listening_socket_.listen();
+    cerr << "Listening on TCP " << listening_socket_.local_address().str()
+         << endl;
 
-        cerr << "Warning: dropped old data " << size_to_drop << endl;
+    poller_.add_action(Poller::Action(udp_socket_, Direction::In,
+      [this]() {
+        receive();
+        return ResultType::Continue;
       }
+    ).named("udp_to_tcp_udp"));
 
-      return ResultType::Continue;
-    }
-  ));
-
-  /* write datagrams to TCP client socket from the buffer */
-  poller.add_action(Poller::Action(client, Direction::Out,
-    [&client, &buffer, &buffer_size, &buffer_offset]() {
-      while (not buffer.empty()) {
-        const string & data = buffer.front();
-        /* convert to string_view to avoid copy */
-        string_view data_view = data;
-
-        /* set write_all to false because socket might be unable to write all */
-        const auto view_it = client.write(
-            data_view.substr(buffer_offset), false);
-
-        if (view_it != data_view.cend()) {
-          /* update buffer_size */
-          auto new_offset = view_it - data_view.cbegin();
-          buffer_size -= new_offset - buffer_offset;
-
-          /* save the offset of the remaining string */
-          buffer_offset = new_offset;
-          break;
-        } else {
-          /* update buffer_size with buffer_offset taken into account */
-          buffer_size -= data.size() - buffer_offset;
-
-          /* move onto the next item in the deque */
-          buffer_offset = 0;
-          buffer.pop_front();
-        }
+    poller_.add_action(Poller::Action(listening_socket_, Direction::In,
+      [this]() {
+        accept();
+        return ResultType::Continue;
+      }
+    ).named("udp_to_tcp_accept"));
+  }
+
+  /* start sending the stream to the clients that have not sent a request
+   * in time; return how long until the next one would be, if any */
+  optional<uint64_t> start_waiting_clients()
+  {
+    const uint64_t now = timestamp_ms();
+    optional<uint64_t> next_wait_ms;
+
+    for (auto & [id, client] : clients_) {
+      if (client.streaming) {
+        continue;
       }
 
-      return ResultType::Continue;
-    },
-    /* interested only when buffer is not empty */
-    [&buffer]() {
-      return not buffer.empty();
+      if (now >= client.connected_ms + REQUEST_WAIT_MS) {
+        client.streaming = true;
+      } else {
+        const uint64_t wait_ms = client.connected_ms + REQUEST_WAIT_MS - now;
+        next_wait_ms = min(next_wait_ms.value_or(wait_ms), wait_ms);
+      }
     }
-  ));
 
-  /* check if TCP client socket has closed */
-  poller.add_action(Poller::Action(client, Direction::In,
-    [&client]() {
-      const string data = client.read();
+    return next_wait_ms;
+  }
+
+  /* forbid copying and moving, as the actions refer to this */
+  Stream(const Stream & other) = delete;
+  Stream & operator=(const Stream & other) = delete;
 
+private:
+  struct Client
+  {
+    TCPSocket socket;
+    uint64_t connected_ms {timestamp_ms()};
+    bool streaming {false};  /* false while waiting for a request */
+    string request {};
+
+    uint64_t offset;  /* of the next byte of the stream to send */
+
+    /* to send before the bytes from offset: the reply to the request and
+     * the rest of a datagram evicted while partially sent */
+    string pending {};
+
+    Client(TCPSocket && s_socket, const uint64_t s_offset)
+      : socket(move(s_socket)), offset(s_offset)
+    {}
+  };
+
+  Poller & poller_;
+  RecvBatch & batch_;
+  uint64_t epoch_;
+  uint16_t udp_port_;
+
+  UDPSocket udp_socket_ {};
+  TCPSocket listening_socket_ {};
+  DatagramRing ring_;
+
+  map<uint64_t, Client> clients_ {};
+  uint64_t next_client_id_ {0};
+
+  Stats stats_ {};
+
+  /* read a batch of datagrams from the UDP socket into the ring */
+  void receive()
+  {
+    const unsigned int num_datagrams = batch_.receive(udp_socket_);
+
+    for (unsigned int i = 0; i < num_datagrams; i++) {
+      const string_view data = batch_.datagram(i);
       if (data.empty()) {
-        cerr << "Error: TCP client has closed the connection" << endl;
-        return ResultType::Exit;
+        cerr << "Warning: ignoring empty datagram" << endl;
+        continue;
+      }
+
+      stats_.received_datagrams++;
+      stats_.received_bytes += data.size();
+
+      const auto kernel_drops = batch_.kernel_drops(i);
+      if (kernel_drops) {
+        stats_.kernel_drops = *kernel_drops;
+      }
+
+      const bool pushed = ring_.push(data,
+        [this](const uint64_t start, const uint64_t end) {
+          evict(start, end);
+        }
+      );
+
+      if (not pushed) {
+        stats_.client_drops++;
+      }
+    }
+
+    if (timestamp_ms() - stats_.last_report_ms >= STATS_INTERVAL_MS) {
+      stats_.report(udp_port_);
+    }
+  }
+
+  /* move the clients yet to be sent the datagram [start, end) past it */
+  void evict(const uint64_t start, const uint64_t end)
+  {
+    for (auto & [id, client] : clients_) {
+      if (client.offset < start or client.offset >= end) {
+        continue;
+      }
+
+      if (client.offset > start) {
+        client.pending.append(ring_.copy(client.offset, end));
       } else {
-        cerr << "Warning: ignoring data received from TCP client" << endl;
+        stats_.client_drops++;
       }
 
-      return ResultType::Continue;
+      client.offset = end;
     }
-  ));
+  }
 
-  for (;;) {
-    auto ret = poller.poll(-1);
-    if (ret.result != Poller::Result::Type::Success) {
-      return;
+  /* a new client starts at the end of the ring rather than at the oldest
+   * datagram kept, which a plain decoder would take for a jump back in the
+   * stream; a client that wants what it missed resumes from an offset */
+  void accept()
+  {
+    const uint64_t client_id = next_client_id_++;
+    auto [it, inserted] = clients_.emplace(piecewise_construct,
+      forward_as_tuple(client_id),
+      forward_as_tuple(listening_socket_.accept(), ring_.end()));
+    Client & client = it->second;
+    client.socket.set_blocking(false);
+
+    cerr << "Start forwarding datagrams from UDP "
+         << udp_socket_.local_address().str() << " to TCP "
+         << client.socket.peer_address().str() << endl;
+
+    /* write the stream to the client with a single writev, however it
+     * wraps around the ring */
+    poller_.add_action(Poller::Action(client.socket, Direction::Out,
+      [this, client_id, &client]() {
+        vector<string_view> data = ring_.from(client.offset);
+        data.insert(data.begin(), client.pending);
+
+        size_t bytes_written;
+        try {
+          bytes_written = client.socket.writev(data);
+        } catch (const exception & e) {
+          cerr << "Error: TCP client has gone: " << e.what() << endl;
+          clients_.erase(client_id);
+          return ResultType::CancelAll;
+        }
+
+        stats_.forwarded_bytes += bytes_written;
+
+        const size_t from_pending = min(bytes_written, client.pending.size());
+        client.pending.erase(0, from_pending);
+        client.offset += bytes_written - from_pending;
+
+        return ResultType::Continue;
+      },
+      /* interested only when there is something to send */
+      [this, &client]() {
+        return client.streaming and
+               (not client.pending.empty() or client.offset < ring_.end());
+      }
+    ).named("udp_to_tcp_client"));
+
+    /* read a request, and check if TCP client socket has closed */
+    poller_.add_action(Poller::Action(client.socket, Direction::In,
+      [this, client_id, &client]() {
+        string data;
+        try {
+          data = client.socket.read();
+        } catch (const exception & e) {
+          cerr << "Warning: " << e.what() << endl;
+        }
+
+        if (data.empty()) {
+          cerr << "Error: TCP client has closed the connection" << endl;
+          clients_.erase(client_id);
+          return ResultType::CancelAll;
+        }
+
+        if (client.streaming) {
+          cerr << "Warning: ignoring data received from TCP client" << endl;
+          return ResultType::Continue;
+        }
+
+        client.request.append(data);
+        const size_t line_end = client.request.find('\n');
+        if (line_end == string::npos) {
+          return ResultType::Continue;
+        }
+
+        if (not handle_request(client,
+                               client.request.substr(0, line_end))) {
+          cerr << "Error: invalid request from TCP client" << endl;
+          clients_.erase(client_id);
+          return ResultType::CancelAll;
+        }
+
+        return ResultType::Continue;
+      }
+    ).named("udp_to_tcp_client"));
+  }
+
+  /* start streaming to client as requested; return false if invalid */
+  bool handle_request(Client & client, const string & request)
+  {
+    const vector<string> tokens = split(request, " ");
+
+    if (tokens.size() == 3 and tokens[0] == "resume") {
+      const uint64_t epoch = stoull(tokens[1]);
+      const uint64_t offset = stoull(tokens[2]);
+
+      if (epoch != epoch_ or offset > ring_.end()) {
+        /* resuming a stream of another udp_to_tcp; start from now on */
+        client.offset = ring_.end();
+      } else {
+        client.offset = max(offset, ring_.begin());
+      }
+
+      if (client.offset != offset) {
+        cerr << "Warning: TCP client resumes from " << client.offset
+             << " rather than " << offset << endl;
+      }
+    } else if (not (tokens.size() == 1 and tokens[0] == "subscribe")) {
+      return false;
     }
+
+    client.pending = "offset " + to_string(epoch_) + " "
+                     + to_string(client.offset) + "\n";
+    client.streaming = true;
+    return true;
   }
-}
+};
 
 int main(int argc, char * argv[])
 {
@@ -144,24 +505,77 @@ int main(int argc, char * argv[])
     abort();
   }
 
-  if (argc != 3) {
+  size_t buffer_bytes = MAX_BUFFER_BYTES;
+  optional<int> receive_buffer;
+
+  const option cmd_line_opts[] = {
+    {"buffer",         required_argument, nullptr, 'b'},
+    {"receive-buffer", required_argument, nullptr, 'r'},
+    { nullptr,         0,                 nullptr,  0 },
+  };
+
+  while (true) {
+    const int opt = getopt_long(argc, argv, "b:r:", cmd_line_opts, nullptr);
+    if (opt == -1) {
+      break;
+    }
+
+    switch (opt) {
+    case 'b':
+      buffer_bytes = stoull(optarg);
+      break;
+    case 'r':
+      receive_buffer = stoi(optarg);
+      break;
+    default:
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (argc - optind < 2 or (argc - optind) % 2 != 0) {
     print_usage(argv[0]);
     return EXIT_FAILURE;
   }
 
-  uint16_t udp_port = narrow_cast<uint16_t>(stoi(argv[1]));
-  uint16_t tcp_port = narrow_cast<uint16_t>(stoi(argv[2]));
+  /* a client that has gone is reported by the failing write instead */
+  if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+    throw runtime_error("signal: failed to ignore SIGPIPE");
+  }
+
+  Poller poller;
+
+  /* shared by the streams, which are served by a single thread */
+  RecvBatch batch;
 
-  /* create a TCP socket */
-  TCPSocket listening_socket;
-  listening_socket.set_reuseaddr();
-  listening_socket.bind(Address("0", tcp_port));
-  listening_socket.listen();
-  cerr << "Listening on TCP " << listening_socket.local_address().str() << endl;
+  /* tells the offsets in the streams of this process from those of
+   * another, e.g., one that ran before a restart */
+  const uint64_t epoch = timestamp_ms();
+
+  vector<unique_ptr<Stream>> streams;
+  for (int i = optind; i < argc; i += 2) {
+    uint16_t udp_port = narrow_cast<uint16_t>(stoi(argv[i]));
+    uint16_t tcp_port = narrow_cast<uint16_t>(stoi(argv[i + 1]));
+
+    streams.emplace_back(make_unique<Stream>(poller, batch, epoch, udp_port,
+                                             tcp_port, buffer_bytes,
+                                             receive_buffer));
+  }
 
   for (;;) {
-    accept_one_client(listening_socket, udp_port);
-    cerr << "Error recovery: waiting to accept a new TCP connection" << endl;
+    /* wake up when a client has waited long enough for its request */
+    optional<uint64_t> timeout_ms;
+    for (auto & stream : streams) {
+      const auto wait_ms = stream->start_waiting_clients();
+      if (wait_ms) {
+        timeout_ms = min(timeout_ms.value_or(*wait_ms), *wait_ms);
+      }
+    }
+
+    auto ret = poller.poll(timeout_ms ? narrow_cast<int>(*timeout_ms) : -1);
+    if (ret.result == Poller::Result::Type::Exit) {
+      return ret.exit_status;
+    }
   }
 
   return EXIT_SUCCESS;
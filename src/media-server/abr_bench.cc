@@ -0,0 +1,406 @@
+#include <getopt.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "yaml.hh"
+#include "exception.hh"
+#include "poller.hh"
+#include "inotify.hh"
+#include "channel.hh"
+#include "ws_client.hh"
+#include "abr_worker_pool.hh"
+#include "binary_log.hh"
+#include "metrics.hh"
+#include "timestamp.hh"
+#include "tokenize.hh"
+
+using namespace std;
+
+void print_usage(const string & program_name)
+{
+  cerr <<
+  "Usage: " << program_name << " [options] <YAML configuration> "
+  "<video_sent log> <video_acked log>\n\n"
+  "Replay the network of the sessions in the logs (text or binary) through "
+  "an ABR\nalgorithm on the chunks of a static channel, and report its cost "
+  "per decision.\n\n"
+  "Options:\n"
+  "-s, --server-id <id>       run the ABR of the experiment of server <id> (default 1)\n"
+  "-a, --abr <name>           run the ABR of the first experiment that runs <name>\n"
+  "-c, --channel <name>       channel to stream (default: the first one)\n"
+  "-b, --batch <n>            simulate <n> sessions in lock step, as the clients\n"
+  "                           due at once on an event loop (default 1)\n"
+  "-n, --max-sessions <n>     simulate at most <n> sessions"
+  << endl;
+}
+
+/* the network of a session when a chunk was sent */
+struct TraceStep
+{
+  double throughput;  /* bytes per ms, from the chunk's size and ack */
+  TCPInfo tcp_info;
+};
+
+/* the lines of a log, each split into its values */
+vector<vector<string>> read_log(const string & log_path)
+{
+  ifstream ifs(log_path, ios::binary);
+  if (not ifs) {
+    throw runtime_error("cannot open " + log_path);
+  }
+
+  stringstream ss;
+  ss << ifs.rdbuf();
+  const string data = ss.str();
+
+  vector<vector<string>> lines;
+
+  /* a binary log (see binary_log.hh) starts with its header */
+  const auto header = BinaryLog::parse_header(data);
+  if (header) {
+    BinaryLogDecoder decoder(header->first);
+    decoder.decode(string_view(data).substr(header->second), lines);
+    return lines;
+  }
+
+  istringstream iss(data);
+  string line;
+  while (getline(iss, line)) {
+    if (not line.empty()) {
+      lines.emplace_back(split(line, ","));
+    }
+  }
+
+  return lines;
+}
+
+/* the sessions in the logs; key: username, first init ID and init ID */
+map<string, vector<TraceStep>> read_sessions(const string & sent_path,
+                                             const string & acked_path)
+{
+  /* columns of video_sent and video_acked (see ws_media_server.cc) */
+  static constexpr size_t TS = 0, USERNAME = 4, INIT_ID = 6, VTS = 7;
+  static constexpr size_t SENT_SIZE = 9, SENT_CWND = 11, SENT_DELIVERY_RATE = 15;
+  static constexpr size_t SENT_COLUMNS = 18, ACKED_COLUMNS = 11;
+
+  auto session_key = [](const vector<string> & values) {
+    return values[USERNAME] + "," + values[USERNAME + 1] + ","
+           + values[INIT_ID];
+  };
+
+  /* key: session and vts; value: time acked */
+  map<pair<string, string>, uint64_t> acked;
+  for (const auto & values : read_log(acked_path)) {
+    if (values.size() == ACKED_COLUMNS) {
+      acked.emplace(make_pair(session_key(values), values[VTS]),
+                    stoull(values[TS]));
+    }
+  }
+
+  map<string, vector<TraceStep>> sessions;
+  for (const auto & values : read_log(sent_path)) {
+    if (values.size() != SENT_COLUMNS) {
+      continue;
+    }
+
+    const string key = session_key(values);
+    const auto it = acked.find({key, values[VTS]});
+    if (it == acked.end()) {
+      continue;  /* the session ended before the chunk was acked */
+    }
+
+    const uint64_t sent_ts = stoull(values[TS]);
+    const uint64_t trans_time = it->second > sent_ts ?
+                                it->second - sent_ts : 1;
+
+    TCPInfo tcp_info;
+    tcp_info.cwnd = stoul(values[SENT_CWND]);
+    tcp_info.in_flight = stoul(values[SENT_CWND + 1]);
+    tcp_info.min_rtt = stoul(values[SENT_CWND + 2]);
+    tcp_info.rtt = stoul(values[SENT_CWND + 3]);
+    tcp_info.delivery_rate = stoull(values[SENT_DELIVERY_RATE]);
+
+    sessions[key].push_back(
+      { stod(values[SENT_SIZE]) / trans_time, tcp_info });
+  }
+
+  return sessions;
+}
+
+/* resident set size of this process in bytes */
+uint64_t resident_bytes()
+{
+  ifstream statm("/proc/self/statm");
+  uint64_t size, resident;
+  statm >> size >> resident;
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+/* a client playing a session on the channel */
+struct SimClient
+{
+  unique_ptr<WebSocketClient> client;
+  const vector<TraceStep> * trace;
+  size_t step {0};
+
+  double buffer_s {0};
+  double rebuffer_s {0};
+  double ssim_db_sum {0};
+};
+
+int main(int argc, char * argv[])
+{
+  if (argc < 1) {
+    abort();
+  }
+
+  unsigned int server_id = 1;
+  string abr, channel_name;
+  size_t batch_size = 1;
+  size_t max_sessions = SIZE_MAX;
+
+  const option cmd_line_opts[] = {
+    {"server-id",    required_argument, nullptr, 's'},
+    {"abr",          required_argument, nullptr, 'a'},
+    {"channel",      required_argument, nullptr, 'c'},
+    {"batch",        required_argument, nullptr, 'b'},
+    {"max-sessions", required_argument, nullptr, 'n'},
+    { nullptr,       0,                 nullptr,  0 },
+  };
+
+  while (true) {
+    const int opt = getopt_long(argc, argv, "s:a:c:b:n:", cmd_line_opts,
+                                nullptr);
+    if (opt == -1) {
+      break;
+    }
+
+    switch (opt) {
+    case 's':
+      server_id = stoul(optarg);
+      break;
+    case 'a':
+      abr = optarg;
+      break;
+    case 'c':
+      channel_name = optarg;
+      break;
+    case 'b':
+      batch_size = stoul(optarg);
+      break;
+    case 'n':
+      max_sessions = stoul(optarg);
+      break;
+    default:
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (optind != argc - 3 or batch_size == 0) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  const YAML::Node config = YAML::LoadFile(argv[optind]);
+
+  /* the ABR of the experiment of server_id (or running abr) */
+  YAML::Node fingerprint;
+  unsigned int cum_servers = 0;
+  for (const auto & node : config["experiments"]) {
+    cum_servers += node["num_servers"].as<unsigned int>();
+    if (abr.empty() ? server_id <= cum_servers
+                    : node["fingerprint"]["abr"].as<string>() == abr) {
+      fingerprint = node["fingerprint"];
+      break;
+    }
+  }
+
+  if (fingerprint.IsNull()) {
+    cerr << "Error: no experiment runs " << (abr.empty() ? "server "
+         + to_string(server_id) : abr) << endl;
+    return EXIT_FAILURE;
+  }
+
+  const string abr_name = fingerprint["abr"].as<string>();
+  YAML::Node abr_config;
+  if (fingerprint["abr_config"]) {
+    abr_config = fingerprint["abr_config"];
+  }
+
+  if (channel_name.empty()) {
+    channel_name = *load_channels(config).begin();
+  }
+
+  const auto sessions = read_sessions(argv[optind + 1], argv[optind + 2]);
+  cerr << "Read " << sessions.size() << " sessions" << endl;
+
+  /* the chunks of the channel, and the event loop of the ABR workers */
+  Poller poller;
+  Inotify inotify(poller);
+  ABRWorkerPool::set_poller(&poller);
+
+  const auto channel = make_shared<Channel>(
+    channel_name, config["media_dir"].as<string>(),
+    config["channel_configs"][channel_name], inotify);
+
+  if (channel->live() or not channel->init_vts()) {
+    cerr << "Error: channel " << channel_name << " is not a static channel "
+         << "with ready chunks" << endl;
+    return EXIT_FAILURE;
+  }
+
+  const uint64_t init_vts = *channel->init_vts();
+  const uint64_t vduration = channel->vduration();
+  const double chunk_s = static_cast<double>(vduration) / channel->timescale();
+
+  /* e.g., load the models shared by all the instances, so that they are not
+   * counted in the memory per instance */
+  {
+    WebSocketClient warmup(0, abr_name, abr_config);
+  }
+
+  Histogram decision_ns, acked_ns;
+  uint64_t total_decision_ns = 0;
+  size_t num_sessions = 0;
+  double total_play_s = 0, total_rebuffer_s = 0, total_ssim_db = 0;
+  optional<uint64_t> instance_bytes;
+
+  auto session_it = sessions.begin();
+
+  while (session_it != sessions.end() and num_sessions < max_sessions) {
+    const uint64_t rss_before = resident_bytes();
+
+    vector<SimClient> batch;
+    for (; session_it != sessions.end() and batch.size() < batch_size and
+           num_sessions < max_sessions; ++session_it, num_sessions++) {
+      auto & sim = batch.emplace_back(SimClient {
+        make_unique<WebSocketClient>(num_sessions + 1, abr_name, abr_config),
+        &session_it->second });
+
+      sim.client->init_channel(channel, init_vts, init_vts);
+    }
+
+    if (not instance_bytes) {
+      const uint64_t rss_after = resident_bytes();
+      instance_bytes = rss_after > rss_before ?
+                       (rss_after - rss_before) / batch.size() : 0;
+    }
+
+    for (;;) {
+      vector<SimClient *> due;
+
+      for (auto & sim : batch) {
+        if (sim.step < sim.trace->size() and
+            *sim.client->next_vts() <= *channel->vready_frontier()) {
+          due.push_back(&sim);
+        }
+      }
+
+      if (due.empty()) {
+        break;
+      }
+
+      /* as serve_video_in_batch() in ws_media_server.cc */
+      vector<uint64_t> elapsed_ns(due.size());
+
+      for (size_t i = 0; i < due.size(); i++) {
+        WebSocketClient & client = *due[i]->client;
+        client.set_video_playback_buf(due[i]->buffer_s);
+        client.set_cum_rebuffer(due[i]->rebuffer_s);
+        client.set_tcp_info(due[i]->trace->at(due[i]->step).tcp_info);
+
+        const uint64_t start_ns = timestamp_ns();
+        client.prepare_video_format();
+        elapsed_ns[i] += timestamp_ns() - start_ns;
+
+        /* wait for a decision made in another process */
+        while (const auto deadline = client.video_format_pending()) {
+          const uint64_t now = timestamp_ms();
+          poller.poll(*deadline > now ? *deadline - now : 1);
+        }
+      }
+
+      for (size_t i = 0; i < due.size(); i++) {
+        SimClient & sim = *due[i];
+        WebSocketClient & client = *sim.client;
+
+        const uint64_t start_ns = timestamp_ns();
+        const size_t format_idx = client.select_video_format();
+        elapsed_ns[i] += timestamp_ns() - start_ns;
+
+        decision_ns.add(elapsed_ns[i]);
+        total_decision_ns += elapsed_ns[i];
+
+        /* send the chunk at the throughput of the session at this step */
+        const uint64_t vts = *client.next_vts();
+        const VideoFormat & format = channel->vformats().at(format_idx);
+        const size_t size = channel->vsize(format_idx, vts);
+        const double ssim = channel->vssim(format_idx, vts);
+
+        const uint64_t trans_time = max<uint64_t>(
+          1, size / sim.trace->at(sim.step).throughput);
+        const double trans_s = trans_time / 1000.0;
+
+        sim.rebuffer_s += max(0.0, trans_s - sim.buffer_s);
+        sim.buffer_s = min(max(0.0, sim.buffer_s - trans_s) + chunk_s,
+                           WebSocketClient::MAX_BUFFER_S);
+        sim.ssim_db_sum += ssim_db(ssim);
+
+        const uint64_t acked_start_ns = timestamp_ns();
+        client.video_chunk_acked(format, ssim, size, trans_time);
+        acked_ns.add(timestamp_ns() - acked_start_ns);
+
+        client.set_curr_vformat(format);
+        client.set_next_vts(vts + vduration);
+        sim.step++;
+      }
+    }
+
+    for (const auto & sim : batch) {
+      total_play_s += sim.step * chunk_s;
+      total_rebuffer_s += sim.rebuffer_s;
+      total_ssim_db += sim.ssim_db_sum;
+    }
+  }
+
+  const uint64_t num_decisions = decision_ns.count();
+  if (num_decisions == 0) {
+    cerr << "Error: no decisions were made" << endl;
+    return EXIT_FAILURE;
+  }
+
+  auto quantiles_us = [](const Histogram & hist) {
+    ostringstream oss;
+    oss << fixed << setprecision(1)
+        << "p50 " << hist.quantile(0.5) / 1000.0
+        << ", p90 " << hist.quantile(0.9) / 1000.0
+        << ", p99 " << hist.quantile(0.99) / 1000.0
+        << ", max " << hist.max() / 1000.0;
+    return oss.str();
+  };
+
+  cout << fixed << setprecision(1)
+       << "abr: " << abr_name << ", channel: " << channel_name
+       << ", sessions: " << num_sessions << ", decisions: " << num_decisions
+       << ", batch: " << batch_size << "\n"
+       << "decisions/s: " << num_decisions * 1e9 / total_decision_ns << "\n"
+       << "decision latency (us): " << quantiles_us(decision_ns) << "\n"
+       << "chunk acked latency (us): " << quantiles_us(acked_ns) << "\n"
+       << "memory per instance (KiB): " << *instance_bytes / 1024.0 << "\n"
+       << setprecision(2)
+       << "mean SSIM (dB): " << total_ssim_db / num_decisions
+       << ", rebuffer: " << 100 * total_rebuffer_s / total_play_s << "%"
+       << endl;
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,109 @@
+#include "admission.hh"
+
+#include <algorithm>
+#include <optional>
+#include <stdexcept>
+
+using namespace std;
+
+unique_ptr<AdmissionController> AdmissionController::create(
+  const YAML::Node & config, const unsigned int max_connection_num,
+  const shared_ptr<LoadTable> & load_table, const unsigned int server_id)
+{
+  const string name = config["controller"] ?
+                      config["controller"].as<string>() : "cap";
+
+  if (name == "cap") {
+    return make_unique<ConnectionCap>(max_connection_num);
+  } else if (name == "load") {
+    return make_unique<LoadShedder>(config, max_connection_num,
+                                    load_table, server_id);
+  }
+
+  throw runtime_error("unknown admission controller: " + name);
+}
+
+AdmissionController::Decision ConnectionCap::admit(
+  const ServerLoad & load) const
+{
+  if (not has_headroom(load)) {
+    return {Decision::Type::Reject};
+  }
+
+  return {Decision::Type::Admit};
+}
+
+bool ConnectionCap::has_headroom(const ServerLoad & load) const
+{
+  return load.num_connections < max_connection_num_;
+}
+
+LoadShedder::LoadShedder(const YAML::Node & config,
+                         const unsigned int max_connection_num,
+                         const shared_ptr<LoadTable> & load_table,
+                         const unsigned int server_id)
+  : max_connection_num_(max_connection_num), load_table_(load_table),
+    server_id_(server_id)
+{
+  if (config["max_loop_lag_ms"]) {
+    max_loop_lag_us_ = config["max_loop_lag_ms"].as<uint64_t>() * 1000;
+  }
+
+  if (config["max_buffer_mb"]) {
+    max_buffer_bytes_ = config["max_buffer_mb"].as<uint64_t>() * 1024 * 1024;
+  }
+
+  if (config["max_cpu_util"]) {
+    max_cpu_util_ = config["max_cpu_util"].as<double>();
+  }
+
+  if (max_connection_num_ == 0 or max_loop_lag_us_ == 0 or
+      max_buffer_bytes_ == 0 or max_cpu_util_ <= 0) {
+    throw runtime_error("LoadShedder: limits must be positive");
+  }
+}
+
+double LoadShedder::utilization(const ServerLoad & load) const
+{
+  return max({
+    static_cast<double>(load.num_connections) / max_connection_num_,
+    static_cast<double>(load.loop_lag_us) / max_loop_lag_us_,
+    static_cast<double>(load.buffer_bytes) / max_buffer_bytes_,
+    load.cpu_util / max_cpu_util_
+  });
+}
+
+AdmissionController::Decision LoadShedder::admit(
+  const ServerLoad & load) const
+{
+  if (has_headroom(load)) {
+    return {Decision::Type::Admit};
+  }
+
+  if (not load_table_) {
+    return {Decision::Type::Reject};
+  }
+
+  /* redirect to the peer with the most headroom, if it has any */
+  optional<LoadTable::Peer> best_peer;
+  double best_utilization = 1;
+
+  for (const auto & peer : load_table_->peers(server_id_)) {
+    const double peer_utilization = utilization(peer.load);
+    if (peer_utilization < best_utilization) {
+      best_peer = peer;
+      best_utilization = peer_utilization;
+    }
+  }
+
+  if (not best_peer) {
+    return {Decision::Type::Reject};
+  }
+
+  return {Decision::Type::Redirect, best_peer->port};
+}
+
+bool LoadShedder::has_headroom(const ServerLoad & load) const
+{
+  return utilization(load) < 1;
+}
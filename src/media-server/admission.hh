@@ -0,0 +1,82 @@
+#ifndef ADMISSION_HH
+#define ADMISSION_HH
+
+#include <cstdint>
+#include <string>
+#include <memory>
+
+#include "yaml.hh"
+#include "load_table.hh"
+
+/* decides whether a new connection is served given the load of the server;
+ * admit() is called from all the event-loop threads */
+class AdmissionController
+{
+public:
+  struct Decision {
+    enum class Type { Admit, Reject, Redirect } type;
+    uint16_t port {0};  /* Redirect: port of the server to reconnect to */
+  };
+
+  virtual ~AdmissionController() {}
+
+  virtual Decision admit(const ServerLoad & load) const = 0;
+
+  /* whether a server with load would admit a new connection */
+  virtual bool has_headroom(const ServerLoad & load) const = 0;
+
+  /* whether admit() looks at more than the number of connections */
+  virtual bool needs_load() const { return false; }
+
+  /* "cap" (default) or "load", configured by the "admission" node of the
+   * YAML config; load_table is only used by "load" and might be null */
+  static std::unique_ptr<AdmissionController> create(
+    const YAML::Node & config, const unsigned int max_connection_num,
+    const std::shared_ptr<LoadTable> & load_table,
+    const unsigned int server_id);
+};
+
+/* admit up to a fixed number of connections */
+class ConnectionCap : public AdmissionController
+{
+public:
+  ConnectionCap(const unsigned int max_connection_num)
+    : max_connection_num_(max_connection_num)
+  {}
+
+  Decision admit(const ServerLoad & load) const override;
+  bool has_headroom(const ServerLoad & load) const override;
+
+private:
+  unsigned int max_connection_num_;
+};
+
+/* admit connections until the event loops lag, too many bytes are queued,
+ * or the CPU is busy (or the number of connections reaches the cap);
+ * an overloaded server sends new clients to the least loaded server in
+ * load_table that is not overloaded, or rejects them */
+class LoadShedder : public AdmissionController
+{
+public:
+  LoadShedder(const YAML::Node & config, const unsigned int max_connection_num,
+              const std::shared_ptr<LoadTable> & load_table,
+              const unsigned int server_id);
+
+  Decision admit(const ServerLoad & load) const override;
+  bool has_headroom(const ServerLoad & load) const override;
+  bool needs_load() const override { return true; }
+
+private:
+  unsigned int max_connection_num_;
+  uint64_t max_loop_lag_us_ {200 * 1000};
+  uint64_t max_buffer_bytes_ {1024 * 1024 * 1024};
+  double max_cpu_util_ {0.9};
+
+  std::shared_ptr<LoadTable> load_table_;
+  unsigned int server_id_;
+
+  /* the largest fraction of a limit that load uses; overloaded if >= 1 */
+  double utilization(const ServerLoad & load) const;
+};
+
+#endif /* ADMISSION_HH */
@@ -0,0 +1,192 @@
+#include "async_auth.hh"
+
+#include <iostream>
+#include <stdexcept>
+#include <unistd.h>
+
+#include "exception.hh"
+
+using namespace std;
+using namespace PollerShortNames;
+
+AsyncAuth::AsyncAuth(const string & db_conn_str, Poller & poller,
+                     ResultCallback && callback)
+  : conn_(PQconnectdb(db_conn_str.c_str())), poller_(poller),
+    callback_(move(callback))
+{
+  if (not conn_ or PQstatus(conn_.get()) != CONNECTION_OK) {
+    throw runtime_error("AsyncAuth: failed to connect to PostgreSQL: " +
+                        string(conn_ ? PQerrorMessage(conn_.get()) : ""));
+  }
+
+  cerr << "Connected to PostgreSQL at " << PQhost(conn_.get()) << endl;
+  setup();
+}
+
+void AsyncAuth::setup()
+{
+  /* check if the session_key in client-init is valid */
+  PGresult * res = PQprepare(conn_.get(), "auth",
+    "SELECT EXISTS(SELECT 1 FROM django_session WHERE "
+    "session_key = $1 AND expire_date > now());", 1, nullptr);
+  const bool prepared = (PQresultStatus(res) == PGRES_COMMAND_OK);
+  PQclear(res);
+
+  if (not prepared) {
+    throw runtime_error("AsyncAuth: failed to prepare statement: " +
+                        string(PQerrorMessage(conn_.get())));
+  }
+
+  if (PQsetnonblocking(conn_.get(), 1) != 0) {
+    throw runtime_error("AsyncAuth: failed to set nonblocking");
+  }
+
+  if (socket_) {
+    poller_.remove_fd(socket_->fd_num());
+  }
+
+  auto socket = make_shared<FileDescriptor>(
+    CheckSystemCall("dup", dup(PQsocket(conn_.get()))));
+  socket_ = socket;
+
+  /* the actions of an old socket cancel themselves */
+  poller_.add_action(Poller::Action(*socket, Direction::In,
+    [this, socket]()->Result {
+      if (socket != socket_) {
+        return ResultType::Cancel;
+      }
+
+      receive();
+      return ResultType::Continue;
+    }
+  ));
+
+  poller_.add_action(Poller::Action(*socket, Direction::Out,
+    [this, socket]()->Result {
+      if (socket != socket_) {
+        return ResultType::Cancel;
+      }
+
+      /* the query did not fit in the socket buffer at once */
+      const int ret = PQflush(conn_.get());
+      if (ret < 0) {
+        reset();
+      } else {
+        flush_pending_ = (ret == 1);
+      }
+
+      return ResultType::Continue;
+    },
+    [this, socket]() { return socket != socket_ or flush_pending_; }
+  ));
+}
+
+void AsyncAuth::submit(const uint64_t connection_id, const string & session_key)
+{
+  requests_.push_back({connection_id, session_key});
+  send_next();
+}
+
+void AsyncAuth::send_next()
+{
+  if (in_flight_ or requests_.empty()) {
+    return;
+  }
+
+  in_flight_ = move(requests_.front());
+  in_flight_valid_.reset();
+  requests_.pop_front();
+
+  const char * values[] = { in_flight_->session_key.c_str() };
+  if (not PQsendQueryPrepared(conn_.get(), "auth", 1, values,
+                              nullptr, nullptr, 0)) {
+    reset();
+    return;
+  }
+
+  const int ret = PQflush(conn_.get());
+  if (ret < 0) {
+    reset();
+    return;
+  }
+
+  flush_pending_ = (ret == 1);
+}
+
+void AsyncAuth::receive()
+{
+  if (not PQconsumeInput(conn_.get())) {
+    reset();
+    return;
+  }
+
+  if (not in_flight_) {
+    /* e.g., a notice from the server */
+    return;
+  }
+
+  /* results are complete once PQgetResult returns nullptr */
+  while (not PQisBusy(conn_.get())) {
+    PGresult * res = PQgetResult(conn_.get());
+    if (not res) {
+      const Request request = move(*in_flight_);
+      const bool valid = in_flight_valid_.value_or(false);
+      in_flight_.reset();
+
+      send_next();
+      callback_(request.connection_id, request.session_key, valid);
+      return;
+    }
+
+    /* returned record is valid containing only true or false */
+    if (PQresultStatus(res) == PGRES_TUPLES_OK and PQntuples(res) == 1 and
+        PQnfields(res) == 1) {
+      in_flight_valid_ = (string(PQgetvalue(res, 0, 0)) == "t");
+    } else {
+      cerr << "AsyncAuth: " << PQresultErrorMessage(res);
+      in_flight_valid_ = false;
+    }
+
+    PQclear(res);
+  }
+}
+
+void AsyncAuth::reset()
+{
+  cerr << "AsyncAuth: " << PQerrorMessage(conn_.get())
+       << "reconnecting to PostgreSQL" << endl;
+
+  /* send the query in flight again after reconnecting */
+  if (in_flight_) {
+    requests_.push_front(move(*in_flight_));
+    in_flight_.reset();
+  }
+  flush_pending_ = false;
+
+  PQreset(conn_.get());
+
+  bool reconnected = (PQstatus(conn_.get()) == CONNECTION_OK);
+  if (reconnected) {
+    try {
+      setup();
+    } catch (const exception & e) {
+      print_exception("AsyncAuth", e);
+      reconnected = false;
+    }
+  }
+
+  if (not reconnected) {
+    /* fail the pending requests rather than keep waiting for the database */
+    cerr << "AsyncAuth: failed to reconnect to PostgreSQL" << endl;
+
+    deque<Request> requests;
+    requests.swap(requests_);
+    for (const auto & request : requests) {
+      callback_(request.connection_id, request.session_key, false);
+    }
+
+    return;
+  }
+
+  send_next();
+}
@@ -0,0 +1,69 @@
+#ifndef ASYNC_AUTH_HH
+#define ASYNC_AUTH_HH
+
+#include <cstdint>
+#include <string>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <functional>
+#include <libpq-fe.h>
+
+#include "file_descriptor.hh"
+#include "poller.hh"
+
+/* Checks the session keys of clients against PostgreSQL with the
+ * asynchronous API of libpq: a query is sent without waiting for it, and its
+ * result is read when the socket of the database connection becomes readable
+ * in the event loop, so that a slow database does not block video delivery.
+ * (A worker thread would not do: ChildProcess refuses to fork in a
+ * multi-threaded program.) Queries run one at a time in the order submitted. */
+class AsyncAuth
+{
+public:
+  /* connection ID, session key, and whether the session key is valid */
+  using ResultCallback =
+    std::function<void(const uint64_t, const std::string &, const bool)>;
+
+  /* connect to the database, which blocks and throws on failure */
+  AsyncAuth(const std::string & db_conn_str, Poller & poller,
+            ResultCallback && callback);
+
+  /* check session_key on behalf of connection_id */
+  void submit(const uint64_t connection_id, const std::string & session_key);
+
+private:
+  struct Request {
+    uint64_t connection_id;
+    std::string session_key;
+  };
+
+  struct PGconn_deleter { void operator()(PGconn * x) const { PQfinish(x); } };
+  std::unique_ptr<PGconn, PGconn_deleter> conn_;
+
+  Poller & poller_;
+  ResultCallback callback_;
+
+  /* a duplicate of the connection's socket for the poller; replaced after
+   * the connection is reset, while the old actions still hold the old one */
+  std::shared_ptr<FileDescriptor> socket_ {nullptr};
+
+  std::deque<Request> requests_ {};
+  std::optional<Request> in_flight_ {};
+  std::optional<bool> in_flight_valid_ {};
+  bool flush_pending_ {false};
+
+  /* prepare the statement and start polling on the connection */
+  void setup();
+
+  /* send the next request if no query is in flight */
+  void send_next();
+
+  /* read the result of the query in flight */
+  void receive();
+
+  /* reconnect after an error; the query in flight is sent again */
+  void reset();
+};
+
+#endif /* ASYNC_AUTH_HH */
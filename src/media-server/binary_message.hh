@@ -0,0 +1,129 @@
+#ifndef BINARY_MESSAGE_HH
+#define BINARY_MESSAGE_HH
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <stdexcept>
+#include <endian.h>
+
+#include "chunk.hh"
+#include "serialization.hh"
+
+/* Compact binary encoding of the frequent messages, used instead of JSON
+ * if the client asks for it with "binaryVersion" in client-init (which is
+ * always JSON). Integers are big-endian, doubles are IEEE 754 big-endian,
+ * and strings are a uint8 length followed by the characters.
+ *
+ * server-video/server-audio (after the 16-bit length of the metadata):
+ *   version:u8 | type:u8 | initId:u32 | timestamp:u64 | byteOffset:u32 |
+ *   totalByteLength:u32 | [ssim:f64 (video only)] | channel:str | format:str
+ *
+ * client-info (in a binary WebSocket frame):
+ *   version:u8 | type:u8 | initId:u32 | videoBuffer:f64 | audioBuffer:f64 |
+ *   cumRebuffer:f64 | event:u8 | screenWidth:u16 | screenHeight:u16
+ *   (screen sizes are 0 if they have not changed)
+ *
+ * client-vidack/client-audack (in a binary WebSocket frame):
+ *   version:u8 | type:u8 | initId:u32 | videoBuffer:f64 | audioBuffer:f64 |
+ *   cumRebuffer:f64 | timestamp:u64 | byteOffset:u32 | byteLength:u32 |
+ *   totalByteLength:u32 | channel:str | format:str | [ssim:f64 (video only)]
+ *
+ * The version byte never collides with '{' that starts a JSON message. */
+
+enum class MsgEncoding { JSON, Binary };
+
+static constexpr uint8_t BINARY_MSG_VERSION = 1;
+
+enum class BinaryMsgType : uint8_t {
+  ServerVideo = 1,
+  ServerAudio = 2,
+  ClientInfo = 3,
+  ClientVidAck = 4,
+  ClientAudAck = 5
+};
+
+/* byte offset of initId in a serialized server message (incl. its length) */
+static constexpr size_t BINARY_INIT_ID_POS = sizeof(uint16_t) + 2;
+
+class BinaryWriter
+{
+public:
+  void put_u8(const uint8_t n) { str_.push_back(static_cast<char>(n)); }
+  void put_u16(const uint16_t n) { str_ += put_field(n); }
+  void put_u32(const uint32_t n) { str_ += put_field(n); }
+  void put_u64(const uint64_t n) { str_ += put_field(n); }
+
+  void put_double(const double d)
+  {
+    uint64_t n;
+    std::memcpy(&n, &d, sizeof(n));
+    put_u64(n);
+  }
+
+  void put_str(const std::string & s)
+  {
+    if (s.size() > UINT8_MAX) {
+      throw std::runtime_error("BinaryWriter: string longer than 255 bytes");
+    }
+
+    put_u8(static_cast<uint8_t>(s.size()));
+    str_ += s;
+  }
+
+  const std::string & str() const { return str_; }
+
+private:
+  std::string str_ {};
+};
+
+/* throws std::out_of_range if reading past the end of the message */
+class BinaryReader
+{
+public:
+  BinaryReader(const std::string & str) : chunk_(str) {}
+  BinaryReader(const std::string_view str)
+    : chunk_(reinterpret_cast<const uint8_t *>(str.data()), str.size())
+  {}
+
+  uint8_t get_u8() { return next(sizeof(uint8_t)).octet(); }
+  uint16_t get_u16() { return next(sizeof(uint16_t)).be16(); }
+  uint32_t get_u32() { return next(sizeof(uint32_t)).be32(); }
+  uint64_t get_u64() { return next(sizeof(uint64_t)).be64(); }
+
+  double get_double()
+  {
+    const uint64_t n = get_u64();
+    double d;
+    std::memcpy(&d, &n, sizeof(d));
+    return d;
+  }
+
+  std::string get_str()
+  {
+    const uint8_t len = get_u8();
+    return next(len).to_string();
+  }
+
+  /* length bytes, e.g., of a field prefixed with a longer length */
+  std::string get_bytes(const uint64_t length)
+  {
+    return next(length).to_string();
+  }
+
+  bool done() const { return offset_ >= chunk_.size(); }
+
+private:
+  Chunk chunk_;
+  uint64_t offset_ {0};
+
+  Chunk next(const uint64_t length)
+  {
+    Chunk ret = chunk_(offset_, length);
+    offset_ += length;
+    return ret;
+  }
+};
+
+#endif /* BINARY_MESSAGE_HH */
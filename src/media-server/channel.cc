@@ -1,26 +1,42 @@
 #include "channel.hh"
 
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <fstream>
+#include <sstream>
+#include <iomanip>
 #include <algorithm>
+#include <functional>
+#include <string_view>
 
 #include "file_descriptor.hh"
 #include "exception.hh"
 #include "timestamp.hh"
+#include "temp_file.hh"
+#include "abr_algo.hh"
+#include "strict_conversions.hh"
+#include "diag_log.hh"
 
 using namespace std;
 
 static const unsigned int DEFAULT_TIMESCALE = 90000;
-static const unsigned int DEFAULT_VIDEO_DURATION = 180180;  // 2.002s per chunk
-static const unsigned int DEFAULT_AUDIO_DURATION = 432000;  // 4.8s per chunk
 static const string DEFAULT_VIDEO_CODEC = "video/mp4; codecs=\"avc1.42E020\"";
 static const string DEFAULT_AUDIO_CODEC = "audio/webm; codecs=\"opus\"";
 static const unsigned int DEFAULT_PRESENT_DELAY_CHUNK = 15;  // chunks
 static const unsigned int PRESENT_CLEAN_DIFF = 150;  // chunks
 static const unsigned int MAX_UNCHANGED_LIVE_EDGE_MS = 10000;  // ms
+static const unsigned int INDEX_CHECK_INTERVAL_MS = 1000;  // ms
+static const string SNAPSHOT_HEADER = "channel-snapshot 1";
+
+/* populate: fault in all the pages of the file now rather than on first read */
+mmap_t mmap_file(const string & filepath, const bool populate = false);
 
 Channel::Channel(const string & name, const fs::path & media_dir,
-                 const YAML::Node & config, Inotify & inotify)
+                 const YAML::Node & config, Inotify & inotify,
+                 const optional<fs::path> & index_path,
+                 const optional<fs::path> & snapshot_path,
+                 const bool dormant)
 {
   live_ = config["live"].as<bool>();
   name_ = name;
@@ -30,6 +46,45 @@ Channel::Channel(const string & name, const fs::path & media_dir,
   vformats_ = channel_video_formats(config);
   aformats_ = channel_audio_formats(config);
 
+  for (const auto & vf : vformats_) {
+    vformat_strings_.emplace_back(vf.to_string());
+  }
+  for (const auto & af : aformats_) {
+    aformat_strings_.emplace_back(af.to_string());
+  }
+
+  for (size_t i = 0; i < vformats_.size(); i++) {
+    all_vformats_.emplace_back(i);
+  }
+
+  if (config["screen_pruning"] and config["screen_pruning"].as<bool>()) {
+    if (config["screen_pixel_ratio"]) {
+      screen_pixel_ratio_ = config["screen_pixel_ratio"].as<double>();
+    }
+
+    set<pair<int, int>> resolutions;
+    for (const auto & vf : vformats_) {
+      resolutions.emplace(vf.height, vf.width);
+    }
+
+    for (const auto & [height, width] : resolutions) {
+      ScreenClass screen_class {width, height, {}};
+
+      for (size_t i = 0; i < vformats_.size(); i++) {
+        if (vformats_[i].width <= width and vformats_[i].height <= height) {
+          screen_class.vformats.emplace_back(i);
+        }
+      }
+
+      screen_classes_.emplace_back(move(screen_class));
+    }
+  }
+
+  vinit_.resize(vformats_.size());
+  ainit_.resize(aformats_.size());
+  vinit_key_.resize(vformats_.size());
+  ainit_key_.resize(aformats_.size());
+
   timescale_ = config["timescale"] ?
       config["timescale"].as<unsigned int>() : DEFAULT_TIMESCALE;
   vduration_ = config["video_duration"] ?
@@ -41,12 +96,20 @@ Channel::Channel(const string & name, const fs::path & media_dir,
   acodec_ = config["audio_codec"] ?
       config["audio_codec"].as<string>() : DEFAULT_AUDIO_CODEC;
 
+  vchunks_ = ChunkIndex<VideoEntry>(vduration_, vformats_.size(), 2);
+  achunks_ = ChunkIndex<AudioEntry>(aduration_, aformats_.size());
+  vformat_tables_ = ChunkIndex<VideoFormatInfo>(vduration_, vformats_.size());
+  aformat_tables_ = ChunkIndex<AudioFormatInfo>(aduration_, aformats_.size());
+
   if (live_) {
     present_delay_chunk_ = config["present_delay_chunk"] ?
         config["present_delay_chunk"].as<unsigned int>() :
         DEFAULT_PRESENT_DELAY_CHUNK;
     clean_window_chunk_ = *present_delay_chunk_ + PRESENT_CLEAN_DIFF;
 
+    prefault_chunks_ = config["prefault_chunks"] ?
+        config["prefault_chunks"].as<bool>() : false;
+
     if (config["repeat"]) {
       throw runtime_error("repeat can't be set if live is true");
     }
@@ -56,16 +119,128 @@ Channel::Channel(const string & name, const fs::path & media_dir,
     if (config["present_delay_chunk"]) {
       throw runtime_error("present_delay_chunk can't be set if live is false");
     }
+
+    if (config["max_mapped_chunks"]) {
+      max_mapped_chunks_ = config["max_mapped_chunks"].as<size_t>();
+    }
+
+    if (config["prefetch_chunks"]) {
+      prefetch_chunks_ = config["prefetch_chunks"].as<unsigned int>();
+    }
+
+    pack_files_ = config["pack_files"] ? config["pack_files"].as<bool>()
+                                       : false;
+
+    /* a pack stays mapped as a whole */
+    if (pack_files_ and max_mapped_chunks_ > 0) {
+      throw runtime_error("max_mapped_chunks can't be set with pack_files");
+    }
+  }
+
+  if (live_ and (config["max_mapped_chunks"] or config["pack_files"])) {
+    throw runtime_error("max_mapped_chunks and pack_files can't be set "
+                        "if live is true");
+  }
+
+  if (config["segment_minutes"]) {
+    segment_span_ = config["segment_minutes"].as<uint64_t>() * 60 * timescale_;
+
+    if (pack_files_ or max_mapped_chunks_ > 0) {
+      throw runtime_error("max_mapped_chunks and pack_files can't be set "
+                          "with segment_minutes");
+    }
+
+    /* media_indexer only indexes a file per chunk */
+    if (index_path) {
+      throw runtime_error("segment_minutes can't be set with a media index");
+    }
+  }
+
+  if (config["dvr_dir"]) {
+    if (not live_) {
+      throw runtime_error("dvr_dir can't be set if live is false");
+    }
+
+    /* windowcleaner archives the chunks of a file each, and the SSIMs only
+     * if they are files too */
+    if (segment_span_ > 0 or
+        (config["ssim_log"] and config["ssim_log"].as<bool>())) {
+      throw runtime_error("dvr_dir can't be set with segment_minutes or "
+                          "ssim_log");
+    }
+
+    dvr_ = make_unique<DVRArchive>(
+      fs::path(config["dvr_dir"].as<string>()) / name,
+      channel_dvr_segment_span(config, timescale_));
+    DIAG(Info) << "Channel " << name_ << ": serve cleaned chunks in "
+               << dvr_->path();
+  }
+
+  if (live_ and index_path) {
+    index_path_ = index_path;
+    DIAG(Info) << "Channel " << name_ << ": serve chunks in the index at "
+               << *index_path_;
+
+    if (dormant) {
+      dormant_ = true;
+    } else {
+      sync_index();
+    }
+    return;
+  }
+
+  const bool ssim_log = config["ssim_log"] and config["ssim_log"].as<bool>();
+
+  /* a static channel does not change, so its index can be restored */
+  optional<vector<SnapshotStamp>> stamps;
+  bool restored = false;
+
+  /* a pack is read as fast as a snapshot */
+  if (not live_ and snapshot_path and not pack_files_ and
+      segment_span_ == 0) {
+    try {
+      stamps = snapshot_stamps(ssim_log);
+      restored = load_snapshot(*snapshot_path, *stamps);
+    } catch (const exception & e) {
+      print_exception(("Channel " + name_ + ": snapshot").c_str(), e);
+      stamps.reset();
+    }
+  }
+
+  if (not restored) {
+    if (pack_files_) {
+      read_pack_files();
+    } else {
+      mmap_video_files(inotify);
+      mmap_audio_files(inotify);
+    }
+
+    if (ssim_log) {
+      tail_ssim_log(inotify);
+    } else {
+      load_ssim_files(inotify);
+    }
+  }
+
+  commit_ready_chunks();
+
+  if (stamps and not restored) {
+    try {
+      write_snapshot(*snapshot_path, *stamps);
+    } catch (const exception & e) {
+      print_exception(("Channel " + name_ + ": snapshot").c_str(), e);
+    }
   }
 
-  mmap_video_files(inotify);
-  mmap_audio_files(inotify);
-  load_ssim_files(inotify);
+  /* on live, new files are committed once per batch of inotify events */
+  if (live_) {
+    inotify.add_batch_callback([this]() { commit_ready_chunks(); });
+  }
 
   if (not live_) {
     /* set init_vts_ to be the first ready timestamp */
     if (vready_frontier_ and aready_frontier_) {
-      uint64_t old_vts = vdata_.cbegin()->first;
+      uint64_t old_vts = vchunks_.first_ts().value();
       uint64_t old_ats = floor_ats(old_vts);
 
       /* check all the videos and audios are ready before ready frontiers */
@@ -83,8 +258,9 @@ Channel::Channel(const string & name, const fs::path & media_dir,
         old_ats += aduration_;
       }
 
-      init_vts_ = vdata_.cbegin()->first;
-      cerr << "Channel " << name_ << ": ready to stream pre-recorded video" << endl;
+      init_vts_ = vchunks_.first_ts().value();
+      DIAG(Info) << "Channel " << name_
+                 << ": ready to stream pre-recorded video";
     }
   }
 }
@@ -124,6 +300,10 @@ bool Channel::ready_to_serve() const
 
 bool Channel::vready_to_serve(const uint64_t ts) const
 {
+  if (in_dvr(true, ts)) {
+    return dvr_vformat_table(ts) != nullptr;
+  }
+
   /* do not serve chunks beyond vready_frontier_ */
   if (vready_frontier_ and ts <= *vready_frontier_ and vready(ts)) {
     return true;
@@ -134,6 +314,10 @@ bool Channel::vready_to_serve(const uint64_t ts) const
 
 bool Channel::aready_to_serve(const uint64_t ts) const
 {
+  if (in_dvr(false, ts)) {
+    return dvr_aformat_table(ts) != nullptr;
+  }
+
   /* do not serve chunks beyond aready_frontier_ */
   if (aready_frontier_ and ts <= *aready_frontier_ and aready(ts)) {
     return true;
@@ -168,304 +352,932 @@ void Channel::enforce_moving_live_edge()
 
 bool Channel::vready(const uint64_t ts) const
 {
-  auto it1 = vdata_.find(ts);
-  if (it1 == vdata_.cend() or it1->second.size() != vformats_.size()) {
-    return false;
+  /* both the chunk and SSIM of every format are present */
+  return vchunks_.complete(ts);
+}
+
+bool Channel::aready(const uint64_t ts) const
+{
+  return achunks_.complete(ts);
+}
+
+size_t Channel::vformat_index(const VideoFormat & format) const
+{
+  const auto it = find(vformats_.cbegin(), vformats_.cend(), format);
+  if (it == vformats_.cend()) {
+    throw out_of_range("Channel: unknown video format " + format.to_string());
   }
 
-  auto it2 = vssim_.find(ts);
-  if (it2 == vssim_.cend() or it2->second.size() != vformats_.size()) {
-    return false;
+  return it - vformats_.cbegin();
+}
+
+size_t Channel::aformat_index(const AudioFormat & format) const
+{
+  const auto it = find(aformats_.cbegin(), aformats_.cend(), format);
+  if (it == aformats_.cend()) {
+    throw out_of_range("Channel: unknown audio format " + format.to_string());
   }
 
-  return true;
+  return it - aformats_.cbegin();
 }
 
-bool Channel::aready(const uint64_t ts) const
+const mmap_t & Channel::vinit(const VideoFormat & format) const
 {
-  auto it = adata_.find(ts);
-  if (it == adata_.cend() or it->second.size() != aformats_.size()) {
-    return false;
+  return vinit(vformat_index(format));
+}
+
+const mmap_t & Channel::vinit(const size_t vformat_idx) const
+{
+  const auto & init = vinit_.at(vformat_idx);
+  if (not init) {
+    throw out_of_range("Channel: video init segment is absent");
   }
 
-  return true;
+  return *init;
 }
 
-mmap_t Channel::vinit(const VideoFormat & format) const
+size_t Channel::vinit_key(const VideoFormat & format) const
 {
-  return vinit_.at(format);
+  return vinit_key(vformat_index(format));
 }
 
-mmap_t Channel::vdata(const VideoFormat & format, const uint64_t ts) const
+size_t Channel::vinit_key(const size_t vformat_idx) const
 {
-  return vdata_.at(ts).at(format);
+  const auto & key = vinit_key_.at(vformat_idx);
+  if (not key) {
+    throw out_of_range("Channel: video init segment is absent");
+  }
+
+  return *key;
+}
+
+const mmap_t & Channel::vdata(const VideoFormat & format,
+                              const uint64_t ts) const
+{
+  return vdata(vformat_index(format), ts);
 }
 
-const map<VideoFormat, mmap_t> & Channel::vdata(const uint64_t ts) const
+const mmap_t & Channel::vdata(const size_t vformat_idx,
+                              const uint64_t ts) const
 {
-  return vdata_.at(ts);
+  if (in_dvr(true, ts)) {
+    return dvr_chunk(vformat_strings_.at(vformat_idx), ".m4s", ts);
+  }
+
+  const auto & entry = vchunks_.at(ts, vformat_idx);
+  map_chunk(entry, true, ts, vformat_idx);
+
+  const auto & data = entry.data;
+  if (not data) {
+    throw out_of_range("Channel: video chunk is absent");
+  }
+
+  return *data;
 }
 
 double Channel::vssim(const VideoFormat & format, const uint64_t ts) const
 {
-  return vssim_.at(ts).at(format);
+  return vssim(vformat_index(format), ts);
 }
 
-const map<VideoFormat, double> & Channel::vssim(const uint64_t ts) const
+double Channel::vssim(const size_t vformat_idx, const uint64_t ts) const
 {
-  return vssim_.at(ts);
+  if (in_dvr(true, ts)) {
+    for (const auto & info : vformat_table(ts)) {
+      if (info.format_idx == vformat_idx) {
+        return info.ssim;
+      }
+    }
+
+    throw out_of_range("Channel: SSIM is absent");
+  }
+
+  const auto & ssim = vchunks_.at(ts, vformat_idx).ssim;
+  if (not ssim) {
+    throw out_of_range("Channel: SSIM is absent");
+  }
+
+  return *ssim;
 }
 
-mmap_t Channel::ainit(const AudioFormat & format) const
+const mmap_t & Channel::ainit(const AudioFormat & format) const
 {
-  return ainit_.at(format);
+  return ainit(aformat_index(format));
 }
 
-mmap_t Channel::adata(const AudioFormat & format, const uint64_t ts) const
+const mmap_t & Channel::ainit(const size_t aformat_idx) const
 {
-  return adata_.at(ts).at(format);
+  const auto & init = ainit_.at(aformat_idx);
+  if (not init) {
+    throw out_of_range("Channel: audio init segment is absent");
+  }
+
+  return *init;
 }
 
-const map<AudioFormat, mmap_t> & Channel::adata(const uint64_t ts) const
+size_t Channel::ainit_key(const AudioFormat & format) const
 {
-  return adata_.at(ts);
+  return ainit_key(aformat_index(format));
 }
 
-mmap_t mmap_file(const string & filepath)
+size_t Channel::ainit_key(const size_t aformat_idx) const
 {
-  try {
-    FileDescriptor fd(CheckSystemCall("open (" + filepath + ")",
-                      open(filepath.c_str(), O_RDONLY)));
-    size_t size = fd.filesize();
-    shared_ptr<void> data = mmap_shared(nullptr, size, PROT_READ,
-                                        MAP_PRIVATE, fd.fd_num(), 0);
-    return {static_pointer_cast<char>(data), size};
-  } catch (const exception & e) {
-    print_exception("mmap_file", e);
-    return {nullptr, 0};
+  const auto & key = ainit_key_.at(aformat_idx);
+  if (not key) {
+    throw out_of_range("Channel: audio init segment is absent");
   }
+
+  return *key;
 }
 
-void Channel::munmap_video(const uint64_t ts)
+const mmap_t & Channel::adata(const AudioFormat & format,
+                              const uint64_t ts) const
 {
-  uint64_t clean_window_ts = (clean_window_chunk_.value() - 1) * vduration_;
-  if (ts < clean_window_ts) return;
-  uint64_t obsolete = ts - clean_window_ts;
+  return adata(aformat_index(format), ts);
+}
 
-  optional<uint64_t> cleaned_ts;
-  for (auto it = vdata_.cbegin(); it != vdata_.cend();) {
-    uint64_t ts = it->first;
-    if (ts <= obsolete) {
-      cleaned_ts = ts;
-      vssim_.erase(ts);
-      it = vdata_.erase(it);
-    } else {
-      break;
-    }
+const mmap_t & Channel::adata(const size_t aformat_idx,
+                              const uint64_t ts) const
+{
+  if (in_dvr(false, ts)) {
+    return dvr_chunk(aformat_strings_.at(aformat_idx), ".chk", ts);
   }
 
-  if (not cleaned_ts) return;
+  const auto & entry = achunks_.at(ts, aformat_idx);
+  map_chunk(entry, false, ts, aformat_idx);
 
-  if (not vclean_frontier_ or *vclean_frontier_ < *cleaned_ts) {
-    vclean_frontier_ = *cleaned_ts;
+  const auto & data = entry.data;
+  if (not data) {
+    throw out_of_range("Channel: audio chunk is absent");
   }
+
+  return *data;
 }
 
-void Channel::munmap_audio(const uint64_t ts)
+size_t Channel::vsize(const size_t vformat_idx, const uint64_t ts) const
 {
-  uint64_t clean_window_ts = (clean_window_chunk_.value() - 1) * vduration_;
-  if (ts < clean_window_ts) return;
-  uint64_t obsolete = ts - clean_window_ts;
+  if (in_dvr(true, ts)) {
+    return get<1>(dvr_chunk(vformat_strings_.at(vformat_idx), ".m4s", ts));
+  }
 
-  optional<uint64_t> cleaned_ts;
-  for (auto it = adata_.cbegin(); it != adata_.cend();) {
-    uint64_t ts = it->first;
-    if (ts <= obsolete) {
-      cleaned_ts = ts;
-      it = adata_.erase(it);
-    } else {
-      break;
-    }
+  const auto & data = vchunks_.at(ts, vformat_idx).data;
+  if (not data) {
+    throw out_of_range("Channel: video chunk is absent");
   }
 
-  if (not cleaned_ts) return;
+  return get<1>(*data);
+}
 
-  if (not aclean_frontier_ or *aclean_frontier_ < *cleaned_ts) {
-    aclean_frontier_ = *cleaned_ts;
+const vector<size_t> & Channel::vformats_for_screen(const uint16_t width,
+                                                   const uint16_t height) const
+{
+  if (width == 0 or height == 0 or width == 0xFFFF or height == 0xFFFF) {
+    return all_vformats_;
+  }
+
+  /* the formats are landscape, while the screen may be held either way */
+  const double long_side = max(width, height) * screen_pixel_ratio_;
+  const double short_side = min(width, height) * screen_pixel_ratio_;
+
+  for (const auto & screen_class : screen_classes_) {
+    if (screen_class.width >= long_side and
+        screen_class.height >= short_side) {
+      return screen_class.vformats;
+    }
   }
+
+  return all_vformats_;
 }
 
-optional<uint64_t> Channel::live_edge() const
+const vector<Channel::VideoFormatInfo> &
+Channel::vformat_table(const uint64_t ts) const
 {
-  assert(live_);
-
-  /* init files are not ready */
-  if (vinit_.size() != vformats_.size() or
-      ainit_.size() != aformats_.size()) {
-    return nullopt;
+  const auto * table = in_dvr(true, ts) ? dvr_vformat_table(ts)
+                                        : vformat_tables_.find(ts);
+  if (not table) {
+    throw out_of_range("Channel: video chunk is not ready");
   }
 
-  /* no video chunks or no audio chunks are ready */
-  if (not vready_frontier_ or not aready_frontier_) {
-    return nullopt;
+  return *table;
+}
+
+const vector<Channel::AudioFormatInfo> &
+Channel::aformat_table(const uint64_t ts) const
+{
+  const auto * table = in_dvr(false, ts) ? dvr_aformat_table(ts)
+                                         : aformat_tables_.find(ts);
+  if (not table) {
+    throw out_of_range("Channel: audio chunk is not ready");
   }
 
-  /* find the max ready video chunk, such that its corresponding ("floor_ats")
-   * audio chunk is also ready */
-  uint64_t ready_frontier = *vready_frontier_;
-  while (not aready(floor_ats(ready_frontier))) {
-    if (ready_frontier < vduration_) {
-      return nullopt;
-    }
+  return *table;
+}
 
-    ready_frontier -= vduration_;
+size_t Channel::asize(const size_t aformat_idx, const uint64_t ts) const
+{
+  if (in_dvr(false, ts)) {
+    return get<1>(dvr_chunk(aformat_strings_.at(aformat_idx), ".chk", ts));
   }
 
-  uint64_t delay_vts = (present_delay_chunk_.value() - 1) * vduration_;
-  if (ready_frontier < delay_vts) {
-    return nullopt;
+  const auto & data = achunks_.at(ts, aformat_idx).data;
+  if (not data) {
+    throw out_of_range("Channel: audio chunk is absent");
   }
 
-  return ready_frontier - delay_vts;
+  return get<1>(*data);
 }
 
-std::optional<uint64_t> Channel::vclean_frontier() const
+bool Channel::in_dvr(const bool video, const uint64_t ts) const
 {
-  assert(live_);
-  return vclean_frontier_;
+  const auto & clean_frontier = video ? vclean_frontier_ : aclean_frontier_;
+  return dvr_ and clean_frontier and ts <= *clean_frontier;
 }
 
-std::optional<uint64_t> Channel::aclean_frontier() const
+const mmap_t & Channel::dvr_chunk(const string & dir, const string & ext,
+                                  const uint64_t ts) const
 {
-  assert(live_);
-  return aclean_frontier_;
+  const mmap_t * chunk = dvr_->find(dir, ext, ts);
+  if (not chunk) {
+    throw out_of_range("Channel: archived chunk is absent");
+  }
+
+  return *chunk;
 }
 
-void Channel::update_vready_frontier(const uint64_t vts)
+/* the SSIM in an archived .ssim file */
+static double parse_ssim(const mmap_t & chunk)
 {
-  if (not vready(vts)) return;
+  const string_view contents(get<0>(chunk).get(), get<1>(chunk));
+  return strict_parse<double>(string(contents.substr(0, contents.find('\n'))));
+}
 
-  /* update vready_frontier_ */
-  if (not vready_frontier_) {
-    vready_frontier_ = vts;
-  } else {
-    /* vready_frontier_ is a contiguous range of ready video chunks */
-    if (vts == *vready_frontier_ + vduration_) {
-      vready_frontier_ = *vready_frontier_ + vduration_;
+const vector<Channel::VideoFormatInfo> *
+Channel::dvr_vformat_table(const uint64_t ts) const
+{
+  const auto it = dvr_vformat_tables_.find(ts);
+  if (it != dvr_vformat_tables_.end()) {
+    return &it->second;
+  }
 
-      while (vready(*vready_frontier_ + vduration_)) {
-        vready_frontier_ = *vready_frontier_ + vduration_;
-      }
+  if (not is_valid_vts(ts)) {
+    return nullptr;
+  }
+
+  /* as build_vformat_table(), once all of the formats have been archived */
+  vector<VideoFormatInfo> infos(vformats_.size());
+  for (size_t i = 0; i < infos.size(); i++) {
+    const auto & vf = vformat_strings_[i];
+    const mmap_t * data = dvr_->find(vf, ".m4s", ts);
+    const mmap_t * ssim_chunk = dvr_->find(vf + "-ssim", ".ssim", ts);
+    if (not data or not ssim_chunk) {
+      return nullptr;
+    }
+
+    double ssim;
+    try {
+      ssim = parse_ssim(*ssim_chunk);
+    } catch (const exception & e) {
+      print_exception(("Channel " + name_ + ": archived SSIM").c_str(), e);
+      return nullptr;
     }
+
+    infos[i] = {i, get<1>(*data), ssim, ssim_db(ssim)};
+  }
+
+  stable_sort(infos.begin(), infos.end(),
+    [](const VideoFormatInfo & a, const VideoFormatInfo & b) {
+      return a.size < b.size;
+    });
+
+  if (dvr_vformat_tables_.size() >= DVR_TABLES_KEPT) {
+    dvr_vformat_tables_.erase(dvr_vformat_tables_.begin());
   }
+
+  return &dvr_vformat_tables_.emplace(ts, move(infos)).first->second;
 }
 
-void Channel::update_aready_frontier(const uint64_t ats)
+const vector<Channel::AudioFormatInfo> *
+Channel::dvr_aformat_table(const uint64_t ts) const
 {
-  if (not aready(ats)) return;
+  const auto it = dvr_aformat_tables_.find(ts);
+  if (it != dvr_aformat_tables_.end()) {
+    return &it->second;
+  }
 
-  /* update aready_frontier_ */
-  if (not aready_frontier_) {
-    aready_frontier_ = ats;
-  } else {
-    /* aready_frontier_ is a contiguous range of ready audio chunks */
-    if (ats == *aready_frontier_ + aduration_) {
-      aready_frontier_ = *aready_frontier_ + aduration_;
+  if (not is_valid_ats(ts)) {
+    return nullptr;
+  }
 
-      while (aready(*aready_frontier_ + aduration_)) {
-        aready_frontier_ = *aready_frontier_ + aduration_;
-      }
+  vector<AudioFormatInfo> infos(aformats_.size());
+  for (size_t i = 0; i < infos.size(); i++) {
+    const mmap_t * data = dvr_->find(aformat_strings_[i], ".chk", ts);
+    if (not data) {
+      return nullptr;
     }
+
+    infos[i] = {i, get<1>(*data)};
   }
+
+  stable_sort(infos.begin(), infos.end(),
+    [](const AudioFormatInfo & a, const AudioFormatInfo & b) {
+      return a.size < b.size;
+    });
+
+  if (dvr_aformat_tables_.size() >= DVR_TABLES_KEPT) {
+    dvr_aformat_tables_.erase(dvr_aformat_tables_.begin());
+  }
+
+  return &dvr_aformat_tables_.emplace(ts, move(infos)).first->second;
 }
 
-void Channel::do_mmap_video(const fs::path & filepath, const VideoFormat & vf)
+template<class Entry>
+void Channel::map_chunk(const Entry & entry, const bool video,
+                        const uint64_t ts, const size_t format_idx) const
 {
-  const mmap_t & data_size = mmap_file(filepath);
-  string filestem = filepath.stem();
+  if (entry.unmapped) {
+    entry.data = mmap_file(video ? vchunk_path(format_idx, ts)
+                                 : achunk_path(format_idx, ts));
+    entry.unmapped = false;
+  }
 
-  if (filestem == "init") {
-    vinit_.emplace(vf, data_size);
+  if (max_mapped_chunks_ == 0) {
+    return;
+  }
+
+  if (entry.mapped_it) {
+    mapped_chunks_.splice(mapped_chunks_.begin(), mapped_chunks_,
+                          *entry.mapped_it);
   } else {
-    if (filepath.extension() == ".m4s") {
-      uint64_t ts = stoull(filestem);
-      vdata_[ts][vf] = data_size;
+    mapped_chunks_.push_front({video, ts, format_idx});
+    entry.mapped_it = mapped_chunks_.begin();
+  }
 
-      update_vready_frontier(ts);
+  /* unmap the least recently read chunks; the clients being sent one of
+   * them keep it mapped until they are done */
+  while (mapped_chunks_.size() > max_mapped_chunks_) {
+    const MappedChunk & lru = mapped_chunks_.back();
 
-      if (live_ and vready_frontier_) {
-        munmap_video(*vready_frontier_);
-      }
+    auto unmap = [](const auto & lru_entry) {
+      lru_entry.data = mmap_t {nullptr, get<1>(*lru_entry.data)};
+      lru_entry.unmapped = true;
+      lru_entry.mapped_it.reset();
+    };
+
+    if (lru.video) {
+      unmap(vchunks_.at(lru.ts, lru.format_idx));
+    } else {
+      unmap(achunks_.at(lru.ts, lru.format_idx));
     }
+
+    if (unmap_callback_) {
+      unmap_callback_(lru.video, lru.ts, lru.format_idx);
+    }
+
+    mapped_chunks_.pop_back();
   }
 }
 
-void Channel::mmap_video_files(Inotify & inotify)
+template<class Entry>
+void Channel::prefetch_chunk(const Entry & entry, const bool video,
+                             const uint64_t ts, const size_t format_idx) const
 {
-  for (const auto & vf : vformats_) {
-    string video_dir = input_path_ / "ready" / vf.to_string();
-    cerr << "Channel " << name_ << ": serve videos in " << video_dir << endl;
+  const bool unmapped = entry.unmapped;
+  map_chunk(entry, video, ts, format_idx);
 
-    /* watch new files only on live */
-    if (live_) {
-      inotify.add_watch(video_dir, IN_MOVED_TO,
-        [this, &vf, video_dir](const inotify_event & event,
-                               const string & path) {
-          /* only interested in regular files that are moved into the dir */
-          if (not (event.mask & IN_MOVED_TO) or (event.mask & IN_ISDIR)) {
-            return;
-          }
+  const auto & [data, size] = *entry.data;
+  if (unmapped and data and size > 0) {
+    madvise(data.get(), size, MADV_WILLNEED);
+  }
+}
 
-          assert(video_dir == path);
-          assert(event.len != 0);
+void Channel::prefetch_video(const uint64_t vts, const size_t vformat_idx) const
+{
+  const size_t first_idx = vformat_idx > 0 ? vformat_idx - 1 : 0;
+
+  /* a client behind the clean frontier reads on from the archive */
+  if (in_dvr(true, vts)) {
+    for (unsigned int i = 0; i < prefetch_chunks_; i++) {
+      const uint64_t ts = vts + i * vduration_;
+      if (not in_dvr(true, ts)) {
+        break;
+      }
 
-          fs::path filepath = fs::path(path) / event.name;
-          do_mmap_video(filepath, vf);
-        }
+      for (size_t j = first_idx; j <= vformat_idx + 1 and j < vformats_.size();
+           j++) {
+        dvr_->read_ahead(vformat_strings_[j], ".m4s", ts);
+      }
+    }
+
+    return;
+  }
+
+  if (max_mapped_chunks_ == 0) {
+    return;
+  }
+
+  for (unsigned int i = 0; i < prefetch_chunks_; i++) {
+    const uint64_t ts = vts + i * vduration_;
+    const auto * entries = vchunks_.find(ts);
+    if (not entries) {
+      break;
+    }
+
+    for (size_t j = first_idx; j <= vformat_idx + 1 and j < entries->size();
+         j++) {
+      if ((*entries)[j].data) {
+        prefetch_chunk((*entries)[j], true, ts, j);
+      }
+    }
+  }
+}
+
+void Channel::prefetch_audio(const uint64_t ats, const size_t aformat_idx) const
+{
+  const size_t first_idx = aformat_idx > 0 ? aformat_idx - 1 : 0;
+
+  /* over the same span as prefetch_video() */
+  const uint64_t end_ts = ats + uint64_t(prefetch_chunks_) * vduration_;
+
+  if (in_dvr(false, ats)) {
+    for (uint64_t ts = ats; ts < end_ts and in_dvr(false, ts);
+         ts += aduration_) {
+      for (size_t j = first_idx; j <= aformat_idx + 1 and j < aformats_.size();
+           j++) {
+        dvr_->read_ahead(aformat_strings_[j], ".chk", ts);
+      }
+    }
+
+    return;
+  }
+
+  if (max_mapped_chunks_ == 0) {
+    return;
+  }
+
+  for (uint64_t ts = ats; ts < end_ts; ts += aduration_) {
+    const auto * entries = achunks_.find(ts);
+    if (not entries) {
+      break;
+    }
+
+    for (size_t j = first_idx; j <= aformat_idx + 1 and j < entries->size();
+         j++) {
+      if ((*entries)[j].data) {
+        prefetch_chunk((*entries)[j], false, ts, j);
+      }
+    }
+  }
+}
+
+mmap_t mmap_file(const string & filepath, const bool populate)
+{
+  try {
+    FileDescriptor fd(CheckSystemCall("open (" + filepath + ")",
+                      open(filepath.c_str(), O_RDONLY)));
+    size_t size = fd.filesize();
+    shared_ptr<void> data = mmap_shared(nullptr, size, PROT_READ,
+        MAP_PRIVATE | (populate ? MAP_POPULATE : 0), fd.fd_num(), 0);
+    return {static_pointer_cast<char>(data), size};
+  } catch (const exception & e) {
+    print_exception("mmap_file", e);
+    return {nullptr, 0};
+  }
+}
+
+/* a key of the contents of an init segment */
+static size_t init_key(const mmap_t & init)
+{
+  if (not get<0>(init)) {
+    return 0;
+  }
+
+  return hash<string_view>()(string_view(get<0>(init).get(), get<1>(init)));
+}
+
+void Channel::munmap_video(const uint64_t ts)
+{
+  uint64_t clean_window_ts = (clean_window_chunk_.value() - 1) * vduration_;
+  if (ts < clean_window_ts) return;
+  uint64_t obsolete = ts - clean_window_ts;
+
+  const optional<uint64_t> cleaned_ts = vchunks_.erase_until(obsolete);
+  vformat_tables_.erase_until(obsolete);
+
+  if (not cleaned_ts) return;
+
+  if (not vclean_frontier_ or *vclean_frontier_ < *cleaned_ts) {
+    vclean_frontier_ = *cleaned_ts;
+  }
+}
+
+void Channel::munmap_audio(const uint64_t ts)
+{
+  uint64_t clean_window_ts = (clean_window_chunk_.value() - 1) * vduration_;
+  if (ts < clean_window_ts) return;
+  uint64_t obsolete = ts - clean_window_ts;
+
+  const optional<uint64_t> cleaned_ts = achunks_.erase_until(obsolete);
+  aformat_tables_.erase_until(obsolete);
+
+  if (not cleaned_ts) return;
+
+  if (not aclean_frontier_ or *aclean_frontier_ < *cleaned_ts) {
+    aclean_frontier_ = *cleaned_ts;
+  }
+}
+
+optional<uint64_t> Channel::live_edge() const
+{
+  assert(live_);
+
+  /* init files are not ready */
+  const auto present = [](const optional<mmap_t> & init) {
+    return init.has_value();
+  };
+  if (not all_of(vinit_.begin(), vinit_.end(), present) or
+      not all_of(ainit_.begin(), ainit_.end(), present)) {
+    return nullopt;
+  }
+
+  /* no video chunks or no audio chunks are ready */
+  if (not vready_frontier_ or not aready_frontier_) {
+    return nullopt;
+  }
+
+  /* find the max ready video chunk, such that its corresponding ("floor_ats")
+   * audio chunk is also ready */
+  uint64_t ready_frontier = *vready_frontier_;
+  while (not aready(floor_ats(ready_frontier))) {
+    if (ready_frontier < vduration_) {
+      return nullopt;
+    }
+
+    ready_frontier -= vduration_;
+  }
+
+  uint64_t delay_vts = (present_delay_chunk_.value() - 1) * vduration_;
+  if (ready_frontier < delay_vts) {
+    return nullopt;
+  }
+
+  return ready_frontier - delay_vts;
+}
+
+std::optional<uint64_t> Channel::vclean_frontier() const
+{
+  assert(live_);
+  return vclean_frontier_;
+}
+
+std::optional<uint64_t> Channel::aclean_frontier() const
+{
+  assert(live_);
+  return aclean_frontier_;
+}
+
+/* drop the pages of a mapped chunk, which is harmless if it is read again */
+static void release_chunk(const optional<mmap_t> & data)
+{
+  if (data and get<1>(*data) > 0) {
+    madvise(get<0>(*data).get(), get<1>(*data), MADV_DONTNEED);
+  }
+}
+
+void Channel::release_chunks_before(const uint64_t vts)
+{
+  if (not prefault_chunks_) {
+    return;
+  }
+
+  const auto vfirst = vchunks_.first_ts();
+  if (vfirst) {
+    uint64_t ts = max(*vfirst, vreleased_until_.value_or(0));
+    for (; ts < floor_vts(vts); ts += vduration_) {
+      if (const auto * entries = vchunks_.find(ts)) {
+        for (const auto & entry : *entries) {
+          release_chunk(entry.data);
+        }
+      }
+    }
+    vreleased_until_ = ts;
+  }
+
+  const auto afirst = achunks_.first_ts();
+  if (afirst) {
+    uint64_t ts = max(*afirst, areleased_until_.value_or(0));
+    for (; ts < floor_ats(vts); ts += aduration_) {
+      if (const auto * entries = achunks_.find(ts)) {
+        for (const auto & entry : *entries) {
+          release_chunk(entry.data);
+        }
+      }
+    }
+    areleased_until_ = ts;
+  }
+}
+
+optional<uint64_t> Channel::vready_us(const uint64_t ts) const
+{
+  const auto & [ready_ts, ready_us] = vready_us_[ts / vduration_
+                                                 % VREADY_TIMES_KEPT];
+  if (ready_us == 0 or ready_ts != ts) {
+    return nullopt;
+  }
+
+  return ready_us;
+}
+
+void Channel::update_vready_frontier(const uint64_t vts)
+{
+  if (not vready(vts)) return;
+
+  /* update vready_frontier_ */
+  if (not vready_frontier_) {
+    vready_frontier_ = vts;
+  } else {
+    /* vready_frontier_ is a contiguous range of ready video chunks */
+    if (vts == *vready_frontier_ + vduration_) {
+      vready_frontier_ = *vready_frontier_ + vduration_;
+
+      while (vready(*vready_frontier_ + vduration_)) {
+        vready_frontier_ = *vready_frontier_ + vduration_;
+      }
+    }
+  }
+}
+
+void Channel::build_vformat_table(const uint64_t vts)
+{
+  if (not vready(vts)) return;
+
+  vector<VideoFormatInfo> infos(vformats_.size());
+  for (size_t i = 0; i < infos.size(); i++) {
+    const double ssim = vssim(i, vts);
+    infos[i] = {i, vsize(i, vts), ssim, ssim_db(ssim)};
+  }
+
+  stable_sort(infos.begin(), infos.end(),
+    [](const VideoFormatInfo & a, const VideoFormatInfo & b) {
+      return a.size < b.size;
+    });
+
+  for (size_t i = 0; i < infos.size(); i++) {
+    vformat_tables_.insert(vts, i) = infos[i];
+  }
+}
+
+void Channel::build_aformat_table(const uint64_t ats)
+{
+  if (not aready(ats)) return;
+
+  vector<AudioFormatInfo> infos(aformats_.size());
+  for (size_t i = 0; i < infos.size(); i++) {
+    infos[i] = {i, asize(i, ats)};
+  }
+
+  stable_sort(infos.begin(), infos.end(),
+    [](const AudioFormatInfo & a, const AudioFormatInfo & b) {
+      return a.size < b.size;
+    });
+
+  for (size_t i = 0; i < infos.size(); i++) {
+    aformat_tables_.insert(ats, i) = infos[i];
+  }
+}
+
+void Channel::update_aready_frontier(const uint64_t ats)
+{
+  if (not aready(ats)) return;
+
+  /* update aready_frontier_ */
+  if (not aready_frontier_) {
+    aready_frontier_ = ats;
+  } else {
+    /* aready_frontier_ is a contiguous range of ready audio chunks */
+    if (ats == *aready_frontier_ + aduration_) {
+      aready_frontier_ = *aready_frontier_ + aduration_;
+
+      while (aready(*aready_frontier_ + aduration_)) {
+        aready_frontier_ = *aready_frontier_ + aduration_;
+      }
+    }
+  }
+}
+
+void Channel::commit_ready_chunks()
+{
+  const auto old_vready_frontier = vready_frontier_;
+  const auto old_aready_frontier = aready_frontier_;
+
+  /* in ascending order, so that each frontier advances in a single pass */
+  for (const uint64_t ts : pending_vts_) {
+    build_vformat_table(ts);
+    update_vready_frontier(ts);
+  }
+
+  for (const uint64_t ts : pending_ats_) {
+    build_aformat_table(ts);
+    update_aready_frontier(ts);
+  }
+
+  /* time the chunks that have just gone ready (not those loaded at start) */
+  if (live_ and old_vready_frontier and
+      vready_frontier_ != old_vready_frontier) {
+    const uint64_t now = timestamp_us();
+    uint64_t ts = *vready_frontier_;
+
+    for (size_t i = 0; i < VREADY_TIMES_KEPT and ts > *old_vready_frontier;
+         i++, ts -= vduration_) {
+      vready_us_[ts / vduration_ % VREADY_TIMES_KEPT] = {ts, now};
+    }
+  }
+
+  if (live_ and not pending_vts_.empty() and vready_frontier_) {
+    munmap_video(*vready_frontier_);
+  }
+
+  if (live_ and not pending_ats_.empty() and aready_frontier_) {
+    munmap_audio(*aready_frontier_);
+  }
+
+  /* forget the segments whose chunks have all been cleaned; windowcleaner
+   * removes the files */
+  auto erase_segments = [this](map<fs::path, ChunkPack> & segments,
+                               const optional<uint64_t> & clean_frontier) {
+    if (not clean_frontier) {
+      return;
+    }
+
+    for (auto it = segments.begin(); it != segments.end();) {
+      if (stoull(it->first.stem()) + segment_span_ <= *clean_frontier) {
+        it = segments.erase(it);
+      } else {
+        it++;
+      }
+    }
+  };
+
+  erase_segments(vsegments_, vclean_frontier_);
+  erase_segments(asegments_, aclean_frontier_);
+
+  /* with the frontiers and clean frontiers updated */
+  if (live_ and ready_callback_) {
+    if (vready_frontier_ != old_vready_frontier) {
+      ready_callback_(true, *vready_frontier_);
+    }
+
+    if (aready_frontier_ != old_aready_frontier) {
+      ready_callback_(false, *aready_frontier_);
+    }
+  }
+
+  pending_vts_.clear();
+  pending_ats_.clear();
+}
+
+void Channel::do_mmap_video(const fs::path & filepath, const size_t vf_idx,
+                            const bool is_new)
+{
+  string filestem = filepath.stem();
+
+  if (filestem == "init") {
+    /* replace an init segment that changed; the fragmenters only write
+     * one whose contents differ */
+    const mmap_t init = mmap_file(filepath, prefault_chunks_ and is_new);
+    const size_t key = init_key(init);
+
+    if (vinit_key_[vf_idx] and *vinit_key_[vf_idx] != key) {
+      DIAG(Info) << "Channel " << name_ << ": init segment of "
+                 << vformat_strings_[vf_idx] << " changed";
+    }
+
+    vinit_[vf_idx] = init;
+    vinit_key_[vf_idx] = key;
+  } else {
+    if (filepath.extension() == ".m4s") {
+      uint64_t ts = stoull(filestem);
+      if (not is_valid_vts(ts)) {
+        DIAG(Warning) << "Channel " << name_ << ": ignored " << filepath;
+        return;
+      }
+
+      auto & entry = vchunks_.insert_part(ts, vf_idx, VDATA);
+      if (max_mapped_chunks_ > 0) {
+        /* mapped on first read */
+        entry.data = mmap_t {nullptr, fs::file_size(filepath)};
+        entry.unmapped = true;
+      } else {
+        entry.data = mmap_file(filepath, prefault_chunks_ and is_new);
+      }
+
+      pending_vts_.insert(ts);
+    } else if (segment_span_ > 0 and filepath.extension() == ".pack") {
+      read_segment(filepath, true, vf_idx);
+    }
+  }
+}
+
+void Channel::mmap_video_files(Inotify & inotify)
+{
+  for (size_t vf_idx = 0; vf_idx < vformats_.size(); vf_idx++) {
+    const auto & vf = vformats_[vf_idx];
+    string video_dir = input_path_ / "ready" / vf.to_string();
+    DIAG(Info) << "Channel " << name_ << ": serve videos in " << video_dir;
+
+    /* watch new files only on live, and appends to the segments */
+    if (live_) {
+      const uint32_t mask = segment_span_ > 0 ? IN_MOVED_TO | IN_CLOSE_WRITE
+                                              : IN_MOVED_TO;
+      inotify.add_watch(video_dir, mask,
+        [this, vf_idx, video_dir, mask](const inotify_event & event,
+                                        const string & path) {
+          /* only interested in regular files moved into (or appended to)
+           * the dir */
+          if (not (event.mask & mask) or (event.mask & IN_ISDIR)) {
+            return;
+          }
+
+          assert(video_dir == path);
+          assert(event.len != 0);
+
+          fs::path filepath = fs::path(path) / event.name;
+          do_mmap_video(filepath, vf_idx, true);
+        },
+        [this, vf_idx](const string & path) {
+          rescan_dir(path, ".m4s", true, vf_idx, VDATA,
+            [this, vf_idx](const fs::path & filepath) {
+              do_mmap_video(filepath, vf_idx, true);
+            }
+          );
+        }
       );
     }
 
     /* process existing files */
     for (const auto & file : fs::directory_iterator(video_dir)) {
-      do_mmap_video(file.path(), vf);
+      do_mmap_video(file.path(), vf_idx);
     }
   }
 }
 
-void Channel::do_mmap_audio(const fs::path & filepath, const AudioFormat & af)
+void Channel::do_mmap_audio(const fs::path & filepath, const size_t af_idx,
+                            const bool is_new)
 {
-  const mmap_t & data_size = mmap_file(filepath);
   string filestem = filepath.stem();
 
   if (filestem == "init") {
-    ainit_.emplace(af, data_size);
+    /* replace an init segment that changed; the fragmenters only write
+     * one whose contents differ */
+    const mmap_t init = mmap_file(filepath, prefault_chunks_ and is_new);
+    const size_t key = init_key(init);
+
+    if (ainit_key_[af_idx] and *ainit_key_[af_idx] != key) {
+      DIAG(Info) << "Channel " << name_ << ": init segment of "
+                 << aformat_strings_[af_idx] << " changed";
+    }
+
+    ainit_[af_idx] = init;
+    ainit_key_[af_idx] = key;
   } else {
     if (filepath.extension() == ".chk") {
       uint64_t ts = stoull(filestem);
-      adata_[ts][af] = data_size;
-
-      update_aready_frontier(ts);
+      if (not is_valid_ats(ts)) {
+        DIAG(Warning) << "Channel " << name_ << ": ignored " << filepath;
+        return;
+      }
 
-      if (live_ and aready_frontier_) {
-        munmap_audio(*aready_frontier_);
+      auto & entry = achunks_.insert_part(ts, af_idx);
+      if (max_mapped_chunks_ > 0) {
+        entry.data = mmap_t {nullptr, fs::file_size(filepath)};
+        entry.unmapped = true;
+      } else {
+        entry.data = mmap_file(filepath, prefault_chunks_ and is_new);
       }
+
+      pending_ats_.insert(ts);
+    } else if (segment_span_ > 0 and filepath.extension() == ".pack") {
+      read_segment(filepath, false, af_idx);
     }
   }
 }
 
 void Channel::mmap_audio_files(Inotify & inotify)
 {
-  for (const auto & af : aformats_) {
+  for (size_t af_idx = 0; af_idx < aformats_.size(); af_idx++) {
+    const auto & af = aformats_[af_idx];
     string audio_dir = input_path_ / "ready" / af.to_string();
-    cerr << "Channel " << name_ << ": serve audios in " << audio_dir << endl;
+    DIAG(Info) << "Channel " << name_ << ": serve audios in " << audio_dir;
 
-    /* watch new files only on live */
+    /* watch new files only on live, and appends to the segments */
     if (live_) {
-      inotify.add_watch(audio_dir, IN_MOVED_TO,
-        [this, &af, audio_dir](const inotify_event & event,
-                               const string & path) {
-          /* only interested in regular files that are moved into the dir */
-          if (not (event.mask & IN_MOVED_TO) or (event.mask & IN_ISDIR)) {
+      const uint32_t mask = segment_span_ > 0 ? IN_MOVED_TO | IN_CLOSE_WRITE
+                                              : IN_MOVED_TO;
+      inotify.add_watch(audio_dir, mask,
+        [this, af_idx, audio_dir, mask](const inotify_event & event,
+                                        const string & path) {
+          /* only interested in regular files moved into (or appended to)
+           * the dir */
+          if (not (event.mask & mask) or (event.mask & IN_ISDIR)) {
             return;
           }
 
@@ -473,44 +1285,122 @@ void Channel::mmap_audio_files(Inotify & inotify)
           assert(event.len != 0);
 
           fs::path filepath = fs::path(path) / event.name;
-          do_mmap_audio(filepath, af);
+          do_mmap_audio(filepath, af_idx, true);
+        },
+        [this, af_idx](const string & path) {
+          rescan_dir(path, ".chk", false, af_idx, 0,
+            [this, af_idx](const fs::path & filepath) {
+              do_mmap_audio(filepath, af_idx, true);
+            }
+          );
         }
       );
     }
 
     /* process existing files */
     for (const auto & file : fs::directory_iterator(audio_dir)) {
-      do_mmap_audio(file.path(), af);
+      do_mmap_audio(file.path(), af_idx);
+    }
+  }
+}
+
+void Channel::read_pack_files()
+{
+  for (size_t vf_idx = 0; vf_idx < vformats_.size(); vf_idx++) {
+    const fs::path video_dir = input_path_ / "ready"
+                               / vformats_[vf_idx].to_string();
+    const ChunkPack pack(video_dir.string() + ".pack");
+    DIAG(Info) << "Channel " << name_ << ": serve videos in "
+               << pack.path().string();
+
+    do_mmap_video(video_dir / "init.mp4", vf_idx);
+    insert_pack_chunks(pack, 0, true, vf_idx);
+  }
+
+  for (size_t af_idx = 0; af_idx < aformats_.size(); af_idx++) {
+    const fs::path audio_dir = input_path_ / "ready"
+                               / aformats_[af_idx].to_string();
+    const ChunkPack pack(audio_dir.string() + ".pack");
+    DIAG(Info) << "Channel " << name_ << ": serve audios in "
+               << pack.path().string();
+
+    do_mmap_audio(audio_dir / "init.webm", af_idx);
+    insert_pack_chunks(pack, 0, false, af_idx);
+  }
+}
+
+void Channel::insert_pack_chunks(const ChunkPack & pack, const size_t first,
+                                 const bool video, const size_t format_idx)
+{
+  for (size_t i = first; i < pack.num_chunks(); i++) {
+    const uint64_t ts = pack.entry(i).ts;
+    if (video ? not is_valid_vts(ts) : not is_valid_ats(ts)) {
+      DIAG(Warning) << "Channel " << name_ << ": ignored chunk " << ts << " in "
+                    << pack.path().string();
+      continue;
+    }
+
+    if (video) {
+      vchunks_.insert_part(ts, format_idx, VDATA).data = pack.chunk(i);
+      pending_vts_.insert(ts);
+    } else {
+      achunks_.insert_part(ts, format_idx).data = pack.chunk(i);
+      pending_ats_.insert(ts);
+    }
+  }
+}
+
+void Channel::read_segment(const fs::path & filepath, const bool video,
+                           const size_t format_idx)
+{
+  auto & segments = video ? vsegments_ : asegments_;
+
+  try {
+    auto it = segments.find(filepath);
+    size_t first = 0;
+
+    if (it == segments.end()) {
+      it = segments.emplace(filepath, ChunkPack(filepath)).first;
+    } else {
+      first = it->second.num_chunks();
+      it->second.refresh();
     }
+
+    insert_pack_chunks(it->second, first, video, format_idx);
+  } catch (const exception & e) {
+    print_exception(("Channel " + name_ + ": segment").c_str(), e);
   }
 }
 
-void Channel::do_read_ssim(const fs::path & filepath, const VideoFormat & vf) {
+void Channel::do_read_ssim(const fs::path & filepath, const size_t vf_idx) {
   if (filepath.extension() == ".ssim") {
-    string filestem = filepath.stem();
-    uint64_t ts = stoull(filestem);
+    uint64_t ts = strict_parse<uint64_t>(filepath.stem().native());
+    if (not is_valid_vts(ts)) {
+      DIAG(Warning) << "Channel " << name_ << ": ignored " << filepath;
+      return;
+    }
 
     ifstream ssim_file(filepath);
     string line;
     getline(ssim_file, line);
 
-    vssim_[ts][vf] = stod(line);
-
-    update_vready_frontier(ts);
+    vchunks_.insert_part(ts, vf_idx, VSSIM).ssim = strict_parse<double>(line);
+    pending_vts_.insert(ts);
   }
 }
 
 void Channel::load_ssim_files(Inotify & inotify)
 {
-  for (const auto & vf : vformats_) {
+  for (size_t vf_idx = 0; vf_idx < vformats_.size(); vf_idx++) {
+    const auto & vf = vformats_[vf_idx];
     string ssim_dir = input_path_ / "ready" / (vf.to_string() + "-ssim");
-    cerr << "Channel " << name_ << ": serve SSIMs in " << ssim_dir << endl;
+    DIAG(Info) << "Channel " << name_ << ": serve SSIMs in " << ssim_dir;
 
     /* watch new files only on live */
     if (live_) {
       inotify.add_watch(ssim_dir, IN_MOVED_TO,
-        [this, &vf, ssim_dir](const inotify_event & event,
-                              const string & path) {
+        [this, vf_idx, ssim_dir](const inotify_event & event,
+                                 const string & path) {
           /* only interested in regular files that are moved into the dir */
           if (not (event.mask & IN_MOVED_TO) or (event.mask & IN_ISDIR)) {
             return;
@@ -520,14 +1410,573 @@ void Channel::load_ssim_files(Inotify & inotify)
           assert(event.len != 0);
 
           fs::path filepath = fs::path(path) / event.name;
-          do_read_ssim(filepath, vf);
+          do_read_ssim(filepath, vf_idx);
+        },
+        [this, vf_idx](const string & path) {
+          rescan_dir(path, ".ssim", true, vf_idx, VSSIM,
+            [this, vf_idx](const fs::path & filepath) {
+              do_read_ssim(filepath, vf_idx);
+            }
+          );
         }
       );
     }
 
     /* process existing files */
     for (const auto & file : fs::directory_iterator(ssim_dir)) {
-      do_read_ssim(file.path(), vf);
+      do_read_ssim(file.path(), vf_idx);
+    }
+  }
+}
+
+void Channel::tail_ssim_log(Inotify & inotify)
+{
+  const fs::path ready_dir = input_path_ / "ready";
+  ssim_log_ = make_unique<SSIMLog>(ready_dir / "ssim.log");
+  DIAG(Info) << "Channel " << name_ << ": serve SSIMs in " << ssim_log_->path();
+
+  /* watch the log for appends only on live */
+  if (live_) {
+    const string log_name = ssim_log_->path().filename();
+
+    inotify.add_watch(ready_dir, IN_MODIFY,
+      [this, log_name](const inotify_event & event, const string &) {
+        if (not (event.mask & IN_MODIFY) or event.len == 0 or
+            event.name != log_name) {
+          return;
+        }
+
+        read_ssim_log();
+      },
+      /* the log is read from where the last read ended anyway */
+      [this](const string &) { read_ssim_log(); }
+    );
+  }
+
+  /* process existing records */
+  read_ssim_log();
+}
+
+void Channel::rescan_dir(const fs::path & dir, const string & chunk_ext,
+                         const bool video, const size_t format_idx,
+                         const unsigned int part,
+                         const function<void(const fs::path &)> & process)
+{
+  const auto first_ts = video ? vchunks_.first_ts() : achunks_.first_ts();
+  const size_t num_formats = video ? vformats_.size() : aformats_.size();
+  const uint64_t part_bit = uint64_t(1) << (part * num_formats + format_idx);
+
+  size_t num_missed = 0;
+
+  for (const auto & file : fs::directory_iterator(dir)) {
+    const fs::path & filepath = file.path();
+
+    if (filepath.extension() == chunk_ext) {
+      const auto ts = parse_number<uint64_t>(filepath.stem().native());
+      if (ts and first_ts and *ts < *first_ts) {
+        continue;  /* cleaned */
+      }
+
+      const uint64_t arrived = ts ? (video ? vchunks_.arrived(*ts)
+                                           : achunks_.arrived(*ts)) : 0;
+      if (arrived & part_bit) {
+        continue;
+      }
+
+      num_missed++;
+    }
+
+    process(filepath);
+  }
+
+  DIAG(Info) << "Channel " << name_ << ": found " << num_missed
+             << " missed chunks in " << dir;
+}
+
+void Channel::read_ssim_log()
+{
+  /* the log still has the records of the chunks that have been cleaned */
+  const auto first_vts = vchunks_.first_ts();
+
+  ssim_log_->tail(
+    [this, &first_vts](const SSIMLog::Record & record) {
+      if (record.format_idx >= vformats_.size() or
+          not is_valid_vts(record.ts)) {
+        DIAG(Warning) << "Channel " << name_ << ": ignored SSIM record of "
+                      << record.ts;
+        return;
+      }
+
+      if (live_ and ((first_vts and record.ts < *first_vts) or
+                     (vclean_frontier_ and record.ts <= *vclean_frontier_))) {
+        return;
+      }
+
+      vchunks_.insert_part(record.ts, record.format_idx, VSSIM).ssim =
+        record.ssim;
+      pending_vts_.insert(record.ts);
+    }
+  );
+}
+
+fs::path Channel::vchunk_path(const size_t vf_idx, const uint64_t ts) const
+{
+  return input_path_ / "ready" / vformat_strings_.at(vf_idx)
+         / (to_string(ts) + ".m4s");
+}
+
+fs::path Channel::achunk_path(const size_t af_idx, const uint64_t ts) const
+{
+  return input_path_ / "ready" / aformat_strings_.at(af_idx)
+         / (to_string(ts) + ".chk");
+}
+
+vector<Channel::SnapshotStamp> Channel::snapshot_stamps(
+  const bool ssim_log) const
+{
+  /* adding, removing or renaming a file changes the mtime of its directory */
+  vector<string> paths;
+  for (const auto & vf : vformats_) {
+    paths.emplace_back(fs::path("ready") / vf.to_string());
+    if (not ssim_log) {
+      paths.emplace_back(fs::path("ready") / (vf.to_string() + "-ssim"));
+    }
+  }
+
+  for (const auto & af : aformats_) {
+    paths.emplace_back(fs::path("ready") / af.to_string());
+  }
+
+  /* the log is appended in place */
+  if (ssim_log) {
+    paths.emplace_back(fs::path("ready") / "ssim.log");
+  }
+
+  vector<SnapshotStamp> stamps;
+  for (const auto & path : paths) {
+    const string full_path = input_path_ / path;
+
+    struct stat st;
+    CheckSystemCall("stat (" + full_path + ")", stat(full_path.c_str(), &st));
+
+    const int64_t mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec)
+                             * 1000000000 + st.st_mtim.tv_nsec;
+    stamps.emplace_back(path, mtime_ns, st.st_size);
+  }
+
+  return stamps;
+}
+
+string Channel::snapshot_header(const vector<SnapshotStamp> & stamps) const
+{
+  ostringstream out;
+  out << SNAPSHOT_HEADER << "\n"
+      << "durations " << vduration_ << " " << aduration_ << "\n";
+
+  out << "vformats";
+  for (const auto & vf : vformats_) {
+    out << " " << vf.to_string();
+  }
+
+  out << "\naformats";
+  for (const auto & af : aformats_) {
+    out << " " << af.to_string();
+  }
+  out << "\n";
+
+  for (const auto & [path, mtime_ns, size] : stamps) {
+    out << "stamp " << mtime_ns << " " << size << " " << path << "\n";
+  }
+
+  return out.str();
+}
+
+bool Channel::load_snapshot(const fs::path & snapshot_path,
+                            const vector<SnapshotStamp> & stamps)
+{
+  ifstream in(snapshot_path);
+  if (not in) {
+    return false;
+  }
+
+  /* written with the same channel config and ready/ directories */
+  const string expected_header = snapshot_header(stamps);
+  string header(expected_header.size(), '\0');
+  if (not in.read(&header[0], header.size()) or header != expected_header) {
+    DIAG(Warning) << "Channel " << name_ << ": " << snapshot_path
+                  << " is stale";
+    return false;
+  }
+
+  /* parse the entries fully before touching the index */
+  struct Chunk {
+    bool video;
+    size_t format_idx;
+    uint64_t ts;
+    size_t size;
+    optional<double> ssim;
+  };
+
+  vector<Chunk> chunks;
+  set<size_t> vinit_idx, ainit_idx;
+  bool complete = false;
+
+  string line;
+  while (getline(in, line)) {
+    istringstream fields(line);
+    string type;
+    fields >> type;
+
+    if (type == "end") {
+      complete = true;
+      break;
+    }
+
+    Chunk chunk {};
+    if (type == "vinit" or type == "ainit") {
+      fields >> chunk.format_idx;
+      (type == "vinit" ? vinit_idx : ainit_idx).insert(chunk.format_idx);
+    } else if (type == "v" or type == "a") {
+      chunk.video = type == "v";
+      fields >> chunk.format_idx >> chunk.ts >> chunk.size;
+
+      string ssim;
+      if (chunk.video and fields >> ssim and ssim != "-") {
+        chunk.ssim = stod(ssim);
+      }
+
+      chunks.emplace_back(chunk);
+    } else {
+      fields.setstate(ios::failbit);
+    }
+
+    const size_t num_formats = type[0] == 'v' ? vformats_.size()
+                                              : aformats_.size();
+    if (fields.fail() or chunk.format_idx >= num_formats) {
+      throw runtime_error("invalid line in the snapshot: " + line);
+    }
+  }
+
+  if (not complete) {
+    throw runtime_error("the snapshot is truncated");
+  }
+
+  for (const size_t vf_idx : vinit_idx) {
+    do_mmap_video(input_path_ / "ready" / vformats_[vf_idx].to_string()
+                  / "init.mp4", vf_idx);
+  }
+
+  for (const size_t af_idx : ainit_idx) {
+    do_mmap_audio(input_path_ / "ready" / aformats_[af_idx].to_string()
+                  / "init.webm", af_idx);
+  }
+
+  /* the chunks are mapped on first read */
+  for (const auto & chunk : chunks) {
+    if (chunk.video) {
+      auto & entry = vchunks_.insert_part(chunk.ts, chunk.format_idx, VDATA);
+      entry.data = mmap_t {nullptr, chunk.size};
+      entry.unmapped = true;
+
+      if (chunk.ssim) {
+        vchunks_.insert_part(chunk.ts, chunk.format_idx, VSSIM).ssim =
+          chunk.ssim;
+      }
+      pending_vts_.insert(chunk.ts);
+    } else {
+      auto & entry = achunks_.insert_part(chunk.ts, chunk.format_idx);
+      entry.data = mmap_t {nullptr, chunk.size};
+      entry.unmapped = true;
+      pending_ats_.insert(chunk.ts);
+    }
+  }
+
+  DIAG(Info) << "Channel " << name_ << ": restored " << chunks.size()
+             << " chunks from " << snapshot_path;
+  return true;
+}
+
+void Channel::write_snapshot(const fs::path & snapshot_path,
+                             const vector<SnapshotStamp> & stamps) const
+{
+  ostringstream out;
+  out << snapshot_header(stamps);
+
+  for (size_t vf_idx = 0; vf_idx < vformats_.size(); vf_idx++) {
+    if (vinit_[vf_idx]) {
+      out << "vinit " << vf_idx << "\n";
+    }
+  }
+
+  for (size_t af_idx = 0; af_idx < aformats_.size(); af_idx++) {
+    if (ainit_[af_idx]) {
+      out << "ainit " << af_idx << "\n";
+    }
+  }
+
+  /* SSIMs are written with enough digits to be read back exactly */
+  out << setprecision(17);
+
+  vchunks_.for_each(
+    [&out](const uint64_t ts, const vector<VideoEntry> & entries) {
+      for (size_t vf_idx = 0; vf_idx < entries.size(); vf_idx++) {
+        const auto & entry = entries[vf_idx];
+        if (not entry.data) {
+          continue;
+        }
+
+        out << "v " << vf_idx << " " << ts << " " << get<1>(*entry.data) << " ";
+        if (entry.ssim) {
+          out << *entry.ssim << "\n";
+        } else {
+          out << "-\n";
+        }
+      }
+    }
+  );
+
+  achunks_.for_each(
+    [&out](const uint64_t ts, const vector<AudioEntry> & entries) {
+      for (size_t af_idx = 0; af_idx < entries.size(); af_idx++) {
+        if (entries[af_idx].data) {
+          out << "a " << af_idx << " " << ts << " "
+              << get<1>(*entries[af_idx].data) << "\n";
+        }
+      }
+    }
+  );
+
+  out << "end\n";
+
+  /* other threads and servers might be writing the same snapshot */
+  UniqueFile tmp_file(snapshot_path.string());
+  tmp_file.write(out.str());
+  fs::rename(tmp_file.name(), snapshot_path);
+
+  DIAG(Info) << "Channel " << name_ << ": wrote " << snapshot_path;
+}
+
+bool Channel::attach_index()
+{
+  const uint64_t now = timestamp_ms();
+  const bool first_check = last_index_check_ms_ == 0;
+
+  if (not first_check and now - last_index_check_ms_ < INDEX_CHECK_INTERVAL_MS) {
+    return index_ != nullptr;
+  }
+  last_index_check_ms_ = now;
+
+  if (index_ and not index_->replaced()) {
+    return true;
+  }
+
+  try {
+    auto index = MediaIndex::attach(*index_path_);
+    if (index->num_vformats() != vformats_.size() or
+        index->num_aformats() != aformats_.size() or
+        index->vduration() != vduration_ or
+        index->aduration() != aduration_) {
+      throw runtime_error("the index does not match the channel config");
+    }
+
+    /* read the new index from the start */
+    index_ = move(index);
+    index_generation_.reset();
+    vsynced_until_.reset();
+    asynced_until_.reset();
+
+    DIAG(Info) << "Channel " << name_ << ": attached to the index";
+  } catch (const exception & e) {
+    /* keep using the stale index (if any) and retry later */
+    if (first_check or index_) {
+      print_exception(("Channel " + name_).c_str(), e);
+    }
+  }
+
+  return index_ != nullptr;
+}
+
+void Channel::make_dormant()
+{
+  if (not index_path_) {
+    throw runtime_error("Channel " + name_ + ": only a channel with a media "
+                        "index can be dormant");
+  }
+
+  if (dormant_) {
+    return;
+  }
+
+  vchunks_ = ChunkIndex<VideoEntry>(vduration_, vformats_.size(), 2);
+  achunks_ = ChunkIndex<AudioEntry>(aduration_, aformats_.size());
+  vformat_tables_ = ChunkIndex<VideoFormatInfo>(vduration_, vformats_.size());
+  aformat_tables_ = ChunkIndex<AudioFormatInfo>(aduration_, aformats_.size());
+  dvr_vformat_tables_.clear();
+  dvr_aformat_tables_.clear();
+
+  /* the keys stay, so that a changed init segment is still noticed */
+  fill(vinit_.begin(), vinit_.end(), nullopt);
+  fill(ainit_.begin(), ainit_.end(), nullopt);
+
+  /* activate() syncs the index from the start */
+  vready_frontier_.reset();
+  aready_frontier_.reset();
+  vclean_frontier_.reset();
+  aclean_frontier_.reset();
+  vreleased_until_.reset();
+  areleased_until_.reset();
+  index_generation_.reset();
+  vsynced_until_.reset();
+  asynced_until_.reset();
+  pending_vts_.clear();
+  pending_ats_.clear();
+
+  /* the live edge does not move while dormant */
+  available_ = true;
+  last_live_edge_.reset();
+  last_live_edge_ts_.reset();
+
+  dormant_ = true;
+  DIAG(Info) << "Channel " << name_ << ": dormant";
+}
+
+void Channel::activate()
+{
+  if (not dormant_) {
+    return;
+  }
+
+  dormant_ = false;
+  sync_index();
+  DIAG(Info) << "Channel " << name_ << ": activated";
+}
+
+void Channel::sync_index()
+{
+  if (not index_path_ or dormant_ or not attach_index()) {
+    return;
+  }
+
+  /* nothing has changed since the last sync */
+  const uint64_t generation = index_->generation();
+  if (index_generation_ == generation) {
+    return;
+  }
+  index_generation_ = generation;
+
+  const uint64_t vinit_mask = index_->vinit_mask();
+  for (size_t vf_idx = 0; vf_idx < vformats_.size(); vf_idx++) {
+    if ((vinit_mask & (uint64_t(1) << vf_idx)) and not vinit_[vf_idx]) {
+      do_mmap_video(input_path_ / "ready" / vformat_strings_[vf_idx]
+                    / "init.mp4",
+                    vf_idx);
+    }
+  }
+
+  const uint64_t ainit_mask = index_->ainit_mask();
+  for (size_t af_idx = 0; af_idx < aformats_.size(); af_idx++) {
+    if ((ainit_mask & (uint64_t(1) << af_idx)) and not ainit_[af_idx]) {
+      do_mmap_audio(input_path_ / "ready" / aformat_strings_[af_idx]
+                    / "init.webm",
+                    af_idx);
+    }
+  }
+
+  sync_index_video();
+  sync_index_audio();
+
+  commit_ready_chunks();
+}
+
+void Channel::sync_index_video()
+{
+  const auto latest = index_->vlatest();
+  if (not latest) {
+    return;
+  }
+
+  /* the oldest timestamp that might still be in the index */
+  const uint64_t span = (MediaIndex::CAPACITY - 1) * vduration_;
+  uint64_t ts = *latest > span ? *latest - span : 0;
+  if (vsynced_until_) {
+    ts = max(ts, *vsynced_until_);
+  }
+
+  /* whether all the chunks before ts are complete */
+  bool synced = true;
+
+  for (; ts <= *latest; ts += vduration_) {
+    if (vclean_frontier_ and ts <= *vclean_frontier_) {
+      continue;
+    }
+
+    const auto chunk = index_->video(ts);
+
+    /* the parts in the index that have not arrived here yet */
+    const uint64_t arrived = vchunks_.arrived(ts);
+    const uint64_t data_mask =
+      chunk ? chunk->ready_mask & ~(arrived >> (VDATA * vformats_.size())) : 0;
+    const uint64_t ssim_mask =
+      chunk ? chunk->ssim_mask & ~(arrived >> (VSSIM * vformats_.size())) : 0;
+
+    for (size_t vf_idx = 0; (data_mask or ssim_mask) and
+                            vf_idx < vformats_.size(); vf_idx++) {
+      const uint64_t bit = uint64_t(1) << vf_idx;
+
+      if (data_mask & bit) {
+        do_mmap_video(vchunk_path(vf_idx, ts), vf_idx, true);
+      }
+
+      if (ssim_mask & bit) {
+        vchunks_.insert_part(ts, vf_idx, VSSIM).ssim = chunk->ssim[vf_idx];
+        pending_vts_.insert(ts);
+      }
+    }
+
+    if (synced and vready(ts)) {
+      vsynced_until_ = ts + vduration_;
+    } else {
+      synced = false;
+    }
+  }
+}
+
+void Channel::sync_index_audio()
+{
+  const auto latest = index_->alatest();
+  if (not latest) {
+    return;
+  }
+
+  /* the oldest timestamp that might still be in the index */
+  const uint64_t span = (MediaIndex::CAPACITY - 1) * aduration_;
+  uint64_t ts = *latest > span ? *latest - span : 0;
+  if (asynced_until_) {
+    ts = max(ts, *asynced_until_);
+  }
+
+  /* whether all the chunks before ts are complete */
+  bool synced = true;
+
+  for (; ts <= *latest; ts += aduration_) {
+    if (aclean_frontier_ and ts <= *aclean_frontier_) {
+      continue;
+    }
+
+    const auto chunk = index_->audio(ts);
+    const uint64_t data_mask =
+      chunk ? chunk->ready_mask & ~achunks_.arrived(ts) : 0;
+
+    for (size_t af_idx = 0; data_mask and af_idx < aformats_.size(); af_idx++) {
+      if (data_mask & (uint64_t(1) << af_idx)) {
+        do_mmap_audio(achunk_path(af_idx, ts), af_idx, true);
+      }
+    }
+
+    if (synced and aready(ts)) {
+      asynced_until_ = ts + aduration_;
+    } else {
+      synced = false;
     }
   }
 }
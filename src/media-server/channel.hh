@@ -3,25 +3,63 @@
 
 #include <cstdint>
 #include <string>
+#include <array>
+#include <functional>
 #include <optional>
 #include <map>
+#include <set>
+#include <list>
 #include <memory>
+#include <vector>
+#include <tuple>
 
 #include "filesystem.hh"
 #include "inotify.hh"
 #include "mmap.hh"
 #include "media_formats.hh"
 #include "yaml.hh"
+#include "chunk_index.hh"
+#include "media_index.hh"
+#include "ssim_log.hh"
+#include "chunk_pack.hh"
+#include "dvr_archive.hh"
 
 using mmap_t = std::tuple<std::shared_ptr<char>, size_t>;
 
 class Channel
 {
 public:
+  static constexpr unsigned int DEFAULT_VIDEO_DURATION = 180180;  /* 2.002s */
+  static constexpr unsigned int DEFAULT_AUDIO_DURATION = 432000;  /* 4.8s */
+  static constexpr unsigned int DEFAULT_PREFETCH_CHUNKS = 2;
+
+  /* a live channel given index_path learns about the ready chunks from the
+   * MediaIndex at index_path (see sync_index()) rather than inotify;
+   * a static channel given snapshot_path restores its index from the
+   * snapshot there if the ready/ directories have not changed since it was
+   * written, and maps the chunks on first read rather than at startup */
   Channel(const std::string & name, const fs::path & media_dir,
-          const YAML::Node & config, Inotify & inotify);
+          const YAML::Node & config, Inotify & inotify,
+          const std::optional<fs::path> & index_path = std::nullopt,
+          const std::optional<fs::path> & snapshot_path = std::nullopt,
+          const bool dormant = false);
 
   bool live() const { return live_; }
+
+  /* a live channel given index_path can be dormant (e.g., while no client
+   * watches it): it holds no chunks or init segments, and sync_index() does
+   * nothing, as the MediaIndex keeps track of the ready chunks meanwhile;
+   * activate() maps the chunks in the index again. Constructed with
+   * dormant, such a channel starts dormant */
+  bool indexed() const { return index_path_.has_value(); }
+  bool dormant() const { return dormant_; }
+  void make_dormant();
+  void activate();
+
+  /* call this function frequently if the channel uses a MediaIndex: map the
+   * chunks (and read the SSIMs) that have become ready in the index */
+  void sync_index();
+
   std::string name() const { return name_; }
 
   fs::path input_path() const { return input_path_; }
@@ -29,7 +67,8 @@ public:
   const std::vector<VideoFormat> & vformats() const { return vformats_; }
   const std::vector<AudioFormat> & aformats() const { return aformats_; }
 
-  /* if channel is ready to serve */
+  /* if channel is ready to serve; on live with dvr_dir, a chunk behind the
+   * clean frontier is ready if it has been archived */
   bool ready_to_serve() const;
   bool vready_to_serve(const uint64_t ts) const;
   bool aready_to_serve(const uint64_t ts) const;
@@ -38,15 +77,86 @@ public:
    * unavailable if live edge hasn't advanced for MAX_UNCHANGED_LIVE_EDGE_MS */
   void enforce_moving_live_edge();
 
-  mmap_t vinit(const VideoFormat & format) const;
-  mmap_t vdata(const VideoFormat & format, const uint64_t ts) const;
-  const std::map<VideoFormat, mmap_t> & vdata(const uint64_t ts) const;
+  /* index of a format in vformats() or aformats(), by which the formats are
+   * referred to on the send path (e.g., as selected by the ABR algorithms) */
+  size_t vformat_index(const VideoFormat & format) const;
+  size_t aformat_index(const AudioFormat & format) const;
+
+  /* the indices in vformats() (ascending) of the formats worth considering
+   * for a screen of width x height pixels: with screen_pruning, those that
+   * fit in the smallest resolution of the channel that covers the screen
+   * (in either orientation, scaled by screen_pixel_ratio), precomputed per
+   * resolution; all the formats otherwise, or if the size is unknown (0 or
+   * 0xFFFF) or no resolution covers the screen */
+  const std::vector<size_t> & vformats_for_screen(const uint16_t width,
+                                                  const uint16_t height) const;
+
+  /* to_string() of the format at an index, formatted once at construction */
+  const std::string & vformat_string(const size_t vformat_idx) const
+  {
+    return vformat_strings_.at(vformat_idx);
+  }
+
+  const std::string & aformat_string(const size_t aformat_idx) const
+  {
+    return aformat_strings_.at(aformat_idx);
+  }
+
+  /* the accessors below throw std::out_of_range if the chunk is absent;
+   * prefer passing the index of the format over the format itself. The
+   * mappings returned are borrowed, without touching their reference counts:
+   * they are valid until the channel next maps or unmaps a chunk (e.g., in
+   * prefetch_video()), so copy one to keep the chunk mapped for longer */
+  const mmap_t & vinit(const VideoFormat & format) const;
+  const mmap_t & vinit(const size_t vformat_idx) const;
+  size_t vinit_key(const VideoFormat & format) const;
+  size_t vinit_key(const size_t vformat_idx) const;
+  const mmap_t & vdata(const VideoFormat & format, const uint64_t ts) const;
+  const mmap_t & vdata(const size_t vformat_idx, const uint64_t ts) const;
   double vssim(const VideoFormat & format, const uint64_t ts) const;
-  const std::map<VideoFormat, double> & vssim(const uint64_t ts) const;
-
-  mmap_t ainit(const AudioFormat & format) const;
-  mmap_t adata(const AudioFormat & format, const uint64_t ts) const;
-  const std::map<AudioFormat, mmap_t> & adata(const uint64_t ts) const;
+  double vssim(const size_t vformat_idx, const uint64_t ts) const;
+
+  const mmap_t & ainit(const AudioFormat & format) const;
+  const mmap_t & ainit(const size_t aformat_idx) const;
+  size_t ainit_key(const AudioFormat & format) const;
+  size_t ainit_key(const size_t aformat_idx) const;
+  const mmap_t & adata(const AudioFormat & format, const uint64_t ts) const;
+  const mmap_t & adata(const size_t aformat_idx, const uint64_t ts) const;
+
+  /* size of a chunk, which need not be mapped (e.g., for ABR) */
+  size_t vsize(const size_t vformat_idx, const uint64_t ts) const;
+  size_t asize(const size_t aformat_idx, const uint64_t ts) const;
+
+  /* a video format at a ready timestamp, as read by the ABR algorithms */
+  struct VideoFormatInfo
+  {
+    size_t format_idx {0};  /* index in vformats() */
+    size_t size {0};
+    double ssim {0};
+    double ssim_db {0};
+  };
+
+  /* the formats at a ready video timestamp in ascending order of size (ties
+   * in the order of vformats()), built once when the timestamp goes ready
+   * rather than looked up and converted to dB per decision of each client */
+  const std::vector<VideoFormatInfo> & vformat_table(const uint64_t ts) const;
+
+  /* likewise, the formats at a ready audio timestamp */
+  struct AudioFormatInfo
+  {
+    size_t format_idx {0};  /* index in aformats() */
+    size_t size {0};
+  };
+
+  const std::vector<AudioFormatInfo> & aformat_table(const uint64_t ts) const;
+
+  /* with max_mapped_chunks (or behind the clean frontier with dvr_dir), map
+   * the chunks that a client sent the chunk of vformat_idx at vts (or
+   * aformat_idx at ats) is likely to be sent next, i.e., those of the
+   * neighboring formats in the next prefetch_chunks, and have the kernel
+   * read them in the background */
+  void prefetch_video(const uint64_t vts, const size_t vformat_idx) const;
+  void prefetch_audio(const uint64_t ats, const size_t aformat_idx) const;
 
   unsigned int timescale() const { return timescale_; }
   unsigned int vduration() const { return vduration_; }
@@ -63,16 +173,47 @@ public:
   /* return the live edge that allow for presentation_delay_s */
   std::optional<uint64_t> live_edge() const;
 
+  /* called on live whenever vready_frontier() (video) or aready_frontier()
+   * advances, once per batch of ready chunks, e.g., to serve the clients
+   * waiting at the live edge for the chunks up to frontier */
+  using ReadyCallback = std::function<void(const bool video,
+                                           const uint64_t frontier)>;
+  void set_ready_callback(const ReadyCallback & callback)
+  {
+    ready_callback_ = callback;
+  }
+
+  /* called with max_mapped_chunks whenever a chunk is unmapped, to release
+   * what else holds its mapping (e.g., the frames cached of it), without
+   * which the chunk would stay mapped */
+  using UnmapCallback = std::function<void(const bool video,
+                                           const uint64_t ts,
+                                           const size_t format_idx)>;
+  void set_unmap_callback(const UnmapCallback & callback)
+  {
+    unmap_callback_ = callback;
+  }
+
   /* return the frontier of contigous range of ready chunks */
   std::optional<uint64_t> vready_frontier() const { return vready_frontier_; }
+
+  /* when (in us) vready_frontier() advanced over the video chunk at ts, on
+   * live and for the last VREADY_TIMES_KEPT chunks only */
+  std::optional<uint64_t> vready_us(const uint64_t ts) const;
   std::optional<uint64_t> aready_frontier() const { return aready_frontier_; }
 
   /* return largest timestamps that have been cleaned */
   std::optional<uint64_t> vclean_frontier() const;
   std::optional<uint64_t> aclean_frontier() const;
 
+  /* with prefault_chunks, drop the pages of the chunks before vts (and the
+   * audio before it), e.g., those behind the slowest client; the chunks stay
+   * mapped and fault in again if read */
+  void release_chunks_before(const uint64_t vts);
+
 private:
   bool live_ {false};
+  bool dormant_ {false};
   std::string name_ {};
 
   /* set by enforce_moving_live_edge */
@@ -83,11 +224,71 @@ private:
   fs::path input_path_ {};
   std::vector<VideoFormat> vformats_ {};
   std::vector<AudioFormat> aformats_ {};
-  std::map<VideoFormat, mmap_t> vinit_ {};
-  std::map<AudioFormat, mmap_t> ainit_ {};
-  std::map<uint64_t, std::map<VideoFormat, mmap_t>> vdata_ {};
-  std::map<uint64_t, std::map<VideoFormat, double>> vssim_ {};
-  std::map<uint64_t, std::map<AudioFormat, mmap_t>> adata_ {};
+  std::vector<std::string> vformat_strings_ {};
+  std::vector<std::string> aformat_strings_ {};
+
+  /* see vformats_for_screen(); the resolutions of vformats_ in ascending
+   * order (of height, then width), each with the formats that fit in it,
+   * or none without screen_pruning */
+  struct ScreenClass
+  {
+    int width;
+    int height;
+    std::vector<size_t> vformats;
+  };
+
+  std::vector<ScreenClass> screen_classes_ {};
+  std::vector<size_t> all_vformats_ {};
+  double screen_pixel_ratio_ {1};
+
+  /* the init segments of the formats, indexed like vformats_ (aformats_) */
+  std::vector<std::optional<mmap_t>> vinit_ {};
+  std::vector<std::optional<mmap_t>> ainit_ {};
+
+  /* the hashes of the contents of the init segments: formats with identical
+   * init segments (e.g., that differ only in CRF) share a key, and the key of
+   * a format changes only with its init segment */
+  std::vector<std::optional<size_t>> vinit_key_ {};
+  std::vector<std::optional<size_t>> ainit_key_ {};
+
+  /* a chunk in mapped_chunks_ */
+  struct MappedChunk
+  {
+    bool video;
+    uint64_t ts;
+    size_t format_idx;
+  };
+
+  using MappedChunkIt = std::list<MappedChunk>::iterator;
+
+  /* media chunk and SSIM of a video format at a timestamp */
+  struct VideoEntry
+  {
+    /* unmapped (e.g., restored from a snapshot or evicted from
+     * mapped_chunks_): data holds only the size until the next read */
+    mutable std::optional<mmap_t> data {};
+    mutable bool unmapped {false};
+    mutable std::optional<MappedChunkIt> mapped_it {};
+    std::optional<double> ssim {};
+  };
+
+  struct AudioEntry
+  {
+    mutable std::optional<mmap_t> data {};
+    mutable bool unmapped {false};
+    mutable std::optional<MappedChunkIt> mapped_it {};
+  };
+
+  /* parts of a VideoEntry that arrive separately (see ChunkIndex) */
+  static constexpr unsigned int VDATA = 0;
+  static constexpr unsigned int VSSIM = 1;
+
+  ChunkIndex<VideoEntry> vchunks_ {};
+  ChunkIndex<AudioEntry> achunks_ {};
+
+  /* see vformat_table() and aformat_table(); erased along with the chunks */
+  ChunkIndex<VideoFormatInfo> vformat_tables_ {};
+  ChunkIndex<AudioFormatInfo> aformat_tables_ {};
 
   unsigned int timescale_ {};
   unsigned int vduration_ {};
@@ -100,15 +301,113 @@ private:
   std::optional<uint64_t> vready_frontier_ {};
   std::optional<uint64_t> aready_frontier_ {};
 
+  /* (ts, us) of the chunks that the video frontier has advanced over,
+   * indexed by chunk number */
+  static constexpr size_t VREADY_TIMES_KEPT = 64;
+  std::array<std::pair<uint64_t, uint64_t>, VREADY_TIMES_KEPT> vready_us_ {};
+
   /* clean window in unit of video chunks */
   std::optional<unsigned int> clean_window_chunk_ {};
   std::optional<uint64_t> vclean_frontier_ {};
   std::optional<uint64_t> aclean_frontier_ {};
 
+  /* populate the mappings of the chunks that go ready on live, so that the
+   * first client to be sent a chunk does not take its page faults */
+  bool prefault_chunks_ {false};
+  std::optional<uint64_t> vreleased_until_ {};
+  std::optional<uint64_t> areleased_until_ {};
+
+  /* SSIMs are tailed from the log written by ssim_calculator if configured
+   * with ssim_log, instead of being read from a .ssim file per chunk */
+  std::unique_ptr<SSIMLog> ssim_log_ {nullptr};
+
+  ReadyCallback ready_callback_ {};
+  UnmapCallback unmap_callback_ {};
+
+  /* timestamps of the chunks and SSIMs added since commit_ready_chunks() */
+  std::set<uint64_t> pending_vts_ {};
+  std::set<uint64_t> pending_ats_ {};
+
+  /* shared index of the ready chunks, maintained by media_indexer */
+  std::optional<fs::path> index_path_ {};
+  std::unique_ptr<MediaIndex> index_ {nullptr};
+  std::optional<uint64_t> index_generation_ {};
+  uint64_t last_index_check_ms_ {0};
+
+  /* timestamps before these have been synced completely */
+  std::optional<uint64_t> vsynced_until_ {};
+  std::optional<uint64_t> asynced_until_ {};
+
   /* configured only if live_ == false */
   std::optional<uint64_t> init_vts_ {};
   bool repeat_ {};
 
+  /* with max_mapped_chunks, the chunks of a static channel are mapped on
+   * first read and at most max_mapped_chunks_ stay mapped, the least
+   * recently read first to be unmapped; 0 means no limit */
+  size_t max_mapped_chunks_ {0};
+  unsigned int prefetch_chunks_ {DEFAULT_PREFETCH_CHUNKS};
+  mutable std::list<MappedChunk> mapped_chunks_ {};  /* most recent first */
+
+  /* with pack_files, the chunks of a static channel are read from a single
+   * ready/<format>.pack per format (see pack_chunks) */
+  bool pack_files_ {false};
+
+  /* with segment_minutes, the chunks are appended by the fragmenters to
+   * segments ready/<format>/<ts>.pack that span segment_span_ each, which
+   * are refreshed on every append rather than a chunk mapped per file */
+  uint64_t segment_span_ {0};
+  std::map<fs::path, ChunkPack> vsegments_ {};
+  std::map<fs::path, ChunkPack> asegments_ {};
+
+  /* with dvr_dir on live, the chunks behind the clean frontiers are read
+   * from the archive that windowcleaner appends them to as it cleans them,
+   * so that a client that falls behind the clean window is not reinited */
+  std::unique_ptr<DVRArchive> dvr_ {nullptr};
+
+  /* the format tables of the archived timestamps read most recently */
+  static constexpr size_t DVR_TABLES_KEPT = 256;
+  mutable std::map<uint64_t, std::vector<VideoFormatInfo>>
+    dvr_vformat_tables_ {};
+  mutable std::map<uint64_t, std::vector<AudioFormatInfo>>
+    dvr_aformat_tables_ {};
+
+  /* ts has been cleaned from the video (or audio) index, but the channel
+   * has an archive to read it from */
+  bool in_dvr(const bool video, const uint64_t ts) const;
+
+  /* the format table of an archived timestamp; nullptr if any of its
+   * chunks (or SSIMs) has not been archived */
+  const std::vector<VideoFormatInfo> * dvr_vformat_table(
+    const uint64_t ts) const;
+  const std::vector<AudioFormatInfo> * dvr_aformat_table(
+    const uint64_t ts) const;
+
+  /* an archived chunk; throws std::out_of_range if it is absent */
+  const mmap_t & dvr_chunk(const std::string & dir, const std::string & ext,
+                           const uint64_t ts) const;
+
+  /* map the chunk of entry if it is unmapped and mark it as recently used */
+  template<class Entry>
+  void map_chunk(const Entry & entry, const bool video, const uint64_t ts,
+                 const size_t format_idx) const;
+
+  /* map_chunk() and read the chunk ahead if it was unmapped */
+  template<class Entry>
+  void prefetch_chunk(const Entry & entry, const bool video,
+                      const uint64_t ts, const size_t format_idx) const;
+
+  void read_pack_files();
+
+  /* insert the chunks of pack from the first one */
+  void insert_pack_chunks(const ChunkPack & pack, const size_t first,
+                          const bool video, const size_t format_idx);
+
+  /* read the chunks appended to the segment at filepath since it was last
+   * read */
+  void read_segment(const fs::path & filepath, const bool video,
+                    const size_t format_idx);
+
   bool vready(const uint64_t ts) const;
   bool aready(const uint64_t ts) const;
 
@@ -118,18 +417,61 @@ private:
   bool is_valid_vts(const uint64_t ts) const { return ts % vduration_ == 0; }
   bool is_valid_ats(const uint64_t ts) const { return ts % aduration_ == 0; }
 
-  void do_mmap_video(const fs::path & filepath, const VideoFormat & vf);
+  /* is_new: filepath has just been moved into ready/ */
+  void do_mmap_video(const fs::path & filepath, const size_t vf_idx,
+                     const bool is_new = false);
   void munmap_video(const uint64_t ts);
   void mmap_video_files(Inotify & inotify);
 
-  void do_mmap_audio(const fs::path & filepath, const AudioFormat & af);
+  void do_mmap_audio(const fs::path & filepath, const size_t af_idx,
+                     const bool is_new = false);
   void munmap_audio(const uint64_t ts);
   void mmap_audio_files(Inotify & inotify);
 
-  void do_read_ssim(const fs::path & filepath, const VideoFormat & vf);
+  void do_read_ssim(const fs::path & filepath, const size_t vf_idx);
   void load_ssim_files(Inotify & inotify);
+  void tail_ssim_log(Inotify & inotify);
+  void read_ssim_log();
+
+  /* after an inotify overflow, process the files in dir that it missed:
+   * the chunks (named <ts><chunk_ext>) whose part of format_idx has not
+   * arrived in the index of video or audio, unless the index has been
+   * cleaned past them, and any other file */
+  void rescan_dir(const fs::path & dir, const std::string & chunk_ext,
+                  const bool video, const size_t format_idx,
+                  const unsigned int part,
+                  const std::function<void(const fs::path &)> & process);
+
+  fs::path vchunk_path(const size_t vf_idx, const uint64_t ts) const;
+  fs::path achunk_path(const size_t af_idx, const uint64_t ts) const;
+
+  /* (path relative to input_path_, mtime in ns, size) of the directories
+   * and files whose changes invalidate a snapshot */
+  using SnapshotStamp = std::tuple<std::string, int64_t, uint64_t>;
+  std::vector<SnapshotStamp> snapshot_stamps(const bool ssim_log) const;
+
+  /* the lines that a snapshot starts with, which must match to restore it */
+  std::string snapshot_header(const std::vector<SnapshotStamp> & stamps) const;
+
+  /* return false if the snapshot is absent, stale or for another config */
+  bool load_snapshot(const fs::path & snapshot_path,
+                     const std::vector<SnapshotStamp> & stamps);
+  void write_snapshot(const fs::path & snapshot_path,
+                      const std::vector<SnapshotStamp> & stamps) const;
+
+  /* map the index at index_path_ if it is not mapped or has been replaced;
+   * return whether the index is mapped */
+  bool attach_index();
+  void sync_index_video();
+  void sync_index_audio();
+
+  /* advance the ready frontiers over the pending timestamps and unmap the
+   * chunks that have fallen out of the clean window */
+  void commit_ready_chunks();
 
   void update_vready_frontier(const uint64_t vts);
+  void build_vformat_table(const uint64_t vts);
+  void build_aformat_table(const uint64_t ats);
   void update_aready_frontier(const uint64_t ats);
 };
 
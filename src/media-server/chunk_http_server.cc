@@ -0,0 +1,324 @@
+#include "chunk_http_server.hh"
+
+#include <iostream>
+#include <algorithm>
+#include <vector>
+
+#include "tokenize.hh"
+#include "exception.hh"
+#include "metrics.hh"
+
+using namespace std;
+using namespace PollerShortNames;
+
+static const string IMMUTABLE = "public, max-age=31536000, immutable";
+
+ChunkHTTPServer::ChunkHTTPServer(Poller & poller, const Address & address,
+                                 ChannelLookup lookup)
+  : poller_(poller), lookup_(move(lookup))
+{
+  listener_.set_blocking(false);
+  listener_.set_reuseaddr();
+  listener_.set_reuseport();
+  listener_.bind(address);
+  listener_.listen();
+
+  poller_.add_action(Poller::Action(listener_, Direction::In,
+    [this]()->Result {
+      TCPSocket client = listener_.accept();
+      client.set_blocking(false);
+
+      add_connection(move(client));
+      return ResultType::Continue;
+    }
+  ).named("http_listener"));
+}
+
+void ChunkHTTPServer::add_connection(TCPSocket && sock)
+{
+  const uint64_t conn_id = last_connection_id_++;
+  Connection & conn = connections_.emplace(conn_id, move(sock)).first->second;
+
+  poller_.add_action(Poller::Action(conn.socket, Direction::In,
+    [this, &conn, conn_id]()->Result {
+      IOBuffer buffer;
+      const string_view data = conn.socket.read(buffer);
+      if (data.empty()) {
+        close_connection(conn_id);
+        return ResultType::CancelAll;
+      }
+
+      try {
+        conn.parser.parse(data);
+      } catch (const exception & e) {
+        print_exception("chunk_http_server", e);
+        close_connection(conn_id);
+        return ResultType::CancelAll;
+      }
+
+      while (not conn.parser.empty()) {
+        handle_request(conn, conn.parser.front());
+        conn.parser.pop();
+      }
+
+      return ResultType::Continue;
+    },
+    [&conn]()->bool {
+      /* stop reading requests after "Connection: close" */
+      return not conn.close_after_send;
+    }
+  ).named("http_connection_in"));
+
+  poller_.add_action(Poller::Action(conn.socket, Direction::Out,
+    [this, &conn, conn_id]()->Result {
+      write(conn);
+
+      if (conn.send_buffer.empty() and conn.close_after_send) {
+        close_connection(conn_id);
+        return ResultType::CancelAll;
+      }
+
+      return ResultType::Continue;
+    },
+    [&conn]()->bool {
+      return not conn.send_buffer.empty();
+    }
+  ).named("http_connection_out"));
+}
+
+void ChunkHTTPServer::close_connection(const uint64_t connection_id)
+{
+  /* the connection is erased after the poll, as its socket is still
+   * referenced by the poller until then */
+  closed_connections_.insert(connection_id);
+}
+
+void ChunkHTTPServer::erase_closed()
+{
+  for (const uint64_t conn_id : closed_connections_) {
+    connections_.erase(conn_id);
+  }
+
+  closed_connections_.clear();
+}
+
+/* parse "bytes=<first>-<last>", "bytes=<first>-" or "bytes=-<suffix>" of a
+ * body of size into [first, last]; nullopt if the range is unsatisfiable */
+static optional<pair<size_t, size_t>> parse_range(const string & range,
+                                                  const size_t size)
+{
+  static const string PREFIX = "bytes=";
+  if (range.compare(0, PREFIX.size(), PREFIX) != 0 or size == 0) {
+    return nullopt;
+  }
+
+  const string spec = range.substr(PREFIX.size());
+  const auto dash = spec.find('-');
+  if (dash == string::npos) {
+    return nullopt;
+  }
+
+  const string first = spec.substr(0, dash);
+  const string last = spec.substr(dash + 1);
+
+  try {
+    if (first.empty()) {
+      /* the last bytes */
+      const size_t suffix = min<size_t>(stoull(last), size);
+      if (suffix == 0) {
+        return nullopt;
+      }
+
+      return make_pair(size - suffix, size - 1);
+    }
+
+    const size_t first_byte = stoull(first);
+    if (first_byte >= size) {
+      return nullopt;
+    }
+
+    const size_t last_byte = last.empty() ? size - 1
+                             : min<size_t>(stoull(last), size - 1);
+    if (last_byte < first_byte) {
+      return nullopt;
+    }
+
+    return make_pair(first_byte, last_byte);
+  } catch (const exception &) {
+    return nullopt;
+  }
+}
+
+void ChunkHTTPServer::handle_request(Connection & conn,
+                                     const HTTPRequest & request)
+{
+  const auto request_line = split(request.first_line(), " ");
+  const bool head = request.is_head();
+
+  Response response;
+  if (request_line.size() != 3) {
+    response.status = "400 Bad Request";
+  } else if (request_line[0] != "GET" and not head) {
+    response.status = "405 Method Not Allowed";
+    response.headers = "Allow: GET, HEAD\r\n";
+  } else {
+    /* ignore the query string */
+    response = get_chunk(request_line[1].substr(0, request_line[1].find('?')));
+  }
+
+  /* keep the connection alive unless the client asks otherwise */
+  const bool keep_alive =
+    request_line.size() == 3 and request_line[2] == "HTTP/1.1" and
+    not (request.has_header("Connection") and
+         HTTPMessage::equivalent_strings(request.get_header_value("Connection"),
+                                         "close"));
+
+  if (not response.chunk) {
+    response.headers += "Cache-Control: no-store\r\n";
+  }
+
+  /* the whole chunk, or a single byte range of it */
+  optional<SharedBuffer> body;
+  if (response.chunk) {
+    const auto & [data, size] = *response.chunk;
+    size_t first = 0, length = size;
+
+    if (request.has_header("Range")) {
+      const auto range = parse_range(request.get_header_value("Range"), size);
+
+      if (range) {
+        first = range->first;
+        length = range->second - range->first + 1;
+        response.status = "206 Partial Content";
+        response.headers += "Content-Range: bytes " + to_string(first) + "-"
+                            + to_string(range->second) + "/"
+                            + to_string(size) + "\r\n";
+      } else {
+        response.status = "416 Range Not Satisfiable";
+        response.headers += "Content-Range: bytes */" + to_string(size)
+                            + "\r\n";
+        length = 0;
+      }
+    }
+
+    body = SharedBuffer(data, data.get() + first, length);
+  }
+
+  const size_t body_size = body ? body->size() : 0;
+
+  string header = "HTTP/1.1 " + response.status + "\r\n" + response.headers
+    + "Content-Length: " + to_string(body_size) + "\r\n"
+    + "Access-Control-Allow-Origin: *\r\n"
+    + (keep_alive ? "" : "Connection: close\r\n") + "\r\n";
+
+  conn.send_buffer.emplace_back(move(header));
+  if (body_size > 0 and not head) {
+    conn.send_buffer.emplace_back(move(*body));
+    Metrics::record("http_chunk_bytes", body_size);
+  }
+
+  if (not keep_alive) {
+    conn.close_after_send = true;
+  }
+}
+
+ChunkHTTPServer::Response ChunkHTTPServer::get_chunk(const string & path) const
+{
+  Response response;
+
+  /* "", channel, "video" or "audio", format, "init" or ts */
+  const auto parts = split(path, "/");
+  if (parts.size() != 5 or not parts[0].empty() or
+      (parts[2] != "video" and parts[2] != "audio")) {
+    return response;
+  }
+
+  const auto channel = lookup_(parts[1]);
+  if (not channel or not channel->ready_to_serve()) {
+    return response;
+  }
+
+  const bool video = parts[2] == "video";
+  const bool init = parts[4] == "init";
+
+  try {
+    optional<uint64_t> ts;
+    if (not init) {
+      size_t pos = 0;
+      ts = stoull(parts[4], &pos);
+      if (pos != parts[4].size()) {
+        return response;
+      }
+
+      if (not (video ? channel->vready_to_serve(*ts)
+                     : channel->aready_to_serve(*ts))) {
+        return response;
+      }
+    }
+
+    mmap_t chunk;
+    if (video) {
+      const VideoFormat format {parts[3]};
+      chunk = init ? channel->vinit(format) : channel->vdata(format, *ts);
+    } else {
+      const AudioFormat format {parts[3]};
+      chunk = init ? channel->ainit(format) : channel->adata(format, *ts);
+    }
+
+    response.chunk = chunk;
+  } catch (const exception &) {
+    /* an unknown format or an absent chunk */
+    return response;
+  }
+
+  response.status = "200 OK";
+  response.headers =
+    string("Content-Type: ") + (video ? "video/mp4" : "audio/webm") + "\r\n"
+    + "Accept-Ranges: bytes\r\n"
+    + "Cache-Control: " + (channel->live() ?
+        "public, max-age=" + to_string(LIVE_MAX_AGE_S) : IMMUTABLE) + "\r\n";
+
+  return response;
+}
+
+void ChunkHTTPServer::write(Connection & conn)
+{
+  /* max number of buffers to gather into a single writev */
+  static constexpr size_t MAX_WRITEV_BUFFERS = 64;
+
+  while (not conn.send_buffer.empty()) {
+    vector<string_view> buffers;
+    for (auto it = conn.send_buffer.cbegin();
+         it != conn.send_buffer.cend() and buffers.size() < MAX_WRITEV_BUFFERS;
+         it++) {
+      buffers.emplace_back(it->view());
+    }
+    buffers.front().remove_prefix(conn.send_buffer_offset);
+
+    size_t total_bytes = 0;
+    for (const auto & buffer : buffers) {
+      total_bytes += buffer.size();
+    }
+
+    /* socket might be unable to write all */
+    size_t bytes_written = conn.socket.writev(buffers);
+    const bool write_all = (bytes_written == total_bytes);
+
+    while (bytes_written > 0) {
+      const size_t remaining =
+        conn.send_buffer.front().size() - conn.send_buffer_offset;
+      if (bytes_written < remaining) {
+        conn.send_buffer_offset += bytes_written;
+        break;
+      }
+
+      bytes_written -= remaining;
+      conn.send_buffer_offset = 0;
+      conn.send_buffer.pop_front();
+    }
+
+    if (not write_all) {
+      break;
+    }
+  }
+}
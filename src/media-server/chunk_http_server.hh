@@ -0,0 +1,97 @@
+#ifndef CHUNK_HTTP_SERVER_HH
+#define CHUNK_HTTP_SERVER_HH
+
+#include <cstdint>
+#include <string>
+#include <deque>
+#include <map>
+#include <set>
+#include <memory>
+#include <optional>
+#include <functional>
+
+#include "poller.hh"
+#include "socket.hh"
+#include "address.hh"
+#include "shared_buffer.hh"
+#include "http_request_parser.hh"
+#include "channel.hh"
+
+/* Serves the media chunks of the channels over plain HTTP/1.1, so that an
+ * HTTP CDN can cache them in front of the media server, while the ABR
+ * decisions and acks stay on the WebSocket connection:
+ *
+ *   GET /<channel>/video/<format>/init    GET /<channel>/video/<format>/<ts>
+ *   GET /<channel>/audio/<format>/init    GET /<channel>/audio/<format>/<ts>
+ *
+ * e.g., /cbs/video/1280x720-20/180180. Only the chunks ready to serve are
+ * found; a chunk never changes once ready, so it is served as cacheable
+ * (immutable on a static channel), along with a single byte range if one is
+ * requested. Connections are kept alive, and responses are written from the
+ * channel's mapped chunks without being copied. The server runs on the
+ * poller of an event-loop thread; with SO_REUSEPORT, the threads share the
+ * port. */
+class ChunkHTTPServer
+{
+public:
+  /* the channel named so, or nullptr */
+  using ChannelLookup =
+    std::function<std::shared_ptr<Channel>(const std::string & name)>;
+
+  /* cache lifetime of the chunks of a live channel, which are cleaned soon */
+  static constexpr unsigned int LIVE_MAX_AGE_S = 60;
+
+  ChunkHTTPServer(Poller & poller, const Address & address,
+                  ChannelLookup lookup);
+
+  /* forget the connections closed during the last poll; call after each
+   * poll (e.g., from WSServer's loop callback) */
+  void erase_closed();
+
+  size_t num_connections() const { return connections_.size(); }
+
+private:
+  struct Connection
+  {
+    TCPSocket socket;
+    HTTPRequestParser parser {};
+
+    /* responses waiting to be written */
+    std::deque<SharedBuffer> send_buffer {};
+    size_t send_buffer_offset {0};
+
+    /* close once send_buffer is written (e.g., "Connection: close") */
+    bool close_after_send {false};
+
+    Connection(TCPSocket && sock) : socket(std::move(sock)) {}
+  };
+
+  /* a response, whose body is (a range of) a mapped chunk */
+  struct Response
+  {
+    std::string status {"404 Not Found"};
+    std::string headers {};
+    std::optional<mmap_t> chunk {};
+  };
+
+  Poller & poller_;
+  TCPSocket listener_ {};
+  ChannelLookup lookup_;
+
+  uint64_t last_connection_id_ {0};
+  std::map<uint64_t, Connection> connections_ {};
+  std::set<uint64_t> closed_connections_ {};
+
+  void add_connection(TCPSocket && sock);
+  void close_connection(const uint64_t connection_id);
+
+  /* queue the response to request on conn */
+  void handle_request(Connection & conn, const HTTPRequest & request);
+
+  /* the response to GET path, without the range applied */
+  Response get_chunk(const std::string & path) const;
+
+  void write(Connection & conn);
+};
+
+#endif /* CHUNK_HTTP_SERVER_HH */
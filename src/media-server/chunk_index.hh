@@ -0,0 +1,277 @@
+#ifndef CHUNK_INDEX_HH
+#define CHUNK_INDEX_HH
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+#include <deque>
+#include <map>
+#include <algorithm>
+#include <stdexcept>
+
+/* Index of the chunks of a channel. Chunk timestamps are multiples of the
+ * chunk duration, so slot i holds the timestamp (base_ + i) * duration_ and
+ * each slot is a contiguous array of entries in the order of the formats;
+ * looking up a chunk is arithmetic rather than two tree searches.
+ *
+ * An entry might consist of parts that arrive separately (e.g., a video
+ * chunk and its SSIM); each slot keeps a bitmask of the arrived parts, so
+ * that whether a timestamp is complete is a single comparison.
+ *
+ * The slots only grow by up to MAX_GAP_SLOTS at a time: a timestamp
+ * farther from them (e.g., of a stray file, or after the origin of the
+ * timestamps was reset) is kept in a sparse map instead, until the slots
+ * reach it, so that it does not allocate a slot per chunk in between. */
+template<class Entry>
+class ChunkIndex
+{
+public:
+  ChunkIndex() {}
+  ChunkIndex(const unsigned int duration, const size_t num_formats,
+             const unsigned int num_parts = 1)
+    : duration_(duration), num_formats_(num_formats)
+  {
+    const size_t num_bits = num_formats * num_parts;
+    if (num_bits > 64) {
+      throw std::runtime_error("ChunkIndex: too many formats");
+    }
+
+    complete_mask_ = num_bits == 64 ? ~uint64_t(0)
+                                    : (uint64_t(1) << num_bits) - 1;
+  }
+
+  static constexpr uint64_t MAX_GAP_SLOTS = 1 << 16;
+
+  /* entries of all formats at ts; nullptr if no entry has been inserted */
+  const std::vector<Entry> * find(const uint64_t ts) const
+  {
+    if (ts % duration_ != 0) {
+      return nullptr;
+    }
+
+    const uint64_t idx = ts / duration_;
+    if (idx < base_ or idx - base_ >= slots_.size()) {
+      const Outlier * outlier = find_outlier(idx);
+      return outlier ? &outlier->entries : nullptr;
+    }
+
+    const auto & slot = slots_[idx - base_];
+    return slot.empty() ? nullptr : &slot;
+  }
+
+  /* entry of format_idx at ts; throws std::out_of_range if absent */
+  const Entry & at(const uint64_t ts, const size_t format_idx) const
+  {
+    const auto * slot = find(ts);
+    if (not slot) {
+      throw std::out_of_range("ChunkIndex: no chunk at the timestamp");
+    }
+
+    return slot->at(format_idx);
+  }
+
+  /* entry of format_idx at ts, which is inserted if absent */
+  Entry & insert(const uint64_t ts, const size_t format_idx)
+  {
+    if (ts % duration_ != 0) {
+      throw std::runtime_error("ChunkIndex: invalid timestamp");
+    }
+
+    const uint64_t idx = ts / duration_;
+    std::vector<Entry> & slot = locate(idx).first;
+    if (slot.empty()) {
+      slot.resize(num_formats_);
+    }
+
+    return slot.at(format_idx);
+  }
+
+  /* entry of format_idx at ts, which is inserted if absent, and mark part
+   * of it as arrived */
+  Entry & insert_part(const uint64_t ts, const size_t format_idx,
+                      const unsigned int part = 0)
+  {
+    Entry & entry = insert(ts, format_idx);
+    locate(ts / duration_).second |=
+      uint64_t(1) << (part * num_formats_ + format_idx);
+    return entry;
+  }
+
+  /* bit part * num_formats + format_idx: the part of format_idx at ts has
+   * arrived (see insert_part()) */
+  uint64_t arrived(const uint64_t ts) const
+  {
+    if (ts % duration_ != 0) {
+      return 0;
+    }
+
+    const uint64_t idx = ts / duration_;
+    if (idx < base_ or idx - base_ >= slots_.size()) {
+      const Outlier * outlier = find_outlier(idx);
+      return outlier ? outlier->arrived : 0;
+    }
+
+    return arrived_[idx - base_];
+  }
+
+  /* all the parts of all the formats at ts have arrived */
+  bool complete(const uint64_t ts) const
+  {
+    return num_formats_ > 0 and arrived(ts) == complete_mask_;
+  }
+
+  /* smallest timestamp that has entries */
+  std::optional<uint64_t> first_ts() const
+  {
+    std::optional<uint64_t> first_idx;
+    for (size_t i = 0; i < slots_.size(); i++) {
+      if (not slots_[i].empty()) {
+        first_idx = base_ + i;
+        break;
+      }
+    }
+
+    if (not outliers_.empty() and
+        (not first_idx or outliers_.begin()->first < *first_idx)) {
+      first_idx = outliers_.begin()->first;
+    }
+
+    if (not first_idx) {
+      return std::nullopt;
+    }
+
+    return *first_idx * duration_;
+  }
+
+  /* call f(ts, entries) on each timestamp that has entries, in order */
+  template<class F>
+  void for_each(F && f) const
+  {
+    auto outlier = outliers_.begin();
+
+    for (size_t i = 0; i < slots_.size(); i++) {
+      for (; outlier != outliers_.end() and outlier->first < base_ + i;
+           outlier++) {
+        f(outlier->first * duration_, outlier->second.entries);
+      }
+
+      if (not slots_[i].empty()) {
+        f((base_ + i) * duration_, slots_[i]);
+      }
+    }
+
+    for (; outlier != outliers_.end(); outlier++) {
+      f(outlier->first * duration_, outlier->second.entries);
+    }
+  }
+
+  /* erase the timestamps <= ts; return the largest erased timestamp */
+  std::optional<uint64_t> erase_until(const uint64_t ts)
+  {
+    std::optional<uint64_t> erased_ts;
+
+    while (not slots_.empty() and base_ * duration_ <= ts) {
+      if (not slots_.front().empty()) {
+        erased_ts = base_ * duration_;
+      }
+
+      slots_.pop_front();
+      arrived_.pop_front();
+      base_++;
+    }
+
+    while (not outliers_.empty() and
+           outliers_.begin()->first * duration_ <= ts) {
+      erased_ts = std::max(erased_ts.value_or(0),
+                           outliers_.begin()->first * duration_);
+      outliers_.erase(outliers_.begin());
+    }
+
+    return erased_ts;
+  }
+
+  /* number of timestamps kept apart from the slots */
+  size_t num_outliers() const { return outliers_.size(); }
+
+private:
+  unsigned int duration_ {1};
+  size_t num_formats_ {0};
+
+  /* slots_[i] holds the entries at timestamp (base_ + i) * duration_;
+   * an empty slot means that no entry has been inserted */
+  uint64_t base_ {0};
+  std::deque<std::vector<Entry>> slots_ {};
+
+  /* arrived_[i]: bitmask of the arrived parts in slots_[i] */
+  std::deque<uint64_t> arrived_ {};
+  uint64_t complete_mask_ {0};
+
+  /* the timestamps beyond MAX_GAP_SLOTS of the slots; key: ts / duration_ */
+  struct Outlier
+  {
+    std::vector<Entry> entries {};
+    uint64_t arrived {0};
+  };
+
+  std::map<uint64_t, Outlier> outliers_ {};
+
+  const Outlier * find_outlier(const uint64_t idx) const
+  {
+    if (outliers_.empty()) {
+      return nullptr;
+    }
+
+    const auto it = outliers_.find(idx);
+    return it == outliers_.end() ? nullptr : &it->second;
+  }
+
+  /* move the outliers in [first, last) into the slots, which cover them */
+  void absorb_outliers(const uint64_t first, const uint64_t last)
+  {
+    auto it = outliers_.lower_bound(first);
+    while (it != outliers_.end() and it->first < last) {
+      slots_[it->first - base_] = std::move(it->second.entries);
+      arrived_[it->first - base_] = it->second.arrived;
+      it = outliers_.erase(it);
+    }
+  }
+
+  /* the entries and the arrived parts at idx, whose slot (or outlier) is
+   * added if absent */
+  std::pair<std::vector<Entry> &, uint64_t &> locate(const uint64_t idx)
+  {
+    const uint64_t end = base_ + slots_.size();
+
+    if (not slots_.empty() and idx >= base_ and idx < end) {
+      return {slots_[idx - base_], arrived_[idx - base_]};
+    }
+
+    const auto outlier = outliers_.find(idx);
+    if (outlier != outliers_.end()) {
+      return {outlier->second.entries, outlier->second.arrived};
+    }
+
+    if (slots_.empty()) {
+      base_ = idx;
+      slots_.resize(1);
+      arrived_.resize(1);
+    } else if (idx < base_ and base_ - idx <= MAX_GAP_SLOTS) {
+      const uint64_t old_base = base_;
+      slots_.insert(slots_.begin(), old_base - idx, std::vector<Entry>());
+      arrived_.insert(arrived_.begin(), old_base - idx, 0);
+      base_ = idx;
+      absorb_outliers(idx, old_base);
+    } else if (idx >= end and idx - end < MAX_GAP_SLOTS) {
+      slots_.resize(idx - base_ + 1);
+      arrived_.resize(idx - base_ + 1);
+      absorb_outliers(end, idx + 1);
+    } else {
+      Outlier & added = outliers_[idx];
+      return {added.entries, added.arrived};
+    }
+
+    return {slots_[idx - base_], arrived_[idx - base_]};
+  }
+};
+
+#endif /* CHUNK_INDEX_HH */
@@ -25,6 +25,11 @@ ClientInitMsg::ClientInitMsg(const json & msg)
   if (it != msg.end()) {
     next_ats = it->get<uint64_t>();
   }
+
+  it = msg.find("binaryVersion");
+  if (it != msg.end()) {
+    binary_version = it->get<unsigned int>();
+  }
 }
 
 ClientInfoMsg::ClientInfoMsg(const json & msg)
@@ -59,6 +64,44 @@ ClientInfoMsg::ClientInfoMsg(const json & msg)
   }
 }
 
+ClientInfoMsg::ClientInfoMsg(BinaryReader & msg)
+{
+  init_id = msg.get_u32();
+
+  video_buffer = msg.get_double();
+  audio_buffer = msg.get_double();
+  cum_rebuffer = msg.get_double();
+
+  switch (msg.get_u8()) {
+  case 0:
+    event = ClientInfoMsg::Event::Timer;
+    event_str = "timer";
+    break;
+  case 1:
+    event = ClientInfoMsg::Event::Startup;
+    event_str = "startup";
+    break;
+  case 2:
+    event = ClientInfoMsg::Event::Rebuffer;
+    event_str = "rebuffer";
+    break;
+  case 3:
+    event = ClientInfoMsg::Event::Play;
+    event_str = "play";
+    break;
+  default:
+    throw runtime_error("Invalid client info event");
+  }
+
+  /* 0 if the screen sizes have not changed */
+  const uint16_t width = msg.get_u16();
+  const uint16_t height = msg.get_u16();
+  if (width > 0 and height > 0) {
+    screen_width = width;
+    screen_height = height;
+  }
+}
+
 ClientAckMsg::ClientAckMsg(const json & msg)
 {
   init_id = msg.at("initId").get<unsigned int>();
@@ -76,19 +119,72 @@ ClientAckMsg::ClientAckMsg(const json & msg)
   cum_rebuffer = msg.at("cumRebuffer").get<double>();
 }
 
+ClientAckMsg::ClientAckMsg(BinaryReader & msg)
+{
+  init_id = msg.get_u32();
+
+  video_buffer = msg.get_double();
+  audio_buffer = msg.get_double();
+  cum_rebuffer = msg.get_double();
+
+  timestamp = msg.get_u64();
+  byte_offset = msg.get_u32();
+  byte_length = msg.get_u32();
+  total_byte_length = msg.get_u32();
+
+  channel = msg.get_str();
+  format = msg.get_str();
+}
+
 ClientVidAckMsg::ClientVidAckMsg(const json & msg)
   : ClientAckMsg(msg), video_format(format)
 {
   ssim = msg.at("ssim").get<double>();
 }
 
+ClientVidAckMsg::ClientVidAckMsg(BinaryReader & msg)
+  : ClientAckMsg(msg), video_format(format)
+{
+  ssim = msg.get_double();
+}
+
 ClientAudAckMsg::ClientAudAckMsg(const json & msg)
   : ClientAckMsg(msg), audio_format(format)
 {}
 
-ClientMsgParser::ClientMsgParser(const string & data)
-  : msg_(json::parse(data))
+ClientAudAckMsg::ClientAudAckMsg(BinaryReader & msg)
+  : ClientAckMsg(msg), audio_format(format)
+{}
+
+ClientMsgParser::ClientMsgParser(const string_view data)
 {
+  /* a JSON message starts with '{' */
+  if (not data.empty() and static_cast<uint8_t>(data[0]) == BINARY_MSG_VERSION) {
+    encoding_ = MsgEncoding::Binary;
+    binary_msg_ = data;
+
+    BinaryReader reader(binary_msg_);
+    reader.get_u8();  /* version */
+
+    switch (static_cast<BinaryMsgType>(reader.get_u8())) {
+    case BinaryMsgType::ClientInfo:
+      type_ = Type::Info;
+      break;
+    case BinaryMsgType::ClientVidAck:
+      type_ = Type::VideoAck;
+      break;
+    case BinaryMsgType::ClientAudAck:
+      type_ = Type::AudioAck;
+      break;
+    default:
+      /* client-init is always JSON */
+      throw runtime_error("Invalid binary client message type");
+    }
+
+    return;
+  }
+
+  msg_ = json::parse(data.begin(), data.end());
   const string & type_str = msg_.at("type").get<string>();
 
   if (type_str == "client-init") {
@@ -104,6 +200,14 @@ ClientMsgParser::ClientMsgParser(const string & data)
   }
 }
 
+BinaryReader ClientMsgParser::binary_reader() const
+{
+  BinaryReader reader(binary_msg_);
+  reader.get_u8();  /* version */
+  reader.get_u8();  /* type */
+  return reader;
+}
+
 ClientInitMsg ClientMsgParser::parse_client_init()
 {
   return ClientInitMsg(msg_);
@@ -111,15 +215,30 @@ ClientInitMsg ClientMsgParser::parse_client_init()
 
 ClientInfoMsg ClientMsgParser::parse_client_info()
 {
+  if (encoding_ == MsgEncoding::Binary) {
+    BinaryReader reader = binary_reader();
+    return ClientInfoMsg(reader);
+  }
+
   return ClientInfoMsg(msg_);
 }
 
 ClientVidAckMsg ClientMsgParser::parse_client_vidack()
 {
+  if (encoding_ == MsgEncoding::Binary) {
+    BinaryReader reader = binary_reader();
+    return ClientVidAckMsg(reader);
+  }
+
   return ClientVidAckMsg(msg_);
 }
 
 ClientAudAckMsg ClientMsgParser::parse_client_audack()
 {
+  if (encoding_ == MsgEncoding::Binary) {
+    BinaryReader reader = binary_reader();
+    return ClientAudAckMsg(reader);
+  }
+
   return ClientAudAckMsg(msg_);
 }
@@ -3,11 +3,13 @@
 
 #include <cstdint>
 #include <string>
+#include <string_view>
 #include <optional>
 #include <exception>
 #include <memory>
 
 #include "media_formats.hh"
+#include "binary_message.hh"
 #include "json.hpp"
 
 using json = nlohmann::json;
@@ -44,6 +46,9 @@ public:
   /* next timestamps to expect; used to resume connection only */
   std::optional<uint64_t> next_vts {};
   std::optional<uint64_t> next_ats {};
+
+  /* version of the binary encoding the client asks for (if any) */
+  std::optional<unsigned int> binary_version {};
 };
 
 class ClientInfoMsg : public ClientMsg
@@ -57,6 +62,7 @@ public:
   };
 
   ClientInfoMsg(const json & msg);
+  ClientInfoMsg(BinaryReader & msg);
 
   unsigned int init_id {};
 
@@ -91,12 +97,14 @@ public:
 protected:
   /* prevent this class from being instantiated */
   ClientAckMsg(const json & msg);
+  ClientAckMsg(BinaryReader & msg);
 };
 
 class ClientVidAckMsg : public ClientAckMsg
 {
 public:
   ClientVidAckMsg(const json & msg);
+  ClientVidAckMsg(BinaryReader & msg);
 
   double ssim {};
   VideoFormat video_format;
@@ -106,6 +114,7 @@ class ClientAudAckMsg : public ClientAckMsg
 {
 public:
   ClientAudAckMsg(const json & msg);
+  ClientAudAckMsg(BinaryReader & msg);
 
   AudioFormat audio_format;
 };
@@ -121,7 +130,9 @@ public:
     AudioAck
   };
 
-  ClientMsgParser(const std::string & data);
+  /* data is either a JSON or a binary message (see binary_message.hh);
+   * a binary message is read in place, so data must outlive the parser */
+  ClientMsgParser(const std::string_view data);
 
   ClientInitMsg parse_client_init();
   ClientInfoMsg parse_client_info();
@@ -130,9 +141,17 @@ public:
 
   Type msg_type() const { return type_; }
 
+  MsgEncoding encoding() const { return encoding_; }
+
 private:
-  json msg_;
+  json msg_ {};
   Type type_ {Type::Unknown};
+
+  MsgEncoding encoding_ {MsgEncoding::JSON};
+  std::string_view binary_msg_ {};
+
+  /* return a reader of binary_msg_ positioned after the version and type */
+  BinaryReader binary_reader() const;
 };
 
 #endif /* CLIENT_MESSAGE_HH */
@@ -0,0 +1,106 @@
+#include "dvr_archive.hh"
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <iostream>
+
+#include "exception.hh"
+
+using namespace std;
+
+DVRArchive::DVRArchive(const fs::path & path, const uint64_t segment_span)
+  : path_(path), segment_span_(segment_span)
+{
+  if (segment_span_ == 0) {
+    throw runtime_error("DVRArchive: segment span must be positive");
+  }
+}
+
+DVRArchive::Segment * DVRArchive::segment(const fs::path & path) const
+{
+  auto it = segments_.find(path);
+
+  if (it != segments_.end()) {
+    lru_.splice(lru_.begin(), lru_, it->second.lru_it);
+    return &it->second;
+  }
+
+  if (not fs::exists(path)) {
+    return nullptr;
+  }
+
+  try {
+    it = segments_.emplace(path, Segment {ChunkPack(path)}).first;
+  } catch (const exception & e) {
+    print_exception("DVRArchive", e);
+    return nullptr;
+  }
+
+  Segment & seg = it->second;
+  for (size_t i = 0; i < seg.pack.num_chunks(); i++) {
+    seg.chunks.emplace(seg.pack.entry(i).ts, seg.pack.chunk(i));
+  }
+
+  lru_.push_front(path);
+  seg.lru_it = lru_.begin();
+
+  /* the chunks sent from an unmapped segment keep its mapping alive */
+  while (lru_.size() > MAX_MAPPED_SEGMENTS) {
+    segments_.erase(lru_.back());
+    lru_.pop_back();
+  }
+
+  return &seg;
+}
+
+const DVRArchive::Chunk * DVRArchive::find(const string & dir,
+                                           const string & ext,
+                                           const uint64_t ts) const
+{
+  const uint64_t segment_ts = ts / segment_span_ * segment_span_;
+  Segment * seg = segment(path_ / dir / (to_string(segment_ts) + ext
+                                         + ".pack"));
+  if (not seg) {
+    return nullptr;
+  }
+
+  auto it = seg->chunks.find(ts);
+
+  /* the segment is being appended to by windowcleaner */
+  if (it == seg->chunks.end()) {
+    try {
+      const size_t num_new_chunks = seg->pack.refresh();
+      for (size_t i = seg->pack.num_chunks() - num_new_chunks;
+           i < seg->pack.num_chunks(); i++) {
+        seg->chunks.emplace(seg->pack.entry(i).ts, seg->pack.chunk(i));
+      }
+    } catch (const exception & e) {
+      print_exception("DVRArchive", e);
+      return nullptr;
+    }
+
+    it = seg->chunks.find(ts);
+    if (it == seg->chunks.end()) {
+      return nullptr;
+    }
+  }
+
+  return &it->second;
+}
+
+void DVRArchive::read_ahead(const string & dir, const string & ext,
+                            const uint64_t ts) const
+{
+  const Chunk * chunk = find(dir, ext, ts);
+  if (not chunk or get<1>(*chunk) == 0) {
+    return;
+  }
+
+  /* madvise() takes a page-aligned address */
+  static const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+  const uintptr_t begin = reinterpret_cast<uintptr_t>(get<0>(*chunk).get());
+  const uintptr_t aligned = begin / page_size * page_size;
+
+  madvise(reinterpret_cast<void *>(aligned),
+          get<1>(*chunk) + (begin - aligned), MADV_WILLNEED);
+}
@@ -0,0 +1,58 @@
+#ifndef DVR_ARCHIVE_HH
+#define DVR_ARCHIVE_HH
+
+#include <cstdint>
+#include <string>
+#include <memory>
+#include <tuple>
+#include <map>
+#include <list>
+
+#include "filesystem.hh"
+#include "chunk_pack.hh"
+
+/* The chunks of a live channel that have left its clean window, as archived
+ * by windowcleaner --archive: the chunks of each directory in ready/ (a
+ * format, or the SSIMs of one) are appended to segments
+ * <path>/<dir>/<ts><ext>.pack that span segment_span each. The segments
+ * read most recently stay mapped, at most MAX_MAPPED_SEGMENTS of them. */
+class DVRArchive
+{
+public:
+  using Chunk = std::tuple<std::shared_ptr<char>, size_t>;
+
+  static constexpr size_t MAX_MAPPED_SEGMENTS = 64;
+
+  DVRArchive(const fs::path & path, const uint64_t segment_span);
+
+  /* the chunk at ts of dir, or nullptr if it has not been archived (yet);
+   * borrowed until another segment is mapped, like a chunk of Channel */
+  const Chunk * find(const std::string & dir, const std::string & ext,
+                     const uint64_t ts) const;
+
+  /* have the kernel read the chunk at ts of dir in the background, if it
+   * has been archived, so that sending it later does not block on disk */
+  void read_ahead(const std::string & dir, const std::string & ext,
+                  const uint64_t ts) const;
+
+  fs::path path() const { return path_; }
+
+private:
+  fs::path path_;
+  uint64_t segment_span_;
+
+  struct Segment
+  {
+    ChunkPack pack;
+    std::map<uint64_t, Chunk> chunks {};  /* key: timestamp */
+    std::list<fs::path>::iterator lru_it {};
+  };
+
+  mutable std::map<fs::path, Segment> segments_ {};
+  mutable std::list<fs::path> lru_ {};  /* most recently read first */
+
+  /* the segment at path, mapped if it exists and is not mapped yet */
+  Segment * segment(const fs::path & path) const;
+};
+
+#endif /* DVR_ARCHIVE_HH */
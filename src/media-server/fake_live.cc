@@ -0,0 +1,422 @@
+#include <getopt.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "filesystem.hh"
+#include "poller.hh"
+#include "timerfd.hh"
+#include "timestamp.hh"
+#include "exception.hh"
+
+using namespace std;
+using namespace PollerShortNames;
+
+void print_usage(const string & program_name)
+{
+  cerr <<
+  "Usage: " << program_name << " [options] <source> <media dir> <n>\n\n"
+  "Simulate n live channels from the chunks of a static channel (<source>,\n"
+  "a directory with ready/ in it), named <prefix>1 to <prefix>n in <media dir>.\n"
+  "The chunks move into ready/ of every channel on the cadence of the video\n"
+  "chunks, as the fragmenters would move them: each file of the source is\n"
+  "hard-linked into tmp/ of the channel and renamed into its ready/ directory,\n"
+  "so that the server (or media_indexer) is notified of IN_MOVED_TO. The\n"
+  "channels are staggered evenly over the duration of a chunk.\n\n"
+  "Options:\n"
+  "-p, --prefix <name>        prefix of the channel names (default fake)\n"
+  "-t, --timescale <n>        timescale of the timestamps (default 90000)\n"
+  "-j, --jitter <ms>          delay each chunk of each channel by up to <ms>\n"
+  "-D, --dropout <p>          stall a channel at each chunk with probability <p>\n"
+  "-S, --stall <ms>           duration of a stall (default 10000); the chunks due\n"
+  "                           in the meantime move in at once when it ends\n"
+  "-i, --interval <s>         report every <s> seconds (default 10)\n"
+  "-y, --yes                  start right away rather than once Enter is pressed\n"
+  "                           (e.g., after launching the server, which watches\n"
+  "                           the directories created)"
+  << endl;
+}
+
+/* the chunks move in on Poller timers (to within Poller::TIMER_TICK_MS);
+ * this timer checks whether to report or exit */
+static constexpr uint64_t REPORT_TICK_MS = 100;
+
+struct Options
+{
+  string prefix {"fake"};
+  uint64_t timescale {90000};
+  uint64_t jitter_ms {0};
+  double dropout {0};
+  uint64_t stall_ms {10000};
+  unsigned int interval_s {10};
+  bool wait {true};
+};
+
+/* a directory in ready/ of the source, e.g., a video or audio format or the
+ * SSIMs of a video format */
+struct Track
+{
+  string name {};
+  vector<string> inits {};
+  vector<pair<uint64_t, string>> files {};  /* sorted by timestamp */
+};
+
+struct FakeChannel
+{
+  fs::path dir {};
+  uint64_t offset_ms {0};     /* of its first chunk from the start */
+  size_t next_tick {0};       /* of the source */
+  vector<size_t> next_file {};  /* in each track */
+};
+
+class FakeLive
+{
+public:
+  FakeLive(const Options & options, const fs::path & source,
+           const fs::path & media_dir, const unsigned int num_channels);
+
+  int run();
+
+private:
+  Options options_;
+  fs::path source_ready_;
+  vector<Track> tracks_ {};
+
+  /* the timestamps of the video chunks, on each of which the files of that
+   * timestamp or earlier move in */
+  vector<uint64_t> ticks_ {};
+  double chunk_ms_ {0};
+
+  vector<FakeChannel> channels_ {};
+  size_t num_done_ {0};
+
+  Poller poller_ {};
+  mt19937 rng_ {random_device{}()};
+  uint64_t start_ms_ {0};
+
+  /* since the last report */
+  uint64_t num_files_ {0};
+  uint64_t num_stalls_ {0};
+  uint64_t max_late_ms_ {0};
+
+  void scan_source();
+  void create_channel(FakeChannel & channel);
+
+  /* link src to tmp/ of channel and rename it to ready/<track>/ */
+  void move_in(const FakeChannel & channel, const Track & track,
+               const string & filename);
+
+  uint64_t due_ms(const FakeChannel & channel, const size_t tick) const;
+
+  /* move in the ticks of channel that are due and schedule the next one */
+  void advance(const size_t channel_idx);
+  void schedule(const size_t channel_idx);
+};
+
+FakeLive::FakeLive(const Options & options, const fs::path & source,
+                   const fs::path & media_dir, const unsigned int num_channels)
+  : options_(options), source_ready_(source / "ready")
+{
+  scan_source();
+
+  for (unsigned int i = 0; i < num_channels; i++) {
+    FakeChannel channel;
+    channel.dir = media_dir / (options_.prefix + to_string(i + 1));
+    channel.offset_ms = chunk_ms_ * i / num_channels;
+    channel.next_file.resize(tracks_.size());
+
+    create_channel(channel);
+    channels_.emplace_back(move(channel));
+  }
+
+  cerr << "Created " << num_channels << " channels of " << ticks_.size()
+       << " chunks (" << chunk_ms_ << " ms each) in " << media_dir << endl;
+}
+
+void FakeLive::scan_source()
+{
+  if (fs::exists(source_ready_ / "ssim.log")) {
+    cerr << "Warning: ssim.log is not moved in; the channels need SSIM files"
+         << endl;
+  }
+
+  for (const auto & dir : fs::directory_iterator(source_ready_)) {
+    if (not fs::is_directory(dir.status())) {
+      continue;
+    }
+
+    Track track;
+    track.name = dir.path().filename();
+
+    for (const auto & file : fs::directory_iterator(dir.path())) {
+      const string filename = file.path().filename();
+
+      if (file.path().stem() == "init") {
+        track.inits.emplace_back(filename);
+        continue;
+      }
+
+      try {
+        const uint64_t ts = stoull(file.path().stem());
+        track.files.emplace_back(ts, filename);
+
+        if (file.path().extension() == ".m4s") {
+          ticks_.emplace_back(ts);
+        }
+      } catch (const exception &) {
+        cerr << "Ignored " << file.path() << endl;
+      }
+    }
+
+    sort(track.files.begin(), track.files.end());
+    tracks_.emplace_back(move(track));
+  }
+
+  sort(ticks_.begin(), ticks_.end());
+  ticks_.erase(unique(ticks_.begin(), ticks_.end()), ticks_.end());
+
+  if (ticks_.size() < 2) {
+    throw runtime_error(source_ready_.string() + " has fewer than two video "
+                        "chunks");
+  }
+
+  chunk_ms_ = (ticks_[1] - ticks_[0]) * 1000.0 / options_.timescale;
+}
+
+void FakeLive::create_channel(FakeChannel & channel)
+{
+  const fs::path ready = channel.dir / "ready";
+  if (fs::exists(ready)) {
+    fs::remove_all(ready);
+    cerr << "Removed " << ready << endl;
+  }
+
+  fs::remove_all(channel.dir / "tmp");
+  fs::create_directories(channel.dir / "tmp");
+
+  for (const auto & track : tracks_) {
+    fs::create_directories(ready / track.name);
+
+    for (const auto & init : track.inits) {
+      move_in(channel, track, init);
+    }
+  }
+}
+
+void FakeLive::move_in(const FakeChannel & channel, const Track & track,
+                       const string & filename)
+{
+  const fs::path src = source_ready_ / track.name / filename;
+  const fs::path tmp = channel.dir / "tmp" / (track.name + "." + filename);
+  const fs::path dst = channel.dir / "ready" / track.name / filename;
+
+  /* copy across filesystems */
+  if (::link(src.c_str(), tmp.c_str()) < 0) {
+    if (errno != EXDEV) {
+      throw unix_error("link (" + src.string() + ")");
+    }
+
+    fs::copy_file(src, tmp, fs::copy_options::overwrite_existing);
+  }
+
+  CheckSystemCall("rename (" + dst.string() + ")",
+                  ::rename(tmp.c_str(), dst.c_str()));
+}
+
+uint64_t FakeLive::due_ms(const FakeChannel & channel, const size_t tick) const
+{
+  return start_ms_ + channel.offset_ms
+         + static_cast<uint64_t>(tick * chunk_ms_);
+}
+
+void FakeLive::advance(const size_t channel_idx)
+{
+  FakeChannel & channel = channels_[channel_idx];
+  const uint64_t now = timestamp_ms();
+
+  /* all the ticks due, e.g., at the end of a stall */
+  while (channel.next_tick < ticks_.size() and
+         due_ms(channel, channel.next_tick) <= now) {
+    const uint64_t ts = ticks_[channel.next_tick];
+
+    for (size_t t = 0; t < tracks_.size(); t++) {
+      const Track & track = tracks_[t];
+      size_t & next = channel.next_file[t];
+
+      while (next < track.files.size() and track.files[next].first <= ts) {
+        move_in(channel, track, track.files[next].second);
+        next++;
+        num_files_++;
+      }
+    }
+
+    channel.next_tick++;
+  }
+
+  if (channel.next_tick == ticks_.size()) {
+    num_done_++;
+    return;
+  }
+
+  schedule(channel_idx);
+}
+
+void FakeLive::schedule(const size_t channel_idx)
+{
+  const FakeChannel & channel = channels_[channel_idx];
+  uint64_t deadline = due_ms(channel, channel.next_tick);
+
+  if (options_.jitter_ms > 0) {
+    deadline += uniform_int_distribution<uint64_t>(0, options_.jitter_ms)(rng_);
+  }
+
+  if (options_.dropout > 0 and bernoulli_distribution(options_.dropout)(rng_)) {
+    deadline += options_.stall_ms;
+    num_stalls_++;
+  }
+
+  poller_.add_timer(deadline,
+    [this, channel_idx, deadline]() {
+      max_late_ms_ = max(max_late_ms_, timestamp_ms() - deadline);
+      advance(channel_idx);
+    }
+  );
+}
+
+int FakeLive::run()
+{
+  if (options_.wait) {
+    cerr << "Press Enter to start once the server runs: ";
+    string line;
+    getline(cin, line);
+  }
+
+  start_ms_ = timestamp_ms();
+  uint64_t last_report_ms = start_ms_;
+
+  for (size_t i = 0; i < channels_.size(); i++) {
+    schedule(i);
+  }
+
+  Timerfd report_timer;
+  report_timer.start(REPORT_TICK_MS, REPORT_TICK_MS);
+
+  poller_.add_action(Poller::Action(report_timer, Direction::In,
+    [&]()->ResultType
+    {
+      if (report_timer.expirations() == 0) {
+        return ResultType::Continue;
+      }
+
+      const uint64_t now = timestamp_ms();
+      const bool done = num_done_ == channels_.size();
+
+      if (done or now - last_report_ms >= options_.interval_s * 1000ULL) {
+        const double elapsed_s = (now - last_report_ms) / 1000.0;
+        cout << (now - start_ms_) / 1000 << "s:"
+             << " files_per_s=" << num_files_ / max(elapsed_s, 0.001)
+             << " stalls=" << num_stalls_
+             << " max_late_ms=" << max_late_ms_
+             << " channels_done=" << num_done_ << "/" << channels_.size()
+             << endl;
+
+        num_files_ = 0;
+        num_stalls_ = 0;
+        max_late_ms_ = 0;
+        last_report_ms = now;
+      }
+
+      return done ? ResultType::Exit : ResultType::Continue;
+    }
+  ).named("report"));
+
+  for (;;) {
+    const auto ret = poller_.poll(-1);
+    if (ret.result == Poller::Result::Type::Exit) {
+      return ret.exit_status;
+    }
+  }
+}
+
+int main(int argc, char * argv[])
+{
+  if (argc < 1) {
+    abort();
+  }
+
+  Options options;
+
+  const option cmd_line_opts[] = {
+    {"prefix",    required_argument, nullptr, 'p'},
+    {"timescale", required_argument, nullptr, 't'},
+    {"jitter",    required_argument, nullptr, 'j'},
+    {"dropout",   required_argument, nullptr, 'D'},
+    {"stall",     required_argument, nullptr, 'S'},
+    {"interval",  required_argument, nullptr, 'i'},
+    {"yes",       no_argument,       nullptr, 'y'},
+    { nullptr,    0,                 nullptr,  0 },
+  };
+
+  while (true) {
+    const int opt = getopt_long(argc, argv, "p:t:j:D:S:i:y",
+                                cmd_line_opts, nullptr);
+    if (opt == -1) {
+      break;
+    }
+
+    switch (opt) {
+    case 'p':
+      options.prefix = optarg;
+      break;
+    case 't':
+      options.timescale = stoull(optarg);
+      break;
+    case 'j':
+      options.jitter_ms = stoull(optarg);
+      break;
+    case 'D':
+      options.dropout = stod(optarg);
+      break;
+    case 'S':
+      options.stall_ms = stoull(optarg);
+      break;
+    case 'i':
+      options.interval_s = stoul(optarg);
+      break;
+    case 'y':
+      options.wait = false;
+      break;
+    default:
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (optind != argc - 3 or options.timescale == 0 or
+      options.interval_s == 0 or options.dropout < 0 or
+      options.dropout > 1) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  try {
+    const unsigned int num_channels = stoul(argv[optind + 2]);
+    if (num_channels == 0) {
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+
+    FakeLive fake_live(options, argv[optind], argv[optind + 1], num_channels);
+    return fake_live.run();
+  } catch (const exception & e) {
+    print_exception(argv[0], e);
+    return EXIT_FAILURE;
+  }
+}
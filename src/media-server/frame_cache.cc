@@ -0,0 +1,46 @@
+#include "frame_cache.hh"
+
+using namespace std;
+
+/* bound the cache for channels whose chunks are never cleaned (not live) */
+static const size_t MAX_CACHED_SEGMENTS = 4096;
+
+shared_ptr<const FrameCache::Frames> FrameCache::get(const Key & key) const
+{
+  auto it = frames_.find(key);
+  if (it == frames_.end()) {
+    return nullptr;
+  }
+
+  return it->second;
+}
+
+shared_ptr<const FrameCache::Frames> FrameCache::put(const Key & key,
+                                                     Frames && frames)
+{
+  /* evict the segment with the smallest timestamp if full */
+  if (frames_.size() >= MAX_CACHED_SEGMENTS and not frames_.count(key)) {
+    frames_.erase(frames_.begin());
+  }
+
+  auto & cached = frames_[key];
+  cached = make_shared<const Frames>(move(frames));
+  return cached;
+}
+
+void FrameCache::evict_until(const uint64_t ts)
+{
+  while (not frames_.empty() and std::get<0>(frames_.begin()->first) <= ts) {
+    frames_.erase(frames_.begin());
+  }
+}
+
+void FrameCache::evict(const uint64_t ts, const size_t format_idx)
+{
+  /* the keys of the chunk are adjacent, from the smallest of the others */
+  auto it = frames_.lower_bound({ts, format_idx, false, MsgEncoding::JSON, 0});
+  while (it != frames_.end() and std::get<0>(it->first) == ts and
+         std::get<1>(it->first) == format_idx) {
+    it = frames_.erase(it);
+  }
+}
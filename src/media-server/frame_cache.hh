@@ -0,0 +1,56 @@
+#ifndef FRAME_CACHE_HH
+#define FRAME_CACHE_HH
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <tuple>
+
+#include "shared_buffer.hh"
+#include "binary_message.hh"
+
+/* WebSocket frames of media segments, built once and shared by all the
+ * clients that are sent the same segment */
+class FrameCache
+{
+public:
+  struct Frame
+  {
+    /* serialized ServerMsg with a slot for initId (see ServerMsg) */
+    std::string msg {};
+    size_t init_id_slot {0};
+
+    /* views into the mmap'd segment that follow msg in the frame */
+    std::vector<SharedBuffer> data {};
+  };
+
+  using Frames = std::vector<Frame>;
+
+  /* timestamp, index of the format in the channel (a cache serves a single
+   * channel), if the init segment is prepended to the data, the encoding of
+   * the message, and the maximum size of a frame */
+  using Key = std::tuple<uint64_t, size_t, bool, MsgEncoding, size_t>;
+
+  /* return nullptr if the frames of key are not cached; the frames outlive
+   * their eviction as long as they are held (e.g., being sent) */
+  std::shared_ptr<const Frames> get(const Key & key) const;
+
+  /* cache frames under key and return the cached frames */
+  std::shared_ptr<const Frames> put(const Key & key, Frames && frames);
+
+  /* remove frames with timestamps <= ts (e.g., chunks that have been cleaned) */
+  void evict_until(const uint64_t ts);
+
+  /* remove the frames of the chunk of format_idx at ts (e.g., unmapped) */
+  void evict(const uint64_t ts, const size_t format_idx);
+
+  size_t size() const { return frames_.size(); }
+
+private:
+  /* ordered by timestamp first to make eviction of the oldest cheap */
+  std::map<Key, std::shared_ptr<const Frames>> frames_ {};
+};
+
+#endif /* FRAME_CACHE_HH */
@@ -0,0 +1,251 @@
+#include <signal.h>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <utility>
+#include <algorithm>
+
+#include "yaml.hh"
+#include "filesystem.hh"
+#include "timestamp.hh"
+#include "mlp.hh"
+#include "inference_channel.hh"
+
+using namespace std;
+
+using Slot = InferenceChannel::Slot;
+
+/* look for new channels at least this often, and for channels of
+ * processes that are gone */
+static const uint64_t RESCAN_INTERVAL_MS = 10 * 1000;
+
+/* report the requests served this often */
+static const uint64_t STATS_INTERVAL_MS = 60 * 1000;
+
+void print_usage(const string & program_name)
+{
+  cerr << "Usage: " << program_name << " <YAML configuration>\n\n"
+  "Evaluate the models of the ws_media_servers on this host, which request\n"
+  "the forward passes through the channels in inference_dir" << endl;
+}
+
+class InferenceDaemon
+{
+public:
+  explicit InferenceDaemon(const fs::path & dir)
+    : dir_(dir), doorbell_(InferenceChannel::map_doorbell(dir))
+  {}
+
+  void run()
+  {
+    for (;;) {
+      const uint32_t seq = doorbell_->seq;
+
+      const uint64_t now = timestamp_ms();
+      if (doorbell_->channels != num_channels_seen_
+          or now >= last_rescan_ms_ + RESCAN_INTERVAL_MS) {
+        rescan();
+      }
+
+      if (now >= last_report_ms_ + STATS_INTERVAL_MS) {
+        report();
+      }
+
+      if (not serve_requests()) {
+        /* until a request (or channel) rings the doorbell */
+        InferenceChannel::futex_wait(doorbell_->seq, seq,
+                                     RESCAN_INTERVAL_MS * 1000);
+      }
+    }
+  }
+
+private:
+  fs::path dir_;
+  shared_ptr<InferenceChannel::Doorbell> doorbell_;
+
+  map<fs::path, shared_ptr<Slot>> channels_ {};
+  uint32_t num_channels_seen_ {0};
+  uint64_t last_rescan_ms_ {0};
+
+  /* key: model and meta paths; null if the model failed to load */
+  map<pair<string, string>, unique_ptr<MLP>> models_ {};
+
+  /* of a batch, reused */
+  vector<float> inputs_ {};
+  vector<float> outputs_ {};
+
+  uint64_t num_requests_ {0};
+  uint64_t num_batches_ {0};
+  uint64_t num_rows_ {0};
+  uint64_t last_report_ms_ {timestamp_ms()};
+
+  /* map the new channels, and remove the files of the ones whose process
+   * is gone */
+  void rescan()
+  {
+    num_channels_seen_ = doorbell_->channels;
+    last_rescan_ms_ = timestamp_ms();
+
+    map<fs::path, shared_ptr<Slot>> channels;
+
+    for (const auto & entry : fs::directory_iterator(dir_)) {
+      const fs::path path = entry.path();
+      const string name = path.filename().string();
+      if (name.compare(0, 8, "channel.") != 0 or path.extension() == ".tmp") {
+        continue;
+      }
+
+      auto it = channels_.find(path);
+      shared_ptr<Slot> slot = it != channels_.end() ? it->second
+                              : InferenceChannel::map_slot(path);
+
+      if (kill(slot->pid, 0) < 0 and errno == ESRCH) {
+        error_code ec;
+        fs::remove(path, ec);
+        continue;
+      }
+
+      channels.emplace(path, move(slot));
+    }
+
+    channels_ = move(channels);
+  }
+
+  /* the model of a request, which is loaded on first use */
+  const MLP * model(const string & model_path, const string & meta_path)
+  {
+    auto it = models_.find({model_path, meta_path});
+    if (it != models_.end()) {
+      return it->second.get();
+    }
+
+    unique_ptr<MLP> mlp;
+    try {
+      mlp = meta_path.empty() ? make_unique<MLP>(model_path)
+                              : make_unique<MLP>(model_path, meta_path);
+      cerr << "Loaded " << model_path << endl;
+    } catch (const exception & e) {
+      cerr << "Failed to load " << model_path << ": " << e.what() << endl;
+    }
+
+    return models_.emplace(make_pair(model_path, meta_path), move(mlp))
+           .first->second.get();
+  }
+
+  /* claim the pending requests of all the channels and evaluate them in a
+   * batch per model; false if there was none */
+  bool serve_requests()
+  {
+    map<pair<string, string>, vector<Slot *>> batches;
+
+    for (auto & [path, slot] : channels_) {
+      uint32_t expected = InferenceChannel::REQUEST;
+      if (slot->state.compare_exchange_strong(expected,
+                                              InferenceChannel::CLAIMED)) {
+        batches[{path_of(slot->model_path), path_of(slot->meta_path)}]
+          .push_back(slot.get());
+      }
+    }
+
+    for (auto & [key, slots] : batches) {
+      serve_batch(model(key.first, key.second), slots);
+    }
+
+    return not batches.empty();
+  }
+
+  void serve_batch(const MLP * mlp, const vector<Slot *> & slots)
+  {
+    /* the requests that match the model, whose inputs are concatenated */
+    vector<Slot *> valid;
+    inputs_.clear();
+    size_t num_rows = 0;
+
+    for (Slot * slot : slots) {
+      num_requests_++;
+
+      if (not mlp or slot->input_dim != mlp->input_dim()
+          or slot->output_dim != mlp->output_dim()
+          or slot->num_rows * max(slot->input_dim, slot->output_dim)
+             > InferenceChannel::MAX_FLOATS) {
+        respond(*slot, InferenceChannel::FAILED);
+        continue;
+      }
+
+      inputs_.insert(inputs_.end(), slot->data,
+                    slot->data + slot->num_rows * slot->input_dim);
+      num_rows += slot->num_rows;
+      valid.push_back(slot);
+    }
+
+    if (valid.empty()) {
+      return;
+    }
+
+    outputs_.resize(num_rows * mlp->output_dim());
+    mlp->forward(inputs_.data(), num_rows, outputs_.data());
+    num_batches_++;
+    num_rows_ += num_rows;
+
+    const float * output = outputs_.data();
+    for (Slot * slot : valid) {
+      const size_t size = slot->num_rows * slot->output_dim;
+      copy(output, output + size, slot->data);
+      output += size;
+
+      respond(*slot, InferenceChannel::RESPONSE);
+    }
+  }
+
+  /* a path in a slot, which the client might not have terminated */
+  static string path_of(const char * path)
+  {
+    return string(path, strnlen(path, InferenceChannel::MAX_PATH));
+  }
+
+  static void respond(Slot & slot, const InferenceChannel::State state)
+  {
+    slot.state = state;
+    InferenceChannel::futex_wake(slot.state);
+  }
+
+  void report()
+  {
+    cerr << "Served " << num_requests_ << " requests from "
+         << channels_.size() << " channels in " << num_batches_
+         << " batches of " << num_rows_ << " rows" << endl;
+
+    num_requests_ = num_batches_ = num_rows_ = 0;
+    last_report_ms_ = timestamp_ms();
+  }
+};
+
+int main(int argc, char * argv[])
+{
+  if (argc < 1) {
+    abort();
+  }
+
+  if (argc != 2) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  YAML::Node config = YAML::LoadFile(argv[1]);
+  if (not config["inference_dir"]) {
+    cerr << "inference_daemon: inference_dir is not set" << endl;
+    return EXIT_FAILURE;
+  }
+
+  const fs::path inference_dir = config["inference_dir"].as<string>();
+  fs::create_directories(inference_dir);
+
+  InferenceDaemon daemon(inference_dir);
+  daemon.run();
+
+  return EXIT_SUCCESS;
+}
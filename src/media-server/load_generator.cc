@@ -0,0 +1,1245 @@
+#include <getopt.h>
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <optional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <crypto++/sha.h>
+#include <crypto++/base64.h>
+
+#include "address.hh"
+#include "socket.hh"
+#include "nb_secure_socket.hh"
+#include "poller.hh"
+#include "timerfd.hh"
+#include "io_buffer.hh"
+#include "ws_frame.hh"
+#include "ws_message_parser.hh"
+#include "binary_message.hh"
+#include "session_trace.hh"
+#include "metrics.hh"
+#include "timestamp.hh"
+#include "exception.hh"
+#include "json.hpp"
+
+using namespace std;
+using namespace PollerShortNames;
+using json = nlohmann::json;
+
+void print_usage(const string & program_name)
+{
+  cerr <<
+  "Usage: " << program_name << " [options] <host> <port>\n\n"
+  "Open WebSocket connections to ws_media_server as simulated viewers, which\n"
+  "speak the protocol of the player (client-init, acks and client-info) and\n"
+  "play their buffers in real time, and report the throughput, chunk latency,\n"
+  "rebuffering and SSIM they experience.\n\n"
+  "Options:\n"
+  "-n, --viewers <n>          number of viewers to keep connected (default 100)\n"
+  "-r, --ramp <n>             viewers to connect per second (default 100)\n"
+  "-c, --channel <name>       channel to watch; if repeated, the viewers are\n"
+  "                           spread over the channels (required)\n"
+  "-k, --session-key <key>    session key to authenticate with (required)\n"
+  "-u, --username <name>      user name to authenticate with\n"
+  "-t, --trace <file>         limit each viewer's download to a bandwidth trace\n"
+  "                           (mahimahi format: the millisecond of each 1500-byte\n"
+  "                           delivery), looped from a random offset\n"
+  "-d, --duration <s>         run for <s> seconds (default 60)\n"
+  "-i, --interval <s>         report every <s> seconds (default 5)\n"
+  "-s, --tls                  connect with TLS (wss)\n"
+  "-b, --binary               ask for the binary encoding of the messages\n"
+  "-R, --replay <trace>       rather than simulate viewers, replay the sessions\n"
+  "                           in a trace of ws_media_server (session_trace_dir):\n"
+  "                           each connects, sends its messages (with the session\n"
+  "                           key given) and closes at the recorded times, until\n"
+  "                           the end of the trace; -n, -r, -c, -t, -d and -b are\n"
+  "                           ignored. A stream starts at the recorded timestamps,\n"
+  "                           so the server must have the same chunks"
+  << endl;
+}
+
+/* Poller timers tick this often; the playback of every viewer (and its
+ * share of a bandwidth trace) advances on each tick */
+static constexpr uint64_t TICK_MS = 10;
+
+/* the player sends client-info every 250 ms once it plays */
+static constexpr uint64_t INFO_INTERVAL_MS = 250;
+
+/* follow at most this many redirects in a row, as the player does */
+static constexpr unsigned int MAX_REDIRECTS = 2;
+
+/* bytes a viewer may take in at once after the trace has been idle */
+static constexpr int64_t MAX_TRACE_BURST = 256 * 1024;
+
+static const string WS_MAGIC_STRING = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+struct Options
+{
+  string host {};
+  uint16_t port {0};
+  unsigned int num_viewers {100};
+  unsigned int ramp {100};
+  vector<string> channels {};
+  string session_key {};
+  string username {"load-generator"};
+  string trace_path {};
+  unsigned int duration_s {60};
+  unsigned int interval_s {5};
+  bool binary {false};
+  string replay_path {};
+};
+
+/* a mahimahi trace: the millisecond of each 1500-byte delivery opportunity,
+ * repeated every period (the last millisecond) */
+class BandwidthTrace
+{
+public:
+  static constexpr uint64_t PACKET_BYTES = 1500;
+
+  BandwidthTrace(const string & trace_path)
+  {
+    ifstream ifs(trace_path);
+    if (not ifs) {
+      throw runtime_error("cannot open " + trace_path);
+    }
+
+    uint64_t ms;
+    while (ifs >> ms) {
+      if (not opportunities_.empty() and ms < opportunities_.back()) {
+        throw runtime_error(trace_path + ": timestamps must not decrease");
+      }
+      opportunities_.emplace_back(ms);
+    }
+
+    if (opportunities_.empty() or opportunities_.back() == 0) {
+      throw runtime_error(trace_path + ": empty trace");
+    }
+  }
+
+  uint64_t period_ms() const { return opportunities_.back(); }
+
+  /* bytes delivered in (begin_ms, end_ms] of the looped trace */
+  uint64_t bytes(const uint64_t begin_ms, const uint64_t end_ms) const
+  {
+    return (delivered(end_ms) - delivered(begin_ms)) * PACKET_BYTES;
+  }
+
+private:
+  vector<uint64_t> opportunities_ {};
+
+  /* number of opportunities in [1, ms] */
+  uint64_t delivered(const uint64_t ms) const
+  {
+    const uint64_t loops = ms / period_ms();
+    const auto it = upper_bound(opportunities_.begin(), opportunities_.end(),
+                                ms % period_ms());
+    return loops * opportunities_.size() + (it - opportunities_.begin());
+  }
+};
+
+/* what the viewers have experienced; cleared after each report, except for
+ * the totals of the whole run */
+struct Stats
+{
+  uint64_t bytes_received {0};
+  uint64_t video_chunks {0};
+  uint64_t audio_chunks {0};
+  uint64_t rebuffers {0};
+  uint64_t play_ms {0};
+  uint64_t rebuffer_ms {0};  /* after startup */
+  double ssim_db_sum {0};    /* over the video chunks */
+
+  /* from the first to the last fragment of a video chunk, and from
+   * client-init to playing */
+  Histogram chunk_ms {};
+  Histogram startup_ms {};
+
+  uint64_t connected {0};
+  uint64_t closed {0};
+  uint64_t failed {0};  /* closed before server-init */
+  map<string, uint64_t> server_errors {};
+
+  void add(const Stats & other)
+  {
+    bytes_received += other.bytes_received;
+    video_chunks += other.video_chunks;
+    audio_chunks += other.audio_chunks;
+    rebuffers += other.rebuffers;
+    play_ms += other.play_ms;
+    rebuffer_ms += other.rebuffer_ms;
+    ssim_db_sum += other.ssim_db_sum;
+    connected += other.connected;
+    closed += other.closed;
+    failed += other.failed;
+
+    chunk_ms.merge(other.chunk_ms);
+    startup_ms.merge(other.startup_ms);
+
+    for (const auto & [type, count] : other.server_errors) {
+      server_errors[type] += count;
+    }
+  }
+};
+
+/* SSIM in dB, as Puffer reports it (capped, as a chunk may be lossless) */
+double ssim_db(const double ssim)
+{
+  return ssim < 1 ? min(-10 * log10(1 - ssim), 60.0) : 60.0;
+}
+
+/* server-video or server-audio */
+struct MediaMsg
+{
+  bool video {true};
+  unsigned int init_id {0};
+  string channel {};
+  string format {};
+  uint64_t timestamp {0};
+  unsigned int byte_offset {0};
+  unsigned int total_byte_length {0};
+  unsigned int byte_length {0};
+  double ssim {0};
+};
+
+/* the transport-specific parts of a viewer's connection */
+template<class SocketType>
+SocketType new_socket(TCPSocket && sock, SSLContext & ssl_context);
+
+template<>
+TCPSocket new_socket(TCPSocket && sock, SSLContext &)
+{
+  return move(sock);
+}
+
+template<>
+NBSecureSocket new_socket(TCPSocket && sock, SSLContext & ssl_context)
+{
+  NBSecureSocket socket(ssl_context.new_secure_socket(move(sock)));
+  socket.connect();
+  return socket;
+}
+
+/* whether the connection (and the TLS handshake) is established */
+bool transport_ready(TCPSocket & socket, const bool tcp_connected)
+{
+  if (not tcp_connected) {
+    socket.verify_no_errors();
+  }
+  return true;
+}
+
+bool transport_ready(NBSecureSocket & socket, const bool)
+{
+  /* Poller drives the handshake of an NBSecureSocket */
+  return socket.ready();
+}
+
+string_view read_socket(TCPSocket & socket, IOBuffer & buffer,
+                        const size_t limit)
+{
+  return socket.read(buffer, limit);
+}
+
+string_view read_socket(NBSecureSocket & socket, IOBuffer &, const size_t)
+{
+  /* NBSecureSocket has read a TLS record into its own buffer already */
+  return socket.ezread_view();
+}
+
+void write_socket(TCPSocket & socket, string & pending)
+{
+  const string_view view = pending;
+  const auto it = socket.write(view, false);
+  pending.erase(0, it - view.begin());
+}
+
+void write_socket(NBSecureSocket & socket, string & pending)
+{
+  socket.ezwrite(move(pending));
+  pending.clear();
+}
+
+bool pending_write(const TCPSocket &, const string & pending)
+{
+  return not pending.empty();
+}
+
+bool pending_write(const NBSecureSocket & socket, const string & pending)
+{
+  return not pending.empty() or socket.something_to_write();
+}
+
+template<class SocketType>
+class LoadGenerator
+{
+public:
+  LoadGenerator(const Options & options)
+    : options_(options), address_(options.host, to_string(options.port))
+  {
+    if (not options_.trace_path.empty()) {
+      trace_.emplace(options_.trace_path);
+    }
+
+    if (replaying()) {
+      replay_records_ = SessionTrace::read(options_.replay_path);
+
+      for (const auto & record : replay_records_) {
+        if (record.type == SessionTrace::Type::Start) {
+          replay_starts_.emplace(record.init_id,
+                                 make_pair(record.vts, record.ats));
+        }
+      }
+
+      cerr << "Replaying " << replay_records_.size() << " records of "
+           << options_.replay_path << endl;
+    }
+  }
+
+  int run();
+
+private:
+  struct Viewer
+  {
+    enum class State { Connecting, Upgrading, Open, Closed };
+    State state {State::Connecting};
+
+    SocketType socket;
+    uint16_t port;
+    unsigned int num_redirects;
+    bool tcp_connected {false};
+
+    string upgrade_response {};
+    string expected_accept {};
+    WSMessageParser message_parser {};
+    string send_buffer {};
+
+    unsigned int init_id;
+    string channel;
+    uint64_t init_sent_ms {0};
+
+    /* from server-init */
+    bool inited {false};
+    double timescale {1};
+    unsigned int vduration {0};
+    unsigned int aduration {0};
+
+    /* the video chunk being received */
+    string chunk_format {};
+    uint64_t chunk_timestamp {0};
+    uint64_t chunk_start_ms {0};
+
+    /* playback, in seconds of media buffered */
+    double video_buffer {0};
+    double audio_buffer {0};
+    bool started {false};
+    bool rebuffering {false};
+    uint64_t cum_rebuffer_ms {0};
+    uint64_t last_info_ms {0};
+
+    /* the share of the trace left to read, and where it is in the trace */
+    int64_t trace_bytes {0};
+    uint64_t trace_ms {0};
+
+    /* with --replay, the messages due before the connection was open */
+    vector<string> replay_pending {};
+
+    Viewer(SocketType && s_socket, const uint16_t s_port,
+           const unsigned int s_num_redirects, const unsigned int s_init_id,
+           const string & s_channel)
+      : socket(move(s_socket)), port(s_port), num_redirects(s_num_redirects),
+        init_id(s_init_id), channel(s_channel)
+    {}
+
+    bool can_read(const bool traced) const
+    {
+      return state != State::Closed and (not traced or trace_bytes > 0);
+    }
+  };
+
+  Options options_;
+  Address address_;
+  optional<BandwidthTrace> trace_ {};
+
+  Poller poller_ {Poller::Backend::Epoll};
+  SSLContext ssl_context_ {};
+  mt19937 rng_ {random_device{}()};
+
+  uint64_t next_viewer_id_ {0};
+  map<uint64_t, Viewer> viewers_ {};
+  vector<uint64_t> closed_viewers_ {};
+  size_t next_channel_ {0};
+
+  Stats interval_stats_ {};
+  Stats total_stats_ {};
+  uint64_t chunk_bytes_ {0};
+
+  /* with --replay: the records of the session trace and the next one due,
+   * the viewer replaying each session, and where each stream started */
+  vector<SessionTrace::Record> replay_records_ {};
+  size_t next_record_ {0};
+  map<uint64_t, uint64_t> replay_viewers_ {};  /* session ID -> viewer ID */
+  map<unsigned int, pair<uint64_t, uint64_t>> replay_starts_ {};
+
+  bool replaying() const { return not options_.replay_path.empty(); }
+
+  /* return the ID of the viewer, which is closed already on failure */
+  uint64_t connect_viewer(const uint16_t port,
+                          const unsigned int num_redirects);
+  void close_viewer(const uint64_t id, Viewer & viewer);
+
+  void start_upgrade(Viewer & viewer);
+  void read_upgrade(const uint64_t id, Viewer & viewer, const string_view data);
+  void handle_message(const uint64_t id, Viewer & viewer,
+                      const string_view payload);
+  void handle_media(Viewer & viewer, const MediaMsg & msg);
+
+  void send_frame(Viewer & viewer, const WSFrame::OpCode opcode,
+                  string && payload);
+  void send_init(Viewer & viewer);
+  void send_info(Viewer & viewer, const string & event);
+  void send_ack(Viewer & viewer, const MediaMsg & msg);
+
+  /* replay the records due by elapsed_us into the trace; return false once
+   * the trace has been replayed and the viewers have closed */
+  bool replay(const uint64_t elapsed_us);
+  void send_replayed(Viewer & viewer, const string & payload);
+
+  void tick(const uint64_t now, const uint64_t elapsed_ms);
+  void report(const uint64_t elapsed_s, const Stats & stats,
+              const double interval_s) const;
+};
+
+template<class SocketType>
+uint64_t LoadGenerator<SocketType>::connect_viewer(
+  const uint16_t port, const unsigned int num_redirects)
+{
+  const uint64_t id = next_viewer_id_++;
+
+  TCPSocket sock;
+  sock.set_blocking(false);
+
+  try {
+    sock.connect(Address(address_.ip(), port));
+  } catch (const unix_error & e) {
+    if (e.code().value() != EINPROGRESS) {
+      cerr << "viewer " << id << ": " << e.what() << endl;
+      interval_stats_.failed++;
+      return id;
+    }
+  }
+
+  /* a replayed session names its channel in its own client-init */
+  const string channel = options_.channels.empty() ? string() :
+    options_.channels[next_channel_++ % options_.channels.size()];
+
+  const unsigned int init_id = uniform_int_distribution<unsigned int>()(rng_);
+
+  Viewer & viewer = viewers_.emplace(piecewise_construct,
+    forward_as_tuple(id),
+    forward_as_tuple(new_socket<SocketType>(move(sock), ssl_context_), port,
+                     num_redirects, init_id, channel)).first->second;
+
+  if (trace_) {
+    viewer.trace_ms =
+      uniform_int_distribution<uint64_t>(0, trace_->period_ms() - 1)(rng_);
+  }
+
+  poller_.add_action(Poller::Action(viewer.socket, Direction::In,
+    [this, &viewer, id]()->ResultType
+    {
+      IOBuffer buffer;
+      const size_t limit = trace_ ? viewer.trace_bytes : IOBuffer::CAPACITY;
+      const string_view data = read_socket(viewer.socket, buffer, limit);
+
+      if (data.empty()) {
+        close_viewer(id, viewer);
+        return ResultType::CancelAll;
+      }
+
+      viewer.trace_bytes -= data.size();
+      interval_stats_.bytes_received += data.size();
+
+      if (viewer.state == Viewer::State::Upgrading) {
+        read_upgrade(id, viewer, data);
+        return ResultType::Continue;
+      }
+
+      viewer.message_parser.parse(data);
+
+      while (not viewer.message_parser.empty()) {
+        const WSMessage & message = viewer.message_parser.front();
+
+        switch (message.type()) {
+        case WSMessage::Type::Text:
+        case WSMessage::Type::Binary:
+          handle_message(id, viewer, message.payload());
+          break;
+
+        case WSMessage::Type::Ping:
+          send_frame(viewer, WSFrame::OpCode::Pong,
+                     string(message.payload()));
+          break;
+
+        case WSMessage::Type::Close:
+          close_viewer(id, viewer);
+          return ResultType::CancelAll;
+
+        default:
+          break;
+        }
+
+        viewer.message_parser.pop();
+
+        if (viewer.state == Viewer::State::Closed) {
+          return ResultType::CancelAll;
+        }
+      }
+
+      return ResultType::Continue;
+    },
+    [this, &viewer]() { return viewer.can_read(trace_.has_value()); },
+    [this, &viewer, id]() { close_viewer(id, viewer); },
+    false
+  ).named("viewer_in"));
+
+  poller_.add_action(Poller::Action(viewer.socket, Direction::Out,
+    [this, &viewer]()->ResultType
+    {
+      if (viewer.state == Viewer::State::Connecting) {
+        if (not transport_ready(viewer.socket, viewer.tcp_connected)) {
+          return ResultType::Continue;
+        }
+
+        viewer.tcp_connected = true;
+        start_upgrade(viewer);
+      }
+
+      if (not viewer.send_buffer.empty()) {
+        write_socket(viewer.socket, viewer.send_buffer);
+      }
+
+      return ResultType::Continue;
+    },
+    [&viewer]()
+    {
+      return viewer.state == Viewer::State::Connecting or
+             (viewer.state != Viewer::State::Closed and
+              pending_write(viewer.socket, viewer.send_buffer));
+    },
+    [this, &viewer, id]() { close_viewer(id, viewer); },
+    false
+  ).named("viewer_out"));
+
+  return id;
+}
+
+template<class SocketType>
+void LoadGenerator<SocketType>::close_viewer(const uint64_t id, Viewer & viewer)
+{
+  if (viewer.state == Viewer::State::Closed) {
+    return;
+  }
+
+  if (viewer.inited) {
+    interval_stats_.closed++;
+  } else {
+    interval_stats_.failed++;
+  }
+
+  viewer.state = Viewer::State::Closed;
+  poller_.remove_fd(viewer.socket.fd_num());
+
+  /* erased once the poller is done with its actions */
+  closed_viewers_.emplace_back(id);
+}
+
+template<class SocketType>
+void LoadGenerator<SocketType>::start_upgrade(Viewer & viewer)
+{
+  string key(16, 0);
+  for (auto & c : key) {
+    c = static_cast<char>(uniform_int_distribution<int>(0, 255)(rng_));
+  }
+
+  string encoded_key;
+  CryptoPP::StringSource encode(key, true,
+    new CryptoPP::Base64Encoder(new CryptoPP::StringSink(encoded_key), false));
+
+  CryptoPP::SHA1 sha1;
+  CryptoPP::StringSource hash(encoded_key + WS_MAGIC_STRING, true,
+    new CryptoPP::HashFilter(sha1,
+      new CryptoPP::Base64Encoder(
+        new CryptoPP::StringSink(viewer.expected_accept), false)));
+
+  viewer.send_buffer +=
+    "GET / HTTP/1.1\r\n"
+    "Host: " + options_.host + ":" + to_string(viewer.port) + "\r\n"
+    "Upgrade: websocket\r\n"
+    "Connection: Upgrade\r\n"
+    "Sec-WebSocket-Key: " + encoded_key + "\r\n"
+    "Sec-WebSocket-Version: 13\r\n\r\n";
+
+  viewer.state = Viewer::State::Upgrading;
+}
+
+template<class SocketType>
+void LoadGenerator<SocketType>::read_upgrade(const uint64_t id, Viewer & viewer,
+                                             const string_view data)
+{
+  viewer.upgrade_response.append(data);
+
+  const size_t end = viewer.upgrade_response.find("\r\n\r\n");
+  if (end == string::npos) {
+    return;
+  }
+
+  const string headers = viewer.upgrade_response.substr(0, end);
+  if (headers.compare(0, 12, "HTTP/1.1 101") != 0 or
+      headers.find(viewer.expected_accept) == string::npos) {
+    cerr << "viewer " << id << ": WebSocket upgrade refused" << endl;
+    close_viewer(id, viewer);
+    return;
+  }
+
+  viewer.state = Viewer::State::Open;
+  interval_stats_.connected++;
+
+  /* the server sends nothing unasked, but keep whatever follows anyway */
+  const string rest = viewer.upgrade_response.substr(end + 4);
+  viewer.upgrade_response.clear();
+  viewer.upgrade_response.shrink_to_fit();
+
+  if (replaying()) {
+    for (const auto & payload : viewer.replay_pending) {
+      send_replayed(viewer, payload);
+    }
+    viewer.replay_pending.clear();
+  } else {
+    send_init(viewer);
+  }
+
+  if (not rest.empty()) {
+    viewer.message_parser.parse(rest);
+  }
+}
+
+template<class SocketType>
+void LoadGenerator<SocketType>::send_frame(Viewer & viewer,
+                                           const WSFrame::OpCode opcode,
+                                           string && payload)
+{
+  /* frames from a client are masked */
+  const uint32_t masking_key = uniform_int_distribution<uint32_t>()(rng_);
+  viewer.send_buffer += WSFrame(true, opcode, move(payload), masking_key)
+                        .to_string();
+}
+
+template<class SocketType>
+void LoadGenerator<SocketType>::send_init(Viewer & viewer)
+{
+  viewer.init_id++;
+
+  json msg = {
+    {"type", "client-init"},
+    {"initId", viewer.init_id},
+    {"sessionKey", options_.session_key},
+    {"userName", options_.username},
+    {"channel", viewer.channel},
+    {"os", "Linux"},
+    {"browser", "load_generator"},
+    {"screenWidth", 1920},
+    {"screenHeight", 1080}
+  };
+
+  if (options_.binary) {
+    msg["binaryVersion"] = BINARY_MSG_VERSION;
+  }
+
+  /* a new client-init starts playback afresh (without resuming) */
+  viewer.inited = false;
+  viewer.started = false;
+  viewer.rebuffering = false;
+  viewer.video_buffer = 0;
+  viewer.audio_buffer = 0;
+  viewer.cum_rebuffer_ms = 0;
+  viewer.chunk_format.clear();
+  viewer.init_sent_ms = timestamp_ms();
+
+  send_frame(viewer, WSFrame::OpCode::Text, msg.dump());
+}
+
+template<class SocketType>
+void LoadGenerator<SocketType>::send_info(Viewer & viewer, const string & event)
+{
+  if (options_.binary) {
+    static const map<string, uint8_t> events {
+      {"timer", 0}, {"startup", 1}, {"rebuffer", 2}, {"play", 3} };
+
+    BinaryWriter writer;
+    writer.put_u8(BINARY_MSG_VERSION);
+    writer.put_u8(static_cast<uint8_t>(BinaryMsgType::ClientInfo));
+    writer.put_u32(viewer.init_id);
+    writer.put_double(viewer.video_buffer);
+    writer.put_double(viewer.audio_buffer);
+    writer.put_double(viewer.cum_rebuffer_ms / 1000.0);
+    writer.put_u8(events.at(event));
+    writer.put_u16(0);  /* the screen sizes have not changed */
+    writer.put_u16(0);
+    send_frame(viewer, WSFrame::OpCode::Binary, string(writer.str()));
+    return;
+  }
+
+  const json msg = {
+    {"type", "client-info"},
+    {"initId", viewer.init_id},
+    {"event", event},
+    {"videoBuffer", viewer.video_buffer},
+    {"audioBuffer", viewer.audio_buffer},
+    {"cumRebuffer", viewer.cum_rebuffer_ms / 1000.0}
+  };
+
+  send_frame(viewer, WSFrame::OpCode::Text, msg.dump());
+}
+
+template<class SocketType>
+void LoadGenerator<SocketType>::send_ack(Viewer & viewer, const MediaMsg & msg)
+{
+  if (options_.binary) {
+    BinaryWriter writer;
+    writer.put_u8(BINARY_MSG_VERSION);
+    const BinaryMsgType type = msg.video ? BinaryMsgType::ClientVidAck
+                                         : BinaryMsgType::ClientAudAck;
+    writer.put_u8(static_cast<uint8_t>(type));
+    writer.put_u32(viewer.init_id);
+    writer.put_double(viewer.video_buffer);
+    writer.put_double(viewer.audio_buffer);
+    writer.put_double(viewer.cum_rebuffer_ms / 1000.0);
+    writer.put_u64(msg.timestamp);
+    writer.put_u32(msg.byte_offset);
+    writer.put_u32(msg.byte_length);
+    writer.put_u32(msg.total_byte_length);
+    writer.put_str(msg.channel);
+    writer.put_str(msg.format);
+    if (msg.video) {
+      writer.put_double(msg.ssim);
+    }
+    send_frame(viewer, WSFrame::OpCode::Binary, string(writer.str()));
+    return;
+  }
+
+  json ack = {
+    {"type", msg.video ? "client-vidack" : "client-audack"},
+    {"initId", viewer.init_id},
+    {"videoBuffer", viewer.video_buffer},
+    {"audioBuffer", viewer.audio_buffer},
+    {"cumRebuffer", viewer.cum_rebuffer_ms / 1000.0},
+    {"channel", msg.channel},
+    {"format", msg.format},
+    {"timestamp", msg.timestamp},
+    {"byteOffset", msg.byte_offset},
+    {"byteLength", msg.byte_length},
+    {"totalByteLength", msg.total_byte_length}
+  };
+
+  if (msg.video) {
+    ack["ssim"] = msg.ssim;
+  }
+
+  send_frame(viewer, WSFrame::OpCode::Text, ack.dump());
+}
+
+template<class SocketType>
+void LoadGenerator<SocketType>::handle_message(const uint64_t id,
+                                               Viewer & viewer,
+                                               const string_view payload)
+{
+  /* 16-bit length of the metadata | metadata | media */
+  if (payload.size() < sizeof(uint16_t)) {
+    throw runtime_error("server message too short");
+  }
+
+  const uint16_t metadata_len = be16toh(*reinterpret_cast<const uint16_t *>(
+                                          payload.data()));
+  const string_view metadata = payload.substr(sizeof(uint16_t), metadata_len);
+  const string_view media = payload.substr(sizeof(uint16_t) + metadata_len);
+
+  MediaMsg msg;
+  msg.byte_length = media.size();
+
+  if (not metadata.empty() and
+      static_cast<uint8_t>(metadata[0]) == BINARY_MSG_VERSION) {
+    BinaryReader reader(metadata);
+    reader.get_u8();  /* version */
+
+    msg.video = static_cast<BinaryMsgType>(reader.get_u8())
+                == BinaryMsgType::ServerVideo;
+    msg.init_id = reader.get_u32();
+    msg.timestamp = reader.get_u64();
+    msg.byte_offset = reader.get_u32();
+    msg.total_byte_length = reader.get_u32();
+    if (msg.video) {
+      msg.ssim = reader.get_double();
+    }
+    msg.channel = reader.get_str();
+    msg.format = reader.get_str();
+
+    handle_media(viewer, msg);
+    return;
+  }
+
+  const json j = json::parse(metadata.begin(), metadata.end());
+  const string type = j.at("type").get<string>();
+
+  if (type == "server-error") {
+    const string error_type = j.at("errorType").get<string>();
+    interval_stats_.server_errors[error_type]++;
+
+    /* a replayed session sends its own client-init after a reinit, and
+     * is closed when it was */
+    if (replaying()) {
+      return;
+    }
+
+    if (error_type == "reinit") {
+      send_init(viewer);
+      return;
+    }
+
+    close_viewer(id, viewer);
+
+    /* the viewer moves to the server redirected to (the others, e.g.,
+     * turned away at the limit, are replaced at the ramp rate) */
+    if (error_type == "redirect" and viewer.num_redirects < MAX_REDIRECTS) {
+      connect_viewer(j.at("redirectPort").get<uint16_t>(),
+                     viewer.num_redirects + 1);
+    }
+
+    return;
+  }
+
+  if (j.at("initId").get<unsigned int>() != viewer.init_id) {
+    return;  /* outdated */
+  }
+
+  if (type == "server-init") {
+    viewer.inited = true;
+    viewer.timescale = j.at("timescale").get<double>();
+    viewer.vduration = j.at("videoDuration").get<unsigned int>();
+    viewer.aduration = j.at("audioDuration").get<unsigned int>();
+    return;
+  }
+
+  msg.video = (type == "server-video");
+  msg.init_id = viewer.init_id;
+  msg.channel = j.at("channel").get<string>();
+  msg.format = j.at("format").get<string>();
+  msg.timestamp = j.at("timestamp").get<uint64_t>();
+  msg.byte_offset = j.at("byteOffset").get<unsigned int>();
+  msg.total_byte_length = j.at("totalByteLength").get<unsigned int>();
+  if (msg.video) {
+    msg.ssim = j.at("ssim").get<double>();
+  }
+
+  handle_media(viewer, msg);
+}
+
+template<class SocketType>
+void LoadGenerator<SocketType>::handle_media(Viewer & viewer,
+                                             const MediaMsg & msg)
+{
+  if (msg.init_id != viewer.init_id or not viewer.inited) {
+    return;
+  }
+
+  const bool last_fragment =
+    msg.byte_offset + msg.byte_length >= msg.total_byte_length;
+
+  if (msg.video) {
+    /* a new chunk, or the server aborted the previous one */
+    if (msg.format != viewer.chunk_format or
+        msg.timestamp != viewer.chunk_timestamp or msg.byte_offset == 0) {
+      viewer.chunk_format = msg.format;
+      viewer.chunk_timestamp = msg.timestamp;
+      viewer.chunk_start_ms = timestamp_ms();
+    }
+
+    if (last_fragment) {
+      viewer.video_buffer += viewer.vduration / viewer.timescale;
+      interval_stats_.video_chunks++;
+      interval_stats_.ssim_db_sum += ssim_db(msg.ssim);
+      interval_stats_.chunk_ms.add(timestamp_ms() - viewer.chunk_start_ms);
+      chunk_bytes_ += msg.total_byte_length;
+    }
+  } else if (last_fragment) {
+    viewer.audio_buffer += viewer.aduration / viewer.timescale;
+    interval_stats_.audio_chunks++;
+  }
+
+  /* the player acks the last fragment once it is buffered; a replayed
+   * session sends the acks that were recorded */
+  if (not replaying()) {
+    send_ack(viewer, msg);
+  }
+}
+
+template<class SocketType>
+void LoadGenerator<SocketType>::send_replayed(Viewer & viewer,
+                                              const string & payload)
+{
+  /* client-init is always JSON, and the only message with credentials */
+  if (payload.find("\"client-init\"") == string::npos) {
+    const bool binary = not payload.empty() and
+      static_cast<uint8_t>(payload[0]) == BINARY_MSG_VERSION;
+    send_frame(viewer, binary ? WSFrame::OpCode::Binary
+                              : WSFrame::OpCode::Text, string(payload));
+    return;
+  }
+
+  json msg = json::parse(payload);
+  msg["sessionKey"] = options_.session_key;
+
+  /* start the stream where it started, rather than at the live edge of
+   * the moment */
+  const unsigned int init_id = msg.at("initId").get<unsigned int>();
+  const auto it = replay_starts_.find(init_id);
+  if (it != replay_starts_.end() and not msg.count("nextVts")) {
+    msg["nextVts"] = it->second.first;
+    msg["nextAts"] = it->second.second;
+  }
+
+  /* to tell the media of this stream from that of the previous one */
+  viewer.init_id = init_id;
+  viewer.inited = false;
+  viewer.init_sent_ms = timestamp_ms();
+  send_frame(viewer, WSFrame::OpCode::Text, msg.dump());
+}
+
+template<class SocketType>
+bool LoadGenerator<SocketType>::replay(const uint64_t elapsed_us)
+{
+  const uint64_t first_us = replay_records_.empty() ? 0 :
+                            replay_records_.front().time_us;
+
+  for (; next_record_ < replay_records_.size(); next_record_++) {
+    const auto & record = replay_records_[next_record_];
+    if (record.time_us - first_us > elapsed_us) {
+      break;
+    }
+
+    using Type = SessionTrace::Type;
+
+    if (record.type == Type::Open) {
+      replay_viewers_[record.session_id] = connect_viewer(options_.port, 0);
+      continue;
+    }
+
+    /* the session was traced from the middle, or failed to connect */
+    const auto it = replay_viewers_.find(record.session_id);
+    if (it == replay_viewers_.end()) {
+      continue;
+    }
+
+    const auto viewer_it = viewers_.find(it->second);
+    if (viewer_it == viewers_.end()) {
+      continue;
+    }
+
+    Viewer & viewer = viewer_it->second;
+
+    if (record.type == Type::Message) {
+      if (viewer.state == Viewer::State::Open) {
+        send_replayed(viewer, record.payload);
+      } else if (viewer.state != Viewer::State::Closed) {
+        viewer.replay_pending.emplace_back(record.payload);
+      }
+    } else if (record.type == Type::Close) {
+      close_viewer(it->second, viewer);
+      replay_viewers_.erase(it);
+    }
+  }
+
+  return next_record_ < replay_records_.size() or not viewers_.empty();
+}
+
+template<class SocketType>
+void LoadGenerator<SocketType>::tick(const uint64_t now,
+                                     const uint64_t elapsed_ms)
+{
+  for (auto & [id, viewer] : viewers_) {
+    if (viewer.state == Viewer::State::Closed) {
+      continue;
+    }
+
+    /* a TLS connection closed by the server is only noticed here */
+    if (viewer.socket.eof()) {
+      close_viewer(id, viewer);
+      continue;
+    }
+
+    if (trace_) {
+      viewer.trace_bytes = min(viewer.trace_bytes +
+        static_cast<int64_t>(trace_->bytes(viewer.trace_ms,
+                                           viewer.trace_ms + elapsed_ms)),
+        MAX_TRACE_BURST);
+      viewer.trace_ms += elapsed_ms;
+    }
+
+    if (not viewer.inited) {
+      continue;
+    }
+
+    const bool have_media = viewer.video_buffer > 0 and viewer.audio_buffer > 0;
+
+    if (not viewer.started) {
+      if (have_media) {
+        viewer.started = true;
+        viewer.cum_rebuffer_ms += now - viewer.init_sent_ms;
+        interval_stats_.startup_ms.add(now - viewer.init_sent_ms);
+        send_info(viewer, "startup");
+        viewer.last_info_ms = now;
+      }
+      continue;
+    }
+
+    if (viewer.rebuffering) {
+      viewer.cum_rebuffer_ms += elapsed_ms;
+      interval_stats_.rebuffer_ms += elapsed_ms;
+
+      if (have_media) {
+        viewer.rebuffering = false;
+        send_info(viewer, "play");
+      }
+    } else {
+      const double played = elapsed_ms / 1000.0;
+      viewer.video_buffer = max(viewer.video_buffer - played, 0.0);
+      viewer.audio_buffer = max(viewer.audio_buffer - played, 0.0);
+      interval_stats_.play_ms += elapsed_ms;
+
+      if (viewer.video_buffer == 0 or viewer.audio_buffer == 0) {
+        viewer.rebuffering = true;
+        interval_stats_.rebuffers++;
+        send_info(viewer, "rebuffer");
+      }
+    }
+
+    if (now - viewer.last_info_ms >= INFO_INTERVAL_MS) {
+      send_info(viewer, "timer");
+      viewer.last_info_ms = now;
+    }
+  }
+}
+
+template<class SocketType>
+void LoadGenerator<SocketType>::report(const uint64_t elapsed_s,
+                                       const Stats & stats,
+                                       const double interval_s) const
+{
+  const uint64_t watched_ms = stats.play_ms + stats.rebuffer_ms;
+
+  cout << fixed << setprecision(1)
+       << "t=" << elapsed_s << "s viewers=" << viewers_.size()
+       << " connected=" << stats.connected << " closed=" << stats.closed
+       << " failed=" << stats.failed
+       << " throughput=" << stats.bytes_received * 8 / interval_s / MILLION
+       << "Mbps chunks=" << stats.video_chunks << "v/" << stats.audio_chunks
+       << "a chunk_ms(p50/p95/p99/max)="
+       << stats.chunk_ms.quantile(0.5) << "/" << stats.chunk_ms.quantile(0.95)
+       << "/" << stats.chunk_ms.quantile(0.99) << "/" << stats.chunk_ms.max()
+       << " startup_ms(p50/p95)=" << stats.startup_ms.quantile(0.5) << "/"
+       << stats.startup_ms.quantile(0.95)
+       << " rebuffers=" << stats.rebuffers
+       << setprecision(2) << " rebuffer_ratio="
+       << (watched_ms ? 100.0 * stats.rebuffer_ms / watched_ms : 0) << "%"
+       << " ssim_db=" << (stats.video_chunks ? stats.ssim_db_sum /
+                                              stats.video_chunks : 0);
+
+  for (const auto & [type, count] : stats.server_errors) {
+    cout << " " << type << "=" << count;
+  }
+
+  cout << defaultfloat << endl;
+}
+
+template<class SocketType>
+int LoadGenerator<SocketType>::run()
+{
+  const uint64_t start_ms = timestamp_ms();
+  uint64_t last_tick_ms = start_ms;
+  uint64_t last_report_ms = start_ms;
+  double ramp_credit = 0;
+
+  Timerfd tick_timer;
+  tick_timer.start(TICK_MS, TICK_MS);
+
+  poller_.add_action(Poller::Action(tick_timer, Direction::In,
+    [&]()->ResultType
+    {
+      if (tick_timer.expirations() == 0) {
+        return ResultType::Continue;
+      }
+
+      const uint64_t now = timestamp_ms();
+
+      /* the messages of a replayed session, buffer levels included, are
+       * those recorded rather than those of a simulated playback */
+      bool replay_done = false;
+      if (replaying()) {
+        replay_done = not replay((now - start_ms) * 1000);
+      } else {
+        tick(now, now - last_tick_ms);
+
+        /* connect viewers at the ramp rate, replacing those closed */
+        ramp_credit = min(ramp_credit + options_.ramp * (now - last_tick_ms)
+                                        / 1000.0,
+                          static_cast<double>(options_.ramp));
+        while (viewers_.size() < options_.num_viewers and ramp_credit >= 1) {
+          connect_viewer(options_.port, 0);
+          ramp_credit -= 1;
+        }
+      }
+
+      last_tick_ms = now;
+
+      if (now - last_report_ms >= options_.interval_s * 1000ULL) {
+        report((now - start_ms) / 1000, interval_stats_,
+               (now - last_report_ms) / 1000.0);
+        total_stats_.add(interval_stats_);
+        interval_stats_ = Stats();
+        last_report_ms = now;
+      }
+
+      if (replay_done or (not replaying() and
+                          now - start_ms >= options_.duration_s * 1000ULL)) {
+        return ResultType::Exit;
+      }
+
+      return ResultType::Continue;
+    }
+  ).named("tick"));
+
+  for (;;) {
+    const auto ret = poller_.poll(-1);
+
+    for (const uint64_t id : closed_viewers_) {
+      viewers_.erase(id);
+    }
+    closed_viewers_.clear();
+
+    if (ret.result == Poller::Result::Type::Exit) {
+      break;
+    }
+  }
+
+  total_stats_.add(interval_stats_);
+  cout << "total: ";
+  report((timestamp_ms() - start_ms) / 1000, total_stats_,
+         (timestamp_ms() - start_ms) / 1000.0);
+  cout << "total: mean video chunk "
+       << (total_stats_.video_chunks ? chunk_bytes_ / total_stats_.video_chunks
+                                     : 0)
+       << " bytes" << endl;
+
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, char * argv[])
+{
+  if (argc < 1) {
+    abort();
+  }
+
+  Options options;
+  bool tls = false;
+
+  const option cmd_line_opts[] = {
+    {"viewers",     required_argument, nullptr, 'n'},
+    {"ramp",        required_argument, nullptr, 'r'},
+    {"channel",     required_argument, nullptr, 'c'},
+    {"session-key", required_argument, nullptr, 'k'},
+    {"username",    required_argument, nullptr, 'u'},
+    {"trace",       required_argument, nullptr, 't'},
+    {"duration",    required_argument, nullptr, 'd'},
+    {"interval",    required_argument, nullptr, 'i'},
+    {"tls",         no_argument,       nullptr, 's'},
+    {"binary",      no_argument,       nullptr, 'b'},
+    {"replay",      required_argument, nullptr, 'R'},
+    { nullptr,      0,                 nullptr,  0 },
+  };
+
+  while (true) {
+    const int opt = getopt_long(argc, argv, "n:r:c:k:u:t:d:i:sbR:",
+                                cmd_line_opts, nullptr);
+    if (opt == -1) {
+      break;
+    }
+
+    switch (opt) {
+    case 'n':
+      options.num_viewers = stoul(optarg);
+      break;
+    case 'r':
+      options.ramp = stoul(optarg);
+      break;
+    case 'c':
+      options.channels.emplace_back(optarg);
+      break;
+    case 'k':
+      options.session_key = optarg;
+      break;
+    case 'u':
+      options.username = optarg;
+      break;
+    case 't':
+      options.trace_path = optarg;
+      break;
+    case 'd':
+      options.duration_s = stoul(optarg);
+      break;
+    case 'i':
+      options.interval_s = stoul(optarg);
+      break;
+    case 's':
+      tls = true;
+      break;
+    case 'b':
+      options.binary = true;
+      break;
+    case 'R':
+      options.replay_path = optarg;
+      break;
+    default:
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (optind != argc - 2 or
+      (options.channels.empty() and options.replay_path.empty()) or
+      options.session_key.empty() or options.ramp == 0 or
+      options.interval_s == 0) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  options.host = argv[optind];
+  options.port = stoul(argv[optind + 1]);
+
+  try {
+    if (tls) {
+      return LoadGenerator<NBSecureSocket>(options).run();
+    }
+
+    return LoadGenerator<TCPSocket>(options).run();
+  } catch (const exception & e) {
+    print_exception(argv[0], e);
+    return EXIT_FAILURE;
+  }
+}
@@ -0,0 +1,81 @@
+#include "load_table.hh"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <stdexcept>
+
+#include "file_descriptor.hh"
+#include "exception.hh"
+#include "mmap.hh"
+#include "timestamp.hh"
+
+using namespace std;
+
+LoadTable::LoadTable(const string & path, const unsigned int num_servers)
+  : num_servers_(num_servers)
+{
+  if (num_servers_ == 0) {
+    throw runtime_error("LoadTable requires at least one server");
+  }
+
+  FileDescriptor fd(CheckSystemCall("open (" + path + ")",
+                    open(path.c_str(), O_RDWR | O_CREAT, 0644)));
+
+  /* every server grows the file to the same size; a larger file left by
+   * a previous run is not shrunk as others might have mapped it already */
+  const size_t size = num_servers_ * sizeof(Slot);
+  if (fd.filesize() < size) {
+    CheckSystemCall("ftruncate", ftruncate(fd.fd_num(), size));
+  }
+
+  /* the mapping remains valid after fd is closed */
+  mapping_ = mmap_shared(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         fd.fd_num(), 0);
+  slots_ = static_cast<Slot *>(mapping_.get());
+}
+
+void LoadTable::publish(const unsigned int server_id, const uint16_t port,
+                        const ServerLoad & load)
+{
+  if (server_id == 0 or server_id > num_servers_) {
+    throw runtime_error("LoadTable: invalid server ID");
+  }
+
+  Slot & slot = slots_[server_id - 1];
+  slot.port = port;
+  slot.num_connections = load.num_connections;
+  slot.loop_lag_us = load.loop_lag_us;
+  slot.buffer_bytes = load.buffer_bytes;
+  slot.cpu_permille = static_cast<uint64_t>(load.cpu_util * 1000);
+
+  /* written last: readers ignore the slot until it has been filled */
+  slot.updated_ms = timestamp_ms();
+}
+
+vector<LoadTable::Peer> LoadTable::peers(const unsigned int server_id) const
+{
+  vector<Peer> ret;
+  const uint64_t now = timestamp_ms();
+
+  for (unsigned int i = 0; i < num_servers_; i++) {
+    if (i + 1 == server_id) {
+      continue;
+    }
+
+    const Slot & slot = slots_[i];
+    const uint64_t updated_ms = slot.updated_ms;
+    if (updated_ms == 0 or updated_ms + MAX_AGE_MS < now) {
+      continue;
+    }
+
+    Peer peer;
+    peer.port = slot.port;
+    peer.load.num_connections = slot.num_connections;
+    peer.load.loop_lag_us = slot.loop_lag_us;
+    peer.load.buffer_bytes = slot.buffer_bytes;
+    peer.load.cpu_util = slot.cpu_permille / 1000.0;
+    ret.emplace_back(peer);
+  }
+
+  return ret;
+}
@@ -0,0 +1,67 @@
+#ifndef LOAD_TABLE_HH
+#define LOAD_TABLE_HH
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+
+/* load of a ws_media_server, summed up over its event-loop threads */
+struct ServerLoad
+{
+  uint64_t num_connections {0};
+  uint64_t loop_lag_us {0};   /* longest delay of an event loop recently */
+  uint64_t buffer_bytes {0};  /* bytes queued to be sent to the clients */
+  double cpu_util {0};        /* CPU time over wall time of all threads */
+};
+
+/* Loads of the ws_media_servers (launched by run_servers) on this host, in a
+ * file mapped by all of them: server i publishes its load in slot i - 1 and
+ * reads the other slots to find a less loaded server. Slots that have not
+ * been updated recently are considered gone. */
+class LoadTable
+{
+public:
+  struct Peer {
+    uint16_t port {0};
+    ServerLoad load {};
+  };
+
+  LoadTable(const std::string & path, const unsigned int num_servers);
+
+  /* publish the load of server_id listening on port */
+  void publish(const unsigned int server_id, const uint16_t port,
+               const ServerLoad & load);
+
+  /* the servers other than server_id whose loads are up to date */
+  std::vector<Peer> peers(const unsigned int server_id) const;
+
+  /* forbid copying */
+  LoadTable(const LoadTable & other) = delete;
+  const LoadTable & operator=(const LoadTable & other) = delete;
+
+private:
+  /* a slot is written by one server and read by the others; fields are
+   * read and written individually */
+  struct Slot {
+    std::atomic<uint64_t> updated_ms;
+    std::atomic<uint64_t> port;
+    std::atomic<uint64_t> num_connections;
+    std::atomic<uint64_t> loop_lag_us;
+    std::atomic<uint64_t> buffer_bytes;
+    std::atomic<uint64_t> cpu_permille;
+  };
+
+  static_assert(std::atomic<uint64_t>::is_always_lock_free,
+                "LoadTable requires lock-free atomics in shared memory");
+
+  /* a load published more than this long ago is stale */
+  static constexpr uint64_t MAX_AGE_MS = 3000;
+
+  unsigned int num_servers_;
+  std::shared_ptr<void> mapping_ {};
+  Slot * slots_ {nullptr};
+};
+
+#endif /* LOAD_TABLE_HH */
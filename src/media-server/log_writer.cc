@@ -0,0 +1,535 @@
+#include "log_writer.hh"
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <zstd.h>
+#include <cstring>
+#include <ctime>
+#include <chrono>
+#include <iostream>
+#include <fstream>
+
+#include "exception.hh"
+#include "timestamp.hh"
+
+using namespace std;
+
+static size_t align(const size_t size, const size_t alignment)
+{
+  return (size + alignment - 1) / alignment * alignment;
+}
+
+bool LogRing::push(const string_view log_stem, const string_view log_line)
+{
+  const size_t record_size = align(sizeof(RecordHeader) + log_stem.size()
+                                   + log_line.size(), ALIGNMENT);
+  if (record_size > CAPACITY) {
+    return false;
+  }
+
+  const uint64_t tail = tail_.load(memory_order_relaxed);
+  const uint64_t head = head_.load(memory_order_acquire);
+
+  /* a record does not wrap around: pad to the start of the ring instead */
+  const size_t offset = tail % CAPACITY;
+  const size_t padding = offset + record_size > CAPACITY ? CAPACITY - offset
+                                                         : 0;
+
+  if (tail + padding + record_size - head > CAPACITY) {
+    return false;
+  }
+
+  if (padding > 0) {
+    const RecordHeader header {PADDING, 0};
+    memcpy(buffer_.get() + offset, &header, sizeof(header));
+  }
+
+  char * record = buffer_.get() + (tail + padding) % CAPACITY;
+  const RecordHeader header {static_cast<uint32_t>(log_stem.size()),
+                             static_cast<uint32_t>(log_line.size())};
+  memcpy(record, &header, sizeof(header));
+  memcpy(record + sizeof(header), log_stem.data(), log_stem.size());
+  memcpy(record + sizeof(header) + log_stem.size(),
+         log_line.data(), log_line.size());
+
+  tail_.store(tail + padding + record_size, memory_order_release);
+  return true;
+}
+
+template<class F>
+void LogRing::pop_all(F && f)
+{
+  uint64_t head = head_.load(memory_order_relaxed);
+  const uint64_t tail = tail_.load(memory_order_acquire);
+
+  while (head < tail) {
+    const char * record = buffer_.get() + head % CAPACITY;
+
+    RecordHeader header;
+    memcpy(&header, record, sizeof(header));
+
+    if (header.stem_size == PADDING) {
+      head += CAPACITY - head % CAPACITY;
+      continue;
+    }
+
+    const char * stem = record + sizeof(header);
+    f(string_view(stem, header.stem_size),
+      string_view(stem + header.stem_size, header.line_size));
+
+    head += align(sizeof(header) + header.stem_size + header.line_size,
+                  ALIGNMENT);
+  }
+
+  head_.store(head, memory_order_release);
+}
+
+LogCompressor::LogCompressor()
+  : cctx_(ZSTD_createCCtx(), ZSTD_freeCCtx)
+{
+  if (not cctx_) {
+    throw runtime_error("ZSTD_createCCtx failed");
+  }
+}
+
+LogCompressor::~LogCompressor()
+{
+  {
+    lock_guard<mutex> lock(queue_mutex_);
+    stop_ = true;
+  }
+  queue_cv_.notify_all();
+
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+
+  /* the log is left to be compressed again by the next run */
+  if (job_) {
+    error_code ec;
+    fs::remove(job_->log_path.string() + ".zst.tmp", ec);
+  }
+}
+
+void LogCompressor::add(const fs::path & log_path)
+{
+  {
+    lock_guard<mutex> lock(queue_mutex_);
+    queue_.emplace_back(log_path);
+  }
+  queue_cv_.notify_one();
+}
+
+/* lower the CPU and I/O priority of the calling thread only */
+static void set_lowest_priority()
+{
+  static constexpr int IOPRIO_WHO_PROCESS = 1;
+  static constexpr int IOPRIO_CLASS_IDLE = 3;
+  static constexpr int IOPRIO_CLASS_SHIFT = 13;
+
+  const pid_t tid = syscall(SYS_gettid);
+
+  try {
+    CheckSystemCall("setpriority", setpriority(PRIO_PROCESS, tid, 19));
+    CheckSystemCall("ioprio_set", syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS,
+        tid, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT));
+  } catch (const exception & e) {
+    print_exception("LogCompressor", e);
+  }
+}
+
+void LogCompressor::start()
+{
+  call_once(start_flag_, [this]() {
+    started_ = true;
+
+    thread_ = thread([this]() {
+      set_lowest_priority();
+
+      for (;;) {
+        bool busy = false;
+        try {
+          busy = compress_some();
+        } catch (const exception & e) {
+          print_exception("LogCompressor", e);
+        }
+
+        unique_lock<mutex> lock(queue_mutex_);
+        if (not busy) {
+          queue_cv_.wait(lock, [this]() {
+            return stop_ or not queue_.empty();
+          });
+        }
+
+        if (stop_) {
+          break;
+        }
+      }
+    });
+  });
+}
+
+void LogCompressor::step()
+{
+  if (started_) {
+    return;
+  }
+
+  try {
+    compress_some();
+  } catch (const exception & e) {
+    print_exception("LogCompressor", e);
+  }
+}
+
+bool LogCompressor::compress_some()
+{
+  lock_guard<mutex> step_lock(step_mutex_);
+
+  if (not job_) {
+    fs::path log_path;
+    {
+      lock_guard<mutex> lock(queue_mutex_);
+      if (queue_.empty()) {
+        return false;
+      }
+
+      log_path = move(queue_.front());
+      queue_.pop_front();
+    }
+
+    const string tmp_path = log_path.string() + ".zst.tmp";
+    FileDescriptor log(CheckSystemCall("open (" + log_path.string() + ")",
+                                       open(log_path.c_str(), O_RDONLY)));
+    FileDescriptor output(CheckSystemCall("open (" + tmp_path + ")",
+        open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)));
+
+    ZSTD_CCtx_reset(cctx_.get(), ZSTD_reset_session_only);
+    ZSTD_CCtx_setParameter(cctx_.get(), ZSTD_c_compressionLevel, LEVEL);
+
+    job_.emplace(Job {log_path, move(log), move(output)});
+  }
+
+  const string log_path = job_->log_path.string();
+
+  try {
+    const string input = job_->log.read(STEP_SIZE);
+    if (not input.empty()) {
+      compress(*job_, input, false);
+      return true;
+    }
+
+    compress(*job_, {}, true);
+
+    /* the log is removed only once its compressed copy is durable */
+    CheckSystemCall("fsync", fsync(job_->output.fd_num()));
+    job_->output.close();
+    fs::rename(log_path + ".zst.tmp", log_path + ".zst");
+    fs::remove(log_path);
+    job_.reset();
+  } catch (const exception &) {
+    error_code ec;
+    fs::remove(log_path + ".zst.tmp", ec);
+    job_.reset();
+    throw;
+  }
+
+  return true;
+}
+
+void LogCompressor::compress(Job & job, const string_view input,
+                             const bool end)
+{
+  ZSTD_inBuffer in {input.data(), input.size(), 0};
+  string output(ZSTD_CStreamOutSize(), '\0');
+
+  for (;;) {
+    ZSTD_outBuffer out {output.data(), output.size(), 0};
+    const size_t remaining = ZSTD_compressStream2(cctx_.get(), &out, &in,
+        end ? ZSTD_e_end : ZSTD_e_continue);
+    if (ZSTD_isError(remaining)) {
+      throw runtime_error("ZSTD_compressStream2: "
+                          + string(ZSTD_getErrorName(remaining)));
+    }
+
+    if (out.pos > 0) {
+      job.output.write(string_view(output.data(), out.pos));
+    }
+
+    if (end ? remaining == 0 : in.pos == in.size) {
+      break;
+    }
+  }
+}
+
+/* the start of the partition of a time (s since epoch) */
+static uint64_t partition_of(const uint64_t ts)
+{
+  return ts / LogWriter::PARTITION_INTERVAL_S * LogWriter::PARTITION_INTERVAL_S;
+}
+
+/* e.g., 20261015T1300 */
+static string partition_name(const uint64_t partition)
+{
+  const time_t t = partition;
+  tm utc;
+  gmtime_r(&t, &utc);
+
+  char name[32];
+  strftime(name, sizeof(name), "%Y%m%dT%H%M", &utc);
+  return name;
+}
+
+LogWriter::LogWriter(const fs::path & log_dir, const string & suffix,
+                     const uint64_t max_log_size, const bool binary)
+  : log_dir_(log_dir), suffix_(suffix), max_log_size_(max_log_size),
+    binary_(binary)
+{
+  if (not fs::is_directory(log_dir_)) {
+    return;
+  }
+
+  /* compress the partitions (and .old logs) that a previous run left */
+  for (const auto & entry : fs::directory_iterator(log_dir_)) {
+    const string path = entry.path().string();
+    const string name = entry.path().filename().string();
+    const size_t pos = name.find(suffix_ + ".");
+
+    if (pos == string::npos or pos == 0
+        or not fs::is_regular_file(entry.status())) {
+      continue;
+    }
+
+    if (name.size() > 8 and name.compare(name.size() - 8, 8, ".zst.tmp") == 0) {
+      fs::remove(path);
+    } else if (name.compare(name.size() - 4, 4, ".zst") != 0) {
+      compressor_.add(path);
+    }
+  }
+}
+
+LogWriter::~LogWriter()
+{
+  stop_ = true;
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+
+  try {
+    flush();
+  } catch (const exception & e) {
+    print_exception("LogWriter", e);
+  }
+}
+
+LogRing & LogWriter::ring()
+{
+  static thread_local shared_ptr<LogRing> thread_ring;
+
+  if (not thread_ring) {
+    thread_ring = make_shared<LogRing>();
+
+    lock_guard<mutex> lock(rings_mutex_);
+    rings_.emplace_back(thread_ring);
+  }
+
+  return *thread_ring;
+}
+
+void LogWriter::append(const string_view log_stem, const string_view log_line)
+{
+  if (not ring().push(log_stem, log_line)) {
+    num_dropped_++;
+  }
+}
+
+void LogWriter::start()
+{
+  call_once(start_flag_, [this]() {
+    compressor_.start();
+
+    thread_ = thread([this]() {
+      while (not stop_) {
+        try {
+          flush();
+        } catch (const exception & e) {
+          print_exception("LogWriter", e);
+        }
+
+        this_thread::sleep_for(chrono::milliseconds(FLUSH_INTERVAL_MS));
+      }
+    });
+  });
+}
+
+void LogWriter::flush()
+{
+  lock_guard<mutex> flush_lock(flush_mutex_);
+
+  vector<shared_ptr<LogRing>> rings;
+  {
+    lock_guard<mutex> lock(rings_mutex_);
+    rings = rings_;
+  }
+
+  /* gather the lines of all the threads by log */
+  for (const auto & ring : rings) {
+    ring->pop_all([this](const string_view log_stem, const string_view line) {
+      const string stem(log_stem);
+      Log & log = get_log(stem);
+
+      if (log.encoder) {
+        try {
+          log.encoder->add(line);
+        } catch (const exception & e) {
+          print_exception("LogWriter", e);
+        }
+        return;
+      }
+
+      string & batch = batches_[stem];
+      batch.append(line);
+      batch.push_back('\n');
+    });
+  }
+
+  for (auto & [log_stem, log] : logs_) {
+    if (log.encoder and not log.encoder->empty()) {
+      write_batch(log_stem, log, log.encoder->finish());
+    }
+  }
+
+  for (auto & [log_stem, batch] : batches_) {
+    if (not batch.empty()) {
+      write_batch(log_stem, get_log(log_stem), batch);
+      batch.clear();
+    }
+  }
+
+  const uint64_t num_dropped = num_dropped_;
+  if (num_dropped > num_dropped_reported_) {
+    cerr << "LogWriter: dropped " << num_dropped - num_dropped_reported_
+         << " log lines" << endl;
+    num_dropped_reported_ = num_dropped;
+  }
+
+  compressor_.step();
+}
+
+LogWriter::Log & LogWriter::get_log(const string & log_stem)
+{
+  auto log_it = logs_.find(log_stem);
+  return log_it != logs_.end() ? log_it->second : open_log(log_stem);
+}
+
+/* whether the (nonempty) log at path starts with a binary header */
+static bool is_binary_log(const fs::path & log_path)
+{
+  ifstream log_file(log_path, ios::binary);
+  string head(BinaryLog::MAGIC.size(), '\0');
+  log_file.read(head.data(), head.size());
+
+  return log_file and head == BinaryLog::MAGIC;
+}
+
+LogWriter::Log & LogWriter::open_log(const string & log_stem)
+{
+  const string log_path = log_dir_ / (log_stem + suffix_);
+
+  optional<string> schema;
+  if (binary_) {
+    schema = BinaryLog::schema(log_stem);
+  }
+
+  /* a log left in the other format is moved aside rather than appended to,
+   * as the readers tell the format from the start of the log */
+  if (fs::exists(log_path) and fs::file_size(log_path) > 0 and
+      is_binary_log(log_path) != schema.has_value()) {
+    rotate(log_stem, partition_of(timestamp_s()));
+  }
+
+  FileDescriptor fd(CheckSystemCall("open (" + log_path + ")",
+      open(log_path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644)));
+  uint64_t size = fd.filesize();
+  const bool empty = size == 0;
+
+  /* a log left by a previous run belongs to the partition it was last
+   * written in */
+  uint64_t partition = partition_of(timestamp_s());
+  if (not empty) {
+    struct stat log_stat;
+    CheckSystemCall("fstat", fstat(fd.fd_num(), &log_stat));
+    partition = partition_of(log_stat.st_mtime);
+  }
+
+  optional<BinaryLogEncoder> encoder;
+  if (schema) {
+    if (size == 0) {
+      const string header = BinaryLog::header(*schema);
+      fd.write(header);
+      size = header.size();
+    }
+
+    encoder.emplace(*schema);
+  }
+
+  /* the lines that a rotated log has not written yet carry over */
+  auto log_it = logs_.find(log_stem);
+  if (log_it != logs_.end()) {
+    log_it->second.fd = move(fd);
+    log_it->second.size = size;
+    log_it->second.partition = partition;
+    log_it->second.empty = empty;
+    return log_it->second;
+  }
+
+  return logs_.emplace(log_stem, Log {move(fd), size, partition, empty,
+                                      move(encoder)}).first->second;
+}
+
+void LogWriter::rotate(const string & log_stem, const uint64_t partition)
+{
+  const string log_path = log_dir_ / (log_stem + suffix_);
+
+  /* never overwrite an earlier file of the partition */
+  const string partition_path = log_path + "." + partition_name(partition);
+  string rotated_path = partition_path;
+  for (unsigned int i = 1; fs::exists(rotated_path)
+                           or fs::exists(rotated_path + ".zst"); i++) {
+    rotated_path = partition_path + "." + to_string(i);
+  }
+
+  fs::rename(log_path, rotated_path);
+  cerr << "Renamed " << log_path << " to " << rotated_path << endl;
+
+  compressor_.add(rotated_path);
+}
+
+void LogWriter::write_batch(const string & log_stem, Log & log,
+                            const string & batch)
+{
+  /* the batch starts a new partition; a log without lines is just relabeled
+   * (the reader is notified of a rotation and safe to open the new log
+   * immediately) */
+  const uint64_t partition = partition_of(timestamp_s());
+  if (partition != log.partition) {
+    if (log.empty) {
+      log.partition = partition;
+    } else {
+      rotate(log_stem, log.partition);
+      open_log(log_stem);
+    }
+  }
+
+  log.fd.write(batch);
+  log.size += batch.size();
+  log.empty = false;
+
+  /* rotate log if filesize is too large */
+  if (log.size > max_log_size_) {
+    rotate(log_stem, log.partition);
+    open_log(log_stem);
+  }
+}
@@ -0,0 +1,190 @@
+#ifndef LOG_WRITER_HH
+#define LOG_WRITER_HH
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <map>
+#include <memory>
+#include <optional>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+#include "filesystem.hh"
+#include "file_descriptor.hh"
+#include "binary_log.hh"
+
+/* single-producer single-consumer ring of (log stem, log line) records,
+ * which never blocks the producer */
+class LogRing
+{
+public:
+  static constexpr size_t CAPACITY = 1 << 20;  /* bytes; a power of two */
+
+  /* producer: return false (and drop the record) if the ring is full */
+  bool push(const std::string_view log_stem, const std::string_view log_line);
+
+  /* consumer: call f(log_stem, log_line) on the records in order of push */
+  template<class F>
+  void pop_all(F && f);
+
+private:
+  struct RecordHeader {
+    uint32_t stem_size;  /* PADDING: skip to the start of the ring */
+    uint32_t line_size;
+  };
+
+  static constexpr uint32_t PADDING = UINT32_MAX;
+  static constexpr size_t ALIGNMENT = sizeof(RecordHeader);
+
+  std::unique_ptr<char[]> buffer_ {new char[CAPACITY]};
+
+  /* positions that only grow; the producer owns tail_, the consumer head_ */
+  alignas(64) std::atomic<uint64_t> head_ {0};
+  alignas(64) std::atomic<uint64_t> tail_ {0};
+};
+
+struct ZSTD_CCtx_s;
+
+/* Compresses rotated logs with zstd, one after another, into <log>.zst and
+ * then removes them. Either a background thread at the lowest CPU and I/O
+ * priority does it, or whoever calls step() periodically, a bounded piece at
+ * a time. A log is removed only once its .zst is complete; a partial
+ * <log>.zst.tmp is removed on destruction. */
+class LogCompressor
+{
+public:
+  static constexpr int LEVEL = 3;
+  static constexpr size_t STEP_SIZE = 128 * 1024;  /* bytes of log per step */
+
+  LogCompressor();
+  ~LogCompressor();
+
+  /* from any thread */
+  void add(const fs::path & log_path);
+
+  /* start the background thread (once) */
+  void start();
+
+  /* without the background thread: compress up to STEP_SIZE bytes of the
+   * queued logs */
+  void step();
+
+private:
+  struct Job {
+    fs::path log_path;
+    FileDescriptor log;
+    FileDescriptor output;  /* of <log>.zst.tmp */
+  };
+
+  std::unique_ptr<ZSTD_CCtx_s, size_t (*)(ZSTD_CCtx_s *)> cctx_;
+
+  std::mutex queue_mutex_ {};  /* protects queue_ and stop_ */
+  std::condition_variable queue_cv_ {};
+  std::deque<fs::path> queue_ {};
+  bool stop_ {false};
+  std::atomic<bool> started_ {false};
+
+  std::mutex step_mutex_ {};  /* serializes step(); protects job_ */
+  std::optional<Job> job_ {};
+
+  std::once_flag start_flag_ {};
+  std::thread thread_ {};
+
+  /* compress up to STEP_SIZE bytes; false if there was nothing to do */
+  bool compress_some();
+
+  /* write the output of compressing input (to its end with end) */
+  void compress(Job & job, const std::string_view input, const bool end);
+};
+
+/* Appends the log lines of all the event-loop threads to log_dir/<log stem>
+ * <suffix>. Each thread pushes its lines to a LogRing of its own, and the
+ * lines are written in batches, a write(2) per log, by a background thread
+ * (or by whoever calls flush() periodically, e.g., if the process must not
+ * have other threads). There is a single LogWriter per process.
+ *
+ * The logs are partitioned by time: a log is renamed to <log>.<start of its
+ * partition in UTC, e.g., 20261015T1300> and reopened at the first write of
+ * the next partition (PARTITION_INTERVAL_S), or earlier (with a suffix .1,
+ * .2, ...) once it grows past max_log_size. A renamed log is never
+ * overwritten; it is compressed to <partition>.zst by a LogCompressor, in
+ * the same way as the lines are written (a background thread or flush()).
+ * Partitions left uncompressed by a previous run are compressed as well.
+ *
+ * With binary, the logs of the measurements that have a BinaryLog schema are
+ * written in the binary format, a block per batch, instead of as text. */
+class LogWriter
+{
+public:
+  static constexpr unsigned int FLUSH_INTERVAL_MS = 10;
+  static constexpr uint64_t PARTITION_INTERVAL_S = 3600;
+
+  LogWriter(const fs::path & log_dir, const std::string & suffix,
+            const uint64_t max_log_size, const bool binary = false);
+
+  /* stop the background thread and write what is left */
+  ~LogWriter();
+
+  /* from any thread; never blocks on I/O, and drops the line if the ring of
+   * the calling thread is full */
+  void append(const std::string_view log_stem,
+              const std::string_view log_line);
+
+  /* start the background threads (once) */
+  void start();
+
+  /* write the lines appended so far */
+  void flush();
+
+  /* lines dropped because a ring was full */
+  uint64_t num_dropped() const { return num_dropped_; }
+
+private:
+  struct Log {
+    FileDescriptor fd;
+    uint64_t size;
+    uint64_t partition;  /* start of its partition (s since epoch) */
+    bool empty;  /* no lines yet (but possibly a binary header) */
+    std::optional<BinaryLogEncoder> encoder;  /* of a binary log */
+  };
+
+  fs::path log_dir_;
+  std::string suffix_;
+  uint64_t max_log_size_;
+  bool binary_;
+
+  std::mutex rings_mutex_ {};  /* protects rings_ */
+  std::vector<std::shared_ptr<LogRing>> rings_ {};
+
+  std::mutex flush_mutex_ {};  /* serializes flush() */
+  std::map<std::string, Log> logs_ {};          /* key: log stem */
+  std::map<std::string, std::string> batches_ {};  /* key: log stem */
+
+  std::atomic<uint64_t> num_dropped_ {0};
+  uint64_t num_dropped_reported_ {0};
+
+  LogCompressor compressor_ {};
+
+  std::atomic<bool> stop_ {false};
+  std::once_flag start_flag_ {};
+  std::thread thread_ {};
+
+  /* the ring of the calling thread, which is registered on first use */
+  LogRing & ring();
+
+  Log & get_log(const std::string & log_stem);
+  Log & open_log(const std::string & log_stem);
+  void write_batch(const std::string & log_stem, Log & log,
+                   const std::string & batch);
+
+  /* rename the log of log_stem to a new file of partition, which is queued
+   * to compressor_ */
+  void rotate(const std::string & log_stem, const uint64_t partition);
+};
+
+#endif /* LOG_WRITER_HH */
@@ -0,0 +1,301 @@
+#include "media_index.hh"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <cstring>
+#include <stdexcept>
+
+#include "file_descriptor.hh"
+#include "exception.hh"
+#include "mmap.hh"
+#include "pid.hh"
+
+using namespace std;
+
+/* "PUFIDX" followed by the layout version */
+static constexpr uint64_t MAGIC = 0x5055464944580001;
+
+/* give up on a slot whose writer seems to have died in the middle */
+static constexpr unsigned int MAX_READ_ATTEMPTS = 1000;
+
+MediaIndex::MediaIndex(const fs::path & path, const ino_t inode,
+                       const shared_ptr<void> & mapping)
+  : path_(path), inode_(inode), mapping_(mapping),
+    header_(static_cast<Header *>(mapping.get())),
+    vslots_(reinterpret_cast<VideoSlot *>(header_ + 1)),
+    aslots_(reinterpret_cast<AudioSlot *>(vslots_ + CAPACITY))
+{}
+
+unique_ptr<MediaIndex> MediaIndex::create(const fs::path & path,
+  const size_t num_vformats, const size_t num_aformats,
+  const unsigned int vduration, const unsigned int aduration)
+{
+  if (num_vformats > MAX_FORMATS or num_aformats > MAX_FORMATS) {
+    throw runtime_error("MediaIndex: too many formats");
+  }
+
+  if (vduration == 0 or aduration == 0) {
+    throw runtime_error("MediaIndex: invalid chunk duration");
+  }
+
+  /* readers of the replaced index keep their mapping until they notice */
+  const fs::path tmp_path = path.string() + ".tmp." + to_string(pid());
+
+  FileDescriptor fd(CheckSystemCall("open (" + tmp_path.string() + ")",
+      open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644)));
+
+  /* the file is zero-filled, which is an empty index */
+  CheckSystemCall("ftruncate", ftruncate(fd.fd_num(), SIZE));
+
+  auto mapping = mmap_shared(nullptr, SIZE, PROT_READ | PROT_WRITE,
+                             MAP_SHARED, fd.fd_num(), 0);
+
+  struct stat st;
+  CheckSystemCall("fstat", fstat(fd.fd_num(), &st));
+
+  unique_ptr<MediaIndex> index(new MediaIndex(path, st.st_ino, mapping));
+  index->header_->num_vformats = num_vformats;
+  index->header_->num_aformats = num_aformats;
+  index->header_->vduration = vduration;
+  index->header_->aduration = aduration;
+  index->header_->magic = MAGIC;
+
+  fs::rename(tmp_path, path);
+  return index;
+}
+
+unique_ptr<MediaIndex> MediaIndex::attach(const fs::path & path)
+{
+  FileDescriptor fd(CheckSystemCall("open (" + path.string() + ")",
+      open(path.c_str(), O_RDONLY)));
+
+  struct stat st;
+  CheckSystemCall("fstat", fstat(fd.fd_num(), &st));
+
+  if (static_cast<size_t>(st.st_size) != SIZE) {
+    throw runtime_error("MediaIndex: " + path.string() + " has a wrong size");
+  }
+
+  auto mapping = mmap_shared(nullptr, SIZE, PROT_READ, MAP_SHARED,
+                             fd.fd_num(), 0);
+
+  unique_ptr<MediaIndex> index(new MediaIndex(path, st.st_ino, mapping));
+  if (index->header_->magic != MAGIC) {
+    throw runtime_error("MediaIndex: " + path.string() + " is not an index");
+  }
+
+  return index;
+}
+
+bool MediaIndex::replaced() const
+{
+  struct stat st;
+  if (stat(path_.c_str(), &st) < 0) {
+    return true;
+  }
+
+  return st.st_ino != inode_;
+}
+
+void MediaIndex::check_format(const size_t idx, const size_t num_formats) const
+{
+  if (idx >= num_formats) {
+    throw out_of_range("MediaIndex: invalid format index");
+  }
+}
+
+template<class Slot>
+Slot * MediaIndex::begin_write(Slot * slots, const uint64_t ts,
+                               const uint64_t duration)
+{
+  if (ts % duration != 0) {
+    throw runtime_error("MediaIndex: invalid timestamp");
+  }
+
+  Slot & slot = slots[(ts / duration) % CAPACITY];
+
+  /* slot.ts holds the timestamp + 1, so that a zeroed slot is empty */
+  const uint64_t slot_ts = slot.ts.load(memory_order_relaxed);
+  if (slot_ts > ts + 1) {
+    return nullptr;
+  }
+
+  /* an odd sequence number makes the readers retry */
+  slot.seq.store(slot.seq.load(memory_order_relaxed) + 1,
+                 memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  if (slot_ts != ts + 1) {
+    slot.ts.store(ts + 1, memory_order_relaxed);
+    slot.ready_mask.store(0, memory_order_relaxed);
+
+    if constexpr (is_same_v<Slot, VideoSlot>) {
+      slot.ssim_mask.store(0, memory_order_relaxed);
+    }
+  }
+
+  return &slot;
+}
+
+template<class Slot>
+void MediaIndex::end_write(Slot & slot, const uint64_t ts,
+                           atomic<uint64_t> & latest)
+{
+  slot.seq.store(slot.seq.load(memory_order_relaxed) + 1,
+                 memory_order_release);
+
+  if (latest.load(memory_order_relaxed) < ts + 1) {
+    latest.store(ts + 1, memory_order_release);
+  }
+
+  header_->generation.store(
+    header_->generation.load(memory_order_relaxed) + 1, memory_order_release);
+}
+
+void MediaIndex::set_vinit(const size_t vf_idx)
+{
+  check_format(vf_idx, num_vformats());
+
+  header_->vinit_mask.fetch_or(uint64_t(1) << vf_idx);
+  header_->generation++;
+}
+
+void MediaIndex::set_ainit(const size_t af_idx)
+{
+  check_format(af_idx, num_aformats());
+
+  header_->ainit_mask.fetch_or(uint64_t(1) << af_idx);
+  header_->generation++;
+}
+
+void MediaIndex::set_video(const uint64_t ts, const size_t vf_idx)
+{
+  check_format(vf_idx, num_vformats());
+
+  VideoSlot * slot = begin_write(vslots_, ts, vduration());
+  if (not slot) {
+    return;
+  }
+
+  slot->ready_mask.store(slot->ready_mask.load(memory_order_relaxed)
+                         | (uint64_t(1) << vf_idx), memory_order_relaxed);
+  end_write(*slot, ts, header_->vlatest);
+}
+
+void MediaIndex::set_ssim(const uint64_t ts, const size_t vf_idx,
+                          const double ssim)
+{
+  check_format(vf_idx, num_vformats());
+
+  VideoSlot * slot = begin_write(vslots_, ts, vduration());
+  if (not slot) {
+    return;
+  }
+
+  uint64_t bits;
+  memcpy(&bits, &ssim, sizeof(bits));
+
+  slot->ssim_bits[vf_idx].store(bits, memory_order_relaxed);
+  slot->ssim_mask.store(slot->ssim_mask.load(memory_order_relaxed)
+                        | (uint64_t(1) << vf_idx), memory_order_relaxed);
+  end_write(*slot, ts, header_->vlatest);
+}
+
+void MediaIndex::set_audio(const uint64_t ts, const size_t af_idx)
+{
+  check_format(af_idx, num_aformats());
+
+  AudioSlot * slot = begin_write(aslots_, ts, aduration());
+  if (not slot) {
+    return;
+  }
+
+  slot->ready_mask.store(slot->ready_mask.load(memory_order_relaxed)
+                         | (uint64_t(1) << af_idx), memory_order_relaxed);
+  end_write(*slot, ts, header_->alatest);
+}
+
+optional<uint64_t> MediaIndex::vlatest() const
+{
+  const uint64_t latest = header_->vlatest.load(memory_order_acquire);
+  return latest > 0 ? optional<uint64_t>(latest - 1) : nullopt;
+}
+
+optional<uint64_t> MediaIndex::alatest() const
+{
+  const uint64_t latest = header_->alatest.load(memory_order_acquire);
+  return latest > 0 ? optional<uint64_t>(latest - 1) : nullopt;
+}
+
+optional<MediaIndex::VideoChunk> MediaIndex::video(const uint64_t ts) const
+{
+  if (ts % vduration() != 0) {
+    return nullopt;
+  }
+
+  const VideoSlot & slot = vslots_[(ts / vduration()) % CAPACITY];
+
+  for (unsigned int i = 0; i < MAX_READ_ATTEMPTS; i++) {
+    const uint64_t seq = slot.seq.load(memory_order_acquire);
+    if (seq % 2 == 1) {
+      continue;
+    }
+
+    const uint64_t slot_ts = slot.ts.load(memory_order_relaxed);
+
+    VideoChunk chunk;
+    chunk.ready_mask = slot.ready_mask.load(memory_order_relaxed);
+    chunk.ssim_mask = slot.ssim_mask.load(memory_order_relaxed);
+    for (size_t j = 0; j < num_vformats(); j++) {
+      const uint64_t bits = slot.ssim_bits[j].load(memory_order_relaxed);
+      memcpy(&chunk.ssim[j], &bits, sizeof(bits));
+    }
+
+    atomic_thread_fence(memory_order_acquire);
+    if (slot.seq.load(memory_order_relaxed) != seq) {
+      continue;
+    }
+
+    if (slot_ts != ts + 1) {
+      return nullopt;
+    }
+
+    return chunk;
+  }
+
+  return nullopt;
+}
+
+optional<MediaIndex::AudioChunk> MediaIndex::audio(const uint64_t ts) const
+{
+  if (ts % aduration() != 0) {
+    return nullopt;
+  }
+
+  const AudioSlot & slot = aslots_[(ts / aduration()) % CAPACITY];
+
+  for (unsigned int i = 0; i < MAX_READ_ATTEMPTS; i++) {
+    const uint64_t seq = slot.seq.load(memory_order_acquire);
+    if (seq % 2 == 1) {
+      continue;
+    }
+
+    const uint64_t slot_ts = slot.ts.load(memory_order_relaxed);
+
+    AudioChunk chunk;
+    chunk.ready_mask = slot.ready_mask.load(memory_order_relaxed);
+
+    atomic_thread_fence(memory_order_acquire);
+    if (slot.seq.load(memory_order_relaxed) != seq) {
+      continue;
+    }
+
+    if (slot_ts != ts + 1) {
+      return nullopt;
+    }
+
+    return chunk;
+  }
+
+  return nullopt;
+}
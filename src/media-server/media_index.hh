@@ -0,0 +1,141 @@
+#ifndef MEDIA_INDEX_HH
+#define MEDIA_INDEX_HH
+
+#include <cstdint>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <optional>
+#include <sys/types.h>
+
+#include "filesystem.hh"
+
+/* Index of the ready chunks and SSIMs of a live channel, kept in a file
+ * (preferably on a tmpfs such as /dev/shm) by the media_indexer daemon and
+ * mapped read-only by all the ws_media_servers on the host, so that only the
+ * daemon watches the ready/ directories and reads the SSIM files.
+ *
+ * The video and audio chunks are kept in rings of CAPACITY slots, where the
+ * chunk at ts goes into slot (ts / duration) % CAPACITY. Each slot is guarded
+ * by a seqlock: the (only) writer makes the sequence number odd while
+ * updating the slot, and readers retry if the number was odd or has changed
+ * during their read. Readers never block the writer. */
+class MediaIndex
+{
+public:
+  static constexpr size_t MAX_FORMATS = 64;
+  static constexpr uint64_t CAPACITY = 512;
+
+  struct VideoChunk {
+    uint64_t ready_mask {0};  /* bit i: the chunk of format i is ready */
+    uint64_t ssim_mask {0};   /* bit i: the SSIM of format i is ready */
+    std::array<double, MAX_FORMATS> ssim {};
+  };
+
+  struct AudioChunk {
+    uint64_t ready_mask {0};
+  };
+
+  /* create an empty index at path, replacing the existing one (writer) */
+  static std::unique_ptr<MediaIndex> create(const fs::path & path,
+    const size_t num_vformats, const size_t num_aformats,
+    const unsigned int vduration, const unsigned int aduration);
+
+  /* map the index at path read-only (reader) */
+  static std::unique_ptr<MediaIndex> attach(const fs::path & path);
+
+  size_t num_vformats() const { return header_->num_vformats; }
+  size_t num_aformats() const { return header_->num_aformats; }
+  unsigned int vduration() const { return header_->vduration; }
+  unsigned int aduration() const { return header_->aduration; }
+
+  /* writer */
+  void set_vinit(const size_t vf_idx);
+  void set_ainit(const size_t af_idx);
+  void set_video(const uint64_t ts, const size_t vf_idx);
+  void set_ssim(const uint64_t ts, const size_t vf_idx, const double ssim);
+  void set_audio(const uint64_t ts, const size_t af_idx);
+
+  /* reader */
+
+  /* changes on every update, so that an unchanged index need not be read */
+  uint64_t generation() const { return header_->generation; }
+
+  /* bit i: the init segment of format i is ready */
+  uint64_t vinit_mask() const { return header_->vinit_mask; }
+  uint64_t ainit_mask() const { return header_->ainit_mask; }
+
+  /* largest timestamp with a chunk in the index */
+  std::optional<uint64_t> vlatest() const;
+  std::optional<uint64_t> alatest() const;
+
+  /* the chunk at ts; nullopt if ts has no slot, e.g., it has been overwritten */
+  std::optional<VideoChunk> video(const uint64_t ts) const;
+  std::optional<AudioChunk> audio(const uint64_t ts) const;
+
+  /* whether the index at the mapped path has been replaced, e.g., because
+   * media_indexer has been restarted; the mapped index is then stale */
+  bool replaced() const;
+
+  /* forbid copying */
+  MediaIndex(const MediaIndex & other) = delete;
+  const MediaIndex & operator=(const MediaIndex & other) = delete;
+
+private:
+  struct Header {
+    uint64_t magic;
+    uint64_t num_vformats;
+    uint64_t num_aformats;
+    uint64_t vduration;
+    uint64_t aduration;
+    std::atomic<uint64_t> vinit_mask;
+    std::atomic<uint64_t> ainit_mask;
+    std::atomic<uint64_t> vlatest;  /* latest timestamp + 1; 0 if none */
+    std::atomic<uint64_t> alatest;
+    std::atomic<uint64_t> generation;
+  };
+
+  struct VideoSlot {
+    std::atomic<uint64_t> seq;
+    std::atomic<uint64_t> ts;
+    std::atomic<uint64_t> ready_mask;
+    std::atomic<uint64_t> ssim_mask;
+    std::array<std::atomic<uint64_t>, MAX_FORMATS> ssim_bits;
+  };
+
+  struct AudioSlot {
+    std::atomic<uint64_t> seq;
+    std::atomic<uint64_t> ts;
+    std::atomic<uint64_t> ready_mask;
+  };
+
+  static_assert(std::atomic<uint64_t>::is_always_lock_free,
+                "MediaIndex requires lock-free atomics in shared memory");
+
+  static constexpr size_t SIZE = sizeof(Header) + CAPACITY * sizeof(VideoSlot)
+                                 + CAPACITY * sizeof(AudioSlot);
+
+  fs::path path_ {};
+  ino_t inode_ {};
+  std::shared_ptr<void> mapping_ {};
+
+  Header * header_ {nullptr};
+  VideoSlot * vslots_ {nullptr};
+  AudioSlot * aslots_ {nullptr};
+
+  MediaIndex(const fs::path & path, const ino_t inode,
+             const std::shared_ptr<void> & mapping);
+
+  /* open the slot of ts for writing, resetting it if it holds an older ts;
+   * return nullptr if it holds a newer ts */
+  template<class Slot>
+  Slot * begin_write(Slot * slots, const uint64_t ts, const uint64_t duration);
+
+  /* close the slot and publish ts as the latest if it is */
+  template<class Slot>
+  void end_write(Slot & slot, const uint64_t ts, std::atomic<uint64_t> & latest);
+
+  void check_format(const size_t idx, const size_t num_formats) const;
+};
+
+#endif /* MEDIA_INDEX_HH */
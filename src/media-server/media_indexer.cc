@@ -0,0 +1,212 @@
+#include <cassert>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+
+#include "yaml.hh"
+#include "media_formats.hh"
+#include "exception.hh"
+#include "poller.hh"
+#include "inotify.hh"
+#include "filesystem.hh"
+#include "channel.hh"
+#include "media_index.hh"
+#include "ssim_log.hh"
+
+using namespace std;
+using namespace PollerShortNames;
+
+void print_usage(const string & program_name)
+{
+  cerr << "Usage: " << program_name << " <YAML configuration>" << endl;
+}
+
+/* record a file that has been moved into a ready/ directory in the index */
+void index_file(MediaIndex & index, const fs::path & filepath,
+                const size_t format_idx, const bool is_video)
+{
+  const string filestem = filepath.stem();
+  const string extension = filepath.extension();
+
+  try {
+    if (filestem == "init") {
+      if (is_video) {
+        index.set_vinit(format_idx);
+      } else {
+        index.set_ainit(format_idx);
+      }
+    } else if (is_video and extension == ".m4s") {
+      index.set_video(stoull(filestem), format_idx);
+    } else if (is_video and extension == ".ssim") {
+      ifstream ssim_file(filepath);
+      string line;
+      getline(ssim_file, line);
+
+      index.set_ssim(stoull(filestem), format_idx, stod(line));
+    } else if (not is_video and extension == ".chk") {
+      index.set_audio(stoull(filestem), format_idx);
+    }
+  } catch (const exception & e) {
+    cerr << "media_indexer: ignored " << filepath << " (" << e.what() << ")"
+         << endl;
+  }
+}
+
+/* watch dir for new files and index the existing ones */
+void watch_dir(Inotify & inotify, MediaIndex & index, const string & dir,
+               const size_t format_idx, const bool is_video)
+{
+  inotify.add_watch(dir, IN_MOVED_TO,
+    [&index, dir, format_idx, is_video](const inotify_event & event,
+                                        const string & path) {
+      /* only interested in regular files that are moved into the dir */
+      if (not (event.mask & IN_MOVED_TO) or (event.mask & IN_ISDIR)) {
+        return;
+      }
+
+      assert(dir == path);
+      assert(event.len != 0);
+
+      index_file(index, fs::path(path) / event.name, format_idx, is_video);
+    }
+  );
+
+  for (const auto & file : fs::directory_iterator(dir)) {
+    index_file(index, file.path(), format_idx, is_video);
+  }
+}
+
+/* watch ssim_log for appends and index the existing records */
+void watch_ssim_log(Inotify & inotify, MediaIndex & index, SSIMLog & ssim_log)
+{
+  auto read_log = [&index, &ssim_log]() {
+    ssim_log.tail(
+      [&index](const SSIMLog::Record & record) {
+        try {
+          index.set_ssim(record.ts, record.format_idx, record.ssim);
+        } catch (const exception & e) {
+          cerr << "media_indexer: ignored SSIM record of " << record.ts
+               << " (" << e.what() << ")" << endl;
+        }
+      }
+    );
+  };
+
+  const string log_name = ssim_log.path().filename();
+
+  inotify.add_watch(ssim_log.path().parent_path(), IN_MODIFY,
+    [read_log, log_name](const inotify_event & event, const string &) {
+      if (not (event.mask & IN_MODIFY) or event.len == 0 or
+          event.name != log_name) {
+        return;
+      }
+
+      read_log();
+    }
+  );
+
+  read_log();
+}
+
+int main(int argc, char * argv[])
+{
+  if (argc < 1) {
+    abort();
+  }
+
+  if (argc != 2) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  YAML::Node config = YAML::LoadFile(argv[1]);
+  if (not config["media_index_dir"]) {
+    cerr << "media_indexer: media_index_dir is not set" << endl;
+    return EXIT_FAILURE;
+  }
+
+  const fs::path media_dir = config["media_dir"].as<string>();
+  const fs::path media_index_dir = config["media_index_dir"].as<string>();
+  fs::create_directories(media_index_dir);
+
+  Poller poller;
+  Inotify inotify(poller);
+
+  /* only live channels have new chunks to index */
+  map<string, unique_ptr<MediaIndex>> indices;
+  map<string, unique_ptr<SSIMLog>> ssim_logs;
+
+  for (const auto & channel_name : load_channels(config)) {
+    const auto & channel_config = config["channel_configs"][channel_name];
+    if (not channel_config["live"].as<bool>()) {
+      continue;
+    }
+
+    /* the chunks appended to segments have no file to be indexed by */
+    if (channel_config["segment_minutes"]) {
+      cerr << "media_indexer: channel " << channel_name
+           << " has segment_minutes and is not indexed" << endl;
+      continue;
+    }
+
+    const auto vformats = channel_video_formats(channel_config);
+    const auto aformats = channel_audio_formats(channel_config);
+
+    const unsigned int vduration = channel_config["video_duration"] ?
+        channel_config["video_duration"].as<unsigned int>() :
+        Channel::DEFAULT_VIDEO_DURATION;
+    const unsigned int aduration = channel_config["audio_duration"] ?
+        channel_config["audio_duration"].as<unsigned int>() :
+        Channel::DEFAULT_AUDIO_DURATION;
+
+    try {
+      /* the watches refer to the index, which must outlive them */
+      auto & index = indices.emplace(channel_name, MediaIndex::create(
+          media_index_dir / (channel_name + ".index"),
+          vformats.size(), aformats.size(), vduration, aduration)
+      ).first->second;
+
+      const fs::path ready_path = media_dir / channel_name / "ready";
+
+      const bool ssim_log = channel_config["ssim_log"] ?
+                            channel_config["ssim_log"].as<bool>() : false;
+
+      for (size_t vf_idx = 0; vf_idx < vformats.size(); vf_idx++) {
+        const string vf = vformats[vf_idx].to_string();
+        watch_dir(inotify, *index, ready_path / vf, vf_idx, true);
+
+        if (not ssim_log) {
+          watch_dir(inotify, *index, ready_path / (vf + "-ssim"), vf_idx, true);
+        }
+      }
+
+      if (ssim_log) {
+        auto & log = ssim_logs.emplace(channel_name,
+          make_unique<SSIMLog>(ready_path / "ssim.log")).first->second;
+        watch_ssim_log(inotify, *index, *log);
+      }
+
+      for (size_t af_idx = 0; af_idx < aformats.size(); af_idx++) {
+        watch_dir(inotify, *index, ready_path / aformats[af_idx].to_string(),
+                  af_idx, false);
+      }
+
+      cerr << "media_indexer: indexing channel " << channel_name << endl;
+    } catch (const exception & e) {
+      cerr << "Error: exceptions in channel " << channel_name << ": "
+           << e.what() << endl;
+    }
+  }
+
+  for (;;) {
+    auto ret = poller.poll(-1);
+    if (ret.result != Poller::Result::Type::Success) {
+      return ret.exit_status;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
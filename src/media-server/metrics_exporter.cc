@@ -0,0 +1,128 @@
+#include "metrics_exporter.hh"
+
+#include <iostream>
+
+#include "metrics.hh"
+#include "timestamp.hh"
+#include "strict_conversions.hh"
+#include "util.hh"
+
+using namespace std;
+using namespace PollerShortNames;
+
+MetricsExporter::MetricsExporter(Poller & poller,
+                                 const YAML::Node & influx_config,
+                                 const string & server_id,
+                                 const unsigned int thread_id)
+  : tags_(",server_id=" + server_id + ",thread=" + to_string(thread_id)),
+    client_(poller,
+            influx_config["host"].as<string>(),
+            to_string(influx_config["port"].as<uint16_t>()),
+            influx_config["dbname"].as<string>(),
+            influx_config["user"].as<string>(),
+            safe_getenv(influx_config["password"].as<string>()))
+{
+  Metrics::enable();
+
+  timer_.start(PROBE_INTERVAL_MS, PROBE_INTERVAL_MS);
+
+  poller.add_action(Poller::Action(timer_, Direction::In,
+    [this]()->Result {
+      if (timer_.expirations() > 0) {
+        probe();
+      }
+
+      return ResultType::Continue;
+    }
+  ).named("metrics_exporter"));
+}
+
+void MetricsExporter::probe()
+{
+  /* how late the poller has run the timer */
+  const uint64_t now = timestamp_us();
+  if (last_probe_us_ > 0) {
+    const uint64_t due = last_probe_us_ + PROBE_INTERVAL_MS * 1000;
+    Metrics::record("poll_lag_us", now > due ? now - due : 0);
+  }
+  last_probe_us_ = now;
+
+  if (++num_probes_ >= PROBES_PER_EXPORT) {
+    num_probes_ = 0;
+    export_metrics();
+  }
+}
+
+void MetricsExporter::export_metrics()
+{
+  const string ts = to_string(timestamp_ms());
+  string payload;
+
+  for (auto & [name, histogram] : Metrics::thread_histograms()) {
+    if (histogram.count() == 0) {
+      continue;
+    }
+
+    payload += "server_metrics" + tags_ + ",metric=" + name
+      + " count=" + to_string(histogram.count()) + "i"
+      + ",mean=" + double_to_string(static_cast<double>(histogram.sum())
+                                    / histogram.count(), 1)
+      + ",p50=" + to_string(histogram.quantile(0.5)) + "i"
+      + ",p90=" + to_string(histogram.quantile(0.9)) + "i"
+      + ",p99=" + to_string(histogram.quantile(0.99)) + "i"
+      + ",max=" + to_string(histogram.max()) + "i " + ts + "\n";
+
+    histogram.clear();
+  }
+
+  if (Counters::enabled) {
+    const Counters::Values counters = Counters::thread_values();
+
+    payload += "server_counters" + tags_ + " ";
+    for (unsigned int i = 0; i < Counters::NUM_COUNTERS; i++) {
+      payload += string(i > 0 ? "," : "")
+        + Counters::name(static_cast<Counters::Counter>(i)) + "="
+        + to_string(counters[i] - last_counters_[i]) + "i";
+    }
+    payload += " " + ts + "\n";
+
+    last_counters_ = counters;
+  }
+
+  if (stream_stats_) {
+    for (const auto & [channel, viewers] : stream_stats_->channel_viewers()) {
+      payload += "stream_viewers" + tags_ + ",channel=" + channel
+        + " viewers=" + to_string(viewers) + "i " + ts + "\n";
+    }
+
+    for (const auto & [key, viewers] : stream_stats_->format_viewers()) {
+      payload += "stream_formats" + tags_ + ",channel=" + key.first
+        + ",format=" + key.second
+        + " viewers=" + to_string(viewers) + "i " + ts + "\n";
+    }
+
+    const auto & levels = stream_stats_->buffer_levels();
+    payload += "stream_buffers" + tags_ + " ";
+    for (size_t i = 0; i < levels.size(); i++) {
+      payload += string(i > 0 ? "," : "")
+        + StreamStats::buffer_level_name(i) + "="
+        + to_string(levels[i]) + "i";
+    }
+    payload += " " + ts + "\n";
+  }
+
+  if (payload.empty()) {
+    return;
+  }
+
+  /* InfluxDB cannot keep up: drop rather than buffer the summaries */
+  if (client_.buffered_bytes() > MAX_BUFFERED_BYTES) {
+    if (num_dropped_++ % 60 == 0) {
+      cerr << "MetricsExporter: InfluxDB is behind; dropped "
+           << num_dropped_ << " exports so far" << endl;
+    }
+    return;
+  }
+
+  client_.post(payload);
+}
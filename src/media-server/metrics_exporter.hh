@@ -0,0 +1,71 @@
+#ifndef METRICS_EXPORTER_HH
+#define METRICS_EXPORTER_HH
+
+#include <cstdint>
+#include <string>
+
+#include "yaml.hh"
+#include "counters.hh"
+#include "poller.hh"
+#include "timerfd.hh"
+#include "address.hh"
+#include "influxdb_client.hh"
+#include "stream_stats.hh"
+
+/* Pushes a summary of the histograms of an event-loop thread (see Metrics)
+ * to InfluxDB every second, from the thread's own poller and without going
+ * through a log file, as lines such as
+ *
+ *   server_metrics,server_id=1,thread=0,metric=ack_latency_ms
+ *     count=42i,mean=183.5,p50=160i,p90=320i,p99=640i,max=702i <ts in ms>
+ *
+ * The exporter also samples how late the poller runs its timer (the
+ * poll_lag_us metric). When built with --enable-counters, it also pushes
+ * what the thread's counters (see Counters) have grown by since the last
+ * export, e.g.,
+ *
+ *   server_counters,server_id=1,thread=0 fd_reads=310i,...,alloc_bytes=9120i
+ *
+ * from which syscalls and allocations per MB served can be derived. Given
+ * the thread's StreamStats, it also pushes the viewers of its clients, e.g.,
+ *
+ *   stream_viewers,server_id=1,thread=0,channel=nbc viewers=12i
+ *   stream_formats,server_id=1,thread=0,channel=nbc,format=1280x720-22 ...
+ *   stream_buffers,server_id=1,thread=0 lt1s=0i,lt2s=1i,...,ge10s=9i
+ *
+ * Summaries are dropped rather than buffered while InfluxDB cannot keep
+ * up. */
+class MetricsExporter
+{
+public:
+  static constexpr unsigned int PROBE_INTERVAL_MS = 100;
+  static constexpr unsigned int PROBES_PER_EXPORT = 10;
+  static constexpr size_t MAX_BUFFERED_BYTES = 1 << 20;
+
+  MetricsExporter(Poller & poller, const YAML::Node & influx_config,
+                  const std::string & server_id,
+                  const unsigned int thread_id);
+
+  /* export stats (which must outlive the exporter) too */
+  void set_stream_stats(const StreamStats & stats) { stream_stats_ = &stats; }
+
+  /* forbid copying */
+  MetricsExporter(const MetricsExporter & other) = delete;
+  const MetricsExporter & operator=(const MetricsExporter & other) = delete;
+
+private:
+  std::string tags_ {};  /* e.g., ",server_id=1,thread=0" */
+  InfluxDBClient client_;
+
+  Timerfd timer_ {};
+  uint64_t last_probe_us_ {0};
+  unsigned int num_probes_ {0};
+  uint64_t num_dropped_ {0};
+  Counters::Values last_counters_ {};
+  const StreamStats * stream_stats_ {nullptr};
+
+  void probe();
+  void export_metrics();
+};
+
+#endif /* METRICS_EXPORTER_HH */
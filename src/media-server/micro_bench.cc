@@ -0,0 +1,491 @@
+#include <getopt.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "ws_frame.hh"
+#include "ws_message_parser.hh"
+#include "http_request_parser.hh"
+#include "server_message.hh"
+#include "client_message.hh"
+#include "eventfd.hh"
+#include "poller.hh"
+#include "distribution.hh"
+#include "timestamp.hh"
+#include "exception.hh"
+
+using namespace std;
+using namespace PollerShortNames;
+
+void print_usage(const string & program_name)
+{
+  cerr <<
+  "Usage: " << program_name << " [options]\n\n"
+  "Time the serialization paths of net/ and media-server (WebSocket frames,\n"
+  "HTTP requests, server and client messages, media segments),\n"
+  "Poller::poll() among idle fds and the distribution kernels of PufferTTP,\n"
+  "and print the time per iteration of each.\n\n"
+  "Options:\n"
+  "-f, --filter <text>        only run the benchmarks whose names contain <text>\n"
+  "-t, --min-time <ms>        run each benchmark for at least <ms> (default 500)\n"
+  "-b, --baseline <file>      compare with an earlier output of this program"
+  << endl;
+}
+
+/* keep the compiler from optimizing away a value that is never used */
+template<class T>
+inline void do_not_optimize(const T & value)
+{
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+class Benchmarks
+{
+public:
+  Benchmarks(const string & filter, const uint64_t min_time_ms,
+             map<string, double> && baseline)
+    : filter_(filter), min_time_ns_(min_time_ms * MILLION),
+      baseline_(move(baseline))
+  {}
+
+  /* call body(iterations) with more and more iterations until it takes at
+   * least min_time_ms; bytes is what one iteration processes (0 if that is
+   * not meaningful) */
+  template<class Body>
+  void run(const string & name, const size_t bytes, Body && body);
+
+private:
+  string filter_;
+  uint64_t min_time_ns_;
+  map<string, double> baseline_;
+};
+
+template<class Body>
+void Benchmarks::run(const string & name, const size_t bytes, Body && body)
+{
+  if (name.find(filter_) == string::npos) {
+    return;
+  }
+
+  body(1);  /* warm up */
+
+  uint64_t iterations = 1;
+  uint64_t elapsed_ns = 0;
+
+  for (;;) {
+    const uint64_t start_ns = timestamp_ns();
+    body(iterations);
+    elapsed_ns = timestamp_ns() - start_ns;
+
+    if (elapsed_ns >= min_time_ns_) {
+      break;
+    }
+
+    /* aim for the minimum time, growing at most tenfold at once */
+    const double target = 1.2 * min_time_ns_ / max<uint64_t>(elapsed_ns, 1);
+    iterations = max(iterations + 1,
+                     static_cast<uint64_t>(iterations * min(target, 10.0)));
+  }
+
+  const double ns_per_iter = static_cast<double>(elapsed_ns) / iterations;
+
+  cout << left << setw(40) << name << right << setw(12) << iterations
+       << fixed << setprecision(1) << setw(14) << ns_per_iter << " ns";
+
+  if (bytes > 0) {
+    cout << setw(10) << bytes * 1000.0 / ns_per_iter << " MB/s";
+  } else {
+    cout << setw(15) << "";
+  }
+
+  const auto it = baseline_.find(name);
+  if (it != baseline_.end() and it->second > 0) {
+    cout << setprecision(2) << setw(9) << ns_per_iter / it->second
+         << "x baseline";
+  }
+
+  cout << defaultfloat << endl;
+}
+
+/* the time per iteration of each benchmark in an earlier output */
+map<string, double> read_baseline(const string & path)
+{
+  ifstream ifs(path);
+  if (not ifs) {
+    throw runtime_error("cannot open " + path);
+  }
+
+  map<string, double> baseline;
+
+  string line;
+  while (getline(ifs, line)) {
+    istringstream iss(line);
+    string name, unit;
+    uint64_t iterations;
+    double ns_per_iter;
+
+    if (line.empty() or line[0] == '#' or
+        not (iss >> name >> iterations >> ns_per_iter >> unit) or
+        unit != "ns") {
+      continue;
+    }
+
+    baseline[name] = ns_per_iter;
+  }
+
+  return baseline;
+}
+
+/* a frame as the browser sends it (masked) */
+string client_frame(const WSFrame::OpCode opcode, const string & payload)
+{
+  return WSFrame(true, opcode, payload, 0x12345678).to_string();
+}
+
+void bench_ws_frame(Benchmarks & benchmarks)
+{
+  for (const size_t size : {128, 64 * 1024}) {
+    const WSFrame frame(true, WSFrame::OpCode::Binary, string(size, 'x'));
+
+    benchmarks.run("ws_frame_to_string/" + to_string(size), size,
+      [&frame](const uint64_t n) {
+        for (uint64_t i = 0; i < n; i++) {
+          do_not_optimize(frame.to_string());
+        }
+      });
+
+    benchmarks.run("ws_frame_header_to_string/" + to_string(size), 0,
+      [&frame](const uint64_t n) {
+        for (uint64_t i = 0; i < n; i++) {
+          do_not_optimize(frame.header().to_string());
+        }
+      });
+  }
+}
+
+void bench_ws_message_parser(Benchmarks & benchmarks)
+{
+  /* 64 acks, as a server reads them from a busy client */
+  string acks;
+  for (unsigned int i = 0; i < 64; i++) {
+    acks += client_frame(WSFrame::OpCode::Text, string(200, 'a'));
+  }
+
+  benchmarks.run("ws_message_parser/64x200", acks.size(),
+    [&acks](const uint64_t n) {
+      WSMessageParser parser;
+      for (uint64_t i = 0; i < n; i++) {
+        parser.parse(acks);
+        while (not parser.empty()) {
+          do_not_optimize(parser.front().payload());
+          parser.pop();
+        }
+      }
+    });
+
+  /* a 1 MB message in 16 fragments, read 64 KB at a time */
+  string fragments;
+  for (unsigned int i = 0; i < 16; i++) {
+    const auto opcode = i == 0 ? WSFrame::OpCode::Binary
+                               : WSFrame::OpCode::Continuation;
+    fragments += WSFrame(i == 15, opcode, string(64 * 1024, 'm'), 0x12345678)
+                 .to_string();
+  }
+
+  benchmarks.run("ws_message_parser/fragmented_1M", fragments.size(),
+    [&fragments](const uint64_t n) {
+      WSMessageParser parser;
+      const string_view data = fragments;
+      for (uint64_t i = 0; i < n; i++) {
+        for (size_t pos = 0; pos < data.size(); pos += 64 * 1024) {
+          parser.parse(data.substr(pos, 64 * 1024));
+        }
+        while (not parser.empty()) {
+          do_not_optimize(parser.front().payload());
+          parser.pop();
+        }
+      }
+    });
+}
+
+void bench_http_request_parser(Benchmarks & benchmarks)
+{
+  const string request =
+    "GET / HTTP/1.1\r\n"
+    "Host: puffer.stanford.edu:50001\r\n"
+    "Connection: Upgrade\r\n"
+    "Pragma: no-cache\r\n"
+    "Cache-Control: no-cache\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+    "(KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+    "Upgrade: websocket\r\n"
+    "Origin: https://puffer.stanford.edu\r\n"
+    "Sec-WebSocket-Version: 13\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+    "Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits\r\n"
+    "\r\n";
+
+  benchmarks.run("http_request_parser/ws_upgrade", request.size(),
+    [&request](const uint64_t n) {
+      HTTPRequestParser parser;
+      for (uint64_t i = 0; i < n; i++) {
+        parser.parse(request);
+        do_not_optimize(parser.front().get_header_value("Sec-WebSocket-Key"));
+        parser.pop();
+      }
+    });
+}
+
+void bench_server_messages(Benchmarks & benchmarks)
+{
+  for (const auto encoding : {MsgEncoding::JSON, MsgEncoding::Binary}) {
+    const string suffix = encoding == MsgEncoding::JSON ? "json" : "binary";
+    const ServerVideoMsg msg(1234567, "nbc", "1280x720-22", 180180 * 1000,
+                             65536, 1500000, 0.987654, encoding);
+
+    benchmarks.run("server_video_msg_to_string/" + suffix, 0,
+      [&msg](const uint64_t n) {
+        for (uint64_t i = 0; i < n; i++) {
+          do_not_optimize(msg.to_string());
+        }
+      });
+
+    /* serialized once per chunk fragment and shared by the clients */
+    size_t slot_pos = 0;
+    const string shared = msg.to_string_with_init_id_slot(slot_pos);
+
+    benchmarks.run("server_video_msg_fill_init_id/" + suffix, 0,
+      [&shared, slot_pos, encoding](const uint64_t n) {
+        for (uint64_t i = 0; i < n; i++) {
+          string copy = shared;
+          ServerMsg::fill_init_id(copy, slot_pos, i, encoding);
+          do_not_optimize(copy);
+        }
+      });
+  }
+}
+
+void bench_client_messages(Benchmarks & benchmarks)
+{
+  const string json_ack = json({
+    {"type", "client-vidack"}, {"initId", 1234567},
+    {"videoBuffer", 10.123}, {"audioBuffer", 10.456}, {"cumRebuffer", 0.5},
+    {"channel", "nbc"}, {"format", "1280x720-22"},
+    {"timestamp", 180180 * 1000}, {"byteOffset", 65536},
+    {"byteLength", 65536}, {"totalByteLength", 1500000}, {"ssim", 0.987654}
+  }).dump();
+
+  BinaryWriter writer;
+  writer.put_u8(BINARY_MSG_VERSION);
+  writer.put_u8(static_cast<uint8_t>(BinaryMsgType::ClientVidAck));
+  writer.put_u32(1234567);
+  writer.put_double(10.123);
+  writer.put_double(10.456);
+  writer.put_double(0.5);
+  writer.put_u64(180180 * 1000);
+  writer.put_u32(65536);
+  writer.put_u32(65536);
+  writer.put_u32(1500000);
+  writer.put_str("nbc");
+  writer.put_str("1280x720-22");
+  writer.put_double(0.987654);
+  const string binary_ack = writer.str();
+
+  for (const auto & [suffix, ack] : {pair("json", cref(json_ack)),
+                                     pair("binary", cref(binary_ack))}) {
+    const string & data = ack;
+
+    benchmarks.run(string("client_msg_parser_vidack/") + suffix, data.size(),
+      [&data](const uint64_t n) {
+        for (uint64_t i = 0; i < n; i++) {
+          ClientMsgParser parser(data);
+          do_not_optimize(parser.parse_client_vidack());
+        }
+      });
+  }
+}
+
+void bench_media_segment(Benchmarks & benchmarks)
+{
+  /* a 1.5 MB chunk and its init segment, sent in 64 KB fragments */
+  const size_t data_size = 1500000, init_size = 1000;
+  const mmap_t data { shared_ptr<char>(new char[data_size](),
+                                       default_delete<char[]>()), data_size };
+  const mmap_t init { shared_ptr<char>(new char[init_size](),
+                                       default_delete<char[]>()), init_size };
+  const VideoFormat format("1280x720-22");
+
+  /* the fragments are views of the chunk, so the size would say nothing */
+  benchmarks.run("media_segment_read/1.5M_64K", 0,
+    [&](const uint64_t n) {
+      vector<SharedBuffer> buffers;
+      for (uint64_t i = 0; i < n; i++) {
+        VideoSegment segment(format, data, init);
+        while (not segment.done()) {
+          buffers.clear();
+          segment.read(buffers, 64 * 1024);
+          do_not_optimize(buffers.data());
+        }
+      }
+    });
+}
+
+void bench_distribution(Benchmarks & benchmarks)
+{
+  /* the sending time distribution of a chunk, as in PufferTTP */
+  const size_t num_bins = 21;
+  vector<float> logits(num_bins), probs(num_bins);
+  for (size_t k = 0; k < num_bins; k++) {
+    logits[k] = (k * 7 % num_bins) * 0.5 - 4;
+  }
+
+  benchmarks.run("distribution_softmax/21", 0,
+    [&](const uint64_t n) {
+      for (uint64_t i = 0; i < n; i++) {
+        Distribution::softmax(logits.data(), num_bins, probs.data());
+        do_not_optimize(probs.data());
+      }
+    });
+
+  benchmarks.run("distribution_truncate/20", 0,
+    [&](const uint64_t n) {
+      for (uint64_t i = 0; i < n; i++) {
+        do_not_optimize(Distribution::truncate(logits.data(), num_bins - 1,
+                                               1e-5, probs.data()));
+      }
+    });
+
+  const GaussianBlur blur(num_bins, 0, 2, num_bins);
+  Distribution::softmax(logits.data(), num_bins, probs.data());
+
+  benchmarks.run("distribution_blur/21", 0,
+    [&](const uint64_t n) {
+      for (uint64_t i = 0; i < n; i++) {
+        blur.apply(probs.data());
+        do_not_optimize(probs.data());
+      }
+    });
+}
+
+void bench_poller(Benchmarks & benchmarks)
+{
+  for (const auto backend : {Poller::Backend::Poll, Poller::Backend::Epoll}) {
+    const string prefix = backend == Poller::Backend::Poll ? "poll" : "epoll";
+
+    for (const size_t num_idle : {16, 1024, 8192}) {
+      Poller poller(backend);
+
+      /* idle fds, which are never ready */
+      vector<unique_ptr<EventFD>> idle;
+      for (size_t i = 0; i < num_idle; i++) {
+        idle.emplace_back(make_unique<EventFD>());
+        poller.add_action(Poller::Action(*idle.back(), Direction::In,
+          []() { return ResultType::Continue; }));
+      }
+
+      /* one fd that is ready on every poll */
+      EventFD ready;
+      poller.add_action(Poller::Action(ready, Direction::In,
+        [&ready]() {
+          ready.consume();
+          return ResultType::Continue;
+        }));
+
+      benchmarks.run("poller_" + prefix + "/" + to_string(num_idle) + "_idle",
+                     0,
+        [&poller, &ready](const uint64_t n) {
+          for (uint64_t i = 0; i < n; i++) {
+            /* returns at once, as ready is */
+            ready.notify();
+            poller.poll(-1);
+          }
+        });
+    }
+  }
+}
+
+/* allow as many fds as the hard limit, for the idle fds of the poller */
+void raise_fd_limit()
+{
+  rlimit limit;
+  CheckSystemCall("getrlimit", getrlimit(RLIMIT_NOFILE, &limit));
+  limit.rlim_cur = limit.rlim_max;
+  CheckSystemCall("setrlimit", setrlimit(RLIMIT_NOFILE, &limit));
+}
+
+int main(int argc, char * argv[])
+{
+  if (argc < 1) {
+    abort();
+  }
+
+  string filter, baseline_path;
+  uint64_t min_time_ms = 500;
+
+  const option cmd_line_opts[] = {
+    {"filter",   required_argument, nullptr, 'f'},
+    {"min-time", required_argument, nullptr, 't'},
+    {"baseline", required_argument, nullptr, 'b'},
+    { nullptr,   0,                 nullptr,  0 },
+  };
+
+  while (true) {
+    const int opt = getopt_long(argc, argv, "f:t:b:", cmd_line_opts, nullptr);
+    if (opt == -1) {
+      break;
+    }
+
+    switch (opt) {
+    case 'f':
+      filter = optarg;
+      break;
+    case 't':
+      min_time_ms = stoul(optarg);
+      break;
+    case 'b':
+      baseline_path = optarg;
+      break;
+    default:
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (optind != argc) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  try {
+    raise_fd_limit();
+
+    Benchmarks benchmarks(filter, min_time_ms,
+      baseline_path.empty() ? map<string, double>()
+                            : read_baseline(baseline_path));
+
+    bench_ws_frame(benchmarks);
+    bench_ws_message_parser(benchmarks);
+    bench_http_request_parser(benchmarks);
+    bench_server_messages(benchmarks);
+    bench_client_messages(benchmarks);
+    bench_media_segment(benchmarks);
+    bench_poller(benchmarks);
+    bench_distribution(benchmarks);
+  } catch (const exception & e) {
+    print_exception(argv[0], e);
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,55 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "filesystem.hh"
+#include "chunk_pack.hh"
+
+using namespace std;
+
+void print_usage(const string & program_name)
+{
+  cerr << "Usage: " << program_name << " <format dir> <output pack>\n\n"
+       << "Pack the chunks in a ready/<format> directory of a static channel "
+          "(e.g., into ready/<format>.pack), for the channel to be served "
+          "with pack_files: true; init segments are left in the directory"
+       << endl;
+}
+
+int main(int argc, char * argv[])
+{
+  if (argc < 1) {
+    abort();
+  }
+
+  if (argc != 3) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  const fs::path format_dir = argv[1];
+  const fs::path output = argv[2];
+
+  /* chunks are named <timestamp>.m4s (video) or <timestamp>.chk (audio) */
+  map<uint64_t, fs::path> chunks;
+
+  for (const auto & file : fs::directory_iterator(format_dir)) {
+    const string extension = file.path().extension();
+    if (extension != ".m4s" and extension != ".chk") {
+      continue;
+    }
+
+    try {
+      chunks.emplace(stoull(file.path().stem()), file.path());
+    } catch (const exception &) {
+      cerr << "Ignored " << file.path() << endl;
+    }
+  }
+
+  ChunkPack::create(output, {chunks.begin(), chunks.end()});
+
+  cerr << "Packed " << chunks.size() << " chunks into " << output.string()
+       << endl;
+  return EXIT_SUCCESS;
+}
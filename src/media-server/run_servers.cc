@@ -2,6 +2,9 @@
 #include <string>
 #include <sstream>
 #include <memory>
+#include <random>
+#include <cstdio>
+#include <fcntl.h>
 #include <crypto++/sha.h>
 #include <crypto++/hex.h>
 #include <pqxx/pqxx>
@@ -12,6 +15,7 @@
 #include "system_runner.hh"
 #include "util.hh"
 #include "exception.hh"
+#include "file_descriptor.hh"
 #include "timestamp.hh"
 #include "yaml.hh"
 
@@ -22,6 +26,20 @@ static string yaml_config;
 static YAML::Node config;
 static fs::path src_path;  /* path to puffer/src directory */
 
+/* the cgroups (config "cgroups") of the programs named in run_in_cgroup(),
+ * e.g., to keep the media servers ahead of an encoding pipeline on the
+ * same host */
+static map<string, unique_ptr<CGroup>> cgroups;
+
+/* run the program in the cgroup named after it if there is one */
+void run_in_cgroup(ProcessManager & proc_manager, const string & name,
+                   const string & program, const vector<string> & args)
+{
+  const auto it = cgroups.find(name);
+  proc_manager.run_as_child(program, args, {}, {}, "", nullopt,
+                            it == cgroups.end() ? "" : it->second->path());
+}
+
 void print_usage(const string & program_name)
 {
   cerr << "Usage: " << program_name << " <YAML configuration> [--maintenance]" << endl;
@@ -108,17 +126,36 @@ int run_maintenance_servers()
   return proc_manager.wait();
 }
 
+/* write a random secret, from which all the ws_media_servers derive the
+ * same (rotating) keys of TLS session tickets; mode 0600 */
+void write_ticket_secret(const string & secret_file)
+{
+  random_device rd;
+  string secret;
+  for (unsigned int i = 0; i < 8; i++) {
+    char word[9];
+    snprintf(word, sizeof(word), "%08x", static_cast<uint32_t>(rd()));
+    secret += word;
+  }
+
+  FileDescriptor fd(CheckSystemCall("open (" + secret_file + ")",
+    open(secret_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600)));
+  fd.write(secret + "\n");
+}
+
 int run_ws_media_servers()
 {
   ProcessManager proc_manager;
 
   const bool enable_logging = config["enable_logging"].as<bool>();
 
-  /* will run log reporters only if enable_logging is true */
+  /* will run a log reporter only if enable_logging is true, which tails the
+   * logs of all the servers: pairs of log format and log path follow */
   auto log_reporter = src_path / "monitoring/log_reporter";
   vector<string> log_stems {
     "server_info", "active_streams", "client_buffer", "client_sysinfo",
-    "video_sent", "video_acked"};
+    "video_sent", "video_acked", "tls_handshakes", "send_trace"};
+  vector<string> log_args { log_reporter, yaml_config };
 
   /* Remove ipc directory prior to starting Media Server */
   string ipc_dir = "pensieve_ipc";
@@ -126,6 +163,27 @@ int run_ws_media_servers()
     fs::remove_all(ipc_dir);
   }
 
+  /* share the secret of session tickets across all the media servers */
+  if (config["ssl_session_tickets"] and
+      config["ssl_session_tickets"].as<bool>()) {
+    write_ticket_secret(config["ssl_ticket_secret_file"] ?
+      config["ssl_ticket_secret_file"].as<string>() : "ssl_ticket_secret");
+  }
+
+  /* index the ready chunks of live channels once for all the media servers */
+  if (config["media_index_dir"]) {
+    const auto & media_indexer = src_path / "media-server/media_indexer";
+    run_in_cgroup(proc_manager, "media_indexer",
+                  media_indexer, {media_indexer, yaml_config});
+  }
+
+  /* evaluate the models of all the media servers in a single process */
+  if (config["inference_dir"]) {
+    const auto & inference_daemon = src_path / "media-server/inference_daemon";
+    run_in_cgroup(proc_manager, "inference_daemon",
+                  inference_daemon, {inference_daemon, yaml_config});
+  }
+
   /* run media servers in each experimental group */
   const auto & expt_json = src_path / "scripts" / "expt_json.py";
   const auto & ws_media_server = src_path / "media-server/ws_media_server";
@@ -152,25 +210,26 @@ int run_ws_media_servers()
       /* run ws_media_server */
       vector<string> args { ws_media_server, yaml_config,
                             to_string(server_id), to_string(expt_id) };
-      proc_manager.run_as_child(ws_media_server, args);
+      run_in_cgroup(proc_manager, "ws_media_server", ws_media_server, args);
 
-      /* run log_reporter */
+      /* the logs of this server for log_reporter */
       if (enable_logging) {
         fs::path log_dir = config["log_dir"].as<string>();
 
         for (const auto & log_stem : log_stems) {
-          string log_format = log_dir / (log_stem + ".conf");
-          string log_path = log_dir / (log_stem + "." + to_string(server_id)
-                                       + ".log");
-
-          vector<string> log_args { log_reporter, yaml_config,
-                                    log_format, log_path };
-          proc_manager.run_as_child(log_reporter, log_args);
+          log_args.emplace_back(log_dir / (log_stem + ".conf"));
+          log_args.emplace_back(log_dir / (log_stem + "."
+                                           + to_string(server_id) + ".log"));
         }
       }
     }
   }
 
+  /* run log_reporter */
+  if (enable_logging and log_args.size() > 2) {
+    run_in_cgroup(proc_manager, "log_reporter", log_reporter, log_args);
+  }
+
   return proc_manager.wait();
 
 }
@@ -202,6 +261,11 @@ int main(int argc, char * argv[])
     return run_maintenance_servers();
   }
 
+  /* before any child is run, as this process moves to a cgroup of its own */
+  if (config["cgroups"]) {
+    cgroups = load_cgroups(config["cgroups"]);
+  }
+
   /* run ws_media_server(s) */
   return run_ws_media_servers();
 }
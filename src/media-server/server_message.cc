@@ -1,12 +1,19 @@
 #include "server_message.hh"
 
+#include <limits>
+
 #include "strict_conversions.hh"
 
 using namespace std;
 
-string ServerMsg::to_string() const
+/* the widest initId; its digits are the slot filled by fill_init_id() */
+static const unsigned int INIT_ID_PLACEHOLDER = numeric_limits<unsigned int>::max();
+static const string INIT_ID_SLOT_KEY = "\"initId\":";
+static const size_t INIT_ID_SLOT_WIDTH = std::to_string(INIT_ID_PLACEHOLDER).size();
+
+/* prepend the 16-bit length of msg_str to it */
+static string prefix_length(const string & msg_str)
 {
-  string msg_str = msg_.dump();
   uint16_t msg_len = narrow_cast<uint16_t>(msg_str.length());
   string ret(sizeof(uint16_t) + msg_len, 0);
 
@@ -18,6 +25,58 @@ string ServerMsg::to_string() const
   return ret;
 }
 
+string ServerMsg::to_string() const
+{
+  if (binary_msg_) {
+    return prefix_length(*binary_msg_);
+  }
+
+  return prefix_length(msg_.dump());
+}
+
+string ServerMsg::to_string_with_init_id_slot(size_t & slot_pos) const
+{
+  /* initId always has a fixed width in binary messages */
+  if (binary_msg_) {
+    slot_pos = BINARY_INIT_ID_POS;
+    return prefix_length(*binary_msg_);
+  }
+
+  if (not msg_.count("initId")) {
+    throw runtime_error("ServerMsg: no initId to leave a slot for");
+  }
+
+  json msg_with_slot = msg_;
+  msg_with_slot["initId"] = INIT_ID_PLACEHOLDER;
+  const string msg_str = msg_with_slot.dump();
+
+  /* keys are dumped in sorted order, so the real "initId" key comes after
+   * the channel and format strings that might contain the same text */
+  const size_t key_pos = msg_str.rfind(INIT_ID_SLOT_KEY);
+  if (key_pos == string::npos) {
+    throw runtime_error("ServerMsg: failed to locate initId");
+  }
+  slot_pos = sizeof(uint16_t) + key_pos + INIT_ID_SLOT_KEY.size();
+
+  return prefix_length(msg_str);
+}
+
+void ServerMsg::fill_init_id(string & serialized, const size_t slot_pos,
+                             const unsigned int init_id,
+                             const MsgEncoding encoding)
+{
+  if (encoding == MsgEncoding::Binary) {
+    serialized.replace(slot_pos, sizeof(uint32_t),
+                       put_field(static_cast<uint32_t>(init_id)));
+    return;
+  }
+
+  /* pad the digits with whitespace, which is valid JSON after a value */
+  string slot = std::to_string(init_id);
+  slot.resize(INIT_ID_SLOT_WIDTH, ' ');
+  serialized.replace(slot_pos, INIT_ID_SLOT_WIDTH, slot);
+}
+
 ServerInitMsg::ServerInitMsg(const unsigned int init_id,
                              const string & channel,
                              const string & video_codec,
@@ -50,8 +109,24 @@ ServerVideoMsg::ServerVideoMsg(const unsigned int init_id,
                                const uint64_t timestamp,
                                const unsigned int byte_offset,
                                const unsigned int total_byte_length,
-                               const double ssim)
+                               const double ssim,
+                               const MsgEncoding encoding)
 {
+  if (encoding == MsgEncoding::Binary) {
+    BinaryWriter writer;
+    writer.put_u8(BINARY_MSG_VERSION);
+    writer.put_u8(static_cast<uint8_t>(BinaryMsgType::ServerVideo));
+    writer.put_u32(init_id);
+    writer.put_u64(timestamp);
+    writer.put_u32(byte_offset);
+    writer.put_u32(total_byte_length);
+    writer.put_double(ssim);
+    writer.put_str(channel);
+    writer.put_str(format);
+    binary_msg_ = writer.str();
+    return;
+  }
+
   msg_ = {
     {"type", "server-video"},
     {"initId", init_id},
@@ -69,8 +144,23 @@ ServerAudioMsg::ServerAudioMsg(const unsigned int init_id,
                                const string & format,
                                const uint64_t timestamp,
                                const unsigned int byte_offset,
-                               const unsigned int total_byte_length)
+                               const unsigned int total_byte_length,
+                               const MsgEncoding encoding)
 {
+  if (encoding == MsgEncoding::Binary) {
+    BinaryWriter writer;
+    writer.put_u8(BINARY_MSG_VERSION);
+    writer.put_u8(static_cast<uint8_t>(BinaryMsgType::ServerAudio));
+    writer.put_u32(init_id);
+    writer.put_u64(timestamp);
+    writer.put_u32(byte_offset);
+    writer.put_u32(total_byte_length);
+    writer.put_str(channel);
+    writer.put_str(format);
+    binary_msg_ = writer.str();
+    return;
+  }
+
   msg_ = {
     {"type", "server-audio"},
     {"initId", init_id},
@@ -83,7 +173,8 @@ ServerAudioMsg::ServerAudioMsg(const unsigned int init_id,
 }
 
 ServerErrorMsg::ServerErrorMsg(const unsigned int init_id,
-                               const Type error_type)
+                               const Type error_type,
+                               const uint16_t redirect_port)
 {
   string error_type_str;
   string error_message;
@@ -104,6 +195,9 @@ ServerErrorMsg::ServerErrorMsg(const unsigned int init_id,
     error_message = "Sorry, this server has reached the limit of concurrent "
       "viewers; our research study only allows up to 500 people to watch "
       "Puffer at a time (see FAQ). Please try again later.";
+  } else if (error_type == Type::Redirect) {
+    error_type_str = "redirect";
+    error_message = "This server is busy; reconnecting to another server.";
   }
 
   msg_ = {
@@ -112,6 +206,10 @@ ServerErrorMsg::ServerErrorMsg(const unsigned int init_id,
     {"errorType", error_type_str},
     {"errorMessage", error_message}
   };
+
+  if (error_type == Type::Redirect) {
+    msg_["redirectPort"] = redirect_port;
+  }
 }
 
 MediaSegment::MediaSegment(const mmap_t & data,
@@ -124,19 +222,21 @@ MediaSegment::MediaSegment(const mmap_t & data,
   }
 }
 
-void MediaSegment::read(string & dst, const size_t n)
+void MediaSegment::read(vector<SharedBuffer> & dst, const size_t n)
 {
   assert(n > 0);
   assert(offset_ < length_);
 
   const size_t init_size = init_ ? get<1>(*init_) : 0;
-  const size_t orig_dst_len = dst.length();
+  size_t bytes_read = 0;
 
   if (init_ and offset_ < init_size) {
     const size_t to_read = init_size - offset_ > n ? n : init_size - offset_;
-    dst.append(get<0>(*init_).get() + offset_, to_read);
+    const auto & init_data = get<0>(*init_);
+    dst.emplace_back(init_data, init_data.get() + offset_, to_read);
     offset_ += to_read;
-    if (dst.length() - orig_dst_len >= n) {
+    bytes_read += to_read;
+    if (bytes_read >= n) {
       return;
     }
   }
@@ -144,14 +244,15 @@ void MediaSegment::read(string & dst, const size_t n)
   const auto & [seg_data, seg_size] = data_;
   const size_t offset_into_data = offset_ - init_size;
 
-  size_t to_read = n - (dst.length() - orig_dst_len);
+  size_t to_read = n - bytes_read;
   to_read = seg_size - offset_into_data > to_read ?
             to_read : seg_size - offset_into_data;
 
-  dst.append(seg_data.get() + offset_into_data, to_read);
+  dst.emplace_back(seg_data, seg_data.get() + offset_into_data, to_read);
   offset_ += to_read;
+  bytes_read += to_read;
 
-  assert(dst.length() - orig_dst_len <= n);
+  assert(bytes_read <= n);
 }
 
 VideoSegment::VideoSegment(const VideoFormat & format,
@@ -4,8 +4,11 @@
 #include <cstdint>
 #include <string>
 #include <vector>
+#include <optional>
 
 #include "channel.hh"
+#include "binary_message.hh"
+#include "shared_buffer.hh"
 #include "json.hpp"
 
 using json = nlohmann::json;
@@ -17,11 +20,22 @@ public:
    * video/audio chunk will be appended to serialized ServerMsg */
   std::string to_string() const;
 
+  /* same as to_string() but with a fixed-width slot in place of the value of
+   * initId, so that one serialization can be shared by clients: copy it and
+   * call fill_init_id() with the returned position of the slot */
+  std::string to_string_with_init_id_slot(size_t & slot_pos) const;
+  static void fill_init_id(std::string & serialized, const size_t slot_pos,
+                           const unsigned int init_id,
+                           const MsgEncoding encoding);
+
 protected:
   /* prevent this class from being instantiated */
   ServerMsg() {}
 
   json msg_ {};
+
+  /* set instead of msg_ if the message is binary encoded */
+  std::optional<std::string> binary_msg_ {};
 };
 
 class ServerInitMsg : public ServerMsg
@@ -48,7 +62,8 @@ public:
                  const uint64_t timestamp,
                  const unsigned int byte_offset,
                  const unsigned int total_byte_length,
-                 const double ssim);
+                 const double ssim,
+                 const MsgEncoding encoding = MsgEncoding::JSON);
 };
 
 class ServerAudioMsg : public ServerMsg
@@ -59,7 +74,8 @@ public:
                  const std::string & format,
                  const uint64_t timestamp,
                  const unsigned int byte_offset,
-                 const unsigned int total_byte_length);
+                 const unsigned int total_byte_length,
+                 const MsgEncoding encoding = MsgEncoding::JSON);
 };
 
 class ServerErrorMsg : public ServerMsg
@@ -69,17 +85,21 @@ public:
     Maintenance, /* server is under maintenance */
     Reinit,      /* channel needs to be reinitialized */
     Unavailable, /* channel is not available */
-    Limit        /* limit on number of concurrent viewers */
+    Limit,       /* limit on number of concurrent viewers */
+    Redirect     /* server is overloaded; reconnect to another port */
   };
 
-  ServerErrorMsg(const unsigned int init_id, const Type error_type);
+  /* redirect_port is only sent with Redirect */
+  ServerErrorMsg(const unsigned int init_id, const Type error_type,
+                 const uint16_t redirect_port = 0);
 };
 
 class MediaSegment
 {
 public:
-  /* read up to n bytes from init_ (if exists) and data_ and append to dst */
-  void read(std::string & dst, const size_t n);
+  /* read up to n bytes from init_ (if exists) and data_ and append to dst
+   * as views into the mmap'd init_ and data_, i.e., without copying */
+  void read(std::vector<SharedBuffer> & dst, const size_t n);
 
   /* length of init_ (if exists) and data_ */
   size_t length() { return length_; }
@@ -0,0 +1,75 @@
+#ifndef SESSION_CACHE_HH
+#define SESSION_CACHE_HH
+
+#include <cstdint>
+#include <string>
+#include <list>
+#include <unordered_map>
+
+#include "timestamp.hh"
+
+/* LRU cache of the session keys validated recently, so that a client that
+ * reconnects (e.g., to resume its stream) is not checked against the
+ * database again; an entry expires ttl_ms after it was validated */
+class SessionCache
+{
+public:
+  SessionCache(const size_t capacity, const uint64_t ttl_ms)
+    : capacity_(capacity), ttl_ms_(ttl_ms)
+  {}
+
+  /* session_key has been validated within ttl_ms */
+  bool contains(const std::string & session_key)
+  {
+    auto it = index_.find(session_key);
+    if (it == index_.end()) {
+      return false;
+    }
+
+    if (timestamp_ms() - it->second->validated_ts > ttl_ms_) {
+      entries_.erase(it->second);
+      index_.erase(it);
+      return false;
+    }
+
+    /* move to the front as the most recently used */
+    entries_.splice(entries_.begin(), entries_, it->second);
+    return true;
+  }
+
+  void insert(const std::string & session_key)
+  {
+    auto it = index_.find(session_key);
+    if (it != index_.end()) {
+      entries_.erase(it->second);
+      index_.erase(it);
+    }
+
+    if (capacity_ == 0) {
+      return;
+    }
+
+    /* evict the least recently used */
+    if (entries_.size() >= capacity_) {
+      index_.erase(entries_.back().session_key);
+      entries_.pop_back();
+    }
+
+    entries_.push_front({session_key, timestamp_ms()});
+    index_.emplace(session_key, entries_.begin());
+  }
+
+private:
+  struct Entry {
+    std::string session_key;
+    uint64_t validated_ts;
+  };
+
+  size_t capacity_;
+  uint64_t ttl_ms_;
+
+  std::list<Entry> entries_ {};  /* most recently used first */
+  std::unordered_map<std::string, std::list<Entry>::iterator> index_ {};
+};
+
+#endif /* SESSION_CACHE_HH */
@@ -0,0 +1,203 @@
+#include "session_store.hh"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <array>
+#include <cstring>
+#include <functional>
+
+#include "file_descriptor.hh"
+#include "exception.hh"
+#include "mmap.hh"
+#include "timestamp.hh"
+
+using namespace std;
+
+/* a reader gives up on a slot that is written this many times as it reads */
+static constexpr unsigned int MAX_READ_ATTEMPTS = 3;
+
+SessionStore::SessionStore(const string & path)
+{
+  FileDescriptor fd(CheckSystemCall("open (" + path + ")",
+                    open(path.c_str(), O_RDWR | O_CREAT, 0644)));
+
+  /* as in LoadTable, every server grows the file to the same size, and
+   * the slots that are never written take no memory */
+  const size_t size = NUM_SLOTS * sizeof(Slot);
+  if (fd.filesize() < size) {
+    CheckSystemCall("ftruncate", ftruncate(fd.fd_num(), size));
+  }
+
+  mapping_ = mmap_shared(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         fd.fd_num(), 0);
+  slots_ = static_cast<Slot *>(mapping_.get());
+}
+
+uint64_t SessionStore::key_of(const string & session_key,
+                              const unsigned int init_id)
+{
+  /* the servers are the same binary, so they hash alike */
+  const uint64_t key = hash<string>{}(session_key + "/" + to_string(init_id));
+  return key == 0 ? 1 : key;
+}
+
+SessionStore::Slot * SessionStore::find(const uint64_t key) const
+{
+  for (size_t i = 0; i < NUM_PROBES; i++) {
+    Slot & slot = slots_[(key + i) % NUM_SLOTS];
+    if (slot.key.load(memory_order_relaxed) == key) {
+      return &slot;
+    }
+  }
+
+  return nullptr;
+}
+
+uint64_t SessionStore::begin_write(Slot & slot, const uint64_t now)
+{
+  uint64_t version = slot.version.load(memory_order_relaxed);
+
+  /* a server that died while writing leaves the slot odd until it is
+   * stale */
+  if (version % 2 == 1 and
+      slot.updated_ms.load(memory_order_relaxed) + MAX_AGE_MS >= now) {
+    return 0;
+  }
+
+  const uint64_t writing = version % 2 == 0 ? version + 1 : version + 2;
+  if (not slot.version.compare_exchange_strong(version, writing,
+                                               memory_order_acquire)) {
+    return 0;
+  }
+
+  /* the writes to the slot are not seen before the version is odd */
+  atomic_thread_fence(memory_order_release);
+  return writing + 1;
+}
+
+void SessionStore::end_write(Slot & slot, const uint64_t version)
+{
+  slot.version.store(version, memory_order_release);
+}
+
+void SessionStore::record(const string & session_key,
+                          const unsigned int init_id,
+                          const ABRAlgo::Chunk & chunk)
+{
+  const uint64_t key = key_of(session_key, init_id);
+  const uint64_t now = timestamp_ms();
+
+  Slot * slot = find(key);
+
+  /* otherwise, take over a free slot or the least recently updated one */
+  if (not slot) {
+    for (size_t i = 0; i < NUM_PROBES; i++) {
+      Slot & candidate = slots_[(key + i) % NUM_SLOTS];
+      if (not slot or candidate.updated_ms.load(memory_order_relaxed) <
+                      slot->updated_ms.load(memory_order_relaxed)) {
+        slot = &candidate;
+      }
+    }
+  }
+
+  const uint64_t version = begin_write(*slot, now);
+  if (version == 0) {
+    return;
+  }
+
+  if (slot->key.load(memory_order_relaxed) != key) {
+    slot->key.store(key, memory_order_relaxed);
+    slot->num_chunks.store(0, memory_order_relaxed);
+  }
+
+  const uint64_t num_chunks = slot->num_chunks.load(memory_order_relaxed);
+  auto & words = slot->chunks[num_chunks % HISTORY_CHUNKS];
+
+  uint64_t ssim_bits;
+  memcpy(&ssim_bits, &chunk.ssim, sizeof(ssim_bits));
+
+  words[0].store(uint64_t(uint16_t(chunk.format.width))
+                 | uint64_t(uint16_t(chunk.format.height)) << 16
+                 | uint64_t(uint16_t(chunk.format.crf)) << 32,
+                 memory_order_relaxed);
+  words[1].store(ssim_bits, memory_order_relaxed);
+  words[2].store(uint64_t(chunk.size) | uint64_t(chunk.cwnd) << 32,
+                 memory_order_relaxed);
+  words[3].store(chunk.trans_time, memory_order_relaxed);
+  words[4].store(uint64_t(chunk.in_flight) | uint64_t(chunk.min_rtt) << 32,
+                 memory_order_relaxed);
+  words[5].store(chunk.rtt, memory_order_relaxed);
+  words[6].store(chunk.delivery_rate, memory_order_relaxed);
+
+  slot->num_chunks.store(num_chunks + 1, memory_order_relaxed);
+  slot->updated_ms.store(now, memory_order_relaxed);
+
+  end_write(*slot, version);
+}
+
+vector<ABRAlgo::Chunk> SessionStore::lookup(const string & session_key,
+                                            const unsigned int init_id) const
+{
+  const uint64_t key = key_of(session_key, init_id);
+  const Slot * slot = find(key);
+  if (not slot) {
+    return {};
+  }
+
+  for (unsigned int attempt = 0; attempt < MAX_READ_ATTEMPTS; attempt++) {
+    const uint64_t version = slot->version.load(memory_order_acquire);
+    if (version % 2 == 1) {
+      continue;
+    }
+
+    if (slot->key.load(memory_order_relaxed) != key or
+        slot->updated_ms.load(memory_order_relaxed) + MAX_AGE_MS
+        < timestamp_ms()) {
+      return {};
+    }
+
+    const uint64_t num_chunks = slot->num_chunks.load(memory_order_relaxed);
+    const uint64_t first = num_chunks > HISTORY_CHUNKS ?
+                           num_chunks - HISTORY_CHUNKS : 0;
+
+    /* the words of each chunk, to be parsed once they are known to be
+     * consistent */
+    vector<array<uint64_t, CHUNK_WORDS>> raw;
+    for (uint64_t i = first; i < num_chunks; i++) {
+      const auto & words = slot->chunks[i % HISTORY_CHUNKS];
+      auto & chunk = raw.emplace_back();
+      for (size_t w = 0; w < CHUNK_WORDS; w++) {
+        chunk[w] = words[w].load(memory_order_relaxed);
+      }
+    }
+
+    atomic_thread_fence(memory_order_acquire);
+    if (slot->version.load(memory_order_relaxed) != version) {
+      continue;
+    }
+
+    vector<ABRAlgo::Chunk> ret;
+    for (const auto & words : raw) {
+      double ssim;
+      memcpy(&ssim, &words[1], sizeof(ssim));
+
+      ret.push_back({
+        VideoFormat(to_string(words[0] & 0xFFFF) + "x"
+                    + to_string(words[0] >> 16 & 0xFFFF) + "-"
+                    + to_string(words[0] >> 32 & 0xFFFF)),
+        ssim,
+        static_cast<unsigned int>(words[2] & 0xFFFFFFFF),
+        words[3],
+        static_cast<uint32_t>(words[2] >> 32),
+        static_cast<uint32_t>(words[4] & 0xFFFFFFFF),
+        static_cast<uint32_t>(words[4] >> 32),
+        static_cast<uint32_t>(words[5]),
+        words[6]
+      });
+    }
+
+    return ret;
+  }
+
+  return {};
+}
@@ -0,0 +1,83 @@
+#ifndef SESSION_STORE_HH
+#define SESSION_STORE_HH
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+
+#include "abr_algo.hh"
+
+/* The recently acked chunks of the streams served by the ws_media_servers on
+ * this host, in a file mapped by all of them, so that a client that resumes
+ * its stream on a new connection (to the same server or another) has them
+ * replayed into its new ABR algorithm rather than starting over. A stream is
+ * keyed by the session key and init_id of its client, and is looked up among
+ * a few slots from the hash of that key; the least recently updated of them
+ * is taken over by a new stream. Entries are best effort: a write that finds
+ * the slot being written by another thread (or server) is skipped. */
+class SessionStore
+{
+public:
+  SessionStore(const std::string & path);
+
+  /* append chunk to the history of the stream */
+  void record(const std::string & session_key, const unsigned int init_id,
+              const ABRAlgo::Chunk & chunk);
+
+  /* the history of the stream, oldest chunk first; empty if there is none
+   * or it has not been updated for MAX_AGE_MS */
+  std::vector<ABRAlgo::Chunk> lookup(const std::string & session_key,
+                                     const unsigned int init_id) const;
+
+  /* chunks kept per stream, i.e., WebSocketClient::MAX_ACKED_CHUNKS */
+  static constexpr size_t HISTORY_CHUNKS = 16;
+
+  static constexpr size_t NUM_SLOTS = 16384;
+
+  /* slots where the key of a stream might be, from its hash on */
+  static constexpr size_t NUM_PROBES = 8;
+
+  /* a stream not updated for this long is not resumed (and its slot is
+   * free to take) */
+  static constexpr uint64_t MAX_AGE_MS = 5 * 60 * 1000;
+
+  /* forbid copying */
+  SessionStore(const SessionStore & other) = delete;
+  const SessionStore & operator=(const SessionStore & other) = delete;
+
+private:
+  /* a chunk in words, which are read and written individually */
+  static constexpr size_t CHUNK_WORDS = 7;
+
+  /* written under its version (a sequence lock): odd while being written;
+   * a reader that sees the version change retries, and one that keeps
+   * seeing it changed gives up */
+  struct Slot {
+    std::atomic<uint64_t> version;
+    std::atomic<uint64_t> key;  /* 0 if never used */
+    std::atomic<uint64_t> updated_ms;
+    std::atomic<uint64_t> num_chunks;  /* recorded since key took the slot */
+    std::atomic<uint64_t> chunks[HISTORY_CHUNKS][CHUNK_WORDS];
+  };
+
+  static_assert(std::atomic<uint64_t>::is_always_lock_free,
+                "SessionStore requires lock-free atomics in shared memory");
+
+  std::shared_ptr<void> mapping_ {};
+  Slot * slots_ {nullptr};
+
+  static uint64_t key_of(const std::string & session_key,
+                         const unsigned int init_id);
+
+  /* the slot that holds key, if any */
+  Slot * find(const uint64_t key) const;
+
+  /* begin writing a slot and return its version to end() with, or 0 if it
+   * is being written already */
+  static uint64_t begin_write(Slot & slot, const uint64_t now);
+  static void end_write(Slot & slot, const uint64_t version);
+};
+
+#endif /* SESSION_STORE_HH */
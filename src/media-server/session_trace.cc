@@ -0,0 +1,190 @@
+#include "session_trace.hh"
+
+#include <fcntl.h>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+
+#include "binary_message.hh"
+#include "exception.hh"
+#include "timestamp.hh"
+#include "json.hpp"
+
+using namespace std;
+using json = nlohmann::json;
+
+SessionTrace::SessionTrace(const string & path)
+  : fd_(CheckSystemCall("open (" + path + ")",
+        ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)))
+{
+  buffer_ = MAGIC;
+}
+
+SessionTrace::~SessionTrace()
+{
+  try {
+    flush();
+  } catch (const exception & e) {
+    print_exception("SessionTrace", e);
+  }
+}
+
+/* the fields that every record starts with */
+static BinaryWriter record_header(const SessionTrace::Type type,
+                                  const uint64_t session_id)
+{
+  BinaryWriter writer;
+  writer.put_u8(static_cast<uint8_t>(type));
+  writer.put_u64(timestamp_us());
+  writer.put_u64(session_id);
+  return writer;
+}
+
+void SessionTrace::append(const string & record)
+{
+  buffer_ += record;
+
+  if (buffer_.size() >= FLUSH_BYTES) {
+    flush();
+  }
+}
+
+void SessionTrace::flush()
+{
+  if (not buffer_.empty()) {
+    fd_.write(buffer_);
+    buffer_.clear();
+  }
+}
+
+void SessionTrace::open(const uint64_t session_id)
+{
+  append(record_header(Type::Open, session_id).str());
+}
+
+void SessionTrace::message(const uint64_t session_id,
+                           const string_view payload)
+{
+  /* a client-init (always JSON) carries the credentials of the user */
+  string scrubbed;
+  if (payload.find("\"client-init\"") != string_view::npos) {
+    try {
+      json msg = json::parse(payload.begin(), payload.end());
+      if (msg.count("sessionKey")) {
+        msg["sessionKey"] = "";
+      }
+      scrubbed = msg.dump();
+    } catch (const exception &) {
+      /* the server rejects it anyway */
+    }
+  }
+
+  const string_view recorded = scrubbed.empty() ? payload : scrubbed;
+
+  BinaryWriter writer = record_header(Type::Message, session_id);
+  writer.put_u32(recorded.size());
+  append(writer.str() + string(recorded));
+}
+
+void SessionTrace::start(const uint64_t session_id,
+                         const unsigned int init_id,
+                         const uint64_t vts, const uint64_t ats)
+{
+  BinaryWriter writer = record_header(Type::Start, session_id);
+  writer.put_u32(init_id);
+  writer.put_u64(vts);
+  writer.put_u64(ats);
+  append(writer.str());
+}
+
+void SessionTrace::video_chunk(const uint64_t session_id,
+                               const unsigned int init_id,
+                               const TCPInfo & tcpi)
+{
+  BinaryWriter writer = record_header(Type::VideoChunk, session_id);
+  writer.put_u32(init_id);
+  writer.put_u32(tcpi.cwnd);
+  writer.put_u32(tcpi.in_flight);
+  writer.put_u32(tcpi.min_rtt);
+  writer.put_u32(tcpi.rtt);
+  writer.put_u64(tcpi.delivery_rate);
+  append(writer.str());
+}
+
+void SessionTrace::close(const uint64_t session_id)
+{
+  append(record_header(Type::Close, session_id).str());
+}
+
+vector<SessionTrace::Record> SessionTrace::read(const string & path)
+{
+  ifstream ifs(path, ios::binary);
+  if (not ifs) {
+    throw runtime_error("SessionTrace: cannot open " + path);
+  }
+
+  stringstream ss;
+  ss << ifs.rdbuf();
+  const string contents = ss.str();
+
+  if (contents.compare(0, MAGIC.size(), MAGIC) != 0) {
+    throw runtime_error("SessionTrace: " + path + " is not a session trace");
+  }
+
+  vector<Record> records;
+  BinaryReader reader(string_view(contents).substr(MAGIC.size()));
+
+  try {
+    while (not reader.done()) {
+      Record record;
+      record.type = static_cast<Type>(reader.get_u8());
+      record.time_us = reader.get_u64();
+      record.session_id = reader.get_u64();
+
+      switch (record.type) {
+      case Type::Open:
+      case Type::Close:
+        break;
+      case Type::Message:
+        record.payload = reader.get_bytes(reader.get_u32());
+        break;
+      case Type::Start:
+        record.init_id = reader.get_u32();
+        record.vts = reader.get_u64();
+        record.ats = reader.get_u64();
+        break;
+      case Type::VideoChunk:
+        record.init_id = reader.get_u32();
+        record.tcp_info.cwnd = reader.get_u32();
+        record.tcp_info.in_flight = reader.get_u32();
+        record.tcp_info.min_rtt = reader.get_u32();
+        record.tcp_info.rtt = reader.get_u32();
+        record.tcp_info.delivery_rate = reader.get_u64();
+        break;
+      default:
+        throw runtime_error("SessionTrace: invalid record in " + path);
+      }
+
+      records.emplace_back(move(record));
+    }
+  } catch (const out_of_range &) {
+    /* the server was killed in the middle of a batch */
+    cerr << "SessionTrace: " << path << " ends with a partial record" << endl;
+  }
+
+  return records;
+}
+
+map<unsigned int, vector<TCPInfo>>
+SessionTrace::read_tcp_infos(const string & path)
+{
+  map<unsigned int, vector<TCPInfo>> tcp_infos;
+
+  for (const auto & record : read(path)) {
+    if (record.type == Type::VideoChunk) {
+      tcp_infos[record.init_id].emplace_back(record.tcp_info);
+    }
+  }
+
+  return tcp_infos;
+}
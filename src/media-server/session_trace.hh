@@ -0,0 +1,83 @@
+#ifndef SESSION_TRACE_HH
+#define SESSION_TRACE_HH
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <optional>
+#include <map>
+#include <vector>
+
+#include "file_descriptor.hh"
+#include "socket.hh"
+
+/* A compact binary trace of sampled sessions of ws_media_server, to replay
+ * them against another build (see load_generator --replay): every message a
+ * traced client sends, where each of its streams starts, and the TCP info
+ * each of its video chunks is chosen on, all timestamped in us.
+ *
+ * The trace starts with MAGIC; each record is a type, time_us and the ID of
+ * the session (i.e., its connection), in BinaryWriter encoding, followed by
+ * the fields of the type. The session keys in client-init are blanked. */
+class SessionTrace
+{
+public:
+  static constexpr std::string_view MAGIC = "puffer-session-trace 1\n";
+
+  enum class Type : uint8_t {
+    Open,        /* the connection is opened */
+    Message,     /* u32 length | the payload of a message from the client */
+    Start,       /* u32 init_id | u64 vts | u64 ats: a stream starts */
+    VideoChunk,  /* u32 init_id | u32 cwnd | u32 in_flight | u32 min_rtt |
+                  * u32 rtt | u64 delivery_rate: a video chunk is sent,
+                  * chosen on this TCP info */
+    Close        /* the connection is closed */
+  };
+
+  struct Record
+  {
+    Type type {Type::Open};
+    uint64_t time_us {0};
+    uint64_t session_id {0};
+
+    std::string payload {};    /* Message */
+    unsigned int init_id {0};  /* Start and VideoChunk */
+    uint64_t vts {0};          /* Start */
+    uint64_t ats {0};          /* Start */
+    TCPInfo tcp_info {};       /* VideoChunk */
+  };
+
+  /* write a trace at path, which is truncated */
+  SessionTrace(const std::string & path);
+  ~SessionTrace();
+
+  void open(const uint64_t session_id);
+  void message(const uint64_t session_id, const std::string_view payload);
+  void start(const uint64_t session_id, const unsigned int init_id,
+             const uint64_t vts, const uint64_t ats);
+  void video_chunk(const uint64_t session_id, const unsigned int init_id,
+                   const TCPInfo & tcpi);
+  void close(const uint64_t session_id);
+
+  /* write out the records buffered so far */
+  void flush();
+
+  /* all the records of the trace at path, in the order written */
+  static std::vector<Record> read(const std::string & path);
+
+  /* the TCP info of each stream (by init_id) in the trace at path, in the
+   * order of its video chunks */
+  static std::map<unsigned int, std::vector<TCPInfo>>
+  read_tcp_infos(const std::string & path);
+
+private:
+  /* records are written in batches of about this many bytes */
+  static constexpr size_t FLUSH_BYTES = 64 * 1024;
+
+  FileDescriptor fd_;
+  std::string buffer_ {};
+
+  void append(const std::string & record);
+};
+
+#endif /* SESSION_TRACE_HH */
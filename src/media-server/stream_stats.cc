@@ -0,0 +1,84 @@
+#include "stream_stats.hh"
+
+#include <algorithm>
+
+using namespace std;
+
+size_t StreamStats::buffer_level(const double buffer_s)
+{
+  return upper_bound(BUFFER_BOUNDS.begin(), BUFFER_BOUNDS.end(), buffer_s)
+         - BUFFER_BOUNDS.begin();
+}
+
+string StreamStats::buffer_level_name(const size_t level)
+{
+  auto bound_name = [](const double bound) {
+    return to_string(static_cast<unsigned int>(bound)) + "s";
+  };
+
+  if (level < BUFFER_BOUNDS.size()) {
+    return "lt" + bound_name(BUFFER_BOUNDS[level]);
+  }
+
+  return "ge" + bound_name(BUFFER_BOUNDS.back());
+}
+
+void StreamStats::add(const Stream & stream)
+{
+  channel_viewers_[stream.channel]++;
+  if (not stream.vformat.empty()) {
+    format_viewers_[{stream.channel, stream.vformat}]++;
+  }
+  buffer_levels_[stream.buffer_level]++;
+}
+
+void StreamStats::subtract(const Stream & stream)
+{
+  channel_viewers_.at(stream.channel)--;
+  if (not stream.vformat.empty()) {
+    format_viewers_.at({stream.channel, stream.vformat})--;
+  }
+  buffer_levels_[stream.buffer_level]--;
+}
+
+void StreamStats::update(const uint64_t connection_id, const string & channel,
+                         const string & vformat, const double buffer_s)
+{
+  if (channel.empty()) {
+    remove(connection_id);
+    return;
+  }
+
+  const size_t level = buffer_level(buffer_s);
+
+  auto [it, inserted] = streams_.try_emplace(connection_id);
+  Stream & stream = it->second;
+
+  if (not inserted) {
+    /* the common case: only a buffer report */
+    if (stream.channel == channel and stream.vformat == vformat) {
+      if (stream.buffer_level != level) {
+        buffer_levels_[stream.buffer_level]--;
+        buffer_levels_[level]++;
+        stream.buffer_level = level;
+      }
+      return;
+    }
+
+    subtract(stream);
+  }
+
+  stream = {channel, vformat, level};
+  add(stream);
+}
+
+void StreamStats::remove(const uint64_t connection_id)
+{
+  const auto it = streams_.find(connection_id);
+  if (it == streams_.end()) {
+    return;
+  }
+
+  subtract(it->second);
+  streams_.erase(it);
+}
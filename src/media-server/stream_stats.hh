@@ -0,0 +1,67 @@
+#ifndef STREAM_STATS_HH
+#define STREAM_STATS_HH
+
+#include <array>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+/* Aggregates of the streams of a thread's clients: viewers per channel, per
+ * channel and video format, and per level of playback buffer. They are kept
+ * up to date as each client's stream changes (on init, on a format switch,
+ * on a buffer report, and on close), rather than counted over all the
+ * clients, so reading them costs O(channels + formats). */
+class StreamStats
+{
+public:
+  /* upper bounds in seconds of the buffer levels, but the last one */
+  static constexpr std::array<double, 4> BUFFER_BOUNDS {1, 2, 5, 10};
+  static constexpr size_t NUM_BUFFER_LEVELS = BUFFER_BOUNDS.size() + 1;
+
+  using Counts = std::map<std::string, uint64_t>;
+  using FormatCounts = std::map<std::pair<std::string, std::string>, uint64_t>;
+  using BufferCounts = std::array<uint64_t, NUM_BUFFER_LEVELS>;
+
+  /* the stream of a client (an empty channel: none yet; an empty vformat:
+   * no video sent yet) */
+  void update(const uint64_t connection_id, const std::string & channel,
+              const std::string & vformat, const double buffer_s);
+
+  /* the client has left */
+  void remove(const uint64_t connection_id);
+
+  /* channel -> viewers; a channel stays listed (maybe with 0) once watched */
+  const Counts & channel_viewers() const { return channel_viewers_; }
+
+  /* {channel, video format} -> viewers; likewise */
+  const FormatCounts & format_viewers() const { return format_viewers_; }
+
+  /* viewers per buffer level */
+  const BufferCounts & buffer_levels() const { return buffer_levels_; }
+
+  /* e.g., "lt1s", ..., "ge10s" */
+  static std::string buffer_level_name(const size_t level);
+
+private:
+  struct Stream
+  {
+    std::string channel {};
+    std::string vformat {};
+    size_t buffer_level {0};
+  };
+
+  std::unordered_map<uint64_t, Stream> streams_ {};
+
+  Counts channel_viewers_ {};
+  FormatCounts format_viewers_ {};
+  BufferCounts buffer_levels_ {};
+
+  static size_t buffer_level(const double buffer_s);
+
+  void add(const Stream & stream);
+  void subtract(const Stream & stream);
+};
+
+#endif /* STREAM_STATS_HH */
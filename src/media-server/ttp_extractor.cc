@@ -0,0 +1,496 @@
+#include <getopt.h>
+
+#include <algorithm>
+#include <array>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "exception.hh"
+#include "filesystem.hh"
+#include "log_reader.hh"
+#include "strict_conversions.hh"
+#include "thread_pool.hh"
+#include "timestamp.hh"
+#include "ttp_features.hh"
+
+using namespace std;
+
+/* the arrays are in host byte order, which scripts/ttp.py takes to be
+ * little-endian */
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__,
+              "arrays must be written little-endian");
+
+void print_usage(const string & program_name)
+{
+  cerr <<
+  "Usage: " << program_name << " [options] -o <output dir> <log>...\n\n"
+  "Make the training data of the TTP models (see scripts/ttp.py) from the\n"
+  "video_sent and video_acked logs of ws_media_server, text or binary. For\n"
+  "the i-th chunk ahead (0 to 4), the inputs that PufferTTP would have made\n"
+  "are rows of float32 in <output dir>/in-<i>.f32, the transmission times of\n"
+  "the chunks (s) are in out-<i>.f32, and the shapes are in meta.json.\n"
+  "A <log> is a log, e.g., video_sent.3.log.old, or a directory of logs;\n"
+  "the logs of a server are read in one pass, and servers in parallel.\n\n"
+  "Options:\n"
+  "-o, --output <dir>         directory to write the arrays into\n"
+  "-j, --threads <N>          servers to process at once (default: # of CPUs)\n"
+  "-f, --from <time>          skip lines before <time> (UTC), e.g., 2026-10-01\n"
+  "                           or 2026-10-01T12:00:00Z\n"
+  "-t, --to <time>            skip lines from <time> on\n"
+  "-e, --expt <ID>            only the chunks of experiment <ID> (repeatable)\n"
+  "-n, --no-tcp-info          the inputs of puffer_ttp_no_tcp_info"
+  << endl;
+}
+
+enum Measurement { VIDEO_SENT, VIDEO_ACKED };
+
+static const vector<string> MEASUREMENTS = { "video_sent", "video_acked" };
+
+/* as Puffer (MAX_NUM_PAST_CHUNKS, MAX_LOOKAHEAD_HORIZON) and scripts/ttp.py */
+static constexpr size_t NUM_PAST_CHUNKS = 8;
+static constexpr size_t LOOKAHEAD_HORIZON = 5;
+static constexpr uint64_t VIDEO_DURATION = 180180;
+
+/* a connection ends after a minute without lines, in log time */
+static constexpr uint64_t CONNECTION_EXPIRY_MS = 60 * 1000;
+static constexpr uint64_t EXPIRY_INTERVAL_MS = 1000;
+
+/* floats of rows buffered by a worker before they are written */
+static constexpr size_t FLUSH_SIZE = 1 << 20;
+
+/* a connection of a client, whose past chunks the ABR algorithm keeps
+ * across the channels (init IDs) that it plays */
+struct ConnectionKey
+{
+  string user {};
+  uint64_t first_init_id {0};
+  uint64_t expt_id {0};
+
+  bool operator==(const ConnectionKey & other) const
+  {
+    return first_init_id == other.first_init_id
+           and expt_id == other.expt_id and user == other.user;
+  }
+};
+
+struct ConnectionKeyHash
+{
+  size_t operator()(const ConnectionKey & key) const
+  {
+    return hash<string>()(key.user)
+           ^ (key.first_init_id * 0x9e3779b97f4a7c15) ^ (key.expt_id << 1);
+  }
+};
+
+/* a chunk from video_sent, with the TCP info when it was sent, and the time
+ * of its video_acked */
+struct SentChunk
+{
+  uint64_t init_id, video_ts;
+  uint64_t sent_ms;
+  uint64_t size;  /* bytes */
+
+  uint64_t delivery_rate;
+  uint64_t cwnd, in_flight, min_rtt, rtt;
+
+  optional<uint64_t> acked_ms {};
+
+  /* as the ABR algorithm is told */
+  uint64_t trans_time() const { return *acked_ms - sent_ms; }
+};
+
+struct Connection
+{
+  uint64_t last_ms {};
+
+  /* in the order sent, i.e., acked, as a chunk is sent after the previous
+   * one is acked */
+  vector<SentChunk> chunks {};
+
+  /* (init ID, video timestamp) -> index in chunks */
+  map<pair<uint64_t, uint64_t>, size_t> index {};
+};
+
+/* rows of each lookahead step */
+struct Dataset
+{
+  array<vector<float>, LOOKAHEAD_HORIZON> in {};
+  array<vector<float>, LOOKAHEAD_HORIZON> out {};
+
+  size_t size() const
+  {
+    size_t ret = 0;
+    for (size_t i = 0; i < LOOKAHEAD_HORIZON; i++) {
+      ret += in[i].size() + out[i].size();
+    }
+    return ret;
+  }
+};
+
+struct Options
+{
+  uint64_t from_ms {0};
+  uint64_t to_ms {UINT64_MAX};
+  set<uint64_t> expt_ids {};
+  bool tcp_info {true};
+
+  size_t dim_in() const
+  {
+    return NUM_PAST_CHUNKS * (tcp_info ? 7 : 2) + (tcp_info ? 5 : 0) + 1;
+  }
+};
+
+/* appends the rows of the workers to the arrays of each lookahead step */
+class DatasetWriter
+{
+public:
+  DatasetWriter(const fs::path & dir, const size_t dim_in)
+    : dir_(dir), dim_in_(dim_in)
+  {
+    fs::create_directories(dir_);
+
+    for (size_t i = 0; i < LOOKAHEAD_HORIZON; i++) {
+      in_[i].open(dir_ / ("in-" + to_string(i) + ".f32"),
+                  ios::binary | ios::trunc);
+      out_[i].open(dir_ / ("out-" + to_string(i) + ".f32"),
+                   ios::binary | ios::trunc);
+    }
+  }
+
+  /* append and clear dataset */
+  void append(Dataset & dataset)
+  {
+    lock_guard<mutex> lock(mutex_);
+
+    for (size_t i = 0; i < LOOKAHEAD_HORIZON; i++) {
+      write(in_[i], dataset.in[i]);
+      write(out_[i], dataset.out[i]);
+      num_rows_[i] += dataset.out[i].size();
+
+      dataset.in[i].clear();
+      dataset.out[i].clear();
+    }
+  }
+
+  /* close the arrays and describe them in meta.json */
+  void finish()
+  {
+    ofstream meta(dir_ / "meta.json", ios::trunc);
+    meta << "{\"dim_in\": " << dim_in_ << ", \"rows\": [";
+
+    for (size_t i = 0; i < LOOKAHEAD_HORIZON; i++) {
+      in_[i].close();
+      out_[i].close();
+      if (not in_[i] or not out_[i]) {
+        throw runtime_error("failed to write the arrays in " + dir_.string());
+      }
+
+      meta << (i ? ", " : "") << num_rows_[i];
+    }
+
+    meta << "]}\n";
+    meta.close();
+    if (not meta) {
+      throw runtime_error("failed to write " + (dir_ / "meta.json").string());
+    }
+  }
+
+  uint64_t num_rows(const size_t i) const { return num_rows_[i]; }
+
+private:
+  fs::path dir_;
+  size_t dim_in_;
+
+  mutex mutex_ {};
+  array<ofstream, LOOKAHEAD_HORIZON> in_ {}, out_ {};
+  array<uint64_t, LOOKAHEAD_HORIZON> num_rows_ {};
+
+  static void write(ofstream & output, const vector<float> & values)
+  {
+    output.write(reinterpret_cast<const char *>(values.data()),
+                 values.size() * sizeof(float));
+  }
+};
+
+/* the rows of the chunks of a connection: as PufferTTP::queue_ttp_inputs()
+ * before each chunk is sent, with the acked chunks before it as the past
+ * chunks, and the chunks of the same channel that follow it as the chunks
+ * ahead; padded as the ABR algorithm pads them (without a throughput prior,
+ * as that of the time is not logged) */
+static void add_rows(const Connection & connection, const Options & options,
+                     Dataset & dataset)
+{
+  deque<const SentChunk *> past_chunks;
+  vector<double> input;
+
+  for (const auto & chunk : connection.chunks) {
+    if (not chunk.acked_ms) {
+      continue;
+    }
+
+    input.clear();
+
+    if (past_chunks.empty()) {
+      for (size_t i = 0; i < NUM_PAST_CHUNKS; i++) {
+        if (options.tcp_info) {
+          TTPFeatures::append_tcp_info(input, chunk);
+        }
+        TTPFeatures::append_chunk(input, 0, 0);
+      }
+    } else {
+      auto it = past_chunks.begin();
+      for (size_t i = 0; i < NUM_PAST_CHUNKS; i++) {
+        if (options.tcp_info) {
+          TTPFeatures::append_tcp_info(input, **it);
+        }
+        TTPFeatures::append_chunk(input, (*it)->size, (*it)->trans_time());
+
+        if (i + past_chunks.size() >= NUM_PAST_CHUNKS) {
+          it++;
+        }
+      }
+    }
+
+    if (options.tcp_info) {
+      TTPFeatures::append_tcp_info(input, chunk);
+    }
+    input.push_back(0);
+
+    for (size_t i = 0; i < LOOKAHEAD_HORIZON; i++) {
+      const auto ahead = connection.index.find(
+        {chunk.init_id, chunk.video_ts + i * VIDEO_DURATION});
+      if (ahead == connection.index.end()) {
+        continue;
+      }
+
+      const SentChunk & next = connection.chunks[ahead->second];
+      if (not next.acked_ms or next.sent_ms < chunk.sent_ms) {
+        continue;
+      }
+
+      input.back() = TTPFeatures::next_chunk_size(next.size);
+      dataset.in[i].insert(dataset.in[i].end(), input.begin(), input.end());
+      dataset.out[i].push_back(next.trans_time() / 1000.0);
+    }
+
+    past_chunks.push_back(&chunk);
+    if (past_chunks.size() > NUM_PAST_CHUNKS) {
+      past_chunks.pop_front();
+    }
+  }
+}
+
+/* extract the rows of the logs of a server into writer; returns the number
+ * of lines read and of those skipped as malformed */
+static pair<uint64_t, uint64_t> extract_server(const ServerLogs & logs,
+                                               const Options & options,
+                                               DatasetWriter & writer)
+{
+  ServerLogReader reader(logs, MEASUREMENTS);
+
+  unordered_map<ConnectionKey, Connection, ConnectionKeyHash> connections;
+  Dataset dataset;
+  uint64_t newest_ms = 0, last_expiry_ms = 0;
+  uint64_t num_lines = 0, num_malformed = 0;
+
+  auto expire = [&](const optional<uint64_t> now_ms) {
+    for (auto it = connections.begin(); it != connections.end();) {
+      if (now_ms and it->second.last_ms + CONNECTION_EXPIRY_MS >= *now_ms) {
+        ++it;
+        continue;
+      }
+
+      add_rows(it->second, options, dataset);
+      it = connections.erase(it);
+    }
+
+    if (dataset.size() >= FLUSH_SIZE or not now_ms) {
+      writer.append(dataset);
+    }
+  };
+
+  ConnectionKey key;
+
+  while (not reader.done()) {
+    const uint64_t ts = reader.ts();
+    if (ts >= options.to_ms) {
+      /* the rest of the log is past the range too */
+      reader.skip_log();
+      continue;
+    }
+
+    try {
+      /* the columns of the lines are in BinaryLog::schema() */
+      const auto & v = reader.values();
+      key.expt_id = strict_parse<uint64_t>(v[3]);
+
+      if (ts >= options.from_ms and (options.expt_ids.empty()
+                                     or options.expt_ids.count(key.expt_id))) {
+        key.user = v[4];
+        key.first_init_id = strict_parse<uint64_t>(v[5]);
+        const uint64_t init_id = strict_parse<uint64_t>(v[6]);
+        const uint64_t video_ts = strict_parse<uint64_t>(v[7]);
+
+        Connection & connection = connections[key];
+        connection.last_ms = max(connection.last_ms, ts);
+
+        if (reader.measurement() == VIDEO_SENT) {
+          connection.index[{init_id, video_ts}] = connection.chunks.size();
+          connection.chunks.push_back({
+            init_id, video_ts, ts, strict_parse<uint64_t>(v[9]),
+            strict_parse<uint64_t>(v[15]), strict_parse<uint64_t>(v[11]),
+            strict_parse<uint64_t>(v[12]), strict_parse<uint64_t>(v[13]),
+            strict_parse<uint64_t>(v[14])
+          });
+        } else {
+          const auto it = connection.index.find({init_id, video_ts});
+          if (it != connection.index.end()) {
+            SentChunk & chunk = connection.chunks[it->second];
+            if (not chunk.acked_ms and ts >= chunk.sent_ms) {
+              chunk.acked_ms = ts;
+            }
+          }
+        }
+
+        num_lines++;
+      }
+    } catch (const exception &) {
+      num_malformed++;
+    }
+
+    newest_ms = max(newest_ms, ts);
+    if (newest_ms >= last_expiry_ms + EXPIRY_INTERVAL_MS) {
+      expire(newest_ms);
+      last_expiry_ms = newest_ms;
+    }
+
+    reader.advance();
+  }
+
+  expire(nullopt);
+
+  return {num_lines, num_malformed + reader.num_malformed()};
+}
+
+int main(int argc, char * argv[])
+{
+  if (argc < 1) {
+    abort();
+  }
+
+  string output_dir;
+  unsigned int num_threads = max(1u, thread::hardware_concurrency());
+  Options options;
+
+  const option cmd_line_opts[] = {
+    {"output",      required_argument, nullptr, 'o'},
+    {"threads",     required_argument, nullptr, 'j'},
+    {"from",        required_argument, nullptr, 'f'},
+    {"to",          required_argument, nullptr, 't'},
+    {"expt",        required_argument, nullptr, 'e'},
+    {"no-tcp-info", no_argument,       nullptr, 'n'},
+    { nullptr,      0,                 nullptr,  0 },
+  };
+
+  try {
+    while (true) {
+      const int opt = getopt_long(argc, argv, "o:j:f:t:e:n", cmd_line_opts,
+                                  nullptr);
+      if (opt == -1) {
+        break;
+      }
+
+      switch (opt) {
+      case 'o':
+        output_dir = optarg;
+        break;
+      case 'j':
+        num_threads = stoul(optarg);
+        break;
+      case 'f':
+        options.from_ms = parse_utc_time_ms(optarg);
+        break;
+      case 't':
+        options.to_ms = parse_utc_time_ms(optarg);
+        break;
+      case 'e':
+        options.expt_ids.insert(strict_parse<uint64_t>(optarg));
+        break;
+      case 'n':
+        options.tcp_info = false;
+        break;
+      default:
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    }
+
+    if (output_dir.empty() or optind == argc or num_threads == 0) {
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+
+    const vector<ServerLogs> servers = find_server_logs(
+      vector<string>(argv + optind, argv + argc), MEASUREMENTS);
+    if (servers.empty()) {
+      throw runtime_error("no video_sent or video_acked logs found");
+    }
+
+    DatasetWriter writer(output_dir, options.dim_in());
+    vector<string> errors;
+    mutex errors_mutex;
+
+    {
+      ThreadPool pool(min<size_t>(num_threads, servers.size()));
+
+      for (const auto & server : servers) {
+        pool.submit([&server, &options, &writer, &errors, &errors_mutex]() {
+          const string name = (server.dir / server.server_id).string();
+
+          try {
+            const auto [num_lines, num_malformed] =
+              extract_server(server, options, writer);
+
+            cerr << name + ": " + to_string(num_lines) + " lines ("
+                    + to_string(num_malformed) + " malformed)\n";
+          } catch (const exception & e) {
+            lock_guard<mutex> lock(errors_mutex);
+            errors.emplace_back(name + ": " + e.what());
+          }
+        });
+      }
+
+      pool.wait();
+    }
+
+    if (not errors.empty()) {
+      for (const auto & error : errors) {
+        cerr << "Error: " << error << endl;
+      }
+      return EXIT_FAILURE;
+    }
+
+    writer.finish();
+
+    cerr << "Wrote rows of " << options.dim_in() << " inputs to "
+         << output_dir << ":";
+    for (size_t i = 0; i < LOOKAHEAD_HORIZON; i++) {
+      cerr << " " << writer.num_rows(i);
+    }
+    cerr << endl;
+  } catch (const exception & e) {
+    print_exception(argv[0], e);
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
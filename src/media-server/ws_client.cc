@@ -7,36 +7,114 @@
 #include "puffer_ttp.hh"
 #include "bola_basic.hh"
 #include "python_ipc.hh"
+#include "audio_linear_bba.hh"
 #include "timestamp.hh"
 #include "exception.hh"
+#include "metrics.hh"
+
+#include <algorithm>
+#include <cmath>
 
 using namespace std;
 
-static constexpr double LOWER_RESERVOIR = 0.1;
-static constexpr double UPPER_RESERVOIR = 0.9;
+bool WebSocketClient::abr_profiling_ = false;
 
 WebSocketClient::WebSocketClient(const uint64_t connection_id,
                                  const string & abr_name,
                                  const YAML::Node & abr_config)
-  : connection_id_(connection_id), abr_name_(abr_name),
-    abr_config_(abr_config), channel_(), last_msg_recv_ts_(timestamp_ms())
+  : connection_id_(connection_id), last_msg_recv_ts_(timestamp_ms()),
+    channel_(),
+    info_(new ClientInfo {abr_name, abr_config,
+                          "abr_prepare_us:" + abr_name,
+                          "abr_select_us:" + abr_name,
+                          "abr_acked_us:" + abr_name})
 {
   init_abr_algo();
+  init_audio_abr_algo();
 }
 
 void WebSocketClient::reset_helper()
 {
   video_playback_buf_ = 0;
   audio_playback_buf_ = 0;
+  buf_report_ts_.reset();
 
   startup_delay_.reset();
   cum_rebuffer_ = 0;
 
   curr_vformat_.reset();
   curr_aformat_.reset();
+  curr_vinit_key_.reset();
+  curr_ainit_key_.reset();
 
   last_video_send_ts_.reset();
   tcp_info_.reset();
+
+  send_traces_ = {};
+  speculative_vformat_.reset();
+}
+
+void WebSocketClient::set_playback_bufs(const double video_buf,
+                                        const double audio_buf,
+                                        const uint64_t report_ts)
+{
+  video_playback_buf_ = video_buf;
+  audio_playback_buf_ = audio_buf;
+  buf_report_ts_ = report_ts;
+}
+
+double WebSocketClient::drained_buf(const double buf,
+                                    const uint64_t ts_ms) const
+{
+  if (not buf_report_ts_ or ts_ms <= *buf_report_ts_ or buf <= 0) {
+    return buf;
+  }
+
+  const uint64_t drain_ms = min(ts_ms - *buf_report_ts_, MAX_BUF_DRAIN_MS);
+  return max(buf - drain_ms / 1000.0, 0.0);
+}
+
+double WebSocketClient::video_playback_buf_at(const uint64_t ts_ms) const
+{
+  return drained_buf(video_playback_buf_, ts_ms);
+}
+
+double WebSocketClient::audio_playback_buf_at(const uint64_t ts_ms) const
+{
+  return drained_buf(audio_playback_buf_, ts_ms);
+}
+
+optional<uint64_t> WebSocketClient::buf_drain_ts(const double buf) const
+{
+  if (not buf_report_ts_ or buf <= MAX_BUFFER_S) {
+    return nullopt;
+  }
+
+  /* rounded up, so that the buffer has drained by then */
+  const uint64_t drain_ms = ceil((buf - MAX_BUFFER_S) * 1000);
+  if (drain_ms > MAX_BUF_DRAIN_MS) {
+    return nullopt;
+  }
+
+  return *buf_report_ts_ + drain_ms;
+}
+
+optional<uint64_t> WebSocketClient::video_buf_drain_ts() const
+{
+  return buf_drain_ts(video_playback_buf_);
+}
+
+optional<uint64_t> WebSocketClient::audio_buf_drain_ts() const
+{
+  return buf_drain_ts(audio_playback_buf_);
+}
+
+WebSocketClient::SendTrace & WebSocketClient::add_send_trace()
+{
+  auto & slot = send_traces_[next_send_trace_];
+  next_send_trace_ = (next_send_trace_ + 1) % SEND_TRACE_SLOTS;
+
+  return slot.emplace();
 }
 
 void WebSocketClient::init_channel(const shared_ptr<Channel> & channel,
@@ -113,121 +191,294 @@ void WebSocketClient::video_chunk_acked(const VideoFormat & format,
 {
   try {
     const auto & ti = tcp_info_.value();
+    const uint64_t start_us = abr_profiling_ ? timestamp_us() : 0;
 
-    abr_algo_->video_chunk_acked({
+    add_acked_chunk({
       format, ssim, chunk_size, transmission_time,
       ti.cwnd, ti.in_flight, ti.min_rtt, ti.rtt, ti.delivery_rate
     });
+
+    if (abr_profiling_) {
+      Metrics::record(info_->abr_acked_metric, timestamp_us() - start_us);
+    }
+
+    /* the throughput of the subnet, for the sessions that start next */
+    ThroughputPrior::update(info_->address, {chunk_size, transmission_time});
   } catch (const exception & e) {
     print_exception("video_chunk_acked", e);
-    throw runtime_error("Error: video_chunk_acked failed with " + abr_name_);
+    throw runtime_error("Error: video_chunk_acked failed with "
+                        + info_->abr_name);
+  }
+}
+
+void WebSocketClient::add_acked_chunk(ABRAlgo::Chunk chunk)
+{
+  acked_chunks_.emplace_back(chunk);
+  abr_algo_->video_chunk_acked(move(chunk));
+
+  if (acked_chunks_.size() > MAX_ACKED_CHUNKS) {
+    acked_chunks_.pop_front();
   }
 }
 
-VideoFormat WebSocketClient::select_video_format()
+void WebSocketClient::prepare_video_format()
 {
   try {
-    return abr_algo_->select_video_format();
+    const uint64_t start_us = abr_profiling_ ? timestamp_us() : 0;
+
+    abr_algo_->prepare_video_format();
+
+    if (abr_profiling_) {
+      Metrics::record(info_->abr_prepare_metric, timestamp_us() - start_us);
+    }
   } catch (const exception & e) {
-    print_exception("select_video_format", e);
-    throw runtime_error("Error: select_video_format failed with " + abr_name_);
+    print_exception("prepare_video_format", e);
+    throw runtime_error("Error: prepare_video_format failed with "
+                        + info_->abr_name);
+  }
+}
+
+optional<uint64_t> WebSocketClient::video_format_pending()
+{
+  try {
+    return abr_algo_->video_format_pending();
+  } catch (const exception & e) {
+    print_exception("video_format_pending", e);
+    throw runtime_error("Error: video_format_pending failed with "
+                        + info_->abr_name);
   }
 }
 
-AudioFormat WebSocketClient::select_audio_format()
+size_t WebSocketClient::select_video_format()
 {
-  double buf = min(max(audio_playback_buf_, 0.0), MAX_BUFFER_S);
+  try {
+    if (not abr_profiling_) {
+      return abr_algo_->select_video_format();
+    }
 
-  const auto & channel = channel_.lock();
-  const auto & aformats = channel->aformats();
-  size_t aformats_cnt = aformats.size();
+    const uint64_t start_us = timestamp_us();
+    const size_t format_idx = abr_algo_->select_video_format();
+    Metrics::record(info_->abr_select_metric, timestamp_us() - start_us);
 
-  uint64_t next_ats = next_ats_.value();
-  const auto & data_map = channel->adata(next_ats);
+    return format_idx;
+  } catch (const exception & e) {
+    print_exception("select_video_format", e);
+    throw runtime_error("Error: select_video_format failed with "
+                        + info_->abr_name);
+  }
+}
+
+optional<double> WebSocketClient::video_target_rate() const
+{
+  return abr_algo_->target_rate();
+}
+
+size_t WebSocketClient::select_audio_format()
+{
+  try {
+    return audio_abr_algo_->select_audio_format();
+  } catch (const exception & e) {
+    print_exception("select_audio_format", e);
+    throw runtime_error("Error: select_audio_format failed with "
+                        + audio_abr_algo_->abr_name());
+  }
+}
 
-  /* get max and min chunk size for the next audio ts */
-  size_t max_size = 0, min_size = SIZE_MAX;
-  size_t max_idx = aformats_cnt, min_idx = aformats_cnt;
+/* helpers of handoff_state() and restore() for the optional fields */
+template<typename T>
+static json optional_to_json(const optional<T> & value)
+{
+  return value ? json(*value) : json(nullptr);
+}
 
-  for (size_t i = 0; i < aformats_cnt; i++) {
-    const auto & af = aformats[i];
+template<typename T>
+static optional<T> optional_from_json(const json & value)
+{
+  return value.is_null() ? nullopt : optional<T>(value.get<T>());
+}
 
-    size_t chunk_size = get<1>(data_map.at(af));
-    if (chunk_size <= 0) continue;
+void WebSocketClient::resume_acked_chunks(const vector<ABRAlgo::Chunk> & chunks)
+{
+  if (not acked_chunks_.empty()) {
+    return;
+  }
 
-    if (chunk_size > max_size) {
-      max_size = chunk_size;
-      max_idx = i;
-    }
+  for (const auto & chunk : chunks) {
+    add_acked_chunk(chunk);
+  }
+}
 
-    if (chunk_size < min_size) {
-      min_size = chunk_size;
-      min_idx = i;
-    }
+json WebSocketClient::handoff_state() const
+{
+  const auto channel = channel_.lock();
+
+  json acked_chunks = json::array();
+  for (const auto & chunk : acked_chunks_) {
+    acked_chunks.push_back({
+      {"format", chunk.format.to_string()},
+      {"ssim", chunk.ssim},
+      {"size", chunk.size},
+      {"trans_time", chunk.trans_time},
+      {"cwnd", chunk.cwnd},
+      {"in_flight", chunk.in_flight},
+      {"min_rtt", chunk.min_rtt},
+      {"rtt", chunk.rtt},
+      {"delivery_rate", chunk.delivery_rate}
+    });
   }
 
-  assert(max_idx < aformats_cnt);
-  assert(min_idx < aformats_cnt);
+  return {
+    {"channel", channel ? json(channel->name()) : json(nullptr)},
+    {"init_id", optional_to_json(init_id_)},
+    {"first_init_id", optional_to_json(first_init_id_)},
+    {"authenticated", authenticated_},
+    {"session_key", info_->session_key},
+    {"username", info_->username},
+    {"browser", info_->browser},
+    {"os", info_->os},
+    {"ip", info_->address.ip()},
+    {"port", info_->address.port()},
+    {"screen_width", screen_width_},
+    {"screen_height", screen_height_},
+    {"next_vts", optional_to_json(next_vts_)},
+    {"next_ats", optional_to_json(next_ats_)},
+    {"client_next_vts", optional_to_json(client_next_vts_)},
+    {"client_next_ats", optional_to_json(client_next_ats_)},
+    {"video_playback_buf", video_playback_buf_},
+    {"audio_playback_buf", audio_playback_buf_},
+    {"startup_delay", optional_to_json(startup_delay_)},
+    {"cum_rebuffer", cum_rebuffer_},
+    {"curr_vformat", curr_vformat_ ? json(curr_vformat_->to_string())
+                                   : json(nullptr)},
+    {"curr_aformat", curr_aformat_ ? json(curr_aformat_->to_string())
+                                   : json(nullptr)},
+    {"last_msg_recv_ts", last_msg_recv_ts_},
+    {"last_video_send_ts", optional_to_json(last_video_send_ts_)},
+    {"msg_encoding", msg_encoding_ == MsgEncoding::Binary ? "binary" : "json"},
+    {"acked_chunks", acked_chunks}
+  };
+}
+
+void WebSocketClient::restore(const json & state,
+                              const shared_ptr<Channel> & channel)
+{
+  channel_ = channel;
+
+  init_id_ = optional_from_json<unsigned int>(state.at("init_id"));
+  first_init_id_ = optional_from_json<unsigned int>(state.at("first_init_id"));
+
+  authenticated_ = state.at("authenticated").get<bool>();
+  info_->session_key = state.at("session_key").get<string>();
+  info_->username = state.at("username").get<string>();
+
+  info_->browser = state.at("browser").get<string>();
+  info_->os = state.at("os").get<string>();
+  info_->address = Address(state.at("ip").get<string>(),
+                           state.at("port").get<uint16_t>());
+
+  screen_width_ = state.at("screen_width").get<uint16_t>();
+  screen_height_ = state.at("screen_height").get<uint16_t>();
+
+  next_vts_ = optional_from_json<uint64_t>(state.at("next_vts"));
+  next_ats_ = optional_from_json<uint64_t>(state.at("next_ats"));
+  client_next_vts_ = optional_from_json<uint64_t>(state.at("client_next_vts"));
+  client_next_ats_ = optional_from_json<uint64_t>(state.at("client_next_ats"));
+
+  video_playback_buf_ = state.at("video_playback_buf").get<double>();
+  audio_playback_buf_ = state.at("audio_playback_buf").get<double>();
+  startup_delay_ = optional_from_json<double>(state.at("startup_delay"));
+  cum_rebuffer_ = state.at("cum_rebuffer").get<double>();
+
+  curr_vformat_.reset();
+  if (not state.at("curr_vformat").is_null()) {
+    curr_vformat_ = VideoFormat(state.at("curr_vformat").get<string>());
+  }
 
-  if (buf >= UPPER_RESERVOIR * MAX_BUFFER_S) {
-    return aformats[max_idx];
-  } else if (buf <= LOWER_RESERVOIR * MAX_BUFFER_S) {
-    return aformats[min_idx];
+  curr_aformat_.reset();
+  if (not state.at("curr_aformat").is_null()) {
+    curr_aformat_ = AudioFormat(state.at("curr_aformat").get<string>());
   }
 
-  /* pick the largest chunk with size <= max_serve_size */
-  double slope = (max_size - min_size) /
-                 ((UPPER_RESERVOIR - LOWER_RESERVOIR) * MAX_BUFFER_S);
-  double max_serve_size = min_size +
-                          slope * (buf - LOWER_RESERVOIR * MAX_BUFFER_S);
-  size_t biggest_chunk_size = 0;
-  size_t ret_idx = aformats_cnt;
+  last_msg_recv_ts_ = state.at("last_msg_recv_ts").get<uint64_t>();
+  last_video_send_ts_ =
+    optional_from_json<uint64_t>(state.at("last_video_send_ts"));
 
-  for (size_t i = 0; i < aformats_cnt; i++) {
-    const auto & af = aformats[i];
+  /* the TCP info is sampled again before the next video chunk is sent */
+  tcp_info_.reset();
 
-    size_t chunk_size = get<1>(data_map.at(af));
-    if (chunk_size <= 0 or chunk_size > max_serve_size) {
-      continue;
-    }
+  msg_encoding_ = state.at("msg_encoding").get<string>() == "binary" ?
+                  MsgEncoding::Binary : MsgEncoding::JSON;
 
-    if (chunk_size > biggest_chunk_size) {
-      biggest_chunk_size = chunk_size;
-      ret_idx = i;
-    }
+  /* only a channel that exists can be streamed from */
+  if (not channel) {
+    reset_channel();
   }
 
-  assert(ret_idx < aformats_cnt);
-  return aformats[ret_idx];
+  acked_chunks_.clear();
+  for (const auto & chunk : state.at("acked_chunks")) {
+    add_acked_chunk({
+      VideoFormat(chunk.at("format").get<string>()),
+      chunk.at("ssim").get<double>(),
+      chunk.at("size").get<unsigned int>(),
+      chunk.at("trans_time").get<uint64_t>(),
+      chunk.at("cwnd").get<uint32_t>(),
+      chunk.at("in_flight").get<uint32_t>(),
+      chunk.at("min_rtt").get<uint32_t>(),
+      chunk.at("rtt").get<uint32_t>(),
+      chunk.at("delivery_rate").get<uint64_t>()
+    });
+  }
 }
 
 void WebSocketClient::init_abr_algo()
 {
-  if (abr_name_ == "linear_bba") {
-    abr_algo_ = make_unique<LinearBBA>(*this, abr_name_, abr_config_);
-  } else if (abr_name_ == "mpc") {
-    abr_algo_ = make_unique<MPC>(*this, abr_name_, abr_config_);
-  } else if (abr_name_ == "robust_mpc") {
-    abr_algo_ = make_unique<MPC>(*this, abr_name_, abr_config_);
-  } else if (abr_name_ == "mpc_search") {
-    abr_algo_ = make_unique<MPCSearch>(*this, abr_name_, abr_config_);
-  } else if (abr_name_ == "pensieve") {
-    abr_algo_ = make_unique<Pensieve>(*this, abr_name_, abr_config_);
-  } else if (abr_name_ == "puffer_raw") {
-    abr_algo_ = make_unique<PufferRaw>(*this, abr_name_, abr_config_);
-  } else if (abr_name_ == "puffer_ttp") {
-    abr_algo_ = make_unique<PufferTTP>(*this, abr_name_, abr_config_);
-  } else if (abr_name_ == "puffer_ttp_no_tcp_info") {
-    abr_algo_ = make_unique<PufferTTP>(*this, abr_name_, abr_config_);
-  } else if (abr_name_ == "puffer_ttp_mle") {
-    abr_algo_ = make_unique<PufferTTP>(*this, abr_name_, abr_config_);
-  } else if (abr_name_ == "bola_basic_v1") {
-    abr_algo_ = make_unique<BolaBasic>(*this, abr_name_);
-  } else if (abr_name_ == "bola_basic_v2") {
-    abr_algo_ = make_unique<BolaBasic>(*this, abr_name_);
-  } else if (abr_name_ == "tara") {
-    abr_algo_ = make_unique<PythonIPC>(*this, abr_name_, abr_config_);
+  const string & abr_name = info_->abr_name;
+  const YAML::Node & abr_config = info_->abr_config;
+
+  if (abr_name == "linear_bba") {
+    abr_algo_ = make_unique<LinearBBA>(*this, abr_name, abr_config);
+  } else if (abr_name == "mpc") {
+    abr_algo_ = make_unique<MPC>(*this, abr_name, abr_config);
+  } else if (abr_name == "robust_mpc") {
+    abr_algo_ = make_unique<MPC>(*this, abr_name, abr_config);
+  } else if (abr_name == "mpc_search") {
+    abr_algo_ = make_unique<MPCSearch>(*this, abr_name, abr_config);
+  } else if (abr_name == "pensieve") {
+    abr_algo_ = make_unique<Pensieve>(*this, abr_name, abr_config);
+  } else if (abr_name == "puffer_raw") {
+    abr_algo_ = make_unique<PufferRaw>(*this, abr_name, abr_config);
+  } else if (abr_name == "puffer_ttp") {
+    abr_algo_ = make_unique<PufferTTP>(*this, abr_name, abr_config);
+  } else if (abr_name == "puffer_ttp_no_tcp_info") {
+    abr_algo_ = make_unique<PufferTTP>(*this, abr_name, abr_config);
+  } else if (abr_name == "puffer_ttp_mle") {
+    abr_algo_ = make_unique<PufferTTP>(*this, abr_name, abr_config);
+  } else if (abr_name == "bola_basic_v1") {
+    abr_algo_ = make_unique<BolaBasic>(*this, abr_name);
+  } else if (abr_name == "bola_basic_v2") {
+    abr_algo_ = make_unique<BolaBasic>(*this, abr_name);
+  } else if (abr_name == "tara") {
+    abr_algo_ = make_unique<PythonIPC>(*this, abr_name, abr_config);
   } else {
     throw runtime_error("undefined ABR algorithm");
   }
 }
+
+void WebSocketClient::init_audio_abr_algo()
+{
+  /* not through operator[] of the non-const info_->abr_config, which would
+   * turn a null config into a map */
+  const YAML::Node & abr_config = info_->abr_config;
+
+  const string name = abr_config["audio_abr"] ?
+      abr_config["audio_abr"].as<string>() : "linear_bba";
+  const YAML::Node audio_abr_config = abr_config["audio_abr_config"] ?
+      abr_config["audio_abr_config"] : YAML::Node();
+
+  if (name == "linear_bba") {
+    audio_abr_algo_ = make_unique<AudioLinearBBA>(*this, name,
+                                                  audio_abr_config);
+  } else {
+    throw runtime_error("undefined audio ABR algorithm");
+  }
+}
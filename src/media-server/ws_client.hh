@@ -5,6 +5,9 @@
 #include <optional>
 #include <string>
 #include <memory>
+#include <deque>
+#include <vector>
+#include <array>
 
 #include "address.hh"
 #include "channel.hh"
@@ -12,12 +15,38 @@
 #include "media_formats.hh"
 #include "yaml.hh"
 #include "socket.hh"
-
-class ABRAlgo;
+#include "abr_algo.hh"
+#include "audio_abr_algo.hh"
 
 class WebSocketClient
 {
 public:
+  /* a video chunk traced along the send path; times in us */
+  struct SendTrace
+  {
+    uint64_t vts {0};
+    std::optional<uint64_t> ready_us {};  /* went ready on a live channel */
+    uint64_t queued_us {0};               /* its frames were queued */
+    uint64_t backlog_bytes {0};  /* waiting to be sent ahead of the chunk */
+
+    /* the bytes written to the connection once its last byte is */
+    uint64_t end_offset {0};
+    std::optional<uint64_t> written_us {};
+  };
+
+  static constexpr size_t SEND_TRACE_SLOTS = 4;
+  using SendTraces = std::array<std::optional<SendTrace>, SEND_TRACE_SLOTS>;
+
+  /* an ABR decision made ahead of time, while the previous chunk was in
+   * flight, along with the state that it was made in */
+  struct SpeculativeDecision
+  {
+    uint64_t vts;
+    size_t format_idx;       /* in vformats() of the channel */
+    double playback_buf;     /* seconds */
+    uint64_t delivery_rate;  /* bytes per second */
+  };
+
   WebSocketClient(const uint64_t connection_id,
                   const std::string & abr_name,
                   const YAML::Node & abr_config);
@@ -48,16 +77,16 @@ public:
   std::optional<unsigned int> first_init_id() const { return first_init_id_; }
 
   bool is_authenticated() const { return authenticated_; }
-  std::string session_key() const { return session_key_; }
-  std::string username() const { return username_; }
+  const std::string & session_key() const { return info_->session_key; }
+  const std::string & username() const { return info_->username; }
 
   std::string signature() const {
-    return std::to_string(connection_id_) + "," + username_;
+    return std::to_string(connection_id_) + "," + info_->username;
   }
 
-  std::string browser() const { return browser_; }
-  std::string os() const { return os_; }
-  Address address() const { return address_; }
+  const std::string & browser() const { return info_->browser; }
+  const std::string & os() const { return info_->os; }
+  const Address & address() const { return info_->address; }
 
   uint16_t screen_width() const { return screen_width_; }
   uint16_t screen_height() const { return screen_height_; }
@@ -74,27 +103,51 @@ public:
   double video_playback_buf() const { return video_playback_buf_; }
   double audio_playback_buf() const { return audio_playback_buf_; }
 
+  /* the playback buffers at ts_ms, having drained in real time since the
+   * client last reported them in set_playback_bufs(), but for no more than
+   * MAX_BUF_DRAIN_MS (e.g., if the client has paused) */
+  double video_playback_buf_at(const uint64_t ts_ms) const;
+  double audio_playback_buf_at(const uint64_t ts_ms) const;
+
+  /* when the video (audio) playback buffer is expected to have drained to
+   * MAX_BUFFER_S; nullopt if it is already there, or is not expected to get
+   * there before the client reports it again */
+  std::optional<uint64_t> video_buf_drain_ts() const;
+  std::optional<uint64_t> audio_buf_drain_ts() const;
+
   std::optional<double> startup_delay() const { return startup_delay_; }
   double cum_rebuffer() const { return cum_rebuffer_; }
 
   std::optional<VideoFormat> curr_vformat() const { return curr_vformat_; }
   std::optional<AudioFormat> curr_aformat() const { return curr_aformat_; }
 
+  std::optional<size_t> curr_vinit_key() const { return curr_vinit_key_; }
+  std::optional<size_t> curr_ainit_key() const { return curr_ainit_key_; }
+
   uint64_t last_msg_recv_ts() const { return last_msg_recv_ts_; }
 
   std::optional<uint64_t> last_video_send_ts() const { return last_video_send_ts_; }
   std::optional<TCPInfo> tcp_info() const { return tcp_info_; }
 
+  MsgEncoding msg_encoding() const { return msg_encoding_; }
+
+  /* the chunks being traced, in a ring that add_send_trace() overwrites */
+  SendTraces & send_traces() { return send_traces_; }
+  SendTrace & add_send_trace();
+
+  /* the decision made ahead of time for the next video chunk, if any */
+  std::optional<SpeculativeDecision> & speculative_vformat() { return speculative_vformat_; }
+
   /* mutators */
   void set_init_id(const unsigned int init_id);
 
   void set_authenticated(const bool authenticated) { authenticated_ = authenticated; }
-  void set_session_key(const std::string & session_key) { session_key_ = session_key; }
-  void set_username(const std::string & username) { username_ = username; }
+  void set_session_key(const std::string & session_key) { info_->session_key = session_key; }
+  void set_username(const std::string & username) { info_->username = username; }
 
-  void set_browser(const std::string & browser) { browser_ = browser; }
-  void set_os(const std::string & os) { os_ = os; }
-  void set_address(const Address & address) { address_ = address; }
+  void set_browser(const std::string & browser) { info_->browser = browser; }
+  void set_os(const std::string & os) { info_->os = os; }
+  void set_address(const Address & address) { info_->address = address; }
 
   void set_screen_size(const uint16_t screen_width, const uint16_t screen_height);
 
@@ -107,56 +160,78 @@ public:
   void set_video_playback_buf(const double buf) { video_playback_buf_ = buf; }
   void set_audio_playback_buf(const double buf) { audio_playback_buf_ = buf; }
 
+  /* the playback buffers reported by the client at report_ts */
+  void set_playback_bufs(const double video_buf, const double audio_buf,
+                         const uint64_t report_ts);
+
   void set_startup_delay(const double delay) { startup_delay_ = delay; }
   void set_cum_rebuffer(const double cum_rebuf) { cum_rebuffer_ = cum_rebuf; }
 
   void set_curr_vformat(const VideoFormat & format) { curr_vformat_ = format; }
   void set_curr_aformat(const AudioFormat & format) { curr_aformat_ = format; }
 
+  void set_curr_vinit_key(const size_t key) { curr_vinit_key_ = key; }
+  void set_curr_ainit_key(const size_t key) { curr_ainit_key_ = key; }
+
   void set_last_msg_recv_ts(uint64_t recv_ts) { last_msg_recv_ts_ = recv_ts; }
 
   void set_last_video_send_ts(const std::optional<uint64_t> send_ts) { last_video_send_ts_ = send_ts; }
   void set_tcp_info(const std::optional<TCPInfo> tcp_info) { tcp_info_ = tcp_info; }
 
+  void set_msg_encoding(const MsgEncoding encoding) { msg_encoding_ = encoding; }
+
   /* ABR related */
   void video_chunk_acked(const VideoFormat & format,
                          const double ssim,
                          const unsigned int chunk_size,
                          const uint64_t transmission_time);
-  VideoFormat select_video_format();
-  AudioFormat select_audio_format();
+  void prepare_video_format();
+  std::optional<uint64_t> video_format_pending();
 
-  static constexpr double MAX_BUFFER_S = 15.0;  /* seconds */
+  /* return the index of the selected format in vformats() (aformats()) of
+   * the channel */
+  size_t select_video_format();
 
-private:
-  uint64_t connection_id_;
+  /* the ABR's expected throughput (bytes/s) of the selected chunk */
+  std::optional<double> video_target_rate() const;
+  size_t select_audio_format();
 
-  /* ABR algorithm */
-  std::string abr_name_;
-  YAML::Node abr_config_;
-  std::unique_ptr<ABRAlgo> abr_algo_ {nullptr};
+  /* handoff to another process (e.g., a new binary) */
 
-  /* WebSocketClient has no interest in managing the ownership of channel */
-  std::weak_ptr<Channel> channel_;
+  /* the streaming state of the client, along with its recent acked chunks */
+  json handoff_state() const;
 
-  /* timestamp of the last message received from client */
-  uint64_t last_msg_recv_ts_;
+  /* restore handoff_state() of a client that was watching channel, replaying
+   * the acked chunks into the ABR algorithm so that it need not start over */
+  void restore(const json & state, const std::shared_ptr<Channel> & channel);
 
-  /* set to the init_id in the most recently received client-init */
-  std::optional<unsigned int> init_id_ {};
-  std::optional<unsigned int> first_init_id_ {};
+  /* the acked chunks kept for restore(), oldest first */
+  const std::deque<ABRAlgo::Chunk> & acked_chunks() const { return acked_chunks_; }
 
-  bool authenticated_ {false};
-  std::string session_key_ {};
-  std::string username_ {};
+  /* replay the acked chunks of the stream that the client resumes on this
+   * connection (e.g., from SessionStore), unless it has acked any here */
+  void resume_acked_chunks(const std::vector<ABRAlgo::Chunk> & chunks);
 
-  /* fields set in client-init */
-  std::string browser_ {};
-  std::string os_ {};
-  Address address_ {};
+  /* time the calls into the ABR algorithms, recording them as Metrics by
+   * algorithm name (e.g., abr_select_us:puffer_ttp) */
+  static void set_abr_profiling(const bool enabled) { abr_profiling_ = enabled; }
 
-  uint16_t screen_width_ {0xFFFF};
-  uint16_t screen_height_ {0xFFFF};
+  static constexpr double MAX_BUFFER_S = 15.0;  /* seconds */
+
+  /* a playing client reports its buffers at 4 Hz; past this since its last
+   * report, the buffers are no longer assumed to drain */
+  static constexpr uint64_t MAX_BUF_DRAIN_MS = 1000;
+
+  /* number of the most recently acked chunks kept for restore() */
+  static constexpr size_t MAX_ACKED_CHUNKS = 16;
+
+private:
+  /* the state consulted on every message and chunk comes first, so that it
+   * shares a few cache lines; the rest is in the cold ClientInfo */
+  uint64_t connection_id_;
+
+  /* timestamp of the last message received from client */
+  uint64_t last_msg_recv_ts_;
 
   /* chunk timestamps in the process of being sent */
   std::optional<uint64_t> next_vts_ {};
@@ -166,26 +241,95 @@ private:
   std::optional<uint64_t> client_next_vts_ {};
   std::optional<uint64_t> client_next_ats_ {};
 
-  /* playback buffer in seconds */
+  /* playback buffer in seconds, as last reported at buf_report_ts_ */
   double video_playback_buf_ {0};
   double audio_playback_buf_ {0};
+  std::optional<uint64_t> buf_report_ts_ {};
+
+  /* current video and audio formats */
+  std::optional<VideoFormat> curr_vformat_ {};
+  std::optional<AudioFormat> curr_aformat_ {};
+
+  /* keys of the init segments last sent (see Channel::vinit_key()); not
+   * saved across restarts, so a restored client is sent an init again */
+  std::optional<size_t> curr_vinit_key_ {};
+  std::optional<size_t> curr_ainit_key_ {};
+
+  /* WebSocketClient has no interest in managing the ownership of channel */
+  std::weak_ptr<Channel> channel_;
+
+  /* ABR algorithm */
+  std::unique_ptr<ABRAlgo> abr_algo_ {nullptr};
+
+  /* audio ABR algorithm: abr_config["audio_abr"] (linear_bba by default),
+   * configured by abr_config["audio_abr_config"] */
+  std::unique_ptr<AudioABRAlgo> audio_abr_algo_ {nullptr};
+
+  /* encoding of server-video and server-audio negotiated in client-init */
+  MsgEncoding msg_encoding_ {MsgEncoding::JSON};
+
+  bool authenticated_ {false};
+
+  uint16_t screen_width_ {0xFFFF};
+  uint16_t screen_height_ {0xFFFF};
+
+  /* set to the init_id in the most recently received client-init */
+  std::optional<unsigned int> init_id_ {};
+  std::optional<unsigned int> first_init_id_ {};
 
   std::optional<double> startup_delay_ {};
 
   /* cumulative rebuffering time, including startup_delay_ */
   double cum_rebuffer_ {};
 
-  /* current video and audio formats */
-  std::optional<VideoFormat> curr_vformat_ {};
-  std::optional<AudioFormat> curr_aformat_ {};
-
   /* sending time of last video chunk */
   std::optional<uint64_t> last_video_send_ts_ {};
   /* TCP info before sending a video chunk */
   std::optional<TCPInfo> tcp_info_ {};
 
+  std::optional<SpeculativeDecision> speculative_vformat_ {};
+
+  /* helpers of the *_playback_buf_at() and *_buf_drain_ts() */
+  double drained_buf(const double buf, const uint64_t ts_ms) const;
+  std::optional<uint64_t> buf_drain_ts(const double buf) const;
+
+  SendTraces send_traces_ {};
+  size_t next_send_trace_ {0};
+
+  /* the last MAX_ACKED_CHUNKS chunks passed to the ABR algorithm */
+  std::deque<ABRAlgo::Chunk> acked_chunks_ {};
+
+  /* the strings that are only read when logging, authenticating or handing
+   * off the client, allocated on the side */
+  struct ClientInfo
+  {
+    std::string abr_name;
+    YAML::Node abr_config;
+
+    /* names of the metrics of the ABR algorithm, built once */
+    std::string abr_prepare_metric;
+    std::string abr_select_metric;
+    std::string abr_acked_metric;
+
+    std::string session_key {};
+    std::string username {};
+
+    /* fields set in client-init */
+    std::string browser {};
+    std::string os {};
+    Address address {};
+  };
+
+  std::unique_ptr<ClientInfo> info_;
+
+  static bool abr_profiling_;
+
   /* (re)instantiate abr_algo_ */
   void init_abr_algo();
+  void init_audio_abr_algo();
+
+  /* pass chunk to abr_algo_ and keep it in acked_chunks_ */
+  void add_acked_chunk(ABRAlgo::Chunk chunk);
 
   void reset_helper();
 };
@@ -3,29 +3,59 @@
 #include <cstdlib>
 #include <cmath>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <sys/resource.h>
 
 #include <iostream>
+#include <fstream>
 #include <string>
 #include <map>
+#include <set>
 #include <memory>
 #include <random>
 #include <algorithm>
-#include <pqxx/pqxx>
+#include <atomic>
+#include <mutex>
+#include <limits>
+#include <thread>
 
 #include "util.hh"
 #include "strict_conversions.hh"
+#include "tokenize.hh"
 #include "timestamp.hh"
 #include "inotify.hh"
 #include "timerfd.hh"
+#include "ipc_socket.hh"
 #include "channel.hh"
 #include "server_message.hh"
 #include "client_message.hh"
+#include "frame_cache.hh"
+#include "chunk_http_server.hh"
 #include "ws_server.hh"
 #include "ws_client.hh"
 #include "media_formats.hh"
 #include "yaml.hh"
 #include "abr_algo.hh"
+#include "abr_worker_pool.hh"
+#include "async_auth.hh"
+#include "session_cache.hh"
+#include "log_writer.hh"
+#include "metrics.hh"
+#include "counters.hh"
+#include "profiler.hh"
+#include "arena.hh"
+#include "slot_map.hh"
+#include "metrics_exporter.hh"
+#include "admission.hh"
+#include "load_table.hh"
+#include "session_store.hh"
+#include "session_trace.hh"
+#include "stream_stats.hh"
+#include "diag_log.hh"
+#include "thread_pool.hh"
+#include "inference_channel.hh"
 
 using namespace std;
 using namespace PollerShortNames;
@@ -36,25 +66,295 @@ using WebSocketServer = WebSocketTCPServer;
 using WebSocketServer = WebSocketSecureServer;
 #endif
 
-/* global variables */
-YAML::Node config;
-static map<string, shared_ptr<Channel>> channels;  /* key: channel name */
-static map<uint64_t, WebSocketClient> clients;  /* key: connection ID */
-
-static const size_t MAX_WS_FRAME_B = 100 * 1024;  /* 10 KB */
+/* global variables; each event-loop thread works on its own copy of the
+ * config, its own channels (sharing the same mmap'd files) and its own clients */
+static YAML::Node base_config;
+thread_local YAML::Node config;
+static thread_local map<string, shared_ptr<Channel>> channels;  /* key: channel name */
+
+/* key: connection ID; in dense slots (see SlotMap) of blocks allocated close
+ * together (in huge pages), as they are iterated over in the timers and
+ * looked up on every message */
+using ClientAllocator = ArenaAllocator<pair<const uint64_t, WebSocketClient>>;
+static thread_local Arena client_arena;
+static thread_local SlotMap<WebSocketClient, ClientAllocator> clients {
+  ClientAllocator(client_arena)};
+
+/* viewers of the clients per channel, format and buffer level, kept up to
+ * date by update_stream_stats() */
+static thread_local StreamStats stream_stats;
+
+/* frames of media segments shared by the clients; key: channel name */
+static thread_local map<string, FrameCache> vframe_caches;
+static thread_local map<string, FrameCache> aframe_caches;
+
+/* clients due for a video segment in this iteration of the event loop; their
+ * ABR decisions are made in a batch after all the events have been handled */
+static thread_local set<uint64_t> video_due_clients;
+
+/* the run queue: clients to be served in this iteration of the event loop,
+ * once all the events have been handled. A client is made runnable by its
+ * messages (and is served once after a burst of them, e.g., acks after a
+ * stall, rather than after each), by the chunks it waits for going ready
+ * (see serve_edge_clients()), and by its playback buffer draining enough to
+ * take another chunk (see wait_for_buffer()); clients are not looked at
+ * otherwise */
+static thread_local set<uint64_t> runnable_clients;
+
+/* clients held back only by full playback buffers, until they are expected
+ * to have drained; value: the timer (of the poller) at that time */
+static thread_local map<uint64_t, TimerWheel::TimerId> buffer_wait_clients;
+
+/* clients whose ABR decisions are made in other processes and pending;
+ * value: the timer (of the poller) at the deadline of the decision */
+static thread_local map<uint64_t, TimerWheel::TimerId> video_pending_clients;
+
+/* with abr_speculation, the next ABR decision of a client just sent a video
+ * chunk is made while the event loop is idle, rather than once the chunk is
+ * acked; it is used if the playback buffer and the delivery rate are still
+ * within these of what it was made with by then */
+static bool abr_speculation = false;
+static thread_local bool speculate_video = false;
+static thread_local set<uint64_t> video_speculation_clients;
+static const double SPECULATION_MAX_BUF_DIFF_S = 1.0;
+static const double SPECULATION_MAX_RATE_DIFF = 0.2;  /* relative */
+
+/* with fast_startup, a client that starts a stream is sent its first chunks
+ * right behind the server-init (see serve_startup_chunks()) */
+static bool fast_startup = false;
+
+/* clients at the live edge that can take the next chunk but wait for it to
+ * be ready, served as soon as their channel reports it ready rather than on
+ * their next message; key: channel name, then the timestamp waited for.
+ * A closed client stays until the frontier passes its timestamp */
+static thread_local map<string, map<uint64_t, set<uint64_t>>> vedge_clients;
+static thread_local map<string, map<uint64_t, set<uint64_t>>> aedge_clients;
+
+/* client-init of the clients waiting for the database to authenticate them;
+ * key: connection ID */
+static thread_local map<uint64_t, ClientInitMsg> pending_auths;
+
+/* session keys validated recently, which are not checked again */
+static const size_t SESSION_CACHE_SIZE = 10000;
+static const uint64_t SESSION_CACHE_TTL_MS = 300000;
+static thread_local SessionCache session_cache {SESSION_CACHE_SIZE,
+                                                SESSION_CACHE_TTL_MS};
+
+static const size_t MAX_WS_FRAME_B = 100 * 1024;  /* 100 KB */
 static const unsigned int MAX_IDLE_MS = 60000; /* clean idle connections */
 
+/* timers (of the poller) that clean each client once it has been idle for
+ * MAX_IDLE_MS; key: connection ID */
+static thread_local map<uint64_t, TimerWheel::TimerId> idle_timers;
+
 static const unsigned int MAX_CONNECTION_NUM = 10; /* max connections */
 
+/* event-loop threads; each runs a WSServer listening on the same port */
+static unsigned int num_threads = 1;
+static thread_local unsigned int thread_id = 0;
+
+/* CPUs shared by the event-loop threads of all the servers on the host; a
+ * thread is pinned to one of them, on which it also runs its ABR (e.g., TTP
+ * inference), so that servers do not compete for the same cores */
+static vector<int> ws_cpus;
+
+/* max connections and number of connections across all threads */
+static unsigned int max_connection_num = MAX_CONNECTION_NUM;
+static atomic<unsigned int> num_connections {0};
+
+/* decides on new connections for all threads given server_load() */
+static unique_ptr<AdmissionController> admission;
+
+/* loads of all the servers on this host; only used by the "load" controller */
+static shared_ptr<LoadTable> load_table;
+
+/* the recent acked chunks of the streams of all the servers on this host,
+ * replayed into the ABR algorithm of a client that resumes its stream */
+static unique_ptr<SessionStore> session_store;
+
+/* each thread samples how late its event loop runs a timer every
+ * LOAD_SAMPLE_MS, and updates its load once per LOAD_SAMPLES_PER_UPDATE */
+static const unsigned int LOAD_SAMPLE_MS = 100;
+static const unsigned int LOAD_SAMPLES_PER_UPDATE = 10;
+
+/* how often the channels look for new chunks in their MediaIndex */
+static const unsigned int INDEX_SYNC_MS = 50;
+
+/* graceful handoff to a new ws_media_server (e.g., a new binary) started
+ * with the same config and server ID: each of its threads connects to the
+ * handoff socket of the same thread of this server, which passes the
+ * listening socket and then the idle connections over, and exits once all
+ * its clients have been handed off or have left */
+static string handoff_socket;  /* path prefix; handoff is disabled if empty */
+static unsigned int handoff_drain_s = 600;  /* give up on the rest after */
+static const unsigned int HANDOFF_MS = 100;  /* how often to hand off */
+
+static thread_local unique_ptr<IPCSocket> handoff_listener;
+static thread_local unique_ptr<IPCSocket> handoff_from;  /* the old server */
+static thread_local unique_ptr<IPCSocket> handoff_to;    /* the new server */
+static thread_local uint64_t handoff_deadline = 0;
+
+struct ThreadLoad {
+  atomic<uint64_t> loop_lag_us {0};
+  atomic<uint64_t> buffer_bytes {0};
+  atomic<uint64_t> memory_bytes {0};  /* see evict_stalled_clients() */
+};
+
+static unique_ptr<ThreadLoad[]> thread_loads;
+static atomic<double> cpu_util {0};  /* updated by thread 0 */
+static Poller::Backend poller_backend = Poller::Backend::Poll;
+
+/* caps on the bytes gathered into a single write and a single TLS record */
+static size_t max_write_bytes = 256 * 1024;
+static size_t max_tls_record_bytes = 16 * 1024;
+
+/* bytes per round of the deficit round robin across the connections (0: no
+ * scheduling), weighted by the clients' buffer deficits but not below
+ * MIN_SEND_WEIGHT, so that a client about to stall is sent to first */
+static size_t send_quantum_bytes = 0;
+static constexpr double MIN_SEND_WEIGHT = 0.1;
+
+/* TCP_NOTSENT_LOWAT of the connections (0: the system default) */
+static unsigned int tcp_notsent_lowat = 0;
+
+/* caps on the memory of the connections' buffers (0: none): a client whose
+ * connection holds more than max_client_buffer_bytes, or any client while
+ * the connections of all threads hold more than max_total_buffer_bytes, is
+ * queued no new segments until they drain; a client over a cap that has not
+ * written a byte for buffer_stall_s has its unsent frames dropped and is
+ * reinitialized. An incomplete message of more than max_receive_bytes from
+ * a client closes its connection */
+static uint64_t max_client_buffer_bytes = 0;
+static uint64_t max_total_buffer_bytes = 0;
+static unsigned int buffer_stall_s = 10;
+static size_t max_receive_bytes = 0;
+
+/* bytes written by the connections over a cap, and since when (in ms) they
+ * have written no more */
+static thread_local map<uint64_t, pair<uint64_t, uint64_t>> stalled_writes;
+
+/* collect the TCP info of all the connections of a thread in a single
+ * NETLINK_SOCK_DIAG dump every tcp_info_interval_ms (0: never), which the
+ * speculative ABR decisions and the transport metrics read; the decisions
+ * due still read the current TCP info of their connections */
+static unsigned int tcp_info_interval_ms = 0;
+
+/* pace each video chunk at pacing_gain times the throughput the ABR
+ * expects of it (0: no pacing); unpaced while the ABR has no estimate */
+static double pacing_gain = 0;
+
+/* with dynamic_record_sizing, the TLS records and WebSocket frames of each
+ * video chunk are sized by the congestion window of its connection: while
+ * the window is small (e.g., at startup or after a loss), a record fits in
+ * a packet and is decrypted by the client as soon as the packet arrives,
+ * rather than once all the packets of a 16 KB record did; as it grows,
+ * larger records and frames cost less per byte */
+struct RecordSizeTier {
+  uint32_t max_cwnd;  /* in packets; the tier applies below it */
+  size_t record_bytes;
+  size_t frame_bytes;
+};
+
+static bool dynamic_record_sizing = false;
+static const RecordSizeTier RECORD_SIZE_TIERS[] = {
+  /* 1369 B of plaintext in a 1448 B (Ethernet MSS) packet, with the TLS
+   * header, tag and TCP timestamps */
+  {32, 1369, 16 * 1024},
+  {128, 16 * 1024, MAX_WS_FRAME_B},
+  {numeric_limits<uint32_t>::max(), 16 * 1024, 256 * 1024},
+};
+
+static const RecordSizeTier & record_size_tier(const TCPInfo & tcpi)
+{
+  for (const auto & tier : RECORD_SIZE_TIERS) {
+    if (tcpi.cwnd < tier.max_cwnd) {
+      return tier;
+    }
+  }
+
+  return RECORD_SIZE_TIERS[size(RECORD_SIZE_TIERS) - 1];
+}
+
+/* threads that construct the static channels of an event-loop thread at
+ * startup (0: the CPUs shared by the event-loop threads) */
+static unsigned int channel_startup_threads = 0;
+
+/* with channel_idle_s > 0, a live channel with a media index starts dormant
+ * (see Channel::make_dormant()), is activated by its first client (or HTTP
+ * request), and goes dormant again once it has not been watched for
+ * channel_idle_s; when each channel was last watched, by channel name */
+static unsigned int channel_idle_s = 0;
+static thread_local map<string, uint64_t> channel_watched_ms;
+
+/* port of the HTTP endpoint that serves the chunks to a CDN (none if unset),
+ * shared by the threads */
+static optional<uint16_t> http_chunk_port;
+
+/* with channel_affinity > 0, each channel is served by that many servers of
+ * the experiment group (picked by rendezvous hashing of the channel name),
+ * to which the clients of the channel are redirected, so that each server
+ * caches the chunks of fewer channels; the group is the servers with IDs in
+ * [group_first_server, group_first_server + group_num_servers) */
+static unsigned int channel_affinity = 0;
+static unsigned int group_first_server = 0;
+static unsigned int group_num_servers = 0;
+
+/* TLS session tickets, whose secret is shared by the servers of run_servers */
+static bool enable_session_tickets = false;
+static string ssl_ticket_secret;
+static unsigned int ssl_ticket_rotation_s = 3600;
+
+/* workers shared by the servers of all threads to run the TLS handshakes
+ * (tls_handshake_threads; none: in the event loops) */
+static shared_ptr<ThreadPool> handshake_pool;
+
+/* TLS handshakes across threads since they were last logged */
+static atomic<uint64_t> num_full_handshakes {0};
+static atomic<uint64_t> num_resumed_handshakes {0};
+static atomic<uint64_t> full_handshake_us {0};
+static atomic<uint64_t> resumed_handshake_us {0};
+
+/* one in send_trace_sample video chunks is traced from going ready to being
+ * acked (0: none); the clients whose traced chunks are still being written */
+static unsigned int send_trace_sample = 0;
+static thread_local uint64_t num_vchunks_served = 0;
+static thread_local set<uint64_t> send_traced_clients;
+
+/* with session_trace_dir, one in session_trace_sample of the sessions of
+ * each thread are recorded to a trace of the thread in that directory, to
+ * be replayed by load_generator --replay */
+static string session_trace_dir;
+static unsigned int session_trace_sample = 100;
+static thread_local unique_ptr<SessionTrace> session_trace;
+static thread_local set<uint64_t> traced_sessions;
+static thread_local uint64_t num_sessions_opened = 0;
+
+/* with replay_tcp_info (the path of a session trace), a stream in the trace
+ * chooses each of its video chunks on the TCP info recorded for that chunk
+ * rather than on that of its connection, so that a replayed session makes
+ * the same ABR decisions as it did; key: init_id */
+static map<unsigned int, vector<TCPInfo>> replay_tcp_infos;
+static thread_local map<unsigned int, size_t> replay_next_chunks;
+
 /* for logging */
 static bool enable_logging = false;
 static fs::path log_dir;  /* base directory for logging */
 static string server_id;
 static string expt_id;
-static map<string, FileDescriptor> log_fds;  /* map log name to fd */
+/* log lines are queued by the event-loop threads and written in batches by
+ * a background thread (see LogWriter) */
+static unique_ptr<LogWriter> log_writer;
 static const unsigned int MAX_LOG_FILESIZE = 100 * 1024 * 1024;  /* 100 MB */
 static uint64_t last_minute = 0;  /* in ms; multiple of 60000 */
 
+/* how long to wait for the inference_daemon before evaluating a model here */
+static const uint64_t INFERENCE_TIMEOUT_US = 2000;
+
+/* per-thread active stream counts (channel name -> count), which are summed
+ * up and logged once per minute by thread 0 */
+static vector<map<string, unsigned int>> active_streams_counts;
+static mutex active_streams_mutex;
+
 void print_usage(const string & program_name)
 {
   cerr <<
@@ -73,90 +373,425 @@ string client_signature(const uint64_t connection_id)
   }
 }
 
+/* account for the stream of client in stream_stats after its channel,
+ * video format or playback buffer may have changed */
+void update_stream_stats(const WebSocketClient & client)
+{
+  const auto channel = client.channel();
+  const auto vformat = client.curr_vformat();
+
+  stream_stats.update(client.connection_id(),
+                      channel ? channel->name() : string(),
+                      vformat ? vformat->to_string() : string(),
+                      client.video_playback_buf());
+}
+
+/* erase a client and keep track of the number of connections */
+void erase_client(WebSocketServer & server, const uint64_t connection_id)
+{
+  if (clients.erase(connection_id)) {
+    num_connections--;
+  }
+
+  stream_stats.remove(connection_id);
+
+  for (auto * timers : {&video_pending_clients, &buffer_wait_clients,
+                        &idle_timers}) {
+    const auto it = timers->find(connection_id);
+    if (it != timers->end()) {
+      server.poller().cancel_timer(it->second);
+      timers->erase(it);
+    }
+  }
+
+  pending_auths.erase(connection_id);
+
+  if (traced_sessions.erase(connection_id)) {
+    session_trace->close(connection_id);
+  }
+}
+
+/* clean the client at deadline_ms unless it has received a message within
+ * MAX_IDLE_MS by then, in which case the timer is armed again; only the
+ * clients whose timers expire are looked at */
+void arm_idle_timer(WebSocketServer & server, const uint64_t connection_id,
+                    const uint64_t deadline_ms)
+{
+  idle_timers[connection_id] = server.poller().add_timer(deadline_ms,
+    [&server, connection_id]() {
+      idle_timers.erase(connection_id);
+
+      const auto it = clients.find(connection_id);
+      if (it == clients.end()) {
+        return;
+      }
+
+      const uint64_t last_msg_recv_ts = it->second.last_msg_recv_ts();
+      if (timestamp_ms() - last_msg_recv_ts <= MAX_IDLE_MS) {
+        arm_idle_timer(server, connection_id,
+                       last_msg_recv_ts + MAX_IDLE_MS + 1);
+        return;
+      }
+
+      DIAG(Info) << it->second.signature() << ": cleaned idle connection";
+      erase_client(server, connection_id);
+      server.clean_idle_connection(connection_id);
+    }
+  );
+}
+
+/* the secret of TLS session tickets written by run_servers */
+string load_ticket_secret()
+{
+  const string secret_file = config["ssl_ticket_secret_file"] ?
+    config["ssl_ticket_secret_file"].as<string>() : "ssl_ticket_secret";
+
+  string secret;
+  ifstream ifs(secret_file);
+  if (ifs >> secret and not secret.empty()) {
+    return secret;
+  }
+
+  /* not launched by run_servers: only this process accepts its tickets */
+  DIAG(Warning) << "Warning: no session ticket secret in " << secret_file
+                << "; using a random secret";
+
+  random_device rd;
+  for (unsigned int i = 0; i < 8; i++) {
+    secret += to_string(rd());
+  }
+
+  return secret;
+}
+
 void append_to_log(const string & log_stem, const string & log_line)
 {
-  if (not enable_logging) {
+  if (not log_writer) {
     throw runtime_error("append_to_log: enable_logging must be true");
   }
 
-  string log_name = log_stem + "." + server_id + ".log";
-  string log_path = log_dir / log_name;
+  log_writer->append(log_stem, log_line);
+}
+
+/* load of the server from the latest updates of all threads */
+ServerLoad server_load()
+{
+  ServerLoad load;
+  load.num_connections = num_connections;
+
+  for (unsigned int i = 0; i < num_threads; i++) {
+    load.loop_lag_us = max(load.loop_lag_us, thread_loads[i].loop_lag_us.load());
+    load.buffer_bytes += thread_loads[i].buffer_bytes;
+  }
+
+  load.cpu_util = cpu_util;
+  return load;
+}
+
+/* bytes held by the connections of all threads as of their last slow timer */
+uint64_t total_memory_bytes()
+{
+  uint64_t total = 0;
+  for (unsigned int i = 0; i < num_threads; i++) {
+    total += thread_loads[i].memory_bytes;
+  }
+
+  return total;
+}
+
+/* whether the buffers are over a cap and client must not be queued new
+ * segments for now (see max_client_buffer_bytes) */
+bool over_memory_cap(const WebSocketServer & server,
+                     const WebSocketClient & client)
+{
+  return (max_client_buffer_bytes > 0 and
+          server.memory_bytes(client.connection_id())
+            > max_client_buffer_bytes) or
+         (max_total_buffer_bytes > 0 and
+          total_memory_bytes() > max_total_buffer_bytes);
+}
+
+/* CPU time of this process over the wall time of its event-loop threads
+ * since the last call */
+double sample_cpu_util()
+{
+  static uint64_t last_wall_us = 0;
+  static uint64_t last_cpu_us = 0;
+
+  rusage usage;
+  CheckSystemCall("getrusage", getrusage(RUSAGE_SELF, &usage));
+
+  const uint64_t cpu_us =
+    (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * MILLION
+    + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+  const uint64_t wall_us = timestamp_us();
+
+  double util = 0;
+  if (last_wall_us > 0 and wall_us > last_wall_us) {
+    util = static_cast<double>(cpu_us - last_cpu_us)
+           / ((wall_us - last_wall_us) * num_threads);
+  }
+
+  last_wall_us = wall_us;
+  last_cpu_us = cpu_us;
+  return util;
+}
+
+/* note how late load_timer has been run by the event loop; update the load
+ * of this thread (and publish the server's if on thread 0) periodically */
+void sample_load(WebSocketServer & server, Timerfd & load_timer,
+                 const uint16_t port)
+{
+  static thread_local uint64_t last_sample_us = 0;
+  static thread_local uint64_t max_lag_us = 0;
+  static thread_local unsigned int num_samples = 0;
+
+  load_timer.expirations();
+
+  const uint64_t now = timestamp_us();
+  if (last_sample_us > 0) {
+    const uint64_t due = last_sample_us + LOAD_SAMPLE_MS * 1000;
+    max_lag_us = max(max_lag_us, now > due ? now - due : 0);
+  }
+  last_sample_us = now;
+
+  if (++num_samples < LOAD_SAMPLES_PER_UPDATE) {
+    return;
+  }
+
+  ThreadLoad & thread_load = thread_loads[thread_id];
+  thread_load.loop_lag_us = max_lag_us;
+  thread_load.buffer_bytes = server.total_buffer_bytes();
+
+  num_samples = 0;
+  max_lag_us = 0;
+
+  if (thread_id == 0) {
+    cpu_util = sample_cpu_util();
+
+    if (load_table) {
+      load_table->publish(stoi(server_id), port, server_load());
+    }
+  }
+}
+
+/* queue the (shared) frames of a media segment to client; the data of the
+ * frames is borrowed rather than shared, so that the reference count of its
+ * mmap'd chunk is not touched for each frame of each client: a frame holds
+ * frames (and so their chunks) alive only if it is the last of a segment,
+ * and the send buffer writes (and drops) the earlier ones before it */
+void queue_cached_frame(WebSocketServer & server,
+                        const uint64_t connection_id,
+                        const FrameCache::Frame & frame,
+                        const unsigned int init_id,
+                        const MsgEncoding encoding,
+                        const shared_ptr<const FrameCache::Frames> & frames,
+                        const bool last)
+{
+  /* only the small message header is copied for each client */
+  string msg = frame.msg;
+  ServerMsg::fill_init_id(msg, frame.init_id_slot, init_id, encoding);
+
+  vector<SharedBuffer> frame_payload;
+  frame_payload.reserve(frame.data.size() + 1);
+
+  if (last and frame.data.empty()) {
+    frame_payload.emplace_back(move(msg),
+                               shared_ptr<const char>(frames, nullptr));
+  } else {
+    frame_payload.emplace_back(move(msg));
+  }
 
-  /* find or create a file descriptor for the log */
-  auto log_it = log_fds.find(log_name);
-  if (log_it == log_fds.end()) {
-    log_it = log_fds.emplace(log_name, FileDescriptor(CheckSystemCall(
-        "open (" + log_path + ")",
-        open(log_path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644)))).first;
+  for (const auto & buffer : frame.data) {
+    if (last and &buffer == &frame.data.back()) {
+      const string_view data = buffer.view();
+      frame_payload.emplace_back(shared_ptr<const char>(frames, data.data()),
+                                 data.data(), data.size());
+    } else {
+      frame_payload.emplace_back(SharedBuffer::borrow(buffer));
+    }
   }
 
-  /* append a line to log */
-  FileDescriptor & fd = log_it->second;
-  fd.write(log_line + "\n");
+  server.queue_frame(connection_id, true, WSFrame::OpCode::Binary,
+                     move(frame_payload));
+}
+
+/* queue the frames one at a time as the connection drains its send buffer,
+ * rather than all at once; urgent frames go ahead of the others */
+void stream_frames(WebSocketServer & server, WebSocketClient & client,
+                   const shared_ptr<const FrameCache::Frames> & frames,
+                   const bool urgent = false)
+{
+  if (frames->empty()) {
+    return;
+  }
 
-  /* rotate log if filesize is too large */
-  if (fd.curr_offset() > MAX_LOG_FILESIZE) {
-    fs::rename(log_path, log_path + ".old");
-    cerr << "Renamed " << log_path << " to " << log_path + ".old" << endl;
+  /* the client might be gone by the time the last frame is queued */
+  server.queue_pull(client.connection_id(),
+    [&server, connection_id = client.connection_id(), frames,
+     init_id = client.init_id().value(), encoding = client.msg_encoding(),
+     next_frame = size_t {0}]() mutable -> bool
+    {
+      const bool last = next_frame + 1 == frames->size();
+      queue_cached_frame(server, connection_id, frames->at(next_frame++),
+                         init_id, encoding, frames, last);
+      return not last;
+    },
+    urgent
+  );
+}
 
-    /* create new fd before closing old one */
-    FileDescriptor new_fd(CheckSystemCall(
-        "open (" + log_path + ")",
-        open(log_path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644)));
-    fd.close();  /* reader is notified and safe to open new fd immediately */
+/* bytes of the frames on the wire, WebSocket frame headers included */
+uint64_t frames_wire_bytes(const FrameCache::Frames & frames)
+{
+  uint64_t total = 0;
+  for (const auto & frame : frames) {
+    uint64_t payload_length = frame.msg.size();
+    for (const auto & buffer : frame.data) {
+      payload_length += buffer.size();
+    }
 
-    log_it->second = move(new_fd);
+    total += WSFrame::Header(true, WSFrame::OpCode::Binary, payload_length)
+             .header_length() + payload_length;
   }
+
+  return total;
 }
 
 void serve_video_to_client(WebSocketServer & server,
-                           WebSocketClient & client)
+                           WebSocketClient & client,
+                           const size_t vformat_idx)
 {
+  const uint64_t start_us = timestamp_us();
+
   const auto channel = client.channel();
   uint64_t next_vts = client.next_vts().value();
+  const TCPInfo tcpi = client.tcp_info().value();
+
+  if (traced_sessions.count(client.connection_id())) {
+    session_trace->video_chunk(client.connection_id(),
+                               client.init_id().value(), tcpi);
+  }
 
-  /* save TCP info before client.select_video_format() */
-  TCPInfo tcpi = server.get_tcp_info(client.connection_id());
-  client.set_tcp_info(tcpi);
+  if (not replay_tcp_infos.empty()) {
+    replay_next_chunks[client.init_id().value()]++;
+  }
 
-  /* select a video format using ABR algorithm */
-  const VideoFormat & next_vformat = client.select_video_format();
-  double ssim = channel->vssim(next_vts).at(next_vformat);
+  const VideoFormat & next_vformat = channel->vformats().at(vformat_idx);
+  const string & next_vformat_str = channel->vformat_string(vformat_idx);
+  double ssim = channel->vssim(vformat_idx, next_vts);
 
-  /* check if a new init segment is needed */
-  optional<mmap_t> init_mmap;
-  if (not client.curr_vformat() or
-      next_vformat != *client.curr_vformat()) {
-    init_mmap = channel->vinit(next_vformat);
+  /* check if a new init segment is needed: formats that share an init
+   * segment (e.g., that differ only in CRF) are switched between without one */
+  const size_t vinit_key = channel->vinit_key(vformat_idx);
+  const bool send_vinit = not client.curr_vinit_key()
+                          or vinit_key != *client.curr_vinit_key();
+
+  /* borrowed until the segment is constructed (see Channel::vdata()) */
+  const mmap_t & data_mmap = channel->vdata(vformat_idx, next_vts);
+  const size_t data_size = get<1>(data_mmap);
+
+  /* clients sent the same segment share its frames */
+  FrameCache & frame_cache = vframe_caches[channel->name()];
+  if (channel->live() and channel->vclean_frontier()) {
+    frame_cache.evict_until(*channel->vclean_frontier());
+  }
+
+  size_t frame_bytes = MAX_WS_FRAME_B;
+  if (dynamic_record_sizing) {
+    const RecordSizeTier & tier = record_size_tier(tcpi);
+    server.set_record_size(client.connection_id(), tier.record_bytes);
+    frame_bytes = tier.frame_bytes;
+  }
+
+  const FrameCache::Key key {next_vts, vformat_idx, send_vinit,
+                             client.msg_encoding(), frame_bytes};
+  auto frames = frame_cache.get(key);
+
+  if (not frames) {
+    /* construct the next segment and divide it into WebSocket frames */
+    optional<mmap_t> init_mmap;
+    if (send_vinit) {
+      init_mmap = channel->vinit(vformat_idx);
+    }
+
+    VideoSegment next_vsegment {next_vformat, data_mmap, init_mmap};
+    FrameCache::Frames new_frames;
+
+    while (not next_vsegment.done()) {
+      ServerVideoMsg video_msg(client.init_id().value(),
+                               channel->name(),
+                               next_vformat_str,
+                               next_vts,
+                               next_vsegment.offset(),
+                               next_vsegment.length(),
+                               ssim,
+                               client.msg_encoding());
+
+      FrameCache::Frame frame;
+      frame.msg = video_msg.to_string_with_init_id_slot(frame.init_id_slot);
+      next_vsegment.read(frame.data, frame_bytes - frame.msg.size());
+      new_frames.emplace_back(move(frame));
+    }
+
+    frames = frame_cache.put(key, move(new_frames));
   }
 
-  /* construct the next segment to send */
-  const auto data_mmap = channel->vdata(next_vformat, next_vts);
-  VideoSegment next_vsegment {next_vformat, data_mmap, init_mmap};
+  /* map what the client is likely to be sent next on a static channel (or
+   * read it ahead from the archive of a live one) */
+  channel->prefetch_video(next_vts + channel->vduration(), vformat_idx);
 
-  /* divide the next segment into WebSocket frames and send */
-  while (not next_vsegment.done()) {
-    ServerVideoMsg video_msg(client.init_id().value(),
-                             channel->name(),
-                             next_vformat.to_string(),
-                             next_vts,
-                             next_vsegment.offset(),
-                             next_vsegment.length(),
-                             ssim);
-    string frame_payload = video_msg.to_string();
-    next_vsegment.read(frame_payload, MAX_WS_FRAME_B - frame_payload.size());
+  const bool traced = send_trace_sample > 0 and
+                      num_vchunks_served++ % send_trace_sample == 0;
+  const uint64_t backlog_bytes =
+    traced ? server.buffer_bytes(client.connection_id()) : 0;
 
-    WSFrame frame {true, WSFrame::OpCode::Binary, move(frame_payload)};
-    server.queue_frame(client.connection_id(), frame);
+  if (pacing_gain > 0) {
+    optional<uint64_t> pacing_rate;
+    if (const auto target_rate = client.video_target_rate()) {
+      pacing_rate = static_cast<uint64_t>(pacing_gain * *target_rate);
+      Metrics::record("video_pacing_kbps", *pacing_rate * 8 / 1000);
+    }
+
+    server.set_pacing_rate(client.connection_id(), pacing_rate);
+  }
+
+  if (send_quantum_bytes > 0) {
+    const double max_buf = WebSocketClient::MAX_BUFFER_S;
+    const double deficit = max_buf - clamp(client.video_playback_buf(),
+                                           0.0, max_buf);
+    server.set_send_weight(client.connection_id(),
+                           max(deficit / max_buf, MIN_SEND_WEIGHT));
+  }
+
+  stream_frames(server, client, frames);
+
+  if (traced) {
+    auto & trace = client.add_send_trace();
+    trace.vts = next_vts;
+    trace.ready_us = channel->vready_us(next_vts);
+    trace.queued_us = timestamp_us();
+    trace.backlog_bytes = backlog_bytes;
+    trace.end_offset =
+      server.write_stats(client.connection_id()).bytes_written
+      + server.buffer_bytes(client.connection_id())
+      + frames_wire_bytes(*frames);
+
+    send_traced_clients.emplace(client.connection_id());
   }
 
   /* finish sending */
   client.set_next_vts(next_vts + channel->vduration());
   client.set_curr_vformat(next_vformat);
+  client.set_curr_vinit_key(vinit_key);
   client.set_last_video_send_ts(timestamp_ms());
+  update_stream_stats(client);
+
+  Metrics::record("video_send_us", timestamp_us() - start_us);
 
-  cerr << client.signature() << ": channel " << channel->name()
-       << ", video " << next_vts << " " << next_vformat << " " << ssim << endl;
+  DIAG(Info) << client.signature() << ": channel " << channel->name()
+             << ", video " << next_vts << " " << next_vformat_str << " "
+             << ssim;
 
   if (enable_logging) {
     string log_line = to_string(timestamp_ms()) + "," + channel->name() + ","
@@ -164,8 +799,8 @@ void serve_video_to_client(WebSocketServer & server,
       + to_string(client.first_init_id().value()) + ","
       + to_string(client.init_id().value()) + ","
       + to_string(next_vts) + ","
-      + next_vformat.to_string() + ","
-      + to_string(get<1>(data_mmap)) + "," + to_string(ssim)
+      + next_vformat_str + ","
+      + to_string(data_size) + "," + to_string(ssim)
       + "," + to_string(tcpi.cwnd) + "," + to_string(tcpi.in_flight) + ","
       + to_string(tcpi.min_rtt) + "," + to_string(tcpi.rtt) + ","
       + to_string(tcpi.delivery_rate) + ","
@@ -182,40 +817,70 @@ void serve_audio_to_client(WebSocketServer & server,
   uint64_t next_ats = client.next_ats().value();
 
   /* select an audio format using ABR algorithm */
-  const AudioFormat & next_aformat = client.select_audio_format();
+  const size_t aformat_idx = client.select_audio_format();
+  const AudioFormat & next_aformat = channel->aformats().at(aformat_idx);
+  const string & next_aformat_str = channel->aformat_string(aformat_idx);
 
   /* check if a new init segment is needed */
-  optional<mmap_t> init_mmap;
-  if (not client.curr_aformat() or
-      next_aformat != *client.curr_aformat()) {
-    init_mmap = channel->ainit(next_aformat);
+  const size_t ainit_key = channel->ainit_key(aformat_idx);
+  const bool send_ainit = not client.curr_ainit_key()
+                          or ainit_key != *client.curr_ainit_key();
+
+  /* borrowed until the segment is constructed (see Channel::adata()) */
+  const mmap_t & data_mmap = channel->adata(aformat_idx, next_ats);
+
+  /* clients sent the same segment share its frames */
+  FrameCache & frame_cache = aframe_caches[channel->name()];
+  if (channel->live() and channel->aclean_frontier()) {
+    frame_cache.evict_until(*channel->aclean_frontier());
   }
 
-  /* construct the next segment to send */
-  const auto data_mmap = channel->adata(next_aformat, next_ats);
-  AudioSegment next_asegment {next_aformat, data_mmap, init_mmap};
+  /* an audio chunk fits in a frame of any size */
+  const FrameCache::Key key {next_ats, aformat_idx, send_ainit,
+                             client.msg_encoding(), MAX_WS_FRAME_B};
+  auto frames = frame_cache.get(key);
 
-  /* divide the next segment into WebSocket frames and send */
-  while (not next_asegment.done()) {
-    ServerAudioMsg audio_msg(client.init_id().value(),
-                             channel->name(),
-                             next_aformat.to_string(),
-                             next_ats,
-                             next_asegment.offset(),
-                             next_asegment.length());
-    string frame_payload = audio_msg.to_string();
-    next_asegment.read(frame_payload, MAX_WS_FRAME_B - frame_payload.size());
+  if (not frames) {
+    /* construct the next segment and divide it into WebSocket frames */
+    optional<mmap_t> init_mmap;
+    if (send_ainit) {
+      init_mmap = channel->ainit(aformat_idx);
+    }
 
-    WSFrame frame {true, WSFrame::OpCode::Binary, move(frame_payload)};
-    server.queue_frame(client.connection_id(), frame);
+    AudioSegment next_asegment {next_aformat, data_mmap, init_mmap};
+    FrameCache::Frames new_frames;
+
+    while (not next_asegment.done()) {
+      ServerAudioMsg audio_msg(client.init_id().value(),
+                               channel->name(),
+                               next_aformat_str,
+                               next_ats,
+                               next_asegment.offset(),
+                               next_asegment.length(),
+                               client.msg_encoding());
+
+      FrameCache::Frame frame;
+      frame.msg = audio_msg.to_string_with_init_id_slot(frame.init_id_slot);
+      next_asegment.read(frame.data, MAX_WS_FRAME_B - frame.msg.size());
+      new_frames.emplace_back(move(frame));
+    }
+
+    frames = frame_cache.put(key, move(new_frames));
   }
 
+  channel->prefetch_audio(next_ats + channel->aduration(), aformat_idx);
+
+  /* audio is small and stalls playback once it runs out, so its frames
+   * are pulled ahead of the rest of a video chunk in flight */
+  stream_frames(server, client, frames, true);
+
   /* finish sending */
   client.set_next_ats(next_ats + channel->aduration());
   client.set_curr_aformat(next_aformat);
+  client.set_curr_ainit_key(ainit_key);
 
-  cerr << client.signature() << ": channel " << channel->name()
-       << ", audio " << next_ats << " " << next_aformat << endl;
+  DIAG(Info) << client.signature() << ": channel " << channel->name()
+             << ", audio " << next_ats << " " << next_aformat_str;
 }
 
 void send_server_init(WebSocketServer & server, WebSocketClient & client,
@@ -231,22 +896,140 @@ void send_server_init(WebSocketServer & server, WebSocketClient & client,
                      can_resume);
   WSFrame frame {true, WSFrame::OpCode::Binary, init.to_string()};
 
+  if (traced_sessions.count(client.connection_id())) {
+    session_trace->start(client.connection_id(), client.init_id().value(),
+                         client.next_vts().value(), client.next_ats().value());
+  }
+
   /* drop previously queued frames before sending server-init */
   server.clear_buffer(client.connection_id());
 
   server.queue_frame(client.connection_id(), frame);
+  update_stream_stats(client);
+}
+
+/* the TCP info to choose the next video chunk of client on (see
+ * replay_tcp_info); cached: the last dump of the connections will do */
+TCPInfo video_tcp_info(const WebSocketServer & server,
+                       const WebSocketClient & client,
+                       const bool cached = false)
+{
+  if (not replay_tcp_infos.empty()) {
+    const unsigned int init_id = client.init_id().value();
+    const auto it = replay_tcp_infos.find(init_id);
+
+    /* past the recorded chunks, the stream keeps the last TCP info */
+    if (it != replay_tcp_infos.end()) {
+      const size_t chunk = replay_next_chunks[init_id];
+      return it->second.at(min(chunk, it->second.size() - 1));
+    }
+  }
+
+  if (cached) {
+    if (const auto tcpi = server.cached_tcp_info(client.connection_id())) {
+      return *tcpi;
+    }
+  }
+
+  return server.get_tcp_info(client.connection_id());
+}
+
+/* queue the first audio chunk and the smallest format of the first video
+ * chunk right behind the server-init, to be written along with it, rather
+ * than once the ABR algorithm has decided on a format it knows nothing to
+ * base on yet; it takes over from the second video chunk, with the first as
+ * its first measurement. The clients starting at the live edge are all sent
+ * the same segments, which the frame caches of the channel keep. */
+void serve_startup_chunks(WebSocketServer & server, WebSocketClient & client)
+{
+  const auto channel = client.channel();
+  const uint64_t next_vts = client.next_vts().value();
+
+  if (not channel->vready_to_serve(next_vts) or
+      not channel->aready_to_serve(client.next_ats().value())) {
+    return;
+  }
+
+  serve_audio_to_client(server, client);
+
+  size_t smallest = 0;
+  for (size_t i = 1; i < channel->vformats().size(); i++) {
+    if (channel->vsize(i, next_vts) < channel->vsize(smallest, next_vts)) {
+      smallest = i;
+    }
+  }
+
+  client.set_tcp_info(video_tcp_info(server, client));
+  serve_video_to_client(server, client, smallest);
 }
 
 void send_server_error(WebSocketServer & server, WebSocketClient & client,
-                       const ServerErrorMsg::Type error_type)
+                       const ServerErrorMsg::Type error_type,
+                       const uint16_t redirect_port = 0)
 {
-  ServerErrorMsg err_msg(client.init_id() ? *client.init_id() : 0, error_type);
+  ServerErrorMsg err_msg(client.init_id() ? *client.init_id() : 0, error_type,
+                         redirect_port);
   WSFrame frame {true, WSFrame::OpCode::Binary, err_msg.to_string()};
 
   server.queue_frame(client.connection_id(), frame);
 
   /* reset the client and wait for client-init */
   client.reset_channel();
+  update_stream_stats(client);
+}
+
+/* whether the client can take the next video segment now */
+bool video_due(const WebSocketClient & client)
+{
+  if (not client.is_channel_initialized()) {
+    return false;
+  }
+
+  const auto channel = client.channel();
+
+  return channel->ready_to_serve() and
+         client.video_playback_buf_at(timestamp_ms())
+           <= WebSocketClient::MAX_BUFFER_S and
+         client.video_in_flight().value() == 0 and
+         channel->vready_to_serve(client.next_vts().value());
+}
+
+/* make the client runnable once its playback buffers are expected to have
+ * drained enough to take the next chunk, rather than waiting for it to
+ * report them again */
+void wait_for_buffer(WebSocketServer & server, const WebSocketClient & client)
+{
+  const uint64_t connection_id = client.connection_id();
+
+  optional<uint64_t> wake_ts;
+  if (client.video_in_flight().value() == 0) {
+    wake_ts = client.video_buf_drain_ts();
+  }
+
+  if (client.audio_in_flight().value() == 0) {
+    const auto audio_wake_ts = client.audio_buf_drain_ts();
+    if (audio_wake_ts and (not wake_ts or *audio_wake_ts < *wake_ts)) {
+      wake_ts = audio_wake_ts;
+    }
+  }
+
+  const auto it = buffer_wait_clients.find(connection_id);
+  if (it != buffer_wait_clients.end()) {
+    server.poller().cancel_timer(it->second);
+    buffer_wait_clients.erase(it);
+  }
+
+  if (not wake_ts) {
+    return;
+  }
+
+  buffer_wait_clients.emplace(connection_id,
+    server.poller().add_timer(*wake_ts, [connection_id]() {
+      if (buffer_wait_clients.erase(connection_id)) {
+        runnable_clients.emplace(connection_id);
+      }
+    })
+  );
 }
 
 void serve_client(WebSocketServer & server, WebSocketClient & client)
@@ -260,8 +1043,8 @@ void serve_client(WebSocketServer & server, WebSocketClient & client)
   /* notify the client that the requested channel is not available */
   if (not channel->ready_to_serve()) {
     send_server_error(server, client, ServerErrorMsg::Type::Unavailable);
-    cerr << client.signature() << ": requested channel "
-         << channel->name() << " is not available" << endl;
+    DIAG(Warning) << client.signature() << ": requested channel "
+                  << channel->name() << " is not available";
     return;
   }
 
@@ -269,13 +1052,16 @@ void serve_client(WebSocketServer & server, WebSocketClient & client)
   uint64_t next_ats = client.next_ats().value();
 
   if (channel->live()) {
-    /* reinit client if clean frontiers of live streaming have caught up */
-    if ((channel->vclean_frontier() and
-         next_vts <= *channel->vclean_frontier()) or
-        (channel->aclean_frontier() and
-         next_ats <= *channel->aclean_frontier())) {
+    /* reinit client if clean frontiers of live streaming have caught up,
+     * unless the chunks it is due have been archived (see dvr_dir) */
+    if (((channel->vclean_frontier() and
+          next_vts <= *channel->vclean_frontier()) or
+         (channel->aclean_frontier() and
+          next_ats <= *channel->aclean_frontier())) and
+        not (channel->vready_to_serve(next_vts) and
+             channel->aready_to_serve(next_ats))) {
       send_server_error(server, client, ServerErrorMsg::Type::Reinit);
-      cerr << client.signature() << ": reinitialize laggy client" << endl;
+      DIAG(Info) << client.signature() << ": reinitialize laggy client";
       return;
     }
   } else {
@@ -284,43 +1070,358 @@ void serve_client(WebSocketServer & server, WebSocketClient & client)
       if (next_vts > channel->vready_frontier() or
           next_ats > channel->aready_frontier()) {
         send_server_error(server, client, ServerErrorMsg::Type::Reinit);
-        cerr << client.signature() << ": reinitialize client intentionally "
-             << "as 'repeat' is set to true" << endl;
+        DIAG(Info) << client.signature()
+                   << ": reinitialize client intentionally "
+                   << "as 'repeat' is set to true";
         return;
       }
     }
   }
 
-  if (client.audio_playback_buf() <= WebSocketClient::MAX_BUFFER_S and
+  /* queue nothing more until the buffers drain (or the client is evicted
+   * by evict_stalled_clients()) */
+  if (over_memory_cap(server, client)) {
+    Metrics::record("memory_backpressure", 1);
+    return;
+  }
+
+  const uint64_t now = timestamp_ms();
+  if (client.audio_playback_buf_at(now) <= WebSocketClient::MAX_BUFFER_S and
       client.audio_in_flight().value() == 0 and channel->aready_to_serve(next_ats)
       and next_ats <= next_vts) {
     serve_audio_to_client(server, client);
   }
 
-  if (client.video_playback_buf() <= WebSocketClient::MAX_BUFFER_S and
-      client.video_in_flight().value() == 0 and channel->vready_to_serve(next_vts)) {
-    serve_video_to_client(server, client);
+  if (video_due(client)) {
+    video_due_clients.emplace(client.connection_id());
+  }
+
+  wait_for_buffer(server, client);
+
+  if (not channel->live()) {
+    return;
+  }
+
+  /* wait for the chunks that are not ready yet (see serve_edge_clients()) */
+  next_ats = client.next_ats().value();
+  if (client.audio_playback_buf_at(now) <= WebSocketClient::MAX_BUFFER_S and
+      client.audio_in_flight().value() == 0 and
+      not channel->aready_to_serve(next_ats)) {
+    aedge_clients[channel->name()][next_ats].emplace(client.connection_id());
+  }
+
+  if (client.video_playback_buf_at(now) <= WebSocketClient::MAX_BUFFER_S and
+      client.video_in_flight().value() == 0 and
+      not channel->vready_to_serve(next_vts)) {
+    vedge_clients[channel->name()][next_vts].emplace(client.connection_id());
   }
 }
 
-void log_active_streams(const uint64_t this_minute)
+/* serve the clients of channel_name waiting for a chunk at or before the ready
+ * frontier that has just advanced */
+void serve_edge_clients(WebSocketServer & server, const string & channel_name,
+                        const bool video, const uint64_t frontier)
 {
-  assert(enable_logging);
+  auto & waiting = (video ? vedge_clients : aedge_clients)[channel_name];
+
+  set<uint64_t> ready_clients;
+  while (not waiting.empty() and waiting.begin()->first <= frontier) {
+    ready_clients.merge(waiting.begin()->second);
+    waiting.erase(waiting.begin());
+  }
+
+  for (const uint64_t connection_id : ready_clients) {
+    auto client_it = clients.find(connection_id);
+    if (client_it == clients.end()) {
+      continue;
+    }
+
+    try {
+      /* video is sent after this iteration of the event loop */
+      serve_client(server, client_it->second);
+    } catch (const exception & e) {
+      DIAG(Warning) << client_signature(connection_id)
+                    << ": warning in serving edge client: " << e.what();
+      server.close_connection(connection_id);
+    }
+  }
+}
+
+/* serve the clients made runnable in this iteration of the event loop */
+void serve_runnable_clients(WebSocketServer & server)
+{
+  for (const uint64_t connection_id : runnable_clients) {
+    /* the client might have been closed since */
+    auto client_it = clients.find(connection_id);
+    if (client_it == clients.end()) {
+      continue;
+    }
+
+    try {
+      serve_client(server, client_it->second);
+    } catch (const exception & e) {
+      DIAG(Warning) << client_signature(connection_id)
+                    << ": warning in serving client: " << e.what();
+      server.close_connection(connection_id);
+    }
+  }
+
+  runnable_clients.clear();
+}
+
+/* make the ABR decisions of all the clients due for video back to back, so
+ * that the ABR algorithm and its DP tables stay hot in cache, and then
+ * construct and send the segments */
+/* time the traced chunks whose last bytes have been written to the socket
+ * (i.e., to the kernel, after TLS) */
+void check_send_traces(const WebSocketServer & server)
+{
+  const uint64_t now = timestamp_us();
+
+  for (auto it = send_traced_clients.begin();
+       it != send_traced_clients.end();) {
+    auto client_it = clients.find(*it);
+    if (client_it == clients.end()) {
+      it = send_traced_clients.erase(it);
+      continue;
+    }
+
+    const uint64_t bytes_written = server.write_stats(*it).bytes_written;
+    bool unwritten = false;
+
+    for (auto & trace : client_it->second.send_traces()) {
+      if (not trace or trace->written_us) {
+        continue;
+      }
+
+      if (bytes_written >= trace->end_offset) {
+        trace->written_us = now;
+      } else {
+        unwritten = true;
+      }
+    }
+
+    it = unwritten ? next(it) : send_traced_clients.erase(it);
+  }
+}
+
+/* export the trace of the chunk acked in msg if it was traced; a stage that
+ * was not timed (ready_us off a live channel) is logged as -1 */
+void finish_send_trace(WebSocketClient & client, const ClientVidAckMsg & msg)
+{
+  for (auto & trace : client.send_traces()) {
+    if (not trace or trace->vts != msg.timestamp) {
+      continue;
+    }
+
+    if (trace->written_us) {
+      const uint64_t acked_us = timestamp_us();
+
+      const int64_t ready_wait_us = trace->ready_us ?
+        static_cast<int64_t>(trace->queued_us - *trace->ready_us) : -1;
+      const uint64_t queue_us = *trace->written_us - trace->queued_us;
+      const uint64_t network_us = acked_us - *trace->written_us;
+
+      if (ready_wait_us >= 0) {
+        Metrics::record("send_ready_wait_us", ready_wait_us);
+      }
+      Metrics::record("send_queue_us", queue_us);
+      Metrics::record("send_network_us", network_us);
+
+      if (enable_logging) {
+        string log_line = to_string(acked_us / 1000) + "," + msg.channel + ","
+          + server_id + "," + expt_id + "," + client.username() + ","
+          + to_string(msg.init_id) + "," + to_string(msg.timestamp) + ","
+          + to_string(msg.total_byte_length) + ","
+          + to_string(trace->backlog_bytes) + ","
+          + to_string(ready_wait_us) + "," + to_string(queue_us) + ","
+          + to_string(network_us);
+        append_to_log("send_trace", log_line);
+      }
+    }
+
+    trace.reset();
+  }
+}
+
+/* make the next ABR decision of one of video_speculation_clients ahead of
+ * time; return whether any of them is left */
+bool speculate_video_format(WebSocketServer & server)
+{
+  if (video_speculation_clients.empty()) {
+    return false;
+  }
+
+  const uint64_t connection_id = *video_speculation_clients.begin();
+  video_speculation_clients.erase(video_speculation_clients.begin());
+
+  auto client_it = clients.find(connection_id);
+  if (client_it == clients.end() or
+      not client_it->second.is_channel_initialized()) {
+    return not video_speculation_clients.empty();
+  }
+
+  auto & client = client_it->second;
+  const uint64_t next_vts = client.next_vts().value();
 
+  /* the decision is left to when it is due if the chunk is not ready */
+  if (client.channel()->vready_to_serve(next_vts)) {
+    try {
+      /* a speculative decision is checked against the current TCP info
+       * when it is due, so it can be made on the last dump */
+      client.set_tcp_info(video_tcp_info(server, client, true));
+      client.prepare_video_format();
+
+      client.speculative_vformat() = WebSocketClient::SpeculativeDecision {
+        next_vts, client.select_video_format(), client.video_playback_buf(),
+        client.tcp_info().value().delivery_rate
+      };
+    } catch (const exception & e) {
+      DIAG(Warning) << client_signature(connection_id)
+                    << ": warning in speculating video format: " << e.what();
+    }
+  }
+
+  return not video_speculation_clients.empty();
+}
+
+/* take the speculative decision of client if it is for the chunk due and
+ * was made in about the current state */
+optional<size_t> take_speculative_vformat(WebSocketClient & client)
+{
+  const auto decision = client.speculative_vformat();
+  client.speculative_vformat().reset();
+
+  if (not decision or decision->vts != client.next_vts().value()) {
+    return nullopt;
+  }
+
+  const double rate = client.tcp_info().value().delivery_rate;
+  const bool holds =
+    fabs(client.video_playback_buf() - decision->playback_buf)
+      <= SPECULATION_MAX_BUF_DIFF_S and
+    fabs(rate - decision->delivery_rate)
+      <= SPECULATION_MAX_RATE_DIFF * decision->delivery_rate;
+
+  Metrics::record("abr_speculation_hit", holds);
+  if (not holds) {
+    return nullopt;
+  }
+
+  return decision->format_idx;
+}
+
+void serve_video_in_batch(WebSocketServer & server)
+{
+  vector<WebSocketClient *> due_clients;
+  vector<pair<WebSocketClient *, size_t>> decisions;
+
+  for (const uint64_t connection_id : video_due_clients) {
+    /* the client might have been closed or reset since it became due */
+    auto client_it = clients.find(connection_id);
+    if (client_it == clients.end() or not video_due(client_it->second)) {
+      continue;
+    }
+
+    auto & client = client_it->second;
+
+    try {
+      /* save TCP info before client.select_video_format() */
+      client.set_tcp_info(video_tcp_info(server, client));
+
+      /* the decision might have been made while the last chunk was sent */
+      if (const auto vformat_idx = take_speculative_vformat(client)) {
+        decisions.emplace_back(&client, *vformat_idx);
+        continue;
+      }
+
+      /* let the ABR algorithm queue work to be batched (e.g., inference) */
+      client.prepare_video_format();
+
+      /* wait for a decision made in another process, until its deadline */
+      if (const auto deadline = client.video_format_pending()) {
+        const auto timer = server.poller().add_timer(*deadline,
+          [connection_id]() {
+            if (video_pending_clients.erase(connection_id)) {
+              video_due_clients.emplace(connection_id);
+            }
+          }
+        );
+
+        auto [it, inserted] = video_pending_clients.emplace(connection_id,
+                                                            timer);
+        if (not inserted) {
+          server.poller().cancel_timer(it->second);
+          it->second = timer;
+        }
+        continue;
+      }
+
+      due_clients.emplace_back(&client);
+    } catch (const exception & e) {
+      DIAG(Warning) << client_signature(connection_id)
+                    << ": warning in preparing video format: " << e.what();
+      server.close_connection(connection_id);
+    }
+  }
+
+  video_due_clients.clear();
+
+  for (WebSocketClient * client : due_clients) {
+    try {
+      /* select a video format using ABR algorithm */
+      decisions.emplace_back(client, client->select_video_format());
+    } catch (const exception & e) {
+      DIAG(Warning) << client_signature(client->connection_id())
+                    << ": warning in selecting video format: " << e.what();
+      server.close_connection(client->connection_id());
+    }
+  }
+
+  for (const auto & [client, vformat_idx] : decisions) {
+    try {
+      serve_video_to_client(server, *client, vformat_idx);
+
+      if (speculate_video) {
+        video_speculation_clients.emplace(client->connection_id());
+      }
+    } catch (const exception & e) {
+      DIAG(Warning) << client_signature(client->connection_id())
+                    << ": warning in serving video: " << e.what();
+      server.close_connection(client->connection_id());
+    }
+  }
+}
+
+/* publish the active stream counts of this thread */
+void update_active_streams()
+{
   /* channel name -> count */
   map<string, unsigned int> active_streams_count;
 
-  for (const auto & client_pair : clients) {
-    const auto channel = client_pair.second.channel();
+  for (const auto & [channel_name, count] : stream_stats.channel_viewers()) {
+    if (count > 0) {
+      active_streams_count.emplace(channel_name, count);
+    }
+  }
+
+  lock_guard<mutex> lock(active_streams_mutex);
+  active_streams_counts.at(thread_id) = move(active_streams_count);
+}
 
-    if (channel) {
-      string channel_name = channel->name();
+void log_active_streams(const uint64_t this_minute)
+{
+  assert(enable_logging);
 
-      auto map_it = active_streams_count.find(channel_name);
-      if (map_it == active_streams_count.end()) {
-        active_streams_count.emplace(channel_name, 1);
-      } else {
-        map_it->second += 1;
+  /* sum up the counts published by all threads */
+  map<string, unsigned int> active_streams_count;
+
+  {
+    lock_guard<mutex> lock(active_streams_mutex);
+
+    for (const auto & thread_count : active_streams_counts) {
+      for (const auto & [channel_name, count] : thread_count) {
+        active_streams_count[channel_name] += count;
       }
     }
   }
@@ -342,6 +1443,139 @@ void log_server_info(const uint64_t this_minute)
   append_to_log("server_info", log_line);
 }
 
+void log_tls_handshakes(const uint64_t this_minute)
+{
+  const uint64_t num_full = num_full_handshakes.exchange(0);
+  const uint64_t num_resumed = num_resumed_handshakes.exchange(0);
+  const uint64_t full_us = full_handshake_us.exchange(0);
+  const uint64_t resumed_us = resumed_handshake_us.exchange(0);
+
+  if (num_full + num_resumed == 0) {
+    return;
+  }
+
+  /* mean handshake durations in ms */
+  const double full_ms = num_full ? full_us / 1000.0 / num_full : 0;
+  const double resumed_ms = num_resumed ? resumed_us / 1000.0 / num_resumed : 0;
+
+  string log_line = to_string(this_minute) + "," + server_id + ","
+    + to_string(num_full) + "," + to_string(num_resumed) + ","
+    + double_to_string(full_ms, 3) + "," + double_to_string(resumed_ms, 3);
+  append_to_log("tls_handshakes", log_line);
+}
+
+void record_handshake(const WebSocketServer & server,
+                      const uint64_t connection_id)
+{
+  const auto info = server.handshake_info(connection_id);
+  if (not info) {
+    return;
+  }
+
+  if (info->resumed) {
+    num_resumed_handshakes++;
+    resumed_handshake_us += info->duration_us;
+  } else {
+    num_full_handshakes++;
+    full_handshake_us += info->duration_us;
+  }
+}
+
+/* the channel of name, activated if it is dormant; nullptr if none */
+shared_ptr<Channel> find_channel(const string & name)
+{
+  const auto it = channels.find(name);
+  if (it == channels.end()) {
+    return nullptr;
+  }
+
+  if (it->second->dormant()) {
+    it->second->activate();
+  }
+
+  if (channel_idle_s > 0) {
+    channel_watched_ms[name] = timestamp_ms();
+  }
+
+  return it->second;
+}
+
+/* make the channels that have not been watched for channel_idle_s dormant,
+ * along with their frames, which hold their chunks mapped */
+void make_idle_channels_dormant()
+{
+  const uint64_t now = timestamp_ms();
+
+  for (const auto & [connection_id, client] : clients) {
+    if (const auto & channel = client.channel()) {
+      channel_watched_ms[channel->name()] = now;
+    }
+  }
+
+  for (auto & [channel_name, channel] : channels) {
+    if (not channel->indexed() or channel->dormant()) {
+      continue;
+    }
+
+    const auto it = channel_watched_ms.find(channel_name);
+    if (it != channel_watched_ms.end() and
+        now - it->second < channel_idle_s * 1000ull) {
+      continue;
+    }
+
+    channel->make_dormant();
+    vframe_caches.erase(channel_name);
+    aframe_caches.erase(channel_name);
+    channel_watched_ms.erase(channel_name);
+  }
+}
+
+/* drop the unsent frames of the clients that are over a memory cap and have
+ * not written a byte for buffer_stall_s, and reinitialize them; publish the
+ * memory of the connections of this thread */
+void evict_stalled_clients(WebSocketServer & server)
+{
+  const uint64_t now = timestamp_ms();
+  const bool total_over_cap = max_total_buffer_bytes > 0 and
+                              total_memory_bytes() > max_total_buffer_bytes;
+
+  map<uint64_t, pair<uint64_t, uint64_t>> still_stalled;
+
+  for (auto & [connection_id, client] : clients) {
+    const uint64_t bytes = server.memory_bytes(connection_id);
+    if (bytes == 0 or not (total_over_cap or
+                           (max_client_buffer_bytes > 0 and
+                            bytes > max_client_buffer_bytes))) {
+      continue;
+    }
+
+    const uint64_t written = server.write_stats(connection_id).bytes_written;
+    uint64_t stalled_since = now;
+
+    const auto it = stalled_writes.find(connection_id);
+    if (it != stalled_writes.end() and it->second.first == written) {
+      stalled_since = it->second.second;
+    }
+
+    if (now - stalled_since < buffer_stall_s * 1000) {
+      still_stalled.emplace(connection_id, make_pair(written, stalled_since));
+      continue;
+    }
+
+    DIAG(Info) << client.signature() << ": dropping " << bytes
+               << " buffered bytes of stalled client";
+    Metrics::record("stalled_client_dropped_bytes", bytes);
+
+    server.clear_buffer(connection_id);
+    if (client.is_channel_initialized()) {
+      send_server_error(server, client, ServerErrorMsg::Type::Reinit);
+    }
+  }
+
+  stalled_writes = move(still_stalled);
+  thread_loads[thread_id].memory_bytes = server.total_memory_bytes();
+}
+
 void start_slow_timer(Timerfd & slow_timer, WebSocketServer & server)
 {
   bool enforce_moving_live_edge = false;
@@ -363,26 +1597,65 @@ void start_slow_timer(Timerfd & slow_timer, WebSocketServer & server)
         }
       }
 
-      set<uint64_t> connections_to_clean;
+      /* drop the pages of the chunks behind the slowest client of each
+       * channel (only if the channel prefaults its chunks) */
+      map<string, uint64_t> slowest_vts;
+      for (const auto & [connection_id, client] : clients) {
+        const auto channel = client.channel();
+        if (channel and channel->live() and client.next_vts()) {
+          auto [it, inserted] = slowest_vts.emplace(channel->name(),
+                                                    *client.next_vts());
+          if (not inserted) {
+            it->second = min(it->second, *client.next_vts());
+          }
+        }
+      }
 
-      for (auto & [connection_id, client] : clients) {
-        /* have not received messages from client for a while */
-        const auto elapsed = timestamp_ms() - client.last_msg_recv_ts();
+      for (const auto & [channel_name, vts] : slowest_vts) {
+        channels.at(channel_name)->release_chunks_before(vts);
+      }
 
-        if (elapsed > MAX_IDLE_MS) {
-          connections_to_clean.emplace(connection_id);
-          cerr << client.signature() << ": cleaned idle connection" << endl;
-          continue;
-        }
+      if (channel_idle_s > 0) {
+        make_idle_channels_dormant();
       }
 
-      /* connections can be safely cleaned now */
-      for (const uint64_t connection_id : connections_to_clean) {
-        clients.erase(connection_id);
-        server.clean_idle_connection(connection_id);
+      if (max_client_buffer_bytes > 0 or max_total_buffer_bytes > 0) {
+        evict_stalled_clients(server);
       }
 
       if (enable_logging) {
+        update_active_streams();
+      }
+
+      if (session_trace) {
+        session_trace->flush();
+      }
+
+      /* transport metrics of the connections, from the last dump */
+      if (tcp_info_interval_ms > 0) {
+        for (const auto & [connection_id, client] : clients) {
+          if (const auto tcpi = server.cached_tcp_info(connection_id)) {
+            Metrics::record("tcp_rtt_us", tcpi->rtt);
+            Metrics::record("tcp_cwnd", tcpi->cwnd);
+            Metrics::record("tcp_delivery_rate_kbps",
+                            tcpi->delivery_rate * 8 / 1000);
+          }
+        }
+      }
+
+      /* memory of the clients and their connections (their buffers and ABR
+       * algorithms aside) */
+      if (not clients.empty()) {
+        Metrics::record("arena_bytes_per_client",
+          (client_arena.bytes_in_use()
+           + server.connection_arena().bytes_in_use()) / clients.size());
+        Metrics::record("arena_mapped_kb",
+          (client_arena.bytes_mapped()
+           + server.connection_arena().bytes_mapped()) / 1024);
+      }
+
+      /* only thread 0 performs the per-minute logging for the server */
+      if (enable_logging and thread_id == 0) {
         /* perform some tasks once per minute */
         const auto curr_time_s = timestamp_s();
         const auto this_minute = (curr_time_s - curr_time_s % 60) * 1000;
@@ -396,13 +1669,31 @@ void start_slow_timer(Timerfd & slow_timer, WebSocketServer & server)
           /* write active_streams count to file */
           log_active_streams(this_minute);
 
+          /* full and resumed TLS handshakes */
+          log_tls_handshakes(this_minute);
+
           last_minute = this_minute;
         }
       }
 
       return ResultType::Continue;
     }
-  ));
+  ).named("slow_timer"));
+}
+
+void set_abr_ready_callback(WebSocketServer & server)
+{
+  /* decisions made in other processes are ready before their deadlines */
+  ABRAlgo::set_ready_callback(
+    [&server](const uint64_t connection_id) {
+      const auto it = video_pending_clients.find(connection_id);
+      if (it != video_pending_clients.end()) {
+        server.poller().cancel_timer(it->second);
+        video_pending_clients.erase(it);
+        video_due_clients.emplace(connection_id);
+      }
+    }
+  );
 }
 
 bool resume_connection(WebSocketServer & server,
@@ -426,12 +1717,70 @@ bool resume_connection(WebSocketServer & server,
 
   /* reinitialize the client */
   client.init_channel(channel, requested_vts, requested_ats);
+
+  /* pick up the ABR history of the stream, wherever it was served */
+  if (session_store) {
+    client.resume_acked_chunks(
+      session_store->lookup(client.session_key(), msg.init_id));
+  }
+
   send_server_init(server, client, true /* can resume */);
 
-  cerr << client.signature() << ": connection resumed" << endl;
+  DIAG(Info) << client.signature() << ": connection resumed with "
+             << client.acked_chunks().size() << " acked chunks";
   return true;
 }
 
+/* the port of a server that channel_name has affinity with to redirect the
+ * client to, or nullopt if it is this server (or none of them can take the
+ * client as far as load_table tells) */
+optional<uint16_t> channel_home_port(const WebSocketClient & client,
+                                     const string & channel_name)
+{
+  /* rendezvous hashing: the servers with the highest scores are the homes,
+   * which change for few channels as the group grows or shrinks */
+  vector<pair<size_t, unsigned int>> scores;
+  for (unsigned int i = 0; i < group_num_servers; i++) {
+    const unsigned int id = group_first_server + i;
+    scores.emplace_back(hash<string>{}(channel_name + "/" + to_string(id)), id);
+  }
+
+  const size_t num_homes = min<size_t>(channel_affinity, scores.size());
+  partial_sort(scores.begin(), scores.begin() + num_homes, scores.end(),
+               greater<>());
+
+  const uint16_t base_port = config["ws_base_port"].as<uint16_t>();
+  map<uint16_t, ServerLoad> peer_loads;
+  if (load_table) {
+    for (const auto & peer : load_table->peers(stoi(server_id))) {
+      peer_loads.emplace(peer.port, peer.load);
+    }
+  }
+
+  vector<uint16_t> home_ports;
+  for (size_t i = 0; i < num_homes; i++) {
+    const unsigned int id = scores[i].second;
+    if (to_string(id) == server_id) {
+      return nullopt;
+    }
+
+    /* without a load table, assume that the other servers can take it */
+    const uint16_t port = base_port + id;
+    const auto load_it = peer_loads.find(port);
+    if (not load_table or (load_it != peer_loads.end() and
+                           admission->has_headroom(load_it->second))) {
+      home_ports.emplace_back(port);
+    }
+  }
+
+  if (home_ports.empty()) {
+    return nullopt;
+  }
+
+  /* the same user goes to the same home */
+  return home_ports[hash<string>{}(client.username()) % home_ports.size()];
+}
+
 void handle_client_init(WebSocketServer & server, WebSocketClient & client,
                         const ClientInitMsg & msg)
 {
@@ -439,24 +1788,33 @@ void handle_client_init(WebSocketServer & server, WebSocketClient & client,
   client.set_init_id(msg.init_id);
 
   /* invalid channel request */
-  auto it = channels.find(msg.channel);
-  if (it == channels.end()) {
+  const auto channel = find_channel(msg.channel);
+  if (not channel) {
     send_server_error(server, client, ServerErrorMsg::Type::Unavailable);
-    cerr << client.signature() << ": requested channel "
-         << msg.channel << " is not found" << endl;
+    DIAG(Info) << client.signature() << ": requested channel "
+               << msg.channel << " is not found";
     return;
   }
 
-  const auto channel = it->second;
-
   /* reply that the channel is not ready */
   if (not channel->ready_to_serve()) {
     send_server_error(server, client, ServerErrorMsg::Type::Unavailable);
-    cerr << client.signature() << ": requested channel "
-         << msg.channel << " is not ready" << endl;
+    DIAG(Info) << client.signature() << ": requested channel "
+               << msg.channel << " is not ready";
     return;
   }
 
+  /* steer the client to a server that the channel has affinity with */
+  if (channel_affinity > 0) {
+    if (const auto port = channel_home_port(client, msg.channel)) {
+      DIAG(Info) << client.signature() << ": redirected to port " << *port
+                 << " for channel " << msg.channel;
+      send_server_error(server, client, ServerErrorMsg::Type::Redirect, *port);
+      server.close_connection(client.connection_id());
+      return;
+    }
+  }
+
   /* record client-init */
   if (enable_logging) {
     string log_line = to_string(timestamp_ms()) + "," + msg.channel
@@ -488,7 +1846,11 @@ void handle_client_init(WebSocketServer & server, WebSocketClient & client,
   client.init_channel(channel, init_vts, init_ats);
   send_server_init(server, client, false /* initialize rather than resume */);
 
-  cerr << client.signature() << ": connection initialized" << endl;
+  if (fast_startup) {
+    serve_startup_chunks(server, client);
+  }
+
+  DIAG(Info) << client.signature() << ": connection initialized";
 }
 
 void handle_client_info(WebSocketClient & client, const ClientInfoMsg & msg)
@@ -498,13 +1860,12 @@ void handle_client_info(WebSocketClient & client, const ClientInfoMsg & msg)
   }
 
   if (msg.init_id != client.init_id().value()) {
-    cerr << client.signature() << ": warning: ignored messages with "
-         << "invalid init_id (but should not have received)" << endl;
+    DIAG(Warning) << client.signature() << ": warning: ignored messages with "
+                  << "invalid init_id (but should not have received)";
     return;
   }
 
-  client.set_video_playback_buf(msg.video_buffer);
-  client.set_audio_playback_buf(msg.audio_buffer);
+  client.set_playback_bufs(msg.video_buffer, msg.audio_buffer, timestamp_ms());
   client.set_cum_rebuffer(msg.cum_rebuffer);
 
   /* msg.cum_rebuffer is startup delay when event is Startup */
@@ -530,6 +1891,9 @@ void handle_client_info(WebSocketClient & client, const ClientInfoMsg & msg)
     }
   }
 
+  Metrics::record("video_buffer_ms",
+                  static_cast<uint64_t>(max(msg.video_buffer, 0.0) * 1000));
+
   /* execute the code below only if logging is enabled */
   if (enable_logging) {
     const auto channel_name = client.channel()->name();
@@ -555,13 +1919,12 @@ void handle_client_video_ack(WebSocketClient & client,
   auto channel = client.channel();
 
   if (msg.init_id != client.init_id().value()) {
-    cerr << client.signature() << ": warning: ignored messages with "
-         << "invalid init_id (but should not have received)" << endl;
+    DIAG(Warning) << client.signature() << ": warning: ignored messages with "
+                  << "invalid init_id (but should not have received)";
     return;
   }
 
-  client.set_video_playback_buf(msg.video_buffer);
-  client.set_audio_playback_buf(msg.audio_buffer);
+  client.set_playback_bufs(msg.video_buffer, msg.audio_buffer, timestamp_ms());
   client.set_cum_rebuffer(msg.cum_rebuffer);
 
   /* only interested in the event when the last segment is acked */
@@ -572,116 +1935,546 @@ void handle_client_video_ack(WebSocketClient & client,
   /* allow sending another chunk */
   client.set_client_next_vts(msg.timestamp + channel->vduration());
 
+  finish_send_trace(client, msg);
+
   /* record transmission time */
   if (client.last_video_send_ts()) {
     uint64_t trans_time = timestamp_ms() - *client.last_video_send_ts();
+    Metrics::record("ack_latency_ms", trans_time);
+
+    /* look up media chunk size (excluding the size of init chunk size) */
+    auto media_chunk_size = channel->vsize(
+      channel->vformat_index(msg.video_format), msg.timestamp);
+
+    /* notify the ABR algorithm that a video chunk is acked */
+    client.video_chunk_acked(msg.video_format, msg.ssim,
+                             media_chunk_size, trans_time);
+
+    if (session_store) {
+      session_store->record(client.session_key(), client.init_id().value(),
+                            client.acked_chunks().back());
+    }
+    client.set_last_video_send_ts(nullopt);
+    client.set_tcp_info(nullopt);
+  } else {
+    DIAG(Warning) << client.signature()
+                  << ": error: server didn't send video but received VideoAck";
+    return;
+  }
+
+  /* record client's received video */
+  if (enable_logging) {
+    string log_line = to_string(timestamp_ms()) + "," + msg.channel + ","
+      + server_id + "," + expt_id + "," + client.username() + ","
+      + to_string(client.first_init_id().value()) + ","
+      + to_string(msg.init_id) + ","
+      + to_string(msg.timestamp) + ","
+      + to_string(msg.ssim) + "," + double_to_string(msg.video_buffer, 3) + ","
+      + double_to_string(msg.cum_rebuffer, 3);
+    append_to_log("video_acked", log_line);
+  }
+}
+
+void handle_client_audio_ack(WebSocketClient & client,
+                             const ClientAudAckMsg & msg)
+{
+  if (not client.is_channel_initialized()) {
+    return;
+  }
+
+  if (msg.init_id != client.init_id().value()) {
+    DIAG(Warning) << client.signature() << ": warning: ignored messages with "
+                  << "invalid init_id (but should not have received)";
+    return;
+  }
+
+  client.set_playback_bufs(msg.video_buffer, msg.audio_buffer, timestamp_ms());
+  client.set_cum_rebuffer(msg.cum_rebuffer);
+
+  /* only interested in the event when the last segment is acked */
+  if (msg.byte_offset + msg.byte_length != msg.total_byte_length) {
+    return;
+  }
+
+  /* allow sending another chunk */
+  client.set_client_next_ats(msg.timestamp + client.channel()->aduration());
+}
+
+void create_channels(Inotify & inotify)
+{
+  fs::path media_dir = config["media_dir"].as<string>();
+
+  /* live channels are indexed by media_indexer if media_index_dir is set */
+  optional<fs::path> media_index_dir;
+  if (config["media_index_dir"]) {
+    media_index_dir = config["media_index_dir"].as<string>();
+  }
+
+  optional<fs::path> snapshot_dir;
+  if (config["channel_snapshot_dir"]) {
+    snapshot_dir = config["channel_snapshot_dir"].as<string>();
+  }
+
+  /* a static channel maps and reads all of its files on construction, so
+   * the static channels are constructed in parallel; a live channel adds
+   * watches to inotify, which is not thread-safe, and is constructed here */
+  struct PendingChannel {
+    string name {};
+    YAML::Node config {};  /* a copy, as nodes are not safe to share */
+    optional<fs::path> index_path {};
+    optional<fs::path> snapshot_path {};
+    shared_ptr<Channel> channel {};
+  };
+
+  vector<PendingChannel> pending;
+  for (const auto & channel_name : load_channels(config)) {
+    PendingChannel & p = pending.emplace_back();
+    p.name = channel_name;
+    p.config = YAML::Clone(config["channel_configs"][channel_name]);
+
+    if (media_index_dir) {
+      p.index_path = *media_index_dir / (channel_name + ".index");
+    }
+
+    if (snapshot_dir) {
+      p.snapshot_path = *snapshot_dir / (channel_name + ".snapshot");
+    }
+  }
+
+  auto construct = [&media_dir, &inotify](PendingChannel & p) {
+    /* exceptions might be thrown from the lambda callbacks in the channel */
+    try {
+      p.channel = make_shared<Channel>(p.name, media_dir, p.config, inotify,
+                                       p.index_path, p.snapshot_path,
+                                       channel_idle_s > 0);
+    } catch (const exception & e) {
+      DIAG(Error) << "Error: exceptions in channel " << p.name << ": "
+                  << e.what();
+    }
+  };
+
+  auto is_live = [](const PendingChannel & p) {
+    return p.config["live"] and p.config["live"].as<bool>();
+  };
+
+  const size_t num_static = count_if(pending.begin(), pending.end(),
+    [&is_live](const PendingChannel & p) { return not is_live(p); });
+
+  /* the event-loop threads construct their channels at the same time */
+  unsigned int startup_threads = channel_startup_threads;
+  if (startup_threads == 0) {
+    startup_threads = max(thread::hardware_concurrency() / num_threads, 1u);
+  }
+  startup_threads = min<size_t>(startup_threads, num_static);
+
+  if (startup_threads > 1) {
+    ThreadPool pool(startup_threads);
+    for (auto & p : pending) {
+      if (not is_live(p)) {
+        pool.submit([&construct, &p]() { construct(p); });
+      }
+    }
+
+    for (auto & p : pending) {
+      if (is_live(p)) {
+        construct(p);
+      }
+    }
+
+    pool.wait();
+  } else {
+    for (auto & p : pending) {
+      construct(p);
+    }
+  }
+
+  for (auto & p : pending) {
+    if (p.channel) {
+      channels.emplace(p.name, move(p.channel));
+    }
+  }
+}
+
+/* mark an authenticated client and save its information in client-init */
+void set_authenticated(WebSocketServer & server, WebSocketClient & client,
+                       const ClientInitMsg & msg)
+{
+  client.set_authenticated(true);
+
+  /* set client's username and IP */
+  client.set_session_key(msg.session_key);
+  client.set_username(msg.username);
+  client.set_address(server.peer_addr(client.connection_id()));
+
+  /* set client's system info (OS, browser and screen size) */
+  client.set_os(msg.os);
+  client.set_browser(msg.browser);
+  client.set_screen_size(msg.screen_width, msg.screen_height);
+
+  DIAG(Info) << client.connection_id() << ": authentication succeeded";
+  DIAG(Info) << client.signature() << ": " << client.browser() << " on "
+             << client.os() << ", " << client.address().str();
+}
+
+/* handle client-init of an authenticated client */
+void init_client(WebSocketServer & server, WebSocketClient & client,
+                 const ClientInitMsg & msg)
+{
+  /* use the binary encoding if the client supports its version */
+  client.set_msg_encoding(
+    msg.binary_version == BINARY_MSG_VERSION ? MsgEncoding::Binary
+                                             : MsgEncoding::JSON);
+
+  /* handle client-init and initialize client's channel */
+  handle_client_init(server, client, msg);
+}
+
+/* the database has checked the session key in client-init */
+void finish_auth(WebSocketServer & server, const uint64_t connection_id,
+                 const string & session_key, const bool valid)
+{
+  /* the client is gone, or a newer client-init is being authenticated */
+  auto it = pending_auths.find(connection_id);
+  if (it == pending_auths.end() or it->second.session_key != session_key) {
+    return;
+  }
+
+  const ClientInitMsg msg = move(it->second);
+  pending_auths.erase(it);
+
+  try {
+    if (not valid) {
+      DIAG(Warning) << connection_id << ": authentication failed";
+      server.close_connection(connection_id);
+      return;
+    }
+
+    session_cache.insert(session_key);
+
+    WebSocketClient & client = clients.at(connection_id);
+    set_authenticated(server, client, msg);
+    init_client(server, client, msg);
+    serve_client(server, client);
+  } catch (const exception & e) {
+    DIAG(Warning) << client_signature(connection_id)
+                  << ": warning in authentication: " << e.what();
+    server.close_connection(connection_id);
+  }
+}
+
+void validate_id(const string & id)
+{
+  int id_int = -1;
+
+  try {
+    id_int = stoi(id);
+  } catch (const exception &) {
+    throw runtime_error("server ID and expt ID must be positive integers");
+  }
+
+  if (id_int <= 0) {
+    throw runtime_error("server ID and expt ID must be positive integers");
+  }
+}
+
+/* this thread's handoff socket */
+string handoff_socket_path()
+{
+  return handoff_socket + "." + server_id + "." + to_string(thread_id);
+}
+
+/* hand the idle clients off to the new server; return true when done */
+bool hand_off_clients(WebSocketServer & server)
+{
+  if (clients.empty() or timestamp_ms() >= handoff_deadline) {
+    if (handoff_to) {
+      handoff_to->send_with_fd("done");
+    }
+
+    DIAG(Info) << "Handoff: done with " << clients.size()
+               << " clients left (thread " << thread_id << ")";
+    return true;
+  }
+
+  /* TLS connections are never released and left to drain instead */
+  if (not handoff_to) {
+    return false;
+  }
+
+  vector<uint64_t> handed_off;
+
+  for (const auto & [connection_id, client] : clients) {
+    /* wait until the client is done with the database or an ABR worker */
+    if (pending_auths.count(connection_id) or
+        video_pending_clients.count(connection_id)) {
+      continue;
+    }
+
+    const auto fd = server.release_connection(connection_id);
+    if (not fd) {
+      continue;
+    }
+
+    handed_off.emplace_back(connection_id);
+
+    try {
+      handoff_to->send_with_fd(client.handoff_state().dump(), fd->fd_num());
+    } catch (const exception & e) {
+      /* the released connection is lost; keep the rest until they leave */
+      print_exception("handoff", e);
+      handoff_to.reset();
+      break;
+    }
+  }
+
+  for (const uint64_t connection_id : handed_off) {
+    DIAG(Info) << client_signature(connection_id) << ": handed off";
+    erase_client(server, connection_id);
+  }
+
+  return false;
+}
+
+/* stop accepting connections and start handing them off to the new server */
+void start_handoff(WebSocketServer & server, Timerfd & handoff_timer)
+{
+  DIAG(Info) << "Handoff: a new server is taking over (thread " << thread_id
+             << ")";
+
+  const FileDescriptor listener = server.release_listener();
+  handoff_to->send_with_fd("listener", listener.fd_num());
+
+  handoff_deadline = timestamp_ms() + handoff_drain_s * 1000;
+  handoff_timer.start(HANDOFF_MS, HANDOFF_MS);
+
+  server.poller().add_action(Poller::Action(handoff_timer, Direction::In,
+    [&server, &handoff_timer]()->Result {
+      if (handoff_timer.expirations() == 0) {
+        return ResultType::Continue;
+      }
+
+      if (hand_off_clients(server)) {
+        return {ResultType::Exit, EXIT_SUCCESS};
+      }
+
+      return ResultType::Continue;
+    }
+  ).named("handoff_timer"));
+}
+
+/* adopt a connection passed over by the old server along with its client */
+void take_over_client(WebSocketServer & server, const string & message,
+                      FileDescriptor && fd, const string & abr_name,
+                      const YAML::Node & abr_config)
+{
+  const json state = json::parse(message);
+
+  const uint64_t connection_id =
+    server.adopt_connection(TCPSocket::adopt(move(fd)));
+
+  shared_ptr<Channel> channel;
+  if (not state.at("channel").is_null()) {
+    channel = find_channel(state.at("channel").get<string>());
+  }
+
+  /* the connection was admitted by the old server, so it takes a slot
+   * without a check (and is released in erase_client()) */
+  auto & client = clients.try_emplace(
+      connection_id, connection_id, abr_name, abr_config).first->second;
+  num_connections.fetch_add(1);
+  arm_idle_timer(server, connection_id, timestamp_ms() + MAX_IDLE_MS + 1);
+
+  try {
+    client.restore(state, channel);
+
+    if (not state.at("channel").is_null() and not channel) {
+      throw runtime_error("channel " + state.at("channel").get<string>()
+                          + " is no longer served");
+    }
+
+    DIAG(Info) << client.signature() << ": taken over";
+    update_stream_stats(client);
+
+    /* resume streaming without waiting for the next message from client */
+    serve_client(server, client);
+  } catch (const exception & e) {
+    DIAG(Warning) << client_signature(connection_id)
+                  << ": warning in taking over: " << e.what();
+    server.close_connection(connection_id);
+  }
+}
+
+/* take over from the old server at the handoff socket of this thread if any,
+ * and listen on the socket for the next server */
+void init_handoff(WebSocketServer & server, Timerfd & handoff_timer,
+                  const string & abr_name, const YAML::Node & abr_config)
+{
+  const string path = handoff_socket_path();
+
+  if (fs::exists(path)) {
+    handoff_from = make_unique<IPCSocket>(SOCK_SEQPACKET);
+
+    try {
+      handoff_from->connect(path);
+    } catch (const exception &) {
+      /* the socket is stale */
+      handoff_from.reset();
+    }
+  }
+
+  if (handoff_from) {
+    DIAG(Info) << "Handoff: taking over from " << path;
+
+    server.poller().add_action(Poller::Action(*handoff_from, Direction::In,
+      [&server, &abr_name, &abr_config]()->Result {
+        auto [message, fd] = handoff_from->recv_with_fd();
+
+        if (message.empty()) {
+          DIAG(Info) << "Handoff: the old server has closed the socket";
+          return ResultType::CancelAll;
+        }
+
+        if (message == "done") {
+          DIAG(Info) << "Handoff: took over (thread " << thread_id << ")";
+          return ResultType::CancelAll;
+        }
+
+        if (not fd) {
+          DIAG(Warning) << "Handoff: ignored message without a socket";
+        } else if (message == "listener") {
+          server.adopt_listener(TCPSocket::adopt(move(*fd)));
+        } else {
+          take_over_client(server, message, move(*fd), abr_name, abr_config);
+        }
+
+        return ResultType::Continue;
+      }
+    ).named("handoff_from"));
+  }
+
+  /* replace the old server's socket, which it has been connected through */
+  fs::remove(path);
+
+  handoff_listener = make_unique<IPCSocket>(SOCK_SEQPACKET);
+  handoff_listener->bind(path);
+  handoff_listener->listen(1);
+
+  server.poller().add_action(Poller::Action(*handoff_listener, Direction::In,
+    [&server, &handoff_timer]()->Result {
+      handoff_to = make_unique<IPCSocket>(handoff_listener->accept());
+      start_handoff(server, handoff_timer);
+
+      /* there is only one handoff */
+      return ResultType::CancelAll;
+    }
+  ).named("handoff_listener"));
+}
 
-    /* look up media chunk size (excluding the size of init chunk size) */
-    const auto data_mmap = channel->vdata(msg.video_format, msg.timestamp);
-    auto media_chunk_size = get<1>(data_mmap);
+/* parse a CPU list of sysfs or procfs, e.g., "0-3,8-11" */
+vector<int> parse_cpu_list(const string & cpu_list)
+{
+  vector<int> cpus;
 
-    /* notify the ABR algorithm that a video chunk is acked */
-    client.video_chunk_acked(msg.video_format, msg.ssim,
-                             media_chunk_size, trans_time);
-    client.set_last_video_send_ts(nullopt);
-    client.set_tcp_info(nullopt);
-  } else {
-    cerr << client.signature() << ": error: server didn't send video but "
-         << "received VideoAck" << endl;
-    return;
-  }
+  for (const auto & range : split(cpu_list, ",")) {
+    if (range.empty()) {
+      continue;
+    }
 
-  /* record client's received video */
-  if (enable_logging) {
-    string log_line = to_string(timestamp_ms()) + "," + msg.channel + ","
-      + server_id + "," + expt_id + "," + client.username() + ","
-      + to_string(client.first_init_id().value()) + ","
-      + to_string(msg.init_id) + ","
-      + to_string(msg.timestamp) + ","
-      + to_string(msg.ssim) + "," + double_to_string(msg.video_buffer, 3) + ","
-      + double_to_string(msg.cum_rebuffer, 3);
-    append_to_log("video_acked", log_line);
+    const auto bounds = split(range, "-");
+    const int first = stoi(bounds.at(0));
+    const int last = bounds.size() > 1 ? stoi(bounds.at(1)) : first;
+    for (int cpu = first; cpu <= last; cpu++) {
+      cpus.emplace_back(cpu);
+    }
   }
+
+  return cpus;
 }
 
-void handle_client_audio_ack(WebSocketClient & client,
-                             const ClientAudAckMsg & msg)
+/* the CPUs on the NUMA node of network interface nic; with avoid_irqs,
+ * without the CPUs its interrupts are steered to (unless none is left) */
+vector<int> nic_cpus(const string & nic, const bool avoid_irqs)
 {
-  if (not client.is_channel_initialized()) {
-    return;
-  }
+  const fs::path device_dir = fs::path("/sys/class/net") / nic / "device";
 
-  if (msg.init_id != client.init_id().value()) {
-    cerr << client.signature() << ": warning: ignored messages with "
-         << "invalid init_id (but should not have received)" << endl;
-    return;
+  string cpu_list;
+  if (not getline(ifstream(device_dir / "local_cpulist"), cpu_list)) {
+    throw runtime_error("cannot read the local CPUs of " + nic);
   }
 
-  client.set_video_playback_buf(msg.video_buffer);
-  client.set_audio_playback_buf(msg.audio_buffer);
-  client.set_cum_rebuffer(msg.cum_rebuffer);
+  vector<int> cpus = parse_cpu_list(cpu_list);
 
-  /* only interested in the event when the last segment is acked */
-  if (msg.byte_offset + msg.byte_length != msg.total_byte_length) {
-    return;
+  const fs::path irq_dir = device_dir / "msi_irqs";
+  if (not avoid_irqs or not fs::is_directory(irq_dir)) {
+    return cpus;
   }
 
-  /* allow sending another chunk */
-  client.set_client_next_ats(msg.timestamp + client.channel()->aduration());
-}
+  set<int> irq_cpus;
+  for (const auto & irq : fs::directory_iterator(irq_dir)) {
+    string affinity;
+    const fs::path affinity_path = fs::path("/proc/irq")
+      / irq.path().filename() / "smp_affinity_list";
 
-void create_channels(Inotify & inotify)
-{
-  fs::path media_dir = config["media_dir"].as<string>();
+    if (getline(ifstream(affinity_path), affinity)) {
+      for (const int cpu : parse_cpu_list(affinity)) {
+        irq_cpus.emplace(cpu);
+      }
+    }
+  }
 
-  set<string> channel_set = load_channels(config);
-  for (const auto & channel_name : channel_set) {
-    /* exceptions might be thrown from the lambda callbacks in the channel */
-    try {
-      auto channel = make_shared<Channel>(
-          channel_name, media_dir,
-          config["channel_configs"][channel_name], inotify);
-      channels.emplace(channel_name, move(channel));
-    } catch (const exception & e) {
-      cerr << "Error: exceptions in channel " << channel_name << ": "
-           << e.what() << endl;
+  vector<int> quiet_cpus;
+  for (const int cpu : cpus) {
+    if (not irq_cpus.count(cpu)) {
+      quiet_cpus.emplace_back(cpu);
     }
   }
+
+  return quiet_cpus.empty() ? cpus : quiet_cpus;
 }
 
-bool auth_client(const string & session_key, pqxx::nontransaction & db_work)
+/* confine the process, including the threads it starts afterwards (e.g.,
+ * the ABR workers), to ws_cpus */
+void confine_to_ws_cpus()
 {
-  try {
-    pqxx::result r = db_work.exec_prepared("auth", session_key);
-
-    if (r.size() == 1 and r[0].size() == 1) {
-      /* returned record is valid containing only true or false */
-      return r[0][0].as<bool>();
-    }
-  } catch (const exception & e) {
-    print_exception("auth_client", e);
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  for (const int cpu : ws_cpus) {
+    CPU_SET(cpu, &cpu_set);
   }
 
-  return false;
+  CheckSystemCall("sched_setaffinity",
+                  sched_setaffinity(0, sizeof(cpu_set), &cpu_set));
 }
 
-void validate_id(const string & id)
+/* pin this event-loop thread to its CPU in ws_cpus, if any: thread i of
+ * server s takes the ((s - 1) * num_threads + i)-th, wrapping around */
+void pin_event_loop_thread()
 {
-  int id_int = -1;
-
-  try {
-    id_int = stoi(id);
-  } catch (const exception &) {
-    throw runtime_error("server ID and expt ID must be positive integers");
+  if (ws_cpus.empty()) {
+    return;
   }
 
-  if (id_int <= 0) {
-    throw runtime_error("server ID and expt ID must be positive integers");
+  const size_t idx = ((stoul(server_id) - 1) * num_threads + thread_id)
+                     % ws_cpus.size();
+
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  CPU_SET(ws_cpus[idx], &cpu_set);
+
+  const int err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set),
+                                         &cpu_set);
+  if (err) {
+    throw unix_error("pthread_setaffinity_np", err);
   }
+
+  cerr << "Event-loop thread " << thread_id << " is pinned to CPU "
+       << ws_cpus[idx] << endl;
 }
 
-int run_websocket_server(pqxx::nontransaction & db_work)
+int run_websocket_server()
 {
+  pin_event_loop_thread();
+
   /* read congestion control and ABR from experimental settings */
   int server_id_int = stoi(server_id);
   int cum_servers = 0;
@@ -707,18 +2500,43 @@ int run_websocket_server(pqxx::nontransaction & db_work)
     abr_config = fingerprint["abr_config"];
   }
 
+  /* ChildProcess refuses to fork in a multi-threaded program */
+  if (num_threads > 1 and (abr_name == "pensieve" or abr_name == "tara")) {
+    throw runtime_error(abr_name + " requires ws_num_threads to be 1");
+  }
+
   const string ip = "0.0.0.0";
   /* run each server on a different port */
   const uint16_t port = config["ws_base_port"].as<uint16_t>() + server_id_int;
 
-  WebSocketServer server {{ip, port}, cc_name};
+  WebSocketServer server {{ip, port}, cc_name, poller_backend};
+
+  /* interleave connection IDs so that they are unique across threads */
+  server.set_connection_ids(thread_id, num_threads);
+  server.set_write_caps(max_write_bytes, max_tls_record_bytes);
+  server.set_send_quantum(send_quantum_bytes);
+  server.set_notsent_lowat(tcp_notsent_lowat);
+  server.set_max_receive_bytes(max_receive_bytes);
+  if (tcp_info_interval_ms > 0) {
+    server.collect_tcp_info(tcp_info_interval_ms);
+  }
+
+  if (not session_trace_dir.empty()) {
+    const fs::path trace_path = fs::path(session_trace_dir)
+      / ("session-" + server_id + "-" + to_string(thread_id) + "-"
+         + to_string(timestamp_s()) + ".trace");
+    session_trace = make_unique<SessionTrace>(trace_path);
+    cerr << "Tracing sessions to " << trace_path << " (thread "
+         << thread_id << ")" << endl;
+  }
 
   const bool portal_debug = config["portal_settings"]["debug"].as<bool>();
 
   /* workaround using compiler macros (CXXFLAGS='-DNONSECURE') to create a
    * server with non-secure socket; secure socket is used by default */
   #ifdef NONSECURE
-  cerr << "Launching non-secure WebSocket server on port " << port << endl;
+  cerr << "Launching non-secure WebSocket server on port " << port
+       << " (thread " << thread_id << ")" << endl;
   if (not portal_debug) {
     cerr << "Error in YAML config: 'debug' must be true in 'portal_settings'" << endl;
     return EXIT_FAILURE;
@@ -726,7 +2544,18 @@ int run_websocket_server(pqxx::nontransaction & db_work)
   #else
   server.ssl_context().use_private_key_file(config["ssl_private_key"].as<string>());
   server.ssl_context().use_certificate_file(config["ssl_certificate"].as<string>());
-  cerr << "Launching secure WebSocket server on port " << port << endl;
+  if (config["enable_ktls"] and config["enable_ktls"].as<bool>()) {
+    server.ssl_context().enable_ktls();
+  }
+  if (enable_session_tickets) {
+    server.ssl_context().enable_session_tickets(ssl_ticket_secret,
+                                                ssl_ticket_rotation_s);
+  }
+  if (handshake_pool) {
+    server.offload_handshakes(handshake_pool);
+  }
+  cerr << "Launching secure WebSocket server on port " << port
+       << " (thread " << thread_id << ")" << endl;
   if (portal_debug) {
     cerr << "Error in YAML config: 'debug' must be false in 'portal_settings'" << endl;
     return EXIT_FAILURE;
@@ -737,50 +2566,71 @@ int run_websocket_server(pqxx::nontransaction & db_work)
   Inotify inotify(server.poller());
   create_channels(inotify);
 
+  for (auto & [channel_name, channel] : channels) {
+    channel->set_ready_callback(
+      [&server, name = channel_name](const bool video,
+                                     const uint64_t frontier) {
+        serve_edge_clients(server, name, video, frontier);
+      }
+    );
+
+    /* the cached frames of a chunk would keep it mapped */
+    channel->set_unmap_callback(
+      [name = channel_name](const bool video, const uint64_t ts,
+                            const size_t format_idx) {
+        auto & caches = video ? vframe_caches : aframe_caches;
+        const auto it = caches.find(name);
+        if (it != caches.end()) {
+          it->second.evict(ts, format_idx);
+        }
+      }
+    );
+  }
+
+  /* libpq connections are not thread-safe: each thread connects on its own */
+  const string db_conn_str =
+    postgres_connection_string(config["postgres_connection"]);
+  AsyncAuth auth(db_conn_str, server.poller(),
+    [&server](const uint64_t connection_id, const string & session_key,
+              const bool valid) {
+      finish_auth(server, connection_id, session_key, valid);
+    }
+  );
+
   /* set server callbacks */
   server.set_message_callback(
-    [&server, &db_work](const uint64_t connection_id, const WSMessage & ws_msg)
+    [&server, &auth](const uint64_t connection_id, const WSMessage & ws_msg)
     {
       try {
         WebSocketClient & client = clients.at(connection_id);
         client.set_last_msg_recv_ts(timestamp_ms());
 
+        if (traced_sessions.count(connection_id)) {
+          session_trace->message(connection_id, ws_msg.payload());
+        }
+
         ClientMsgParser msg_parser(ws_msg.payload());
         if (msg_parser.msg_type() == ClientMsgParser::Type::Init) {
           ClientInitMsg msg = msg_parser.parse_client_init();
 
           /* authenticate user */
           if (not client.is_authenticated()) {
-            if (auth_client(msg.session_key, db_work)) {
-              client.set_authenticated(true);
-
-              /* set client's username and IP */
-              client.set_session_key(msg.session_key);
-              client.set_username(msg.username);
-              client.set_address(server.peer_addr(connection_id));
-
-              /* set client's system info (OS, browser and screen size) */
-              client.set_os(msg.os);
-              client.set_browser(msg.browser);
-              client.set_screen_size(msg.screen_width, msg.screen_height);
-
-              cerr << connection_id << ": authentication succeeded" << endl;
-              cerr << client.signature() << ": " << client.browser() << " on "
-                   << client.os() << ", " << client.address().str() << endl;
-            } else {
-              cerr << connection_id << ": authentication failed" << endl;
-              server.close_connection(connection_id);
+            if (not session_cache.contains(msg.session_key)) {
+              /* continue in finish_auth() once the database has answered */
+              pending_auths.insert_or_assign(connection_id, msg);
+              auth.submit(connection_id, msg.session_key);
               return;
             }
+
+            set_authenticated(server, client, msg);
           }
 
-          /* handle client-init and initialize client's channel */
-          handle_client_init(server, client, msg);
+          init_client(server, client, msg);
         } else {
           /* parse a message other than client-init only if user is authed */
           if (not client.is_authenticated()) {
-            cerr << connection_id << ": ignored messages from a "
-                 << "non-authenticated user" << endl;
+            DIAG(Warning) << connection_id << ": ignored messages from a "
+                          << "non-authenticated user";
             server.close_connection(connection_id);
             return;
           }
@@ -798,13 +2648,16 @@ int run_websocket_server(pqxx::nontransaction & db_work)
           default:
             throw runtime_error("invalid client message");
           }
+
+          /* the client has reported its buffer */
+          update_stream_stats(client);
         }
 
-        /* try serving media to this client */
-        serve_client(server, client);
+        /* try serving media to this client after its other messages */
+        runnable_clients.emplace(connection_id);
       } catch (const exception & e) {
-        cerr << client_signature(connection_id)
-             << ": warning in message callback: " << e.what() << endl;
+        DIAG(Warning) << client_signature(connection_id)
+                      << ": warning in message callback: " << e.what();
         server.close_connection(connection_id);
       }
     }
@@ -813,51 +2666,228 @@ int run_websocket_server(pqxx::nontransaction & db_work)
   server.set_open_callback(
     [&server, &abr_name, &abr_config](const uint64_t connection_id)
     {
+      /* whether this connection holds a slot in num_connections */
+      bool reserved = false;
+
       try {
-        cerr << connection_id << ": connection opened" << endl;
+        DIAG(Info) << connection_id << ": connection opened";
 
-        /* check if number of connections already exceeds the limit */
-        if (clients.size() >= MAX_CONNECTION_NUM) {
-          cerr << connection_id << ": rejected over-limit connection" << endl;
+        if (enable_logging) {
+          record_handshake(server, connection_id);
+        }
+
+        /* check if the server can take another connection; the slot is
+         * reserved before the check, so that the threads cannot all take
+         * the last one at once */
+        ServerLoad load = server_load();
+        load.num_connections = num_connections.fetch_add(1);
+        reserved = true;
+
+        const auto decision = admission->admit(load);
+        using Decision = AdmissionController::Decision;
+
+        if (decision.type != Decision::Type::Admit) {
+          num_connections.fetch_sub(1);
+          reserved = false;
 
           WebSocketClient tmp_client(connection_id, abr_name, abr_config);
-          send_server_error(server, tmp_client, ServerErrorMsg::Type::Limit);
+
+          if (decision.type == Decision::Type::Redirect) {
+            DIAG(Info) << connection_id << ": redirected to port "
+                       << decision.port;
+            send_server_error(server, tmp_client,
+                              ServerErrorMsg::Type::Redirect, decision.port);
+          } else {
+            DIAG(Warning) << connection_id
+                          << ": rejected over-limit connection";
+            send_server_error(server, tmp_client, ServerErrorMsg::Type::Limit);
+          }
+
           server.close_connection(connection_id);
           return;
         }
 
-        /* create a new WebSocketClient */
-        clients.emplace(
-            piecewise_construct,
-            forward_as_tuple(connection_id),
-            forward_as_tuple(connection_id, abr_name, abr_config));
+        /* create a new WebSocketClient, which takes over the slot (see
+         * erase_client()) */
+        clients.try_emplace(connection_id,
+                            connection_id, abr_name, abr_config);
+
+        if (session_trace and
+            num_sessions_opened++ % session_trace_sample == 0) {
+          traced_sessions.emplace(connection_id);
+          session_trace->open(connection_id);
+        }
+        arm_idle_timer(server, connection_id, timestamp_ms() + MAX_IDLE_MS + 1);
       } catch (const exception & e) {
-        cerr << client_signature(connection_id)
-             << ": warning in open callback: " << e.what() << endl;
+        DIAG(Warning) << client_signature(connection_id)
+                      << ": warning in open callback: " << e.what();
+
+        /* the slot of a client is released when it is erased */
+        if (reserved and clients.find(connection_id) == clients.end()) {
+          num_connections.fetch_sub(1);
+        }
         server.close_connection(connection_id);
       }
     }
   );
 
   server.set_close_callback(
-    [](const uint64_t connection_id)
+    [&server](const uint64_t connection_id)
     {
       try {
-        clients.erase(connection_id);
-        cerr << connection_id << ": connection closed" << endl;
+        erase_client(server, connection_id);
+        DIAG(Info) << connection_id << ": connection closed";
       } catch (const exception & e) {
-        cerr << client_signature(connection_id)
-             << ": warning in close callback: " << e.what() << endl;
+        DIAG(Warning) << client_signature(connection_id)
+                      << ": warning in close callback: " << e.what();
+      }
+    }
+  );
+
+  /* ABR worker processes are served by this thread's event loop */
+  ABRWorkerPool::set_poller(&server.poller());
+
+  /* the logs are written by a background thread, unless the process must
+   * stay single-threaded to fork (as above): then by this event loop */
+  Timerfd log_timer;
+  if (enable_logging) {
+    if (abr_name == "pensieve" or abr_name == "tara") {
+      log_timer.start(LogWriter::FLUSH_INTERVAL_MS,
+                      LogWriter::FLUSH_INTERVAL_MS);
+
+      server.poller().add_action(Poller::Action(log_timer, Direction::In,
+        [&log_timer]()->Result {
+          if (log_timer.expirations() > 0) {
+            log_writer->flush();
+          }
+
+          return ResultType::Continue;
+        }
+      ).named("log_timer"));
+    } else {
+      log_writer->start();
+    }
+  }
+
+  /* likewise, the diagnostic lines (see DiagLog) */
+  Timerfd diag_timer;
+  if (abr_name == "pensieve" or abr_name == "tara") {
+    DiagLog::start(false /* no background thread */);
+    diag_timer.start(DiagLog::FLUSH_INTERVAL_MS, DiagLog::FLUSH_INTERVAL_MS);
+
+    server.poller().add_action(Poller::Action(diag_timer, Direction::In,
+      [&diag_timer]()->Result {
+        if (diag_timer.expirations() > 0) {
+          DiagLog::flush();
+        }
+
+        return ResultType::Continue;
+      }
+    ).named("diag_timer"));
+  } else {
+    DiagLog::start();
+  }
+
+  set_abr_ready_callback(server);
+
+  /* sample the load of this thread for admission control */
+  Timerfd load_timer;
+  if (admission->needs_load()) {
+    load_timer.start(LOAD_SAMPLE_MS, LOAD_SAMPLE_MS);
+
+    server.poller().add_action(Poller::Action(load_timer, Direction::In,
+      [&server, &load_timer, port]()->Result {
+        sample_load(server, load_timer, port);
+        return ResultType::Continue;
+      }
+    ).named("load_timer"));
+  }
+
+  /* pick up the chunks that media_indexer has found ready */
+  Timerfd index_timer;
+  if (config["media_index_dir"]) {
+    index_timer.start(INDEX_SYNC_MS, INDEX_SYNC_MS);
+
+    server.poller().add_action(Poller::Action(index_timer, Direction::In,
+      [&index_timer]()->Result {
+        if (index_timer.expirations() == 0) {
+          return ResultType::Continue;
+        }
+
+        for (auto & [channel_name, channel] : channels) {
+          channel->sync_index();
+        }
+
+        return ResultType::Continue;
+      }
+    ).named("index_timer"));
+  }
+
+  /* serve the chunks over HTTP as well, for a CDN to cache */
+  unique_ptr<ChunkHTTPServer> chunk_http_server;
+  if (http_chunk_port) {
+    chunk_http_server = make_unique<ChunkHTTPServer>(server.poller(),
+      Address {ip, *http_chunk_port},
+      [](const string & name)->shared_ptr<Channel> {
+        return find_channel(name);
+      }
+    );
+  }
+
+  server.set_loop_callback(
+    [&server, &chunk_http_server]()
+    {
+      if (chunk_http_server) {
+        chunk_http_server->erase_closed();
+      }
+
+      if (not send_traced_clients.empty()) {
+        check_send_traces(server);
       }
+
+      serve_runnable_clients(server);
+      serve_video_in_batch(server);
     }
   );
 
+  /* decisions made in other processes are not worth speculating */
+  if (abr_speculation and abr_name != "pensieve" and abr_name != "tara") {
+    speculate_video = true;
+
+    server.set_idle_callback(
+      [&server]()
+      {
+        return speculate_video_format(server);
+      }
+    );
+  }
+
   /* start a slow timer to perform some tasks */
   Timerfd slow_timer;
   start_slow_timer(slow_timer, server);
 
   slow_timer.start(1000, 1000);  /* slow timer fires every second */
 
+  Timerfd handoff_timer;
+  if (not handoff_socket.empty()) {
+    init_handoff(server, handoff_timer, abr_name, abr_config);
+  }
+
+  /* time the callbacks of the poller and summarize them to stderr; with
+   * metrics_export, their histograms are exported too */
+  if (config["poller_instrumentation"] and
+      config["poller_instrumentation"].as<bool>()) {
+    server.poller().set_instrumented(true);
+  }
+
+  /* push the metrics of this thread straight to InfluxDB */
+  unique_ptr<MetricsExporter> metrics_exporter;
+  if (config["metrics_export"] and config["metrics_export"].as<bool>()) {
+    metrics_exporter = make_unique<MetricsExporter>(server.poller(),
+      config["influxdb_connection"], server_id, thread_id);
+    metrics_exporter->set_stream_stats(stream_stats);
+  }
+
   return server.loop();
 }
 
@@ -873,11 +2903,17 @@ int main(int argc, char * argv[])
   }
 
   /* load YAML settings */
-  config = YAML::LoadFile(argv[1]);
+  base_config = YAML::LoadFile(argv[1]);
+  config = YAML::Clone(base_config);
   enable_logging = config["enable_logging"].as<bool>();
   if (enable_logging) {
     cerr << "Logging is enabled" << endl;
     log_dir = config["log_dir"].as<string>();
+
+    if (config["log_io_uring"]) {
+      cerr << "Warning: log_io_uring is ignored; logs are written in batches "
+           << "by a background thread" << endl;
+    }
   } else {
     cerr << "Logging is disabled" << endl;
   }
@@ -893,6 +2929,213 @@ int main(int argc, char * argv[])
 
     expt_id = argv[3];
     validate_id(expt_id);
+
+    /* write video_sent, video_acked and client_buffer in the compact
+     * binary format (see binary_log.hh), which log_reporter detects */
+    const bool binary_logs = config["binary_logs"] ?
+                             config["binary_logs"].as<bool>() : false;
+
+    log_writer = make_unique<LogWriter>(log_dir, "." + server_id + ".log",
+                                        MAX_LOG_FILESIZE, binary_logs);
+  }
+
+  /* number of event-loop threads; 0 means one thread per core */
+  if (config["ws_num_threads"]) {
+    num_threads = config["ws_num_threads"].as<unsigned int>();
+    if (num_threads == 0) {
+      num_threads = max(thread::hardware_concurrency(), 1u);
+    }
+  }
+
+  if (config["ws_cpus"]) {
+    ws_cpus = config["ws_cpus"].as<vector<int>>();
+  }
+
+  /* place the process on the NUMA node of the NIC that serves the clients
+   * (ws_cpus defaults to its CPUs), so that its threads and the memory they
+   * first touch stay local to the NIC; optionally off the CPUs that take
+   * the NIC's interrupts */
+  if (config["ws_nic"]) {
+    if (ws_cpus.empty()) {
+      ws_cpus = nic_cpus(config["ws_nic"].as<string>(),
+                         config["ws_nic_avoid_irq_cpus"] and
+                         config["ws_nic_avoid_irq_cpus"].as<bool>());
+    }
+
+    confine_to_ws_cpus();
+  }
+
+  if (config["max_connection_num"]) {
+    max_connection_num = config["max_connection_num"].as<unsigned int>();
+  }
+
+  if (config["max_write_bytes"]) {
+    max_write_bytes = config["max_write_bytes"].as<size_t>();
+  }
+
+  if (config["max_client_buffer_bytes"]) {
+    max_client_buffer_bytes = config["max_client_buffer_bytes"].as<uint64_t>();
+  }
+
+  if (config["max_total_buffer_bytes"]) {
+    max_total_buffer_bytes = config["max_total_buffer_bytes"].as<uint64_t>();
+  }
+
+  if (config["buffer_stall_s"]) {
+    buffer_stall_s = config["buffer_stall_s"].as<unsigned int>();
+  }
+
+  if (config["max_receive_bytes"]) {
+    max_receive_bytes = config["max_receive_bytes"].as<size_t>();
+  }
+
+  /* the diagnostic lines written: of "debug", "info" (the default),
+   * "warning" or "error" and above, and at most so many per second from
+   * each line of code (0: no limit) */
+  if (config["diag_log_level"]) {
+    DiagLog::set_min_severity(
+      DiagLog::parse_severity(config["diag_log_level"].as<string>()));
+  }
+
+  if (config["diag_max_lines_per_site"]) {
+    DiagLog::set_max_lines_per_site(
+      config["diag_max_lines_per_site"].as<unsigned int>());
+  }
+
+  /* request the forward passes of the TTP models and Pensieve actors from
+   * the inference_daemon of this host (see InferenceChannel), falling back
+   * to evaluating them in this process after inference_timeout_us. Each
+   * forward pass blocks the event loop, and so the sends of all the
+   * clients of the thread, for up to inference_timeout_us: a Pensieve
+   * decision makes one, and a batch of puffer_ttp decisions one per
+   * lookahead chunk. Once a pass times out, the thread evaluates locally
+   * for a second */
+  if (config["inference_dir"]) {
+    const uint64_t timeout_us = config["inference_timeout_us"] ?
+      config["inference_timeout_us"].as<uint64_t>() : INFERENCE_TIMEOUT_US;
+    InferenceChannel::enable(config["inference_dir"].as<string>(), timeout_us);
+  }
+
+  if (config["send_quantum_bytes"]) {
+    send_quantum_bytes = config["send_quantum_bytes"].as<size_t>();
+  }
+
+  if (config["tcp_notsent_lowat"]) {
+    tcp_notsent_lowat = config["tcp_notsent_lowat"].as<unsigned int>();
+  }
+
+  if (config["tcp_info_interval_ms"]) {
+    tcp_info_interval_ms = config["tcp_info_interval_ms"].as<unsigned int>();
+  }
+
+  if (config["http_chunk_port"]) {
+    http_chunk_port = config["http_chunk_port"].as<uint16_t>();
+  }
+
+  if (config["pacing_gain"]) {
+    pacing_gain = config["pacing_gain"].as<double>();
+  }
+
+  if (config["channel_startup_threads"]) {
+    channel_startup_threads =
+      config["channel_startup_threads"].as<unsigned int>();
+  }
+
+  if (config["channel_idle_s"]) {
+    channel_idle_s = config["channel_idle_s"].as<unsigned int>();
+  }
+
+  /* size the TLS records and frames of video by the congestion window */
+  if (config["dynamic_record_sizing"] and
+      config["dynamic_record_sizing"].as<bool>()) {
+    dynamic_record_sizing = true;
+  }
+
+  if (config["send_trace_sample"]) {
+    send_trace_sample = config["send_trace_sample"].as<unsigned int>();
+  }
+
+  if (config["session_trace_dir"]) {
+    session_trace_dir = config["session_trace_dir"].as<string>();
+    fs::create_directories(session_trace_dir);
+
+    if (config["session_trace_sample"]) {
+      session_trace_sample = config["session_trace_sample"].as<unsigned int>();
+      if (session_trace_sample == 0) {
+        throw runtime_error("session_trace_sample must be positive");
+      }
+    }
+  }
+
+  if (config["replay_tcp_info"]) {
+    replay_tcp_infos = SessionTrace::read_tcp_infos(
+      config["replay_tcp_info"].as<string>());
+  }
+
+  /* the costs of the ABR algorithms are exported by metrics_export */
+  if (config["abr_profiling"] and config["abr_profiling"].as<bool>()) {
+    if (not config["metrics_export"] or
+        not config["metrics_export"].as<bool>()) {
+      cerr << "Warning: abr_profiling requires metrics_export" << endl;
+    }
+
+    WebSocketClient::set_abr_profiling(true);
+  }
+
+  /* make the next ABR decision of a client while its chunk is in flight */
+  if (config["abr_speculation"] and config["abr_speculation"].as<bool>()) {
+    abr_speculation = true;
+  }
+
+  /* send the first chunks of a stream along with the server-init */
+  if (config["fast_startup"] and config["fast_startup"].as<bool>()) {
+    fast_startup = true;
+  }
+
+  /* a new server started later takes over through the handoff socket */
+  if (config["handoff_socket"]) {
+    handoff_socket = config["handoff_socket"].as<string>();
+
+    if (config["handoff_drain_s"]) {
+      handoff_drain_s = config["handoff_drain_s"].as<unsigned int>();
+    }
+  }
+
+  /* static channels restore their indices from snapshots in this dir */
+  if (config["channel_snapshot_dir"]) {
+    fs::create_directories(config["channel_snapshot_dir"].as<string>());
+  }
+
+  if (config["max_tls_record_bytes"]) {
+    max_tls_record_bytes = config["max_tls_record_bytes"].as<size_t>();
+  }
+
+  if (config["ssl_session_tickets"] and
+      config["ssl_session_tickets"].as<bool>()) {
+    enable_session_tickets = true;
+    ssl_ticket_secret = load_ticket_secret();
+
+    if (config["ssl_ticket_rotation_s"]) {
+      ssl_ticket_rotation_s = config["ssl_ticket_rotation_s"].as<unsigned int>();
+    }
+  }
+
+  if (config["tls_handshake_threads"]) {
+    const auto num_threads = config["tls_handshake_threads"].as<unsigned int>();
+    if (num_threads > 0) {
+      handshake_pool = make_shared<ThreadPool>(num_threads);
+    }
+  }
+
+  /* "poll" (default) or "epoll" */
+  if (config["poller_backend"]) {
+    const string backend = config["poller_backend"].as<string>();
+    if (backend == "epoll") {
+      poller_backend = Poller::Backend::Epoll;
+    } else if (backend != "poll") {
+      cerr << "Error in YAML config: unknown poller_backend " << backend << endl;
+      return EXIT_FAILURE;
+    }
   }
 
   /* ignore SIGPIPE generated by SSL_write */
@@ -900,18 +3143,89 @@ int main(int argc, char * argv[])
     throw runtime_error("signal: failed to ignore SIGPIPE");
   }
 
-  /* connect to the database for user authentication */
-  string db_conn_str = postgres_connection_string(config["postgres_connection"]);
-  pqxx::connection db_conn(db_conn_str);
-  cerr << "Connected to PostgreSQL at " << db_conn.hostname() << endl;
+  /* with --enable-counters, kill -USR1 dumps the syscall and allocation
+   * counters of each thread to stderr */
+  Counters::install_dump_handler();
+
+  /* and kill -USR2 profiles the CPU if PROFILER_DIR is set */
+  Profiler::install_from_env();
+
+  active_streams_counts.resize(num_threads);
+  thread_loads = make_unique<ThreadLoad[]>(num_threads);
+
+  /* admission control: "cap" (default) admits up to max_connection_num */
+  const YAML::Node admission_config = config["admission"] ?
+                                      config["admission"] : YAML::Node();
+  if (admission_config["controller"] and
+      admission_config["controller"].as<string>() == "load") {
+    unsigned int num_servers = 0;
+    for (const auto & node : config["experiments"]) {
+      num_servers += node["num_servers"].as<unsigned int>();
+    }
+
+    load_table = make_shared<LoadTable>(
+      admission_config["load_table"] ?
+      admission_config["load_table"].as<string>() : "server_load",
+      num_servers);
+  }
+
+  /* resume the ABR state of the streams that reconnect to any server */
+  if (config["session_store"]) {
+    session_store = make_unique<SessionStore>(
+      config["session_store"].as<string>());
+  }
+
+  /* the experiment group of this server, among which channel_affinity
+   * servers serve each channel */
+  if (config["channel_affinity"]) {
+    channel_affinity = config["channel_affinity"].as<unsigned int>();
+
+    const unsigned int server_id_int = stoi(server_id);
+    unsigned int cum_servers = 0;
+    for (const auto & node : config["experiments"]) {
+      const unsigned int num_servers = node["num_servers"].as<unsigned int>();
+      if (server_id_int <= cum_servers + num_servers) {
+        group_first_server = cum_servers + 1;
+        group_num_servers = num_servers;
+        break;
+      }
+      cum_servers += num_servers;
+    }
+  }
+
+  admission = AdmissionController::create(admission_config,
+    max_connection_num, load_table, stoi(server_id));
+
+  if (num_threads == 1) {
+    /* run a WebSocketServer instance in the main thread */
+    return run_websocket_server();
+  }
+
+  cerr << "Running " << num_threads << " event-loop threads" << endl;
+
+  /* run a WebSocketServer instance in each thread; each thread owns a copy
+   * of the config as YAML::Node is not safe to access concurrently */
+  vector<int> exit_status(num_threads, EXIT_SUCCESS);
+  vector<thread> threads;
+
+  for (unsigned int i = 0; i < num_threads; i++) {
+    threads.emplace_back(
+      [i, &exit_status, thread_config = YAML::Clone(base_config)]() {
+        thread_id = i;
+        config = thread_config;
+        exit_status[i] = run_websocket_server();
+      }
+    );
+  }
 
-  /* prepare a statement to check if the session_key in client-init is valid */
-  db_conn.prepare("auth", "SELECT EXISTS(SELECT 1 FROM django_session WHERE "
-    "session_key = $1 AND expire_date > now());");
+  int ret = EXIT_SUCCESS;
+  for (unsigned int i = 0; i < num_threads; i++) {
+    threads[i].join();
 
-  /* reuse the same nontransaction as the server only reads the database */
-  pqxx::nontransaction db_work(db_conn);
+    if (exit_status[i] != EXIT_SUCCESS) {
+      ret = exit_status[i];
+    }
+  }
 
-  /* run a WebSocketServer instance */
-  return run_websocket_server(db_work);
+  return ret;
 }
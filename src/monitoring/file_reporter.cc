@@ -1,10 +1,13 @@
+#include <fcntl.h>
 #include <iostream>
 #include <string>
-#include <fstream>
+#include <string_view>
+#include <optional>
 #include <map>
 #include <ctime>
 
 #include "util.hh"
+#include "strict_conversions.hh"
 #include "yaml.hh"
 #include "media_formats.hh"
 #include "exception.hh"
@@ -13,8 +16,10 @@
 #include "inotify.hh"
 #include "filesystem.hh"
 #include "timestamp.hh"
-#include "tokenize.hh"
+#include "file_descriptor.hh"
+#include "io_buffer.hh"
 #include "influxdb_client.hh"
+#include "stage_stats.hh"
 
 using namespace std;
 using namespace PollerShortNames;
@@ -22,20 +27,106 @@ using namespace PollerShortNames;
 static const int TIMER_PERIOD_MS = 60000;  /* 1 minute */
 static fs::path media_dir;
 
+/* the values reported for a channel (and format) over a TIMER_PERIOD_MS */
+struct Summary
+{
+  unsigned int count {0};
+  double min {0};
+  double max {0};
+  double sum {0};
+
+  /* media timestamps of the first and last files */
+  uint64_t first_ts {0};
+  uint64_t last_ts {0};
+
+  void add(const double value, const uint64_t ts)
+  {
+    if (count == 0) {
+      min = max = value;
+      first_ts = ts;
+    } else {
+      min = std::min(min, value);
+      max = std::max(max, value);
+    }
+
+    count++;
+    sum += value;
+    last_ts = ts;
+  }
+
+  /* e.g., "count=10i,size_min=...,size_mean=...,size_max=...,..." */
+  string fields(const string & name) const
+  {
+    return "count=" + to_string(count) + "i," + name + "_min="
+      + to_string(min) + "," + name + "_mean=" + to_string(sum / count) + ","
+      + name + "_max=" + to_string(max) + ",first_timestamp="
+      + to_string(first_ts) + "i,last_timestamp=" + to_string(last_ts) + "i";
+  }
+};
+
+/* the summaries of each measurement, by the tags of its lines
+ * (e.g., "channel=abc,format=1280x720-20"); posted and cleared every period */
+static map<string, map<string, Summary>> summaries;
+
+/* the first line of a small file, read into buffer without allocating */
+static optional<string_view> read_first_line(const fs::path & filepath,
+                                             IOBuffer & buffer)
+{
+  const int fd_num = open(filepath.c_str(), O_RDONLY);
+  if (fd_num < 0) {
+    cerr << "Warning: cannot open " << filepath << endl;
+    return nullopt;
+  }
+
+  FileDescriptor fd(fd_num);
+  string_view data = fd.read(buffer);
+  return data.substr(0, data.find('\n'));
+}
+
+/* the next space-separated field of line, which is consumed */
+static string_view next_field(string_view & line)
+{
+  const size_t pos = line.find(' ');
+  const string_view field = line.substr(0, pos);
+  line.remove_prefix(pos == string_view::npos ? line.size() : pos + 1);
+  return field;
+}
+
+static void post_summaries(InfluxDBClient & influxdb_client)
+{
+  const string now = to_string(timestamp_ms());
+  string payload;
+
+  for (auto & [measurement, tagged_summaries] : summaries) {
+    const string field_name = measurement == "ssim_summary" ? "ssim_index"
+      : measurement == "video_size_summary" ? "size"
+      : measurement == "decoder_rasters_summary" ? "rasters_in_use"
+      : "filler_fields";
+
+    for (const auto & [tags, summary] : tagged_summaries) {
+      payload += measurement + "," + tags + " " + summary.fields(field_name)
+                 + " " + now + "\n";
+    }
+
+    tagged_summaries.clear();
+  }
+
+  influxdb_client.post(payload);
+}
+
 void print_usage(const string & program_name)
 {
   cerr << "Usage: " << program_name << " <YAML configuration>" << endl;
 }
 
 void report_decoder_info(const string & channel_name,
-                         Inotify & inotify,
-                         InfluxDBClient & influxdb_client)
+                         Inotify & inotify)
 {
   fs::path channel_path = media_dir / channel_name;
   string video_raw = channel_path / "working/video-raw";
 
   inotify.add_watch(video_raw, IN_MOVED_TO,
-    [channel_name, video_raw, &influxdb_client]
+    [channel_name, video_raw]
     (const inotify_event & event, const string & path) {
       /* only interested in regular files that are moved into the dir */
       if (not (event.mask & IN_MOVED_TO) or (event.mask & IN_ISDIR)) {
@@ -47,17 +138,31 @@ void report_decoder_info(const string & channel_name,
 
       fs::path filepath = fs::path(path) / event.name;
       if (filepath.extension() == ".info") {
-        ifstream decoder_info_stream(filepath);
-        string line;
-        getline(decoder_info_stream, line);
-        vector<string> sp = split(line, " ");
-
-        string log_line = "decoder_info,channel=" + channel_name
-          + " timestamp=" + sp[1] + "i,due=" + sp[2] + "i,filler_fields="
-          + sp[3] + "i " + sp[0];
-        influxdb_client.post(log_line);
+        /* <time> <timestamp> <due> <filler fields> [<rasters in use>] */
+        IOBuffer buffer;
+        if (auto line = read_first_line(filepath, buffer)) {
+          next_field(*line);
+          const auto ts = parse_number<uint64_t>(next_field(*line));
+          next_field(*line);
+          const auto filler_fields = parse_number<uint64_t>(next_field(*line));
+
+          /* the most rasters in use at once, which older decoders omit */
+          const auto rasters = parse_number<uint64_t>(next_field(*line));
+
+          if (ts and filler_fields) {
+            summaries["decoder_info_summary"]["channel=" + channel_name].add(
+              *filler_fields, *ts);
+
+            if (rasters) {
+              summaries["decoder_rasters_summary"]["channel=" + channel_name]
+                .add(*rasters, *ts);
+            }
+          } else {
+            cerr << "Warning: invalid decoder info in " << filepath << endl;
+          }
+        }
 
-        /* remove .y4m.info files after posting to InfluxDB */
+        /* remove .y4m.info files once they have been summarized */
         fs::remove(filepath);
       }
     }
@@ -66,14 +171,13 @@ void report_decoder_info(const string & channel_name,
 
 void report_ssim(const string & channel_name,
                  const string & vformat,
-                 Inotify & inotify,
-                 InfluxDBClient & influxdb_client)
+                 Inotify & inotify)
 {
   fs::path channel_path = media_dir / channel_name;
   string ssim_dir = channel_path / "ready" / (vformat + "-ssim");
 
   inotify.add_watch(ssim_dir, IN_MOVED_TO,
-    [channel_name, vformat, ssim_dir, &influxdb_client]
+    [tags = "channel=" + channel_name + ",format=" + vformat, ssim_dir]
     (const inotify_event & event, const string & path) {
       /* only interested in regular files that are moved into the dir */
       if (not (event.mask & IN_MOVED_TO) or (event.mask & IN_ISDIR)) {
@@ -85,16 +189,18 @@ void report_ssim(const string & channel_name,
 
       fs::path filepath = fs::path(path) / event.name;
       if (filepath.extension() == ".ssim") {
-        string ts = filepath.stem();
+        const auto ts = parse_number<uint64_t>(filepath.stem().native());
 
-        ifstream ssim_file(filepath);
-        string line;
-        getline(ssim_file, line);
+        IOBuffer buffer;
+        if (const auto line = read_first_line(filepath, buffer)) {
+          const auto ssim = parse_number<double>(*line);
 
-        string log_line = "ssim,channel=" + channel_name + ",format="
-          + vformat + " timestamp=" + ts + "i,ssim_index=" + line
-          + " " + to_string(timestamp_ms());
-        influxdb_client.post(log_line);
+          if (ts and ssim) {
+            summaries["ssim_summary"][tags].add(*ssim, *ts);
+          } else {
+            cerr << "Warning: invalid SSIM in " << filepath << endl;
+          }
+        }
       }
     }
   );
@@ -102,14 +208,13 @@ void report_ssim(const string & channel_name,
 
 void report_video_size(const string & channel_name,
                        const string & vformat,
-                       Inotify & inotify,
-                       InfluxDBClient & influxdb_client)
+                       Inotify & inotify)
 {
   fs::path channel_path = media_dir / channel_name;
   string video_dir = channel_path / "ready" / vformat;
 
   inotify.add_watch(video_dir, IN_MOVED_TO,
-    [channel_name, vformat, video_dir, &influxdb_client]
+    [tags = "channel=" + channel_name + ",format=" + vformat, video_dir]
     (const inotify_event & event, const string & path) {
       /* only interested in regular files that are moved into the dir */
       if (not (event.mask & IN_MOVED_TO) or (event.mask & IN_ISDIR)) {
@@ -121,18 +226,21 @@ void report_video_size(const string & channel_name,
 
       fs::path filepath = fs::path(path) / event.name;
       if (filepath.extension() == ".m4s") {
-        string ts = filepath.stem();
+        const auto ts = parse_number<uint64_t>(filepath.stem().native());
         const auto filesize = fs::file_size(filepath);
 
-        string log_line = "video_size,channel=" + channel_name + ",format="
-          + vformat + " timestamp=" + ts + "i,size=" + to_string(filesize)
-          + "i " + to_string(timestamp_ms());
-        influxdb_client.post(log_line);
+        if (ts) {
+          summaries["video_size_summary"][tags].add(filesize, *ts);
+        }
       }
     }
   );
 }
 
+/* the counters of the stages of a channel, mapped as their notifiers create
+ * them; key: channel name, then stage */
+static map<string, map<string, StageStats>> stage_stats;
+
 void report_backlog(const set<string> & channel_set,
                     Poller & poller,
                     Timerfd & timer,
@@ -145,32 +253,41 @@ void report_backlog(const set<string> & channel_set,
         return ResultType::Continue;
       }
 
+      /* the files reported since the timer last fired */
+      post_summaries(influxdb_client);
+
+      const string now = to_string(timestamp_ms());
+      string payload;
+
       for (const auto & channel_name : channel_set) {
-        fs::path channel_path = media_dir / channel_name;
-        string working_dir = channel_path / "working";
-        string canonical_dir = channel_path / "working/video-canonical";
-
-        unsigned int working_cnt = 0;
-        for (const auto & entry : fs::recursive_directory_iterator(working_dir)) {
-          if (fs::is_regular_file(entry)) {
-            working_cnt++;
+        auto & channel_stats = stage_stats[channel_name];
+
+        /* a file per stage, mapped once: unlike working/, the directory
+         * is small and does not change after the stages have started */
+        const fs::path stats_dir = media_dir / channel_name / "stats";
+        if (fs::exists(stats_dir)) {
+          for (const auto & entry : fs::directory_iterator(stats_dir)) {
+            const string stage = entry.path().stem();
+            if (entry.path().extension() == ".stats" and
+                channel_stats.count(stage) == 0) {
+              channel_stats.try_emplace(stage, entry.path());
+            }
           }
         }
 
-        unsigned int canonical_cnt = 0;
-        for (const auto & entry : fs::recursive_directory_iterator(canonical_dir)) {
-          if (fs::is_regular_file(entry)) {
-            canonical_cnt++;
-          }
-        }
+        for (const auto & [stage, stats] : channel_stats) {
+          const auto counts = stats.counts();
 
-        string log_line = "backlog,channel=" + channel_name
-          + " working_cnt=" + to_string(working_cnt)
-          + "i,canonical_cnt=" + to_string(canonical_cnt)
-          + "i " + to_string(timestamp_ms());
-        influxdb_client.post(log_line);
+          payload += "stage_backlog,channel=" + channel_name + ",stage="
+            + stage + " started=" + to_string(counts.started)
+            + "i,finished=" + to_string(counts.finished)
+            + "i,in_progress=" + to_string(counts.in_progress())
+            + "i " + now + "\n";
+        }
       }
 
+      influxdb_client.post(payload);
+
       return ResultType::Continue;
     }
   ));
@@ -202,7 +319,7 @@ int main(int argc, char * argv[])
   const auto & influx = config["influxdb_connection"];
   InfluxDBClient influxdb_client(
       poller,
-      {influx["host"].as<string>(), to_string(influx["port"].as<uint16_t>())},
+      influx["host"].as<string>(), to_string(influx["port"].as<uint16_t>()),
       influx["dbname"].as<string>(),
       influx["user"].as<string>(),
       safe_getenv(influx["password"].as<string>()));
@@ -211,22 +328,21 @@ int main(int argc, char * argv[])
     const auto & channel_config = config["channel_configs"][channel_name];
 
     /* report .y4m.info files */
-    report_decoder_info(channel_name, inotify, influxdb_client);
+    report_decoder_info(channel_name, inotify);
 
     vector<VideoFormat> vformats = channel_video_formats(channel_config);
 
     for (const auto & vformat : vformats) {
       /* report SSIM indices */
-      report_ssim(channel_name, vformat.to_string(),
-                  inotify, influxdb_client);
+      report_ssim(channel_name, vformat.to_string(), inotify);
 
       /* report video sizes */
-      report_video_size(channel_name, vformat.to_string(),
-                        inotify, influxdb_client);
+      report_video_size(channel_name, vformat.to_string(), inotify);
     }
   }
 
-  /* create a periodic timer that fires every minute to report backlog sizes */
+  /* create a periodic timer that fires every minute to report backlog sizes
+   * and the summaries of the files */
   Timerfd timer;
   report_backlog(channel_set, poller, timer, influxdb_client);
   timer.start(TIMER_PERIOD_MS, TIMER_PERIOD_MS);
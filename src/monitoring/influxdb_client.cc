@@ -1,79 +1,350 @@
 #include "influxdb_client.hh"
 
+#include <zlib.h>
+#include <algorithm>
+#include <cctype>
+#include <fstream>
 #include <iostream>
+#include <sstream>
+
 #include "http_request.hh"
+#include "http_response.hh"
+#include "exception.hh"
 
 using namespace std;
 using namespace PollerShortNames;
 
+static string gzip(const string & data)
+{
+  z_stream stream {};
+
+  /* 15 + 16: a gzip header rather than a zlib one */
+  if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16,
+                   8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    throw runtime_error("gzip: deflateInit2 failed");
+  }
+
+  string ret(deflateBound(&stream, data.size()), '\0');
+
+  stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+  stream.avail_in = data.size();
+  stream.next_out = reinterpret_cast<Bytef *>(ret.data());
+  stream.avail_out = ret.size();
+
+  const int status = deflate(&stream, Z_FINISH);
+  ret.resize(stream.total_out);
+  deflateEnd(&stream);
+
+  if (status != Z_STREAM_END) {
+    throw runtime_error("gzip: deflate failed");
+  }
+
+  return ret;
+}
+
 InfluxDBClient::InfluxDBClient(Poller & poller,
-                               const Address & address,
+                               const string & host,
+                               const string & service,
                                const string & database,
                                const string & user,
-                               const string & password)
+                               const string & password,
+                               const fs::path & spill_dir)
+  : poller_(poller), resolver_(poller), host_(host), service_(service),
+    database_(database),
+    user_(user), password_(password), spill_dir_(spill_dir)
 {
-  influxdb_addr_ = address;
-  sock_.connect(influxdb_addr_);
+  /* pick up the batches spilled by a previous run */
+  if (not spill_dir_.empty()) {
+    fs::create_directories(spill_dir_);
+
+    vector<fs::path> spilled;
+    for (const auto & file : fs::directory_iterator(spill_dir_)) {
+      const string name = file.path().filename();
+      if (not name.empty() and isdigit(name.front())) {
+        spilled.emplace_back(file.path());
+      }
+    }
 
-  database_ = database;
-  user_ = user;
-  password_ = password;
+    /* the names of the files start with a zero-padded sequence number */
+    sort(spilled.begin(), spilled.end());
+    for (const auto & path : spilled) {
+      spilled_.emplace_back(path);
+      next_spill_id_ = max<uint64_t>(next_spill_id_,
+                                     stoull(path.filename()) + 1);
+    }
+  }
 
-  poller.add_action(Poller::Action(sock_, Direction::In,
+  poller_.add_action(Poller::Action(retry_timer_, Direction::In,
     [this]()->Result {
-      /* must read HTTP responses from InfluxDB, then basically ignore them */
-      const string response = sock_.read();
-      if (response.empty()) {
-        throw runtime_error("peer socket in InfluxDB has closed");
+      if (retry_timer_.expirations() > 0 and not sock_ and not resolving_) {
+        connect();
       }
 
       return ResultType::Continue;
     }
-  ));
+  ).named("influxdb_retry"));
+
+  connect();
+}
+
+void InfluxDBClient::connect()
+{
+  /* the poller has dropped the actions of the failed socket by now */
+  failed_sock_.reset();
+
+  resolving_ = true;
+  resolver_.resolve(host_, service_,
+    [this](const optional<Address> & address, const string & error) {
+      resolving_ = false;
+
+      if (not address) {
+        cerr << "InfluxDBClient: failed to resolve " << host_ << ": " << error
+             << "; retrying in " << retry_ms_ << " ms" << endl;
+        retry_timer_.start(retry_ms_);
+        retry_ms_ = min(retry_ms_ * 2, MAX_RETRY_MS);
+        return;
+      }
+
+      connect(*address);
+    }
+  );
+}
+
+void InfluxDBClient::connect(const Address & address)
+{
+  sock_ = make_unique<TCPSocket>();
+  parser_ = make_unique<HTTPResponseParser>();
+
+  /* do not block the poller on connecting; an error in connecting shows
+   * on the socket */
+  sock_->set_blocking(false);
 
-  poller.add_action(Poller::Action(sock_, Direction::Out,
+  try {
+    sock_->connect(address);
+  } catch (const unix_error & e) {
+    if (e.error_code() != EINPROGRESS) {
+      fail(e.what());
+      return;
+    }
+  }
+
+  poller_.add_action(Poller::Action(*sock_, Direction::In,
     [this]()->Result {
-      while (not buffer_.empty()) {
-        const string & data = buffer_.front();
-        /* convert to string_view to avoid copy */
-        string_view data_view = data;
-
-        /* set write_all to false because socket might be unable to write all */
-        const auto view_it = sock_.write(
-            data_view.substr(buffer_offset_), false);
-
-        if (view_it != data_view.cend()) {
-          /* save the offset of the remaining string */
-          buffer_offset_ = view_it - data_view.cbegin();
-          break;
-        } else {
-          /* move onto the next item in the deque */
-          buffer_offset_ = 0;
-          buffer_.pop_front();
+      const string data = sock_->read();
+      if (data.empty()) {
+        throw runtime_error("peer socket in InfluxDB has closed");
+      }
+
+      parser_->parse(data);
+      while (sock_ and not parser_->empty()) {
+        handle_response(parser_->front());
+
+        /* the connection might have failed on the response */
+        if (parser_) {
+          parser_->pop();
         }
       }
 
       return ResultType::Continue;
     },
+    []() { return true; },
+    [this]() { fail("connection error"); },
+    false
+  ).named("influxdb_in"));
+
+  poller_.add_action(Poller::Action(*sock_, Direction::Out,
+    [this]()->Result {
+      /* fill the socket with the requests that can be pipelined */
+      while (in_flight_.size() < MAX_IN_FLIGHT and send_next_batch()) {}
+
+      const string_view data = send_buffer_;
+      const auto view_it = sock_->write(data.substr(send_offset_), false);
+      send_offset_ = view_it - data.cbegin();
+
+      if (send_offset_ == send_buffer_.size()) {
+        send_buffer_.clear();
+        send_offset_ = 0;
+      }
+
+      return ResultType::Continue;
+    },
     [this]()->bool {
-      return not buffer_.empty();
-    }
-  ));
+      return not send_buffer_.empty() or
+             (in_flight_.size() < MAX_IN_FLIGHT and
+              (not queue_.empty() or not spilled_.empty() or
+               not pending_.empty()));
+    },
+    [this]() { fail("connection error"); },
+    false
+  ).named("influxdb_out"));
+}
+
+void InfluxDBClient::fail(const string & reason)
+{
+  if (not sock_) {
+    return;
+  }
+
+  cerr << "InfluxDBClient: " << reason << "; retrying in " << retry_ms_
+       << " ms" << endl;
+
+  poller_.remove_fd(sock_->fd_num());
+  failed_sock_ = move(sock_);
+  parser_.reset();
+
+  /* resend what has not been acknowledged, in order */
+  while (not in_flight_.empty()) {
+    queued_bytes_ += in_flight_.back().body.size();
+    queue_.emplace_front(move(in_flight_.back()));
+    in_flight_.pop_back();
+  }
+
+  send_buffer_.clear();
+  send_offset_ = 0;
+
+  retry_timer_.start(retry_ms_);
+  retry_ms_ = min(retry_ms_ * 2, MAX_RETRY_MS);
 }
 
 void InfluxDBClient::post(const string & payload,
                           const std::string & precision)
 {
+  if (payload.empty()) {
+    return;
+  }
+
+  if (not pending_.empty() and precision != pending_precision_) {
+    close_batch();
+  }
+
+  pending_ += payload;
+  pending_precision_ = precision;
+
+  if (pending_.size() >= TARGET_BODY_SIZE) {
+    close_batch();
+  }
+}
+
+void InfluxDBClient::close_batch()
+{
+  if (pending_.empty()) {
+    return;
+  }
+
+  enqueue({pending_precision_, gzip(pending_)});
+  pending_.clear();
+}
+
+void InfluxDBClient::enqueue(Batch && batch)
+{
+  queued_bytes_ += batch.body.size();
+  queue_.emplace_back(move(batch));
+
+  /* keep the oldest batches in memory, as they are to be sent next */
+  while (queued_bytes_ > MAX_QUEUED_BYTES and queue_.size() > 1) {
+    Batch & newest = queue_.back();
+
+    if (spill_dir_.empty()) {
+      drop(queue_.front(), "too much data queued");
+      queued_bytes_ -= queue_.front().body.size();
+      queue_.pop_front();
+      continue;
+    }
+
+    /* e.g., 00000000000000000042.ms */
+    ostringstream name;
+    name.width(20);
+    name.fill('0');
+    name << next_spill_id_++;
+    const fs::path path = spill_dir_ / (name.str() + "." + newest.precision);
+
+    ofstream(path, ios::binary) << newest.body;
+    spilled_.emplace_back(path);
+
+    queued_bytes_ -= newest.body.size();
+    queue_.pop_back();
+  }
+}
+
+bool InfluxDBClient::send_next_batch()
+{
+  if (queue_.empty() and spilled_.empty()) {
+    /* nothing else is waiting: send the batch being filled */
+    close_batch();
+  }
+
+  Batch batch;
+
+  if (not queue_.empty()) {
+    batch = move(queue_.front());
+    queue_.pop_front();
+    queued_bytes_ -= batch.body.size();
+  } else if (not spilled_.empty()) {
+    batch.spill_path = spilled_.front();
+    batch.precision = batch.spill_path.extension().string().substr(1);
+    spilled_.pop_front();
+
+    ifstream file(batch.spill_path, ios::binary);
+    batch.body.assign(istreambuf_iterator<char>(file),
+                      istreambuf_iterator<char>());
+  } else {
+    return false;
+  }
+
   HTTPRequest request;
   request.set_first_line("POST /write?db=" + database_ + "&u=" + user_ + "&p="
-                         + password_ + "&precision=" + precision + " HTTP/1.1");
+                         + password_ + "&precision=" + batch.precision
+                         + " HTTP/1.1");
 
-  request.add_header(HTTPHeader{"Host", influxdb_addr_.str()});
+  request.add_header(HTTPHeader{"Host", host_ + ":" + service_});
   request.add_header(HTTPHeader{"Content-Type",
                                 "application/x-www-form-urlencoded"});
+  request.add_header(HTTPHeader{"Content-Encoding", "gzip"});
   request.add_header(HTTPHeader{"Content-Length",
-                                to_string(payload.size())});
+                                to_string(batch.body.size())});
   request.done_with_headers();
-  request.read_in_body(payload);
-  buffer_.emplace_back(request.str());
+  request.read_in_body(batch.body);
+
+  parser_->new_request_arrived(request);
+  send_buffer_ += request.str();
+  in_flight_.emplace_back(move(batch));
+
+  return true;
+}
+
+void InfluxDBClient::handle_response(const HTTPResponse & response)
+{
+  if (in_flight_.empty()) {
+    throw runtime_error("InfluxDBClient: response without a request");
+  }
+
+  const string status = response.status_code();
+
+  if (status.front() == '2') {
+    if (not in_flight_.front().spill_path.empty()) {
+      fs::remove(in_flight_.front().spill_path);
+    }
+
+    in_flight_.pop_front();
+    retry_ms_ = MIN_RETRY_MS;
+  } else if (status.front() == '5' or status == "429") {
+    /* InfluxDB is unavailable or overloaded: back off and resend */
+    fail("InfluxDB responded " + status);
+  } else {
+    drop(in_flight_.front(), "InfluxDB responded " + status + ": "
+                             + response.body());
+    in_flight_.pop_front();
+  }
+}
+
+void InfluxDBClient::drop(const Batch & batch, const string & reason)
+{
+  if (not batch.spill_path.empty()) {
+    fs::remove(batch.spill_path);
+  }
+
+  if (num_dropped_++ % 100 == 0) {
+    cerr << "InfluxDBClient: dropped a batch (" << reason << "); "
+         << num_dropped_ << " dropped so far" << endl;
+  }
 }
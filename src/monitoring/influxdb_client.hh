@@ -1,29 +1,103 @@
 #include <string>
 #include <deque>
+#include <memory>
 
 #include "socket.hh"
+#include "dns_resolver.hh"
 #include "poller.hh"
+#include "timerfd.hh"
+#include "filesystem.hh"
+#include "http_response_parser.hh"
 
+/* Writes points to InfluxDB without ever blocking the poller. Payloads are
+ * batched into gzip-compressed requests of about TARGET_BODY_SIZE (a batch
+ * is closed when it is full or when nothing else is waiting to be sent) and
+ * pipelined over a keep-alive connection. Each response is matched to its
+ * request: a batch is retried on a 5xx or 429, or if the connection fails
+ * (which is reconnected with exponential backoff), and dropped on any other
+ * error. At most MAX_QUEUED_BYTES of compressed batches are kept in memory;
+ * beyond that, batches are spilled to files in spill_dir (and picked up
+ * from there after a restart), or the oldest are dropped without one. The
+ * host is resolved off the event loop on each connection (see DNSResolver),
+ * so that a reconnection follows a changed address. */
 class InfluxDBClient
 {
 public:
+  static constexpr size_t TARGET_BODY_SIZE = 1 << 20;  /* uncompressed */
+  static constexpr size_t MAX_QUEUED_BYTES = 32 << 20;
+  static constexpr size_t MAX_IN_FLIGHT = 4;
+  static constexpr unsigned int MIN_RETRY_MS = 1000;
+  static constexpr unsigned int MAX_RETRY_MS = 30000;
+
   InfluxDBClient(Poller & poller,
-                 const Address & address,
+                 const std::string & host,
+                 const std::string & service,
                  const std::string & database,
                  const std::string & user,
-                 const std::string & password);
+                 const std::string & password,
+                 const fs::path & spill_dir = {});
 
   void post(const std::string & payload,
             const std::string & precision = "ms");
 
+  /* bytes waiting in memory to be sent */
+  size_t buffered_bytes() const { return queued_bytes_ + pending_.size(); }
+
 private:
-  Address influxdb_addr_ {};
-  TCPSocket sock_ {};
+  struct Batch {
+    std::string precision {};
+    std::string body {};     /* gzip-compressed */
+    fs::path spill_path {};  /* the file the batch was read from, if any */
+  };
+
+  Poller & poller_;
+  DNSResolver resolver_;
+  std::string host_ {};
+  std::string service_ {};
+  bool resolving_ {false};
 
   std::string database_ {};
   std::string user_ {};
   std::string password_ {};
 
-  std::deque<std::string> buffer_ {};
-  size_t buffer_offset_ {0};
+  /* the current connection, and the failed one that the poller may still
+   * refer to until it has removed its actions */
+  std::unique_ptr<TCPSocket> sock_ {};
+  std::unique_ptr<TCPSocket> failed_sock_ {};
+  std::unique_ptr<HTTPResponseParser> parser_ {};
+
+  Timerfd retry_timer_ {};
+  unsigned int retry_ms_ {MIN_RETRY_MS};
+
+  /* uncompressed lines of the batch being filled */
+  std::string pending_ {};
+  std::string pending_precision_ {};
+
+  std::deque<Batch> queue_ {};      /* closed, waiting to be sent */
+  std::deque<Batch> in_flight_ {};  /* sent, waiting for a response */
+  size_t queued_bytes_ {0};
+
+  /* the requests being written */
+  std::string send_buffer_ {};
+  size_t send_offset_ {0};
+
+  fs::path spill_dir_;
+  std::deque<fs::path> spilled_ {};  /* in order of spilling */
+  uint64_t next_spill_id_ {0};
+  uint64_t num_dropped_ {0};
+
+  /* resolve the host, then connect to it */
+  void connect();
+  void connect(const Address & address);
+  void fail(const std::string & reason);
+
+  /* close the pending batch */
+  void close_batch();
+  void enqueue(Batch && batch);
+
+  /* queue the next batch for sending; false if there is none */
+  bool send_next_batch();
+
+  void handle_response(const HTTPResponse & response);
+  void drop(const Batch & batch, const std::string & reason);
 };
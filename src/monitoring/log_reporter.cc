@@ -1,163 +1,357 @@
 #include <cstdlib>
+#include <cstring>
 #include <fcntl.h>
 
 #include <iostream>
 #include <vector>
-#include <deque>
+#include <list>
+#include <functional>
+#include <map>
+#include <unordered_map>
 #include <string>
+#include <string_view>
 #include <fstream>
+#include <optional>
 
 #include "util.hh"
+#include "tokenize.hh"
+#include "strict_conversions.hh"
 #include "yaml-cpp/yaml.h"
 #include "inotify.hh"
 #include "poller.hh"
 #include "file_descriptor.hh"
 #include "filesystem.hh"
-#include "tokenize.hh"
 #include "exception.hh"
 #include "formatter.hh"
 #include "influxdb_client.hh"
 #include "timestamp.hh"
+#include "timerfd.hh"
+#include "binary_log.hh"
+#include "profiler.hh"
 
 using namespace std;
 using namespace PollerShortNames;
 
-/* payload data format to post to DB (a "format string" in a vector) */
-static Formatter formatter;
+/* bounds of a batch of points posted to DB */
+static constexpr size_t MAX_PAYLOAD_SIZE = 1 << 20;
+static constexpr unsigned int POST_INTERVAL_MS = 500;
 
 void print_usage(const string & program_name)
 {
   cerr <<
-  "Usage: " << program_name << " <YAML configuration> <log format> <log path>"
-  << endl;
+  "Usage: " << program_name << " <YAML configuration> <log format> <log path> "
+  "[<log format> <log path>...]" << endl;
 }
 
-tuple<string, string> enforce_unique(const string & line,
-                                     deque<uint64_t> & unique_ns)
+/* Gives the points of a measurement unique timestamps in ns, so that points
+ * in the same ms do not overwrite each other in InfluxDB: the n-th point in
+ * a millisecond gets ms * MILLION + n. The counts are kept per ms and expired
+ * a second at a time once EXPIRY_MS older than the newest point, so points
+ * need not arrive in order (e.g., from several writer threads). */
+class UniqueTimestamps
 {
-  auto last_space = line.rfind(' ');
-  string before_last_space = line.substr(0, last_space);
-  string orig_ts_str = line.substr(last_space + 1);
+public:
+  static constexpr uint64_t EXPIRY_MS = 60 * 1000;
+
+  uint64_t assign(const uint64_t ts_ms)
+  {
+    auto [it, inserted] = counts_.emplace(ts_ms, 0);
+    if (inserted) {
+      buckets_[ts_ms / 1000].push_back(ts_ms);
+    }
 
-  const uint64_t orig_ts_ns = stoll(orig_ts_str) * MILLION;  /* ms -> ns */
+    if (it->second >= MILLION) {
+      throw runtime_error("UniqueTimestamps: too many points in "
+                          + to_string(ts_ms));
+    }
 
-  /* pop if ts in ms < orig_new_ts in ms */
-  while (not unique_ns.empty()) {
-    const auto ts_ns = unique_ns.front();
-    if (ts_ns / MILLION < orig_ts_ns / MILLION) {
-      unique_ns.pop_front();
-    } else {
-      break;
+    const uint64_t ts_ns = ts_ms * MILLION + it->second++;
+
+    newest_ms_ = max(newest_ms_, ts_ms);
+    while (not buckets_.empty() and
+           (buckets_.begin()->first + 1) * 1000 + EXPIRY_MS <= newest_ms_) {
+      for (const uint64_t ms : buckets_.begin()->second) {
+        counts_.erase(ms);
+      }
+      buckets_.erase(buckets_.begin());
     }
+
+    return ts_ns;
   }
 
-  /* increment the last ts in unique_ns by 1 ns */
-  uint64_t new_ts_ns = orig_ts_ns;
-  if (not unique_ns.empty()) {
-    const auto ts_ns = unique_ns.back();
+private:
+  unordered_map<uint64_t, uint64_t> counts_ {};  /* key: ms */
+  map<uint64_t, vector<uint64_t>> buckets_ {};   /* key: s; value: ms */
+  uint64_t newest_ms_ {0};
+};
 
-    if ((ts_ns + 1) / MILLION != new_ts_ns / MILLION) {
-      throw runtime_error("enforce_unique: " + to_string(ts_ns) +
-                          ", " + to_string(new_ts_ns));
+/* A log being tailed, whose lines (or blocks of a binary log) are formatted
+ * into points of its measurement. A log rotated by LogWriter is read to its
+ * end, then reopened by reopen_if_rotated(), as its path is a new log. */
+class LogTail
+{
+public:
+  /* the points go to payload, which post_payload() posts once full */
+  LogTail(Inotify & inotify, const string & log_format,
+          const string & log_path, string & payload,
+          const function<void()> & post_payload)
+    : inotify_(inotify), path_(log_path),
+      payload_(payload), post_payload_(post_payload)
+  {
+    /* read a line specifying log format and pass into string formatter */
+    ifstream format_ifstream(log_format);
+    string format_string;
+    getline(format_ifstream, format_string);
+    formatter_.parse(format_string);
+
+    const string measurement = format_string.substr(0, format_string.find(','));
+
+    /* enforce uniqueness for the crucial measurements below */
+    crucial_ = (measurement == "client_buffer" ||
+                measurement == "video_acked" ||
+                measurement == "video_sent");
+  }
+
+  /* open the log and watch it from its end */
+  void open()
+  {
+    fd_.emplace(CheckSystemCall("open (" + path_ + ")",
+                                ::open(path_.c_str(), O_RDONLY)));
+
+    /* a binary log (see binary_log.hh) starts with its header; the format of
+     * a log that is still empty is told by its first content */
+    decoder_.reset();
+    format_known_ = fd_->filesize() > 0;
+    if (format_known_) {
+      const auto header = BinaryLog::parse_header(fd_->read());
+      if (header) {
+        decoder_.emplace(header->first);
+      }
     }
 
-    new_ts_ns = ts_ns + 1;
+    fd_->seek(0, SEEK_END);
+    buf_.clear();
+    rotated_ = false;
+
+    wd_ = inotify_.add_watch(path_, IN_MODIFY | IN_CLOSE_WRITE,
+      [this](const inotify_event & event, const string &) {
+        /* read all there is, which is more than one read if behind; a
+         * rotated log (see LogWriter) is read to its end first, as it is
+         * renamed to a partition file and compressed, not tailed again */
+        if (event.mask & (IN_MODIFY | IN_CLOSE_WRITE)) {
+          read_to_end();
+        }
+
+        if (event.mask & IN_CLOSE_WRITE) {
+          /* old log was closed; open and watch new log after this batch */
+          rotated_ = true;
+        }
+      },
+      /* catch up on what the missed events announced */
+      [this](const string &) { read_to_end(); }
+    );
   }
-  unique_ns.push_back(new_ts_ns);
-
-  if (new_ts_ns == orig_ts_ns) {
-    /* no duplicate timestamp exists */
-    return make_tuple(line, "ms");
-  } else {
-    /* duplicate timestamp exists; post the incremented timestamp */
-    string new_line = before_last_space + " " + to_string(new_ts_ns);
-    return make_tuple(new_line, "ns");
+
+  /* once the events of a batch have been handled */
+  void reopen_if_rotated()
+  {
+    if (rotated_) {
+      inotify_.rm_watch(wd_);
+      open();
+    }
   }
-}
 
-int tail_loop(const YAML::Node & config, const string & log_path,
-              const string & measurement)
-{
-  /* enforce uniqueness for the crucial measurements below */
-  bool crucial_measurements = (measurement == "client_buffer" ||
-                               measurement == "video_acked" ||
-                               measurement == "video_sent");
-  deque<uint64_t> unique_ns;
+private:
+  Inotify & inotify_;
+  string path_;
+
+  string & payload_;
+  function<void()> post_payload_;
+
+  /* payload data format to post to DB (a "format string" in a vector) */
+  Formatter formatter_ {};
+  bool crucial_ {false};
+  UniqueTimestamps unique_timestamps_ {};
+
+  optional<FileDescriptor> fd_ {};
+  int wd_ {-1};
+  bool rotated_ {false};  /* whether log rotation happened */
+
+  optional<BinaryLogDecoder> decoder_ {};
+  bool format_known_ {false};
+  string buf_ {};  /* content read from the log but not yet made into points */
+
+  vector<string_view> values_ {};
+  vector<vector<string>> decoded_lines_ {};
+
+  void read_to_end()
+  {
+    for (;;) {
+      const string new_content = fd_->read();
+      if (new_content.empty()) {
+        break;
+      }
+
+      buf_ += new_content;
+      consume_buf();
+    }
+  }
+
+  /* make points of the complete lines (or blocks) in buf_ */
+  void consume_buf()
+  {
+    if (not format_known_) {
+      const auto header = BinaryLog::parse_header(buf_);
+      const auto magic = BinaryLog::MAGIC.substr(0, buf_.size());
+
+      if (header) {
+        decoder_.emplace(header->first);
+        buf_.erase(0, header->second);
+      } else if (buf_.compare(0, magic.size(), magic) == 0) {
+        /* wait for the rest of the header */
+        return;
+      }
+      format_known_ = true;
+    }
 
+    size_t consumed = 0;
+
+    if (decoder_) {
+      /* decode the complete blocks */
+      decoded_lines_.clear();
+      consumed = decoder_->decode(buf_, decoded_lines_);
+
+      for (const auto & line_values : decoded_lines_) {
+        add_line(line_values);
+      }
+    } else {
+      /* scan for complete lines */
+      const char * data = buf_.data();
+      const void * newline;
+
+      while ((newline = memchr(data + consumed, '\n',
+                               buf_.size() - consumed)) != nullptr) {
+        const size_t line_end = static_cast<const char *>(newline) - data;
+        split(string_view(data + consumed, line_end - consumed), ",",
+              values_);
+        add_line(values_);
+
+        consumed = line_end + 1;
+      }
+    }
+
+    /* keep only the incomplete line (or block) */
+    buf_.erase(0, consumed);
+  }
+
+  /* format the values of a line into payload_, with its timestamp in ns (the
+   * precision of all the points, so that the points of all the logs can be
+   * batched together) */
+  template<class Values>
+  void add_line(const Values & values)
+  {
+    const size_t line_start = payload_.size();
+
+    try {
+      formatter_.format_to(payload_, values);
+
+      /* the timestamp in ms is the last field */
+      const size_t last_space = payload_.rfind(' ');
+      if (last_space == string::npos or last_space < line_start) {
+        throw runtime_error("no timestamp");
+      }
+
+      const auto ts_ms = parse_number<uint64_t>(
+        string_view(payload_).substr(last_space + 1));
+      if (not ts_ms) {
+        throw runtime_error("invalid timestamp");
+      }
+
+      payload_.resize(last_space + 1);
+      if (crucial_) {
+        /* replace it with a unique one */
+        payload_ += to_string(unique_timestamps_.assign(*ts_ms));
+      } else {
+        payload_ += to_string(*ts_ms * MILLION);
+      }
+
+      payload_ += '\n';
+    } catch (const exception & e) {
+      payload_.resize(line_start);
+      print_exception("log_reporter: skipped a line", e);
+    }
+
+    if (payload_.size() >= MAX_PAYLOAD_SIZE) {
+      post_payload_();
+    }
+  }
+};
+
+/* tail all the logs in a single event loop, which posts their points to DB
+ * over a single connection in shared batches */
+int tail_loop(const YAML::Node & config,
+              const vector<pair<string, string>> & logs)
+{
   Poller poller;
   Inotify inotify(poller);
 
   const auto & influx = config["influxdb_connection"];
   InfluxDBClient influxdb_client(
       poller,
-      {influx["host"].as<string>(), to_string(influx["port"].as<uint16_t>())},
+      influx["host"].as<string>(), to_string(influx["port"].as<uint16_t>()),
       influx["dbname"].as<string>(),
       influx["user"].as<string>(),
-      safe_getenv(influx["password"].as<string>()));
+      safe_getenv(influx["password"].as<string>()),
+      /* batches that InfluxDB cannot take in time wait on disk (in a
+       * directory named after the first log) */
+      influx["spill_dir"] ?
+      fs::path(influx["spill_dir"].as<string>())
+        / fs::path(logs.front().second).filename()
+      : fs::path());
+
+  /* lines are posted in batches of up to MAX_PAYLOAD_SIZE bytes, at least
+   * every POST_INTERVAL_MS */
+  string payload;
+
+  const function<void()> post_payload = [&influxdb_client, &payload]() {
+    if (not payload.empty()) {
+      influxdb_client.post(payload, "ns");
+      payload.clear();
+    }
+  };
 
-  bool log_rotated = false;  /* whether log rotation happened */
-  string buf;  /* used to assemble content read from the log into lines */
+  Timerfd post_timer;
+  post_timer.start(POST_INTERVAL_MS, POST_INTERVAL_MS);
 
-  for (;;) {
-    FileDescriptor fd(CheckSystemCall("open (" + log_path + ")",
-                                      open(log_path.c_str(), O_RDONLY)));
-    fd.seek(0, SEEK_END);
-
-    int wd = inotify.add_watch(log_path, IN_MODIFY | IN_CLOSE_WRITE,
-      [&log_rotated, &buf, &fd, &influxdb_client,
-       crucial_measurements, &unique_ns]
-      (const inotify_event & event, const string &) {
-        if (event.mask & IN_MODIFY) {
-          string new_content = fd.read();
-          if (new_content.empty()) {
-            /* return if nothing more to read */
-            return;
-          }
-          buf += new_content;
-
-          /* find new lines iteratively */
-          size_t pos = 0;
-          string payload;
-
-          while ((pos = buf.find("\n")) != string::npos) {
-            const string & line = buf.substr(0, pos);
-            vector<string> values = split(line, ",");
-
-            /* enforce data uniqueness for crucial measurements */
-            if (crucial_measurements) {
-              auto [new_line, precision] = enforce_unique(
-                  formatter.format(values), unique_ns);
-              if (precision == "ms") {
-                payload += new_line + "\n";
-              } else {
-                /* post data points with other time precisions immediately */
-                influxdb_client.post(new_line, precision);
-              }
-            } else {
-              payload += formatter.format(values) + "\n";
-            }
-
-            buf = buf.substr(pos + 1);
-          }
-
-          /* post aggregated lines (with time precision 'ms') */
-          influxdb_client.post(payload);
-        } else if (event.mask & IN_CLOSE_WRITE) {
-          /* old log was closed; open and watch new log in next loop */
-          log_rotated = true;
-        }
+  poller.add_action(Poller::Action(post_timer, Direction::In,
+    [&post_timer, &post_payload]()->Result {
+      if (post_timer.expirations() > 0) {
+        post_payload();
       }
-    );
 
-    while (not log_rotated) {
-      auto ret = poller.poll(-1);
-      if (ret.result != Poller::Result::Type::Success) {
-        return ret.exit_status;
+      return ResultType::Continue;
+    }
+  ));
+
+  list<LogTail> tails;
+  for (const auto & [log_format, log_path] : logs) {
+    tails.emplace_back(inotify, log_format, log_path, payload, post_payload)
+      .open();
+  }
+
+  inotify.add_batch_callback(
+    [&tails]() {
+      for (auto & tail : tails) {
+        tail.reopen_if_rotated();
       }
     }
+  );
 
-    inotify.rm_watch(wd);
-    log_rotated = false;
+  for (;;) {
+    auto ret = poller.poll(-1);
+    if (ret.result != Poller::Result::Type::Success) {
+      return ret.exit_status;
+    }
   }
 
   return EXIT_SUCCESS;
@@ -169,7 +363,7 @@ int main(int argc, char * argv[])
     abort();
   }
 
-  if (argc != 4) {
+  if (argc < 4 or argc % 2 != 0) {
     print_usage(argv[0]);
     return EXIT_FAILURE;
   }
@@ -180,23 +374,22 @@ int main(int argc, char * argv[])
     return EXIT_FAILURE;
   }
 
-  string log_format(argv[2]);
-  string log_path(argv[3]);
+  /* pairs of log format and log path */
+  vector<pair<string, string>> logs;
+  for (int i = 2; i < argc; i += 2) {
+    const string log_path(argv[i + 1]);
 
-  /* create an empty log if it does not exist */
-  FileDescriptor touch(CheckSystemCall("open (" + log_path + ")",
-                       open(log_path.c_str(), O_WRONLY | O_CREAT, 0644)));
-  touch.close();
+    /* create an empty log if it does not exist */
+    FileDescriptor touch(CheckSystemCall("open (" + log_path + ")",
+                         open(log_path.c_str(), O_WRONLY | O_CREAT, 0644)));
+    touch.close();
 
-  /* read a line specifying log format and pass into string formatter */
-  ifstream format_ifstream(log_format);
-  string format_string;
-  getline(format_ifstream, format_string);
-  formatter.parse(format_string);
+    logs.emplace_back(argv[i], log_path);
+  }
 
-  auto comma_pos = format_string.find(',');
-  string measurement = format_string.substr(0, comma_pos);
+  /* profile the CPU on SIGUSR2 if PROFILER_DIR is set */
+  Profiler::install_from_env();
 
   /* read new lines from logs and post to InfluxDB */
-  return tail_loop(config, log_path, measurement);
+  return tail_loop(config, logs);
 }
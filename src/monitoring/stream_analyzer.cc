@@ -0,0 +1,635 @@
+#include <getopt.h>
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "exception.hh"
+#include "filesystem.hh"
+#include "log_reader.hh"
+#include "strict_conversions.hh"
+#include "thread_pool.hh"
+#include "timestamp.hh"
+
+using namespace std;
+
+/* the columns are arrays in host byte order, which readers take to be
+ * little-endian (e.g., numpy.fromfile(path, '<f8')) */
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__,
+              "columns must be written little-endian");
+
+void print_usage(const string & program_name)
+{
+  cerr <<
+  "Usage: " << program_name << " [options] -o <output dir> <log>...\n\n"
+  "Reconstruct the streams in the video_sent, video_acked and client_buffer\n"
+  "logs of ws_media_server (text or binary), as scripts/stream_processor.py\n"
+  "does from InfluxDB, and write the metrics of each stream as a row of a\n"
+  "table in columns: a file per column in <output dir> and its \"schema\".\n"
+  "A <log> is a log, e.g., client_buffer.3.log.old, or a directory of logs;\n"
+  "the logs of a server are read in one pass, and servers in parallel.\n\n"
+  "Options:\n"
+  "-o, --output <dir>         directory to write the columns into\n"
+  "-j, --threads <N>          servers to process at once (default: # of CPUs)\n"
+  "-f, --from <time>          skip lines before <time> (UTC), e.g., 2026-10-01\n"
+  "                           or 2026-10-01T12:00:00Z\n"
+  "-t, --to <time>            skip lines from <time> on"
+  << endl;
+}
+
+enum Measurement { VIDEO_SENT, VIDEO_ACKED, CLIENT_BUFFER };
+
+static const vector<string> MEASUREMENTS = {
+  "video_sent", "video_acked", "client_buffer"
+};
+
+/* as in scripts/stream_processor.py: a session ends after a minute without
+ * lines, and its rebuffering is not trusted after a gap, a long stretch of
+ * low buffer or a stall with a full buffer (i.e., of the video decoder) */
+static constexpr uint64_t SESSION_EXPIRY_MS = 60 * 1000;
+static constexpr uint64_t MAX_GAP_MS = 60 * 1000;
+static constexpr uint64_t MAX_LOW_BUFFER_MS = 30 * 1000;
+static constexpr double LOW_BUFFER_S = 0.1;
+static constexpr double STALL_BUFFER_S = 5;
+static constexpr double STALL_REBUFFER_S = 0.25;
+
+/* how often the sessions are checked for expiry, in log time */
+static constexpr uint64_t EXPIRY_INTERVAL_MS = 1000;
+
+/* a session of a client, as stream_processor.py tells them apart */
+struct SessionKey
+{
+  string user {};
+  uint64_t init_id {0};
+  uint64_t expt_id {0};
+
+  bool operator==(const SessionKey & other) const
+  {
+    return init_id == other.init_id and expt_id == other.expt_id
+           and user == other.user;
+  }
+};
+
+struct SessionKeyHash
+{
+  size_t operator()(const SessionKey & key) const
+  {
+    return hash<string>()(key.user) ^ (key.init_id * 0x9e3779b97f4a7c15)
+           ^ (key.expt_id << 1);
+  }
+};
+
+/* a chunk of video, from video_sent and its video_acked */
+struct Chunk
+{
+  uint64_t sent_ms;
+  uint64_t size;            /* bytes */
+  double ssim_index;
+  uint64_t delivery_rate;   /* bytes/s */
+  uint64_t min_rtt;         /* us */
+  optional<uint64_t> acked_ms {};
+};
+
+struct Session
+{
+  uint64_t server_id {};
+  string channel {};
+  uint64_t first_ms {}, last_ms {};
+
+  /* client_buffer, as BufferStream of stream_processor.py */
+  bool has_buffer {false};
+  const char * invalid_reason {nullptr};
+  optional<uint64_t> min_play_ms {}, max_play_ms {};
+  optional<double> min_cum_rebuf {}, max_cum_rebuf {};
+  bool is_rebuffer {true};
+  uint64_t num_rebuf {0};
+  optional<uint64_t> last_buffer_ms {}, last_low_buffer_ms {};
+  optional<double> last_buffer {}, last_cum_rebuf {};
+
+  /* video_sent and video_acked, by video timestamp */
+  map<uint64_t, Chunk> chunks {};
+};
+
+/* the metrics of a session, a row of the output */
+struct StreamRow
+{
+  uint64_t server_id, expt_id, init_id;
+  string user, channel;
+  uint64_t start_ms, end_ms;
+
+  /* "valid", or why play_time to startup_delay are NaN */
+  string buffer_status;
+  double play_time;          /* s, from startup to the last play */
+  double cum_rebuf;          /* s, after startup */
+  uint64_t num_rebuf;
+  double startup_delay;      /* s */
+
+  /* every chunk sent; SSIM sums leave out an index of 1 as
+   * plot_ssim_rebuffer.py does, so that they add up across streams */
+  uint64_t sent_chunks;
+  double ssim_index_sum;
+  uint64_t ssim_count;
+
+  /* the chunks acked after a positive transmission time */
+  uint64_t acked_chunks, acked_bytes;
+  double trans_time_sum;     /* s */
+  double ssim_db_mean;
+  double ssim_db_variation;  /* mean change between consecutive chunks */
+  double delivery_rate_mean; /* bytes/s */
+  double min_rtt_mean;       /* s */
+};
+
+struct ServerResult
+{
+  vector<StreamRow> rows {};
+  uint64_t num_lines {0}, num_malformed {0};
+};
+
+/* [from_ms, to_ms) of the lines to analyze */
+struct TimeRange
+{
+  uint64_t from_ms {0};
+  uint64_t to_ms {UINT64_MAX};
+};
+
+static void add_buffer_point(Session & s, const uint64_t ts,
+                             const string_view event, const double buffer,
+                             const double cum_rebuf)
+{
+  s.has_buffer = true;
+  if (s.invalid_reason) {
+    return;
+  }
+
+  /* the session is still valid */
+  if (s.last_buffer_ms and ts > *s.last_buffer_ms + MAX_GAP_MS) {
+    s.invalid_reason = "nonconsecutive";
+    return;
+  }
+
+  if (s.last_low_buffer_ms and ts > *s.last_low_buffer_ms + MAX_LOW_BUFFER_MS) {
+    s.invalid_reason = "long_rebuffer";
+    return;
+  }
+
+  if (s.last_buffer and s.last_cum_rebuf and buffer > STALL_BUFFER_S
+      and *s.last_buffer > STALL_BUFFER_S
+      and cum_rebuf > *s.last_cum_rebuf + STALL_REBUFFER_S) {
+    s.invalid_reason = "decoding_stall";
+    return;
+  }
+
+  /* wait until startup */
+  if (not s.min_play_ms and event != "startup") {
+    return;
+  }
+
+  if (event == "startup") {
+    s.min_play_ms = ts;
+    s.min_cum_rebuf = cum_rebuf;
+    s.is_rebuffer = false;
+  } else if (event == "rebuffer") {
+    if (not s.is_rebuffer) {
+      s.num_rebuf++;
+    }
+    s.is_rebuffer = true;
+  } else if (event == "play") {
+    s.is_rebuffer = false;
+  }
+
+  if (not s.is_rebuffer) {
+    if (not s.max_play_ms or ts > *s.max_play_ms) {
+      s.max_play_ms = ts;
+    }
+
+    if (not s.max_cum_rebuf or cum_rebuf > *s.max_cum_rebuf) {
+      s.max_cum_rebuf = cum_rebuf;
+    }
+  }
+
+  s.last_buffer_ms = ts;
+  s.last_buffer = buffer;
+  s.last_cum_rebuf = cum_rebuf;
+  if (buffer > LOW_BUFFER_S) {
+    s.last_low_buffer_ms.reset();
+  } else if (not s.last_low_buffer_ms) {
+    s.last_low_buffer_ms = ts;
+  }
+}
+
+/* the row of an ended session; nullopt if there is nothing to report */
+static optional<StreamRow> finish_session(const SessionKey & key,
+                                          const Session & s)
+{
+  if (not s.has_buffer and s.chunks.empty()) {
+    return nullopt;
+  }
+
+  StreamRow row {};
+  row.server_id = s.server_id;
+  row.expt_id = key.expt_id;
+  row.init_id = key.init_id;
+  row.user = key.user;
+  row.channel = s.channel;
+  row.start_ms = s.first_ms;
+  row.end_ms = s.last_ms;
+
+  if (not s.has_buffer) {
+    row.buffer_status = "no_client_buffer";
+  } else if (s.invalid_reason) {
+    row.buffer_status = s.invalid_reason;
+  } else if (not s.min_play_ms or not s.max_play_ms) {
+    row.buffer_status = "no_startup";
+  } else {
+    row.buffer_status = "valid";
+  }
+
+  if (row.buffer_status == "valid") {
+    row.play_time = (*s.max_play_ms - *s.min_play_ms) / 1000.0;
+    row.cum_rebuf = *s.max_cum_rebuf - *s.min_cum_rebuf;
+    row.num_rebuf = s.num_rebuf;
+    row.startup_delay = *s.min_cum_rebuf;
+  } else {
+    row.play_time = row.cum_rebuf = row.startup_delay = NAN;
+  }
+
+  double ssim_db_sum = 0, variation_sum = 0;
+  uint64_t ssim_db_count = 0, variation_count = 0;
+  double delivery_rate_sum = 0, min_rtt_sum = 0;
+  optional<double> last_ssim_db;
+
+  for (const auto & [video_ts, chunk] : s.chunks) {
+    const bool has_ssim = chunk.ssim_index >= 0 and chunk.ssim_index < 1;
+
+    row.sent_chunks++;
+    if (has_ssim) {
+      row.ssim_index_sum += chunk.ssim_index;
+      row.ssim_count++;
+    }
+
+    if (not chunk.acked_ms or *chunk.acked_ms <= chunk.sent_ms) {
+      continue;
+    }
+
+    row.acked_chunks++;
+    row.acked_bytes += chunk.size;
+    row.trans_time_sum += (*chunk.acked_ms - chunk.sent_ms) / 1000.0;
+    delivery_rate_sum += chunk.delivery_rate;
+    min_rtt_sum += chunk.min_rtt / 1e6;
+
+    if (has_ssim) {
+      const double ssim_db = -10 * log10(1 - chunk.ssim_index);
+      ssim_db_sum += ssim_db;
+      ssim_db_count++;
+
+      if (last_ssim_db) {
+        variation_sum += fabs(ssim_db - *last_ssim_db);
+        variation_count++;
+      }
+      last_ssim_db = ssim_db;
+    }
+  }
+
+  row.ssim_db_mean = ssim_db_count ? ssim_db_sum / ssim_db_count : NAN;
+  row.ssim_db_variation = variation_count ? variation_sum / variation_count
+                                          : NAN;
+  row.delivery_rate_mean = row.acked_chunks
+                           ? delivery_rate_sum / row.acked_chunks : NAN;
+  row.min_rtt_mean = row.acked_chunks ? min_rtt_sum / row.acked_chunks : NAN;
+
+  return row;
+}
+
+/* reconstruct the sessions in the logs of a server, merging the lines of
+ * its logs by timestamp */
+static ServerResult analyze_server(const ServerLogs & logs,
+                                   const TimeRange & range)
+{
+  ServerResult result;
+  ServerLogReader reader(logs, MEASUREMENTS);
+
+  unordered_map<SessionKey, Session, SessionKeyHash> sessions;
+  uint64_t newest_ms = 0, last_expiry_ms = 0;
+
+  auto expire = [&sessions, &result](const optional<uint64_t> now_ms) {
+    for (auto it = sessions.begin(); it != sessions.end();) {
+      if (now_ms and it->second.last_ms + SESSION_EXPIRY_MS >= *now_ms) {
+        ++it;
+        continue;
+      }
+
+      if (auto row = finish_session(it->first, it->second)) {
+        result.rows.emplace_back(move(*row));
+      }
+      it = sessions.erase(it);
+    }
+  };
+
+  SessionKey key;
+
+  while (not reader.done()) {
+    const uint64_t ts = reader.ts();
+    if (ts >= range.to_ms) {
+      /* the rest of the log is past the range too */
+      reader.skip_log();
+      continue;
+    }
+
+    if (ts >= range.from_ms) {
+      const auto & v = reader.values();
+
+      try {
+        /* the columns of the lines are in BinaryLog::schema() */
+        const bool buffer = reader.measurement() == CLIENT_BUFFER;
+        key.user = v[buffer ? 5 : 4];
+        key.init_id = strict_parse<uint64_t>(v[buffer ? 7 : 6]);
+        key.expt_id = strict_parse<uint64_t>(v[buffer ? 4 : 3]);
+
+        auto [it, inserted] = sessions.try_emplace(key);
+        Session & s = it->second;
+        if (inserted) {
+          s.server_id = strict_parse<uint64_t>(v[2]);
+          s.channel = v[1];
+          s.first_ms = ts;
+        }
+        s.last_ms = max(s.last_ms, ts);
+
+        switch (reader.measurement()) {
+        case VIDEO_SENT:
+          s.chunks.try_emplace(strict_parse<uint64_t>(v[7]), Chunk {
+            ts, strict_parse<uint64_t>(v[9]), strict_parse<double>(v[10]),
+            strict_parse<uint64_t>(v[15]), strict_parse<uint64_t>(v[13])
+          });
+          break;
+
+        case VIDEO_ACKED: {
+          const auto chunk = s.chunks.find(strict_parse<uint64_t>(v[7]));
+          if (chunk != s.chunks.end() and not chunk->second.acked_ms) {
+            chunk->second.acked_ms = ts;
+          }
+          break;
+        }
+
+        default:
+          add_buffer_point(s, ts, v[3], strict_parse<double>(v[8]),
+                           strict_parse<double>(v[9]));
+          break;
+        }
+
+        result.num_lines++;
+      } catch (const exception &) {
+        result.num_malformed++;
+      }
+    }
+
+    newest_ms = max(newest_ms, ts);
+    if (newest_ms >= last_expiry_ms + EXPIRY_INTERVAL_MS) {
+      expire(newest_ms);
+      last_expiry_ms = newest_ms;
+    }
+
+    reader.advance();
+  }
+
+  expire(nullopt);
+  result.num_malformed += reader.num_malformed();
+
+  return result;
+}
+
+/* writes the rows a column at a time: a file of values per column (or of
+ * offsets and data for strings), and the schema with the number of rows */
+class ColumnWriter
+{
+public:
+  ColumnWriter(const fs::path & dir, const vector<StreamRow> & rows)
+    : dir_(dir), rows_(rows)
+  {
+    fs::create_directories(dir_);
+    schema_ << "rows " << rows_.size() << "\n";
+  }
+
+  /* a column of type (u8, u64 or f64) T, the field of each row */
+  template<typename T, typename Field>
+  void add(const string & name, const string & type, Field && field)
+  {
+    vector<T> values;
+    values.reserve(rows_.size());
+    for (const auto & row : rows_) {
+      values.emplace_back(field(row));
+    }
+
+    write(name, values.data(), values.size() * sizeof(T));
+    schema_ << name << " " << type << "\n";
+  }
+
+  /* a column of strings: name.offsets has the u64 offset of each string in
+   * name.data and the end of the last, as Arrow lays them out */
+  template<typename Field>
+  void add_string(const string & name, Field && field)
+  {
+    vector<uint64_t> offsets {0};
+    string data;
+    for (const auto & row : rows_) {
+      data += field(row);
+      offsets.emplace_back(data.size());
+    }
+
+    write(name + ".offsets", offsets.data(),
+          offsets.size() * sizeof(uint64_t));
+    write(name + ".data", data.data(), data.size());
+    schema_ << name << " str\n";
+  }
+
+  void finish()
+  {
+    const string schema = schema_.str();
+    write("schema", schema.data(), schema.size());
+  }
+
+private:
+  fs::path dir_;
+  const vector<StreamRow> & rows_;
+  ostringstream schema_ {};
+
+  void write(const string & name, const void * data, const size_t size)
+  {
+    const fs::path path = dir_ / name;
+    ofstream output(path, ios::binary | ios::trunc);
+    output.write(static_cast<const char *>(data), size);
+    output.close();
+
+    if (not output) {
+      throw runtime_error("failed to write " + path.string());
+    }
+  }
+};
+
+static void write_columns(const fs::path & dir, const vector<StreamRow> & rows)
+{
+  ColumnWriter writer(dir, rows);
+
+  writer.add<uint64_t>("server_id", "u64", [](auto & r) { return r.server_id; });
+  writer.add<uint64_t>("expt_id", "u64", [](auto & r) { return r.expt_id; });
+  writer.add<uint64_t>("init_id", "u64", [](auto & r) { return r.init_id; });
+  writer.add_string("user", [](auto & r) { return r.user; });
+  writer.add_string("channel", [](auto & r) { return r.channel; });
+  writer.add<uint64_t>("start_ms", "u64", [](auto & r) { return r.start_ms; });
+  writer.add<uint64_t>("end_ms", "u64", [](auto & r) { return r.end_ms; });
+
+  writer.add_string("buffer_status", [](auto & r) { return r.buffer_status; });
+  writer.add<uint8_t>("valid", "u8",
+                      [](auto & r) { return r.buffer_status == "valid"; });
+  writer.add<double>("play_time", "f64", [](auto & r) { return r.play_time; });
+  writer.add<double>("cum_rebuf", "f64", [](auto & r) { return r.cum_rebuf; });
+  writer.add<uint64_t>("num_rebuf", "u64", [](auto & r) { return r.num_rebuf; });
+  writer.add<double>("startup_delay", "f64",
+                     [](auto & r) { return r.startup_delay; });
+
+  writer.add<uint64_t>("sent_chunks", "u64",
+                       [](auto & r) { return r.sent_chunks; });
+  writer.add<double>("ssim_index_sum", "f64",
+                     [](auto & r) { return r.ssim_index_sum; });
+  writer.add<uint64_t>("ssim_count", "u64",
+                       [](auto & r) { return r.ssim_count; });
+
+  writer.add<uint64_t>("acked_chunks", "u64",
+                       [](auto & r) { return r.acked_chunks; });
+  writer.add<uint64_t>("acked_bytes", "u64",
+                       [](auto & r) { return r.acked_bytes; });
+  writer.add<double>("trans_time_sum", "f64",
+                     [](auto & r) { return r.trans_time_sum; });
+  writer.add<double>("ssim_db_mean", "f64",
+                     [](auto & r) { return r.ssim_db_mean; });
+  writer.add<double>("ssim_db_variation", "f64",
+                     [](auto & r) { return r.ssim_db_variation; });
+  writer.add<double>("delivery_rate_mean", "f64",
+                     [](auto & r) { return r.delivery_rate_mean; });
+  writer.add<double>("min_rtt_mean", "f64",
+                     [](auto & r) { return r.min_rtt_mean; });
+
+  writer.finish();
+}
+
+int main(int argc, char * argv[])
+{
+  if (argc < 1) {
+    abort();
+  }
+
+  string output_dir;
+  unsigned int num_threads = max(1u, thread::hardware_concurrency());
+  TimeRange range;
+
+  const option cmd_line_opts[] = {
+    {"output",  required_argument, nullptr, 'o'},
+    {"threads", required_argument, nullptr, 'j'},
+    {"from",    required_argument, nullptr, 'f'},
+    {"to",      required_argument, nullptr, 't'},
+    { nullptr,  0,                 nullptr,  0 },
+  };
+
+  try {
+    while (true) {
+      const int opt = getopt_long(argc, argv, "o:j:f:t:", cmd_line_opts,
+                                  nullptr);
+      if (opt == -1) {
+        break;
+      }
+
+      switch (opt) {
+      case 'o':
+        output_dir = optarg;
+        break;
+      case 'j':
+        num_threads = stoul(optarg);
+        break;
+      case 'f':
+        range.from_ms = parse_utc_time_ms(optarg);
+        break;
+      case 't':
+        range.to_ms = parse_utc_time_ms(optarg);
+        break;
+      default:
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    }
+
+    if (output_dir.empty() or optind == argc or num_threads == 0) {
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+
+    const vector<ServerLogs> servers = find_server_logs(
+      vector<string>(argv + optind, argv + argc), MEASUREMENTS);
+    if (servers.empty()) {
+      throw runtime_error("no video_sent, video_acked or client_buffer logs "
+                          "found");
+    }
+
+    cerr << "Analyzing the logs of " << servers.size() << " servers with "
+         << min<size_t>(num_threads, servers.size()) << " threads" << endl;
+
+    vector<ServerResult> results(servers.size());
+    vector<string> errors;
+    mutex errors_mutex;
+
+    {
+      ThreadPool pool(min<size_t>(num_threads, servers.size()));
+
+      for (size_t i = 0; i < servers.size(); i++) {
+        pool.submit([&servers, &results, &errors, &errors_mutex, &range, i]() {
+          const ServerLogs & server = servers[i];
+          const string name = (server.dir / server.server_id).string();
+
+          try {
+            results[i] = analyze_server(server, range);
+
+            cerr << name + ": " + to_string(results[i].rows.size())
+                    + " streams in " + to_string(results[i].num_lines)
+                    + " lines (" + to_string(results[i].num_malformed)
+                    + " malformed)\n";
+          } catch (const exception & e) {
+            lock_guard<mutex> lock(errors_mutex);
+            errors.emplace_back(name + ": " + e.what());
+          }
+        });
+      }
+
+      pool.wait();
+    }
+
+    if (not errors.empty()) {
+      for (const auto & error : errors) {
+        cerr << "Error: " << error << endl;
+      }
+      return EXIT_FAILURE;
+    }
+
+    vector<StreamRow> rows;
+    for (auto & result : results) {
+      move(result.rows.begin(), result.rows.end(), back_inserter(rows));
+      result.rows = {};
+    }
+
+    write_columns(output_dir, rows);
+    cerr << "Wrote " << rows.size() << " streams to " << output_dir << endl;
+  } catch (const exception & e) {
+    print_exception(argv[0], e);
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -7,12 +7,14 @@
 using namespace std;
 using namespace MP4;
 
-Box::Box(const uint64_t size, const string & type)
-  : size_(size), type_(type), raw_data_(), children_()
+Box::Box(const uint64_t size, const FourCC type)
+  : size_(size), type_(type), raw_data_(), raw_data_owner_(),
+    raw_data_offset_(), children_()
 {}
 
-Box::Box(const string & type)
-  : size_(), type_(type), raw_data_(), children_()
+Box::Box(const FourCC type)
+  : size_(), type_(type), raw_data_(), raw_data_owner_(),
+    raw_data_offset_(), children_()
 {}
 
 void Box::add_child(shared_ptr<Box> && child)
@@ -20,31 +22,27 @@ void Box::add_child(shared_ptr<Box> && child)
   children_.emplace_back(move(child));
 }
 
-void Box::remove_child(const string & type)
+void Box::remove_child(const FourCC type)
 {
-  for (auto it = children_.begin(); it != children_.end(); ) {
+  for (auto it = children_.begin(); it != children_.end(); ++it) {
     if ((*it)->type() == type) {
-      it = children_.erase(it);
+      children_.erase(it);
       break;
-    } else {
-      ++it;
     }
   }
 }
 
-void Box::insert_child(shared_ptr<Box> && child, const string & type)
+void Box::insert_child(shared_ptr<Box> && child, const FourCC type)
 {
-  for (auto it = children_.begin(); it != children_.end(); ) {
+  for (auto it = children_.begin(); it != children_.end(); ++it) {
     if ((*it)->type() == type) {
       children_.insert(++it, move(child));
       break;
-    } else {
-      ++it;
     }
   }
 }
 
-shared_ptr<Box> Box::find_child(const string & type)
+shared_ptr<Box> Box::find_child(const FourCC type)
 {
   for (const auto & child : children_) {
     if (child->type() == type) {
@@ -55,12 +53,12 @@ shared_ptr<Box> Box::find_child(const string & type)
   return nullptr;
 }
 
-list<shared_ptr<Box>>::const_iterator Box::children_begin()
+Box::Children::const_iterator Box::children_begin()
 {
   return children_.cbegin();
 }
 
-list<shared_ptr<Box>>::const_iterator Box::children_end()
+Box::Children::const_iterator Box::children_end()
 {
   return children_.cend();
 }
@@ -76,7 +74,9 @@ void Box::print_box(const unsigned int indent)
 
 void Box::parse_data(MP4File & mp4, const uint64_t data_size)
 {
-  raw_data_ = mp4.read_exactly(narrow_cast<size_t>(data_size));
+  raw_data_offset_ = mp4.curr_offset();
+  tie(raw_data_, raw_data_owner_) =
+    mp4.read_shared(narrow_cast<size_t>(data_size));
 }
 
 void Box::write_box(MP4File & mp4)
@@ -96,6 +96,33 @@ void Box::write_box(MP4File & mp4)
   fix_size_at(mp4, size_offset);
 }
 
+void Box::copy_box(MP4File & src, MP4File & mp4)
+{
+  if (raw_data_.empty()) {
+    write_box(mp4);
+    return;
+  }
+
+  copy_box(src, mp4, 0, raw_data_.size());
+}
+
+void Box::copy_box(MP4File & src, MP4File & mp4, const uint64_t offset,
+                   const uint64_t length)
+{
+  if (offset + length > raw_data_.size()) {
+    throw runtime_error("Box: range to copy exceeds the raw data of "
+                        + type_.str());
+  }
+
+  /* the size is known up front, so it needs no patching after the copy */
+  mp4.write_uint32(narrow_cast<uint32_t>(header_size() + length));
+  mp4.write_uint32(type_.value());
+
+  if (not mp4.copy_range(src, raw_data_offset_ + offset, length)) {
+    mp4.write(raw_data_.substr(offset, length));
+  }
+}
+
 void Box::print_size_type(const unsigned int indent)
 {
   cout << string(indent, ' ') << "- " << type_ << " " << size_ << endl;
@@ -105,7 +132,7 @@ void Box::write_size_type(MP4File & mp4)
 {
   /* does not support creating boxes with size > uint32 for now */
   mp4.write_uint32(narrow_cast<uint32_t>(size_));
-  mp4.write_string(type_, 4);
+  mp4.write_uint32(type_.value());
 }
 
 void Box::fix_size_at(MP4File & mp4, const uint64_t size_offset)
@@ -122,7 +149,7 @@ void Box::skip_data_left(MP4File & mp4, const uint64_t data_size,
   uint64_t data_parsed = mp4.curr_offset() - init_offset;
 
   if (data_size < data_parsed) {
-    throw runtime_error(type() + " box: data size is too small");
+    throw runtime_error(type_.str() + " box: data size is too small");
   } else if (data_size > data_parsed) {
     mp4.inc_offset(data_size - data_parsed);
   }
@@ -132,15 +159,15 @@ void Box::check_data_left(MP4File & mp4, const uint64_t data_size,
                           const uint64_t init_offset)
 {
   if (mp4.curr_offset() != init_offset + data_size) {
-    throw runtime_error(type() + " box: data remains to be parsed");
+    throw runtime_error(type_.str() + " box: data remains to be parsed");
   }
 }
 
-FullBox::FullBox(const uint64_t size, const string & type)
+FullBox::FullBox(const uint64_t size, const FourCC type)
   : Box(size, type), version_(), flags_()
 {}
 
-FullBox::FullBox(const string & type,
+FullBox::FullBox(const FourCC type,
                  const uint8_t version, const uint32_t flags)
   : Box(type), version_(version), flags_(flags & 0x00FFFFFF)
 {}
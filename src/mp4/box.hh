@@ -3,40 +3,45 @@
 
 #include <cstdint>
 #include <string>
-#include <list>
+#include <string_view>
+#include <vector>
 #include <memory>
 
 #include "mp4_file.hh"
+#include "fourcc.hh"
 
 namespace MP4 {
 
 class Box
 {
 public:
-  Box(const uint64_t size, const std::string & type);
-  Box(const std::string & type);
+  /* a box has a handful of children at most */
+  using Children = std::vector<std::shared_ptr<Box>>;
+
+  Box(const uint64_t size, const FourCC type);
+  Box(const FourCC type);
   virtual ~Box() {}
 
   /* accessors */
   uint64_t size() { return size_; }
-  std::string type() { return type_; }
-  std::string raw_data() { return raw_data_; }
+  FourCC type() { return type_; }
+  std::string_view raw_data() { return raw_data_; }
 
   /* parameter is a sink; use rvalue reference to save a "move" operation */
   void add_child(std::shared_ptr<Box> && child);
 
   /* remove the first child of type 'type' */
-  void remove_child(const std::string & type);
+  void remove_child(const FourCC type);
 
   /* insert 'child' after the first child of type 'type' */
-  void insert_child(std::shared_ptr<Box> && child, const std::string & type);
+  void insert_child(std::shared_ptr<Box> && child, const FourCC type);
 
-  std::shared_ptr<Box> find_child(const std::string & type);
+  std::shared_ptr<Box> find_child(const FourCC type);
 
   unsigned int children_size() { return children_.size(); }
 
-  std::list<std::shared_ptr<Box>>::const_iterator children_begin();
-  std::list<std::shared_ptr<Box>>::const_iterator children_end();
+  Children::const_iterator children_begin();
+  Children::const_iterator children_end();
 
   /* print the box and its children */
   virtual void print_box(const unsigned int indent = 0);
@@ -47,6 +52,15 @@ public:
   /* write the box and its children to 'mp4' */
   virtual void write_box(MP4File & mp4);
 
+  /* write the box to 'mp4' like write_box, but copy its raw data straight
+   * from 'src', the file that it was parsed from */
+  void copy_box(MP4File & src, MP4File & mp4);
+
+  /* write a box of the same type holding only the 'length' bytes at
+   * 'offset' of the raw data, copied like copy_box */
+  void copy_box(MP4File & src, MP4File & mp4, const uint64_t offset,
+                const uint64_t length);
+
   void print_size_type(const unsigned int indent = 0);
   void write_size_type(MP4File & mp4);
   unsigned int header_size() { return 8; /* size and type */ }
@@ -65,17 +79,22 @@ protected:
 
 private:
   uint64_t size_;
-  std::string type_;
+  FourCC type_;
+
+  /* a view into the parsed file (e.g., of a whole mdat), which is not
+   * copied; raw_data_owner_ keeps it valid */
+  std::string_view raw_data_;
+  std::shared_ptr<const void> raw_data_owner_;
+  uint64_t raw_data_offset_;  /* in the parsed file */
 
-  std::string raw_data_;
-  std::list<std::shared_ptr<Box>> children_;
+  Children children_;
 };
 
 class FullBox : public Box
 {
 public:
-  FullBox(const uint64_t size, const std::string & type);
-  FullBox(const std::string & type,
+  FullBox(const uint64_t size, const FourCC type);
+  FullBox(const FourCC type,
           const uint8_t version, const uint32_t flags);
 
   /* accessors */
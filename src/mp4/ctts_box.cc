@@ -5,7 +5,7 @@
 using namespace std;
 using namespace MP4;
 
-CttsBox::CttsBox(const uint64_t size, const string & type)
+CttsBox::CttsBox(const uint64_t size, const FourCC type)
   : FullBox(size, type), entries_()
 {}
 
@@ -16,7 +16,7 @@ public:
     int64_t sample_offset;
   };
 
-  CttsBox(const uint64_t size, const std::string & type);
+  CttsBox(const uint64_t size, const FourCC type);
 
   /* accessors */
   uint32_t entry_count() { return entries_.size(); }
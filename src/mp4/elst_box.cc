@@ -5,11 +5,11 @@
 using namespace std;
 using namespace MP4;
 
-ElstBox::ElstBox(const uint64_t size, const string & type)
+ElstBox::ElstBox(const uint64_t size, const FourCC type)
   : FullBox(size, type), edit_list_()
 {}
 
-ElstBox::ElstBox(const string & type,
+ElstBox::ElstBox(const FourCC type,
                  const uint8_t version,
                  const uint32_t flags,
                  const vector<Edit> & edit_list)
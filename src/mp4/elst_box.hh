@@ -18,8 +18,8 @@ public:
     int16_t media_rate_fraction;
   };
 
-  ElstBox(const uint64_t size, const std::string & type);
-  ElstBox(const std::string & type,
+  ElstBox(const uint64_t size, const FourCC type);
+  ElstBox(const FourCC type,
           const uint8_t version,
           const uint32_t flags,
           const std::vector<Edit> & edit_list);
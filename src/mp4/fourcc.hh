@@ -0,0 +1,72 @@
+#ifndef FOURCC_HH
+#define FOURCC_HH
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <ostream>
+#include <stdexcept>
+
+namespace MP4 {
+
+/* the four characters of a box type, held as the big-endian uint32 that they
+ * are in the file, so that types are compared and looked up as integers; a
+ * literal such as "moov" converts at compile time */
+class FourCC
+{
+public:
+  constexpr FourCC(const char (&type)[5])
+    : value_(static_cast<uint32_t>(static_cast<uint8_t>(type[0])) << 24 |
+             static_cast<uint32_t>(static_cast<uint8_t>(type[1])) << 16 |
+             static_cast<uint32_t>(static_cast<uint8_t>(type[2])) << 8 |
+             static_cast<uint32_t>(static_cast<uint8_t>(type[3])))
+  {}
+
+  constexpr explicit FourCC(const uint32_t value) : value_(value) {}
+
+  explicit FourCC(const std::string_view type) : value_()
+  {
+    if (type.size() != 4) {
+      throw std::runtime_error("invalid box type: " + std::string(type));
+    }
+
+    for (const char c : type) {
+      value_ = value_ << 8 | static_cast<uint8_t>(c);
+    }
+  }
+
+  constexpr uint32_t value() const { return value_; }
+
+  std::string str() const
+  {
+    return {static_cast<char>(value_ >> 24), static_cast<char>(value_ >> 16),
+            static_cast<char>(value_ >> 8), static_cast<char>(value_)};
+  }
+
+  constexpr bool operator==(const FourCC other) const
+  {
+    return value_ == other.value_;
+  }
+
+  constexpr bool operator!=(const FourCC other) const
+  {
+    return value_ != other.value_;
+  }
+
+  constexpr bool operator<(const FourCC other) const
+  {
+    return value_ < other.value_;
+  }
+
+private:
+  uint32_t value_;
+};
+
+inline std::ostream & operator<<(std::ostream & os, const FourCC type)
+{
+  return os << type.str();
+}
+
+} /* namespace MP4 */
+
+#endif /* FOURCC_HH */
@@ -5,11 +5,11 @@
 using namespace std;
 using namespace MP4;
 
-FtypBox::FtypBox(const uint64_t size, const string & type)
+FtypBox::FtypBox(const uint64_t size, const FourCC type)
   : Box(size, type), major_brand_(), minor_version_(), compatible_brands_()
 {}
 
-FtypBox::FtypBox(const string & type,
+FtypBox::FtypBox(const FourCC type,
                  const string & major_brand,
                  const uint32_t minor_version,
                  const vector<string> & compatible_brands)
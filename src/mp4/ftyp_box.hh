@@ -11,8 +11,8 @@ namespace MP4 {
 class FtypBox : public Box
 {
 public:
-  FtypBox(const uint64_t size, const std::string & type);
-  FtypBox(const std::string & type,
+  FtypBox(const uint64_t size, const FourCC type);
+  FtypBox(const FourCC type,
           const std::string & major_brand,
           const uint32_t minor_version,
           const std::vector<std::string> & compatible_brands);
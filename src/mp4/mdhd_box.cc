@@ -5,12 +5,12 @@
 using namespace std;
 using namespace MP4;
 
-MdhdBox::MdhdBox(const uint64_t size, const string & type)
+MdhdBox::MdhdBox(const uint64_t size, const FourCC type)
   : FullBox(size, type), creation_time_(), modification_time_(),
     timescale_(), duration_(), language_()
 {}
 
-MdhdBox::MdhdBox(const string & type,
+MdhdBox::MdhdBox(const FourCC type,
                  const uint8_t version,
                  const uint32_t flags,
                  const uint64_t creation_time,
@@ -10,8 +10,8 @@ namespace MP4 {
 class MdhdBox : public FullBox
 {
 public:
-  MdhdBox(const uint64_t size, const std::string & type);
-  MdhdBox(const std::string & type,
+  MdhdBox(const uint64_t size, const FourCC type);
+  MdhdBox(const FourCC type,
           const uint8_t version,
           const uint32_t flags,
           const uint64_t creation_time,
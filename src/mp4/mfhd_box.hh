@@ -10,8 +10,8 @@ namespace MP4 {
 class MfhdBox : public FullBox
 {
 public:
-  MfhdBox(const uint64_t size, const std::string & type);
-  MfhdBox(const std::string & type,
+  MfhdBox(const uint64_t size, const FourCC type);
+  MfhdBox(const FourCC type,
           const uint8_t version,
           const uint32_t flags,
           const uint32_t sequence_number);
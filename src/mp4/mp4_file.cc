@@ -1,8 +1,14 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <endian.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
 
 #include "exception.hh"
+#include "mmap.hh"
 #include "mp4_file.hh"
 
 using namespace std;
@@ -18,119 +24,352 @@ MP4File::MP4File(const string & filename, int flags, mode_t mode)
                                    open(filename.c_str(), flags, mode)))
 {}
 
+MP4File::MP4File(const string & filename)
+  : MP4File(filename, O_RDONLY)
+{
+  mapping_size_ = FileDescriptor::filesize();
+
+  /* an empty file cannot be mapped, but has nothing to read either */
+  if (mapping_size_ > 0) {
+    mapping_ = mmap_shared(nullptr, mapping_size_, PROT_READ, MAP_PRIVATE,
+                           fd_num(), 0);
+    madvise(mapping_.get(), mapping_size_, MADV_SEQUENTIAL);
+  }
+}
+
+MP4File::~MP4File()
+{
+  try {
+    flush();
+  } catch (const exception & e) {
+    cerr << "MP4File: failed to flush writes: " << e.what() << endl;
+  }
+}
+
+void MP4File::buffer_writes()
+{
+  if (not buffering_) {
+    write_buffer_offset_ = FileDescriptor::seek(0, SEEK_CUR);
+    buffering_ = true;
+  }
+}
+
+void MP4File::flush()
+{
+  if (write_buffer_.empty()) {
+    return;
+  }
+
+  FileDescriptor::write(write_buffer_);
+  write_buffer_offset_ += write_buffer_.size();
+  write_buffer_.clear();
+}
+
+string MP4File::read(const size_t limit)
+{
+  if (not mapping_) {
+    return FileDescriptor::read(limit);
+  }
+
+  const size_t length = min<uint64_t>(limit, mapping_size_ - mapping_offset_);
+  if (length == 0) {
+    set_eof();
+  }
+
+  string ret(mapped_data() + mapping_offset_, length);
+  mapping_offset_ += length;
+  return ret;
+}
+
+string MP4File::read_exactly(const size_t length, const bool fail_silently)
+{
+  if (not mapping_) {
+    return FileDescriptor::read_exactly(length, fail_silently);
+  }
+
+  if (length > mapping_size_ - mapping_offset_ and not fail_silently) {
+    throw runtime_error("read_exactly: reached EOF before reaching target");
+  }
+
+  return read(length);
+}
+
+uint64_t MP4File::seek(const int64_t offset, const int whence)
+{
+  if (buffering_) {
+    flush();
+    write_buffer_offset_ = FileDescriptor::seek(offset, whence);
+    return write_buffer_offset_;
+  }
+
+  if (not mapping_) {
+    return FileDescriptor::seek(offset, whence);
+  }
+
+  int64_t base = 0;
+  if (whence == SEEK_CUR) {
+    base = mapping_offset_;
+  } else if (whence == SEEK_END) {
+    base = mapping_size_;
+  } else if (whence != SEEK_SET) {
+    throw runtime_error("MP4File: invalid whence");
+  }
+
+  if (base + offset < 0) {
+    throw runtime_error("MP4File: seek before the start of file");
+  }
+
+  /* like lseek, seeking past the end is allowed but reads nothing */
+  mapping_offset_ = base + offset;
+  return mapping_offset_;
+}
+
+uint64_t MP4File::curr_offset()
+{
+  if (buffering_) {
+    return write_buffer_offset_ + write_buffer_.size();
+  }
+
+  return seek(0, SEEK_CUR);
+}
+
+uint64_t MP4File::inc_offset(const int64_t offset)
+{
+  return seek(offset, SEEK_CUR);
+}
+
+uint64_t MP4File::filesize()
+{
+  if (not mapping_) {
+    return FileDescriptor::filesize();
+  }
+
+  return mapping_size_;
+}
+
+pair<string_view, shared_ptr<const void>> MP4File::read_shared(
+  const size_t length)
+{
+  if (not mapping_) {
+    auto data = make_shared<const string>(read_exactly(length));
+    return {*data, data};
+  }
+
+  if (length > mapping_size_ - mapping_offset_) {
+    throw runtime_error("read_shared: reached EOF before reaching target");
+  }
+
+  const string_view ret(mapped_data() + mapping_offset_, length);
+  mapping_offset_ += length;
+  return {ret, mapping_};
+}
+
+bool MP4File::copy_range(MP4File & src, const uint64_t offset,
+                         const uint64_t length)
+{
+  /* the copy goes to the file offset, after whatever is buffered */
+  flush();
+
+  loff_t src_offset = offset;
+  uint64_t copied = 0;
+
+  while (copied < length) {
+    const ssize_t n = copy_file_range(src.fd_num(), &src_offset, fd_num(),
+                                      nullptr, length - copied, 0);
+    if (n < 0 and copied == 0 and
+        (errno == EXDEV or errno == EINVAL or errno == ENOSYS or
+         errno == EOPNOTSUPP)) {
+      return false;
+    }
+
+    CheckSystemCall("copy_file_range", n);
+    if (n == 0) {
+      throw runtime_error("copy_range: reached EOF before reaching target");
+    }
+
+    copied += n;
+  }
+
+  write_buffer_offset_ += copied;
+  return true;
+}
+
+void MP4File::read_to(void * dst, const size_t length)
+{
+  if (not mapping_) {
+    const string data = read_exactly(length);
+    memcpy(dst, data.data(), length);
+    return;
+  }
+
+  if (length > mapping_size_ - mapping_offset_) {
+    throw runtime_error("MP4File: reached EOF before reaching target");
+  }
+
+  memcpy(dst, mapped_data() + mapping_offset_, length);
+  mapping_offset_ += length;
+}
+
 uint8_t MP4File::read_uint8()
 {
-  string data = read(1);
-  const uint8_t * size = reinterpret_cast<const uint8_t *>(data.c_str());
-  return *size;
+  uint8_t data;
+  read_to(&data, 1);
+  return data;
 }
 
 uint16_t MP4File::read_uint16()
 {
-  string data = read(2);
-  const uint16_t * size = reinterpret_cast<const uint16_t *>(data.c_str());
-  return be16toh(*size);
+  uint16_t data;
+  read_to(&data, 2);
+  return be16toh(data);
 }
 
 uint32_t MP4File::read_uint32()
 {
-  string data = read(4);
-  const uint32_t * size = reinterpret_cast<const uint32_t *>(data.c_str());
-  return be32toh(*size);
+  uint32_t data;
+  read_to(&data, 4);
+  return be32toh(data);
 }
 
 uint64_t MP4File::read_uint64()
 {
-  string data = read(8);
-  const uint64_t * size = reinterpret_cast<const uint64_t *>(data.c_str());
-  return be64toh(*size);
+  uint64_t data;
+  read_to(&data, 8);
+  return be64toh(data);
 }
 
 int8_t MP4File::read_int8()
 {
-  string data = read(1);
-  const int8_t * size = reinterpret_cast<const int8_t *>(data.c_str());
-  return *size;
+  int8_t data;
+  read_to(&data, 1);
+  return data;
 }
 
 int16_t MP4File::read_int16()
 {
-  string data = read(2);
-  const int16_t * size = reinterpret_cast<const int16_t *>(data.c_str());
-  return be16toh(*size);
+  int16_t data;
+  read_to(&data, 2);
+  return be16toh(data);
 }
 
 int32_t MP4File::read_int32()
 {
-  string data = read(4);
-  const int32_t * size = reinterpret_cast<const int32_t *>(data.c_str());
-  return be32toh(*size);
+  int32_t data;
+  read_to(&data, 4);
+  return be32toh(data);
 }
 
 int64_t MP4File::read_int64()
 {
-  string data = read(8);
-  const int64_t * size = reinterpret_cast<const int64_t *>(data.c_str());
-  return be64toh(*size);
+  int64_t data;
+  read_to(&data, 8);
+  return be64toh(data);
+}
+
+vector<uint32_t> MP4File::read_uint32s(const size_t count)
+{
+  if (mapping_ and count > (mapping_size_ - mapping_offset_) / 4) {
+    throw runtime_error("MP4File: reached EOF before reaching target");
+  }
+
+  vector<uint32_t> data(count);
+  read_to(data.data(), count * 4);
+
+  /* a plain loop over the whole table, which the compiler vectorizes */
+  for (auto & value : data) {
+    value = be32toh(value);
+  }
+
+  return data;
+}
+
+void MP4File::write(const string_view & data)
+{
+  if (buffering_) {
+    write_buffer_.append(data);
+  } else {
+    FileDescriptor::write(data);
+  }
+}
+
+void MP4File::write_at(const string_view & data, const uint64_t offset)
+{
+  if (buffering_ and offset >= write_buffer_offset_ and
+      offset + data.size() <= curr_offset()) {
+    write_buffer_.replace(offset - write_buffer_offset_, data.size(),
+                          data.data(), data.size());
+    return;
+  }
+
+  /* already in the file: pwrite leaves the file offset alone */
+  flush();
+  const ssize_t n = CheckSystemCall("pwrite",
+                                    pwrite(fd_num(), data.data(), data.size(),
+                                           offset));
+  if (static_cast<size_t>(n) != data.size()) {
+    throw runtime_error("MP4File: short pwrite");
+  }
 }
 
 void MP4File::write_uint8(const uint8_t data)
 {
-  write(string(1, static_cast<char>(data)));
+  write({reinterpret_cast<const char *>(&data), 1});
 }
 
 void MP4File::write_uint16(const uint16_t data)
 {
-  uint16_t host_data = htobe16(data);
-  const char * str = reinterpret_cast<const char *>(&host_data);
-  write(string(str, 2));
+  const uint16_t be_data = htobe16(data);
+  write({reinterpret_cast<const char *>(&be_data), 2});
 }
 
 void MP4File::write_uint32(const uint32_t data)
 {
-  const uint32_t host_data = htobe32(data);
-  const char * str = reinterpret_cast<const char *>(&host_data);
-  write(string(str, 4));
+  const uint32_t be_data = htobe32(data);
+  write({reinterpret_cast<const char *>(&be_data), 4});
 }
 
 void MP4File::write_uint64(const uint64_t data)
 {
-  uint64_t host_data = htobe64(data);
-  const char * str = reinterpret_cast<const char *>(&host_data);
-  write(string(str, 8));
+  const uint64_t be_data = htobe64(data);
+  write({reinterpret_cast<const char *>(&be_data), 8});
 }
 
 void MP4File::write_int8(const int8_t data)
 {
-  write(string(1, static_cast<char>(data)));
+  write({reinterpret_cast<const char *>(&data), 1});
 }
 
 void MP4File::write_int16(const int16_t data)
 {
-  int16_t host_data = htobe16(data);
-  const char * str = reinterpret_cast<const char *>(&host_data);
-  write(string(str, 2));
+  const int16_t be_data = htobe16(data);
+  write({reinterpret_cast<const char *>(&be_data), 2});
 }
 
 void MP4File::write_int32(const int32_t data)
 {
-  int32_t host_data = htobe32(data);
-  const char * str = reinterpret_cast<const char *>(&host_data);
-  write(string(str, 4));
+  const int32_t be_data = htobe32(data);
+  write({reinterpret_cast<const char *>(&be_data), 4});
 }
 
 void MP4File::write_int64(const int64_t data)
 {
-  int64_t host_data = htobe64(data);
-  const char * str = reinterpret_cast<const char *>(&host_data);
-  write(string(str, 8));
+  const int64_t be_data = htobe64(data);
+  write({reinterpret_cast<const char *>(&be_data), 8});
 }
 
-void MP4File::write_zeros(const size_t bytes)
+void MP4File::write_uint32s(const vector<uint32_t> & data)
 {
-  for (size_t i = 0; i < bytes; ++i) {
-    write(string(1, static_cast<char>(0)));
+  vector<uint32_t> be_data(data.size());
+  for (size_t i = 0; i < data.size(); ++i) {
+    be_data[i] = htobe32(data[i]);
   }
+
+  write({reinterpret_cast<const char *>(be_data.data()), be_data.size() * 4});
+}
+
+void MP4File::write_zeros(const size_t bytes)
+{
+  write(string(bytes, '\0'));
 }
 
 void MP4File::write_string(const string & data, const size_t bytes)
@@ -144,16 +383,12 @@ void MP4File::write_string(const string & data, const size_t bytes)
 
 void MP4File::write_uint32_at(const uint32_t data, const uint64_t offset)
 {
-  uint64_t prev_offset = curr_offset();
-  seek(offset, SEEK_SET);
-  write_uint32(data);
-  seek(prev_offset, SEEK_SET);
+  const uint32_t be_data = htobe32(data);
+  write_at({reinterpret_cast<const char *>(&be_data), 4}, offset);
 }
 
 void MP4File::write_int32_at(const int32_t data, const uint64_t offset)
 {
-  uint64_t prev_offset = curr_offset();
-  seek(offset, SEEK_SET);
-  write_int32(data);
-  seek(prev_offset, SEEK_SET);
+  const int32_t be_data = htobe32(data);
+  write_at({reinterpret_cast<const char *>(&be_data), 4}, offset);
 }
@@ -3,8 +3,11 @@
 
 #include <fcntl.h>
 #include <cstdint>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <tuple>
+#include <vector>
 
 #include "file_descriptor.hh"
 
@@ -16,6 +19,39 @@ public:
   MP4File(const std::string & filename, int flags);
   MP4File(const std::string & filename, int flags, mode_t mode);
 
+  /* open filename read-only and map it in memory, so that reading and
+   * seeking are done on the mapping rather than by system calls */
+  explicit MP4File(const std::string & filename);
+
+  /* flush any buffered writes */
+  ~MP4File();
+
+  /* from now on, collect writes in memory and overwrite them in place, so
+   * that a whole box tree reaches the file in a single write on flush() */
+  void buffer_writes();
+  void flush();
+
+  /* reading and seeking, on the mapping if there is one */
+  using FileDescriptor::read;
+  std::string read(const size_t limit = BUFFER_SIZE);
+  std::string read_exactly(const size_t length,
+                           const bool fail_silently = false);
+  uint64_t seek(const int64_t offset, const int whence);
+  uint64_t curr_offset();
+  uint64_t inc_offset(const int64_t offset);
+  uint64_t filesize();
+
+  /* read 'length' bytes without copying them out of the mapping: the view
+   * stays valid for as long as the returned owner (a copy is owned if the
+   * file is not mapped) */
+  std::pair<std::string_view, std::shared_ptr<const void>> read_shared(
+    const size_t length);
+
+  /* copy 'length' bytes at 'offset' of 'src' to the current offset of this
+   * file within the kernel, without reading them into memory; false (before
+   * anything is written) if the file systems do not support it */
+  bool copy_range(MP4File & src, const uint64_t offset, const uint64_t length);
+
   /* read bytes from file and return meaningful data */
   uint8_t read_uint8();
   uint16_t read_uint16();
@@ -26,7 +62,11 @@ public:
   int32_t read_int32();
   int64_t read_int64();
 
-  /* write bytes to file */
+  /* read a table of 'count' big-endian uint32s, converting it in bulk */
+  std::vector<uint32_t> read_uint32s(const size_t count);
+
+  /* write bytes to file (or to the write buffer) */
+  void write(const std::string_view & data);
   void write_uint8(const uint8_t data);
   void write_uint16(const uint16_t data);
   void write_uint32(const uint32_t data);
@@ -36,6 +76,9 @@ public:
   void write_int32(const int32_t data);
   void write_int64(const int64_t data);
 
+  /* write a table of uint32s as big-endian in a single write */
+  void write_uint32s(const std::vector<uint32_t> & data);
+
   /* write 'bytes' bytes of zeros to file */
   void write_zeros(const size_t bytes);
 
@@ -44,6 +87,26 @@ public:
   /* overwrite 'data' at 'offset' */
   void write_uint32_at(const uint32_t data, const uint64_t offset);
   void write_int32_at(const int32_t data, const uint64_t offset);
+
+private:
+  std::shared_ptr<void> mapping_ {};
+  uint64_t mapping_size_ {0};
+  uint64_t mapping_offset_ {0};
+
+  bool buffering_ {false};
+  std::string write_buffer_ {};
+  uint64_t write_buffer_offset_ {0};  /* file offset of write_buffer_ */
+
+  const char * mapped_data() const
+  {
+    return static_cast<const char *>(mapping_.get());
+  }
+
+  /* copy 'length' bytes to 'dst' and advance */
+  void read_to(void * dst, const size_t length);
+
+  /* overwrite 'data' at 'offset' in the write buffer or in the file */
+  void write_at(const std::string_view & data, const uint64_t offset);
 };
 
 } /* namespace MP4 */
@@ -2,11 +2,15 @@
 #include <cstdint>
 #include <cassert>
 #include <iostream>
+#include <numeric>
 #include <string>
 #include <memory>
 #include <vector>
 
 #include "filesystem.hh"
+#include "batch.hh"
+#include "bench.hh"
+#include "fragment_output.hh"
 #include "strict_conversions.hh"
 #include "tokenize.hh"
 #include "mp4_parser.hh"
@@ -41,7 +45,32 @@ void print_usage(const string & program_name)
   "Options:\n"
   "--init-segment, -i     output initial segment\n"
   "--media-segment, -m    output media segment in the format of <num>.m4s,\n"
-  "                       where <num> denotes the segment number"
+  "                       where <num> denotes the segment number\n"
+  "--cmaf-chunks, -c <n>  split the media segment into <n> CMAF chunks\n"
+  "                       (moof and mdat pairs) of about the same number\n"
+  "                       of samples (default: 1)\n\n"
+  "Usage: " << program_name << " --batch -i <init_path> [-p <span>]"
+  " [-j <threads>]\n"
+  "       [-c <n>]\n\n"
+  "Fragment the inputs given on stdin, a line of\n"
+  "\"<input_segment> <media_segment>\" each, as video_fragmenter and\n"
+  "audio_fragmenter do (the init segment replaces <init_path> only if\n"
+  "changed), and reply a line of \"<input_segment> <exit status>\" on\n"
+  "stdout for each (see batch.hh)\n\n"
+  "Options:\n"
+  "--batch, -b            run in batch mode\n"
+  "--pack, -p <span>      append the media segments to their segments of\n"
+  "                       <span> (see video_fragmenter -p)\n"
+  "--threads, -j          fragment on <threads> threads (default: 1)\n"
+  "--cmaf-chunks, -c <n>  as above\n\n"
+  "Usage: " << program_name << " --bench <dir> [-n <rounds>] [-c <n>]\n\n"
+  "Fragment the chunks (<timestamp>.mp4) in <dir> over and over in process\n"
+  "and report chunks/s, MB/s, read/write syscalls per chunk and peak RSS\n"
+  "(see bench.hh)\n\n"
+  "Options:\n"
+  "--bench, -B <dir>      run in benchmark mode on the chunks in <dir>\n"
+  "--rounds, -n <rounds>  fragment each chunk <rounds> times (default: 10)\n"
+  "--cmaf-chunks, -c <n>  as above"
   << endl;
 }
 
@@ -197,57 +226,45 @@ uint32_t check_sample_count(const uint32_t size_cnt,
   return same_cnt;
 }
 
-vector<TrunBox::Sample> create_samples(MP4Parser & mp4_parser,
-                                       const uint32_t trun_flags)
+TrunBox::Samples create_samples(MP4Parser & mp4_parser,
+                                const uint32_t trun_flags)
 {
-  vector<TrunBox::Sample> samples;
+  /* the columns are taken over from the sample tables whole */
+  TrunBox::Samples samples;
 
-  vector<uint32_t> size_entries;
   if (trun_flags & TrunBox::sample_size_present) {
     auto stsz_box = static_pointer_cast<StszBox>(
                         mp4_parser.find_first_box_of("stsz"));
 
-    size_entries = stsz_box->entries();
+    samples.sizes = stsz_box->entries();
   }
 
-  vector<uint32_t> duration_entries;
   if (trun_flags & TrunBox::sample_duration_present) {
     auto stts_box = static_pointer_cast<SttsBox>(
                         mp4_parser.find_first_box_of("stts"));
 
     for (const auto & stts_entry : stts_box->entries()) {
-      for (uint32_t i = 0; i < stts_entry.sample_count; ++i) {
-        duration_entries.emplace_back(stts_entry.sample_delta);
-      }
+      samples.durations.insert(samples.durations.end(),
+                               stts_entry.sample_count,
+                               stts_entry.sample_delta);
     }
   }
 
-  vector<uint32_t> offset_entries;
   if (trun_flags & TrunBox::sample_composition_time_offsets_present) {
     auto ctts_box = static_pointer_cast<CttsBox>(
                         mp4_parser.find_first_box_of("ctts"));
 
     for (const auto & ctts_entry : ctts_box->entries()) {
-      for (uint32_t i = 0; i < ctts_entry.sample_count; ++i) {
-        offset_entries.emplace_back(ctts_entry.sample_offset);
-      }
+      samples.composition_time_offsets.insert(
+          samples.composition_time_offsets.end(),
+          ctts_entry.sample_count, ctts_entry.sample_offset);
     }
   }
 
   /* sanity check for consistent sample count */
-  uint32_t size_cnt = size_entries.size();
-  uint32_t duration_cnt = duration_entries.size();
-  uint32_t offset_cnt = offset_entries.size();
-  uint32_t sample_cnt = check_sample_count(size_cnt, duration_cnt, offset_cnt);
-
-  for (unsigned int i = 0; i < sample_cnt; ++i) {
-    samples.push_back({
-      duration_cnt ? duration_entries[i] : 0,  // sample_duration
-      size_cnt ? size_entries[i] : 0,      // sample_size
-      0,                                   // sample_flags (not present)
-      offset_cnt ? offset_entries[i] : 0,  // sample_composition_time_offset
-    });
-  }
+  samples.count = check_sample_count(samples.sizes.size(),
+                                     samples.durations.size(),
+                                     samples.composition_time_offsets.size());
 
   return samples;
 }
@@ -273,25 +290,18 @@ uint32_t get_default_sample_size(MP4Parser & mp4_parser)
   return stsz_box->sample_size();
 }
 
-void create_moof_box(MP4Parser & mp4_parser, MP4File & output_mp4,
-                     const uint64_t global_timestamp)
+/* the defaults and flags shared by the track fragments of a segment */
+struct FragmentDefaults {
+  uint32_t tfhd_flags;
+  uint32_t trun_flags;
+  uint32_t sample_duration;
+  uint32_t sample_size;
+  uint32_t sample_flags;
+  uint32_t first_sample_flags;
+};
+
+FragmentDefaults get_fragment_defaults(MP4Parser & mp4_parser)
 {
-  auto mdhd_box = static_pointer_cast<MdhdBox>(
-      mp4_parser.find_first_box_of("mdhd"));
-  uint32_t timescale = mdhd_box->timescale();
-  uint32_t duration = narrow_cast<uint32_t>(mdhd_box->duration());
-
-  uint64_t mp4_ts = scale_global_timestamp(global_timestamp, timescale);
-  uint32_t sequence_number = narrow_round<uint32_t>(
-                               static_cast<double>(mp4_ts) / duration);
-
-  auto mfhd_box = make_shared<MfhdBox>(
-      "mfhd",         // type
-      0,              // version
-      0,              // flags
-      sequence_number
-  );
-
   /* create flags for tfhd and trun boxes */
   uint32_t tfhd_flags = TfhdBox::default_base_is_moof |
                         TfhdBox::default_sample_flags_present;
@@ -311,7 +321,7 @@ void create_moof_box(MP4Parser & mp4_parser, MP4File & output_mp4,
     trun_flags |= TrunBox::sample_size_present;
   }
 
-  uint32_t default_sample_flags, first_sample_flags;
+  uint32_t default_sample_flags = 0, first_sample_flags = 0;
   if (mp4_parser.is_video()) {
     default_sample_flags = 0x1010000;
     first_sample_flags = 0x2000000;
@@ -322,35 +332,126 @@ void create_moof_box(MP4Parser & mp4_parser, MP4File & output_mp4,
     }
   } else if (mp4_parser.is_audio()) {
     default_sample_flags = 0x2000000;
-    first_sample_flags = 0;
   }
 
+  return {tfhd_flags, trun_flags, default_sample_duration, default_sample_size,
+          default_sample_flags, first_sample_flags};
+}
+
+/* a CMAF chunk of a segment: some of its samples in a moof and an mdat of
+ * their own, which a player can append before the rest of the segment */
+struct CMAFChunk {
+  uint32_t index;         /* within the segment */
+  uint64_t decode_time;   /* of its first sample, in the media timescale */
+  TrunBox::Samples samples;
+  uint64_t data_offset;   /* of its samples in the input mdat */
+  uint64_t data_size;
+};
+
+template<typename T>
+vector<T> slice_column(const vector<T> & column, const uint32_t first,
+                       const uint32_t count)
+{
+  if (column.empty()) {
+    return {};  /* not present */
+  }
+
+  return {column.begin() + first, column.begin() + first + count};
+}
+
+/* split the samples of a segment into (at most) 'num_chunks' CMAF chunks
+ * of about the same number of samples */
+vector<CMAFChunk> split_samples(const TrunBox::Samples & samples,
+                                const FragmentDefaults & defaults,
+                                const unsigned int num_chunks,
+                                const uint64_t decode_time,
+                                const uint64_t mdat_size)
+{
+  const uint32_t chunk_cnt = max(1u, min<uint32_t>(num_chunks, samples.count));
+
+  vector<CMAFChunk> chunks;
+  uint64_t chunk_decode_time = decode_time;
+  uint64_t data_offset = 0;
+
+  for (uint32_t i = 0; i < chunk_cnt; ++i) {
+    const uint32_t first = uint64_t(samples.count) * i / chunk_cnt;
+    const uint32_t count = uint64_t(samples.count) * (i + 1) / chunk_cnt
+                           - first;
+
+    TrunBox::Samples chunk_samples;
+    chunk_samples.count = count;
+    chunk_samples.durations = slice_column(samples.durations, first, count);
+    chunk_samples.sizes = slice_column(samples.sizes, first, count);
+    chunk_samples.flags = slice_column(samples.flags, first, count);
+    chunk_samples.composition_time_offsets =
+      slice_column(samples.composition_time_offsets, first, count);
+
+    const uint64_t duration = chunk_samples.durations.empty() ?
+      uint64_t(defaults.sample_duration) * count :
+      accumulate(chunk_samples.durations.begin(),
+                 chunk_samples.durations.end(), uint64_t {0});
+
+    /* the last chunk takes whatever is left of the mdat */
+    const uint64_t data_size = i + 1 == chunk_cnt ? mdat_size - data_offset :
+      chunk_samples.sizes.empty() ?
+      uint64_t(defaults.sample_size) * count :
+      accumulate(chunk_samples.sizes.begin(), chunk_samples.sizes.end(),
+                 uint64_t {0});
+
+    if (data_offset + data_size > mdat_size) {
+      throw runtime_error("samples exceed the size of mdat");
+    }
+
+    chunks.push_back({i, chunk_decode_time, move(chunk_samples),
+                      data_offset, data_size});
+
+    chunk_decode_time += duration;
+    data_offset += data_size;
+  }
+
+  return chunks;
+}
+
+void create_moof_box(MP4File & output_mp4, const FragmentDefaults & defaults,
+                     const uint32_t sequence_number, CMAFChunk & chunk)
+{
+  auto mfhd_box = make_shared<MfhdBox>(
+      "mfhd",         // type
+      0,              // version
+      0,              // flags
+      sequence_number
+  );
+
   auto tfhd_box = make_shared<TfhdBox>(
-      "tfhd",      // type
-      0,           // version
-      tfhd_flags,  // flags
-      1,           // track_id
-      default_sample_duration,
-      default_sample_size,
-      default_sample_flags
+      "tfhd",               // type
+      0,                    // version
+      defaults.tfhd_flags,  // flags
+      1,                    // track_id
+      defaults.sample_duration,
+      defaults.sample_size,
+      defaults.sample_flags
   );
 
   auto tfdt_box = make_shared<TfdtBox>(
-      "tfdt",  // type
-      1,       // version
-      0,       // flags
-      mp4_ts   // base_media_decode_time
+      "tfdt",             // type
+      1,                  // version
+      0,                  // flags
+      chunk.decode_time   // base_media_decode_time
   );
 
-  vector<TrunBox::Sample> samples = create_samples(mp4_parser, trun_flags);
+  /* only the first chunk starts with a sync sample */
+  uint32_t trun_flags = defaults.trun_flags;
+  if (chunk.index > 0) {
+    trun_flags &= ~TrunBox::first_sample_flags_present;
+  }
 
   auto trun_box = make_shared<TrunBox>(
-      "trun",         // type
-      0,              // version
-      trun_flags,     // flags
-      move(samples),  // samples
-      0,              // data_offset, will be filled in once moof is created
-      first_sample_flags
+      "trun",               // type
+      0,                    // version
+      trun_flags,           // flags
+      move(chunk.samples),  // samples
+      0,                    // data_offset, will be filled in once moof is created
+      defaults.first_sample_flags
   );
 
   /* write boxes one by one to get the position of 'data_offset' */
@@ -380,7 +481,8 @@ void create_moof_box(MP4Parser & mp4_parser, MP4File & output_mp4,
 }
 
 void create_media_segment(MP4Parser & mp4_parser, MP4File & output_mp4,
-                          const uint64_t global_timestamp)
+                          const uint64_t global_timestamp,
+                          const unsigned int num_chunks)
 {
   create_styp_box(output_mp4);
 
@@ -389,18 +491,50 @@ void create_media_segment(MP4Parser & mp4_parser, MP4File & output_mp4,
   unsigned int sidx_ref_list_pos = create_sidx_box(mp4_parser, output_mp4,
                                                    global_timestamp);
 
+  auto mdat_box = mp4_parser.find_first_box_of("mdat");
+  if (mdat_box == nullptr) {
+    throw runtime_error("input MP4 has no mdat box");
+  }
+
+  auto mdhd_box = static_pointer_cast<MdhdBox>(
+      mp4_parser.find_first_box_of("mdhd"));
+  uint32_t timescale = mdhd_box->timescale();
+  uint32_t duration = narrow_cast<uint32_t>(mdhd_box->duration());
+
+  uint64_t mp4_ts = scale_global_timestamp(global_timestamp, timescale);
+  uint32_t segment_number = narrow_round<uint32_t>(
+                              static_cast<double>(mp4_ts) / duration);
+
+  const FragmentDefaults defaults = get_fragment_defaults(mp4_parser);
+  vector<CMAFChunk> chunks = split_samples(
+      create_samples(mp4_parser, defaults.trun_flags), defaults, num_chunks,
+      mp4_ts, mdat_box->raw_data().size());
+
   uint64_t moof_offset = output_mp4.curr_offset();
-  create_moof_box(mp4_parser, output_mp4, global_timestamp);
 
-  auto mdat_box = mp4_parser.find_first_box_of("mdat");
-  mdat_box->write_box(output_mp4);
-
-  /* fill in 'referenced_size' = size of moof + size of mdat in sidx box */
-  uint32_t referenced_size = narrow_cast<uint32_t>(
-      output_mp4.curr_offset() - moof_offset);
-  /* set referenced_size's most significant bit to 0 (reference_type) */
-  output_mp4.write_uint32_at(referenced_size & 0x7FFFFFFF,
-                             sidx_offset + sidx_ref_list_pos);
+  for (auto & chunk : chunks) {
+    /* the sequence numbers of moofs keep increasing across segments */
+    create_moof_box(output_mp4, defaults,
+                    narrow_cast<uint32_t>(uint64_t(segment_number) *
+                                          num_chunks + chunk.index),
+                    chunk);
+
+    if (chunk.index + 1 == chunks.size()) {
+      /* fill in 'referenced_size' = size of moofs + size of mdats in sidx
+       * box, before the last mdat is copied; with a single chunk, the patch
+       * then stays in the buffer */
+      uint32_t referenced_size = narrow_cast<uint32_t>(
+          output_mp4.curr_offset() - moof_offset +
+          mdat_box->header_size() + chunk.data_size);
+      /* set referenced_size's most significant bit to 0 (reference_type) */
+      output_mp4.write_uint32_at(referenced_size & 0x7FFFFFFF,
+                                 sidx_offset + sidx_ref_list_pos);
+    }
+
+    /* the samples are copied within the kernel rather than written out */
+    mp4_parser.copy_box_to_mp4("mdat", output_mp4,
+                               chunk.data_offset, chunk.data_size);
+  }
 }
 
 uint64_t get_timestamp(const string & filepath)
@@ -410,7 +544,8 @@ uint64_t get_timestamp(const string & filepath)
 
 void fragment(const string & input_mp4,
               const string & init_segment,
-              const string & media_segment)
+              const string & media_segment,
+              const unsigned int num_chunks)
 {
   MP4Parser mp4_parser(input_mp4);
   /* skip parsing avc1 and mp4a boxes (if exist) but save them as raw data */
@@ -428,14 +563,19 @@ void fragment(const string & input_mp4,
     const uint64_t global_timestamp = get_timestamp(input_mp4);
 
     MP4File output_mp4(media_segment, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    output_mp4.buffer_writes();
 
-    create_media_segment(mp4_parser, output_mp4, global_timestamp);
+    create_media_segment(mp4_parser, output_mp4, global_timestamp,
+                         num_chunks);
+    output_mp4.flush();
   }
 
   if (init_segment.size()) {
     MP4File output_mp4(init_segment, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    output_mp4.buffer_writes();
 
     create_init_segment(mp4_parser, output_mp4);
+    output_mp4.flush();
   }
 }
 
@@ -446,15 +586,27 @@ int main(int argc, char * argv[])
   }
 
   string init_segment, media_segment;
+  bool batch = false;
+  uint64_t pack_span = 0;
+  size_t num_threads = 1;
+  unsigned int num_chunks = 1;
+  string bench_dir;
+  unsigned int rounds = 10;
 
   const option cmd_line_opts[] = {
     {"init-segment",  required_argument, nullptr, 'i'},
     {"media-segment", required_argument, nullptr, 'm'},
+    {"batch",         no_argument,       nullptr, 'b'},
+    {"pack",          required_argument, nullptr, 'p'},
+    {"threads",       required_argument, nullptr, 'j'},
+    {"cmaf-chunks",   required_argument, nullptr, 'c'},
+    {"bench",         required_argument, nullptr, 'B'},
+    {"rounds",        required_argument, nullptr, 'n'},
     { nullptr,        0,                 nullptr,  0 }
   };
 
   while (true) {
-    const int opt = getopt_long(argc, argv, "i:m:", cmd_line_opts, nullptr);
+    const int opt = getopt_long(argc, argv, "i:m:bp:j:c:B:n:", cmd_line_opts, nullptr);
     if (opt == -1) {
       break;
     }
@@ -466,12 +618,75 @@ int main(int argc, char * argv[])
     case 'm':
       media_segment = optarg;
       break;
+    case 'b':
+      batch = true;
+      break;
+    case 'p':
+      pack_span = stoull(optarg);
+      break;
+    case 'j':
+      num_threads = stoul(optarg);
+      break;
+    case 'c':
+      num_chunks = stoul(optarg);
+      if (num_chunks == 0) {
+        cerr << "Error: -c must be at least 1" << endl;
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'B':
+      bench_dir = optarg;
+      break;
+    case 'n':
+      rounds = stoul(optarg);
+      break;
     default:
       print_usage(argv[0]);
       return EXIT_FAILURE;
     }
   }
 
+  /* a process fragments all the inputs, saving a process per input */
+  if (batch) {
+    if (init_segment.empty() or optind != argc) {
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+
+    return run_batch(
+      [&init_segment, pack_span, num_chunks](const string & input_path,
+                                             const string & output_path) {
+        const string tmp_init = tmp_init_path(output_path, init_segment);
+
+        try {
+          fragment(input_path, tmp_init, output_path, num_chunks);
+        } catch (const exception &) {
+          fs::remove(tmp_init);
+          throw;
+        }
+
+        finish_fragment(output_path, init_segment, pack_span);
+      }, num_threads);
+  }
+
+  /* fragment the chunks of a test vector in process, as batch mode would */
+  if (not bench_dir.empty()) {
+    if (optind != argc) {
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+
+    return run_bench(bench_dir,
+      [](const string & path) {
+        return fs::path(path).extension() == ".mp4" and is_timestamped(path);
+      }, rounds,
+      [num_chunks](const string & input_path, const string & output_dir) {
+        const string stem = fs::path(input_path).stem();
+        fragment(input_path, fs::path(output_dir) / "init.mp4",
+                 fs::path(output_dir) / (stem + ".m4s"), num_chunks);
+      });
+  }
+
   if (optind != argc - 1) {
     print_usage(argv[0]);
     return EXIT_FAILURE;
@@ -485,7 +700,7 @@ int main(int argc, char * argv[])
     return EXIT_FAILURE;
   }
 
-  fragment(input_segment, init_segment, media_segment);
+  fragment(input_segment, init_segment, media_segment, num_chunks);
 
   return EXIT_SUCCESS;
 }
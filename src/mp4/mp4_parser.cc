@@ -3,6 +3,7 @@
 #include <endian.h>
 #include <iostream>
 #include <stdexcept>
+#include <algorithm>
 
 #include "exception.hh"
 #include "mp4_parser.hh"
@@ -28,12 +29,92 @@
 using namespace std;
 using namespace MP4;
 
+/* an STL allocator of boxes from the arena of a parse, which it keeps alive
+ * (in the control block of each box) */
+template<class T>
+class BoxAllocator
+{
+public:
+  using value_type = T;
+
+  BoxAllocator(const shared_ptr<Arena> & arena) : arena_(arena) {}
+
+  template<class U>
+  BoxAllocator(const BoxAllocator<U> & other) : arena_(other.arena()) {}
+
+  T * allocate(const size_t n)
+  {
+    return ArenaAllocator<T>(*arena_).allocate(n);
+  }
+
+  void deallocate(T * p, const size_t n)
+  {
+    ArenaAllocator<T>(*arena_).deallocate(p, n);
+  }
+
+  const shared_ptr<Arena> & arena() const { return arena_; }
+
+  template<class U>
+  bool operator==(const BoxAllocator<U> & other) const
+  {
+    return arena_ == other.arena();
+  }
+
+  template<class U>
+  bool operator!=(const BoxAllocator<U> & other) const
+  {
+    return arena_ != other.arena();
+  }
+
+private:
+  shared_ptr<Arena> arena_;
+};
+
+template<class T>
+static shared_ptr<Box> make_box(const shared_ptr<Arena> & arena,
+                                const uint64_t size, const FourCC type)
+{
+  return allocate_shared<T>(BoxAllocator<T>(arena), size, type);
+}
+
+/* the boxes that are parsed by a class of their own; the other boxes are
+ * kept as raw data */
+struct BoxMaker
+{
+  FourCC type;
+  shared_ptr<Box> (*make)(const shared_ptr<Arena> & arena,
+                          const uint64_t size, const FourCC type);
+};
+
+static constexpr BoxMaker box_makers[] {
+  {"ftyp", make_box<FtypBox>},
+  {"styp", make_box<FtypBox>},
+  {"mvhd", make_box<MvhdBox>},
+  {"mfhd", make_box<MfhdBox>},
+  {"tfhd", make_box<TfhdBox>},
+  {"sidx", make_box<SidxBox>},
+  {"trex", make_box<TrexBox>},
+  {"stsz", make_box<StszBox>},
+  {"tkhd", make_box<TkhdBox>},
+  {"trun", make_box<TrunBox>},
+  {"mdhd", make_box<MdhdBox>},
+  {"tfdt", make_box<TfdtBox>},
+  {"elst", make_box<ElstBox>},
+  {"ctts", make_box<CttsBox>},
+  {"stco", make_box<StcoBox>},
+  {"stsc", make_box<StscBox>},
+  {"stss", make_box<StssBox>},
+  {"stts", make_box<SttsBox>},
+  {"stsd", make_box<StsdBox>},
+};
+
 MP4Parser::MP4Parser()
-  : mp4_(), root_box_(make_shared<Box>("root")), ignored_boxes_()
+  : mp4_(), arena_(make_shared<Arena>()), root_box_(make_shared<Box>("root")),
+    ignored_boxes_()
 {}
 
 MP4Parser::MP4Parser(const string & mp4_file)
-  : mp4_(make_shared<MP4File>(mp4_file, O_RDONLY)),
+  : mp4_(make_shared<MP4File>(mp4_file)), arena_(make_shared<Arena>()),
     root_box_(make_shared<Box>("root")), ignored_boxes_()
 {}
 
@@ -46,17 +127,17 @@ void MP4Parser::parse()
   create_boxes(root_box_, 0, mp4_->filesize());
 }
 
-void MP4Parser::ignore_box(const string & type)
+void MP4Parser::ignore_box(const FourCC type)
 {
   ignored_boxes_.insert(type);
 }
 
-bool MP4Parser::is_ignored(const string & type)
+bool MP4Parser::is_ignored(const FourCC type)
 {
   return ignored_boxes_.find(type) != ignored_boxes_.end();
 }
 
-shared_ptr<Box> MP4Parser::find_first_box_of(const string & type)
+shared_ptr<Box> MP4Parser::find_first_box_of(const FourCC type)
 {
   if (type == "root") {
     return nullptr; /* do not return root box publicly */
@@ -96,65 +177,57 @@ void MP4Parser::save_to_mp4(MP4File & mp4)
   }
 }
 
+void MP4Parser::copy_box_to_mp4(const FourCC type, MP4File & mp4)
+{
+  auto box = find_first_box_of(type);
+  if (box == nullptr) {
+    throw runtime_error("MP4Parser: no " + type.str() + " box to copy");
+  }
+
+  box->copy_box(*mp4_, mp4);
+}
+
+void MP4Parser::copy_box_to_mp4(const FourCC type, MP4File & mp4,
+                                const uint64_t offset, const uint64_t length)
+{
+  auto box = find_first_box_of(type);
+  if (box == nullptr) {
+    throw runtime_error("MP4Parser: no " + type.str() + " box to copy");
+  }
+
+  box->copy_box(*mp4_, mp4, offset, length);
+}
+
 shared_ptr<Box> MP4Parser::box_factory(const uint64_t size,
-                                       const string & type,
+                                       const FourCC type,
                                        const uint64_t data_size)
 {
   shared_ptr<Box> box;
 
   if (is_ignored(type)) {
     /* skip parsing box but save raw data */
-    box = make_shared<Box>(size, type);
+    box = make_box<Box>(arena_, size, type);
   } else {
-    if (type == "ftyp" or type == "styp") {
-      box = make_shared<FtypBox>(size, type);
-    } else if (type == "mvhd") {
-      box = make_shared<MvhdBox>(size, type);
-    } else if (type == "mfhd") {
-      box = make_shared<MfhdBox>(size, type);
-    } else if (type == "tfhd") {
-      box = make_shared<TfhdBox>(size, type);
-    } else if (type == "sidx") {
-      box = make_shared<SidxBox>(size, type);
-    } else if (type == "trex") {
-      box = make_shared<TrexBox>(size, type);
-    } else if (type == "stsz") {
-      box = make_shared<StszBox>(size, type);
-    } else if (type == "tkhd") {
-      box = make_shared<TkhdBox>(size, type);
-    } else if (type == "trun") {
-      box = make_shared<TrunBox>(size, type);
-    } else if (type == "mdhd") {
-      box = make_shared<MdhdBox>(size, type);
-    } else if (type == "tfdt") {
-      box = make_shared<TfdtBox>(size, type);
-    } else if (type == "elst") {
-      box = make_shared<ElstBox>(size, type);
-    } else if (type == "ctts") {
-      box = make_shared<CttsBox>(size, type);
-    } else if (type == "stco") {
-      box = make_shared<StcoBox>(size, type);
-    } else if (type == "stsc") {
-      box = make_shared<StscBox>(size, type);
-    } else if (type == "stss") {
-      box = make_shared<StssBox>(size, type);
-    } else if (type == "stts") {
-      box = make_shared<SttsBox>(size, type);
-    } else if (type == "stsd") {
-      auto stsd_box = make_shared<StsdBox>(size, type);
-
-      /* special case: a sample entry box of stsd can be ignored too */
+    const auto maker = find_if(begin(box_makers), end(box_makers),
+      [type](const BoxMaker & m) { return m.type == type; });
+
+    if (maker != end(box_makers)) {
+      box = maker->make(arena_, size, type);
+    } else {
+      /* unknown box type */
+      box = make_box<Box>(arena_, size, type);
+    }
+
+    /* special case: a sample entry box of stsd can be ignored too */
+    if (type == "stsd") {
+      auto & stsd_box = static_cast<StsdBox &>(*box);
+
       if (is_ignored("avc1")) {
-        stsd_box->ignore_sample_entry("avc1");
+        stsd_box.ignore_sample_entry("avc1");
       }
       if (is_ignored("mp4a")) {
-        stsd_box->ignore_sample_entry("mp4a");
+        stsd_box.ignore_sample_entry("mp4a");
       }
-
-      box = move(stsd_box);
-    } else {
-      /* unknown box type */
-      box = make_shared<Box>(size, type);
     }
   }
 
@@ -175,7 +248,7 @@ void MP4Parser::create_boxes(const shared_ptr<Box> & parent_box,
 {
   while (true) {
     uint64_t size = mp4_->read_uint32();
-    string type = mp4_->read(4);
+    const FourCC type(mp4_->read_uint32());
     uint64_t data_size;
 
     if (size == 0) {
@@ -192,9 +265,9 @@ void MP4Parser::create_boxes(const shared_ptr<Box> & parent_box,
       mp4_->read(16); /* ignore extended_type */
     }
 
-    if (mp4_container_boxes.find(type) != mp4_container_boxes.end()) {
+    if (is_container_box(type)) {
       /* parse a container box recursively */
-      auto box = make_shared<Box>(size, type);
+      auto box = make_box<Box>(arena_, size, type);
       create_boxes(box, mp4_->curr_offset(), data_size);
 
       parent_box->add_child(move(box));
@@ -212,7 +285,7 @@ void MP4Parser::create_boxes(const shared_ptr<Box> & parent_box,
 }
 
 shared_ptr<Box> MP4Parser::do_find_first_box_of(const shared_ptr<Box> & box,
-                                                const string & type)
+                                                const FourCC type)
 {
   if (box->type() == type) {
     return box;
@@ -8,28 +8,43 @@
 
 #include "mp4_file.hh"
 #include "box.hh"
+#include "arena.hh"
 
 namespace MP4 {
 
-const std::set<std::string> mp4_container_boxes{
+constexpr FourCC mp4_container_boxes[] {
   "moov", "trak", "edts", "mdia", "minf", "stbl", "mvex", "moof", "traf",
   "mfra", "skip", "strk", "meta", "dinf", "ipro", "sinf", "fiin", "paen",
   "meco", "mere"};
 
+constexpr bool is_container_box(const FourCC type)
+{
+  for (const FourCC container : mp4_container_boxes) {
+    if (container == type) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
 class MP4Parser
 {
 public:
   MP4Parser();
+
+  /* parse mp4_file through a read-only mapping: the boxes that are not
+   * parsed, such as mdat, are views into the mapping rather than copies */
   MP4Parser(const std::string & mp4_file);
 
   /* parse MP4 into boxes */
   void parse();
 
   /* skip parsing 'type' box but save it in raw data */
-  void ignore_box(const std::string & type);
-  bool is_ignored(const std::string & type);
+  void ignore_box(const FourCC type);
+  bool is_ignored(const FourCC type);
 
-  std::shared_ptr<Box> find_first_box_of(const std::string & type);
+  std::shared_ptr<Box> find_first_box_of(const FourCC type);
 
   bool is_video();
   bool is_audio();
@@ -41,6 +56,15 @@ public:
 
   void save_to_mp4(MP4File & mp4);
 
+  /* write the first box of 'type' to 'mp4', copying its raw data (e.g., the
+   * samples of mdat) from the parsed file within the kernel */
+  void copy_box_to_mp4(const FourCC type, MP4File & mp4);
+
+  /* likewise, but keep only the 'length' bytes at 'offset' of its raw data
+   * (e.g., the samples of a fragment of mdat) */
+  void copy_box_to_mp4(const FourCC type, MP4File & mp4,
+                       const uint64_t offset, const uint64_t length);
+
 protected:
   /* accessors */
   std::shared_ptr<MP4File> mp4() { return mp4_; }
@@ -48,13 +72,21 @@ protected:
 
 private:
   std::shared_ptr<MP4File> mp4_;
+
+  /* the boxes that are parsed are allocated from the arena of the parse
+   * rather than one by one from the heap; each of them holds a reference
+   * to the arena, so the arena outlives the parser as long as they do, and
+   * they must be released on one thread at a time as Arena is not
+   * thread-safe */
+  std::shared_ptr<Arena> arena_;
+
   std::shared_ptr<Box> root_box_;
 
-  std::set<std::string> ignored_boxes_;
+  std::set<FourCC> ignored_boxes_;
 
   /* a factory method to create different boxes based on their type */
   std::shared_ptr<Box> box_factory(const uint64_t size,
-                                   const std::string & type,
+                                   const FourCC type,
                                    const uint64_t data_size);
 
   /* recursively create boxes between 'start_offset' and its following
@@ -64,7 +96,7 @@ private:
                     const uint64_t total_size);
 
   std::shared_ptr<Box> do_find_first_box_of(const std::shared_ptr<Box> & box,
-                                            const std::string & type);
+                                            const FourCC type);
 };
 
 } /* namespace MP4 */
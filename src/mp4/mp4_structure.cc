@@ -1,8 +1,12 @@
+#include <getopt.h>
 #include <iostream>
 #include <string>
 #include <memory>
 
+#include "filesystem.hh"
+#include "bench.hh"
 #include "mp4_parser.hh"
+#include "mp4_info.hh"
 
 using namespace std;
 
@@ -10,22 +14,89 @@ void print_usage(const string & program_name)
 {
   cerr <<
   "Usage: " << program_name << " <file.mp4>\n\n"
-  "<file.mp4>    MP4 file to parse"
+  "<file.mp4>    MP4 file to parse\n\n"
+  "Usage: " << program_name << " --bench <dir> [-n <rounds>]\n\n"
+  "Parse the MP4 files (.mp4 and .m4s) in <dir> over and over in process,\n"
+  "probing each with MP4Info as the MPD writer does, and report chunks/s,\n"
+  "MB/s, read/write syscalls per chunk and peak RSS (see bench.hh)\n\n"
+  "Options:\n"
+  "--bench, -B <dir>      run in benchmark mode on the files in <dir>\n"
+  "--rounds, -n <rounds>  parse each file <rounds> times (default: 10)"
   << endl;
 }
 
+/* what probe_media_info() of the MPD writer reads from an MP4 file */
+void probe(const string & path)
+{
+  auto parser = make_shared<MP4::MP4Parser>(path);
+  parser->parse();
+
+  MP4::MP4Info info(parser);
+  info.get_timescale_duration();
+
+  if (info.is_video()) {
+    info.get_width_height();
+    info.get_avc_profile_level();
+  } else if (info.is_audio()) {
+    info.get_sample_rate();
+    info.get_audio_code_channel();
+  }
+}
+
 int main(int argc, char * argv[])
 {
   if (argc < 1) {
     abort();
   }
 
-  if (argc != 2) {
+  string bench_dir;
+  unsigned int rounds = 10;
+
+  const option cmd_line_opts[] = {
+    {"bench",  required_argument, nullptr, 'B'},
+    {"rounds", required_argument, nullptr, 'n'},
+    { nullptr, 0,                 nullptr,  0 }
+  };
+
+  while (true) {
+    const int opt = getopt_long(argc, argv, "B:n:", cmd_line_opts, nullptr);
+    if (opt == -1) {
+      break;
+    }
+
+    switch (opt) {
+    case 'B':
+      bench_dir = optarg;
+      break;
+    case 'n':
+      rounds = stoul(optarg);
+      break;
+    default:
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (not bench_dir.empty()) {
+    if (optind != argc) {
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+
+    return run_bench(bench_dir,
+      [](const string & path) {
+        const auto ext = fs::path(path).extension();
+        return ext == ".mp4" or ext == ".m4s";
+      }, rounds,
+      [](const string & input_path, const string &) { probe(input_path); });
+  }
+
+  if (optind != argc - 1) {
     print_usage(argv[0]);
     return EXIT_FAILURE;
   }
 
-  auto parser = make_unique<MP4::MP4Parser>(argv[1]);
+  auto parser = make_unique<MP4::MP4Parser>(argv[optind]);
   parser->parse();
   parser->print_structure();
 
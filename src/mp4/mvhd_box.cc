@@ -5,12 +5,12 @@
 using namespace std;
 using namespace MP4;
 
-MvhdBox::MvhdBox(const uint64_t size, const string & type)
+MvhdBox::MvhdBox(const uint64_t size, const FourCC type)
   : FullBox(size, type), creation_time_(), modification_time_(),
     timescale_(), duration_(), next_track_id_()
 {}
 
-MvhdBox::MvhdBox(const string & type,
+MvhdBox::MvhdBox(const FourCC type,
                  const uint8_t version,
                  const uint32_t flags,
                  const uint64_t creation_time,
@@ -11,8 +11,8 @@ namespace MP4 {
 class MvhdBox : public FullBox
 {
 public:
-  MvhdBox(const uint64_t size, const std::string & type);
-  MvhdBox(const std::string & type,
+  MvhdBox(const uint64_t size, const FourCC type);
+  MvhdBox(const FourCC type,
           const uint8_t version,
           const uint32_t flags,
           const uint64_t creation_time,
@@ -7,12 +7,12 @@
 using namespace std;
 using namespace MP4;
 
-SidxBox::SidxBox(const uint64_t size, const string & type)
+SidxBox::SidxBox(const uint64_t size, const FourCC type)
   : FullBox(size, type), reference_id_(), timescale_(),
     earlist_presentation_time_(), first_offset_(), reference_list_()
 {}
 
-SidxBox::SidxBox(const string & type,
+SidxBox::SidxBox(const FourCC type,
                  const uint8_t version,
                  const uint32_t flags,
                  const uint32_t reference_id,
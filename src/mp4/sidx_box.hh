@@ -20,8 +20,8 @@ public:
     uint32_t sap_delta;
   };
 
-  SidxBox(const uint64_t size, const std::string & type);
-  SidxBox(const std::string & type,
+  SidxBox(const uint64_t size, const FourCC type);
+  SidxBox(const FourCC type,
           const uint8_t version,
           const uint32_t flags,
           const uint32_t reference_id,
@@ -5,7 +5,7 @@
 using namespace std;
 using namespace MP4;
 
-StcoBox::StcoBox(const uint64_t size, const string & type)
+StcoBox::StcoBox(const uint64_t size, const FourCC type)
   : FullBox(size, type), entries_()
 {}
 
@@ -42,11 +42,7 @@ void StcoBox::parse_data(MP4File & mp4, const uint64_t data_size)
   parse_version_flags(mp4);
 
   uint32_t entry_count = mp4.read_uint32();
-
-  for (uint32_t i = 0; i < entry_count; ++i) {
-    uint32_t chunk_offset = mp4.read_uint32();
-    entries_.emplace_back(chunk_offset);
-  }
+  entries_ = mp4.read_uint32s(entry_count);
 
   check_data_left(mp4, data_size, init_offset);
 }
@@ -60,9 +56,7 @@ void StcoBox::write_box(MP4File & mp4)
 
   mp4.write_uint32(entry_count());
 
-  for (const auto & chunk_offset : entries_) {
-    mp4.write_uint32(chunk_offset);
-  }
+  mp4.write_uint32s(entries_);
 
   fix_size_at(mp4, size_offset);
 }
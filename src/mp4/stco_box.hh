@@ -11,7 +11,7 @@ namespace MP4 {
 class StcoBox : public FullBox
 {
 public:
-  StcoBox(const uint64_t size, const std::string & type);
+  StcoBox(const uint64_t size, const FourCC type);
 
   /* accessors */
   uint32_t entry_count() { return entries_.size(); }
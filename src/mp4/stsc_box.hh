@@ -17,7 +17,7 @@ public:
     uint32_t sample_description_index;
   };
 
-  StscBox(const uint64_t size, const std::string & type);
+  StscBox(const uint64_t size, const FourCC type);
 
   /* accessors */
   uint32_t entry_count() { return entries_.size(); }
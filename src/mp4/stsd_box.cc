@@ -6,16 +6,16 @@
 using namespace std;
 using namespace MP4;
 
-StsdBox::StsdBox(const uint64_t size, const string & type)
+StsdBox::StsdBox(const uint64_t size, const FourCC type)
   : FullBox(size, type), ignored_boxes_()
 {}
 
-void StsdBox::ignore_sample_entry(const string & sample_type)
+void StsdBox::ignore_sample_entry(const FourCC sample_type)
 {
   ignored_boxes_.insert(sample_type);
 }
 
-bool StsdBox::is_ignored(const string & sample_type)
+bool StsdBox::is_ignored(const FourCC sample_type)
 {
   return ignored_boxes_.find(sample_type) != ignored_boxes_.end();
 }
@@ -31,7 +31,7 @@ void StsdBox::parse_data(MP4File & mp4, const uint64_t data_size)
 
   for (uint32_t i = 0; i < num_sample_entries; ++i) {
     uint32_t sample_size = mp4.read_uint32();
-    string sample_type = mp4.read(4);
+    const FourCC sample_type(mp4.read_uint32());
 
     shared_ptr<Box> box;
 
@@ -72,7 +72,7 @@ void StsdBox::write_box(MP4File & mp4)
   fix_size_at(mp4, size_offset);
 }
 
-SampleEntry::SampleEntry(const uint64_t size, const string & type)
+SampleEntry::SampleEntry(const uint64_t size, const FourCC type)
   : Box(size, type), data_reference_index_()
 {}
 
@@ -82,7 +82,7 @@ void SampleEntry::parse_sample_entry(MP4File & mp4)
   data_reference_index_ = mp4.read_uint16();
 }
 
-VisualSampleEntry::VisualSampleEntry(const uint64_t size, const string & type)
+VisualSampleEntry::VisualSampleEntry(const uint64_t size, const FourCC type)
   : SampleEntry(size, type), width_(), height_(), compressorname_()
 {}
 
@@ -115,7 +115,7 @@ void VisualSampleEntry::parse_visual_sample_entry(MP4File & mp4)
   mp4.read(2); /* pre-defined */
 }
 
-AVC1::AVC1(const uint64_t size, const string & type)
+AVC1::AVC1(const uint64_t size, const FourCC type)
   : VisualSampleEntry(size, type), avc_profile_(),
     avc_profile_compatibility_(), avc_level_(), avcc_size_()
 {}
@@ -143,10 +143,10 @@ void AVC1::parse_data(MP4File & mp4, const uint64_t data_size)
   VisualSampleEntry::parse_visual_sample_entry(mp4);
   /* avcc is parsed along with avc1 */
 
-  string type = "";
+  FourCC type(0);
   for (int i = 0; i < 2; i++) {
     avcc_size_ = mp4.read_uint32();
-    type = mp4.read(4);
+    type = FourCC(mp4.read_uint32());
     if (type != "avcC") {
       mp4.read(avcc_size_ - 8); /* we've read 8 bytes already */
     } else {
@@ -166,7 +166,7 @@ void AVC1::parse_data(MP4File & mp4, const uint64_t data_size)
   skip_data_left(mp4, data_size, init_offset);
 }
 
-AudioSampleEntry::AudioSampleEntry(const uint64_t size, const string & type)
+AudioSampleEntry::AudioSampleEntry(const uint64_t size, const FourCC type)
   : SampleEntry(size, type)
 {}
 
@@ -184,7 +184,7 @@ void AudioSampleEntry::parse_audio_sample_entry(MP4File & mp4)
   sample_rate_ = mp4.read_uint32() >> 16;
 }
 
-MP4A::MP4A(const uint64_t size, const string & type)
+MP4A::MP4A(const uint64_t size, const FourCC type)
   : AudioSampleEntry(size, type), esds_box_()
 {}
 
@@ -196,7 +196,7 @@ void MP4A::parse_data(MP4File & mp4, const uint64_t data_size)
 
   /* assume there are no other boxes in between */
   uint32_t size = mp4.read_uint32();
-  string type = mp4.read(4);
+  const FourCC type(mp4.read_uint32());
 
   if (type != "esds") {
     throw runtime_error("expect esds box inside mp4a box");
@@ -220,7 +220,7 @@ void MP4A::print_box(const unsigned int indent)
   esds_box_->print_box(indent + 2);
 }
 
-EsdsBox::EsdsBox(const uint64_t size, const string & type)
+EsdsBox::EsdsBox(const uint64_t size, const FourCC type)
   : FullBox(size, type), es_id_(), stream_priority_(), object_type_(),
     max_bitrate_(), avg_bitrate_()
 {}
@@ -13,25 +13,25 @@ namespace MP4 {
 class StsdBox : public FullBox
 {
 public:
-  StsdBox(const uint64_t size, const std::string & type);
+  StsdBox(const uint64_t size, const FourCC type);
 
   /* accessors */
   uint32_t num_sample_entries() { return children_size(); }
 
-  void ignore_sample_entry(const std::string & sample_type);
-  bool is_ignored(const std::string & sample_type);
+  void ignore_sample_entry(const FourCC sample_type);
+  bool is_ignored(const FourCC sample_type);
 
   void parse_data(MP4File & mp4, const uint64_t data_size);
   void write_box(MP4File & mp4);
 
 private:
-  std::set<std::string> ignored_boxes_;
+  std::set<FourCC> ignored_boxes_;
 };
 
 class SampleEntry : public Box
 {
 public:
-  SampleEntry(const uint64_t size, const std::string & type);
+  SampleEntry(const uint64_t size, const FourCC type);
 
   /* accessors */
   uint16_t data_reference_index() { return data_reference_index_; }
@@ -45,7 +45,7 @@ private:
 class VisualSampleEntry : public SampleEntry
 {
 public:
-  VisualSampleEntry(const uint64_t size, const std::string & type);
+  VisualSampleEntry(const uint64_t size, const FourCC type);
 
   /* accessors */
   uint16_t width() { return width_; }
@@ -71,7 +71,7 @@ private:
 class AVC1 : public VisualSampleEntry
 {
 public:
-  AVC1(const uint64_t size, const std::string & type);
+  AVC1(const uint64_t size, const FourCC type);
 
   /* accessors */
   uint8_t configuration_version() { return configuration_version_; }
@@ -95,7 +95,7 @@ private:
 class AudioSampleEntry : public SampleEntry
 {
 public:
-  AudioSampleEntry(const uint64_t size, const std::string & type);
+  AudioSampleEntry(const uint64_t size, const FourCC type);
 
   /* accessors */
   uint16_t channel_count() { return channel_count_; }
@@ -114,7 +114,7 @@ private:
 class EsdsBox : public FullBox
 {
 public:
-  EsdsBox(const uint64_t size, const std::string & type);
+  EsdsBox(const uint64_t size, const FourCC type);
 
   uint16_t es_id() { return es_id_; }
   uint8_t stream_priority() { return stream_priority_; }
@@ -146,7 +146,7 @@ private:
 class MP4A : public AudioSampleEntry
 {
 public:
-  MP4A(const uint64_t size, const std::string & type);
+  MP4A(const uint64_t size, const FourCC type);
 
   /* accessors */
   std::shared_ptr<EsdsBox> esds_box() { return esds_box_; }
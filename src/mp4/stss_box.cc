@@ -5,7 +5,7 @@
 using namespace std;
 using namespace MP4;
 
-StssBox::StssBox(const uint64_t size, const string & type)
+StssBox::StssBox(const uint64_t size, const FourCC type)
   : FullBox(size, type), entries_()
 {}
 
@@ -29,11 +29,7 @@ void StssBox::parse_data(MP4File & mp4, const uint64_t data_size)
   parse_version_flags(mp4);
 
   uint32_t entry_count = mp4.read_uint32();
-
-  for (uint32_t i = 0; i < entry_count; ++i) {
-    uint32_t sample_number = mp4.read_uint32();
-    entries_.emplace_back(sample_number);
-  }
+  entries_ = mp4.read_uint32s(entry_count);
 
   check_data_left(mp4, data_size, init_offset);
 }
@@ -47,9 +43,7 @@ void StssBox::write_box(MP4File & mp4)
 
   mp4.write_uint32(entry_count());
 
-  for (const auto & sample_number : entries_) {
-    mp4.write_uint32(sample_number);
-  }
+  mp4.write_uint32s(entries_);
 
   fix_size_at(mp4, size_offset);
 }
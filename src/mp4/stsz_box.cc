@@ -6,11 +6,11 @@
 using namespace std;
 using namespace MP4;
 
-StszBox::StszBox(const uint64_t size, const string & type)
+StszBox::StszBox(const uint64_t size, const FourCC type)
   : FullBox(size, type), sample_size_(), entries_()
 {}
 
-StszBox::StszBox(const string & type,
+StszBox::StszBox(const FourCC type,
                  const uint8_t version,
                  const uint32_t flags,
                  const uint32_t sample_size,
@@ -64,10 +64,7 @@ void StszBox::parse_data(MP4File & mp4, const uint64_t data_size)
   uint32_t sample_count = mp4.read_uint32();
 
   if (sample_size_ == 0) {
-    for (uint32_t i = 0; i < sample_count; ++i) {
-      uint32_t entry_size = mp4.read_uint32();
-      entries_.emplace_back(entry_size);
-    }
+    entries_ = mp4.read_uint32s(sample_count);
   }
 
   check_data_left(mp4, data_size, init_offset);
@@ -84,9 +81,7 @@ void StszBox::write_box(MP4File & mp4)
   mp4.write_uint32(sample_count());
 
   if (sample_size_ == 0) {
-    for (const auto entry_size : entries_) {
-      mp4.write_uint32(entry_size);
-    }
+    mp4.write_uint32s(entries_);
   }
 
   fix_size_at(mp4, size_offset);
@@ -11,8 +11,8 @@ namespace MP4 {
 class StszBox : public FullBox
 {
 public:
-  StszBox(const uint64_t size, const std::string & type);
-  StszBox(const std::string & type,
+  StszBox(const uint64_t size, const FourCC type);
+  StszBox(const FourCC type,
           const uint8_t version,
           const uint32_t flags,
           const uint32_t sample_size,
@@ -16,7 +16,7 @@ public:
     uint32_t sample_delta;
   };
 
-  SttsBox(const uint64_t size, const std::string & type);
+  SttsBox(const uint64_t size, const FourCC type);
 
   /* accessors */
   uint32_t entry_count() { return entries_.size(); }
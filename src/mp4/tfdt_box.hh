@@ -10,8 +10,8 @@ namespace MP4 {
 class TfdtBox : public FullBox
 {
 public:
-  TfdtBox(const uint64_t size, const std::string & type);
-  TfdtBox(const std::string & type,
+  TfdtBox(const uint64_t size, const FourCC type);
+  TfdtBox(const FourCC type,
           const uint8_t version,
           const uint32_t flags,
           const uint64_t base_media_decode_time);
@@ -5,11 +5,11 @@
 using namespace std;
 using namespace MP4;
 
-TfhdBox::TfhdBox(const uint64_t size, const string & type)
+TfhdBox::TfhdBox(const uint64_t size, const FourCC type)
   : FullBox(size, type), track_id_()
 {}
 
-TfhdBox::TfhdBox(const string & type,
+TfhdBox::TfhdBox(const FourCC type,
                  const uint8_t version,
                  const uint32_t flags,
                  const uint32_t track_id,
@@ -10,8 +10,8 @@ namespace MP4 {
 class TfhdBox : public FullBox
 {
 public:
-  TfhdBox(const uint64_t size, const std::string & type);
-  TfhdBox(const std::string & type,
+  TfhdBox(const uint64_t size, const FourCC type);
+  TfhdBox(const FourCC type,
           const uint8_t version,
           const uint32_t flags,
           const uint32_t track_id,
@@ -5,12 +5,12 @@
 using namespace std;
 using namespace MP4;
 
-TkhdBox::TkhdBox(const uint64_t size, const string & type)
+TkhdBox::TkhdBox(const uint64_t size, const FourCC type)
   : FullBox(size, type), creation_time_(), modification_time_(),
     track_id_(), duration_(), volume_(), width_(), height_()
 {}
 
-TkhdBox::TkhdBox(const string & type,
+TkhdBox::TkhdBox(const FourCC type,
                  const uint8_t version,
                  const uint32_t flags,
                  const uint64_t creation_time,
@@ -11,8 +11,8 @@ namespace MP4 {
 class TkhdBox : public FullBox
 {
 public:
-  TkhdBox(const uint64_t size, const std::string & type);
-  TkhdBox(const std::string & type,
+  TkhdBox(const uint64_t size, const FourCC type);
+  TkhdBox(const FourCC type,
           const uint8_t version,
           const uint32_t flags,
           const uint64_t creation_time,
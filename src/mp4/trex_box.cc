@@ -5,12 +5,12 @@
 using namespace std;
 using namespace MP4;
 
-TrexBox::TrexBox(const uint64_t size, const string & type)
+TrexBox::TrexBox(const uint64_t size, const FourCC type)
   : FullBox(size, type), track_id_(), default_sample_description_index_(),
     default_sample_duration_(), default_sample_size_(), default_sample_flags_()
 {}
 
-TrexBox::TrexBox(const string & type,
+TrexBox::TrexBox(const FourCC type,
                  const uint8_t version,
                  const uint32_t flags,
                  const uint32_t track_id,
@@ -10,8 +10,8 @@ namespace MP4 {
 class TrexBox : public FullBox
 {
 public:
-  TrexBox(const uint64_t size, const std::string & type);
-  TrexBox(const std::string & type,
+  TrexBox(const uint64_t size, const FourCC type);
+  TrexBox(const FourCC type,
           const uint8_t version,
           const uint32_t flags,
           const uint32_t track_id,
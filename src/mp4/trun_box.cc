@@ -1,4 +1,5 @@
 #include <iostream>
+#include <numeric>
 
 #include "trun_box.hh"
 #include "strict_conversions.hh"
@@ -6,15 +7,15 @@
 using namespace std;
 using namespace MP4;
 
-TrunBox::TrunBox(const uint64_t size, const string & type)
+TrunBox::TrunBox(const uint64_t size, const FourCC type)
   : FullBox(size, type), samples_()
 {}
 
-TrunBox::TrunBox(const string & type,
+TrunBox::TrunBox(const FourCC type,
                  const uint8_t version,
                  const uint32_t flags,
                  /* 'samples': lvalue is copied, rvalue is moved */
-                 vector<Sample> samples,
+                 Samples samples,
                  const int32_t data_offset,
                  const uint32_t first_sample_flags)
   : FullBox(type, version, flags), samples_(move(samples))
@@ -29,24 +30,29 @@ TrunBox::TrunBox(const string & type,
 
 uint64_t TrunBox::total_sample_duration()
 {
-  uint64_t total_sample_duration = 0;
-
-  for (const auto & sample : samples_) {
-    total_sample_duration += sample.sample_duration;
-  }
-
-  return total_sample_duration;
+  return accumulate(samples_.durations.begin(), samples_.durations.end(),
+                    uint64_t {0});
 }
 
 uint64_t TrunBox::total_sample_size()
 {
-  uint64_t total_sample_size = 0;
+  return accumulate(samples_.sizes.begin(), samples_.sizes.end(),
+                    uint64_t {0});
+}
+
+unsigned int TrunBox::fields_per_sample()
+{
+  unsigned int fields = 0;
 
-  for (const auto & sample : samples_) {
-    total_sample_size += sample.sample_size;
+  for (const uint32_t flag : {sample_duration_present, sample_size_present,
+                              sample_flags_present,
+                              sample_composition_time_offsets_present}) {
+    if (flags() & flag) {
+      fields++;
+    }
   }
 
-  return total_sample_size;
+  return fields;
 }
 
 void TrunBox::print_box(const unsigned int indent)
@@ -93,15 +99,15 @@ void TrunBox::print_box(const unsigned int indent)
 
     if (duration_present) {
       row += row.empty() ? i_str : ", ";
-      row += to_string(samples_[i].sample_duration);
+      row += to_string(samples_.durations[i]);
     }
     if (size_present) {
       row += row.empty() ? i_str : ", ";
-      row += to_string(samples_[i].sample_size);
+      row += to_string(samples_.sizes[i]);
     }
     if (offset_present) {
       row += row.empty() ? i_str : ", ";
-      row += to_string(samples_[i].sample_composition_time_offset);
+      row += to_string(samples_.composition_time_offsets[i]);
     }
 
     cout << indent_str << row << endl;
@@ -136,34 +142,36 @@ void TrunBox::parse_data(MP4File & mp4, const uint64_t data_size)
     first_sample_flags_ = mp4.read_uint32();
   }
 
-  for (uint32_t i = 0; i < sample_count; ++i) {
-    uint32_t sample_duration = 0;
-    uint32_t sample_size = 0;
-    uint32_t sample_flags = 0;
-    int64_t sample_composition_time_offset = 0;
+  /* read the row-major table in one go, then split it into columns */
+  const unsigned int fields = fields_per_sample();
+  const vector<uint32_t> table = mp4.read_uint32s(
+      static_cast<size_t>(sample_count) * fields);
 
-    if (flags() & sample_duration_present) {
-      sample_duration = mp4.read_uint32();
-    }
+  samples_.count = sample_count;
+  unsigned int column = 0;
 
-    if (flags() & sample_size_present) {
-      sample_size = mp4.read_uint32();
+  auto read_column = [&](const uint32_t flag, auto & values) {
+    if (not (flags() & flag)) {
+      return;
     }
 
-    if (flags() & sample_flags_present) {
-      sample_flags = mp4.read_uint32();
+    values.resize(sample_count);
+    for (uint32_t i = 0; i < sample_count; ++i) {
+      values[i] = table[i * fields + column];
     }
-
-    if (flags() & sample_composition_time_offsets_present) {
-      if (version() == 0) {
-        sample_composition_time_offset = mp4.read_uint32();
-      } else {
-        sample_composition_time_offset = mp4.read_int32();
-      }
+    column++;
+  };
+
+  read_column(sample_duration_present, samples_.durations);
+  read_column(sample_size_present, samples_.sizes);
+  read_column(sample_flags_present, samples_.flags);
+  read_column(sample_composition_time_offsets_present,
+              samples_.composition_time_offsets);
+
+  if (version() != 0) {
+    for (auto & offset : samples_.composition_time_offsets) {
+      offset = static_cast<int32_t>(offset);
     }
-
-    samples_.push_back({sample_duration, sample_size, sample_flags,
-                        sample_composition_time_offset});
   }
 
   check_data_left(mp4, data_size, init_offset);
@@ -186,29 +194,42 @@ void TrunBox::write_box(MP4File & mp4)
     mp4.write_uint32(first_sample_flags_);
   }
 
-  for (const auto & sample : samples_) {
-    if (flags() & sample_duration_present) {
-      mp4.write_uint32(sample.sample_duration);
-    }
+  /* interleave the columns into the row-major table and write it at once */
+  const unsigned int fields = fields_per_sample();
+  vector<uint32_t> table(static_cast<size_t>(sample_count()) * fields);
+  unsigned int column = 0;
 
-    if (flags() & sample_size_present) {
-      mp4.write_uint32(sample.sample_size);
+  auto write_column = [&](const uint32_t flag, const auto & values,
+                          auto convert) {
+    if (not (flags() & flag)) {
+      return;
     }
 
-    if (flags() & sample_flags_present) {
-      mp4.write_uint32(sample.sample_flags);
+    if (values.size() != sample_count()) {
+      throw runtime_error("trun: sample column of wrong size");
     }
 
-    if (flags() & sample_composition_time_offsets_present) {
-      if (version() == 0) {
-        mp4.write_uint32(
-            narrow_cast<uint32_t>(sample.sample_composition_time_offset));
-      } else {
-        mp4.write_int32(
-            narrow_cast<int32_t>(sample.sample_composition_time_offset));
-      }
+    for (uint32_t i = 0; i < sample_count(); ++i) {
+      table[i * fields + column] = convert(values[i]);
     }
-  }
+    column++;
+  };
+
+  auto as_is = [](const uint32_t value) { return value; };
+
+  write_column(sample_duration_present, samples_.durations, as_is);
+  write_column(sample_size_present, samples_.sizes, as_is);
+  write_column(sample_flags_present, samples_.flags, as_is);
+  write_column(sample_composition_time_offsets_present,
+               samples_.composition_time_offsets,
+               [this](const int64_t offset) {
+                 if (version() == 0) {
+                   return narrow_cast<uint32_t>(offset);
+                 }
+                 return static_cast<uint32_t>(narrow_cast<int32_t>(offset));
+               });
+
+  mp4.write_uint32s(table);
 
   fix_size_at(mp4, size_offset);
 }
@@ -11,25 +11,28 @@ namespace MP4 {
 class TrunBox : public FullBox
 {
 public:
-  struct Sample {
-    uint32_t sample_duration;
-    uint32_t sample_size;
-    uint32_t sample_flags;
+  /* the sample table as a struct of arrays: a column holds one entry per
+   * sample if its field is present in the box, and is empty otherwise */
+  struct Samples {
+    uint32_t count {0};
+    std::vector<uint32_t> durations {};
+    std::vector<uint32_t> sizes {};
+    std::vector<uint32_t> flags {};
     /* use int64_t to hold both unsigned and signed int32 */
-    int64_t sample_composition_time_offset;
+    std::vector<int64_t> composition_time_offsets {};
   };
 
-  TrunBox(const uint64_t size, const std::string & type);
-  TrunBox(const std::string & type,
+  TrunBox(const uint64_t size, const FourCC type);
+  TrunBox(const FourCC type,
           const uint8_t version,
           const uint32_t flags,
-          std::vector<Sample> samples,
+          Samples samples,
           const int32_t data_offset = 0,
           const uint32_t first_sample_flags = 0);
 
   /* accessors */
-  uint32_t sample_count() { return samples_.size(); }
-  std::vector<Sample> samples() { return samples_; }
+  uint32_t sample_count() { return samples_.count; }
+  const Samples & samples() { return samples_; }
 
   unsigned int data_offset_pos() {
     return FullBox::header_size() + 4 /* sample_count */;
@@ -56,7 +59,10 @@ public:
   static const uint32_t sample_composition_time_offsets_present = 0x000800;
 
 private:
-  std::vector<Sample> samples_;
+  Samples samples_;
+
+  /* number of uint32 fields per sample, given the flags */
+  unsigned int fields_per_sample();
 
   int32_t data_offset_ = 0;
   uint32_t first_sample_flags_ = 0;
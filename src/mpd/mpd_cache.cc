@@ -0,0 +1,345 @@
+#include <ctime>
+#include <iostream>
+#include <string>
+#include <memory>
+#include <queue>
+#include <numeric>
+
+#include "mpd_cache.hh"
+#include "mp4_info.hh"
+#include "mp4_parser.hh"
+#include "trun_box.hh"
+#include "strict_conversions.hh"
+#include "webm_info.hh"
+
+using namespace std;
+using namespace MPD;
+using namespace MP4;
+
+static const uint32_t global_timescale = 90000;
+
+static const set<fs::path> media_extension {".m4s", ".chk"};
+
+static inline bool is_webm(const fs::path & filename)
+{
+  return filename.extension() == ".webm" \
+      or filename.extension() == ".chk";
+}
+
+MediaInfo probe_media_info(const fs::path & file)
+{
+  MediaInfo info;
+
+  if (is_webm(file)) {
+    WebmInfo w_info(file);
+
+    info.codec = "opus";
+    info.timescale = w_info.get_timescale();
+    info.duration = w_info.get_duration(info.timescale);
+    info.sample_bytes = w_info.get_total_block_size();
+    info.sample_rate = w_info.get_sample_rate();
+    return info;
+  }
+
+  auto parser = make_shared<MP4Parser>(file);
+  parser->parse();
+  MP4Info m_info(parser);
+
+  tie(info.timescale, info.duration) = m_info.get_timescale_duration();
+
+  if (auto trun = static_pointer_cast<TrunBox>(
+        parser->find_first_box_of("trun"))) {
+    info.sample_count = trun->sample_count();
+    info.sample_bytes = trun->total_sample_size();
+  }
+
+  if (m_info.is_video()) {
+    info.codec = "avc1";
+    tie(info.width, info.height) = m_info.get_width_height();
+    tie(info.avc_profile, info.avc_level) = m_info.get_avc_profile_level();
+  } else if (m_info.is_audio()) {
+    info.codec = "mp4a";
+    info.sample_rate = m_info.get_sample_rate();
+    tie(info.audio_object_type, info.channel_count) =
+      m_info.get_audio_code_channel();
+  }
+
+  return info;
+}
+
+static shared_ptr<Representation> probe_webm_audio(
+    const MediaInfo & i_info, const MediaInfo & s_info,
+    const string & repr_id, const uint32_t expected_duration)
+{
+  /* get webm info */
+  uint32_t timescale = i_info.timescale;
+  uint32_t duration = narrow_cast<uint32_t>(i_info.duration);
+
+  /* compute the expected duration and actual duration */
+  float f_duration = duration / (float)(timescale);
+  float f_expected = expected_duration / (float)global_timescale;
+  if (f_duration != f_expected and expected_duration) {
+    cerr << "WARN: expect to find duration " << f_expected
+         << ". got " << f_duration << endl;
+  }
+
+  uint32_t sample_rate = i_info.sample_rate;
+
+  /* scale the timescale to global timescale */
+  float scaling_factor = static_cast<float>(global_timescale) / timescale;
+  timescale = global_timescale;
+  duration = narrow_round<uint32_t>(duration * scaling_factor);
+
+  if (expected_duration) {
+    duration = expected_duration;
+  }
+
+  if (duration == 0) {
+    throw runtime_error("Duration cannot be zero");
+  }
+
+  /* as WebmInfo::get_bitrate() */
+  double raw_bitrate = static_cast<double>(s_info.sample_bytes)
+                       / duration * timescale * 8;
+  uint32_t bitrate = (static_cast<uint32_t>(raw_bitrate) / 100) * 100;
+
+  return make_shared<AudioRepresentation>(repr_id, bitrate,
+        sample_rate, MimeType::Audio_OPUS, timescale, duration);
+}
+
+static shared_ptr<Representation> probe_mp4_representation(
+    const MediaInfo & i_info, const MediaInfo & s_info,
+    const string & repr_id, uint32_t expected_duration)
+{
+  /* selecting the proper values because mp4 atoms are a mess */
+  uint32_t duration = static_cast<uint32_t>(s_info.duration);
+
+  /* override the timescale from init.mp4 */
+  uint32_t timescale = s_info.timescale == 0 ? i_info.timescale
+                                             : s_info.timescale;
+
+  /* get bitrate, as MP4Info::get_bitrate() */
+  uint32_t bitrate = 0;
+  if (timescale != 0 and duration != 0) {
+    float s_duration = static_cast<float>(duration) / timescale; /* seconds */
+    float raw_bitrate = s_info.sample_bytes / s_duration * 8;
+    /* round to nearest thousands */
+    bitrate = (static_cast<uint32_t>(raw_bitrate) / 1000) * 1000;
+  }
+
+  float f_duration = duration / (float)(timescale);
+  float f_expected = expected_duration / (float)global_timescale;
+  if (f_duration != f_expected and expected_duration) {
+    cerr << "WARN: expect to find duration " << f_expected
+         << ". got " << f_duration << endl;
+  }
+
+  /* scale the timescale to global timescale */
+  float scaling_factor = static_cast<float>(global_timescale) / timescale;
+  timescale = global_timescale;
+  duration = narrow_round<uint32_t>(duration * scaling_factor);
+
+  if (expected_duration) {
+    duration = expected_duration;
+  }
+
+  if (i_info.codec == "avc1") {
+    /* this is a video; get fps as MP4Info::get_fps() */
+    float fps = duration == 0 ? 0 :
+      static_cast<float>(s_info.sample_count) * timescale / duration;
+    return make_shared<VideoRepresentation>(
+        repr_id, i_info.width, i_info.height, bitrate, i_info.avc_profile,
+        i_info.avc_level, fps, timescale, duration);
+  } else {
+    /* this is an audio */
+    /* translate audio code. default AAC_LC 0x40 0x67 */
+    MimeType type = MimeType::Audio_AAC_LC;
+    if (i_info.audio_object_type == 0x64) { /* I might be wrong about this value */
+      type = MimeType::Audio_HE_AAC;
+    } else if (i_info.audio_object_type == 0x69) {
+      type = MimeType::Audio_MP3;
+    }
+    return make_shared<AudioRepresentation>(repr_id, bitrate,
+                                            i_info.sample_rate, type,
+                                            timescale, duration);
+  }
+}
+
+shared_ptr<Representation> probe_representation(
+    const fs::path & init, const fs::path & segment,
+    const uint32_t expected_duration, MediaInfoCache * info_cache)
+{
+  /* get repr id from it's parent folder.
+   * for instance, if the segment path is a/b/0.m4s,
+   * then we will have b
+   */
+  fs::path repr_id = *(--(--segment.end()));
+  if (repr_id.empty()) {
+    throw runtime_error(segment.string() + " is in top folder");
+  }
+
+  auto media_info = [info_cache](const fs::path & file) {
+    return info_cache ? info_cache->get(file, probe_media_info)
+                      : probe_media_info(file);
+  };
+
+  const MediaInfo i_info = media_info(init);
+  const MediaInfo s_info = media_info(segment);
+
+  /* if this is a webm segment */
+  if (is_webm(segment)) {
+    return probe_webm_audio(i_info, s_info, repr_id, expected_duration);
+  } else {
+    return probe_mp4_representation(i_info, s_info, repr_id,
+                                    expected_duration);
+  }
+}
+
+FormatFiles find_format_files(const fs::path & dir,
+                              const fs::path & audio_init_name,
+                              const fs::path & video_init_name,
+                              const uint32_t num_check)
+{
+  FormatFiles files;
+  fs::path file_extension;
+  priority_queue<int> queue;
+
+  for (const auto & p : fs::directory_iterator(dir)) {
+    fs::path filename = p.path().filename();
+    file_extension = filename.extension();
+    if (find(media_extension.begin(), media_extension.end(), file_extension)
+        != media_extension.end()) {
+      int file_num = stoi(filename.stem().string());
+
+      /* set the segment only once */
+      if (files.segment.empty()) {
+        files.segment = p.path();
+      }
+      if (queue.size() >= num_check) {
+        if (file_num < queue.top()) {
+          /* find an earlier segment */
+          queue.pop();
+          queue.emplace(file_num);
+        }
+      } else {
+        queue.emplace(file_num);
+      }
+    }
+  }
+
+  if (files.segment.empty()) {
+    throw runtime_error("No media segments found in " + dir.string());
+  }
+
+  /* compute the expected duration */
+  files.expected_duration = queue.top();
+  while (queue.size()) {
+    files.expected_duration = gcd(queue.top(), files.expected_duration);
+    queue.pop();
+  }
+
+  if (file_extension != ".m4s" and file_extension != ".mp4") {
+    files.init = dir / audio_init_name.filename();
+  } else {
+    /* make an assumption here that media segments (audio and video) have
+     * the same extension, i.e., .m4s
+     */
+    files.init = dir / video_init_name.filename();
+  }
+
+  if (not fs::exists(files.init)) {
+    throw runtime_error("Cannnot find " + files.init.string());
+  }
+
+  return files;
+}
+
+MPDCache::MPDCache(const uint32_t min_buffer_time,
+                   const string & base_url,
+                   const string & time_url,
+                   const string & video_uri,
+                   const string & audio_uri,
+                   const fs::path & video_init_name,
+                   const fs::path & audio_init_name,
+                   const uint32_t num_check)
+  : min_buffer_time_(min_buffer_time), base_url_(base_url),
+    time_url_(time_url), video_uri_(video_uri), audio_uri_(audio_uri),
+    video_init_name_(video_init_name), audio_init_name_(audio_init_name),
+    num_check_(num_check)
+{}
+
+bool MPDCache::update(const fs::path & dir)
+{
+  const FormatFiles files = find_format_files(dir, audio_init_name_,
+                                              video_init_name_, num_check_);
+
+  const uintmax_t init_size = fs::file_size(files.init);
+  const fs::file_time_type init_mtime = fs::last_write_time(files.init);
+
+  /* the init segment is only replaced when it changes */
+  auto it = entries_.find(dir);
+  if (it != entries_.end() and it->second.init_size == init_size
+      and it->second.init_mtime == init_mtime) {
+    return false;
+  }
+
+  auto repr = probe_representation(files.init, files.segment,
+                                   files.expected_duration,
+                                   info_cache_.get());
+  entries_[dir] = {init_size, init_mtime, move(repr)};
+  mpd_.reset();
+
+  if (info_cache_) {
+    info_cache_->save();
+  }
+
+  return true;
+}
+
+void MPDCache::use_info_cache(const fs::path & path)
+{
+  info_cache_ = make_unique<MediaInfoCache>(path);
+}
+
+bool MPDCache::remove(const fs::path & dir)
+{
+  if (entries_.erase(dir) == 0) {
+    return false;
+  }
+
+  mpd_.reset();
+  return true;
+}
+
+void MPDCache::set_publish_time(const chrono::seconds time)
+{
+  publish_time_ = time;
+  mpd_.reset();
+}
+
+shared_ptr<const string> MPDCache::mpd()
+{
+  if (mpd_) {
+    return mpd_;
+  }
+
+  auto set_v = make_shared<VideoAdaptionSet>(1, video_init_name_, video_uri_);
+  auto set_a = make_shared<AudioAdaptionSet>(2, audio_init_name_, audio_uri_);
+
+  for (const auto & [dir, entry] : entries_) {
+    if (auto v = dynamic_pointer_cast<VideoRepresentation>(entry.repr)) {
+      set_v->add_repr(v);
+    } else {
+      set_a->add_repr(dynamic_pointer_cast<AudioRepresentation>(entry.repr));
+    }
+  }
+
+  MPDWriter writer(min_buffer_time_, base_url_, time_url_);
+  writer.set_publish_time(
+    publish_time_.value_or(chrono::seconds(std::time(nullptr))));
+  writer.add_video_adaption_set(set_v);
+  writer.add_audio_adaption_set(set_a);
+
+  mpd_ = make_shared<const string>(writer.flush());
+  return mpd_;
+}
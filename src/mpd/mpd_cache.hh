@@ -0,0 +1,100 @@
+#ifndef MPD_CACHE_HH
+#define MPD_CACHE_HH
+
+#include <cstdint>
+#include <string>
+#include <memory>
+#include <map>
+#include <optional>
+
+#include "mpd.hh"
+#include "filesystem.hh"
+#include "media_info_cache.hh"
+
+/* the files of a format that its representation is probed from */
+struct FormatFiles
+{
+  fs::path init {};
+  fs::path segment {};
+  uint32_t expected_duration {0};
+};
+
+/* find the init segment and a media segment in the directory of a format,
+ * and the duration of its segments from the GCD of the timestamps of (up to)
+ * num_check of the earliest ones */
+FormatFiles find_format_files(const fs::path & dir,
+                              const fs::path & audio_init_name,
+                              const fs::path & video_init_name,
+                              const uint32_t num_check);
+
+/* probe the metadata of an MP4 or WebM file by parsing it */
+MediaInfo probe_media_info(const fs::path & file);
+
+/* probe the representation of a format from its init segment and a media
+ * segment, named after the directory of the segment; their metadata is taken
+ * from info_cache if given */
+std::shared_ptr<MPD::Representation> probe_representation(
+    const fs::path & init, const fs::path & segment,
+    const uint32_t expected_duration,
+    MediaInfoCache * info_cache = nullptr);
+
+/* The MPD of a channel, kept in memory and updated incrementally: a format
+ * is only probed when it is added or its init segment changes, and the MPD
+ * is only serialized again when a representation changes, so serving it is
+ * a copy of mpd() rather than a probe of every format and a serialization. */
+class MPDCache
+{
+public:
+  static constexpr uint32_t DEFAULT_NUM_CHECK = 3;
+
+  MPDCache(const uint32_t min_buffer_time,
+           const std::string & base_url,
+           const std::string & time_url,
+           const std::string & video_uri = "$RepresentationID$/$Time$.m4s",
+           const std::string & audio_uri = "$RepresentationID$/$Time$.chk",
+           const fs::path & video_init_name = "$RepresentationID$/init.mp4",
+           const fs::path & audio_init_name = "$RepresentationID$/init.webm",
+           const uint32_t num_check = DEFAULT_NUM_CHECK);
+
+  /* add the format in dir, or probe it again if its init segment has changed
+   * since; return whether the MPD changed */
+  bool update(const fs::path & dir);
+
+  /* remove the format in dir; return whether it was there */
+  bool remove(const fs::path & dir);
+
+  /* the MPD, serialized again only if a format has changed since; it is
+   * published at that time unless set_publish_time() says otherwise */
+  std::shared_ptr<const std::string> mpd();
+
+  void set_publish_time(const std::chrono::seconds time);
+
+  /* take the metadata of the files probed from the MediaInfoCache saved at
+   * path, so that a restart only parses the files that changed since */
+  void use_info_cache(const fs::path & path);
+
+private:
+  uint32_t min_buffer_time_;
+  std::string base_url_, time_url_;
+  std::string video_uri_, audio_uri_;
+  fs::path video_init_name_, audio_init_name_;
+  uint32_t num_check_;
+
+  /* the init segment a representation was probed from, by its size and
+   * modification time */
+  struct Entry
+  {
+    uintmax_t init_size {0};
+    fs::file_time_type init_mtime {};
+    std::shared_ptr<MPD::Representation> repr {};
+  };
+
+  std::map<fs::path, Entry> entries_ {};  /* key: directory of a format */
+
+  std::optional<std::chrono::seconds> publish_time_ {};
+  std::shared_ptr<const std::string> mpd_ {};  /* null if out of date */
+
+  std::unique_ptr<MediaInfoCache> info_cache_ {};
+};
+
+#endif /* MPD_CACHE_HH */
@@ -4,6 +4,7 @@
 #define BODY_PARSER_HH
 
 #include <string>
+#include <string_view>
 
 class BodyParser
 {
@@ -12,7 +13,7 @@ public:
         - entire string belongs to body
         - only some of string (0 bytes to n bytes) belongs to body */
 
-    virtual std::string::size_type read( const std::string & str ) = 0;
+    virtual std::string::size_type read( const std::string_view str ) = 0;
 
     /* does message become complete upon EOF in body? */
     virtual bool eof() const = 0;
@@ -25,7 +26,7 @@ class Rule5BodyParser : public BodyParser
 {
 public:
     /* all of buffer always belongs to body */
-    std::string::size_type read( const std::string & ) override
+    std::string::size_type read( const std::string_view ) override
     {
         return std::string::npos;
     }
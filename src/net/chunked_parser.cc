@@ -8,47 +8,51 @@
 using namespace std;
 
 /* Take a chunk header and parse it assuming no folding */
-uint32_t ChunkedBodyParser::get_chunk_size( const string & chunk_hdr ) const
+uint32_t ChunkedBodyParser::get_chunk_size( const string_view chunk_hdr ) const
 {
     /* Check that the chunk header ends with a CRLF */
     assert( chunk_hdr.substr( chunk_hdr.length() - 2, 2 ) == "\r\n" );
 
     /* If there are chunk extensions, ';' terminates chunk size */
-    auto pos = chunk_hdr.find( ";" );
+    auto pos = chunk_hdr.find( ';' );
 
     /* There are no ';'s, and hence no chunk externsions, CRLF terminates chunk size */
-    if ( pos == string::npos ) {
+    if ( pos == string_view::npos ) {
         pos = chunk_hdr.find( "\r\n" );
     }
 
     /* Can't be npos even now */
-    assert( pos != string::npos );
+    assert( pos != string_view::npos );
 
     /* Parse hex string, after removing trailing spaces (RFC 2616 Section 2.1) */
     auto hex_string = chunk_hdr.substr( 0, pos );
-    auto space_loc = hex_string.find( " " );
-    if ( space_loc != string::npos ) hex_string.erase( space_loc, hex_string.length() - space_loc );
-    return strict_atoi( hex_string, 16 );
+    hex_string = hex_string.substr( 0, hex_string.find( ' ' ) );
+    return strict_atoi( string( hex_string ), 16 );
 }
 
-string::size_type ChunkedBodyParser::read( const std::string & input_buffer )
+string::size_type ChunkedBodyParser::read( const string_view input_buffer )
 {
+    /* drop what has been parsed before appending */
+    parser_buffer_.erase( 0, parser_offset_ );
+    parser_offset_ = 0;
     parser_buffer_ += input_buffer;
 
-    while ( !parser_buffer_.empty() ) {
+    while ( parser_offset_ < parser_buffer_.size() ) {
+        const string_view unparsed = string_view( parser_buffer_ ).substr( parser_offset_ );
+
         switch (state_) {
         case CHUNK_HDR: {
-            auto it = parser_buffer_.find( "\r\n" );
-            if (it != string::npos) {
+            auto it = unparsed.find( "\r\n" );
+            if (it != string_view::npos) {
                 /* if you have CRLF, get chunk size & transition to CHUNK/TRAILER */
-                current_chunk_size_ = get_chunk_size( parser_buffer_.substr( 0, it + 2 ) );
+                current_chunk_size_ = get_chunk_size( unparsed.substr( 0, it + 2 ) );
 
                 /* Transition appropriately */
                 state_ = ( current_chunk_size_ == 0 ) ? TRAILER : CHUNK;
 
-                /* shrink parser_buffer_ */
+                /* consume the chunk header */
                 parsed_so_far_ += ( it + 2 );
-                parser_buffer_ = parser_buffer_.substr( it + 2 );
+                parser_offset_ += ( it + 2 );
                 break;
             } else {
                 /* if you haven't seen a CRLF so far, do nothing */
@@ -58,16 +62,16 @@ string::size_type ChunkedBodyParser::read( const std::string & input_buffer )
         }
 
         case CHUNK: {
-            if ( parser_buffer_.length() >= current_chunk_size_ + 2 ) {
+            if ( unparsed.length() >= current_chunk_size_ + 2 ) {
                 /* accumulated enough bytes, check CRLF at the end of the chunk */
-                assert( parser_buffer_.substr( current_chunk_size_, 2 ) == "\r\n" );
+                assert( unparsed.substr( current_chunk_size_, 2 ) == "\r\n" );
 
                 /* Transition to next state */
                 state_ = CHUNK_HDR;
 
-                /* shrink parser_buffer_ */
+                /* consume the chunk */
                 parsed_so_far_ += current_chunk_size_ + 2;
-                parser_buffer_ = parser_buffer_.substr( current_chunk_size_ + 2 );
+                parser_offset_ += current_chunk_size_ + 2;
                 break;
             } else {
                 /* Haven't seen enough bytes so far, do nothing */
@@ -79,12 +83,12 @@ string::size_type ChunkedBodyParser::read( const std::string & input_buffer )
         case TRAILER: {
             if ( trailers_enabled_) {
                 /* We need two consecutive CRLFs */
-                return compute_ack_size( parser_buffer_,
+                return compute_ack_size( unparsed,
                                          "\r\n\r\n",
                                          input_buffer.length() );
             } else {
                 /* We need only one CRLF now */
-                return compute_ack_size( parser_buffer_,
+                return compute_ack_size( unparsed,
                                          "\r\n",
                                          input_buffer.length() );
             }
@@ -105,7 +109,7 @@ string::size_type ChunkedBodyParser::read( const std::string & input_buffer )
    telling it how much of the current input_buffer has been
    successfully parsed.
 */
-string::size_type ChunkedBodyParser::compute_ack_size( const string & haystack,
+string::size_type ChunkedBodyParser::compute_ack_size( const string_view haystack,
                                                        const string & needle,
                                                        const string::size_type input_size )
 {
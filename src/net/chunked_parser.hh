@@ -9,11 +9,14 @@
 class ChunkedBodyParser : public BodyParser
 {
 private:
-    std::string::size_type compute_ack_size(const std::string & haystack,
+    std::string::size_type compute_ack_size(const std::string_view haystack,
                                             const std::string & needle,
                                             std::string::size_type input_size);
-    uint32_t get_chunk_size(const std::string & chunk_hdr) const;
+    uint32_t get_chunk_size(const std::string_view chunk_hdr) const;
     std::string parser_buffer_ {""};
+    /* bytes of parser_buffer_ before this have been parsed; they are dropped
+       on the next read rather than copying the rest after each chunk */
+    std::string::size_type parser_offset_ {0};
     uint32_t current_chunk_size_ {0};
     std::string::size_type acked_so_far_ {0};
     std::string::size_type parsed_so_far_ {0};
@@ -21,7 +24,7 @@ private:
     const bool trailers_enabled_ {false};
 
 public:
-    std::string::size_type read( const std::string & ) override;
+    std::string::size_type read( const std::string_view ) override;
 
     /* Follow item 2, Section 4.4 of RFC 2616 */
     bool eof() const override { return true; }
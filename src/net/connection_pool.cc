@@ -0,0 +1,120 @@
+#include "connection_pool.hh"
+
+#include <sys/socket.h>
+
+#include "timestamp.hh"
+
+using namespace std;
+
+/* whether a connection with nothing left to read is still open */
+static bool idle_and_open(TCPSocket & socket)
+{
+  char byte;
+  const ssize_t ret = recv(socket.fd_num(), &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+  return ret < 0 and (errno == EAGAIN or errno == EWOULDBLOCK);
+}
+
+static bool idle_and_open(SecureSocket & socket)
+{
+  return socket.idle_and_open();
+}
+
+/* a new TCP connection to address, with keepalive on */
+static TCPSocket connect_tcp(const Address & address)
+{
+  TCPSocket socket;
+  socket.connect(address);
+
+  socket.set_keepalive(ConnectionPool<TCPSocket>::KEEPALIVE_IDLE_S);
+
+  return socket;
+}
+
+template<class SocketType>
+ConnectionPool<SocketType>::ConnectionPool(const unsigned int idle_timeout_s,
+                                           const size_t max_idle)
+  : idle_timeout_s_(idle_timeout_s), max_idle_(max_idle)
+{}
+
+template<class SocketType>
+ConnectionPool<SocketType>::ConnectionPool(SSLContext & ssl_context,
+                                           const unsigned int idle_timeout_s,
+                                           const size_t max_idle)
+  : ssl_context_(&ssl_context), idle_timeout_s_(idle_timeout_s),
+    max_idle_(max_idle)
+{}
+
+template<>
+TCPSocket ConnectionPool<TCPSocket>::connect(const Address & address)
+{
+  return connect_tcp(address);
+}
+
+template<>
+SecureSocket ConnectionPool<SecureSocket>::connect(const Address & address)
+{
+  if (not ssl_context_) {
+    throw runtime_error("ConnectionPool: no SSLContext for TLS connections");
+  }
+
+  SecureSocket socket = ssl_context_->new_secure_socket(connect_tcp(address));
+
+  const auto session_it = sessions_.find(address);
+  if (session_it != sessions_.end()) {
+    socket.set_session(session_it->second.get());
+  }
+
+  socket.connect();
+  return socket;
+}
+
+template<class SocketType>
+SocketType ConnectionPool<SocketType>::get(const Address & address)
+{
+  const auto idle_it = idle_.find(address);
+
+  if (idle_it != idle_.end()) {
+    auto & idle = idle_it->second;
+    const uint64_t now = timestamp_ms();
+
+    /* the newest first, as it is the least likely to have been closed */
+    while (not idle.empty()) {
+      Idle candidate = move(idle.back());
+      idle.pop_back();
+
+      if (now - candidate.since_ms < idle_timeout_s_ * 1000ULL and
+          idle_and_open(candidate.socket)) {
+        num_reused_++;
+        return move(candidate.socket);
+      }
+    }
+
+    idle_.erase(idle_it);
+  }
+
+  num_connected_++;
+  return connect(address);
+}
+
+template<class SocketType>
+void ConnectionPool<SocketType>::put(const Address & address,
+                                     SocketType && socket)
+{
+  if constexpr (is_same<SocketType, SecureSocket>::value) {
+    /* by now the server has sent its tickets, if any */
+    if (auto session = socket.session()) {
+      sessions_[address] = move(session);
+    }
+  }
+
+  auto & idle = idle_[address];
+  idle.push_back({move(socket), timestamp_ms()});
+
+  /* close the connections idle for the longest beyond max_idle_ */
+  while (idle.size() > max_idle_) {
+    idle.pop_front();
+  }
+}
+
+template class ConnectionPool<TCPSocket>;
+template class ConnectionPool<SecureSocket>;
@@ -0,0 +1,78 @@
+#ifndef CONNECTION_POOL_HH
+#define CONNECTION_POOL_HH
+
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+
+#include "address.hh"
+#include "socket.hh"
+#include "secure_socket.hh"
+
+/* Idle outbound connections (TCPSocket or SecureSocket), kept open to be
+ * reused for later exchanges with the same destination rather than set up
+ * anew each time. A connection is taken with get() and, once an exchange
+ * has left nothing to read on it, handed back with put(); one that is not
+ * handed back (e.g., on an error) is simply closed. Connections are
+ * blocking, have TCP keepalive on, and are checked to be still open (the
+ * server has not closed them, nor sent anything unexpected) before they
+ * are reused; those idle for longer than idle_timeout_s are closed. A TLS
+ * connection resumes the session of the last one to its destination, so
+ * even a new one has an abbreviated handshake. */
+template<class SocketType>
+class ConnectionPool
+{
+public:
+  static constexpr unsigned int DEFAULT_IDLE_TIMEOUT_S = 60;
+  static constexpr size_t DEFAULT_MAX_IDLE = 4;  /* per destination */
+  static constexpr unsigned int KEEPALIVE_IDLE_S = 30;
+
+  /* for TCPSocket */
+  ConnectionPool(const unsigned int idle_timeout_s = DEFAULT_IDLE_TIMEOUT_S,
+                 const size_t max_idle = DEFAULT_MAX_IDLE);
+
+  /* for SecureSocket, whose connections are set up with ssl_context */
+  ConnectionPool(SSLContext & ssl_context,
+                 const unsigned int idle_timeout_s = DEFAULT_IDLE_TIMEOUT_S,
+                 const size_t max_idle = DEFAULT_MAX_IDLE);
+
+  /* an idle connection to address if there is one still open, or else a
+   * new one; throws if it cannot connect */
+  SocketType get(const Address & address);
+
+  /* hand back a connection to address to be reused */
+  void put(const Address & address, SocketType && socket);
+
+  /* connections set up and reused so far */
+  uint64_t num_connected() const { return num_connected_; }
+  uint64_t num_reused() const { return num_reused_; }
+
+  /* forbid copying, as the idle connections cannot be */
+  ConnectionPool(const ConnectionPool & other) = delete;
+  const ConnectionPool & operator=(const ConnectionPool & other) = delete;
+
+private:
+  struct Idle
+  {
+    SocketType socket;
+    uint64_t since_ms;
+  };
+
+  SSLContext * ssl_context_ {nullptr};
+  unsigned int idle_timeout_s_;
+  size_t max_idle_;
+
+  /* oldest first */
+  std::map<Address, std::deque<Idle>> idle_ {};
+
+  /* SecureSocket only: the session to resume with each destination */
+  std::map<Address, std::shared_ptr<SSL_SESSION>> sessions_ {};
+
+  uint64_t num_connected_ {0};
+  uint64_t num_reused_ {0};
+
+  SocketType connect(const Address & address);
+};
+
+#endif /* CONNECTION_POOL_HH */
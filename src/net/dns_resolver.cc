@@ -0,0 +1,130 @@
+#include "dns_resolver.hh"
+
+#include "exception.hh"
+#include "timestamp.hh"
+
+using namespace std;
+using namespace PollerShortNames;
+
+DNSResolver::DNSResolver(Poller & poller, const unsigned int ttl_s)
+  : ttl_s_(ttl_s)
+{
+  poller.add_action(Poller::Action(*eventfd_, Direction::In,
+    [this, eventfd = eventfd_, alive = alive_]()->Result {
+      if (not *alive) {
+        return ResultType::Cancel;
+      }
+
+      eventfd->consume();
+
+      deliver();
+      return ResultType::Continue;
+    }
+  ).named("dns_resolver"));
+
+  thread_ = thread(&DNSResolver::run, this);
+}
+
+DNSResolver::~DNSResolver()
+{
+  *alive_ = false;
+
+  {
+    lock_guard<mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_one();
+
+  thread_.join();
+}
+
+void DNSResolver::resolve(const string & host, const string & service,
+                          Callback && callback)
+{
+  Key key {host, service};
+
+  auto cache_it = cache_.find(key);
+  if (cache_it != cache_.end()) {
+    if (timestamp_ms() < cache_it->second.expiry_ms) {
+      callback(cache_it->second.address, "");
+      return;
+    }
+
+    cache_.erase(cache_it);
+  }
+
+  /* only the first lookup of a name waiting for an answer queries it */
+  auto & callbacks = pending_[key];
+  callbacks.emplace_back(move(callback));
+  if (callbacks.size() > 1) {
+    return;
+  }
+
+  {
+    lock_guard<mutex> lock(mutex_);
+    queries_.emplace_back(move(key));
+  }
+  cv_.notify_one();
+}
+
+void DNSResolver::run()
+{
+  for (;;) {
+    Key key;
+
+    {
+      unique_lock<mutex> lock(mutex_);
+      cv_.wait(lock, [this]() { return stop_ or not queries_.empty(); });
+
+      if (stop_) {
+        return;
+      }
+
+      key = move(queries_.front());
+      queries_.pop_front();
+    }
+
+    Answer answer {key, nullopt, ""};
+    try {
+      answer.address = Address(key.first, key.second);
+    } catch (const exception & e) {
+      answer.error = e.what();
+    }
+
+    {
+      lock_guard<mutex> lock(mutex_);
+      answers_.emplace_back(move(answer));
+    }
+
+    eventfd_->notify();
+  }
+}
+
+void DNSResolver::deliver()
+{
+  deque<Answer> answers;
+  {
+    lock_guard<mutex> lock(mutex_);
+    answers.swap(answers_);
+  }
+
+  for (auto & answer : answers) {
+    if (answer.address) {
+      cache_.insert_or_assign(answer.key,
+        CacheEntry {*answer.address, timestamp_ms() + ttl_s_ * 1000});
+    }
+
+    auto pending_it = pending_.find(answer.key);
+    if (pending_it == pending_.end()) {
+      continue;
+    }
+
+    /* the callbacks might resolve again */
+    const auto callbacks = move(pending_it->second);
+    pending_.erase(pending_it);
+
+    for (const auto & callback : callbacks) {
+      callback(answer.address, answer.error);
+    }
+  }
+}
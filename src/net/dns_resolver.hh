@@ -0,0 +1,93 @@
+#ifndef DNS_RESOLVER_HH
+#define DNS_RESOLVER_HH
+
+#include <cstdint>
+#include <string>
+#include <deque>
+#include <map>
+#include <vector>
+#include <memory>
+#include <optional>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "address.hh"
+#include "poller.hh"
+#include "eventfd.hh"
+
+/* Resolves host names with getaddrinfo() on a thread of its own, so that a
+ * slow resolver never stalls the event loop. Completions are signaled on an
+ * eventfd, so that the callbacks are run by the poller like the other
+ * actions. Answers are cached for ttl_s (getaddrinfo does not tell the TTL
+ * of the records), and concurrent lookups of the same name share a single
+ * query; failures are not cached. */
+class DNSResolver
+{
+public:
+  /* the address, or nullopt along with the error if it failed */
+  using Callback = std::function<void(const std::optional<Address> & address,
+                                      const std::string & error)>;
+
+  static constexpr unsigned int DEFAULT_TTL_S = 60;
+
+  DNSResolver(Poller & poller, const unsigned int ttl_s = DEFAULT_TTL_S);
+
+  /* stops the thread, after the lookup in progress, without running any
+   * callbacks */
+  ~DNSResolver();
+
+  /* resolve host and service (a name or port number) to an IPv4 address;
+   * callback is run right away if the answer is cached */
+  void resolve(const std::string & host, const std::string & service,
+               Callback && callback);
+
+  /* forbid copying or moving */
+  DNSResolver(const DNSResolver & other) = delete;
+  const DNSResolver & operator=(const DNSResolver & other) = delete;
+  DNSResolver(DNSResolver && other) = delete;
+  DNSResolver & operator=(DNSResolver && other) = delete;
+
+private:
+  using Key = std::pair<std::string, std::string>;  /* host, service */
+
+  struct Answer
+  {
+    Key key;
+    std::optional<Address> address;
+    std::string error;
+  };
+
+  struct CacheEntry
+  {
+    Address address;
+    uint64_t expiry_ms;
+  };
+
+  unsigned int ttl_s_;
+
+  /* accessed by the event loop only */
+  std::map<Key, CacheEntry> cache_ {};
+  std::map<Key, std::vector<Callback>> pending_ {};
+
+  /* shared with the thread */
+  std::mutex mutex_ {};
+  std::condition_variable cv_ {};
+  std::deque<Key> queries_ {};
+  std::deque<Answer> answers_ {};
+  bool stop_ {false};
+
+  /* shared with the poller action, which might outlive the resolver */
+  std::shared_ptr<EventFD> eventfd_ {std::make_shared<EventFD>()};
+  std::shared_ptr<bool> alive_ {std::make_shared<bool>(true)};
+
+  std::thread thread_ {};
+
+  void run();
+
+  /* run the callbacks of the answered queries */
+  void deliver();
+};
+
+#endif /* DNS_RESOLVER_HH */
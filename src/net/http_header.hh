@@ -4,6 +4,7 @@
 #define HTTP_HEADER_HH
 
 #include <string>
+#include <string_view>
 
 class HTTPHeader
 {
@@ -11,7 +12,7 @@ private:
     std::string key_, value_;
 
 public:
-    HTTPHeader( const std::string & buf );
+    HTTPHeader( const std::string_view buf );
     HTTPHeader( const std::string & key, const std::string & value );
 
     const std::string & key() const { return key_; }
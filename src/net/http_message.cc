@@ -8,14 +8,14 @@
 using namespace std;
 
 /* methods called by an external parser */
-void HTTPMessage::set_first_line( const string & str )
+void HTTPMessage::set_first_line( const string_view str )
 {
     assert( state_ == FIRST_LINE_PENDING );
     first_line_ = str;
     state_ = HEADERS_PENDING;
 }
 
-void HTTPMessage::add_header( const std::string & str )
+void HTTPMessage::add_header( const string_view str )
 {
     assert( state_ == HEADERS_PENDING );
     headers_.emplace_back( str );
@@ -42,7 +42,7 @@ void HTTPMessage::set_expected_body_size( const bool is_known, const size_t valu
     expected_body_size_ = make_pair( is_known, value );
 }
 
-size_t HTTPMessage::read_in_body( const std::string & str )
+size_t HTTPMessage::read_in_body( const string_view str )
 {
     assert( state_ == BODY_PENDING );
 
@@ -4,6 +4,7 @@
 #define HTTP_MESSAGE_HH
 
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include "http_header.hh"
@@ -25,7 +26,7 @@ private:
     virtual void calculate_expected_body_size() = 0;
 
     /* bodies with size not known in advance must be handled by subclass */
-    virtual size_t read_in_complex_body( const std::string & str ) = 0;
+    virtual size_t read_in_complex_body( const std::string_view str ) = 0;
 
     /* does message become complete upon EOF in body? */
     virtual bool eof_in_body() const = 0;
@@ -51,10 +52,10 @@ public:
     virtual ~HTTPMessage() {}
 
     /* methods called by an external parser */
-    void set_first_line( const std::string & str );
-    void add_header( const std::string & str );
+    void set_first_line( const std::string_view str );
+    void add_header( const std::string_view str );
     void done_with_headers();
-    size_t read_in_body( const std::string & str );
+    size_t read_in_body( const std::string_view str );
     void eof();
 
     /* setter */
@@ -4,7 +4,9 @@
 #define HTTP_MESSAGE_SEQUENCE
 
 #include <string>
+#include <string_view>
 #include <queue>
+#include <algorithm>
 #include <cassert>
 
 #include "http_message.hh"
@@ -18,18 +20,29 @@ private:
     private:
         std::string buffer_ {};
 
+        /* bytes before start_ have been consumed; they are dropped on the
+           next append, rather than moving the rest on every pop */
+        size_t start_ {0};
+
+        /* no line ending starts in [start_, scanned_), so that a partial
+           line is not searched again as more of it arrives */
+        size_t scanned_ {0};
+
+        size_t find_line_ending();
+
     public:
-        bool have_complete_line() const;
+        bool have_complete_line() { return find_line_ending() != std::string::npos; }
 
-        std::string get_and_pop_line();
+        /* the view is valid until the next append */
+        std::string_view get_and_pop_line();
 
         void pop_bytes( const size_t n );
 
-        bool empty() const { return buffer_.empty(); }
+        bool empty() const { return start_ == buffer_.size(); }
 
-        void append( const std::string & str ) { buffer_.append( str ); }
+        void append( const std::string_view str );
 
-        const std::string & str() const { return buffer_; }
+        std::string_view str() const { return std::string_view( buffer_ ).substr( start_ ); }
     };
 
     /* bytes that haven't been parsed yet */
@@ -55,7 +68,7 @@ public:
     virtual ~HTTPMessageSequence() {}
 
     /* must accept all of buf */
-    void parse( const std::string & buf );
+    void parse( const std::string_view buf );
 
     /* getters */
     bool empty() const { return complete_messages_.empty(); }
@@ -68,29 +81,50 @@ public:
 };
 
 template <class MessageType>
-bool HTTPMessageSequence<MessageType>::InternalBuffer::have_complete_line() const
+size_t HTTPMessageSequence<MessageType>::InternalBuffer::find_line_ending()
 {
-    size_t first_line_ending = buffer_.find( CRLF );
-    return first_line_ending != std::string::npos;
+    const size_t line_ending = buffer_.find( CRLF, scanned_ );
+    if ( line_ending == std::string::npos ) {
+        /* the last byte might be the start of a CRLF */
+        scanned_ = std::max( start_, buffer_.size() - std::min( buffer_.size(), CRLF.size() - 1 ) );
+    } else {
+        scanned_ = line_ending;
+    }
+
+    return line_ending;
 }
 
 template <class MessageType>
-std::string HTTPMessageSequence<MessageType>::InternalBuffer::get_and_pop_line()
+std::string_view HTTPMessageSequence<MessageType>::InternalBuffer::get_and_pop_line()
 {
-    size_t first_line_ending = buffer_.find( CRLF );
-    assert( first_line_ending != std::string::npos );
+    const size_t line_ending = find_line_ending();
+    assert( line_ending != std::string::npos );
 
-    std::string first_line( buffer_.substr( 0, first_line_ending ) );
-    pop_bytes( first_line_ending + CRLF.size() );
+    const std::string_view line = std::string_view( buffer_ ).substr( start_, line_ending - start_ );
+    pop_bytes( line.size() + CRLF.size() );
 
-    return first_line;
+    return line;
 }
 
 template <class MessageType>
 void HTTPMessageSequence<MessageType>::InternalBuffer::pop_bytes( const size_t num )
 {
-    assert( buffer_.size() >= num );
-    buffer_.replace( 0, num, std::string() );
+    assert( buffer_.size() - start_ >= num );
+    start_ += num;
+    scanned_ = std::max( scanned_, start_ );
+}
+
+template <class MessageType>
+void HTTPMessageSequence<MessageType>::InternalBuffer::append( const std::string_view str )
+{
+    /* drop the consumed bytes once per append */
+    if ( start_ > 0 ) {
+        buffer_.erase( 0, start_ );
+        scanned_ -= start_;
+        start_ = 0;
+    }
+
+    buffer_.append( str );
 }
 
 template <class MessageType>
@@ -113,7 +147,7 @@ bool HTTPMessageSequence<MessageType>::parsing_step()
 
         /* is line blank? */
         {
-            std::string line( buffer_.get_and_pop_line() );
+            const std::string_view line = buffer_.get_and_pop_line();
             if ( line.empty() ) {
                 message_in_progress_.done_with_headers();
             } else {
@@ -141,7 +175,7 @@ bool HTTPMessageSequence<MessageType>::parsing_step()
 }
 
 template <class MessageType>
-void HTTPMessageSequence<MessageType>::parse( const std::string & buf )
+void HTTPMessageSequence<MessageType>::parse( const std::string_view buf )
 {
     if ( buf.empty() ) { /* EOF */
         message_in_progress_.eof();
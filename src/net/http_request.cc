@@ -26,7 +26,7 @@ void HTTPRequest::calculate_expected_body_size()
     }
 }
 
-size_t HTTPRequest::read_in_complex_body( const std::string & )
+size_t HTTPRequest::read_in_complex_body( const std::string_view )
 {
     /* we don't support complex bodies */
     throw runtime_error( "HTTPRequest: does not support chunked requests" );
@@ -12,7 +12,7 @@ private:
     void calculate_expected_body_size() override;
 
     /* we have no complex bodies */
-    size_t read_in_complex_body( const std::string & str ) override;
+    size_t read_in_complex_body( const std::string_view str ) override;
 
     /* connection closed while body was pending */
     bool eof_in_body() const override;
@@ -66,7 +66,7 @@ void HTTPResponse::calculate_expected_body_size()
     }
 }
 
-size_t HTTPResponse::read_in_complex_body( const std::string & str )
+size_t HTTPResponse::read_in_complex_body( const std::string_view str )
 {
     assert( state_ == BODY_PENDING );
     assert( body_parser_ );
@@ -16,7 +16,7 @@ private:
 
     /* required methods */
     void calculate_expected_body_size() override;
-    size_t read_in_complex_body( const std::string & str ) override;
+    size_t read_in_complex_body( const std::string_view str ) override;
     bool eof_in_body() const override;
 
     std::unique_ptr<BodyParser> body_parser_ { nullptr };
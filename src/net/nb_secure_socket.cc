@@ -3,6 +3,11 @@
 #include "nb_secure_socket.hh"
 
 #include <cassert>
+#include <utility>
+#include <vector>
+
+#include "timestamp.hh"
+#include "counters.hh"
 
 using namespace std;
 
@@ -16,6 +21,7 @@ void NBSecureSocket::accept()
 {
   mode_ = Mode::accept;
   state_ = State::needs_accept;
+  handshake_start_us_ = timestamp_us();
 }
 
 void NBSecureSocket::continue_SSL_connect()
@@ -66,27 +72,20 @@ void NBSecureSocket::continue_SSL_accept()
       state_ == State::needs_ssl_write_to_accept or
       state_ == State::needs_ssl_read_to_accept)
   {
-    try {
-      SecureSocket::accept( state_ == State::needs_ssl_write_to_accept );
-    }
-    catch (const ssl_error & s) {
-      switch (s.error_code()) {
-      case SSL_ERROR_WANT_READ:
-        state_ = State::needs_ssl_read_to_accept;
-        break;
-
-      case SSL_ERROR_WANT_WRITE:
-        state_ = State::needs_ssl_write_to_accept;
-        break;
-
-      default:
-        throw;
-      }
+    if (handshake_offload_) {
+      /* the poller expects the action to have serviced the socket */
+      register_service(state_ == State::needs_ssl_write_to_accept);
 
+      offloaded_from_ = state_;
+      state_ = State::accepting_offloaded;
+      handshake_offload_();
       return;
     }
 
-    state_ = State::ready;
+    state_ = step_SSL_accept(state_);
+    if (state_ == State::ready) {
+      handshake_us_ = timestamp_us() - handshake_start_us_;
+    }
     return;
   }
 
@@ -94,10 +93,118 @@ void NBSecureSocket::continue_SSL_accept()
   throw runtime_error("session already connected");
 }
 
+NBSecureSocket::State NBSecureSocket::step_SSL_accept(const State state)
+{
+  try {
+    SecureSocket::accept( state == State::needs_ssl_write_to_accept );
+  }
+  catch (const ssl_error & s) {
+    switch (s.error_code()) {
+    case SSL_ERROR_WANT_READ:
+      return State::needs_ssl_read_to_accept;
+
+    case SSL_ERROR_WANT_WRITE:
+      return State::needs_ssl_write_to_accept;
+
+    default:
+      throw;
+    }
+  }
+
+  return State::ready;
+}
+
+void NBSecureSocket::run_offloaded_SSL_accept()
+{
+  /* only offloaded_to_ and offloaded_error_ are written here, as the thread
+   * of the poller may look at state_ meanwhile */
+  try {
+    offloaded_to_ = step_SSL_accept(offloaded_from_);
+  }
+  catch (...) {
+    offloaded_error_ = current_exception();
+  }
+}
+
+void NBSecureSocket::finish_offloaded_SSL_accept()
+{
+  if (state_ != State::accepting_offloaded) {
+    throw runtime_error("no handshake step was offloaded");
+  }
+
+  if (offloaded_error_) {
+    state_ = State::closed;
+    rethrow_exception(exchange(offloaded_error_, nullptr));
+  }
+
+  state_ = offloaded_to_;
+  if (state_ == State::ready) {
+    handshake_us_ = timestamp_us() - handshake_start_us_;
+  }
+}
+
+void NBSecureSocket::prepare_SSL_write()
+{
+  const string_view front =
+    write_buffer_.front().view().substr(write_buffer_offset_);
+
+  if (front.size() >= max_record_bytes_) {
+    /* large enough to be written as is */
+    pending_write_ = front;
+    pending_in_record_ = false;
+    return;
+  }
+
+  /* coalesce the small buffers (e.g., frame headers and acks), each of
+   * which would be a TLS record of its own otherwise */
+  record_.clear();
+
+  while (not write_buffer_.empty() and record_.size() < max_record_bytes_) {
+    const string_view buffer =
+      write_buffer_.front().view().substr(write_buffer_offset_);
+    const size_t length = min(buffer.size(),
+                              max_record_bytes_ - record_.size());
+    record_.append(buffer.substr(0, length));
+
+    if (length < buffer.size()) {
+      write_buffer_offset_ += length;
+    } else {
+      write_buffer_offset_ = 0;
+      write_buffer_.pop_front();
+    }
+  }
+
+  pending_write_ = record_;
+  pending_in_record_ = true;
+}
+
 void NBSecureSocket::continue_SSL_write()
 {
+  /* only between writes, as an SSL_write must be retried as is */
+  if (record_size_ > 0 and record_size_ != applied_record_size_ and
+      pending_write_.empty() and state_ == State::ready) {
+    set_max_send_fragment(record_size_);
+    applied_record_size_ = record_size_;
+  }
+
+  if (state_ == State::ready and ktls_send()) {
+    continue_ktls_write();
+    return;
+  }
+
+  if (pending_write_.empty()) {
+    if (write_buffer_.empty()) {
+      register_write();
+      return;
+    }
+
+    prepare_SSL_write();
+  }
+
+  Counters::count(Counters::SSL_WRITES);
+
   try {
-    SecureSocket::write(write_buffer_.size() ? write_buffer_.front() : string(),
+    SecureSocket::write(pending_write_,
                         state_ == State::needs_ssl_read_to_write);
   }
   catch (ssl_error & s) {
@@ -117,19 +224,88 @@ void NBSecureSocket::continue_SSL_write()
     return;
   }
 
-  write_buffer_.pop_front();
+  num_writes_++;
+  bytes_written_ += pending_write_.size();
+  Counters::count(Counters::SSL_WRITE_BYTES, pending_write_.size());
+
+  if (not pending_in_record_) {
+    write_buffer_offset_ = 0;
+    write_buffer_.pop_front();
+  }
+
+  pending_write_ = {};
   state_ = State::ready;
 }
 
+void NBSecureSocket::continue_ktls_write()
+{
+  /* max number of buffers to gather into a single writev */
+  static constexpr size_t MAX_WRITEV_BUFFERS = 64;
+
+  if (write_buffer_.empty()) {
+    register_write();
+    return;
+  }
+
+  vector<string_view> buffers;
+  size_t total_bytes = 0;
+  for (auto it = write_buffer_.cbegin();
+       it != write_buffer_.cend() and buffers.size() < MAX_WRITEV_BUFFERS and
+       total_bytes < max_write_bytes_;
+       it++) {
+    buffers.emplace_back(it->view());
+
+    /* skip the part of the first buffer that has been written */
+    if (it == write_buffer_.cbegin()) {
+      buffers.back().remove_prefix(write_buffer_offset_);
+    }
+
+    /* truncate the last buffer to the cap */
+    if (buffers.back().size() > max_write_bytes_ - total_bytes) {
+      buffers.back().remove_suffix(buffers.back().size() -
+                                   (max_write_bytes_ - total_bytes));
+    }
+
+    total_bytes += buffers.back().size();
+  }
+
+  /* unlike SSL_write, writev might write only part of the buffers */
+  size_t bytes_written = TCPSocket::writev(buffers);
+
+  num_writes_++;
+  bytes_written_ += bytes_written;
+
+  while (bytes_written > 0) {
+    const size_t remaining = write_buffer_.front().size() - write_buffer_offset_;
+    if (bytes_written < remaining) {
+      write_buffer_offset_ += bytes_written;
+      break;
+    }
+
+    bytes_written -= remaining;
+    write_buffer_offset_ = 0;
+    write_buffer_.pop_front();
+  }
+}
+
 void NBSecureSocket::continue_SSL_read()
 {
+  Counters::count(Counters::SSL_READS);
+
   try {
-    read_buffer_ += SecureSocket::read(state_ == State::needs_ssl_write_to_read);
+    IOBuffer buffer;
+    const string_view data = SecureSocket::read(buffer,
+      state_ == State::needs_ssl_write_to_read);
+    read_buffer_.append(data);
+    Counters::count(Counters::SSL_READ_BYTES, data.size());
   }
   catch (ssl_error & s) {
     switch (s.error_code()) {
     case SSL_ERROR_WANT_READ:
-      state_ = State::needs_ssl_read_to_read;
+      /* no complete record yet (or only a TLS 1.3 session ticket): unlike
+       * SSL_write, nothing has to be retried as is, so stay ready to write
+       * rather than wait for the peer to send more */
+      state_ = State::ready;
       break;
 
     case SSL_ERROR_WANT_WRITE:
@@ -153,6 +329,13 @@ string NBSecureSocket::ezread()
   return buffer;
 }
 
+string_view NBSecureSocket::ezread_view()
+{
+  swap(read_buffer_, read_view_buffer_);
+  read_buffer_.clear();
+  return read_view_buffer_;
+}
+
 unsigned int NBSecureSocket::buffer_bytes() const
 {
   unsigned int total_bytes = 0;
@@ -161,10 +344,44 @@ unsigned int NBSecureSocket::buffer_bytes() const
     total_bytes += buffer.size();
   }
 
+  total_bytes -= write_buffer_offset_;
+
+  /* a coalesced record has been taken out of write_buffer_ */
+  if (pending_in_record_) {
+    total_bytes += pending_write_.size();
+  }
+
   return total_bytes;
 }
 
 void NBSecureSocket::clear_buffer()
 {
-  write_buffer_.clear();
+  /* the front buffer has started to go out if part of it has been written
+   * or coalesced into a record, or if an SSL_write in progress from it must
+   * be retried with it, or if it continues a buffer that has; it is kept
+   * along with the buffers that continue it, so that the message that has
+   * started is not cut short */
+  size_t keep = 0;
+  if (not write_buffer_.empty() and
+      (write_buffer_offset_ > 0 or write_buffer_.front().continuation() or
+       (not pending_write_.empty() and not pending_in_record_))) {
+    keep = 1;
+    while (keep < write_buffer_.size() and
+           write_buffer_[keep].continuation()) {
+      keep++;
+    }
+  }
+
+  write_buffer_.erase(write_buffer_.begin() + keep, write_buffer_.end());
+}
+
+void NBSecureSocket::set_write_caps(const size_t max_write_bytes,
+                                    const size_t max_record_bytes)
+{
+  if (max_write_bytes == 0 or max_record_bytes == 0) {
+    throw runtime_error("write caps must be positive");
+  }
+
+  max_write_bytes_ = max_write_bytes;
+  max_record_bytes_ = max_record_bytes;
 }
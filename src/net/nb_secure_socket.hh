@@ -4,9 +4,14 @@
 #define CONNECTION_HH
 
 #include <string>
+#include <string_view>
 #include <deque>
+#include <exception>
+#include <functional>
+#include <optional>
 
 #include "secure_socket.hh"
+#include "shared_buffer.hh"
 
 class NBSecureSocket : public SecureSocket
 {
@@ -22,6 +27,7 @@ public:
                     needs_accept,
                     needs_ssl_read_to_accept,
                     needs_ssl_write_to_accept,
+                    accepting_offloaded,  /* see set_handshake_offload() */
 
                     needs_ssl_write_to_write,
                     needs_ssl_write_to_read,
@@ -36,9 +42,53 @@ private:
   Mode mode_ {Mode::not_set};
   State state_ {State::not_connected};
 
-  std::deque<std::string> write_buffer_ {};
+  std::deque<SharedBuffer> write_buffer_ {};
+  size_t write_buffer_offset_ {0};
   std::string read_buffer_ {};
 
+  /* the bytes returned by the last ezread_view() */
+  std::string read_view_buffer_ {};
+
+  /* data of the SSL_write in progress, which must be retried with the same
+   * data: a record coalesced from small buffers in record_, or a view of the
+   * front buffer if that is large enough to be written by itself */
+  std::string record_ {};
+  std::string_view pending_write_ {};
+  bool pending_in_record_ {false};
+
+  /* caps on the bytes of a writev (kTLS) and of a coalesced TLS record */
+  size_t max_write_bytes_ {256 * 1024};
+  size_t max_record_bytes_ {16 * 1024};
+
+  /* the plaintext bytes of each TLS record (see set_record_size()), and
+   * those of the records being written; 0: the default of OpenSSL (16 KB) */
+  size_t record_size_ {0};
+  size_t applied_record_size_ {0};
+
+  /* when accept() was called, and how long the handshake took */
+  uint64_t handshake_start_us_ {0};
+  std::optional<uint64_t> handshake_us_ {};
+
+  /* see set_handshake_offload(); the state before and after the step that
+   * is run elsewhere, or what the step threw */
+  std::function<void()> handshake_offload_ {};
+  State offloaded_from_ {State::not_connected};
+  State offloaded_to_ {State::not_connected};
+  std::exception_ptr offloaded_error_ {};
+
+  /* a step of the handshake (SSL_accept) from state; returns the next state */
+  State step_SSL_accept(const State state);
+
+  /* number of writes (SSL_write or writev) and bytes they wrote */
+  uint64_t num_writes_ {0};
+  uint64_t bytes_written_ {0};
+
+  /* write the plaintext buffers to the socket directly (kTLS is enabled) */
+  void continue_ktls_write();
+
+  /* set pending_write_ to the next data to pass to SSL_write */
+  void prepare_SSL_write();
+
 public:
   NBSecureSocket(SecureSocket && sock)
     : SecureSocket(std::move(sock))
@@ -52,14 +102,53 @@ public:
   void continue_SSL_write();
   void continue_SSL_read();
 
+  /* rather than run the steps of an accepted handshake (SSL_accept, which
+   * does the public-key operations) itself, continue_SSL_accept() calls
+   * offload, which must arrange for run_offloaded_SSL_accept() to be called
+   * on another thread, and then finish_offloaded_SSL_accept() on this one.
+   * In between, the state is accepting_offloaded, in which the socket is
+   * not polled and must not be touched. */
+  void set_handshake_offload(std::function<void()> && offload)
+  {
+    handshake_offload_ = std::move(offload);
+  }
+
+  void run_offloaded_SSL_accept();
+
+  /* rethrows what the step threw, if anything */
+  void finish_offloaded_SSL_accept();
+
   std::string ezread();
+
+  /* like ezread(), but the view is valid until the next call, and neither
+   * buffer is reallocated once they have grown to the size of a read */
+  std::string_view ezread_view();
   void ezwrite(const std::string & msg) { write_buffer_.emplace_back(msg); };
   void ezwrite(std::string && msg) { write_buffer_.emplace_back(move(msg)); };
+  void ezwrite(SharedBuffer && msg) { write_buffer_.emplace_back(std::move(msg)); };
   unsigned int buffer_bytes() const;
 
+  /* drop the buffers that have yet to go out, except the rest of one that
+   * has started to (see SharedBuffer::continuation()) */
   void clear_buffer();
 
-  bool something_to_write() const { return (write_buffer_.size() > 0); }
+  void set_write_caps(const size_t max_write_bytes,
+                      const size_t max_record_bytes);
+
+  /* write TLS records of about bytes of plaintext from the next write on
+   * (an SSL_write in progress is retried as is) */
+  void set_record_size(const size_t bytes) { record_size_ = bytes; }
+
+  /* duration of the accepted handshake, once it has completed */
+  std::optional<uint64_t> handshake_us() const { return handshake_us_; }
+
+  uint64_t num_writes() const { return num_writes_; }
+  uint64_t bytes_written() const { return bytes_written_; }
+
+  bool something_to_write() const
+  {
+    return write_buffer_.size() > 0 or not pending_write_.empty();
+  }
   bool something_to_read() const { return (read_buffer_.size() > 0); }
 
   State state() const  { return state_; }
@@ -78,7 +167,8 @@ public:
   {
     return (state_ != State::needs_accept) and
            (state_ != State::needs_ssl_read_to_accept) and
-           (state_ != State::needs_ssl_write_to_accept);
+           (state_ != State::needs_ssl_write_to_accept) and
+           (state_ != State::accepting_offloaded);
   }
 };
 
@@ -4,6 +4,17 @@
 #include <vector>
 #include <thread>
 #include <mutex>
+#include <ctime>
+#include <cstring>
+#include <initializer_list>
+#include <algorithm>
+#include <linux/tls.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#endif
 
 #include "secure_socket.hh"
 #include "exception.hh"
@@ -93,14 +104,15 @@ SecureSocket SSLContext::new_secure_socket( TCPSocket && sock )
 void SecureSocket::connect( void )
 {
     ERR_clear_error();
-    int retval = SSL_connect( ssl_.get() );
-
-    if ( not retval ) {
-        throw ssl_error( "SSL_connect", SSL_get_error( ssl_.get(), retval ) );
-    }
+    const int retval = SSL_connect( ssl_.get() );
 
+    /* a non-blocking handshake in progress returns -1 as well */
     register_read();
     register_write();
+
+    if ( retval != 1 ) {
+        throw ssl_error( "SSL_connect", SSL_get_error( ssl_.get(), retval ) );
+    }
 }
 
 void SecureSocket::accept( const bool register_as_write )
@@ -123,14 +135,18 @@ void SecureSocket::accept( const bool register_as_write )
 }
 
 string SecureSocket::read( const bool register_as_write )
+{
+    IOBuffer buffer;
+    return string( read( buffer, register_as_write ) );
+}
+
+string_view SecureSocket::read( IOBuffer & buffer, const bool register_as_write )
 {
     /* SSL record max size is 16kB */
     const size_t SSL_max_record_length = 16384;
 
-    char buffer[ SSL_max_record_length ];
-
     ERR_clear_error();
-    ssize_t bytes_read = SSL_read( ssl_.get(), buffer, SSL_max_record_length );
+    ssize_t bytes_read = SSL_read( ssl_.get(), buffer.data(), SSL_max_record_length );
 
     /* Make sure that we really are reading from the underlying fd */
     assert( 0 == SSL_pending( ssl_.get() ) );
@@ -145,7 +161,8 @@ string SecureSocket::read( const bool register_as_write )
             set_eof();
         }
         register_service( register_as_write );
-        return string(); /* EOF */
+        buffer.set_size( 0 );
+        return buffer.view(); /* EOF */
     } else if ( bytes_read < 0 ) {
         if ( error_return == SSL_ERROR_WANT_WRITE or error_return == SSL_ERROR_WANT_READ ) {
           register_service( register_as_write );
@@ -155,11 +172,12 @@ string SecureSocket::read( const bool register_as_write )
     } else {
         /* success */
         register_service( register_as_write );
-        return string( buffer, bytes_read );
+        buffer.set_size( bytes_read );
+        return buffer.view();
     }
 }
 
-void SecureSocket::write( const string & message, const bool register_as_read )
+void SecureSocket::write( const string_view & message, const bool register_as_read )
 {
     /* SSL_write returns with success if complete contents of message are written */
     ERR_clear_error();
@@ -183,6 +201,69 @@ int SecureSocket::get_error( const int return_value )
     return SSL_get_error( ssl_.get(), return_value );
 }
 
+bool SecureSocket::session_reused( void ) const
+{
+    return SSL_session_reused( ssl_.get() );
+}
+
+void SecureSocket::set_session( SSL_SESSION * session )
+{
+    if ( not SSL_set_session( ssl_.get(), session ) ) {
+        throw ssl_error( "SSL_set_session" );
+    }
+}
+
+shared_ptr<SSL_SESSION> SecureSocket::session( void ) const
+{
+    const SSL_SESSION * current = SSL_get_session( ssl_.get() );
+    if ( not current or not SSL_SESSION_is_resumable( current ) ) {
+        return nullptr;
+    }
+
+    /* a copy, which stays resumable even if this connection fails later */
+    return { SSL_SESSION_dup( current ), SSL_SESSION_free };
+}
+
+bool SecureSocket::idle_and_open( void )
+{
+    set_blocking( false );
+
+    char byte;
+    ERR_clear_error();
+    const int ret = SSL_peek( ssl_.get(), &byte, 1 );
+    const int error = SSL_get_error( ssl_.get(), ret );
+
+    set_blocking( true );
+
+    return ret <= 0 and error == SSL_ERROR_WANT_READ;
+}
+
+bool SecureSocket::ktls_send( void ) const
+{
+#ifdef SSL_OP_ENABLE_KTLS
+    return not SSL_in_init( ssl_.get() ) and BIO_get_ktls_send( SSL_get_wbio( ssl_.get() ) );
+#else
+    return false;
+#endif
+}
+
+void SecureSocket::set_max_send_fragment( const size_t bytes )
+{
+    const size_t fragment = clamp<size_t>( bytes, 512, SSL3_RT_MAX_PLAIN_LENGTH );
+
+    if ( not SSL_set_max_send_fragment( ssl_.get(), fragment ) ) {
+        throw ssl_error( "SSL_set_max_send_fragment" );
+    }
+
+#ifdef TLS_TX_MAX_PAYLOAD_LEN
+    if ( ktls_send() ) {
+        const uint16_t payload = fragment;
+        ::setsockopt( fd_num(), SOL_TLS, TLS_TX_MAX_PAYLOAD_LEN,
+                      &payload, sizeof( payload ) );
+    }
+#endif
+}
+
 void SSLContext::use_certificate_file( const std::string & cert_file )
 {
   ERR_clear_error();
@@ -204,3 +285,159 @@ void SSLContext::use_private_key_file( const std::string & pkey_file )
     throw ssl_error( "SSL_CTX_use_certificate_file" );
   }
 }
+
+void SSLContext::enable_ktls( void )
+{
+#ifdef SSL_OP_ENABLE_KTLS
+  SSL_CTX_set_options( ctx_.get(), SSL_OP_ENABLE_KTLS );
+#else
+  throw runtime_error( "SSLContext: OpenSSL was built without kTLS support" );
+#endif
+}
+
+/* index of the TicketSecret in the ex_data of an SSL_CTX */
+static int ticket_secret_index()
+{
+  static const int index = SSL_CTX_get_ex_new_index( 0, nullptr, nullptr,
+                                                     nullptr, nullptr );
+  return index;
+}
+
+struct TicketKey
+{
+  unsigned char name[ 16 ];
+  unsigned char hmac_key[ 32 ];
+  unsigned char aes_key[ 32 ];
+};
+
+/* the keys of a rotation period: HMAC-SHA256 of the secret over labels */
+static TicketKey derive_ticket_key( const string & secret, const uint64_t period )
+{
+  TicketKey key;
+
+  const auto derive = [&secret, period]( const string & label,
+                                         unsigned char * out, const size_t length ) {
+    const string msg = label + ":" + to_string( period );
+    unsigned char digest[ EVP_MAX_MD_SIZE ];
+    unsigned int digest_length = 0;
+
+    if ( not HMAC( EVP_sha256(), secret.data(), secret.size(),
+                   reinterpret_cast<const unsigned char *>( msg.data() ),
+                   msg.size(), digest, &digest_length )
+         or digest_length < length ) {
+      throw ssl_error( "HMAC" );
+    }
+
+    memcpy( out, digest, length );
+  };
+
+  derive( "name", key.name, sizeof( key.name ) );
+  derive( "hmac", key.hmac_key, sizeof( key.hmac_key ) );
+  derive( "aes", key.aes_key, sizeof( key.aes_key ) );
+
+  return key;
+}
+
+/* HMAC_CTX is deprecated since OpenSSL 3.0 in favor of EVP_MAC_CTX */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+using TicketMacCtx = EVP_MAC_CTX;
+
+static bool init_ticket_mac( EVP_MAC_CTX * mac_ctx, TicketKey & key )
+{
+  char digest[] = "SHA256";
+  OSSL_PARAM params[] = {
+    OSSL_PARAM_construct_octet_string( OSSL_MAC_PARAM_KEY, key.hmac_key,
+                                       sizeof( key.hmac_key ) ),
+    OSSL_PARAM_construct_utf8_string( OSSL_MAC_PARAM_DIGEST, digest, 0 ),
+    OSSL_PARAM_construct_end()
+  };
+
+  return EVP_MAC_CTX_set_params( mac_ctx, params ) == 1;
+}
+#else
+using TicketMacCtx = HMAC_CTX;
+
+static bool init_ticket_mac( HMAC_CTX * hmac_ctx, TicketKey & key )
+{
+  return HMAC_Init_ex( hmac_ctx, key.hmac_key, sizeof( key.hmac_key ),
+                       EVP_sha256(), nullptr ) == 1;
+}
+#endif
+
+/* OpenSSL calls this to encrypt a new ticket (enc = 1) or to find the key of
+   a ticket presented by a client (enc = 0) */
+static int ticket_key_callback( SSL * ssl, unsigned char * key_name,
+                                unsigned char * iv, EVP_CIPHER_CTX * cipher_ctx,
+                                TicketMacCtx * mac_ctx, int enc )
+{
+  const auto * ticket_secret = static_cast<const SSLContext::TicketSecret *>(
+    SSL_CTX_get_ex_data( SSL_get_SSL_CTX( ssl ), ticket_secret_index() ) );
+  if ( not ticket_secret ) {
+    return -1;
+  }
+
+  const uint64_t period = time( nullptr ) / ticket_secret->rotation_s;
+
+  try {
+    if ( enc ) {
+      TicketKey key = derive_ticket_key( ticket_secret->secret, period );
+      memcpy( key_name, key.name, sizeof( key.name ) );
+
+      if ( RAND_bytes( iv, EVP_CIPHER_iv_length( EVP_aes_256_cbc() ) ) != 1 or
+           EVP_EncryptInit_ex( cipher_ctx, EVP_aes_256_cbc(), nullptr,
+                               key.aes_key, iv ) != 1 or
+           not init_ticket_mac( mac_ctx, key ) ) {
+        return -1;
+      }
+
+      return 1;
+    }
+
+    /* accept the current and the previous key */
+    for ( const uint64_t p : { period, period - 1 } ) {
+      TicketKey key = derive_ticket_key( ticket_secret->secret, p );
+      if ( memcmp( key_name, key.name, sizeof( key.name ) ) != 0 ) {
+        continue;
+      }
+
+      if ( not init_ticket_mac( mac_ctx, key ) or
+           EVP_DecryptInit_ex( cipher_ctx, EVP_aes_256_cbc(), nullptr,
+                               key.aes_key, iv ) != 1 ) {
+        return -1;
+      }
+
+      /* ask for a new ticket if the key is about to expire */
+      return p == period ? 1 : 2;
+    }
+  } catch ( const exception & ) {
+    return -1;
+  }
+
+  /* unknown key (e.g., expired): fall back to a full handshake */
+  return 0;
+}
+
+void SSLContext::enable_session_tickets( const std::string & secret,
+                                         const unsigned int rotation_s )
+{
+  if ( secret.empty() or rotation_s == 0 ) {
+    throw runtime_error( "SSLContext: invalid session ticket secret or rotation" );
+  }
+
+  ticket_secret_ = make_unique<TicketSecret>( TicketSecret { secret, rotation_s } );
+
+  if ( not SSL_CTX_set_ex_data( ctx_.get(), ticket_secret_index(),
+                                ticket_secret_.get() ) ) {
+    throw ssl_error( "SSL_CTX_set_ex_data" );
+  }
+
+  SSL_CTX_clear_options( ctx_.get(), SSL_OP_NO_TICKET );
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  SSL_CTX_set_tlsext_ticket_key_evp_cb( ctx_.get(), ticket_key_callback );
+#else
+  SSL_CTX_set_tlsext_ticket_key_cb( ctx_.get(), ticket_key_callback );
+#endif
+
+  /* a ticket is accepted for up to two rotation periods */
+  SSL_CTX_set_timeout( ctx_.get(), 2 * rotation_s );
+}
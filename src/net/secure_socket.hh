@@ -46,8 +46,33 @@ public:
     void accept( const bool register_as_write = false );
 
     std::string read( const bool register_as_write = false );
-    void write( const std::string & message, const bool register_as_read = false );
+
+    /* read into buffer without allocating; return a view of what was read */
+    std::string_view read( IOBuffer & buffer, const bool register_as_write = false );
+    void write( const std::string_view & message, const bool register_as_read = false );
     int get_error( const int return_value );
+
+    /* the kernel (kTLS) encrypts what is written to the socket directly */
+    bool ktls_send( void ) const;
+
+    /* cap the plaintext of each TLS record written from now on at bytes
+       (clamped to 512..16384, the max by default); with kTLS, this is only
+       advice to the kernel, which honors it since Linux 6.8 */
+    void set_max_send_fragment( const size_t bytes );
+
+    /* the handshake resumed a previous session (e.g., from a ticket) */
+    bool session_reused( void ) const;
+
+    /* the session to resume in connect() (of an earlier connection to the
+       same server), and a copy of the session of this connection if it is
+       resumable */
+    void set_session( SSL_SESSION * session );
+    std::shared_ptr<SSL_SESSION> session( void ) const;
+
+    /* whether a blocking connection with nothing left to read is still
+       open, after taking in what the server sends unasked (e.g., the
+       session tickets of TLS 1.3) */
+    bool idle_and_open( void );
 };
 
 class SSLContext
@@ -57,6 +82,17 @@ private:
     typedef std::unique_ptr<SSL_CTX, CTX_deleter> CTX_handle;
     CTX_handle ctx_;
 
+public:
+    /* what session ticket keys are derived from; see enable_session_tickets */
+    struct TicketSecret
+    {
+        std::string secret;
+        unsigned int rotation_s;
+    };
+
+private:
+    std::unique_ptr<TicketSecret> ticket_secret_ {};
+
 public:
     SSLContext();
 
@@ -64,4 +100,16 @@ public:
 
     void use_certificate_file( const std::string & cert_file );
     void use_private_key_file( const std::string & pkey_file );
+
+    /* hand record encryption over to the kernel after the handshake when
+       the negotiated cipher and the kernel support it (falls back silently) */
+    void enable_ktls( void );
+
+    /* issue session tickets, with which clients resume sessions with an
+       abbreviated handshake. The ticket keys are derived from secret and
+       rotate every rotation_s seconds; tickets of the previous key are still
+       accepted (and renewed), and all the processes that share the secret
+       accept each other's tickets. */
+    void enable_session_tickets( const std::string & secret,
+                                 const unsigned int rotation_s );
 };
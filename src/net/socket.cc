@@ -1,13 +1,16 @@
 /* -*-mode:c++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
 
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
 #include <linux/tcp.h>
 #include <linux/netfilter_ipv4.h>
 #include <cstring>
+#include <cerrno>
 
 #include "socket.hh"
 #include "exception.hh"
+#include "counters.hh"
 
 using namespace std;
 
@@ -74,6 +77,7 @@ void Socket::bind( const Address & address )
 /* connect socket to a specified peer address */
 void Socket::connect( const Address & address )
 {
+    Counters::count( Counters::CONNECTS );
     CheckSystemCall( "connect", ::connect( fd_num(),
                                            &address.to_sockaddr(),
                                            address.size() ) );
@@ -124,6 +128,7 @@ void TCPSocket::listen( const int backlog )
 TCPSocket TCPSocket::accept( void )
 {
     register_read();
+    Counters::count( Counters::ACCEPTS );
     return TCPSocket( FileDescriptor( CheckSystemCall( "accept", ::accept( fd_num(), nullptr, nullptr ) ) ) );
 }
 
@@ -162,6 +167,49 @@ void UDPSocket::set_timestamps( void )
     setsockopt( SOL_SOCKET, SO_TIMESTAMPNS, int( true ) );
 }
 
+int UDPSocket::set_receive_buffer( const int bytes )
+{
+    /* SO_RCVBUFFORCE requires CAP_NET_ADMIN */
+    if ( ::setsockopt( fd_num(), SOL_SOCKET, SO_RCVBUFFORCE,
+                       &bytes, sizeof( bytes ) ) < 0 ) {
+        setsockopt( SOL_SOCKET, SO_RCVBUF, bytes );
+    }
+
+    int actual_bytes;
+    getsockopt( SOL_SOCKET, SO_RCVBUF, actual_bytes );
+    return actual_bytes;
+}
+
+void UDPSocket::set_drop_counts( void )
+{
+    setsockopt( SOL_SOCKET, SO_RXQ_OVFL, int( true ) );
+}
+
+void UDPSocket::join_multicast_group( const Address & group )
+{
+    if ( group.to_sockaddr().sa_family != AF_INET ) {
+        throw runtime_error( "not an IPv4 multicast group: " + group.str() );
+    }
+
+    ip_mreq request {};
+    request.imr_multiaddr = reinterpret_cast<const sockaddr_in &>( group.to_sockaddr() ).sin_addr;
+    request.imr_interface.s_addr = htonl( INADDR_ANY );
+    setsockopt( IPPROTO_IP, IP_ADD_MEMBERSHIP, request );
+}
+
+unsigned int UDPSocket::recvmmsg( vector<mmsghdr> & msgs )
+{
+    const int ret = ::recvmmsg( fd_num(), msgs.data(), msgs.size(),
+                                MSG_DONTWAIT, nullptr );
+    if ( ret < 0 and (errno == EAGAIN or errno == EWOULDBLOCK) ) {
+        return 0;
+    }
+
+    register_read();
+
+    return CheckSystemCall( "recvmmsg", ret );
+}
+
 pair<Address, string> UDPSocket::recvfrom( void )
 {
     static const ssize_t RECEIVE_MTU = 65536;
@@ -232,12 +280,41 @@ string TCPSocket::get_congestion_control() const
     return optval;
 }
 
+void TCPSocket::set_notsent_lowat( const unsigned int bytes )
+{
+    setsockopt( IPPROTO_TCP, TCP_NOTSENT_LOWAT, bytes );
+}
+
+void TCPSocket::set_max_pacing_rate( const uint64_t rate )
+{
+    setsockopt( SOL_SOCKET, SO_MAX_PACING_RATE, rate );
+}
+
+void TCPSocket::set_keepalive( const unsigned int idle_s )
+{
+    setsockopt( SOL_SOCKET, SO_KEEPALIVE, int( true ) );
+    setsockopt( IPPROTO_TCP, TCP_KEEPIDLE, int( idle_s ) );
+}
+
 TCPInfo TCPSocket::get_tcp_info() const
 {
   /* get tcp_info from the kernel */
   tcp_info x;
   getsockopt( IPPROTO_TCP, TCP_INFO, x );
 
+  return TCPInfo::from_tcp_info( x );
+}
+
+uint64_t TCPSocket::inode() const
+{
+  struct stat st;
+  CheckSystemCall( "fstat", fstat( fd_num(), &st ) );
+
+  return st.st_ino;
+}
+
+TCPInfo TCPInfo::from_tcp_info( const tcp_info & x )
+{
   /* construct a TCPInfo of our interest */
   TCPInfo ret;
   ret.cwnd = x.tcpi_snd_cwnd;
@@ -4,6 +4,8 @@
 #define SOCKET_HH
 
 #include <functional>
+#include <vector>
+#include <sys/socket.h>
 
 #include "address.hh"
 #include "file_descriptor.hh"
@@ -63,8 +65,26 @@ public:
 
     /* turn on timestamps on receipt */
     void set_timestamps( void );
+
+    /* enlarge the receive buffer, beyond net.core.rmem_max if privileged;
+       return the size in effect, which the kernel doubles for bookkeeping */
+    int set_receive_buffer( const int bytes );
+
+    /* pass with each datagram the number dropped so far for lack of room in
+       the receive buffer, as an SO_RXQ_OVFL control message */
+    void set_drop_counts( void );
+
+    /* receive the datagrams sent to the IPv4 multicast group, on the
+       interface the kernel picks for it */
+    void join_multicast_group( const Address & group );
+
+    /* receive up to msgs.size() datagrams with a single recvmmsg, into the
+       buffers set up in msgs; return the number received (0 if none) */
+    unsigned int recvmmsg( std::vector<mmsghdr> & msgs );
 };
 
+struct tcp_info;
+
 /* tcp_info of our interest; keep the units used in the kernel */
 struct TCPInfo
 {
@@ -73,6 +93,9 @@ struct TCPInfo
   uint32_t min_rtt;   /* minimum RTT in microsecond */
   uint32_t rtt;       /* RTT in microsecond */
   uint64_t delivery_rate;  /* bytes per second */
+
+  /* from the tcp_info of TCP_INFO or of a NETLINK_SOCK_DIAG dump */
+  static TCPInfo from_tcp_info( const tcp_info & x );
 };
 
 /* TCP socket */
@@ -85,6 +108,9 @@ protected:
 public:
     TCPSocket() : Socket( AF_INET, SOCK_STREAM ) {}
 
+    /* take over a TCP socket, e.g., one received from another process */
+    static TCPSocket adopt( FileDescriptor && fd ) { return TCPSocket( std::move( fd ) ); }
+
     /* mark the socket as listening for incoming connections */
     void listen( const int backlog = 16 );
 
@@ -103,7 +129,23 @@ public:
     /* get the current congestion control algorithm */
     std::string get_congestion_control() const;
 
+    /* limit the bytes queued in the kernel but not yet sent, below which
+       the socket becomes writable again (TCP_NOTSENT_LOWAT) */
+    void set_notsent_lowat( const unsigned int bytes );
+
+    /* cap the rate (bytes/s) at which the socket is paced, which needs
+       the fq qdisc or a pacing congestion control such as BBR;
+       UINT64_MAX removes the cap (SO_MAX_PACING_RATE) */
+    void set_max_pacing_rate( const uint64_t rate );
+
+    /* probe the peer of a connection idle for idle_s, so that a connection
+       that has gone away silently is closed (SO_KEEPALIVE) */
+    void set_keepalive( const unsigned int idle_s );
+
     TCPInfo get_tcp_info() const;
+
+    /* inode of the socket, by which TCPInfoCollector looks it up */
+    uint64_t inode() const;
 };
 
 #endif /* SOCKET_HH */
@@ -0,0 +1,124 @@
+#include "tcp_info_collector.hh"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
+#include <linux/tcp.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "exception.hh"
+#include "timestamp.hh"
+
+using namespace std;
+
+/* large enough for a few hundred sockets per recv() */
+static constexpr size_t RECV_BUFFER_SIZE = 64 * 1024;
+
+/* TCP_ESTABLISHED (from netinet/tcp.h, which conflicts with linux/tcp.h) */
+static constexpr uint32_t TCP_ESTABLISHED_STATE = 1;
+
+TCPInfoCollector::TCPInfoCollector(const uint16_t local_port)
+  : local_port_(local_port),
+    netlink_(CheckSystemCall("socket (NETLINK_SOCK_DIAG)",
+                             socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC,
+                                    NETLINK_SOCK_DIAG))),
+    recv_buffer_(RECV_BUFFER_SIZE, '\0')
+{}
+
+void TCPInfoCollector::refresh()
+{
+  infos_.clear();
+
+  send_request();
+  receive_dump();
+
+  refreshed_ms_ = timestamp_ms();
+}
+
+optional<TCPInfo> TCPInfoCollector::get(const uint64_t inode) const
+{
+  const auto it = infos_.find(inode);
+  if (it == infos_.end()) {
+    return nullopt;
+  }
+
+  return it->second;
+}
+
+void TCPInfoCollector::send_request()
+{
+  struct {
+    nlmsghdr nlh;
+    inet_diag_req_v2 req;
+  } request {};
+
+  request.nlh.nlmsg_len = sizeof(request);
+  request.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+  request.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+
+  /* the established IPv4 TCP sockets, along with their tcp_info; the kernel
+   * cannot filter a dump by port without bytecode, so that is left to
+   * receive_dump() */
+  request.req.sdiag_family = AF_INET;
+  request.req.sdiag_protocol = IPPROTO_TCP;
+  request.req.idiag_ext = 1 << (INET_DIAG_INFO - 1);
+  request.req.idiag_states = 1 << TCP_ESTABLISHED_STATE;
+
+  sockaddr_nl kernel {};
+  kernel.nl_family = AF_NETLINK;
+
+  CheckSystemCall("sendto (NETLINK_SOCK_DIAG)",
+                  sendto(netlink_.fd_num(), &request, sizeof(request), 0,
+                         reinterpret_cast<sockaddr *>(&kernel),
+                         sizeof(kernel)));
+}
+
+void TCPInfoCollector::receive_dump()
+{
+  for (;;) {
+    int len = CheckSystemCall("recv (NETLINK_SOCK_DIAG)",
+                              recv(netlink_.fd_num(), recv_buffer_.data(),
+                                   recv_buffer_.size(), 0));
+
+    for (nlmsghdr * nlh = reinterpret_cast<nlmsghdr *>(recv_buffer_.data());
+         NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+      if (nlh->nlmsg_type == NLMSG_DONE) {
+        return;
+      }
+
+      if (nlh->nlmsg_type == NLMSG_ERROR) {
+        const auto * err = static_cast<nlmsgerr *>(NLMSG_DATA(nlh));
+        throw unix_error("NETLINK_SOCK_DIAG dump", -err->error);
+      }
+
+      if (nlh->nlmsg_type != SOCK_DIAG_BY_FAMILY) {
+        continue;
+      }
+
+      auto * msg = static_cast<inet_diag_msg *>(NLMSG_DATA(nlh));
+      if (ntohs(msg->id.idiag_sport) != local_port_) {
+        continue;
+      }
+
+      int attr_len = nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*msg));
+      for (rtattr * attr = reinterpret_cast<rtattr *>(msg + 1);
+           RTA_OK(attr, attr_len); attr = RTA_NEXT(attr, attr_len)) {
+        if (attr->rta_type != INET_DIAG_INFO) {
+          continue;
+        }
+
+        /* an older kernel may report a shorter tcp_info */
+        tcp_info info {};
+        memcpy(&info, RTA_DATA(attr),
+               min<size_t>(RTA_PAYLOAD(attr), sizeof(info)));
+
+        infos_[msg->idiag_inode] = TCPInfo::from_tcp_info(info);
+      }
+    }
+  }
+}
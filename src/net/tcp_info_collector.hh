@@ -0,0 +1,51 @@
+#ifndef TCP_INFO_COLLECTOR_HH
+#define TCP_INFO_COLLECTOR_HH
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+#include "file_descriptor.hh"
+#include "socket.hh"
+
+/* The TCPInfo of all the TCP sockets on a local port, fetched with a single
+ * NETLINK_SOCK_DIAG dump per refresh() rather than a getsockopt(TCP_INFO)
+ * per socket, and looked up by the inode of a socket (TCPSocket::inode()).
+ * What it returns is as old as the last refresh(), so a decision that needs
+ * the current state of a connection should still call get_tcp_info(). */
+class TCPInfoCollector
+{
+public:
+  explicit TCPInfoCollector(const uint16_t local_port);
+
+  /* replace the TCPInfo of the sockets with a fresh dump */
+  void refresh();
+
+  /* nullopt if the socket was absent (e.g., not yet established) at the
+   * last refresh() */
+  std::optional<TCPInfo> get(const uint64_t inode) const;
+
+  /* when refresh() last completed (ms); 0 if never */
+  uint64_t refreshed_ms() const { return refreshed_ms_; }
+
+  size_t size() const { return infos_.size(); }
+
+private:
+  uint16_t local_port_;
+  FileDescriptor netlink_;
+
+  /* inode of a socket -> its TCPInfo at the last refresh() */
+  std::unordered_map<uint64_t, TCPInfo> infos_ {};
+  uint64_t refreshed_ms_ {0};
+
+  /* buffer for the replies of the dumps */
+  std::string recv_buffer_;
+
+  void send_request();
+
+  /* parse the replies to the dump into infos_ until its end */
+  void receive_dump();
+};
+
+#endif /* TCP_INFO_COLLECTOR_HH */
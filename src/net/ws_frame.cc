@@ -4,8 +4,15 @@
 #include "serialization.hh"
 
 #include <iostream>
+#include <cstring>
 #include <endian.h>
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 using namespace std;
 
 WSFrame::Header::Header(const Chunk & chunk)
@@ -38,6 +45,10 @@ WSFrame::Header::Header(const Chunk & chunk)
 
     payload_length_ = chunk(2, 8).be64();
     next_idx = 10;
+
+    if (payload_length_ > MAX_PAYLOAD_LENGTH) {
+      throw runtime_error("invalid payload length");
+    }
     break;
 
   default:
@@ -90,6 +101,11 @@ uint64_t WSFrame::expected_length( const Chunk & chunk )
       return 10;
     }
 
+    /* the length would overflow otherwise */
+    if (chunk(2, 8).be64() > Header::MAX_PAYLOAD_LENGTH) {
+      throw runtime_error("invalid payload length");
+    }
+
     return 10 + chunk(2, 8).be64() + (masked ? 4 : 0);
 
   default:
@@ -132,57 +148,114 @@ WSFrame::WSFrame(const Chunk & chunk)
   }
 
   if (header_.masking_key()) {
-    const string mk = put_field(*header_.masking_key());
+    mask(payload_.data(), payload_.length(), *header_.masking_key());
+  }
+}
 
-    for (size_t i = 0; i < payload_.length(); i++) {
-      payload_[i] ^= mk[i % 4];
-    }
+void WSFrame::mask(char * data, const size_t length,
+                   const uint32_t masking_key)
+{
+  /* the key in network byte order, repeated to fill the widest register;
+   * every step below is a multiple of 4 bytes, so the key stays aligned */
+  const string mk = put_field(masking_key);
+  char mk_pattern[32];
+  for (size_t j = 0; j < sizeof(mk_pattern); j++) {
+    mk_pattern[j] = mk[j % 4];
+  }
+
+  size_t i = 0;
+
+#if defined(__AVX2__)
+  const __m256i mk_256 = _mm256_loadu_si256(
+    reinterpret_cast<const __m256i *>(mk_pattern));
+
+  for (; i + sizeof(__m256i) <= length; i += sizeof(__m256i)) {
+    __m256i * p = reinterpret_cast<__m256i *>(data + i);
+    _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), mk_256));
+  }
+#endif
+
+#if defined(__SSE2__)
+  const __m128i mk_128 = _mm_loadu_si128(
+    reinterpret_cast<const __m128i *>(mk_pattern));
+
+  for (; i + sizeof(__m128i) <= length; i += sizeof(__m128i)) {
+    __m128i * p = reinterpret_cast<__m128i *>(data + i);
+    _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), mk_128));
+  }
+#elif defined(__ARM_NEON)
+  const uint8x16_t mk_128 = vld1q_u8(
+    reinterpret_cast<const uint8_t *>(mk_pattern));
+
+  for (; i + sizeof(uint8x16_t) <= length; i += sizeof(uint8x16_t)) {
+    uint8_t * p = reinterpret_cast<uint8_t *>(data + i);
+    vst1q_u8(p, veorq_u8(vld1q_u8(p), mk_128));
+  }
+#endif
+
+  /* scalar fallback: a word at a time, and then the remaining bytes */
+  uint64_t mk_word;
+  memcpy(&mk_word, mk_pattern, sizeof(mk_word));
+
+  for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, data + i, sizeof(word));
+    word ^= mk_word;
+    memcpy(data + i, &word, sizeof(word));
+  }
+
+  for (; i < length; i++) {
+    data[i] ^= mk_pattern[i % 4];
   }
 }
 
-string WSFrame::to_string() const
+string WSFrame::Header::to_string() const
 {
   string output;
   uint8_t temp_byte;
 
   /* first byte */
-  temp_byte = (header_.fin() << 7) + static_cast<uint8_t>(header_.opcode());
+  temp_byte = (fin_ << 7) + static_cast<uint8_t>(opcode_);
   output.push_back(temp_byte);
 
   /* second byte */
-  temp_byte = header_.masking_key() ? 1 << 7 : 0;
+  temp_byte = masking_key_ ? 1 << 7 : 0;
 
-  if (payload_.length() <= 125u) {
-    temp_byte += static_cast<uint8_t>(payload_.length());
+  if (payload_length_ <= 125u) {
+    temp_byte += static_cast<uint8_t>(payload_length_);
     output.push_back(temp_byte);
   }
-  else if (payload_.length() < (1u << 16)) {
+  else if (payload_length_ < (1u << 16)) {
     temp_byte += static_cast<uint8_t>(126);
     output.push_back(temp_byte);
-    output += put_field(static_cast<uint16_t>(payload_.length()));
+    output += put_field(static_cast<uint16_t>(payload_length_));
   }
-  else if (payload_.length() <= (1ull << 63)){
+  else if (payload_length_ <= MAX_PAYLOAD_LENGTH) {
     temp_byte += static_cast<uint8_t>(127);
     output.push_back(temp_byte);
-    output += put_field(static_cast<uint64_t>(payload_.length()));
+    output += put_field(static_cast<uint64_t>(payload_length_));
   }
   else {
     throw runtime_error("payload size > maximum allowed");
   }
 
-  if (header_.masking_key()) {
-    string mk = put_field(*header_.masking_key());
-    output += mk;
+  if (masking_key_) {
+    output += put_field(*masking_key_);
+  }
+
+  return output;
+}
 
-    string masked_payload;
-    masked_payload.reserve(payload_.length());
+string WSFrame::to_string() const
+{
+  string output = header_.to_string();
 
-    for (size_t i = 0; i < payload_.length(); i++) {
-      masked_payload.push_back(payload_[i] ^ mk[i % 4]);
-    }
-  }
-  else {
-    output += payload_;
+  const size_t header_length = output.length();
+  output += payload_;
+
+  if (header_.masking_key()) {
+    mask(output.data() + header_length, payload_.length(),
+         *header_.masking_key());
   }
 
   return output;
@@ -26,6 +26,9 @@ public:
     std::optional<uint32_t> masking_key_ {};
 
   public:
+    /* the most significant bit of a 64-bit length must be 0 (RFC 6455) */
+    static constexpr uint64_t MAX_PAYLOAD_LENGTH = (1ull << 63) - 1;
+
     Header(const Chunk & chunk);
     Header(const bool fin, const OpCode opcode, const uint64_t payload_length);
     Header(const bool fin, const OpCode opcode, const uint64_t payload_length,
@@ -37,6 +40,9 @@ public:
     std::optional<uint32_t> masking_key() const { return masking_key_; }
 
     uint32_t header_length() const;
+
+    /* serialize the header alone (e.g., to send it ahead of the payload) */
+    std::string to_string() const;
   };
 
 private:
@@ -59,6 +65,10 @@ public:
   std::string to_string() const;
 
   static uint64_t expected_length( const Chunk & chunk );
+
+  /* XOR data in place with masking_key (masking and unmasking are alike) */
+  static void mask(char * data, const size_t length,
+                   const uint32_t masking_key);
 };
 
 #endif /* WS_FRAME_HH */
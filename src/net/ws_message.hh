@@ -3,12 +3,11 @@
 #ifndef WS_MESSAGE_HH
 #define WS_MESSAGE_HH
 
-#include <string>
-#include <vector>
-#include <list>
+#include <string_view>
 
 #include "ws_frame.hh"
 
+/* a complete message; the payload is a view into the parser's buffer */
 class WSMessage
 {
 public:
@@ -16,14 +15,13 @@ public:
 
 private:
   Type type_ {Type::Text};
-  std::string payload_ {};
+  std::string_view payload_ {};
 
 public:
-  WSMessage(const WSFrame & frame);
-  WSMessage(const std::list<WSFrame> & frames);
+  WSMessage(const Type type, const std::string_view payload);
 
   Type type() const { return type_; }
-  const std::string & payload() const { return payload_; }
+  std::string_view payload() const { return payload_; }
 };
 
 #endif /* WS_MESSAGE_HH */
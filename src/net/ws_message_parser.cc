@@ -2,61 +2,117 @@
 
 #include "ws_message_parser.hh"
 
+#include <cstring>
+#include <stdexcept>
+
+#include "chunk.hh"
+
 using namespace std;
 
-void WSMessageParser::parse(const string & buf)
+void WSMessageParser::compact()
+{
+  complete_messages_.clear();
+  next_message_ = 0;
+  control_payloads_.clear();
+
+  /* the payload of a fragmented message must stay where it is */
+  const size_t consumed = message_type_ ? message_start_ : parsed_;
+
+  if (consumed == raw_buffer_.size()) {
+    /* the common case: keeps the capacity and moves nothing */
+    raw_buffer_.clear();
+  } else if (consumed >= raw_buffer_.size() - consumed) {
+    /* only move the remaining bytes if they are fewer than the consumed */
+    raw_buffer_.erase(0, consumed);
+  } else {
+    return;
+  }
+
+  parsed_ -= consumed;
+  if (message_type_) {
+    message_start_ -= consumed;
+    message_end_ -= consumed;
+  }
+}
+
+void WSMessageParser::parse(const string_view buf)
 {
+  compact();
   raw_buffer_.append(buf);
 
   /* repeatedly parse complete frames */
-  while (not raw_buffer_.empty()) {
-    uint64_t expected_length = WSFrame::expected_length(raw_buffer_);
+  while (parsed_ < raw_buffer_.size()) {
+    const Chunk chunk {
+      reinterpret_cast<const uint8_t *>(raw_buffer_.data() + parsed_),
+      raw_buffer_.size() - parsed_};
+    const uint64_t frame_length = WSFrame::expected_length(chunk);
 
-    if (raw_buffer_.length() < expected_length) {
+    if (chunk.size() < frame_length) {
       /* still need more bytes to have a complete frame */
       return;
     }
 
     /* okay, we have a complete frame now! */
-    WSFrame frame {raw_buffer_.substr(0, expected_length)};
-    raw_buffer_.erase(0, expected_length);
+    const WSFrame::Header header {chunk};
+    const uint64_t payload_length = header.payload_length();
+    const size_t payload_start = parsed_ + frame_length - payload_length;
+    char * payload = raw_buffer_.data() + payload_start;
+
+    if (header.masking_key()) {
+      WSFrame::mask(payload, payload_length, *header.masking_key());
+    }
 
-    switch (frame.header().opcode()) {
+    parsed_ += frame_length;
+
+    switch (header.opcode()) {
     case WSFrame::OpCode::Continuation:
-      if (frame_buffer_.size() == 0) {
+      if (not message_type_) {
         throw runtime_error("message cannot start with a continuation frame");
       }
 
-      frame_buffer_.emplace_back(move(frame));
+      /* append the payload to the rest of the message */
+      memmove(raw_buffer_.data() + message_end_, payload, payload_length);
+      message_end_ += payload_length;
       break;
 
     case WSFrame::OpCode::Text:
     case WSFrame::OpCode::Binary:
-      if (frame_buffer_.size() != 0) {
+      if (message_type_) {
         throw runtime_error("expected a continuation message, got text/binary");
       }
 
-      frame_buffer_.emplace_back(move(frame));
+      message_type_ = header.opcode();
+      message_start_ = payload_start;
+      message_end_ = payload_start + payload_length;
       break;
 
     case WSFrame::OpCode::Close:
     case WSFrame::OpCode::Ping:
     case WSFrame::OpCode::Pong:
-      if (not frame.header().fin()) {
+      if (not header.fin()) {
         throw runtime_error("control frames must not be fragmented");
       }
 
-      /* we don't put control frames into the frame buffer, we directly create
-      the message from those and push them into the output queue */
-      complete_messages_.emplace(list<WSFrame>{frame});
-      return;
+      /* control frames are messages by themselves */
+      if (message_type_) {
+        control_payloads_.emplace_back(payload, payload_length);
+        complete_messages_.emplace_back(header.opcode(),
+                                        control_payloads_.back());
+      } else {
+        complete_messages_.emplace_back(header.opcode(),
+                                        string_view(payload, payload_length));
+      }
+      continue;
+
     default:
       throw runtime_error("invalid opcode");
     }
 
-    if (frame.header().fin()) {
-      complete_messages_.emplace(frame_buffer_);
-      frame_buffer_.clear();
+    if (header.fin()) {
+      complete_messages_.emplace_back(*message_type_,
+        string_view(raw_buffer_.data() + message_start_,
+                    message_end_ - message_start_));
+      message_type_.reset();
     }
   }
 }
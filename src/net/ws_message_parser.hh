@@ -4,28 +4,65 @@
 #define WS_MESSAGE_PARSER_HH
 
 #include <string>
-#include <queue>
+#include <string_view>
+#include <vector>
 #include <list>
+#include <optional>
 
 #include "ws_message.hh"
 #include "ws_frame.hh"
 
+/* Frames are parsed and unmasked in place in the receive buffer, and the
+ * payloads of fragmented messages are moved together in the buffer, so a
+ * complete message is a view into the buffer rather than a copy. The views
+ * are valid until the next call to parse(). */
 class WSMessageParser
 {
 private:
+  /* received bytes; the first parsed_ bytes have been parsed */
   std::string raw_buffer_ {};
-  std::list<WSFrame> frame_buffer_ {};
-  std::queue<WSMessage> complete_messages_ {};
+  size_t parsed_ {0};
+
+  /* type of the fragmented message being assembled, whose payload so far
+   * occupies [message_start_, message_end_) of raw_buffer_ */
+  std::optional<WSMessage::Type> message_type_ {};
+  size_t message_start_ {0};
+  size_t message_end_ {0};
+
+  /* payloads of the control frames in the middle of a fragmented message,
+   * which would otherwise be overwritten while the message is assembled */
+  std::list<std::string> control_payloads_ {};
+
+  /* messages completed by the last parse() and the next one to hand out */
+  std::vector<WSMessage> complete_messages_ {};
+  size_t next_message_ {0};
+
+  /* drop the messages of the last parse() and the bytes that they used */
+  void compact();
 
 public:
-  void parse(const std::string & buf);
+  void parse(const std::string_view buf);
+
+  bool empty() const { return next_message_ == complete_messages_.size(); }
+
+  const WSMessage & front() const { return complete_messages_[next_message_]; }
+  WSMessage & front() { return complete_messages_[next_message_]; }
 
-  bool empty() const { return complete_messages_.empty(); }
+  void pop() { next_message_++; }
 
-  const WSMessage & front() const { return complete_messages_.front(); }
-  WSMessage & front() { return complete_messages_.front(); }
+  /* bytes buffered for the frame or fragmented message being assembled,
+   * which a peer could otherwise grow without bound */
+  size_t buffer_bytes() const
+  {
+    return raw_buffer_.size() - (message_type_ ? message_start_ : parsed_);
+  }
 
-  void pop() { complete_messages_.pop(); }
+  /* no message is being handed out or assembled, and no bytes of a partial
+   * frame are buffered */
+  bool idle() const
+  {
+    return empty() and not message_type_ and parsed_ == raw_buffer_.size();
+  }
 };
 
 #endif /* WS_MESSAGE_PARSER_HH */
@@ -2,14 +2,18 @@
 
 #include "ws_server.hh"
 
+#include <algorithm>
 #include <iostream>
+#include <limits>
 #include <stdexcept>
+#include <thread>
 #include <crypto++/sha.h>
 #include <crypto++/hex.h>
 #include <crypto++/base64.h>
 
 #include "http_response.hh"
 #include "exception.hh"
+#include "timestamp.hh"
 
 using namespace std;
 using namespace PollerShortNames;
@@ -114,39 +118,90 @@ WSServer<NBSecureSocket>::Connection::Connection(TCPSocket && sock,
 }
 
 template<>
-string WSServer<TCPSocket>::Connection::read()
+string_view WSServer<TCPSocket>::Connection::read(IOBuffer & buffer)
 {
-  return socket.read();
+  return socket.read(buffer);
 }
 
 template<>
-string WSServer<NBSecureSocket>::Connection::read()
+string_view WSServer<NBSecureSocket>::Connection::read(IOBuffer &)
 {
-  return socket.ezread();
+  /* NBSecureSocket has read into its own buffer already */
+  return socket.ezread_view();
 }
 
 template<>
 void WSServer<TCPSocket>::Connection::write()
 {
-  while (not send_buffer.empty()) {
-    const string & buffer = send_buffer.front();
+  /* max number of buffers to gather into a single writev */
+  static constexpr size_t MAX_WRITEV_BUFFERS = 64;
+
+  /* bytes this connection may write in this round */
+  size_t budget = numeric_limits<size_t>::max();
+  size_t weighted_quantum = 0;
+  if (send_quantum > 0) {
+    weighted_quantum =
+      max<size_t>(1, static_cast<size_t>(send_quantum * send_weight));
+    send_deficit += weighted_quantum;
+    budget = send_deficit;
+  }
 
-    /* need to convert to string_view iterator to avoid copy */
-    string_view buffer_view = buffer;
+  while (not send_buffer.empty() and budget > 0) {
+    const size_t write_cap = min(max_write_bytes, budget);
+
+    vector<string_view> buffers;
+    size_t total_bytes = 0;
+    for (auto it = send_buffer.cbegin();
+         it != send_buffer.cend() and buffers.size() < MAX_WRITEV_BUFFERS and
+         total_bytes < write_cap;
+         it++) {
+      buffers.emplace_back(it->view());
+
+      /* skip the part of the first buffer that has been written */
+      if (it == send_buffer.cbegin()) {
+        buffers.back().remove_prefix(send_buffer_offset);
+      }
+
+      /* truncate the last buffer to the cap */
+      if (buffers.back().size() > write_cap - total_bytes) {
+        buffers.back().remove_suffix(buffers.back().size() -
+                                     (write_cap - total_bytes));
+      }
+
+      total_bytes += buffers.back().size();
+    }
 
-    /* set write_all to false because socket might be unable to write all */
-    const auto view_it = socket.write(
-        buffer_view.substr(send_buffer_offset), false);
+    /* socket might be unable to write all */
+    size_t bytes_written = socket.writev(buffers);
+
+    stats.num_writes++;
+    stats.bytes_written += bytes_written;
+    budget -= bytes_written;
+
+    const bool write_all = (bytes_written == total_bytes);
+
+    while (bytes_written > 0) {
+      const size_t remaining = send_buffer.front().size() - send_buffer_offset;
+      if (bytes_written < remaining) {
+        /* save the offset of the remaining string */
+        send_buffer_offset += bytes_written;
+        break;
+      }
 
-    if (view_it != buffer_view.cend()) {
-      /* save the offset of the remaining string */
-      send_buffer_offset = view_it - buffer_view.cbegin();
-      break;
-    } else {
       /* move onto the next item in the deque */
+      bytes_written -= remaining;
       send_buffer_offset = 0;
       send_buffer.pop_front();
     }
+
+    if (not write_all) {
+      break;
+    }
+  }
+
+  if (send_quantum > 0) {
+    /* an emptied connection starts its next round afresh */
+    send_deficit = send_buffer.empty() ? 0 : min(budget, weighted_quantum);
   }
 }
 
@@ -170,195 +225,281 @@ void WSServer<SocketType>::init_listener_socket()
   listener_socket_.bind(listener_addr_);
   listener_socket_.listen();
 
-  poller_.add_action(Poller::Action(listener_socket_, Direction::In,
-    [this]()->ResultType
+  add_listener_action(listener_socket_);
+}
+
+template<class SocketType>
+void WSServer<SocketType>::add_listener_action(TCPSocket & listener)
+{
+  poller_.add_action(Poller::Action(listener, Direction::In,
+    [this, &listener]()->ResultType
     {
-      TCPSocket client = listener_socket_.accept();
+      TCPSocket client = listener.accept();
       client.set_blocking(false);
 
-      const uint64_t conn_id = last_connection_id_++;
-      connections_.emplace(piecewise_construct,
-                           forward_as_tuple(conn_id),
-                           forward_as_tuple(move(client), ssl_context_));
-      Connection & conn = connections_.at(conn_id);
+      add_connection(move(client), Connection::State::NotConnected);
+      return ResultType::Continue;
+    }
+  ).named("ws_listener"));
+}
+
+template<class SocketType>
+uint64_t WSServer<SocketType>::add_connection(
+  TCPSocket && sock, const typename Connection::State state)
+{
+  if (notsent_lowat_ > 0) {
+    sock.set_notsent_lowat(notsent_lowat_);
+  }
 
-      /* add the actions for this connection */
-      poller_.add_action(Poller::Action(conn.socket, Direction::In,
-        [this, &conn, conn_id]()->ResultType
-        {
-          const string data = conn.read();
+  const uint64_t inode = tcp_info_collector_ ? sock.inode() : 0;
 
-          if (data.empty()) {
-            /* peer socket is gone */
+  const auto conn_it = connections_.emplace(move(sock), ssl_context_);
+  const uint64_t conn_id = conn_it->first;
+  Connection & conn = conn_it->second;
+  conn.inode = inode;
+  conn.set_write_caps(max_write_bytes_, max_record_bytes_);
+  conn.send_quantum = send_quantum_;
+  conn.state = state;
+
+  if (handshake_pool_) {
+    offload_handshake(conn, conn_id);
+  }
+
+  /* add the actions for this connection */
+  poller_.add_action(Poller::Action(conn.socket, Direction::In,
+    [this, &conn, conn_id]()->ResultType
+    {
+      IOBuffer buffer;
+      const string_view data = conn.read(buffer);
+
+      if (data.empty()) {
+        /* peer socket is gone */
+        force_close_connection(conn_id);
+        return ResultType::CancelAll;
+      }
+
+      if (conn.state == Connection::State::NotConnected) {
+        try {
+          conn.ws_handshake_parser.parse(data);
+        } catch (const exception & e) {
+          /* close the connection if received an invalid message */
+          print_exception("ws_server", e);
+          force_close_connection(conn_id);
+          return ResultType::CancelAll;
+        }
+
+        while (not conn.ws_handshake_parser.empty()) {
+          auto request = move(conn.ws_handshake_parser.front());
+          conn.ws_handshake_parser.pop();
+
+          const auto & response = create_handshake_response(request);
+          conn.send_buffer.emplace_back(response.str());
+
+          /* only continue with status code of 101 */
+          if (response.status_code() != "101") {
+            /* TODO: response will not reach the client side currently */
             force_close_connection(conn_id);
             return ResultType::CancelAll;
           }
 
-          if (conn.state == Connection::State::NotConnected) {
-            try {
-              conn.ws_handshake_parser.parse(data);
-            } catch (const exception & e) {
-              /* close the connection if received an invalid message */
-              print_exception("ws_server", e);
-              force_close_connection(conn_id);
-              return ResultType::CancelAll;
-            }
-
-            while (not conn.ws_handshake_parser.empty()) {
-              auto request = move(conn.ws_handshake_parser.front());
-              conn.ws_handshake_parser.pop();
-
-              const auto & response = create_handshake_response(request);
-              conn.send_buffer.emplace_back(response.str());
-
-              /* only continue with status code of 101 */
-              if (response.status_code() != "101") {
-                /* TODO: response will not reach the client side currently */
-                force_close_connection(conn_id);
-                return ResultType::CancelAll;
-              }
-
-              conn.state = Connection::State::Connecting;
-            }
-          }
-          else if (conn.state == Connection::State::Connected) {
-            try {
-              conn.ws_message_parser.parse(data);
-            } catch (const exception & e) {
-              /* close the connection if received an invalid message */
-              print_exception("ws_server", e);
-              wait_close_connection(conn_id);
-            }
-
-            while (not conn.ws_message_parser.empty()) {
-              WSMessage message = move(conn.ws_message_parser.front());
-              conn.ws_message_parser.pop();
-
-              switch (message.type()) {
-              case WSMessage::Type::Text:
-              case WSMessage::Type::Binary:
-                message_callback_(conn_id, message);
-                break;
-
-              case WSMessage::Type::Close:
-              {
-                /* respond to client-initiated close */
-                WSFrame close_frame { true, WSFrame::OpCode::Close,
-                                      message.payload() };
-                queue_frame(conn_id, close_frame);
-                force_close_connection(conn_id);
-                return ResultType::CancelAll;
-              }
-
-              case WSMessage::Type::Ping:
-              {
-                WSFrame pong { true, WSFrame::OpCode::Pong, "" };
-                queue_frame(conn_id, pong);
-                break;
-              }
-
-              case WSMessage::Type::Pong:
-                break;
-
-              default:
-                assert(false);  /* will not happen */
-                break;
-              }
-            }
-          }
-          else if (conn.state == Connection::State::Closing) {
-            try {
-              conn.ws_message_parser.parse(data);
-            } catch (const exception & e) {
-              /* close the connection if received an invalid message */
-              print_exception("ws_server", e);
-              force_close_connection(conn_id);
-              return ResultType::CancelAll;
-            }
-
-            while (not conn.ws_message_parser.empty()) {
-              WSMessage message = move(conn.ws_message_parser.front());
-              conn.ws_message_parser.pop();
-
-              switch (message.type()) {
-              case WSMessage::Type::Close:
-                /* complete server-initiated close */
-                force_close_connection(conn_id);
-                return ResultType::CancelAll;
-
-              default:
-                /* all the other message types are ignored */
-                break;
-              }
-            }
-          } else {
-            cerr << "Invalid conn.state = " << (int) conn.state << endl;
+          conn.state = Connection::State::Connecting;
+        }
+      }
+      else if (conn.state == Connection::State::Connected) {
+        try {
+          conn.ws_message_parser.parse(data);
+        } catch (const exception & e) {
+          /* close the connection if received an invalid message */
+          print_exception("ws_server", e);
+          wait_close_connection(conn_id);
+        }
+
+        if (max_receive_bytes_ > 0 and
+            conn.ws_message_parser.buffer_bytes() > max_receive_bytes_) {
+          cerr << conn_id << ": incomplete message exceeds "
+               << max_receive_bytes_ << " bytes; closing" << endl;
+          force_close_connection(conn_id);
+          return ResultType::CancelAll;
+        }
+
+        while (not conn.ws_message_parser.empty()) {
+          WSMessage message = move(conn.ws_message_parser.front());
+          conn.ws_message_parser.pop();
+
+          switch (message.type()) {
+          case WSMessage::Type::Text:
+          case WSMessage::Type::Binary:
+            message_callback_(conn_id, message);
+            break;
+
+          case WSMessage::Type::Close:
+          {
+            /* respond to client-initiated close */
+            WSFrame close_frame { true, WSFrame::OpCode::Close,
+                                  string(message.payload()) };
+            queue_frame(conn_id, close_frame);
             force_close_connection(conn_id);
             return ResultType::CancelAll;
           }
 
-          return ResultType::Continue;
-        },
-        [&conn]()->bool
-        {
-          return (conn.state != Connection::State::Connecting) and
-                 (conn.state != Connection::State::Closed);
-        }
-      ));
-
-      poller_.add_action(Poller::Action(conn.socket, Direction::Out,
-        [this, &conn, conn_id]()->ResultType
-        {
-          if (conn.state == Connection::State::Connecting) {
-            if (conn.data_to_write()) {
-              conn.write();
-            }
-
-            if (not conn.data_to_write()) {
-              /* if we've sent the whole handshake response */
-              conn.state = Connection::State::Connected;
-              open_callback_(conn_id);
-            }
+          case WSMessage::Type::Ping:
+          {
+            WSFrame pong { true, WSFrame::OpCode::Pong, "" };
+            queue_frame(conn_id, pong);
+            break;
           }
-          else if ((conn.state == Connection::State::Connected or
-                    conn.state == Connection::State::Closing or
-                    conn.state == Connection::State::Closed) and
-                   conn.data_to_write()) {
-            conn.write();
+
+          case WSMessage::Type::Pong:
+            break;
+
+          default:
+            assert(false);  /* will not happen */
+            break;
           }
+        }
+      }
+      else if (conn.state == Connection::State::Closing) {
+        try {
+          conn.ws_message_parser.parse(data);
+        } catch (const exception & e) {
+          /* close the connection if received an invalid message */
+          print_exception("ws_server", e);
+          force_close_connection(conn_id);
+          return ResultType::CancelAll;
+        }
+
+        while (not conn.ws_message_parser.empty()) {
+          WSMessage message = move(conn.ws_message_parser.front());
+          conn.ws_message_parser.pop();
 
-          if (conn.state == Connection::State::Closed and
-              not conn.data_to_write()) {
+          switch (message.type()) {
+          case WSMessage::Type::Close:
+            /* complete server-initiated close */
             force_close_connection(conn_id);
             return ResultType::CancelAll;
+
+          default:
+            /* all the other message types are ignored */
+            break;
           }
+        }
+      } else {
+        cerr << "Invalid conn.state = " << (int) conn.state << endl;
+        force_close_connection(conn_id);
+        return ResultType::CancelAll;
+      }
+
+      return ResultType::Continue;
+    },
+    [&conn]()->bool
+    {
+      return (conn.state != Connection::State::Connecting) and
+             (conn.state != Connection::State::Closed);
+    }
+  ).named("ws_connection_in").notify_interest());
+
+  poller_.add_action(Poller::Action(conn.socket, Direction::Out,
+    [this, &conn, conn_id]()->ResultType
+    {
+      if (conn.state == Connection::State::Connecting) {
+        if (conn.data_to_write()) {
+          conn.write();
+        }
 
-          return ResultType::Continue;
-        },
-        [&conn]()->bool
-        {
-          return (conn.state == Connection::State::Connecting) or
-                 ((conn.state == Connection::State::Connected or
-                   conn.state == Connection::State::Closing or
-                   conn.state == Connection::State::Closed) and
-                  conn.interested_in_sending());
+        if (not conn.data_to_write()) {
+          /* if we've sent the whole handshake response */
+          conn.state = Connection::State::Connected;
+          open_callback_(conn_id);
+        }
+      }
+      else if (conn.state == Connection::State::Connected or
+               conn.state == Connection::State::Closing or
+               conn.state == Connection::State::Closed) {
+        pull_frames(conn);
+
+        if (conn.data_to_write()) {
+          conn.write();
         }
-      ));
+      }
+
+      if (conn.state == Connection::State::Closed and
+          not conn.data_to_write()) {
+        force_close_connection(conn_id);
+        return ResultType::CancelAll;
+      }
 
       return ResultType::Continue;
+    },
+    [&conn]()->bool
+    {
+      return (conn.state == Connection::State::Connecting) or
+             ((conn.state == Connection::State::Connected or
+               conn.state == Connection::State::Closing or
+               conn.state == Connection::State::Closed) and
+              (conn.interested_in_sending() or conn.data_to_pull()));
     }
-  ));
+  ).named("ws_connection_out").notify_interest());
+
+  return conn_id;
 }
 
 template<class SocketType>
 WSServer<SocketType>::WSServer(const Address & listener_addr,
-                               const string & congestion_control)
+                               const string & congestion_control,
+                               const Poller::Backend poller_backend)
+  : poller_(poller_backend)
 {
   listener_addr_ = listener_addr;
   congestion_control_ = congestion_control;
   init_listener_socket();
 }
 
+template<class SocketType>
+WSServer<SocketType>::~WSServer()
+{
+  /* the workers refer to the connections and to handshakes_done_, which
+   * cannot fill up for good while it is drained here */
+  while (handshakes_in_flight_ > 0) {
+    while (handshakes_done_->pop()) {}
+    this_thread::yield();
+  }
+}
+
+template<class SocketType>
+void WSServer<SocketType>::set_connection_ids(const uint64_t first_id,
+                                              const uint64_t step)
+{
+  connections_.set_keys(first_id, step);
+}
+
+template<class SocketType>
+void WSServer<SocketType>::pull_frames(Connection & conn)
+{
+  while (conn.data_to_pull() and conn.buffer_bytes() < max_write_bytes_) {
+    auto & pulls = conn.urgent_pulls.empty() ? conn.pull_callbacks
+                                             : conn.urgent_pulls;
+    if (not pulls.front()()) {
+      pulls.pop_front();
+    }
+  }
+}
+
+template<class SocketType>
+void WSServer<SocketType>::queue_pull(const uint64_t connection_id,
+                                      PullCallback func,
+                                      const bool urgent)
+{
+  Connection & conn = connections_.at(connection_id);
+
+  if (conn.state != Connection::State::Connected) {
+    cerr << connection_id << ": not connected; cannot queue frames" << endl;
+    return;
+  }
+
+  (urgent ? conn.urgent_pulls : conn.pull_callbacks).emplace_back(move(func));
+  poller_.interest_changed(conn.socket.fd_num());
+}
+
 template<class SocketType>
 bool WSServer<SocketType>::queue_frame(const uint64_t connection_id,
                                        const WSFrame & frame)
@@ -373,6 +514,39 @@ bool WSServer<SocketType>::queue_frame(const uint64_t connection_id,
   /* frame.to_string() inevitably copies frame.payload_ into the return string,
    * but the return string will be moved into conn.send_buffer without copy */
   conn.send_buffer.emplace_back(frame.to_string());
+  poller_.interest_changed(conn.socket.fd_num());
+  return true;
+}
+
+template<class SocketType>
+bool WSServer<SocketType>::queue_frame(const uint64_t connection_id,
+                                       const bool fin,
+                                       const WSFrame::OpCode opcode,
+                                       vector<SharedBuffer> && payload_buffers)
+{
+  Connection & conn = connections_.at(connection_id);
+
+  if (conn.state != Connection::State::Connected) {
+    cerr << connection_id << ": not connected; cannot queue frame" << endl;
+    return false;
+  }
+
+  uint64_t payload_length = 0;
+  for (const auto & buffer : payload_buffers) {
+    payload_length += buffer.size();
+  }
+
+  /* only the frame header is created here; the payload is left in place */
+  conn.send_buffer.emplace_back(
+    WSFrame::Header(fin, opcode, payload_length).to_string());
+
+  for (auto & buffer : payload_buffers) {
+    buffer.set_continuation();
+    conn.send_buffer.emplace_back(move(buffer));
+  }
+
+  poller_.interest_changed(conn.socket.fd_num());
+
   return true;
 }
 
@@ -408,7 +582,8 @@ void WSServer<SocketType>::force_close_connection(const uint64_t connection_id)
 
   auto & conn = conn_it->second;
   conn.state = Connection::State::Closed;
-  closed_connections_.insert(connection_id);
+  poller_.interest_changed(conn.socket.fd_num());
+  closed_connections_.emplace_back(connection_id);
   close_callback_(connection_id);
 }
 
@@ -433,10 +608,144 @@ void WSServer<SocketType>::clean_idle_connection(const uint64_t connection_id)
   poller_.remove_fd(conn.socket.fd_num());
 
   conn.state = Connection::State::Closed;
-  closed_connections_.insert(connection_id);
+  closed_connections_.emplace_back(connection_id);
   close_callback_(connection_id);
 }
 
+template<class SocketType>
+FileDescriptor WSServer<SocketType>::release_listener()
+{
+  /* the socket stays open in this process, so no connection in its backlog
+   * is reset while the copy is passed on */
+  poller_.remove_fd(listener_socket_.fd_num());
+
+  return {CheckSystemCall("dup", dup(listener_socket_.fd_num()))};
+}
+
+template<class SocketType>
+void WSServer<SocketType>::adopt_listener(TCPSocket && listener)
+{
+  listener.set_blocking(false);
+
+  adopted_listeners_.emplace_back(move(listener));
+  add_listener_action(adopted_listeners_.back());
+}
+
+template<>
+optional<FileDescriptor> WSServer<TCPSocket>::release_connection(
+  const uint64_t connection_id)
+{
+  auto conn_it = connections_.find(connection_id);
+  if (conn_it == connections_.end()) {
+    return nullopt;
+  }
+
+  auto & conn = conn_it->second;
+
+  /* another process could not pick up in the middle of a frame */
+  if (conn.state != Connection::State::Connected or conn.data_to_write() or
+      conn.data_to_pull() or not conn.ws_message_parser.idle()) {
+    return nullopt;
+  }
+
+  FileDescriptor fd {CheckSystemCall("dup", dup(conn.socket.fd_num()))};
+
+  /* forget the connection as clean_idle_connection() does, but without
+   * calling the close callback since the connection stays open */
+  poller_.remove_fd(conn.socket.fd_num());
+
+  conn.state = Connection::State::Closed;
+  closed_connections_.emplace_back(connection_id);
+
+  return fd;
+}
+
+template<>
+optional<FileDescriptor> WSServer<NBSecureSocket>::release_connection(
+  const uint64_t)
+{
+  /* the TLS session state cannot leave this process */
+  return nullopt;
+}
+
+template<>
+uint64_t WSServer<TCPSocket>::adopt_connection(TCPSocket && sock)
+{
+  sock.set_blocking(false);
+
+  return add_connection(move(sock), Connection::State::Connected);
+}
+
+template<>
+uint64_t WSServer<NBSecureSocket>::adopt_connection(TCPSocket &&)
+{
+  throw runtime_error("adopt_connection: TLS connections cannot be adopted");
+}
+
+template<>
+void WSServer<TCPSocket>::offload_handshakes(const shared_ptr<ThreadPool> &)
+{
+  throw runtime_error("offload_handshakes: plaintext has no handshake");
+}
+
+template<>
+void WSServer<NBSecureSocket>::offload_handshakes(
+  const shared_ptr<ThreadPool> & pool)
+{
+  /* holds more than the handshakes that may be in flight at once */
+  static constexpr size_t HANDSHAKE_QUEUE_SIZE = 4096;
+
+  if (not handshakes_done_) {
+    handshakes_done_ = make_unique<MPSCQueue<uint64_t>>(HANDSHAKE_QUEUE_SIZE);
+
+    handshakes_done_->add_to_poller(poller_, [this](uint64_t && conn_id) {
+      auto conn_it = connections_.find(conn_id);
+      if (conn_it == connections_.end()) {
+        return;
+      }
+
+      try {
+        /* polled again from the state that the step left */
+        conn_it->second.socket.finish_offloaded_SSL_accept();
+        poller_.interest_changed(conn_it->second.socket.fd_num());
+      } catch (const exception & e) {
+        print_exception("ws_server: TLS handshake", e);
+        clean_idle_connection(conn_id);
+      }
+    });
+  }
+
+  handshake_pool_ = pool;
+}
+
+template<>
+void WSServer<TCPSocket>::offload_handshake(Connection &, const uint64_t)
+{}
+
+template<>
+void WSServer<NBSecureSocket>::offload_handshake(Connection & conn,
+                                                 const uint64_t conn_id)
+{
+  /* the connection is neither polled nor known to the callbacks (which
+   * could close it) until its ID is popped from handshakes_done_ */
+  NBSecureSocket & socket = conn.socket;
+
+  socket.set_handshake_offload([this, &socket, conn_id]() {
+    handshakes_in_flight_++;
+
+    handshake_pool_->submit([this, &socket, conn_id]() {
+      socket.run_offloaded_SSL_accept();
+
+      uint64_t id = conn_id;
+      while (not handshakes_done_->push(move(id))) {
+        this_thread::yield();
+      }
+
+      handshakes_in_flight_--;
+    });
+  });
+}
+
 template<class SocketType>
 TCPInfo WSServer<SocketType>::get_tcp_info(const uint64_t connection_id) const
 {
@@ -445,6 +754,51 @@ TCPInfo WSServer<SocketType>::get_tcp_info(const uint64_t connection_id) const
   return conn.socket.get_tcp_info();
 }
 
+template<class SocketType>
+void WSServer<SocketType>::collect_tcp_info(const uint64_t interval_ms)
+{
+  if (interval_ms == 0) {
+    throw runtime_error("collect_tcp_info: interval must be positive");
+  }
+
+  if (not tcp_info_collector_) {
+    tcp_info_collector_ = make_unique<TCPInfoCollector>(listener_addr_.port());
+
+    for (auto & [conn_id, conn] : connections_) {
+      conn.inode = conn.socket.inode();
+    }
+
+    tcp_info_interval_ms_ = interval_ms;
+    refresh_tcp_info();
+  } else {
+    tcp_info_interval_ms_ = interval_ms;
+  }
+}
+
+template<class SocketType>
+void WSServer<SocketType>::refresh_tcp_info()
+{
+  try {
+    tcp_info_collector_->refresh();
+  } catch (const exception & e) {
+    print_exception("collect_tcp_info", e);
+  }
+
+  poller_.add_timer(timestamp_ms() + tcp_info_interval_ms_,
+                    [this]() { refresh_tcp_info(); });
+}
+
+template<class SocketType>
+optional<TCPInfo> WSServer<SocketType>::cached_tcp_info(
+  const uint64_t connection_id) const
+{
+  if (not tcp_info_collector_) {
+    return nullopt;
+  }
+
+  return tcp_info_collector_->get(connections_.at(connection_id).inode);
+}
+
 template<class SocketType>
 Address WSServer<SocketType>::peer_addr(const uint64_t connection_id) const
 {
@@ -496,29 +850,212 @@ unsigned int WSServer<SocketType>::buffer_bytes(const uint64_t conn_id) const
   return connections_.at(conn_id).buffer_bytes();
 }
 
+template<class SocketType>
+uint64_t WSServer<SocketType>::total_buffer_bytes() const
+{
+  uint64_t total = 0;
+  for (const auto & [conn_id, conn] : connections_) {
+    total += conn.buffer_bytes();
+  }
+
+  return total;
+}
+
+template<class SocketType>
+uint64_t WSServer<SocketType>::memory_bytes(const uint64_t conn_id) const
+{
+  return connections_.at(conn_id).memory_bytes();
+}
+
+template<class SocketType>
+uint64_t WSServer<SocketType>::total_memory_bytes() const
+{
+  uint64_t total = 0;
+  for (const auto & [conn_id, conn] : connections_) {
+    total += conn.memory_bytes();
+  }
+
+  return total;
+}
+
 template<>
 void WSServer<TCPSocket>::Connection::clear_buffer()
 {
-  send_buffer.clear();
+  /* keep the rest of a frame that has started to go out, lest the peer see
+   * it cut short */
+  size_t keep = 0;
+  if (not send_buffer.empty() and
+      (send_buffer_offset > 0 or send_buffer.front().continuation())) {
+    keep = 1;
+    while (keep < send_buffer.size() and send_buffer[keep].continuation()) {
+      keep++;
+    }
+  }
+
+  send_buffer.erase(send_buffer.begin() + keep, send_buffer.end());
+  urgent_pulls.clear();
+  pull_callbacks.clear();
 }
 
 template<>
 void WSServer<NBSecureSocket>::Connection::clear_buffer()
 {
-  send_buffer.clear();
+  /* NBSecureSocket keeps the rest of a frame that has started to go out */
+  write();
   socket.clear_buffer();
+  urgent_pulls.clear();
+  pull_callbacks.clear();
 }
 
 template<class SocketType>
 void WSServer<SocketType>::clear_buffer(const uint64_t conn_id)
 {
-  return connections_.at(conn_id).clear_buffer();
+  Connection & conn = connections_.at(conn_id);
+  conn.clear_buffer();
+  poller_.interest_changed(conn.socket.fd_num());
+}
+
+template<>
+void WSServer<TCPSocket>::Connection::set_write_caps(
+  const size_t write_cap, const size_t)
+{
+  max_write_bytes = write_cap;
+}
+
+template<>
+void WSServer<NBSecureSocket>::Connection::set_write_caps(
+  const size_t write_cap, const size_t record_cap)
+{
+  socket.set_write_caps(write_cap, record_cap);
+}
+
+template<>
+void WSServer<TCPSocket>::Connection::set_record_size(const size_t)
+{}
+
+template<>
+void WSServer<NBSecureSocket>::Connection::set_record_size(const size_t bytes)
+{
+  socket.set_record_size(bytes);
+}
+
+template<>
+typename WSServer<TCPSocket>::WriteStats
+WSServer<TCPSocket>::Connection::write_stats() const
+{
+  return stats;
+}
+
+template<>
+typename WSServer<NBSecureSocket>::WriteStats
+WSServer<NBSecureSocket>::Connection::write_stats() const
+{
+  return {socket.num_writes(), socket.bytes_written()};
+}
+
+template<>
+optional<typename WSServer<TCPSocket>::HandshakeInfo>
+WSServer<TCPSocket>::Connection::handshake_info() const
+{
+  return nullopt;
+}
+
+template<>
+optional<typename WSServer<NBSecureSocket>::HandshakeInfo>
+WSServer<NBSecureSocket>::Connection::handshake_info() const
+{
+  if (not socket.handshake_us()) {
+    return nullopt;
+  }
+
+  return HandshakeInfo {socket.session_reused(), *socket.handshake_us()};
+}
+
+template<class SocketType>
+void WSServer<SocketType>::set_write_caps(const size_t max_write_bytes,
+                                          const size_t max_record_bytes)
+{
+  if (max_write_bytes == 0 or max_record_bytes == 0) {
+    throw runtime_error("set_write_caps: caps must be positive");
+  }
+
+  max_write_bytes_ = max_write_bytes;
+  max_record_bytes_ = max_record_bytes;
+}
+
+template<class SocketType>
+void WSServer<SocketType>::set_send_quantum(const size_t quantum)
+{
+  send_quantum_ = quantum;
+
+  for (auto & [conn_id, conn] : connections_) {
+    conn.send_quantum = quantum;
+    conn.send_deficit = 0;
+  }
+}
+
+template<class SocketType>
+void WSServer<SocketType>::set_send_weight(const uint64_t connection_id,
+                                           const double weight)
+{
+  if (not (weight > 0)) {
+    throw runtime_error("set_send_weight: weight must be positive");
+  }
+
+  connections_.at(connection_id).send_weight = weight;
+}
+
+template<class SocketType>
+void WSServer<SocketType>::set_pacing_rate(const uint64_t connection_id,
+                                           const optional<uint64_t> rate)
+{
+  connections_.at(connection_id).socket.set_max_pacing_rate(
+    rate.value_or(numeric_limits<uint64_t>::max()));
+}
+
+template<class SocketType>
+void WSServer<SocketType>::set_record_size(const uint64_t connection_id,
+                                           const size_t bytes)
+{
+  if (bytes == 0) {
+    throw runtime_error("set_record_size: size must be positive");
+  }
+
+  connections_.at(connection_id).set_record_size(bytes);
+}
+
+template<class SocketType>
+typename WSServer<SocketType>::WriteStats
+WSServer<SocketType>::write_stats(const uint64_t connection_id) const
+{
+  return connections_.at(connection_id).write_stats();
+}
+
+template<class SocketType>
+optional<typename WSServer<SocketType>::HandshakeInfo>
+WSServer<SocketType>::handshake_info(const uint64_t connection_id) const
+{
+  return connections_.at(connection_id).handshake_info();
 }
 
 template<class SocketType>
 Poller::Result WSServer<SocketType>::loop_once()
 {
-  auto result = poller_.poll(-1);
+  /* with idle work left, wait for events only briefly; the poller refuses
+   * a zero timeout to rule out busy-waiting */
+  auto result = poller_.poll(idle_work_ ? 1 : -1);
+
+  if (result.result == Poller::Result::Type::Timeout) {
+    idle_work_ = idle_callback_();
+    result = {Poller::Result::Type::Success};
+  } else {
+    if (loop_callback_ and result.result == Poller::Result::Type::Success) {
+      loop_callback_();
+    }
+
+    /* the events might have left work for idle_callback_ */
+    idle_work_ = static_cast<bool>(idle_callback_);
+  }
 
   /* let's garbage collect the closed connections */
   for (const uint64_t conn_id : closed_connections_) {
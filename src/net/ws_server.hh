@@ -3,17 +3,26 @@
 #ifndef WSSERVER_HH
 #define WSSERVER_HH
 
-#include <map>
-#include <set>
+#include <atomic>
+#include <list>
 #include <functional>
 #include <deque>
+#include <memory>
+#include <vector>
+#include <optional>
 
 #include "socket.hh"
+#include "tcp_info_collector.hh"
 #include "nb_secure_socket.hh"
 #include "poller.hh"
 #include "address.hh"
 #include "http_request_parser.hh"
 #include "ws_message_parser.hh"
+#include "shared_buffer.hh"
+#include "arena.hh"
+#include "slot_map.hh"
+#include "thread_pool.hh"
+#include "mpsc_queue.hh"
 
 /* this implementation is not thread-safe. */
 template<class SocketType>
@@ -23,10 +32,28 @@ public:
   using MessageCallback = std::function<void(const uint64_t, const WSMessage &)>;
   using OpenCallback = std::function<void(const uint64_t)>;
   using CloseCallback = std::function<void(const uint64_t)>;
+  using LoopCallback = std::function<void()>;
+  using IdleCallback = std::function<bool()>;
 
-private:
-  uint64_t last_connection_id_ {0};
+  /* queues the next frames of a connection with queue_frame(); returns
+   * whether it has more to queue */
+  using PullCallback = std::function<bool()>;
+
+  /* counters of the writes to the socket of a connection */
+  struct WriteStats
+  {
+    uint64_t num_writes {0};  /* writev or SSL_write calls */
+    uint64_t bytes_written {0};
+  };
+
+  /* the TLS handshake of a connection */
+  struct HandshakeInfo
+  {
+    bool resumed;  /* abbreviated handshake resuming a session */
+    uint64_t duration_us;
+  };
 
+private:
   struct Connection
   {
     enum class State {
@@ -39,48 +66,148 @@ private:
 
     SocketType socket;
 
+    /* inode of the socket, if the server collects TCP info */
+    uint64_t inode {0};
+
     /* incoming messages */
     HTTPRequestParser ws_handshake_parser {};
     WSMessageParser ws_message_parser {};
 
     /* outgoing messages */
-    std::deque<std::string> send_buffer {};
+    std::deque<SharedBuffer> send_buffer {};
     size_t send_buffer_offset {0};
 
+    /* cap on the bytes of a writev, and the counters of TCPSocket writes
+     * (NBSecureSocket keeps its own) */
+    size_t max_write_bytes {256 * 1024};
+    WriteStats stats {};
+
+    /* deficit round robin across the connections: each time the socket is
+     * writable, the connection may write up to send_deficit bytes, which
+     * grows by send_quantum * send_weight and carries over at most one
+     * weighted quantum; a send_quantum of 0 writes until the socket blocks */
+    size_t send_quantum {0};
+    double send_weight {1.0};
+    size_t send_deficit {0};
+
+    /* messages whose frames are queued as the send buffer drains, in order;
+     * urgent ones are pulled first, between the frames of the others */
+    std::deque<PullCallback> urgent_pulls {};
+    std::deque<PullCallback> pull_callbacks {};
+
     Connection(TCPSocket && sock, SSLContext & ssl_context);
 
-    std::string read();
+    /* read what is available, into buffer if needed; the view is valid
+     * until the next read */
+    std::string_view read(IOBuffer & buffer);
     void write();
 
+    void set_write_caps(const size_t write_cap, const size_t record_cap);
+    void set_record_size(const size_t bytes);
+    WriteStats write_stats() const;
+
+    /* nullopt over plaintext or before the TLS handshake completes */
+    std::optional<HandshakeInfo> handshake_info() const;
+
     /* the connection has data to write to TCPSocket directly,
      * or write to NBSecureSocket's internal send_buffer */
     bool data_to_write() const { return send_buffer.size() > 0; }
 
     /* tell the poller if the connection is interested in sending
-     * i.e., it or its NBSecureSocket has pending data in the send_buffer */
+     * i.e., it or its NBSecureSocket has pending data in the send_buffer,
+     * or it has frames to pull */
     bool interested_in_sending() const;
 
+    /* whether the connection has frames to pull */
+    bool data_to_pull() const
+    {
+      return state == State::Connected and
+             (not urgent_pulls.empty() or not pull_callbacks.empty());
+    }
+
     unsigned int buffer_bytes() const;
     void clear_buffer();
+
+    /* the send buffers plus what the message parser holds */
+    uint64_t memory_bytes() const
+    {
+      return buffer_bytes() + ws_message_parser.buffer_bytes();
+    }
   };
 
   SSLContext ssl_context_ {};
 
   TCPSocket listener_socket_ {};
   Address listener_addr_ {};
-  std::map<uint64_t, Connection> connections_ {};
+
+  /* key: connection ID, which is assigned by the slot map so that looking a
+   * connection up on the send path indexes its slot; the connections are
+   * allocated close together, in huge pages */
+  using ConnectionAllocator =
+    ArenaAllocator<std::pair<const uint64_t, Connection>>;
+  Arena connection_arena_ {};
+  GenerationalSlotMap<Connection, ConnectionAllocator>
+    connections_ {ConnectionAllocator(connection_arena_)};
+
   Poller poller_ {};
 
   MessageCallback message_callback_ {};
   OpenCallback open_callback_ {};
   CloseCallback close_callback_ {};
+  LoopCallback loop_callback_ {};
+  IdleCallback idle_callback_ {};
+  bool idle_work_ {false};  /* whether idle_callback_ may have work left */
+
+  /* erased after the iteration of the event loop (possibly listed twice) */
+  std::vector<uint64_t> closed_connections_ {};
 
-  std::set<uint64_t> closed_connections_ {};
+  /* listening sockets taken over from another process */
+  std::list<TCPSocket> adopted_listeners_ {};
 
   std::string congestion_control_ {};
 
+  /* caps on the bytes of a writev and of a coalesced TLS record */
+  size_t max_write_bytes_ {256 * 1024};
+  size_t max_record_bytes_ {16 * 1024};
+
+  /* bytes per round of the send scheduler (0: disabled) */
+  size_t send_quantum_ {0};
+
+  /* TCP_NOTSENT_LOWAT of the connections (0: the system default) */
+  unsigned int notsent_lowat_ {0};
+
+  /* cap on the bytes of an incomplete message from a peer (0: none) */
+  size_t max_receive_bytes_ {0};
+
+  /* see collect_tcp_info() */
+  std::unique_ptr<TCPInfoCollector> tcp_info_collector_ {nullptr};
+  uint64_t tcp_info_interval_ms_ {0};
+
+  /* refresh tcp_info_collector_ and schedule the next refresh */
+  void refresh_tcp_info();
+
+  /* see offload_handshakes(); a worker that has run a step of a handshake
+   * pushes the ID of its connection to handshakes_done_ */
+  std::shared_ptr<ThreadPool> handshake_pool_ {nullptr};
+  std::unique_ptr<MPSCQueue<uint64_t>> handshakes_done_ {nullptr};
+  std::atomic<unsigned int> handshakes_in_flight_ {0};
+
+  /* have the handshake of conn run on handshake_pool_ (TLS only) */
+  void offload_handshake(Connection & conn, const uint64_t conn_id);
+
   void init_listener_socket();
 
+  /* accept the connections on listener */
+  void add_listener_action(TCPSocket & listener);
+
+  /* pull frames into the send buffer of conn until it holds a write's
+   * worth (max_write_bytes_) */
+  void pull_frames(Connection & conn);
+
+  /* add a connection in state on sock and its actions; return its ID */
+  uint64_t add_connection(TCPSocket && sock,
+                          const typename Connection::State state);
+
   /* gracefully close the connection */
   void wait_close_connection(const uint64_t connection_id);
 
@@ -89,7 +216,11 @@ private:
 
 public:
   WSServer(const Address & listener_addr,
-           const std::string & congestion_control = "default");
+           const std::string & congestion_control = "default",
+           const Poller::Backend poller_backend = Poller::Backend::Poll);
+
+  /* waits for the handshake steps running on the pool */
+  ~WSServer();
 
   Poller::Result loop_once();
   int loop();
@@ -98,15 +229,99 @@ public:
 
   SSLContext & ssl_context() { return ssl_context_; }
 
+  /* assign connection IDs among first_id, first_id + step, first_id + 2 *
+   * step... (before any connection) so that servers sharing a port
+   * (SO_REUSEPORT) have disjoint IDs; an ID is never reused */
+  void set_connection_ids(const uint64_t first_id, const uint64_t step);
+
   void set_message_callback(MessageCallback func) { message_callback_ = func; }
   void set_open_callback(OpenCallback func) { open_callback_ = func; }
   void set_close_callback(CloseCallback func) { close_callback_ = func; }
 
+  /* called once per iteration of the event loop, after all the events
+   * returned by the poller have been handled */
+  void set_loop_callback(LoopCallback func) { loop_callback_ = func; }
+
+  /* called when no event is ready, to do deferrable work a piece at a time
+   * between the events; returns whether any work is left */
+  void set_idle_callback(IdleCallback func) { idle_callback_ = func; }
+
   bool queue_frame(const uint64_t connection_id, const WSFrame & frame);
 
+  /* queue a frame whose payload is the concatenation of payload_buffers,
+   * which are queued as is (e.g., views into mmap'd files) without copying */
+  bool queue_frame(const uint64_t connection_id,
+                   const bool fin, const WSFrame::OpCode opcode,
+                   std::vector<SharedBuffer> && payload_buffers);
+
+  /* queue the frames of a long message lazily: func is called to queue the
+   * next few frames whenever the connection's send buffer runs low, until
+   * it returns false, so that only a couple of frames are buffered at a
+   * time. The frames queued meanwhile with queue_frame() may go out in
+   * between; clear_buffer() drops func. An urgent func is pulled ahead of
+   * the others, at the next frame boundary, so that a short message (e.g.,
+   * an audio chunk) is not stuck behind a long one (e.g., a video chunk) */
+  void queue_pull(const uint64_t connection_id, PullCallback func,
+                  const bool urgent = false);
+
   Address peer_addr(const uint64_t connection_id) const;
 
+  /* caps on the bytes gathered into a single write of the connections
+   * accepted afterwards: a writev (plaintext or kTLS), and a TLS record
+   * into which small buffers are coalesced */
+  void set_write_caps(const size_t max_write_bytes,
+                      const size_t max_record_bytes);
+
+  /* keep at most about bytes of each connection accepted afterwards queued
+   * unsent in the kernel: the connection is polled as writable (and pulls
+   * more of its send buffer) only below this mark, so the TCP state seen
+   * by the ABR is not inflated by a backlog queued up in the kernel */
+  void set_notsent_lowat(const unsigned int bytes) { notsent_lowat_ = bytes; }
+
+  /* close a connection whose peer has sent more than bytes (0: no cap) of a
+   * frame or fragmented message that is yet to complete */
+  void set_max_receive_bytes(const size_t bytes) { max_receive_bytes_ = bytes; }
+
+  /* schedule the writes of the connections by deficit round robin: in each
+   * iteration of the event loop, a writable connection writes at most
+   * quantum bytes times its weight (plus what it could not write in the
+   * last round), so that a connection on a fast link cannot monopolize the
+   * loop; 0 disables the scheduler. TLS connections are unaffected, as they
+   * write a single record (or writev) per iteration anyway */
+  void set_send_quantum(const size_t quantum);
+
+  /* weight (> 0, 1 by default) of the connection's share of the quantum */
+  void set_send_weight(const uint64_t connection_id, const double weight);
+
+  /* pace the connection at rate (bytes/s) from now on; nullopt unpaces */
+  void set_pacing_rate(const uint64_t connection_id,
+                       const std::optional<uint64_t> rate);
+
+  /* write the data queued afterwards in TLS records of about bytes (> 0) of
+   * plaintext each (16 KB by default): smaller records can be decrypted as
+   * soon as their packets arrive, larger ones cost less per byte.
+   * No-op over plaintext */
+  void set_record_size(const uint64_t connection_id, const size_t bytes);
+
+  WriteStats write_stats(const uint64_t connection_id) const;
+
+  std::optional<HandshakeInfo> handshake_info(const uint64_t connection_id) const;
+
   unsigned int buffer_bytes(const uint64_t connection_id) const;
+
+  /* the memory of the connections (not counting their buffers) */
+  const Arena & connection_arena() const { return connection_arena_; }
+
+  /* bytes waiting to be sent across all connections */
+  uint64_t total_buffer_bytes() const;
+
+  /* bytes held by the send and receive buffers of a connection, and of all
+   * the connections */
+  uint64_t memory_bytes(const uint64_t connection_id) const;
+  uint64_t total_memory_bytes() const;
+
+  /* drop the frames queued to a connection, and its pulls, except the rest
+   * of a frame that has started to go out */
   void clear_buffer(const uint64_t connection_id);
 
   /* public method to gracefully close a connection */
@@ -116,6 +331,45 @@ public:
   void clean_idle_connection(const uint64_t connection_id);
 
   TCPInfo get_tcp_info(const uint64_t connection_id) const;
+
+  /* fetch the TCP info of all the connections in a single NETLINK_SOCK_DIAG
+   * dump every interval_ms (see TCPInfoCollector) for cached_tcp_info(),
+   * which costs no system call */
+  void collect_tcp_info(const uint64_t interval_ms);
+
+  /* the TCP info of the connection as of the last dump, which is up to
+   * interval_ms old; nullopt if TCP info is not collected or the connection
+   * was not established yet at the last dump. Prefer get_tcp_info() when
+   * the current state matters (e.g., for an ABR decision). */
+  std::optional<TCPInfo> cached_tcp_info(const uint64_t connection_id) const;
+
+  /* run the steps of the TLS handshakes of the connections accepted
+   * afterwards, which do the public-key operations, on pool (which may be
+   * shared with the servers of other threads) rather than in the event loop,
+   * so that a burst of new connections does not stall the others; the
+   * connection is not polled while a step runs, and the records of
+   * established connections are still processed in the loop. Throws over
+   * plaintext. */
+  void offload_handshakes(const std::shared_ptr<ThreadPool> & pool);
+
+  /* hand the connections over to another process, e.g., a new binary, which
+   * receives the sockets over a Unix domain socket (plaintext only) */
+
+  /* stop accepting connections and return a copy of the listening socket */
+  FileDescriptor release_listener();
+
+  /* also accept the connections on a listening socket from release_listener */
+  void adopt_listener(TCPSocket && listener);
+
+  /* if the connection is idle, i.e., connected with nothing to send and no
+   * partial message received, forget it without calling the close callback
+   * and return a copy of its socket; nullopt otherwise or over TLS.
+   * Like clean_idle_connection, it must be called from a poller action. */
+  std::optional<FileDescriptor> release_connection(const uint64_t connection_id);
+
+  /* add a connected WebSocket connection from release_connection and return
+   * its new ID; the open callback is not called. Throws over TLS. */
+  uint64_t adopt_connection(TCPSocket && sock);
 };
 
 using WebSocketTCPServer = WSServer<TCPSocket>;
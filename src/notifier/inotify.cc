@@ -1,18 +1,22 @@
 #include "inotify.hh"
 
 #include <sys/inotify.h>
+#include <sys/ioctl.h>
 #include <limits.h>
 #include <unistd.h>
+#include <cerrno>
+#include <iostream>
 #include <stdexcept>
 
 #include "exception.hh"
+#include "metrics.hh"
 
 using namespace std;
 using namespace PollerShortNames;
 
 Inotify::Inotify(Poller & poller)
-  : inotify_fd_(CheckSystemCall("inotify_init", inotify_init())),
-    map_()
+  : inotify_fd_(CheckSystemCall("inotify_init1", inotify_init1(IN_NONBLOCK))),
+    map_(), batch_callbacks_()
 {
   poller.add_action(
     Poller::Action(inotify_fd_, Direction::In,
@@ -25,25 +29,27 @@ Inotify::Inotify(Poller & poller)
 
 int Inotify::add_watch(const string & path,
                         const uint32_t mask,
-                        const callback_t & callback)
+                        const callback_t & callback,
+                        const rescan_t & rescan)
 {
   int wd = CheckSystemCall(
              "inotify_add_watch",
              inotify_add_watch(inotify_fd_.fd_num(), path.c_str(), mask));
 
   /* insert a new key-value pair or update the current value */
-  map_[wd] = make_tuple(path, mask, callback);
+  map_[wd] = make_tuple(path, mask, callback, rescan);
 
   return wd;
 }
 
 vector<int> Inotify::add_watch(const vector<string> & paths,
                                 const uint32_t mask,
-                                const callback_t & callback)
+                                const callback_t & callback,
+                                const rescan_t & rescan)
 {
   vector<int> wd_list;
   for (const auto & path : paths) {
-    wd_list.emplace_back(add_watch(path, mask, callback));
+    wd_list.emplace_back(add_watch(path, mask, callback, rescan));
   }
 
   return wd_list;
@@ -61,25 +67,30 @@ void Inotify::rm_watch(const int wd)
   }
 }
 
-Result Inotify::handle_events()
+void Inotify::add_batch_callback(const function<void()> & callback)
 {
-  /* explicitly ensure the buffer is sufficient to read at least one event */
-  const int BUF_LEN = sizeof(inotify_event) + NAME_MAX + 1;
-
-  /* read events */
-  string event_buf = inotify_fd_.read(BUF_LEN);
+  batch_callbacks_.emplace_back(callback);
+}
 
-  const char * buf = event_buf.c_str();
+size_t Inotify::dispatch_events(const char * buf, const size_t len)
+{
   const inotify_event * event;
+  size_t num_events = 0;
 
   /* loop over all events in the buffer */
-  for (const char * ptr = buf; ptr < buf + event_buf.size(); ) {
+  for (const char * ptr = buf; ptr < buf + len; ) {
     event = reinterpret_cast<const inotify_event *>(ptr);
+    num_events++;
+
+    /* not of any watch (wd is -1) */
+    if (event->mask & IN_Q_OVERFLOW) {
+      overflowed_ = true;
+    }
 
     auto map_it = map_.find(event->wd);
     /* ignore events from an unwatched descriptor */
     if (map_it != map_.end()) {
-      const auto & [path, mask, callback] = map_it->second;
+      const auto & [path, mask, callback, rescan] = map_it->second;
 
       /* ignore events not interested in */
       if ((event->mask & mask) != 0) {
@@ -90,5 +101,71 @@ Result Inotify::handle_events()
     ptr += sizeof(inotify_event) + event->len;
   }
 
+  return num_events;
+}
+
+void Inotify::rescan_watches()
+{
+  num_overflows_++;
+  cerr << "Inotify: event queue overflowed; rescanning the watched paths"
+       << endl;
+
+  /* a rescan may add or remove watches */
+  vector<pair<string, rescan_t>> rescans;
+  for (const auto & [wd, watch] : map_) {
+    const auto & rescan = get<3>(watch);
+    if (rescan) {
+      rescans.emplace_back(get<0>(watch), rescan);
+    }
+  }
+
+  for (const auto & [path, rescan] : rescans) {
+    try {
+      rescan(path);
+    } catch (const exception & e) {
+      print_exception(("Inotify: rescan of " + path).c_str(), e);
+    }
+  }
+}
+
+Result Inotify::handle_events()
+{
+  /* large enough for many events (and at least one with the longest name) */
+  static constexpr size_t BUF_LEN = 64 * 1024;
+  static_assert(BUF_LEN >= sizeof(inotify_event) + NAME_MAX + 1);
+
+  alignas(inotify_event) char buf[BUF_LEN];
+
+  /* the depth of the queue, which nears max_queued_events (in events of
+   * about sizeof(inotify_event) plus a name each) before it overflows */
+  int queued_bytes = 0;
+  if (ioctl(inotify_fd_.fd_num(), FIONREAD, &queued_bytes) == 0) {
+    Metrics::record("inotify_queued_bytes", queued_bytes);
+  }
+
+  /* drain all the queued events before running the batch callbacks */
+  size_t num_events = 0;
+  for (;;) {
+    const ssize_t len = ::read(inotify_fd_.fd_num(), buf, BUF_LEN);
+    inotify_fd_.register_read();
+
+    if (len < 0 and (errno == EAGAIN or errno == EWOULDBLOCK)) {
+      break;
+    }
+
+    num_events += dispatch_events(buf, CheckSystemCall("read", len));
+  }
+
+  Metrics::record("inotify_batch_events", num_events);
+
+  if (overflowed_) {
+    overflowed_ = false;
+    rescan_watches();
+  }
+
+  for (const auto & callback : batch_callbacks_) {
+    callback();
+  }
+
   return ResultType::Continue;
 }
@@ -21,29 +21,59 @@ public:
   using callback_t = std::function<void(const inotify_event &,
                                         const std::string &)>;
 
+  /* when the queue of events overflows (IN_Q_OVERFLOW), the kernel drops
+   * the events that follow, so any watch may have missed some; a rescan
+   * function is then called with the path of its watch, after the queued
+   * events are handled (and before the batch callbacks), to find what the
+   * callback missed by diffing the path against what is already known */
+  using rescan_t = std::function<void(const std::string &)>;
+
   Inotify(Poller & poller);
 
   /* add a single path to the watch list */
   int add_watch(const std::string & path,
                 const uint32_t mask,
-                const callback_t & callback);
+                const callback_t & callback,
+                const rescan_t & rescan = {});
 
   /* add multiple paths to the watch list */
   std::vector<int> add_watch(const std::vector<std::string> & paths,
                              const uint32_t mask,
-                             const callback_t & callback);
+                             const callback_t & callback,
+                             const rescan_t & rescan = {});
 
   /* remove a watch descriptor from the watch list */
   void rm_watch(const int wd);
 
+  /* add a callback that runs once after each batch of events, i.e., all the
+   * events queued when the inotify fd became readable, has been handled;
+   * useful to coalesce the work triggered by many events */
+  void add_batch_callback(const std::function<void()> & callback);
+
+  /* number of times the queue has overflowed */
+  uint64_t num_overflows() const { return num_overflows_; }
+
 private:
   /* inotify instance */
   FileDescriptor inotify_fd_;
 
-  /* map a watch descriptor to its associated <path, mask, callback> */
-  std::unordered_map<int, std::tuple<std::string, uint32_t, callback_t>> map_;
+  /* map a watch descriptor to its associated <path, mask, callback, rescan> */
+  std::unordered_map<int, std::tuple<std::string, uint32_t, callback_t,
+                                     rescan_t>> map_;
+
+  std::vector<std::function<void()>> batch_callbacks_;
+
+  uint64_t num_overflows_ {0};
+  bool overflowed_ {false};  /* in the batch being handled */
+
+  /* dispatch the events in buf to the callbacks of their watches; return
+   * the number of events */
+  size_t dispatch_events(const char * buf, const size_t len);
+
+  /* call the rescan functions of the watches after an overflow */
+  void rescan_watches();
 
-  /* handles notified events and tells the poller to continue polling */
+  /* drains and handles notified events and tells the poller to continue polling */
   Poller::Action::Result handle_events();
 };
 
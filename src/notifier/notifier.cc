@@ -1,25 +1,56 @@
 #include "notifier.hh"
 
 #include <sys/inotify.h>
+#include <sys/stat.h>
+#include <charconv>
 #include <iostream>
+#include <tuple>
 #include <unordered_set>
 #include "filesystem.hh"
 #include "system_runner.hh"
+#include "profiler.hh"
+#include "timestamp.hh"
 
 using namespace std;
 using namespace PollerShortNames;
 
+/* the arrivals remembered in Notifier::recent_, which must be longer than
+ * the time between two batches of events, and the slack for the coarse
+ * granularity of the ctime of a file */
+static constexpr uint64_t RECENT_MS = 10000;
+static constexpr uint64_t CTIME_SLACK_MS = 1000;
+
 void print_usage(const string & prog)
 {
   cerr <<
   "Usage: " << prog << " <src_dir> <src_ext> [--check <dst_dir> <dst_ext>]\n"
-  "       [--tmp <tmp_dir>] --exec <program> [program args]\n\n"
+  "       [--tmp <tmp_dir>] [--stats <stats_path>] [--batch]\n"
+  "       [--max-jobs <n>] [--max-queued <n>]\n"
+  "       [--scheduler <socket_path> <channel> <stage>]\n"
+  "       --exec <program> [program args]\n\n"
   "<src_dir>           source directory\n"
   "<src_ext>           extension of files in <src_dir> to watch\n"
   "[--check <dst_dir> <dst_ext>]\n"
   "                    make sure an output file with extension <dst_ext>\n"
   "                    appears in <dst_dir> eventually\n"
   "[--tmp <tmp_dir>]   temporary directory to use whenever it is needed\n"
+  "[--stats <stats_path>]\n"
+  "                    keep the numbers of started and finished programs\n"
+  "                    in a file shared with readers (see stage_stats.hh)\n"
+  "[--batch]           run the program only once, and rather than passing\n"
+  "                    <src_filepath> [<dst_filepath>] as arguments, write\n"
+  "                    them as a line to its stdin; it must reply a line of\n"
+  "                    \"<src_filepath> <exit status>\" to its stdout for\n"
+  "                    each (see batch.hh)\n"
+  "[--max-jobs <n>]    process at most <n> files at a time; the others are\n"
+  "                    queued and the newest of them (by the timestamp in\n"
+  "                    their names) processed first\n"
+  "[--max-queued <n>]  with --max-jobs, drop the oldest queued files beyond\n"
+  "                    <n>, which are never processed\n"
+  "[--scheduler <socket_path> <channel> <stage>]\n"
+  "                    process a file only once the job scheduler listening\n"
+  "                    on <socket_path> grants it a CPU, as a job of the\n"
+  "                    <stage>-th stage of <channel> (see job_scheduler.hh)\n"
   "--exec <program>    program to run after a new file <src_filepath> is\n"
   "                    moved into <src_dir>. The program must take at least\n"
   "                    one argument: <src_filepath>, and must take a second\n"
@@ -34,14 +65,23 @@ Notifier::Notifier(const string & src_dir,
                    const optional<string> & dst_dir_opt,
                    const optional<string> & dst_ext_opt,
                    const optional<string> & tmp_dir_opt,
+                   const optional<string> & stats_path_opt,
+                   const bool batch,
+                   const unsigned int max_jobs,
+                   const optional<size_t> & max_queued_opt,
                    const string & program,
                    const vector<string> & prog_args)
   : src_dir_(src_dir), src_ext_(src_ext),
     check_mode_(false), dst_dir_(), dst_ext_(),
     tmp_dir_(), program_(program), prog_args_(prog_args),
     process_manager_(), inotify_(process_manager_.poller()),
-    prefixes_()
+    prefixes_(), batch_(batch), stats_(),
+    max_jobs_(max_jobs), max_queued_(max_queued_opt)
 {
+  if (stats_path_opt) {
+    stats_.emplace(*stats_path_opt, true);
+  }
+
   /* check mode */
   if (dst_dir_opt and dst_ext_opt) {
     check_mode_ = true;
@@ -74,9 +114,31 @@ Notifier::Notifier(const string & src_dir,
         return;
       }
 
-      run_as_child(filename);
-    }
+      /* unless a rescan has just found it */
+      if (not recent_.emplace(filename, timestamp_ms()).second) {
+        return;
+      }
+
+      schedule(filename);
+    },
+    [this](const string &) { rescan_src_dir(); }
   );
+
+  inotify_.add_batch_callback([this]() {
+    synced_ms_ = timestamp_ms();
+
+    for (auto it = recent_.begin(); it != recent_.end(); ) {
+      if (it->second + RECENT_MS < synced_ms_) {
+        it = recent_.erase(it);
+      } else {
+        it++;
+      }
+    }
+  });
+
+  if (batch_) {
+    start_batch();
+  }
 }
 
 inline string Notifier::get_src_path(const string & prefix)
@@ -96,6 +158,54 @@ inline string Notifier::get_tmp_path(const string & prefix)
   return fs::path(tmp_dir_) / (prefix + dst_ext_);
 }
 
+/* the timestamp that a file is named after, if any */
+static optional<uint64_t> parse_timestamp(const string & prefix)
+{
+  uint64_t value;
+  const auto [ptr, ec] = from_chars(prefix.data(),
+                                    prefix.data() + prefix.size(), value);
+  if (ec != errc() or ptr != prefix.data() + prefix.size()) {
+    return nullopt;
+  }
+
+  return value;
+}
+
+void Notifier::schedule(const string & filename, const bool start)
+{
+  if (max_jobs_ == 0) {
+    run_as_child(filename);
+    return;
+  }
+
+  /* inputs not named after a timestamp are only ordered by arrival */
+  const auto ts = parse_timestamp(fs::path(filename).stem());
+  queue_.emplace(make_pair(ts.value_or(0), num_arrived_++), filename);
+
+  if (max_queued_) {
+    while (queue_.size() > *max_queued_) {
+      cerr << "Notifier: dropping " << queue_.begin()->second
+           << " with " << queue_.size() << " files queued" << endl;
+      queue_.erase(queue_.begin());
+    }
+  }
+
+  if (start) {
+    start_queued();
+  }
+}
+
+void Notifier::start_queued()
+{
+  while (running_ < max_jobs_ and not queue_.empty()) {
+    const auto newest = prev(queue_.end());
+    const string filename = newest->second;
+    queue_.erase(newest);
+
+    run_as_child(filename);
+  }
+}
+
 void Notifier::run_as_child(const string & filename)
 {
   string prefix = fs::path(filename).stem();
@@ -117,6 +227,34 @@ void Notifier::run_as_child(const string & filename)
 
   args.insert(args.end(), prog_args_.begin(), prog_args_.end());
 
+  running_++;
+
+  if (scheduler_) {
+    /* run once granted a worker, on its CPU */
+    scheduler_->request(parse_timestamp(prefix),
+      [this, args, prefix](const uint64_t job, const int cpu) {
+        jobs_.emplace(prefix, job);
+        start(args, prefix, cpu);
+      }
+    );
+    return;
+  }
+
+  start(args, prefix, nullopt);
+}
+
+void Notifier::start(const vector<string> & args, const string & prefix,
+                     const optional<int> & cpu)
+{
+  if (stats_) {
+    stats_->add_started();
+  }
+
+  if (batch_) {
+    run_in_batch(args, prefix);
+    return;
+  }
+
   /* run program_ as a child */
   if (check_mode_) {
     pid_t pid = process_manager_.run_as_child(program_, args,
@@ -124,23 +262,147 @@ void Notifier::run_as_child(const string & filename)
         /* verify that the correct output has been written */
         assert(check_mode_);
 
-        string prefix = prefixes_[pid];
-
-        /* throw an exception if get_tmp_path(prefix) does not exist */
-        fs::rename(get_tmp_path(prefix), get_dst_path(prefix));
-
+        finish(prefixes_[pid]);
         prefixes_.erase(pid);
-      }
+      }, {}, "", cpu
     );
 
     prefixes_.emplace(pid, prefix);
   } else {
-    process_manager_.run_as_child(program_, args);
+    process_manager_.run_as_child(program_, args,
+      [this, prefix](const pid_t &) { finish(prefix); }, {}, "", cpu);
+  }
+}
+
+void Notifier::finish(const string & prefix)
+{
+  if (check_mode_) {
+    /* throw an exception if get_tmp_path(prefix) does not exist */
+    fs::rename(get_tmp_path(prefix), get_dst_path(prefix));
+  }
+
+  if (stats_) {
+    stats_->add_finished();
+  }
+
+  if (scheduler_) {
+    const auto it = jobs_.find(prefix);
+    scheduler_->release(it->second);
+    jobs_.erase(it);
+  }
+
+  running_--;
+  start_queued();
+}
+
+void Notifier::start_batch()
+{
+  vector<string> args { program_ };
+  args.insert(args.end(), prog_args_.begin(), prog_args_.end());
+
+  /* the program is not expected to exit, even successfully */
+  auto [pid, in, out] = process_manager_.run_as_coprocess(program_, args,
+    [](const pid_t &) {
+      throw runtime_error("Notifier: the batch program exited");
+    }
+  );
+  cerr << "Notifier: running " << program_ << " in batch as PID "
+       << pid << endl;
+
+  batch_in_ = make_unique<FileDescriptor>(move(in));
+  batch_out_ = make_unique<FileDescriptor>(move(out));
+
+  /* a line is only written as the pipe has room, so that neither the
+   * notifier nor the program blocks on the other with many inputs queued */
+  batch_in_->set_blocking(false);
+
+  process_manager_.poller().add_action(
+    Poller::Action(*batch_in_, Direction::Out,
+      [this]() {
+        const string_view pending(batch_pending_);
+        const auto it = batch_in_->write(pending, false);
+        batch_pending_.erase(0, it - pending.begin());
+        return ResultType::Continue;
+      },
+      [this]() { return not batch_pending_.empty(); }
+    ).named("batch_in")
+  );
+
+  process_manager_.poller().add_action(
+    Poller::Action(*batch_out_, Direction::In,
+      [this]() {
+        batch_replies_.append(batch_out_->read());
+        if (batch_out_->eof()) {
+          throw runtime_error("Notifier: the batch program closed stdout");
+        }
+
+        size_t line_start = 0;
+        for (size_t line_end = batch_replies_.find('\n');
+             line_end != string::npos;
+             line_end = batch_replies_.find('\n', line_start)) {
+          handle_batch_reply(
+            batch_replies_.substr(line_start, line_end - line_start));
+          line_start = line_end + 1;
+        }
+
+        batch_replies_.erase(0, line_start);
+        return ResultType::Continue;
+      }
+    ).named("batch_out")
+  );
+}
+
+void Notifier::run_in_batch(const vector<string> & args, const string & prefix)
+{
+  /* args are { program_, <src_filepath>, [<dst_filepath>], prog_args_... } */
+  const string & src_path = args.at(1);
+
+  batch_pending_ += src_path;
+  if (check_mode_) {
+    batch_pending_ += " " + args.at(2);
   }
+  batch_pending_ += "\n";
+
+  batch_prefixes_[src_path] = prefix;
+}
+
+void Notifier::handle_batch_reply(const string & reply)
+{
+  /* "<src_filepath> <exit status>" */
+  const size_t space = reply.rfind(' ');
+  if (space == string::npos) {
+    throw runtime_error("Notifier: invalid reply from batch: " + reply);
+  }
+
+  const string src_path = reply.substr(0, space);
+  const int status = stoi(reply.substr(space + 1));
+
+  const auto it = batch_prefixes_.find(src_path);
+  if (it == batch_prefixes_.end()) {
+    throw runtime_error("Notifier: unexpected reply from batch: " + reply);
+  }
+
+  /* an input that fails is fatal, as is a child that exits abnormally */
+  if (status != EXIT_SUCCESS) {
+    throw runtime_error("Notifier: batch failed to process " + src_path);
+  }
+
+  finish(it->second);
+  batch_prefixes_.erase(it);
+}
+
+void Notifier::use_scheduler(const string & socket_path, const string & channel,
+                             const unsigned int stage)
+{
+  scheduler_ = make_unique<JobSchedulerClient>(process_manager_.poller(),
+                                               socket_path, channel, stage);
 }
 
 void Notifier::process_existing_files()
 {
+  /* the events of the inputs moved in from now on are queued */
+  synced_ms_ = timestamp_ms();
+
   unordered_set<string> dst_prefixes;
 
   if (check_mode_) {
@@ -160,14 +422,64 @@ void Notifier::process_existing_files()
       if (check_mode_) {
         /* in check mode only process files with no outputs in dst_dir */
         if (dst_prefixes.find(prefix) == dst_prefixes.end()) {
-          run_as_child(filename);
+          schedule(filename, false);
         }
       } else {
         /* otherwise process every file in src_dir with src_ext */
-        run_as_child(filename);
+        schedule(filename, false);
       }
     }
   }
+
+  /* with --max-jobs, the newest of the backlog are started first */
+  start_queued();
+}
+
+void Notifier::rescan_src_dir()
+{
+  /* an input whose event was dropped has been moved in (which sets its
+   * ctime) after the last batch, as the events queued by then were kept;
+   * its event would have arrived after that too, so it is not in recent_
+   * unless it has been scheduled */
+  const uint64_t since_ms = synced_ms_ - min(synced_ms_, CTIME_SLACK_MS);
+  size_t num_missed = 0;
+
+  for (const auto & src : fs::directory_iterator(src_dir_)) {
+    const auto & src_path = src.path();
+    if (src_ext_ != "." and src_path.extension() != src_ext_) {
+      continue;
+    }
+
+    const string filename = src_path.filename();
+    if (recent_.count(filename)) {
+      continue;
+    }
+
+    struct stat st;
+    if (stat(src_path.c_str(), &st) != 0 or not S_ISREG(st.st_mode)) {
+      continue;  /* e.g., already cleaned up */
+    }
+
+    const uint64_t ctime_ms = st.st_ctim.tv_sec * 1000
+                              + st.st_ctim.tv_nsec / MILLION;
+    if (ctime_ms < since_ms) {
+      continue;
+    }
+
+    /* in check mode, skip the inputs whose outputs are already there */
+    if (check_mode_ and fs::exists(get_dst_path(src_path.stem()))) {
+      continue;
+    }
+
+    recent_[filename] = timestamp_ms();
+    schedule(filename, false);
+    num_missed++;
+  }
+
+  cerr << "Notifier: found " << num_missed << " missed files in "
+       << src_dir_ << endl;
+
+  start_queued();
 }
 
 int Notifier::loop()
@@ -193,6 +505,11 @@ int main(int argc, char * argv[])
 
   optional<string> dst_dir_opt, dst_ext_opt;
   optional<string> tmp_dir_opt;
+  optional<string> stats_path_opt;
+  bool batch = false;
+  unsigned int max_jobs = 0;
+  optional<size_t> max_queued_opt;
+  optional<tuple<string, string, unsigned int>> scheduler_opt;
 
   for (;;) {
     if (arg_idx >= argc) {
@@ -208,6 +525,18 @@ int main(int argc, char * argv[])
       dst_ext_opt = argv[arg_idx++];
     } else if (opt_arg == "--tmp") {
       tmp_dir_opt = argv[arg_idx++];
+    } else if (opt_arg == "--stats") {
+      stats_path_opt = argv[arg_idx++];
+    } else if (opt_arg == "--batch") {
+      batch = true;
+    } else if (opt_arg == "--max-jobs") {
+      max_jobs = stoul(argv[arg_idx++]);
+    } else if (opt_arg == "--max-queued") {
+      max_queued_opt = stoul(argv[arg_idx++]);
+    } else if (opt_arg == "--scheduler") {
+      const string socket_path = argv[arg_idx++];
+      const string channel = argv[arg_idx++];
+      scheduler_opt = { socket_path, channel, stoul(argv[arg_idx++]) };
     } else if (opt_arg == "--exec") {
       break;
     }
@@ -222,6 +551,11 @@ int main(int argc, char * argv[])
     }
   }
 
+  if (max_queued_opt and max_jobs == 0) {
+    cerr << "Error: --max-queued requires --max-jobs" << endl;
+    return EXIT_FAILURE;
+  }
+
   /* the remaining arguments should be <program> [program args] */
   string program = argv[arg_idx++];
 
@@ -231,7 +565,16 @@ int main(int argc, char * argv[])
   }
 
   Notifier notifier(src_dir, src_ext, dst_dir_opt, dst_ext_opt,
-                    tmp_dir_opt, program, prog_args);
+                    tmp_dir_opt, stats_path_opt, batch, max_jobs,
+                    max_queued_opt, program, prog_args);
+  if (scheduler_opt) {
+    const auto & [socket_path, channel, stage] = *scheduler_opt;
+    notifier.use_scheduler(socket_path, channel, stage);
+  }
+
+  /* profile the CPU on SIGUSR2 if PROFILER_DIR is set */
+  Profiler::install_from_env();
+
   notifier.process_existing_files();
   return notifier.loop();
 }
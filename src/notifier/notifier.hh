@@ -1,8 +1,12 @@
 #ifndef NOTIFIER_HH
 #define NOTIFIER_HH
 
+#include <cstdint>
 #include <string>
+#include <map>
+#include <memory>
 #include <optional>
+#include <utility>
 #include <vector>
 #include <unordered_map>
 
@@ -10,6 +14,8 @@
 #include "poller.hh"
 #include "inotify.hh"
 #include "child_process.hh"
+#include "stage_stats.hh"
+#include "job_scheduler.hh"
 
 class Notifier
 {
@@ -19,9 +25,18 @@ public:
            const std::optional<std::string> & dst_dir_opt,
            const std::optional<std::string> & dst_ext_opt,
            const std::optional<std::string> & tmp_dir_opt,
+           const std::optional<std::string> & stats_path_opt,
+           const bool batch,
+           const unsigned int max_jobs,
+           const std::optional<size_t> & max_queued_opt,
            const std::string & program,
            const std::vector<std::string> & prog_args);
 
+  /* run each input only once granted a worker by the JobScheduler listening
+   * on socket_path, as a job of the stage (rank) of channel */
+  void use_scheduler(const std::string & socket_path,
+                     const std::string & channel, const unsigned int stage);
+
   void process_existing_files();
 
   int loop();
@@ -41,12 +56,64 @@ private:
 
   std::unordered_map<pid_t, std::string> prefixes_;
 
+  /* after an inotify overflow, the inputs moved into src_dir_ since
+   * synced_ms_ (when the last batch of events was handled, in ms since
+   * epoch) are rescanned, but for those in recent_ (arrived within
+   * RECENT_MS of synced_ms_, key: filename, value: arrival time), which
+   * have been scheduled already */
+  uint64_t synced_ms_ {0};
+  std::unordered_map<std::string, uint64_t> recent_ {};
+
+  void rescan_src_dir();
+
+  /* with --batch, program_ runs once and is given the inputs on its stdin,
+   * replying on its stdout as each input is processed (see batch.hh) */
+  bool batch_;
+  std::unique_ptr<FileDescriptor> batch_in_ {};
+  std::unique_ptr<FileDescriptor> batch_out_ {};
+  std::string batch_pending_ {};  /* yet to be written to batch_in_ */
+  std::string batch_replies_ {};  /* read from batch_out_, not yet a line */
+  std::unordered_map<std::string, std::string> batch_prefixes_ {};  /* key: src path */
+
+  /* counters of the inputs, if --stats is given */
+  std::optional<StageStats> stats_;
+
+  /* with --max-jobs, at most max_jobs_ inputs are processed at a time and
+   * the others wait in queue_, from which the newest (by the timestamp in
+   * their names, then by arrival) is started first to keep the live edge
+   * moving; with --max-queued, the oldest are dropped beyond max_queued_ */
+  unsigned int max_jobs_;  /* 0: no limit */
+  std::optional<size_t> max_queued_;
+  unsigned int running_ {0};
+  uint64_t num_arrived_ {0};
+  /* keyed by (timestamp, arrival number) */
+  std::map<std::pair<uint64_t, uint64_t>, std::string> queue_ {};
+
+  /* with --scheduler, the jobs granted to the inputs being processed */
+  std::unique_ptr<JobSchedulerClient> scheduler_ {};
+  std::unordered_map<std::string, uint64_t> jobs_ {};  /* key: prefix */
+
   /* helper functions */
   inline std::string get_src_path(const std::string & prefix);
   inline std::string get_dst_path(const std::string & prefix);
   inline std::string get_tmp_path(const std::string & prefix);
 
-  void run_as_child(const std::string & prefix);
+  /* queue filename to be processed, and start what can be started unless
+   * more is about to be queued */
+  void schedule(const std::string & filename, const bool start = true);
+  void start_queued();
+
+  void run_as_child(const std::string & filename);
+  void start(const std::vector<std::string> & args, const std::string & prefix,
+             const std::optional<int> & cpu);
+
+  void start_batch();
+  void run_in_batch(const std::vector<std::string> & args,
+                    const std::string & prefix);
+  void handle_batch_reply(const std::string & reply);
+
+  /* an input has been processed: move its output to dst_dir in check mode */
+  void finish(const std::string & prefix);
 };
 
 #endif /* NOTIFIER_HH */
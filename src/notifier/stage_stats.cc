@@ -0,0 +1,40 @@
+#include "stage_stats.hh"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "file_descriptor.hh"
+#include "exception.hh"
+#include "mmap.hh"
+
+using namespace std;
+
+StageStats::StageStats(const string & path, const bool reset)
+{
+  FileDescriptor fd(CheckSystemCall("open (" + path + ")",
+                    open(path.c_str(), O_RDWR | O_CREAT, 0644)));
+
+  /* the reader might map the file before the notifier has grown it */
+  if (fd.filesize() < sizeof(Counters)) {
+    CheckSystemCall("ftruncate", ftruncate(fd.fd_num(), sizeof(Counters)));
+  }
+
+  /* the mapping remains valid after fd is closed */
+  mapping_ = mmap_shared(nullptr, sizeof(Counters), PROT_READ | PROT_WRITE,
+                         MAP_SHARED, fd.fd_num(), 0);
+  counters_ = static_cast<Counters *>(mapping_.get());
+
+  if (reset) {
+    counters_->started = 0;
+    counters_->finished = 0;
+  }
+}
+
+StageStats::Counts StageStats::counts() const
+{
+  /* read finished first so that in_progress() does not underflow */
+  const uint64_t finished = counters_->finished;
+  const uint64_t started = counters_->started;
+
+  return {started, finished};
+}
@@ -0,0 +1,50 @@
+#ifndef STAGE_STATS_HH
+#define STAGE_STATS_HH
+
+#include <cstdint>
+#include <string>
+#include <memory>
+#include <atomic>
+
+/* Counters of the inputs of a pipeline stage run by a notifier, in a small
+ * file mapped by the notifier, which updates them, and by readers such as
+ * file_reporter, which read them in O(1) instead of listing the working
+ * directories. The notifier runs a child per input as soon as it appears,
+ * so the inputs of a stage are either in progress or finished. */
+class StageStats
+{
+public:
+  struct Counts {
+    uint64_t started {0};
+    uint64_t finished {0};
+
+    uint64_t in_progress() const { return started - finished; }
+  };
+
+  /* map the counters at path, creating them if needed; the notifier resets
+   * them when it starts */
+  StageStats(const std::string & path, const bool reset = false);
+
+  void add_started() { counters_->started++; }
+  void add_finished() { counters_->finished++; }
+
+  Counts counts() const;
+
+  /* forbid copying */
+  StageStats(const StageStats & other) = delete;
+  const StageStats & operator=(const StageStats & other) = delete;
+
+private:
+  struct Counters {
+    std::atomic<uint64_t> started;
+    std::atomic<uint64_t> finished;
+  };
+
+  static_assert(std::atomic<uint64_t>::is_always_lock_free,
+                "StageStats requires lock-free atomics in shared memory");
+
+  std::shared_ptr<void> mapping_ {};
+  Counters * counters_ {nullptr};
+};
+
+#endif /* STAGE_STATS_HH */
@@ -3,6 +3,11 @@
 #include <memory>
 #include <iostream>
 #include <vector>
+#include <array>
+#include <algorithm>
+#include <thread>
+#include <exception>
+#include <optional>
 #include <endian.h>
 
 #include <sndfile.hh>
@@ -13,6 +18,11 @@ extern "C" {
 }
 
 #include "media_formats.hh"
+#include "filesystem.hh"
+#include "tokenize.hh"
+#include "fragment_output.hh"
+#include "batch.hh"
+#include "webm_fragmenter.hh"
 
 const unsigned int SAMPLE_RATE = 48000; /* Hz */
 const unsigned int NUM_CHANNELS = 2;
@@ -91,6 +101,13 @@ the first two frames as independent (no prediction), and chop the
 first of them. In practice we use 10 extra overlapping frames because this seems
 to make all the audible glitches go away.
 
+The extra frames only serve to warm up a new encoder to the state it would be
+in had it encoded the previous chunk. In batch mode (--batch), the encoders
+live on from a chunk to the next, so a chunk that follows the previous one
+(by its timestamp) is encoded from frame EXTRA_FRAMES_PREPENDED on by the
+encoder that has just encoded the previous chunk, which is in that state
+already; the overlap is only encoded after a gap (or for the first chunk).
+
 */
 
 using namespace std;
@@ -210,7 +227,7 @@ public:
     }
   }
 
-  wav_frame_t view( const size_t offset )
+  wav_frame_t view( const size_t offset ) const
   {
     if ( offset > samples_.size() ) {
       throw out_of_range( "offset > samples_.size()" );
@@ -238,10 +255,11 @@ class AVFormatWrapper
   AVStream * audio_stream_;
 
   bool header_written_;
+  bool in_memory_;
 
   static int av_check( const int retval )
   {
-    static array<char, 256> errbuf;
+    array<char, 256> errbuf;
 
     if ( retval < 0 ) {
       if ( av_strerror( retval, errbuf.data(), errbuf.size() ) < 0 ) {
@@ -257,25 +275,32 @@ class AVFormatWrapper
   }
 
 public:
+  /* an empty output_filename writes the WebM into memory (see finish()) */
   AVFormatWrapper( const string & output_filename, const int bit_rate )
     : context_(),
       audio_stream_(),
-      header_written_( false )
+      header_written_( false ),
+      in_memory_( output_filename.empty() )
   {
     av_register_all();
 
-    if ( output_filename.substr( output_filename.size() - 5 ) != ".webm" ) {
+    if ( not in_memory_ and output_filename.substr( output_filename.size() - 5 ) != ".webm" ) {
       throw runtime_error( "output filename must be a .webm" );
     }
 
     {
       AVFormatContext * tmp_context;
-      av_check( avformat_alloc_output_context2( &tmp_context, nullptr, nullptr, output_filename.c_str() ) );
+      av_check( avformat_alloc_output_context2( &tmp_context, nullptr, "webm",
+                                                in_memory_ ? nullptr : output_filename.c_str() ) );
       context_.reset( tmp_context );
     }
 
-    /* open output file */
-    av_check( avio_open( &context_->pb, output_filename.c_str(), AVIO_FLAG_WRITE ) );
+    /* open output file (or buffer) */
+    if ( in_memory_ ) {
+      av_check( avio_open_dyn_buf( &context_->pb ) );
+    } else {
+      av_check( avio_open( &context_->pb, output_filename.c_str(), AVIO_FLAG_WRITE ) );
+    }
 
     /* allocate audio stream */
     audio_stream_ = notnull( "avformat_new_stream",
@@ -325,16 +350,36 @@ public:
     }
   }
 
-  ~AVFormatWrapper()
+  /* write the trailer, and return the WebM if written into memory */
+  string finish()
   {
-    try {
-      if ( header_written_ ) {
-        av_check( av_write_trailer( context_.get() ) );
-      }
+    if ( header_written_ ) {
+      header_written_ = false;
+      av_check( av_write_trailer( context_.get() ) );
+    }
 
-      if ( context_->pb ) {
+    string webm;
+
+    if ( context_->pb ) {
+      if ( in_memory_ ) {
+        uint8_t * buffer;
+        const int size = avio_close_dyn_buf( context_->pb, &buffer );
+        webm.assign( reinterpret_cast<char *>( buffer ), size );
+        av_free( buffer );
+      } else {
         av_check( avio_close( context_->pb ) );
       }
+
+      context_->pb = nullptr;
+    }
+
+    return webm;
+  }
+
+  ~AVFormatWrapper()
+  {
+    try {
+      finish();
     } catch ( const exception & e ) {
       cerr << "Exception in AVFormatWrapper destructor: " << e.what() << "\n";
     }
@@ -361,60 +406,276 @@ public:
   AVFormatWrapper & operator=( const AVFormatWrapper & other ) = delete;
 };
 
-void opus_encode( int argc, char *argv[] ) {
-  if ( argc != 5 ) {
-    throw runtime_error( "Usage: " + string( argv[ 0 ] ) + " WAV_INPUT WEBM_OUTPUT -b BIT_RATE [e.g., \"64k\"]" );
-  }
+/* the encoder of a rendition, which lives on from a chunk to the next */
+class ChunkEncoder
+{
+  int bit_rate_;
+  unique_ptr<OpusEncoderWrapper> encoder_ {};
 
-  /* parse arguments */
-  const string input_filename = argv[ 1 ];
-  const string output_filename = argv[ 2 ];
-  const string dash_b = argv[ 3 ];
+  /* the timestamp of the chunk that would follow the last one encoded */
+  optional<uint64_t> next_timestamp_ {};
 
-  if ( dash_b != "-b" ) {
-    throw runtime_error( "-b argument is mandatory" );
+public:
+  ChunkEncoder( const int bit_rate ) : bit_rate_( bit_rate ) {}
+
+  int bit_rate() const { return bit_rate_; }
+
+  /* encode the whole file, outputting every frame except the first, and
+     with prediction disabled until frame #2 and for the last frame; a chunk
+     that follows the last one (timestamp is 90 kHz) skips straight to
+     frame #2 */
+  void encode( const WavWrapper & wav_file, const optional<uint64_t> timestamp,
+               AVFormatWrapper & output )
+  {
+    const bool follows = timestamp and next_timestamp_ == *timestamp;
+
+    /* in case of an error, start over with the next chunk */
+    next_timestamp_.reset();
+
+    if ( not follows ) {
+      encoder_ = make_unique<OpusEncoderWrapper>( bit_rate_ );
+      encoder_->disable_prediction();
+    }
+
+    /* allocate memory for 20 ms of compressed Opus output */
+    auto opus_frame = make_unique<opus_frame_t>();
+
+    for ( unsigned int frame_no = follows ? EXTRA_FRAMES_PREPENDED : 0;
+          frame_no < NUM_FRAMES_IN_OUTPUT + EXTRA_FRAMES_PREPENDED; frame_no++ ) {
+      if ( frame_no == EXTRA_FRAMES_PREPENDED ) {
+        encoder_->enable_prediction();
+      }
+
+      if ( frame_no == NUM_FRAMES_IN_OUTPUT + EXTRA_FRAMES_PREPENDED - 1 ) {
+        encoder_->disable_prediction();
+      }
+
+      encoder_->encode( wav_file.view( frame_no * NUM_CHANNELS * NUM_SAMPLES_IN_OPUS_FRAME ), *opus_frame );
+
+      if ( frame_no >= EXTRA_FRAMES_PREPENDED ) {
+        output.write( *opus_frame, (frame_no - EXTRA_FRAMES_PREPENDED) * NUM_SAMPLES_IN_OPUS_FRAME );
+      }
+    }
+
+    if ( timestamp ) {
+      next_timestamp_ = *timestamp + uint64_t( NUM_SAMPLES_IN_OUTPUT ) * 90000 / SAMPLE_RATE;
+    }
   }
+};
 
-  const AudioFormat audio_format { argv[ 4 ] };
+int parse_bit_rate( const string & arg )
+{
+  const AudioFormat audio_format { arg };
 
   if ( audio_format.bitrate <= 0 or audio_format.bitrate > 256 ) {
-    throw runtime_error( "invalid bit rate: " + string( argv[ 4 ] ) );
+    throw runtime_error( "invalid bit rate: " + arg );
   }
 
-  const int bit_rate = audio_format.bitrate * 1000; /* bits per second */
+  return audio_format.bitrate * 1000; /* bits per second */
+}
 
-  /* open input WAV file */
-  WavWrapper wav_file { input_filename };
+/* a bit rate to encode at, written to OUTPUT (the first), or to tmp_dir and
+   then moved to dst_dir; with fragments, the output is the media segment,
+   and init_path the init segment */
+struct Rendition
+{
+  string dst_dir {};
+  string tmp_dir {};
+  string init_path {};
+};
 
-  /* create Opus encoder */
-  OpusEncoderWrapper encoder { bit_rate };
+struct Options
+{
+  bool fragments { false };
+  uint64_t pack_span { 0 };
+  vector<Rendition> renditions {};
+  vector<ChunkEncoder> encoders {};  /* of each rendition */
+};
+
+void print_usage( const string & program )
+{
+  cerr << "Usage: " << program << " WAV_INPUT OUTPUT -b BIT_RATE [e.g., \"64k\"] [options]\n"
+       << "       " << program << " --batch -b BIT_RATE [options]\n\n"
+       << "Encode WAV_INPUT as Opus into the WebM OUTPUT\n\n"
+       << "Options:\n"
+       << "--batch             encode the chunks given on stdin (see batch.hh) one\n"
+       << "                    after another, with the same Opus encoders, which only\n"
+       << "                    encode the overlap of a chunk after a gap\n"
+       << "-i INIT_PATH        write fragments rather than a WebM, as audio_fragmenter\n"
+       << "                    would: OUTPUT is the media segment, and the init segment\n"
+       << "                    replaces INIT_PATH if changed\n"
+       << "-p SPAN             with -i, append the media segment to the segment of SPAN\n"
+       << "                    in the directory of INIT_PATH (see audio_fragmenter -p)\n"
+       << "--rendition BIT_RATE:DST_DIR:TMP_DIR[:INIT_PATH]\n"
+       << "                    also encode at BIT_RATE from the same read of WAV_INPUT,\n"
+       << "                    in a thread of its own, written to TMP_DIR and then moved\n"
+       << "                    to DST_DIR; INIT_PATH is required with -i; may be repeated\n";
+}
 
-  /* allocate memory for 20 ms of compressed Opus output */
-  opus_frame_t opus_frame;
+/* parse the options of argv from first on */
+Options parse_options( const int argc, char *argv[], const int first )
+{
+  if ( ( argc - first ) % 2 != 0 ) {
+    print_usage( argv[ 0 ] );
+    throw runtime_error( "invalid arguments" );
+  }
 
-  /* create .webm output */
-  AVFormatWrapper output { output_filename, bit_rate };
+  optional<int> bit_rate;
+  string init_path;
+  Options options;
+  vector<string> extra_renditions;
+
+  for ( int i = first; i < argc; i += 2 ) {
+    const string option = argv[ i ];
+    const string value = argv[ i + 1 ];
+
+    if ( option == "-b" ) {
+      bit_rate = parse_bit_rate( value );
+    } else if ( option == "-i" ) {
+      init_path = value;
+    } else if ( option == "-p" ) {
+      options.pack_span = stoull( value );
+    } else if ( option == "--rendition" ) {
+      extra_renditions.push_back( value );
+    } else {
+      print_usage( argv[ 0 ] );
+      throw runtime_error( "invalid option: " + option );
+    }
+  }
 
-  /* encode the whole file, outputting every frame except the first,
-     and with prediction disabled until frame #2 */
+  if ( not bit_rate ) {
+    throw runtime_error( "-b argument is mandatory" );
+  }
 
-  encoder.disable_prediction();
+  options.fragments = not init_path.empty();
+  options.renditions.push_back( { "", "", init_path } );
+  options.encoders.emplace_back( *bit_rate );
 
-  for ( unsigned int frame_no = 0; frame_no < NUM_FRAMES_IN_OUTPUT + EXTRA_FRAMES_PREPENDED; frame_no++ ) {
-    if ( frame_no == EXTRA_FRAMES_PREPENDED ) {
-      encoder.enable_prediction();
+  for ( const auto & extra_rendition : extra_renditions ) {
+    const vector<string> extra = split( extra_rendition, ":" );
+    if ( extra.size() != ( options.fragments ? 4 : 3 ) ) {
+      throw runtime_error( "invalid rendition: " + extra_rendition );
     }
 
-    if ( frame_no == NUM_FRAMES_IN_OUTPUT + EXTRA_FRAMES_PREPENDED - 1 ) {
-      encoder.disable_prediction();
+    options.renditions.push_back( { extra[ 1 ], extra[ 2 ], options.fragments ? extra[ 3 ] : "" } );
+    options.encoders.emplace_back( parse_bit_rate( extra[ 0 ] ) );
+  }
+
+  return options;
+}
+
+/* encode the chunk input_filename in all the renditions of options */
+void encode_chunk( const string & input_filename, const string & output_filename,
+                   Options & options )
+{
+  const auto & renditions = options.renditions;
+  const bool fragments = options.fragments;
+
+  /* the notifier moves output_filename, and this process the others */
+  const string stem = fs::path( input_filename ).stem().string();
+  const string filename = stem + ( fragments ? ".chk" : ".webm" );
+
+  vector<string> output_paths { output_filename };
+  for ( size_t i = 1; i < renditions.size(); i++ ) {
+    output_paths.push_back( fs::path( renditions[ i ].tmp_dir ) / filename );
+  }
+
+  /* the timestamp of the chunk, if its name is one: for the Cluster of its
+     media segment, and to tell if it follows the previous chunk */
+  optional<uint64_t> timestamp;
+  if ( not stem.empty() and all_of( stem.begin(), stem.end(), ::isdigit ) ) {
+    timestamp = stoull( stem );
+  } else if ( fragments ) {
+    throw runtime_error( input_filename + ": not named after its timestamp" );
+  }
+
+  /* open input WAV file, read once for all the renditions */
+  const WavWrapper wav_file { input_filename };
+
+  /* create .webm outputs (here, as libavformat's setup is not thread-safe);
+     with fragments, the WebM is only written into memory */
+  vector<unique_ptr<AVFormatWrapper>> outputs;
+  for ( size_t i = 0; i < renditions.size(); i++ ) {
+    outputs.push_back( make_unique<AVFormatWrapper>( fragments ? "" : output_paths[ i ],
+                                                     options.encoders[ i ].bit_rate() ) );
+  }
+
+  /* encode (and fragment) a rendition */
+  auto encode = [&]( const size_t i ) {
+    options.encoders[ i ].encode( wav_file, timestamp, *outputs[ i ] );
+
+    if ( fragments ) {
+      const string webm = outputs[ i ]->finish();
+      const string tmp_init = tmp_init_path( output_paths[ i ], renditions[ i ].init_path );
+
+      try {
+        fragment_webm( webm, *timestamp, scan_layout( webm ), tmp_init, output_paths[ i ] );
+      } catch ( const exception & ) {
+        fs::remove( tmp_init );
+        throw;
+      }
+
+      finish_fragment( output_paths[ i ], renditions[ i ].init_path, options.pack_span );
     }
+  };
+
+  /* encode the renditions other than the first in threads of their own */
+  vector<exception_ptr> errors( renditions.size() );
+  vector<thread> threads;
+
+  for ( size_t i = 1; i < renditions.size(); i++ ) {
+    threads.emplace_back( [&, i] {
+      try {
+        encode( i );
+      } catch ( ... ) {
+        errors[ i ] = current_exception();
+      }
+    } );
+  }
 
-    encoder.encode( wav_file.view( frame_no * NUM_CHANNELS * NUM_SAMPLES_IN_OPUS_FRAME ), opus_frame );
+  try {
+    encode( 0 );
+  } catch ( ... ) {
+    errors[ 0 ] = current_exception();
+  }
 
-    if ( frame_no >= EXTRA_FRAMES_PREPENDED ) {
-      output.write( opus_frame, (frame_no - EXTRA_FRAMES_PREPENDED) * NUM_SAMPLES_IN_OPUS_FRAME );
+  for ( auto & t : threads ) {
+    t.join();
+  }
+
+  for ( const auto & error : errors ) {
+    if ( error ) {
+      rethrow_exception( error );
     }
   }
+
+  /* write the trailers */
+  outputs.clear();
+
+  for ( size_t i = 1; i < renditions.size(); i++ ) {
+    fs::rename( output_paths[ i ], fs::path( renditions[ i ].dst_dir ) / filename );
+  }
+}
+
+int opus_encode( int argc, char *argv[] ) {
+  /* the chunks are encoded in order, as each follows the previous one */
+  if ( argc >= 2 and string( argv[ 1 ] ) == "--batch" ) {
+    Options options = parse_options( argc, argv, 2 );
+
+    return run_batch( [&options]( const string & input_path, const string & output_path ) {
+                        encode_chunk( input_path, output_path, options );
+                      }, 1 );
+  }
+
+  if ( argc < 5 ) {
+    print_usage( argv[ 0 ] );
+    throw runtime_error( "invalid arguments" );
+  }
+
+  Options options = parse_options( argc, argv, 3 );
+  encode_chunk( argv[ 1 ], argv[ 2 ], options );
+
+  return EXIT_SUCCESS;
 }
 
 int main( int argc, char *argv[] )
@@ -424,11 +685,9 @@ int main( int argc, char *argv[] )
   }
 
   try {
-    opus_encode( argc, argv );
+    return opus_encode( argc, argv );
   } catch ( const exception & e ) {
     cerr << argv[ 0 ] << ": " << e.what() << "\n";
     return EXIT_FAILURE;
   }
-
-  return EXIT_SUCCESS;
 }
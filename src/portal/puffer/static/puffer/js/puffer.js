@@ -424,6 +424,14 @@ function WebSocketClient(session_key, username_in, settings_debug, port_in,
   /* exponential backoff to reconnect */
   var reconnect_backoff = BASE_RECONNECT_BACKOFF;
 
+  /* port that a server redirected to, as it is overloaded or does not serve
+   * the channel; followed at most MAX_REDIRECTS times in a row until a
+   * server accepts the client */
+  const MAX_REDIRECTS = 2;
+  var redirect_port = null;
+  var num_redirects = 0;
+
+  var requested_channel = null;  /* channel of the last client-init */
   var set_channel_ts = null;  /* timestamp (in ms) of setting a channel */
   var startup_delay_ms = null;
 
@@ -599,6 +607,20 @@ function WebSocketClient(session_key, username_in, settings_debug, port_in,
         ws.close();
         return;
       }
+
+      if (metadata.errorType === 'redirect') {
+        if (num_redirects >= MAX_REDIRECTS) {
+          set_fatal_error('Sorry, our servers are busy right now. ' +
+                          'Please try again later.');
+        } else {
+          /* reconnect to the other server once this connection is closed */
+          num_redirects += 1;
+          redirect_port = metadata.redirectPort;
+        }
+
+        ws.close();
+        return;
+      }
     }
 
     /* ignore outdated messages from the server */
@@ -625,6 +647,8 @@ function WebSocketClient(session_key, username_in, settings_debug, port_in,
         channel_error = true;
       }
     } else if (metadata.type === 'server-init') {
+      num_redirects = 0;
+
       /* return if client is able to resume */
       if (av_source && av_source.isOpen() && metadata.canResume) {
         console.log('Resuming playback');
@@ -691,6 +715,16 @@ function WebSocketClient(session_key, username_in, settings_debug, port_in,
         return;
       }
 
+      if (redirect_port) {
+        port = redirect_port;
+        redirect_port = null;
+        console.log('Redirected to port', port);
+
+        /* the redirect might answer a client-init of a new channel */
+        that.connect(requested_channel || channel);
+        return;
+      }
+
       if (reconnect_backoff < MAX_RECONNECT_BACKOFF) {
         /* Try to reconnect */
         console.log('Reconnecting in ' + reconnect_backoff + 'ms');
@@ -732,6 +766,7 @@ function WebSocketClient(session_key, username_in, settings_debug, port_in,
     channel_error = false;
 
     /* send client-init */
+    requested_channel = channel;
     that.send_client_init(channel);
 
     /* reset stats */
@@ -0,0 +1,102 @@
+#!/usr/bin/env python3
+
+# Export the actor network of a Pensieve model (a TensorFlow checkpoint of
+# the network in Pensieve's a3c.py) to the binary format read by the MLP
+# inference engine in src/abr/mlp.cc, for abr_config "actor_path".
+#
+# The actor applies a branch to each row of its state [S_INFO][S_LEN]: a
+# fully connected layer to the last value of rows 0, 1 and 5, and a 1-D
+# convolution to rows 2, 3 and 4 (the first A_DIM values of row 4). As a
+# row is passed as a single step of S_LEN channels, with "same" padding,
+# each convolution only applies one tap of its kernel, i.e., it is a fully
+# connected layer too. The branches are thus exported as a single layer
+# from the flattened state to their concatenated outputs, followed by the
+# two layers of the actor that merge them.
+
+import sys
+import struct
+import argparse
+
+import numpy as np
+import tensorflow as tf
+
+S_INFO = 6
+
+
+def write_mlp(weights_and_biases, mlp_path):
+    # as in export_ttp_mlp.py, which needs torch
+    with open(mlp_path, 'wb') as fh:
+        fh.write(b'MLP1')
+        fh.write(struct.pack('<I', len(weights_and_biases)))
+
+        for weight, bias in weights_and_biases:
+            weight = np.asarray(weight, dtype='<f4')
+            bias = np.asarray(bias, dtype='<f4')
+            fh.write(struct.pack('<II', weight.shape[0], weight.shape[1]))
+            fh.write(weight.tobytes(order='C'))
+            fh.write(bias.tobytes())
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('checkpoint', help='checkpoint of the model (nn_path)')
+    parser.add_argument('output', help='path of the exported actor')
+    parser.add_argument('--scope', default='actor',
+                        help='variable scope of the actor (default actor)')
+    args = parser.parse_args()
+
+    reader = tf.train.load_checkpoint(args.checkpoint)
+
+    def var(name):
+        return reader.get_tensor('{}/{}'.format(args.scope, name))
+
+    # tflearn names the layers of each type in the order of creation
+    fc_rows = {0: 'FullyConnected', 1: 'FullyConnected_1',
+               5: 'FullyConnected_2'}
+    conv_rows = {2: 'Conv1D', 3: 'Conv1D_1', 4: 'Conv1D_2'}
+
+    # a convolution of 'same' padding over a single step applies the tap
+    # that is aligned with it, after (kernel - 1) // 2 taps of padding
+    def conv_tap(name):
+        w = var(name + '/W')
+        kernel, num_filters = w.shape[0], w.shape[-1]
+        return w.reshape(kernel, -1, num_filters)[(kernel - 1) // 2]
+
+    s_len = conv_tap(conv_rows[2]).shape[0]
+    branches = []
+    for row in range(S_INFO):
+        if row in fc_rows:
+            w = var(fc_rows[row] + '/W')  # [1][outputs]
+            b = var(fc_rows[row] + '/b')
+            w_row = np.zeros((s_len, w.shape[1]))
+            w_row[-1] = w[0]
+        else:
+            w = conv_tap(conv_rows[row])  # [channels][outputs]
+            b = var(conv_rows[row] + '/b')
+            w_row = np.zeros((s_len, w.shape[1]))
+            w_row[:w.shape[0]] = w
+        branches.append((row, w_row, b))
+
+    # the branches in the order they are merged, from the flattened state
+    num_outputs = sum(b.shape[0] for _, _, b in branches)
+    merged_w = np.zeros((num_outputs, S_INFO * s_len))
+    merged_b = np.zeros(num_outputs)
+    out = 0
+    for row, w_row, b in branches:
+        merged_w[out:out + b.shape[0], row * s_len:(row + 1) * s_len] = \
+            w_row.T
+        merged_b[out:out + b.shape[0]] = b
+        out += b.shape[0]
+
+    layers = [(merged_w, merged_b)]
+    for name in ['FullyConnected_3', 'FullyConnected_4']:
+        layers.append((var(name + '/W').T, var(name + '/b')))
+
+    write_mlp(layers, args.output)
+    sys.stderr.write('Exported the actor of {} ({} formats, S_LEN = {}) to '
+                     '{}\n'.format(args.checkpoint, layers[-1][1].shape[0],
+                                   s_len, args.output))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,57 @@
+#!/usr/bin/env python3
+
+# Export the TTP models saved for C++ (cpp-<i>.pt) to the binary format read
+# by the MLP inference engine in src/abr/mlp.cc (cpp-mlp-<i>.bin).
+
+import sys
+import struct
+import argparse
+from os import path
+
+import numpy as np
+import torch
+
+
+def write_mlp(weights_and_biases, mlp_path):
+    # weights_and_biases: a list of (weight [out, in], bias [out]) per layer
+    with open(mlp_path, 'wb') as fh:
+        fh.write(b'MLP1')
+        fh.write(struct.pack('<I', len(weights_and_biases)))
+
+        for weight, bias in weights_and_biases:
+            weight = np.asarray(weight, dtype='<f4')
+            bias = np.asarray(bias, dtype='<f4')
+            fh.write(struct.pack('<II', weight.shape[0], weight.shape[1]))
+            fh.write(weight.tobytes(order='C'))
+            fh.write(bias.tobytes())
+
+
+def module_layers(module):
+    # the fully connected layers of a (traced) torch.nn.Sequential, in order
+    params = [p.detach().cpu().numpy() for p in module.parameters()]
+    if len(params) % 2 != 0:
+        sys.exit('Error: expected a weight and a bias per layer')
+
+    return list(zip(params[0::2], params[1::2]))
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('model_dir',
+                        help='directory containing cpp-<i>.pt')
+    parser.add_argument('--horizon', type=int, default=5,
+                        help='number of models (default 5)')
+    args = parser.parse_args()
+
+    for i in range(args.horizon):
+        model_path = path.join(args.model_dir, 'cpp-{}.pt'.format(i))
+        if not path.isfile(model_path):
+            sys.exit('Error: C++ model {} does not exist'.format(model_path))
+
+        mlp_path = path.join(args.model_dir, 'cpp-mlp-{}.bin'.format(i))
+        write_mlp(module_layers(torch.jit.load(model_path)), mlp_path)
+        sys.stderr.write('Exported {} to {}\n'.format(model_path, mlp_path))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,454 @@
+#!/usr/bin/env python3
+
+# Replay a recorded TS capture (e.g., from puffer-test-vectors) through the
+# decoder and the encoding pipeline of a channel, faster than real time, and
+# report the CPU time of each stage per second of media, the latency from TS
+# arrival to chunks in ready/, and the bytes written to disk.
+
+import os
+import sys
+import time
+import yaml
+import socket
+import signal
+import shutil
+import argparse
+import tempfile
+import subprocess
+from os import path
+
+
+TS_PACKET_SIZE = 188
+TIMESCALE = 90000  # of the PCR base and of the chunk timestamps
+PCR_WRAP = 1 << 33
+
+CLK_TCK = os.sysconf('SC_CLK_TCK')
+
+
+def read_pcr(packet):
+    # the PCR base in the adaptation field of a TS packet, if any
+    if packet[0] != 0x47 or not packet[3] & 0x20:
+        return None
+
+    if packet[4] < 7 or not packet[5] & 0x10:
+        return None
+
+    return ((packet[6] << 25) | (packet[7] << 17) | (packet[8] << 9) |
+            (packet[9] << 1) | (packet[10] >> 7))
+
+
+def ts_blocks(ts_path):
+    # yield the packets of the capture in blocks that end with a PCR (of the
+    # first PID that carries one), along with that PCR unwrapped
+    pcr_pid = None
+    last_pcr = None
+    offset = 0
+    block = bytearray()
+
+    with open(ts_path, 'rb') as fh:
+        while True:
+            data = fh.read(TS_PACKET_SIZE * 4096)
+            if not data:
+                break
+
+            for i in range(0, len(data) - TS_PACKET_SIZE + 1, TS_PACKET_SIZE):
+                packet = data[i:i + TS_PACKET_SIZE]
+                block += packet
+
+                pid = ((packet[1] & 0x1F) << 8) | packet[2]
+                pcr = read_pcr(packet)
+                if pcr is None or (pcr_pid is not None and pid != pcr_pid):
+                    continue
+
+                pcr_pid = pid
+                if last_pcr is not None and pcr < last_pcr - PCR_WRAP // 2:
+                    offset += PCR_WRAP
+                last_pcr = pcr
+
+                yield pcr + offset, bytes(block)
+                block.clear()
+
+    if pcr_pid is None:
+        sys.exit('No PCR in ' + ts_path)
+
+    if block:
+        yield None, bytes(block)
+
+
+def feed(conn, ts_path, speed):
+    # send the capture, paced by its PCRs at speed times real time; return
+    # the seconds of media that were sent
+    first_pcr = None
+    last_pcr = None
+    start = time.time()
+
+    for pcr, block in ts_blocks(ts_path):
+        conn.sendall(block)
+
+        if pcr is None:
+            break
+
+        if first_pcr is None:
+            first_pcr = pcr
+        last_pcr = pcr
+
+        delay = start + (pcr - first_pcr) / TIMESCALE / speed - time.time()
+        if delay > 0:
+            time.sleep(delay)
+
+    return (last_pcr - first_pcr) / TIMESCALE
+
+
+def make_config(args, media_dir, port):
+    # the configuration of run_pipeline for the channel alone, with its
+    # decoder reading from the port that the capture is fed to
+    with open(args.yaml_settings, 'r') as fh:
+        config = yaml.safe_load(fh)
+
+    channel_config = config['channel_configs'][args.channel]
+    channel_config.pop('multiplex', None)
+
+    decoder_args = []
+    tokens = channel_config['decoder_args'].split()
+    i = 0
+    while i < len(tokens):
+        if tokens[i] == '--tcp':
+            i += 2
+            continue
+        if tokens[i] != '--resume':
+            decoder_args.append(tokens[i])
+        i += 1
+
+    decoder_args += ['--tcp', '127.0.0.1:{}'.format(port)]
+    channel_config['decoder_args'] = ' '.join(decoder_args)
+
+    config['media_dir'] = media_dir
+    config['channels'] = [args.channel]
+    config['channel_configs'] = {args.channel: channel_config}
+    config['enable_logging'] = False
+    config.pop('remote_media_server', None)
+
+    config_path = path.join(media_dir, 'pipeline_bench.yml')
+    with open(config_path, 'w') as fh:
+        yaml.safe_dump(config, fh)
+
+    return config_path
+
+
+class ChunkWatcher:
+    # the time (in ms) at which each chunk was first seen in the raw
+    # directories and in all the ready directories of its kind
+
+    def __init__(self, channel_dir):
+        self.channel_dir = channel_dir
+        self.raw_info = {}  # video timestamp -> (written ms, filler fields)
+        self.raw_audio = set()
+        self.video_ready = {}
+        self.audio_ready = {}
+        self.seen = {}  # dir -> {timestamp: ms}
+
+    def ready_dirs(self):
+        # a fragment appended to a segment is marked in working/ instead
+        ready = path.join(self.channel_dir, 'ready')
+        working = path.join(self.channel_dir, 'working')
+
+        video, audio = [], []
+        for d in os.listdir(ready) if path.isdir(ready) else []:
+            if not path.isdir(path.join(ready, d)):
+                continue
+            (audio if d.endswith('k') else video).append(path.join(ready, d))
+
+        for d in os.listdir(working) if path.isdir(working) else []:
+            if d.endswith('-m4s'):
+                video.append(path.join(working, d))
+            elif d.endswith('-chk'):
+                audio.append(path.join(working, d))
+
+        # ready/<format> only has segments (.pack) when there are marks
+        video = [d for d in video if not self.packed(d)]
+        audio = [d for d in audio if not self.packed(d)]
+
+        return video, audio
+
+    def packed(self, d):
+        return path.isdir(path.join(self.channel_dir, 'working',
+                                    path.basename(d) + '-m4s')) or \
+               path.isdir(path.join(self.channel_dir, 'working',
+                                    path.basename(d) + '-chk'))
+
+    def scan_raw(self):
+        audio_dir = path.join(self.channel_dir, 'working', 'audio-raw')
+        for f in os.listdir(audio_dir) if path.isdir(audio_dir) else []:
+            if f.endswith('.wav'):
+                self.raw_audio.add(int(f.split('.')[0]))
+
+        raw_dir = path.join(self.channel_dir, 'working', 'video-raw')
+        for f in os.listdir(raw_dir) if path.isdir(raw_dir) else []:
+            if not f.endswith('.y4m.info'):
+                continue
+
+            ts = int(f.split('.')[0])
+            if ts in self.raw_info:
+                continue
+
+            try:
+                with open(path.join(raw_dir, f)) as fh:
+                    fields = fh.read().split()
+            except FileNotFoundError:
+                continue
+
+            if len(fields) >= 4:
+                self.raw_info[ts] = (int(fields[0]), int(fields[3]))
+
+    def scan(self):
+        now_ms = time.time() * 1000
+        self.scan_raw()
+
+        video_dirs, audio_dirs = self.ready_dirs()
+        for dirs, ready in [(video_dirs, self.video_ready),
+                            (audio_dirs, self.audio_ready)]:
+            timestamps = None
+
+            for d in dirs:
+                seen = self.seen.setdefault(d, {})
+                for f in os.listdir(d):
+                    name = f.split('.')[0]
+                    if name.isdigit():
+                        seen.setdefault(int(name), now_ms)
+
+                timestamps = set(seen) if timestamps is None \
+                             else timestamps & seen.keys()
+
+            for ts in timestamps or []:
+                if ts not in ready:
+                    ready[ts] = max(self.seen[d][ts] for d in dirs)
+
+    def done(self, fed):
+        # all the video chunks fed are ready, and the audio chunks up to them
+        # (the raw audio of a ready chunk may be cleaned before it is seen)
+        if not fed or any(ts not in self.video_ready for ts in fed):
+            return False
+
+        audio = self.raw_audio | set(self.audio_ready)
+        return all(ts in self.audio_ready for ts in audio if ts <= max(fed))
+
+
+def process_tree(root_pid):
+    # map each pid in the tree under root_pid (inclusive) to its parent
+    parents = {}
+    for pid in os.listdir('/proc'):
+        if not pid.isdigit():
+            continue
+        try:
+            with open('/proc/{}/stat'.format(pid)) as fh:
+                stat = fh.read()
+        except OSError:
+            continue
+        parents[int(pid)] = int(stat[stat.rindex(')') + 2:].split()[1])
+
+    tree = {root_pid}
+    grew = True
+    while grew:
+        grew = False
+        for pid, ppid in parents.items():
+            if ppid in tree and pid not in tree:
+                tree.add(pid)
+                grew = True
+
+    return {pid: parents.get(pid) for pid in tree}
+
+
+def stage_name(pid):
+    # a notifier is named by its --stats file, other processes by program
+    with open('/proc/{}/cmdline'.format(pid), 'rb') as fh:
+        args = fh.read().decode().split('\0')
+
+    if '--stats' in args:
+        stats = args[args.index('--stats') + 1]
+        return path.splitext(path.basename(stats))[0]
+
+    return path.basename(args[0])
+
+
+def usage(pid):
+    # the CPU seconds and bytes written by pid and its reaped descendants
+    with open('/proc/{}/stat'.format(pid)) as fh:
+        stat = fh.read()
+    fields = stat[stat.rindex(')') + 2:].split()
+    cpu = sum(int(x) for x in fields[11:15]) / CLK_TCK
+
+    io = {}
+    with open('/proc/{}/io'.format(pid)) as fh:
+        for line in fh:
+            key, value = line.split(':')
+            io[key] = int(value)
+
+    return cpu, io['write_bytes'], io['cancelled_write_bytes']
+
+
+def stage_usage(pipeline_pid):
+    # attribute each process to the child of run_pipeline that it descends
+    # from, i.e., to a stage (notifier), the decoder or a cleaner
+    tree = process_tree(pipeline_pid)
+    stages = {}
+
+    for pid in tree:
+        top = pid
+        while tree.get(top) in tree and tree[top] != pipeline_pid:
+            top = tree[top]
+
+        try:
+            name = 'run_pipeline' if pid == pipeline_pid else stage_name(top)
+            cpu, written, cancelled = usage(pid)
+        except (OSError, ValueError):
+            continue  # exited in the meantime
+
+        total = stages.setdefault(name, [0.0, 0, 0])
+        total[0] += cpu
+        total[1] += written
+        total[2] += cancelled
+
+    return stages
+
+
+def percentile(values, q):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * q / 100))]
+
+
+def latencies(ready, arrival):
+    return [(ready[ts] - arrival(ts)) / 1000 for ts in ready
+            if arrival(ts) is not None]
+
+
+def print_latencies(name, values):
+    if not values:
+        print('{:<28} no chunks'.format(name))
+        return
+
+    print('{:<28} {:>6} chunks  p50 {:7.2f} s  p90 {:7.2f} s  max {:7.2f} s'
+          .format(name, len(values), percentile(values, 50),
+                  percentile(values, 90), max(values)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('yaml_settings', help='run_pipeline configuration')
+    parser.add_argument('channel', help='channel whose config to replay with')
+    parser.add_argument('ts', help='recorded TS capture')
+    parser.add_argument('--speed', type=float, default=2.0,
+                        help='times real time to feed the capture at '
+                        '(default 2)')
+    parser.add_argument('--port', type=int, default=0,
+                        help='port for the decoder to read from (default any)')
+    parser.add_argument('--media-dir',
+                        help='directory to run in (default a temporary one, '
+                        'removed afterwards)')
+    parser.add_argument('--drain-timeout', type=float, default=120,
+                        help='seconds to wait for the last chunks to be ready '
+                        'after the capture is sent (default 120)')
+    parser.add_argument('--run-pipeline', default=path.join(
+                        path.dirname(path.abspath(__file__)),
+                        '..', 'wrappers', 'run_pipeline'),
+                        help='path to run_pipeline')
+    args = parser.parse_args()
+
+    media_dir = args.media_dir or tempfile.mkdtemp(prefix='pipeline_bench_')
+    os.makedirs(media_dir, exist_ok=True)
+    channel_dir = path.join(media_dir, args.channel)
+
+    listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    listener.bind(('127.0.0.1', args.port))
+    listener.listen(1)
+
+    config_path = make_config(args, media_dir,
+                              listener.getsockname()[1])
+
+    # run in a session of its own, to kill all of the pipeline at the end
+    pipeline = subprocess.Popen([args.run_pipeline, config_path],
+                                start_new_session=True)
+    watcher = ChunkWatcher(channel_dir)
+
+    try:
+        listener.settimeout(30)
+        conn, _ = listener.accept()
+        sys.stderr.write('Decoder connected, feeding {} at {}x\n'
+                         .format(args.ts, args.speed))
+
+        start = time.time()
+        media_s = feed(conn, args.ts, args.speed)
+        feed_end_ms = time.time() * 1000
+        sys.stderr.write('Fed {:.1f} s of media in {:.1f} s\n'
+                         .format(media_s, time.time() - start))
+
+        # the chunks of the capture are those written while feeding, and
+        # after it without filler (which the decoder writes when starved)
+        deadline = time.time() + args.drain_timeout
+        while time.time() < deadline:
+            watcher.scan()
+            fed = [ts for ts, (written_ms, filler) in watcher.raw_info.items()
+                   if written_ms <= feed_end_ms or filler == 0]
+            if watcher.done(fed):
+                break
+            time.sleep(0.05)
+        else:
+            sys.stderr.write('Timed out waiting for the last chunks\n')
+
+        stages = stage_usage(pipeline.pid)
+        conn.close()
+    finally:
+        if pipeline.poll() is None:
+            os.killpg(pipeline.pid, signal.SIGKILL)
+        pipeline.wait()
+        listener.close()
+
+    # a chunk arrives when the TS of its last frame does: the first chunk
+    # when the decoder wrote it, and the others media time later
+    fed = sorted(ts for ts, (written_ms, filler) in watcher.raw_info.items()
+                 if written_ms <= feed_end_ms or filler == 0)
+    if not fed:
+        sys.exit('The decoder wrote no chunks')
+
+    first_ts = fed[0]
+    first_ms = watcher.raw_info[first_ts][0]
+    last_ts = fed[-1]
+
+    def arrival(ts):
+        if ts < first_ts or ts > last_ts:
+            return None
+        return first_ms + (ts - first_ts) / TIMESCALE / args.speed * 1000
+
+    print('media: {:.1f} s at {}x real time'.format(media_s, args.speed))
+    print()
+    print('{:<28} {:>10} {:>12} {:>14}'.format(
+          'stage', 'CPU s', 'CPU s/media s', 'disk MB'))
+
+    total_cpu = total_written = total_cancelled = 0
+    for name, (cpu, written, cancelled) in sorted(stages.items()):
+        print('{:<28} {:>10.1f} {:>12.3f} {:>14.1f}'.format(
+              name, cpu, cpu / media_s, written / 1e6))
+        total_cpu += cpu
+        total_written += written
+        total_cancelled += cancelled
+
+    print('{:<28} {:>10.1f} {:>12.3f} {:>14.1f}'.format(
+          'total', total_cpu, total_cpu / media_s, total_written / 1e6))
+    print('(of which {:.1f} MB were deleted before reaching the disk)'
+          .format(total_cancelled / 1e6))
+    print()
+
+    print('latency from TS arrival:')
+    print_latencies('  raw video (decoder)', latencies(
+        {ts: watcher.raw_info[ts][0] for ts in fed}, arrival))
+    print_latencies('  video in ready/', latencies(watcher.video_ready,
+                                                  arrival))
+    print_latencies('  audio in ready/', latencies(watcher.audio_ready,
+                                                  arrival))
+
+    if not args.media_dir:
+        shutil.rmtree(media_dir)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,183 @@
+#!/usr/bin/env python3
+
+# Run the synthetic viewers of load_generator against ws_media_server, once
+# per experiment (ABR and congestion control fingerprint) and bandwidth
+# trace, each on a fresh server, and report the SSIM, rebuffering and
+# startup delay of the viewers along with the CPU time of the server per
+# viewer. The settings are those of ws_media_server, including the database
+# that authenticates the session key of the viewers.
+
+import os
+import re
+import sys
+import json
+import time
+import yaml
+import socket
+import argparse
+import tempfile
+import subprocess
+from os import path
+
+
+SRC_DIR = path.join(path.dirname(path.abspath(__file__)), '..')
+CLK_TCK = os.sysconf('SC_CLK_TCK')
+
+
+def server_cpu_s(pid):
+    # CPU seconds of all the threads of pid so far
+    with open('/proc/{}/stat'.format(pid)) as fh:
+        stat = fh.read()
+    fields = stat[stat.rindex(')') + 2:].split()
+    return (int(fields[11]) + int(fields[12])) / CLK_TCK
+
+
+def wait_for_port(port, proc, timeout=30):
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        if proc.poll() is not None:
+            sys.exit('ws_media_server exited with {}'.format(proc.returncode))
+        try:
+            socket.create_connection(('127.0.0.1', port), timeout=1).close()
+            return
+        except OSError:
+            time.sleep(0.2)
+
+    sys.exit('ws_media_server did not listen on port {}'.format(port))
+
+
+def parse_total(output):
+    # the key=value pairs of the "total:" report of load_generator
+    for line in output.splitlines():
+        if line.startswith('total: t='):
+            return dict(re.findall(r'(\S+)=(\S+)', line))
+
+    sys.exit('load_generator reported no totals:\n' + output)
+
+
+def run_one(args, settings, expt, trace, tmp_dir):
+    # the server runs the experiment alone, as server 1
+    config = dict(settings)
+    config['experiments'] = [dict(expt, num_servers=1)]
+    config['enable_logging'] = False
+
+    config_path = path.join(tmp_dir, 'qoe_bench.yml')
+    with open(config_path, 'w') as fh:
+        yaml.safe_dump(config, fh)
+
+    port = config['ws_base_port'] + 1
+    server = subprocess.Popen([args.ws_media_server, config_path, '1'],
+                              stdout=subprocess.DEVNULL,
+                              stderr=subprocess.DEVNULL)
+
+    try:
+        wait_for_port(port, server)
+
+        lg_args = ['-n', str(args.viewers), '-r', str(args.ramp),
+                   '-k', args.session_key, '-d', str(args.duration),
+                   '-i', str(args.duration)]
+        for channel in args.channel:
+            lg_args += ['-c', channel]
+        if args.binary:
+            lg_args.append('-b')
+
+        if args.mm_link:
+            # all the viewers share a link of the trace in both directions
+            cmd = ['mm-link', trace, trace, '--', 'sh', '-c',
+                   '"$0" "$@" "$MAHIMAHI_BASE" {}'.format(port),
+                   args.load_generator] + lg_args
+        else:
+            # each viewer is limited to the trace on its own
+            cmd = [args.load_generator, '-t', trace] + lg_args + \
+                  ['127.0.0.1', str(port)]
+
+        cpu_before = server_cpu_s(server.pid)
+        output = subprocess.check_output(cmd, universal_newlines=True)
+        cpu_s = server_cpu_s(server.pid) - cpu_before
+    finally:
+        server.terminate()
+        server.wait()
+
+    total = parse_total(output)
+    fingerprint = expt['fingerprint']
+
+    return {
+        'abr': fingerprint['abr'],
+        'cc': fingerprint['cc'],
+        'trace': path.basename(trace),
+        'viewers': args.viewers,
+        'ssim_db': float(total['ssim_db']),
+        'rebuffer_ratio': float(total['rebuffer_ratio'].rstrip('%')),
+        'startup_ms_p50': float(total['startup_ms(p50/p95)'].split('/')[0]),
+        'throughput_mbps': float(total['throughput'].rstrip('Mbps')),
+        'server_cpu_s': cpu_s,
+        # server CPU per second of a viewer watching
+        'server_cpu_ms_per_viewer_s':
+            cpu_s * 1000 / (args.viewers * args.duration),
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('yaml_settings', help='ws_media_server settings')
+    parser.add_argument('--expt', type=int, action='append',
+                        help='index of an experiment in the settings to run '
+                        '(repeatable; default all)')
+    parser.add_argument('--trace', action='append', required=True,
+                        help='mahimahi bandwidth trace, e.g., FCC, 3G or '
+                        'cable (repeatable)')
+    parser.add_argument('-c', '--channel', action='append', required=True,
+                        help='channel to watch (repeatable)')
+    parser.add_argument('-k', '--session-key', required=True,
+                        help='session key of the viewers')
+    parser.add_argument('-n', '--viewers', type=int, default=50,
+                        help='number of viewers (default 50)')
+    parser.add_argument('-r', '--ramp', type=int, default=50,
+                        help='viewers to connect per second (default 50)')
+    parser.add_argument('-d', '--duration', type=int, default=120,
+                        help='seconds to watch per run (default 120)')
+    parser.add_argument('-b', '--binary', action='store_true',
+                        help='ask for the binary encoding of the messages')
+    parser.add_argument('--mm-link', action='store_true',
+                        help='share an mm-link shell of the trace among all '
+                        'the viewers, rather than limit each to the trace')
+    parser.add_argument('--json', help='also write the results to this file')
+    parser.add_argument('--ws-media-server', default=path.join(
+                        SRC_DIR, 'media-server', 'ws_media_server'))
+    parser.add_argument('--load-generator', default=path.join(
+                        SRC_DIR, 'media-server', 'load_generator'))
+    args = parser.parse_args()
+
+    with open(args.yaml_settings, 'r') as fh:
+        settings = yaml.safe_load(fh)
+
+    experiments = settings['experiments']
+    indices = args.expt if args.expt else range(len(experiments))
+
+    results = []
+    columns = '{:<16} {:<8} {:<20} {:>8} {:>10} {:>11} {:>11} {:>16}'
+    print(columns.format('abr', 'cc', 'trace', 'ssim_db', 'rebuffer%',
+                         'startup_ms', 'Mbps', 'cpu_ms/viewer_s'))
+
+    with tempfile.TemporaryDirectory(prefix='qoe_bench_') as tmp_dir:
+        for i in indices:
+            for trace in args.trace:
+                r = run_one(args, settings, experiments[i],
+                            path.abspath(trace), tmp_dir)
+                results.append(r)
+
+                print(columns.format(
+                    r['abr'], r['cc'], r['trace'], '{:.2f}'.format(r['ssim_db']),
+                    '{:.2f}'.format(r['rebuffer_ratio']),
+                    '{:.0f}'.format(r['startup_ms_p50']),
+                    '{:.1f}'.format(r['throughput_mbps']),
+                    '{:.3f}'.format(r['server_cpu_ms_per_viewer_s'])),
+                    flush=True)
+
+    if args.json:
+        with open(args.json, 'w') as fh:
+            json.dump(results, fh, indent=2)
+
+
+if __name__ == '__main__':
+    main()
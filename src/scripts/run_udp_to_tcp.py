@@ -24,16 +24,14 @@ def main():
     src_dir = path.dirname(path.dirname(path.abspath(__file__)))
     udp_to_tcp_path = path.join(src_dir, 'forwarder', 'udp_to_tcp')
 
-    procs = []
-
+    # a single udp_to_tcp forwards all the channels
+    cmd = [udp_to_tcp_path]
     for channel in args.channel:
         config = channel_configs[channel]
-        cmd = [udp_to_tcp_path, str(config[0]), str(config[1])]
-        print(' '.join(cmd))
-        procs.append(Popen(cmd))
+        cmd += [str(config[0]), str(config[1])]
 
-    for proc in procs:
-        proc.communicate()
+    print(' '.join(cmd))
+    Popen(cmd).communicate()
 
 
 if __name__ == '__main__':
@@ -19,6 +19,7 @@ from helpers import (
     connect_to_influxdb, connect_to_postgres,
     make_sure_path_exists, retrieve_expt_config, create_time_clause,
     get_expt_id, get_user)
+from export_ttp_mlp import write_mlp, module_layers
 
 
 VIDEO_DURATION = 180180
@@ -204,12 +205,15 @@ class Model:
             'obs_std': self.obs_std,
         }, model_path)
 
-    def save_cpp_model(self, model_path, meta_path):
+    def save_cpp_model(self, model_path, meta_path, mlp_path):
         # save model to model_path
         example = torch.rand(1, Model.DIM_IN).double()
         traced_script_module = torch.jit.trace(self.model, example)
         traced_script_module.save(model_path)
 
+        # save the weights read by ws_media_server to mlp_path
+        write_mlp(module_layers(self.model), mlp_path)
+
         # save obs_size, obs_mean, obs_std to meta_path
         meta = {'obs_size': self.obs_size,
                 'obs_mean': self.obs_mean.tolist(),
@@ -293,6 +297,16 @@ def check_args(args):
         global NUM_EPOCHS
         NUM_EPOCHS = 300
 
+    # data made by ttp_extractor from the logs
+    if args.data_dir:
+        if args.cl or args.time_start or args.time_end or args.cc:
+            sys.exit('Error: --data-dir conflicts with --cl, --from, --to and '
+                     '--cc; pass them to ttp_extractor instead')
+
+        if not path.isfile(path.join(args.data_dir, 'meta.json')):
+            sys.exit('Error: {} is not an output of ttp_extractor'
+                     .format(args.data_dir))
+
 
 def calculate_trans_times(video_sent_results, video_acked_results,
                           cc, postgres_cursor):
@@ -471,6 +485,32 @@ def prepare_input_output(d):
     return ret
 
 
+# load the rows written by ttp_extractor (src/media-server/ttp_extractor.cc)
+def load_extracted_data(data_dir):
+    with open(path.join(data_dir, 'meta.json')) as fh:
+        meta = json.load(fh)
+
+    if meta['dim_in'] != Model.DIM_IN:
+        sys.exit('Error: {} has rows of {} inputs rather than {}'
+                 .format(data_dir, meta['dim_in'], Model.DIM_IN))
+
+    ret = []
+    for i in range(Model.FUTURE_CHUNKS):
+        num_rows = meta['rows'][i]
+
+        raw_in = np.memmap(path.join(data_dir, 'in-{}.f32'.format(i)),
+                           dtype='<f4', mode='r',
+                           shape=(num_rows, Model.DIM_IN))
+        raw_out = np.memmap(path.join(data_dir, 'out-{}.f32'.format(i)),
+                            dtype='<f4', mode='r', shape=(num_rows,))
+
+        # the models are trained in double precision
+        ret.append({'in': raw_in.astype(np.float64),
+                    'out': raw_out.astype(np.float64)})
+
+    return ret
+
+
 def cl_sample(args, time_start, time_end, max_size, ret):
     raw_data = prepare_raw_data(args.yaml_settings,
                                 time_start, time_end, args.cc)
@@ -649,9 +689,11 @@ def train(i, args, model, input_data, output_data):
                                    'cpp-{}{}.pt'.format(i, suffix))
             meta_path = path.join(args.save_model,
                                   'cpp-meta-{}{}.json'.format(i, suffix))
-            model.save_cpp_model(model_path, meta_path)
-            sys.stderr.write('[{}] Saved model for C++ to {} and {}\n'
-                             .format(i, model_path, meta_path))
+            mlp_path = path.join(args.save_model,
+                                 'cpp-mlp-{}{}.bin'.format(i, suffix))
+            model.save_cpp_model(model_path, meta_path, mlp_path)
+            sys.stderr.write('[{}] Saved model for C++ to {}, {} and {}\n'
+                             .format(i, model_path, meta_path, mlp_path))
 
             # plot losses
             losses = {}
@@ -719,12 +761,16 @@ def main():
     parser.add_argument('--tune', action='store_true')
     parser.add_argument('--inference', action='store_true')
     parser.add_argument('--cl', action='store_true', help='continual learning')
+    parser.add_argument('--data-dir',
+        help='train on the output of ttp_extractor rather than InfluxDB')
     args = parser.parse_args()
 
     # validate and process args
     check_args(args)
 
-    if not args.cl:
+    if args.data_dir:
+        raw_in_out = load_extracted_data(args.data_dir)
+    elif not args.cl:
         # query InfluxDB and retrieve raw data
         raw_data = prepare_raw_data(args.yaml_settings,
                                     args.time_start, args.time_end, args.cc)
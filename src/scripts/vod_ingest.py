@@ -0,0 +1,408 @@
+#!/usr/bin/env python3
+
+# Ingest a title (a media file) into a channel that is not live, with its
+# encoding spread over worker hosts rather than fed chunk by chunk through
+# a single pipeline at the pace of a decoder.
+#
+# The chunks of the title are dealt out to the workers up front, in blocks
+# of consecutive chunks. On each worker host, "worker" decodes the blocks of
+# that worker straight into raw chunks (as atsc/decoder would write them)
+# and runs run_pipeline --no-decoder on them, which sends the chunks in its
+# ready/ to remote_media_server (the host that serves the channel) with
+# file_sender, as for a live channel. On that host, "wait" reports the
+# progress of the chunks into its ready/ until the title is complete.
+#
+#   (host A) file_receiver PORT
+#   (host B) vod_ingest.py worker config.yml CHANNEL title.mkv -i 0 -n 2
+#   (host C) vod_ingest.py worker config.yml CHANNEL title.mkv -i 1 -n 2
+#   (host A) vod_ingest.py wait config.yml CHANNEL title.mkv
+#
+# The title must be at its path on every worker (e.g., on shared storage).
+
+import os
+import sys
+import time
+import yaml
+import wave
+import signal
+import shutil
+import argparse
+import subprocess
+from os import path
+
+
+TIMESCALE = 90000  # of the chunk timestamps
+VIDEO_DURATION = 180180  # 2.002 s
+AUDIO_DURATION = 432000  # 4.8 s
+
+FRAME_RATE = (30000, 1001)
+FRAMES_PER_CHUNK = 60
+
+SAMPLE_RATE = 48000
+SAMPLES_PER_CHUNK = 230400
+# the samples of the previous chunk that start a chunk, to warm up an Opus
+# encoder (audio_sample_overlap in atsc/decoder.cc)
+OVERLAP_SAMPLES = 10 * 960 + 960 - 312
+BYTES_PER_SAMPLE = 4  # 16-bit stereo
+
+
+def load_channel_config(yaml_settings, channel):
+    with open(yaml_settings, 'r') as fh:
+        config = yaml.safe_load(fh)
+
+    channel_config = config['channel_configs'][channel]
+    if channel_config.get('live', True):
+        sys.exit('{} is live; only a channel that is not can be ingested'
+                 .format(channel))
+
+    # a segment would be appended to by the fragments of several workers
+    if 'segment_minutes' in channel_config:
+        sys.exit('segment_minutes is not supported by vod_ingest')
+
+    return config, channel_config
+
+
+def ready_formats(channel_config):
+    # the directories in ready/ of the video and audio chunks
+    video = []
+    for res, crfs in channel_config['video'].items():
+        for crf in crfs:
+            video.append('{}-{}'.format(res, crf))
+            video.append('{}-{}-ssim'.format(res, crf))
+
+    audio = [str(bitrate) for bitrate in channel_config['audio']]
+    return video, audio
+
+
+def title_duration(source):
+    out = subprocess.check_output([
+        'ffprobe', '-v', 'error', '-show_entries', 'format=duration',
+        '-of', 'default=noprint_wrappers=1:nokey=1', source])
+    return float(out)
+
+
+def num_chunks(duration, chunk_duration):
+    # a partial chunk at the end is padded
+    return -(-int(duration * TIMESCALE) // chunk_duration)
+
+
+def worker_blocks(total, block, index, num_workers):
+    # the ranges of chunks of worker index, dealt round-robin
+    for first in range(index * block, total, num_workers * block):
+        yield first, min(first + block, total)
+
+
+def read_exactly(fh, size):
+    data = bytearray()
+    while len(data) < size:
+        buf = fh.read(size - len(data))
+        if not buf:
+            break
+        data += buf
+    return bytes(data)
+
+
+class RawWriter:
+    # writes raw chunks atomically into working/, waiting while more than
+    # max_backlog video chunks are yet to be encoded (a raw chunk of 1080p
+    # takes almost 200 MB)
+
+    def __init__(self, channel_dir, max_backlog):
+        self.tmp_dir = path.join(channel_dir, 'tmp', 'raw')
+        self.video_dir = path.join(channel_dir, 'working', 'video-raw')
+        self.audio_dir = path.join(channel_dir, 'working', 'audio-raw')
+        self.canonical_dir = path.join(channel_dir, 'working',
+                                       'video-canonical')
+        self.max_backlog = max_backlog
+
+        for d in [self.tmp_dir, self.video_dir, self.audio_dir]:
+            os.makedirs(d, exist_ok=True)
+
+    def backlog(self):
+        ret = 0
+        for d in [self.video_dir, self.canonical_dir]:
+            if path.isdir(d):
+                ret += sum(1 for f in os.listdir(d)
+                           if f.endswith(('.y4m', '.mkv')))
+        return ret
+
+    def commit(self, name, dst_dir):
+        os.rename(path.join(self.tmp_dir, name), path.join(dst_dir, name))
+
+    def write_video(self, ts, header, frames):
+        while self.backlog() >= self.max_backlog:
+            time.sleep(0.1)
+
+        name = '{}.y4m'.format(ts)
+        with open(path.join(self.tmp_dir, name), 'wb') as fh:
+            fh.write(header)
+            for frame in frames:
+                fh.write(frame)
+        self.commit(name, self.video_dir)
+
+    def write_audio(self, ts, samples):
+        name = '{}.wav'.format(ts)
+        with wave.open(path.join(self.tmp_dir, name), 'wb') as fh:
+            fh.setnchannels(2)
+            fh.setsampwidth(2)
+            fh.setframerate(SAMPLE_RATE)
+            fh.writeframes(samples)
+        self.commit(name, self.audio_dir)
+
+
+def split_video(source, first, end, writer):
+    # decode chunks [first, end) of the video at 29.97 fps
+    start_s = first * VIDEO_DURATION / TIMESCALE
+    num_frames = (end - first) * FRAMES_PER_CHUNK
+
+    ffmpeg = subprocess.Popen([
+        'ffmpeg', '-nostdin', '-hide_banner', '-loglevel', 'error',
+        '-ss', '{:.6f}'.format(start_s), '-i', source, '-map', '0:v:0',
+        '-vf', 'fps={}/{}'.format(*FRAME_RATE), '-pix_fmt', 'yuv420p',
+        '-frames:v', str(num_frames), '-f', 'yuv4mpegpipe', '-'],
+        stdout=subprocess.PIPE)
+
+    header = ffmpeg.stdout.readline()
+    params = header.split()
+    width = int(next(p[1:] for p in params if p.startswith(b'W')))
+    height = int(next(p[1:] for p in params if p.startswith(b'H')))
+    frame_size = len(b'FRAME\n') + width * height * 3 // 2
+
+    last_frame = None
+    for chunk in range(first, end):
+        frames = []
+        for _ in range(FRAMES_PER_CHUNK):
+            frame = read_exactly(ffmpeg.stdout, frame_size)
+            if len(frame) == frame_size:
+                last_frame = frame
+            elif last_frame is None:
+                sys.exit('No video at {:.3f} s of {}'.format(start_s, source))
+            frames.append(last_frame)  # the end of the title is padded
+
+        writer.write_video(chunk * VIDEO_DURATION, header, frames)
+
+    ffmpeg.stdout.close()
+    if ffmpeg.wait() != 0:
+        sys.exit('ffmpeg failed to decode the video of ' + source)
+
+
+def split_audio(source, first, end, writer):
+    # decode chunks [first, end) of the audio, each after the overlap
+    first_sample = first * SAMPLES_PER_CHUNK - OVERLAP_SAMPLES
+    leading_zeros = max(0, -first_sample) * BYTES_PER_SAMPLE
+    first_sample = max(0, first_sample)
+    num_samples = end * SAMPLES_PER_CHUNK - first_sample
+
+    ffmpeg = subprocess.Popen([
+        'ffmpeg', '-nostdin', '-hide_banner', '-loglevel', 'error',
+        '-ss', '{:.6f}'.format(first_sample / SAMPLE_RATE), '-i', source,
+        '-t', '{:.6f}'.format(num_samples / SAMPLE_RATE), '-map', '0:a:0',
+        '-ac', '2', '-ar', str(SAMPLE_RATE), '-f', 's16le', '-'],
+        stdout=subprocess.PIPE)
+
+    chunk_bytes = SAMPLES_PER_CHUNK * BYTES_PER_SAMPLE
+    overlap_bytes = OVERLAP_SAMPLES * BYTES_PER_SAMPLE
+
+    overlap = bytes(leading_zeros) + read_exactly(
+        ffmpeg.stdout, overlap_bytes - leading_zeros)
+    for chunk in range(first, end):
+        samples = read_exactly(ffmpeg.stdout, chunk_bytes)
+        samples += bytes(chunk_bytes - len(samples))  # silence at the end
+
+        writer.write_audio(chunk * AUDIO_DURATION,
+                           overlap.ljust(overlap_bytes, b'\0') + samples)
+        overlap = samples[-overlap_bytes:]
+
+    ffmpeg.stdout.close()
+    if ffmpeg.wait() != 0:
+        sys.exit('ffmpeg failed to decode the audio of ' + source)
+
+
+def make_worker_config(config, channel_config, args):
+    # the configuration of run_pipeline for the channel alone, which keeps
+    # every chunk (rather than dropping those beyond max_queued) and leaves
+    # the chunks in ready/ to the media servers to clean
+    if 'remote_media_server' not in config:
+        sys.exit('remote_media_server is required to collect the chunks')
+
+    channel_config = dict(channel_config)
+    channel_config.pop('multiplex', None)
+    channel_config.pop('max_queued', None)
+
+    config = dict(config)
+    config['media_dir'] = args.media_dir
+    config['channels'] = [args.channel]
+    config['channel_configs'] = {args.channel: channel_config}
+    config['enable_logging'] = False
+    config['clean_ready_media'] = False
+
+    config_path = path.join(args.media_dir, 'vod_ingest.yml')
+    with open(config_path, 'w') as fh:
+        yaml.safe_dump(config, fh)
+
+    return config_path
+
+
+def count_ready(channel_dir, dirs, duration):
+    # the chunks (by timestamp) in all of dirs in ready/
+    timestamps = None
+    for d in dirs:
+        ready_dir = path.join(channel_dir, 'ready', d)
+        seen = set()
+        for f in os.listdir(ready_dir) if path.isdir(ready_dir) else []:
+            name = f.split('.')[0]
+            if name.isdigit() and int(name) % duration == 0:
+                seen.add(int(name) // duration)
+
+        timestamps = seen if timestamps is None else timestamps & seen
+
+    return timestamps or set()
+
+
+def run_worker(args):
+    config, channel_config = load_channel_config(args.yaml_settings,
+                                                 args.channel)
+    if not 0 <= args.index < args.num_workers:
+        sys.exit('--index must be less than --num-workers')
+
+    duration = title_duration(args.source)
+    num_video = num_chunks(duration, VIDEO_DURATION)
+    num_audio = num_chunks(duration, AUDIO_DURATION)
+
+    # run_pipeline starts from an empty channel directory
+    channel_dir = path.join(args.media_dir, args.channel)
+    if path.isdir(channel_dir):
+        shutil.rmtree(channel_dir)
+    os.makedirs(args.media_dir, exist_ok=True)
+
+    config_path = make_worker_config(config, channel_config, args)
+
+    # run in a session of its own, to kill all of the pipeline at the end
+    pipeline = subprocess.Popen([args.run_pipeline, '--no-decoder',
+                                 config_path], start_new_session=True)
+    try:
+        while not path.isdir(path.join(channel_dir, 'working')):
+            if pipeline.poll() is not None:
+                sys.exit('run_pipeline exited')
+            time.sleep(0.1)
+
+        writer = RawWriter(channel_dir, args.max_backlog)
+        start = time.time()
+
+        video_blocks = list(worker_blocks(num_video, args.block_chunks,
+                                          args.index, args.num_workers))
+        audio_blocks = list(worker_blocks(
+            num_audio, max(1, args.block_chunks * VIDEO_DURATION //
+                           AUDIO_DURATION), args.index, args.num_workers))
+
+        for first, end in audio_blocks:
+            split_audio(args.source, first, end, writer)
+
+        for first, end in video_blocks:
+            sys.stderr.write('Decoding video chunks {}-{} of {}\n'
+                             .format(first, end - 1, num_video))
+            split_video(args.source, first, end, writer)
+
+        # wait for the chunks of the worker to be ready here; they are sent
+        # to remote_media_server from there
+        video_dirs, audio_dirs = ready_formats(channel_config)
+        mine_video = {c for b in video_blocks for c in range(*b)}
+        mine_audio = {c for b in audio_blocks for c in range(*b)}
+
+        while not (mine_video <= count_ready(channel_dir, video_dirs,
+                                             VIDEO_DURATION) and
+                   mine_audio <= count_ready(channel_dir, audio_dirs,
+                                             AUDIO_DURATION)):
+            if pipeline.poll() is not None:
+                sys.exit('run_pipeline exited')
+            time.sleep(1)
+
+        sys.stderr.write('Encoded {} video and {} audio chunks in {:.1f} s; '
+                         'sending them until interrupted\n'.format(
+                             len(mine_video), len(mine_audio),
+                             time.time() - start))
+        pipeline.wait()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        if pipeline.poll() is None:
+            os.killpg(pipeline.pid, signal.SIGTERM)
+        pipeline.wait()
+
+
+def run_wait(args):
+    config, channel_config = load_channel_config(args.yaml_settings,
+                                                 args.channel)
+    media_dir = args.media_dir or config['media_dir']
+    channel_dir = path.join(media_dir, args.channel)
+
+    duration = title_duration(args.source)
+    num_video = num_chunks(duration, VIDEO_DURATION)
+    num_audio = num_chunks(duration, AUDIO_DURATION)
+    video_dirs, audio_dirs = ready_formats(channel_config)
+
+    start = time.time()
+    while True:
+        video = len(count_ready(channel_dir, video_dirs, VIDEO_DURATION))
+        audio = len(count_ready(channel_dir, audio_dirs, AUDIO_DURATION))
+
+        sys.stderr.write('\r{}/{} video and {}/{} audio chunks in {:.0f} s'
+                         .format(video, num_video, audio, num_audio,
+                                 time.time() - start))
+        if video >= num_video and audio >= num_audio:
+            break
+        time.sleep(args.interval)
+
+    sys.stderr.write('\nIngested {:.1f} s of {} into {}\n'.format(
+                     duration, args.source, channel_dir))
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='ingest a title into a channel that is not live')
+    subparsers = parser.add_subparsers(dest='command')
+    subparsers.required = True
+
+    worker = subparsers.add_parser(
+        'worker', help='encode the blocks of chunks of a worker')
+    wait = subparsers.add_parser(
+        'wait', help='wait for all the chunks to be in ready/')
+
+    for p in [worker, wait]:
+        p.add_argument('yaml_settings', help='run_pipeline configuration')
+        p.add_argument('channel', help='channel to ingest into')
+        p.add_argument('source', help='title to ingest')
+
+    worker.add_argument('-i', '--index', type=int, required=True,
+                        help='of this worker, from 0')
+    worker.add_argument('-n', '--num-workers', type=int, required=True,
+                        help='number of workers')
+    worker.add_argument('--media-dir', required=True,
+                        help='directory of the pipeline of this worker '
+                        '(its channel directory is removed first)')
+    worker.add_argument('--block-chunks', type=int, default=30,
+                        help='video chunks per block dealt out (default 30)')
+    worker.add_argument('--max-backlog', type=int,
+                        default=2 * (os.cpu_count() or 1),
+                        help='raw video chunks to have on disk at most '
+                        '(default twice the CPUs)')
+    worker.add_argument('--run-pipeline', default=path.join(
+                        path.dirname(path.abspath(__file__)),
+                        '..', 'wrappers', 'run_pipeline'),
+                        help='path to run_pipeline')
+
+    wait.add_argument('--media-dir',
+                      help='media directory (default media_dir of the '
+                      'configuration)')
+    wait.add_argument('--interval', type=float, default=5,
+                      help='seconds between reports (default 5)')
+
+    args = parser.parse_args()
+    if args.command == 'worker':
+        run_worker(args)
+    else:
+        run_wait(args)
+
+
+if __name__ == '__main__':
+    main()
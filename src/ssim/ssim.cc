@@ -1,20 +1,62 @@
 #include <fcntl.h>
-#include <cmath>
+#include <getopt.h>
+#include <unistd.h>
 
+#include <cmath>
+#include <condition_variable>
+#include <exception>
+#include <iomanip>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
 #include <string>
 #include <stdexcept>
+#include <thread>
+#include <vector>
 
-#include "file_descriptor.hh"
-#include "system_runner.hh"
+#include "child_process.hh"
 #include "exception.hh"
+#include "file_descriptor.hh"
+#include "filesystem.hh"
+#include "pipe.hh"
+#include "ssim_kernel.hh"
+#include "y4m_reader.hh"
 
 using namespace std;
 
+/* the error bound of an approximate SSIM, in standard errors of the mean of
+ * the sampled frames */
+static const double ERROR_BOUND_Z = 3;
+
+/* the frames and rows of windows that are compared (see --frame-step and
+ * --row-step), and whether the exact SSIM is computed too (--verify) */
+static unsigned int frame_step = 1;
+static unsigned int row_step = 1;
+static bool verify = false;
+
+static bool approximate() { return frame_step > 1 or row_step > 1; }
+
 void print_usage(const string & program)
 {
   cerr <<
-  "Usage: " << program << " <video1.y4m> <video2.y4m> <output>"
+  "Usage: " << program << " [options] <video> <reference> <output> "
+  "[<video> <output> ...]\n"
+  "Calculate the SSIM of each <video> against <reference>, to whose "
+  "resolution it\nis scaled, and write it to the <output> that follows it. "
+  "The reference is read\nonly once: directly if it is a Y4M, or decoded by "
+  "FFmpeg otherwise.\n\n"
+  "Options:\n"
+  "--frame-step <n>   approximate the SSIM from every <n>th frame, which is\n"
+  "                   all that FFmpeg scales\n"
+  "--row-step <n>     approximate the SSIM of a frame from every <n>th row\n"
+  "                   of windows, from a row that varies with the frame\n"
+  "--verify           also compute the exact SSIM, which is written instead,\n"
+  "                   and report the error of the approximation\n\n"
+  "An approximate SSIM is followed in <output> by a line with its error\n"
+  "bound: " << ERROR_BOUND_Z << " standard errors of the mean over the "
+  "sampled frames."
   << endl;
 }
 
@@ -26,57 +68,402 @@ void write_to_file(const string & output_path, const string & result)
   output_fd.close();
 }
 
+/* FFmpeg decoding a video into a Y4M stream read from a pipe */
+struct Decoder
+{
+  ChildProcess process;
+  Y4MReader reader;
+};
+
+Decoder spawn_decoder(const string & video, const vector<string> & filters)
+{
+  vector<string> args {
+    "ffmpeg", "-nostdin", "-hide_banner", "-loglevel", "error",
+    "-threads", "1", "-i", video };
+  args.insert(args.end(), filters.begin(), filters.end());
+  args.insert(args.end(), {
+    "-pix_fmt", "yuv420p", "-threads", "1", "-f", "yuv4mpegpipe", "-" });
+
+  auto [read_end, write_end] = make_pipe();
+
+  SpawnOptions options;
+  options.dup2s = { {write_end.fd_num(), STDOUT_FILENO} };
+  options.closes = { read_end.fd_num() };
+
+  ChildProcess process("ffmpeg", "ffmpeg", args, options);
+
+  /* so that the other decoders do not inherit the write end, and EOF is
+   * seen when this one exits */
+  write_end.close();
+
+  return {move(process), Y4MReader(move(read_end), video)};
+}
+
+/* the frames of the reference, read once and shared by the threads that
+ * compare the videos against it; at most WINDOW frames are held */
+class ReferenceFrames
+{
+public:
+  using Frame = shared_ptr<const vector<uint8_t>>;
+
+  static constexpr uint64_t WINDOW = 8;
+
+  ReferenceFrames(const size_t num_readers) : consumed_(num_readers, 0) {}
+
+  /* add the next frame; blocks while the readers have WINDOW frames left */
+  void push(Frame && frame)
+  {
+    unique_lock<mutex> lock(mutex_);
+    cv_.wait(lock, [this]() { return num_frames_ - min_consumed() < WINDOW; });
+
+    frames_[num_frames_ % WINDOW] = move(frame);
+    num_frames_++;
+    cv_.notify_all();
+  }
+
+  /* no frames follow */
+  void finish()
+  {
+    lock_guard<mutex> lock(mutex_);
+    finished_ = true;
+    cv_.notify_all();
+  }
+
+  /* frame i for a reader that is done with the frames before it; null if
+   * the reference has fewer frames */
+  Frame get(const size_t reader, const uint64_t i)
+  {
+    unique_lock<mutex> lock(mutex_);
+    consumed_.at(reader) = i;
+    cv_.notify_all();
+
+    cv_.wait(lock, [this, i]() { return i < num_frames_ or finished_; });
+    return i < num_frames_ ? frames_[i % WINDOW] : nullptr;
+  }
+
+  /* the reader needs no more frames */
+  void done(const size_t reader)
+  {
+    lock_guard<mutex> lock(mutex_);
+    consumed_.at(reader) = UINT64_MAX;
+    cv_.notify_all();
+  }
+
+private:
+  mutex mutex_ {};
+  condition_variable cv_ {};
+
+  Frame frames_[WINDOW] {};
+  uint64_t num_frames_ {0};
+  bool finished_ {false};
+
+  /* the index of the frame required next by each reader */
+  vector<uint64_t> consumed_;
+
+  uint64_t min_consumed() const
+  {
+    uint64_t ret = UINT64_MAX;
+    for (const uint64_t c : consumed_) {
+      ret = min(ret, c);
+    }
+    return min(ret, num_frames_);
+  }
+};
+
+/* the comparison of a video against the reference, run in its own thread */
+struct Comparison
+{
+  string video;
+  string output_path;
+
+  optional<Decoder> decoder {};
+  exception_ptr error {};
+
+  /* over the sampled frames */
+  double total_ssim {0};
+  double total_squared_ssim {0};
+  uint64_t num_frames {0};
+
+  /* over all the frames, with --verify */
+  double total_exact_ssim {0};
+  uint64_t num_exact_frames {0};
+
+  double ssim() const { return total_ssim / num_frames; }
+
+  /* the error bound of ssim(): with the rows of windows varying from frame
+   * to frame, the spread of the frames includes that of the rows */
+  double error_bound() const
+  {
+    if (num_frames < 2) {
+      return 1;
+    }
+
+    const double mean = ssim();
+    const double variance = max(0.0, (total_squared_ssim
+                                      - num_frames * mean * mean)
+                                     / (num_frames - 1));
+    return ERROR_BOUND_Z * sqrt(variance / num_frames);
+  }
+
+  void run(ReferenceFrames & reference, const size_t idx,
+           const unsigned int width, const unsigned int height)
+  {
+    try {
+      SSIMKernel kernel(width, height, row_step);
+      optional<SSIMKernel> exact_kernel;
+      if (verify) {
+        exact_kernel.emplace(width, height);
+      }
+
+      vector<uint8_t> frame;
+
+      /* without --verify, FFmpeg only outputs the sampled frames */
+      for (uint64_t i = 0; ; i++) {
+        const auto reference_frame = reference.get(idx, i);
+        if (not reference_frame) {
+          /* see whether the video ends here too */
+          decoder->reader.read_frame(frame);
+          break;
+        }
+
+        if (not decoder->reader.read_frame(frame)) {
+          break;
+        }
+
+        if (verify) {
+          total_exact_ssim += exact_kernel->frame_ssim(
+            reference_frame->data(), frame.data());
+          num_exact_frames++;
+
+          if (i % frame_step != 0) {
+            continue;
+          }
+        }
+
+        const double ssim = kernel.frame_ssim(reference_frame->data(),
+                                              frame.data(),
+                                              num_frames % row_step);
+        total_ssim += ssim;
+        total_squared_ssim += ssim * ssim;
+        num_frames++;
+      }
+    } catch (...) {
+      error = current_exception();
+    }
+
+    reference.done(idx);
+  }
+};
+
+/* FFmpeg filter that keeps every frame_step-th frame, from the first */
+static string select_filter()
+{
+  return "select=not(mod(n\\," + to_string(frame_step) + "))";
+}
+
 int main(int argc, char * argv[])
 {
   if (argc < 1) {
     abort();
   }
 
-  if (argc != 4) {
+  const option cmd_line_opts[] = {
+    {"frame-step", required_argument, nullptr, 'f'},
+    {"row-step",   required_argument, nullptr, 'r'},
+    {"verify",     no_argument,       nullptr, 'v'},
+    { nullptr,     0,                 nullptr,  0 }
+  };
+
+  while (true) {
+    const int opt = getopt_long(argc, argv, "f:r:v", cmd_line_opts, nullptr);
+    if (opt == -1) {
+      break;
+    }
+
+    switch (opt) {
+    case 'f':
+      frame_step = stoul(optarg);
+      break;
+    case 'r':
+      row_step = stoul(optarg);
+      break;
+    case 'v':
+      verify = true;
+      break;
+    default:
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  const int num_args = argc - optind;
+  if (num_args < 3 or num_args % 2 != 1 or frame_step == 0 or
+      row_step == 0) {
     print_usage(argv[0]);
     return EXIT_FAILURE;
   }
 
-  string video1{argv[1]}, video2{argv[2]}, output_path{argv[3]};
+  char ** args = argv + optind;
+  const string reference_path = args[1];
 
-  /* run FFmpeg's SSIM calculation and read from stderr */
-  vector<string> cmd {
-    "ffmpeg", "-nostdin", "-hide_banner", "-i", video1, "-i", video2,
-    "-lavfi", "ssim", "-threads", "1", "-f", "null", "-" };
-  string output = run("ffmpeg", cmd, false, true).second;
+  /* FFmpeg drops the frames that are not sampled before scaling them, and
+   * outputs the others as they are */
+  const bool select_frames = frame_step > 1 and not verify;
+  vector<string> select_args;
+  if (select_frames) {
+    select_args = {"-vsync", "0"};
+  }
 
-  /* the overall SSIM appears between "All:" and the first space after */
-  auto ssim_pos = output.rfind("All:");
-  if (ssim_pos == string::npos) {
-    cerr << "No valid SSIM found in the output of FFmpeg" << endl;
-    return EXIT_FAILURE;
+  /* a Y4M reference is read as is, without FFmpeg */
+  optional<Decoder> reference_decoder;
+  optional<Y4MReader> reference_file;
+
+  if (fs::path(reference_path).extension() == ".y4m") {
+    FileDescriptor fd(CheckSystemCall("open (" + reference_path + ")",
+                                      open(reference_path.c_str(), O_RDONLY)));
+    reference_file.emplace(move(fd), reference_path);
+  } else {
+    vector<string> filters;
+    if (select_frames) {
+      filters = {"-vf", select_filter()};
+      filters.insert(filters.end(), select_args.begin(), select_args.end());
+    }
+    reference_decoder.emplace(spawn_decoder(reference_path, filters));
   }
-  ssim_pos += 4;
 
-  auto space_pos = output.find(' ', ssim_pos);
-  if (space_pos == string::npos) {
-    cerr << "No valid SSIM found in the output of FFmpeg" << endl;
-    return EXIT_FAILURE;
+  Y4MReader & reference_reader = reference_file ? *reference_file
+                                                : reference_decoder->reader;
+  const unsigned int width = reference_reader.width();
+  const unsigned int height = reference_reader.height();
+
+  /* start all the decoders before any thread */
+  string scale = "scale=" + to_string(width) + ":" + to_string(height);
+  if (select_frames) {
+    scale = select_filter() + "," + scale;
   }
-  string ssim_str = output.substr(ssim_pos, space_pos - ssim_pos);
 
-  /* check if ssim_str is a valid SSIM between -1 and 1 */
+  vector<string> filters {"-vf", scale};
+  filters.insert(filters.end(), select_args.begin(), select_args.end());
+
+  vector<Comparison> comparisons;
+  comparisons.push_back({args[0], args[2]});
+  for (int i = 3; i < num_args; i += 2) {
+    comparisons.push_back({args[i], args[i + 1]});
+  }
+
+  for (auto & comparison : comparisons) {
+    comparison.decoder.emplace(spawn_decoder(comparison.video, filters));
+  }
+
+  ReferenceFrames reference(comparisons.size());
+  vector<thread> threads;
+  for (size_t i = 0; i < comparisons.size(); i++) {
+    threads.emplace_back(&Comparison::run, &comparisons[i], ref(reference),
+                         i, width, height);
+  }
+
+  /* read the reference once for all the comparisons; a Y4M reference is
+   * sampled here */
+  exception_ptr reference_error;
   try {
-    double ssim_val = stod(ssim_str);
-    if (ssim_val >= -1 and ssim_val <= 1) {
-      cerr << "SSIM = " + ssim_str + " between " + video1 + " and " + video2
-           << endl;
+    vector<uint8_t> skipped;
+
+    for (uint64_t i = 0; ; i++) {
+      if (reference_file and select_frames and i % frame_step != 0) {
+        if (not reference_reader.read_frame(skipped)) {
+          break;
+        }
+        continue;
+      }
+
+      auto frame = make_shared<vector<uint8_t>>();
+      if (not reference_reader.read_frame(*frame)) {
+        break;
+      }
+      reference.push(move(frame));
+    }
+  } catch (...) {
+    reference_error = current_exception();
+  }
+
+  reference.finish();
+  for (auto & t : threads) {
+    t.join();
+  }
+
+  if (reference_error) {
+    rethrow_exception(reference_error);
+  }
+
+  int ret_code = EXIT_SUCCESS;
+
+  for (auto & comparison : comparisons) {
+    Decoder & decoder = *comparison.decoder;
+
+    /* a decoder that was not read to the end is stopped by the pipe */
+    const bool read_to_end = decoder.reader.eof();
+    decoder.reader.close();
+    while (not decoder.process.terminated()) {
+      decoder.process.wait();
+    }
+
+    if (comparison.error) {
+      try {
+        rethrow_exception(comparison.error);
+      } catch (const exception & e) {
+        print_exception(comparison.video.c_str(), e);
+      }
+      ret_code = EXIT_FAILURE;
+      continue;
+    }
+
+    if (read_to_end and decoder.process.exit_status() != 0) {
+      cerr << "FFmpeg failed to decode " << comparison.video << endl;
+      ret_code = EXIT_FAILURE;
+      continue;
+    }
+
+    if (comparison.num_frames == 0) {
+      cerr << "No frames to compare in " << comparison.video << endl;
+      ret_code = EXIT_FAILURE;
+      continue;
+    }
+
+    /* in the format of the "All:" of FFmpeg */
+    ostringstream ssim;
+    ssim << fixed << setprecision(6);
+
+    if (verify) {
+      const double exact = comparison.total_exact_ssim
+                           / comparison.num_exact_frames;
+      const double error = fabs(comparison.ssim() - exact);
+      const double bound = comparison.error_bound();
+
+      ssim << exact;
+      cerr << "SSIM approximation error = " << error << " (bound " << bound
+           << (error > bound ? ", exceeded" : "") << ") for "
+           << comparison.video << endl;
     } else {
-      cerr << "Invalid SSIM value out of range: " + ssim_str << endl;
-      return EXIT_FAILURE;
+      ssim << comparison.ssim();
     }
-  } catch (const exception & e) {
-    cerr << "Error in converting " + ssim_str + ": " + e.what() << endl;
-    return EXIT_FAILURE;
+
+    cerr << "SSIM = " + ssim.str() + " between " + comparison.video + " and "
+            + reference_path << endl;
+
+    /* write the SSIM value to output_path, followed by its error bound if
+     * it is approximate; readers take the first line */
+    if (approximate() and not verify) {
+      ssim << "\n" << comparison.error_bound();
+    }
+    write_to_file(comparison.output_path, ssim.str());
   }
 
-  /* write the SSIM value to output_path */
-  write_to_file(output_path, ssim_str);
+  if (reference_decoder) {
+    reference_decoder->reader.close();
+    while (not reference_decoder->process.terminated()) {
+      reference_decoder->process.wait();
+    }
+  }
 
-  return EXIT_SUCCESS;
+  return ret_code;
 }
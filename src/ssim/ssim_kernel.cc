@@ -0,0 +1,156 @@
+#include "ssim_kernel.hh"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+using namespace std;
+
+/* the constants of an 8x8 window of 8-bit pixels */
+static const int SSIM_C1 = static_cast<int>(.01 * .01 * 255 * 255 * 64 + .5);
+static const int SSIM_C2 = static_cast<int>(.03 * .03 * 255 * 255 * 64 * 63
+                                            + .5);
+
+/* SSIM of a window from its sums, with the same rounding as FFmpeg */
+static float window_ssim(const int s1, const int s2, const int ss,
+                         const int s12)
+{
+  const int vars = ss * 64 - s1 * s1 - s2 * s2;
+  const int covar = s12 * 64 - s1 * s2;
+
+  return static_cast<float>(2 * s1 * s2 + SSIM_C1)
+         * static_cast<float>(2 * covar + SSIM_C2)
+         / (static_cast<float>(s1 * s1 + s2 * s2 + SSIM_C1)
+            * static_cast<float>(vars + SSIM_C2));
+}
+
+void SSIMKernel::BlockSums::resize(const size_t size)
+{
+  for (auto * sums : {&s1, &s2, &ss, &s12}) {
+    sums->resize(size);
+  }
+}
+
+SSIMKernel::SSIMKernel(const unsigned int width, const unsigned int height,
+                       const unsigned int row_step)
+  : width_(width), height_(height), row_step_(row_step)
+{
+  /* the chroma planes need at least 2x2 blocks too */
+  if (width_ < 16 or height_ < 16) {
+    throw runtime_error("SSIMKernel: frame of " + to_string(width_) + "x"
+                        + to_string(height_) + " is too small");
+  }
+
+  if (row_step_ == 0) {
+    throw runtime_error("SSIMKernel: the row step must be positive");
+  }
+
+  column_sums_.resize(width_ / 4 * 4);
+  for (auto & row : rows_) {
+    row.resize(width_ / 4);
+  }
+}
+
+void SSIMKernel::sum_blocks(const uint8_t * a, const uint8_t * b,
+                            const unsigned int width, BlockSums & row)
+{
+  const unsigned int num_blocks = width / 4;
+  const unsigned int num_columns = num_blocks * 4;
+
+  int32_t * c1 = column_sums_.s1.data();
+  int32_t * c2 = column_sums_.s2.data();
+  int32_t * css = column_sums_.ss.data();
+  int32_t * c12 = column_sums_.s12.data();
+
+  fill(c1, c1 + num_columns, 0);
+  fill(c2, c2 + num_columns, 0);
+  fill(css, css + num_columns, 0);
+  fill(c12, c12 + num_columns, 0);
+
+  for (unsigned int y = 0; y < 4; y++) {
+    const uint8_t * line_a = a + size_t(y) * width;
+    const uint8_t * line_b = b + size_t(y) * width;
+
+    for (unsigned int x = 0; x < num_columns; x++) {
+      const int32_t pa = line_a[x];
+      const int32_t pb = line_b[x];
+
+      c1[x] += pa;
+      c2[x] += pb;
+      css[x] += pa * pa + pb * pb;
+      c12[x] += pa * pb;
+    }
+  }
+
+  for (unsigned int i = 0; i < num_blocks; i++) {
+    const unsigned int x = i * 4;
+
+    row.s1[i] = c1[x] + c1[x + 1] + c1[x + 2] + c1[x + 3];
+    row.s2[i] = c2[x] + c2[x + 1] + c2[x + 2] + c2[x + 3];
+    row.ss[i] = css[x] + css[x + 1] + css[x + 2] + css[x + 3];
+    row.s12[i] = c12[x] + c12[x + 1] + c12[x + 2] + c12[x + 3];
+  }
+}
+
+double SSIMKernel::plane_ssim(const uint8_t * a, const uint8_t * b,
+                              const unsigned int width,
+                              const unsigned int height,
+                              const unsigned int row_offset)
+{
+  const unsigned int num_blocks = width / 4;
+  const unsigned int num_rows = height / 4;
+
+  /* the windows of row z span the rows z - 1 and z of blocks; a plane with
+   * fewer rows than the offset is sampled from its first row */
+  const unsigned int first = 1 + (1 + row_offset < num_rows ? row_offset : 0);
+
+  double total = 0;
+  unsigned int num_window_rows = 0;
+
+  for (unsigned int z = first; z < num_rows; z += row_step_) {
+    const size_t offset = size_t(z) * 4 * width;
+    BlockSums & top = rows_[(z - 1) % 2];
+    BlockSums & bottom = rows_[z % 2];
+
+    /* consecutive rows of windows share a row of blocks */
+    if (z == first or row_step_ > 1) {
+      const size_t top_offset = offset - size_t(4) * width;
+      sum_blocks(a + top_offset, b + top_offset, width, top);
+    }
+    sum_blocks(a + offset, b + offset, width, bottom);
+
+    double row_total = 0;
+    for (unsigned int i = 0; i + 1 < num_blocks; i++) {
+      row_total += window_ssim(
+          top.s1[i] + top.s1[i + 1] + bottom.s1[i] + bottom.s1[i + 1],
+          top.s2[i] + top.s2[i + 1] + bottom.s2[i] + bottom.s2[i + 1],
+          top.ss[i] + top.ss[i + 1] + bottom.ss[i] + bottom.ss[i + 1],
+          top.s12[i] + top.s12[i + 1] + bottom.s12[i] + bottom.s12[i + 1]);
+    }
+
+    total += row_total;
+    num_window_rows++;
+  }
+
+  return total / (num_window_rows * double(num_blocks - 1));
+}
+
+double SSIMKernel::frame_ssim(const uint8_t * a, const uint8_t * b,
+                              const unsigned int row_offset)
+{
+  const unsigned int chroma_width = (width_ + 1) / 2;
+  const unsigned int chroma_height = (height_ + 1) / 2;
+
+  const size_t luma_size = size_t(width_) * height_;
+  const size_t chroma_size = size_t(chroma_width) * chroma_height;
+
+  const double y = plane_ssim(a, b, width_, height_, row_offset);
+  const double cb = plane_ssim(a + luma_size, b + luma_size,
+                               chroma_width, chroma_height, row_offset);
+  const double cr = plane_ssim(a + luma_size + chroma_size,
+                               b + luma_size + chroma_size,
+                               chroma_width, chroma_height, row_offset);
+
+  return (y * luma_size + (cb + cr) * chroma_size)
+         / (luma_size + 2 * chroma_size);
+}
@@ -0,0 +1,58 @@
+#ifndef SSIM_KERNEL_HH
+#define SSIM_KERNEL_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/* SSIM of 8-bit 4:2:0 frames computed as by FFmpeg's ssim filter (and
+ * x264): the sums of the pixels of each 4x4 block are computed once, and
+ * the SSIM is averaged over the 8x8 windows of 2x2 blocks at a step of 4.
+ * The SSIM of a frame weighs the SSIM of each plane by its size, as does
+ * the "All" of FFmpeg. An SSIMKernel holds the sums of two rows of blocks,
+ * so each thread needs its own.
+ *
+ * With row_step > 1, the SSIM is approximated from the rows of windows
+ * at that step only, which spares the sums of most rows of blocks. */
+class SSIMKernel
+{
+public:
+  SSIMKernel(const unsigned int width, const unsigned int height,
+             const unsigned int row_step = 1);
+
+  /* SSIM between frames a and b of the size of the kernel, over the rows of
+   * windows from row_offset (< row_step) at a step of row_step; varying the
+   * offset from frame to frame covers all the rows */
+  double frame_ssim(const uint8_t * a, const uint8_t * b,
+                    const unsigned int row_offset = 0);
+
+private:
+  /* the sums over a row of 4x4 blocks */
+  struct BlockSums {
+    std::vector<int32_t> s1 {};   /* of the pixels of a */
+    std::vector<int32_t> s2 {};   /* of the pixels of b */
+    std::vector<int32_t> ss {};   /* of the squares of both */
+    std::vector<int32_t> s12 {};  /* of the products */
+
+    void resize(const size_t size);
+  };
+
+  unsigned int width_, height_;
+  unsigned int row_step_;
+
+  /* sums of the columns of the pixels of a row of blocks, in a layout that
+   * lets the compiler vectorize their loop */
+  BlockSums column_sums_ {};
+  BlockSums rows_[2] {};
+
+  /* mean SSIM of a plane */
+  double plane_ssim(const uint8_t * a, const uint8_t * b,
+                    const unsigned int width, const unsigned int height,
+                    const unsigned int row_offset);
+
+  /* sums of the blocks of the row of 4 lines starting at a and b */
+  void sum_blocks(const uint8_t * a, const uint8_t * b,
+                  const unsigned int width, BlockSums & row);
+};
+
+#endif /* SSIM_KERNEL_HH */
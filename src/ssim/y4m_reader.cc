@@ -0,0 +1,134 @@
+#include "y4m_reader.hh"
+
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "exception.hh"
+#include "tokenize.hh"
+
+using namespace std;
+
+static constexpr size_t READ_BUFFER_SIZE = 1 << 16;
+
+Y4MReader::Y4MReader(FileDescriptor && fd, const string & name)
+  : fd_(move(fd)), name_(name), buffer_(READ_BUFFER_SIZE)
+{
+  string header;
+  if (not read_line(header)) {
+    throw runtime_error(name_ + ": empty Y4M stream");
+  }
+
+  const vector<string> params = split(header, " ");
+  if (params.empty() or params[0] != "YUV4MPEG2") {
+    throw runtime_error(name_ + ": no YUV4MPEG2 found");
+  }
+
+  for (size_t i = 1; i < params.size(); i++) {
+    const string & p = params[i];
+    if (p.empty()) {
+      continue;
+    }
+
+    switch (p[0]) {
+    case 'W':
+      width_ = stoul(p.substr(1));
+      break;
+    case 'H':
+      height_ = stoul(p.substr(1));
+      break;
+    case 'C':
+      /* 8-bit 4:2:0 with any chroma siting */
+      if (p != "C420" and p != "C420jpeg" and p != "C420mpeg2" and
+          p != "C420paldv") {
+        throw runtime_error(name_ + ": unsupported colorspace " + p);
+      }
+      break;
+    default:
+      break;
+    }
+  }
+
+  if (width_ == 0 or height_ == 0) {
+    throw runtime_error(name_ + ": no frame size found");
+  }
+}
+
+bool Y4MReader::fill()
+{
+  pos_ = 0;
+  end_ = CheckSystemCall("read (" + name_ + ")",
+                         ::read(fd_.fd_num(), buffer_.data(), buffer_.size()));
+  if (end_ == 0) {
+    eof_ = true;
+  }
+
+  return end_ > 0;
+}
+
+bool Y4MReader::read_line(string & line)
+{
+  line.clear();
+
+  while (true) {
+    if (pos_ == end_ and not fill()) {
+      if (line.empty()) {
+        return false;
+      }
+      throw runtime_error(name_ + ": truncated Y4M stream");
+    }
+
+    const char * begin = buffer_.data() + pos_;
+    const char * newline = static_cast<const char *>(
+        memchr(begin, '\n', end_ - pos_));
+
+    if (newline) {
+      line.append(begin, newline);
+      pos_ += newline - begin + 1;
+      return true;
+    }
+
+    line.append(begin, end_ - pos_);
+    pos_ = end_;
+  }
+}
+
+void Y4MReader::read_bytes(uint8_t * dst, size_t size)
+{
+  /* what is buffered first */
+  const size_t buffered = min(size, end_ - pos_);
+  memcpy(dst, buffer_.data() + pos_, buffered);
+  pos_ += buffered;
+  dst += buffered;
+  size -= buffered;
+
+  /* then straight into dst, which saves a copy of the bulk of a frame */
+  while (size > 0) {
+    const ssize_t n = CheckSystemCall("read (" + name_ + ")",
+                                      ::read(fd_.fd_num(), dst, size));
+    if (n == 0) {
+      eof_ = true;
+      throw runtime_error(name_ + ": truncated Y4M frame");
+    }
+
+    dst += n;
+    size -= n;
+  }
+}
+
+bool Y4MReader::read_frame(vector<uint8_t> & frame)
+{
+  string frame_header;
+  if (not read_line(frame_header)) {
+    return false;
+  }
+
+  if (frame_header.compare(0, 5, "FRAME") != 0) {
+    throw runtime_error(name_ + ": no FRAME found");
+  }
+
+  frame.resize(frame_size());
+  read_bytes(frame.data(), frame.size());
+  return true;
+}
@@ -0,0 +1,58 @@
+#ifndef Y4M_READER_HH
+#define Y4M_READER_HH
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "file_descriptor.hh"
+
+/* reads the frames of an 8-bit 4:2:0 Y4M stream, such as a file or the
+ * output of FFmpeg through a pipe */
+class Y4MReader
+{
+public:
+  /* reads the header of the stream; name is used in errors */
+  Y4MReader(FileDescriptor && fd, const std::string & name);
+
+  unsigned int width() const { return width_; }
+  unsigned int height() const { return height_; }
+
+  /* the Y plane followed by the Cb and Cr planes */
+  size_t frame_size() const
+  {
+    return size_t(width_) * height_
+           + 2 * size_t((width_ + 1) / 2) * ((height_ + 1) / 2);
+  }
+
+  /* read the next frame into frame; false at the end of the stream */
+  bool read_frame(std::vector<uint8_t> & frame);
+
+  bool eof() const { return eof_; }
+
+  /* stop reading, e.g., to let a writer on the other end of a pipe exit */
+  void close() { fd_.close(); }
+
+private:
+  FileDescriptor fd_;
+  std::string name_;
+
+  unsigned int width_ {0};
+  unsigned int height_ {0};
+
+  std::vector<char> buffer_;
+  size_t pos_ {0};
+  size_t end_ {0};
+  bool eof_ {false};
+
+  /* refill the (consumed) buffer; false at EOF */
+  bool fill();
+
+  /* the next line without its newline; false at EOF before any byte */
+  bool read_line(std::string & line);
+
+  /* throws if the stream ends before size bytes */
+  void read_bytes(uint8_t * dst, size_t size);
+};
+
+#endif /* Y4M_READER_HH */
@@ -0,0 +1,188 @@
+/* ChunkIndex against a map of the timestamps inserted, with timestamps near
+ * the slots, far above and far below them (which are kept apart until the
+ * slots reach them), and erasures: the lookups, the arrived parts and the
+ * order of for_each() must match, and far timestamps must not allocate the
+ * slots in between */
+
+#include <iostream>
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "chunk_index.hh"
+#include "exception.hh"
+
+using namespace std;
+
+static const unsigned int DURATION = 180180;
+static const size_t NUM_FORMATS = 3;
+static const unsigned int NUM_PARTS = 2;
+
+static void check(const bool condition, const string & message)
+{
+  if (not condition) {
+    throw runtime_error(message);
+  }
+}
+
+/* the index as the map that ChunkIndex replaced: entry values and the
+ * arrived parts by timestamp */
+struct Model
+{
+  map<uint64_t, pair<vector<int>, uint64_t>> chunks {};
+
+  void insert_part(const uint64_t ts, const size_t format_idx,
+                   const unsigned int part, const int value)
+  {
+    auto & chunk = chunks[ts];
+    chunk.first.resize(NUM_FORMATS);
+    chunk.first[format_idx] = value;
+    chunk.second |= uint64_t(1) << (part * NUM_FORMATS + format_idx);
+  }
+
+  void erase_until(const uint64_t ts)
+  {
+    chunks.erase(chunks.begin(), chunks.upper_bound(ts));
+  }
+};
+
+static void compare(const ChunkIndex<int> & index, const Model & model,
+                    const vector<uint64_t> & probes, const string & context)
+{
+  for (const uint64_t ts : probes) {
+    const auto it = model.chunks.find(ts);
+    const auto * entries = index.find(ts);
+
+    check((entries != nullptr) == (it != model.chunks.end()),
+          context + ": find(" + to_string(ts) + ")");
+    const uint64_t arrived =
+      it == model.chunks.end() ? 0 : it->second.second;
+    check(index.arrived(ts) == arrived,
+          context + ": arrived(" + to_string(ts) + ")");
+
+    if (entries) {
+      check(*entries == it->second.first,
+            context + ": entries at " + to_string(ts));
+    }
+  }
+
+  vector<uint64_t> order;
+  index.for_each(
+    [&index, &order](const uint64_t ts, const vector<int> & entries) {
+      check(&entries == index.find(ts), "for_each() entries");
+      order.push_back(ts);
+    }
+  );
+
+  vector<uint64_t> expected;
+  for (const auto & [ts, chunk] : model.chunks) {
+    expected.push_back(ts);
+  }
+
+  check(order == expected, context + ": for_each() visited "
+        + to_string(order.size()) + " timestamps, expected "
+        + to_string(expected.size()));
+
+  const auto first = index.first_ts();
+  check(first.has_value() == not model.chunks.empty() and
+        (not first or *first == model.chunks.begin()->first),
+        context + ": first_ts()");
+}
+
+static void test_random()
+{
+  mt19937 rng(7);
+  uniform_int_distribution<unsigned int> percent(0, 99);
+
+  for (unsigned int run = 0; run < 50; run++) {
+    ChunkIndex<int> index(DURATION, NUM_FORMATS, NUM_PARTS);
+    Model model;
+
+    /* the timestamps cluster around a few origins, far apart */
+    const vector<uint64_t> origins = {
+      1000000, 1000000 + 3 * ChunkIndex<int>::MAX_GAP_SLOTS,
+      100 * ChunkIndex<int>::MAX_GAP_SLOTS, 0};
+    vector<uint64_t> probes;
+
+    for (unsigned int step = 0; step < 3000; step++) {
+      const string context = "run " + to_string(run) + ", step "
+                             + to_string(step);
+
+      if (percent(rng) < 2) {
+        /* erase up to a timestamp inserted so far */
+        const uint64_t ts = probes.at(rng() % probes.size());
+        index.erase_until(ts);
+        model.erase_until(ts);
+      } else {
+        const uint64_t origin = origins.at(rng() % origins.size());
+        const uint64_t ts = (origin + rng() % 200) * DURATION;
+        const size_t format_idx = rng() % NUM_FORMATS;
+        const unsigned int part = rng() % NUM_PARTS;
+        const int value = static_cast<int>(rng());
+
+        index.insert_part(ts, format_idx, part) = value;
+        model.insert_part(ts, format_idx, part, value);
+        probes.push_back(ts);
+        probes.push_back(ts + DURATION);
+      }
+
+      if (step % 100 == 0) {
+        compare(index, model, probes, context);
+      }
+    }
+
+    compare(index, model, probes, "run " + to_string(run));
+  }
+}
+
+/* a stray timestamp far from the others does not allocate the slots in
+ * between, whether above or below them, and is moved into the slots once
+ * they reach it */
+static void test_outliers()
+{
+  ChunkIndex<int> index(DURATION, NUM_FORMATS);
+  const uint64_t base = 1000000;
+
+  index.insert(base * DURATION, 0) = 1;
+  index.insert((base + 1000 * ChunkIndex<int>::MAX_GAP_SLOTS) * DURATION,
+               0) = 2;
+  index.insert((base - 10 * ChunkIndex<int>::MAX_GAP_SLOTS) * DURATION,
+               0) = 3;
+  check(index.num_outliers() == 2, "far timestamps kept apart: "
+        + to_string(index.num_outliers()));
+
+  const uint64_t near = base + ChunkIndex<int>::MAX_GAP_SLOTS + 10;
+  index.insert(near * DURATION, 1) = 4;
+  check(index.num_outliers() == 3, "timestamp beyond the gap kept apart");
+
+  /* filling in the gap brings it into the slots */
+  index.insert((base + ChunkIndex<int>::MAX_GAP_SLOTS / 2) * DURATION, 2) = 5;
+  index.insert((near + 1) * DURATION, 2) = 6;
+  check(index.num_outliers() == 2, "outlier reached by the slots");
+  check(index.at(near * DURATION, 1) == 4, "outlier moved into the slots");
+
+  check(index.erase_until((base + 1000 * ChunkIndex<int>::MAX_GAP_SLOTS)
+                          * DURATION)
+        == (base + 1000 * ChunkIndex<int>::MAX_GAP_SLOTS) * DURATION,
+        "largest erased timestamp");
+  check(index.num_outliers() == 0 and not index.first_ts(), "all erased");
+}
+
+int main(int argc, char * argv[])
+{
+  if (argc < 1) {
+    abort();
+  }
+
+  try {
+    test_random();
+    test_outliers();
+  } catch (const exception & e) {
+    print_exception(argv[0], e);
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
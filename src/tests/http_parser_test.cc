@@ -0,0 +1,205 @@
+/* pipelined HTTP requests and responses (with chunked bodies) fed to the
+ * parsers in pieces of a few sizes, so that lines, CRLFs, chunk headers and
+ * bodies are split at every offset: each message must be parsed as when fed
+ * at once, and be complete once its last byte has been fed, not before */
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "http_request_parser.hh"
+#include "http_response_parser.hh"
+#include "exception.hh"
+
+using namespace std;
+
+static const vector<size_t> PIECE_SIZES = {1, 2, 3, 7, 1000};
+
+static void check(const bool condition, const string & message)
+{
+  if (not condition) {
+    throw runtime_error(message);
+  }
+}
+
+/* a message of a stream and what it must be parsed into */
+struct Expected
+{
+  string text;        /* as sent */
+  string first_line;
+  string body;
+  string header {};   /* the name of a header to check, if any */
+  string value {};
+};
+
+static string stream_of(const vector<Expected> & messages)
+{
+  string stream;
+  for (const auto & message : messages) {
+    stream += message.text;
+  }
+  return stream;
+}
+
+/* the offsets in the stream at which each message ends */
+static vector<size_t> ends_of(const vector<Expected> & messages)
+{
+  vector<size_t> ends;
+  size_t end = 0;
+  for (const auto & message : messages) {
+    end += message.text.size();
+    ends.push_back(end);
+  }
+  return ends;
+}
+
+template<class Message>
+static void check_message(const Message & message, const Expected & expected,
+                          const string & context)
+{
+  check(message.first_line() == expected.first_line,
+        context + ": first line \"" + message.first_line() + "\"");
+  check(message.body() == expected.body,
+        context + ": body \"" + message.body() + "\"");
+
+  if (not expected.header.empty()) {
+    check(message.has_header(expected.header)
+          and message.get_header_value(expected.header) == expected.value,
+          context + ": header " + expected.header);
+  }
+}
+
+/* feed stream in pieces of piece_size, checking the messages as they
+ * complete; the parser gets an EOF at the end if eof */
+template<class Parser>
+static void feed(Parser & parser, const vector<Expected> & messages,
+                 const size_t piece_size, const bool eof, const string & name)
+{
+  const string stream = stream_of(messages);
+  const vector<size_t> ends = ends_of(messages);
+  size_t num_complete = 0;
+
+  const auto collect = [&](const size_t fed) {
+    while (not parser.empty()) {
+      const string context = name + " " + to_string(num_complete)
+                             + " in pieces of " + to_string(piece_size);
+      check(num_complete < messages.size(), context + ": extra message");
+      check(fed >= ends[num_complete],
+            context + ": complete after " + to_string(fed) + " bytes of "
+            + to_string(ends[num_complete]));
+
+      check_message(parser.front(), messages[num_complete], context);
+      parser.pop();
+      num_complete++;
+    }
+
+    /* all messages that were fed completely, but a body that ends at EOF */
+    const size_t fed_complete = upper_bound(ends.begin(), ends.end(), fed)
+                                - ends.begin();
+    check(num_complete == fed_complete or (eof and fed == stream.size()),
+          name + " in pieces of " + to_string(piece_size) + ": "
+          + to_string(num_complete) + " messages after " + to_string(fed)
+          + " bytes, expected " + to_string(fed_complete));
+  };
+
+  for (size_t fed = 0; fed < stream.size(); fed += piece_size) {
+    parser.parse(string_view(stream).substr(fed, piece_size));
+    collect(min(fed + piece_size, stream.size()));
+  }
+
+  if (eof) {
+    parser.parse("");
+    collect(stream.size());
+  }
+
+  check(num_complete == messages.size(),
+        name + " in pieces of " + to_string(piece_size) + ": "
+        + to_string(num_complete) + " messages");
+}
+
+static const vector<Expected> requests = {
+  {"GET /a HTTP/1.1\r\nHost: example.com\r\n\r\n",
+   "GET /a HTTP/1.1", "", "Host", "example.com"},
+
+  /* a body with a CRLF, which must not be taken for the end of a line */
+  {"POST /b HTTP/1.1\r\nContent-Length: 12\r\n\r\nhello\r\nworld",
+   "POST /b HTTP/1.1", "hello\r\nworld", "Content-Length", "12"},
+
+  /* a line longer than the larger pieces */
+  {"GET /c HTTP/1.1\r\nX-Long: " + string(3000, 'x') + "\r\n\r\n",
+   "GET /c HTTP/1.1", "", "X-Long", string(3000, 'x')},
+
+  {"HEAD /d HTTP/1.1\r\n\r\n", "HEAD /d HTTP/1.1", ""},
+
+  {"PUT /e HTTP/1.1\r\nContent-Length: 0\r\n\r\n", "PUT /e HTTP/1.1", ""},
+};
+
+/* the chunked bodies are kept as sent */
+static const string CHUNKED = "5\r\nhello\r\n7;ext=1\r\n, \r\nwor\r\n"
+                              "2\r\nld\r\n0\r\n\r\n";
+static const string CHUNKED_TRAILER = "3\r\nabc\r\n0\r\nX-Sum: 6\r\n\r\n";
+
+/* in response to requests in order, the last one ending at EOF */
+static const vector<Expected> responses = {
+  {"HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n" + CHUNKED,
+   "HTTP/1.1 200 OK", CHUNKED, "Transfer-Encoding", "chunked"},
+
+  {"HTTP/1.1 201 Created\r\nContent-Length: 4\r\n\r\n\r\n\r\n",
+   "HTTP/1.1 201 Created", "\r\n\r\n"},
+
+  {"HTTP/1.1 200 OK\r\nTrailer: X-Sum\r\nTransfer-Encoding: chunked\r\n\r\n"
+   + CHUNKED_TRAILER, "HTTP/1.1 200 OK", CHUNKED_TRAILER},
+
+  /* no body in response to HEAD, whatever its Content-Length */
+  {"HTTP/1.1 200 OK\r\nContent-Length: 100\r\n\r\n", "HTTP/1.1 200 OK", ""},
+
+  {"HTTP/1.1 200 OK\r\n\r\nuntil EOF\r\n", "HTTP/1.1 200 OK", "until EOF\r\n"},
+};
+
+static void test_requests()
+{
+  for (const size_t piece_size : PIECE_SIZES) {
+    HTTPRequestParser parser;
+    feed(parser, requests, piece_size, false, "request");
+  }
+}
+
+static void test_responses()
+{
+  /* the requests the responses are matched with */
+  vector<HTTPRequest> sent;
+  HTTPRequestParser request_parser;
+  request_parser.parse(stream_of(requests));
+  for (; not request_parser.empty(); request_parser.pop()) {
+    sent.push_back(request_parser.front());
+  }
+
+  for (const size_t piece_size : PIECE_SIZES) {
+    HTTPResponseParser parser;
+    for (const auto & request : sent) {
+      parser.new_request_arrived(request);
+    }
+
+    feed(parser, responses, piece_size, true, "response");
+  }
+}
+
+int main(int argc, char * argv[])
+{
+  if (argc < 1) {
+    abort();
+  }
+
+  try {
+    test_requests();
+    test_responses();
+  } catch (const exception & e) {
+    print_exception(argv[0], e);
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,238 @@
+/* MPCLookahead's branch and bound against an exhaustive search over every
+ * path of the horizon, on random ladders, sending times and buffers: the
+ * format it picks must be as good as the best one */
+
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "mpc_lookahead.hh"
+#include "exception.hh"
+
+using namespace std;
+
+static const unsigned int NUM_CASES = 2000;
+static const double MAX_BUFFER_S = 15;
+static const double CHUNK_LENGTH = 2.002;
+
+static void check(const bool condition, const string & message)
+{
+  if (not condition) {
+    throw runtime_error(message);
+  }
+}
+
+/* a decision: the tables of MPCLookahead and how they are searched */
+struct Case
+{
+  size_t horizon {0};
+  size_t num_formats {0};
+  bool is_init {false};
+  double curr_buffer {0};
+  double unit_buf_length {0};
+  double rebuffer_length_coeff {0};
+  double ssim_diff_coeff {0};
+
+  double last_ssim {0};
+  vector<vector<double>> ssims {};          /* [1, horizon][format] */
+  vector<vector<double>> sending_times {};  /* [1, horizon][format] */
+
+  string str() const
+  {
+    return to_string(num_formats) + " formats, " + to_string(horizon)
+           + " chunks, buffer " + to_string(curr_buffer)
+           + (unit_buf_length > 0 ? " (discrete)" : "")
+           + (is_init ? ", first chunk" : "")
+           + ", coefficients " + to_string(rebuffer_length_coeff) + " and "
+           + to_string(ssim_diff_coeff);
+  }
+};
+
+static Case random_case(mt19937 & rng)
+{
+  uniform_real_distribution<double> unit(0, 1);
+  Case c;
+
+  c.horizon = uniform_int_distribution<size_t>(1, 5)(rng);
+  c.num_formats = uniform_int_distribution<size_t>(1, 10)(rng);
+  c.is_init = unit(rng) < 0.2;
+  c.curr_buffer = unit(rng) * MAX_BUFFER_S;
+  c.unit_buf_length = unit(rng) < 0.5 ? MAX_BUFFER_S / 100 : 0;
+
+  /* the defaults of MPCSearch, or random ones (with some zeros) */
+  if (unit(rng) < 0.3) {
+    c.rebuffer_length_coeff = 20;
+    c.ssim_diff_coeff = 1;
+  } else {
+    c.rebuffer_length_coeff = unit(rng) < 0.1 ? 0 : unit(rng) * 50;
+    c.ssim_diff_coeff = unit(rng) < 0.1 ? 0 : unit(rng) * 3;
+  }
+
+  c.last_ssim = c.is_init ? 0 : 5 + unit(rng) * 15;
+
+  /* mostly a ladder, whose SSIM and size increase with the format and vary
+   * with the chunk, else arbitrary */
+  const bool ladder = unit(rng) < 0.8;
+  const double throughput = 0.1 + unit(rng) * 5;  /* MB/s */
+
+  c.ssims.assign(c.horizon + 1, vector<double>(c.num_formats));
+  c.sending_times.assign(c.horizon + 1, vector<double>(c.num_formats));
+  for (size_t i = 1; i <= c.horizon; i++) {
+    const double complexity = 0.5 + unit(rng);
+    for (size_t j = 0; j < c.num_formats; j++) {
+      if (ladder) {
+        c.ssims[i][j] = 8 + 1.5 * j / complexity + unit(rng);
+        c.sending_times[i][j] = 0.1 * (j + 1) * complexity / throughput;
+      } else {
+        c.ssims[i][j] = unit(rng) * 20;
+        c.sending_times[i][j] = unit(rng) * 10;
+      }
+    }
+  }
+
+  return c;
+}
+
+static double discretize(const Case & c, const double buf)
+{
+  if (c.unit_buf_length == 0) {
+    return buf;
+  }
+
+  return floor((buf + c.unit_buf_length * 0.5) / c.unit_buf_length)
+         * c.unit_buf_length;
+}
+
+/* the best value of the paths from chunk i of format (after i chunks, with
+ * buffer), summing the SSIM of each chunk less the penalties for switching
+ * to the next one and for rebuffering while it is sent */
+static double exhaustive_value(const Case & c, const size_t i,
+                               const size_t format, const double buffer)
+{
+  const double ssim = i == 0 ? c.last_ssim : c.ssims[i][format];
+  if (i == c.horizon) {
+    return ssim;
+  }
+
+  double best = -INFINITY;
+  for (size_t next = 0; next < c.num_formats; next++) {
+    const double rebuffer = c.sending_times[i + 1][next] - buffer;
+    const double switch_cost = (c.is_init and i == 0) ? 0 :
+      c.ssim_diff_coeff * fabs(ssim - c.ssims[i + 1][next]);
+    const double next_buffer = discretize(c,
+      min(MAX_BUFFER_S, max(0.0, -rebuffer) + CHUNK_LENGTH));
+
+    best = max(best, ssim - switch_cost
+                     - c.rebuffer_length_coeff * max(0.0, rebuffer)
+                     + exhaustive_value(c, i + 1, next, next_buffer));
+  }
+
+  return best;
+}
+
+/* the value of picking format for the next chunk */
+static double exhaustive_qvalue(const Case & c, const size_t format)
+{
+  Case first = c;
+  first.ssims[1].assign(c.num_formats, -INFINITY);
+  first.ssims[1][format] = c.ssims[1][format];
+
+  return exhaustive_value(first, 0, 0, discretize(c, c.curr_buffer));
+}
+
+/* search c with lookahead, from first_format */
+static size_t search(MPCLookahead & lookahead, const Case & c,
+                     const size_t first_format)
+{
+  lookahead.reset(c.horizon, c.num_formats, CHUNK_LENGTH, c.is_init);
+
+  lookahead.ssim(0, 0) = c.last_ssim;
+  for (size_t i = 1; i <= c.horizon; i++) {
+    for (size_t j = 0; j < c.num_formats; j++) {
+      lookahead.ssim(i, j) = c.ssims[i][j];
+      lookahead.sending_time(i, j) = c.sending_times[i][j];
+    }
+  }
+
+  return lookahead.search(discretize(c, c.curr_buffer), first_format);
+}
+
+static bool close(const double a, const double b)
+{
+  return fabs(a - b) <= 1e-9 * max(1.0, max(fabs(a), fabs(b)));
+}
+
+static void test_random_cases()
+{
+  mt19937 rng(20260415);
+  size_t pruned_nodes = 0, exhaustive_nodes = 0;
+
+  for (unsigned int n = 0; n < NUM_CASES; n++) {
+    const Case c = random_case(rng);
+    const size_t first_format =
+      uniform_int_distribution<size_t>(0, c.num_formats - 1)(rng);
+
+    const double best = exhaustive_value(c, 0, 0,
+                                         discretize(c, c.curr_buffer));
+
+    for (const bool prune : {true, false}) {
+      MPCLookahead lookahead(c.rebuffer_length_coeff, c.ssim_diff_coeff,
+                             prune, MAX_BUFFER_S, c.unit_buf_length, 0, 0);
+
+      const size_t format = search(lookahead, c, first_format);
+      const string context = "case " + to_string(n) + " ("
+                             + c.str() + (prune ? ", pruned" : "") + ")";
+
+      check(format < c.num_formats, context + ": no format");
+      check(close(lookahead.value(), best),
+            context + ": value " + to_string(lookahead.value())
+            + ", best " + to_string(best));
+      check(close(exhaustive_qvalue(c, format), best),
+            context + ": format " + to_string(format) + " is worth "
+            + to_string(exhaustive_qvalue(c, format)) + ", best "
+            + to_string(best));
+
+      (prune ? pruned_nodes : exhaustive_nodes) += lookahead.num_nodes();
+    }
+  }
+
+  check(pruned_nodes < exhaustive_nodes,
+        "pruning expanded " + to_string(pruned_nodes) + " states, "
+        + "the exhaustive search " + to_string(exhaustive_nodes));
+}
+
+/* a search cut short by its budget still picks a format */
+static void test_budget()
+{
+  mt19937 rng(1);
+
+  for (unsigned int n = 0; n < 100; n++) {
+    const Case c = random_case(rng);
+    MPCLookahead lookahead(c.rebuffer_length_coeff, c.ssim_diff_coeff, true,
+                           MAX_BUFFER_S, c.unit_buf_length, 1, 0);
+
+    const size_t format = search(lookahead, c, 0);
+    check(format < c.num_formats, "no format within the budget");
+    check(lookahead.num_nodes() <= 1, "budget of 1 state exceeded");
+  }
+}
+
+int main(int argc, char * argv[])
+{
+  if (argc < 1) {
+    abort();
+  }
+
+  try {
+    test_random_cases();
+    test_budget();
+  } catch (const exception & e) {
+    print_exception(argv[0], e);
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,120 @@
+/* producers push numbered items concurrently into a small MPSCQueue (so
+ * that it is often full) and a poller consumes them: every item must arrive
+ * exactly once, and the items of each producer in the order pushed */
+
+#include <atomic>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "mpsc_queue.hh"
+#include "poller.hh"
+#include "exception.hh"
+
+using namespace std;
+
+static const size_t NUM_PRODUCERS = 8;
+static const uint64_t ITEMS_PER_PRODUCER = 100000;
+static const size_t CAPACITY = 64;
+
+/* of an item: its producer and its number within that producer's items */
+using Item = pair<size_t, uint64_t>;
+
+static void check(const bool condition, const string & message)
+{
+  if (not condition) {
+    throw runtime_error(message);
+  }
+}
+
+static void test_single_thread()
+{
+  MPSCQueue<Item> queue(4);
+  check(not queue.pop(), "pop from an empty queue");
+
+  for (uint64_t i = 0; i < 4; i++) {
+    check(queue.push({0, i}), "push into a queue with room");
+  }
+  check(not queue.push({0, 4}), "push into a full queue");
+
+  /* the slots wrap around */
+  for (uint64_t i = 0; i < 10; i++) {
+    const auto item = queue.pop();
+    check(item and item->second == i, "pop in the order pushed");
+    check(queue.push({0, i + 4}), "push after a pop");
+  }
+}
+
+static void test_producers()
+{
+  MPSCQueue<Item> queue(CAPACITY);
+  Poller poller;
+
+  vector<uint64_t> next(NUM_PRODUCERS, 0);  /* expected of each producer */
+  uint64_t num_received = 0;
+
+  queue.add_to_poller(poller, [&](Item && item) {
+    const auto & [producer, number] = item;
+    check(producer < NUM_PRODUCERS, "item of an unknown producer");
+    check(number == next[producer],
+          "producer " + to_string(producer) + ": got item "
+          + to_string(number) + ", expected " + to_string(next[producer]));
+    next[producer]++;
+    num_received++;
+  });
+
+  /* set to stop the producers if the consumer fails */
+  atomic<bool> abandon {false};
+
+  vector<thread> producers;
+  for (size_t p = 0; p < NUM_PRODUCERS; p++) {
+    producers.emplace_back([&queue, &abandon, p]() {
+      for (uint64_t i = 0; i < ITEMS_PER_PRODUCER and not abandon; i++) {
+        while (not queue.push({p, i}) and not abandon) {
+          this_thread::yield();  /* full */
+        }
+      }
+    });
+  }
+
+  try {
+    /* a lost wakeup would leave items in the queue with the poller asleep */
+    while (num_received < NUM_PRODUCERS * ITEMS_PER_PRODUCER) {
+      const auto result = poller.poll(5000);
+      check(result.result != Poller::Result::Type::Timeout,
+            "no wakeup with " + to_string(num_received) + " items received");
+    }
+  } catch (const exception &) {
+    abandon = true;
+    for (auto & producer : producers) {
+      producer.join();
+    }
+    throw;
+  }
+
+  for (auto & producer : producers) {
+    producer.join();
+  }
+
+  check(not queue.pop(), "item left after all were received");
+}
+
+int main(int argc, char * argv[])
+{
+  if (argc < 1) {
+    abort();
+  }
+
+  try {
+    test_single_thread();
+    test_producers();
+  } catch (const exception & e) {
+    print_exception(argv[0], e);
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -9,6 +9,7 @@ import signal
 import uuid
 from functools import wraps
 import tempfile
+import time
 from shutil import copyfile
 
 
@@ -108,3 +109,14 @@ def copy_move(src_path, dst_path):
     tmp_path = path.join(tempfile.gettempdir(), path.basename(src_path))
     copyfile(src_path, tmp_path)
     os.rename(tmp_path, dst_path)
+
+
+# poll until predicate() holds, returning False if it still does not after
+# timeout seconds (e.g., for a long-running process to act on a file)
+def wait_until(predicate, timeout=10, interval=0.01):
+    deadline = time.time() + timeout
+    while not predicate():
+        if time.time() > deadline:
+            return False
+        time.sleep(interval)
+    return True
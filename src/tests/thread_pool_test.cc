@@ -0,0 +1,132 @@
+/* every task submitted to a ThreadPool runs exactly once, whether it is
+ * waited for or left queued when the pool is destroyed, including the
+ * tasks that tasks submit and those that throw */
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "thread_pool.hh"
+#include "exception.hh"
+
+using namespace std;
+
+static const unsigned int NUM_THREADS = 4;
+static const size_t NUM_TASKS = 10000;
+static const size_t NUM_SUBTASKS = 4;
+
+static void check(const bool condition, const string & message)
+{
+  if (not condition) {
+    throw runtime_error(message);
+  }
+}
+
+/* how many times each task has run */
+using RunCounts = vector<atomic<unsigned int>>;
+
+static void check_ran_once(const RunCounts & runs)
+{
+  for (size_t i = 0; i < runs.size(); i++) {
+    check(runs[i] == 1, "task " + to_string(i) + " ran "
+                        + to_string(runs[i]) + " times");
+  }
+}
+
+/* tasks from several threads at once, and subtasks from the workers */
+static void test_wait()
+{
+  RunCounts runs(NUM_TASKS * (1 + NUM_SUBTASKS));
+  ThreadPool pool(NUM_THREADS);
+
+  vector<thread> submitters;
+  for (size_t s = 0; s < 2; s++) {
+    submitters.emplace_back([&pool, &runs, s]() {
+      for (size_t i = s; i < NUM_TASKS; i += 2) {
+        pool.submit([&pool, &runs, i]() {
+          runs[i]++;
+
+          for (size_t j = 0; j < NUM_SUBTASKS; j++) {
+            pool.submit([&runs, i, j]() {
+              runs[NUM_TASKS + i * NUM_SUBTASKS + j]++;
+            });
+          }
+        });
+      }
+    });
+  }
+
+  for (auto & submitter : submitters) {
+    submitter.join();
+  }
+
+  pool.wait();
+  check_ran_once(runs);
+}
+
+/* the destructor runs what is still queued, and a task that throws does
+ * not take its worker down */
+static void test_shutdown_drains()
+{
+  RunCounts runs(NUM_TASKS);
+
+  {
+    ThreadPool pool(NUM_THREADS);
+
+    /* hold the workers up so that the tasks pile up in the deques */
+    for (unsigned int t = 0; t < NUM_THREADS; t++) {
+      pool.submit([]() { this_thread::sleep_for(chrono::milliseconds(50)); });
+    }
+
+    for (size_t i = 0; i < NUM_TASKS; i++) {
+      pool.submit([&runs, i]() {
+        runs[i]++;
+        if (i % 5000 == 0) {
+          throw runtime_error("expected exception of task " + to_string(i));
+        }
+      });
+    }
+  }
+
+  check_ran_once(runs);
+}
+
+static void test_wait_from_worker()
+{
+  ThreadPool pool(1);
+  atomic<bool> threw {false};
+
+  pool.submit([&pool, &threw]() {
+    try {
+      pool.wait();
+    } catch (const runtime_error &) {
+      threw = true;
+    }
+  });
+
+  pool.wait();
+  check(threw, "wait() from a worker did not throw");
+}
+
+int main(int argc, char * argv[])
+{
+  if (argc < 1) {
+    abort();
+  }
+
+  try {
+    test_wait();
+    test_shutdown_drains();
+    test_wait_from_worker();
+  } catch (const exception & e) {
+    print_exception(argv[0], e);
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
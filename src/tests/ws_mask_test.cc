@@ -0,0 +1,101 @@
+/* WSFrame::mask, which XORs a vector at a time where it can, against a loop
+ * over the bytes: payloads of every length modulo the vector widths, at
+ * every alignment, with random keys; the bytes around the payload must be
+ * left as they are */
+
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "ws_frame.hh"
+#include "exception.hh"
+
+using namespace std;
+
+/* lengths 0 to MAX_SHORT_LENGTH (every remainder modulo 16 and 32 several
+ * times over), then some longer ones */
+static const size_t MAX_SHORT_LENGTH = 200;
+static const vector<size_t> LONG_LENGTHS = {1000, 1023, 1024, 1025, 4096 + 17,
+                                            65536 + 31};
+static const size_t MAX_OFFSET = 64;  /* alignments: 0 to MAX_OFFSET - 1 */
+static const size_t GUARD = 64;       /* bytes checked after the payload */
+
+static void check(const bool condition, const string & message)
+{
+  if (not condition) {
+    throw runtime_error(message);
+  }
+}
+
+static void scalar_mask(char * data, const size_t length,
+                        const uint32_t masking_key)
+{
+  /* the key is applied in network byte order */
+  for (size_t i = 0; i < length; i++) {
+    data[i] ^= static_cast<char>(masking_key >> (8 * (3 - i % 4)));
+  }
+}
+
+static void test_mask(mt19937 & rng, const size_t length, const size_t offset)
+{
+  const uint32_t masking_key = rng();
+  const string context = to_string(length) + " bytes at offset "
+                         + to_string(offset) + " with key "
+                         + to_string(masking_key);
+
+  /* the vector is aligned for any vector type, so offset is the alignment */
+  vector<char> original(MAX_OFFSET + length + GUARD);
+  for (auto & byte : original) {
+    byte = static_cast<char>(rng());
+  }
+
+  vector<char> expected = original;
+  scalar_mask(expected.data() + offset, length, masking_key);
+
+  vector<char> masked = original;
+  WSFrame::mask(masked.data() + offset, length, masking_key);
+  check(masked == expected, "mask of " + context);
+
+  /* masking again unmasks */
+  WSFrame::mask(masked.data() + offset, length, masking_key);
+  check(masked == original, "unmask of " + context);
+}
+
+int main(int argc, char * argv[])
+{
+  if (argc < 1) {
+    abort();
+  }
+
+  try {
+    mt19937 rng(14);
+
+    for (size_t length = 0; length <= MAX_SHORT_LENGTH; length++) {
+      for (size_t offset = 0; offset < MAX_OFFSET; offset++) {
+        test_mask(rng, length, offset);
+      }
+    }
+
+    for (const size_t length : LONG_LENGTHS) {
+      for (size_t offset = 0; offset < MAX_OFFSET; offset++) {
+        test_mask(rng, length, offset);
+      }
+    }
+
+    /* the key bytes that are all zeros or all ones */
+    for (const uint32_t masking_key : {0u, 0xffffffffu, 0x000000ffu}) {
+      string data(100, 'x');
+      string expected = data;
+      WSFrame::mask(data.data() + 3, 90, masking_key);
+      scalar_mask(expected.data() + 3, 90, masking_key);
+      check(data == expected, "mask with key " + to_string(masking_key));
+    }
+  } catch (const exception & e) {
+    print_exception(argv[0], e);
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
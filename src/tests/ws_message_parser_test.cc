@@ -0,0 +1,250 @@
+/* WebSocket frames fed to WSMessageParser in pieces of a few sizes, so that
+ * headers, extended lengths, masking keys and masked payloads are split
+ * across reads: fragmented messages (with control frames between their
+ * fragments), payloads of 7-, 16- and 64-bit lengths, oversized frames and
+ * protocol errors */
+
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "ws_message_parser.hh"
+#include "ws_frame.hh"
+#include "serialization.hh"
+#include "exception.hh"
+
+using namespace std;
+
+using OpCode = WSFrame::OpCode;
+
+static const vector<size_t> PIECE_SIZES = {1, 2, 3, 7, 1000, 100000};
+
+static void check(const bool condition, const string & message)
+{
+  if (not condition) {
+    throw runtime_error(message);
+  }
+}
+
+/* a message as parsed, copied out of the parser */
+using Message = pair<OpCode, string>;
+
+static string frame(const bool fin, const OpCode opcode,
+                    const string & payload, const uint32_t masking_key)
+{
+  return WSFrame(fin, opcode, payload, masking_key).to_string();
+}
+
+static string frame(const bool fin, const OpCode opcode,
+                    const string & payload)
+{
+  return WSFrame(fin, opcode, payload).to_string();
+}
+
+/* a payload that is not the same when masked, whatever the key */
+static string payload_of(const size_t length)
+{
+  string payload(length, '\0');
+  for (size_t i = 0; i < length; i++) {
+    payload[i] = static_cast<char>(i * 7 + i / 251);
+  }
+  return payload;
+}
+
+/* feed stream in pieces of piece_size, copying out the messages after each
+ * piece as their views only last until the next parse() */
+static vector<Message> feed(const string & stream, const size_t piece_size)
+{
+  WSMessageParser parser;
+  vector<Message> messages;
+
+  for (size_t fed = 0; fed < stream.size(); fed += piece_size) {
+    parser.parse(string_view(stream).substr(fed, piece_size));
+
+    for (; not parser.empty(); parser.pop()) {
+      messages.emplace_back(parser.front().type(),
+                            string(parser.front().payload()));
+    }
+  }
+
+  check(parser.idle(), "bytes left in the parser");
+  return messages;
+}
+
+static void check_stream(const string & name, const string & stream,
+                         const vector<Message> & expected)
+{
+  for (const size_t piece_size : PIECE_SIZES) {
+    const string context = name + " in pieces of " + to_string(piece_size);
+    const vector<Message> messages = feed(stream, piece_size);
+
+    check(messages.size() == expected.size(),
+          context + ": " + to_string(messages.size()) + " messages");
+
+    for (size_t i = 0; i < messages.size(); i++) {
+      check(messages[i].first == expected[i].first,
+            context + ": type of message " + to_string(i));
+      check(messages[i].second == expected[i].second,
+            context + ": payload of message " + to_string(i) + " ("
+            + to_string(messages[i].second.size()) + " bytes, expected "
+            + to_string(expected[i].second.size()) + ")");
+    }
+  }
+}
+
+/* payloads around the limits of the 7-bit and 16-bit lengths */
+static void test_lengths()
+{
+  const vector<pair<size_t, size_t>> header_lengths = {
+    {0, 2}, {125, 2}, {126, 4}, {65535, 4}, {65536, 10}, {200000, 10}};
+
+  for (const auto & [length, header_length] : header_lengths) {
+    const string payload = payload_of(length);
+    const string name = to_string(length) + "-byte payload";
+
+    const string unmasked = frame(true, OpCode::Binary, payload);
+    check(unmasked.size() == header_length + length,
+          name + ": header of " + to_string(unmasked.size() - length));
+
+    const string masked = frame(true, OpCode::Binary, payload, 0x12345678);
+    check(masked.size() == header_length + 4 + length,
+          name + ": masked header of " + to_string(masked.size() - length));
+
+    check_stream(name, unmasked, {{OpCode::Binary, payload}});
+    check_stream("masked " + name, masked, {{OpCode::Binary, payload}});
+
+    /* a 64-bit length that would fit in fewer bits is still understood */
+    if (length < 65536) {
+      const string long_header = string(1, '\x82') + '\x7f'
+        + put_field(static_cast<uint64_t>(length));
+      check_stream(name + " with a 64-bit length", long_header + payload,
+                   {{OpCode::Binary, payload}});
+    }
+  }
+}
+
+/* a message in fragments, each with a masking key of its own, with control
+ * frames between them, and followed by other messages */
+static void test_fragments()
+{
+  const string part1 = payload_of(1000);
+  const string part2 = "second part";
+  const string part3 = payload_of(70000);
+
+  const string stream =
+    frame(false, OpCode::Text, part1, 0xdeadbeef)
+    + frame(false, OpCode::Continuation, part2, 0x01020304)
+    + frame(true, OpCode::Ping, "ping", 0xa5a5a5a5)
+    + frame(false, OpCode::Continuation, "", 0x11111111)
+    + frame(true, OpCode::Pong, "", 0x22222222)
+    + frame(true, OpCode::Continuation, part3, 0xcafebabe)
+    + frame(true, OpCode::Binary, "whole", 0x33333333)
+    + frame(false, OpCode::Binary, "a", 0x44444444)
+    + frame(true, OpCode::Continuation, "b", 0x55555555)
+    + frame(true, OpCode::Close, "bye");
+
+  check_stream("fragmented messages", stream, {
+    {OpCode::Ping, "ping"},
+    {OpCode::Pong, ""},
+    {OpCode::Text, part1 + part2 + part3},
+    {OpCode::Binary, "whole"},
+    {OpCode::Binary, "ab"},
+    {OpCode::Close, "bye"},
+  });
+}
+
+/* a frame longer than what has arrived is buffered without a message, and
+ * is reported by buffer_bytes() for the server to cut it off */
+static void test_oversized()
+{
+  const uint64_t length = 1ull << 40;
+  const string header = string(1, '\x82') + '\xff' + put_field(length)
+                        + put_field(static_cast<uint32_t>(0x12345678));
+  const string payload = payload_of(100000);
+
+  WSMessageParser parser;
+  parser.parse(header);
+  check(parser.empty() and not parser.idle(), "header of an oversized frame");
+
+  for (size_t fed = 0; fed < payload.size(); fed += 1000) {
+    parser.parse(string_view(payload).substr(fed, 1000));
+    check(parser.empty(), "message from a frame that has not arrived");
+    check(parser.buffer_bytes() == header.size() + fed + 1000,
+          "buffer_bytes() of " + to_string(parser.buffer_bytes())
+          + " after " + to_string(header.size() + fed + 1000));
+  }
+
+  /* also of a message whose fragments have arrived (with the headers of
+   * all but the first, which the payloads are moved over) */
+  WSMessageParser fragments;
+  const string part = payload_of(5000);
+  const string stream = frame(false, OpCode::Binary, part, 1)
+                        + frame(false, OpCode::Continuation, part, 2);
+  fragments.parse(stream);
+  check(fragments.empty() and fragments.buffer_bytes() >= 2 * part.size()
+        and fragments.buffer_bytes() <= stream.size(),
+        "buffer_bytes() of a fragmented message: "
+        + to_string(fragments.buffer_bytes()));
+}
+
+static void check_error(const string & name, const string & stream)
+{
+  for (const size_t piece_size : PIECE_SIZES) {
+    WSMessageParser parser;
+    bool threw = false;
+
+    for (size_t fed = 0; fed < stream.size() and not threw;
+         fed += piece_size) {
+      try {
+        parser.parse(string_view(stream).substr(fed, piece_size));
+      } catch (const runtime_error &) {
+        threw = true;
+      }
+    }
+
+    check(threw, name + " in pieces of " + to_string(piece_size)
+                 + ": accepted");
+  }
+}
+
+static void test_errors()
+{
+  check_error("continuation without a message",
+              frame(true, OpCode::Continuation, "x", 1));
+
+  check_error("message in the middle of another",
+              frame(false, OpCode::Text, "x", 1)
+              + frame(true, OpCode::Binary, "y", 2));
+
+  check_error("fragmented control frame", frame(false, OpCode::Ping, "x", 1));
+
+  check_error("invalid opcode", string("\x83\x00", 2));
+
+  /* the most significant bit of a 64-bit length must be 0; the frame
+   * length would overflow otherwise */
+  check_error("64-bit length with the top bit set",
+              string(1, '\x82') + '\xff' + string(8, '\xff')
+              + put_field(static_cast<uint32_t>(1)) + "some bytes");
+}
+
+int main(int argc, char * argv[])
+{
+  if (argc < 1) {
+    abort();
+  }
+
+  try {
+    test_lengths();
+    test_fragments();
+    test_oversized();
+    test_errors();
+  } catch (const exception & e) {
+    print_exception(argv[0], e);
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
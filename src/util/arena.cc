@@ -0,0 +1,94 @@
+#include "arena.hh"
+
+#include <sys/mman.h>
+
+#include "exception.hh"
+
+using namespace std;
+
+Arena::~Arena()
+{
+  /* blocks still in use (e.g., by a thread_local map destroyed after the
+   * arena at thread exit) are left mapped */
+  if (bytes_in_use_ > 0) {
+    return;
+  }
+
+  for (void * chunk : chunks_) {
+    munmap(chunk, CHUNK_SIZE);
+  }
+}
+
+void Arena::map_chunk()
+{
+  /* map twice the size, to trim it to a chunk aligned to a huge page */
+  void * p = mmap(nullptr, 2 * CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    throw unix_error("mmap");
+  }
+
+  char * start = static_cast<char *>(p);
+  char * chunk = reinterpret_cast<char *>(
+    (reinterpret_cast<uintptr_t>(start) + CHUNK_SIZE - 1) & ~(CHUNK_SIZE - 1));
+
+  if (chunk > start) {
+    CheckSystemCall("munmap", munmap(start, chunk - start));
+  }
+  if (start + 2 * CHUNK_SIZE > chunk + CHUNK_SIZE) {
+    CheckSystemCall("munmap", munmap(chunk + CHUNK_SIZE,
+                                     start + CHUNK_SIZE - chunk));
+  }
+
+  /* only advice: transparent huge pages might be disabled */
+  madvise(chunk, CHUNK_SIZE, MADV_HUGEPAGE);
+
+  chunks_.push_back(chunk);
+  next_ = chunk;
+  end_ = chunk + CHUNK_SIZE;
+}
+
+void * Arena::allocate(const size_t size)
+{
+  const size_t block_size = round_up(size);
+  bytes_in_use_ += block_size;
+
+  if (block_size > MAX_BLOCK_SIZE) {
+    return ::operator new(block_size);
+  }
+
+  const size_t index = block_size / ALIGNMENT;
+  if (index < free_lists_.size() and free_lists_[index]) {
+    void * block = free_lists_[index];
+    free_lists_[index] = *static_cast<void **>(block);
+    return block;
+  }
+
+  /* the rest of the last chunk is abandoned if the block does not fit */
+  if (next_ == nullptr or size_t(end_ - next_) < block_size) {
+    map_chunk();
+  }
+
+  void * block = next_;
+  next_ += block_size;
+  return block;
+}
+
+void Arena::deallocate(void * p, const size_t size)
+{
+  const size_t block_size = round_up(size);
+  bytes_in_use_ -= block_size;
+
+  if (block_size > MAX_BLOCK_SIZE) {
+    ::operator delete(p);
+    return;
+  }
+
+  const size_t index = block_size / ALIGNMENT;
+  if (index >= free_lists_.size()) {
+    free_lists_.resize(index + 1, nullptr);
+  }
+
+  *static_cast<void **>(p) = free_lists_[index];
+  free_lists_[index] = p;
+}
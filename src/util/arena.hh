@@ -0,0 +1,99 @@
+#ifndef ARENA_HH
+#define ARENA_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+/* Memory for objects that live as long as a connection (e.g., the nodes of
+ * the maps of connections and clients), carved out of 2 MiB chunks that are
+ * advised to be backed by transparent huge pages, so that the state of
+ * thousands of connections sits in a few TLB entries rather than scattered
+ * over the heap. Freed blocks are kept on a free list per size (rounded up
+ * to ALIGNMENT) for the next object of that size; larger objects are left to
+ * operator new. Not thread-safe: each event loop has its own arenas. */
+class Arena
+{
+public:
+  static constexpr size_t CHUNK_SIZE = 2 * 1024 * 1024;
+  static constexpr size_t ALIGNMENT = 16;
+  static constexpr size_t MAX_BLOCK_SIZE = CHUNK_SIZE / 8;
+
+  Arena() {}
+  ~Arena();
+
+  void * allocate(const size_t size);
+  void deallocate(void * p, const size_t size);
+
+  /* bytes allocated and not freed (including those left to operator new),
+   * and bytes of the chunks mapped */
+  size_t bytes_in_use() const { return bytes_in_use_; }
+  size_t bytes_mapped() const { return chunks_.size() * CHUNK_SIZE; }
+
+  /* forbid copying, as the allocators refer to this */
+  Arena(const Arena & other) = delete;
+  const Arena & operator=(const Arena & other) = delete;
+
+private:
+  std::vector<void *> chunks_ {};
+  char * next_ {nullptr};  /* the unused rest of the last chunk */
+  char * end_ {nullptr};
+
+  /* index: size / ALIGNMENT */
+  std::vector<void *> free_lists_ {};
+
+  size_t bytes_in_use_ {0};
+
+  void map_chunk();
+
+  /* to a multiple of ALIGNMENT, with room for a free list's pointer */
+  static size_t round_up(const size_t size)
+  {
+    return size == 0 ? ALIGNMENT : (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+  }
+};
+
+/* an STL allocator that allocates from an Arena, e.g., for a std::map */
+template<class T>
+class ArenaAllocator
+{
+public:
+  using value_type = T;
+
+  ArenaAllocator(Arena & arena) : arena_(&arena) {}
+
+  template<class U>
+  ArenaAllocator(const ArenaAllocator<U> & other) : arena_(other.arena()) {}
+
+  T * allocate(const size_t n)
+  {
+    static_assert(alignof(T) <= Arena::ALIGNMENT);
+    if (n > SIZE_MAX / sizeof(T)) {
+      throw std::bad_array_new_length();
+    }
+
+    return static_cast<T *>(arena_->allocate(n * sizeof(T)));
+  }
+
+  void deallocate(T * p, const size_t n) { arena_->deallocate(p, n * sizeof(T)); }
+
+  Arena * arena() const { return arena_; }
+
+  template<class U>
+  bool operator==(const ArenaAllocator<U> & other) const
+  {
+    return arena_ == other.arena();
+  }
+
+  template<class U>
+  bool operator!=(const ArenaAllocator<U> & other) const
+  {
+    return arena_ != other.arena();
+  }
+
+private:
+  Arena * arena_;
+};
+
+#endif /* ARENA_HH */
@@ -0,0 +1,83 @@
+#include "batch.hh"
+
+#include <iostream>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+int run_batch(const function<void(const string & input_path,
+                                  const string & output_path)> & job,
+              const size_t num_threads)
+{
+  mutex mtx;
+  condition_variable cv;
+  deque<string> lines;
+  bool eof = false;
+
+  auto worker = [&]() {
+    for (;;) {
+      string line;
+
+      {
+        unique_lock<mutex> lock(mtx);
+        cv.wait(lock, [&]() { return eof or not lines.empty(); });
+
+        if (lines.empty()) {
+          return;
+        }
+
+        line = move(lines.front());
+        lines.pop_front();
+      }
+
+      const size_t space = line.find(' ');
+      const string input_path = line.substr(0, space);
+      const string output_path =
+        space == string::npos ? "" : line.substr(space + 1);
+
+      int status = EXIT_SUCCESS;
+      try {
+        job(input_path, output_path);
+      } catch (const exception & e) {
+        cerr << input_path << ": " << e.what() << endl;
+        status = EXIT_FAILURE;
+      }
+
+      /* a reply is a single line, written and flushed under the lock */
+      lock_guard<mutex> lock(mtx);
+      cout << input_path << " " << status << endl;
+    }
+  };
+
+  vector<thread> threads;
+  for (size_t i = 0; i < max(num_threads, size_t(1)); i++) {
+    threads.emplace_back(worker);
+  }
+
+  string line;
+  while (getline(cin, line)) {
+    if (line.empty()) {
+      continue;
+    }
+
+    lock_guard<mutex> lock(mtx);
+    lines.emplace_back(move(line));
+    cv.notify_one();
+  }
+
+  {
+    lock_guard<mutex> lock(mtx);
+    eof = true;
+  }
+  cv.notify_all();
+
+  for (auto & t : threads) {
+    t.join();
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,19 @@
+#ifndef BATCH_HH
+#define BATCH_HH
+
+#include <cstddef>
+#include <functional>
+#include <string>
+
+/* Batch mode of a program that is otherwise run once per input file, e.g.,
+ * by a notifier with --batch: a job is read from stdin per line, as
+ * "<input_path> [<output_path>]", and run on one of num_threads threads, and
+ * a line of "<input_path> <exit status>" is written to stdout as each job
+ * finishes (so not necessarily in order). An exception thrown by a job is
+ * printed and reported as EXIT_FAILURE. Return once stdin is closed and all
+ * the jobs have finished. */
+int run_batch(const std::function<void(const std::string & input_path,
+                                       const std::string & output_path)> & job,
+              const size_t num_threads);
+
+#endif /* BATCH_HH */
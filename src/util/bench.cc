@@ -0,0 +1,100 @@
+#include "bench.hh"
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <vector>
+
+#include "filesystem.hh"
+#include "temp_dir.hh"
+#include "exception.hh"
+
+using namespace std;
+
+/* the counters of /proc/self/io, such as syscr and syscw */
+static map<string, uint64_t> read_io_counters()
+{
+  ifstream ifs("/proc/self/io");
+  map<string, uint64_t> counters;
+
+  string key;
+  uint64_t value;
+  while (ifs >> key >> value) {
+    counters[key.substr(0, key.find(':'))] = value;
+  }
+
+  return counters;
+}
+
+bool is_timestamped(const string & path)
+{
+  const string stem = fs::path(path).stem();
+  return not stem.empty() and all_of(stem.begin(), stem.end(), ::isdigit);
+}
+
+int run_bench(const string & vectors_dir,
+              const function<bool(const string & path)> & is_input,
+              const unsigned int rounds,
+              const function<void(const string & input_path,
+                                  const string & output_dir)> & job)
+{
+  vector<string> inputs;
+  uint64_t input_bytes = 0;
+
+  for (const auto & entry : fs::directory_iterator(vectors_dir)) {
+    if (fs::is_regular_file(entry.path()) and is_input(entry.path())) {
+      inputs.emplace_back(entry.path());
+      input_bytes += fs::file_size(entry.path());
+    }
+  }
+
+  if (inputs.empty()) {
+    throw runtime_error("no inputs in " + vectors_dir);
+  }
+
+  sort(inputs.begin(), inputs.end());
+
+  UniqueDirectory output_dir(fs::temp_directory_path() / "bench");
+
+  auto io_before = read_io_counters();
+  const auto start = chrono::steady_clock::now();
+
+  try {
+    for (unsigned int round = 0; round < rounds; round++) {
+      for (const auto & input : inputs) {
+        job(input, output_dir.name());
+      }
+    }
+  } catch (...) {
+    fs::remove_all(output_dir.name());
+    throw;
+  }
+
+  const double elapsed_s = chrono::duration<double>(
+      chrono::steady_clock::now() - start).count();
+  auto io_after = read_io_counters();
+
+  fs::remove_all(output_dir.name());
+
+  rusage usage;
+  CheckSystemCall("getrusage", getrusage(RUSAGE_SELF, &usage));
+
+  const double chunks = double(inputs.size()) * rounds;
+  const double syscalls = (io_after["syscr"] - io_before["syscr"]) +
+                          (io_after["syscw"] - io_before["syscw"]);
+
+  cout << fixed << setprecision(1)
+       << "inputs: " << inputs.size() << " (" << input_bytes << " bytes), "
+       << rounds << " rounds in " << elapsed_s << " s\n"
+       << "chunks/s: " << chunks / elapsed_s << "\n"
+       << "MB/s: " << input_bytes * rounds / elapsed_s / 1e6 << "\n"
+       << "read/write syscalls per chunk: " << syscalls / chunks << "\n"
+       << "peak RSS: " << usage.ru_maxrss / 1024.0 << " MB" << endl;
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,23 @@
+#ifndef BENCH_HH
+#define BENCH_HH
+
+#include <functional>
+#include <string>
+
+/* Benchmark mode of a program that is otherwise run once per input file:
+ * job is run in process on each input in vectors_dir (a file for which
+ * is_input is true, e.g., the chunks of a test vector), over and over for
+ * the given number of rounds, with a scratch directory to write its outputs
+ * to. Then the chunks/s, bytes/s (of the inputs), read and write system
+ * calls per chunk (as counted in /proc/self/io) and peak RSS are printed on
+ * stdout. An exception thrown by a job ends the benchmark. */
+int run_bench(const std::string & vectors_dir,
+              const std::function<bool(const std::string & path)> & is_input,
+              const unsigned int rounds,
+              const std::function<void(const std::string & input_path,
+                                       const std::string & output_dir)> & job);
+
+/* whether the stem of path is a timestamp, as in the names of chunks */
+bool is_timestamped(const std::string & path);
+
+#endif /* BENCH_HH */
@@ -0,0 +1,401 @@
+#include "binary_log.hh"
+
+#include <limits>
+#include <stdexcept>
+
+#include "tokenize.hh"
+
+using namespace std;
+
+/* a D value of this scale is escaped as a string */
+static constexpr uint8_t ESCAPED_SCALE = UINT8_MAX;
+static constexpr uint8_t MAX_SCALE = 18;
+
+static void put_varint(string & out, uint64_t value)
+{
+  while (value >= 0x80) {
+    out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  out.push_back(static_cast<char>(value));
+}
+
+static uint64_t zigzag(const int64_t value)
+{
+  return (static_cast<uint64_t>(value) << 1) ^ (value < 0 ? UINT64_MAX : 0);
+}
+
+static int64_t unzigzag(const uint64_t value)
+{
+  return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+/* bounds-checked reads from the head of data */
+class Cursor
+{
+public:
+  Cursor(const string_view data) : data_(data) {}
+
+  bool done() const { return pos_ == data_.size(); }
+  size_t pos() const { return pos_; }
+
+  /* nullopt if data ends in the middle of the varint */
+  optional<uint64_t> try_varint()
+  {
+    uint64_t value = 0;
+    for (unsigned int shift = 0; shift < 64; shift += 7) {
+      if (pos_ == data_.size()) {
+        return nullopt;
+      }
+
+      const uint8_t byte = data_[pos_++];
+      value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if (not (byte & 0x80)) {
+        return value;
+      }
+    }
+
+    throw runtime_error("BinaryLog: invalid varint");
+  }
+
+  uint64_t varint()
+  {
+    const auto value = try_varint();
+    if (not value) {
+      throw runtime_error("BinaryLog: truncated record");
+    }
+    return *value;
+  }
+
+  uint8_t byte()
+  {
+    return bytes(1)[0];
+  }
+
+  string_view bytes(const uint64_t size)
+  {
+    if (size > data_.size() - pos_) {
+      throw runtime_error("BinaryLog: truncated record");
+    }
+
+    const string_view ret = data_.substr(pos_, size);
+    pos_ += size;
+    return ret;
+  }
+
+private:
+  string_view data_;
+  size_t pos_ {0};
+};
+
+/* value if str is the canonical text of an integer, e.g., not "007" */
+static optional<uint64_t> parse_unsigned(const string_view str)
+{
+  if (str.empty() or str.size() > 20 or (str[0] == '0' and str.size() > 1)) {
+    return nullopt;
+  }
+
+  uint64_t value = 0;
+  for (const char c : str) {
+    if (c < '0' or c > '9') {
+      return nullopt;
+    }
+
+    const uint64_t digit = c - '0';
+    if (value > (UINT64_MAX - digit) / 10) {
+      return nullopt;
+    }
+    value = value * 10 + digit;
+  }
+
+  return value;
+}
+
+/* (mantissa, scale) if str is a decimal that round-trips through them */
+static optional<pair<int64_t, uint8_t>> parse_decimal(const string_view str)
+{
+  const bool negative = not str.empty() and str[0] == '-';
+  const string_view abs = str.substr(negative ? 1 : 0);
+
+  const size_t dot = abs.find('.');
+  const string_view int_part = abs.substr(0, dot);
+  const string_view frac_part = dot == string_view::npos ? string_view()
+                                                         : abs.substr(dot + 1);
+
+  if (dot != string_view::npos and frac_part.empty()) {
+    return nullopt;
+  }
+
+  if (frac_part.size() > MAX_SCALE) {
+    return nullopt;
+  }
+
+  const auto int_value = parse_unsigned(int_part);
+  if (not int_value) {
+    return nullopt;
+  }
+
+  /* digits only, leading zeros allowed */
+  uint64_t value = *int_value;
+  for (const char c : frac_part) {
+    if (c < '0' or c > '9') {
+      return nullopt;
+    }
+
+    const uint64_t digit = c - '0';
+    if (value > (static_cast<uint64_t>(numeric_limits<int64_t>::max())
+                 - digit) / 10) {
+      return nullopt;
+    }
+    value = value * 10 + digit;
+  }
+
+  if (value > static_cast<uint64_t>(numeric_limits<int64_t>::max())) {
+    return nullopt;
+  }
+
+  /* "-0.0" would be decoded without its sign */
+  if (negative and value == 0) {
+    return nullopt;
+  }
+
+  const int64_t mantissa = negative ? -static_cast<int64_t>(value)
+                                    : static_cast<int64_t>(value);
+  return make_pair(mantissa, static_cast<uint8_t>(frac_part.size()));
+}
+
+static string format_decimal(const int64_t mantissa, const uint8_t scale)
+{
+  const uint64_t abs = mantissa < 0 ? -static_cast<uint64_t>(mantissa)
+                                    : static_cast<uint64_t>(mantissa);
+  string digits = to_string(abs);
+  if (digits.size() <= scale) {
+    digits.insert(0, scale + 1 - digits.size(), '0');
+  }
+
+  if (scale > 0) {
+    digits.insert(digits.size() - scale, 1, '.');
+  }
+
+  return mantissa < 0 ? "-" + digits : digits;
+}
+
+optional<string> BinaryLog::schema(const string & measurement)
+{
+  /* the columns of the lines of ws_media_server */
+  if (measurement == "video_sent") {
+    return "TSUUSUUUSUDUUUUUDD";
+  } else if (measurement == "video_acked") {
+    return "TSUUSUUUDDD";
+  } else if (measurement == "client_buffer") {
+    return "TSUSUSUUDD";
+  }
+
+  return nullopt;
+}
+
+string BinaryLog::header(const string & schema)
+{
+  string ret(MAGIC);
+  put_varint(ret, schema.size());
+  return ret + schema;
+}
+
+optional<pair<string, size_t>> BinaryLog::parse_header(const string_view data)
+{
+  if (data.substr(0, MAGIC.size()) != MAGIC) {
+    return nullopt;
+  }
+
+  Cursor cursor(data.substr(MAGIC.size()));
+  const auto schema_size = cursor.try_varint();
+  if (not schema_size or
+      *schema_size > data.size() - MAGIC.size() - cursor.pos()) {
+    return nullopt;
+  }
+
+  const string schema(cursor.bytes(*schema_size));
+  return make_pair(schema, MAGIC.size() + cursor.pos());
+}
+
+BinaryLogEncoder::BinaryLogEncoder(const string & schema)
+  : schema_(schema)
+{}
+
+void BinaryLogEncoder::put_string(string & out, const string_view value)
+{
+  auto [it, inserted] = dict_.emplace(value, dict_.size());
+  put_varint(out, it->second);
+
+  if (inserted) {
+    put_varint(out, value.size());
+    out.append(value);
+  }
+}
+
+void BinaryLogEncoder::add(const string_view line)
+{
+  split(line, ",", values_);
+  const auto & values = values_;
+  if (values.size() != schema_.size()) {
+    throw runtime_error("BinaryLogEncoder: line has " +
+                        to_string(values.size()) + " columns instead of " +
+                        to_string(schema_.size()));
+  }
+
+  /* validate the timestamps before touching the dictionary or records */
+  for (size_t i = 0; i < schema_.size(); i++) {
+    if (schema_[i] == 'T' and not parse_unsigned(values[i])) {
+      throw runtime_error("BinaryLogEncoder: invalid timestamp " +
+                          string(values[i]));
+    }
+  }
+
+  for (size_t i = 0; i < schema_.size(); i++) {
+    const string_view value = values[i];
+
+    switch (schema_[i]) {
+    case 'T': {
+      const uint64_t ts = *parse_unsigned(value);
+      put_varint(records_, zigzag(static_cast<int64_t>(ts - last_ts_)));
+      last_ts_ = ts;
+      break;
+    }
+
+    case 'U': {
+      /* 0 escapes a string */
+      const auto u = parse_unsigned(value);
+      if (u and *u < UINT64_MAX) {
+        put_varint(records_, *u + 1);
+      } else {
+        put_varint(records_, 0);
+        put_string(records_, value);
+      }
+      break;
+    }
+
+    case 'D': {
+      const auto decimal = parse_decimal(value);
+      if (decimal) {
+        records_.push_back(static_cast<char>(decimal->second));
+        put_varint(records_, zigzag(decimal->first));
+      } else {
+        records_.push_back(static_cast<char>(ESCAPED_SCALE));
+        put_string(records_, value);
+      }
+      break;
+    }
+
+    case 'S':
+      put_string(records_, value);
+      break;
+
+    default:
+      throw runtime_error("BinaryLogEncoder: invalid schema " + schema_);
+    }
+  }
+
+  num_lines_++;
+}
+
+string BinaryLogEncoder::finish()
+{
+  string block(1, BinaryLog::BLOCK_MARKER);
+  put_varint(block, records_.size());
+  block += records_;
+
+  records_.clear();
+  num_lines_ = 0;
+  dict_.clear();
+  last_ts_ = 0;
+
+  return block;
+}
+
+BinaryLogDecoder::BinaryLogDecoder(const string & schema)
+  : schema_(schema)
+{}
+
+static string get_string(Cursor & cursor, vector<string> & dict)
+{
+  const uint64_t idx = cursor.varint();
+  if (idx < dict.size()) {
+    return dict[idx];
+  }
+
+  if (idx != dict.size()) {
+    throw runtime_error("BinaryLogDecoder: invalid dictionary index");
+  }
+
+  dict.emplace_back(cursor.bytes(cursor.varint()));
+  return dict.back();
+}
+
+size_t BinaryLogDecoder::decode(const string_view data,
+                                vector<vector<string>> & lines)
+{
+  Cursor blocks(data);
+  size_t consumed = 0;
+
+  while (not blocks.done()) {
+    if (static_cast<char>(blocks.byte()) != BinaryLog::BLOCK_MARKER) {
+      throw runtime_error("BinaryLogDecoder: invalid block");
+    }
+
+    const auto block_size = blocks.try_varint();
+    if (not block_size or *block_size > data.size() - blocks.pos()) {
+      break;  /* incomplete block */
+    }
+
+    Cursor cursor(blocks.bytes(*block_size));
+    vector<string> dict;
+    uint64_t ts = 0;
+
+    while (not cursor.done()) {
+      vector<string> values;
+      values.reserve(schema_.size());
+
+      for (const char type : schema_) {
+        switch (type) {
+        case 'T':
+          ts += unzigzag(cursor.varint());
+          values.emplace_back(to_string(ts));
+          break;
+
+        case 'U': {
+          const uint64_t u = cursor.varint();
+          values.emplace_back(u > 0 ? to_string(u - 1)
+                                    : get_string(cursor, dict));
+          break;
+        }
+
+        case 'D': {
+          const uint8_t scale = cursor.byte();
+          if (scale == ESCAPED_SCALE) {
+            values.emplace_back(get_string(cursor, dict));
+          } else if (scale <= MAX_SCALE) {
+            values.emplace_back(format_decimal(unzigzag(cursor.varint()),
+                                               scale));
+          } else {
+            throw runtime_error("BinaryLogDecoder: invalid decimal");
+          }
+          break;
+        }
+
+        case 'S':
+          values.emplace_back(get_string(cursor, dict));
+          break;
+
+        default:
+          throw runtime_error("BinaryLogDecoder: invalid schema " + schema_);
+        }
+      }
+
+      lines.emplace_back(move(values));
+    }
+
+    consumed = blocks.pos();
+  }
+
+  return consumed;
+}
@@ -0,0 +1,88 @@
+#ifndef BINARY_LOG_HH
+#define BINARY_LOG_HH
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/* Compact binary form of the comma-separated log lines of a measurement with
+ * a fixed schema (see schema()), which has a character per column:
+ *
+ *   T  timestamp in ms, a (zigzag) varint delta from the previous line
+ *   U  unsigned integer, a varint
+ *   D  decimal such as "0.934521", a (zigzag) varint mantissa and a scale
+ *   S  string such as a channel, format or username, a dictionary index
+ *
+ * A log starts with a header (MAGIC and the schema) followed by blocks, each
+ * holding the lines of a write: a BLOCK_MARKER, the varint size of the block
+ * and its records. The dictionary and the base of the timestamps are reset
+ * at every block, so a reader that seeks to the end of a log can decode from
+ * the next block on. A U or D value that would not be decoded to the same
+ * text, e.g., "nan", is kept escaped as a string, so lines are decoded into
+ * exactly the values that were encoded. */
+class BinaryLog
+{
+public:
+  static constexpr std::string_view MAGIC = "PUFBLOG1";
+  static constexpr char BLOCK_MARKER = '\xb1';
+
+  /* the schema of the measurement; nullopt if it is only logged as text */
+  static std::optional<std::string> schema(const std::string & measurement);
+
+  /* the header of a log of schema */
+  static std::string header(const std::string & schema);
+
+  /* (schema, header size) if data starts with a complete header */
+  static std::optional<std::pair<std::string, size_t>> parse_header(
+    const std::string_view data);
+};
+
+/* encodes lines into a block */
+class BinaryLogEncoder
+{
+public:
+  BinaryLogEncoder(const std::string & schema);
+
+  /* append a comma-separated line to the block; throws (leaving the block
+   * unchanged) if it does not have the columns of the schema */
+  void add(const std::string_view line);
+
+  bool empty() const { return num_lines_ == 0; }
+
+  /* the block of the lines added so far; the next block starts afresh */
+  std::string finish();
+
+private:
+  std::string schema_;
+  std::string records_ {};
+  unsigned int num_lines_ {0};
+
+  std::unordered_map<std::string, uint64_t> dict_ {};
+  uint64_t last_ts_ {0};
+
+  /* columns of the line being added, reused across lines */
+  std::vector<std::string_view> values_ {};
+
+  void put_string(std::string & out, const std::string_view value);
+};
+
+/* decodes blocks into the values of their lines */
+class BinaryLogDecoder
+{
+public:
+  BinaryLogDecoder(const std::string & schema);
+
+  /* decode the complete blocks at the start of data, appending the values of
+   * each line to lines, and return the number of bytes consumed; throws if
+   * data is not a block */
+  size_t decode(const std::string_view data,
+                std::vector<std::vector<std::string>> & lines);
+
+private:
+  std::string schema_;
+};
+
+#endif /* BINARY_LOG_HH */
@@ -0,0 +1,96 @@
+#include "cgroup.hh"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <iostream>
+#include <set>
+
+#include "exception.hh"
+#include "file_descriptor.hh"
+#include "filesystem.hh"
+
+using namespace std;
+
+static const fs::path CGROUP_MOUNT = "/sys/fs/cgroup";
+
+static void write_file(const fs::path & path, const string & value)
+{
+  FileDescriptor fd(CheckSystemCall("open (" + path.string() + ")",
+                                    open(path.c_str(), O_WRONLY)));
+  fd.write(value);
+}
+
+/* the cgroup v2 of this process, as "0::<path>" in /proc/self/cgroup */
+static fs::path own_cgroup()
+{
+  ifstream ifs("/proc/self/cgroup");
+  string line;
+
+  while (getline(ifs, line)) {
+    if (line.compare(0, 3, "0::") == 0) {
+      return CGROUP_MOUNT / fs::path(line.substr(3)).relative_path();
+    }
+  }
+
+  throw runtime_error("CGroup: this process is not in a cgroup v2 hierarchy");
+}
+
+/* the cgroup of this process when first called, after moving this process
+ * into its supervisor cgroup */
+static const fs::path & delegated_cgroup()
+{
+  static const fs::path root = []() {
+    const fs::path own = own_cgroup();
+
+    const fs::path supervisor = own / "supervisor";
+    fs::create_directories(supervisor);
+    write_file(supervisor / "cgroup.procs", "0");
+
+    return own;
+  }();
+
+  return root;
+}
+
+CGroup::CGroup(const string & name, const map<string, string> & controls)
+  : path_()
+{
+  const fs::path & root = delegated_cgroup();
+
+  /* e.g., cpu.weight is a file of the controller cpu */
+  set<string> controllers;
+  for (const auto & [file, value] : controls) {
+    const size_t dot = file.find('.');
+    if (dot == string::npos or dot == 0) {
+      throw runtime_error("CGroup " + name + ": invalid control " + file);
+    }
+    controllers.insert(file.substr(0, dot));
+  }
+
+  for (const auto & controller : controllers) {
+    write_file(root / "cgroup.subtree_control", "+" + controller);
+  }
+
+  const fs::path path = root / name;
+  fs::create_directories(path);
+  path_ = path;
+
+  for (const auto & [file, value] : controls) {
+    write_file(path / file, value);
+  }
+
+  cerr << "CGroup " << path_ << " created" << endl;
+}
+
+CGroup::~CGroup()
+{
+  /* fails (harmlessly) if processes are left in it */
+  rmdir(path_.c_str());
+}
+
+void CGroup::enter(const string & path)
+{
+  write_file(fs::path(path) / "cgroup.procs", "0");
+}
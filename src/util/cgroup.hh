@@ -0,0 +1,40 @@
+#ifndef CGROUP_HH
+#define CGROUP_HH
+
+#include <map>
+#include <string>
+
+/* A cgroup (v2) in which child processes are confined by resource controls
+ * such as cpu.weight, cpu.max and io.weight. The cgroups are created under
+ * the cgroup of this process, which must be delegated to it (e.g., a systemd
+ * service with Delegate=yes); as a cgroup that has processes cannot enable
+ * the controllers of its children, this process is first moved into a
+ * "supervisor" cgroup beside them. */
+class CGroup
+{
+public:
+  /* create (or reuse) the cgroup name, enable the controllers of the files
+   * of controls and write each value to its file, e.g., "cpu.max" -> "max
+   * 100000" */
+  CGroup(const std::string & name,
+         const std::map<std::string, std::string> & controls);
+
+  /* removed unless processes are left in it */
+  ~CGroup();
+
+  const std::string & path() const { return path_; }
+
+  /* move the calling process into the cgroup at path, e.g., a child before
+   * it execs (see ProcessManager::run_as_child), so that all that it forks
+   * is confined too */
+  static void enter(const std::string & path);
+
+  /* forbid copying or moving, as the cgroup is removed on destruction */
+  CGroup(const CGroup & other) = delete;
+  const CGroup & operator=(const CGroup & other) = delete;
+
+private:
+  std::string path_;
+};
+
+#endif /* CGROUP_HH */
@@ -9,9 +9,13 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sched.h>
+#include <spawn.h>
 #include <unistd.h>
 
 #include "child_process.hh"
+#include "cgroup.hh"
+#include "pipe.hh"
 #include "system_runner.hh"
 #include "exception.hh"
 #include "signalfd.hh"
@@ -36,6 +40,116 @@ int do_fork()
     return CheckSystemCall( "fork", fork() );
 }
 
+/* the attributes and file actions of posix_spawn, destroyed on return */
+class SpawnAttributes
+{
+public:
+    posix_spawnattr_t attr {};
+    posix_spawn_file_actions_t file_actions {};
+
+    SpawnAttributes()
+    {
+        check( "posix_spawnattr_init", posix_spawnattr_init( &attr ) );
+
+        const int ret = posix_spawn_file_actions_init( &file_actions );
+        if ( ret != 0 ) {
+            posix_spawnattr_destroy( &attr );
+            throw unix_error( "posix_spawn_file_actions_init", ret );
+        }
+    }
+
+    ~SpawnAttributes()
+    {
+        posix_spawn_file_actions_destroy( &file_actions );
+        posix_spawnattr_destroy( &attr );
+    }
+
+    /* the posix_spawn functions return an error number */
+    static void check( const string & attempt, const int ret )
+    {
+        if ( ret != 0 ) {
+            throw unix_error( attempt, ret );
+        }
+    }
+
+    SpawnAttributes( const SpawnAttributes & other ) = delete;
+    SpawnAttributes & operator=( const SpawnAttributes & other ) = delete;
+};
+
+/* glibc's posix_spawn runs the child on the parent's memory until it execs
+ * (clone with CLONE_VM | CLONE_VFORK), which costs the same however large
+ * the parent is */
+int do_spawn( const string & program, const vector<string> & args,
+              const SpawnOptions & options )
+{
+    if ( args.empty() ) {
+        throw runtime_error( "spawn: empty args" );
+    }
+
+    /* as in ezexec() */
+    if ( geteuid() == 0 or getegid() == 0 ) {
+        if ( environ ) {
+            throw runtime_error( "BUG: root's env not cleared" );
+        }
+
+        if ( options.path_search ) {
+            throw runtime_error( "BUG: root should not search PATH" );
+        }
+    }
+
+    /* posix_spawn does not modify the strings */
+    vector<char *> argv;
+    for ( const auto & arg : args ) {
+        argv.push_back( const_cast<char *>( arg.c_str() ) );
+    }
+    argv.push_back( nullptr );
+
+    vector<char *> envp;
+    if ( options.env ) {
+        for ( const auto & var : *options.env ) {
+            envp.push_back( const_cast<char *>( var.c_str() ) );
+        }
+        envp.push_back( nullptr );
+    }
+
+    SpawnAttributes spawn;
+
+    /* the child starts with no signals blocked, as with fork */
+    sigset_t empty_mask;
+    sigemptyset( &empty_mask );
+    SpawnAttributes::check( "posix_spawnattr_setsigmask",
+        posix_spawnattr_setsigmask( &spawn.attr, &empty_mask ) );
+    SpawnAttributes::check( "posix_spawnattr_setflags",
+        posix_spawnattr_setflags( &spawn.attr, POSIX_SPAWN_SETSIGMASK ) );
+
+    if ( not options.log_path.empty() ) {
+        SpawnAttributes::check( "posix_spawn_file_actions_addopen",
+            posix_spawn_file_actions_addopen( &spawn.file_actions, STDOUT_FILENO,
+                options.log_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644 ) );
+        SpawnAttributes::check( "posix_spawn_file_actions_adddup2",
+            posix_spawn_file_actions_adddup2( &spawn.file_actions,
+                                              STDOUT_FILENO, STDERR_FILENO ) );
+    }
+
+    for ( const auto & [ old_fd, new_fd ] : options.dup2s ) {
+        SpawnAttributes::check( "posix_spawn_file_actions_adddup2",
+            posix_spawn_file_actions_adddup2( &spawn.file_actions, old_fd, new_fd ) );
+    }
+
+    for ( const int fd : options.closes ) {
+        SpawnAttributes::check( "posix_spawn_file_actions_addclose",
+            posix_spawn_file_actions_addclose( &spawn.file_actions, fd ) );
+    }
+
+    pid_t pid;
+    SpawnAttributes::check( "posix_spawn (" + program + ")",
+        ( options.path_search ? posix_spawnp : posix_spawn )(
+            &pid, program.c_str(), &spawn.file_actions, &spawn.attr,
+            &argv[ 0 ], options.env ? &envp[ 0 ] : environ ) );
+
+    return pid;
+}
+
 /* start up a child process running the supplied lambda */
 /* the return value of the lambda is the child's exit status */
 ChildProcess::ChildProcess( const string & name,
@@ -61,6 +175,21 @@ ChildProcess::ChildProcess( const string & name,
     }
 }
 
+ChildProcess::ChildProcess( const string & name,
+                            const string & program,
+                            const vector<string> & args,
+                            const SpawnOptions & options,
+                            const int termination_signal )
+    : name_( name ),
+      pid_( do_spawn( program, args, options ) ),
+      running_( true ),
+      terminated_( false ),
+      exit_status_(),
+      died_on_signal_( false ),
+      graceful_termination_signal_( termination_signal ),
+      moved_away_( false )
+{}
+
 /* is process in a waitable state? */
 bool ChildProcess::waitable( void ) const
 {
@@ -212,11 +341,34 @@ pid_t ProcessManager::run_as_child(const string & program,
                                    const vector<string> & prog_args,
                                    const callback_t & callback,
                                    const callback_t & error_callback,
-                                   const std::string & log_path)
+                                   const std::string & log_path,
+                                   const optional<int> & cpu,
+                                   const std::string & cgroup_path)
 {
+  /* spawn the program unless the child has to be set up beyond its fds */
+  if (not cpu and cgroup_path.empty()) {
+    SpawnOptions options;
+    options.log_path = log_path;
+
+    return add_child(ChildProcess(program, program, prog_args, options),
+                     prog_args, callback, error_callback);
+  }
+
   auto child = ChildProcess(program,
-    [&program, &prog_args, &log_path]() {
+    [&program, &prog_args, &log_path, &cpu, &cgroup_path]() {
       /* references won't be dangling as they will be used immediately */
+      if (not cgroup_path.empty()) {
+        CGroup::enter(cgroup_path);
+      }
+
+      if (cpu) {
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        CPU_SET(*cpu, &cpu_set);
+        CheckSystemCall("sched_setaffinity",
+                        sched_setaffinity(0, sizeof(cpu_set), &cpu_set));
+      }
+
       if (not log_path.empty()) {
         /* redirect stdout and stderr to log_path */
         FileDescriptor fd(CheckSystemCall("open (" + log_path + ")",
@@ -232,6 +384,39 @@ pid_t ProcessManager::run_as_child(const string & program,
     }
   );
 
+  return add_child(move(child), prog_args, callback, error_callback);
+}
+
+tuple<pid_t, FileDescriptor, FileDescriptor>
+ProcessManager::run_as_coprocess(const string & program,
+                                 const vector<string> & prog_args,
+                                 const callback_t & callback,
+                                 const callback_t & error_callback)
+{
+  auto [stdin_read, stdin_write] = make_pipe();
+  auto [stdout_read, stdout_write] = make_pipe();
+
+  SpawnOptions options;
+  options.dup2s = { {stdin_read.fd_num(), STDIN_FILENO},
+                    {stdout_write.fd_num(), STDOUT_FILENO} };
+  options.closes = { stdin_read.fd_num(), stdin_write.fd_num(),
+                     stdout_read.fd_num(), stdout_write.fd_num() };
+
+  auto child = ChildProcess(program, program, prog_args, options);
+
+  /* so that the child sees EOF once the write end returned is closed */
+  stdin_read.close();
+  stdout_write.close();
+
+  const pid_t pid = add_child(move(child), prog_args, callback, error_callback);
+  return {pid, move(stdin_write), move(stdout_read)};
+}
+
+pid_t ProcessManager::add_child(ChildProcess && child,
+                                const vector<string> & prog_args,
+                                const callback_t & callback,
+                                const callback_t & error_callback)
+{
   pid_t pid = child.pid();
   child_processes_.emplace(pid, move(child));
 
@@ -289,48 +474,57 @@ Result ProcessManager::handle_signal(const signalfd_siginfo & sig)
       break;
     }
 
-    for (auto it = child_processes_.begin(); it != child_processes_.end();) {
-      ChildProcess & child = it->second;
-
-      if (not child.waitable()) {
-        ++it;
-      } else {
-        child.wait(true);
-
-        if (child.terminated()) {
-          if (child.exit_status() != 0) {
-            /* call the corresponding callback function if it exists */
-            const auto & callback_it = error_callbacks_.find(it->first);
-            if (callback_it != error_callbacks_.end()) {
-              callback_it->second(it->first);
-            } else {
-              child_processes_.clear();
-              throw runtime_error("ProcessManager: PID " + to_string(it->first) +
-                                " exits abnormally");
+    {
+      /* reap the children first and call back after, so that a callback can
+       * run more children without invalidating the iteration */
+      struct Event {
+        pid_t pid;
+        bool terminated;
+        bool failed;  /* exited abnormally or stopped */
+      };
+      vector<Event> events;
+
+      for (auto it = child_processes_.begin(); it != child_processes_.end();) {
+        ChildProcess & child = it->second;
+
+        if (not child.waitable()) {
+          ++it;
+        } else {
+          child.wait(true);
+
+          if (child.terminated()) {
+            events.push_back({it->first, true, child.exit_status() != 0});
+            it = child_processes_.erase(it);
+          } else {
+            if (not child.running()) {
+              events.push_back({it->first, false, true});
             }
+
+            ++it;
           }
+        }
+      }
 
+      for (const auto & event : events) {
+        if (event.failed) {
           /* call the corresponding callback function if it exists */
-          const auto & callback_it = callbacks_.find(it->first);
-          if (callback_it != callbacks_.end()) {
-            callback_it->second(it->first);
+          const auto & callback_it = error_callbacks_.find(event.pid);
+          if (callback_it != error_callbacks_.end()) {
+            callback_it->second(event.pid);
+          } else {
+            child_processes_.clear();
+            throw runtime_error("ProcessManager: PID " + to_string(event.pid)
+                                + (event.terminated ? " exits abnormally"
+                                                    : " is not running"));
           }
+        }
 
-          it = child_processes_.erase(it);
-        } else {
-          if (not child.running()) {
-            /* call the corresponding callback function if it exists */
-            const auto & callback_it = error_callbacks_.find(it->first);
-            if (callback_it != error_callbacks_.end()) {
-              callback_it->second(it->first);
-            } else {
-              child_processes_.clear();
-              throw runtime_error("ProcessManager: PID " + to_string(it->first) +
-                                " is not running");
-            }
+        if (event.terminated) {
+          /* call the corresponding callback function if it exists */
+          const auto & callback_it = callbacks_.find(event.pid);
+          if (callback_it != callbacks_.end()) {
+            callback_it->second(event.pid);
           }
-
-          ++it;
         }
       }
     }
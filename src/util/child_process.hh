@@ -11,9 +11,25 @@
 #include <unordered_map>
 #include <vector>
 #include <string>
+#include <tuple>
+#include <optional>
+#include <utility>
+#include "file_descriptor.hh"
 #include "signalfd.hh"
 #include "poller.hh"
 
+/* how to set up a child that is spawned rather than forked: as nothing
+ * runs in the child before the program is exec'ed, only its file
+ * descriptors and environment can be set up, in this order */
+struct SpawnOptions
+{
+    std::string log_path {};  /* redirect stdout and stderr to, if not empty */
+    std::vector<std::pair<int, int>> dup2s {};  /* (old fd, new fd) */
+    std::vector<int> closes {};
+    std::optional<std::vector<std::string>> env {};  /* default: environ */
+    bool path_search { true };
+};
+
 /* object-oriented wrapper for handling Unix child processes */
 
 class ChildProcess
@@ -33,6 +49,16 @@ public:
                   std::function<int()> && child_procedure,
                   const int termination_signal = SIGHUP );
 
+    /* exec program with args (as ezexec) in a child spawned with posix_spawn,
+     * which does not copy the page tables of the parent as fork does (and
+     * works in a multi-threaded program); use the constructor above only to
+     * run code in the child that options cannot express */
+    ChildProcess( const std::string & name,
+                  const std::string & program,
+                  const std::vector<std::string> & args,
+                  const SpawnOptions & options = {},
+                  const int termination_signal = SIGHUP );
+
     bool waitable( void ) const; /* is process in a waitable state? */
     void wait( const bool nonblocking = false ); /* wait for process to change state */
     void signal( const int sig ); /* send signal */
@@ -70,12 +96,25 @@ public:
   ProcessManager();
 
   /* run the program as a child process
-   * call the callback function if the child exits with 0 */
+   * call the callback function if the child exits with 0
+   * confine the child (and its descendants) to cpu if given,
+   * and to the cgroup at cgroup_path (see CGroup) if not empty */
   pid_t run_as_child(const std::string & program,
                      const std::vector<std::string> & prog_args,
                      const callback_t & callback = {},
                      const callback_t & error_callback = {},
-                     const std::string & log_path = "");
+                     const std::string & log_path = "",
+                     const std::optional<int> & cpu = std::nullopt,
+                     const std::string & cgroup_path = "");
+
+  /* run the program as a child process like run_as_child(), with its stdin
+   * and stdout connected to pipes; return the pid, the write end of the
+   * child's stdin and the read end of its stdout */
+  std::tuple<pid_t, FileDescriptor, FileDescriptor>
+  run_as_coprocess(const std::string & program,
+                   const std::vector<std::string> & prog_args,
+                   const callback_t & callback = {},
+                   const callback_t & error_callback = {});
 
   /* return when all the child processes exit */
   int wait();
@@ -102,6 +141,12 @@ private:
   SignalMask signals_;
   SignalFD signal_fd_;
 
+  /* manage a child that has been started */
+  pid_t add_child(ChildProcess && child,
+                  const std::vector<std::string> & prog_args,
+                  const callback_t & callback,
+                  const callback_t & error_callback);
+
   PollerShortNames::Result handle_signal(const signalfd_siginfo & sig);
 };
 
@@ -0,0 +1,219 @@
+#include "chunk_pack.hh"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <algorithm>
+#include <stdexcept>
+
+#include "exception.hh"
+#include "file_descriptor.hh"
+#include "temp_file.hh"
+#include "mmap.hh"
+
+using namespace std;
+
+/* "PUFPACK" followed by the layout version */
+static constexpr uint64_t MAGIC = 0x5055465041434b01;
+
+/* the mapping of a growing pack grows by at least this much at a time */
+static const size_t MIN_MAPPING_SIZE = 1 << 20;  /* 1 MiB */
+
+static void pread_all(FileDescriptor & fd, void * buf, const size_t count,
+                      const uint64_t offset)
+{
+  const ssize_t n = CheckSystemCall("pread",
+      pread(fd.fd_num(), buf, count, offset));
+  if (static_cast<size_t>(n) != count) {
+    throw runtime_error("ChunkPack: short read");
+  }
+}
+
+static void pwrite_all(FileDescriptor & fd, const void * buf,
+                       const size_t count, const uint64_t offset)
+{
+  size_t written = 0;
+  while (written < count) {
+    written += CheckSystemCall("pwrite",
+        pwrite(fd.fd_num(), static_cast<const char *>(buf) + written,
+               count - written, offset + written));
+  }
+}
+
+void ChunkPack::create(const fs::path & path,
+  const vector<pair<uint64_t, fs::path>> & chunk_files)
+{
+  Header header {MAGIC, chunk_files.size(), chunk_files.size(), 0};
+  vector<Entry> entries;
+
+  uint64_t offset = sizeof(Header) + chunk_files.size() * sizeof(Entry);
+  for (const auto & [ts, chunk_path] : chunk_files) {
+    if (not entries.empty() and ts <= entries.back().ts) {
+      throw runtime_error("ChunkPack: timestamps must be ascending");
+    }
+
+    const uint64_t size = fs::file_size(chunk_path);
+    entries.push_back({ts, offset, size, 0});
+    offset += size;
+  }
+
+  UniqueFile tmp_file(path.string());
+  FileDescriptor & fd = tmp_file.fd();
+  CheckSystemCall("fchmod", fchmod(fd.fd_num(), 0644));
+
+  fd.write({reinterpret_cast<const char *>(&header), sizeof(header)});
+  fd.write({reinterpret_cast<const char *>(entries.data()),
+            entries.size() * sizeof(Entry)});
+
+  for (size_t i = 0; i < chunk_files.size(); i++) {
+    FileDescriptor chunk_fd(CheckSystemCall(
+        "open (" + chunk_files[i].second.string() + ")",
+        open(chunk_files[i].second.c_str(), O_RDONLY)));
+
+    /* the chunk must not change while being packed */
+    const string data = chunk_fd.read_exactly(entries[i].size);
+    fd.write(data);
+  }
+
+  fs::rename(tmp_file.name(), path);
+}
+
+bool ChunkPack::append(const fs::path & path, const uint64_t capacity,
+                       const uint64_t ts, const string_view data)
+{
+  if (not fs::exists(path)) {
+    /* an empty pack with a zero-filled index */
+    UniqueFile tmp_file(path.string());
+    FileDescriptor & tmp_fd = tmp_file.fd();
+    CheckSystemCall("fchmod", fchmod(tmp_fd.fd_num(), 0644));
+
+    const Header header {MAGIC, capacity, 0, 0};
+    tmp_fd.write({reinterpret_cast<const char *>(&header), sizeof(header)});
+    CheckSystemCall("ftruncate", ftruncate(tmp_fd.fd_num(),
+        sizeof(Header) + capacity * sizeof(Entry)));
+
+    /* another writer might have created the pack in the meantime */
+    if (renameat2(AT_FDCWD, tmp_file.name().c_str(), AT_FDCWD, path.c_str(),
+                  RENAME_NOREPLACE) < 0) {
+      if (errno != EEXIST) {
+        throw unix_error("renameat2 (" + path.string() + ")");
+      }
+
+      fs::remove(tmp_file.name());
+    }
+  }
+
+  FileDescriptor fd(CheckSystemCall("open (" + path.string() + ")",
+      open(path.c_str(), O_RDWR)));
+  fd.acquire_exclusive_flock();
+
+  Header header;
+  pread_all(fd, &header, sizeof(header), 0);
+  if (header.magic != MAGIC) {
+    throw runtime_error("ChunkPack: " + path.string() + " is not a pack");
+  }
+
+  if (header.num_chunks >= header.capacity) {
+    throw runtime_error("ChunkPack: " + path.string() + " is full");
+  }
+
+  vector<Entry> entries(header.num_chunks);
+  pread_all(fd, entries.data(), entries.size() * sizeof(Entry),
+            sizeof(Header));
+
+  for (const auto & e : entries) {
+    if (e.ts == ts) {
+      return false;
+    }
+  }
+
+  /* the chunk and its entry are in place before num_chunks covers them */
+  const Entry entry {ts, fd.filesize(), data.size(), 0};
+  pwrite_all(fd, data.data(), data.size(), entry.offset);
+  pwrite_all(fd, &entry, sizeof(entry),
+             sizeof(Header) + header.num_chunks * sizeof(Entry));
+
+  header.num_chunks++;
+  pwrite_all(fd, &header.num_chunks, sizeof(header.num_chunks),
+             offsetof(Header, num_chunks));
+
+  return true;
+}
+
+ChunkPack::ChunkPack(const fs::path & path)
+  : path_(path)
+{
+  refresh();
+}
+
+size_t ChunkPack::refresh()
+{
+  FileDescriptor fd(CheckSystemCall("open (" + path_.string() + ")",
+      open(path_.c_str(), O_RDONLY)));
+  const size_t size = fd.filesize();
+
+  if (size < max(size_, sizeof(Header))) {
+    throw runtime_error("ChunkPack: " + path_.string() + " is truncated");
+  }
+
+  if (size > mapping_size_) {
+    /* a pack that is appended to grows the mapping by at least double; the
+     * chunks read so far keep the old mapping alive */
+    size_t new_size = size;
+    if (mapping_) {
+      const long page_size = sysconf(_SC_PAGESIZE);
+      new_size = max({size, 2 * mapping_size_, MIN_MAPPING_SIZE});
+      new_size = (new_size + page_size - 1) / page_size * page_size;
+    }
+
+    mapping_ = mmap_shared(nullptr, new_size, PROT_READ, MAP_SHARED,
+                           fd.fd_num(), 0);
+    mapping_size_ = new_size;
+  }
+
+  size_ = size;
+
+  const auto * header = static_cast<const Header *>(mapping_.get());
+  if (header->magic != MAGIC) {
+    throw runtime_error("ChunkPack: " + path_.string() + " is not a pack");
+  }
+
+  const uint64_t num_chunks = header->num_chunks;
+  if (num_chunks < num_chunks_ or num_chunks > header->capacity or
+      sizeof(Header) + header->capacity * sizeof(Entry) > size_) {
+    throw runtime_error("ChunkPack: " + path_.string() + " has a bad index");
+  }
+
+  entries_ = reinterpret_cast<const Entry *>(header + 1);
+
+  for (size_t i = num_chunks_; i < num_chunks; i++) {
+    if (entries_[i].offset + entries_[i].size > size_) {
+      throw runtime_error("ChunkPack: " + path_.string() + " is truncated");
+    }
+  }
+
+  const size_t num_new_chunks = num_chunks - num_chunks_;
+  num_chunks_ = num_chunks;
+  return num_new_chunks;
+}
+
+const ChunkPack::Entry & ChunkPack::entry(const size_t i) const
+{
+  if (i >= num_chunks_) {
+    throw out_of_range("ChunkPack: invalid chunk index");
+  }
+
+  return entries_[i];
+}
+
+tuple<shared_ptr<char>, size_t> ChunkPack::chunk(const size_t i) const
+{
+  const Entry & e = entry(i);
+
+  /* alias the mapping of the whole pack */
+  return {shared_ptr<char>(mapping_, static_cast<char *>(mapping_.get())
+                                     + e.offset), e.size};
+}
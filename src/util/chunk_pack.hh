@@ -0,0 +1,89 @@
+#ifndef CHUNK_PACK_HH
+#define CHUNK_PACK_HH
+
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "filesystem.hh"
+
+/* Container of the chunks of a format: a header, an index of up to capacity
+ * entries ordered by timestamp, and the chunks concatenated after the index.
+ * A reader maps the whole pack once, i.e., one open() and one VMA for all the
+ * chunks of the format rather than one per chunk.
+ *
+ * A pack can also be appended to chunk by chunk (see append()), e.g., a
+ * segment of a live channel that holds the chunks of a few minutes, in which
+ * case its entries are in the order of appends. */
+class ChunkPack
+{
+public:
+  /* entries of an appended pack, e.g., an hour of 0.9s chunks */
+  static constexpr uint64_t DEFAULT_CAPACITY = 4096;
+
+  struct Header {
+    uint64_t magic;
+    uint64_t capacity;    /* entries that the index has room for */
+    uint64_t num_chunks;  /* entries in use */
+    uint64_t reserved;
+  };
+
+  struct Entry {
+    uint64_t ts;
+    uint64_t offset;  /* of the chunk from the start of the pack */
+    uint64_t size;
+    uint64_t reserved;
+  };
+
+  static_assert(sizeof(Header) == 32 and sizeof(Entry) == 32,
+                "ChunkPack: the header and entries must be packed");
+
+  /* pack the chunk files, given as (timestamp, path) in ascending order of
+   * timestamps, into path, which is replaced atomically */
+  static void create(const fs::path & path,
+    const std::vector<std::pair<uint64_t, fs::path>> & chunk_files);
+
+  /* append the chunk at ts to the pack at path, which is created with room
+   * for capacity entries if it does not exist; a new pack appears with a
+   * single rename (so it can be watched for with IN_MOVED_TO), appends are
+   * serialized with flock(), and a chunk is visible to the readers once
+   * num_chunks covers its entry. Return false if the pack has ts already. */
+  static bool append(const fs::path & path, const uint64_t capacity,
+                     const uint64_t ts, const std::string_view data);
+
+  /* map the pack at path */
+  ChunkPack(const fs::path & path);
+
+  /* re-read the index of a pack that is being appended to, remapping it if
+   * it has outgrown the mapping; return the number of new chunks, which are
+   * the last ones */
+  size_t refresh();
+
+  size_t num_chunks() const { return num_chunks_; }
+  const Entry & entry(const size_t i) const;
+
+  /* chunk i, which keeps the mapping of the pack alive */
+  std::tuple<std::shared_ptr<char>, size_t> chunk(const size_t i) const;
+
+  fs::path path() const { return path_; }
+
+  /* forbid copying; moving is allowed (e.g., into a map) */
+  ChunkPack(const ChunkPack & other) = delete;
+  const ChunkPack & operator=(const ChunkPack & other) = delete;
+  ChunkPack(ChunkPack && other) = default;
+  ChunkPack & operator=(ChunkPack && other) = default;
+
+private:
+  fs::path path_ {};
+  std::shared_ptr<void> mapping_ {};
+  size_t mapping_size_ {0};  /* might extend past the end of the pack */
+  size_t size_ {0};
+
+  const Entry * entries_ {nullptr};
+  size_t num_chunks_ {0};
+};
+
+#endif /* CHUNK_PACK_HH */
@@ -0,0 +1,208 @@
+#include "counters.hh"
+
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <unistd.h>
+
+using namespace std;
+
+static const char * const counter_names[Counters::NUM_COUNTERS] = {
+  "fd_reads", "fd_read_bytes", "fd_writes", "fd_write_bytes",
+  "accepts", "connects",
+  "ssl_reads", "ssl_read_bytes", "ssl_writes", "ssl_write_bytes",
+  "polls", "allocs", "alloc_bytes"
+};
+
+const char * Counters::name(const Counter counter)
+{
+  return counter_names[counter];
+}
+
+#ifdef ENABLE_COUNTERS
+
+Counters::Slot Counters::slots_[MAX_THREADS];
+atomic<unsigned int> Counters::num_slots_ {0};
+
+Counters::Slot & Counters::claim_slot()
+{
+  const unsigned int idx = num_slots_.fetch_add(1, memory_order_relaxed);
+  return slots_[min(idx, MAX_THREADS - 1)];
+}
+
+Counters::Values Counters::thread_values()
+{
+  const Slot & slot = thread_slot();
+
+  Values values;
+  for (unsigned int i = 0; i < NUM_COUNTERS; i++) {
+    values[i] = slot.values[i].load(memory_order_relaxed);
+  }
+
+  return values;
+}
+
+Counters::Values Counters::total_values()
+{
+  const unsigned int num_slots = min(num_slots_.load(memory_order_relaxed),
+                                     MAX_THREADS);
+
+  Values values {};
+  for (unsigned int s = 0; s < num_slots; s++) {
+    for (unsigned int i = 0; i < NUM_COUNTERS; i++) {
+      values[i] += slots_[s].values[i].load(memory_order_relaxed);
+    }
+  }
+
+  return values;
+}
+
+/* append s to buf, for the signal handler, which may not allocate */
+static size_t append(char * buf, size_t len, const size_t cap, const char * s)
+{
+  while (*s and len < cap) {
+    buf[len++] = *s++;
+  }
+
+  return len;
+}
+
+static size_t append(char * buf, size_t len, const size_t cap, uint64_t n)
+{
+  char digits[20];
+  size_t num_digits = 0;
+
+  do {
+    digits[num_digits++] = '0' + n % 10;
+    n /= 10;
+  } while (n > 0);
+
+  while (num_digits > 0 and len < cap) {
+    buf[len++] = digits[--num_digits];
+  }
+
+  return len;
+}
+
+/* e.g., "counters: slot=0 fd_reads=12 ... alloc_bytes=4096" */
+static void dump_line(const char * slot, const uint64_t slot_idx,
+                      const uint64_t * values)
+{
+  char buf[1024];
+  const size_t cap = sizeof(buf) - 1;
+
+  size_t len = append(buf, 0, cap, "counters: ");
+  len = append(buf, len, cap, slot);
+  if (slot_idx != UINT64_MAX) {
+    len = append(buf, len, cap, slot_idx);
+  }
+
+  for (unsigned int i = 0; i < Counters::NUM_COUNTERS; i++) {
+    len = append(buf, len, cap, " ");
+    len = append(buf, len, cap, counter_names[i]);
+    len = append(buf, len, cap, "=");
+    len = append(buf, len, cap, values[i]);
+  }
+
+  buf[len++] = '\n';
+
+  /* best effort: nothing to do in a signal handler if stderr is gone */
+  size_t written = 0;
+  while (written < len) {
+    const ssize_t ret = ::write(STDERR_FILENO, buf + written, len - written);
+    if (ret <= 0) {
+      break;
+    }
+    written += ret;
+  }
+}
+
+/* runs in a signal handler, so only loads atomics and calls write(2) */
+void Counters::dump(int)
+{
+  const int saved_errno = errno;
+
+  const unsigned int num_slots = min(num_slots_.load(memory_order_relaxed),
+                                     MAX_THREADS);
+
+  uint64_t totals[NUM_COUNTERS] {};
+  for (unsigned int s = 0; s < num_slots; s++) {
+    uint64_t values[NUM_COUNTERS];
+    for (unsigned int i = 0; i < NUM_COUNTERS; i++) {
+      values[i] = slots_[s].values[i].load(memory_order_relaxed);
+      totals[i] += values[i];
+    }
+
+    dump_line("slot=", s, values);
+  }
+
+  dump_line("total", UINT64_MAX, totals);
+
+  errno = saved_errno;
+}
+
+void Counters::install_dump_handler()
+{
+  struct sigaction action {};
+  action.sa_handler = dump;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+
+  if (sigaction(SIGUSR1, &action, nullptr) < 0) {
+    throw runtime_error("sigaction: failed to install SIGUSR1 handler");
+  }
+}
+
+/* count every allocation through the global operator new; the array and
+ * nothrow forms of libstdc++ call this one, and delete pairs it with free() */
+void * operator new(size_t size)
+{
+  Counters::count(Counters::ALLOCS);
+  Counters::count(Counters::ALLOC_BYTES, size);
+
+  if (size == 0) {
+    size = 1;
+  }
+
+  while (true) {
+    void * ptr = malloc(size);
+    if (ptr) {
+      return ptr;
+    }
+
+    new_handler handler = get_new_handler();
+    if (not handler) {
+      throw bad_alloc();
+    }
+    handler();
+  }
+}
+
+void operator delete(void * ptr) noexcept
+{
+  free(ptr);
+}
+
+void operator delete(void * ptr, size_t) noexcept
+{
+  free(ptr);
+}
+
+#else
+
+Counters::Values Counters::thread_values()
+{
+  return {};
+}
+
+Counters::Values Counters::total_values()
+{
+  return {};
+}
+
+void Counters::install_dump_handler() {}
+
+#endif /* ENABLE_COUNTERS */
@@ -0,0 +1,101 @@
+#ifndef COUNTERS_HH
+#define COUNTERS_HH
+
+#include "config.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+/* Counts of the syscalls, bytes and heap allocations behind serving a byte,
+ * kept per thread so that counting takes no lock: only the owning thread
+ * updates its counters (with relaxed atomics), and any thread may read them.
+ * Compiled in only with ./configure --enable-counters, which also replaces
+ * the global operator new to count allocations; otherwise count() is a
+ * no-op and the counters read as zero. */
+class Counters
+{
+public:
+  enum Counter : unsigned int {
+    FD_READS,         /* read(2) on a FileDescriptor */
+    FD_READ_BYTES,
+    FD_WRITES,        /* write(2) and writev(2) on a FileDescriptor */
+    FD_WRITE_BYTES,
+    ACCEPTS,          /* accept(2) on a TCPSocket */
+    CONNECTS,         /* connect(2) on a Socket, including in progress */
+    SSL_READS,        /* SSL_read attempts, each one read(2) or more */
+    SSL_READ_BYTES,
+    SSL_WRITES,       /* SSL_write attempts, each one write(2) or more */
+    SSL_WRITE_BYTES,
+    POLLS,            /* poll(2) or epoll_wait(2) */
+    ALLOCS,           /* global operator new */
+    ALLOC_BYTES,
+    NUM_COUNTERS
+  };
+
+  using Values = std::array<uint64_t, NUM_COUNTERS>;
+
+#ifdef ENABLE_COUNTERS
+  static constexpr bool enabled = true;
+
+  static void count(const Counter counter, const uint64_t n = 1)
+  {
+    Slot & slot = thread_slot();
+    std::atomic<uint64_t> & value = slot.values[counter];
+
+    if (&slot == &slots_[MAX_THREADS - 1]) {
+      value.fetch_add(n, std::memory_order_relaxed);
+    } else {
+      value.store(value.load(std::memory_order_relaxed) + n,
+                  std::memory_order_relaxed);
+    }
+  }
+#else
+  static constexpr bool enabled = false;
+
+  static void count(const Counter, const uint64_t = 1) {}
+#endif
+
+  static const char * name(const Counter counter);
+
+  /* the counters of the calling thread */
+  static Values thread_values();
+
+  /* the counters summed over all the threads, past and present */
+  static Values total_values();
+
+  /* dump the counters of each thread and their totals to stderr on SIGUSR1
+   * (a no-op unless the counters are compiled in) */
+  static void install_dump_handler();
+
+private:
+  /* threads beyond the first MAX_THREADS - 1 share the last slot */
+  static constexpr unsigned int MAX_THREADS = 256;
+
+  struct Slot
+  {
+    std::array<std::atomic<uint64_t>, NUM_COUNTERS> values {};
+  };
+
+  static Slot slots_[MAX_THREADS];
+  static std::atomic<unsigned int> num_slots_;
+
+  /* claimed on the first count of a thread without allocating, as counting
+   * an allocation may be that first count */
+  static Slot & claim_slot();
+
+  static Slot & thread_slot()
+  {
+    static thread_local Slot * slot = nullptr;
+
+    if (slot == nullptr) {
+      slot = &claim_slot();
+    }
+
+    return *slot;
+  }
+
+  static void dump(int);
+};
+
+#endif /* COUNTERS_HH */
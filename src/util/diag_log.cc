@@ -0,0 +1,199 @@
+#include "diag_log.hh"
+
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include "mpsc_queue.hh"
+#include "timestamp.hh"
+
+using namespace std;
+
+namespace {
+
+atomic<int> min_severity {static_cast<int>(DiagLog::Severity::Info)};
+atomic<unsigned int> max_lines {100};
+
+/* lines are queued once line_queue is set */
+unique_ptr<MPSCQueue<string>> line_queue;
+atomic<MPSCQueue<string> *> active_queue {nullptr};
+atomic<uint64_t> num_dropped_lines {0};
+uint64_t num_dropped_reported = 0;  /* under flush_mutex */
+
+mutex flush_mutex;  /* serializes flush(); protects the consumer side */
+once_flag start_flag;
+
+/* write all of data to stderr, retrying on EINTR; a failure is ignored, as
+ * there is nowhere else to report it */
+void write_stderr(const string & data)
+{
+  size_t offset = 0;
+  while (offset < data.size()) {
+    const ssize_t n = ::write(STDERR_FILENO, data.data() + offset,
+                              data.size() - offset);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    offset += n;
+  }
+}
+
+/* stops and joins the background thread (writing what is left) at exit */
+class Flusher
+{
+public:
+  void start()
+  {
+    thread_ = thread([this]() {
+      while (not stop_) {
+        this_thread::sleep_for(
+          chrono::milliseconds(DiagLog::FLUSH_INTERVAL_MS));
+        DiagLog::flush();
+      }
+    });
+  }
+
+  ~Flusher()
+  {
+    if (thread_.joinable()) {
+      stop_ = true;
+      thread_.join();
+    }
+
+    /* the lines from here on are written directly */
+    active_queue.store(nullptr, memory_order_release);
+    DiagLog::flush();
+  }
+
+private:
+  atomic<bool> stop_ {false};
+  thread thread_ {};
+};
+
+Flusher flusher;
+
+} /* namespace */
+
+void DiagLog::set_min_severity(const Severity severity)
+{
+  min_severity = static_cast<int>(severity);
+}
+
+DiagLog::Severity DiagLog::parse_severity(const string & name)
+{
+  if (name == "debug") {
+    return Severity::Debug;
+  } else if (name == "info") {
+    return Severity::Info;
+  } else if (name == "warning") {
+    return Severity::Warning;
+  } else if (name == "error") {
+    return Severity::Error;
+  }
+
+  throw runtime_error("invalid severity: " + name);
+}
+
+void DiagLog::set_max_lines_per_site(const unsigned int max_lines_per_site)
+{
+  max_lines = max_lines_per_site;
+}
+
+unsigned int DiagLog::max_lines_per_site()
+{
+  return max_lines;
+}
+
+bool DiagLog::admit(Site & site, const Severity severity)
+{
+  if (static_cast<int>(severity) < min_severity) {
+    return false;
+  }
+
+  const unsigned int limit = max_lines;
+  if (limit == 0) {
+    return true;
+  }
+
+  /* a new second resets the count (approximately, if threads race) */
+  const uint64_t now = timestamp_s();
+  if (site.second.exchange(now) != now) {
+    site.num_lines = 0;
+  }
+
+  if (site.num_lines++ < limit) {
+    return true;
+  }
+
+  site.num_suppressed++;
+  return false;
+}
+
+DiagLog::Line::~Line()
+{
+  if (num_suppressed_ > 0) {
+    stream_ << " (" << num_suppressed_ << " similar lines suppressed)";
+  }
+  stream_ << '\n';
+
+  string line = stream_.str();
+
+  MPSCQueue<string> * const q = active_queue.load(memory_order_acquire);
+  if (not q) {
+    write_stderr(line);
+  } else if (not q->push(move(line))) {
+    num_dropped_lines++;
+  }
+}
+
+void DiagLog::start(const bool background)
+{
+  call_once(start_flag, [background]() {
+    {
+      lock_guard<mutex> lock(flush_mutex);
+      line_queue = make_unique<MPSCQueue<string>>(QUEUE_CAPACITY);
+      active_queue.store(line_queue.get(), memory_order_release);
+    }
+
+    if (background) {
+      flusher.start();
+    }
+  });
+}
+
+void DiagLog::flush()
+{
+  lock_guard<mutex> lock(flush_mutex);
+  if (not line_queue) {
+    return;
+  }
+
+  string batch;
+  while (auto line = line_queue->pop()) {
+    batch += *line;
+  }
+
+  const uint64_t dropped = num_dropped_lines;
+  if (dropped > num_dropped_reported) {
+    batch += "DiagLog: dropped " + to_string(dropped - num_dropped_reported)
+             + " lines as the queue was full\n";
+    num_dropped_reported = dropped;
+  }
+
+  if (not batch.empty()) {
+    write_stderr(batch);
+  }
+}
+
+uint64_t DiagLog::num_dropped()
+{
+  return num_dropped_lines;
+}
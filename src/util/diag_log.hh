@@ -0,0 +1,87 @@
+#ifndef DIAG_LOG_HH
+#define DIAG_LOG_HH
+
+#include <cstdint>
+#include <atomic>
+#include <sstream>
+#include <string>
+
+/* Diagnostic lines of the servers (e.g., that a connection has closed), which
+ * are written to stderr without blocking the event loops: once started, the
+ * lines are pushed to a lock-free queue (see MPSCQueue) and written in
+ * batches, a write(2) per batch, by a background thread (or by whoever calls
+ * flush() periodically, e.g., if the process must not have other threads);
+ * before that, they are written directly. A line that finds the queue full
+ * is dropped and counted.
+ *
+ * Each call site of DIAG writes at most max_lines_per_site() lines a second,
+ * and tells with its next line how many it has suppressed, so that an error
+ * that hits every client at once is not a storm of writes. Lines below the
+ * minimum severity are neither formatted nor counted. */
+class DiagLog
+{
+public:
+  enum class Severity { Debug, Info, Warning, Error };
+
+  static constexpr size_t QUEUE_CAPACITY = 1 << 16;  /* lines */
+  static constexpr unsigned int FLUSH_INTERVAL_MS = 50;
+
+  /* the rate limit of a call site, shared by the threads */
+  struct Site
+  {
+    std::atomic<uint64_t> second {0};  /* of the lines counted */
+    std::atomic<unsigned int> num_lines {0};
+    std::atomic<uint64_t> num_suppressed {0};
+  };
+
+  /* a line being formatted, which is written or queued on destruction */
+  class Line
+  {
+  public:
+    Line(Site & site) : num_suppressed_(site.num_suppressed.exchange(0)) {}
+    ~Line();
+
+    template<class T>
+    Line & operator<<(const T & value)
+    {
+      stream_ << value;
+      return *this;
+    }
+
+  private:
+    std::ostringstream stream_ {};
+    uint64_t num_suppressed_;
+  };
+
+  /* Info by default */
+  static void set_min_severity(const Severity severity);
+
+  /* "debug", "info", "warning" or "error" */
+  static Severity parse_severity(const std::string & name);
+
+  /* 100 by default; 0 for no limit */
+  static void set_max_lines_per_site(const unsigned int max_lines);
+  static unsigned int max_lines_per_site();
+
+  /* whether a line of severity at site is to be written; if not, it is
+   * counted as suppressed unless it is below the minimum severity */
+  static bool admit(Site & site, const Severity severity);
+
+  /* queue the lines from now on, and write them from a background thread
+   * (once) with background; otherwise, flush() must be called */
+  static void start(const bool background = true);
+
+  /* write the lines queued so far */
+  static void flush();
+
+  /* lines dropped because the queue was full */
+  static uint64_t num_dropped();
+};
+
+/* DIAG(Warning) << "something went wrong: " << what; (no endl) */
+#define DIAG(severity) \
+  if (static DiagLog::Site diag_site_; \
+      not DiagLog::admit(diag_site_, DiagLog::Severity::severity)) {} \
+  else DiagLog::Line(diag_site_)
+
+#endif /* DIAG_LOG_HH */
@@ -0,0 +1,29 @@
+#include "eventfd.hh"
+#include "exception.hh"
+
+using namespace std;
+
+EventFD::EventFD(int flags)
+  : FileDescriptor(CheckSystemCall("eventfd", eventfd(0, flags)))
+{}
+
+void EventFD::notify(uint64_t count)
+{
+  /* not counted with register_write(), as the counts are not atomic */
+  CheckSystemCall("eventfd_write", eventfd_write(fd_num(), count));
+}
+
+uint64_t EventFD::consume()
+{
+  eventfd_t count = 0;
+  if (eventfd_read(fd_num(), &count) < 0) {
+    if (errno != EAGAIN) {
+      throw unix_error("eventfd_read");
+    }
+    count = 0;
+  }
+
+  register_read();
+
+  return count;
+}
@@ -0,0 +1,20 @@
+#ifndef EVENTFD_HH
+#define EVENTFD_HH
+
+#include <sys/eventfd.h>
+#include "file_descriptor.hh"
+
+/* a counter that other threads add to in order to wake up a poller */
+class EventFD : public FileDescriptor
+{
+public:
+  EventFD(int flags = EFD_NONBLOCK | EFD_CLOEXEC);
+
+  /* any thread */
+  void notify(uint64_t count = 1);
+
+  /* the count notified since the last call (0 if none), which is reset */
+  uint64_t consume();
+};
+
+#endif /* EVENTFD_HH */
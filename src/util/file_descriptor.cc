@@ -2,11 +2,15 @@
 
 #include "file_descriptor.hh"
 #include "exception.hh"
+#include "counters.hh"
 
 #include <unistd.h>
 #include <fcntl.h>
 #include <cassert>
 #include <sys/file.h>
+#include <sys/uio.h>
+#include <climits>
+#include <algorithm>
 
 using namespace std;
 
@@ -83,10 +87,43 @@ string_view::const_iterator FileDescriptor::write( const string_view::const_iter
   }
 
   register_write();
+  Counters::count( Counters::FD_WRITES );
+  Counters::count( Counters::FD_WRITE_BYTES, bytes_written );
 
   return begin + bytes_written;
 }
 
+size_t FileDescriptor::writev( const vector<string_view> & buffers )
+{
+  vector<iovec> iov;
+  iov.reserve( min( buffers.size(), static_cast<size_t>( IOV_MAX ) ) );
+
+  for ( const auto & buffer : buffers ) {
+    if ( iov.size() == IOV_MAX ) {
+      break;
+    }
+
+    if ( not buffer.empty() ) {
+      iov.push_back( { const_cast<char *>( buffer.data() ), buffer.size() } );
+    }
+  }
+
+  if ( iov.empty() ) {
+    throw runtime_error( "nothing to write" );
+  }
+
+  ssize_t bytes_written = CheckSystemCall( "writev", ::writev( fd_, iov.data(), iov.size() ) );
+  if ( bytes_written == 0 ) {
+    throw runtime_error( "writev returned 0" );
+  }
+
+  register_write();
+  Counters::count( Counters::FD_WRITES );
+  Counters::count( Counters::FD_WRITE_BYTES, bytes_written );
+
+  return bytes_written;
+}
+
 /* read method */
 string FileDescriptor::read( const size_t limit )
 {
@@ -98,10 +135,28 @@ string FileDescriptor::read( const size_t limit )
   }
 
   register_read();
+  Counters::count( Counters::FD_READS );
+  Counters::count( Counters::FD_READ_BYTES, bytes_read );
 
   return string( buffer, bytes_read );
 }
 
+string_view FileDescriptor::read( IOBuffer & buffer, const size_t limit )
+{
+  ssize_t bytes_read = CheckSystemCall( "read", ::read( fd_, buffer.data(),
+                                        min( IOBuffer::CAPACITY, limit ) ) );
+  if ( bytes_read == 0 ) {
+    set_eof();
+  }
+
+  register_read();
+  Counters::count( Counters::FD_READS );
+  Counters::count( Counters::FD_READ_BYTES, bytes_read );
+
+  buffer.set_size( bytes_read );
+  return buffer.view();
+}
+
 /* write method */
 string_view::const_iterator FileDescriptor::write( const string_view & buffer, const bool write_all )
 {
@@ -184,6 +239,12 @@ void FileDescriptor::reset_offset()
   set_eof(false);
 }
 
+void FileDescriptor::replace_with(const FileDescriptor & other)
+{
+  CheckSystemCall("dup2", dup2(other.fd_num(), fd_));
+  set_eof(false);
+}
+
 uint64_t FileDescriptor::filesize()
 {
   uint64_t prev_offset = curr_offset();
@@ -4,9 +4,11 @@
 #define FILE_DESCRIPTOR_HH
 
 #include <string>
+#include <vector>
 #include <unistd.h>
 
 #include "config.h"
+#include "io_buffer.hh"
 
 #ifdef HAVE_STRING_VIEW
 #include <string_view>
@@ -54,17 +56,27 @@ public:
 
   /* read and write methods */
   std::string read( const size_t limit = BUFFER_SIZE );
+
+  /* read into buffer without allocating; return a view of what was read */
+  std::string_view read( IOBuffer & buffer, const size_t limit = IOBuffer::CAPACITY );
   std::string read_exactly( const size_t length, const bool fail_silently = false );
   std::string_view::const_iterator write( const std::string_view & buffer, const bool write_all = true );
   std::string_view::const_iterator write( const std::string_view::const_iterator & begin,
                                           const std::string_view::const_iterator & end );
 
+  /* gather-write the buffers with a single writev; return bytes written */
+  size_t writev( const std::vector<std::string_view> & buffers );
+
   /* manipulate file offset */
   uint64_t seek(const int64_t offset, const int whence);
   uint64_t curr_offset();
   uint64_t inc_offset(const int64_t offset);
   void reset_offset();  /* also set EOF to false */
 
+  /* make this fd number refer to what other does (e.g., a new connection
+   * on an fd being polled), and set EOF to false */
+  void replace_with( const FileDescriptor & other );
+
   uint64_t filesize();
 
   void register_read( void ) { read_count_++; }
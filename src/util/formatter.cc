@@ -1,5 +1,7 @@
 #include "formatter.hh"
 
+#include <stdexcept>
+
 using namespace std;
 
 void Formatter::parse(const string & format_string)
@@ -61,29 +63,47 @@ void Formatter::parse(const string & format_string)
   }
 }
 
-string Formatter::format(const vector<string> & values)
+template<class T>
+static void format_fields(
+  const vector<unique_ptr<Formatter::Field>> & fields,
+  string & out, const vector<T> & values)
 {
-  string ret;
-
-  for (const auto & field : fields_) {
-    if (field->type == Type::literal) {
-      ret += static_cast<Literal*>(field.get())->text;
-    } else if (field->type == Type::replacement) {
-      unsigned int index = static_cast<Replacement*>(field.get())->index;
+  for (const auto & field : fields) {
+    if (field->type == Formatter::Type::literal) {
+      out += static_cast<Formatter::Literal*>(field.get())->text;
+    } else if (field->type == Formatter::Type::replacement) {
+      unsigned int index =
+        static_cast<Formatter::Replacement*>(field.get())->index;
 
       if (index >= values.size()) {
         throw runtime_error("index out of range");
       }
 
-      ret += values.at(index);
+      out += values.at(index);
     } else {
       throw runtime_error("invalid field type");
     }
   }
+}
 
+string Formatter::format(const vector<string> & values)
+{
+  string ret;
+  format_fields(fields_, ret, values);
   return ret;
 }
 
+void Formatter::format_to(string & out, const vector<string> & values) const
+{
+  format_fields(fields_, out, values);
+}
+
+void Formatter::format_to(string & out,
+                          const vector<string_view> & values) const
+{
+  format_fields(fields_, out, values);
+}
+
 void Formatter::reset()
 {
   fields_.clear();
@@ -2,6 +2,7 @@
 #define FORMATTER_HH
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <optional>
 #include <memory>
@@ -15,6 +16,12 @@ public:
   void parse(const std::string & format_string);
   std::string format(const std::vector<std::string> & values);
 
+  /* append the formatted values to out, e.g., a payload of many lines */
+  void format_to(std::string & out,
+                 const std::vector<std::string> & values) const;
+  void format_to(std::string & out,
+                 const std::vector<std::string_view> & values) const;
+
   enum class Type {literal, replacement};
 
   struct Field {
@@ -0,0 +1,57 @@
+#include "fragment_output.hh"
+
+#include <fcntl.h>
+#include <iostream>
+
+#include "chunk_pack.hh"
+#include "exception.hh"
+#include "file_descriptor.hh"
+#include "filesystem.hh"
+#include "path.hh"
+
+using namespace std;
+
+string tmp_init_path(const string & output_path, const string & init_path)
+{
+  const fs::path output(output_path);
+  const string tmp_init_name = output.stem().string() + "-init"
+                               + fs::path(init_path).extension().string();
+  return output.parent_path() / tmp_init_name;
+}
+
+void finish_fragment(const string & output_path, const string & init_path,
+                     const uint64_t pack_span)
+{
+  /* a fragmenter in batch mode might not make the same init segment again */
+  const string tmp_init = tmp_init_path(output_path, init_path);
+  if (fs::exists(tmp_init)) {
+    const bool existed = fs::exists(init_path);
+    if (roost::rename_if_changed(tmp_init, init_path) and existed) {
+      cerr << "Warning: init segment " << init_path << " changed" << endl;
+    }
+  }
+
+  /* the segment is a single file with an inotify event per append, instead
+   * of a file per fragment in the directory of init_path */
+  if (pack_span == 0) {
+    return;
+  }
+
+  const uint64_t ts = stoull(fs::path(output_path).stem());
+  const string pack_name = to_string(ts - ts % pack_span) + ".pack";
+  const fs::path pack_path = fs::path(init_path).parent_path() / pack_name;
+
+  FileDescriptor fd(CheckSystemCall("open (" + output_path + ")",
+                    open(output_path.c_str(), O_RDONLY)));
+  const string data = fd.read_exactly(fd.filesize());
+  fd.close();
+
+  if (not ChunkPack::append(pack_path, ChunkPack::DEFAULT_CAPACITY,
+                            ts, data)) {
+    cerr << "Warning: " << pack_path.string() << " has " << ts
+         << " already" << endl;
+  }
+
+  /* output_path only marks that the fragment has been appended */
+  fs::resize_file(output_path, 0);
+}
@@ -0,0 +1,28 @@
+#ifndef FRAGMENT_OUTPUT_HH
+#define FRAGMENT_OUTPUT_HH
+
+#include <cstdint>
+#include <string>
+
+/* Outputs of a fragmenter (mp4_fragment or webm_fragment) for a chunk, as
+ * run by video_fragmenter and audio_fragmenter or in batch mode: the fragment
+ * is written to output_path, and the init segment, which is only a few
+ * hundred bytes, is always written to a temporary path next to it so that a
+ * change of the init segment (e.g., of its sample description) is not missed.
+ */
+
+/* the temporary init segment of output_path, e.g., <ts>-init.mp4 in the
+ * directory of output_path for init_path init.mp4 */
+std::string tmp_init_path(const std::string & output_path,
+                          const std::string & init_path);
+
+/* move the temporary init segment, if any, to init_path only if its
+ * contents change, so the media server sees an init event only for a true
+ * change; if pack_span > 0, append the fragment to the segment <ts>.pack in the
+ * directory of init_path, where <ts> is the multiple of pack_span at or
+ * before the timestamp of output_path, and leave output_path empty */
+void finish_fragment(const std::string & output_path,
+                     const std::string & init_path,
+                     const uint64_t pack_span);
+
+#endif /* FRAGMENT_OUTPUT_HH */
@@ -0,0 +1,70 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+#include "io_buffer.hh"
+
+#include <stdexcept>
+
+using namespace std;
+
+thread_local vector<unique_ptr<char[]>> IOBuffer::free_buffers_;
+
+IOBuffer::IOBuffer()
+  : data_( acquire() )
+{}
+
+IOBuffer::~IOBuffer()
+{
+  release( move( data_ ) );
+}
+
+IOBuffer::IOBuffer( IOBuffer && other )
+  : data_( move( other.data_ ) ), size_( other.size_ )
+{
+  other.size_ = 0;
+}
+
+IOBuffer & IOBuffer::operator=( IOBuffer && other )
+{
+  if ( this != &other ) {
+    release( move( data_ ) );
+    data_ = move( other.data_ );
+    size_ = other.size_;
+    other.size_ = 0;
+  }
+
+  return *this;
+}
+
+void IOBuffer::set_size( const size_t size )
+{
+  if ( size > CAPACITY ) {
+    throw out_of_range( "IOBuffer: size exceeds the capacity" );
+  }
+
+  size_ = size;
+}
+
+size_t IOBuffer::num_free()
+{
+  return free_buffers_.size();
+}
+
+unique_ptr<char[]> IOBuffer::acquire()
+{
+  if ( free_buffers_.empty() ) {
+    /* not value-initialized: no need to zero the bytes */
+    return unique_ptr<char[]>( new char[ CAPACITY ] );
+  }
+
+  unique_ptr<char[]> data = move( free_buffers_.back() );
+  free_buffers_.pop_back();
+  return data;
+}
+
+void IOBuffer::release( unique_ptr<char[]> && data )
+{
+  /* a moved-from buffer has nothing to release */
+  if ( data and free_buffers_.size() < MAX_FREE_BUFFERS ) {
+    free_buffers_.emplace_back( move( data ) );
+  }
+}
@@ -0,0 +1,52 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+#ifndef IO_BUFFER_HH
+#define IO_BUFFER_HH
+
+#include <string_view>
+#include <memory>
+#include <vector>
+
+/* A fixed-size buffer to read into. Buffers come from a free list on each
+ * thread and go back to it when destroyed, so reading into an IOBuffer and
+ * parsing a view of it does not allocate once the pool is warm. */
+class IOBuffer
+{
+public:
+  /* capacity of every buffer; the maximum size of a read into one */
+  static constexpr size_t CAPACITY = 1024 * 1024;
+
+  IOBuffer();
+  ~IOBuffer();
+
+  char * data() { return data_.get(); }
+
+  /* the bytes that have been read into the buffer */
+  size_t size() const { return size_; }
+  void set_size( const size_t size );
+
+  std::string_view view() const { return { data_.get(), size_ }; }
+
+  /* number of buffers kept in the free list of this thread */
+  static size_t num_free();
+
+  /* allow moving, but forbid copying */
+  IOBuffer( IOBuffer && other );
+  IOBuffer & operator=( IOBuffer && other );
+  IOBuffer( const IOBuffer & other ) = delete;
+  IOBuffer & operator=( const IOBuffer & other ) = delete;
+
+private:
+  std::unique_ptr<char[]> data_;
+  size_t size_ { 0 };
+
+  /* at most this many free buffers are kept on each thread */
+  static constexpr size_t MAX_FREE_BUFFERS = 16;
+
+  static thread_local std::vector<std::unique_ptr<char[]>> free_buffers_;
+
+  static std::unique_ptr<char[]> acquire();
+  static void release( std::unique_ptr<char[]> && data );
+};
+
+#endif /* IO_BUFFER_HH */
@@ -0,0 +1,522 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+#include "io_uring.hh"
+
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "exception.hh"
+
+#if defined(HAVE_LINUX_IO_URING_H) and defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define IO_URING_SUPPORTED 1
+#endif
+
+using namespace std;
+using namespace PollerShortNames;
+
+/* at most this many consecutive writes to a file are gathered in a writev */
+static constexpr size_t MAX_IOV = 64;
+
+IOUring::IOUring( const unsigned int entries )
+{
+  if ( not setup_ring( entries ) ) {
+    cerr << "Warning: io_uring is not available; "
+         << "file I/O falls back to blocking syscalls" << endl;
+  }
+}
+
+IOUring::~IOUring()
+{
+  *alive_ = false;
+
+  if ( not enabled() ) {
+    return;
+  }
+
+  /* the kernel might still access the buffers of the in-flight operations */
+  try {
+#ifdef IO_URING_SUPPORTED
+    while ( num_in_flight_ > 0 ) {
+      enter( 1 );
+
+      unsigned int head = *cq_head_;
+      const unsigned int tail = __atomic_load_n( cq_tail_, __ATOMIC_ACQUIRE );
+      num_in_flight_ -= tail - head;
+      head = tail;
+      __atomic_store_n( cq_head_, head, __ATOMIC_RELEASE );
+    }
+#endif
+  } catch ( const exception & e ) {
+    cerr << "Exception draining io_uring: " << e.what() << endl;
+  }
+
+  unmap_ring();
+}
+
+bool IOUring::setup_ring( const unsigned int entries )
+{
+#ifdef IO_URING_SUPPORTED
+  io_uring_params params;
+  memset( &params, 0, sizeof( params ) );
+
+  const int ring_fd = syscall( __NR_io_uring_setup, entries, &params );
+  if ( ring_fd < 0 ) {
+    return false;
+  }
+
+  ring_fd_ = ring_fd;
+
+  /* a single mapping of both rings requires Linux 5.4, and reading/writing
+   * at the current file offset requires Linux 5.6 */
+  if ( not ( params.features & IORING_FEAT_SINGLE_MMAP ) or
+       not ( params.features & IORING_FEAT_RW_CUR_POS ) ) {
+    unmap_ring();
+    return false;
+  }
+
+  ring_size_ = max( params.sq_off.array + params.sq_entries * sizeof( unsigned int ),
+                    params.cq_off.cqes + params.cq_entries * sizeof( io_uring_cqe ) );
+  sqes_size_ = params.sq_entries * sizeof( io_uring_sqe );
+
+  ring_ = mmap( nullptr, ring_size_, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING );
+  if ( ring_ == MAP_FAILED ) {
+    ring_ = nullptr;
+    unmap_ring();
+    return false;
+  }
+
+  sqes_ = mmap( nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES );
+  if ( sqes_ == MAP_FAILED ) {
+    sqes_ = nullptr;
+    unmap_ring();
+    return false;
+  }
+
+  char * ring = static_cast<char *>( ring_ );
+  sq_head_ = reinterpret_cast<unsigned int *>( ring + params.sq_off.head );
+  sq_tail_ = reinterpret_cast<unsigned int *>( ring + params.sq_off.tail );
+  sq_mask_ = *reinterpret_cast<unsigned int *>( ring + params.sq_off.ring_mask );
+  sq_array_ = reinterpret_cast<unsigned int *>( ring + params.sq_off.array );
+  cq_head_ = reinterpret_cast<unsigned int *>( ring + params.cq_off.head );
+  cq_tail_ = reinterpret_cast<unsigned int *>( ring + params.cq_off.tail );
+  cq_mask_ = *reinterpret_cast<unsigned int *>( ring + params.cq_off.ring_mask );
+  cqes_ = ring + params.cq_off.cqes;
+  sq_entries_ = params.sq_entries;
+
+  /* signal the completions on eventfd_ */
+  const int event_fd = eventfd_->fd_num();
+  if ( syscall( __NR_io_uring_register, ring_fd_, IORING_REGISTER_EVENTFD,
+                &event_fd, 1 ) < 0 ) {
+    unmap_ring();
+    return false;
+  }
+
+  return true;
+#else
+  (void) entries;
+  return false;
+#endif
+}
+
+void IOUring::unmap_ring()
+{
+  if ( sqes_ ) {
+    munmap( sqes_, sqes_size_ );
+    sqes_ = nullptr;
+  }
+
+  if ( ring_ ) {
+    munmap( ring_, ring_size_ );
+    ring_ = nullptr;
+  }
+
+  if ( ring_fd_ >= 0 ) {
+    ::close( ring_fd_ );
+    ring_fd_ = -1;
+  }
+}
+
+void IOUring::add_to_poller( Poller & poller )
+{
+  /* the kernel has completed some operations */
+  poller.add_action( Poller::Action( *eventfd_, Direction::In,
+    [this, eventfd = eventfd_, alive = alive_]()->Result {
+      if ( not *alive ) {
+        return ResultType::Cancel;
+      }
+
+      eventfd->consume();
+
+      reap();
+      return ResultType::Continue;
+    }
+  ) );
+
+  /* an eventfd is always writable: submit what has been queued in the
+   * previous iteration of the event loop as a single batch */
+  poller.add_action( Poller::Action( *eventfd_, Direction::Out,
+    [this, eventfd = eventfd_, alive = alive_]()->Result {
+      if ( not *alive ) {
+        return ResultType::Cancel;
+      }
+
+      submit();
+      eventfd->register_write();  /* nothing is written to the eventfd */
+      return ResultType::Continue;
+    },
+    [this, alive = alive_] { return not *alive or unsubmitted_; }
+  ) );
+}
+
+void IOUring::queue( const shared_ptr<FileDescriptor> & fd, Op && op )
+{
+  auto it = files_.find( fd->fd_num() );
+  if ( it == files_.end() ) {
+    it = files_.emplace( fd->fd_num(), File { fd } ).first;
+  }
+
+  it->second.ops.emplace_back( move( op ) );
+  num_pending_++;
+  unsubmitted_ = true;
+}
+
+void IOUring::write( const shared_ptr<FileDescriptor> & fd, string && data,
+                     DoneCallback && callback )
+{
+  Op op { Op::Type::Write };
+  op.data = move( data );
+  op.done_callback = move( callback );
+  queue( fd, move( op ) );
+}
+
+void IOUring::read( const shared_ptr<FileDescriptor> & fd, const size_t length,
+                    ReadCallback && callback )
+{
+  Op op { Op::Type::Read };
+  op.length = min( length, IOBuffer::CAPACITY );
+  op.read_callback = move( callback );
+  queue( fd, move( op ) );
+}
+
+void IOUring::fsync( const shared_ptr<FileDescriptor> & fd,
+                     DoneCallback && callback )
+{
+  Op op { Op::Type::Fsync };
+  op.done_callback = move( callback );
+  queue( fd, move( op ) );
+}
+
+void IOUring::submit()
+{
+  if ( not enabled() ) {
+    submit_fallback();
+    return;
+  }
+
+  unsubmitted_ = false;
+
+  bool prepared = false;
+  for ( auto & [ fd_num, file ] : files_ ) {
+    if ( file.in_flight or file.ops.empty() ) {
+      continue;
+    }
+
+    /* the rest waits for some operations to complete */
+    if ( num_in_flight_ >= sq_entries_ ) {
+      unsubmitted_ = true;
+      break;
+    }
+
+    prepare( file, fd_num );
+    prepared = true;
+  }
+
+  if ( prepared ) {
+    enter( 0 );
+  }
+}
+
+void IOUring::prepare( File & file, const int fd_num )
+{
+#ifdef IO_URING_SUPPORTED
+  const unsigned int tail = *sq_tail_;
+  const unsigned int idx = tail & sq_mask_;
+
+  io_uring_sqe * sqe = static_cast<io_uring_sqe *>( sqes_ ) + idx;
+  memset( sqe, 0, sizeof( *sqe ) );
+
+  file.iov.clear();
+  file.num_in_flight_ops = 0;
+
+  const Op & first = file.ops.front();
+
+  switch ( first.type ) {
+  case Op::Type::Write:
+    for ( const auto & op : file.ops ) {
+      if ( op.type != Op::Type::Write or file.iov.size() >= MAX_IOV ) {
+        break;
+      }
+
+      file.iov.push_back( { const_cast<char *>( op.data.data() ) + op.done,
+                            op.data.size() - op.done } );
+      file.num_in_flight_ops++;
+    }
+
+    sqe->opcode = IORING_OP_WRITEV;
+    break;
+
+  case Op::Type::Read:
+    if ( not file.read_buffer ) {
+      file.read_buffer = make_shared<IOBuffer>();
+    }
+
+    file.iov.push_back( { file.read_buffer->data(), first.length } );
+    file.num_in_flight_ops = 1;
+
+    sqe->opcode = IORING_OP_READV;
+    break;
+
+  case Op::Type::Fsync:
+    file.num_in_flight_ops = 1;
+
+    sqe->opcode = IORING_OP_FSYNC;
+    break;
+  }
+
+  sqe->fd = fd_num;
+  if ( not file.iov.empty() ) {
+    sqe->addr = reinterpret_cast<uint64_t>( file.iov.data() );
+    sqe->len = file.iov.size();
+    sqe->off = static_cast<uint64_t>( -1 );  /* at the current file offset */
+  }
+  sqe->user_data = fd_num;
+
+  sq_array_[ idx ] = idx;
+  __atomic_store_n( sq_tail_, tail + 1, __ATOMIC_RELEASE );
+
+  file.in_flight = true;
+  num_in_flight_++;
+#else
+  (void) file;
+  (void) fd_num;
+#endif
+}
+
+void IOUring::enter( const unsigned int min_complete )
+{
+#ifdef IO_URING_SUPPORTED
+  for ( ;; ) {
+    const unsigned int to_submit =
+      *sq_tail_ - __atomic_load_n( sq_head_, __ATOMIC_ACQUIRE );
+    const unsigned int flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+
+    if ( syscall( __NR_io_uring_enter, ring_fd_, to_submit, min_complete,
+                  flags, nullptr, 0 ) >= 0 ) {
+      return;
+    }
+
+    if ( errno != EINTR ) {
+      throw unix_error( "io_uring_enter" );
+    }
+  }
+#else
+  (void) min_complete;
+#endif
+}
+
+void IOUring::reap()
+{
+  if ( not enabled() ) {
+    return;
+  }
+
+#ifdef IO_URING_SUPPORTED
+  /* run after the bookkeeping, as the callbacks might queue operations */
+  vector<function<void()>> callbacks;
+  int error_fd = -1, error = 0;
+
+  unsigned int head = *cq_head_;
+  const unsigned int tail = __atomic_load_n( cq_tail_, __ATOMIC_ACQUIRE );
+
+  for ( ; head != tail; head++ ) {
+    const io_uring_cqe * cqe = static_cast<io_uring_cqe *>( cqes_ )
+                               + ( head & cq_mask_ );
+    const int fd_num = cqe->user_data;
+    const int result = cqe->res;
+
+    num_in_flight_--;
+
+    auto it = files_.find( fd_num );
+    if ( it == files_.end() ) {
+      continue;
+    }
+
+    File & file = it->second;
+    file.in_flight = false;
+
+    if ( result == -EINTR or result == -EAGAIN ) {
+      unsubmitted_ = true;  /* retry */
+      continue;
+    }
+
+    /* a write that makes no progress would be retried forever */
+    if ( result < 0 or
+         ( result == 0 and file.ops.front().type == Op::Type::Write ) ) {
+      error_fd = fd_num;
+      error = result < 0 ? -result : EIO;
+
+      /* the failed operations are dropped without running their callbacks */
+      file.ops.erase( file.ops.begin(),
+                      file.ops.begin() + file.num_in_flight_ops );
+      num_pending_ -= file.num_in_flight_ops;
+    } else {
+      complete( file, result, callbacks );
+    }
+
+    if ( file.ops.empty() ) {
+      files_.erase( it );  /* also releases the fd */
+    } else {
+      unsubmitted_ = true;
+    }
+  }
+
+  __atomic_store_n( cq_head_, head, __ATOMIC_RELEASE );
+
+  /* the following operations of the files go in the same batch */
+  if ( unsubmitted_ ) {
+    submit();
+  }
+
+  for ( auto & callback : callbacks ) {
+    callback();
+  }
+
+  if ( error ) {
+    throw unix_error( "io_uring (fd " + to_string( error_fd ) + ")", error );
+  }
+#endif
+}
+
+void IOUring::complete( File & file, const size_t result,
+                        vector<function<void()>> & callbacks )
+{
+  Op & first = file.ops.front();
+
+  switch ( first.type ) {
+  case Op::Type::Write:
+  {
+    /* a short write leaves the rest of the data queued */
+    size_t written = result;
+    for ( size_t i = 0; i < file.num_in_flight_ops; i++ ) {
+      Op & op = file.ops.front();
+      const size_t remaining = op.data.size() - op.done;
+
+      if ( written < remaining ) {
+        op.done += written;
+        break;
+      }
+
+      written -= remaining;
+      if ( op.done_callback ) {
+        callbacks.emplace_back( move( op.done_callback ) );
+      }
+      file.ops.pop_front();
+      num_pending_--;
+    }
+    break;
+  }
+
+  case Op::Type::Read:
+    callbacks.emplace_back(
+      [callback = move( first.read_callback ), buffer = file.read_buffer,
+       result]() {
+        callback( { buffer->data(), result } );
+      }
+    );
+
+    /* the next read must not overwrite the buffer before the callback */
+    file.read_buffer = nullptr;
+    file.ops.pop_front();
+    num_pending_--;
+    break;
+
+  case Op::Type::Fsync:
+    if ( first.done_callback ) {
+      callbacks.emplace_back( move( first.done_callback ) );
+    }
+    file.ops.pop_front();
+    num_pending_--;
+    break;
+  }
+}
+
+void IOUring::submit_fallback()
+{
+  unsubmitted_ = false;
+
+  /* the callbacks might queue operations, which are performed next round */
+  while ( not files_.empty() ) {
+    auto files = move( files_ );
+    files_.clear();
+
+    for ( auto & [ fd_num, file ] : files ) {
+      while ( not file.ops.empty() ) {
+        Op op = move( file.ops.front() );
+        file.ops.pop_front();
+        num_pending_--;
+
+        switch ( op.type ) {
+        case Op::Type::Write:
+          file.fd->write( string_view( op.data ).substr( op.done ) );
+          if ( op.done_callback ) {
+            op.done_callback();
+          }
+          break;
+
+        case Op::Type::Read:
+        {
+          IOBuffer buffer;
+          op.read_callback( file.fd->read( buffer, op.length ) );
+          break;
+        }
+
+        case Op::Type::Fsync:
+          CheckSystemCall( "fsync", ::fsync( fd_num ) );
+          if ( op.done_callback ) {
+            op.done_callback();
+          }
+          break;
+        }
+      }
+    }
+  }
+}
+
+void IOUring::wait()
+{
+  for ( ;; ) {
+    submit();
+
+    if ( num_pending_ == 0 ) {
+      return;
+    }
+
+    if ( not enabled() ) {
+      continue;
+    }
+
+    if ( num_in_flight_ == 0 ) {
+      throw runtime_error( "IOUring: operations are pending but none is in flight" );
+    }
+
+    enter( 1 );
+    reap();
+  }
+}
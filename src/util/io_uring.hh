@@ -0,0 +1,156 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+#ifndef IO_URING_HH
+#define IO_URING_HH
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <unordered_map>
+#include <sys/uio.h>
+
+#include "config.h"
+#include "file_descriptor.hh"
+#include "eventfd.hh"
+#include "io_buffer.hh"
+#include "poller.hh"
+
+/* Batched file I/O through io_uring. Reads, writes and fsyncs are queued and
+ * handed to the kernel together with a single io_uring_enter(2); consecutive
+ * writes to a file become a single writev. Completions are signaled on an
+ * eventfd, so that the callbacks are run by the event loop like the other
+ * actions. Operations on a file run in the order they were queued, at the
+ * current file offset.
+ *
+ * Without io_uring (an old kernel, a seccomp filter, or built without
+ * <linux/io_uring.h>), the queued operations are performed with the usual
+ * blocking syscalls when submitted, and the callbacks are run right away. */
+class IOUring
+{
+public:
+  using DoneCallback = std::function<void()>;
+  using ReadCallback = std::function<void(const std::string_view data)>;
+
+  IOUring( const unsigned int entries = 64 );
+
+  /* waits for the operations in flight, but drops the queued ones and does
+   * not run any callbacks */
+  ~IOUring();
+
+  /* whether the operations go through io_uring or the fallback */
+  bool enabled() const { return ring_fd_ >= 0; }
+
+  /* submit the queued operations and run the callbacks of the completed
+   * ones from poller's event loop */
+  void add_to_poller( Poller & poller );
+
+  /* write all of data to fd; fd is kept open until the write completes */
+  void write( const std::shared_ptr<FileDescriptor> & fd, std::string && data,
+              DoneCallback && callback = {} );
+
+  /* read at most length bytes from fd; an empty read means EOF */
+  void read( const std::shared_ptr<FileDescriptor> & fd, const size_t length,
+             ReadCallback && callback );
+
+  /* flush fd to disk after the operations that were queued before */
+  void fsync( const std::shared_ptr<FileDescriptor> & fd,
+              DoneCallback && callback = {} );
+
+  /* hand the queued operations to the kernel (or perform them) */
+  void submit();
+
+  /* run the callbacks of the completed operations without blocking */
+  void reap();
+
+  /* block until all the operations have completed */
+  void wait();
+
+  /* number of operations that have not completed */
+  size_t num_pending() const { return num_pending_; }
+
+  /* forbid copying or moving */
+  IOUring( const IOUring & other ) = delete;
+  const IOUring & operator=( const IOUring & other ) = delete;
+  IOUring( IOUring && other ) = delete;
+  IOUring & operator=( IOUring && other ) = delete;
+
+private:
+  struct Op
+  {
+    enum class Type { Write, Read, Fsync } type;
+    std::string data {};      /* write: the bytes to write */
+    size_t length { 0 };      /* read: the maximum bytes to read */
+    size_t done { 0 };        /* write: the bytes already written */
+    DoneCallback done_callback {};
+    ReadCallback read_callback {};
+  };
+
+  /* the queued operations of a file, of which only the first (or the first
+   * writes) are handed to the kernel at a time */
+  struct File
+  {
+    std::shared_ptr<FileDescriptor> fd;
+    std::deque<Op> ops {};
+    bool in_flight { false };
+    size_t num_in_flight_ops { 0 };
+    std::vector<iovec> iov {};
+    std::shared_ptr<IOBuffer> read_buffer { nullptr };
+  };
+
+  /* key: fd number */
+  std::unordered_map<int, File> files_ {};
+  size_t num_pending_ { 0 };
+
+  /* whether a file has queued operations that are not in flight */
+  bool unsubmitted_ { false };
+
+  /* shared with the poller actions, which might outlive the ring */
+  std::shared_ptr<EventFD> eventfd_ { std::make_shared<EventFD>() };
+  std::shared_ptr<bool> alive_ { std::make_shared<bool>( true ) };
+
+  /* io_uring only */
+  int ring_fd_ { -1 };
+  unsigned int num_in_flight_ { 0 };
+  unsigned int sq_entries_ { 0 };
+
+  /* the submission and completion rings share a single mapping */
+  void * ring_ { nullptr };
+  size_t ring_size_ { 0 };
+  void * sqes_ { nullptr };
+  size_t sqes_size_ { 0 };
+
+  unsigned int * sq_head_ { nullptr };
+  unsigned int * sq_tail_ { nullptr };
+  unsigned int sq_mask_ { 0 };
+  unsigned int * sq_array_ { nullptr };
+  unsigned int * cq_head_ { nullptr };
+  unsigned int * cq_tail_ { nullptr };
+  unsigned int cq_mask_ { 0 };
+  void * cqes_ { nullptr };
+
+  void queue( const std::shared_ptr<FileDescriptor> & fd, Op && op );
+
+  /* set up the ring; return false if io_uring is not available */
+  bool setup_ring( const unsigned int entries );
+  void unmap_ring();
+
+  /* fill a submission entry with the first operations of file */
+  void prepare( File & file, const int fd_num );
+
+  /* account for the bytes transferred by file's in-flight operations; the
+   * callbacks of the completed operations are appended to callbacks */
+  void complete( File & file, const size_t result,
+                 std::vector<std::function<void()>> & callbacks );
+
+  /* perform the queued operations with blocking syscalls */
+  void submit_fallback();
+
+  /* io_uring_enter(2) with all the prepared entries */
+  void enter( const unsigned int min_complete );
+};
+
+#endif /* IO_URING_HH */
@@ -4,13 +4,14 @@
 
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <cstring>
 
 #include "exception.hh"
 
 using namespace std;
 
-IPCSocket::IPCSocket()
-  : FileDescriptor( CheckSystemCall( "socket", socket( AF_UNIX, SOCK_STREAM, 0 ) ) )
+IPCSocket::IPCSocket( const int type )
+  : FileDescriptor( CheckSystemCall( "socket", socket( AF_UNIX, type, 0 ) ) )
 {}
 
 sockaddr_un create_sockaddr_un( const string & path )
@@ -46,6 +47,7 @@ void IPCSocket::listen( const int backlog )
 
 FileDescriptor IPCSocket::accept()
 {
+  register_read();
   return { CheckSystemCall( "accept", ::accept( fd_num(), nullptr, nullptr ) ) };
 }
 
@@ -62,3 +64,81 @@ void IPCSocket::set_reuseaddr( void )
 {
   setsockopt( SOL_SOCKET, SO_REUSEADDR, int( true ) );
 }
+
+void IPCSocket::send_with_fd( const string & message, const int fd )
+{
+  if ( message.empty() ) {
+    throw runtime_error( "send_with_fd: empty message" );
+  }
+
+  iovec iov;
+  iov.iov_base = const_cast<char *>( message.data() );
+  iov.iov_len = message.size();
+
+  msghdr msg {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  alignas( cmsghdr ) char control[ CMSG_SPACE( sizeof( int ) ) ];
+
+  if ( fd >= 0 ) {
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof( control );
+
+    cmsghdr * cmsg = CMSG_FIRSTHDR( &msg );
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN( sizeof( int ) );
+    memcpy( CMSG_DATA( cmsg ), &fd, sizeof( int ) );
+  }
+
+  const ssize_t bytes_sent = CheckSystemCall( "sendmsg", sendmsg( fd_num(), &msg, MSG_NOSIGNAL ) );
+  register_write();
+
+  if ( static_cast<size_t>( bytes_sent ) != message.size() ) {
+    throw runtime_error( "send_with_fd: short write" );
+  }
+}
+
+pair<string, optional<FileDescriptor>> IPCSocket::recv_with_fd( const size_t max_size )
+{
+  string message( max_size, '\0' );
+
+  iovec iov;
+  iov.iov_base = message.data();
+  iov.iov_len = message.size();
+
+  msghdr msg {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  alignas( cmsghdr ) char control[ CMSG_SPACE( sizeof( int ) ) ];
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof( control );
+
+  const ssize_t bytes_read = CheckSystemCall( "recvmsg",
+    recvmsg( fd_num(), &msg, MSG_CMSG_CLOEXEC ) );
+  register_read();
+
+  if ( bytes_read == 0 ) {
+    set_eof();
+  }
+
+  message.resize( bytes_read );
+
+  optional<FileDescriptor> received_fd;
+  for ( cmsghdr * cmsg = CMSG_FIRSTHDR( &msg ); cmsg != nullptr;
+        cmsg = CMSG_NXTHDR( &msg, cmsg ) ) {
+    if ( cmsg->cmsg_level == SOL_SOCKET and cmsg->cmsg_type == SCM_RIGHTS ) {
+      int fd;
+      memcpy( &fd, CMSG_DATA( cmsg ), sizeof( int ) );
+      received_fd.emplace( fd );
+    }
+  }
+
+  if ( msg.msg_flags & ( MSG_TRUNC | MSG_CTRUNC ) ) {
+    throw runtime_error( "recv_with_fd: message truncated" );
+  }
+
+  return { move( message ), move( received_fd ) };
+}
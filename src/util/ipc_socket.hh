@@ -4,6 +4,9 @@
 #define IPC_SOCKET_HH
 
 #include <string>
+#include <utility>
+#include <optional>
+#include <sys/socket.h>
 
 #include "file_descriptor.hh"
 
@@ -11,7 +14,12 @@
 class IPCSocket : public FileDescriptor
 {
 public:
-  IPCSocket();
+  /* SOCK_SEQPACKET preserves the boundaries of the messages passed to
+   * send_with_fd() */
+  IPCSocket( const int type = SOCK_STREAM );
+
+  /* adopt an accepted connection */
+  explicit IPCSocket( FileDescriptor && fd ) : FileDescriptor( std::move( fd ) ) {}
 
   void bind( const std::string & path );
   void connect( const std::string & path );
@@ -21,6 +29,14 @@ public:
 
   void set_reuseaddr( void );
 
+  /* send message along with a copy of fd (SCM_RIGHTS) if fd >= 0 */
+  void send_with_fd( const std::string & message, const int fd = -1 );
+
+  /* receive a message of up to max_size bytes and the fd sent with it;
+   * an empty message and no fd on EOF */
+  std::pair<std::string, std::optional<FileDescriptor>>
+  recv_with_fd( const size_t max_size = 65536 );
+
 protected:
   template <typename option_type>
   void setsockopt( const int level, const int option, const option_type & option_value );
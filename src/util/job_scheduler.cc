@@ -0,0 +1,266 @@
+#include "job_scheduler.hh"
+
+#include <charconv>
+#include <iostream>
+#include <stdexcept>
+
+#include "filesystem.hh"
+#include "timestamp.hh"
+#include "tokenize.hh"
+
+using namespace std;
+using namespace PollerShortNames;
+
+/* the deadline of a chunk is forgotten after this long, by when all of its
+ * stages should have been requested */
+static const uint64_t deadline_memory_ms = 10 * 60 * 1000;
+
+static optional<uint64_t> parse_uint64(const string & str)
+{
+  uint64_t value;
+  const auto [ptr, ec] = from_chars(str.data(), str.data() + str.size(),
+                                    value);
+  if (ec != errc() or ptr != str.data() + str.size()) {
+    return nullopt;
+  }
+
+  return value;
+}
+
+JobScheduler::JobScheduler(Poller & poller, const string & socket_path,
+                           const vector<int> & cpus)
+  : poller_(poller), socket_path_(socket_path), cpus_(cpus)
+{
+  if (cpus_.empty()) {
+    throw runtime_error("JobScheduler requires at least one worker");
+  }
+
+  for (size_t i = 0; i < cpus_.size(); i++) {
+    idle_workers_.emplace_back(i);
+  }
+
+  socket_.bind(socket_path_);
+  socket_.listen();
+
+  poller_.add_action(
+    Poller::Action(socket_, Direction::In,
+      [this]() {
+        accept();
+        return ResultType::Continue;
+      }
+    ).named("job_scheduler")
+  );
+}
+
+JobScheduler::~JobScheduler()
+{
+  error_code ec;
+  if (not fs::remove(socket_path_, ec)) {
+    cerr << "Warning: file " << socket_path_ << " cannot be removed" << endl;
+  }
+}
+
+void JobScheduler::accept()
+{
+  const uint64_t client_id = next_client_id_++;
+  auto connection = make_shared<IPCSocket>(socket_.accept());
+  clients_.emplace(client_id, Client { connection });
+
+  /* the action holds the connection, which outlives the client */
+  poller_.add_action(
+    Poller::Action(*connection, Direction::In,
+      [this, client_id, connection]() {
+        return receive(client_id) ? ResultType::Continue : ResultType::Cancel;
+      }
+    ).named("job_scheduler_client")
+  );
+}
+
+bool JobScheduler::receive(const uint64_t client_id)
+{
+  Client & client = clients_.at(client_id);
+  client.buffer.append(client.connection->read());
+
+  if (client.connection->eof()) {
+    disconnect(client_id);
+    return false;
+  }
+
+  size_t line_start = 0;
+  for (size_t line_end = client.buffer.find('\n');
+       line_end != string::npos;
+       line_end = client.buffer.find('\n', line_start)) {
+    handle_line(client_id,
+                client.buffer.substr(line_start, line_end - line_start));
+    line_start = line_end + 1;
+  }
+
+  client.buffer.erase(0, line_start);
+
+  dispatch();
+  return true;
+}
+
+void JobScheduler::handle_line(const uint64_t client_id, const string & line)
+{
+  const vector<string> tokens = split(line, " ");
+
+  if (tokens.size() == 5 and tokens[0] == "request") {
+    const auto stage = parse_uint64(tokens[3]);
+    if (not stage) {
+      throw runtime_error("JobScheduler: invalid request: " + line);
+    }
+
+    pending_.emplace(
+      PendingKey { deadline(tokens[2], parse_uint64(tokens[4])),
+                   -int64_t(*stage), num_requests_++ },
+      JobKey { client_id, tokens[1] });
+  } else if (tokens.size() == 2 and tokens[0] == "release") {
+    const auto it = granted_.find({client_id, tokens[1]});
+    if (it == granted_.end()) {
+      throw runtime_error("JobScheduler: release of a job not granted: "
+                          + line);
+    }
+
+    idle_workers_.emplace_back(it->second);
+    granted_.erase(it);
+  } else {
+    throw runtime_error("JobScheduler: invalid line: " + line);
+  }
+}
+
+void JobScheduler::disconnect(const uint64_t client_id)
+{
+  for (auto it = pending_.begin(); it != pending_.end();) {
+    if (it->second.first == client_id) {
+      it = pending_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  for (auto it = granted_.begin(); it != granted_.end();) {
+    if (it->first.first == client_id) {
+      idle_workers_.emplace_back(it->second);
+      it = granted_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  clients_.erase(client_id);
+  dispatch();
+}
+
+uint64_t JobScheduler::deadline(const string & channel,
+                                const optional<uint64_t> & timestamp)
+{
+  const uint64_t now = timestamp_ms();
+
+  /* forget the chunks seen too long ago */
+  while (not deadline_order_.empty() and
+         deadline_order_.front().first + deadline_memory_ms < now) {
+    deadlines_.erase(deadline_order_.front().second);
+    deadline_order_.pop_front();
+  }
+
+  if (not timestamp) {
+    return now;
+  }
+
+  const ChunkKey chunk { channel, *timestamp };
+  const auto [it, inserted] = deadlines_.emplace(chunk, now);
+  if (inserted) {
+    deadline_order_.emplace_back(now, chunk);
+  }
+
+  return it->second;
+}
+
+void JobScheduler::dispatch()
+{
+  while (not idle_workers_.empty() and not pending_.empty()) {
+    const JobKey job = pending_.begin()->second;
+    pending_.erase(pending_.begin());
+
+    const size_t worker = idle_workers_.back();
+    idle_workers_.pop_back();
+
+    granted_.emplace(job, worker);
+
+    /* without SIGPIPE; a client that has gone releases the worker once its
+     * EOF is read */
+    try {
+      clients_.at(job.first).connection->send_with_fd(
+        "grant " + job.second + " " + to_string(cpus_[worker]) + "\n");
+    } catch (const exception & e) {
+      cerr << "JobScheduler: " << e.what() << endl;
+    }
+  }
+}
+
+JobSchedulerClient::JobSchedulerClient(Poller & poller,
+                                       const string & socket_path,
+                                       const string & channel,
+                                       const unsigned int stage)
+  : channel_(channel), stage_(stage)
+{
+  socket_.connect(socket_path);
+
+  poller.add_action(
+    Poller::Action(socket_, Direction::In,
+      [this]() {
+        receive();
+        return ResultType::Continue;
+      }
+    ).named("job_scheduler")
+  );
+}
+
+uint64_t JobSchedulerClient::request(const optional<uint64_t> & timestamp,
+                                     grant_callback_t && callback)
+{
+  const uint64_t job = next_job_++;
+  waiting_.emplace(job, move(callback));
+
+  socket_.write("request " + to_string(job) + " " + channel_ + " "
+                + to_string(stage_) + " "
+                + (timestamp ? to_string(*timestamp) : "-") + "\n");
+  return job;
+}
+
+void JobSchedulerClient::release(const uint64_t job)
+{
+  socket_.write("release " + to_string(job) + "\n");
+}
+
+void JobSchedulerClient::receive()
+{
+  buffer_.append(socket_.read());
+  if (socket_.eof()) {
+    throw runtime_error("JobSchedulerClient: the scheduler has exited");
+  }
+
+  size_t line_start = 0;
+  for (size_t line_end = buffer_.find('\n');
+       line_end != string::npos;
+       line_end = buffer_.find('\n', line_start)) {
+    const vector<string> tokens =
+      split(buffer_.substr(line_start, line_end - line_start), " ");
+    line_start = line_end + 1;
+
+    const auto job = tokens.size() == 3 and tokens[0] == "grant" ?
+                     parse_uint64(tokens[1]) : nullopt;
+    const auto it = job ? waiting_.find(*job) : waiting_.end();
+    if (it == waiting_.end()) {
+      throw runtime_error("JobSchedulerClient: unexpected grant");
+    }
+
+    /* the callback may request more */
+    const grant_callback_t callback = move(it->second);
+    waiting_.erase(it);
+    callback(*job, stoi(tokens[2]));
+  }
+
+  buffer_.erase(0, line_start);
+}
@@ -0,0 +1,126 @@
+#ifndef JOB_SCHEDULER_HH
+#define JOB_SCHEDULER_HH
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "file_descriptor.hh"
+#include "ipc_socket.hh"
+#include "poller.hh"
+
+/* A scheduler of the jobs of all the notifiers on a host (of every stage,
+ * format and channel), which run a job only once the scheduler grants it
+ * one of a fixed pool of workers, each pinned to a CPU. Waiting jobs are
+ * granted earliest deadline first: the deadline of a chunk of a channel is
+ * when the first job of that chunk was requested, i.e., when the decoder
+ * wrote the raw chunk and its canonicalizer asked to run, so that every
+ * stage of an older chunk goes before any job of a newer one; among chunks
+ * with the same deadline, the job at a later stage (closer to making the
+ * chunk ready) goes first.
+ *
+ * The notifiers talk to the scheduler over a Unix domain socket in lines:
+ *   "request <job> <channel> <stage> <timestamp>"  notifier to scheduler
+ *   "grant <job> <cpu>"                             scheduler to notifier
+ *   "release <job>"                                 notifier to scheduler
+ * where <timestamp> is "-" for an input not named after a timestamp (whose
+ * deadline is then when it is requested). A notifier that disconnects
+ * releases all of its jobs. */
+class JobScheduler
+{
+public:
+  /* listen on socket_path, with a worker on each of cpus (a CPU may appear
+   * more than once to run more than one job on it) */
+  JobScheduler(Poller & poller, const std::string & socket_path,
+               const std::vector<int> & cpus);
+  ~JobScheduler();
+
+  /* forbid copying and moving, as the actions refer to this */
+  JobScheduler(const JobScheduler & other) = delete;
+  JobScheduler & operator=(const JobScheduler & other) = delete;
+
+private:
+  struct Client
+  {
+    std::shared_ptr<IPCSocket> connection;
+    std::string buffer {};
+  };
+
+  /* key: deadline (ms), minus stage, request number */
+  using PendingKey = std::tuple<uint64_t, int64_t, uint64_t>;
+  /* key: client, job */
+  using JobKey = std::pair<uint64_t, std::string>;
+  /* key: channel, timestamp */
+  using ChunkKey = std::pair<std::string, uint64_t>;
+
+  Poller & poller_;
+  std::string socket_path_;
+  IPCSocket socket_ {};
+
+  std::vector<int> cpus_;
+  std::vector<size_t> idle_workers_ {};  /* indices into cpus_ */
+
+  std::map<uint64_t, Client> clients_ {};
+  uint64_t next_client_id_ {0};
+
+  std::map<PendingKey, JobKey> pending_ {};
+  uint64_t num_requests_ {0};
+  std::map<JobKey, size_t> granted_ {};  /* value: worker */
+
+  /* the deadlines of the chunks seen recently, in the order they were seen
+   * so that those too old to be requested again are forgotten */
+  std::map<ChunkKey, uint64_t> deadlines_ {};
+  std::deque<std::pair<uint64_t, ChunkKey>> deadline_order_ {};
+
+  void accept();
+  bool receive(const uint64_t client_id);
+  void handle_line(const uint64_t client_id, const std::string & line);
+  void disconnect(const uint64_t client_id);
+
+  uint64_t deadline(const std::string & channel,
+                    const std::optional<uint64_t> & timestamp);
+
+  /* grant the idle workers to the pending jobs with the earliest deadlines */
+  void dispatch();
+};
+
+/* a notifier's connection to JobScheduler */
+class JobSchedulerClient
+{
+public:
+  /* called with the job and the CPU of its worker once granted */
+  using grant_callback_t = std::function<void(const uint64_t, const int)>;
+
+  JobSchedulerClient(Poller & poller, const std::string & socket_path,
+                     const std::string & channel, const unsigned int stage);
+
+  /* ask for a worker to process an input with the timestamp in its name,
+   * if any; return the job to release after processing it */
+  uint64_t request(const std::optional<uint64_t> & timestamp,
+                   grant_callback_t && callback);
+  void release(const uint64_t job);
+
+  /* forbid copying and moving, as the action refers to this */
+  JobSchedulerClient(const JobSchedulerClient & other) = delete;
+  JobSchedulerClient & operator=(const JobSchedulerClient & other) = delete;
+
+private:
+  IPCSocket socket_ {};
+  std::string channel_;
+  unsigned int stage_;
+
+  uint64_t next_job_ {0};
+  std::map<uint64_t, grant_callback_t> waiting_ {};
+  std::string buffer_ {};
+
+  void receive();
+};
+
+#endif /* JOB_SCHEDULER_HH */
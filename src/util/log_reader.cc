@@ -0,0 +1,270 @@
+#include "log_reader.hh"
+
+#include <fcntl.h>
+#include <zstd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+
+#include "exception.hh"
+#include "strict_conversions.hh"
+#include "tokenize.hh"
+
+using namespace std;
+
+LogReader::LogReader(const fs::path & path, const size_t num_columns)
+  : path_(path), num_columns_(num_columns),
+    fd_(CheckSystemCall("open (" + path.string() + ")",
+                        open(path.c_str(), O_RDONLY)))
+{
+  /* a compressed log is decompressed as it is read */
+  string head = fd_.read();
+  uint32_t magic = 0;
+  memcpy(&magic, head.data(), min(head.size(), sizeof(magic)));
+
+  if (magic == ZSTD_MAGICNUMBER) {
+    dctx_ = {ZSTD_createDCtx(), ZSTD_freeDCtx};
+    if (not dctx_) {
+      throw runtime_error("ZSTD_createDCtx failed");
+    }
+
+    input_ = move(head);
+    fill();
+  } else {
+    buf_ = move(head);
+  }
+
+  /* a binary log starts with its header */
+  if (buf_.compare(0, BinaryLog::MAGIC.size(), BinaryLog::MAGIC) == 0) {
+    const auto header = BinaryLog::parse_header(buf_);
+    if (not header) {
+      throw runtime_error(path_.string() + ": truncated binary log header");
+    }
+
+    decoder_.emplace(header->first);
+    pos_ = header->second;
+  }
+
+  advance();
+}
+
+bool LogReader::fill()
+{
+  buf_.erase(0, pos_);
+  pos_ = 0;
+
+  if (not dctx_) {
+    const string data = fd_.read();
+    buf_ += data;
+    return not data.empty();
+  }
+
+  /* decompress until there is some output, or to the end of the log */
+  const size_t old_size = buf_.size();
+
+  for (;;) {
+    if (input_pos_ == input_.size()) {
+      input_ = fd_.read();
+      input_pos_ = 0;
+      if (input_.empty()) {
+        return buf_.size() > old_size;
+      }
+    }
+
+    ZSTD_inBuffer in {input_.data(), input_.size(), input_pos_};
+    size_t out_size;
+
+    /* all the output of the input so far */
+    do {
+      out_size = buf_.size();
+      buf_.resize(out_size + ZSTD_DStreamOutSize());
+
+      ZSTD_outBuffer out {buf_.data() + out_size, ZSTD_DStreamOutSize(), 0};
+      const size_t ret = ZSTD_decompressStream(dctx_.get(), &out, &in);
+      if (ZSTD_isError(ret)) {
+        throw runtime_error(path_.string() + ": " + ZSTD_getErrorName(ret));
+      }
+
+      buf_.resize(out_size + out.pos);
+    } while (buf_.size() == out_size + ZSTD_DStreamOutSize()
+             or in.pos < in.size);
+
+    input_pos_ = in.pos;
+
+    if (buf_.size() > old_size) {
+      return true;
+    }
+  }
+}
+
+bool LogReader::next_line()
+{
+  for (;;) {
+    if (decoder_) {
+      if (next_decoded_ < decoded_.size()) {
+        values_.clear();
+        for (const auto & value : decoded_[next_decoded_]) {
+          values_.emplace_back(value);
+        }
+        next_decoded_++;
+        return true;
+      }
+
+      /* decode the next complete blocks */
+      decoded_.clear();
+      next_decoded_ = 0;
+      pos_ += decoder_->decode(string_view(buf_).substr(pos_), decoded_);
+      if (not decoded_.empty()) {
+        continue;
+      }
+    } else {
+      const char * data = buf_.data();
+      const void * newline = memchr(data + pos_, '\n', buf_.size() - pos_);
+      if (newline) {
+        const size_t line_end = static_cast<const char *>(newline) - data;
+        split(string_view(data + pos_, line_end - pos_), ",", values_);
+        pos_ = line_end + 1;
+        return true;
+      }
+    }
+
+    if (not fill()) {
+      /* e.g., the server died in the middle of a write */
+      if (pos_ < buf_.size()) {
+        cerr << path_.string() << ": ignored " << buf_.size() - pos_
+             << " bytes of an incomplete " << (decoder_ ? "block" : "line")
+             << " at the end" << endl;
+      }
+      return false;
+    }
+  }
+}
+
+void LogReader::advance()
+{
+  while (next_line()) {
+    if (values_.size() == num_columns_) {
+      if (const auto ts = parse_number<uint64_t>(values_[0])) {
+        ts_ = *ts;
+        return;
+      }
+    }
+
+    num_malformed_++;
+  }
+
+  done_ = true;
+}
+
+vector<ServerLogs> find_server_logs(const vector<string> & paths,
+                                    const vector<string> & measurements)
+{
+  map<pair<fs::path, string>, ServerLogs> servers;
+
+  auto add = [&servers, &measurements](const fs::path & path) {
+    const string name = path.filename().string();
+
+    for (size_t m = 0; m < measurements.size(); m++) {
+      const string prefix = measurements[m] + ".";
+      if (name.compare(0, prefix.size(), prefix) != 0) {
+        continue;
+      }
+
+      const size_t dot = name.find('.', prefix.size());
+      if (dot == string::npos or dot == prefix.size()
+          or name.compare(dot, 4, ".log") != 0
+          or (name.size() >= 4
+              and name.compare(name.size() - 4, 4, ".tmp") == 0)) {
+        continue;
+      }
+
+      const string server_id = name.substr(prefix.size(), dot - prefix.size());
+      ServerLogs & server = servers[{path.parent_path(), server_id}];
+      server.dir = path.parent_path();
+      server.server_id = server_id;
+      server.logs.emplace_back(path, m);
+      server.total_size += fs::file_size(path);
+    }
+  };
+
+  for (const auto & path : paths) {
+    if (fs::is_directory(path)) {
+      for (const auto & entry : fs::recursive_directory_iterator(path)) {
+        if (fs::is_regular_file(entry.path())) {
+          add(entry.path());
+        }
+      }
+    } else if (fs::is_regular_file(path)) {
+      add(path);
+    } else {
+      throw runtime_error(path + ": no such log or directory");
+    }
+  }
+
+  vector<ServerLogs> ret;
+  for (auto & [dir_and_id, server] : servers) {
+    ret.emplace_back(move(server));
+  }
+
+  /* the largest first, so that work spread over threads ends evenly */
+  sort(ret.begin(), ret.end(), [](const ServerLogs & a, const ServerLogs & b) {
+    return a.total_size > b.total_size;
+  });
+
+  return ret;
+}
+
+ServerLogReader::ServerLogReader(const ServerLogs & logs,
+                                 const vector<string> & measurements)
+{
+  for (const auto & [path, measurement] : logs.logs) {
+    const auto schema = BinaryLog::schema(measurements.at(measurement));
+    if (not schema) {
+      throw runtime_error("no schema of " + measurements.at(measurement));
+    }
+
+    logs_.emplace_back(new Log {LogReader(path, schema->size()), measurement});
+    if (not logs_.back()->reader.done()) {
+      heap_.push_back(logs_.back().get());
+    }
+  }
+
+  make_heap(heap_.begin(), heap_.end(), later);
+}
+
+bool ServerLogReader::later(const Log * a, const Log * b)
+{
+  return a->reader.ts() > b->reader.ts();
+}
+
+void ServerLogReader::advance()
+{
+  pop_heap(heap_.begin(), heap_.end(), later);
+
+  Log * const log = heap_.back();
+  log->reader.advance();
+
+  if (log->reader.done()) {
+    heap_.pop_back();
+  } else {
+    push_heap(heap_.begin(), heap_.end(), later);
+  }
+}
+
+void ServerLogReader::skip_log()
+{
+  pop_heap(heap_.begin(), heap_.end(), later);
+  heap_.pop_back();
+}
+
+uint64_t ServerLogReader::num_malformed() const
+{
+  uint64_t ret = 0;
+  for (const auto & log : logs_) {
+    ret += log->reader.num_malformed();
+  }
+  return ret;
+}
@@ -0,0 +1,131 @@
+#ifndef LOG_READER_HH
+#define LOG_READER_HH
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "binary_log.hh"
+#include "file_descriptor.hh"
+#include "filesystem.hh"
+
+struct ZSTD_DCtx_s;
+
+/* Reads the comma-separated lines of a log of ws_media_server, text or
+ * binary (see binary_log.hh) and possibly compressed with zstd (see
+ * LogCompressor), from start to end, for offline analysis. Lines
+ * without num_columns columns and a timestamp in ms first are skipped (and
+ * counted), as is an incomplete line or block at the end of the log. */
+class LogReader
+{
+public:
+  LogReader(const fs::path & path, const size_t num_columns);
+
+  bool done() const { return done_; }
+
+  /* the timestamp and values of the current line, valid until advance() */
+  uint64_t ts() const { return ts_; }
+  const std::vector<std::string_view> & values() const { return values_; }
+
+  /* move on to the next line */
+  void advance();
+
+  uint64_t num_malformed() const { return num_malformed_; }
+
+private:
+  fs::path path_;
+  size_t num_columns_;
+  FileDescriptor fd_;
+
+  /* of a compressed log: its unread input */
+  std::unique_ptr<ZSTD_DCtx_s, size_t (*)(ZSTD_DCtx_s *)> dctx_ {nullptr,
+                                                                 nullptr};
+  std::string input_ {};
+  size_t input_pos_ {0};
+
+  std::string buf_ {};
+  size_t pos_ {0};
+
+  std::optional<BinaryLogDecoder> decoder_ {};
+  std::vector<std::vector<std::string>> decoded_ {};
+  size_t next_decoded_ {0};
+
+  std::vector<std::string_view> values_ {};
+  uint64_t ts_ {0};
+  bool done_ {false};
+  uint64_t num_malformed_ {0};
+
+  /* append the next read of the log to buf_; false at its end */
+  bool fill();
+
+  /* the values of the next line, or false at the end of the log */
+  bool next_line();
+};
+
+/* the logs of a server, e.g., video_sent.3.log and its partitions such as
+ * video_sent.3.log.20261015T1300.zst */
+struct ServerLogs
+{
+  fs::path dir {};
+  std::string server_id {};
+
+  /* each log and the index of its measurement */
+  std::vector<std::pair<fs::path, size_t>> logs {};
+  uintmax_t total_size {0};
+};
+
+/* the logs of measurements in paths (logs or directories of them), which are
+ * named <measurement>.<server ID>.log and possibly a suffix (such as that of
+ * a partition, see LogWriter), by server and largest first; a server is told
+ * apart by its directory as well, as each host numbers its servers from 1.
+ * Files still being written by LogCompressor (.tmp) are skipped. */
+std::vector<ServerLogs> find_server_logs(
+  const std::vector<std::string> & paths,
+  const std::vector<std::string> & measurements);
+
+/* reads the logs of a server at once, merged into a single sequence of lines
+ * by timestamp; the columns of each measurement are those of its schema in
+ * BinaryLog::schema() */
+class ServerLogReader
+{
+public:
+  ServerLogReader(const ServerLogs & logs,
+                  const std::vector<std::string> & measurements);
+
+  bool done() const { return heap_.empty(); }
+
+  /* the current line, that of the earliest timestamp */
+  size_t measurement() const { return heap_.front()->measurement; }
+  uint64_t ts() const { return heap_.front()->reader.ts(); }
+  const std::vector<std::string_view> & values() const
+  { return heap_.front()->reader.values(); }
+
+  /* move on to the next line */
+  void advance();
+
+  /* skip the rest of the log of the current line */
+  void skip_log();
+
+  /* lines skipped as malformed so far */
+  uint64_t num_malformed() const;
+
+private:
+  struct Log
+  {
+    LogReader reader;
+    size_t measurement;
+  };
+
+  std::vector<std::unique_ptr<Log>> logs_ {};
+
+  /* the logs not done yet, as a min-heap by the timestamp of their line */
+  std::vector<Log *> heap_ {};
+
+  static bool later(const Log * a, const Log * b);
+};
+
+#endif /* LOG_READER_HH */
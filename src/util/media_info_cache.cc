@@ -0,0 +1,133 @@
+#include <sys/stat.h>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include "media_info_cache.hh"
+#include "exception.hh"
+#include "path.hh"
+
+using namespace std;
+
+/* one line per entry: the stat of the file, its info, and its path last
+ * (as it may contain spaces) */
+static const string format_version = "media-info-cache 1";
+
+static bool stat_file(const string & file, struct stat & st)
+{
+  if (stat(file.c_str(), &st) < 0) {
+    if (errno == ENOENT) {
+      return false;
+    }
+    throw unix_error("stat (" + file + ")");
+  }
+
+  return true;
+}
+
+static int64_t mtime_ns(const struct stat & st)
+{
+  return int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+MediaInfoCache::MediaInfoCache(const fs::path & path)
+  : path_(path)
+{
+  ifstream in(path_);
+  if (not in) {
+    return;  /* not saved yet */
+  }
+
+  string line;
+  if (not getline(in, line) or line != format_version) {
+    cerr << "MediaInfoCache: ignoring " << path_ << " of another format"
+         << endl;
+    return;
+  }
+
+  while (getline(in, line)) {
+    istringstream fields(line);
+    Entry entry {};
+    MediaInfo & info = entry.info;
+    unsigned int profile, level, object_type;
+    string file;
+
+    fields >> entry.ino >> entry.mtime_ns >> entry.size >> info.codec
+           >> info.timescale >> info.duration >> info.sample_count
+           >> info.sample_bytes >> info.width >> info.height >> profile
+           >> level >> info.sample_rate >> object_type >> info.channel_count;
+    fields.get();  /* the space before the path */
+    getline(fields, file);
+
+    if (fields.fail() or file.empty()) {
+      cerr << "MediaInfoCache: ignoring a bad line in " << path_ << endl;
+      continue;
+    }
+
+    info.codec = info.codec == "-" ? "" : info.codec;
+    info.avc_profile = profile;
+    info.avc_level = level;
+    info.audio_object_type = object_type;
+
+    entries_.emplace(move(file), move(entry));
+  }
+}
+
+MediaInfo MediaInfoCache::get(
+    const fs::path & file,
+    const function<MediaInfo(const fs::path &)> & probe)
+{
+  struct stat st;
+  if (not stat_file(file, st)) {
+    throw runtime_error("MediaInfoCache: " + file.string() + " is gone");
+  }
+
+  auto it = entries_.find(file);
+  if (it != entries_.end() and it->second.ino == st.st_ino
+      and it->second.mtime_ns == mtime_ns(st)
+      and it->second.size == st.st_size) {
+    return it->second.info;
+  }
+
+  MediaInfo info = probe(file);
+  entries_[file] = {st.st_ino, mtime_ns(st), st.st_size, info};
+  dirty_ = true;
+
+  return info;
+}
+
+void MediaInfoCache::save()
+{
+  for (auto it = entries_.begin(); it != entries_.end();) {
+    struct stat st;
+    if (stat_file(it->first, st)) {
+      ++it;
+    } else {
+      it = entries_.erase(it);
+      dirty_ = true;
+    }
+  }
+
+  if (not dirty_) {
+    return;
+  }
+
+  ostringstream out;
+  out << format_version << "\n";
+
+  for (const auto & [file, entry] : entries_) {
+    const MediaInfo & info = entry.info;
+
+    out << entry.ino << " " << entry.mtime_ns << " " << entry.size << " "
+        << (info.codec.empty() ? "-" : info.codec) << " "
+        << info.timescale << " " << info.duration << " "
+        << info.sample_count << " " << info.sample_bytes << " "
+        << info.width << " " << info.height << " "
+        << unsigned(info.avc_profile) << " " << unsigned(info.avc_level) << " "
+        << info.sample_rate << " " << unsigned(info.audio_object_type) << " "
+        << info.channel_count << " " << file << "\n";
+  }
+
+  roost::atomic_create(out.str(), path_.string());
+  dirty_ = false;
+}
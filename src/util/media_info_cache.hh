@@ -0,0 +1,63 @@
+#ifndef MEDIA_INFO_CACHE_HH
+#define MEDIA_INFO_CACHE_HH
+
+#include <sys/types.h>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+
+#include "filesystem.hh"
+
+/* metadata probed from a media file (an init segment or a media segment);
+ * the fields that do not apply to a file are left zero */
+struct MediaInfo
+{
+  std::string codec {};       /* sample entry, e.g., avc1, mp4a or opus */
+  uint32_t timescale {0};
+  uint64_t duration {0};      /* in timescale */
+  uint64_t sample_count {0};
+  uint64_t sample_bytes {0};  /* total size of the samples */
+  uint16_t width {0};
+  uint16_t height {0};
+  uint8_t avc_profile {0};
+  uint8_t avc_level {0};
+  uint32_t sample_rate {0};
+  uint8_t audio_object_type {0};
+  uint16_t channel_count {0};
+};
+
+/* The MediaInfo of files by path, saved to a file so that it outlives the
+ * process: an entry is valid for as long as its file has the same inode,
+ * modification time and size as when it was probed, so that a job that
+ * looks at the same files over and over only probes the ones that changed. */
+class MediaInfoCache
+{
+public:
+  /* load the cache saved at path, if any */
+  explicit MediaInfoCache(const fs::path & path);
+
+  /* the info of file, from the cache if still valid, or else from probe
+   * (and then cached) */
+  MediaInfo get(const fs::path & file,
+                const std::function<MediaInfo(const fs::path &)> & probe);
+
+  /* save the cache atomically if it has changed, dropping the entries of
+   * the files that are gone */
+  void save();
+
+private:
+  struct Entry
+  {
+    ino_t ino {0};
+    int64_t mtime_ns {0};
+    off_t size {0};
+    MediaInfo info {};
+  };
+
+  fs::path path_ {};
+  std::map<std::string, Entry> entries_ {};  /* key: path of the file */
+  bool dirty_ {false};
+};
+
+#endif /* MEDIA_INFO_CACHE_HH */
@@ -0,0 +1,102 @@
+#include "metrics.hh"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+atomic<bool> Metrics::enabled_ {false};
+
+size_t Histogram::bucket(const uint64_t value)
+{
+  if (value < 4) {
+    return value;
+  }
+
+  /* the top two bits below the leading one select the sub-bucket */
+  const unsigned int exponent = 63 - __builtin_clzll(value);
+  return 4 * (exponent - 1) + ((value >> (exponent - 2)) & 3);
+}
+
+uint64_t Histogram::bucket_upper_bound(const size_t idx)
+{
+  if (idx < 4) {
+    return idx;
+  }
+
+  const unsigned int exponent = idx / 4 + 1;
+  const uint64_t sub = idx % 4;
+  const uint64_t lower = (uint64_t(4) | sub) << (exponent - 2);
+  const uint64_t width = uint64_t(1) << (exponent - 2);
+
+  return lower > UINT64_MAX - width ? UINT64_MAX : lower + width - 1;
+}
+
+void Histogram::add(const uint64_t value)
+{
+  buckets_[bucket(value)]++;
+  count_++;
+  sum_ += value;
+  max_ = std::max(max_, value);
+}
+
+void Histogram::merge(const Histogram & other)
+{
+  for (size_t i = 0; i < NUM_BUCKETS; i++) {
+    buckets_[i] += other.buckets_[i];
+  }
+
+  count_ += other.count_;
+  sum_ += other.sum_;
+  max_ = std::max(max_, other.max_);
+}
+
+uint64_t Histogram::quantile(const double q) const
+{
+  if (count_ == 0) {
+    return 0;
+  }
+
+  const uint64_t rank = std::max(uint64_t(1),
+    static_cast<uint64_t>(ceil(clamp(q, 0.0, 1.0) * count_)));
+
+  uint64_t seen = 0;
+  for (size_t i = 0; i < NUM_BUCKETS; i++) {
+    seen += buckets_[i];
+    if (seen >= rank) {
+      return std::min(bucket_upper_bound(i), max_);
+    }
+  }
+
+  return max_;
+}
+
+void Histogram::clear()
+{
+  buckets_.fill(0);
+  count_ = 0;
+  sum_ = 0;
+  max_ = 0;
+}
+
+Metrics::Histograms & Metrics::thread_histograms()
+{
+  static thread_local Histograms histograms;
+  return histograms;
+}
+
+void Metrics::record(const string_view name, const uint64_t value)
+{
+  if (not enabled_.load(memory_order_relaxed)) {
+    return;
+  }
+
+  Histograms & histograms = thread_histograms();
+
+  auto it = histograms.find(name);
+  if (it == histograms.end()) {
+    it = histograms.emplace(string(name), Histogram()).first;
+  }
+
+  it->second.add(value);
+}
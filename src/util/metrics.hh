@@ -0,0 +1,62 @@
+#ifndef METRICS_HH
+#define METRICS_HH
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+
+/* histogram of samples, with four buckets per power of two, so a quantile is
+ * known to within 25% of its value */
+class Histogram
+{
+public:
+  void add(const uint64_t value);
+
+  /* add the samples of other */
+  void merge(const Histogram & other);
+
+  uint64_t count() const { return count_; }
+  uint64_t sum() const { return sum_; }
+  uint64_t max() const { return max_; }
+
+  /* upper bound of the bucket that holds the q-quantile (0 if empty) */
+  uint64_t quantile(const double q) const;
+
+  void clear();
+
+private:
+  static constexpr size_t NUM_BUCKETS = 252;
+
+  std::array<uint64_t, NUM_BUCKETS> buckets_ {};
+  uint64_t count_ {0};
+  uint64_t sum_ {0};
+  uint64_t max_ {0};
+
+  static size_t bucket(const uint64_t value);
+  static uint64_t bucket_upper_bound(const size_t idx);
+};
+
+/* Named histograms kept per thread, so that recording a sample takes no lock;
+ * each thread exports (and clears) its own histograms, e.g., every second
+ * (see MetricsExporter). Recording is a no-op until enable() is called. */
+class Metrics
+{
+public:
+  using Histograms = std::map<std::string, Histogram, std::less<>>;
+
+  static void enable() { enabled_ = true; }
+  static bool enabled() { return enabled_; }
+
+  static void record(const std::string_view name, const uint64_t value);
+
+  /* the histograms of the calling thread */
+  static Histograms & thread_histograms();
+
+private:
+  static std::atomic<bool> enabled_;
+};
+
+#endif /* METRICS_HH */
@@ -0,0 +1,131 @@
+#ifndef MPSC_QUEUE_HH
+#define MPSC_QUEUE_HH
+
+#include <cstdint>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <vector>
+
+#include "eventfd.hh"
+#include "poller.hh"
+
+/* bounded multiple-producer single-consumer queue of items, which any
+ * thread pushes to without locks (each slot has a sequence number that
+ * tells whose turn it is, as in Vyukov's bounded queue); the consumer is
+ * usually a poller, woken up on an eventfd (see add_to_poller), and the
+ * eventfd is only written when the consumer might be waiting, not on every
+ * push */
+template<class T>
+class MPSCQueue
+{
+public:
+  MPSCQueue(const size_t capacity)
+    : slots_(capacity)
+  {
+    if (capacity == 0) {
+      throw std::runtime_error("MPSCQueue: capacity must be positive");
+    }
+
+    for (size_t i = 0; i < capacity; i++) {
+      slots_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  /* any thread: false (and item is left as is) if the queue is full */
+  bool push(T && item)
+  {
+    uint64_t tail = tail_.load(std::memory_order_relaxed);
+    Slot * slot;
+
+    for (;;) {
+      slot = &slots_[tail % slots_.size()];
+      const uint64_t sequence = slot->sequence.load(std::memory_order_acquire);
+
+      if (sequence == tail) {
+        /* the slot is free: claim it, unless another producer has */
+        if (tail_.compare_exchange_weak(tail, tail + 1,
+                                        std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (sequence < tail) {
+        return false;  /* the consumer has yet to pop the slot */
+      } else {
+        tail = tail_.load(std::memory_order_relaxed);
+      }
+    }
+
+    slot->item.emplace(std::move(item));
+    slot->sequence.store(tail + 1, std::memory_order_release);
+
+    /* wake up the consumer unless it has yet to see an earlier wakeup */
+    if (not signaled_.exchange(true)) {
+      eventfd_->notify();
+    }
+
+    return true;
+  }
+
+  size_t capacity() const { return slots_.size(); }
+
+  /* consumer: the oldest item, if any has been pushed completely */
+  std::optional<T> pop()
+  {
+    Slot & slot = slots_[head_ % slots_.size()];
+    if (slot.sequence.load(std::memory_order_acquire) != head_ + 1) {
+      return std::nullopt;
+    }
+
+    std::optional<T> item = std::move(slot.item);
+    slot.item.reset();
+    slot.sequence.store(head_ + slots_.size(), std::memory_order_release);
+    head_++;
+
+    return item;
+  }
+
+  /* consumer: call callback with each item pushed, from the poller */
+  void add_to_poller(Poller & poller, std::function<void(T &&)> && callback)
+  {
+    poller.add_action(Poller::Action(*eventfd_, Poller::Action::In,
+      [this, eventfd = eventfd_, callback = std::move(callback)]() {
+        eventfd->consume();
+
+        /* cleared before draining (with an exchange, to see the items of
+         * the pushes that found it set), so that a push after the drain
+         * has started writes the eventfd again */
+        signaled_.exchange(false);
+
+        while (auto item = pop()) {
+          callback(std::move(*item));
+        }
+
+        return Poller::Action::Result::Type::Continue;
+      }
+    ).named("mpsc_queue"));
+  }
+
+  /* forbid copying or moving, as the producers refer to this */
+  MPSCQueue(const MPSCQueue & other) = delete;
+  const MPSCQueue & operator=(const MPSCQueue & other) = delete;
+
+private:
+  struct Slot
+  {
+    std::atomic<uint64_t> sequence {0};
+    std::optional<T> item {};
+  };
+
+  std::vector<Slot> slots_;
+
+  alignas(64) std::atomic<uint64_t> tail_ {0};
+  alignas(64) uint64_t head_ {0};  /* owned by the consumer */
+  alignas(64) std::atomic<bool> signaled_ {false};
+
+  /* shared with the poller action */
+  std::shared_ptr<EventFD> eventfd_ {std::make_shared<EventFD>()};
+};
+
+#endif /* MPSC_QUEUE_HH */
@@ -175,6 +175,26 @@ namespace roost {
     remove( src );
   }
 
+  static string read_all( const path & pathn )
+  {
+    FileDescriptor file { CheckSystemCall( "open (" + pathn.string() + ")",
+                          open( pathn.string().c_str(), O_RDONLY ) ) };
+    return file.read_exactly( file.filesize() );
+  }
+
+  bool rename_if_changed( const path & src, const path & dst )
+  {
+    /* cheap checks first: a file of another size has changed */
+    if ( exists( dst ) and file_size( src ) == file_size( dst )
+         and read_all( src ) == read_all( dst ) ) {
+      remove( src );
+      return false;
+    }
+
+    rename( src, dst );
+    return true;
+  }
+
   void atomic_create( const string & contents, const path & dst,
                       const bool set_mode, const mode_t target_mode )
   {
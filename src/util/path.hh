@@ -58,6 +58,9 @@ namespace roost {
                   const bool is_directory = false );
   void remove_directory( const path & pathn );
   void rename( const path & oldpath, const path & newpath );
+  /* rename src to dst unless dst has the same contents, in which case src
+     is removed and dst is left untouched; returns whether dst was replaced */
+  bool rename_if_changed( const path & src, const path & dst );
   void chmod( const path & pathn, mode_t mode );
   std::string readlink( const path & pathn );
   std::vector<std::string> get_directory_listing( const path & pathn );
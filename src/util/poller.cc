@@ -1,15 +1,22 @@
 /* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
 
 #include <algorithm>
-#include <numeric>
+#include <cerrno>
+#include <iomanip>
 
 #include "poller.hh"
 #include "exception.hh"
 #include "nb_secure_socket.hh"
+#include "metrics.hh"
+#include "counters.hh"
+#include "timestamp.hh"
 
 using namespace std;
 using namespace PollerShortNames;
 
+/* max number of events returned by a single epoll_wait */
+static constexpr size_t MAX_EPOLL_EVENTS = 1024;
+
 Poller::Action::Action( NBSecureSocket & s_socket,
                         const PollDirection & s_direction,
                         const CallbackType & s_callback,
@@ -65,7 +72,8 @@ Poller::Action::Action( NBSecureSocket & s_socket,
                ( s_socket.state() == NBSecureSocket::State::needs_ssl_write_to_accept ) or
                ( s_socket.state() == NBSecureSocket::State::needs_ssl_write_to_write ) or
                ( s_socket.state() == NBSecureSocket::State::needs_ssl_write_to_read ) or
-               ( s_socket.state() == NBSecureSocket::State::ready and s_when_interested() );
+               ( s_socket.state() == NBSecureSocket::State::ready and
+                 ( not s_when_interested or s_when_interested() ) );
       };
 
   }
@@ -111,23 +119,100 @@ Poller::Action::Action( NBSecureSocket & s_socket,
                ( s_socket.state() == NBSecureSocket::State::needs_ssl_read_to_accept ) or
                ( s_socket.state() == NBSecureSocket::State::needs_ssl_read_to_write ) or
                ( s_socket.state() == NBSecureSocket::State::needs_ssl_read_to_read ) or
-               ( s_socket.state() == NBSecureSocket::State::ready and s_when_interested() );
+               ( s_socket.state() == NBSecureSocket::State::ready and
+                 ( not s_when_interested or s_when_interested() ) );
       };
   }
 }
 
+Poller::Poller( const Backend backend )
+{
+  if ( backend == Backend::Epoll ) {
+    epoll_fd_ = std::make_unique<FileDescriptor>(
+      CheckSystemCall( "epoll_create1", epoll_create1( EPOLL_CLOEXEC ) ) );
+    epoll_events_.resize( MAX_EPOLL_EVENTS );
+  }
+}
+
 void Poller::add_action( Poller::Action action )
 {
   /* the action won't be actually added until the next poll() function call.
      this allows us to call add_action inside the callback functions */
-  action_add_queue_.push( action );
+  action_add_queue_.emplace_back( move( action ) );
+}
+
+TimerWheel::TimerId Poller::add_timer( const uint64_t deadline_ms,
+                                      function<void(void)> callback )
+{
+  if ( not timers_ ) {
+    timers_ = make_unique<TimerWheel>( TIMER_TICK_MS, timestamp_ms() );
+    timerfd_ = make_unique<Timerfd>();
+
+    add_action( Action( *timerfd_, Direction::In,
+      [this] () {
+        if ( timerfd_->expirations() == 0 ) {
+          return ResultType::Continue;
+        }
+
+        timerfd_armed_ms_.reset();
+        timers_->advance( timestamp_ms() );
+        rearm_timerfd();
+
+        return ResultType::Continue;
+      },
+      [this] () { return not timers_->empty(); }
+    ).named( "timers" ) );
+  }
+
+  const auto id = timers_->add( deadline_ms, move( callback ) );
+  rearm_timerfd();
+  return id;
+}
+
+bool Poller::cancel_timer( const TimerWheel::TimerId id )
+{
+  /* timerfd_ stays armed, and finds nothing to do if this was the next */
+  return timers_ and timers_->cancel( id );
+}
+
+void Poller::rearm_timerfd()
+{
+  const auto next_ms = timers_->next_ms();
+  if ( not next_ms or next_ms == timerfd_armed_ms_ ) {
+    return;
+  }
+
+  const uint64_t now_ms = timestamp_ms();
+  timerfd_->start( *next_ms > now_ms ? *next_ms - now_ms : 1 );
+  timerfd_armed_ms_ = next_ms;
 }
 
 void Poller::remove_fd( const int fd_num )
 {
   /* the fd won't be actually removed until the end of the current poll().
      this allows us to deregister a fd inside the callback functions */
-  fds_to_remove_.emplace( fd_num );
+  fds_to_remove_.push_back( fd_num );
+}
+
+void Poller::interest_changed( const int fd_num )
+{
+  if ( not epoll_fd_ ) {
+    return;
+  }
+
+  /* an fd whose actions are still queued is evaluated once added */
+  auto entry_it = epoll_entries_.find( fd_num );
+  if ( entry_it != epoll_entries_.end() ) {
+    mark_dirty( fd_num, entry_it->second );
+  }
+}
+
+void Poller::mark_dirty( const int fd_num, EpollEntry & entry )
+{
+  if ( not entry.dirty ) {
+    entry.dirty = true;
+    dirty_fds_.push_back( fd_num );
+  }
 }
 
 unsigned int Poller::Action::service_count( void ) const
@@ -135,127 +220,535 @@ unsigned int Poller::Action::service_count( void ) const
   return direction == Direction::In ? fd.read_count() : fd.write_count();
 }
 
-Poller::Result Poller::poll( const int timeout_ms )
+bool Poller::is_interested( const Action & action )
 {
-  /* first, let's add all the actions that are waiting in the queue */
-  while ( not action_add_queue_.empty() ) {
-    Action & action = action_add_queue_.front();
-    pollfds_.push_back( { action.fd.fd_num(), 0, 0 } );
-    actions_.emplace_back( move( action ) );
-    action_add_queue_.pop();
+  const bool interested = action.active and
+    ( not action.when_interested or action.when_interested() );
+
+  /* don't poll in on fds that have had EOF */
+  if ( action.direction == Direction::In and action.fd.eof() ) {
+    return false;
   }
 
-  assert( pollfds_.size() == actions_.size() );
+  return interested;
+}
+
+void Poller::fderror( const Action & action )
+{
+  if ( action.fderror_callback ) {
+    action.fderror_callback();
+  }
+}
+
+optional<Poller::Result> Poller::run_action( const size_t slot, const int fd_num )
+{
+  if ( not instrumented_ ) {
+    return call_action( slot, fd_num );
+  }
+
+  const uint64_t start_us = timestamp_us();
+  const auto result = call_action( slot, fd_num );
+  const uint64_t elapsed_us = timestamp_us() - start_us;
+
+  const Action & action = *actions_[ slot ];
+  CallbackStats & stats = callback_stats_[ action.name ];
+  stats.calls++;
+  stats.total_us += elapsed_us;
+  stats.max_us = max( stats.max_us, elapsed_us );
+
+  Metrics::record( "callback_us:" + action.name, elapsed_us );
+
+  return result;
+}
+
+void Poller::record_wait( const uint64_t blocked_us, const int num_ready )
+{
+  num_iterations_++;
+  blocked_us_ += blocked_us;
+  num_ready_fds_ += num_ready;
+
+  Metrics::record( "poll_blocked_us", blocked_us );
+  Metrics::record( "poll_ready_fds", num_ready );
+
+  const uint64_t now = timestamp_us();
+  if ( last_summary_us_ == 0 ) {
+    last_summary_us_ = now;
+  } else if ( now - last_summary_us_ >= SUMMARY_INTERVAL_S * MILLION ) {
+    print_summary();
+    last_summary_us_ = now;
+  }
+}
+
+void Poller::print_summary()
+{
+  cerr << fixed << setprecision( 1 )
+       << "Poller: " << num_iterations_ << " iterations, "
+       << blocked_us_ / 1000.0 << " ms blocked, "
+       << static_cast<double>( num_ready_fds_ )
+          / max( num_iterations_, uint64_t( 1 ) )
+       << " ready fds per iteration" << endl;
+
+  /* the reads or writes that the live actions of each name have serviced */
+  map<string, uint64_t> service_counts;
+  for ( const auto & action : actions_ ) {
+    if ( action ) {
+      service_counts[ action->name ] += action->service_count();
+    }
+  }
+
+  /* the callbacks that took the most time first */
+  vector<pair<string, CallbackStats>> stats( callback_stats_.begin(),
+                                             callback_stats_.end() );
+  sort( stats.begin(), stats.end(),
+        [] ( const auto & a, const auto & b ) {
+          return a.second.total_us > b.second.total_us;
+        } );
+
+  for ( const auto & [ name, callback_stats ] : stats ) {
+    cerr << "Poller:   " << name << ": " << callback_stats.calls << " calls, "
+         << callback_stats.total_us / 1000.0 << " ms total, "
+         << callback_stats.max_us << " us max, "
+         << service_counts[ name ] << " services" << endl;
+  }
+
+  cerr << defaultfloat;
+
+  callback_stats_.clear();
+  num_iterations_ = 0;
+  blocked_us_ = 0;
+  num_ready_fds_ = 0;
+}
+
+optional<Poller::Result> Poller::call_action( const size_t slot, const int fd_num )
+{
+  Action & action = *actions_[ slot ];
+  const auto count_before = action.service_count();
+
+  try {
+    auto result = action.callback();
+
+    switch ( result.result ) {
+    case ResultType::Exit:
+      return Result( Result::Type::Exit, result.exit_status );
+
+    case ResultType::Cancel:
+      action.active = false;
+      slots_to_cancel_.emplace_back( slot, fd_num );
+      break;
+
+    case ResultType::CancelAll:
+      remove_fd( fd_num );
+      break;
+
+    case ResultType::Continue:
+      break;
+    }
+  } catch ( const exception & e ) {
+    if ( action.fail_poller ) {
+      /* throw only if the action is intended to fail the entire poller */
+      throw;
+    } else {
+      /* simply remove the fd from poller and keep the poller running */
+      print_exception( "Poller: error in callback", e );
+
+      fderror( action );
+      remove_fd( fd_num );
+      return nullopt;
+    }
+  }
+
+  if ( count_before == action.service_count() ) {
+    throw runtime_error( "Poller: busy wait detected: callback did not read/write fd" );
+  }
+
+  return nullopt;
+}
+
+void Poller::add_queued_actions()
+{
+  for ( auto & action : action_add_queue_ ) {
+    const int fd_num = action.fd.fd_num();
+    const Direction direction = action.direction;
+
+    if ( epoll_fd_ ) {
+      const auto entry_it = epoll_entries_.find( fd_num );
+      if ( entry_it != epoll_entries_.end() and
+           ( direction == Direction::In ? entry_it->second.in : entry_it->second.out ) ) {
+        throw runtime_error( "Poller: epoll allows only one action per fd and direction" );
+      }
+    }
+
+    /* reuse a free slot if there is one */
+    size_t slot;
+    if ( free_slots_.empty() ) {
+      slot = actions_.size();
+      actions_.emplace_back( move( action ) );
+      if ( not epoll_fd_ ) {
+        pollfds_.push_back( { fd_num, 0, 0 } );
+      }
+    } else {
+      slot = free_slots_.back();
+      free_slots_.pop_back();
+      actions_[ slot ].emplace( move( action ) );
+      if ( not epoll_fd_ ) {
+        pollfds_[ slot ] = { fd_num, 0, 0 };
+      }
+    }
+
+    if ( not epoll_fd_ ) {
+      fd_slots_[ fd_num ].push_back( slot );
+      continue;
+    }
+
+    /* register the fd with epoll (with no events) on its first action */
+    const auto [entry_it, inserted] = epoll_entries_.try_emplace( fd_num );
+    EpollEntry & entry = entry_it->second;
+    ( direction == Direction::In ? entry.in : entry.out ) = slot;
+
+    if ( inserted ) {
+      epoll_event ev {};
+      ev.data.fd = fd_num;
+      CheckSystemCall( "epoll_ctl", epoll_ctl( epoll_fd_->fd_num(), EPOLL_CTL_ADD,
+                                               fd_num, &ev ) );
+    }
+
+    mark_dirty( fd_num, entry );
+    if ( unnotified( entry ) ) {
+      unnotified_fds_.insert( fd_num );
+    }
+  }
+
+  action_add_queue_.clear();
+}
+
+Poller::Result Poller::poll( const int timeout_ms )
+{
+  /* remove what an iteration that returned early has left, then add all
+   * the actions that are waiting in the queue */
+  remove_actions();
+  add_queued_actions();
 
   if ( timeout_ms == 0 ) {
     throw runtime_error( "poll asked to busy-wait" );
   }
 
+  if ( epoll_fd_ ) {
+    return poll_epoll( timeout_ms );
+  }
+
+  assert( pollfds_.size() == actions_.size() );
+
   /* tell poll whether we care about each fd */
-  auto it_action = actions_.begin();
-  auto it_pollfd = pollfds_.begin();
-
-  for ( ; it_action != actions_.end() and it_pollfd != pollfds_.end()
-        ; it_action++, it_pollfd++ ) {
-    assert( it_pollfd->fd == it_action->fd.fd_num() );
-    it_pollfd->events = (it_action->active and it_action->when_interested())
-      ? it_action->direction : 0;
-
-    /* don't poll in on fds that have had EOF */
-    if ( it_action->direction == Direction::In
-       and it_action->fd.eof() ) {
-      it_pollfd->events = 0;
+  bool any_interest = false;
+
+  for ( size_t i = 0; i < actions_.size(); i++ ) {
+    if ( actions_[ i ] ) {
+      assert( pollfds_[ i ].fd == actions_[ i ]->fd.fd_num() );
+      pollfds_[ i ].events = is_interested( *actions_[ i ] ) ? actions_[ i ]->direction : 0;
+      any_interest = any_interest or pollfds_[ i ].events;
     }
   }
 
   /* Quit if no member in pollfds_ has a non-zero direction */
-  if ( not accumulate( pollfds_.begin(), pollfds_.end(), false,
-                       [] ( bool acc, pollfd x ) { return acc or x.events; } ) ) {
+  if ( not any_interest ) {
     return Result::Type::Exit;
   }
 
-  if ( 0 == CheckSystemCall( "poll", ::poll( &pollfds_[ 0 ], pollfds_.size(), timeout_ms ) ) ) {
+  const uint64_t wait_start_us = instrumented_ ? timestamp_us() : 0;
+  Counters::count( Counters::POLLS );
+  const int num_ready = ::poll( &pollfds_[ 0 ], pollfds_.size(), timeout_ms );
+
+  /* poll is not restarted after a signal handler (e.g., of the profiler) */
+  if ( num_ready < 0 and errno == EINTR ) {
+    return Result::Type::Success;
+  }
+  CheckSystemCall( "poll", num_ready );
+
+  if ( instrumented_ ) {
+    record_wait( timestamp_us() - wait_start_us, num_ready );
+  }
+
+  if ( num_ready == 0 ) {
     return Result::Type::Timeout;
   }
 
-  it_action = actions_.begin();
-  it_pollfd = pollfds_.begin();
+  /* callbacks only queue actions and fds to remove, so the slots stay put */
+  for ( size_t i = 0; i < actions_.size(); i++ ) {
+    const pollfd & pfd = pollfds_[ i ];
+    if ( not actions_[ i ] or pfd.revents == 0 ) {
+      continue;
+    }
+
+    Action & action = *actions_[ i ];
 
-  for ( ; it_action != actions_.end() and it_pollfd != pollfds_.end()
-        ; it_action++, it_pollfd++ ) {
-    assert( it_pollfd->fd == it_action->fd.fd_num() );
-    if ( it_pollfd->revents & (POLLERR | POLLHUP | POLLNVAL) ) {
-      it_action->fderror_callback();
-      remove_fd( it_pollfd->fd );
+    if ( pfd.revents & (POLLERR | POLLHUP | POLLNVAL) ) {
+      fderror( action );
+      remove_fd( pfd.fd );
       continue;
     }
 
-    if ( it_pollfd->revents & it_pollfd->events ) {
+    if ( pfd.revents & pfd.events ) {
       /* we only want to call callback if revents includes
         the event we asked for */
-      const auto count_before = it_action->service_count();
+      const auto exit_result = run_action( i, pfd.fd );
+      if ( exit_result ) {
+        return *exit_result;
+      }
+    }
+  }
 
-      try {
-        auto result = it_action->callback();
+  remove_actions();
 
-        switch ( result.result ) {
-        case ResultType::Exit:
-          return Result( Result::Type::Exit, result.exit_status );
+  return Result::Type::Success;
+}
 
-        case ResultType::Cancel:
-          it_action->active = false;
-          break;
+bool Poller::unnotified( const EpollEntry & entry ) const
+{
+  for ( const auto & slot : { entry.in, entry.out } ) {
+    if ( slot and actions_[ *slot ]->when_interested and
+         not actions_[ *slot ]->interest_notified ) {
+      return true;
+    }
+  }
 
-        case ResultType::CancelAll:
-          remove_fd( it_pollfd->fd );
-          break;
+  return false;
+}
 
-        case ResultType::Continue:
-          break;
-        }
-      } catch ( const exception & e ) {
-        if ( it_action->fail_poller ) {
-          /* throw only if the action is intended to fail the entire poller */
-          throw;
-        } else {
-          /* simply remove the fd from poller and keep the poller running */
-          print_exception( "Poller: error in callback", e );
-
-          it_action->fderror_callback();
-          remove_fd( it_pollfd->fd );
-          continue;
-        }
+void Poller::update_interest( const int fd_num, EpollEntry & entry )
+{
+  uint32_t events = 0;
+
+  if ( entry.in and is_interested( *actions_[ *entry.in ] ) ) {
+    events |= EPOLLIN;
+  }
+
+  if ( entry.out and is_interested( *actions_[ *entry.out ] ) ) {
+    events |= EPOLLOUT;
+  }
+
+  if ( events == entry.events ) {
+    return;
+  }
+
+  epoll_event ev {};
+  ev.events = events;
+  ev.data.fd = fd_num;
+  if ( epoll_ctl( epoll_fd_->fd_num(), EPOLL_CTL_MOD, fd_num, &ev ) < 0 ) {
+    if ( errno != EBADF and errno != ENOENT ) {
+      throw unix_error( "epoll_ctl" );
+    }
+
+    /* the fd was closed behind our back (poll() would report POLLNVAL) */
+    for ( const auto & slot : { entry.in, entry.out } ) {
+      if ( slot ) {
+        fderror( *actions_[ *slot ] );
+      }
+    }
+    remove_fd( fd_num );
+    return;
+  }
+
+  if ( entry.events == 0 ) {
+    num_interested_fds_++;
+  } else if ( events == 0 ) {
+    num_interested_fds_--;
+  }
+  entry.events = events;
+}
+
+Poller::Result Poller::poll_epoll( const int timeout_ms )
+{
+  static_assert( EPOLLIN == POLLIN and EPOLLOUT == POLLOUT );
+
+  /* tell epoll whether we care about the fds whose interest might have
+   * changed, making a system call only for those whose interest has */
+  for ( const int fd_num : unnotified_fds_ ) {
+    update_interest( fd_num, epoll_entries_.at( fd_num ) );
+  }
+
+  /* a when_interested may itself call interest_changed() */
+  vector<int> dirty_fds;
+  swap( dirty_fds, dirty_fds_ );
+
+  for ( const int fd_num : dirty_fds ) {
+    auto entry_it = epoll_entries_.find( fd_num );
+    if ( entry_it == epoll_entries_.end() or not entry_it->second.dirty ) {
+      continue;
+    }
+
+    entry_it->second.dirty = false;
+    update_interest( fd_num, entry_it->second );
+  }
+
+  dirty_fds.clear();
+  if ( dirty_fds_.empty() ) {
+    swap( dirty_fds, dirty_fds_ );  /* keep the capacity */
+  }
+
+  /* Quit if no fd has a non-zero direction */
+  if ( num_interested_fds_ == 0 ) {
+    return Result::Type::Exit;
+  }
+
+  const uint64_t wait_start_us = instrumented_ ? timestamp_us() : 0;
+  Counters::count( Counters::POLLS );
+  const int num_events = epoll_wait( epoll_fd_->fd_num(), epoll_events_.data(),
+                                     epoll_events_.size(), timeout_ms );
+
+  /* epoll_wait is not restarted after a signal handler either */
+  if ( num_events < 0 and errno == EINTR ) {
+    return Result::Type::Success;
+  }
+  CheckSystemCall( "epoll_wait", num_events );
+
+  if ( instrumented_ ) {
+    record_wait( timestamp_us() - wait_start_us, num_events );
+  }
+
+  if ( num_events == 0 ) {
+    return Result::Type::Timeout;
+  }
+
+  for ( int i = 0; i < num_events; i++ ) {
+    const int fd_num = epoll_events_[ i ].data.fd;
+    const uint32_t revents = epoll_events_[ i ].events;
+
+    /* entries are not erased until remove_actions() below */
+    auto entry_it = epoll_entries_.find( fd_num );
+    if ( entry_it == epoll_entries_.end() ) {
+      continue;
+    }
+
+    EpollEntry & entry = entry_it->second;
+
+    /* a callback is likely to change the interest of its fd */
+    mark_dirty( fd_num, entry );
+
+    for ( const auto & slot : { entry.in, entry.out } ) {
+      if ( not slot ) {
+        continue;
       }
 
-      if ( count_before == it_action->service_count() ) {
-        throw runtime_error( "Poller: busy wait detected: callback did not read/write fd" );
+      Action & action = *actions_[ *slot ];
+
+      if ( revents & (EPOLLERR | EPOLLHUP) ) {
+        fderror( action );
+        remove_fd( fd_num );
+        continue;
+      }
+
+      if ( revents & entry.events & action.direction ) {
+        /* we only want to call callback if revents includes
+          the event we asked for */
+        const auto exit_result = run_action( *slot, fd_num );
+        if ( exit_result ) {
+          return *exit_result;
+        }
       }
     }
   }
 
-  remove_actions( fds_to_remove_ );
-  fds_to_remove_.clear();
+  remove_actions();
 
   return Result::Type::Success;
 }
 
-void Poller::remove_actions( const set<int> & fd_nums )
+void Poller::free_slot( const size_t slot )
 {
-  if ( fd_nums.size() == 0 ) {
-    return;
+  actions_[ slot ].reset();
+  free_slots_.push_back( slot );
+
+  if ( not epoll_fd_ ) {
+    pollfds_[ slot ] = { -1, 0, 0 };
+  }
+}
+
+void Poller::erase_epoll_entry( const int fd_num )
+{
+  auto entry_it = epoll_entries_.find( fd_num );
+  if ( entry_it->second.events ) {
+    num_interested_fds_--;
   }
 
-  auto it_action = actions_.begin();
-  auto it_pollfd = pollfds_.begin();
+  epoll_entries_.erase( entry_it );
+  unnotified_fds_.erase( fd_num );
 
-  while ( it_action != actions_.end() and it_pollfd != pollfds_.end() ) {
-    if ( fd_nums.count( it_pollfd->fd ) ) {
-      it_action = actions_.erase( it_action );
-      it_pollfd = pollfds_.erase( it_pollfd );
+  /* closing an fd has already removed it from epoll */
+  if ( epoll_ctl( epoll_fd_->fd_num(), EPOLL_CTL_DEL, fd_num, nullptr ) < 0
+       and errno != EBADF and errno != ENOENT ) {
+    throw unix_error( "epoll_ctl" );
+  }
+}
+
+void Poller::remove_actions()
+{
+  /* the canceled actions, unless their fds are removed below; they are
+   * deregistered before they are freed, as freeing an action might close
+   * its fd (e.g., one owned by its callback) */
+  for ( const auto & [ slot, fd_num ] : slots_to_cancel_ ) {
+    if ( not actions_[ slot ] ) {
+      continue;
     }
-    else {
-      it_action++;
-      it_pollfd++;
+
+    if ( not epoll_fd_ ) {
+      auto & slots = fd_slots_.at( fd_num );
+      slots.erase( find( slots.begin(), slots.end(), slot ) );
+      if ( slots.empty() ) {
+        fd_slots_.erase( fd_num );
+      }
+
+      free_slot( slot );
+      continue;
+    }
+
+    EpollEntry & entry = epoll_entries_.at( fd_num );
+    ( entry.in == slot ? entry.in : entry.out ).reset();
+
+    if ( not entry.in and not entry.out ) {
+      erase_epoll_entry( fd_num );
+    } else {
+      /* drop the direction of the action from epoll */
+      mark_dirty( fd_num, entry );
+      if ( not unnotified( entry ) ) {
+        unnotified_fds_.erase( fd_num );
+      }
+    }
+
+    free_slot( slot );
+  }
+
+  slots_to_cancel_.clear();
+
+  /* an fd might be listed more than once; it is only found the first time */
+  for ( const int fd_num : fds_to_remove_ ) {
+    if ( not epoll_fd_ ) {
+      auto slots_it = fd_slots_.find( fd_num );
+      if ( slots_it == fd_slots_.end() ) {
+        continue;
+      }
+
+      for ( const size_t slot : slots_it->second ) {
+        free_slot( slot );
+      }
+
+      fd_slots_.erase( slots_it );
+      continue;
+    }
+
+    auto entry_it = epoll_entries_.find( fd_num );
+    if ( entry_it == epoll_entries_.end() ) {
+      continue;
+    }
+
+    const EpollEntry entry = entry_it->second;
+    erase_epoll_entry( fd_num );
+
+    for ( const auto & slot : { entry.in, entry.out } ) {
+      if ( slot ) {
+        free_slot( *slot );
+      }
     }
   }
+
+  fds_to_remove_.clear();
 }
@@ -7,11 +7,19 @@
 #include <vector>
 #include <cassert>
 #include <list>
+#include <map>
 #include <set>
+#include <string>
 #include <queue>
+#include <memory>
+#include <optional>
+#include <unordered_map>
 #include <poll.h>
+#include <sys/epoll.h>
 
 #include "file_descriptor.hh"
+#include "timer_wheel.hh"
+#include "timerfd.hh"
 
 class NBSecureSocket;
 
@@ -33,8 +41,10 @@ public:
     FileDescriptor & fd;
     enum PollDirection : short { In = POLLIN, Out = POLLOUT } direction;
     CallbackType callback;
-    std::function<bool(void)> when_interested;
 
+    /* left empty (the default), the action is always interested and nothing
+     * is called on errors, which spares the poller a call per iteration */
+    std::function<bool(void)> when_interested;
     std::function<void(void)> fderror_callback;
     /* whether an error in this action's callback will fail the entire poller
      * set to false by default for NBSecureSocket and true for other fds */
@@ -42,11 +52,20 @@ public:
 
     bool active;
 
+    /* e.g., in the statistics of an instrumented poller */
+    std::string name { "unnamed" };
+
+    /* set with notify_interest(): the owner calls Poller::interest_changed()
+     * whenever when_interested might change other than in a callback of an
+     * action on the fd (which the poller sees), so that Epoll re-evaluates
+     * it only then rather than on every poll */
+    bool interest_notified { false };
+
     Action( FileDescriptor & s_fd,
             const PollDirection & s_direction,
             const CallbackType & s_callback,
-            const std::function<bool(void)> & s_when_interested = [] () { return true; },
-            const std::function<void(void)> & s_fderror_callback = [] () {},
+            const std::function<bool(void)> & s_when_interested = {},
+            const std::function<void(void)> & s_fderror_callback = {},
             const bool s_fail_poller = true )
       : fd( s_fd ), direction( s_direction ), callback( s_callback ),
         when_interested( s_when_interested ),
@@ -56,23 +75,25 @@ public:
     Action( NBSecureSocket & s_socket,
             const PollDirection & s_direction,
             const CallbackType & s_callback,
-            const std::function<bool(void)> & s_when_interested = [] () { return true; },
-            const std::function<void(void)> & s_fderror_callback = [] () {},
+            const std::function<bool(void)> & s_when_interested = {},
+            const std::function<void(void)> & s_fderror_callback = {},
             const bool s_fail_poller = false );
 
     unsigned int service_count( void ) const;
-  };
 
-private:
-  std::queue<Action> action_add_queue_ {};
-  std::list<Action> actions_ {};
-  std::vector<pollfd> pollfds_ {};
-  std::set<int> fds_to_remove_ {};
+    Action & named( const std::string & s_name ) { name = s_name; return *this; }
+    Action & notify_interest() { interest_notified = true; return *this; }
+  };
 
-  /* remove all actions for file descriptors in `fd_nums` */
-  void remove_actions( const std::set<int> & fd_nums );
+  /* Poll rebuilds the pollfd set and calls poll(2) on every iteration;
+   * Epoll keeps the fds registered and only calls epoll_ctl(2) when the
+   * interest of an fd changes, which it re-evaluates for the fds that were
+   * serviced or notified of (see Action::interest_notified), and for the
+   * fds of the actions whose when_interested is not notified. An fd must
+   * not have more than one action per direction and must support epoll
+   * (i.e., not a regular file) with Epoll. */
+  enum class Backend { Poll, Epoll };
 
-public:
   struct Result
   {
     enum class Type { Success, Timeout, Exit } result;
@@ -81,11 +102,129 @@ public:
       : result( s_result ), exit_status( s_status ) {}
   };
 
-  Poller() {}
+private:
+  /* added at the start of the next poll(), so that callbacks can add actions */
+  std::vector<Action> action_add_queue_ {};
+
+  /* a slot map: an action stays in its slot until its fd is removed, which
+   * frees the slot for a later action (so the walk over the actions has no
+   * pointer chasing, and removing an fd is O(1) rather than a search) */
+  std::vector<std::optional<Action>> actions_ {};
+  std::vector<size_t> free_slots_ {};
+  std::vector<int> fds_to_remove_ {};
+
+  /* the slots (and fds) of the actions that returned Cancel, freed along
+   * with the fds to remove */
+  std::vector<std::pair<size_t, int>> slots_to_cancel_ {};
+
+  /* poll backend only: pollfds_[i] is for actions_[i] (fd -1, which poll(2)
+   * ignores, if the slot is free), and the slots of each fd */
+  std::vector<pollfd> pollfds_ {};
+  std::unordered_map<int, std::vector<size_t>> fd_slots_ {};
+
+  /* epoll backend only */
+  struct EpollEntry
+  {
+    std::optional<size_t> in {};
+    std::optional<size_t> out {};
+    uint32_t events {0};  /* events currently registered with epoll_ctl */
+    bool dirty {false};   /* listed in dirty_fds_ */
+  };
+
+  std::unique_ptr<FileDescriptor> epoll_fd_ {nullptr};
+  std::unordered_map<int, EpollEntry> epoll_entries_ {};
+  std::vector<epoll_event> epoll_events_ {};
+
+  /* the fds whose interest is re-evaluated at the next poll: those that
+   * were added, serviced or notified of since the last one, and those with
+   * an action whose when_interested is not notified (every poll) */
+  std::vector<int> dirty_fds_ {};
+  std::set<int> unnotified_fds_ {};
+
+  /* the fds registered with nonzero events */
+  size_t num_interested_fds_ {0};
+
+  void mark_dirty( const int fd_num, EpollEntry & entry );
+
+  /* whether an action of entry must be re-evaluated on every poll */
+  bool unnotified( const EpollEntry & entry ) const;
+
+  /* re-evaluate the interest of the fd of entry and update epoll with it */
+  void update_interest( const int fd_num, EpollEntry & entry );
+
+  /* deregister an fd whose actions have all been freed */
+  void erase_epoll_entry( const int fd_num );
+
+  /* whether the action wants to be polled on */
+  static bool is_interested( const Action & action );
+
+  /* call the action's fderror_callback, if any */
+  static void fderror( const Action & action );
+
+  /* run the callback of the action in slot; return a Result only if poller
+   * should exit */
+  std::optional<Result> run_action( const size_t slot, const int fd_num );
+  std::optional<Result> call_action( const size_t slot, const int fd_num );
+
+  /* instrumentation */
+  struct CallbackStats
+  {
+    uint64_t calls {0};
+    uint64_t total_us {0};
+    uint64_t max_us {0};
+  };
+
+  bool instrumented_ {false};
+  std::map<std::string, CallbackStats> callback_stats_ {};  /* key: name */
+  uint64_t num_iterations_ {0};
+  uint64_t blocked_us_ {0};
+  uint64_t num_ready_fds_ {0};
+  uint64_t last_summary_us_ {0};
+
+  void record_wait( const uint64_t blocked_us, const int num_ready );
+  void print_summary();
+
+  void add_queued_actions();
+  Result poll_epoll( const int timeout_ms );
+
+  /* remove the canceled actions, and all actions for the file descriptors
+   * in fds_to_remove_ */
+  void remove_actions();
+  void free_slot( const size_t slot );
+
+  /* timers, created on the first add_timer(); timerfd_ is armed for when
+   * timers_ next has anything to do */
+  std::unique_ptr<TimerWheel> timers_ {nullptr};
+  std::unique_ptr<Timerfd> timerfd_ {nullptr};
+  std::optional<uint64_t> timerfd_armed_ms_ {};
+
+  void rearm_timerfd();
+
+public:
+  Poller( const Backend backend = Backend::Poll );
+
+  /* time the callbacks (by action name) and the blocking in poll(2), and
+   * count the ready fds per iteration, recording them as Metrics and
+   * summarizing them (with the service counts) to cerr periodically */
+  static constexpr unsigned int SUMMARY_INTERVAL_S = 60;
+  void set_instrumented( const bool instrumented ) { instrumented_ = instrumented; }
 
   void add_action( Action action );
   void remove_fd( const int fd_num );
+
+  /* the when_interested of an action on fd_num (with interest_notified)
+   * might have changed: re-evaluate it at the next poll */
+  void interest_changed( const int fd_num );
   Result poll( const int timeout_ms );
+
+  /* call callback from poll() once timestamp_ms() reaches deadline_ms (to
+   * within TIMER_TICK_MS); adding and canceling a timer are O(1), and only
+   * the timers that expire are touched (see TimerWheel) */
+  static constexpr unsigned int TIMER_TICK_MS = 10;
+  TimerWheel::TimerId add_timer( const uint64_t deadline_ms,
+                                 std::function<void(void)> callback );
+  /* return false if the timer has already fired or been canceled */
+  bool cancel_timer( const TimerWheel::TimerId id );
 };
 
 namespace PollerShortNames {
@@ -0,0 +1,269 @@
+#include "profiler.hh"
+
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "exception.hh"
+#include "pipe.hh"
+#include "timestamp.hh"
+#include "util.hh"
+
+using namespace std;
+
+namespace {
+
+constexpr int MAX_DEPTH = 64;
+
+/* the frames of the signal handler and of the signal trampoline */
+constexpr int SKIPPED_FRAMES = 2;
+
+constexpr size_t MAX_SAMPLES = 1 << 18;
+
+struct Sample
+{
+  void * frames[MAX_DEPTH];
+  int depth;
+};
+
+/* shared with the SIGPROF handler, which claims a sample with num_samples
+ * and runs between the increment and decrement of num_handlers, so that the
+ * buffer outlives it */
+atomic<Sample *> samples {nullptr};
+atomic<size_t> capacity {0};
+atomic<size_t> num_samples {0};
+atomic<int> num_handlers {0};
+
+/* written to by the SIGUSR2 handler to start a profile */
+int trigger_fd = -1;
+
+void take_sample(int)
+{
+  const int saved_errno = errno;
+  num_handlers++;
+
+  Sample * const buffer = samples.load();
+  if (buffer) {
+    const size_t idx = num_samples++;
+    if (idx < capacity.load()) {
+      buffer[idx].depth = backtrace(buffer[idx].frames, MAX_DEPTH);
+    }
+  }
+
+  num_handlers--;
+  errno = saved_errno;
+}
+
+void trigger(int)
+{
+  const int saved_errno = errno;
+
+  const char byte = 0;
+  if (::write(trigger_fd, &byte, 1) < 0) {
+    /* the write end is nonblocking: a full pipe already has a profile due */
+  }
+
+  errno = saved_errno;
+}
+
+void install_handler(const int signum, void (*handler)(int))
+{
+  struct sigaction action {};
+  action.sa_handler = handler;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+
+  CheckSystemCall("sigaction", sigaction(signum, &action, nullptr));
+}
+
+void set_profile_timer(const unsigned int hz)
+{
+  itimerval timer {};
+  if (hz > 0) {
+    timer.it_interval.tv_usec = 1000000 / hz;
+    timer.it_value = timer.it_interval;
+  }
+
+  CheckSystemCall("setitimer", setitimer(ITIMER_PROF, &timer, nullptr));
+}
+
+/* the function name of a frame, or else its object */
+string symbolize(void * const addr)
+{
+  Dl_info info;
+  if (not dladdr(addr, &info)) {
+    ostringstream name;
+    name << addr;
+    return name.str();
+  }
+
+  if (info.dli_sname) {
+    int status = 0;
+    char * const demangled = abi::__cxa_demangle(info.dli_sname, nullptr,
+                                                 nullptr, &status);
+    if (status == 0 and demangled) {
+      string name(demangled);
+      free(demangled);
+      return name;
+    }
+
+    return info.dli_sname;
+  }
+
+  /* as perf does, so that the samples in the object add up in one frame */
+  const string object = info.dli_fname ? info.dli_fname : "unknown";
+  return "[" + object.substr(object.rfind('/') + 1) + "]";
+}
+
+/* sample for seconds, then write the collapsed stacks into dir */
+void profile(const string & dir, const unsigned int hz,
+             const unsigned int seconds)
+{
+  const size_t max_samples = min(
+    MAX_SAMPLES, size_t(hz) * seconds * max(1u, thread::hardware_concurrency()));
+  auto buffer = make_unique<Sample[]>(max_samples);
+
+  capacity = max_samples;
+  num_samples = 0;
+  samples = buffer.get();
+
+  cerr << "Profiler: sampling at " << hz << " Hz for " << seconds << " s"
+       << endl;
+
+  set_profile_timer(hz);
+  this_thread::sleep_for(chrono::seconds(seconds));
+  set_profile_timer(0);
+
+  /* wait out the handlers that might still write to the buffer */
+  samples = nullptr;
+  while (num_handlers > 0) {
+    this_thread::yield();
+  }
+
+  const size_t taken = min(num_samples.load(), max_samples);
+
+  /* collapse the stacks, root first */
+  map<void *, string> names;
+  map<string, uint64_t> stacks;
+
+  for (size_t i = 0; i < taken; i++) {
+    const Sample & sample = buffer[i];
+
+    string stack;
+    for (int f = sample.depth - 1; f >= SKIPPED_FRAMES; f--) {
+      /* but for the interrupted frame, the addresses are return addresses,
+       * which might belong to the next function */
+      void * addr = sample.frames[f];
+      if (f > SKIPPED_FRAMES) {
+        addr = static_cast<char *>(addr) - 1;
+      }
+
+      auto it = names.find(addr);
+      if (it == names.end()) {
+        it = names.emplace(addr, symbolize(addr)).first;
+      }
+
+      if (not stack.empty()) {
+        stack += ';';
+      }
+      stack += it->second;
+    }
+
+    if (not stack.empty()) {
+      stacks[stack]++;
+    }
+  }
+
+  const string path = dir + "/" + program_invocation_short_name + "."
+    + to_string(getpid()) + "." + to_string(timestamp_ms()) + ".folded";
+
+  ofstream output(path);
+  for (const auto & [stack, count] : stacks) {
+    output << stack << " " << count << "\n";
+  }
+  output.close();
+
+  if (not output) {
+    throw runtime_error("Profiler: failed to write " + path);
+  }
+
+  cerr << "Profiler: wrote " << taken << " samples to " << path;
+  if (num_samples > max_samples) {
+    cerr << " (dropped " << num_samples - max_samples << ")";
+  }
+  cerr << endl;
+}
+
+}
+
+void Profiler::install_from_env()
+{
+  const string dir = safe_getenv_or("PROFILER_DIR", "");
+  if (dir.empty()) {
+    return;
+  }
+
+  const unsigned int hz = stoul(safe_getenv_or("PROFILER_HZ", "99"));
+  const unsigned int seconds = stoul(safe_getenv_or("PROFILER_SECONDS", "30"));
+  if (hz == 0 or hz > 1000 or seconds == 0) {
+    throw runtime_error("Profiler: PROFILER_HZ must be within 1-1000 and "
+                        "PROFILER_SECONDS positive");
+  }
+
+  auto [read_end, write_end] = make_pipe();
+  write_end.set_blocking(false);
+  trigger_fd = write_end.fd_num();
+
+  /* the first backtrace() loads the unwinder, which must not happen in the
+   * signal handler */
+  void * frames[MAX_DEPTH];
+  backtrace(frames, MAX_DEPTH);
+
+  /* the background thread is not sampled itself */
+  sigset_t mask, old_mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGPROF);
+  sigaddset(&mask, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+
+  thread([dir, hz, seconds, read_end = move(read_end),
+          write_end = move(write_end)]() mutable {
+    while (true) {
+      char byte;
+      if (::read(read_end.fd_num(), &byte, 1) <= 0) {
+        return;
+      }
+
+      try {
+        profile(dir, hz, seconds);
+      } catch (const exception & e) {
+        cerr << "Profiler: " << e.what() << endl;
+      }
+    }
+  }).detach();
+
+  pthread_sigmask(SIG_SETMASK, &old_mask, nullptr);
+
+  install_handler(SIGPROF, take_sample);
+  install_handler(SIGUSR2, trigger);
+
+  cerr << "Profiler: kill -USR2 " << getpid() << " to write a profile to "
+       << dir << endl;
+}
@@ -0,0 +1,25 @@
+#ifndef PROFILER_HH
+#define PROFILER_HH
+
+/* A sampling CPU profiler built into the long-running daemons, for profiles
+ * of live traffic without attaching perf or restarting. It is opt-in: with
+ * PROFILER_DIR set in the environment, each SIGUSR2 to the process samples
+ * the stacks of its threads on CPU (ITIMER_PROF) at PROFILER_HZ (default 99)
+ * for PROFILER_SECONDS (default 30), and writes them collapsed, one stack
+ * per line with its count as flamegraph.pl takes, e.g.,
+ *
+ *   main;WSServer::loop;Poller::poll;NBSecureSocket::continue_SSL_write 42
+ *
+ * to PROFILER_DIR/<program>.<pid>.<timestamp in ms>.folded. Frames without a
+ * symbol (the daemons export theirs with -rdynamic) are written as [<object>],
+ * e.g., [libcrypto.so.3]. Samples are taken in a buffer sized up front and
+ * symbolized by a background thread once sampling has stopped. */
+class Profiler
+{
+public:
+  /* start the background thread and install the SIGUSR2 handler if
+   * PROFILER_DIR is set; a no-op otherwise */
+  static void install_from_env();
+};
+
+#endif /* PROFILER_HH */
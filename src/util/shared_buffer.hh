@@ -0,0 +1,63 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+#ifndef SHARED_BUFFER_HH
+#define SHARED_BUFFER_HH
+
+#include <string>
+#include <string_view>
+#include <memory>
+
+/* bytes waiting to be written: either a string owned by the buffer, or a
+ * view into memory (e.g., an mmap'd file) that is kept alive by a shared_ptr
+ * so that it can be written out without being copied, or a view borrowed
+ * from another buffer (see borrow()) */
+class SharedBuffer
+{
+private:
+  std::string owned_ {};
+  std::shared_ptr<const char> owner_ {};
+  std::string_view shared_view_ {};  /* null unless a view */
+  bool continuation_ {false};
+
+public:
+  SharedBuffer(const std::string & str) : owned_(str) {}
+  SharedBuffer(std::string && str) : owned_(std::move(str)) {}
+
+  /* str that also keeps owner alive until it is written */
+  SharedBuffer(std::string && str, const std::shared_ptr<const char> & owner)
+    : owned_(std::move(str)), owner_(owner)
+  {}
+
+  /* view [data, data + length) must stay valid as long as owner is alive */
+  SharedBuffer(const std::shared_ptr<const char> & owner,
+               const char * data, const size_t length)
+    : owner_(owner), shared_view_(data, length)
+  {}
+
+  /* a view of other that does not touch the reference count of its owner
+   * (which is atomic): other must stay alive until the view is written,
+   * e.g., by a buffer queued after the view that shares its owner */
+  static SharedBuffer borrow(const SharedBuffer & other)
+  {
+    return SharedBuffer(Borrowed {}, other.view());
+  }
+
+  std::string_view view() const
+  {
+    return shared_view_.data() ? shared_view_ : std::string_view(owned_);
+  }
+
+  size_t size() const { return view().size(); }
+
+  /* whether the buffer continues a message (e.g., a WebSocket frame) begun
+   * by the buffer queued before it, so that a queue cut short must not be
+   * cut in front of it */
+  bool continuation() const { return continuation_; }
+  void set_continuation() { continuation_ = true; }
+
+private:
+  struct Borrowed {};
+  SharedBuffer(Borrowed, const std::string_view view) : shared_view_(view) {}
+};
+
+#endif /* SHARED_BUFFER_HH */
@@ -0,0 +1,406 @@
+#ifndef SLOT_MAP_HH
+#define SLOT_MAP_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/* Values keyed by uint64_t in dense slots: blocks of BLOCK_SLOTS values from
+ * Allocator, whose slots are reused as soon as their values are erased.
+ * Iterating over the values thus walks a few contiguous blocks (in slot
+ * order, not key order) rather than the nodes of a tree. Values never move
+ * once emplaced, so they may be referred to (and need not be movable). The
+ * storage of SlotMap and GenerationalSlotMap, which look the keys up. */
+template<class T, class Allocator, size_t BLOCK_SLOTS>
+class SlotStorage
+{
+public:
+  using key_type = uint64_t;
+  using mapped_type = T;
+  using value_type = std::pair<const uint64_t, T>;
+
+  template<bool Const>
+  class Iterator
+  {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = SlotStorage::value_type;
+    using difference_type = std::ptrdiff_t;
+    using reference = std::conditional_t<Const, const value_type &,
+                                         value_type &>;
+    using pointer = std::conditional_t<Const, const value_type *,
+                                       value_type *>;
+    using Storage = std::conditional_t<Const, const SlotStorage, SlotStorage>;
+
+    Iterator(Storage * storage, const size_t slot)
+      : storage_(storage), slot_(slot)
+    {
+      skip_free();
+    }
+
+    /* an iterator converts to a const_iterator */
+    operator Iterator<true>() const { return {storage_, slot_}; }
+
+    reference operator*() const { return *storage_->value(slot_); }
+    pointer operator->() const { return storage_->value(slot_); }
+
+    Iterator & operator++()
+    {
+      slot_++;
+      skip_free();
+      return *this;
+    }
+
+    bool operator==(const Iterator & other) const
+    {
+      return slot_ == other.slot_;
+    }
+    bool operator!=(const Iterator & other) const
+    {
+      return slot_ != other.slot_;
+    }
+
+  private:
+    Storage * storage_;
+    size_t slot_;
+
+    void skip_free()
+    {
+      while (slot_ < storage_->used_.size() and not storage_->used_[slot_]) {
+        slot_++;
+      }
+    }
+  };
+
+  using iterator = Iterator<false>;
+  using const_iterator = Iterator<true>;
+
+  iterator begin() { return {this, 0}; }
+  iterator end() { return {this, used_.size()}; }
+  const_iterator begin() const { return {this, 0}; }
+  const_iterator end() const { return {this, used_.size()}; }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  /* forbid copying and moving, as the values may be referred to */
+  SlotStorage(const SlotStorage & other) = delete;
+  const SlotStorage & operator=(const SlotStorage & other) = delete;
+
+protected:
+  explicit SlotStorage(const Allocator & allocator) : allocator_(allocator) {}
+
+  ~SlotStorage()
+  {
+    clear_slots();
+    for (Block * block : blocks_) {
+      allocator_.deallocate(block, 1);
+    }
+  }
+
+  /* the slot that construct() will use next */
+  size_t next_slot() const
+  {
+    return free_slots_.empty() ? used_.size() : free_slots_.back();
+  }
+
+  /* construct a value with key and args in next_slot() */
+  template<class... Args>
+  size_t construct(const uint64_t key, Args &&... args)
+  {
+    const size_t slot = next_slot();
+    if (slot == blocks_.size() * BLOCK_SLOTS) {
+      blocks_.push_back(allocator_.allocate(1));
+    }
+
+    new (value(slot)) value_type(std::piecewise_construct,
+                                 std::forward_as_tuple(key),
+                                 std::forward_as_tuple(
+                                   std::forward<Args>(args)...));
+
+    if (free_slots_.empty()) {
+      used_.push_back(true);
+    } else {
+      free_slots_.pop_back();
+      used_[slot] = true;
+    }
+
+    size_++;
+    return slot;
+  }
+
+  void destroy(const size_t slot)
+  {
+    value(slot)->~value_type();
+    used_[slot] = false;
+    free_slots_.push_back(slot);
+    size_--;
+  }
+
+  void clear_slots()
+  {
+    for (size_t slot = 0; slot < used_.size(); slot++) {
+      if (used_[slot]) {
+        value(slot)->~value_type();
+      }
+    }
+
+    used_.clear();
+    free_slots_.clear();
+    size_ = 0;
+  }
+
+  size_t num_slots() const { return used_.size(); }
+  bool used(const size_t slot) const { return used_[slot]; }
+
+  value_type * value(const size_t slot) const
+  {
+    return std::launder(reinterpret_cast<value_type *>(
+      blocks_[slot / BLOCK_SLOTS]->slots[slot % BLOCK_SLOTS]));
+  }
+
+private:
+  struct Block
+  {
+    alignas(value_type) unsigned char slots[BLOCK_SLOTS][sizeof(value_type)];
+  };
+
+  using BlockAllocator =
+    typename std::allocator_traits<Allocator>::template rebind_alloc<Block>;
+
+  BlockAllocator allocator_;
+  std::vector<Block *> blocks_ {};
+
+  std::vector<bool> used_ {};  /* whether each slot holds a value */
+  std::vector<size_t> free_slots_ {};
+  size_t size_ {0};
+};
+
+/* SlotStorage under the keys of the caller (e.g., connection IDs), which are
+ * looked up in a hash table of slots. The interface is the subset of
+ * std::map's that is used. */
+template<class T,
+         class Allocator = std::allocator<std::pair<const uint64_t, T>>,
+         size_t BLOCK_SLOTS = 64>
+class SlotMap : public SlotStorage<T, Allocator, BLOCK_SLOTS>
+{
+  using Storage = SlotStorage<T, Allocator, BLOCK_SLOTS>;
+
+public:
+  using typename Storage::iterator;
+  using typename Storage::const_iterator;
+
+  explicit SlotMap(const Allocator & allocator = Allocator())
+    : Storage(allocator), slots_(IndexAllocator(allocator))
+  {}
+
+  using Storage::end;
+
+  iterator find(const uint64_t key)
+  {
+    const auto it = slots_.find(key);
+    return it == slots_.end() ? end() : iterator(this, it->second);
+  }
+
+  const_iterator find(const uint64_t key) const
+  {
+    const auto it = slots_.find(key);
+    return it == slots_.end() ? end() : const_iterator(this, it->second);
+  }
+
+  size_t count(const uint64_t key) const { return slots_.count(key); }
+
+  T & at(const uint64_t key) { return this->value(slot_of(key))->second; }
+  const T & at(const uint64_t key) const
+  {
+    return this->value(slot_of(key))->second;
+  }
+
+  /* construct a value from args in a free slot, unless key is present */
+  template<class... Args>
+  std::pair<iterator, bool> try_emplace(const uint64_t key, Args &&... args)
+  {
+    const auto it = slots_.find(key);
+    if (it != slots_.end()) {
+      return {iterator(this, it->second), false};
+    }
+
+    const size_t slot = this->construct(key, std::forward<Args>(args)...);
+    slots_.emplace(key, slot);
+    return {iterator(this, slot), true};
+  }
+
+  /* return the number of values erased (0 or 1) */
+  size_t erase(const uint64_t key)
+  {
+    const auto it = slots_.find(key);
+    if (it == slots_.end()) {
+      return 0;
+    }
+
+    const size_t slot = it->second;
+    slots_.erase(it);
+    this->destroy(slot);
+    return 1;
+  }
+
+  void clear()
+  {
+    this->clear_slots();
+    slots_.clear();
+  }
+
+private:
+  using IndexAllocator = typename std::allocator_traits<Allocator>::
+    template rebind_alloc<std::pair<const uint64_t, size_t>>;
+
+  /* key -> slot of its value */
+  std::unordered_map<uint64_t, size_t, std::hash<uint64_t>,
+                     std::equal_to<uint64_t>, IndexAllocator> slots_;
+
+  size_t slot_of(const uint64_t key) const
+  {
+    const auto it = slots_.find(key);
+    if (it == slots_.end()) {
+      throw std::out_of_range("SlotMap::at");
+    }
+    return it->second;
+  }
+};
+
+/* SlotStorage that assigns the keys itself: a key is made of the slot of
+ * its value and the generation of the slot (the number of values that it
+ * held before), so a lookup indexes the slots directly, and the key of an
+ * erased value is never found (or assigned) again. The keys are
+ * first_key + step * (generation << SLOT_BITS | slot), so that several maps
+ * can assign disjoint keys (see set_keys()). */
+template<class T,
+         class Allocator = std::allocator<std::pair<const uint64_t, T>>,
+         size_t BLOCK_SLOTS = 64>
+class GenerationalSlotMap : public SlotStorage<T, Allocator, BLOCK_SLOTS>
+{
+  using Storage = SlotStorage<T, Allocator, BLOCK_SLOTS>;
+
+public:
+  using typename Storage::iterator;
+  using typename Storage::const_iterator;
+
+  static constexpr unsigned int SLOT_BITS = 24;
+
+  explicit GenerationalSlotMap(const Allocator & allocator = Allocator())
+    : Storage(allocator)
+  {}
+
+  using Storage::end;
+
+  /* assign the keys first_key, first_key + step... (before any emplace()) */
+  void set_keys(const uint64_t first_key, const uint64_t step)
+  {
+    if (step == 0) {
+      throw std::invalid_argument("GenerationalSlotMap: step must be positive");
+    }
+    if (this->num_slots() > 0) {
+      throw std::logic_error("GenerationalSlotMap: keys already assigned");
+    }
+
+    first_key_ = first_key;
+    step_ = step;
+  }
+
+  iterator find(const uint64_t key)
+  {
+    const auto slot = slot_of(key);
+    return slot ? iterator(this, *slot) : end();
+  }
+
+  const_iterator find(const uint64_t key) const
+  {
+    const auto slot = slot_of(key);
+    return slot ? const_iterator(this, *slot) : end();
+  }
+
+  size_t count(const uint64_t key) const { return slot_of(key) ? 1 : 0; }
+
+  T & at(const uint64_t key) { return this->value(checked_slot(key))->second; }
+  const T & at(const uint64_t key) const
+  {
+    return this->value(checked_slot(key))->second;
+  }
+
+  /* construct a value from args in a free slot under a new key */
+  template<class... Args>
+  iterator emplace(Args &&... args)
+  {
+    const size_t slot = this->next_slot();
+    if (slot >> SLOT_BITS) {
+      throw std::length_error("GenerationalSlotMap: out of slots");
+    }
+
+    if (slot == generations_.size()) {
+      generations_.push_back(0);
+    }
+
+    const uint64_t key = first_key_
+                         + step_ * (generations_[slot] << SLOT_BITS | slot);
+    this->construct(key, std::forward<Args>(args)...);
+    return iterator(this, slot);
+  }
+
+  /* return the number of values erased (0 or 1) */
+  size_t erase(const uint64_t key)
+  {
+    const auto slot = slot_of(key);
+    if (not slot) {
+      return 0;
+    }
+
+    this->destroy(*slot);
+    generations_[*slot]++;
+    return 1;
+  }
+
+private:
+  uint64_t first_key_ {0};
+  uint64_t step_ {1};
+
+  /* of each slot */
+  std::vector<uint64_t> generations_ {};
+
+  /* the slot of the value of key, if any */
+  std::optional<size_t> slot_of(const uint64_t key) const
+  {
+    if (key < first_key_ or (key - first_key_) % step_ != 0) {
+      return std::nullopt;
+    }
+
+    const uint64_t index = (key - first_key_) / step_;
+    const size_t slot = index & ((uint64_t(1) << SLOT_BITS) - 1);
+
+    if (slot >= this->num_slots() or not this->used(slot)
+        or generations_[slot] != index >> SLOT_BITS) {
+      return std::nullopt;
+    }
+
+    return slot;
+  }
+
+  size_t checked_slot(const uint64_t key) const
+  {
+    const auto slot = slot_of(key);
+    if (not slot) {
+      throw std::out_of_range("GenerationalSlotMap::at");
+    }
+    return *slot;
+  }
+};
+
+#endif /* SLOT_MAP_HH */
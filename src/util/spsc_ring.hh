@@ -0,0 +1,76 @@
+#ifndef SPSC_RING_HH
+#define SPSC_RING_HH
+
+#include <cstdint>
+#include <atomic>
+#include <optional>
+#include <stdexcept>
+#include <vector>
+
+/* bounded single-producer single-consumer ring of items, which passes them
+ * between two threads without locks; neither side blocks, so a stage that
+ * finds the ring full (or empty) decides how to wait */
+template<class T>
+class SPSCRing
+{
+public:
+  SPSCRing(const size_t capacity)
+    : slots_(capacity)
+  {
+    if (capacity == 0) {
+      throw std::runtime_error("SPSCRing: capacity must be positive");
+    }
+  }
+
+  /* producer: false (and item is left as is) if the ring is full */
+  bool push(T && item)
+  {
+    const uint64_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) == slots_.size()) {
+      return false;
+    }
+
+    slots_[tail % slots_.size()].emplace(std::move(item));
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  size_t capacity() const { return slots_.size(); }
+
+  /* consumer */
+  bool empty() const
+  {
+    return head_.load(std::memory_order_relaxed)
+           == tail_.load(std::memory_order_acquire);
+  }
+
+  /* the oldest item, which stays in the ring until pop(); not empty() */
+  T & front()
+  {
+    return *slots_[head_.load(std::memory_order_relaxed) % slots_.size()];
+  }
+
+  void pop()
+  {
+    const uint64_t head = head_.load(std::memory_order_relaxed);
+    slots_[head % slots_.size()].reset();
+    head_.store(head + 1, std::memory_order_release);
+  }
+
+  /* consumer: drop all the items */
+  void clear()
+  {
+    while (not empty()) {
+      pop();
+    }
+  }
+
+private:
+  std::vector<std::optional<T>> slots_;
+
+  /* positions that only grow; the producer owns tail_, the consumer head_ */
+  alignas(64) std::atomic<uint64_t> head_ {0};
+  alignas(64) std::atomic<uint64_t> tail_ {0};
+};
+
+#endif /* SPSC_RING_HH */
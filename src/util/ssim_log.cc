@@ -0,0 +1,93 @@
+#include "ssim_log.hh"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <algorithm>
+#include <stdexcept>
+
+#include "exception.hh"
+#include "mmap.hh"
+
+using namespace std;
+
+/* the mapping grows by at least this much at a time */
+static const size_t MIN_MAPPING_SIZE = 1 << 20;  /* 1 MiB */
+
+void SSIMLog::append(const fs::path & path, const Record & record)
+{
+  FileDescriptor fd(CheckSystemCall("open (" + path.string() + ")",
+      open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644)));
+
+  /* a single write, which the other writers cannot interleave */
+  const ssize_t n = CheckSystemCall("write",
+      ::write(fd.fd_num(), &record, sizeof(record)));
+  if (static_cast<size_t>(n) != sizeof(record)) {
+    throw runtime_error("SSIMLog: short write to " + path.string());
+  }
+}
+
+SSIMLog::SSIMLog(const fs::path & path)
+  : path_(path)
+{
+  open_log();
+}
+
+bool SSIMLog::open_log()
+{
+  if (fd_) {
+    return true;
+  }
+
+  const int fd = open(path_.c_str(), O_RDONLY);
+  if (fd < 0) {
+    if (errno == ENOENT) {
+      return false;
+    }
+
+    CheckSystemCall("open (" + path_.string() + ")", fd);
+  }
+
+  fd_.emplace(fd);
+  return true;
+}
+
+void SSIMLog::tail(const function<void(const Record &)> & callback)
+{
+  if (not open_log()) {
+    return;
+  }
+
+  /* ignore a partially written record at the end */
+  const size_t total_records = fd_->filesize() / sizeof(Record);
+  if (total_records < num_records_) {
+    throw runtime_error("SSIMLog: " + path_.string() + " has been truncated");
+  }
+
+  if (total_records == num_records_) {
+    return;
+  }
+
+  const size_t size = total_records * sizeof(Record);
+  if (size > mapping_size_) {
+    /* at least double the mapping to remap rarely */
+    const long page_size = sysconf(_SC_PAGESIZE);
+    size_t new_size = max({size, 2 * mapping_size_, MIN_MAPPING_SIZE});
+    new_size = (new_size + page_size - 1) / page_size * page_size;
+
+    mapping_ = mmap_shared(nullptr, new_size, PROT_READ, MAP_SHARED,
+                           fd_->fd_num(), 0);
+    mapping_size_ = new_size;
+  }
+
+  const Record * all_records = records();
+  for (size_t i = num_records_; i < total_records; i++) {
+    num_records_ = i + 1;
+    callback(all_records[i]);
+  }
+}
+
+const SSIMLog::Record * SSIMLog::records() const
+{
+  return static_cast<const Record *>(mapping_.get());
+}
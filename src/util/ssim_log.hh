@@ -0,0 +1,60 @@
+#ifndef SSIM_LOG_HH
+#define SSIM_LOG_HH
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+
+#include "filesystem.hh"
+#include "file_descriptor.hh"
+
+/* Append-only log of fixed-size records, one per encoded video chunk, written
+ * by ssim_calculator next to the .ssim files and tailed by the readers
+ * through a single mmap of the log, rather than by opening one small file
+ * per chunk per format. Records are appended with a single write() on an
+ * O_APPEND fd, so concurrent writers never interleave. */
+class SSIMLog
+{
+public:
+  struct Record {
+    uint64_t ts;
+    uint32_t format_idx;  /* index of the video format in the channel config */
+    uint32_t reserved;
+    double ssim;
+    uint64_t size;        /* size of the encoded chunk in bytes */
+  };
+
+  static_assert(sizeof(Record) == 32, "SSIMLog::Record must be packed");
+
+  /* append a record to the log at path, creating the log if necessary */
+  static void append(const fs::path & path, const Record & record);
+
+  /* the log is opened once it exists */
+  SSIMLog(const fs::path & path);
+
+  /* call callback on each record appended since the last call */
+  void tail(const std::function<void(const Record &)> & callback);
+
+  /* all the (whole) records tailed so far, contiguous in memory */
+  const Record * records() const;
+  size_t num_records() const { return num_records_; }
+
+  fs::path path() const { return path_; }
+
+private:
+  fs::path path_;
+  std::optional<FileDescriptor> fd_ {};
+
+  /* the log is mapped beyond its end so that it is remapped only when its
+   * size exceeds the mapping; the pages beyond the end are never touched */
+  std::shared_ptr<void> mapping_ {};
+  size_t mapping_size_ {0};
+
+  size_t num_records_ {0};
+
+  /* return false if the log does not exist yet */
+  bool open_log();
+};
+
+#endif /* SSIM_LOG_HH */
@@ -4,8 +4,11 @@
 #define STRICT_CONVERSIONS_HH
 
 #include <cmath>
+#include <charconv>
+#include <optional>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <type_traits>
 #include <sstream>
 
@@ -14,6 +17,36 @@ double strict_atof( const std::string & str );
 unsigned long int strict_atoui(const std::string & str, const int base = 10);
 std::string double_to_string(const double input, const int precision);
 
+/* Parse the whole of str as a number of type T with std::from_chars, which
+ * neither allocates nor depends on the locale; nullopt if str is not exactly
+ * one number in range (e.g., leading whitespace or '+' is not accepted). */
+template<typename T>
+std::optional<T> parse_number(const std::string_view str)
+{
+  static_assert(std::is_arithmetic<T>::value, "T: arithmetic required.");
+
+  T value;
+  const auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(),
+                                         value);
+  if (ec != std::errc() or ptr != str.data() + str.size()) {
+    return std::nullopt;
+  }
+
+  return value;
+}
+
+/* Same as parse_number, but throws if str is not a number. */
+template<typename T>
+T strict_parse(const std::string_view str)
+{
+  const auto value = parse_number<T>(str);
+  if (not value) {
+    throw std::runtime_error("Invalid number: " + std::string(str));
+  }
+
+  return *value;
+}
+
 /* Cast two integral types Source to Target.
  * Assert no precision is lost. */
 template<typename Target, typename Source>
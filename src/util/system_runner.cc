@@ -98,25 +98,23 @@ pair<string, string> run(
     stderr_pipe = make_pipe();
   }
 
-  ChildProcess command_process(args[0],
-    [&filename, &args, &env, use_environ, path_search,
-     &stdout_pipe, &stderr_pipe]()
-    {
-      if (stdout_pipe) {
-        stdout_pipe->first.close();
-        CheckSystemCall("dup2", dup2(stdout_pipe->second.fd_num(),
-                                     STDOUT_FILENO));
-      }
+  SpawnOptions options;
+  if (stdout_pipe) {
+    options.closes.emplace_back(stdout_pipe->first.fd_num());
+    options.dup2s.emplace_back(stdout_pipe->second.fd_num(), STDOUT_FILENO);
+  }
 
-      if (stderr_pipe) {
-        stderr_pipe->first.close();
-        CheckSystemCall("dup2", dup2(stderr_pipe->second.fd_num(),
-                                     STDERR_FILENO));
-      }
+  if (stderr_pipe) {
+    options.closes.emplace_back(stderr_pipe->first.fd_num());
+    options.dup2s.emplace_back(stderr_pipe->second.fd_num(), STDERR_FILENO);
+  }
 
-      return ezexec(filename, args, env, use_environ, path_search);
-    }
- );
+  if (not use_environ) {
+    options.env = env;
+  }
+  options.path_search = path_search;
+
+  ChildProcess command_process(args[0], filename, args, options);
 
   if (stdout_pipe) {
     stdout_pipe->second.close();
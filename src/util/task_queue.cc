@@ -0,0 +1,59 @@
+#include "task_queue.hh"
+
+using namespace std;
+using namespace PollerShortNames;
+
+TaskQueue::TaskQueue(Poller & poller)
+{
+  poller.add_action(Poller::Action(*eventfd_, Direction::In,
+    [this, eventfd = eventfd_, alive = alive_]()->Result {
+      if (not *alive) {
+        return ResultType::Cancel;
+      }
+
+      eventfd->consume();
+      run_posted();
+      return ResultType::Continue;
+    }
+  ).named("task_queue"));
+}
+
+TaskQueue::~TaskQueue()
+{
+  *alive_ = false;
+}
+
+void TaskQueue::post(Task && task)
+{
+  bool was_empty;
+  {
+    lock_guard<mutex> lock(mutex_);
+    was_empty = posted_.empty();
+    posted_.emplace_back(move(task));
+  }
+
+  /* otherwise, the eventfd has been written and not yet drained */
+  if (was_empty) {
+    eventfd_->notify();
+  }
+}
+
+void TaskQueue::run_posted()
+{
+  {
+    lock_guard<mutex> lock(mutex_);
+    swap(posted_, running_);
+  }
+
+  /* cleared even if a task throws, so that no task is run twice */
+  try {
+    for (auto & task : running_) {
+      task();
+    }
+  } catch (...) {
+    running_.clear();
+    throw;
+  }
+
+  running_.clear();
+}
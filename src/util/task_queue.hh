@@ -0,0 +1,46 @@
+#ifndef TASK_QUEUE_HH
+#define TASK_QUEUE_HH
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "eventfd.hh"
+#include "poller.hh"
+
+/* Tasks posted by other threads (e.g., the results of TLS, ABR inference or
+ * disk workers) to be run by a poller's event loop. Only the first post
+ * since the poller last drained the queue writes the eventfd, and the
+ * poller swaps out all the tasks posted at once, so a batch costs one
+ * wakeup and no allocations (the two vectors keep their capacity). */
+class TaskQueue
+{
+public:
+  typedef std::function<void(void)> Task;
+
+  TaskQueue(Poller & poller);
+  ~TaskQueue();
+
+  /* any thread */
+  void post(Task && task);
+
+  /* forbid copying or moving, as the workers refer to this */
+  TaskQueue(const TaskQueue & other) = delete;
+  const TaskQueue & operator=(const TaskQueue & other) = delete;
+
+private:
+  std::mutex mutex_ {};
+  std::vector<Task> posted_ {};
+
+  /* accessed by the event loop only */
+  std::vector<Task> running_ {};
+
+  /* shared with the poller action, which might outlive the queue */
+  std::shared_ptr<EventFD> eventfd_ {std::make_shared<EventFD>()};
+  std::shared_ptr<bool> alive_ {std::make_shared<bool>(true)};
+
+  void run_posted();
+};
+
+#endif /* TASK_QUEUE_HH */
@@ -0,0 +1,160 @@
+#include "thread_pool.hh"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdexcept>
+
+#include "exception.hh"
+
+using namespace std;
+
+/* the pool and the worker of the current thread, if it is a worker */
+static thread_local const ThreadPool * current_pool = nullptr;
+static thread_local size_t current_worker = 0;
+
+ThreadPool::ThreadPool(const vector<int> & cpus)
+{
+  start(vector<optional<int>>(cpus.begin(), cpus.end()));
+}
+
+ThreadPool::ThreadPool(const unsigned int num_threads)
+{
+  start(vector<optional<int>>(num_threads));
+}
+
+void ThreadPool::start(const vector<optional<int>> & cpus)
+{
+  if (cpus.empty()) {
+    throw runtime_error("ThreadPool: at least one worker is required");
+  }
+
+  for (size_t i = 0; i < cpus.size(); i++) {
+    workers_.emplace_back(make_unique<Worker>());
+  }
+
+  /* only once every worker exists, as they steal from each other */
+  for (size_t i = 0; i < cpus.size(); i++) {
+    workers_[i]->thread = thread(&ThreadPool::run, this, i, cpus[i]);
+  }
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    lock_guard<mutex> lock(mutex_);
+    stop_ = true;
+  }
+  work_cv_.notify_all();
+
+  for (auto & worker : workers_) {
+    worker->thread.join();
+  }
+}
+
+void ThreadPool::submit(Task && task)
+{
+  size_t index;
+
+  {
+    lock_guard<mutex> lock(mutex_);
+    index = current_pool == this ? current_worker
+                                 : next_worker_++ % workers_.size();
+  }
+
+  {
+    lock_guard<mutex> lock(workers_[index]->mutex);
+    workers_[index]->tasks.emplace_back(move(task));
+  }
+
+  {
+    lock_guard<mutex> lock(mutex_);
+    num_queued_++;
+    num_unfinished_++;
+  }
+  work_cv_.notify_one();
+}
+
+void ThreadPool::wait()
+{
+  if (current_pool == this) {
+    throw runtime_error("ThreadPool: wait() from a worker would deadlock");
+  }
+
+  unique_lock<mutex> lock(mutex_);
+  idle_cv_.wait(lock, [this]() { return num_unfinished_ == 0; });
+}
+
+ThreadPool::Task ThreadPool::take(const size_t index)
+{
+  /* a task has been counted for this worker, so one is in some deque */
+  for (;;) {
+    for (size_t i = 0; i < workers_.size(); i++) {
+      Worker & worker = *workers_[(index + i) % workers_.size()];
+      lock_guard<mutex> lock(worker.mutex);
+
+      if (worker.tasks.empty()) {
+        continue;
+      }
+
+      Task task;
+      if (i == 0) {
+        /* its own newest */
+        task = move(worker.tasks.back());
+        worker.tasks.pop_back();
+      } else {
+        /* the oldest of another */
+        task = move(worker.tasks.front());
+        worker.tasks.pop_front();
+      }
+
+      return task;
+    }
+  }
+}
+
+void ThreadPool::run(const size_t index, const optional<int> cpu)
+{
+  current_pool = this;
+  current_worker = index;
+
+  if (cpu) {
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(*cpu, &cpu_set);
+
+    const int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set),
+                                           &cpu_set);
+    if (ret != 0) {
+      throw unix_error("pthread_setaffinity_np", ret);
+    }
+  }
+
+  for (;;) {
+    {
+      unique_lock<mutex> lock(mutex_);
+      work_cv_.wait(lock, [this]() { return stop_ or num_queued_ > 0; });
+
+      if (num_queued_ == 0) {
+        return;  /* stopped, with nothing left to run */
+      }
+
+      num_queued_--;
+    }
+
+    Task task = take(index);
+
+    try {
+      task();
+    } catch (const exception & e) {
+      print_exception("ThreadPool task", e);
+    }
+
+    {
+      lock_guard<mutex> lock(mutex_);
+      num_unfinished_--;
+      if (num_unfinished_ == 0) {
+        idle_cv_.notify_all();
+      }
+    }
+  }
+}
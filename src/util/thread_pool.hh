@@ -0,0 +1,73 @@
+#ifndef THREAD_POOL_HH
+#define THREAD_POOL_HH
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+/* Worker threads that run tasks, each worker pinned to a CPU if given one.
+ * Every worker has a deque of its own: a task submitted from a worker
+ * (e.g., a part of the task it is running) goes to the back of its deque,
+ * and is run newest first while its data is still in the cache; other
+ * tasks are dealt to the workers in turn. A worker whose deque is empty
+ * steals the oldest task of another, so that the load evens out. The
+ * deques are guarded by a mutex each, as tasks are meant to be coarse
+ * (e.g., a frame or a chunk). */
+class ThreadPool
+{
+public:
+  using Task = std::function<void(void)>;
+
+  /* a worker pinned to each of cpus */
+  ThreadPool(const std::vector<int> & cpus);
+
+  /* num_threads workers that are not pinned */
+  ThreadPool(const unsigned int num_threads);
+
+  /* runs the tasks submitted before returning */
+  ~ThreadPool();
+
+  /* run task on a worker; an exception that it throws is printed */
+  void submit(Task && task);
+
+  /* block until every task submitted has run (not from a worker) */
+  void wait();
+
+  size_t size() const { return workers_.size(); }
+
+  /* forbid copying or moving, as the workers refer to this */
+  ThreadPool(const ThreadPool & other) = delete;
+  const ThreadPool & operator=(const ThreadPool & other) = delete;
+
+private:
+  struct Worker
+  {
+    std::mutex mutex {};
+    std::deque<Task> tasks {};
+    std::thread thread {};
+  };
+
+  std::vector<std::unique_ptr<Worker>> workers_ {};
+
+  /* guards what follows; a task is counted once it is in a deque */
+  std::mutex mutex_ {};
+  std::condition_variable work_cv_ {};
+  std::condition_variable idle_cv_ {};
+  size_t num_queued_ {0};       /* not yet taken by a worker */
+  size_t num_unfinished_ {0};   /* not yet run */
+  size_t next_worker_ {0};
+  bool stop_ {false};
+
+  void start(const std::vector<std::optional<int>> & cpus);
+  void run(const size_t index, const std::optional<int> cpu);
+
+  /* a task of worker index, or else one stolen from another */
+  Task take(const size_t index);
+};
+
+#endif /* THREAD_POOL_HH */
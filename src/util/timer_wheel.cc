@@ -0,0 +1,188 @@
+#include "timer_wheel.hh"
+
+#include <algorithm>
+
+using namespace std;
+
+static constexpr uint64_t SLOT_MASK = (1 << 8) - 1;
+
+TimerWheel::TimerWheel(const unsigned int tick_ms, const uint64_t now_ms)
+  : tick_ms_(max(tick_ms, 1u)), current_tick_(now_ms / tick_ms_),
+    heads_(FIRING + 1, NIL)
+{
+  static_assert(SLOT_MASK == SLOTS_PER_LEVEL - 1);
+}
+
+void TimerWheel::link(const uint32_t list, const uint32_t idx)
+{
+  Node & node = nodes_[idx];
+  node.list = list;
+  node.prev = NIL;
+  node.next = heads_[list];
+
+  if (node.next != NIL) {
+    nodes_[node.next].prev = idx;
+  }
+  heads_[list] = idx;
+}
+
+void TimerWheel::unlink(const uint32_t idx)
+{
+  Node & node = nodes_[idx];
+
+  if (node.prev != NIL) {
+    nodes_[node.prev].next = node.next;
+  } else {
+    heads_[node.list] = node.next;
+  }
+
+  if (node.next != NIL) {
+    nodes_[node.next].prev = node.prev;
+  }
+
+  node.list = NIL;
+  node.prev = NIL;
+  node.next = NIL;
+}
+
+void TimerWheel::free_node(const uint32_t idx)
+{
+  Node & node = nodes_[idx];
+  node.callback = nullptr;
+  node.generation++;
+
+  free_nodes_.push_back(idx);
+  num_timers_--;
+}
+
+void TimerWheel::schedule(const uint32_t idx)
+{
+  const uint64_t expiry = nodes_[idx].expiry;
+  const uint64_t delta = expiry - current_tick_;
+
+  for (unsigned int level = 0; level < NUM_LEVELS; level++) {
+    const unsigned int shift = level * LEVEL_BITS;
+
+    if (level + 1 == NUM_LEVELS) {
+      /* beyond the top level: wait in the farthest slot of the top level
+       * and get re-scheduled from there */
+      const uint64_t max_delta = (uint64_t(1) << (shift + LEVEL_BITS)) - 1;
+      const uint64_t capped = current_tick_ + min(delta, max_delta);
+      link(level * SLOTS_PER_LEVEL + (capped >> shift & SLOT_MASK), idx);
+      return;
+    }
+
+    if (delta < (uint64_t(1) << (shift + LEVEL_BITS))) {
+      link(level * SLOTS_PER_LEVEL + (expiry >> shift & SLOT_MASK), idx);
+      return;
+    }
+  }
+}
+
+TimerWheel::TimerId TimerWheel::add(const uint64_t deadline_ms,
+                                    function<void()> callback)
+{
+  uint32_t idx;
+  if (not free_nodes_.empty()) {
+    idx = free_nodes_.back();
+    free_nodes_.pop_back();
+  } else {
+    idx = nodes_.size();
+    nodes_.emplace_back();
+  }
+
+  Node & node = nodes_[idx];
+  node.expiry = max((deadline_ms + tick_ms_ - 1) / tick_ms_, current_tick_ + 1);
+  node.callback = move(callback);
+  num_timers_++;
+
+  schedule(idx);
+
+  return uint64_t(node.generation) << 32 | idx;
+}
+
+bool TimerWheel::cancel(const TimerId id)
+{
+  const uint32_t idx = id & UINT32_MAX;
+  if (idx >= nodes_.size()) {
+    return false;
+  }
+
+  Node & node = nodes_[idx];
+  if (node.generation != (id >> 32) or node.list == NIL) {
+    return false;
+  }
+
+  unlink(idx);
+  free_node(idx);
+  return true;
+}
+
+void TimerWheel::cascade(const unsigned int level, const size_t slot)
+{
+  const uint32_t list = level * SLOTS_PER_LEVEL + slot;
+
+  while (heads_[list] != NIL) {
+    const uint32_t idx = heads_[list];
+    unlink(idx);
+    schedule(idx);
+  }
+}
+
+void TimerWheel::advance(const uint64_t now_ms)
+{
+  const uint64_t now_tick = now_ms / tick_ms_;
+
+  while (current_tick_ < now_tick) {
+    if (empty()) {
+      current_tick_ = now_tick;
+      return;
+    }
+
+    const uint64_t tick = ++current_tick_;
+
+    /* when a level wraps, bring the next slot of the level above down */
+    for (unsigned int level = 1; level < NUM_LEVELS; level++) {
+      const unsigned int shift = level * LEVEL_BITS;
+      if ((tick & ((uint64_t(1) << shift) - 1)) != 0) {
+        break;
+      }
+
+      cascade(level, tick >> shift & SLOT_MASK);
+    }
+
+    /* move the due timers out of the slot first, so that the callbacks can
+     * add timers to it (for the next round) and cancel the others */
+    const uint32_t slot = tick & SLOT_MASK;
+    while (heads_[slot] != NIL) {
+      const uint32_t idx = heads_[slot];
+      unlink(idx);
+      link(FIRING, idx);
+    }
+
+    while (heads_[FIRING] != NIL) {
+      const uint32_t idx = heads_[FIRING];
+      unlink(idx);
+
+      auto callback = move(nodes_[idx].callback);
+      free_node(idx);
+      callback();
+    }
+  }
+}
+
+optional<uint64_t> TimerWheel::next_ms() const
+{
+  if (empty()) {
+    return nullopt;
+  }
+
+  /* the next tick with a timer in the lowest level, or the next wrap of
+   * the lowest level, which cascades */
+  uint64_t tick = current_tick_ + 1;
+  while (heads_[tick & SLOT_MASK] == NIL and (tick & SLOT_MASK) != 0) {
+    tick++;
+  }
+
+  return tick * tick_ms_;
+}
@@ -0,0 +1,80 @@
+#ifndef TIMER_WHEEL_HH
+#define TIMER_WHEEL_HH
+
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <vector>
+
+/* A hierarchical timer wheel: NUM_LEVELS wheels of SLOTS_PER_LEVEL slots,
+ * where a slot of level l spans SLOTS_PER_LEVEL^l ticks. A timer goes into
+ * the slot of the lowest level that covers its deadline, and the timers of
+ * a slot of a higher level are cascaded into the lower levels when the
+ * wheel below wraps, so adding and canceling a timer are O(1) and advancing
+ * only touches the timers that expire (or cascade). A timer fires on the
+ * first tick at or after its deadline, never earlier. Times are in ms. */
+class TimerWheel
+{
+public:
+  /* identifies a timer until it fires or is canceled; never reused */
+  using TimerId = uint64_t;
+
+  TimerWheel(const unsigned int tick_ms, const uint64_t now_ms);
+
+  /* call callback once at deadline_ms (or on the next tick if it is due) */
+  TimerId add(const uint64_t deadline_ms, std::function<void()> callback);
+
+  /* return false if the timer has already fired or been canceled */
+  bool cancel(const TimerId id);
+
+  /* fire the timers that are due at now_ms; their callbacks may add and
+   * cancel timers */
+  void advance(const uint64_t now_ms);
+
+  /* when (ms) advance() has anything to do next, i.e., the next tick with
+   * a timer or a cascade; nullopt if there are no timers */
+  std::optional<uint64_t> next_ms() const;
+
+  size_t size() const { return num_timers_; }
+  bool empty() const { return num_timers_ == 0; }
+
+private:
+  static constexpr unsigned int LEVEL_BITS = 8;
+  static constexpr size_t SLOTS_PER_LEVEL = 1 << LEVEL_BITS;
+  static constexpr unsigned int NUM_LEVELS = 4;
+
+  /* the list of the timers being fired, after the slots */
+  static constexpr uint32_t FIRING = NUM_LEVELS * SLOTS_PER_LEVEL;
+  static constexpr uint32_t NIL = UINT32_MAX;
+
+  /* nodes of doubly linked lists, one per slot, kept in a pool */
+  struct Node
+  {
+    uint64_t expiry {0};      /* tick */
+    uint32_t generation {0};  /* of the TimerId, bumped when freed */
+    uint32_t list {NIL};      /* slot (or FIRING); NIL if free */
+    uint32_t prev {NIL};
+    uint32_t next {NIL};
+    std::function<void()> callback {};
+  };
+
+  unsigned int tick_ms_;
+  uint64_t current_tick_;  /* the last tick that has been advanced over */
+  size_t num_timers_ {0};
+
+  std::vector<Node> nodes_ {};
+  std::vector<uint32_t> free_nodes_ {};
+  std::vector<uint32_t> heads_;  /* of each slot, then FIRING */
+
+  void link(const uint32_t list, const uint32_t idx);
+  void unlink(const uint32_t idx);
+  void free_node(const uint32_t idx);
+
+  /* put a linked-out node into the slot for its expiry */
+  void schedule(const uint32_t idx);
+
+  /* re-schedule the timers of slot of level (> 0) into the lower levels */
+  void cascade(const unsigned int level, const size_t slot);
+};
+
+#endif /* TIMER_WHEEL_HH */
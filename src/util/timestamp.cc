@@ -1,5 +1,6 @@
 #include "timestamp.hh"
 #include <ctime>
+#include <stdexcept>
 #include "exception.hh"
 
 uint64_t timestamp_ns()
@@ -27,3 +28,17 @@ uint64_t timestamp_s()
 
   return ts.tv_sec;
 }
+
+uint64_t parse_utc_time_ms(const std::string & str)
+{
+  for (const char * format : {"%Y-%m-%dT%H:%M:%SZ", "%Y-%m-%d"}) {
+    tm t {};
+    const char * end = strptime(str.c_str(), format, &t);
+    if (end and *end == '\0') {
+      return static_cast<uint64_t>(timegm(&t)) * 1000;
+    }
+  }
+
+  throw std::runtime_error("invalid time: " + str
+                           + " (expected YYYY-MM-DD[THH:MM:SSZ])");
+}
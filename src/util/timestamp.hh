@@ -2,6 +2,7 @@
 #define TIMESTAMP_HH
 
 #include <cstdint>
+#include <string>
 
 const uint64_t MILLION = 1000 * 1000;
 const uint64_t BILLION = 1000 * 1000 * 1000;
@@ -18,4 +19,7 @@ uint64_t timestamp_ms();
 /* seconds since epoch */
 uint64_t timestamp_s();
 
+/* milliseconds since epoch of a UTC time such as 2026-10-01[T12:00:00Z] */
+uint64_t parse_utc_time_ms(const std::string & str);
+
 #endif /* TIMESTAMP_HH */
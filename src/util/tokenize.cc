@@ -32,3 +32,29 @@ vector< string > split( const string & str, const string & separator )
 
   return ret;
 }
+
+void split( const string_view str, const string_view separator,
+            vector< string_view > & tokens )
+{
+  tokens.clear();
+
+  if ( separator.empty() ) {
+    tokens.push_back( str );
+    return;
+  }
+
+  /* a single character is searched for with memchr (vectorized in libc) */
+  const bool single_char = separator.size() == 1;
+
+  size_t pos = 0;
+  for ( ;; ) {
+    const size_t next_token = single_char ? str.find( separator[ 0 ], pos )
+                                          : str.find( separator, pos );
+    tokens.push_back( str.substr( pos, next_token - pos ) );
+
+    if ( next_token == string_view::npos ) {
+      return;
+    }
+    pos = next_token + separator.size();
+  }
+}
@@ -4,9 +4,16 @@
 #define TOKENIZE_HH
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <utility>
 
 std::vector< std::string > split( const std::string & str, const std::string & separator );
 
+/* split str on separator into views of str, which must outlive them; tokens
+ * is cleared first and reused, so that splitting one line after another
+ * allocates nothing once it has grown */
+void split( const std::string_view str, const std::string_view separator,
+            std::vector< std::string_view > & tokens );
+
 #endif /* TOKENIZE_HH */
@@ -1,5 +1,7 @@
 #include "y4m.hh"
 
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string>
@@ -7,18 +9,28 @@
 #include <fstream>
 
 #include "exception.hh"
+#include "mmap.hh"
 #include "tokenize.hh"
 
 using namespace std;
 
-Y4MParser::Y4MParser(const string & y4m_path)
-  : width_(-1), height_(-1), frame_rate_numerator_(-1),
-    frame_rate_denominator_(-1), interlaced_(false)
-{
-  ifstream y4m_file(y4m_path);
-  string line;
-  getline(y4m_file, line);
+namespace {
+  /* the parameters of a Y4M header; -1 if missing */
+  struct Y4MHeader
+  {
+    int width {-1};
+    int height {-1};
+    int frame_rate_numerator {-1};
+    int frame_rate_denominator {-1};
+    bool interlaced {false};
+    bool top_field_first {false};  /* "It" (or "Im", mixed, as FFmpeg) */
+    string colorspace {};  /* e.g., "420jpeg" */
+  };
+}
 
+/* parse the first line of a Y4M file (without its newline) */
+static Y4MHeader parse_header(const string & line, const string & y4m_path)
+{
   /* split the first line into parameters */
   vector<string> params = split(line, " ");
 
@@ -27,44 +39,202 @@ Y4MParser::Y4MParser(const string & y4m_path)
     throw runtime_error(y4m_path + ": no YUV4MPEG2 found");
   }
 
+  Y4MHeader header;
+
   for (size_t i = 1; i < params.size(); ++i) {
     const string & p = params[i];
     size_t pos;
 
+    if (p.empty()) {
+      continue;
+    }
+
     switch (p.at(0)) {
     case 'W':
-      width_ = stoi(p.substr(1));
+      header.width = stoi(p.substr(1));
       break;
     case 'H':
-      height_ = stoi(p.substr(1));
+      header.height = stoi(p.substr(1));
       break;
     case 'F':
       pos = p.find(':');
       if (pos != string::npos) {
-        frame_rate_numerator_ = stoi(p.substr(1, pos - 1));
-        frame_rate_denominator_ = stoi(p.substr(pos + 1));
+        header.frame_rate_numerator = stoi(p.substr(1, pos - 1));
+        header.frame_rate_denominator = stoi(p.substr(pos + 1));
       }
       break;
     case 'I':
-      if (p.at(1) != 'p') {
-        interlaced_ = true;
+      if (p.size() > 1 and p.at(1) != 'p') {
+        header.interlaced = true;
+        header.top_field_first = p.at(1) != 'b';
       }
       break;
+    case 'C':
+      header.colorspace = p.substr(1);
+      break;
     default:
       break;
     }
   }
 
   /* validate width, height and frame rate */
-  if (width_ < 0) {
+  if (header.width < 0) {
     throw runtime_error(y4m_path + " : no frame width found");
   }
 
-  if (height_ < 0) {
+  if (header.height < 0) {
     throw runtime_error(y4m_path + " : no frame height found");
   }
 
-  if (frame_rate_numerator_ < 0 or frame_rate_denominator_ < 0) {
+  if (header.frame_rate_numerator < 0 or header.frame_rate_denominator < 0) {
     throw runtime_error(y4m_path + " : no frame rate found");
   }
+
+  return header;
+}
+
+/* the sizes of the Y plane and of each chroma plane of a 4:2:0 frame */
+static pair<size_t, size_t> plane_sizes(const unsigned int width,
+                                        const unsigned int height)
+{
+  return { size_t(width) * height,
+           size_t((width + 1) / 2) * ((height + 1) / 2) };
+}
+
+Y4MParser::Y4MParser(const string & y4m_path)
+  : width_(-1), height_(-1), frame_rate_numerator_(-1),
+    frame_rate_denominator_(-1), interlaced_(false)
+{
+  ifstream y4m_file(y4m_path);
+  string line;
+  getline(y4m_file, line);
+
+  const Y4MHeader header = parse_header(line, y4m_path);
+  width_ = header.width;
+  height_ = header.height;
+  frame_rate_numerator_ = header.frame_rate_numerator;
+  frame_rate_denominator_ = header.frame_rate_denominator;
+  interlaced_ = header.interlaced;
+}
+
+Y4MFile::Y4MFile(const string & y4m_path)
+  : path_(y4m_path)
+{
+  FileDescriptor fd(CheckSystemCall("open (" + y4m_path + ")",
+                                    open(y4m_path.c_str(), O_RDONLY)));
+
+  struct stat st;
+  CheckSystemCall("fstat (" + y4m_path + ")", fstat(fd.fd_num(), &st));
+  size_ = st.st_size;
+
+  if (size_ == 0) {
+    throw runtime_error(y4m_path + ": empty Y4M file");
+  }
+
+  data_ = mmap_shared(nullptr, size_, PROT_READ, MAP_PRIVATE, fd.fd_num(), 0);
+  const string_view data(static_cast<const char *>(data_.get()), size_);
+
+  size_t newline = data.find('\n');
+  if (newline == string_view::npos) {
+    throw runtime_error(y4m_path + ": no Y4M header found");
+  }
+
+  const Y4MHeader header = parse_header(string(data.substr(0, newline)),
+                                        y4m_path);
+
+  /* 8-bit 4:2:0 (the default) with any chroma siting */
+  if (not header.colorspace.empty() and
+      header.colorspace.compare(0, 3, "420") != 0) {
+    throw runtime_error(y4m_path + ": unsupported colorspace C"
+                        + header.colorspace);
+  }
+
+  width_ = header.width;
+  height_ = header.height;
+  frame_rate_numerator_ = header.frame_rate_numerator;
+  frame_rate_denominator_ = header.frame_rate_denominator;
+  interlaced_ = header.interlaced;
+  top_field_first_ = header.top_field_first;
+
+  const auto [luma_size, chroma_size] = plane_sizes(width_, height_);
+  const size_t frame_size = luma_size + 2 * chroma_size;
+
+  /* each frame is a FRAME line (which may have parameters) and the planes */
+  size_t pos = newline + 1;
+  while (pos < size_) {
+    if (data.compare(pos, 5, "FRAME") != 0) {
+      throw runtime_error(y4m_path + ": no FRAME found");
+    }
+
+    newline = data.find('\n', pos);
+    if (newline == string_view::npos or size_ - (newline + 1) < frame_size) {
+      throw runtime_error(y4m_path + ": truncated Y4M frame");
+    }
+
+    frame_offsets_.push_back(newline + 1);
+    pos = newline + 1 + frame_size;
+  }
+}
+
+Y4MFrame Y4MFile::frame(const size_t i) const
+{
+  if (i >= frame_offsets_.size()) {
+    throw out_of_range(path_ + ": no frame " + to_string(i));
+  }
+
+  const auto [luma_size, chroma_size] = plane_sizes(width_, height_);
+  const string_view data(static_cast<const char *>(data_.get()), size_);
+  const size_t offset = frame_offsets_[i];
+
+  return { data.substr(offset, luma_size),
+           data.substr(offset + luma_size, chroma_size),
+           data.substr(offset + luma_size + chroma_size, chroma_size) };
+}
+
+Y4MWriter::Y4MWriter(FileDescriptor && fd, const unsigned int width,
+                     const unsigned int height,
+                     const tuple<int, int> frame_rate,
+                     const bool interlaced)
+  : fd_(move(fd)), width_(width), height_(height),
+    header_("YUV4MPEG2 W" + to_string(width) + " H" + to_string(height)
+            + " F" + to_string(get<0>(frame_rate)) + ":"
+            + to_string(get<1>(frame_rate)) + (interlaced ? " It" : " Ip")
+            + " C420jpeg\n")
+{}
+
+void Y4MWriter::write_frame(const Y4MFrame & frame)
+{
+  const auto [luma_size, chroma_size] = plane_sizes(width_, height_);
+  if (frame.Y.size() != luma_size or frame.Cb.size() != chroma_size or
+      frame.Cr.size() != chroma_size) {
+    throw runtime_error("Y4MWriter: planes are not the size of a "
+                        + to_string(width_) + "x" + to_string(height_)
+                        + " frame");
+  }
+
+  static const string_view frame_header { "FRAME\n" };
+
+  vector<string_view> buffers;
+  if (not header_written_) {
+    buffers.emplace_back(header_);
+  }
+  buffers.insert(buffers.end(), { frame_header, frame.Y, frame.Cb, frame.Cr });
+
+  /* writev might write only some of the buffers, e.g., to a pipe */
+  auto next = buffers.begin();
+  while (next != buffers.end()) {
+    size_t bytes_written = fd_.writev(vector<string_view>(next, buffers.end()));
+
+    /* skip the buffers written */
+    while (next != buffers.end() and bytes_written >= next->size()) {
+      bytes_written -= next->size();
+      next++;
+    }
+
+    if (bytes_written > 0) {
+      next->remove_prefix(bytes_written);
+    }
+  }
+
+  header_written_ = true;
 }
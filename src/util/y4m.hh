@@ -1,8 +1,14 @@
 #ifndef Y4M_HH
 #define Y4M_HH
 
+#include <cstdint>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <tuple>
+#include <vector>
+
+#include "file_descriptor.hh"
 
 /* parse Y4M header */
 class Y4MParser
@@ -32,4 +38,76 @@ private:
   bool interlaced_;
 };
 
+/* the planes of an 8-bit 4:2:0 frame, which point into a Y4MFile or into
+ * buffers of the caller's */
+struct Y4MFrame
+{
+  std::string_view Y {};
+  std::string_view Cb {};
+  std::string_view Cr {};
+};
+
+/* an 8-bit 4:2:0 Y4M file mapped into memory, for random access to its
+ * frames without copying them: the FRAME markers are indexed once, and the
+ * planes of a frame are views into the mapping (valid while the Y4MFile is) */
+class Y4MFile
+{
+public:
+  Y4MFile(const std::string & y4m_path);
+
+  unsigned int width() const { return width_; }
+  unsigned int height() const { return height_; }
+  std::tuple<int, int> frame_rate() const
+  {
+    return { frame_rate_numerator_, frame_rate_denominator_ };
+  }
+  bool interlaced() const { return interlaced_; }
+  bool top_field_first() const { return top_field_first_; }
+
+  size_t num_frames() const { return frame_offsets_.size(); }
+
+  /* throws if there is no frame i */
+  Y4MFrame frame(const size_t i) const;
+
+private:
+  std::string path_;
+  unsigned int width_ {0};
+  unsigned int height_ {0};
+  int frame_rate_numerator_ {0};
+  int frame_rate_denominator_ {0};
+  bool interlaced_ {false};
+  bool top_field_first_ {false};
+
+  std::shared_ptr<void> data_ {};
+  size_t size_ {0};
+
+  /* offset of the Y plane of each frame */
+  std::vector<size_t> frame_offsets_ {};
+};
+
+/* writes an 8-bit 4:2:0 Y4M stream, e.g., to a file or a pipe; the header
+ * and the planes of a frame are gathered with writev rather than copied
+ * into a buffer first */
+class Y4MWriter
+{
+public:
+  Y4MWriter(FileDescriptor && fd, const unsigned int width,
+            const unsigned int height, const std::tuple<int, int> frame_rate,
+            const bool interlaced = false);
+
+  /* throws if the planes are not the size of a frame */
+  void write_frame(const Y4MFrame & frame);
+
+  void close() { fd_.close(); }
+
+private:
+  FileDescriptor fd_;
+  unsigned int width_;
+  unsigned int height_;
+
+  /* written along with the first frame */
+  std::string header_;
+  bool header_written_ {false};
+};
+
 #endif /* Y4M_HH */
@@ -58,6 +58,20 @@ vector<AudioFormat> channel_audio_formats(const YAML::Node & channel_config)
   return { aformats.begin(), aformats.end() };
 }
 
+uint64_t channel_dvr_segment_span(const YAML::Node & channel_config,
+                                  const unsigned int timescale)
+{
+  const unsigned int segment_minutes = channel_config["dvr_segment_minutes"] ?
+      channel_config["dvr_segment_minutes"].as<unsigned int>() : 10;
+
+  /* a segment must have room for all of its chunks (see ChunkPack) */
+  if (segment_minutes == 0 or segment_minutes > 60) {
+    throw runtime_error("dvr_segment_minutes must be between 1 and 60");
+  }
+
+  return uint64_t(segment_minutes) * 60 * timescale;
+}
+
 string postgres_connection_string(const YAML::Node & config)
 {
   string ret;
@@ -77,3 +91,22 @@ string postgres_connection_string(const YAML::Node & config)
 
   return ret;
 }
+
+map<string, unique_ptr<CGroup>> load_cgroups(const YAML::Node & config)
+{
+  map<string, unique_ptr<CGroup>> cgroups;
+
+  for (const auto & cgroup_node : config) {
+    const string & name = cgroup_node.first.as<string>();
+
+    map<string, string> controls;
+    for (const auto & control_node : cgroup_node.second) {
+      controls.emplace(control_node.first.as<string>(),
+                       control_node.second.as<string>());
+    }
+
+    cgroups.emplace(name, make_unique<CGroup>(name, controls));
+  }
+
+  return cgroups;
+}
@@ -1,13 +1,16 @@
 #ifndef YAML_HH
 #define YAML_HH
 
+#include <cstdint>
 #include <string>
 #include <map>
+#include <memory>
 #include <set>
 #include <vector>
 
 #include "yaml-cpp/yaml.h"
 #include "media_formats.hh"
+#include "cgroup.hh"
 
 /* get all channel names */
 std::set<std::string> load_channels(const YAML::Node & config);
@@ -18,7 +21,19 @@ std::vector<VideoFormat> channel_video_formats(const YAML::Node & channel_config
 /* get audio formats of a specific channel's config */
 std::vector<AudioFormat> channel_audio_formats(const YAML::Node & channel_config);
 
+/* the span (in timescale units) of each segment of the DVR archive of a
+ * live channel configured with "dvr_dir", from "dvr_segment_minutes"
+ * (10 by default); the windowcleaners append to the segments and the
+ * media servers read from them */
+uint64_t channel_dvr_segment_span(const YAML::Node & channel_config,
+                                  const unsigned int timescale);
+
 /* get connection string of postgres_connection */
 std::string postgres_connection_string(const YAML::Node & postgres_connection_config);
 
+/* create the cgroups of cgroups_config, which maps the name of each to its
+ * controls, e.g., "encoder: {cpu.weight: 200, io.weight: 200}" */
+std::map<std::string, std::unique_ptr<CGroup>>
+load_cgroups(const YAML::Node & cgroups_config);
+
 #endif /* YAML_HH */
@@ -7,24 +7,21 @@
 #include <utility>
 #include <memory>
 #include <stdexcept>
+#include <optional>
+#include <mutex>
 
 #include "filesystem.hh"
+#include "batch.hh"
+#include "bench.hh"
+#include "fragment_output.hh"
 #include "tokenize.hh"
 #include "exception.hh"
 #include "file_descriptor.hh"
 #include "strict_conversions.hh"
-
-#include "mkvparser/mkvparser.h"
-#include "mkvparser/mkvreader.h"
-#include "mkvmuxer/mkvmuxer.h"
-#include "mkvmuxer/mkvmuxerutil.h"
-#include "mkvmuxer/mkvwriter.h"
+#include "webm_fragmenter.hh"
 
 using namespace std;
 
-const uint32_t global_timescale = 90000;
-const uint32_t webm_default_timescale = 1000;
-
 void print_usage(const string & program_name)
 {
   cerr <<
@@ -33,228 +30,39 @@ void print_usage(const string & program_name)
   "Options:\n"
   "--init-segment, -i     output initial segment\n"
   "--media-segment, -m    output media segment in the format of <num>.chk,\n"
-  "                       where <num> denotes the segment number\n"
+  "                       where <num> denotes the segment number\n\n"
+  "Usage: " << program_name << " --batch -i <init_path> [-p <span>]"
+  " [-j <threads>]\n\n"
+  "Fragment the inputs given on stdin, a line of\n"
+  "\"<input_segment> <media_segment>\" each, as video_fragmenter and\n"
+  "audio_fragmenter do (the init segment replaces <init_path> only if\n"
+  "changed), and reply a line of \"<input_segment> <exit status>\" on\n"
+  "stdout for each (see batch.hh)\n\n"
+  "Options:\n"
+  "--batch, -b            run in batch mode\n"
+  "--pack, -p <span>      append the media segments to their segments of\n"
+  "                       <span> (see video_fragmenter -p)\n"
+  "--threads, -j          fragment on <threads> threads (default: 1)\n\n"
+  "Usage: " << program_name << " --bench <dir> [-n <rounds>]\n\n"
+  "Fragment the chunks (<timestamp>.webm) in <dir> over and over in process\n"
+  "and report chunks/s, MB/s, read/write syscalls per chunk and peak RSS\n"
+  "(see bench.hh)\n\n"
+  "Options:\n"
+  "--bench, -B <dir>      run in benchmark mode on the chunks in <dir>\n"
+  "--rounds, -n <rounds>  fragment each chunk <rounds> times (default: 10)"
   << endl;
 }
 
-void create_init_segment(mkvmuxer::MkvWriter * writer,
-                         mkvparser::MkvReader * reader,
-                         const unique_ptr<mkvparser::Segment> & parser_segment)
-{
-  /* get Segment Info element */
-  auto parser_info = parser_segment->GetInfo();
-  if (not parser_info) {
-    throw runtime_error("Segment::GetInfo() failed");
-  }
-
-  /* get Tracks element */
-  auto parser_tracks = parser_segment->GetTracks();
-  if (not parser_tracks) {
-    throw runtime_error("Segment::GetTracks() failed");
-  }
-
-  /* create muxer for Segment */
-  auto muxer_segment = make_unique<mkvmuxer::Segment>();
-  if (not muxer_segment->Init(writer)) {
-    throw runtime_error("failed to initialize muxer segment");
-  }
-
-  /* write Segment header */
-  if (mkvmuxer::WriteID(writer, libwebm::kMkvSegment)) {
-    throw runtime_error("WriteID failed while writing Segment header");
-  }
-
-  if (mkvmuxer::SerializeInt(writer, mkvmuxer::kEbmlUnknownValue, 8)) {
-    throw runtime_error("SerializeInt failed while writing Segment header");
-  }
-
-  /* write Segment Info with no duration in particular */
-  auto muxer_info = muxer_segment->GetSegmentInfo();
-  muxer_info->set_timecode_scale(parser_info->GetTimeCodeScale());
-  muxer_info->Write(writer);
-
-  /* simply copy Tracks element */
-  long long tracks_start = parser_tracks->m_element_start;
-  long tracks_size = narrow_cast<long>(parser_tracks->m_element_size);
-  auto tracks_buffer = make_unique<unsigned char[]>(tracks_size);
-
-  if (reader->Read(tracks_start, tracks_size, tracks_buffer.get())) {
-    throw runtime_error("failed to read (copy) Tracks element");
-  }
-
-  if (writer->Write(tracks_buffer.get(), tracks_size)) {
-    throw runtime_error("failed to write (forward) Tracks element");
-  }
-
-  /* get and copy Tags element if exists */
-  auto parser_tags = parser_segment->GetTags();
-
-  if (parser_tags) {
-    auto muxer_tags = make_unique<mkvmuxer::Tags>();
-
-    for (int i = 0; i < parser_tags->GetTagCount(); ++i) {
-      auto parser_tag = parser_tags->GetTag(i);
-
-      for (int j = 0; j < parser_tag->GetSimpleTagCount(); ++j) {
-        auto parser_simple_tag = parser_tag->GetSimpleTag(j);
-        auto tag_name = parser_simple_tag->GetTagName();
-        auto tag_string = parser_simple_tag->GetTagString();
-
-        auto muxer_tag = muxer_tags->AddTag();
-        muxer_tag->add_simple_tag(tag_name, tag_string);
-      }
-    }
-
-    muxer_tags->Write(writer);
-  }
-}
-
 uint64_t get_timestamp(const string & filepath)
 {
   return narrow_cast<uint64_t>(stoll(fs::path(filepath).stem()));
 }
 
-void create_media_segment(
-    mkvmuxer::MkvWriter * writer,
-    mkvparser::MkvReader * reader,
-    const unique_ptr<mkvparser::Segment> & parser_segment,
-    const string & input_webm)
+string read_file(const string & path)
 {
-  if (parser_segment->GetCount() != 1) {
-    throw runtime_error("input WebM should contain a single Cluster element");
-  }
-
-  /* copy Cluster except BlockGroup
-   * (TODO: what if BlockGroup also contains audio data) */
-  auto cluster = parser_segment->GetFirst();
-  if (not cluster) {
-    throw runtime_error("no Cluster element is found");
-  }
-
-  const mkvparser::BlockEntry * block_entry;
-  if (cluster->GetFirst(block_entry)) {
-    throw runtime_error("failed to get the first block of cluster");
-  }
-
-  /* get the last SimpleBlock */
-  const mkvparser::BlockEntry * last_simple_block_entry = nullptr;
-
-  while (block_entry and not block_entry->EOS()) {
-    if (block_entry->GetKind() == mkvparser::BlockEntry::kBlockSimple) {
-      last_simple_block_entry = block_entry;
-    }
-
-    if (cluster->GetNext(block_entry, block_entry)) {
-      throw runtime_error("failed to get the next block of cluster");
-    }
-  }
-
-  if (last_simple_block_entry == nullptr) {
-    throw runtime_error("no SimpleBlock exists");
-  }
-
-  /* get the absolute timecode by converting the filename/timestamp
-   * (in global timescale) into WebM's default timescale (1000) */
-  uint64_t global_timestamp = get_timestamp(input_webm);
-  double sec = static_cast<double>(global_timestamp) / global_timescale;
-  long long abs_timecode = narrow_round<uint64_t>(sec * webm_default_timescale);
-
-  /* calculate sizes */
-  auto last_block = last_simple_block_entry->GetBlock();
-  long long last_block_end = last_block->m_start + last_block->m_size;
-  long long first_block_start = cluster->GetFirstBlockPos();
-  long long copy_size = last_block_end - first_block_start;
-
-  long long timecode_size = mkvmuxer::EbmlElementSize(
-      libwebm::kMkvTimecode, abs_timecode);
-  long long payload_size = copy_size + timecode_size;
-
-  /* manually write Cluster header with the correct payload size */
-  if (mkvmuxer::WriteID(writer, libwebm::kMkvCluster)) {
-    throw runtime_error("WriteID failed while writing Cluster header");
-  }
-
-  if (mkvmuxer::WriteUInt(writer, payload_size)) {
-    throw runtime_error("SerializeInt failed while writing Cluster header");
-  }
-
-  if (not mkvmuxer::WriteEbmlElement(
-          writer, libwebm::kMkvTimecode, abs_timecode)) {
-    throw runtime_error("failed to write Timecode");
-  }
-
-  /* copy all SimpleBlocks */
-  auto cluster_buffer = make_unique<unsigned char[]>(copy_size);
-
-  if (reader->Read(first_block_start, copy_size, cluster_buffer.get())) {
-    throw runtime_error("failed to read (copy) Cluster element");
-  }
-
-  if (writer->Write(cluster_buffer.get(), copy_size)) {
-    throw runtime_error("failed to write (forward) Cluster element");
-  }
-}
-
-void fragment(const string & input_webm,
-              const string & init_segment,
-              const string & media_segment)
-{
-  mkvparser::MkvReader reader;
-  if (reader.Open(input_webm.c_str())) {
-    throw runtime_error("error while opening " + input_webm);
-  }
-
-  mkvmuxer::MkvWriter init_writer;
-  if (init_segment.size()) {
-    if (not init_writer.Open(init_segment.c_str())) {
-      throw runtime_error("error while opening " + init_segment);
-    }
-  }
-
-  mkvmuxer::MkvWriter media_writer;
-  if (media_segment.size()) {
-    if (not media_writer.Open(media_segment.c_str())) {
-      throw runtime_error("error while opening " + media_segment);
-    }
-  }
-
-  long long pos = 0;
-
-  /* parse EBML header */
-  mkvparser::EBMLHeader ebml_header;
-  long long ret = ebml_header.Parse(&reader, pos);
-  if (ret) {
-    throw runtime_error("EBMLHeader::Parse() failed");
-  }
-
-  /* write EBML header in init segment */
-  if (init_segment.size()) {
-    mkvmuxer::WriteEbmlHeader(&init_writer, ebml_header.m_docTypeVersion,
-                              ebml_header.m_docType);
-  }
-
-  /* parse Segment element */
-  mkvparser::Segment * parser_segment_raw;
-  ret = mkvparser::Segment::CreateInstance(&reader, pos, parser_segment_raw);
-  if (ret) {
-    throw runtime_error("Segment::CreateInstance() failed");
-  }
-
-  std::unique_ptr<mkvparser::Segment> parser_segment(parser_segment_raw);
-  ret = parser_segment->Load();
-  if (ret < 0) {
-    throw runtime_error("Segment::Load() failed");
-  }
-
-  /* write the rest of init segment */
-  if (init_segment.size()) {
-    create_init_segment(&init_writer, &reader, parser_segment);
-  }
-
-  /* write media segment */
-  if (media_segment.size()) {
-    create_media_segment(&media_writer, &reader, parser_segment, input_webm);
-  }
+  FileDescriptor fd(CheckSystemCall("open (" + path + ")",
+                    open(path.c_str(), O_RDONLY)));
+  return fd.read_exactly(fd.filesize());
 }
 
 int main(int argc, char * argv[])
@@ -264,15 +72,25 @@ int main(int argc, char * argv[])
   }
 
   string init_segment, media_segment;
+  bool batch = false;
+  uint64_t pack_span = 0;
+  size_t num_threads = 1;
+  string bench_dir;
+  unsigned int rounds = 10;
 
   const option cmd_line_opts[] = {
     {"init-segment",  required_argument, nullptr, 'i'},
     {"media-segment", required_argument, nullptr, 'm'},
+    {"batch",         no_argument,       nullptr, 'b'},
+    {"pack",          required_argument, nullptr, 'p'},
+    {"threads",       required_argument, nullptr, 'j'},
+    {"bench",         required_argument, nullptr, 'B'},
+    {"rounds",        required_argument, nullptr, 'n'},
     { nullptr,        0,                 nullptr,  0 }
   };
 
   while (true) {
-    const int opt = getopt_long(argc, argv, "i:m:t:", cmd_line_opts, nullptr);
+    const int opt = getopt_long(argc, argv, "i:m:bp:j:B:n:", cmd_line_opts, nullptr);
     if (opt == -1) {
       break;
     }
@@ -284,12 +102,91 @@ int main(int argc, char * argv[])
     case 'm':
       media_segment = optarg;
       break;
+    case 'b':
+      batch = true;
+      break;
+    case 'p':
+      pack_span = stoull(optarg);
+      break;
+    case 'j':
+      num_threads = stoul(optarg);
+      break;
+    case 'B':
+      bench_dir = optarg;
+      break;
+    case 'n':
+      rounds = stoul(optarg);
+      break;
     default:
       print_usage(argv[0]);
       return EXIT_FAILURE;
     }
   }
 
+  /* a process fragments all the inputs, saving a process per input */
+  if (batch) {
+    if (init_segment.empty() or optind != argc) {
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+
+    /* the elements of the last input that the init segment was made of, so
+     * that the init segment is not made again from the same ones */
+    mutex init_key_mutex;
+    string init_key;
+
+    return run_batch(
+      [&init_segment, pack_span, &init_key_mutex, &init_key](
+          const string & input_path, const string & output_path) {
+        const string tmp_init = tmp_init_path(output_path, init_segment);
+        const string data = read_file(input_path);
+        const auto layout = scan_layout(data);
+
+        bool make_init = true;
+        if (layout) {
+          lock_guard<mutex> lock(init_key_mutex);
+          make_init = layout->init_key != init_key
+                      or not fs::exists(init_segment);
+        }
+
+        try {
+          fragment_webm(data, get_timestamp(input_path), layout,
+                        make_init ? tmp_init : "", output_path);
+        } catch (const exception &) {
+          fs::remove(tmp_init);
+          throw;
+        }
+
+        finish_fragment(output_path, init_segment, pack_span);
+
+        if (layout and make_init) {
+          lock_guard<mutex> lock(init_key_mutex);
+          init_key = layout->init_key;
+        }
+      }, num_threads);
+  }
+
+  /* fragment the chunks of a test vector in process, as batch mode would
+   * (making the init segment of each, as batch mode does when it changes) */
+  if (not bench_dir.empty()) {
+    if (optind != argc) {
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+
+    return run_bench(bench_dir,
+      [](const string & path) {
+        return fs::path(path).extension() == ".webm" and is_timestamped(path);
+      }, rounds,
+      [](const string & input_path, const string & output_dir) {
+        const string data = read_file(input_path);
+        const string stem = fs::path(input_path).stem();
+        fragment_webm(data, get_timestamp(input_path), scan_layout(data),
+                      fs::path(output_dir) / "init.webm",
+                      fs::path(output_dir) / (stem + ".chk"));
+      });
+  }
+
   if (optind != argc - 1) {
     print_usage(argv[0]);
     return EXIT_FAILURE;
@@ -302,7 +199,9 @@ int main(int argc, char * argv[])
     return EXIT_FAILURE;
   }
 
-  fragment(input_segment, init_segment, media_segment);
+  const string data = read_file(input_segment);
+  fragment_webm(data, get_timestamp(input_segment), scan_layout(data),
+                init_segment, media_segment);
 
   return EXIT_SUCCESS;
 }
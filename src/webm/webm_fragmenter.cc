@@ -0,0 +1,451 @@
+#include "webm_fragmenter.hh"
+
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+
+#include "strict_conversions.hh"
+
+#include "mkvparser/mkvparser.h"
+#include "mkvmuxer/mkvmuxer.h"
+#include "mkvmuxer/mkvmuxerutil.h"
+#include "mkvmuxer/mkvwriter.h"
+
+using namespace std;
+
+static const uint32_t global_timescale = 90000;
+static const uint32_t webm_default_timescale = 1000;
+
+namespace {
+  /* a WebM in memory, for mkvparser to parse */
+  class StringReader : public mkvparser::IMkvReader
+  {
+  public:
+    StringReader(const string & data) : data_(data) {}
+
+    int Read(long long pos, long len, unsigned char * buf) override
+    {
+      if (pos < 0 or len < 0 or size_t(pos) + size_t(len) > data_.size()) {
+        return -1;
+      }
+
+      memcpy(buf, data_.data() + pos, len);
+      return 0;
+    }
+
+    int Length(long long * total, long long * available) override
+    {
+      if (total) {
+        *total = data_.size();
+      }
+      if (available) {
+        *available = data_.size();
+      }
+      return 0;
+    }
+
+    virtual ~StringReader() {}
+
+  private:
+    const string & data_;
+  };
+}
+
+static void create_init_segment(mkvmuxer::MkvWriter * writer,
+                                mkvparser::IMkvReader * reader,
+                                const unique_ptr<mkvparser::Segment> & parser_segment)
+{
+  /* get Segment Info element */
+  auto parser_info = parser_segment->GetInfo();
+  if (not parser_info) {
+    throw runtime_error("Segment::GetInfo() failed");
+  }
+
+  /* get Tracks element */
+  auto parser_tracks = parser_segment->GetTracks();
+  if (not parser_tracks) {
+    throw runtime_error("Segment::GetTracks() failed");
+  }
+
+  /* create muxer for Segment */
+  auto muxer_segment = make_unique<mkvmuxer::Segment>();
+  if (not muxer_segment->Init(writer)) {
+    throw runtime_error("failed to initialize muxer segment");
+  }
+
+  /* write Segment header */
+  if (mkvmuxer::WriteID(writer, libwebm::kMkvSegment)) {
+    throw runtime_error("WriteID failed while writing Segment header");
+  }
+
+  if (mkvmuxer::SerializeInt(writer, mkvmuxer::kEbmlUnknownValue, 8)) {
+    throw runtime_error("SerializeInt failed while writing Segment header");
+  }
+
+  /* write Segment Info with no duration in particular */
+  auto muxer_info = muxer_segment->GetSegmentInfo();
+  muxer_info->set_timecode_scale(parser_info->GetTimeCodeScale());
+  muxer_info->Write(writer);
+
+  /* simply copy Tracks element */
+  long long tracks_start = parser_tracks->m_element_start;
+  long tracks_size = narrow_cast<long>(parser_tracks->m_element_size);
+  auto tracks_buffer = make_unique<unsigned char[]>(tracks_size);
+
+  if (reader->Read(tracks_start, tracks_size, tracks_buffer.get())) {
+    throw runtime_error("failed to read (copy) Tracks element");
+  }
+
+  if (writer->Write(tracks_buffer.get(), tracks_size)) {
+    throw runtime_error("failed to write (forward) Tracks element");
+  }
+
+  /* get and copy Tags element if exists */
+  auto parser_tags = parser_segment->GetTags();
+
+  if (parser_tags) {
+    auto muxer_tags = make_unique<mkvmuxer::Tags>();
+
+    for (int i = 0; i < parser_tags->GetTagCount(); ++i) {
+      auto parser_tag = parser_tags->GetTag(i);
+
+      for (int j = 0; j < parser_tag->GetSimpleTagCount(); ++j) {
+        auto parser_simple_tag = parser_tag->GetSimpleTag(j);
+        auto tag_name = parser_simple_tag->GetTagName();
+        auto tag_string = parser_simple_tag->GetTagString();
+
+        auto muxer_tag = muxer_tags->AddTag();
+        muxer_tag->add_simple_tag(tag_name, tag_string);
+      }
+    }
+
+    muxer_tags->Write(writer);
+  }
+}
+
+/* the absolute timecode of a Cluster, by converting its timestamp (in
+ * global timescale) into WebM's default timescale (1000) */
+static long long cluster_timecode(const uint64_t timestamp)
+{
+  double sec = static_cast<double>(timestamp) / global_timescale;
+  return narrow_round<uint64_t>(sec * webm_default_timescale);
+}
+
+static void create_media_segment(
+    mkvmuxer::MkvWriter * writer,
+    mkvparser::IMkvReader * reader,
+    const unique_ptr<mkvparser::Segment> & parser_segment,
+    const uint64_t timestamp)
+{
+  if (parser_segment->GetCount() != 1) {
+    throw runtime_error("input WebM should contain a single Cluster element");
+  }
+
+  /* copy Cluster except BlockGroup
+   * (TODO: what if BlockGroup also contains audio data) */
+  auto cluster = parser_segment->GetFirst();
+  if (not cluster) {
+    throw runtime_error("no Cluster element is found");
+  }
+
+  const mkvparser::BlockEntry * block_entry;
+  if (cluster->GetFirst(block_entry)) {
+    throw runtime_error("failed to get the first block of cluster");
+  }
+
+  /* get the last SimpleBlock */
+  const mkvparser::BlockEntry * last_simple_block_entry = nullptr;
+
+  while (block_entry and not block_entry->EOS()) {
+    if (block_entry->GetKind() == mkvparser::BlockEntry::kBlockSimple) {
+      last_simple_block_entry = block_entry;
+    }
+
+    if (cluster->GetNext(block_entry, block_entry)) {
+      throw runtime_error("failed to get the next block of cluster");
+    }
+  }
+
+  if (last_simple_block_entry == nullptr) {
+    throw runtime_error("no SimpleBlock exists");
+  }
+
+  long long abs_timecode = cluster_timecode(timestamp);
+
+  /* calculate sizes */
+  auto last_block = last_simple_block_entry->GetBlock();
+  long long last_block_end = last_block->m_start + last_block->m_size;
+  long long first_block_start = cluster->GetFirstBlockPos();
+  long long copy_size = last_block_end - first_block_start;
+
+  long long timecode_size = mkvmuxer::EbmlElementSize(
+      libwebm::kMkvTimecode, abs_timecode);
+  long long payload_size = copy_size + timecode_size;
+
+  /* manually write Cluster header with the correct payload size */
+  if (mkvmuxer::WriteID(writer, libwebm::kMkvCluster)) {
+    throw runtime_error("WriteID failed while writing Cluster header");
+  }
+
+  if (mkvmuxer::WriteUInt(writer, payload_size)) {
+    throw runtime_error("SerializeInt failed while writing Cluster header");
+  }
+
+  if (not mkvmuxer::WriteEbmlElement(
+          writer, libwebm::kMkvTimecode, abs_timecode)) {
+    throw runtime_error("failed to write Timecode");
+  }
+
+  /* copy all SimpleBlocks */
+  auto cluster_buffer = make_unique<unsigned char[]>(copy_size);
+
+  if (reader->Read(first_block_start, copy_size, cluster_buffer.get())) {
+    throw runtime_error("failed to read (copy) Cluster element");
+  }
+
+  if (writer->Write(cluster_buffer.get(), copy_size)) {
+    throw runtime_error("failed to write (forward) Cluster element");
+  }
+}
+
+/* an EBML element ID (with its length marker) or data size (without); a data
+ * size of all ones means unknown */
+static uint64_t read_vint(const string & data, size_t & pos,
+                          const bool keep_marker, bool * unknown = nullptr)
+{
+  if (pos >= data.size()) {
+    throw runtime_error("EBML element is truncated");
+  }
+
+  const uint8_t first = data[pos];
+  size_t length = 1;
+  while (length <= 8 and not (first & (0x80 >> (length - 1)))) {
+    length++;
+  }
+
+  if (length > 8 or pos + length > data.size()) {
+    throw runtime_error("invalid EBML variable-length integer");
+  }
+
+  const uint8_t marker = 0x80 >> (length - 1);
+  uint64_t value = keep_marker ? first : (first & (marker - 1));
+  bool all_ones = (value == uint64_t(marker - 1));
+
+  for (size_t i = 1; i < length; i++) {
+    const uint8_t byte = data[pos + i];
+    value = (value << 8) | byte;
+    all_ones = all_ones and byte == 0xFF;
+  }
+
+  if (unknown) {
+    *unknown = all_ones;
+  }
+
+  pos += length;
+  return value;
+}
+
+optional<WebmLayout> scan_layout(const string & data)
+{
+  WebmLayout layout;
+
+  /* an element at pos, returning the start and end of its payload */
+  auto element = [&data](size_t & pos, uint64_t & id, size_t & end,
+                         bool & unknown_size) {
+    id = read_vint(data, pos, true);
+    const uint64_t size = read_vint(data, pos, false, &unknown_size);
+    end = unknown_size ? data.size() : pos + size;
+    if (end > data.size()) {
+      throw runtime_error("EBML element is truncated");
+    }
+  };
+
+  size_t pos = 0;
+  uint64_t id;
+  size_t end;
+  bool unknown_size;
+
+  /* the EBML header is part of the init segment */
+  element(pos, id, end, unknown_size);
+  if (id != libwebm::kMkvEBML or unknown_size) {
+    return nullopt;
+  }
+  layout.init_key.append(data, 0, end);
+  pos = end;
+
+  element(pos, id, end, unknown_size);
+  if (id != libwebm::kMkvSegment) {
+    return nullopt;
+  }
+  const size_t segment_end = end;
+
+  bool found_cluster = false;
+  while (pos < segment_end) {
+    const size_t elem_start = pos;
+    element(pos, id, end, unknown_size);
+
+    if (id == libwebm::kMkvCluster) {
+      if (found_cluster or unknown_size) {
+        return nullopt;
+      }
+      found_cluster = true;
+
+      /* a Timecode, then only SimpleBlocks */
+      size_t child_end;
+      element(pos, id, child_end, unknown_size);
+      if (id != libwebm::kMkvTimecode) {
+        return nullopt;
+      }
+      pos = child_end;
+
+      layout.blocks_start = pos;
+      while (pos < end) {
+        element(pos, id, child_end, unknown_size);
+        if (id != libwebm::kMkvSimpleBlock or unknown_size) {
+          return nullopt;
+        }
+        pos = child_end;
+      }
+      layout.blocks_end = end;
+
+      if (layout.blocks_start == layout.blocks_end) {
+        return nullopt;
+      }
+    } else if (unknown_size) {
+      return nullopt;
+    } else if (id == libwebm::kMkvTracks or id == libwebm::kMkvTags) {
+      layout.init_key.append(data, elem_start, end - elem_start);
+    } else if (id == libwebm::kMkvInfo) {
+      /* only the TimecodeScale of Info goes into the init segment */
+      size_t child = pos;
+      while (child < end) {
+        const size_t child_start = child;
+        size_t child_end;
+        element(child, id, child_end, unknown_size);
+        if (id == libwebm::kMkvTimecodeScale) {
+          layout.init_key.append(data, child_start, child_end - child_start);
+        }
+        child = child_end;
+      }
+    }
+
+    pos = end;
+  }
+
+  if (not found_cluster) {
+    return nullopt;
+  }
+
+  return layout;
+}
+
+/* the media segment of create_media_segment(), written from the layout:
+ * the SimpleBlocks are copied as is after a new Cluster header, and only the
+ * Timecode of the Cluster is rewritten */
+static void create_media_segment_fast(const string & data,
+                                      const WebmLayout & layout,
+                                      const uint64_t timestamp,
+                                      const string & media_segment)
+{
+  mkvmuxer::MkvWriter writer;
+  if (not writer.Open(media_segment.c_str())) {
+    throw runtime_error("error while opening " + media_segment);
+  }
+
+  const long long abs_timecode = cluster_timecode(timestamp);
+
+  const long long copy_size = layout.blocks_end - layout.blocks_start;
+  const long long timecode_size = mkvmuxer::EbmlElementSize(
+      libwebm::kMkvTimecode, abs_timecode);
+
+  if (mkvmuxer::WriteID(&writer, libwebm::kMkvCluster)) {
+    throw runtime_error("WriteID failed while writing Cluster header");
+  }
+
+  if (mkvmuxer::WriteUInt(&writer, copy_size + timecode_size)) {
+    throw runtime_error("SerializeInt failed while writing Cluster header");
+  }
+
+  if (not mkvmuxer::WriteEbmlElement(
+          &writer, libwebm::kMkvTimecode, abs_timecode)) {
+    throw runtime_error("failed to write Timecode");
+  }
+
+  if (writer.Write(data.data() + layout.blocks_start, copy_size)) {
+    throw runtime_error("failed to write (forward) Cluster element");
+  }
+}
+
+static void fragment_generic(const string & data, const uint64_t timestamp,
+                             const string & init_segment,
+                             const string & media_segment)
+{
+  StringReader reader(data);
+
+  mkvmuxer::MkvWriter init_writer;
+  if (init_segment.size()) {
+    if (not init_writer.Open(init_segment.c_str())) {
+      throw runtime_error("error while opening " + init_segment);
+    }
+  }
+
+  mkvmuxer::MkvWriter media_writer;
+  if (media_segment.size()) {
+    if (not media_writer.Open(media_segment.c_str())) {
+      throw runtime_error("error while opening " + media_segment);
+    }
+  }
+
+  long long pos = 0;
+
+  /* parse EBML header */
+  mkvparser::EBMLHeader ebml_header;
+  long long ret = ebml_header.Parse(&reader, pos);
+  if (ret) {
+    throw runtime_error("EBMLHeader::Parse() failed");
+  }
+
+  /* write EBML header in init segment */
+  if (init_segment.size()) {
+    mkvmuxer::WriteEbmlHeader(&init_writer, ebml_header.m_docTypeVersion,
+                              ebml_header.m_docType);
+  }
+
+  /* parse Segment element */
+  mkvparser::Segment * parser_segment_raw;
+  ret = mkvparser::Segment::CreateInstance(&reader, pos, parser_segment_raw);
+  if (ret) {
+    throw runtime_error("Segment::CreateInstance() failed");
+  }
+
+  std::unique_ptr<mkvparser::Segment> parser_segment(parser_segment_raw);
+  ret = parser_segment->Load();
+  if (ret < 0) {
+    throw runtime_error("Segment::Load() failed");
+  }
+
+  /* write the rest of init segment */
+  if (init_segment.size()) {
+    create_init_segment(&init_writer, &reader, parser_segment);
+  }
+
+  /* write media segment */
+  if (media_segment.size()) {
+    create_media_segment(&media_writer, &reader, parser_segment, timestamp);
+  }
+}
+
+void fragment_webm(const string & data, const uint64_t timestamp,
+                   const optional<WebmLayout> & layout,
+                   const string & init_segment, const string & media_segment)
+{
+  if (layout and media_segment.size()) {
+    create_media_segment_fast(data, *layout, timestamp, media_segment);
+
+    if (init_segment.size()) {
+      fragment_generic(data, timestamp, init_segment, "");
+    }
+  } else {
+    fragment_generic(data, timestamp, init_segment, media_segment);
+  }
+}
@@ -0,0 +1,35 @@
+#ifndef WEBM_FRAGMENTER_HH
+#define WEBM_FRAGMENTER_HH
+
+#include <cstdint>
+#include <optional>
+#include <string>
+
+/* Fragments a WebM (e.g., an Opus chunk) into an init segment and a media
+ * segment of a single Cluster, whose Timecode is set from the timestamp of
+ * the chunk (in 90 kHz). Used by webm_fragment, and by opus-encoder to write
+ * the fragments of the chunk it has just encoded directly. */
+
+/* the layout of a WebM as our Opus encoder writes it, found by scanning its
+ * EBML elements rather than parsing it with mkvparser */
+struct WebmLayout
+{
+  std::string init_key {};  /* the elements that the init segment is made of */
+  size_t blocks_start {0};  /* the SimpleBlocks of the single Cluster */
+  size_t blocks_end {0};
+};
+
+/* the layout of data, or nothing if it is not the single Cluster of
+ * SimpleBlocks (after a Timecode) with known sizes that the fast path
+ * expects, in which case the input is fragmented with libwebm instead */
+std::optional<WebmLayout> scan_layout(const std::string & data);
+
+/* write the init segment and the media segment of data (either skipped if
+ * its path is empty), with the fast path if the layout of data is known, and
+ * with libwebm otherwise, which the init segment always takes */
+void fragment_webm(const std::string & data, const uint64_t timestamp,
+                   const std::optional<WebmLayout> & layout,
+                   const std::string & init_segment,
+                   const std::string & media_segment);
+
+#endif /* WEBM_FRAGMENTER_HH */
@@ -167,15 +167,21 @@ uint32_t WebmInfo::get_bitrate(const uint32_t timescale,
   if (duration == 0) {
     throw runtime_error("Duration cannot be zero");
   }
-  double total_size = 0;
+  double total_size = get_total_block_size();
+  double raw_bitrate = total_size / duration * timescale * 8;
+  uint32_t bitrate = static_cast<uint32_t>(raw_bitrate);
+  return (bitrate / 100) * 100;
+}
+
+uint64_t WebmInfo::get_total_block_size()
+{
+  uint64_t total_size = 0;
   auto elems = parser_.find_all(ElementTagID::SimpleBlock);
   for (const auto & elem : elems) {
     /* ignore the header size, which is much smaller than the actual size */
     total_size += elem->size();
   }
-  double raw_bitrate = total_size / duration * timescale * 8;
-  uint32_t bitrate = static_cast<uint32_t>(raw_bitrate);
-  return (bitrate / 100) * 100;
+  return total_size;
 }
 
 uint32_t WebmInfo::get_duration(uint32_t timescale)
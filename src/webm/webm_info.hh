@@ -194,6 +194,8 @@ public:
                                               get_duration()); }
   uint32_t get_bitrate(uint32_t timescale, uint32_t duration);
   uint32_t get_sample_rate();
+  /* total size of the SimpleBlocks, i.e., of the samples */
+  uint64_t get_total_block_size();
 
 private:
   WebmParser parser_;
@@ -1,8 +1,11 @@
+#include <getopt.h>
 #include <cstring>
 #include <iostream>
 #include <memory>
 #include <map>
 
+#include "filesystem.hh"
+#include "bench.hh"
 #include "webm_info.hh"
 #include "strict_conversions.hh"
 
@@ -32,7 +35,33 @@ static map<uint32_t, pair<string, char>> print_map = {
 void print_usage(const string & name)
 {
   cerr << "Usage: " + name + " <filename>" << endl
-       << "<filename>       webm file that contains an audio track" << endl;
+       << "<filename>       webm file that contains an audio track" << endl
+       << endl
+       << "Usage: " + name + " --bench <dir> [-n <rounds>]" << endl
+       << endl
+       << "Parse the WebM files (.webm and .chk) in <dir> over and over in"
+       << endl
+       << "process, probing each with WebmInfo as the MPD writer does, and"
+       << endl
+       << "report chunks/s, MB/s, read/write syscalls per chunk and peak RSS"
+       << endl
+       << "(see bench.hh)" << endl
+       << endl
+       << "Options:" << endl
+       << "--bench, -B <dir>      run in benchmark mode on the files in <dir>"
+       << endl
+       << "--rounds, -n <rounds>  parse each file <rounds> times (default: 10)"
+       << endl;
+}
+
+/* what probe_media_info() of the MPD writer reads from a WebM file */
+void probe(const string & path)
+{
+  WebmInfo info(path);
+  const uint32_t timescale = info.get_timescale();
+  info.get_duration(timescale);
+  info.get_total_block_size();
+  info.get_sample_rate();
 }
 
 void print(shared_ptr<WebmElement> element, uint32_t indent = 0)
@@ -87,11 +116,53 @@ void print(shared_ptr<WebmElement> element, uint32_t indent = 0)
 
 int main(int argc, char * argv[])
 {
-  if (argc != 2) {
+  string bench_dir;
+  unsigned int rounds = 10;
+
+  const option cmd_line_opts[] = {
+    {"bench",  required_argument, nullptr, 'B'},
+    {"rounds", required_argument, nullptr, 'n'},
+    { nullptr, 0,                 nullptr,  0 }
+  };
+
+  while (true) {
+    const int opt = getopt_long(argc, argv, "B:n:", cmd_line_opts, nullptr);
+    if (opt == -1) {
+      break;
+    }
+
+    switch (opt) {
+    case 'B':
+      bench_dir = optarg;
+      break;
+    case 'n':
+      rounds = stoul(optarg);
+      break;
+    default:
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (not bench_dir.empty()) {
+    if (optind != argc) {
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+
+    return run_bench(bench_dir,
+      [](const string & path) {
+        const auto ext = fs::path(path).extension();
+        return ext == ".webm" or ext == ".chk";
+      }, rounds,
+      [](const string & input_path, const string &) { probe(input_path); });
+  }
+
+  if (optind != argc - 1) {
     print_usage(argv[0]);
     return EXIT_FAILURE;
   }
-  auto p = make_unique<WebmParser>(string(argv[1]));
+  auto p = make_unique<WebmParser>(string(argv[optind]));
   for (const auto & elem : p->get_all()) {
     print(elem);
   }
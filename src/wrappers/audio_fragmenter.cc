@@ -5,6 +5,7 @@
 
 #include "child_process.hh"
 #include "filesystem.hh"
+#include "fragment_output.hh"
 #include "path.hh"  /* readlink */
 
 using namespace std;
@@ -17,7 +18,11 @@ void print_usage(const string & program)
   "<input_path>     path of the input encoded audio\n"
   "<output_path>    path to output the fragmented audio\n\n"
   "Options:\n"
-  "-i <init_path>    output an init segment to <init_path> if not exists"
+  "-i <init_path>    output an init segment to <init_path> if changed\n"
+  "-p <span>         append the fragment to the segment <ts>.pack in the\n"
+  "                  directory of <init_path>, where <ts> is the multiple of\n"
+  "                  <span> at or before the timestamp of <output_path>,\n"
+  "                  and leave <output_path> empty"
   << endl;
 }
 
@@ -29,14 +34,16 @@ int main(int argc, char * argv[])
   }
 
   string init_path;
+  uint64_t pack_span = 0;
 
   const option cmd_line_opts[] = {
     {"init",   required_argument, nullptr, 'i'},
+    {"pack",   required_argument, nullptr, 'p'},
     { nullptr, 0,                 nullptr,  0 }
   };
 
   while (true) {
-    const int opt = getopt_long(argc, argv, "i:", cmd_line_opts, nullptr);
+    const int opt = getopt_long(argc, argv, "i:p:", cmd_line_opts, nullptr);
     if (opt == -1) {
       break;
     }
@@ -45,6 +52,9 @@ int main(int argc, char * argv[])
     case 'i':
       init_path = optarg;
       break;
+    case 'p':
+      pack_span = stoull(optarg);
+      break;
     default:
       print_usage(argv[0]);
       return EXIT_FAILURE;
@@ -59,30 +69,23 @@ int main(int argc, char * argv[])
   string input_path = argv[optind];
   string output_path = argv[optind + 1];
 
-  string tmp_init_name = fs::path(output_path).stem().string() + "-init.webm";
-  string tmp_init_path = fs::path(output_path).parent_path() / tmp_init_name;
+  string tmp_init = tmp_init_path(output_path, init_path);
 
   /* path of the webm_fragment program */
   auto exe_dir = fs::path(roost::readlink("/proc/self/exe")).parent_path();
   string webm_fragment = fs::canonical(exe_dir / "../webm/webm_fragment");
 
   /* fragment audio */
-  vector<string> args = { webm_fragment, input_path, "-m", output_path };
-
-  /* output a temp init segment if the dest init segment does not exist */
-  bool output_tmp_init = false;
-  if (not fs::exists(init_path)) {
-    args.emplace_back("-i");
-    args.emplace_back(tmp_init_path);
-    output_tmp_init = true;
-  }
+  vector<string> args = { webm_fragment, input_path, "-m", output_path,
+                          "-i", tmp_init };
 
   ProcessManager proc_manager;
   int ret_code = proc_manager.run(webm_fragment, args);
 
-  /* move the init segment from temporary path to target path */
-  if (output_tmp_init) {
-    fs::rename(tmp_init_path, init_path);
+  if (ret_code == EXIT_SUCCESS) {
+    finish_fragment(output_path, init_path, pack_span);
+  } else {
+    fs::remove(tmp_init);
   }
 
   return ret_code;
@@ -0,0 +1,229 @@
+#include "deinterlacer.hh"
+
+#include <algorithm>
+#include <cstdlib>
+#include <stdexcept>
+#include <thread>
+
+using namespace std;
+
+namespace {
+  /* the lines around a line being interpolated */
+  struct Lines
+  {
+    const uint8_t * cur_up, * cur_down;    /* of the field kept */
+    const uint8_t * prev_up, * prev_down;  /* same in the previous frame */
+    const uint8_t * next_up, * next_down;  /* same in the next frame */
+
+    /* the line itself, and the lines two above and below, in the frames
+     * around the interpolated field in time */
+    const uint8_t * prev2, * next2;
+    const uint8_t * prev2_up2, * next2_up2;
+    const uint8_t * prev2_down2, * next2_down2;
+  };
+}
+
+/* interpolate the pixels [begin, end) of a line; EDGE skips the search for
+ * the direction of an edge, which reads three pixels to each side, and
+ * CHECK_FIELDS clamps to the lines two above and below as well */
+template<bool EDGE, bool CHECK_FIELDS>
+static void filter_pixels(const Lines & l, uint8_t * __restrict dst,
+                          const unsigned int begin, const unsigned int end)
+{
+  /* copied, so that they are not reloaded after each store to dst */
+  const uint8_t * const cur_up = l.cur_up, * const cur_down = l.cur_down;
+  const uint8_t * const prev_up = l.prev_up, * const prev_down = l.prev_down;
+  const uint8_t * const next_up = l.next_up, * const next_down = l.next_down;
+  const uint8_t * const prev2 = l.prev2, * const next2 = l.next2;
+  const uint8_t * const prev2_up2 = l.prev2_up2, * const next2_up2 = l.next2_up2;
+  const uint8_t * const prev2_down2 = l.prev2_down2;
+  const uint8_t * const next2_down2 = l.next2_down2;
+
+  for (unsigned int x = begin; x < end; x++) {
+    const int c = cur_up[x];
+    const int e = cur_down[x];
+    const int d = (prev2[x] + next2[x]) >> 1;
+
+    const int temporal_diff0 = abs(prev2[x] - next2[x]);
+    const int temporal_diff1 =
+      (abs(prev_up[x] - c) + abs(prev_down[x] - e)) >> 1;
+    const int temporal_diff2 =
+      (abs(next_up[x] - c) + abs(next_down[x] - e)) >> 1;
+    int diff = max(max(temporal_diff0 >> 1, temporal_diff1), temporal_diff2);
+
+    int spatial_pred = (c + e) >> 1;
+
+    if (not EDGE) {
+      /* the score of the direction j (the line through x + j above and
+       * x - j below) */
+      const auto score = [cur_up, cur_down, x](const int j) {
+        return abs(cur_up[x - 1 + j] - cur_down[x - 1 - j])
+               + abs(cur_up[x + j] - cur_down[x - j])
+               + abs(cur_up[x + 1 + j] - cur_down[x + 1 - j]);
+      };
+
+      const auto pred = [cur_up, cur_down, x](const int j) {
+        return (cur_up[x + j] + cur_down[x - j]) >> 1;
+      };
+
+      int spatial_score = score(0) - 1;
+
+      /* a direction further out is only tried if the nearer one is better
+       * (as in yadif); everything is computed and selected, with no
+       * branches, to vectorize */
+      const int score_m1 = score(-1), pred_m1 = pred(-1);
+      const int score_m2 = score(-2), pred_m2 = pred(-2);
+      const int score_p1 = score(1), pred_p1 = pred(1);
+      const int score_p2 = score(2), pred_p2 = pred(2);
+
+      const bool m1 = score_m1 < spatial_score;
+      spatial_score = m1 ? score_m1 : spatial_score;
+      spatial_pred = m1 ? pred_m1 : spatial_pred;
+
+      const bool m2 = m1 & (score_m2 < spatial_score);
+      spatial_score = m2 ? score_m2 : spatial_score;
+      spatial_pred = m2 ? pred_m2 : spatial_pred;
+
+      const bool p1 = score_p1 < spatial_score;
+      spatial_score = p1 ? score_p1 : spatial_score;
+      spatial_pred = p1 ? pred_p1 : spatial_pred;
+
+      const bool p2 = p1 & (score_p2 < spatial_score);
+      spatial_pred = p2 ? pred_p2 : spatial_pred;
+    }
+
+    if (CHECK_FIELDS) {
+      const int b = (prev2_up2[x] + next2_up2[x]) >> 1;
+      const int f = (prev2_down2[x] + next2_down2[x]) >> 1;
+      const int max_diff = max(max(d - e, d - c), min(b - c, f - e));
+      const int min_diff = min(min(d - e, d - c), max(b - c, f - e));
+
+      diff = max(max(diff, min_diff), -max_diff);
+    }
+
+    dst[x] = clamp(spatial_pred, d - diff, d + diff);
+  }
+}
+
+Deinterlacer::Deinterlacer(const unsigned int width, const unsigned int height,
+                           const bool top_field_first,
+                           const unsigned int num_threads)
+  : width_(width), height_(height), top_field_first_(top_field_first),
+    num_threads_(max(num_threads, 1u)),
+    frame_(size_t(width) * height
+           + 2 * size_t((width + 1) / 2) * ((height + 1) / 2))
+{
+  if (height < 4) {
+    throw runtime_error("Deinterlacer: frames must have at least 4 lines");
+  }
+}
+
+void Deinterlacer::filter_lines(const Plane & plane, const unsigned int begin,
+                                const unsigned int end)
+{
+  const size_t w = plane.width;
+  const unsigned int h = plane.height;
+
+  /* the field of the first half of a frame is interpolated from the
+   * previous frame and the frame itself, and the second from the frame
+   * and the next */
+  const uint8_t * prev2 = plane.second_field ? plane.cur : plane.prev;
+  const uint8_t * next2 = plane.second_field ? plane.next : plane.cur;
+
+  for (unsigned int y = begin; y < end; y++) {
+    uint8_t * dst = plane.dst + y * w;
+
+    if ((y & 1) != plane.parity) {
+      /* a line of the field kept */
+      copy_n(plane.cur + y * w, w, dst);
+      continue;
+    }
+
+    /* mirrored at the top and bottom of the plane (and kept within it) */
+    const auto line = [h, w](const int i) {
+      return size_t(clamp(i, 0, int(h) - 1)) * w;
+    };
+
+    const int i = y;
+    const size_t up = line(y == 0 ? i + 1 : i - 1);
+    const size_t down = line(y + 1 == h ? i - 1 : i + 1);
+    const size_t up2 = line(y == 0 ? i + 2 : i - 2);
+    const size_t down2 = line(y + 1 == h ? i - 2 : i + 2);
+
+    const Lines lines {
+      plane.cur + up, plane.cur + down,
+      plane.prev + up, plane.prev + down,
+      plane.next + up, plane.next + down,
+      prev2 + y * w, next2 + y * w,
+      prev2 + up2, next2 + up2,
+      prev2 + down2, next2 + down2 };
+
+    /* the lines next to the top or bottom line do not have the lines two
+     * above or below */
+    const bool check_fields = not (y == 1 or y + 2 == h);
+
+    /* the direction search reads up to three pixels to each side */
+    const unsigned int border = min<unsigned int>(3, w);
+    const unsigned int inner_end = max<unsigned int>(border, w - border);
+
+    if (check_fields) {
+      filter_pixels<true, true>(lines, dst, 0, border);
+      filter_pixels<false, true>(lines, dst, border, inner_end);
+      filter_pixels<true, true>(lines, dst, inner_end, w);
+    } else {
+      filter_pixels<true, false>(lines, dst, 0, border);
+      filter_pixels<false, false>(lines, dst, border, inner_end);
+      filter_pixels<true, false>(lines, dst, inner_end, w);
+    }
+  }
+}
+
+Y4MFrame Deinterlacer::field_frame(const Y4MFrame & prev, const Y4MFrame & cur,
+                                   const Y4MFrame & next,
+                                   const bool second_field)
+{
+  /* the lines of the other field than the one shown in this frame */
+  const unsigned int parity = (top_field_first_ ? 1 : 0) ^ second_field;
+
+  const size_t luma_size = size_t(width_) * height_;
+  const size_t chroma_size = (frame_.size() - luma_size) / 2;
+  const unsigned int chroma_width = (width_ + 1) / 2;
+  const unsigned int chroma_height = (height_ + 1) / 2;
+
+  const auto bytes = [](const string_view plane) {
+    return reinterpret_cast<const uint8_t *>(plane.data());
+  };
+
+  const Plane planes[3] {
+    { bytes(prev.Y), bytes(cur.Y), bytes(next.Y), frame_.data(),
+      width_, height_, parity, second_field },
+    { bytes(prev.Cb), bytes(cur.Cb), bytes(next.Cb), frame_.data() + luma_size,
+      chroma_width, chroma_height, parity, second_field },
+    { bytes(prev.Cr), bytes(cur.Cr), bytes(next.Cr),
+      frame_.data() + luma_size + chroma_size,
+      chroma_width, chroma_height, parity, second_field } };
+
+  if (num_threads_ == 1) {
+    for (const auto & plane : planes) {
+      filter_lines(plane, 0, plane.height);
+    }
+  } else {
+    /* each thread takes a band of the lines of every plane */
+    vector<thread> threads;
+    for (unsigned int i = 0; i < num_threads_; i++) {
+      threads.emplace_back([&planes, i, n = num_threads_]() {
+        for (const auto & plane : planes) {
+          filter_lines(plane, plane.height * i / n, plane.height * (i + 1) / n);
+        }
+      });
+    }
+
+    for (auto & t : threads) {
+      t.join();
+    }
+  }
+
+  const char * data = reinterpret_cast<const char *>(frame_.data());
+  return { {data, luma_size}, {data + luma_size, chroma_size},
+           {data + luma_size + chroma_size, chroma_size} };
+}
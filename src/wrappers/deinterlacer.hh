@@ -0,0 +1,50 @@
+#ifndef DEINTERLACER_HH
+#define DEINTERLACER_HH
+
+#include <cstdint>
+#include <vector>
+
+#include "y4m.hh"
+
+/* Deinterlaces 8-bit 4:2:0 frames as FFmpeg's yadif (in mode send_field):
+ * each field becomes a frame, doubling the frame rate. The lines of the
+ * other field are interpolated from the lines above and below, along the
+ * direction that matches best, and clamped to how much the pixel changes
+ * between the neighboring frames. The loops over a line have no branches,
+ * so that the compiler vectorizes them; the lines of a frame can also be
+ * split among threads. */
+class Deinterlacer
+{
+public:
+  Deinterlacer(const unsigned int width, const unsigned int height,
+               const bool top_field_first, const unsigned int num_threads = 1);
+
+  /* the frame of the first (or second) field of cur, whose neighbors are
+   * prev and next (cur itself at either end of a video); valid until the
+   * next call */
+  Y4MFrame field_frame(const Y4MFrame & prev, const Y4MFrame & cur,
+                       const Y4MFrame & next, const bool second_field);
+
+private:
+  unsigned int width_, height_;
+  bool top_field_first_;
+  unsigned int num_threads_;
+
+  std::vector<uint8_t> frame_;
+
+  /* a plane of the output; parity is that of the lines interpolated */
+  struct Plane
+  {
+    const uint8_t * prev, * cur, * next;
+    uint8_t * dst;
+    unsigned int width, height;
+    unsigned int parity;
+    bool second_field;
+  };
+
+  /* the lines [begin, end) of plane */
+  static void filter_lines(const Plane & plane, const unsigned int begin,
+                           const unsigned int end);
+};
+
+#endif /* DEINTERLACER_HH */
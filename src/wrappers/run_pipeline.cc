@@ -3,7 +3,12 @@
 #include <vector>
 #include <tuple>
 #include <set>
+#include <map>
+#include <memory>
+#include <optional>
+#include <algorithm>
 #include <getopt.h>
+#include <sched.h>
 
 #include "filesystem.hh"
 #include "path.hh"
@@ -11,6 +16,9 @@
 #include "media_formats.hh"
 #include "tokenize.hh"
 #include "yaml.hh"
+#include "job_scheduler.hh"
+#include "pid.hh"
+#include "exception.hh"
 
 using namespace std;
 
@@ -23,6 +31,39 @@ static string notifier;
 
 static bool no_decoder = false;
 
+/* the channels of a multiplex (channel config "multiplex") share a decoder,
+ * which demuxes the multiplex once and decodes each channel as a program */
+struct Multiplex
+{
+  vector<string> options {};   /* of the decoder, e.g., its input */
+  vector<string> programs {};  /* the --program of each channel */
+};
+
+static map<string, Multiplex> multiplexes;
+
+/* the notifier options that bound the jobs of each stage of a channel
+ * (channel config "max_jobs" and "max_queued") */
+static vector<string> scheduler_args;
+
+/* the options of a notifier to run its jobs when granted by the job
+ * scheduler shared by all the channels (config "job_scheduler_workers"),
+ * which are followed by the rank of its stage */
+static string job_scheduler_socket;
+static vector<string> job_scheduler_args;
+
+/* the cgroups (config "cgroups") of the stages named in run_stage(), whose
+ * children compete for the CPUs and disks by the weights of their cgroups
+ * rather than by their numbers */
+static map<string, unique_ptr<CGroup>> cgroups;
+
+/* the ranks of the stages, in the order they process a chunk */
+enum Stage : unsigned int
+{
+  CANONICALIZER_STAGE = 0,
+  ENCODER_STAGE = 1,
+  FRAGMENTER_STAGE = 2,  /* also of the SSIM calculator */
+};
+
 void print_usage(const string & program_name)
 {
   cerr <<
@@ -30,9 +71,51 @@ void print_usage(const string & program_name)
   << endl;
 }
 
+/* run the program of a stage, e.g., its notifier, in the cgroup of the stage
+ * if there is one */
+void run_stage(ProcessManager & proc_manager, const string & stage,
+               const string & program, const vector<string> & args,
+               const string & log_path = "")
+{
+  const auto it = cgroups.find(stage);
+  proc_manager.run_as_child(program, args, {}, {}, log_path, nullopt,
+                            it == cgroups.end() ? "" : it->second->path());
+}
+
+/* the counters of a stage, which its notifier keeps for file_reporter */
+string stats_path(const fs::path & output_path, const string & stage)
+{
+  const fs::path stats_dir = output_path / "stats";
+  fs::create_directories(stats_dir);
+
+  return stats_dir / (stage + ".stats");
+}
+
+/* add scheduler_args and job_scheduler_args to the options of the notifier
+ * of a stage, i.e., before --exec */
+void add_scheduler_args(vector<string> & args, const Stage stage)
+{
+  vector<string> options = scheduler_args;
+  if (not job_scheduler_args.empty()) {
+    options.insert(options.end(),
+                   job_scheduler_args.begin(), job_scheduler_args.end());
+    options.emplace_back(to_string(stage));
+  }
+
+  const auto exec = find(args.begin(), args.end(), "--exec");
+  args.insert(exec, options.begin(), options.end());
+}
+
+/* the extension of the canonical video: a lossless FFV1 mezzanine or Y4M */
+string canonical_ext(const bool mezzanine)
+{
+  return mezzanine ? ".mkv" : ".y4m";
+}
+
 void run_video_canonicalizer(ProcessManager & proc_manager,
                              const fs::path & output_path,
-                             vector<tuple<string, string>> & vwork)
+                             vector<tuple<string, string>> & vwork,
+                             const bool mezzanine)
 {
   /* prepare directories */
   string src_dir = output_path / "working/video-raw";
@@ -43,185 +126,493 @@ void run_video_canonicalizer(ProcessManager & proc_manager,
     fs::create_directories(dir);
   }
 
-  vwork.emplace_back(dst_dir, ".y4m");
+  vwork.emplace_back(dst_dir, canonical_ext(mezzanine));
 
   /* notifier runs video_canonicalizer */
   string video_canonicalizer = src_path / "wrappers/video_canonicalizer";
 
   vector<string> args {
-    notifier, src_dir, ".y4m", "--check", dst_dir, ".y4m", "--tmp", tmp_dir,
+    notifier, src_dir, ".y4m", "--check", dst_dir, canonical_ext(mezzanine),
+    "--tmp", tmp_dir,
+    "--stats", stats_path(output_path, "video-canonicalizer"),
     "--exec", video_canonicalizer };
-  proc_manager.run_as_child(notifier, args);
+
+  if (mezzanine) {
+    args.emplace_back("--mezzanine");
+  }
+
+  add_scheduler_args(args, CANONICALIZER_STAGE);
+  run_stage(proc_manager, "video_canonicalizer", notifier, args);
+}
+
+/* the encoder of vf (see video_encoder --encoder): that of its format in
+ * video_encoder_formats, or video_encoder, or x264 */
+string video_encoder_of(const YAML::Node & channel_config,
+                        const VideoFormat & vf)
+{
+  string encoder = "x264";
+  if (channel_config["video_encoder_formats"] and
+      channel_config["video_encoder_formats"][vf.to_string()]) {
+    encoder = channel_config["video_encoder_formats"][vf.to_string()]
+              .as<string>();
+  } else if (channel_config["video_encoder"]) {
+    encoder = channel_config["video_encoder"].as<string>();
+  }
+
+  if (encoder != "x264" and encoder != "nvenc" and encoder != "qsv") {
+    throw runtime_error("invalid video encoder " + encoder + " of "
+                        + vf.to_string() + " (x264, nvenc or qsv)");
+  }
+
+  return encoder;
 }
 
+/* run a video encoder for the formats in vfs, with the encoders given for
+ * each: the first is the output that the notifier checks, and the others
+ * are encoded along with it from a single decode of the canonical video */
 void run_video_encoder(ProcessManager & proc_manager,
                        const fs::path & output_path,
                        vector<tuple<string, string>> & vwork,
-                       const VideoFormat & vf)
+                       const vector<VideoFormat> & vfs,
+                       const vector<string> & encoders,
+                       const bool mezzanine,
+                       const vector<string> & extra_args = {})
 {
-  /* prepare directories */
-  string base = vf.to_string() + "-" + "mp4";
   string src_dir = output_path / "working/video-canonical";
-  string dst_dir = output_path / "working" / base;
-  string tmp_dir = output_path / "tmp" / base;
+  vector<string> renditions;
 
-  for (const auto & dir : {src_dir, dst_dir, tmp_dir}) {
-    fs::create_directories(dir);
+  /* prepare directories */
+  for (const auto & vf : vfs) {
+    string base = vf.to_string() + "-" + "mp4";
+    string dst_dir = output_path / "working" / base;
+    string tmp_dir = output_path / "tmp" / base;
+
+    for (const auto & dir : {src_dir, dst_dir, tmp_dir}) {
+      fs::create_directories(dir);
+    }
+
+    vwork.emplace_back(dst_dir, ".mp4");
+
+    if (&vf != &vfs.front()) {
+      renditions.emplace_back(vf.resolution() + ":" + to_string(vf.crf) + ":"
+                              + dst_dir + ":" + tmp_dir + ":"
+                              + encoders.at(&vf - &vfs.front()));
+    }
   }
 
-  vwork.emplace_back(dst_dir, ".mp4");
+  const VideoFormat & vf = vfs.front();
+  string base = vf.to_string() + "-" + "mp4";
+  string dst_dir = output_path / "working" / base;
+  string tmp_dir = output_path / "tmp" / base;
 
   /* notifier runs video_encoder */
   string video_encoder = src_path / "wrappers/video_encoder";
 
   vector<string> args {
-    notifier, src_dir, ".y4m", "--check", dst_dir, ".mp4", "--tmp", tmp_dir,
-    "--exec", video_encoder, "-s", vf.resolution(), "--crf", to_string(vf.crf)
+    notifier, src_dir, canonical_ext(mezzanine), "--check", dst_dir, ".mp4",
+    "--tmp", tmp_dir,
+    "--stats", stats_path(output_path, vf.to_string() + "-encoder"),
+    "--exec", video_encoder, "-s", vf.resolution(), "--crf", to_string(vf.crf),
+    "--encoder", encoders.at(0)
   };
-  proc_manager.run_as_child(notifier, args);
+
+  for (const auto & rendition : renditions) {
+    args.insert(args.end(), {"--rendition", rendition});
+  }
+
+  args.insert(args.end(), extra_args.begin(), extra_args.end());
+  add_scheduler_args(args, ENCODER_STAGE);
+  run_stage(proc_manager, "video_encoder", notifier, args);
+}
+
+/* prepare the directories of the SSIMs of vf for its encoder to write them,
+ * in place of an SSIM calculator, and return the options of the encoder */
+vector<string> encoder_ssim_args(const fs::path & output_path,
+                                 vector<tuple<string, string>> & vready,
+                                 const VideoFormat & vf, const size_t vf_idx,
+                                 const bool ssim_log)
+{
+  string ready_base = vf.to_string() + "-" + "ssim";
+  string dst_dir = output_path / "ready" / ready_base;
+  string tmp_dir = output_path / "tmp" / ready_base;
+
+  for (const auto & dir : {dst_dir, tmp_dir}) {
+    fs::create_directories(dir);
+  }
+
+  vready.emplace_back(dst_dir, ".ssim");
+
+  vector<string> args { "--ssim", dst_dir + ":" + tmp_dir };
+  if (ssim_log) {
+    args.insert(args.end(), {
+      "--log", output_path / "ready" / "ssim.log",
+      "--format-index", to_string(vf_idx) });
+  }
+
+  return args;
 }
 
 void run_video_fragmenter(ProcessManager & proc_manager,
                           const fs::path & output_path,
+                          vector<tuple<string, string>> & vwork,
                           vector<tuple<string, string>> & vready,
-                          const VideoFormat & vf)
+                          vector<tuple<string, string>> & vmarks,
+                          const VideoFormat & vf,
+                          const uint64_t pack_span,
+                          const bool batch,
+                          const unsigned int cmaf_chunks)
 {
   /* prepare directories */
   string working_base = vf.to_string() + "-" + "mp4";
   string ready_base = vf.to_string();
   string src_dir = output_path / "working" / working_base;
-  string dst_dir = output_path / "ready" / ready_base;
+  string ready_dir = output_path / "ready" / ready_base;
   string tmp_dir = output_path / "tmp" / ready_base;
 
-  for (const auto & dir : {src_dir, dst_dir, tmp_dir}) {
+  /* with segments, the fragments are appended to ready/<vf>/<ts>.pack and
+   * only marked as such by an empty file in working/ for depcleaner */
+  string dst_dir = pack_span > 0 ?
+      string(output_path / "working" / (vf.to_string() + "-m4s")) : ready_dir;
+
+  for (const auto & dir : {src_dir, ready_dir, dst_dir, tmp_dir}) {
     fs::create_directories(dir);
   }
 
-  vready.emplace_back(dst_dir, ".m4s");
+  if (pack_span > 0) {
+    vwork.emplace_back(dst_dir, ".m4s");
+    vmarks.emplace_back(dst_dir, ".m4s");
+    vready.emplace_back(ready_dir, ".pack");
+  } else {
+    vready.emplace_back(dst_dir, ".m4s");
+  }
 
-  /* notifier runs video_fragmenter */
-  string video_fragmenter = src_path / "wrappers/video_fragmenter";
-  string dst_init_path = fs::path(dst_dir) / "init.mp4";
+  /* notifier runs video_fragmenter, or with batch, a single mp4_fragment
+   * that fragments all the chunks rather than two processes per chunk */
+  string dst_init_path = fs::path(ready_dir) / "init.mp4";
 
   vector<string> args {
     notifier, src_dir, ".mp4", "--check", dst_dir, ".m4s", "--tmp", tmp_dir,
-    "--exec", video_fragmenter, "-i", dst_init_path };
-  proc_manager.run_as_child(notifier, args);
+    "--stats", stats_path(output_path, vf.to_string() + "-fragmenter") };
+
+  if (batch) {
+    args.insert(args.end(), {
+      "--batch", "--exec", src_path / "mp4/mp4_fragment", "--batch",
+      "-i", dst_init_path });
+  } else {
+    args.insert(args.end(), {
+      "--exec", src_path / "wrappers/video_fragmenter", "-i", dst_init_path });
+  }
+
+  if (pack_span > 0) {
+    args.insert(args.end(), { "-p", to_string(pack_span) });
+  }
+
+  if (cmaf_chunks > 1) {
+    args.insert(args.end(), { "-c", to_string(cmaf_chunks) });
+  }
+
+  add_scheduler_args(args, FRAGMENTER_STAGE);
+  run_stage(proc_manager, "video_fragmenter", notifier, args);
 }
 
+/* run an SSIM calculator for the formats in vfs, the first of which has
+ * index vf_idx in the channel config: the notifier checks the output of the
+ * first, and the others are calculated along with it from a single read of
+ * the canonical video (which needs a shared encoder, so that all the
+ * renditions of a chunk are there when the first is) */
 void run_ssim_calculator(ProcessManager & proc_manager,
                          const fs::path & output_path,
                          vector<tuple<string, string>> & vready,
-                         const VideoFormat & vf)
+                         const vector<VideoFormat> & vfs, const size_t vf_idx,
+                         const bool ssim_log, const bool mezzanine,
+                         const vector<string> & extra_args = {})
 {
+  string canonical_dir = output_path / "working/video-canonical";
+  vector<string> renditions;
+
   /* prepare directories */
+  for (size_t i = 0; i < vfs.size(); i++) {
+    string working_base = vfs[i].to_string() + "-" + "mp4";
+    string ready_base = vfs[i].to_string() + "-" + "ssim";
+    string src_dir = output_path / "working" / working_base;
+    string dst_dir = output_path / "ready" / ready_base;
+    string tmp_dir = output_path / "tmp" / ready_base;
+
+    for (const auto & dir : {src_dir, dst_dir, tmp_dir, canonical_dir}) {
+      fs::create_directories(dir);
+    }
+
+    vready.emplace_back(dst_dir, ".ssim");
+
+    if (i > 0) {
+      renditions.emplace_back(src_dir + ":" + dst_dir + ":" + tmp_dir + ":"
+                              + to_string(vf_idx + i));
+    }
+  }
+
+  const VideoFormat & vf = vfs.front();
   string working_base = vf.to_string() + "-" + "mp4";
   string ready_base = vf.to_string() + "-" + "ssim";
   string src_dir = output_path / "working" / working_base;
   string dst_dir = output_path / "ready" / ready_base;
   string tmp_dir = output_path / "tmp" / ready_base;
-  string canonical_dir = output_path / "working/video-canonical";
-
-  for (const auto & dir : {src_dir, dst_dir, tmp_dir, canonical_dir}) {
-    fs::create_directories(dir);
-  }
-
-  vready.emplace_back(dst_dir, ".ssim");
 
   /* notifier runs ssim_calculator */
   string ssim_calculator = src_path / "wrappers/ssim_calculator";
 
   vector<string> args {
     notifier, src_dir, ".mp4", "--check", dst_dir, ".ssim", "--tmp", tmp_dir,
+    "--stats", stats_path(output_path, vf.to_string() + "-ssim"),
     "--exec", ssim_calculator, "--canonical", canonical_dir };
-  proc_manager.run_as_child(notifier, args);
+
+  if (mezzanine) {
+    args.emplace_back("--mezzanine");
+  }
+
+  /* also append the SSIMs to the log that ws_media_server tails */
+  if (ssim_log) {
+    args.insert(args.end(), {
+      "--log", output_path / "ready" / "ssim.log",
+      "--format-index", to_string(vf_idx) });
+  }
+
+  for (const auto & rendition : renditions) {
+    args.insert(args.end(), {"--rendition", rendition});
+  }
+
+  args.insert(args.end(), extra_args.begin(), extra_args.end());
+  add_scheduler_args(args, FRAGMENTER_STAGE);
+  run_stage(proc_manager, "ssim_calculator", notifier, args);
 }
 
+/* the directories of the fragments of af: the fragments are written to
+ * dst_dir, which is ready_dir unless they are appended to the segments of
+ * pack_span in ready_dir (see run_video_fragmenter()) */
+struct AudioFragmentDirs
+{
+  string ready_dir;
+  string dst_dir;
+  string tmp_dir;
+  string init_path;
+};
+
+AudioFragmentDirs audio_fragment_dirs(const fs::path & output_path,
+                                      vector<tuple<string, string>> & awork,
+                                      vector<tuple<string, string>> & aready,
+                                      vector<tuple<string, string>> & amarks,
+                                      const AudioFormat & af,
+                                      const uint64_t pack_span)
+{
+  string ready_base = af.to_string();
+  string ready_dir = output_path / "ready" / ready_base;
+  string tmp_dir = output_path / "tmp" / ready_base;
+
+  string dst_dir = pack_span > 0 ?
+      string(output_path / "working" / (af.to_string() + "-chk")) : ready_dir;
+
+  for (const auto & dir : {ready_dir, dst_dir, tmp_dir}) {
+    fs::create_directories(dir);
+  }
+
+  if (pack_span > 0) {
+    awork.emplace_back(dst_dir, ".chk");
+    amarks.emplace_back(dst_dir, ".chk");
+    aready.emplace_back(ready_dir, ".pack");
+  } else {
+    aready.emplace_back(dst_dir, ".chk");
+  }
+
+  return {ready_dir, dst_dir, tmp_dir, fs::path(ready_dir) / "init.webm"};
+}
+
+/* with fragments, the encoder writes the fragments of the formats directly,
+ * as audio_fragmenter would (and the WebM of a chunk only into memory); with
+ * batch, a single encoder encodes the chunks one after another, keeping its
+ * Opus state from a chunk to the next */
 void run_audio_encoder(ProcessManager & proc_manager,
                        const fs::path & output_path,
                        vector<tuple<string, string>> & awork,
-                       const AudioFormat & af)
+                       vector<tuple<string, string>> & aready,
+                       vector<tuple<string, string>> & amarks,
+                       const vector<AudioFormat> & afs,
+                       const bool fragments,
+                       const uint64_t pack_span,
+                       const bool batch)
 {
-  /* prepare directories */
-  string base = af.to_string() + "-" + "webm";
   string src_dir = output_path / "working/audio-raw";
-  string dst_dir = output_path / "working" / base;
-  string tmp_dir = output_path / "tmp" / base;
+  fs::create_directories(src_dir);
 
-  for (const auto & dir : {src_dir, dst_dir, tmp_dir}) {
-    fs::create_directories(dir);
+  /* the output and temporary directories of each format, and the init
+   * segment of its fragments */
+  vector<tuple<string, string, string>> dirs;
+
+  /* prepare directories */
+  for (const auto & af : afs) {
+    awork.emplace_back(src_dir, ".wav");
+
+    if (fragments) {
+      const auto frag_dirs = audio_fragment_dirs(output_path, awork, aready,
+                                                 amarks, af, pack_span);
+      dirs.emplace_back(frag_dirs.dst_dir, frag_dirs.tmp_dir,
+                        frag_dirs.init_path);
+      continue;
+    }
+
+    string base = af.to_string() + "-" + "webm";
+    string dst_dir = output_path / "working" / base;
+    string tmp_dir = output_path / "tmp" / base;
+
+    for (const auto & dir : {dst_dir, tmp_dir}) {
+      fs::create_directories(dir);
+    }
+
+    awork.emplace_back(dst_dir, ".webm");
+    dirs.emplace_back(dst_dir, tmp_dir, "");
+  }
+
+  vector<string> renditions;
+  for (size_t i = 1; i < afs.size(); i++) {
+    const auto & [dst_dir, tmp_dir, init_path] = dirs[i];
+    renditions.emplace_back(afs[i].to_string() + ":" + dst_dir + ":" + tmp_dir
+                            + (fragments ? ":" + init_path : ""));
   }
 
-  awork.emplace_back(src_dir, ".wav");
-  awork.emplace_back(dst_dir, ".webm");
+  const AudioFormat & af = afs.front();
+  const auto & [dst_dir, tmp_dir, init_path] = dirs.front();
+  const string ext = fragments ? ".chk" : ".webm";
 
   /* notifier runs audio_encoder */
   string audio_encoder = src_path / "opus-encoder/opus-encoder";
 
   vector<string> args {
-    notifier, src_dir, ".wav", "--check", dst_dir, ".webm", "--tmp", tmp_dir,
-    "--exec", audio_encoder, "-b", af.to_string() };
-  proc_manager.run_as_child(notifier, args);
+    notifier, src_dir, ".wav", "--check", dst_dir, ext, "--tmp", tmp_dir,
+    "--stats", stats_path(output_path, af.to_string() + "-encoder") };
+
+  if (batch) {
+    args.insert(args.end(), {"--batch", "--exec", audio_encoder, "--batch"});
+  } else {
+    args.insert(args.end(), {"--exec", audio_encoder});
+  }
+
+  args.insert(args.end(), {"-b", af.to_string()});
+
+  if (fragments) {
+    args.insert(args.end(), {"-i", init_path});
+
+    if (pack_span > 0) {
+      args.insert(args.end(), {"-p", to_string(pack_span)});
+    }
+  }
+
+  for (const auto & rendition : renditions) {
+    args.insert(args.end(), {"--rendition", rendition});
+  }
+
+  add_scheduler_args(args, ENCODER_STAGE);
+  run_stage(proc_manager, "audio_encoder", notifier, args);
 }
 
 void run_audio_fragmenter(ProcessManager & proc_manager,
                           const fs::path & output_path,
+                          vector<tuple<string, string>> & awork,
                           vector<tuple<string, string>> & aready,
-                          const AudioFormat & af)
+                          vector<tuple<string, string>> & amarks,
+                          const AudioFormat & af,
+                          const uint64_t pack_span,
+                          const bool batch)
 {
   /* prepare directories */
   string working_base = af.to_string() + "-" + "webm";
-  string ready_base = af.to_string();
   string src_dir = output_path / "working" / working_base;
-  string dst_dir = output_path / "ready" / ready_base;
-  string tmp_dir = output_path / "tmp" / ready_base;
+  fs::create_directories(src_dir);
 
-  for (const auto & dir : {src_dir, dst_dir, tmp_dir}) {
-    fs::create_directories(dir);
-  }
+  const auto dirs = audio_fragment_dirs(output_path, awork, aready, amarks,
+                                        af, pack_span);
 
-  aready.emplace_back(dst_dir, ".chk");
+  /* notifier runs audio_fragmenter, or a single webm_fragment with batch */
+  vector<string> args {
+    notifier, src_dir, ".webm", "--check", dirs.dst_dir, ".chk",
+    "--tmp", dirs.tmp_dir,
+    "--stats", stats_path(output_path, af.to_string() + "-fragmenter") };
+
+  if (batch) {
+    args.insert(args.end(), {
+      "--batch", "--exec", src_path / "webm/webm_fragment", "--batch",
+      "-i", dirs.init_path });
+  } else {
+    args.insert(args.end(), {
+      "--exec", src_path / "wrappers/audio_fragmenter", "-i", dirs.init_path });
+  }
 
-  /* notifier runs audio_fragmenter */
-  string audio_fragmenter = src_path / "wrappers/audio_fragmenter";
-  string dst_init_path = fs::path(dst_dir) / "init.webm";
+  if (pack_span > 0) {
+    args.insert(args.end(), { "-p", to_string(pack_span) });
+  }
 
-  vector<string> args {
-    notifier, src_dir, ".webm", "--check", dst_dir, ".chk", "--tmp", tmp_dir,
-    "--exec", audio_fragmenter, "-i", dst_init_path };
-  proc_manager.run_as_child(notifier, args);
+  add_scheduler_args(args, FRAGMENTER_STAGE);
+  run_stage(proc_manager, "audio_fragmenter", notifier, args);
 }
 
 void run_file_sender(ProcessManager & proc_manager,
                      const vector<tuple<string, string>> & ready,
                      const YAML::Node & config)
 {
+  if (ready.empty()) {
+    return;
+  }
+
   string host = config["host"].as<string>();
   uint16_t port = config["port"].as<uint16_t>();
   fs::path dst_media_dir = config["media_dir"].as<string>();
   string file_sender = src_path / "forwarder/file_sender";
 
+  /* a single file_sender transfers any move-in files of all the ready dirs,
+   * e.g., init.mp4 and .m4s in a vready dir, over one connection */
+  vector<string> args { file_sender, "--watch", host, to_string(port) };
+  set<string> dirs;
+
   for (const auto & item : ready) {
     const auto & dir = std::get<0>(item);
 
+    /* a dir with files of more than one extension is listed more than once */
+    if (not dirs.emplace(dir).second) {
+      continue;
+    }
+
     /* remove the prefix of media_dir from dir and append to dst_media_dir */
     string remaining = dir.substr(media_dir.string().size());
     string dst_dir = dst_media_dir / remaining;
 
-    /* file sender is interested in any move-in files
-     * e.g., init.mp4 and .m4s in a vready dir */
-    vector<string> notifier_args { notifier, dir, ".", "--exec",
-      file_sender, host, to_string(port), dst_dir };
-    proc_manager.run_as_child(notifier, notifier_args);
+    args.insert(args.end(), { dir, dst_dir });
   }
+
+  run_stage(proc_manager, "file_sender", file_sender, args);
+}
+
+/* the files in ready that mark a working file as processed; a fragment
+ * appended to a segment is marked by a file in marks instead */
+vector<tuple<string, string>> depend_files(
+  vector<tuple<string, string>> ready,
+  const vector<tuple<string, string>> & marks)
+{
+  ready.erase(remove_if(ready.begin(), ready.end(),
+    [](const tuple<string, string> & item) {
+      return get<1>(item) == ".pack";
+    }), ready.end());
+
+  ready.insert(ready.end(), marks.begin(), marks.end());
+  return ready;
 }
 
 void run_depcleaner(ProcessManager & proc_manager,
                     const vector<tuple<string, string>> & work,
                     const vector<tuple<string, string>> & ready)
 {
+  if (work.empty() or ready.empty()) {
+    return;
+  }
+
   string depcleaner = src_path / "cleaner/depcleaner";
-  vector<string> args = {depcleaner};
+  vector<string> args = {depcleaner, "--watch"};
 
   args.emplace_back("--clean");
   for (const auto & item : work) {
@@ -237,28 +628,37 @@ void run_depcleaner(ProcessManager & proc_manager,
     args.emplace_back(ext);
   }
 
-  /* run notifier to start depcleaner for each directory in ready/ */
-  for (const auto & item : ready) {
-    const auto & [dir, ext] = item;
-    vector<string> notifier_args { notifier, dir, ext, "--exec" };
-    notifier_args.insert(notifier_args.end(), args.begin(), args.end());
-    proc_manager.run_as_child(notifier, notifier_args);
-  }
+  /* a single depcleaner watches all the directories in ready/ */
+  run_stage(proc_manager, "cleaner", depcleaner, args);
 }
 
 void run_windowcleaner(ProcessManager & proc_manager,
                        const vector<tuple<string, string>> & ready,
-                       const unsigned int clean_window_ts)
+                       const uint64_t clean_window_ts,
+                       const uint64_t pack_span,
+                       const vector<string> & archive_args)
 {
+  if (ready.empty()) {
+    return;
+  }
+
   string windowcleaner = src_path / "cleaner/windowcleaner";
+  vector<string> args = {windowcleaner, "--watch"};
+  args.insert(args.end(), archive_args.begin(), archive_args.end());
 
-  /* run notifier to start windowcleaner for each directory in ready/ */
+  /* a single windowcleaner watches all the directories in ready/ */
   for (const auto & item : ready) {
     const auto & [dir, ext] = item;
-    vector<string> notifier_args { notifier, dir, ext, "--exec", windowcleaner,
-                                   ext, to_string(clean_window_ts) };
-    proc_manager.run_as_child(notifier, notifier_args);
+
+    /* a segment is named by its first timestamp but spans pack_span more,
+     * and is cleaned whenever a new segment appears */
+    const uint64_t window_ts = ext == ".pack" ? clean_window_ts + pack_span
+                                              : clean_window_ts;
+
+    args.insert(args.end(), { dir, ext, to_string(window_ts) });
   }
+
+  run_stage(proc_manager, "cleaner", windowcleaner, args);
 }
 
 void run_decoder(ProcessManager & proc_manager,
@@ -279,10 +679,57 @@ void run_decoder(ProcessManager & proc_manager,
   vector<string> decoder_args = split(config["decoder_args"].as<string>(), " ");
   string decoder_log = src_path / "atsc" / (channel_name + "_decoder.log");
 
+  if (config["multiplex"]) {
+    /* tell the options (such as --tcp IP:PORT) from the program arguments */
+    vector<string> options, program_args;
+    for (size_t i = 0; i < decoder_args.size(); i++) {
+      if (decoder_args[i].rfind("--", 0) == 0 and i + 1 < decoder_args.size()) {
+        options.emplace_back(decoder_args[i]);
+        options.emplace_back(decoder_args[++i]);
+      } else if (not decoder_args[i].empty()) {
+        program_args.emplace_back(decoder_args[i]);
+      }
+    }
+
+    string program;
+    for (const auto & arg : program_args) {
+      program += arg + ",";
+    }
+    program += video_raw + "," + audio_raw + "," + tmp_raw;
+
+    const string name = config["multiplex"].as<string>();
+    auto [it, inserted] = multiplexes.emplace(name, Multiplex{options, {}});
+    if (not inserted and it->second.options != options) {
+      throw runtime_error("the channels of multiplex " + name +
+                          " have different decoder options");
+    }
+
+    it->second.programs.emplace_back(program);
+    return;
+  }
+
   vector<string> args { decoder, video_raw, audio_raw, "--tmp", tmp_raw };
   args.insert(args.begin() + 1, decoder_args.begin(), decoder_args.end());
 
-  proc_manager.run_as_child(decoder, args, {}, {}, decoder_log);
+  run_stage(proc_manager, "decoder", decoder, args, decoder_log);
+}
+
+void run_multiplex_decoders(ProcessManager & proc_manager)
+{
+  string decoder = src_path / "atsc/decoder";
+
+  for (const auto & [name, multiplex] : multiplexes) {
+    string decoder_log = src_path / "atsc" / (name + "_decoder.log");
+
+    vector<string> args { decoder };
+    args.insert(args.end(), multiplex.options.begin(), multiplex.options.end());
+    for (const auto & program : multiplex.programs) {
+      args.emplace_back("--program");
+      args.emplace_back(program);
+    }
+
+    run_stage(proc_manager, "decoder", decoder, args, decoder_log);
+  }
 }
 
 void run_pipeline(ProcessManager & proc_manager,
@@ -296,6 +743,7 @@ void run_pipeline(ProcessManager & proc_manager,
   /* tuple<directory, extension> */
   vector<tuple<string, string>> vwork, awork;
   vector<tuple<string, string>> vready, aready;
+  vector<tuple<string, string>> vmarks, amarks;
 
   fs::path output_path = media_dir / channel_name;
   if (fs::exists(output_path)) {
@@ -308,42 +756,263 @@ void run_pipeline(ProcessManager & proc_manager,
   /* create a tmp directory for decoder to output raw media chunks */
   fs::create_directories(output_path / "tmp" / "raw");
 
+  /* append the chunks to a segment per segment_minutes and format rather
+   * than writing a file per chunk */
+  uint64_t pack_span = 0;
+  if (channel_config["segment_minutes"]) {
+    const unsigned int segment_minutes =
+        channel_config["segment_minutes"].as<unsigned int>();
+
+    /* a segment must have room for all of its chunks */
+    if (segment_minutes == 0 or segment_minutes > 60) {
+      throw runtime_error("segment_minutes must be between 1 and 60");
+    }
+
+    pack_span = uint64_t(segment_minutes) * 60 * global_timescale;
+  }
+
+  /* archive the chunks that windowcleaner cleans from ready/ to
+   * <dvr_dir>/<channel>, from which the media servers serve the clients
+   * behind the clean window, for dvr_minutes */
+  vector<string> archive_args;
+  if (channel_config["dvr_dir"]) {
+    if (pack_span > 0) {
+      throw runtime_error("dvr_dir can't be set with segment_minutes");
+    }
+
+    if (config["clean_ready_media"] and
+        not config["clean_ready_media"].as<bool>()) {
+      throw runtime_error("dvr_dir requires clean_ready_media");
+    }
+
+    if (not channel_config["dvr_minutes"]) {
+      throw runtime_error("dvr_dir requires dvr_minutes");
+    }
+
+    const uint64_t dvr_window = uint64_t(
+        channel_config["dvr_minutes"].as<unsigned int>()) * 60
+        * global_timescale;
+
+    archive_args = { "--archive",
+      fs::path(channel_config["dvr_dir"].as<string>()) / channel_name,
+      to_string(channel_dvr_segment_span(channel_config, global_timescale)),
+      to_string(dvr_window) };
+  }
+
+  /* write the canonical video as a lossless mezzanine rather than Y4M */
+  const bool mezzanine = channel_config["lossless_mezzanine"] ?
+      channel_config["lossless_mezzanine"].as<bool>() : false;
+
+  /* fragment the chunks of a format in a long-lived fragmenter rather than
+   * with a process (or two) per chunk, which dominates for audio chunks */
+  const bool batch_fragmenter = channel_config["batch_fragmenter"] ?
+      channel_config["batch_fragmenter"].as<bool>() : false;
+
+  /* split each video chunk into CMAF chunks (moof and mdat pairs), which a
+   * player can append as they arrive rather than a whole chunk at a time */
+  const unsigned int cmaf_chunks = channel_config["cmaf_chunks"] ?
+      channel_config["cmaf_chunks"].as<unsigned int>() : 1;
+  if (cmaf_chunks < 1) {
+    throw runtime_error("cmaf_chunks must be at least 1");
+  }
+
+  /* run at most max_jobs of each stage at once, newest chunks first, and
+   * drop the oldest waiting chunks beyond max_queued to catch up */
+  scheduler_args.clear();
+  if (channel_config["max_jobs"]) {
+    const unsigned int max_jobs = channel_config["max_jobs"].as<unsigned int>();
+    scheduler_args = { "--max-jobs", to_string(max_jobs) };
+
+    if (channel_config["max_queued"]) {
+      scheduler_args.insert(scheduler_args.end(), { "--max-queued",
+          to_string(channel_config["max_queued"].as<size_t>()) });
+    }
+  } else if (channel_config["max_queued"]) {
+    throw runtime_error("max_queued requires max_jobs");
+  }
+
+  job_scheduler_args.clear();
+  if (not job_scheduler_socket.empty()) {
+    job_scheduler_args = { "--scheduler", job_scheduler_socket, channel_name };
+  }
+
   /* run video_canonicalizer */
-  run_video_canonicalizer(proc_manager, output_path, vwork);
+  run_video_canonicalizer(proc_manager, output_path, vwork, mezzanine);
+
+  const bool ssim_log = channel_config["ssim_log"] ?
+                        channel_config["ssim_log"].as<bool>() : false;
+  if (ssim_log and config["remote_media_server"]) {
+    throw runtime_error("ssim_log is not sent to remote_media_server");
+  }
 
+  /* encode all the formats with a single encoder per chunk, which decodes
+   * the canonical video once and scales it down in a cascade */
+  const bool shared_encoder = channel_config["shared_encoder"] ?
+      channel_config["shared_encoder"].as<bool>() : false;
+
+  /* encode a format with x264 (by default) or a hardware encoder, which
+   * frees the CPUs of the host for more channels */
+  vector<string> vencoders;
   for (const auto & vf : vformats) {
+    vencoders.emplace_back(video_encoder_of(channel_config, vf));
+  }
+
+  const bool all_x264 = all_of(vencoders.begin(), vencoders.end(),
+    [](const string & encoder) { return encoder == "x264"; });
+
+  /* raise the CRF of a chunk (of every format, with shared_encoder, by the
+   * headroom of the first) while its SSIM still reaches target_ssim_db */
+  vector<string> target_args;
+  if (channel_config["target_ssim_db"]) {
+    if (not all_x264) {
+      throw runtime_error("target_ssim_db requires the x264 video encoder");
+    }
+
+    target_args = { "--target-ssim-db",
+      to_string(channel_config["target_ssim_db"].as<double>()) };
+  }
+
+  /* approximate the SSIMs of the formats no taller than max_height (or all)
+   * from a sample of the frames and rows (see ssim --frame-step and
+   * --row-step); a calculator of several formats approximates them only if
+   * all of them are */
+  vector<string> approximate_args;
+  optional<int> approximate_max_height;
+  if (const auto approximate = channel_config["approximate_ssim"]) {
+    for (const string key : {"frame_step", "row_step", "verify_every"}) {
+      if (approximate[key]) {
+        string option = "--" + key;
+        replace(option.begin(), option.end(), '_', '-');
+        approximate_args.insert(approximate_args.end(), {
+          option, to_string(approximate[key].as<unsigned int>()) });
+      }
+    }
+
+    if (approximate["max_height"]) {
+      approximate_max_height = approximate["max_height"].as<int>();
+    }
+  }
+
+  auto ssim_args = [&](const vector<VideoFormat> & vfs) {
+    for (const auto & vf : vfs) {
+      if (approximate_max_height and vf.height > *approximate_max_height) {
+        return vector<string> {};
+      }
+    }
+    return approximate_args;
+  };
+
+  if (shared_encoder and not vformats.empty()) {
+    run_video_encoder(proc_manager, output_path, vwork, vformats, vencoders,
+                      mezzanine, target_args);
+    run_ssim_calculator(proc_manager, output_path, vready, vformats, 0,
+                        ssim_log, mezzanine, ssim_args(vformats));
+  }
+
+  /* take the SSIMs that x264 computes against the scaled input as it
+   * encodes, rather than comparing each chunk with the canonical video */
+  const bool encoder_ssim = channel_config["encoder_ssim"] ?
+      channel_config["encoder_ssim"].as<bool>() : false;
+  if (encoder_ssim and shared_encoder) {
+    throw runtime_error("encoder_ssim does not work with shared_encoder");
+  }
+
+  if (encoder_ssim and not all_x264) {
+    throw runtime_error("encoder_ssim requires the x264 video encoder");
+  }
+
+  for (size_t vf_idx = 0; vf_idx < vformats.size(); vf_idx++) {
+    const auto & vf = vformats[vf_idx];
+
     /* run video encoder and video fragmenter */
-    run_video_encoder(proc_manager, output_path, vwork, vf);
-    run_video_fragmenter(proc_manager, output_path, vready, vf);
+    if (encoder_ssim) {
+      vector<string> args =
+        encoder_ssim_args(output_path, vready, vf, vf_idx, ssim_log);
+      args.insert(args.end(), target_args.begin(), target_args.end());
+      run_video_encoder(proc_manager, output_path, vwork, {vf},
+                        {vencoders[vf_idx]}, mezzanine, args);
+    } else if (not shared_encoder) {
+      run_video_encoder(proc_manager, output_path, vwork, {vf},
+                        {vencoders[vf_idx]}, mezzanine, target_args);
+    }
+
+    run_video_fragmenter(proc_manager, output_path, vwork, vready, vmarks, vf,
+                         pack_span, batch_fragmenter, cmaf_chunks);
 
     /* run ssim_calculator */
-    run_ssim_calculator(proc_manager, output_path, vready, vf);
+    if (not shared_encoder and not encoder_ssim) {
+      run_ssim_calculator(proc_manager, output_path, vready, {vf}, vf_idx,
+                          ssim_log, mezzanine, ssim_args({vf}));
+    }
+  }
+
+  /* encode all the formats with a single encoder per chunk, which reads
+   * the WAV once and encodes each bit rate in a thread of its own */
+  const bool shared_audio_encoder = channel_config["shared_audio_encoder"] ?
+      channel_config["shared_audio_encoder"].as<bool>() : false;
+
+  /* the audio encoder writes the fragments directly, a stage earlier and
+   * without the intermediate WebM on disk, rather than audio fragmenters */
+  const bool audio_encoder_fragments =
+      channel_config["audio_encoder_fragments"] ?
+      channel_config["audio_encoder_fragments"].as<bool>() : false;
+
+  /* the audio encoders run in batch, and only encode the overlap of a chunk
+   * with the previous one (to warm up a new Opus encoder) after a gap */
+  const bool batch_audio_encoder = channel_config["batch_audio_encoder"] ?
+      channel_config["batch_audio_encoder"].as<bool>() : false;
+
+  if (shared_audio_encoder and not aformats.empty()) {
+    run_audio_encoder(proc_manager, output_path, awork, aready, amarks,
+                      aformats, audio_encoder_fragments, pack_span,
+                      batch_audio_encoder);
   }
 
   for (const auto & af : aformats) {
     /* run audio encoder and audio fragmenter */
-    run_audio_encoder(proc_manager, output_path, awork, af);
-    run_audio_fragmenter(proc_manager, output_path, aready, af);
+    if (not shared_audio_encoder) {
+      run_audio_encoder(proc_manager, output_path, awork, aready, amarks,
+                        {af}, audio_encoder_fragments, pack_span,
+                        batch_audio_encoder);
+    }
+
+    if (not audio_encoder_fragments) {
+      run_audio_fragmenter(proc_manager, output_path, awork, aready, amarks,
+                           af, pack_span, batch_fragmenter);
+    }
   }
 
   if (config["remote_media_server"]) {
     /* run file_sender to transfer files in ready/ */
-    run_file_sender(proc_manager, vready, config["remote_media_server"]);
-    run_file_sender(proc_manager, aready, config["remote_media_server"]);
+    auto ready = vready;
+    ready.insert(ready.end(), aready.begin(), aready.end());
+
+    /* remote_media_server is a server or a list of them, each sent to by a
+     * file_sender of its own so that a slow server delays no other */
+    const YAML::Node & servers = config["remote_media_server"];
+    if (servers.IsSequence()) {
+      for (const auto & server : servers) {
+        run_file_sender(proc_manager, ready, server);
+      }
+    } else {
+      run_file_sender(proc_manager, ready, servers);
+    }
   }
 
   /* vwork, awork, vready, aready should already be filled in */
 
   /* run depcleaner to clean up files in working/ */
-  run_depcleaner(proc_manager, vwork, vready);
-  run_depcleaner(proc_manager, awork, aready);
+  run_depcleaner(proc_manager, vwork, depend_files(vready, vmarks));
+  run_depcleaner(proc_manager, awork, depend_files(aready, amarks));
 
   if (not config["clean_ready_media"] or
       config["clean_ready_media"].as<bool>()) {
     /* run windowcleaner to clean up files in ready/ */
     unsigned int clean_window_ts = clean_window_s * global_timescale;
-    run_windowcleaner(proc_manager, vready, clean_window_ts);
-    run_windowcleaner(proc_manager, aready, clean_window_ts);
+    run_windowcleaner(proc_manager, vready, clean_window_ts, pack_span,
+                      archive_args);
+    run_windowcleaner(proc_manager, aready, clean_window_ts, pack_span,
+                      archive_args);
   }
 
   /* run decoder */
@@ -352,6 +1021,41 @@ void run_pipeline(ProcessManager & proc_manager,
   }
 }
 
+/* the CPUs of the workers of the job scheduler: "job_scheduler_cpus" lists
+ * them, or "job_scheduler_workers" spreads that many over the CPUs that
+ * run_pipeline may run on */
+vector<int> load_job_scheduler_cpus(const YAML::Node & config)
+{
+  if (config["job_scheduler_cpus"]) {
+    return config["job_scheduler_cpus"].as<vector<int>>();
+  }
+
+  if (not config["job_scheduler_workers"]) {
+    return {};
+  }
+
+  cpu_set_t cpu_set;
+  CheckSystemCall("sched_getaffinity",
+                  sched_getaffinity(0, sizeof(cpu_set), &cpu_set));
+
+  vector<int> allowed_cpus;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &cpu_set)) {
+      allowed_cpus.emplace_back(cpu);
+    }
+  }
+
+  const unsigned int num_workers =
+      config["job_scheduler_workers"].as<unsigned int>();
+
+  vector<int> cpus;
+  for (unsigned int i = 0; i < num_workers; i++) {
+    cpus.emplace_back(allowed_cpus[i % allowed_cpus.size()]);
+  }
+
+  return cpus;
+}
+
 int main(int argc, char * argv[])
 {
   if (argc < 1) {
@@ -396,12 +1100,32 @@ int main(int argc, char * argv[])
 
   ProcessManager proc_manager;
 
+  /* before any child is run, as this process moves to a cgroup of its own */
+  if (config["cgroups"]) {
+    cgroups = load_cgroups(config["cgroups"]);
+  }
+
+  /* schedule the jobs of all the channels on a pool of workers pinned to
+   * CPUs, earliest deadline first, rather than leave the notifiers of every
+   * stage, format and channel to compete for the CPUs */
+  unique_ptr<JobScheduler> job_scheduler;
+  const vector<int> job_scheduler_cpus = load_job_scheduler_cpus(config);
+  if (not job_scheduler_cpus.empty()) {
+    job_scheduler_socket = fs::temp_directory_path() /
+        ("puffer_job_scheduler_" + to_string(pid()));
+    job_scheduler = make_unique<JobScheduler>(
+        proc_manager.poller(), job_scheduler_socket, job_scheduler_cpus);
+  }
+
   set<string> channel_set = load_channels(config);
   for (const auto & channel_name : channel_set) {
     /* run the encoding pipeline for channel_name */
     run_pipeline(proc_manager, channel_name, config);
   }
 
+  /* run a decoder for the channels of each multiplex */
+  run_multiplex_decoders(proc_manager);
+
   /* if logging is enabled */
   if (config["enable_logging"].as<bool>()) {
     fs::path monitoring_dir = src_path / "monitoring";
@@ -409,7 +1133,7 @@ int main(int argc, char * argv[])
     /* report SSIMs, video chunk sizes, backlog sizes and .y4m.info files */
     string file_reporter = monitoring_dir / "file_reporter";
     vector<string> file_reporter_args { file_reporter, yaml_config };
-    proc_manager.run_as_child(file_reporter, file_reporter_args);
+    run_stage(proc_manager, "file_reporter", file_reporter, file_reporter_args);
   }
 
   return proc_manager.wait();
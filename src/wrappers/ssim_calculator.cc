@@ -1,13 +1,17 @@
 #include <getopt.h>
 #include <cmath>
+#include <fstream>
+#include <functional>
 #include <iostream>
 #include <string>
+#include <optional>
 #include <vector>
 
 #include "child_process.hh"
 #include "filesystem.hh"
 #include "path.hh"  /* readlink */
-#include "y4m.hh"
+#include "ssim_log.hh"
+#include "tokenize.hh"
 
 using namespace std;
 
@@ -19,7 +23,22 @@ void print_usage(const string & program)
   "<input_path>     path of the input encoded video\n"
   "<output_path>    path to output the SSIM\n\n"
   "Options:\n"
-  "--canonical <dir>    directory of the canonical video in Y4M"
+  "--canonical <dir>    directory of the canonical video in Y4M\n"
+  "--mezzanine          the canonical video is an FFV1 mezzanine (.mkv)\n"
+  "--log <path>         also append the SSIM to the binary SSIM log <path>\n"
+  "--format-index <i>   index of the video format in the channel config;\n"
+  "                     required by --log\n"
+  "--rendition <src_dir>:<dst_dir>:<tmp_dir>:<i>\n"
+  "                     also calculate the SSIM of the chunk of format <i> in\n"
+  "                     <src_dir>, written to <tmp_dir> and then moved to\n"
+  "                     <dst_dir>; may be repeated. The canonical video is\n"
+  "                     read once for all renditions\n"
+  "--frame-step <n>     approximate the SSIMs from every <n>th frame\n"
+  "--row-step <n>       approximate the SSIM of each frame from every <n>th\n"
+  "                     row of windows\n"
+  "--verify-every <n>   compute the exact SSIMs of about one in <n> chunks\n"
+  "                     (picked by a hash of their timestamps) as well, to\n"
+  "                     report the error of the approximation"
   << endl;
 }
 
@@ -31,14 +50,28 @@ int main(int argc, char * argv[])
   }
 
   string canonical_dir;
+  string log_path;
+  optional<uint32_t> format_idx;
+  bool mezzanine = false;
+  vector<vector<string>> extra_renditions;
+  vector<string> approximate_args;
+  unsigned int verify_every = 0;
 
   const option cmd_line_opts[] = {
-    {"canonical",   required_argument, nullptr, 'c'},
-    { nullptr,      0,                 nullptr,  0 }
+    {"canonical",    required_argument, nullptr, 'c'},
+    {"log",          required_argument, nullptr, 'l'},
+    {"format-index", required_argument, nullptr, 'f'},
+    {"mezzanine",    no_argument,       nullptr, 'm'},
+    {"rendition",    required_argument, nullptr, 'r'},
+    {"frame-step",   required_argument, nullptr, 'F'},
+    {"row-step",     required_argument, nullptr, 'R'},
+    {"verify-every", required_argument, nullptr, 'V'},
+    { nullptr,       0,                 nullptr,  0 }
   };
 
   while (true) {
-    const int opt = getopt_long(argc, argv, "c:", cmd_line_opts, nullptr);
+    const int opt = getopt_long(argc, argv, "c:l:f:mr:F:R:V:", cmd_line_opts,
+                                nullptr);
     if (opt == -1) {
       break;
     }
@@ -47,6 +80,31 @@ int main(int argc, char * argv[])
     case 'c':
       canonical_dir = optarg;
       break;
+    case 'l':
+      log_path = optarg;
+      break;
+    case 'f':
+      format_idx = stoul(optarg);
+      break;
+    case 'm':
+      mezzanine = true;
+      break;
+    case 'r':
+      extra_renditions.emplace_back(split(optarg, ":"));
+      if (extra_renditions.back().size() != 4) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'F':
+      approximate_args.insert(approximate_args.end(), {"--frame-step", optarg});
+      break;
+    case 'R':
+      approximate_args.insert(approximate_args.end(), {"--row-step", optarg});
+      break;
+    case 'V':
+      verify_every = stoul(optarg);
+      break;
     default:
       print_usage(argv[0]);
       return EXIT_FAILURE;
@@ -64,40 +122,81 @@ int main(int argc, char * argv[])
     return EXIT_FAILURE;
   }
 
+  if (not log_path.empty() and not format_idx) {
+    print_usage(argv[0]);
+    cerr << "Error: --log <path> requires --format-index <i>" << endl;
+    return EXIT_FAILURE;
+  }
+
   string input_path = argv[optind];
   string output_path = argv[optind + 1];
 
-  string y4m_filename = fs::path(input_path).stem().string() + ".y4m";
-  string canonical_path = fs::path(canonical_dir) / y4m_filename;
+  const string stem = fs::path(input_path).stem().string();
+  string canonical_path = fs::path(canonical_dir) /
+    (stem + (mezzanine ? ".mkv" : ".y4m"));
 
   /* path of the ssim program */
   auto exe_dir = fs::path(roost::readlink("/proc/self/exe")).parent_path();
   string ssim = fs::canonical(exe_dir / "../ssim/ssim");
 
-  /* get width, height and frame rate of the canonical video */
-  Y4MParser y4m_parser(canonical_path);
-  int width = y4m_parser.get_frame_width();
-  int height = y4m_parser.get_frame_height();
+  /* the notifier moves output_path; the others are moved here */
+  struct Rendition {
+    string input_path;
+    string output_path;
+    string dst_path {};
+    optional<uint32_t> format_idx {};
+  };
 
-  /* scale the input video to a Y4M with the same resolution */
-  string scaled_y4m = fs::path(output_path).parent_path() / y4m_filename;
-  string scale = to_string(width) + ":" + to_string(height);
-  vector<string> ffmpeg_args {
-    "ffmpeg", "-nostdin", "-hide_banner", "-loglevel", "warning", "-y",
-    "-i", input_path, "-vf", "scale=" + scale, "-threads", "1", scaled_y4m };
+  vector<Rendition> renditions { {input_path, output_path, {}, format_idx} };
+  for (const auto & extra : extra_renditions) {
+    renditions.push_back({fs::path(extra[0]) / (stem + ".mp4"),
+                          fs::path(extra[2]) / (stem + ".ssim"),
+                          fs::path(extra[1]) / (stem + ".ssim"),
+                          stoul(extra[3])});
+  }
+
+  /* run ssim program, which scales each input video to the resolution of
+   * the canonical video on the fly */
+  vector<string> ssim_args { ssim };
+  ssim_args.insert(ssim_args.end(), approximate_args.begin(),
+                   approximate_args.end());
+
+  if (not approximate_args.empty() and verify_every > 0 and
+      hash<string>()(stem) % verify_every == 0) {
+    ssim_args.emplace_back("--verify");
+  }
+
+  ssim_args.insert(ssim_args.end(), {input_path, canonical_path, output_path});
+  for (size_t i = 1; i < renditions.size(); i++) {
+    ssim_args.insert(ssim_args.end(),
+                     {renditions[i].input_path, renditions[i].output_path});
+  }
 
   ProcessManager proc_manager;
-  int ret_code = proc_manager.run("ffmpeg", ffmpeg_args);
-  if (ret_code < 0) {
+  const int ret_code = proc_manager.run(ssim, ssim_args);
+  if (ret_code != 0) {
     return ret_code;
   }
 
-  /* run ssim program */
-  vector<string> ssim_args { ssim, scaled_y4m, canonical_path, output_path };
-  ret_code = proc_manager.run(ssim, ssim_args);
+  for (const auto & rendition : renditions) {
+    if (not log_path.empty()) {
+      ifstream ssim_file(rendition.output_path);
+      string line;
+      getline(ssim_file, line);
 
-  /* remove scaled_y4m */
-  fs::remove(scaled_y4m);
+      SSIMLog::Record record {};
+      record.ts = stoull(stem);
+      record.format_idx = *rendition.format_idx;
+      record.ssim = stod(line);
+      record.size = fs::file_size(rendition.input_path);
+
+      SSIMLog::append(log_path, record);
+    }
+
+    if (not rendition.dst_path.empty()) {
+      fs::rename(rendition.output_path, rendition.dst_path);
+    }
+  }
 
-  return ret_code;
+  return EXIT_SUCCESS;
 }
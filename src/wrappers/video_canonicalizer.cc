@@ -1,8 +1,12 @@
+#include <fcntl.h>
+#include <getopt.h>
 #include <iostream>
 #include <string>
 #include <vector>
 
 #include "child_process.hh"
+#include "deinterlacer.hh"
+#include "exception.hh"
 #include "filesystem.hh"
 #include "y4m.hh"
 
@@ -11,13 +15,49 @@ using namespace std;
 void print_usage(const string & program)
 {
   cerr <<
-  "Usage: " << program << " <input_path> <output_path>\n"
+  "Usage: " << program << " <input_path> <output_path> [--mezzanine]\n"
   "Canonicalize the video <input_path> and output to <output_path>\n\n"
   "<input_path>     path of the input raw video\n"
-  "<output_path>    path to output the canonical video"
+  "<output_path>    path to output the canonical video\n\n"
+  "Options:\n"
+  "--mezzanine      output a lossless FFV1 mezzanine (e.g., to a .mkv)\n"
+  "                 rather than Y4M, which is far smaller to write and read\n"
+  "--threads <N>    deinterlace with N threads (default: 1)"
   << endl;
 }
 
+/* deinterlace the Y4M at input_path into a Y4M of a frame per field (as
+ * FFmpeg's "-vf bwdif"), without FFmpeg */
+void deinterlace(const string & input_path, const string & output_path,
+                 const unsigned int num_threads)
+{
+  Y4MFile input(input_path);
+
+  const auto [frame_rate_num, frame_rate_den] = input.frame_rate();
+  Y4MWriter output(
+    FileDescriptor(CheckSystemCall("open (" + output_path + ")",
+      open(output_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644))),
+    input.width(), input.height(), {2 * frame_rate_num, frame_rate_den});
+
+  Deinterlacer deinterlacer(input.width(), input.height(),
+                            input.top_field_first(), num_threads);
+
+  /* the first and last frames are their own neighbors */
+  const size_t num_frames = input.num_frames();
+  for (size_t i = 0; i < num_frames; i++) {
+    const Y4MFrame prev = input.frame(i > 0 ? i - 1 : i);
+    const Y4MFrame cur = input.frame(i);
+    const Y4MFrame next = input.frame(i + 1 < num_frames ? i + 1 : i);
+
+    for (const bool second_field : {false, true}) {
+      output.write_frame(
+        deinterlacer.field_frame(prev, cur, next, second_field));
+    }
+  }
+
+  output.close();
+}
+
 int main(int argc, char * argv[])
 {
   /* parse arguments */
@@ -25,26 +65,73 @@ int main(int argc, char * argv[])
     abort();
   }
 
-  if (argc != 3) {
+  bool mezzanine = false;
+  unsigned int num_threads = 1;
+
+  const option cmd_line_opts[] = {
+    {"mezzanine", no_argument,       nullptr, 'm'},
+    {"threads",   required_argument, nullptr, 't'},
+    { nullptr,    0,                 nullptr,  0 }
+  };
+
+  while (true) {
+    const int opt = getopt_long(argc, argv, "mt:", cmd_line_opts, nullptr);
+    if (opt == -1) {
+      break;
+    }
+
+    switch (opt) {
+    case 'm':
+      mezzanine = true;
+      break;
+    case 't':
+      num_threads = stoul(optarg);
+      break;
+    default:
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (optind != argc - 2) {
     print_usage(argv[0]);
     return EXIT_FAILURE;
   }
 
-  string input_path = argv[1];
-  string output_path= argv[2];
+  string input_path = argv[optind];
+  string output_path = argv[optind + 1];
 
   /* parse header of the input Y4M */
   Y4MParser y4m_parser(input_path);
 
-  if (not y4m_parser.is_interlaced()) {
+  if (not y4m_parser.is_interlaced() and not mezzanine) {
     /* simply move video from input_path to output_path if not interlaced */
     fs::rename(input_path, output_path);
     return EXIT_SUCCESS;
+  } else if (not mezzanine) {
+    /* deinterlace in-process, reading the input mapped into memory */
+    deinterlace(input_path, output_path, num_threads);
+
+    /* remove the input raw video */
+    fs::remove(input_path);
+    return EXIT_SUCCESS;
   } else {
     /* canonicalize video */
     vector<string> args {
       "ffmpeg", "-nostdin", "-hide_banner", "-loglevel", "panic", "-y",
-      "-i", input_path, "-vf", "bwdif", "-threads", "1", output_path };
+      "-i", input_path };
+
+    if (y4m_parser.is_interlaced()) {
+      args.insert(args.end(), {"-vf", "bwdif"});
+    }
+
+    if (mezzanine) {
+      /* intra-only, so that any reader can seek and decode quickly */
+      args.insert(args.end(), {"-c:v", "ffv1", "-level", "3", "-g", "1",
+                               "-slices", "4", "-slicecrc", "0"});
+    }
+
+    args.insert(args.end(), {"-threads", "1", output_path});
 
     ProcessManager proc_manager;
     int ret_code = proc_manager.run("ffmpeg", args);
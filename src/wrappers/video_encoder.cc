@@ -1,13 +1,33 @@
 #include <getopt.h>
+#include <algorithm>
+#include <cmath>
+#include <fstream>
 #include <iostream>
+#include <map>
+#include <optional>
 #include <string>
 #include <vector>
 
 #include "child_process.hh"
+#include "exception.hh"
 #include "filesystem.hh"
+#include "ssim_log.hh"
+#include "system_runner.hh"
+#include "tokenize.hh"
 
 using namespace std;
 
+/* with --target-ssim-db, the CRF is raised by at most MAX_CRF_RAISE, and
+ * by a step per DB_PER_CRF of SSIM above the target; x264 loses about
+ * 0.3 dB of SSIM per step at the CRFs of the ladder, so the estimate errs
+ * on keeping quality */
+static const int MAX_CRF_RAISE = 8;
+static const double DB_PER_CRF = 0.5;
+
+/* the encoders of a rendition: x264 by default, or the H.264 encoder of
+ * NVENC (NVIDIA) or Quick Sync (Intel) at a constant quality of the CRF */
+static const vector<string> ENCODERS {"x264", "nvenc", "qsv"};
+
 void print_usage(const string & program)
 {
   cerr <<
@@ -18,10 +38,210 @@ void print_usage(const string & program)
   "<output_path>    path to output the encoded video\n\n"
   "Options:\n"
   "-s <resolution>    resolution (e.g., 1280x720)\n"
-  "--crf <CRF>        constant rate factor"
+  "--crf <CRF>        constant rate factor\n"
+  "--encoder <name>   x264 (default), or the hardware encoder nvenc or qsv,\n"
+  "                   which encode at the CRF as a constant quality\n"
+  "--rendition <resolution>:<CRF>:<dst_dir>:<tmp_dir>[:<encoder>]\n"
+  "                   also encode a rendition, written to <tmp_dir> and then\n"
+  "                   moved to <dst_dir>; may be repeated. The input is\n"
+  "                   decoded once for all renditions, and each resolution\n"
+  "                   is scaled down from the next larger one; the encoder\n"
+  "                   is that of --encoder unless given\n"
+  "--ssim <dst_dir>:<tmp_dir>\n"
+  "                   also write the SSIM that x264 computes on the luma of\n"
+  "                   the reconstructed frames against their (scaled) input,\n"
+  "                   to <tmp_dir> and then <dst_dir>; not with --rendition\n"
+  "                   and only with x264\n"
+  "--log <path>       also append the SSIM to the binary SSIM log <path>\n"
+  "--format-index <i> index of the video format in the channel config;\n"
+  "                   required by --log\n"
+  "--target-ssim-db <dB>\n"
+  "                   raise the CRFs where the SSIM (in dB) still reaches\n"
+  "                   <dB>: the first rendition is encoded at its CRF to\n"
+  "                   measure its SSIM, and if that is above <dB>, all the\n"
+  "                   renditions are encoded again at CRFs raised by the\n"
+  "                   same estimate of the headroom (at most "
+  << MAX_CRF_RAISE << "),\n"
+  "                   which are kept if the first still reaches <dB>;\n"
+  "                   only with x264"
   << endl;
 }
 
+struct Rendition
+{
+  string resolution;  /* e.g., 1280x720 */
+  string crf;
+  string output_path;
+  string dst_path {};  /* moved to after encoding, unless empty */
+  string encoder {"x264"};
+};
+
+/* the arguments of FFmpeg to encode an output with encoder at crf */
+static vector<string> codec_args(const string & encoder, const string & crf)
+{
+  if (encoder == "x264") {
+    return { "-c:v", "libx264", "-crf", crf,
+             "-preset", "veryfast", "-threads", "1" };
+  }
+
+  /* variable bitrate at a constant quality, without a bitrate cap */
+  if (encoder == "nvenc") {
+    return { "-c:v", "h264_nvenc", "-preset", "p4", "-rc", "vbr",
+             "-cq", crf, "-b:v", "0" };
+  }
+
+  /* intelligent constant quality */
+  if (encoder == "qsv") {
+    return { "-c:v", "h264_qsv", "-preset", "veryfast",
+             "-global_quality", crf };
+  }
+
+  throw runtime_error("invalid encoder " + encoder);
+}
+
+static uint64_t area(const string & resolution)
+{
+  const vector<string> dims = split(resolution, "x");
+  if (dims.size() != 2) {
+    throw runtime_error("invalid resolution " + resolution);
+  }
+
+  return stoull(dims[0]) * stoull(dims[1]);
+}
+
+/* the arguments of FFmpeg to encode all the renditions from a single decode
+ * of the input, scaling each resolution (largest first) from the last; with
+ * ssim, x264 prints the SSIM of the first rendition (only) */
+static vector<string> ffmpeg_args(const string & input_path,
+                                  const vector<Rendition> & renditions,
+                                  const bool ssim = false)
+{
+  /* the renditions of each resolution, largest first */
+  map<uint64_t, vector<const Rendition *>, greater<uint64_t>> by_area;
+  for (const auto & rendition : renditions) {
+    by_area[area(rendition.resolution)].emplace_back(&rendition);
+  }
+
+  /* e.g., [0:v]scale=s=1280x720,split=2[o0][c0];[c0]scale=s=854x480,... */
+  string graph;
+  vector<string> output_args;
+  string prev = "[0:v]";
+  size_t out_idx = 0;
+  size_t step = 0;
+
+  for (auto it = by_area.begin(); it != by_area.end(); it++, step++) {
+    const auto & group = it->second;
+    const bool last = next(it) == by_area.end();
+
+    graph += prev + "scale=s=" + group.front()->resolution + ",split="
+             + to_string(group.size() + (last ? 0 : 1));
+
+    for (const auto rendition : group) {
+      const string label = "[o" + to_string(out_idx++) + "]";
+      graph += label;
+
+      output_args.insert(output_args.end(), {"-map", label});
+
+      const auto codec = codec_args(rendition->encoder, rendition->crf);
+      output_args.insert(output_args.end(), codec.begin(), codec.end());
+
+      if (ssim and rendition == &renditions.front()) {
+        output_args.insert(output_args.end(), {"-ssim", "1"});
+      }
+      output_args.emplace_back(rendition->output_path);
+    }
+
+    if (not last) {
+      prev = "[c" + to_string(step) + "]";
+      graph += prev + ";";
+    }
+  }
+
+  /* x264 prints its SSIM at the info level */
+  vector<string> args {
+    "ffmpeg", "-nostdin", "-hide_banner", "-nostats",
+    "-loglevel", ssim ? "info" : "warning", "-y",
+    "-i", input_path, "-filter_complex", graph };
+  args.insert(args.end(), output_args.begin(), output_args.end());
+  return args;
+}
+
+/* the SSIM (on the luma) in the output of FFmpeg as printed, and in dB, e.g.,
+ * from "[libx264 @ 0x55d0c8] SSIM Mean Y:0.9842811 (18.034db)" */
+static pair<string, double> parse_ssim(const string & log)
+{
+  size_t ssim_pos = log.rfind("SSIM Mean Y:");
+  if (ssim_pos == string::npos) {
+    throw runtime_error("no SSIM found in the output of FFmpeg");
+  }
+  ssim_pos += 12;
+
+  const string ssim = log.substr(ssim_pos, log.find(' ', ssim_pos)
+                                           - ssim_pos);
+
+  const size_t db_pos = log.find('(', ssim_pos);
+  if (db_pos == string::npos) {
+    throw runtime_error("no SSIM in dB found in the output of FFmpeg");
+  }
+
+  return {ssim, stod(log.substr(db_pos + 1))};
+}
+
+/* encode renditions from input_path and return the SSIM of the first */
+static pair<string, double> encode_with_ssim(
+  const string & input_path, const vector<Rendition> & renditions)
+{
+  return parse_ssim(run("ffmpeg", ffmpeg_args(input_path, renditions, true),
+                        false, true).second);
+}
+
+/* encode renditions (the first of which is output to output_path) at the
+ * CRFs given, or raised as long as the SSIM of the first reaches target_db
+ * (see --target-ssim-db); return the SSIM of the first */
+static pair<string, double> encode_to_target(
+  const string & input_path, const vector<Rendition> & renditions,
+  const double target_db)
+{
+  const string & output_path = renditions.front().output_path;
+
+  /* the first rendition alone, at its CRF, as the estimate of how complex
+   * the content is */
+  const auto probe = encode_with_ssim(input_path, {renditions.front()});
+
+  const int raise = min(MAX_CRF_RAISE,
+    static_cast<int>(floor((probe.second - target_db) / DB_PER_CRF)));
+
+  if (raise > 0) {
+    /* the first is written next to the probe, which is kept if the SSIM
+     * falls short */
+    vector<Rendition> raised = renditions;
+    raised.front().output_path = (fs::path(output_path).parent_path()
+      / fs::path(output_path).stem()).string() + ".raised.mp4";
+
+    for (auto & rendition : raised) {
+      rendition.crf = to_string(stoi(rendition.crf) + raise);
+    }
+
+    const auto ssim = encode_with_ssim(input_path, raised);
+    if (ssim.second >= target_db) {
+      fs::rename(raised.front().output_path, output_path);
+      cerr << input_path << ": CRF raised by " << raise << " (SSIM "
+           << probe.second << " dB to " << ssim.second << " dB)" << endl;
+      return ssim;
+    }
+
+    fs::remove(raised.front().output_path);
+  }
+
+  /* the other renditions at their CRFs */
+  if (renditions.size() > 1) {
+    const vector<Rendition> others(renditions.begin() + 1, renditions.end());
+    run("ffmpeg", ffmpeg_args(input_path, others));
+  }
+
+  return probe;
+}
+
 int main(int argc, char * argv[])
 {
   /* parse arguments */
@@ -31,15 +251,28 @@ int main(int argc, char * argv[])
 
   string resolution;
   string crf;
+  vector<vector<string>> extra_renditions;
+  vector<string> ssim_dirs;
+  string log_path;
+  optional<uint32_t> format_idx;
+  optional<double> target_ssim_db;
+  string encoder = "x264";
 
   const option cmd_line_opts[] = {
-    {"res",    required_argument, nullptr, 's'},
-    {"crf",    required_argument, nullptr, 'c'},
-    { nullptr, 0,                 nullptr,  0 }
+    {"res",          required_argument, nullptr, 's'},
+    {"crf",          required_argument, nullptr, 'c'},
+    {"rendition",    required_argument, nullptr, 'r'},
+    {"ssim",         required_argument, nullptr, 'm'},
+    {"log",          required_argument, nullptr, 'l'},
+    {"format-index", required_argument, nullptr, 'f'},
+    {"target-ssim-db", required_argument, nullptr, 't'},
+    {"encoder",      required_argument, nullptr, 'e'},
+    { nullptr,       0,                 nullptr,  0 }
   };
 
   while (true) {
-    const int opt = getopt_long(argc, argv, "s:c:", cmd_line_opts, nullptr);
+    const int opt = getopt_long(argc, argv, "s:c:r:m:l:f:t:e:", cmd_line_opts,
+                                nullptr);
     if (opt == -1) {
       break;
     }
@@ -51,6 +284,33 @@ int main(int argc, char * argv[])
     case 'c':
       crf = optarg;
       break;
+    case 'r':
+      extra_renditions.emplace_back(split(optarg, ":"));
+      if (extra_renditions.back().size() != 4 and
+          extra_renditions.back().size() != 5) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'm':
+      ssim_dirs = split(optarg, ":");
+      if (ssim_dirs.size() != 2) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'l':
+      log_path = optarg;
+      break;
+    case 'f':
+      format_idx = stoul(optarg);
+      break;
+    case 't':
+      target_ssim_db = stod(optarg);
+      break;
+    case 'e':
+      encoder = optarg;
+      break;
     default:
       print_usage(argv[0]);
       return EXIT_FAILURE;
@@ -68,15 +328,124 @@ int main(int argc, char * argv[])
     return EXIT_FAILURE;
   }
 
+  if (not ssim_dirs.empty() and not extra_renditions.empty()) {
+    print_usage(argv[0]);
+    cerr << "Error: --ssim cannot be used with --rendition" << endl;
+    return EXIT_FAILURE;
+  }
+
+  if (not log_path.empty() and (ssim_dirs.empty() or not format_idx)) {
+    print_usage(argv[0]);
+    cerr << "Error: --log <path> requires --ssim and --format-index" << endl;
+    return EXIT_FAILURE;
+  }
+
+  /* the hardware encoders do not compute the SSIM */
+  bool all_x264 = encoder == "x264";
+  for (const auto & extra : extra_renditions) {
+    if (extra.size() == 5 and extra[4] != "x264") {
+      all_x264 = false;
+    }
+  }
+
+  if ((not ssim_dirs.empty() or target_ssim_db) and not all_x264) {
+    print_usage(argv[0]);
+    cerr << "Error: --ssim and --target-ssim-db require x264" << endl;
+    return EXIT_FAILURE;
+  }
+
+  for (const auto & extra : extra_renditions) {
+    const string & name = extra.size() == 5 ? extra[4] : encoder;
+    if (find(ENCODERS.begin(), ENCODERS.end(), name) == ENCODERS.end()) {
+      print_usage(argv[0]);
+      cerr << "Error: invalid encoder " << name << endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (find(ENCODERS.begin(), ENCODERS.end(), encoder) == ENCODERS.end()) {
+    print_usage(argv[0]);
+    cerr << "Error: invalid encoder " << encoder << endl;
+    return EXIT_FAILURE;
+  }
+
   string input_path = argv[optind];
   string output_path = argv[optind + 1];
 
-  /* encode video */
-  vector<string> args {
-    "ffmpeg", "-nostdin", "-hide_banner", "-loglevel", "warning", "-y",
-    "-i", input_path, "-c:v", "libx264", "-s", resolution, "-crf", crf,
-    "-preset", "veryfast", "-threads", "1", output_path };
+  try {
+    if (not ssim_dirs.empty()) {
+      /* x264 prints the SSIM of the encode when it is done */
+      const vector<Rendition> renditions { {resolution, crf, output_path} };
+      const string ssim = (target_ssim_db ?
+        encode_to_target(input_path, renditions, *target_ssim_db) :
+        encode_with_ssim(input_path, renditions)).first;
+
+      const double ssim_val = stod(ssim);
+
+      const string filename = fs::path(input_path).stem().string() + ".ssim";
+      const string tmp_path = fs::path(ssim_dirs[1]) / filename;
+      ofstream(tmp_path) << ssim;
+      fs::rename(tmp_path, fs::path(ssim_dirs[0]) / filename);
+
+      if (not log_path.empty()) {
+        SSIMLog::Record record {};
+        record.ts = stoull(fs::path(input_path).stem().string());
+        record.format_idx = *format_idx;
+        record.ssim = ssim_val;
+        record.size = fs::file_size(output_path);
+
+        SSIMLog::append(log_path, record);
+      }
+
+      return EXIT_SUCCESS;
+    }
 
-  ProcessManager proc_manager;
-  return proc_manager.run("ffmpeg", args);
+    if (extra_renditions.empty() and not target_ssim_db) {
+      /* encode video: nothing is left to do afterwards, so replace this
+       * process with FFmpeg rather than forking and waiting for it */
+      vector<string> args {
+        "ffmpeg", "-nostdin", "-hide_banner", "-loglevel", "warning", "-y",
+        "-i", input_path, "-s", resolution };
+
+      const auto codec = codec_args(encoder, crf);
+      args.insert(args.end(), codec.begin(), codec.end());
+      args.emplace_back(output_path);
+
+      CheckSystemCall("exec (ffmpeg)", ezexec("ffmpeg", args));
+      return EXIT_FAILURE;
+    }
+
+    ProcessManager proc_manager;
+
+    /* encode all the renditions at once; the notifier moves output_path */
+    const string filename = fs::path(input_path).stem().string() + ".mp4";
+    vector<Rendition> renditions { {resolution, crf, output_path, "",
+                                    encoder} };
+    for (const auto & extra : extra_renditions) {
+      renditions.push_back({extra[0], extra[1], fs::path(extra[3]) / filename,
+                            fs::path(extra[2]) / filename,
+                            extra.size() == 5 ? extra[4] : encoder});
+    }
+
+    if (target_ssim_db) {
+      encode_to_target(input_path, renditions, *target_ssim_db);
+    } else {
+      const int ret_code = proc_manager.run(
+        "ffmpeg", ffmpeg_args(input_path, renditions));
+      if (ret_code != 0) {
+        return ret_code;
+      }
+    }
+
+    for (const auto & rendition : renditions) {
+      if (not rendition.dst_path.empty()) {
+        fs::rename(rendition.output_path, rendition.dst_path);
+      }
+    }
+
+    return EXIT_SUCCESS;
+  } catch (const exception & e) {
+    print_exception(argv[0], e);
+    return EXIT_FAILURE;
+  }
 }